@@ -265,6 +265,19 @@ typedef uint16_t	in_port_t;
    } while (0)
 #endif
 
+/* needed by smtpd */
+#ifndef timespecadd
+#define timespecadd(a, b, result)				\
+   do {								\
+      (result)->tv_sec = (a)->tv_sec + (b)->tv_sec;		\
+      (result)->tv_nsec = (a)->tv_nsec + (b)->tv_nsec;		\
+      if ((result)->tv_nsec >= 1000000000L) {			\
+	 ++(result)->tv_sec;					\
+	 (result)->tv_nsec -= 1000000000L;			\
+      }								\
+   } while (0)
+#endif
+
 /* needed by smtpd */
 #ifndef TIMEVAL_TO_TIMESPEC
 #define	TIMEVAL_TO_TIMESPEC(tv, ts) {					\
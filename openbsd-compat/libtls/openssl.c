@@ -149,20 +149,20 @@ ssl_ctx_use_certificate_chain_bio(SSL_CTX *ctx, BIO *in)
 		 * the CA certificates.
 		 */
 		X509 *ca;
-		STACK_OF(X509) *chain;
 		int r;
 		unsigned long err;
 
-		SSL_CTX_get_extra_chain_certs_only(ctx, &chain);
-		if (chain != NULL) {
-		  sk_X509_pop_free(chain, X509_free);
-			SSL_CTX_clear_extra_chain_certs(ctx);
-		}
+		/*
+		 * Attach the chain to the certificate just installed
+		 * rather than to the context, so that certificates of
+		 * different key types each keep their own chain.
+		 */
+		SSL_CTX_clear_chain_certs(ctx);
 
 		while ((ca = PEM_read_bio_X509(in, NULL,
 		    SSL_CTX_get_default_passwd_cb(ctx),
 		    SSL_CTX_get_default_passwd_cb_userdata(ctx))) != NULL) {
-			r = SSL_CTX_add_extra_chain_cert(ctx, ca);
+			r = SSL_CTX_add0_chain_cert(ctx, ca);
 			if (!r) {
 				X509_free(ca);
 				ret = 0;
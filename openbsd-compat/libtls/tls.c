@@ -25,6 +25,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <openssl/async.h>
 #include <openssl/bio.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
@@ -521,6 +522,14 @@ tls_configure_ssl_keypair(struct tls *ctx, SSL_CTX *ssl_ctx,
 		goto err;
 	}
 
+	/*
+	 * The alternate keypair lands in the certificate slot for its own
+	 * key type, so the library can pick either one per handshake.
+	 */
+	if (keypair->alt != NULL &&
+	    tls_configure_ssl_keypair(ctx, ssl_ctx, keypair->alt, 1) != 0)
+		goto err;
+
 	return (0);
 
  err:
@@ -537,6 +546,16 @@ tls_configure_ssl(struct tls *ctx, SSL_CTX *ssl_ctx)
 	SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
 	SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
+#ifdef SSL_MODE_ASYNC
+	/*
+	 * Let a private key operation suspend the handshake instead of
+	 * blocking the caller; the mode is dropped once the handshake is
+	 * complete.
+	 */
+	if (ASYNC_is_capable())
+		SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ASYNC);
+#endif
+
 	SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2);
 	SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv3);
 	SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TLSv1);
@@ -777,6 +796,11 @@ tls_ssl_error(struct tls *ctx, SSL *ssl_conn, int ssl_ret, const char *prefix)
 	case SSL_ERROR_WANT_WRITE:
 		return (TLS_WANT_POLLOUT);
 
+#ifdef SSL_ERROR_WANT_ASYNC
+	case SSL_ERROR_WANT_ASYNC:
+		return (TLS_WANT_ASYNC);
+#endif
+
 	case SSL_ERROR_SYSCALL:
 		if ((err = ERR_peek_error()) != 0) {
 			errstr = ERR_error_string(err, NULL);
@@ -836,6 +860,9 @@ tls_handshake(struct tls *ctx)
 		rv = tls_handshake_server(ctx);
 
 	if (rv == 0) {
+#ifdef SSL_MODE_ASYNC
+		SSL_clear_mode(ctx->ssl_conn, SSL_MODE_ASYNC);
+#endif
 		ctx->ssl_peer_cert = SSL_get_peer_certificate(ctx->ssl_conn);
 		ctx->ssl_peer_chain = SSL_get_peer_cert_chain(ctx->ssl_conn);
 		if (tls_conninfo_populate(ctx) == -1)
@@ -47,6 +47,7 @@ extern "C" {
 
 #define TLS_WANT_POLLIN		-2
 #define TLS_WANT_POLLOUT	-3
+#define TLS_WANT_ASYNC		-4
 
 /* RFC 6960 Section 2.3 */
 #define TLS_OCSP_RESPONSE_SUCCESSFUL		0
@@ -106,6 +107,9 @@ int tls_config_add_keypair_file(struct tls_config *_config,
     const char *_cert_file, const char *_key_file);
 int tls_config_add_keypair_mem(struct tls_config *_config, const uint8_t *_cert,
     size_t _cert_len, const uint8_t *_key, size_t _key_len);
+int tls_config_add_keypair_alt_mem(struct tls_config *_config,
+    const uint8_t *_cert, size_t _cert_len, const uint8_t *_key,
+    size_t _key_len);
 int tls_config_add_keypair_ocsp_file(struct tls_config *_config,
     const char *_cert_file, const char *_key_file,
     const char *_ocsp_staple_file);
@@ -204,6 +208,7 @@ time_t	tls_peer_cert_notafter(struct tls *_ctx);
 const uint8_t *tls_peer_cert_chain_pem(struct tls *_ctx, size_t *_len);
 
 const char *tls_conn_alpn_selected(struct tls *_ctx);
+const char *tls_conn_cert_type(struct tls *_ctx);
 const char *tls_conn_cipher(struct tls *_ctx);
 int tls_conn_cipher_strength(struct tls *_ctx);
 const char *tls_conn_servername(struct tls *_ctx);
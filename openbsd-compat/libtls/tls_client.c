@@ -252,6 +252,10 @@ tls_client_write_session(struct tls *ctx)
 		goto done;
 	}
 
+	/* A TLSv1.3 session is only resumable once a ticket came in. */
+	if (!SSL_SESSION_is_resumable(ss))
+		goto done;
+
 	if ((bio = BIO_new(BIO_s_mem())) == NULL)
 		goto err;
 	if (PEM_write_bio_SSL_SESSION(bio, ss) == 0)
@@ -287,6 +291,17 @@ tls_client_write_session(struct tls *ctx)
 	return (rv);
 }
 
+static int
+tls_client_new_session_cb(SSL *ssl, SSL_SESSION *ss)
+{
+	struct tls *ctx;
+
+	if ((ctx = SSL_get_app_data(ssl)) != NULL)
+		(void)tls_client_write_session(ctx);
+
+	return (0);
+}
+
 static int
 tls_connect_common(struct tls *ctx, const char *servername)
 {
@@ -370,6 +385,10 @@ tls_connect_common(struct tls *ctx, const char *servername)
 
 	if (ctx->config->session_fd != -1) {
 		SSL_clear_options(ctx->ssl_conn, SSL_OP_NO_TICKET);
+		/* TLSv1.3 tickets arrive after the handshake completed. */
+		SSL_CTX_set_session_cache_mode(ctx->ssl_ctx,
+		    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx->ssl_ctx, tls_client_new_session_cb);
 		if (tls_client_read_session(ctx) == -1)
 			goto err;
 	}
@@ -416,6 +416,65 @@ tls_config_add_keypair_mem(struct tls_config *config, const uint8_t *cert,
 	    key_len, NULL, 0);
 }
 
+/*
+ * Attach a certificate and key of a different public key type to the
+ * most recently configured keypair.  Both are loaded into the same SSL
+ * context, leaving the choice between them to the client's signature
+ * algorithms rather than to SNI.
+ */
+int
+tls_config_add_keypair_alt_mem(struct tls_config *config, const uint8_t *cert,
+    size_t cert_len, const uint8_t *key, size_t key_len)
+{
+	struct tls_keypair *kp, *keypair;
+	X509 *cert1 = NULL, *cert2 = NULL;
+	int rv = -1;
+
+	kp = config->keypair;
+	while (kp->next != NULL)
+		kp = kp->next;
+
+	if (kp->alt != NULL) {
+		tls_error_setx(&config->error, TLS_ERROR_INVALID_ARGUMENT,
+		    "alternate keypair already set");
+		return (-1);
+	}
+
+	if ((keypair = tls_keypair_new()) == NULL) {
+		tls_error_setx(&config->error, TLS_ERROR_OUT_OF_MEMORY,
+		    "out of memory");
+		return (-1);
+	}
+	if (tls_keypair_set_cert_mem(keypair, &config->error, cert,
+	    cert_len) != 0)
+		goto err;
+	if (key != NULL &&
+	    tls_keypair_set_key_mem(keypair, &config->error, key,
+	    key_len) != 0)
+		goto err;
+
+	if (tls_keypair_load_cert(kp, &config->error, &cert1) == -1)
+		goto err;
+	if (tls_keypair_load_cert(keypair, &config->error, &cert2) == -1)
+		goto err;
+	if (EVP_PKEY_base_id(X509_get0_pubkey(cert1)) ==
+	    EVP_PKEY_base_id(X509_get0_pubkey(cert2))) {
+		tls_error_setx(&config->error, TLS_ERROR_INVALID_ARGUMENT,
+		    "alternate certificate has the same key type");
+		goto err;
+	}
+
+	kp->alt = keypair;
+	keypair = NULL;
+	rv = 0;
+
+ err:
+	X509_free(cert1);
+	X509_free(cert2);
+	tls_keypair_free(keypair);
+	return (rv);
+}
+
 int
 tls_config_add_keypair_file(struct tls_config *config,
     const char *cert_file, const char *key_file)
@@ -765,6 +824,21 @@ tls_config_set_sign_cb(struct tls_config *config, tls_sign_cb cb, void *cb_arg)
 	return (0);
 }
 
+/*
+ * Called by a server for a server name that none of its keypairs match,
+ * the callback returns the server context to use for the connection, or
+ * NULL to keep the default keypair.  The context it returns must stay
+ * around until the handshake is complete.
+ */
+int
+tls_config_set_sni_cb(struct tls_config *config, tls_sni_cb cb, void *cb_arg)
+{
+	config->sni_cb = cb;
+	config->sni_cb_arg = cb_arg;
+
+	return (0);
+}
+
 int
 tls_config_set_verify_depth(struct tls_config *config, int verify_depth)
 {
@@ -239,6 +239,31 @@ tls_conninfo_session(struct tls *ctx)
 	return 0;
 }
 
+static const char *
+tls_conninfo_cert_type(struct tls *ctx)
+{
+	X509 *cert;
+	EVP_PKEY *pkey;
+
+	if ((cert = SSL_get_certificate(ctx->ssl_conn)) == NULL)
+		return (NULL);
+	if ((pkey = X509_get0_pubkey(cert)) == NULL)
+		return (NULL);
+
+	switch (EVP_PKEY_base_id(pkey)) {
+	case EVP_PKEY_RSA:
+		return ("rsa");
+	case EVP_PKEY_EC:
+		return ("ecdsa");
+#ifdef EVP_PKEY_ED25519
+	case EVP_PKEY_ED25519:
+		return ("ed25519");
+#endif
+	default:
+		return ("other");
+	}
+}
+
 int
 tls_conninfo_populate(struct tls *ctx)
 {
@@ -271,6 +296,9 @@ tls_conninfo_populate(struct tls *ctx)
 	if ((ctx->conninfo->version = strdup(tmp)) == NULL)
 		goto err;
 
+	if ((ctx->flags & TLS_SERVER_CONN) != 0)
+		ctx->conninfo->cert_type = tls_conninfo_cert_type(ctx);
+
 	if (tls_get_peer_cert_info(ctx) == -1)
 		goto err;
 
@@ -317,6 +345,14 @@ tls_conn_alpn_selected(struct tls *ctx)
 	return (ctx->conninfo->alpn);
 }
 
+const char *
+tls_conn_cert_type(struct tls *ctx)
+{
+	if (ctx->conninfo == NULL)
+		return (NULL);
+	return (ctx->conninfo->cert_type);
+}
+
 const char *
 tls_conn_cipher(struct tls *ctx)
 {
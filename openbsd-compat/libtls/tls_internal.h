@@ -45,6 +45,7 @@ struct tls_error {
 
 struct tls_keypair {
 	struct tls_keypair *next;
+	struct tls_keypair *alt;
 
 	char *cert_mem;
 	size_t cert_len;
@@ -75,6 +76,9 @@ typedef int (*tls_sign_cb)(void *_cb_arg, const char *_pubkey_hash,
     const uint8_t *_input, size_t _input_len, int _padding_type,
     uint8_t **_out_signature, size_t *_out_signature_len);
 
+typedef struct tls *(*tls_sni_cb)(void *_cb_arg, struct tls *_conn,
+    const char *_servername);
+
 struct tls_config {
 	struct tls_error error;
 
@@ -110,6 +114,8 @@ struct tls_config {
 	int use_fake_private_key;
 	tls_sign_cb sign_cb;
 	void *sign_cb_arg;
+	tls_sni_cb sni_cb;
+	void *sni_cb_arg;
 };
 
 struct tls_conninfo {
@@ -119,6 +125,7 @@ struct tls_conninfo {
 	char *servername;
 	int session_resumed;
 	char *version;
+	const char *cert_type;
 
 	char *hash;
 	char *issuer;
@@ -313,6 +320,10 @@ int tls_signer_sign(struct tls_signer *_signer, const char *_pubkey_hash,
 void tls_config_skip_private_key_check(struct tls_config *config);
 void tls_config_use_fake_private_key(struct tls_config *config);
 
+/* XXX and this one so smtpd can load certificates by server name */
+int tls_config_set_sni_cb(struct tls_config *_config, tls_sni_cb _cb,
+    void *_cb_arg);
+
 #ifndef HAVE_SSL_CTX_USE_CERTIFICATE_CHAIN_MEM
 int SSL_CTX_use_certificate_chain_mem(SSL_CTX *, void *, int);
 #endif
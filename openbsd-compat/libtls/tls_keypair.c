@@ -125,6 +125,7 @@ tls_keypair_free(struct tls_keypair *keypair)
 		return;
 
 	tls_keypair_clear_key(keypair);
+	tls_keypair_free(keypair->alt);
 
 	free(keypair->cert_mem);
 	free(keypair->ocsp_staple);
@@ -85,7 +85,7 @@ tls_servername_cb(SSL *ssl, int *al, void *arg)
 	struct tls *ctx = (struct tls *)arg;
 	struct tls_sni_ctx *sni_ctx;
 	union tls_addr addrbuf;
-	struct tls *conn_ctx;
+	struct tls *conn_ctx, *sni;
 	const char *name;
 	int match;
 
@@ -128,6 +128,14 @@ tls_servername_cb(SSL *ssl, int *al, void *arg)
 		}
 	}
 
+	/* Ask the application, it may have a keypair for this name. */
+	if (ctx->config->sni_cb != NULL && (sni = ctx->config->sni_cb(
+	    ctx->config->sni_cb_arg, conn_ctx, name)) != NULL) {
+		conn_ctx->keypair = sni->keypair;
+		SSL_set_SSL_CTX(conn_ctx->ssl_conn, sni->ssl_ctx);
+		return (SSL_TLSEXT_ERR_OK);
+	}
+
 	/* No match, use the existing context/certificate. */
 	return (SSL_TLSEXT_ERR_OK);
 
@@ -201,7 +209,8 @@ tls_server_ticket_cb(SSL *ssl, unsigned char *keyname, unsigned char *iv,
 			    "failed to init hmac");
 			return (-1);
 		}
-		return (0);
+		/* OpenSSL does not issue the ticket when 0 is returned */
+		return (1);
 	} else {
 		/* get key by name */
 		key = tls_server_ticket_key(tls_ctx->config, keyname);
@@ -108,7 +108,7 @@ typedef struct {
 
 %token  INCLUDE PORT REPEAT RANDOM NOOP
 %token	PROC TESTCASE NAME NO_AUTOCONNECT EXPECT FAIL SKIP
-%token	CALL CONNECT DISCONNECT STARTTLS SLEEP WRITE WRITELN
+%token	CALL CONNECT DISCONNECT STARTTLS RESUME SLEEP WRITE WRITEDATA WRITELN
 %token	SMTP OK TEMPFAIL PERMFAIL HELO
 %token	ERROR ARROW
 %token	<v.string>	STRING
@@ -230,11 +230,17 @@ statement	: block
 		| CONNECT STRING port {
 			$$ = op_connect(peek_op(), $2, $3);
 		}
+		| CONNECT {
+			$$ = op_connect(peek_op(), NULL, 0);
+		}
 		| DISCONNECT {
 			$$ = op_disconnect(peek_op());
 		}
 		| STARTTLS {
-			$$ = op_starttls(peek_op());
+			$$ = op_starttls(peek_op(), 0);
+		}
+		| STARTTLS RESUME {
+			$$ = op_starttls(peek_op(), 1);
 		}
 		| WRITE STRING {
 			$$ = op_write(peek_op(), $2, strlen($2));
@@ -243,6 +249,13 @@ statement	: block
 			$$ = op_printf(peek_op(), "%s\r\n", $2);
 			free($2);
 		}
+		| WRITEDATA NUMBER {
+			if ($2 < 2 || $2 > 64 * 1024 * 1024) {
+				yyerror("invalid data size: %" PRId64, $2);
+				YYERROR;
+			}
+			$$ = op_data(peek_op(), $2);
+		}
 		| EXPECT DISCONNECT {
 			$$ = op_expect_disconnect(peek_op());
 		}
@@ -394,6 +407,7 @@ lookup(char *s)
 		{ "proc",		PROC },
 		{ "random",		RANDOM },
 		{ "repeat",		REPEAT },
+		{ "resume",		RESUME },
 		{ "skip",		SKIP },
 		{ "sleep",		SLEEP },
 		{ "smtp",		SMTP },
@@ -401,6 +415,7 @@ lookup(char *s)
 		{ "tempfail",		TEMPFAIL },
 		{ "test-case",		TESTCASE },
 		{ "write",		WRITE },
+		{ "write-data",		WRITEDATA },
 		{ "writeln",		WRITELN },
 	};
 	const struct keywords	*p;
@@ -0,0 +1,101 @@
+#!/bin/sh
+#	$OpenBSD$
+
+# The "db" queue backend syncs its journal before a change is acked, so
+# every message accepted before smtpd is killed must be in the queue
+# once it is restarted, and be delivered and removed in spite of more
+# crashes during the deliveries.
+#
+# Run as root from this directory, with an empty queue and the programs
+# under test given in SMTPD, SMTPCTL, SMTPSCRIPT and SMTPSINK if they
+# are not in PATH.  smtpd must be built with the db api.
+
+SMTPD=${SMTPD:-smtpd}
+SMTPCTL=${SMTPCTL:-smtpctl}
+SMTPSCRIPT=${SMTPSCRIPT:-smtpscript}
+SMTPSINK=${SMTPSINK:-smtpsink}
+ROUNDS=${ROUNDS:-10}
+
+acked=$(mktemp) || exit 1
+sink=
+fail() {
+	echo "FAIL: $*"
+	[ -n "$sink" ] && kill $sink
+	pkill -o -x smtpd
+	rm -f $acked
+	exit 1
+}
+
+# wait up to 30s for a command to succeed
+waitfor() {
+	i=0
+	until "$@" >/dev/null 2>&1; do
+		i=$((i + 1))
+		[ $i -gt 300 ] && return 1
+		sleep 0.1
+	done
+}
+
+# smtpscript only reports a failed test in its summary
+send() {
+	$SMTPSCRIPT -p 2525 reload.script | grep -q "^passed: 1/1"
+}
+
+queued() {
+	[ $($SMTPCTL show queue | wc -l) -ge $1 ]
+}
+
+empty() {
+	[ -z "$($SMTPCTL show queue)" ]
+}
+
+stopped() {
+	! pgrep -x smtpd
+}
+
+start() {
+	$SMTPD -B queue=db -f "$PWD/reload.conf" || fail "smtpd did not start"
+	waitfor $SMTPCTL show status || fail "smtpd is not running"
+}
+
+crash() {
+	pkill -KILL -x smtpd
+	waitfor stopped || fail "smtpd did not exit"
+}
+
+start
+empty || fail "the queue is not empty"
+
+# no sink, the messages stay in the queue
+round=1
+while [ $round -le $ROUNDS ]; do
+	(while send; do
+		echo
+	done) >>$acked &
+	sleep 0.$((round % 3 + 1))
+	crash
+	wait
+
+	n=$(wc -l <$acked)
+	[ $n -gt 0 ] || fail "no message accepted"
+	start
+	waitfor queued $n ||
+	    fail "round $round: $n messages accepted, $($SMTPCTL show queue |
+	    wc -l) in the queue"
+	round=$((round + 1))
+done
+
+# and crash again while they are delivered
+$SMTPSINK -p 2526 >/dev/null 2>&1 &
+sink=$!
+$SMTPCTL schedule all >/dev/null
+sleep 0.2
+crash
+start
+$SMTPCTL schedule all >/dev/null
+waitfor empty || fail "messages left in the queue after delivery"
+
+kill $sink
+pkill -o -x smtpd
+rm -f $acked
+echo "queue-db: ok"
@@ -0,0 +1,61 @@
+#!/bin/sh
+#	$OpenBSD$
+
+# A message queued before a reload must be delivered and removed from
+# the spool by the new generation, which did not walk the queue.
+#
+# Run as root from this directory, with the programs under test given
+# in SMTPD, SMTPCTL, SMTPSCRIPT and SMTPSINK if they are not in PATH.
+
+SMTPD=${SMTPD:-smtpd}
+SMTPCTL=${SMTPCTL:-smtpctl}
+SMTPSCRIPT=${SMTPSCRIPT:-smtpscript}
+SMTPSINK=${SMTPSINK:-smtpsink}
+SPOOL=${SPOOL:-/var/spool/smtpd}
+
+sink=
+fail() {
+	echo "FAIL: $*"
+	[ -n "$sink" ] && kill $sink
+	pkill -o -x smtpd
+	exit 1
+}
+
+# wait up to 30s for a command to succeed
+waitfor() {
+	i=0
+	until "$@" >/dev/null 2>&1; do
+		i=$((i + 1))
+		[ $i -gt 300 ] && return 1
+		sleep 0.1
+	done
+}
+
+nomessage() {
+	[ -z "$(find $SPOOL/queue -mindepth 2 -type d)" ]
+}
+
+gone() {
+	! kill -0 $1
+}
+
+$SMTPD -f "$PWD/reload.conf" || fail "smtpd did not start"
+waitfor $SMTPCTL show status || fail "smtpd is not running"
+pid=$(pgrep -o -x smtpd)
+
+# no sink yet, the message stays in the queue
+$SMTPSCRIPT -p 2525 reload.script >/dev/null || fail "message not queued"
+nomessage && fail "message not in the queue"
+
+kill -HUP $pid || fail "no smtpd to reload"
+waitfor gone $pid || fail "the previous generation did not exit"
+waitfor $SMTPCTL show status || fail "smtpd did not reload"
+
+$SMTPSINK -p 2526 >/dev/null 2>&1 &
+sink=$!
+$SMTPCTL schedule all >/dev/null
+waitfor nomessage || fail "message left in the queue after delivery"
+
+kill $sink
+pkill -o -x smtpd
+echo "reload: ok"
@@ -0,0 +1,65 @@
+#!/bin/sh
+#	$OpenBSD$
+
+# A message queued before a stop must be taken from the scheduler state
+# saved on SIGTERM by the next start, then delivered and removed.
+#
+# Run as root from this directory, with the programs under test given
+# in SMTPD, SMTPCTL, SMTPSCRIPT and SMTPSINK if they are not in PATH.
+
+SMTPD=${SMTPD:-smtpd}
+SMTPCTL=${SMTPCTL:-smtpctl}
+SMTPSCRIPT=${SMTPSCRIPT:-smtpscript}
+SMTPSINK=${SMTPSINK:-smtpsink}
+SPOOL=${SPOOL:-/var/spool/smtpd}
+
+sink=
+fail() {
+	echo "FAIL: $*"
+	[ -n "$sink" ] && kill $sink
+	pkill -o -x smtpd
+	exit 1
+}
+
+# wait up to 30s for a command to succeed
+waitfor() {
+	i=0
+	until "$@" >/dev/null 2>&1; do
+		i=$((i + 1))
+		[ $i -gt 300 ] && return 1
+		sleep 0.1
+	done
+}
+
+nomessage() {
+	[ -z "$(find $SPOOL/queue -mindepth 2 -type d)" ]
+}
+
+gone() {
+	! kill -0 $1
+}
+
+$SMTPD -f "$PWD/reload.conf" || fail "smtpd did not start"
+waitfor $SMTPCTL show status || fail "smtpd is not running"
+pid=$(pgrep -o -x smtpd)
+
+# no sink yet, the message stays in the queue
+$SMTPSCRIPT -p 2525 reload.script >/dev/null || fail "message not queued"
+nomessage && fail "message not in the queue"
+
+kill -TERM $pid || fail "no smtpd to stop"
+waitfor gone $pid || fail "smtpd did not exit"
+[ -f $SPOOL/temporary/scheduler.state ] || fail "no scheduler state saved"
+
+# the message was in flight when stopped, it is due right away
+$SMTPSINK -p 2526 >/dev/null 2>&1 &
+sink=$!
+$SMTPD -f "$PWD/reload.conf" || fail "smtpd did not restart"
+waitfor $SMTPCTL show status || fail "smtpd is not running"
+waitfor test ! -f $SPOOL/temporary/scheduler.state ||
+    fail "scheduler state not loaded"
+waitfor nomessage || fail "message left in the queue after delivery"
+
+kill $sink
+pkill -o -x smtpd
+echo "restart: ok"
@@ -18,16 +18,24 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/queue.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <vis.h>
 
@@ -35,12 +43,16 @@
 
 #include "smtpscript.h"
 
-void   *ssl_connect(int);
+void   *ssl_connect(int, int);
+int	ssl_resumed(void *);
 void	ssl_close(void *);
 
 /* XXX */
 #define SMTP_LINE_MAX	4096
 
+/* length of the lines generated by write-data */
+#define DATA_LINE_LEN	76
+
 enum {
 	OP_BLOCK,
 	OP_REPEAT,
@@ -86,6 +98,9 @@ struct op {
 			char		*hostname;
 			int		 portno;
 		}	connect;
+		struct {
+			int		 resume;
+		}	starttls;
 		struct {
 			unsigned int	 ms;
 		}	sleep;
@@ -112,6 +127,32 @@ struct ctx {
 
 	int		 result;
 	char		*reason;
+
+	/* the end of a message was sent, its reply is the next one */
+	int		 indata;
+	struct timespec	 tdata;
+};
+
+/*
+ * In load mode, every worker records a sample for each test-case run,
+ * each connection and each message, and the parent reports on them.
+ */
+#define SAMPLE_SESSION	0
+#define SAMPLE_CONNECT	1
+#define SAMPLE_MESSAGE	2
+#define SAMPLE_MAX	3
+
+struct sample {
+	int		 type;
+	int		 result;
+	int64_t		 usec;
+};
+
+struct samples {
+	size_t		 ok;
+	size_t		 failed;
+	size_t		 size;
+	int64_t		*usec;
 };
 
 static struct op	* _op_connect;
@@ -120,6 +161,10 @@ int		verbose;
 int		randomdelay; /* between each testcase */
 int		tapout;
 size_t		rundelay; /* between each testcase */
+int		concurrency; /* load mode */
+int		iterations = 1;
+
+static FILE	*samples;
 
 static size_t	test_pass;
 static size_t	test_skip;
@@ -132,6 +177,11 @@ static void run_testcase(struct procedure *);
 static void print_testcase(char *status, char *name, char *reason, char *directive, size_t number);
 static void process_op(struct ctx *, struct op *);
 static const char * parse_smtp_response(char *, size_t, char **, int *);
+static int is_data_end(const char *, size_t);
+static int run_load(struct script *);
+static int print_load(FILE **, int64_t);
+static void add_sample(int, int, const struct timespec *);
+static int64_t elapsed(const struct timespec *);
 
 struct procedure *
 procedure_create(struct script *scr, char *name)
@@ -274,7 +324,9 @@ op_connect(struct op *parent, const char *hostname, int portno)
 
 	bzero(&o, sizeof o);
 	o.type = OP_CONNECT;
-	o.u.connect.hostname = strdup(hostname);
+	/* without a host, the one the test-cases connect to first */
+	if (hostname)
+		o.u.connect.hostname = strdup(hostname);
 	o.u.connect.portno = portno;
 	return (op_add_child(parent, &o));
 }
@@ -290,12 +342,13 @@ op_disconnect(struct op *parent)
 }
 
 struct op *
-op_starttls(struct op *parent)
+op_starttls(struct op *parent, int resume)
 {
 	struct op	o;
 
 	bzero(&o, sizeof o);
 	o.type	= OP_STARTTLS;
+	o.u.starttls.resume = resume;
 	return (op_add_child(parent, &o));
 }
 
@@ -337,6 +390,30 @@ op_printf(struct op *parent, const char *fmt, ...)
 	return op_write(parent, buf, len);
 }
 
+/* a message body of at least 2 bytes, without the final dot */
+struct op *
+op_data(struct op *parent, size_t size)
+{
+	char	*buf;
+	size_t	 i, n;
+
+	if ((buf = malloc(size)) == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < size; i += n) {
+		n = size - i;
+		if (n > DATA_LINE_LEN + 2)
+			n = DATA_LINE_LEN + 2;
+		/* the body must end with a full line */
+		if (size - i - n == 1)
+			n--;
+		memset(buf + i, 'x', n - 2);
+		memcpy(buf + i + n - 2, "\r\n", 2);
+	}
+
+	return op_write(parent, buf, size);
+}
+
 struct op *
 op_expect_disconnect(struct op *parent)
 {
@@ -362,7 +439,8 @@ static void
 usage(void)
 {
 	extern const char *__progname;
-	errx(1, "Usage: %s [-rvt] [-d delay] script", __progname);
+	errx(1, "Usage: %s [-rvt] [-c concurrency] [-d delay] [-h host] "
+	    "[-n iterations] [-p port] script", __progname);
 }
 
 int
@@ -370,16 +448,35 @@ main(int argc, char **argv)
 {
 	struct script		*s;
 	struct procedure	*p;
-	int			 ch;
+	const char		*host = "127.0.0.1", *errstr;
+	int			 ch, port = 25;
 
-	while ((ch = getopt(argc, argv, "d:rvt")) != -1) {
+	while ((ch = getopt(argc, argv, "c:d:h:n:p:rvt")) != -1) {
 		switch(ch) {
 		case 'v':
 			verbose += 1;
 			break;
+		case 'c':
+			concurrency = strtonum(optarg, 1, 10000, &errstr);
+			if (errstr)
+				errx(1, "concurrency is %s: %s", errstr, optarg);
+			break;
 		case 'd':
 			rundelay = atoi(optarg) * 1000;
 			break;
+		case 'h':
+			host = optarg;
+			break;
+		case 'n':
+			iterations = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "iterations is %s: %s", errstr, optarg);
+			break;
+		case 'p':
+			port = strtonum(optarg, 1, USHRT_MAX, &errstr);
+			if (errstr)
+				errx(1, "port is %s: %s", errstr, optarg);
+			break;
 		case 'r':
 			randomdelay = 1;
 			break;
@@ -401,7 +498,10 @@ main(int argc, char **argv)
 	if (s == NULL)
 		errx(1, "error reading script file");
 
-	_op_connect = op_connect(NULL, "127.0.0.1", 25);
+	_op_connect = op_connect(NULL, host, port);
+
+	if (concurrency)
+		return (run_load(s));
 
 	if (tapout) {
 		printf("# smtpscript is an SMTP testing framework\n\n");
@@ -455,6 +555,7 @@ static void
 run_testcase(struct procedure *proc)
 {
 	struct ctx	 c;
+	struct timespec	 t0;
 	uint32_t	 rdelay;
 
 	bzero(&c, sizeof c);
@@ -474,6 +575,7 @@ run_testcase(struct procedure *proc)
 	if (verbose > 1)
 		printf("\n");
 
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 	if (!(proc->flags & PROC_NOCONNECT))
 		process_op(&c, _op_connect);
 	process_op(&c, proc->root);
@@ -484,6 +586,12 @@ run_testcase(struct procedure *proc)
 		ssl_close(c.ssl);
 	iobuf_clear(&c.iobuf);
 
+	if (samples) {
+		add_sample(SAMPLE_SESSION, c.result, &t0);
+		free(c.reason);
+		return;
+	}
+
 	if (verbose > 1) {
 		printf("# Done with test-case \"%s\": ", proc->name);
 	}
@@ -637,9 +745,12 @@ print_op(struct op *op, int lvl)
 		break;
 	
 	case OP_CONNECT:
-		printf("=> connect %s:%i\n",
-		    op->u.connect.hostname,
-		    op->u.connect.portno);
+		if (op->u.connect.hostname == NULL)
+			printf("=> connect\n");
+		else
+			printf("=> connect %s:%i\n",
+			    op->u.connect.hostname,
+			    op->u.connect.portno);
 		break;
 
 	case OP_DISCONNECT:
@@ -647,7 +758,8 @@ print_op(struct op *op, int lvl)
 		break;
 
 	case OP_STARTTLS:
-		printf("=> starttls\n");
+		printf("=> starttls%s\n",
+		    op->u.starttls.resume ? " resume" : "");
 		break;
 
 	case OP_SLEEP:
@@ -693,6 +805,7 @@ process_op(struct ctx *ctx, struct op *op)
 	struct addrinfo	 hints, *a, *ai;
 	struct op	*o;
 	struct iobuf	*iobuf;
+	struct timespec	 t0;
 	int		 i, r, s, save_errno, cont;
 	const char	*cause;
 	char		 buf[16], *servname, *line;
@@ -755,10 +868,16 @@ process_op(struct ctx *ctx, struct op *op)
 		break;
 
 	case OP_CONNECT:
+		if (op->u.connect.hostname == NULL)
+			op = _op_connect;
+		if (ctx->ssl)
+			ssl_close(ctx->ssl);
+		ctx->ssl = NULL;
 		if (ctx->sock != -1)
 			close(ctx->sock);
 		ctx->sock = -1;
 		iobuf_clear(iobuf);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
 
 		servname = NULL;
 		if (op->u.connect.portno) {
@@ -795,16 +914,24 @@ process_op(struct ctx *ctx, struct op *op)
 		}
 		freeaddrinfo(ai);
 		if (s == -1) {
+			add_sample(SAMPLE_CONNECT, RES_ERROR, &t0);
 			set_failure(ctx, RES_ERROR,
 			    "failed to connect to %s:%s: %s",
 			    op->u.connect.hostname, servname, cause);
 		} else {
 			ctx->sock = s;
 			iobuf_init(iobuf, 0, 0);
+			add_sample(SAMPLE_CONNECT, RES_OK, &t0);
+			/* do not delay the small writes ending a message */
+			i = 1;
+			setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &i, sizeof i);
 		}
 		break;
 
 	case OP_DISCONNECT:
+		if (ctx->ssl)
+			ssl_close(ctx->ssl);
+		ctx->ssl = NULL;
 		if (ctx->sock != -1)
 			close(ctx->sock);
 		ctx->sock = -1;
@@ -814,8 +941,11 @@ process_op(struct ctx *ctx, struct op *op)
 	case OP_STARTTLS:
 		if (ctx->ssl)
 			set_failure(ctx, RES_ERROR, "SSL context already here");
-		else if ((ctx->ssl = ssl_connect(ctx->sock)) == NULL)
+		else if ((ctx->ssl = ssl_connect(ctx->sock,
+		    op->u.starttls.resume)) == NULL)
 			set_failure(ctx, RES_ERROR, "SSL connection failed");
+		else if (op->u.starttls.resume && !ssl_resumed(ctx->ssl))
+			set_failure(ctx, RES_FAIL, "SSL session not resumed");
 		break;
 
 	case OP_SLEEP:
@@ -830,6 +960,10 @@ process_op(struct ctx *ctx, struct op *op)
 			r = iobuf_flush(iobuf, ctx->sock);
 		switch (r) {
 		case 0:
+			if (is_data_end(op->u.write.buf, op->u.write.len)) {
+				ctx->indata = 1;
+				clock_gettime(CLOCK_MONOTONIC, &ctx->tdata);
+			}
 			break;
 		case IOBUF_CLOSED:
 			set_failure(ctx, RES_FAIL, "connection closed");
@@ -865,6 +999,7 @@ process_op(struct ctx *ctx, struct op *op)
 			ctx->sock = -1;
 			if (ctx->ssl)
 				ssl_close(ctx->ssl);
+			ctx->ssl = NULL;
 			break;
 		case IOBUF_WANT_READ:
 			set_failure(ctx, RES_ERROR, "iobuf_read(): WANT_READ");
@@ -936,6 +1071,12 @@ process_op(struct ctx *ctx, struct op *op)
 
 		/* got our response */
 
+		if (ctx->indata) {
+			ctx->indata = 0;
+			add_sample(SAMPLE_MESSAGE,
+			    line[0] == '2' ? RES_OK : RES_FAIL, &ctx->tdata);
+		}
+
 		if (verbose > 1) {
 			len = ctx->lvl;
 			while (len--)
@@ -1007,3 +1148,170 @@ parse_smtp_response(char *line, size_t len, char **msg, int *cont)
 
 	return NULL;
 }
+
+/* whether the buffer ends a message, but maybe not the write */
+static int
+is_data_end(const char *buf, size_t len)
+{
+	size_t	i;
+
+	if (len >= 3 && !memcmp(buf, ".\r\n", 3))
+		return (1);
+	for (i = 0; i + 5 <= len; i++)
+		if (!memcmp(buf + i, "\r\n.\r\n", 5))
+			return (1);
+	return (0);
+}
+
+static int64_t
+elapsed(const struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((int64_t)(t1.tv_sec - t0->tv_sec) * 1000000 +
+	    (t1.tv_nsec - t0->tv_nsec) / 1000);
+}
+
+static void
+add_sample(int type, int result, const struct timespec *t0)
+{
+	struct sample	s;
+
+	if (samples == NULL)
+		return;
+
+	s.type = type;
+	s.result = result;
+	s.usec = elapsed(t0);
+	if (fwrite(&s, sizeof s, 1, samples) != 1)
+		err(1, "fwrite");
+}
+
+/*
+ * Run all the test-cases "iterations" times in each of "concurrency"
+ * workers, as fast as the server permits.
+ */
+static int
+run_load(struct script *s)
+{
+	struct procedure	*p;
+	struct timespec		 t0;
+	FILE			**files;
+	int			 i, n, status, ret = 0;
+
+	if ((files = calloc(concurrency, sizeof *files)) == NULL)
+		err(1, "calloc");
+
+	/* a server closing on us is a failure, not a reason to die */
+	signal(SIGPIPE, SIG_IGN);
+
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < concurrency; i++) {
+		if ((files[i] = tmpfile()) == NULL)
+			err(1, "tmpfile");
+		switch (fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			samples = files[i];
+			for (n = 0; n < iterations; n++)
+				TAILQ_FOREACH(p, &s->procs, entry)
+					if (p->flags & PROC_TESTCASE)
+						run_testcase(p);
+			if (fflush(samples) == EOF)
+				err(1, "fflush");
+			_exit(0);
+		}
+	}
+
+	for (;;) {
+		if (wait(&status) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ECHILD)
+				break;
+			err(1, "wait");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+	}
+
+	if (print_load(files, elapsed(&t0)))
+		ret = 1;
+
+	for (i = 0; i < concurrency; i++)
+		fclose(files[i]);
+	free(files);
+
+	return (ret);
+}
+
+static int
+usec_cmp(const void *a, const void *b)
+{
+	int64_t	x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static double
+percentile(struct samples *ss, int pct)
+{
+	if (ss->ok == 0)
+		return (0.0);
+	return (ss->usec[(ss->ok - 1) * pct / 100] / 1000.0);
+}
+
+/* returns whether any test-case run failed */
+static int
+print_load(FILE **files, int64_t usec)
+{
+	static const char	*names[SAMPLE_MAX] = {
+		"sessions", "connections", "messages"
+	};
+	struct samples		 ss[SAMPLE_MAX], *sp;
+	struct sample		 s;
+	double			 secs;
+	int			 i;
+
+	bzero(ss, sizeof ss);
+	for (i = 0; i < concurrency; i++) {
+		rewind(files[i]);
+		while (fread(&s, sizeof s, 1, files[i]) == 1) {
+			if (s.type < 0 || s.type >= SAMPLE_MAX)
+				errx(1, "bad sample");
+			sp = &ss[s.type];
+			if (s.result != RES_OK) {
+				sp->failed++;
+				continue;
+			}
+			if (sp->ok == sp->size) {
+				sp->size = sp->size ? sp->size * 2 : 1024;
+				sp->usec = reallocarray(sp->usec, sp->size,
+				    sizeof *sp->usec);
+				if (sp->usec == NULL)
+					err(1, "reallocarray");
+			}
+			sp->usec[sp->ok++] = s.usec;
+		}
+		if (ferror(files[i]))
+			err(1, "fread");
+	}
+
+	secs = usec / 1000000.0;
+	printf("concurrency: %d, iterations: %d, elapsed: %.3fs\n",
+	    concurrency, iterations, secs);
+	for (i = 0; i < SAMPLE_MAX; i++) {
+		sp = &ss[i];
+		qsort(sp->usec, sp->ok, sizeof *sp->usec, usec_cmp);
+		printf("%s: %zu ok, %zu failed, %.1f/s, "
+		    "latency p50 %.3fms p99 %.3fms\n", names[i],
+		    sp->ok, sp->failed, secs ? sp->ok / secs : 0.0,
+		    percentile(sp, 50), percentile(sp, 99));
+		free(sp->usec);
+	}
+
+	return (ss[SAMPLE_SESSION].failed != 0);
+}
@@ -46,6 +46,10 @@ void	ssl_error(const char *);
 static void	ssl_init(void);
 static SSL_CTX *ssl_ctx_create(void);
 static void    *ssl_client_ctx(void);
+static int	ssl_new_session(SSL *, SSL_SESSION *);
+
+/* the last session, offered again by "starttls resume" */
+static SSL_SESSION	*ssl_session;
 
 static void
 ssl_init(void)
@@ -81,12 +85,28 @@ ssl_error(const char *where)
 }
 
 void *
-ssl_connect(int sock)
+ssl_connect(int sock, int resume)
 {
-	SSL	*ssl;
+	SSL		*ssl;
+	SSL_SESSION	*session = NULL;
 
 	ssl = ssl_client_ctx();
 
+	/*
+	 * A TLSv1.3 session is only used once, so every resumption
+	 * offers a copy of the one kept.
+	 */
+	if (resume && ssl_session) {
+		if ((session = SSL_SESSION_dup(ssl_session)) == NULL ||
+		    SSL_set_session(ssl, session) == 0) {
+			ssl_error("ssl_connect:SSL_set_session");
+			SSL_SESSION_free(session);
+			SSL_free(ssl);
+			return (NULL);
+		}
+		SSL_SESSION_free(session);
+	}
+
 	if (SSL_set_fd(ssl, sock) == 0) {
 		ssl_error("ssl_connect:SSL_set_fd");
 		SSL_free(ssl);
@@ -102,11 +122,33 @@ ssl_connect(int sock)
 	return ((void*)ssl);
 }
 
+int
+ssl_resumed(void *a)
+{
+	return (SSL_session_reused(a));
+}
+
+/*
+ * Sessions are kept from here rather than at the end of the handshake,
+ * as a TLSv1.3 ticket only comes in with the first reply after it.
+ */
+static int
+ssl_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	if (ssl_session)
+		SSL_SESSION_free(ssl_session);
+	ssl_session = session;
+	return (1);
+}
+
 void
 ssl_close(void *a)
 {
 	SSL	*ssl = a;
 
+	/* a session freed without a shutdown is not resumable */
+	SSL_set_quiet_shutdown(ssl, 1);
+	SSL_shutdown(ssl);
 	SSL_free(ssl);
 }
 
@@ -123,10 +165,12 @@ ssl_ctx_create(void)
 		errx(1, "ssl_ctx_create: could not create SSL context");
 	}
 
-	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_session_cache_mode(ctx,
+	    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, ssl_new_session);
 	SSL_CTX_set_timeout(ctx, 30);
 	SSL_CTX_set_options(ctx,
-	    SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_TICKET);
+	    SSL_OP_ALL | SSL_OP_NO_SSLv2);
 	SSL_CTX_set_options(ctx,
 	    SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION);
 
@@ -141,27 +185,20 @@ ssl_ctx_create(void)
 static void *
 ssl_client_ctx(void)
 {
-	SSL_CTX		*ctx;
-	SSL		*ssl = NULL;
-	int		 rv = -1;
+	static SSL_CTX	*ctx;
+	SSL		*ssl;
 
-	ctx = ssl_ctx_create();
+	/* shared by all connections, for their sessions to be resumed */
+	if (ctx == NULL)
+		ctx = ssl_ctx_create();
 
 	if ((ssl = SSL_new(ctx)) == NULL)
-		goto done;
-	SSL_CTX_free(ctx);
-
-	if (!SSL_set_ssl_method(ssl, SSLv23_client_method()))
-		goto done;
+		return (NULL);
 
-	rv = 0;
-done:
-	if (rv) {
-		if (ssl)
-			SSL_free(ssl);
-		else if (ctx)
-			SSL_CTX_free(ctx);
-		ssl = NULL;
+	if (!SSL_set_ssl_method(ssl, SSLv23_client_method())) {
+		SSL_free(ssl);
+		return (NULL);
 	}
+
 	return (void*)(ssl);
 }
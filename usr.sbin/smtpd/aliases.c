@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 #ifdef HAVE_UTIL_H
 #include <util.h>
 #endif
@@ -41,13 +42,42 @@
 #include "smtpd.h"
 #include "log.h"
 
+/*
+ * Resolved aliases are cached per table and key, after includes have been
+ * read and duplicates dropped, so that list traffic does not parse the
+ * same large value again for every envelope.  The cache is flushed when
+ * any table is updated; include files and misses are picked up again once
+ * the entry expires.  Proc tables are never cached since their content is
+ * not known to change only on update.
+ */
+#define	ALIASES_CACHE_MAX	1024
+#define	ALIASES_CACHE_TTL	60	/* seconds */
+
+struct aliases_cache_entry {
+	TAILQ_ENTRY(aliases_cache_entry) entry;
+	char			*key;
+	time_t			 expire;
+	int			 nbaliases;
+	struct expand		 expand;
+};
+
 static int aliases_expand_include(struct expand *, const char *);
+static int aliases_cache_get(struct expand *, struct table *, const char *);
+static int aliases_resolve(struct expand *, struct table *, const char *,
+    struct expand *);
+static void aliases_cache_remove(struct aliases_cache_entry *);
+static int aliases_merge(struct expand *, struct aliases_cache_entry *);
+
+static struct dict	aliases_cache;
+static TAILQ_HEAD(aliases_cache_lru, aliases_cache_entry) aliases_cache_lru;
+static unsigned int	aliases_cache_gen;
+static int		aliases_cache_init;
 
 int
 aliases_get(struct expand *expand, const char *username)
 {
-	struct expandnode      *xn;
 	char			buf[SMTPD_MAXLOCALPARTSIZE];
+	char			key[SMTPD_MAXLOCALPARTSIZE];
 	size_t			nbaliases;
 	int			ret;
 	union lookup		lk;
@@ -55,10 +85,14 @@ aliases_get(struct expand *expand, const char *username)
 	struct table	       *mapping = NULL;
 	char		       *pbuf;
 
-	dsp = dict_xget(env->sc_dispatchers, expand->rule->dispatcher);
+	dsp = hdict_xget(env->sc_dispatchers, expand->rule->dispatcher);
 	mapping = table_find(env, dsp->u.local.table_alias);
 
 	xlowercase(buf, username, sizeof(buf));
+	(void)strlcpy(key, buf, sizeof(key));
+
+	if ((ret = aliases_cache_get(expand, mapping, key)) >= 0)
+		return ret;
 
 	/* first, check if entry has a user-part tag */
 	pbuf = strchr(buf, *env->sc_subaddressing_delim);
@@ -73,23 +107,13 @@ aliases_get(struct expand *expand, const char *username)
 
 	/* no user-part tag, try looking up user */
 	ret = table_lookup(mapping, K_ALIAS, buf, &lk);
-	if (ret <= 0)
+	if (ret < 0)
 		return ret;
+	if (ret == 0)
+		lk.expand = NULL;
 
 expand:
-	/* foreach node in table_alias expandtree, we merge */
-	nbaliases = 0;
-	RB_FOREACH(xn, expandtree, &lk.expand->tree) {
-		if (xn->type == EXPAND_INCLUDE)
-			nbaliases += aliases_expand_include(expand,
-			    xn->u.buffer);
-		else {
-			expand_insert(expand, xn);
-			nbaliases++;
-		}
-	}
-
-	expand_free(lk.expand);
+	nbaliases = aliases_resolve(expand, mapping, key, lk.expand);
 
 	log_debug("debug: aliases_get: returned %zd aliases", nbaliases);
 	return nbaliases;
@@ -98,9 +122,9 @@ expand:
 int
 aliases_virtual_get(struct expand *expand, const struct mailaddr *maddr)
 {
-	struct expandnode      *xn;
 	union lookup		lk;
 	char			buf[LINE_MAX];
+	char			key[LINE_MAX];
 	char			user[LINE_MAX];
 	char			tag[LINE_MAX];
 	char			domain[LINE_MAX];
@@ -110,7 +134,7 @@ aliases_virtual_get(struct expand *expand, const struct mailaddr *maddr)
 	struct dispatcher      *dsp;
 	struct table	       *mapping = NULL;
 
-	dsp = dict_xget(env->sc_dispatchers, expand->rule->dispatcher);
+	dsp = hdict_xget(env->sc_dispatchers, expand->rule->dispatcher);
 	mapping = table_find(env, dsp->u.local.table_virtual);
 
 	if (!bsnprintf(user, sizeof(user), "%s", maddr->user))
@@ -120,6 +144,11 @@ aliases_virtual_get(struct expand *expand, const struct mailaddr *maddr)
 	xlowercase(user, user, sizeof(user));
 	xlowercase(domain, domain, sizeof(domain));
 
+	if (!bsnprintf(key, sizeof(key), "%s@%s", user, domain))
+		return 0;
+	if ((ret = aliases_cache_get(expand, mapping, key)) >= 0)
+		return ret;
+
 	memset(tag, '\0', sizeof tag);
 	pbuf = strchr(user, *env->sc_subaddressing_delim);
 	if (pbuf) {
@@ -186,23 +215,13 @@ aliases_virtual_get(struct expand *expand, const struct mailaddr *maddr)
 
 	/* Failed ? We lookup for a *global* catch all */
 	ret = table_lookup(mapping, K_ALIAS, "@", &lk);
-	if (ret <= 0)
+	if (ret < 0)
 		return (ret);
+	if (ret == 0)
+		lk.expand = NULL;
 
 expand:
-	/* foreach node in table_virtual expand, we merge */
-	nbaliases = 0;
-	RB_FOREACH(xn, expandtree, &lk.expand->tree) {
-		if (xn->type == EXPAND_INCLUDE)
-			nbaliases += aliases_expand_include(expand,
-			    xn->u.buffer);
-		else {
-			expand_insert(expand, xn);
-			nbaliases++;
-		}
-	}
-
-	expand_free(lk.expand);
+	nbaliases = aliases_resolve(expand, mapping, key, lk.expand);
 
 	log_debug("debug: aliases_virtual_get: '%s' resolved to %d nodes",
 	    buf, nbaliases);
@@ -232,3 +251,112 @@ aliases_expand_include(struct expand *expand, const char *filename)
 	fclose(fp);
 	return 1;
 }
+
+/*
+ * Returns the number of aliases merged from a valid cache entry for key,
+ * or -1 if the caller must look it up.
+ */
+static int
+aliases_cache_get(struct expand *expand, struct table *mapping,
+    const char *key)
+{
+	struct aliases_cache_entry	*e;
+	char				 ckey[LINE_MAX];
+
+	if (!aliases_cache_init) {
+		dict_init(&aliases_cache);
+		TAILQ_INIT(&aliases_cache_lru);
+		aliases_cache_gen = table_generation();
+		aliases_cache_init = 1;
+	}
+
+	if (aliases_cache_gen != table_generation()) {
+		while (!TAILQ_EMPTY(&aliases_cache_lru))
+			aliases_cache_remove(TAILQ_FIRST(&aliases_cache_lru));
+		aliases_cache_gen = table_generation();
+	}
+
+	if (!bsnprintf(ckey, sizeof(ckey), "%s:%s", mapping->t_name, key))
+		return (-1);
+	if ((e = dict_get(&aliases_cache, ckey)) == NULL)
+		return (-1);
+	if (e->expire <= time(NULL)) {
+		aliases_cache_remove(e);
+		return (-1);
+	}
+
+	TAILQ_REMOVE(&aliases_cache_lru, e, entry);
+	TAILQ_INSERT_HEAD(&aliases_cache_lru, e, entry);
+
+	log_trace(TRACE_EXPAND, "expand: aliases cache hit for %s", ckey);
+	return (aliases_merge(expand, e));
+}
+
+/*
+ * Resolve the nodes of a successful lookup, or NULL for a miss, into a
+ * cache entry for key and merge them into the expansion.  The lookup
+ * result is freed.
+ */
+static int
+aliases_resolve(struct expand *expand, struct table *mapping, const char *key,
+    struct expand *lkexpand)
+{
+	struct aliases_cache_entry	*e, *old;
+	struct expandnode		*xn;
+	char				 ckey[LINE_MAX];
+	int				 nbaliases;
+
+	e = xcalloc(1, sizeof(*e));
+
+	if (lkexpand) {
+		TAILQ_FOREACH(xn, &lkexpand->nodes, entry) {
+			if (xn->type == EXPAND_INCLUDE)
+				e->nbaliases += aliases_expand_include(
+				    &e->expand, xn->u.buffer);
+			else {
+				expand_insert(&e->expand, xn);
+				e->nbaliases++;
+			}
+		}
+		expand_free(lkexpand);
+	}
+
+	nbaliases = aliases_merge(expand, e);
+
+	if (strcmp(mapping->t_backend->name, "proc") == 0 ||
+	    !bsnprintf(ckey, sizeof(ckey), "%s:%s", mapping->t_name, key)) {
+		expand_clear(&e->expand);
+		free(e);
+		return (nbaliases);
+	}
+
+	if ((old = dict_get(&aliases_cache, ckey)))
+		aliases_cache_remove(old);
+	else if (dict_count(&aliases_cache) >= ALIASES_CACHE_MAX)
+		aliases_cache_remove(TAILQ_LAST(&aliases_cache_lru,
+		    aliases_cache_lru));
+
+	e->key = xstrdup(ckey);
+	e->expire = time(NULL) + ALIASES_CACHE_TTL;
+	dict_xset(&aliases_cache, e->key, e);
+	TAILQ_INSERT_HEAD(&aliases_cache_lru, e, entry);
+
+	return (nbaliases);
+}
+
+static void
+aliases_cache_remove(struct aliases_cache_entry *e)
+{
+	dict_xpop(&aliases_cache, e->key);
+	TAILQ_REMOVE(&aliases_cache_lru, e, entry);
+	expand_clear(&e->expand);
+	free(e->key);
+	free(e);
+}
+
+static int
+aliases_merge(struct expand *expand, struct aliases_cache_entry *e)
+{
+	expand_merge(expand, &e->expand);
+	return (e->nbaliases);
+}
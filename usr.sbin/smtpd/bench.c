@@ -0,0 +1,711 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Micro-benchmarks of the primitives on the hot paths of smtpd.
+ *
+ * Each benchmark runs its operation a growing number of times until the
+ * run lasts long enough, then reports the time and the number of
+ * allocations per operation.  Allocations are counted by wrapping the
+ * allocator at link time, see the "bench" target in mk/smtpd.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <event.h>
+#include <imsg.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "iobuf.h"
+#include "log.h"
+#include "rfc5322.h"
+
+#define	BENCH_NKEYS	10000
+#define	BENCH_NLINES	64
+#define	BENCH_NEXPAND	100
+#define	BENCH_MAXOPS	(1 << 30)
+
+struct bench {
+	const char	*name;
+	void		(*init)(void);
+	void		(*run)(size_t);
+};
+
+static void	bench_keys_init(void);
+static void	bench_tree_init(void);
+static void	bench_tree_get(size_t);
+static void	bench_tree_setpop(size_t);
+static void	bench_dict_init(void);
+static void	bench_dict_get(size_t);
+static void	bench_dict_setpop(size_t);
+static void	bench_runq_init(void);
+static void	bench_runq_schedcancel(size_t);
+static void	bench_iobuf_init(void);
+static void	bench_iobuf_getline(size_t);
+static void	bench_rfc5322_init(void);
+static void	bench_rfc5322_message(size_t);
+static void	bench_envelope_init(void);
+static void	bench_envelope_dump(size_t);
+static void	bench_envelope_load(size_t);
+static void	bench_envelope_dump_binary(size_t);
+static void	bench_envelope_load_binary(size_t);
+static void	bench_mailaddr(size_t);
+static void	bench_table_init(void);
+static void	bench_table_lookup(size_t);
+static void	bench_table_match_domain(size_t);
+static void	bench_expand_insert(size_t);
+static void	bench_runq_cb(struct runq *, void *);
+
+static struct bench benches[] = {
+	{ "tree_get",		bench_tree_init, bench_tree_get },
+	{ "tree_set_pop",	bench_tree_init, bench_tree_setpop },
+	{ "dict_get",		bench_dict_init, bench_dict_get },
+	{ "dict_set_pop",	bench_dict_init, bench_dict_setpop },
+	{ "runq_schedule_cancel", bench_runq_init, bench_runq_schedcancel },
+	{ "iobuf_getline",	bench_iobuf_init, bench_iobuf_getline },
+	{ "rfc5322_message",	bench_rfc5322_init, bench_rfc5322_message },
+	{ "envelope_dump",	bench_envelope_init, bench_envelope_dump },
+	{ "envelope_load",	bench_envelope_init, bench_envelope_load },
+	{ "envelope_dump_binary", bench_envelope_init,
+	    bench_envelope_dump_binary },
+	{ "envelope_load_binary", bench_envelope_init,
+	    bench_envelope_load_binary },
+	{ "text_to_mailaddr",	NULL, bench_mailaddr },
+	{ "table_lookup",	bench_table_init, bench_table_lookup },
+	{ "table_match_domain",	bench_table_init, bench_table_match_domain },
+	{ "expand_insert",	NULL, bench_expand_insert },
+};
+
+/* the smtpd bits the primitives depend on */
+struct smtpd	*env;
+int		 profiling;
+
+static size_t	 nallocs;
+static int	 keys_done;
+static uint64_t	 ids[BENCH_NKEYS], newids[BENCH_NKEYS];
+static char	 keys[BENCH_NKEYS][64], newkeys[BENCH_NKEYS][64];
+
+static struct tree	 tree;
+static struct dict	 dict;
+static struct runq	*runq;
+static struct iobuf	 iobuf;
+static char		*lines;
+static size_t		 lineslen;
+static struct rfc5322_parser *parser;
+static struct envelope	 envelope;
+static char		 evpbuf[8192], evpbin[8192];
+static size_t		 evpbuflen, evpbinlen;
+static struct table	*table;
+
+static const char *message[] = {
+	"Received: from mail.example.org (mail.example.org [192.0.2.1])",
+	"	by mx.example.com (OpenSMTPD) with ESMTPS id 4f0a1b2c",
+	"	for <user@example.com>; Mon, 12 Oct 2026 10:00:00 +0000 (UTC)",
+	"From: Some Sender <sender@example.org>",
+	"To: Some User <user@example.com>, Another User <other@example.com>",
+	"Cc: list@lists.example.net",
+	"Subject: a message of a realistic shape",
+	"Date: Mon, 12 Oct 2026 10:00:00 +0000",
+	"Message-ID: <20261012100000.4f0a1b2c@mail.example.org>",
+	"MIME-Version: 1.0",
+	"Content-Type: text/plain; charset=utf-8",
+	"Content-Transfer-Encoding: 8bit",
+	"",
+	"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod",
+	"tempor incididunt ut labore et dolore magna aliqua. Ut enim ad minim",
+	"veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea",
+	"commodo consequat. Duis aute irure dolor in reprehenderit in voluptate",
+	"velit esse cillum dolore eu fugiat nulla pariatur. Excepteur sint",
+	"occaecat cupidatat non proident, sunt in culpa qui officia deserunt.",
+	"",
+	"-- ",
+	"Some Sender",
+};
+
+void	*__real_malloc(size_t);
+void	*__real_calloc(size_t, size_t);
+void	*__real_realloc(void *, size_t);
+void	*__real_reallocarray(void *, size_t, size_t);
+char	*__real_strdup(const char *);
+void	*__wrap_malloc(size_t);
+void	*__wrap_calloc(size_t, size_t);
+void	*__wrap_realloc(void *, size_t);
+void	*__wrap_reallocarray(void *, size_t, size_t);
+char	*__wrap_strdup(const char *);
+
+void *
+__wrap_malloc(size_t size)
+{
+	nallocs++;
+	return (__real_malloc(size));
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+	nallocs++;
+	return (__real_calloc(nmemb, size));
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	nallocs++;
+	return (__real_realloc(ptr, size));
+}
+
+void *
+__wrap_reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	nallocs++;
+	return (__real_reallocarray(ptr, nmemb, size));
+}
+
+char *
+__wrap_strdup(const char *s)
+{
+	nallocs++;
+	return (__real_strdup(s));
+}
+
+int
+profile_begin(struct timespec *t0)
+{
+	return (0);
+}
+
+void
+profile_end(const struct timespec *t0, const char *fmt, ...)
+{
+}
+
+void
+stat_increment(const char *key, size_t n)
+{
+}
+
+int
+fork_proc_backend(const char *key, const char *conf, const char *procname,
+    int do_stdout)
+{
+	errx(1, "fork_proc_backend: not in a benchmark");
+}
+
+static void
+bench_keys_init(void)
+{
+	size_t	i;
+
+	if (keys_done)
+		return;
+	keys_done = 1;
+
+	for (i = 0; i < BENCH_NKEYS; i++) {
+		ids[i] = (uint64_t)arc4random() << 32 | arc4random();
+		newids[i] = (uint64_t)arc4random() << 32 | arc4random();
+		(void)snprintf(keys[i], sizeof keys[i],
+		    "user%zu@example%zu.org", i, i % 97);
+		(void)snprintf(newkeys[i], sizeof newkeys[i],
+		    "other%zu@example%zu.net", i, i % 89);
+	}
+}
+
+/* a tree of BENCH_NKEYS envelope ids */
+static void
+bench_tree_init(void)
+{
+	size_t	i;
+
+	bench_keys_init();
+	if (tree_count(&tree))
+		return;
+	tree_init(&tree);
+	for (i = 0; i < BENCH_NKEYS; i++)
+		tree_xset(&tree, ids[i], &ids[i]);
+}
+
+static void
+bench_tree_get(size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		if (tree_get(&tree, ids[i % BENCH_NKEYS]) == NULL)
+			errx(1, "tree_get");
+}
+
+static void
+bench_tree_setpop(size_t n)
+{
+	size_t	i;
+	uint64_t id;
+
+	for (i = 0; i < n; i++) {
+		id = newids[i % BENCH_NKEYS];
+		tree_xset(&tree, id, &tree);
+		tree_xpop(&tree, id);
+	}
+}
+
+/* a dict of BENCH_NKEYS addresses */
+static void
+bench_dict_init(void)
+{
+	size_t	i;
+
+	bench_keys_init();
+	if (dict_count(&dict))
+		return;
+	dict_init(&dict);
+	for (i = 0; i < BENCH_NKEYS; i++)
+		dict_xset(&dict, keys[i], keys[i]);
+}
+
+static void
+bench_dict_get(size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		if (dict_get(&dict, keys[i % BENCH_NKEYS]) == NULL)
+			errx(1, "dict_get");
+}
+
+static void
+bench_dict_setpop(size_t n)
+{
+	size_t	i;
+	const char *k;
+
+	for (i = 0; i < n; i++) {
+		k = newkeys[i % BENCH_NKEYS];
+		dict_xset(&dict, k, &dict);
+		dict_xpop(&dict, k);
+	}
+}
+
+static void
+bench_runq_cb(struct runq *rq, void *arg)
+{
+}
+
+/* a runq with BENCH_NKEYS jobs pending, as a busy mta would have */
+static void
+bench_runq_init(void)
+{
+	time_t	t;
+	size_t	i;
+
+	bench_keys_init();
+	if (runq)
+		return;
+	if (!runq_init(&runq, bench_runq_cb))
+		err(1, "runq_init");
+	t = time(NULL) + 3600;
+	for (i = 0; i < BENCH_NKEYS; i++)
+		if (!runq_schedule_at(runq, t + i % 600, &ids[i]))
+			err(1, "runq_schedule_at");
+}
+
+static void
+bench_runq_schedcancel(size_t n)
+{
+	time_t	t;
+	size_t	i;
+
+	t = time(NULL) + 3600;
+	for (i = 0; i < n; i++) {
+		if (!runq_schedule_at(runq, t + i % 600, &newids[i %
+		    BENCH_NKEYS]))
+			err(1, "runq_schedule_at");
+		if (!runq_cancel(runq, &newids[i % BENCH_NKEYS]))
+			errx(1, "runq_cancel");
+	}
+}
+
+/* an input buffer of BENCH_NLINES lines of the message */
+static void
+bench_iobuf_init(void)
+{
+	size_t	i, len;
+
+	if (lines)
+		return;
+	for (i = 0; i < BENCH_NLINES; i++)
+		lineslen += strlen(message[i % nitems(message)]) + 2;
+	lines = xmalloc(lineslen + 1);
+	for (i = 0, len = 0; i < BENCH_NLINES; i++)
+		len += snprintf(lines + len, lineslen + 1 - len, "%s\r\n",
+		    message[i % nitems(message)]);
+
+	if (iobuf_init(&iobuf, lineslen, 0) == -1)
+		errx(1, "iobuf_init");
+}
+
+static void
+bench_iobuf_getline(size_t n)
+{
+	size_t	i, len;
+
+	for (i = 0; i < n; i++) {
+		if (iobuf_len(&iobuf) == 0) {
+			/* what a read would do */
+			memcpy(iobuf.buf, lines, lineslen);
+			iobuf.rpos = 0;
+			iobuf.wpos = lineslen;
+		}
+		if (iobuf_getline(&iobuf, &len) == NULL)
+			errx(1, "iobuf_getline");
+	}
+}
+
+static void
+bench_rfc5322_init(void)
+{
+	if (parser)
+		return;
+	if ((parser = rfc5322_parser_new()) == NULL)
+		err(1, "rfc5322_parser_new");
+}
+
+/* one operation is a whole message, as smtp_tx_parse() sees it */
+static void
+bench_rfc5322_message(size_t n)
+{
+	struct rfc5322_result	res;
+	size_t			i, l;
+	int			r;
+
+	for (i = 0; i < n; i++) {
+		rfc5322_clear(parser);
+		for (l = 0; l <= nitems(message); l++) {
+			if (rfc5322_push(parser,
+			    l < nitems(message) ? message[l] : NULL) == -1)
+				err(1, "rfc5322_push");
+			while ((r = rfc5322_next(parser, &res)) !=
+			    RFC5322_NONE && r != RFC5322_END_OF_MESSAGE) {
+				if (r == RFC5322_ERR)
+					errx(1, "rfc5322_next");
+				if (r == RFC5322_HEADER_START &&
+				    (!strcasecmp(res.hdr, "To") ||
+				    !strcasecmp(res.hdr, "Cc") ||
+				    !strcasecmp(res.hdr, "From")))
+					rfc5322_unfold_header(parser);
+			}
+		}
+	}
+}
+
+/* an mta envelope, as submitted from the network */
+static void
+bench_envelope_init(void)
+{
+	struct sockaddr_in	*sin;
+
+	if (evpbuflen)
+		return;
+
+	memset(&envelope, 0, sizeof envelope);
+	envelope.version = SMTPD_ENVELOPE_VERSION;
+	envelope.id = 0x4f0a1b2c5d6e7f80ULL;
+	envelope.type = D_MTA;
+	(void)strlcpy(envelope.dispatcher, "relay", sizeof envelope.dispatcher);
+	(void)strlcpy(envelope.tag, "incoming", sizeof envelope.tag);
+	(void)strlcpy(envelope.smtpname, "mx.example.com",
+	    sizeof envelope.smtpname);
+	(void)strlcpy(envelope.helo, "mail.example.org",
+	    sizeof envelope.helo);
+	(void)strlcpy(envelope.hostname, "mail.example.org",
+	    sizeof envelope.hostname);
+	sin = (struct sockaddr_in *)&envelope.ss;
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(0xc0000201);
+	if (!text_to_mailaddr(&envelope.sender, "sender@example.org") ||
+	    !text_to_mailaddr(&envelope.rcpt, "user@example.com") ||
+	    !text_to_mailaddr(&envelope.dest, "user@example.com"))
+		errx(1, "text_to_mailaddr");
+	envelope.creation = time(NULL);
+	envelope.ttl = 4 * 24 * 3600;
+	envelope.retry = 3;
+	envelope.lasttry = envelope.creation + 600;
+	envelope.dsn_notify = DSN_FAILURE;
+	envelope.dsn_ret = DSN_RETHDRS;
+	(void)strlcpy(envelope.dsn_envid, "4f0a1b2c@mail.example.org",
+	    sizeof envelope.dsn_envid);
+
+	if ((evpbuflen = envelope_dump_buffer(&envelope, evpbuf,
+	    sizeof evpbuf)) == 0)
+		errx(1, "envelope_dump_buffer");
+	if ((evpbinlen = envelope_dump_binary(&envelope, evpbin,
+	    sizeof evpbin)) == 0)
+		errx(1, "envelope_dump_binary");
+}
+
+static void
+bench_envelope_dump(size_t n)
+{
+	char	buf[8192];
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		if (envelope_dump_buffer(&envelope, buf, sizeof buf) == 0)
+			errx(1, "envelope_dump_buffer");
+}
+
+static void
+bench_envelope_load(size_t n)
+{
+	struct envelope	ep;
+	size_t		i;
+
+	for (i = 0; i < n; i++)
+		if (!envelope_load_buffer(&ep, evpbuf, evpbuflen))
+			errx(1, "envelope_load_buffer");
+}
+
+static void
+bench_envelope_dump_binary(size_t n)
+{
+	char	buf[8192];
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		if (envelope_dump_binary(&envelope, buf, sizeof buf) == 0)
+			errx(1, "envelope_dump_binary");
+}
+
+static void
+bench_envelope_load_binary(size_t n)
+{
+	struct envelope	ep;
+	size_t		i;
+
+	for (i = 0; i < n; i++)
+		if (!envelope_load_buffer(&ep, evpbin, evpbinlen))
+			errx(1, "envelope_load_buffer");
+}
+
+static void
+bench_mailaddr(size_t n)
+{
+	struct mailaddr	maddr;
+	size_t		i;
+
+	for (i = 0; i < n; i++)
+		if (!text_to_mailaddr(&maddr, "Some.User+tag@Sub.Example.COM"))
+			errx(1, "text_to_mailaddr");
+}
+
+/* an aliases table of BENCH_NKEYS entries, and a few domain patterns */
+static void
+bench_table_init(void)
+{
+	char	val[128];
+	size_t	i;
+
+	bench_keys_init();
+	if (table)
+		return;
+
+	env = xcalloc(1, sizeof *env);
+	env->sc_tables_dict = xcalloc(1, sizeof *env->sc_tables_dict);
+	dict_init(env->sc_tables_dict);
+
+	table = table_create(env, "static", "bench", NULL);
+	for (i = 0; i < BENCH_NKEYS; i++) {
+		(void)snprintf(val, sizeof val, "%s, archive@example.com",
+		    newkeys[i]);
+		table_add(table, keys[i], val);
+	}
+	for (i = 0; i < 20; i++) {
+		(void)snprintf(val, sizeof val, "*.example%zu.org", i);
+		table_add(table, val, "relay");
+	}
+	if (!table_open(table))
+		errx(1, "table_open");
+}
+
+static void
+bench_table_lookup(size_t n)
+{
+	union lookup	lk;
+	size_t		i;
+
+	for (i = 0; i < n; i++) {
+		if (table_lookup(table, K_ALIAS, keys[i % BENCH_NKEYS],
+		    &lk) != 1)
+			errx(1, "table_lookup");
+		expand_free(lk.expand);
+	}
+}
+
+/* a miss, which walks the patterns */
+static void
+bench_table_match_domain(size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		if (table_match(table, K_DOMAIN, "mail.example.com") != 0)
+			errx(1, "table_match");
+}
+
+/* one operation inserts a node in an expansion of BENCH_NEXPAND */
+static void
+bench_expand_insert(size_t n)
+{
+	struct expand		expand;
+	struct expandnode	xn;
+	size_t			i;
+
+	memset(&expand, 0, sizeof expand);
+	memset(&xn, 0, sizeof xn);
+	xn.type = EXPAND_ADDRESS;
+
+	for (i = 0; i < n; i++) {
+		if (i % BENCH_NEXPAND == 0)
+			expand_clear(&expand);
+		(void)snprintf(xn.u.mailaddr.user, sizeof xn.u.mailaddr.user,
+		    "user%zu", i % BENCH_NEXPAND);
+		(void)strlcpy(xn.u.mailaddr.domain, "example.com",
+		    sizeof xn.u.mailaddr.domain);
+		expand_insert(&expand, &xn);
+	}
+	expand_clear(&expand);
+}
+
+static int64_t
+elapsed(const struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((int64_t)(t1.tv_sec - t0->tv_sec) * 1000000000 +
+	    (t1.tv_nsec - t0->tv_nsec));
+}
+
+static void
+bench_run(struct bench *b, int64_t mintime)
+{
+	struct timespec	t0;
+	int64_t		ns;
+	size_t		n, allocs;
+
+	if (b->init)
+		b->init();
+
+	/* grow the run until it lasts long enough to be measured */
+	for (n = 1;; ) {
+		allocs = nallocs;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		b->run(n);
+		ns = elapsed(&t0);
+		allocs = nallocs - allocs;
+		if (ns >= mintime || n >= BENCH_MAXOPS)
+			break;
+		if (ns < mintime / 100)
+			n *= 100;
+		else
+			n = n * mintime / ns * 6 / 5 + 1;
+		if (n > BENCH_MAXOPS)
+			n = BENCH_MAXOPS;
+	}
+
+	printf("%-24s %12zu %12.1f ns/op %10.2f allocs/op\n", b->name, n,
+	    (double)ns / n, (double)allocs / n);
+	fflush(stdout);
+}
+
+static void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s [-l] [-t msec] [benchmark ...]\n",
+	    __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*errstr;
+	int64_t		 mintime = 500;
+	size_t		 i;
+	int		 ch, j, list = 0, found;
+
+	while ((ch = getopt(argc, argv, "lt:")) != -1) {
+		switch (ch) {
+		case 'l':
+			list = 1;
+			break;
+		case 't':
+			mintime = strtonum(optarg, 1, 3600 * 1000, &errstr);
+			if (errstr)
+				errx(1, "time is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (list) {
+		for (i = 0; i < nitems(benches); i++)
+			printf("%s\n", benches[i].name);
+		return (0);
+	}
+
+	log_init(1, LOG_MAIL);
+	log_setverbose(0);
+	event_init();
+
+	for (j = 0; j < argc; j++) {
+		for (i = 0, found = 0; i < nitems(benches); i++)
+			if (!strcmp(argv[j], benches[i].name))
+				found = 1;
+		if (!found)
+			errx(1, "unknown benchmark: %s", argv[j]);
+	}
+
+	for (i = 0; i < nitems(benches); i++) {
+		if (argc) {
+			for (j = 0; j < argc; j++)
+				if (!strcmp(argv[j], benches[i].name))
+					break;
+			if (j == argc)
+				continue;
+		}
+		bench_run(&benches[i], mintime * 1000000);
+	}
+
+	return (0);
+}
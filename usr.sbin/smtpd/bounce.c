@@ -35,8 +35,8 @@
 #include "smtpd.h"
 #include "log.h"
 
-#define BOUNCE_MAXRUN	2
 #define BOUNCE_HIWAT	65535
+#define BOUNCE_IDLE_TIMEOUT	10	/* seconds */
 
 enum {
 	BOUNCE_EHLO,
@@ -48,6 +48,7 @@ enum {
 	BOUNCE_DATA_END,
 	BOUNCE_QUIT,
 	BOUNCE_CLOSE,
+	BOUNCE_IDLE,
 };
 
 struct bounce_envelope {
@@ -71,6 +72,7 @@ struct bounce_message {
 };
 
 struct bounce_session {
+	TAILQ_ENTRY(bounce_session)	 entry;
 	char				*smtpname;
 	struct bounce_message		*msg;
 	FILE				*msgfp;
@@ -85,6 +87,12 @@ static int bounce_message_cmp(const struct bounce_message *,
 SPLAY_PROTOTYPE(bounce_message_tree, bounce_message, sp_entry,
     bounce_message_cmp);
 
+static void bounce_add_envelope(uint64_t);
+static void bounce_pending(struct bounce_message *);
+static int  bounce_rate(void);
+static struct bounce_message *bounce_ready(const char *, time_t);
+static void bounce_wakeup(void);
+static void bounce_timer(void);
 static void bounce_drain(void);
 static void bounce_send(struct bounce_session *, const char *, ...)
 	__attribute__((__format__ (printf, 2, 3)));
@@ -100,11 +108,14 @@ static const char *action_str(const struct delivery_bounce *);
 
 static struct tree			wait_fd;
 static struct bounce_message_tree	messages;
-static TAILQ_HEAD(, bounce_message)	pending;
+static TAILQ_HEAD(bounce_mq, bounce_message) pending;
+static TAILQ_HEAD(, bounce_session)	idle;
 
 static int				nmessage = 0;
 static int				running = 0;
 static struct event			ev_timer;
+static time_t				rate_time;
+static size_t				rate_count;
 
 static void
 bounce_init(void)
@@ -113,6 +124,7 @@ bounce_init(void)
 
 	if (init == 0) {
 		TAILQ_INIT(&pending);
+		TAILQ_INIT(&idle);
 		SPLAY_INIT(&messages);
 		tree_init(&wait_fd);
 		evtimer_set(&ev_timer, bounce_timeout, NULL);
@@ -120,20 +132,38 @@ bounce_init(void)
 	}
 }
 
+/*
+ * Envelopes injected together by the scheduler are coalesced before
+ * a single drain, so that a mass expiry turns into one report per
+ * message rather than one session per envelope.
+ */
 void
-bounce_add(uint64_t evpid)
+bounce_add(const uint64_t *evpids, size_t n)
+{
+	size_t	i;
+
+	bounce_init();
+
+	for (i = 0; i < n; i++)
+		bounce_add_envelope(evpids[i]);
+
+	bounce_drain();
+}
+
+static void
+bounce_add_envelope(uint64_t evpid)
 {
 	char			 buf[LINE_MAX], *line;
 	struct envelope		 evp;
 	struct bounce_message	 key, *msg;
 	struct bounce_envelope	*be;
-
-	bounce_init();
+	struct mproc		*p_sched;
 
 	if (queue_envelope_load(evpid, &evp) == 0) {
-		m_create(p_scheduler, IMSG_QUEUE_DELIVERY_PERMFAIL, 0, 0, -1);
-		m_add_evpid(p_scheduler, evpid);
-		m_close(p_scheduler);
+		p_sched = scheduler_peer(evpid_to_msgid(evpid));
+		m_create(p_sched, IMSG_QUEUE_DELIVERY_PERMFAIL, 0, 0, -1);
+		m_add_evpid(p_sched, evpid);
+		m_close(p_sched);
 		return;
 	}
 
@@ -175,8 +205,12 @@ bounce_add(uint64_t evpid)
 		log_debug("debug: bounce: new message %08" PRIx32,
 		    msg->msgid);
 		stat_increment("bounce.message", 1);
-	} else
-		TAILQ_REMOVE(&pending, msg, entry);
+
+		/* the window starts with the first report, it never slides */
+		msg->timeout = time(NULL) +
+		    env->sc_bounce_coalesce[msg->bounce.type];
+		bounce_pending(msg);
+	}
 
 	line = evp.errorline;
 	if (strlen(line) > 4 && (*line == '1' || *line == '6'))
@@ -195,11 +229,85 @@ bounce_add(uint64_t evpid)
 	TAILQ_INSERT_TAIL(&msg->envelopes, be, entry);
 	log_debug("debug: bounce: adding report %16"PRIx64": %s", be->id, be->report);
 
-	msg->timeout = time(NULL) + 1;
-	TAILQ_INSERT_TAIL(&pending, msg, entry);
-
 	stat_increment("bounce.envelope", 1);
-	bounce_drain();
+}
+
+/*
+ * Keep the pending list sorted by timeout.  New messages usually have
+ * the latest timeout, so look for their place from the tail.
+ */
+static void
+bounce_pending(struct bounce_message *msg)
+{
+	struct bounce_message	*m;
+
+	TAILQ_FOREACH_REVERSE(m, &pending, bounce_mq, entry)
+		if (m->timeout <= msg->timeout)
+			break;
+	if (m == NULL)
+		TAILQ_INSERT_HEAD(&pending, msg, entry);
+	else
+		TAILQ_INSERT_AFTER(&pending, m, msg, entry);
+}
+
+/*
+ * Return 1 if another bounce may be injected within the current second.
+ */
+static int
+bounce_rate(void)
+{
+	time_t	t;
+
+	if (env->sc_bounce_max_rate == 0)
+		return (1);
+
+	t = time(NULL);
+	if (t != rate_time) {
+		rate_time = t;
+		rate_count = 0;
+	}
+	return (rate_count < env->sc_bounce_max_rate);
+}
+
+/*
+ * Find the first pending message for the given smtpname that is due
+ * before the given time.
+ */
+static struct bounce_message *
+bounce_ready(const char *smtpname, time_t t)
+{
+	struct bounce_message	*msg;
+
+	TAILQ_FOREACH(msg, &pending, entry) {
+		if (msg->timeout > t)
+			break;
+		if (strcmp(msg->smtpname, smtpname) == 0)
+			return (msg);
+	}
+	return (NULL);
+}
+
+/*
+ * Resume the idle sessions that have a message ready.
+ */
+static void
+bounce_wakeup(void)
+{
+	struct bounce_session	*s, *ts;
+
+	TAILQ_FOREACH_SAFE(s, &idle, entry, ts) {
+		if (!bounce_rate())
+			return;
+		if (bounce_ready(s->smtpname, time(NULL)) == NULL)
+			continue;
+
+		log_debug("debug: bounce: %p: resuming session", s);
+		TAILQ_REMOVE(&idle, s, entry);
+		s->state = BOUNCE_MAIL;
+		io_set_timeout(s->io, 30000);
+		bounce_next(s);
+		io_set_write(s->io);
+	}
 }
 
 void
@@ -243,19 +351,59 @@ bounce_timeout(int fd, short ev, void *arg)
 	bounce_drain();
 }
 
+/*
+ * Arm the timer for the next pending message, or for the next second
+ * if the rate limit is reached.
+ */
 static void
-bounce_drain(void)
+bounce_timer(void)
 {
 	struct bounce_message	*msg;
 	struct timeval		 tv;
-	time_t			 t;
+
+	if ((msg = TAILQ_FIRST(&pending)) == NULL)
+		return;
+
+	tv.tv_sec = bounce_rate() ? msg->timeout - time(NULL) : 1;
+	tv.tv_usec = 0;
+	if (tv.tv_sec <= 0)
+		return;
+
+	log_debug("debug: bounce: setting timer");
+	evtimer_del(&ev_timer);
+	evtimer_add(&ev_timer, &tv);
+}
+
+static void
+bounce_drain(void)
+{
+	struct bounce_message	*msg;
+	struct bounce_session	*s;
 
 	log_debug("debug: bounce: drain: nmessage=%d running=%d",
 	    nmessage, running);
 
+	bounce_wakeup();
+	bounce_timer();
+
 	while (1) {
-		if (running >= BOUNCE_MAXRUN) {
+		if (running >= (int)env->sc_bounce_max_session) {
 			log_debug("debug: bounce: max session reached");
+			/*
+			 * Sessions left idle have nothing ready: close one
+			 * if the next message needs another smtpname.
+			 */
+			msg = TAILQ_FIRST(&pending);
+			s = TAILQ_FIRST(&idle);
+			if (msg && s && msg->timeout <= time(NULL) &&
+			    bounce_rate()) {
+				log_debug("debug: bounce: %p: closing idle "
+				    "session", s);
+				TAILQ_REMOVE(&idle, s, entry);
+				bounce_send(s, "QUIT");
+				s->state = BOUNCE_CLOSE;
+				io_set_write(s->io);
+			}
 			return;
 		}
 
@@ -274,15 +422,13 @@ bounce_drain(void)
 			return;
 		}
 
-		t = time(NULL);
-		if (msg->timeout > t) {
+		if (msg->timeout > time(NULL)) {
 			log_debug("debug: bounce: next message not ready yet");
-			if (!evtimer_pending(&ev_timer, NULL)) {
-				log_debug("debug: bounce: setting timer");
-				tv.tv_sec = msg->timeout - t;
-				tv.tv_usec = 0;
-				evtimer_add(&ev_timer, &tv);
-			}
+			return;
+		}
+
+		if (!bounce_rate()) {
+			log_debug("debug: bounce: rate limit reached");
 			return;
 		}
 
@@ -371,20 +517,16 @@ bounce_next_message(struct bounce_session *s)
 
     again:
 
-	now = time(NULL);
+	if (!bounce_rate())
+		return (0);
 
-	TAILQ_FOREACH(msg, &pending, entry) {
-		if (msg->timeout > now)
-			continue;
-		if (strcmp(msg->smtpname, s->smtpname))
-			continue;
-		break;
-	}
-	if (msg == NULL)
+	now = time(NULL);
+	if ((msg = bounce_ready(s->smtpname, now)) == NULL)
 		return (0);
 
 	TAILQ_REMOVE(&pending, msg, entry);
 	SPLAY_REMOVE(bounce_message_tree, &messages, msg);
+	rate_count += 1;
 
 	if ((fd = queue_message_fd_r(msg->msgid)) == -1) {
 		bounce_delivery(msg, IMSG_QUEUE_DELIVERY_TEMPFAIL,
@@ -422,6 +564,20 @@ bounce_next(struct bounce_session *s)
 	case BOUNCE_DATA_END:
 		log_debug("debug: bounce: %p: getting next message...", s);
 		if (bounce_next_message(s) == 0) {
+			/*
+			 * Keep the session open if more reports are due
+			 * shortly or held back by the rate limit.
+			 */
+			if (bounce_ready(s->smtpname,
+			    time(NULL) + BOUNCE_IDLE_TIMEOUT)) {
+				log_debug("debug: bounce: %p: idle", s);
+				s->state = BOUNCE_IDLE;
+				io_set_timeout(s->io,
+				    BOUNCE_IDLE_TIMEOUT * 1000);
+				TAILQ_INSERT_TAIL(&idle, s, entry);
+				bounce_timer();
+				break;
+			}
 			log_debug("debug: bounce: %p: no more messages", s);
 			bounce_send(s, "QUIT");
 			s->state = BOUNCE_CLOSE;
@@ -605,11 +761,13 @@ bounce_delivery(struct bounce_message *msg, int delivery, const char *status)
 {
 	struct bounce_envelope	*be;
 	struct envelope		 evp;
+	struct mproc		*p_sched;
 	size_t			 n;
 	const char		*f;
 
 	n = 0;
 	while ((be = TAILQ_FIRST(&msg->envelopes))) {
+		p_sched = scheduler_peer(evpid_to_msgid(be->id));
 		if (delivery == IMSG_QUEUE_DELIVERY_TEMPFAIL) {
 			if (queue_envelope_load(be->id, &evp) == 0) {
 				fatalx("could not reload envelope!");
@@ -617,14 +775,14 @@ bounce_delivery(struct bounce_message *msg, int delivery, const char *status)
 			evp.retry++;
 			evp.lasttry = msg->timeout;
 			envelope_set_errormsg(&evp, "%s", status);
-			queue_envelope_update(&evp);
-			m_create(p_scheduler, delivery, 0, 0, -1);
-			m_add_envelope(p_scheduler, &evp);
-			m_close(p_scheduler);
+			queue_envelope_retry(&evp);
+			m_create(p_sched, delivery, 0, 0, -1);
+			m_add_envelope(p_sched, &evp);
+			m_close(p_sched);
 		} else {
-			m_create(p_scheduler, delivery, 0, 0, -1);
-			m_add_evpid(p_scheduler, be->id);
-			m_close(p_scheduler);
+			m_create(p_sched, delivery, 0, 0, -1);
+			m_add_evpid(p_sched, be->id);
+			m_close(p_sched);
 			queue_envelope_delete(be->id);
 		}
 		TAILQ_REMOVE(&msg->envelopes, be, entry);
@@ -690,6 +848,8 @@ bounce_free(struct bounce_session *s)
 {
 	log_debug("debug: bounce: %p: deleting session", s);
 
+	if (s->state == BOUNCE_IDLE)
+		TAILQ_REMOVE(&idle, s, entry);
 	io_free(s->io);
 
 	free(s->smtpname);
@@ -739,7 +899,7 @@ bounce_io(struct io *io, int evt, void *arg)
 		if (cont)
 			goto nextline;
 
-		if (s->state == BOUNCE_CLOSE) {
+		if (s->state == BOUNCE_CLOSE || s->state == BOUNCE_IDLE) {
 			bounce_free(s);
 			return;
 		}
@@ -756,7 +916,9 @@ bounce_io(struct io *io, int evt, void *arg)
 			return;
 		}
 
-		io_set_write(io);
+		/* idle sessions keep reading until resumed or timed out */
+		if (s->state != BOUNCE_IDLE)
+			io_set_write(io);
 		break;
 
 	case IO_LOWAT:
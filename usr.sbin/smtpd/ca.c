@@ -29,6 +29,7 @@
 #include <imsg.h>
 #include <limits.h>
 
+#include <openssl/async.h>
 #include <openssl/err.h>
 #include <openssl/pem.h>
 #include <pwd.h>
@@ -48,8 +49,24 @@ static int	 rsae_priv_dec(int, const unsigned char *, unsigned char *,
 		    RSA *, int);
 static ECDSA_SIG *ecdsae_do_sign(const unsigned char *, int, const BIGNUM *,
     const BIGNUM *, EC_KEY *);
+static int	 ca_dkim_sign(EVP_PKEY *, const unsigned char *, size_t,
+		    unsigned char *, size_t *);
+static void	 ca_load_pki_key(struct pki *);
+static int	 ca_load_pki_mem(const char *, size_t, const char *, size_t);
+
+struct ca_req {
+	uint64_t	 id;
+	struct io	*io;
+	int		 done;
+	int		 orphan;
+	int		 ret;
+	void		*data;
+	size_t		 datalen;
+};
 
 static struct dict pkeys;
+static struct dict dkeys;
+static struct tree requests;
 static uint64_t	 reqid = 0;
 
 static void
@@ -63,6 +80,7 @@ int
 ca(void)
 {
 	struct passwd	*pw;
+	int		 i;
 
 	purge_config(PURGE_LISTENERS|PURGE_TABLES|PURGE_RULES|PURGE_DISPATCHERS);
 
@@ -92,9 +110,21 @@ ca(void)
 	config_peer(PROC_CONTROL);
 	config_peer(PROC_PARENT);
 	config_peer(PROC_DISPATCHER);
+	config_peer(PROC_TLS);
+	config_peer(PROC_MTA);
+	config_peer(PROC_SMTP);
+	config_peer(PROC_LOGGER);
+	stat_cpu_start(NULL);
+	memory_start(NULL, NULL);
 
 	/* Ignore them until we get our config */
 	mproc_disable(p_dispatcher);
+	for (i = 0; i < env->sc_tls_workers; i++)
+		mproc_disable(p_tls[i]);
+	for (i = 0; i < env->sc_mta_workers; i++)
+		mproc_disable(p_mta[i]);
+	for (i = 0; i < env->sc_smtp_workers; i++)
+		mproc_disable(p_smtp[i]);
 
 #if HAVE_PLEDGE
 	if (pledge("stdio", NULL) == -1)
@@ -113,34 +143,151 @@ ca_init(void)
 	BIO		*in = NULL;
 	EVP_PKEY	*pkey = NULL;
 	struct pki	*pki;
+	struct dkim	*dkim;
 	const char	*k;
 	void		*iter_dict;
-	char		*hash;
 
 	log_debug("debug: init private ssl-tree");
 	dict_init(&pkeys);
 	iter_dict = NULL;
 	while (dict_iter(env->sc_pki_dict, &iter_dict, &k, (void **)&pki)) {
-		if (pki->pki_key == NULL)
+		ca_load_pki_key(pki);
+		if (pki->pki_alt)
+			ca_load_pki_key(pki->pki_alt);
+	}
+
+	dict_init(&dkeys);
+	iter_dict = NULL;
+	while (dict_iter(env->sc_dkim_dict, &iter_dict, &k, (void **)&dkim)) {
+		if (dkim->dkim_key == NULL)
 			continue;
 
-		in = BIO_new_mem_buf(pki->pki_key, pki->pki_key_len);
+		in = BIO_new_mem_buf(dkim->dkim_key, dkim->dkim_key_len);
 		if (in == NULL)
-			fatalx("ca_init: key");
+			fatalx("ca_init: dkim key");
 		pkey = PEM_read_bio_PrivateKey(in, NULL, NULL, NULL);
 		if (pkey == NULL)
-			fatalx("ca_init: PEM");
+			fatalx("ca_init: dkim PEM");
 		BIO_free(in);
 
-		hash = ssl_pubkey_hash(pki->pki_cert, pki->pki_cert_len);
-		if (dict_check(&pkeys, hash))
-			EVP_PKEY_free(pkey);
-		else
-			dict_xset(&pkeys, hash, pkey);
-		free(hash);
+		dict_xset(&dkeys, k, pkey);
 	}
 }
 
+/*
+ * Keys are looked up by the hash of their certificate's public key, so
+ * an alternate keypair needs no more than its own entry.
+ */
+static void
+ca_load_pki_key(struct pki *pki)
+{
+	BIO		*in;
+	EVP_PKEY	*pkey;
+	char		*hash;
+
+	if (pki->pki_key == NULL)
+		return;
+
+	in = BIO_new_mem_buf(pki->pki_key, pki->pki_key_len);
+	if (in == NULL)
+		fatalx("ca_init: key");
+	pkey = PEM_read_bio_PrivateKey(in, NULL, NULL, NULL);
+	if (pkey == NULL)
+		fatalx("ca_init: PEM");
+	BIO_free(in);
+
+	hash = ssl_pubkey_hash(pki->pki_cert, pki->pki_cert_len);
+	if (dict_check(&pkeys, hash))
+		EVP_PKEY_free(pkey);
+	else
+		dict_xset(&pkeys, hash, pkey);
+	free(hash);
+}
+
+/*
+ * Take the key of a certificate found in a pki table of a listener,
+ * read by the parent when a client first asked for one of its names.
+ */
+static int
+ca_load_pki_mem(const char *cert, size_t certlen, const char *key,
+    size_t keylen)
+{
+	BIO		*in;
+	X509		*x509 = NULL;
+	EVP_PKEY	*pkey = NULL;
+	char		*hash = NULL;
+	int		 ret = 0;
+
+	if ((in = BIO_new_mem_buf(cert, certlen)) == NULL)
+		goto end;
+	x509 = PEM_read_bio_X509(in, NULL, NULL, NULL);
+	BIO_free(in);
+	if ((in = BIO_new_mem_buf(key, keylen)) == NULL)
+		goto end;
+	pkey = PEM_read_bio_PrivateKey(in, NULL, NULL, NULL);
+	BIO_free(in);
+
+	if (x509 == NULL || pkey == NULL) {
+		log_warnx("warn: ca: invalid certificate or key in pki table");
+		goto end;
+	}
+	if (!X509_check_private_key(x509, pkey)) {
+		log_warnx("warn: ca: key does not match certificate "
+		    "in pki table");
+		goto end;
+	}
+	if ((hash = ssl_pubkey_hash(cert, certlen)) == NULL)
+		goto end;
+
+	if (!dict_check(&pkeys, hash)) {
+		dict_xset(&pkeys, hash, pkey);
+		pkey = NULL;
+	}
+	ret = 1;
+
+    end:
+	X509_free(x509);
+	EVP_PKEY_free(pkey);
+	free(hash);
+	return (ret);
+}
+
+/*
+ * DKIM signs the SHA-256 hash of the canonicalized headers: RSA uses
+ * the usual PKCS#1 v1.5 encoding of it, Ed25519 signs the hash itself.
+ */
+static int
+ca_dkim_sign(EVP_PKEY *pkey, const unsigned char *md, size_t mdlen,
+    unsigned char *sig, size_t *siglen)
+{
+	EVP_PKEY_CTX	*ctx;
+	int		 ret = 0;
+
+#ifdef EVP_PKEY_ED25519
+	if (EVP_PKEY_id(pkey) == EVP_PKEY_ED25519) {
+		EVP_MD_CTX	*mdctx;
+
+		if ((mdctx = EVP_MD_CTX_new()) == NULL)
+			return 0;
+		if (EVP_DigestSignInit(mdctx, NULL, NULL, NULL, pkey) == 1 &&
+		    EVP_DigestSign(mdctx, sig, siglen, md, mdlen) == 1)
+			ret = 1;
+		EVP_MD_CTX_free(mdctx);
+		return ret;
+	}
+#endif
+
+	if ((ctx = EVP_PKEY_CTX_new(pkey, NULL)) == NULL)
+		return 0;
+	if (EVP_PKEY_sign_init(ctx) == 1 &&
+	    EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) == 1 &&
+	    EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) == 1 &&
+	    EVP_PKEY_sign(ctx, sig, siglen, md, mdlen) == 1)
+		ret = 1;
+	EVP_PKEY_CTX_free(ctx);
+	return ret;
+}
+
 int
 ca_X509_verify(void *certificate, void *chain, const char *CAfile,
     const char *CRLfile, const char **errstr)
@@ -190,11 +337,12 @@ ca_imsg(struct mproc *p, struct imsg *imsg)
 	EVP_PKEY		*pkey;
 	RSA			*rsa = NULL;
 	EC_KEY			*ecdsa = NULL;
-	const void		*from = NULL;
+	const void		*from = NULL, *cert = NULL, *key = NULL;
 	unsigned char		*to = NULL;
+	struct mproc		*p_session;
 	struct msg		 m;
 	const char		*hash;
-	size_t			 flen, tlen, padding;
+	size_t			 flen, tlen, padding, certlen, keylen;
 	int			 buf_len;
 	int			 ret = 0;
 	uint64_t		 id;
@@ -211,6 +359,9 @@ ca_imsg(struct mproc *p, struct imsg *imsg)
 
 		/* Start fulfilling requests */
 		mproc_enable(p_dispatcher);
+		config_peer(PROC_TLS);
+		config_peer(PROC_MTA);
+		config_peer(PROC_SMTP);
 		return;
 
 	case IMSG_CTL_VERBOSE:
@@ -227,6 +378,32 @@ ca_imsg(struct mproc *p, struct imsg *imsg)
 		profiling = v;
 		return;
 
+	case IMSG_CTL_SHOW_PROFILE:
+		profile_show(p, imsg->hdr.peerid);
+		return;
+
+	case IMSG_CA_LOAD_PKI:
+		m_msg(&m, imsg);
+		m_get_id(&m, &id);
+		m_get_int(&m, &ret);
+		if (ret) {
+			m_get_data(&m, &cert, &certlen);
+			m_get_data(&m, &key, &keylen);
+		}
+		m_end(&m);
+
+		if (ret)
+			ret = ca_load_pki_mem(cert, certlen, key, keylen);
+
+		p_session = smtp_peer(id);
+		m_create(p_session, IMSG_CA_LOAD_PKI, 0, 0, -1);
+		m_add_id(p_session, id);
+		m_add_int(p_session, ret);
+		if (ret)
+			m_add_data(p_session, cert, certlen);
+		m_close(p_session);
+		return;
+
 	case IMSG_CA_RSA_PRIVENC:
 	case IMSG_CA_RSA_PRIVDEC:
 		m_msg(&m, imsg);
@@ -291,93 +468,205 @@ ca_imsg(struct mproc *p, struct imsg *imsg)
 		free(to);
 		EC_KEY_free(ecdsa);
 		return;
+
+	case IMSG_CA_DKIM_SIGN:
+		m_msg(&m, imsg);
+		m_get_id(&m, &id);
+		m_get_string(&m, &hash);
+		m_get_data(&m, &from, &flen);
+		m_end(&m);
+
+		if ((pkey = dict_get(&dkeys, hash)) == NULL)
+			fatalx("ca_imsg: invalid dkim domain");
+
+		tlen = EVP_PKEY_size(pkey);
+		if ((to = calloc(1, tlen)) == NULL)
+			fatalx("ca_imsg: calloc");
+		if (!ca_dkim_sign(pkey, from, flen, to, &tlen)) {
+			ssl_error("ca_dkim_sign");
+			ret = 0;
+		} else
+			ret = 1;
+
+		m_create(p, imsg->hdr.type, 0, 0, -1);
+		m_add_id(p, id);
+		m_add_int(p, ret);
+		if (ret > 0)
+			m_add_data(p, to, tlen);
+		m_close(p);
+		free(to);
+		return;
 	}
 
 	fatalx("ca_imsg: unexpected %s imsg", imsg_to_str(imsg->hdr.type));
 }
 
 /*
- * RSA privsep engine (called from unprivileged processes)
+ * Requests to the CA process (called from unprivileged processes)
  */
 
-const RSA_METHOD *rsa_default = NULL;
+static struct ca_req *
+ca_req_new(void)
+{
+	struct ca_req	*req;
 
-static RSA_METHOD *rsae_method = NULL;
+	if ((req = calloc(1, sizeof(*req))) == NULL)
+		fatal("ca_req_new: calloc");
+	req->id = ++reqid;
+	tree_xset(&requests, req->id, req);
 
-static int
-rsae_send_imsg(int flen, const unsigned char *from, unsigned char *to,
-    RSA *rsa, int padding, unsigned int cmd)
+	return (req);
+}
+
+static void
+ca_req_free(struct ca_req *req)
 {
-	int		 ret = 0;
+	free(req->data);
+	free(req);
+}
+
+/*
+ * Called by OpenSSL when the TLS context owning a suspended request is
+ * freed before the handshake could be resumed.
+ */
+static void
+ca_req_cleanup(ASYNC_WAIT_CTX *ctx, const void *key, OSSL_ASYNC_FD fd,
+    void *arg)
+{
+	struct ca_req	*req = arg;
+
+	if (req->done)
+		ca_req_free(req);
+	else {
+		req->io = NULL;
+		req->orphan = 1;
+	}
+}
+
+/*
+ * Wait for the reply to the request being built on p_ca.  When called
+ * from a TLS handshake, the handshake is suspended so that the event
+ * loop keeps running, and resumed by ca_dispatch_result().  Otherwise,
+ * fall back to reading the CA channel synchronously.
+ */
+static void
+ca_req_wait(struct ca_req *req)
+{
+	ASYNC_JOB	*job;
+	ASYNC_WAIT_CTX	*waitctx;
 	struct imsgbuf	*ibuf;
 	struct imsg	 imsg;
-	int		 n, done = 0;
-	const void	*toptr;
-	char		*hash;
-	size_t		 tlen;
-	struct msg	 m;
-	uint64_t	 id;
-
-	if ((hash = RSA_get_ex_data(rsa, 0)) == NULL)
-		return (0);
+	ssize_t		 n;
+
+	if ((job = ASYNC_get_current_job()) != NULL &&
+	    (req->io = io_current()) != NULL) {
+		m_close(p_ca);
+
+		waitctx = ASYNC_get_wait_ctx(job);
+		if (!ASYNC_WAIT_CTX_set_wait_fd(waitctx, req, -1, req,
+		    ca_req_cleanup))
+			fatalx("ca_req_wait: ASYNC_WAIT_CTX_set_wait_fd");
+		while (!req->done)
+			if (!ASYNC_pause_job())
+				fatalx("ca_req_wait: ASYNC_pause_job");
+		ASYNC_WAIT_CTX_clear_fd(waitctx, req);
+		return;
+	}
 
-	/*
-	 * Send a synchronous imsg because we cannot defer the RSA
-	 * operation in OpenSSL's engine layer.
-	 */
-	m_create(p_ca, cmd, 0, 0, -1);
-	reqid++;
-	m_add_id(p_ca, reqid);
-	m_add_string(p_ca, hash);
-	m_add_data(p_ca, (const void *)from, (size_t)flen);
-	m_add_size(p_ca, (size_t)RSA_size(rsa));
-	m_add_size(p_ca, (size_t)padding);
 	m_flush(p_ca);
 
 	ibuf = &p_ca->imsgbuf;
 
-	while (!done) {
+	while (!req->done) {
 		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
 			fatalx("imsg_read");
 		if (n == 0)
 			fatalx("pipe closed");
 
-		while (!done) {
+		while (!req->done) {
 			if ((n = imsg_get(ibuf, &imsg)) == -1)
 				fatalx("imsg_get error");
 			if (n == 0)
 				break;
 
-			log_imsg(PROC_DISPATCHER, PROC_CA, &imsg);
-
-			switch (imsg.hdr.type) {
-			case IMSG_CA_RSA_PRIVENC:
-			case IMSG_CA_RSA_PRIVDEC:
-				break;
-			default:
-				/* Another imsg is queued up in the buffer */
-				dispatcher_imsg(p_ca, &imsg);
-				imsg_free(&imsg);
-				continue;
-			}
-
-			m_msg(&m, &imsg);
-			m_get_id(&m, &id);
-			if (id != reqid)
-				fatalx("invalid response id");
-			m_get_int(&m, &ret);
-			if (ret > 0)
-				m_get_data(&m, &toptr, &tlen);
-			m_end(&m);
-
-			if (ret > 0)
-				memcpy(to, toptr, tlen);
-			done = 1;
+			log_imsg(smtpd_process, PROC_CA, &imsg);
 
+			/* Another imsg may be queued up in the buffer */
+			imsg_callback(p_ca, &imsg);
 			imsg_free(&imsg);
 		}
 	}
 	mproc_event_add(p_ca);
+}
+
+void
+ca_dispatch_result(struct mproc *p, struct imsg *imsg)
+{
+	struct ca_req	*req;
+	struct msg	 m;
+	const void	*data;
+	size_t		 datalen;
+	uint64_t	 id;
+	int		 ret;
+
+	m_msg(&m, imsg);
+	m_get_id(&m, &id);
+	m_get_int(&m, &ret);
+	if (ret > 0)
+		m_get_data(&m, &data, &datalen);
+	m_end(&m);
+
+	if ((req = tree_pop(&requests, id)) == NULL)
+		fatalx("ca_dispatch_result: invalid response id");
+
+	/* The TLS session went away in the meantime. */
+	if (req->orphan) {
+		ca_req_free(req);
+		return;
+	}
+
+	req->done = 1;
+	req->ret = ret;
+	if (ret > 0) {
+		req->data = xmemdup(data, datalen);
+		req->datalen = datalen;
+	}
+
+	if (req->io)
+		io_wakeup(req->io);
+}
+
+/*
+ * RSA privsep engine (called from unprivileged processes)
+ */
+
+const RSA_METHOD *rsa_default = NULL;
+
+static RSA_METHOD *rsae_method = NULL;
+
+static int
+rsae_send_imsg(int flen, const unsigned char *from, unsigned char *to,
+    RSA *rsa, int padding, unsigned int cmd)
+{
+	struct ca_req	*req;
+	char		*hash;
+	int		 ret;
+
+	if ((hash = RSA_get_ex_data(rsa, 0)) == NULL)
+		return (0);
+
+	req = ca_req_new();
+	m_create(p_ca, cmd, 0, 0, -1);
+	m_add_id(p_ca, req->id);
+	m_add_string(p_ca, hash);
+	m_add_data(p_ca, (const void *)from, (size_t)flen);
+	m_add_size(p_ca, (size_t)RSA_size(rsa));
+	m_add_size(p_ca, (size_t)padding);
+	ca_req_wait(req);
+
+	if ((ret = req->ret) > 0)
+		memcpy(to, req->data, req->datalen);
+	ca_req_free(req);
 
 	return (ret);
 }
@@ -417,72 +706,26 @@ static ECDSA_SIG *
 ecdsae_send_enc_imsg(const unsigned char *dgst, int dgst_len,
     const BIGNUM *inv, const BIGNUM *rp, EC_KEY *eckey)
 {
-	int		 ret = 0;
-	struct imsgbuf	*ibuf;
-	struct imsg	 imsg;
-	int		 n, done = 0;
-	const void	*toptr;
+	struct ca_req	*req;
+	const unsigned char *p;
 	char		*hash;
-	size_t		 tlen;
-	struct msg	 m;
-	uint64_t	 id;
 	ECDSA_SIG	*sig = NULL;
 
 	if ((hash = EC_KEY_get_ex_data(eckey, 0)) == NULL)
 		return (0);
 
-	/*
-	 * Send a synchronous imsg because we cannot defer the ECDSA
-	 * operation in OpenSSL's engine layer.
-	 */
+	req = ca_req_new();
 	m_create(p_ca, IMSG_CA_ECDSA_SIGN, 0, 0, -1);
-	reqid++;
-	m_add_id(p_ca, reqid);
+	m_add_id(p_ca, req->id);
 	m_add_string(p_ca, hash);
 	m_add_data(p_ca, (const void *)dgst, (size_t)dgst_len);
-	m_flush(p_ca);
-
-	ibuf = &p_ca->imsgbuf;
-
-	while (!done) {
-		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
-			fatalx("imsg_read");
-		if (n == 0)
-			fatalx("pipe closed");
-		while (!done) {
-			if ((n = imsg_get(ibuf, &imsg)) == -1)
-				fatalx("imsg_get error");
-			if (n == 0)
-				break;
-
-			log_imsg(PROC_DISPATCHER, PROC_CA, &imsg);
+	ca_req_wait(req);
 
-			switch (imsg.hdr.type) {
-			case IMSG_CA_ECDSA_SIGN:
-				break;
-			default:
-				/* Another imsg is queued up in the buffer */
-				dispatcher_imsg(p_ca, &imsg);
-				imsg_free(&imsg);
-				continue;
-			}
-
-			m_msg(&m, &imsg);
-			m_get_id(&m, &id);
-			if (id != reqid)
-				fatalx("invalid response id");
-			m_get_int(&m, &ret);
-			if (ret > 0)
-				m_get_data(&m, &toptr, &tlen);
-			m_end(&m);
-			done = 1;
-
-			if (ret > 0)
-				d2i_ECDSA_SIG(&sig, (const unsigned char **)&toptr, tlen);
-			imsg_free(&imsg);
-		}
+	if (req->ret > 0) {
+		p = req->data;
+		d2i_ECDSA_SIG(&sig, &p, req->datalen);
 	}
-	mproc_event_add(p_ca);
+	ca_req_free(req);
 
 	return (sig);
 }
@@ -567,6 +810,8 @@ ecdsa_engine_init(void)
 void
 ca_engine_init(void)
 {
+	tree_init(&requests);
+
 	rsa_engine_init();
 	ecdsa_engine_init();
 }
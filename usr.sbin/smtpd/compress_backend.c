@@ -34,17 +34,100 @@
 
 #define	BUFFER_SIZE	16364
 
+#define	MAGIC_LEN	4
+
 extern struct compress_backend compress_gzip;
+#ifdef HAVE_ZSTD
+extern struct compress_backend compress_zstd;
+#endif
+#ifdef HAVE_LZ4
+extern struct compress_backend compress_lz4;
+#endif
+
+/* decompression follows the data, a stream starts after MAGIC_LEN bytes */
+struct compress_stream {
+	struct compress_backend	*backend;
+	void			*hdl;
+	FILE			*out;
+	unsigned char		 magic[MAGIC_LEN];
+	size_t			 len;
+	int			 error;
+};
+
+static int	uncompress_stream_start(struct compress_stream *);
 
 struct compress_backend *
 compress_backend_lookup(const char *name)
 {
 	if (!strcmp(name, "gzip"))
 		return &compress_gzip;
+#ifdef HAVE_ZSTD
+	if (!strcmp(name, "zstd"))
+		return &compress_zstd;
+#endif
+#ifdef HAVE_LZ4
+	if (!strcmp(name, "lz4"))
+		return &compress_lz4;
+#endif
 
 	return NULL;
 }
 
+/*
+ * Find the backend that produced a buffer from its magic number, so
+ * that what was queued before a change of algorithm remains readable
+ * and smtpctl does not need to know the configuration.
+ */
+struct compress_backend *
+compress_backend_detect(const void *buf, size_t len)
+{
+	const unsigned char	*p = buf;
+
+	if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+		return &compress_gzip;
+#ifdef HAVE_ZSTD
+	if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f &&
+	    p[3] == 0xfd)
+		return &compress_zstd;
+#endif
+#ifdef HAVE_LZ4
+	if (len >= 4 && p[0] == 0x04 && p[1] == 0x22 && p[2] == 0x4d &&
+	    p[3] == 0x18)
+		return &compress_lz4;
+#endif
+
+	return (env ? env->sc_comp : NULL);
+}
+
+int
+compress_dictionary(const char *path)
+{
+	if (env->sc_comp->load_dictionary == NULL)
+		return (0);
+	return (env->sc_comp->load_dictionary(path));
+}
+
+/*
+ * Read the next chunk for a framed backend.  The first chunk stops at
+ * the end of the headers so that they can be inflated on their own.
+ */
+size_t
+compress_read_chunk(FILE *in, char *buf, size_t len, int first)
+{
+	size_t	n = 0;
+	int	c;
+
+	if (!first)
+		return (fread(buf, 1, len, in));
+
+	while (n < len && (c = getc(in)) != EOF) {
+		buf[n++] = c;
+		if (c == '\n' && n >= 2 && buf[n - 2] == '\n')
+			break;
+	}
+	return (n);
+}
+
 size_t
 compress_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
 {
@@ -54,7 +137,11 @@ compress_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
 size_t
 uncompress_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
 {
-	return (env->sc_comp->uncompress_chunk(ib, ibsz, ob, obsz));
+	struct compress_backend	*backend;
+
+	if ((backend = compress_backend_detect(ib, ibsz)) == NULL)
+		return (0);
+	return (backend->uncompress_chunk(ib, ibsz, ob, obsz));
 }
 
 int
@@ -66,5 +153,92 @@ compress_file(FILE *ifile, FILE *ofile)
 int
 uncompress_file(FILE *ifile, FILE *ofile)
 {
-	return (env->sc_comp->uncompress_file(ifile, ofile));
+	struct compress_backend	*backend;
+	unsigned char		 magic[MAGIC_LEN];
+	size_t			 n;
+
+	n = fread(magic, 1, sizeof magic, ifile);
+	if (ferror(ifile) || fseek(ifile, -(long)n, SEEK_CUR) == -1)
+		return (0);
+	if ((backend = compress_backend_detect(magic, n)) == NULL)
+		return (0);
+	return (backend->uncompress_file(ifile, ofile));
+}
+
+int
+compress_file_cb(FILE *ifile, int (*cb)(void *, const void *, size_t),
+    void *arg)
+{
+	return (env->sc_comp->compress_file_cb(ifile, cb, arg));
+}
+
+void *
+uncompress_stream_begin(FILE *ofile)
+{
+	struct compress_stream	*cs;
+
+	if ((cs = calloc(1, sizeof *cs)) == NULL)
+		return (NULL);
+	cs->out = ofile;
+	return (cs);
+}
+
+static int
+uncompress_stream_start(struct compress_stream *cs)
+{
+	cs->backend = compress_backend_detect(cs->magic, cs->len);
+	if (cs->backend == NULL ||
+	    (cs->hdl = cs->backend->uncompress_stream_begin(cs->out)) == NULL)
+		return (0);
+	return (cs->backend->uncompress_stream_write(cs->hdl, cs->magic,
+	    cs->len));
+}
+
+int
+uncompress_stream_write(void *hdl, const void *buf, size_t len)
+{
+	struct compress_stream	*cs = hdl;
+	size_t			 n;
+
+	if (cs->error)
+		return (0);
+
+	if (cs->backend == NULL) {
+		n = MIN(len, sizeof cs->magic - cs->len);
+		memcpy(cs->magic + cs->len, buf, n);
+		cs->len += n;
+		buf = (const char *)buf + n;
+		len -= n;
+		if (cs->len < sizeof cs->magic)
+			return (1);
+		if (!uncompress_stream_start(cs)) {
+			cs->error = 1;
+			return (0);
+		}
+	}
+	if (len == 0)
+		return (1);
+
+	if (!cs->backend->uncompress_stream_write(cs->hdl, buf, len)) {
+		cs->error = 1;
+		return (0);
+	}
+	return (1);
+}
+
+int
+uncompress_stream_end(void *hdl)
+{
+	struct compress_stream	*cs = hdl;
+	int			 ret;
+
+	/* input shorter than a magic number */
+	if (cs->backend == NULL && !cs->error && !uncompress_stream_start(cs))
+		cs->error = 1;
+
+	ret = !cs->error;
+	if (cs->hdl && !cs->backend->uncompress_stream_end(cs->hdl))
+		ret = 0;
+	free(cs);
+	return (ret);
 }
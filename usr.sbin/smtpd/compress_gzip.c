@@ -31,6 +31,7 @@
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <zlib.h>
 
 #include "smtpd.h"
@@ -42,6 +43,17 @@ static size_t	compress_gzip_chunk(void *, size_t, void *, size_t);
 static size_t	uncompress_gzip_chunk(void *, size_t, void *, size_t);
 static int	compress_gzip_file(FILE *, FILE *);
 static int	uncompress_gzip_file(FILE *, FILE *);
+static int	compress_gzip_file_cb(FILE *,
+		    int (*)(void *, const void *, size_t), void *);
+static void    *uncompress_gzip_stream_begin(FILE *);
+static int	uncompress_gzip_stream_write(void *, const void *, size_t);
+static int	uncompress_gzip_stream_end(void *);
+
+struct gzip_stream {
+	z_stream	 strm;
+	FILE		*out;
+	int		 status;
+};
 
 
 struct compress_backend	compress_gzip = {
@@ -50,6 +62,12 @@ struct compress_backend	compress_gzip = {
 
 	compress_gzip_file,
 	uncompress_gzip_file,
+
+	compress_gzip_file_cb,
+
+	uncompress_gzip_stream_begin,
+	uncompress_gzip_stream_write,
+	uncompress_gzip_stream_end,
 };
 
 static size_t
@@ -119,61 +137,189 @@ end:
 }
 
 
+static int
+compress_gzip_write(void *arg, const void *buf, size_t len)
+{
+	return (fwrite(buf, len, 1, arg) == 1);
+}
+
+/*
+ * The files are processed through their stdio streams: gzdopen() would
+ * take over the descriptors, close them behind the callers' back and
+ * miss what the streams have already buffered.
+ */
 static int
 compress_gzip_file(FILE *in, FILE *out)
 {
-	gzFile  gzf;
-	char  ibuf[GZIP_BUFFER_SIZE];
-	int  r;
-	int  ret = 0;
+	if (in == NULL || out == NULL)
+		return (0);
+
+	return (compress_gzip_file_cb(in, compress_gzip_write, out));
+}
+
+
+static int
+uncompress_gzip_file(FILE *in, FILE *out)
+{
+	void	*hdl;
+	char	 ibuf[GZIP_BUFFER_SIZE];
+	size_t	 r;
+	int	 ret = 1;
 
 	if (in == NULL || out == NULL)
 		return (0);
 
-	gzf = gzdopen(fileno(out), "wb");
-	if (gzf == NULL)
+	if ((hdl = uncompress_gzip_stream_begin(out)) == NULL)
 		return (0);
 
-	while ((r = fread(ibuf, 1, GZIP_BUFFER_SIZE, in)) != 0) {
-		if (gzwrite(gzf, ibuf, r) != r)
-			goto end;
+	while ((r = fread(ibuf, 1, sizeof ibuf, in)) != 0) {
+		if (!uncompress_gzip_stream_write(hdl, ibuf, r)) {
+			ret = 0;
+			break;
+		}
 	}
-	if (!feof(in))
-		goto end;
+	if (ferror(in))
+		ret = 0;
+
+	if (!uncompress_gzip_stream_end(hdl))
+		ret = 0;
+	return (ret);
+}
+
+
+/*
+ * Same output as compress_gzip_file() but handed to a callback chunk by
+ * chunk, so that it can be fed to another stage without an intermediate
+ * file.
+ */
+static int
+compress_gzip_file_cb(FILE *in, int (*cb)(void *, const void *, size_t),
+    void *arg)
+{
+	z_stream	strm;
+	char		ibuf[GZIP_BUFFER_SIZE];
+	char		obuf[GZIP_BUFFER_SIZE];
+	size_t		r;
+	int		flush, zr = Z_OK;
+	int		ret = 0;
+
+	if (in == NULL)
+		return (0);
 
-	ret = 1;
+	memset(&strm, 0, sizeof strm);
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		(15+16), 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return (0);
+
+	do {
+		r = fread(ibuf, 1, sizeof ibuf, in);
+		if (r == 0 && ferror(in))
+			goto end;
+		flush = feof(in) ? Z_FINISH : Z_NO_FLUSH;
+
+		strm.avail_in = r;
+		strm.next_in = (unsigned char *)ibuf;
+		do {
+			strm.avail_out = sizeof obuf;
+			strm.next_out = (unsigned char *)obuf;
+			zr = deflate(&strm, flush);
+			if (zr == Z_STREAM_ERROR)
+				goto end;
+			r = sizeof obuf - strm.avail_out;
+			if (r && !cb(arg, obuf, r))
+				goto end;
+		} while (strm.avail_out == 0);
+	} while (flush != Z_FINISH);
+
+	if (zr == Z_STREAM_END)
+		ret = 1;
 
 end:
-	gzclose(gzf);
+	deflateEnd(&strm);
 	return (ret);
 }
 
+/*
+ * Incremental counterpart of uncompress_gzip_file(): compressed data is
+ * pushed in as it becomes available and inflated to the output file.
+ */
+static void *
+uncompress_gzip_stream_begin(FILE *out)
+{
+	struct gzip_stream	*gs;
+
+	if (out == NULL)
+		return (NULL);
+
+	if ((gs = calloc(1, sizeof *gs)) == NULL)
+		return (NULL);
+
+	gs->strm.zalloc = Z_NULL;
+	gs->strm.zfree = Z_NULL;
+	gs->strm.opaque = Z_NULL;
+	gs->strm.avail_in = 0;
+	gs->strm.next_in = Z_NULL;
+	if (inflateInit2(&gs->strm, (15+16)) != Z_OK) {
+		free(gs);
+		return (NULL);
+	}
+	gs->out = out;
+	gs->status = Z_OK;
+
+	return (gs);
+}
 
 static int
-uncompress_gzip_file(FILE *in, FILE *out)
+uncompress_gzip_stream_write(void *hdl, const void *buf, size_t len)
 {
-	gzFile  gzf;
-	char  obuf[GZIP_BUFFER_SIZE];
-	int  r;
-	int  ret = 0;
+	struct gzip_stream	*gs = hdl;
+	char			 obuf[GZIP_BUFFER_SIZE];
+	size_t			 n;
+	int			 r;
 
-	if (in == NULL || out == NULL)
+	/* anything past the end of the gzip stream is an error */
+	if (gs->status != Z_OK)
 		return (0);
 
-	gzf = gzdopen(fileno(in), "r");
-	if (gzf == NULL)
+	gs->strm.avail_in = len;
+	gs->strm.next_in = (unsigned char *)buf;
+	do {
+		gs->strm.avail_out = sizeof obuf;
+		gs->strm.next_out = (unsigned char *)obuf;
+		r = inflate(&gs->strm, Z_NO_FLUSH);
+		if (r == Z_BUF_ERROR)
+			break;
+		if (r != Z_OK && r != Z_STREAM_END) {
+			gs->status = r;
+			return (0);
+		}
+		gs->status = r;
+		n = sizeof obuf - gs->strm.avail_out;
+		if (n && fwrite(obuf, n, 1, gs->out) != 1) {
+			gs->status = Z_ERRNO;
+			return (0);
+		}
+	} while (gs->status == Z_OK &&
+	    (gs->strm.avail_in || gs->strm.avail_out == 0));
+
+	if (gs->status == Z_STREAM_END && gs->strm.avail_in)
 		return (0);
 
-	while ((r = gzread(gzf, obuf, sizeof(obuf))) > 0) {
-		if  (fwrite(obuf, r, 1, out) != 1)
-			goto end;
-	}
-	if (!gzeof(gzf))
-		goto end;
+	return (1);
+}
+
+static int
+uncompress_gzip_stream_end(void *hdl)
+{
+	struct gzip_stream	*gs = hdl;
+	int			 ret;
 
-	ret = 1;
+	ret = (gs->status == Z_STREAM_END);
 
-end:
-	gzclose(gzf);
+	inflateEnd(&gs->strm);
+	free(gs);
 	return (ret);
 }
@@ -0,0 +1,255 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <imsg.h>
+#include <lz4frame.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smtpd.h"
+
+/*
+ * Same layout as compress_zstd.c: one independent frame per chunk read
+ * by compress_read_chunk(), the first one holding the headers only.
+ */
+#define	LZ4_CHUNK_SIZE		(64 * 1024)
+
+static size_t	compress_lz4_chunk(void *, size_t, void *, size_t);
+static size_t	uncompress_lz4_chunk(void *, size_t, void *, size_t);
+static int	compress_lz4_file(FILE *, FILE *);
+static int	uncompress_lz4_file(FILE *, FILE *);
+static int	compress_lz4_file_cb(FILE *,
+		    int (*)(void *, const void *, size_t), void *);
+static void    *uncompress_lz4_stream_begin(FILE *);
+static int	uncompress_lz4_stream_write(void *, const void *, size_t);
+static int	uncompress_lz4_stream_end(void *);
+
+static int	lz4_fwrite(void *, const void *, size_t);
+
+struct lz4_stream {
+	LZ4F_dctx	*dctx;
+	FILE		*out;
+	size_t		 status;
+	int		 error;
+};
+
+static const LZ4F_preferences_t	lz4_prefs = {
+	.frameInfo = {
+		.blockSizeID = LZ4F_max64KB,
+		.blockMode = LZ4F_blockIndependent,
+		.contentChecksumFlag = LZ4F_contentChecksumEnabled,
+	},
+};
+
+struct compress_backend	compress_lz4 = {
+	compress_lz4_chunk,
+	uncompress_lz4_chunk,
+
+	compress_lz4_file,
+	uncompress_lz4_file,
+
+	compress_lz4_file_cb,
+
+	uncompress_lz4_stream_begin,
+	uncompress_lz4_stream_write,
+	uncompress_lz4_stream_end,
+
+	NULL,
+};
+
+static size_t
+compress_lz4_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
+{
+	size_t	r;
+
+	if (LZ4F_compressFrameBound(ibsz, &lz4_prefs) > obsz)
+		return (0);
+	r = LZ4F_compressFrame(ob, obsz, ib, ibsz, &lz4_prefs);
+
+	return (LZ4F_isError(r) ? 0 : r);
+}
+
+static size_t
+uncompress_lz4_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
+{
+	LZ4F_dctx	*dctx;
+	size_t		 ilen = ibsz, olen = obsz, r;
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+		return (0);
+	r = LZ4F_decompress(dctx, ob, &olen, ib, &ilen, NULL);
+	LZ4F_freeDecompressionContext(dctx);
+
+	/* the whole frame must have fit */
+	if (LZ4F_isError(r) || r != 0 || ilen != ibsz)
+		return (0);
+	return (olen);
+}
+
+static int
+lz4_fwrite(void *arg, const void *buf, size_t len)
+{
+	return (fwrite(buf, len, 1, arg) == 1);
+}
+
+static int
+compress_lz4_file(FILE *in, FILE *out)
+{
+	if (out == NULL)
+		return (0);
+
+	return (compress_lz4_file_cb(in, lz4_fwrite, out));
+}
+
+static int
+uncompress_lz4_file(FILE *in, FILE *out)
+{
+	char	 ibuf[LZ4_CHUNK_SIZE];
+	void	*hdl;
+	size_t	 r;
+	int	 ret = 1;
+
+	if (in == NULL || out == NULL)
+		return (0);
+
+	if ((hdl = uncompress_lz4_stream_begin(out)) == NULL)
+		return (0);
+	while ((r = fread(ibuf, 1, sizeof ibuf, in)) != 0)
+		if (!uncompress_lz4_stream_write(hdl, ibuf, r)) {
+			ret = 0;
+			break;
+		}
+	if (ferror(in))
+		ret = 0;
+	if (!uncompress_lz4_stream_end(hdl))
+		ret = 0;
+
+	return (ret);
+}
+
+static int
+compress_lz4_file_cb(FILE *in, int (*cb)(void *, const void *, size_t),
+    void *arg)
+{
+	char	 ibuf[LZ4_CHUNK_SIZE];
+	char	*obuf;
+	size_t	 obsz, n, r;
+	int	 first = 1, ret = 0;
+
+	if (in == NULL)
+		return (0);
+
+	obsz = LZ4F_compressFrameBound(sizeof ibuf, &lz4_prefs);
+	obuf = xmalloc(obsz);
+
+	/* even an empty file gets a frame */
+	do {
+		n = compress_read_chunk(in, ibuf, sizeof ibuf, first);
+		if (ferror(in))
+			goto end;
+		if (n == 0 && !first)
+			break;
+		first = 0;
+
+		r = LZ4F_compressFrame(obuf, obsz, ibuf, n, &lz4_prefs);
+		if (LZ4F_isError(r))
+			goto end;
+		if (!cb(arg, obuf, r))
+			goto end;
+	} while (!feof(in));
+
+	ret = 1;
+
+end:
+	free(obuf);
+	return (ret);
+}
+
+static void *
+uncompress_lz4_stream_begin(FILE *out)
+{
+	struct lz4_stream	*ls;
+
+	if (out == NULL)
+		return (NULL);
+
+	if ((ls = calloc(1, sizeof *ls)) == NULL)
+		return (NULL);
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&ls->dctx,
+	    LZ4F_VERSION))) {
+		free(ls);
+		return (NULL);
+	}
+	ls->out = out;
+	/* nothing seen yet, which is not a complete frame */
+	ls->status = 1;
+
+	return (ls);
+}
+
+static int
+uncompress_lz4_stream_write(void *hdl, const void *buf, size_t len)
+{
+	struct lz4_stream	*ls = hdl;
+	char			 obuf[LZ4_CHUNK_SIZE];
+	const char		*p = buf;
+	size_t			 ilen, olen;
+
+	if (ls->error)
+		return (0);
+	if (len == 0)
+		return (1);
+
+	/* a status of 0 ends a frame, the context then expects a new one */
+	do {
+		ilen = len;
+		olen = sizeof obuf;
+		ls->status = LZ4F_decompress(ls->dctx, obuf, &olen, p, &ilen,
+		    NULL);
+		if (LZ4F_isError(ls->status) ||
+		    (olen && fwrite(obuf, olen, 1, ls->out) != 1)) {
+			ls->error = 1;
+			return (0);
+		}
+		p += ilen;
+		len -= ilen;
+	} while (len || (olen == sizeof obuf && ls->status));
+
+	return (1);
+}
+
+static int
+uncompress_lz4_stream_end(void *hdl)
+{
+	struct lz4_stream	*ls = hdl;
+	int			 ret;
+
+	/* the input must end on a frame boundary */
+	ret = !ls->error && ls->status == 0;
+
+	LZ4F_freeDecompressionContext(ls->dctx);
+	free(ls);
+	return (ret);
+}
@@ -0,0 +1,317 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <imsg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zstd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+/*
+ * Files are a sequence of independent zstd frames, one per chunk read
+ * by compress_read_chunk(): the first one holds the headers only.
+ */
+#define	ZSTD_CHUNK_SIZE		(64 * 1024)
+#define	ZSTD_LEVEL		3
+
+static size_t	compress_zstd_chunk(void *, size_t, void *, size_t);
+static size_t	uncompress_zstd_chunk(void *, size_t, void *, size_t);
+static int	compress_zstd_file(FILE *, FILE *);
+static int	uncompress_zstd_file(FILE *, FILE *);
+static int	compress_zstd_file_cb(FILE *,
+		    int (*)(void *, const void *, size_t), void *);
+static void    *uncompress_zstd_stream_begin(FILE *);
+static int	uncompress_zstd_stream_write(void *, const void *, size_t);
+static int	uncompress_zstd_stream_end(void *);
+static int	compress_zstd_dictionary(const char *);
+
+static int	zstd_fwrite(void *, const void *, size_t);
+
+struct zstd_stream {
+	ZSTD_DCtx	*dctx;
+	FILE		*out;
+	size_t		 status;
+	int		 error;
+};
+
+static ZSTD_CDict	*cdict;
+static ZSTD_DDict	*ddict;
+
+struct compress_backend	compress_zstd = {
+	compress_zstd_chunk,
+	uncompress_zstd_chunk,
+
+	compress_zstd_file,
+	uncompress_zstd_file,
+
+	compress_zstd_file_cb,
+
+	uncompress_zstd_stream_begin,
+	uncompress_zstd_stream_write,
+	uncompress_zstd_stream_end,
+
+	compress_zstd_dictionary,
+};
+
+static size_t
+compress_zstd_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
+{
+	ZSTD_CCtx	*cctx;
+	size_t		 r;
+
+	if ((cctx = ZSTD_createCCtx()) == NULL)
+		return (0);
+	if (cdict)
+		r = ZSTD_compress_usingCDict(cctx, ob, obsz, ib, ibsz, cdict);
+	else
+		r = ZSTD_compressCCtx(cctx, ob, obsz, ib, ibsz, ZSTD_LEVEL);
+	ZSTD_freeCCtx(cctx);
+
+	return (ZSTD_isError(r) ? 0 : r);
+}
+
+static size_t
+uncompress_zstd_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
+{
+	ZSTD_DCtx	*dctx;
+	size_t		 r;
+
+	if ((dctx = ZSTD_createDCtx()) == NULL)
+		return (0);
+	if (ddict)
+		r = ZSTD_decompress_usingDDict(dctx, ob, obsz, ib, ibsz,
+		    ddict);
+	else
+		r = ZSTD_decompressDCtx(dctx, ob, obsz, ib, ibsz);
+	ZSTD_freeDCtx(dctx);
+
+	return (ZSTD_isError(r) ? 0 : r);
+}
+
+static int
+zstd_fwrite(void *arg, const void *buf, size_t len)
+{
+	return (fwrite(buf, len, 1, arg) == 1);
+}
+
+static int
+compress_zstd_file(FILE *in, FILE *out)
+{
+	if (out == NULL)
+		return (0);
+
+	return (compress_zstd_file_cb(in, zstd_fwrite, out));
+}
+
+static int
+uncompress_zstd_file(FILE *in, FILE *out)
+{
+	char	 ibuf[ZSTD_CHUNK_SIZE];
+	void	*hdl;
+	size_t	 r;
+	int	 ret = 1;
+
+	if (in == NULL || out == NULL)
+		return (0);
+
+	if ((hdl = uncompress_zstd_stream_begin(out)) == NULL)
+		return (0);
+	while ((r = fread(ibuf, 1, sizeof ibuf, in)) != 0)
+		if (!uncompress_zstd_stream_write(hdl, ibuf, r)) {
+			ret = 0;
+			break;
+		}
+	if (ferror(in))
+		ret = 0;
+	if (!uncompress_zstd_stream_end(hdl))
+		ret = 0;
+
+	return (ret);
+}
+
+static int
+compress_zstd_file_cb(FILE *in, int (*cb)(void *, const void *, size_t),
+    void *arg)
+{
+	ZSTD_CCtx	*cctx;
+	char		 ibuf[ZSTD_CHUNK_SIZE];
+	char		 obuf[ZSTD_COMPRESSBOUND(ZSTD_CHUNK_SIZE)];
+	size_t		 n, r;
+	int		 first = 1, ret = 0;
+
+	if (in == NULL)
+		return (0);
+
+	if ((cctx = ZSTD_createCCtx()) == NULL)
+		return (0);
+
+	/* even an empty file gets a frame */
+	do {
+		n = compress_read_chunk(in, ibuf, sizeof ibuf, first);
+		if (ferror(in))
+			goto end;
+		if (n == 0 && !first)
+			break;
+		first = 0;
+
+		if (cdict)
+			r = ZSTD_compress_usingCDict(cctx, obuf, sizeof obuf,
+			    ibuf, n, cdict);
+		else
+			r = ZSTD_compressCCtx(cctx, obuf, sizeof obuf,
+			    ibuf, n, ZSTD_LEVEL);
+		if (ZSTD_isError(r))
+			goto end;
+		if (!cb(arg, obuf, r))
+			goto end;
+	} while (!feof(in));
+
+	ret = 1;
+
+end:
+	ZSTD_freeCCtx(cctx);
+	return (ret);
+}
+
+static void *
+uncompress_zstd_stream_begin(FILE *out)
+{
+	struct zstd_stream	*zs;
+
+	if (out == NULL)
+		return (NULL);
+
+	if ((zs = calloc(1, sizeof *zs)) == NULL)
+		return (NULL);
+	if ((zs->dctx = ZSTD_createDCtx()) == NULL) {
+		free(zs);
+		return (NULL);
+	}
+	if (ddict && ZSTD_isError(ZSTD_DCtx_refDDict(zs->dctx, ddict))) {
+		ZSTD_freeDCtx(zs->dctx);
+		free(zs);
+		return (NULL);
+	}
+	zs->out = out;
+	/* nothing seen yet, which is not a complete frame */
+	zs->status = 1;
+
+	return (zs);
+}
+
+static int
+uncompress_zstd_stream_write(void *hdl, const void *buf, size_t len)
+{
+	struct zstd_stream	*zs = hdl;
+	char			 obuf[ZSTD_CHUNK_SIZE];
+	ZSTD_inBuffer		 in;
+	ZSTD_outBuffer		 out;
+
+	if (zs->error)
+		return (0);
+	if (len == 0)
+		return (1);
+
+	in.src = buf;
+	in.size = len;
+	in.pos = 0;
+
+	/* a full output buffer may leave data buffered in the context */
+	do {
+		out.dst = obuf;
+		out.size = sizeof obuf;
+		out.pos = 0;
+		zs->status = ZSTD_decompressStream(zs->dctx, &out, &in);
+		if (ZSTD_isError(zs->status) ||
+		    (out.pos && fwrite(obuf, out.pos, 1, zs->out) != 1)) {
+			zs->error = 1;
+			return (0);
+		}
+	} while (in.pos < in.size || (out.pos == out.size && zs->status));
+
+	return (1);
+}
+
+static int
+uncompress_zstd_stream_end(void *hdl)
+{
+	struct zstd_stream	*zs = hdl;
+	int			 ret;
+
+	/* the input must end on a frame boundary */
+	ret = !zs->error && zs->status == 0;
+
+	ZSTD_freeDCtx(zs->dctx);
+	free(zs);
+	return (ret);
+}
+
+/*
+ * A dictionary trained on mail headers, for example with
+ * "zstd --train", helps most with envelopes and the header frame which
+ * are too small for zstd to learn much from.
+ */
+static int
+compress_zstd_dictionary(const char *path)
+{
+	FILE		*fp;
+	struct stat	 sb;
+	void		*buf;
+	int		 ret = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		log_warn("warn: compress-zstd: %s", path);
+		return (0);
+	}
+	if (fstat(fileno(fp), &sb) == -1 || sb.st_size == 0) {
+		log_warnx("warn: compress-zstd: %s: empty dictionary", path);
+		fclose(fp);
+		return (0);
+	}
+	buf = xmalloc(sb.st_size);
+	if (fread(buf, sb.st_size, 1, fp) != 1) {
+		log_warn("warn: compress-zstd: %s", path);
+		goto end;
+	}
+
+	cdict = ZSTD_createCDict(buf, sb.st_size, ZSTD_LEVEL);
+	ddict = ZSTD_createDDict(buf, sb.st_size);
+	if (cdict == NULL || ddict == NULL) {
+		log_warnx("warn: compress-zstd: %s: invalid dictionary", path);
+		ZSTD_freeCDict(cdict);
+		ZSTD_freeDDict(ddict);
+		cdict = NULL;
+		ddict = NULL;
+		goto end;
+	}
+	ret = 1;
+
+end:
+	free(buf);
+	fclose(fp);
+	return (ret);
+}
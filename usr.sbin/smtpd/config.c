@@ -24,6 +24,10 @@
 #include <sys/socket.h>
 #include <sys/resource.h>
 
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
 #include <ifaddrs.h>
 #include <stdlib.h>
 #include <string.h>
@@ -56,24 +60,39 @@ config_default(void)
 	conf->sc_subaddressing_delim = SUBADDRESSING_DELIMITER;
 	conf->sc_ttl = SMTPD_QUEUE_EXPIRY;
 	conf->sc_srs_ttl = SMTPD_QUEUE_EXPIRY / 86400;
+	conf->sc_queue_evpcache_size = 1024;
+	conf->sc_queue_offline_max = 5;
+	conf->sc_queue_shards = 1;
 
 	conf->sc_mta_max_deferred = 100;
 	conf->sc_scheduler_max_inflight = 5000;
-	conf->sc_scheduler_max_schedule = 10;
+	conf->sc_scheduler_max_schedule = 100;
+	conf->sc_scheduler_shards = 1;
+	conf->sc_dlog_rotate = 3600;
 	conf->sc_scheduler_max_evp_batch_size = 256;
 	conf->sc_scheduler_max_msg_batch_size = 1024;
 
 	conf->sc_session_max_rcpt = 1000;
 	conf->sc_session_max_mails = 100;
+	conf->sc_filter_hiwat = 1024 * 1024;
+	conf->sc_filter_lowat = 256 * 1024;
+	conf->sc_conn_net4_prefix = 24;
+	conf->sc_conn_net6_prefix = 64;
 
 	conf->sc_mda_max_session = 50;
 	conf->sc_mda_max_user_session = 7;
+	conf->sc_mda_max_dest_session = 3;
 	conf->sc_mda_task_hiwat = 50;
 	conf->sc_mda_task_lowat = 30;
 	conf->sc_mda_task_release = 10;
 
 	/* Report mails delayed for more than 4 hours */
 	conf->sc_bounce_warn[0] = 3600 * 4;
+	conf->sc_bounce_coalesce[B_FAILED] = 1;
+	conf->sc_bounce_coalesce[B_DELAYED] = 1;
+	conf->sc_bounce_coalesce[B_DELIVERED] = 1;
+	conf->sc_bounce_max_session = 2;
+	conf->sc_bounce_max_rate = 0;
 
 	conf->sc_tables_dict = calloc(1, sizeof(*conf->sc_tables_dict));
 	conf->sc_rules = calloc(1, sizeof(*conf->sc_rules));
@@ -82,11 +101,13 @@ config_default(void)
 	conf->sc_ca_dict = calloc(1, sizeof(*conf->sc_ca_dict));
 	conf->sc_pki_dict = calloc(1, sizeof(*conf->sc_pki_dict));
 	conf->sc_ssl_dict = calloc(1, sizeof(*conf->sc_ssl_dict));
+	conf->sc_dkim_dict = calloc(1, sizeof(*conf->sc_dkim_dict));
 	conf->sc_limits_dict = calloc(1, sizeof(*conf->sc_limits_dict));
 	conf->sc_mda_wrappers = calloc(1, sizeof(*conf->sc_mda_wrappers));
 	conf->sc_filter_processes_dict = calloc(1, sizeof(*conf->sc_filter_processes_dict));
 	conf->sc_dispatcher_bounce = calloc(1, sizeof(*conf->sc_dispatcher_bounce));
 	conf->sc_filters_dict = calloc(1, sizeof(*conf->sc_filters_dict));
+	conf->sc_cpu_affinity = calloc(1, sizeof(*conf->sc_cpu_affinity));
 	limits = calloc(1, sizeof(*limits));
 
 	if (conf->sc_tables_dict == NULL	||
@@ -96,22 +117,26 @@ config_default(void)
 	    conf->sc_ca_dict == NULL		||
 	    conf->sc_pki_dict == NULL		||
 	    conf->sc_ssl_dict == NULL		||
+	    conf->sc_dkim_dict == NULL		||
 	    conf->sc_limits_dict == NULL        ||
 	    conf->sc_mda_wrappers == NULL	||
 	    conf->sc_filter_processes_dict == NULL	||
 	    conf->sc_dispatcher_bounce == NULL	||
 	    conf->sc_filters_dict == NULL	||
+	    conf->sc_cpu_affinity == NULL	||
 	    limits == NULL)
 		goto error;
 
-	dict_init(conf->sc_dispatchers);
+	hdict_init(conf->sc_dispatchers);
 	dict_init(conf->sc_mda_wrappers);
 	dict_init(conf->sc_ca_dict);
 	dict_init(conf->sc_pki_dict);
 	dict_init(conf->sc_ssl_dict);
+	dict_init(conf->sc_dkim_dict);
 	dict_init(conf->sc_tables_dict);
 	dict_init(conf->sc_limits_dict);
 	dict_init(conf->sc_filter_processes_dict);
+	dict_init(conf->sc_cpu_affinity);
 
 	limit_mta_set_defaults(limits);
 
@@ -148,6 +173,7 @@ error:
 	free(conf->sc_ca_dict);
 	free(conf->sc_pki_dict);
 	free(conf->sc_ssl_dict);
+	free(conf->sc_dkim_dict);
 	free(conf->sc_limits_dict);
 	free(conf->sc_mda_wrappers);
 	free(conf->sc_filter_processes_dict);
@@ -242,6 +268,7 @@ purge_config(uint8_t what)
 	struct table	*t;
 	struct rule	*r;
 	struct pki	*p;
+	struct dkim	*dk;
 	const char	*k;
 	void		*iter_dict;
 
@@ -271,7 +298,7 @@ purge_config(uint8_t what)
 		env->sc_rules = NULL;
 	}
 	if (what & PURGE_DISPATCHERS) {
-		while (dict_poproot(env->sc_dispatchers, (void **)&d)) {
+		while (hdict_poproot(env->sc_dispatchers, (void **)&d)) {
 			free(d);
 		}
 		free(env->sc_dispatchers);
@@ -279,12 +306,25 @@ purge_config(uint8_t what)
 	}
 	if (what & PURGE_PKI) {
 		while (dict_poproot(env->sc_pki_dict, (void **)&p)) {
+			if (p->pki_alt) {
+				freezero(p->pki_alt->pki_cert,
+				    p->pki_alt->pki_cert_len);
+				freezero(p->pki_alt->pki_key,
+				    p->pki_alt->pki_key_len);
+				free(p->pki_alt);
+			}
 			freezero(p->pki_cert, p->pki_cert_len);
 			freezero(p->pki_key, p->pki_key_len);
 			free(p);
 		}
 		free(env->sc_pki_dict);
 		env->sc_pki_dict = NULL;
+		while (dict_poproot(env->sc_dkim_dict, (void **)&dk)) {
+			freezero(dk->dkim_key, dk->dkim_key_len);
+			free(dk);
+		}
+		free(env->sc_dkim_dict);
+		env->sc_dkim_dict = NULL;
 	} else if (what & PURGE_PKI_KEYS) {
 		iter_dict = NULL;
 		while (dict_iter(env->sc_pki_dict, &iter_dict, &k,
@@ -293,6 +333,20 @@ purge_config(uint8_t what)
 			p->pki_cert = NULL;
 			freezero(p->pki_key, p->pki_key_len);
 			p->pki_key = NULL;
+			if (p->pki_alt) {
+				freezero(p->pki_alt->pki_cert,
+				    p->pki_alt->pki_cert_len);
+				p->pki_alt->pki_cert = NULL;
+				freezero(p->pki_alt->pki_key,
+				    p->pki_alt->pki_key_len);
+				p->pki_alt->pki_key = NULL;
+			}
+		}
+		iter_dict = NULL;
+		while (dict_iter(env->sc_dkim_dict, &iter_dict, &k,
+		    (void **)&dk)) {
+			freezero(dk->dkim_key, dk->dkim_key_len);
+			dk->dkim_key = NULL;
 		}
 	}
 }
@@ -313,12 +367,62 @@ config_process(enum smtp_proc_type proc)
 	if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
 		if (errno != EINVAL)
 			fatal("fdlimit: setrlimit");
+
+	config_affinity();
+}
+
+#ifdef HAVE_SCHED_SETAFFINITY
+static void
+config_affinity_cpu(int cpu, void *arg)
+{
+	if (cpu < CPU_SETSIZE)
+		CPU_SET(cpu, (cpu_set_t *)arg);
+}
+#endif
+
+/*
+ * Bind the current process to the cpus set by "cpu affinity", looking
+ * up a scheduler shard by its own entry before the process-wide one.
+ */
+void
+config_affinity(void)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t	 set;
+#endif
+	char		 key[32];
+	const char	*name, *list = NULL;
+
+	name = proc_name(smtpd_process);
+	if (smtpd_process == PROC_SCHEDULER) {
+		(void)snprintf(key, sizeof key, "%s.%d", name,
+		    env->sc_scheduler_shard);
+		list = dict_get(env->sc_cpu_affinity, key);
+	}
+	if (list == NULL)
+		list = dict_get(env->sc_cpu_affinity, name);
+	if (list == NULL)
+		return;
+
+#ifdef HAVE_SCHED_SETAFFINITY
+	CPU_ZERO(&set);
+	if (!cpulist_parse(list, config_affinity_cpu, &set))
+		fatalx("%s: invalid cpu list: %s", name, list);
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+		log_warn("warn: %s: cannot bind to cpus %s", name, list);
+	else
+		log_debug("debug: %s: bound to cpus %s", name, list);
+#else
+	log_warnx("warn: %s: cpu affinity is not supported on this system",
+	    name);
+#endif
 }
 
 void
 config_peer(enum smtp_proc_type proc)
 {
 	struct mproc	*p;
+	int		 i;
 
 	if (proc == smtpd_process)
 		fatal("config_peers: cannot peer with oneself");
@@ -327,16 +431,47 @@ config_peer(enum smtp_proc_type proc)
 		p = p_control;
 	else if (proc == PROC_LKA)
 		p = p_lka;
+	else if (proc == PROC_RESOLVER)
+		p = p_resolver;
 	else if (proc == PROC_PARENT)
 		p = p_parent;
 	else if (proc == PROC_QUEUE)
 		p = p_queue;
-	else if (proc == PROC_SCHEDULER)
-		p = p_scheduler;
+	else if (proc == PROC_SCHEDULER) {
+		for (i = 0; i < env->sc_scheduler_shards; i++)
+			mproc_enable(p_schedulers[i]);
+		return;
+	}
 	else if (proc == PROC_DISPATCHER)
 		p = p_dispatcher;
 	else if (proc == PROC_CA)
 		p = p_ca;
+	else if (proc == PROC_LAUNCHER)
+		p = p_launcher;
+	else if (proc == PROC_TLS) {
+		for (i = 0; i < env->sc_tls_workers; i++)
+			mproc_enable(p_tls[i]);
+		return;
+	}
+	else if (proc == PROC_MTA) {
+		for (i = 0; i < env->sc_mta_workers; i++)
+			mproc_enable(p_mta[i]);
+		return;
+	}
+	else if (proc == PROC_SMTP) {
+		for (i = 0; i < env->sc_smtp_workers; i++)
+			mproc_enable(p_smtp[i]);
+		return;
+	}
+	else if (proc == PROC_LOGGER) {
+		/* records go to the logger from now on */
+		if (p_logger == NULL)
+			return;
+		mproc_enable(p_logger);
+		if (env->sc_log_async && !foreground_log)
+			logger_client();
+		return;
+	}
 	else
 		fatalx("bad peer");
 
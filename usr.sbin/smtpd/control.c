@@ -47,9 +47,23 @@ struct ctl_conn {
 	uint32_t		 id;
 	uint8_t			 flags;
 #define CTL_CONN_NOTIFY		 0x01
+#define CTL_CONN_MONITOR	 0x02
 	struct mproc		 mproc;
 	uid_t			 euid;
 	gid_t			 egid;
+
+	struct event		 ev_monitor;
+	struct timeval		 monitor_tv;
+	struct dict		 monitor;	/* values last sent */
+
+	/* replies of the scheduler shards, merged before going out */
+	int			 gather;	/* shards yet to reply */
+	size_t			 gather_nmsg;
+	struct queue_count	 gather_count;
+	void			*gather_data;
+	size_t			 gather_len;
+
+	int			 mta_gather;	/* mta processes yet to end */
 };
 
 struct {
@@ -64,7 +78,21 @@ static void control_accept(int, short, void *);
 static void control_close(struct ctl_conn *);
 static void control_dispatch_ext(struct mproc *, struct imsg *);
 static void control_digest_update(const char *, size_t, int);
+static void control_monitor(int, short, void *);
+static void control_monitor_stop(struct ctl_conn *);
 static void control_broadcast_verbose(int, int);
+static struct mproc *control_scheduler(uint64_t);
+static void control_gather_start(struct ctl_conn *, uint32_t, void *,
+    size_t);
+static void control_gather(struct ctl_conn *, struct imsg *);
+static void control_gather_messages(struct ctl_conn *);
+static void control_gather_summary(struct ctl_conn *);
+static void control_count_add(struct queue_count *,
+    const struct queue_count *);
+static int control_domain_cmp(const void *, const void *);
+static int control_msgid_cmp(const void *, const void *);
+static void control_stat_set(const char *, const struct stat_value *);
+static void control_show_status(struct mproc *);
 
 static struct stat_backend *stat_backend = NULL;
 extern const char *backend_stat;
@@ -77,6 +105,9 @@ static struct stat_digest	digest;
 #define	CONTROL_FD_RESERVE		5
 #define	CONTROL_MAXCONN_PER_CLIENT	32
 
+#define	CONTROL_MONITOR_MAXINTERVAL	3600	/* seconds */
+#define	CONTROL_MONITOR_MAXQUEUED	64	/* imsg not read yet */
+
 static void
 control_imsg(struct mproc *p, struct imsg *imsg)
 {
@@ -85,6 +116,7 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 	struct msg		 m;
 	const char		*key;
 	const void		*data;
+	int			 fd;
 	size_t			 sz;
 
 	if (imsg == NULL) {
@@ -94,17 +126,40 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 	}
 
 	switch (imsg->hdr.type) {
+	case IMSG_CTL_LIST_MESSAGES:
+	case IMSG_CTL_QUEUE_SUMMARY:
+	case IMSG_CTL_QUEUE_BULK:
+		c = tree_get(&ctl_conns, imsg->hdr.peerid);
+		if (c == NULL)
+			return;
+		control_gather(c, imsg);
+		return;
+
 	case IMSG_CTL_OK:
 	case IMSG_CTL_FAIL:
-	case IMSG_CTL_LIST_MESSAGES:
-	case IMSG_CTL_LIST_ENVELOPES:
-	case IMSG_CTL_DISCOVER_EVPID:
-	case IMSG_CTL_DISCOVER_MSGID:
 	case IMSG_CTL_MTA_SHOW_HOSTS:
 	case IMSG_CTL_MTA_SHOW_RELAYS:
 	case IMSG_CTL_MTA_SHOW_ROUTES:
 	case IMSG_CTL_MTA_SHOW_HOSTSTATS:
 	case IMSG_CTL_MTA_SHOW_BLOCK:
+	case IMSG_CTL_MTA_SHOW_DESTINATIONS:
+		c = tree_get(&ctl_conns, imsg->hdr.peerid);
+		if (c == NULL)
+			return;
+		/* the mta workers each end their reply, pass on the last */
+		if (p->proc == PROC_MTA && imsg->hdr.len == IMSG_HEADER_SIZE &&
+		    --c->mta_gather > 0)
+			return;
+		imsg->hdr.peerid = 0;
+		m_forward(&c->mproc, imsg);
+		return;
+
+	case IMSG_CTL_LIST_ENVELOPES:
+	case IMSG_CTL_LIST_QUEUE:
+	case IMSG_CTL_DISCOVER_EVPID:
+	case IMSG_CTL_DISCOVER_MSGID:
+	case IMSG_CTL_SHOW_FILTERS:
+	case IMSG_CTL_SHOW_PROFILE:
 		c = tree_get(&ctl_conns, imsg->hdr.peerid);
 		if (c == NULL)
 			return;
@@ -112,6 +167,19 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 		m_forward(&c->mproc, imsg);
 		return;
 
+	case IMSG_CTL_QUEUE_EXPORT:
+	case IMSG_CTL_QUEUE_IMPORT:
+		/* the queue gives up on the archive once its pipe is closed */
+		c = tree_get(&ctl_conns, imsg->hdr.peerid);
+		if (c == NULL) {
+			if ((fd = imsg_get_fd(imsg)) != -1)
+				close(fd);
+			return;
+		}
+		imsg->hdr.peerid = 0;
+		m_forward(&c->mproc, imsg);
+		return;
+
 	case IMSG_CTL_SMTP_SESSION:
 		c = tree_get(&ctl_conns, imsg->hdr.peerid);
 		if (c == NULL)
@@ -122,28 +190,32 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 
 	case IMSG_STAT_INCREMENT:
 		m_msg(&m, imsg);
-		m_get_string(&m, &key);
-		m_get_data(&m, &data, &sz);
+		while (!m_is_eom(&m)) {
+			m_get_string(&m, &key);
+			m_get_data(&m, &data, &sz);
+			if (sz != sizeof(val))
+				fatalx("control: IMSG_STAT_INCREMENT size mismatch");
+			memmove(&val, data, sz);
+			if (stat_backend)
+				stat_backend->increment(key, val.u.counter);
+			control_digest_update(key, val.u.counter, 1);
+		}
 		m_end(&m);
-		if (sz != sizeof(val))
-			fatalx("control: IMSG_STAT_INCREMENT size mismatch");
-		memmove(&val, data, sz);
-		if (stat_backend)
-			stat_backend->increment(key, val.u.counter);
-		control_digest_update(key, val.u.counter, 1);
 		return;
 
 	case IMSG_STAT_DECREMENT:
 		m_msg(&m, imsg);
-		m_get_string(&m, &key);
-		m_get_data(&m, &data, &sz);
+		while (!m_is_eom(&m)) {
+			m_get_string(&m, &key);
+			m_get_data(&m, &data, &sz);
+			if (sz != sizeof(val))
+				fatalx("control: IMSG_STAT_DECREMENT size mismatch");
+			memmove(&val, data, sz);
+			if (stat_backend)
+				stat_backend->decrement(key, val.u.counter);
+			control_digest_update(key, val.u.counter, 0);
+		}
 		m_end(&m);
-		if (sz != sizeof(val))
-			fatalx("control: IMSG_STAT_DECREMENT size mismatch");
-		memmove(&val, data, sz);
-		if (stat_backend)
-			stat_backend->decrement(key, val.u.counter);
-		control_digest_update(key, val.u.counter, 0);
 		return;
 
 	case IMSG_STAT_SET:
@@ -179,7 +251,9 @@ control_create_socket(void)
 	    sizeof(s_un.sun_path)) >= sizeof(s_un.sun_path))
 		fatal("control: socket name too long");
 
-	if (connect(fd, (struct sockaddr *)&s_un, sizeof(s_un)) == 0)
+	/* on reload, the socket is taken over from the running generation */
+	if (!(env->sc_opts & SMTPD_OPT_TAKEOVER) &&
+	    connect(fd, (struct sockaddr *)&s_un, sizeof(s_un)) == 0)
 		fatalx("control socket already listening");
 
 	if (unlink(SMTPD_SOCKET) == -1)
@@ -248,8 +322,15 @@ control(void)
 	config_peer(PROC_QUEUE);
 	config_peer(PROC_PARENT);
 	config_peer(PROC_LKA);
+	config_peer(PROC_RESOLVER);
 	config_peer(PROC_DISPATCHER);
+	config_peer(PROC_LOGGER);
+	config_peer(PROC_TLS);
+	config_peer(PROC_MTA);
+	config_peer(PROC_SMTP);
 	config_peer(PROC_CA);
+	stat_cpu_start(control_stat_set);
+	memory_start(control_stat_set, NULL);
 
 	control_listen();
 
@@ -361,8 +442,10 @@ control_close(struct ctl_conn *c)
 		tree_xpop(&ctl_count, c->euid);
 		free(count);
 	}
+	control_monitor_stop(c);
 	tree_xpop(&ctl_conns, c->id);
 	mproc_clear(&c->mproc);
+	free(c->gather_data);
 	free(c);
 
 	stat_backend->decrement("control.session", 1);
@@ -419,18 +502,85 @@ control_digest_update(const char *key, size_t value, int incr)
 	}
 }
 
+/*
+ * Push to a monitoring client the stats that changed since the last
+ * time, then the digest which marks the end of the update.
+ */
+static void
+control_monitor(int fd, short event, void *arg)
+{
+	struct ctl_conn		*c = arg;
+	struct stat_value	 val, *last;
+	char			*key;
+	void			*iter;
+	size_t			 len, n;
+
+	/* a client not reading gets nothing more, it catches up later */
+	if (c->mproc.imsgbuf.w.queued >= CONTROL_MONITOR_MAXQUEUED)
+		goto end;
+
+	n = 0;
+	iter = NULL;
+	while (stat_backend->iter(&iter, &key, &val)) {
+		if ((last = dict_get(&c->monitor, key)) == NULL) {
+			last = xcalloc(1, sizeof *last);
+			dict_set(&c->monitor, key, last);
+		}
+		else if (memcmp(last, &val, sizeof val) == 0)
+			continue;
+		*last = val;
+
+		len = IMSG_HEADER_SIZE + strlen(key) + 2 + sizeof(size_t) +
+		    sizeof(val);
+		if (n && c->mproc.m_pos + len > MAX_IMSGSIZE) {
+			m_close(&c->mproc);
+			n = 0;
+		}
+		if (n++ == 0)
+			m_create(&c->mproc, IMSG_CTL_MONITOR, 0, 0, -1);
+		m_add_string(&c->mproc, key);
+		m_add_data(&c->mproc, &val, sizeof(val));
+	}
+	if (n)
+		m_close(&c->mproc);
+
+	digest.timestamp = time(NULL);
+	m_compose(&c->mproc, IMSG_CTL_GET_DIGEST, 0, 0, -1, &digest,
+	    sizeof digest);
+
+end:
+	evtimer_add(&c->ev_monitor, &c->monitor_tv);
+}
+
+static void
+control_monitor_stop(struct ctl_conn *c)
+{
+	void	*last;
+
+	if (!(c->flags & CTL_CONN_MONITOR))
+		return;
+
+	evtimer_del(&c->ev_monitor);
+	while (dict_poproot(&c->monitor, &last))
+		free(last);
+	c->flags &= ~CTL_CONN_MONITOR;
+}
+
 static void
 control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 {
 	struct sockaddr_storage	 ss;
 	struct ctl_conn		*c;
+	struct mproc		*m;
 	int			 v;
 	struct stat_kv		*kvp;
 	char			*key;
 	struct stat_value	 val;
 	size_t			 len;
+	struct queue_filter	 filter;
 	uint64_t		 evpid;
 	uint32_t		 msgid;
+	int			 i;
 
 	c = p->data;
 
@@ -461,6 +611,66 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		m_compose(p, IMSG_CTL_GET_DIGEST, 0, 0, -1, &digest, sizeof digest);
 		return;
 
+	case IMSG_CTL_MONITOR:
+		if (c->euid)
+			goto badcred;
+		if (imsg->hdr.len - IMSG_HEADER_SIZE != sizeof(v))
+			goto invalid;
+		memcpy(&v, imsg->data, sizeof(v));
+		if (v < 1 || v > CONTROL_MONITOR_MAXINTERVAL)
+			goto invalid;
+
+		if (c->flags & CTL_CONN_MONITOR)
+			evtimer_del(&c->ev_monitor);
+		else {
+			dict_init(&c->monitor);
+			evtimer_set(&c->ev_monitor, control_monitor, c);
+			c->flags |= CTL_CONN_MONITOR;
+		}
+		c->monitor_tv.tv_sec = v;
+		c->monitor_tv.tv_usec = 0;
+		/* the first update holds all of the stats */
+		control_monitor(-1, 0, c);
+		return;
+
+	case IMSG_CTL_SHOW_PROFILE:
+		if (c->euid)
+			goto badcred;
+		if (imsg->hdr.len - IMSG_HEADER_SIZE != sizeof(v))
+			goto invalid;
+		memcpy(&v, imsg->data, sizeof(v));
+		switch (v) {
+		case PROC_CONTROL:
+			profile_show(p, 0);
+			return;
+		case PROC_PARENT:
+			m = p_parent;
+			break;
+		case PROC_LKA:
+			m = p_lka;
+			break;
+		case PROC_RESOLVER:
+			m = p_resolver;
+			break;
+		case PROC_QUEUE:
+			m = p_queue;
+			break;
+		case PROC_SCHEDULER:
+			/* the first shard speaks for the others */
+			m = p_schedulers[0];
+			break;
+		case PROC_DISPATCHER:
+			m = p_dispatcher;
+			break;
+		case PROC_CA:
+			m = p_ca;
+			break;
+		default:
+			goto invalid;
+		}
+		m_compose(m, IMSG_CTL_SHOW_PROFILE, c->id, 0, -1, NULL, 0);
+		return;
+
 	case IMSG_CTL_GET_STATS:
 		if (c->euid)
 			goto badcred;
@@ -555,8 +765,12 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		if (c->euid)
 			goto badcred;
 
+		if (imsg->hdr.len - IMSG_HEADER_SIZE != sizeof evpid)
+			goto invalid;
+
+		memmove(&evpid, imsg->data, sizeof evpid);
 		imsg->hdr.peerid = c->id;
-		m_forward(p_scheduler, imsg);
+		m_forward(control_scheduler(evpid), imsg);
 		return;
 
 	case IMSG_CTL_PAUSE_MDA:
@@ -597,7 +811,9 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		}
 		log_info("info: smtp paused");
 		env->sc_flags |= SMTPD_SMTP_PAUSED;
-		m_compose(p_dispatcher, IMSG_CTL_PAUSE_SMTP, 0, 0, -1, NULL, 0);
+		for (i = 0; i < smtp_peer_count(); i++)
+			m_compose(smtp_peer_at(i), IMSG_CTL_PAUSE_SMTP, 0, 0,
+			    -1, NULL, 0);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -605,8 +821,12 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		if (c->euid)
 			goto badcred;
 
+		if (imsg->hdr.len - IMSG_HEADER_SIZE != sizeof evpid)
+			goto invalid;
+
+		memmove(&evpid, imsg->data, sizeof evpid);
 		imsg->hdr.peerid = c->id;
-		m_forward(p_scheduler, imsg);
+		m_forward(control_scheduler(evpid), imsg);
 		return;
 
 	case IMSG_CTL_RESUME_MDA:
@@ -647,7 +867,8 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		}
 		log_info("info: smtp resumed");
 		env->sc_flags &= ~SMTPD_SMTP_PAUSED;
-		m_forward(p_dispatcher, imsg);
+		for (i = 0; i < smtp_peer_count(); i++)
+			m_forward(smtp_peer_at(i), imsg);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -655,21 +876,75 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		if (c->euid)
 			goto badcred;
 
-		m_forward(p_dispatcher, imsg);
+		/* only the process owning the route acts on it */
+		for (i = 0; i < mta_peer_count(); i++)
+			m_forward(mta_peer_at(i), imsg);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
 	case IMSG_CTL_LIST_MESSAGES:
 		if (c->euid)
 			goto badcred;
-		m_compose(p_scheduler, IMSG_CTL_LIST_MESSAGES, c->id, 0, -1,
+		if (imsg->hdr.len - sizeof(imsg->hdr) != sizeof msgid)
+			goto invalid;
+		if (c->gather)
+			goto invalid;
+		control_gather_start(c, IMSG_CTL_LIST_MESSAGES,
 		    imsg->data, imsg->hdr.len - sizeof(imsg->hdr));
 		return;
 
 	case IMSG_CTL_LIST_ENVELOPES:
 		if (c->euid)
 			goto badcred;
-		m_compose(p_scheduler, IMSG_CTL_LIST_ENVELOPES, c->id, 0, -1,
+		if (imsg->hdr.len - sizeof(imsg->hdr) != sizeof evpid)
+			goto invalid;
+		/* envelopes are listed one message at a time */
+		memmove(&evpid, imsg->data, sizeof evpid);
+		m_compose(control_scheduler(evpid), IMSG_CTL_LIST_ENVELOPES,
+		    c->id, 0, -1, imsg->data, imsg->hdr.len - sizeof(imsg->hdr));
+		return;
+
+	case IMSG_CTL_LIST_QUEUE:
+		if (c->euid)
+			goto badcred;
+		if (imsg->hdr.len - sizeof(imsg->hdr) !=
+		    sizeof(struct queue_filter))
+			goto invalid;
+		/*
+		 * The shards are walked one after the other, the cursor
+		 * of a page falls in the shard the listing is at.
+		 */
+		memmove(&filter, imsg->data, sizeof filter);
+		m_compose(scheduler_peer(evpid_to_msgid(filter.from)),
+		    IMSG_CTL_LIST_QUEUE, c->id, 0, -1,
+		    imsg->data, imsg->hdr.len - sizeof(imsg->hdr));
+		return;
+
+	case IMSG_CTL_QUEUE_BULK:
+		if (c->euid)
+			goto badcred;
+		if (imsg->hdr.len - sizeof(imsg->hdr) !=
+		    sizeof(struct queue_filter))
+			goto invalid;
+		memmove(&filter, imsg->data, sizeof filter);
+		if (filter.bulk < QUEUE_BULK_SCHEDULE ||
+		    filter.bulk > QUEUE_BULK_REMOVE)
+			goto invalid;
+		if (c->gather)
+			goto invalid;
+		control_gather_start(c, IMSG_CTL_QUEUE_BULK,
+		    imsg->data, imsg->hdr.len - sizeof(imsg->hdr));
+		return;
+
+	case IMSG_CTL_QUEUE_SUMMARY:
+		if (c->euid)
+			goto badcred;
+		if (imsg->hdr.len - sizeof(imsg->hdr) !=
+		    SMTPD_MAXDOMAINPARTSIZE)
+			goto invalid;
+		if (c->gather)
+			goto invalid;
+		control_gather_start(c, IMSG_CTL_QUEUE_SUMMARY,
 		    imsg->data, imsg->hdr.len - sizeof(imsg->hdr));
 		return;
 
@@ -678,19 +953,27 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 	case IMSG_CTL_MTA_SHOW_ROUTES:
 	case IMSG_CTL_MTA_SHOW_HOSTSTATS:
 	case IMSG_CTL_MTA_SHOW_BLOCK:
+	case IMSG_CTL_MTA_SHOW_DESTINATIONS:
 		if (c->euid)
 			goto badcred;
 
 		imsg->hdr.peerid = c->id;
-		m_forward(p_dispatcher, imsg);
+		if (imsg->hdr.type == IMSG_CTL_MTA_SHOW_BLOCK) {
+			/* all the mta processes hold the same blocks */
+			c->mta_gather = 1;
+			m_forward(mta_peer_at(0), imsg);
+			return;
+		}
+		c->mta_gather = mta_peer_count();
+		for (i = 0; i < mta_peer_count(); i++)
+			m_forward(mta_peer_at(i), imsg);
 		return;
 
 	case IMSG_CTL_SHOW_STATUS:
 		if (c->euid)
 			goto badcred;
 
-		m_compose(p, IMSG_CTL_SHOW_STATUS, 0, 0, -1, &env->sc_flags,
-		    sizeof(env->sc_flags));
+		control_show_status(p);
 		return;
 
 	case IMSG_CTL_MTA_BLOCK:
@@ -701,26 +984,46 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		if (imsg->hdr.len - IMSG_HEADER_SIZE <= sizeof(ss))
 			goto invalid;
 		memmove(&ss, imsg->data, sizeof(ss));
-		m_create(p_dispatcher, imsg->hdr.type, c->id, 0, -1);
-		m_add_sockaddr(p_dispatcher, (struct sockaddr *)&ss);
-		m_add_string(p_dispatcher, (char *)imsg->data + sizeof(ss));
-		m_close(p_dispatcher);
+		c->mta_gather = mta_peer_count();
+		for (i = 0; i < mta_peer_count(); i++) {
+			m = mta_peer_at(i);
+			m_create(m, imsg->hdr.type, c->id, 0, -1);
+			m_add_sockaddr(m, (struct sockaddr *)&ss);
+			m_add_string(m, (char *)imsg->data + sizeof(ss));
+			m_close(m);
+		}
 		return;
 
 	case IMSG_CTL_SCHEDULE:
 		if (c->euid)
 			goto badcred;
 
+		if (imsg->hdr.len - IMSG_HEADER_SIZE != sizeof evpid)
+			goto invalid;
+
+		memmove(&evpid, imsg->data, sizeof evpid);
 		imsg->hdr.peerid = c->id;
-		m_forward(p_scheduler, imsg);
+		m_forward(control_scheduler(evpid), imsg);
 		return;
 
 	case IMSG_CTL_REMOVE:
 		if (c->euid)
 			goto badcred;
 
+		if (imsg->hdr.len - IMSG_HEADER_SIZE != sizeof evpid)
+			goto invalid;
+
+		memmove(&evpid, imsg->data, sizeof evpid);
+		imsg->hdr.peerid = c->id;
+		m_forward(control_scheduler(evpid), imsg);
+		return;
+
+	case IMSG_CTL_SHOW_FILTERS:
+		if (c->euid)
+			goto badcred;
+
 		imsg->hdr.peerid = c->id;
-		m_forward(p_scheduler, imsg);
+		m_forward(p_lka, imsg);
 		return;
 
 	case IMSG_CTL_UPDATE_TABLE:
@@ -762,6 +1065,14 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		m_close(p_queue);
 		return;
 
+	case IMSG_CTL_QUEUE_EXPORT:
+	case IMSG_CTL_QUEUE_IMPORT:
+		if (c->euid)
+			goto badcred;
+		imsg->hdr.peerid = c->id;
+		m_forward(p_queue, imsg);
+		return;
+
 	default:
 		log_debug("debug: control_dispatch_ext: "
 		    "error handling %s imsg",
@@ -776,10 +1087,16 @@ invalid:
 static void
 control_broadcast_verbose(int msg, int v)
 {
+	int	i;
+
 	m_create(p_lka, msg, 0, 0, -1);
 	m_add_int(p_lka, v);
 	m_close(p_lka);
 
+	m_create(p_resolver, msg, 0, 0, -1);
+	m_add_int(p_resolver, v);
+	m_close(p_resolver);
+
 	m_create(p_dispatcher, msg, 0, 0, -1);
 	m_add_int(p_dispatcher, v);
 	m_close(p_dispatcher);
@@ -792,11 +1109,251 @@ control_broadcast_verbose(int msg, int v)
 	m_add_int(p_ca, v);
 	m_close(p_ca);
 
-	m_create(p_scheduler, msg, 0, 0, -1);
-	m_add_int(p_scheduler, v);
-	m_close(p_scheduler);
+	for (i = 0; i < env->sc_scheduler_shards; i++) {
+		m_create(p_schedulers[i], msg, 0, 0, -1);
+		m_add_int(p_schedulers[i], v);
+		m_close(p_schedulers[i]);
+	}
+
+	for (i = 0; i < env->sc_tls_workers; i++) {
+		m_create(p_tls[i], msg, 0, 0, -1);
+		m_add_int(p_tls[i], v);
+		m_close(p_tls[i]);
+	}
+
+	for (i = 0; i < env->sc_mta_workers; i++) {
+		m_create(p_mta[i], msg, 0, 0, -1);
+		m_add_int(p_mta[i], v);
+		m_close(p_mta[i]);
+	}
+
+	for (i = 0; i < env->sc_smtp_workers; i++) {
+		m_create(p_smtp[i], msg, 0, 0, -1);
+		m_add_int(p_smtp[i], v);
+		m_close(p_smtp[i]);
+	}
 
 	m_create(p_parent, msg, 0, 0, -1);
 	m_add_int(p_parent, v);
 	m_close(p_parent);
 }
+
+/* a message or an envelope id */
+static struct mproc *
+control_scheduler(uint64_t id)
+{
+	if (id <= 0xffffffffL)
+		return (scheduler_peer(id));
+	return (scheduler_peer(evpid_to_msgid(id)));
+}
+
+/*
+ * Message lists and queue summaries are asked to all the scheduler
+ * shards, the replies are merged into one for the client.
+ */
+static void
+control_gather_start(struct ctl_conn *c, uint32_t type, void *data,
+    size_t len)
+{
+	int	i;
+
+	c->gather = env->sc_scheduler_shards;
+	c->gather_nmsg = 0;
+	memset(&c->gather_count, 0, sizeof c->gather_count);
+	free(c->gather_data);
+	c->gather_data = NULL;
+	c->gather_len = 0;
+
+	for (i = 0; i < env->sc_scheduler_shards; i++)
+		m_compose(p_schedulers[i], type, c->id, 0, -1, data, len);
+}
+
+static void
+control_gather(struct ctl_conn *c, struct imsg *imsg)
+{
+	struct queue_count	 count;
+	struct msg		 m;
+	const void		*data;
+	size_t			 len, nmsg;
+
+	if (c->gather == 0)
+		return;
+
+	if (imsg->hdr.type == IMSG_CTL_LIST_MESSAGES) {
+		data = imsg->data;
+		len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	} else if (imsg->hdr.type == IMSG_CTL_QUEUE_BULK) {
+		/* the envelopes each shard acted upon */
+		m_msg(&m, imsg);
+		m_get_size(&m, &nmsg);
+		m_end(&m);
+		c->gather_nmsg += nmsg;
+		len = 0;
+	} else {
+		m_msg(&m, imsg);
+		m_get_size(&m, &nmsg);
+		m_get_data(&m, &data, &len);
+		if (len != sizeof count)
+			fatalx("control: bad queue summary");
+		memmove(&count, data, sizeof count);
+		m_get_data(&m, &data, &len);
+		m_end(&m);
+		if (len % sizeof(struct queue_domain))
+			fatalx("control: bad queue summary");
+		c->gather_nmsg += nmsg;
+		control_count_add(&c->gather_count, &count);
+	}
+
+	if (len) {
+		c->gather_data = realloc(c->gather_data, c->gather_len + len);
+		if (c->gather_data == NULL)
+			fatal("control: realloc");
+		memmove((char *)c->gather_data + c->gather_len, data, len);
+		c->gather_len += len;
+	}
+
+	if (--c->gather)
+		return;
+
+	if (imsg->hdr.type == IMSG_CTL_LIST_MESSAGES)
+		control_gather_messages(c);
+	else if (imsg->hdr.type == IMSG_CTL_QUEUE_BULK)
+		m_compose(&c->mproc, IMSG_CTL_QUEUE_BULK, 0, 0, -1,
+		    &c->gather_nmsg, sizeof c->gather_nmsg);
+	else
+		control_gather_summary(c);
+
+	free(c->gather_data);
+	c->gather_data = NULL;
+	c->gather_len = 0;
+}
+
+/* the lowest msgids of all shards make the next batch */
+static void
+control_gather_messages(struct ctl_conn *c)
+{
+	size_t	n;
+
+	n = c->gather_len / sizeof(uint32_t);
+	if (n)
+		qsort(c->gather_data, n, sizeof(uint32_t), control_msgid_cmp);
+	if (n > env->sc_scheduler_max_msg_batch_size)
+		n = env->sc_scheduler_max_msg_batch_size;
+
+	m_compose(&c->mproc, IMSG_CTL_LIST_MESSAGES, 0, 0, -1,
+	    c->gather_data, n * sizeof(uint32_t));
+}
+
+/*
+ * Each shard lists its first domains after the requested one, a domain
+ * found on several shards has its counts added up.
+ */
+static void
+control_gather_summary(struct ctl_conn *c)
+{
+	struct queue_domain	*d = c->gather_data;
+	size_t			 i, n, nd;
+
+	nd = c->gather_len / sizeof(*d);
+	if (nd)
+		qsort(d, nd, sizeof(*d), control_domain_cmp);
+
+	for (i = 0, n = 0; i < nd; i++) {
+		if (n && strcmp(d[n - 1].name, d[i].name) == 0) {
+			control_count_add(&d[n - 1].count, &d[i].count);
+			if (d[i].oldest && (d[n - 1].oldest == 0 ||
+			    d[i].oldest < d[n - 1].oldest))
+				d[n - 1].oldest = d[i].oldest;
+			if (d[i].next && (d[n - 1].next == 0 ||
+			    d[i].next < d[n - 1].next))
+				d[n - 1].next = d[i].next;
+			continue;
+		}
+		if (n == QUEUE_DOMAIN_MAX)
+			break;
+		d[n++] = d[i];
+	}
+
+	m_create(&c->mproc, IMSG_CTL_QUEUE_SUMMARY, 0, 0, -1);
+	m_add_size(&c->mproc, c->gather_nmsg);
+	m_add_data(&c->mproc, &c->gather_count, sizeof c->gather_count);
+	m_add_data(&c->mproc, d, n * sizeof(*d));
+	m_close(&c->mproc);
+}
+
+static void
+control_count_add(struct queue_count *dst, const struct queue_count *src)
+{
+	dst->total += src->total;
+	dst->pending += src->pending;
+	dst->inflight += src->inflight;
+	dst->held += src->held;
+	dst->suspended += src->suspended;
+}
+
+static int
+control_domain_cmp(const void *a, const void *b)
+{
+	const struct queue_domain	*da = a, *db = b;
+
+	return (strcmp(da->name, db->name));
+}
+
+static int
+control_msgid_cmp(const void *a, const void *b)
+{
+	uint32_t	ma = *(const uint32_t *)a, mb = *(const uint32_t *)b;
+
+	if (ma < mb)
+		return (-1);
+	return (ma > mb);
+}
+
+static void
+control_stat_set(const char *key, const struct stat_value *value)
+{
+	stat_backend->set(key, value);
+}
+
+/*
+ * Reply with the daemon flags followed by the cpu time and usage of every
+ * process, from the "cpu.<proc>.time" and "cpu.<proc>.usage" pairs which
+ * sort next to each other in the stat backend.
+ */
+static void
+control_show_status(struct mproc *p)
+{
+	struct stat_value	 val;
+	struct timeval		 tv;
+	char			 name[STAT_KEY_SIZE];
+	char			*key;
+	void			*iter = NULL;
+	size_t			 len;
+
+	m_create(p, IMSG_CTL_SHOW_STATUS, 0, 0, -1);
+	m_add_u32(p, env->sc_flags);
+
+	name[0] = '\0';
+	timerclear(&tv);
+	while (stat_backend->iter(&iter, &key, &val)) {
+		if (strncmp(key, "cpu.", 4) != 0)
+			continue;
+		len = strlen(key);
+		if (len > 9 && strcmp(key + len - 5, ".time") == 0 &&
+		    val.type == STAT_TIMEVAL) {
+			(void)strlcpy(name, key + 4, sizeof name);
+			name[len - 9] = '\0';
+			tv = val.u.tv;
+		}
+		else if (len > 10 && strcmp(key + len - 6, ".usage") == 0 &&
+		    val.type == STAT_COUNTER && name[0] != '\0' &&
+		    strlen(name) == len - 10 &&
+		    strncmp(key + 4, name, len - 10) == 0) {
+			m_add_string(p, name);
+			m_add_timeval(p, &tv);
+			m_add_size(p, val.u.counter);
+			name[0] = '\0';
+		}
+	}
+	m_close(p);
+}
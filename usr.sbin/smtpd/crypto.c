@@ -22,9 +22,11 @@
 #include <sys/stat.h>
 
 #include <openssl/evp.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define	CRYPTO_BUFFER_SIZE	16384
+#define	CRYPTO_CHUNK_SIZE	65536
 
 #define	GCM_TAG_SIZE		16
 #define	IV_SIZE			12
@@ -33,17 +35,53 @@
 /* bump if we ever switch from aes-256-gcm to anything else */
 #define	API_VERSION    		1
 
+/*
+ * Files are written as a sequence of chunks, each sealed on its own
+ * with a nonce derived from the IV and the chunk number:
+ *
+ *	version | iv | chunk 0 | tag 0 | ... | chunk n | tag n
+ *
+ * Every chunk but the last holds exactly CRYPTO_CHUNK_SIZE bytes and
+ * the last one is always shorter, possibly empty.  The chunk number
+ * and whether it is the last one are authenticated with it, so that
+ * chunks can be neither reordered nor dropped.  Each chunk is checked
+ * before its plaintext is released, and nothing requires seeking to
+ * the end of the file first.
+ */
+#define	API_VERSION_CHUNKED	2
+
 
 int	crypto_setup(const char *, size_t);
 int	crypto_encrypt_file(FILE *, FILE *);
 int	crypto_decrypt_file(FILE *, FILE *);
+int	crypto_decrypt_file_cb(FILE *, int (*)(void *, const void *, size_t),
+	    void *);
 size_t	crypto_encrypt_buffer(const char *, size_t, char *, size_t);
 size_t	crypto_decrypt_buffer(const char *, size_t, char *, size_t);
+void   *crypto_encrypt_stream_begin(FILE *);
+int	crypto_encrypt_stream_write(void *, const void *, size_t);
+int	crypto_encrypt_stream_end(void *);
 
 static struct crypto_ctx {
 	unsigned char  		key[KEY_SIZE];
 } cp;
 
+struct crypto_stream {
+	EVP_CIPHER_CTX	*ctx;
+	FILE		*out;
+	uint8_t		 iv[IV_SIZE];
+	uint64_t	 chunk;
+	size_t		 len;
+	uint8_t		 buf[CRYPTO_CHUNK_SIZE];
+	int		 error;
+};
+
+static void	crypto_chunk_nonce(const uint8_t *, uint64_t, int, uint8_t *,
+		    uint8_t *);
+static int	crypto_seal_chunk(struct crypto_stream *, int);
+static int	crypto_decrypt_file_v1(FILE *,
+		    int (*)(void *, const void *, size_t), void *);
+
 int
 crypto_setup(const char *key, size_t len)
 {
@@ -58,64 +96,157 @@ crypto_setup(const char *key, size_t len)
 	return 1;
 }
 
+/*
+ * The nonce of a chunk is the IV with the chunk number xor-ed into its
+ * last 8 bytes; the additional data binds the number and last flag.
+ */
+static void
+crypto_chunk_nonce(const uint8_t *iv, uint64_t chunk, int last,
+    uint8_t *nonce, uint8_t *aad)
+{
+	int	i;
+
+	aad[0] = API_VERSION_CHUNKED;
+	memcpy(nonce, iv, IV_SIZE);
+	for (i = 0; i < 8; i++) {
+		nonce[IV_SIZE - 1 - i] ^= (chunk >> (i * 8)) & 0xff;
+		aad[8 - i] = (chunk >> (i * 8)) & 0xff;
+	}
+	aad[9] = last;
+}
+
+static int
+crypto_seal_chunk(struct crypto_stream *cs, int last)
+{
+	uint8_t	obuf[CRYPTO_CHUNK_SIZE + GCM_TAG_SIZE];
+	uint8_t	nonce[IV_SIZE];
+	uint8_t	aad[10];
+	int	len, flen;
+
+	crypto_chunk_nonce(cs->iv, cs->chunk, last, nonce, aad);
+
+	if (!EVP_EncryptInit_ex(cs->ctx, EVP_aes_256_gcm(), NULL, cp.key,
+	    nonce) ||
+	    !EVP_EncryptUpdate(cs->ctx, NULL, &len, aad, sizeof aad) ||
+	    !EVP_EncryptUpdate(cs->ctx, obuf, &len, cs->buf, cs->len) ||
+	    !EVP_EncryptFinal_ex(cs->ctx, obuf + len, &flen) ||
+	    !EVP_CIPHER_CTX_ctrl(cs->ctx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_SIZE,
+	    obuf + len + flen))
+		return 0;
+	len += flen + GCM_TAG_SIZE;
+
+	if (fwrite(obuf, len, 1, cs->out) != 1)
+		return 0;
+
+	cs->chunk++;
+	cs->len = 0;
+	return 1;
+}
+
 int
 crypto_encrypt_file(FILE * in, FILE * out)
 {
-	EVP_CIPHER_CTX	*ctx;
 	uint8_t		ibuf[CRYPTO_BUFFER_SIZE];
-	uint8_t		obuf[CRYPTO_BUFFER_SIZE];
-	uint8_t		iv[IV_SIZE];
-	uint8_t		tag[GCM_TAG_SIZE];
-	uint8_t		version = API_VERSION;
+	void	       *hdl;
 	size_t		r;
-	int		len;
-	int		ret = 0;
-	struct stat	sb;
+	int		ret = 1;
 
-	/* XXX - Do NOT encrypt files bigger than 64GB */
-	if (fstat(fileno(in), &sb) == -1)
+	if ((hdl = crypto_encrypt_stream_begin(out)) == NULL)
 		return 0;
-	if (sb.st_size >= 0x1000000000LL)
+
+	/* encrypt until end of file */
+	while ((r = fread(ibuf, 1, sizeof ibuf, in)) != 0)
+		if (!crypto_encrypt_stream_write(hdl, ibuf, r)) {
+			ret = 0;
+			break;
+		}
+	if (!feof(in))
+		ret = 0;
+
+	if (!crypto_encrypt_stream_end(hdl))
+		ret = 0;
+
+	return ret;
+}
+
+static int
+crypto_write_file(void *arg, const void *buf, size_t len)
+{
+	return fwrite(buf, len, 1, arg) == 1;
+}
+
+int
+crypto_decrypt_file(FILE * in, FILE * out)
+{
+	if (!crypto_decrypt_file_cb(in, crypto_write_file, out))
 		return 0;
+	fflush(out);
+	return 1;
+}
 
-	/* prepend version byte*/
-	if (fwrite(&version, 1, sizeof version, out) != sizeof version)
+/*
+ * Decrypt a file produced by crypto_encrypt_file(), handing the plaintext
+ * to a callback instead of writing it to a file.  Chunks are passed on as
+ * soon as they are authenticated, but the file is only known to be whole
+ * once the function returns successfully.
+ */
+int
+crypto_decrypt_file_cb(FILE * in, int (*cb)(void *, const void *, size_t),
+    void *arg)
+{
+	EVP_CIPHER_CTX	*ctx;
+	uint8_t		ibuf[CRYPTO_CHUNK_SIZE + GCM_TAG_SIZE];
+	uint8_t		obuf[CRYPTO_CHUNK_SIZE];
+	uint8_t		iv[IV_SIZE];
+	uint8_t		nonce[IV_SIZE];
+	uint8_t		aad[10];
+	uint8_t		version;
+	uint64_t	chunk;
+	size_t		r;
+	int		len, flen, last;
+	int		ret = 0;
+
+	if (fread(&version, 1, sizeof version, in) != sizeof version)
+		return 0;
+	if (version == API_VERSION)
+		return crypto_decrypt_file_v1(in, cb, arg);
+	if (version != API_VERSION_CHUNKED)
 		return 0;
 
-	/* generate and prepend IV */
-	memset(iv, 0, sizeof iv);
-	arc4random_buf(iv, sizeof iv);
-	if (fwrite(iv, 1, sizeof iv, out) != sizeof iv)
+	/* extract IV */
+	if (fread(iv, 1, sizeof iv, in) != sizeof iv)
 		return 0;
 
 	ctx = EVP_CIPHER_CTX_new();
 	if (ctx == NULL)
 		return 0;
 
-	EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, cp.key, iv);
-
-	/* encrypt until end of file */
-	while ((r = fread(ibuf, 1, CRYPTO_BUFFER_SIZE, in)) != 0) {
-		if (!EVP_EncryptUpdate(ctx, obuf, &len, ibuf, r))
+	/* a short chunk is the last one, a missing one is an error */
+	for (chunk = 0, last = 0; !last; chunk++) {
+		r = fread(ibuf, 1, sizeof ibuf, in);
+		if (ferror(in) || r < GCM_TAG_SIZE)
+			goto end;
+		last = r < sizeof ibuf;
+		r -= GCM_TAG_SIZE;
+
+		crypto_chunk_nonce(iv, chunk, last, nonce, aad);
+		if (!EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, cp.key,
+		    nonce) ||
+		    !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG,
+		    GCM_TAG_SIZE, ibuf + r) ||
+		    !EVP_DecryptUpdate(ctx, NULL, &len, aad, sizeof aad) ||
+		    !EVP_DecryptUpdate(ctx, obuf, &len, ibuf, r) ||
+		    !EVP_DecryptFinal_ex(ctx, obuf + len, &flen))
 			goto end;
-		if (len && fwrite(obuf, len, 1, out) != 1)
+		len += flen;
+		if (len && !cb(arg, obuf, len))
 			goto end;
 	}
-	if (!feof(in))
-		goto end;
 
-	/* finalize and write last chunk if any */
-	if (!EVP_EncryptFinal_ex(ctx, obuf, &len))
-		goto end;
-	if (len && fwrite(obuf, len, 1, out) != 1)
+	/* nothing may follow the last chunk */
+	if (fgetc(in) != EOF || ferror(in))
 		goto end;
 
-	/* get and append tag */
-	EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, sizeof tag, tag);
-	if (fwrite(tag, sizeof tag, 1, out) != 1)
-		goto end;
-
-	fflush(out);
 	ret = 1;
 
 end:
@@ -123,8 +254,10 @@ end:
 	return ret;
 }
 
-int
-crypto_decrypt_file(FILE * in, FILE * out)
+/* files written before the chunked format, past their version byte */
+static int
+crypto_decrypt_file_v1(FILE * in, int (*cb)(void *, const void *, size_t),
+    void *arg)
 {
 	EVP_CIPHER_CTX	*ctx;
 	uint8_t		ibuf[CRYPTO_BUFFER_SIZE];
@@ -134,6 +267,7 @@ crypto_decrypt_file(FILE * in, FILE * out)
 	uint8_t		version;
 	size_t		r;
 	off_t		sz;
+	off_t		pos;
 	int		len;
 	int		ret = 0;
 	struct stat	sb;
@@ -146,18 +280,14 @@ crypto_decrypt_file(FILE * in, FILE * out)
 	sz = sb.st_size;
 
 	/* extract tag */
+	if ((pos = ftello(in)) == -1)
+		return 0;
 	if (fseek(in, -sizeof(tag), SEEK_END) == -1)
 		return 0;
 	if ((r = fread(tag, 1, sizeof tag, in)) != sizeof tag)
 		return 0;
 
-	if (fseek(in, 0, SEEK_SET) == -1)
-		return 0;
-
-	/* extract version */
-	if ((r = fread(&version, 1, sizeof version, in)) != sizeof version)
-		return 0;
-	if (version != API_VERSION)
+	if (fseeko(in, pos, SEEK_SET) == -1)
 		return 0;
 
 	/* extract IV */
@@ -189,7 +319,7 @@ crypto_decrypt_file(FILE * in, FILE * out)
 			break;
 		if (!EVP_DecryptUpdate(ctx, obuf, &len, ibuf, r))
 			goto end;
-		if (len && fwrite(obuf, len, 1, out) != 1)
+		if (len && !cb(arg, obuf, len))
 			goto end;
 		sz -= r;
 	}
@@ -199,10 +329,9 @@ crypto_decrypt_file(FILE * in, FILE * out)
 	/* finalize, write last chunk if any and perform authentication check */
 	if (!EVP_DecryptFinal_ex(ctx, obuf, &len))
 		goto end;
-	if (len && fwrite(obuf, len, 1, out) != 1)
+	if (len && !cb(arg, obuf, len))
 		goto end;
 
-	fflush(out);
 	ret = 1;
 
 end:
@@ -210,6 +339,87 @@ end:
 	return ret;
 }
 
+/*
+ * Incremental variant of crypto_encrypt_file() producing the same output
+ * format, for callers that generate the plaintext on the fly.
+ */
+void *
+crypto_encrypt_stream_begin(FILE *out)
+{
+	struct crypto_stream	*cs;
+	uint8_t			 version = API_VERSION_CHUNKED;
+
+	/* prepend version byte*/
+	if (fwrite(&version, 1, sizeof version, out) != sizeof version)
+		return NULL;
+
+	if ((cs = calloc(1, sizeof *cs)) == NULL)
+		return NULL;
+	if ((cs->ctx = EVP_CIPHER_CTX_new()) == NULL) {
+		free(cs);
+		return NULL;
+	}
+	cs->out = out;
+
+	/* generate and prepend IV */
+	arc4random_buf(cs->iv, sizeof cs->iv);
+	if (fwrite(cs->iv, 1, sizeof cs->iv, out) != sizeof cs->iv) {
+		EVP_CIPHER_CTX_free(cs->ctx);
+		free(cs);
+		return NULL;
+	}
+
+	return cs;
+}
+
+int
+crypto_encrypt_stream_write(void *hdl, const void *buf, size_t len)
+{
+	struct crypto_stream	*cs = hdl;
+	const uint8_t		*in = buf;
+	size_t			 n;
+
+	while (len && !cs->error) {
+		/* a full chunk is only sealed once more data follows */
+		if (cs->len == sizeof cs->buf && !crypto_seal_chunk(cs, 0)) {
+			cs->error = 1;
+			break;
+		}
+		n = MIN(len, sizeof cs->buf - cs->len);
+		memcpy(cs->buf + cs->len, in, n);
+		cs->len += n;
+		in += n;
+		len -= n;
+	}
+
+	return !cs->error;
+}
+
+int
+crypto_encrypt_stream_end(void *hdl)
+{
+	struct crypto_stream	*cs = hdl;
+	int			 ret = 0;
+
+	if (cs->error)
+		goto end;
+
+	/* the last chunk must be short so that readers can tell */
+	if (cs->len == sizeof cs->buf && !crypto_seal_chunk(cs, 0))
+		goto end;
+	if (!crypto_seal_chunk(cs, 1))
+		goto end;
+
+	if (fflush(cs->out) == 0)
+		ret = 1;
+
+end:
+	explicit_bzero(cs->buf, sizeof cs->buf);
+	EVP_CIPHER_CTX_free(cs->ctx);
+	free(cs);
+	return ret;
+}
+
 size_t
 crypto_encrypt_buffer(const char *in, size_t inlen, char *out, size_t outlen)
 {
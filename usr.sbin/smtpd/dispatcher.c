@@ -34,18 +34,26 @@
 #include <unistd.h>
 
 #include "smtpd.h"
+#include "iobuf.h"
 #include "log.h"
 
+#define	IOBUF_STAT_INTERVAL	10
+
 void mda_imsg(struct mproc *, struct imsg *);
 void mta_imsg(struct mproc *, struct imsg *);
 void smtp_imsg(struct mproc *, struct imsg *);
 
 static void dispatcher_shutdown(void);
+static void dispatcher_memory(enum memory_level);
+static void dispatcher_iobuf_stat(int, short, void *);
+
+static struct event	ev_iobuf_stat;
 
 void
 dispatcher_imsg(struct mproc *p, struct imsg *imsg)
 {
 	struct msg	m;
+	uint32_t	in, out;
 	int		v;
 
 	if (imsg == NULL)
@@ -60,6 +68,12 @@ dispatcher_imsg(struct mproc *p, struct imsg *imsg)
 		resolver_dispatch_result(p, imsg);
 		return;
 
+	case IMSG_CA_RSA_PRIVENC:
+	case IMSG_CA_RSA_PRIVDEC:
+	case IMSG_CA_ECDSA_SIGN:
+		ca_dispatch_result(p, imsg);
+		return;
+
 	case IMSG_CONF_START:
 		return;
 	case IMSG_CONF_END:
@@ -77,23 +91,43 @@ dispatcher_imsg(struct mproc *p, struct imsg *imsg)
 		m_end(&m);
 		profiling = v;
 		return;
+	case IMSG_CTL_SHOW_PROFILE:
+		profile_show(p, imsg->hdr.peerid);
+		return;
+	case IMSG_REPORT_SMTP_EVENTS:
+		m_msg(&m, imsg);
+		m_get_u32(&m, &in);
+		m_get_u32(&m, &out);
+		m_end(&m);
+		report_smtp_events(in, out);
+		return;
 
 	/* smtp imsg */
 	case IMSG_SMTP_CHECK_SENDER:
 	case IMSG_SMTP_EXPAND_RCPT:
 	case IMSG_SMTP_LOOKUP_HELO:
+	case IMSG_SMTP_LOOKUP_PKI:
+	case IMSG_CA_LOAD_PKI:
 	case IMSG_SMTP_AUTHENTICATE:
 	case IMSG_SMTP_MESSAGE_COMMIT:
 	case IMSG_SMTP_MESSAGE_CREATE:
 	case IMSG_SMTP_MESSAGE_OPEN:
+	case IMSG_CA_DKIM_SIGN:
 	case IMSG_FILTER_SMTP_PROTOCOL:
 	case IMSG_FILTER_SMTP_DATA_BEGIN:
+	case IMSG_FILTER_SMTP_PHASES:
 	case IMSG_QUEUE_ENVELOPE_SUBMIT:
 	case IMSG_QUEUE_ENVELOPE_COMMIT:
+	case IMSG_QUEUE_PRESSURE:
+	case IMSG_TLS_READY:
+	case IMSG_TLS_FAIL:
 	case IMSG_QUEUE_SMTP_SESSION:
 	case IMSG_CTL_SMTP_SESSION:
 	case IMSG_CTL_PAUSE_SMTP:
 	case IMSG_CTL_RESUME_SMTP:
+	case IMSG_RELOAD_LISTENER:
+	case IMSG_RELOAD_ABORT:
+	case IMSG_RELOAD_DRAIN:
 		smtp_imsg(p, imsg);
 		return;
 
@@ -107,6 +141,7 @@ dispatcher_imsg(struct mproc *p, struct imsg *imsg)
 	case IMSG_MTA_DNS_HOST:
 	case IMSG_MTA_DNS_HOST_END:
 	case IMSG_MTA_DNS_MX_PREFERENCE:
+	case IMSG_LKA_TABLE_CHANGED:
 	case IMSG_CTL_RESUME_ROUTE:
 	case IMSG_CTL_MTA_SHOW_HOSTS:
 	case IMSG_CTL_MTA_SHOW_RELAYS:
@@ -115,6 +150,7 @@ dispatcher_imsg(struct mproc *p, struct imsg *imsg)
 	case IMSG_CTL_MTA_BLOCK:
 	case IMSG_CTL_MTA_UNBLOCK:
 	case IMSG_CTL_MTA_SHOW_BLOCK:
+	case IMSG_CTL_MTA_SHOW_DESTINATIONS:
 		mta_imsg(p, imsg);
 		return;
 
@@ -124,6 +160,7 @@ dispatcher_imsg(struct mproc *p, struct imsg *imsg)
 	case IMSG_MDA_OPEN_MESSAGE:
 	case IMSG_MDA_FORK:
 	case IMSG_MDA_DONE:
+	case IMSG_MDA_LMTP_CONNECT:
 		mda_imsg(p, imsg);
 		return;
 	default:
@@ -133,6 +170,31 @@ dispatcher_imsg(struct mproc *p, struct imsg *imsg)
 	fatalx("session_imsg: unexpected %s imsg", imsg_to_str(imsg->hdr.type));
 }
 
+static void
+dispatcher_iobuf_stat(int fd, short ev, void *arg)
+{
+	struct iobuf_stats	st;
+	struct timeval		tv;
+
+	iobuf_pool_stats(&st);
+	stat_set("dispatcher.iobuf.chunk.allocated", stat_counter(st.allocated));
+	stat_set("dispatcher.iobuf.chunk.cached", stat_counter(st.cached));
+	stat_set("dispatcher.iobuf.bytes.cached", stat_counter(st.cached_bytes));
+	stat_set("dispatcher.iobuf.bytes.recycled",
+	    stat_counter(st.recycled_bytes));
+
+	tv.tv_sec = IOBUF_STAT_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_iobuf_stat, &tv);
+}
+
+static void
+dispatcher_memory(enum memory_level level)
+{
+	mta_memory(level);
+	smtp_memory(level);
+}
+
 static void
 dispatcher_shutdown(void)
 {
@@ -148,7 +210,8 @@ dispatcher(void)
 	ca_engine_init();
 
 	mda_postfork();
-	mta_postfork();
+	if (env->sc_mta_workers == 0)
+		mta_postfork();
 	smtp_postfork();
 
 	/* do not purge listeners and pki, they are purged
@@ -186,8 +249,17 @@ dispatcher(void)
 	config_peer(PROC_PARENT);
 	config_peer(PROC_QUEUE);
 	config_peer(PROC_LKA);
+	config_peer(PROC_RESOLVER);
 	config_peer(PROC_CONTROL);
 	config_peer(PROC_CA);
+	config_peer(PROC_LAUNCHER);
+	config_peer(PROC_LOGGER);
+	config_peer(PROC_TLS);
+	stat_cpu_start(NULL);
+	memory_start(NULL, dispatcher_memory);
+
+	evtimer_set(&ev_iobuf_stat, dispatcher_iobuf_stat, NULL);
+	dispatcher_iobuf_stat(-1, 0, NULL);
 
 #if HAVE_PLEDGE
 	if (pledge("stdio inet unix recvfd sendfd", NULL) == -1)
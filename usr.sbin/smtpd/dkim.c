@@ -0,0 +1,480 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * DKIM signing (RFC 6376), relaxed/relaxed, fed by the spool writer.
+ *
+ * The body hash is computed as the body is written to the spool, and
+ * only the header fields that are signed are kept in memory.  Since the
+ * length of the DKIM-Signature header only depends on the key, a
+ * placeholder of the final length is written first and the signature
+ * is written over it once the CA process has signed the header hash.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+
+#include "smtpd.h"
+#include "log.h"
+#include "ssl.h"
+
+#define	DKIM_FOLD	64	/* base64 characters per b= line */
+
+struct dkim_field {
+	char			*data;
+	size_t			 len;
+	int			 used;
+};
+
+struct dkim_sign {
+	const struct dkim	*dkim;
+	time_t			 time;
+
+	EVP_MD_CTX		*body;
+	size_t			 blanks;
+	int			 inbody;
+
+	char			*line;
+	size_t			 linelen;
+	size_t			 linesz;
+
+	struct dkim_field	*fields;
+	size_t			 nfields;
+	size_t			 fieldsz;
+	int			 cur;
+
+	char			*placeholder;
+	size_t			 len;
+	char			 bh[64];
+};
+
+static const char *dkim_headers[] = {
+	"from",
+	"reply-to",
+	"subject",
+	"date",
+	"to",
+	"cc",
+	"message-id",
+	"in-reply-to",
+	"references",
+	"mime-version",
+	"content-type",
+	"content-transfer-encoding",
+	NULL
+};
+
+static const char *dkim_algorithm(const struct dkim *);
+static char *dkim_format(struct dkim_sign *, const char *, const char *);
+static void dkim_header_line(struct dkim_sign *, const char *, size_t);
+static int dkim_canon_header(EVP_MD_CTX *, const char *, size_t, int);
+static int dkim_signed(const char *, size_t);
+
+struct dkim_sign *
+dkim_sign_new(const struct dkim *dkim, time_t t)
+{
+	struct dkim_sign	*ds;
+	char			*bh, *b;
+	size_t			 blen;
+
+	ds = xcalloc(1, sizeof(*ds));
+	ds->dkim = dkim;
+	ds->time = t;
+	ds->cur = -1;
+
+	if ((ds->body = EVP_MD_CTX_new()) == NULL ||
+	    !EVP_DigestInit_ex(ds->body, EVP_sha256(), NULL)) {
+		EVP_MD_CTX_free(ds->body);
+		free(ds);
+		return NULL;
+	}
+
+	/* same length as the real thing, the values do not matter */
+	blen = 4 * ((dkim->dkim_siglen + 2) / 3);
+	bh = xmalloc(44 + 1);
+	memset(bh, 'A', 44);
+	bh[44] = '\0';
+	b = xmalloc(blen + 1);
+	memset(b, 'A', blen);
+	b[blen] = '\0';
+	ds->placeholder = dkim_format(ds, bh, b);
+	ds->len = strlen(ds->placeholder);
+	free(bh);
+	free(b);
+
+	return ds;
+}
+
+void
+dkim_sign_free(struct dkim_sign *ds)
+{
+	size_t	i;
+
+	if (ds == NULL)
+		return;
+
+	EVP_MD_CTX_free(ds->body);
+	for (i = 0; i < ds->nfields; i++)
+		free(ds->fields[i].data);
+	free(ds->fields);
+	free(ds->line);
+	free(ds->placeholder);
+	free(ds);
+}
+
+/*
+ * The header to write at the top of the message until it is signed.
+ */
+const char *
+dkim_sign_placeholder(struct dkim_sign *ds, size_t *len)
+{
+	*len = ds->len;
+	return ds->placeholder;
+}
+
+/*
+ * Header data, as written to the spool.  It may come in pieces that
+ * are not whole lines.
+ */
+void
+dkim_sign_header(struct dkim_sign *ds, const char *data, size_t len)
+{
+	const char	*nl;
+	size_t		 n;
+
+	while (len) {
+		nl = memchr(data, '\n', len);
+		n = nl ? (size_t)(nl - data) : len;
+
+		if (ds->linelen + n + 1 > ds->linesz) {
+			ds->linesz = ds->linelen + n + 128;
+			if ((ds->line = realloc(ds->line, ds->linesz)) == NULL)
+				fatal("dkim_sign_header: realloc");
+		}
+		memcpy(ds->line + ds->linelen, data, n);
+		ds->linelen += n;
+		if (nl == NULL)
+			return;
+
+		dkim_header_line(ds, ds->line, ds->linelen);
+		ds->linelen = 0;
+		data += n + 1;
+		len -= n + 1;
+	}
+}
+
+static void
+dkim_header_line(struct dkim_sign *ds, const char *line, size_t len)
+{
+	struct dkim_field	*f;
+	const char		*colon;
+
+	if (len && (line[0] == ' ' || line[0] == '\t')) {
+		if (ds->cur == -1)
+			return;
+		f = &ds->fields[ds->cur];
+		if ((f->data = realloc(f->data, f->len + len + 2)) == NULL)
+			fatal("dkim_header_line: realloc");
+		f->data[f->len++] = '\n';
+		memcpy(f->data + f->len, line, len);
+		f->len += len;
+		f->data[f->len] = '\0';
+		return;
+	}
+
+	ds->cur = -1;
+	if ((colon = memchr(line, ':', len)) == NULL)
+		return;
+	if (!dkim_signed(line, colon - line))
+		return;
+
+	if (ds->nfields == ds->fieldsz) {
+		ds->fieldsz = ds->fieldsz ? ds->fieldsz * 2 : 8;
+		ds->fields = reallocarray(ds->fields, ds->fieldsz,
+		    sizeof(*ds->fields));
+		if (ds->fields == NULL)
+			fatal("dkim_header_line: reallocarray");
+	}
+	f = &ds->fields[ds->nfields];
+	f->data = xmalloc(len + 1);
+	memcpy(f->data, line, len);
+	f->data[len] = '\0';
+	f->len = len;
+	f->used = 0;
+	ds->cur = ds->nfields++;
+}
+
+static int
+dkim_signed(const char *name, size_t len)
+{
+	size_t	i;
+
+	while (len && (name[len - 1] == ' ' || name[len - 1] == '\t'))
+		len--;
+
+	for (i = 0; dkim_headers[i]; i++)
+		if (strlen(dkim_headers[i]) == len &&
+		    strncasecmp(dkim_headers[i], name, len) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * A body line, without its line ending.  The first one is the empty
+ * line that separates the body from the headers.
+ */
+void
+dkim_sign_body(struct dkim_sign *ds, const char *line, size_t len)
+{
+	char	buf[1024];
+	size_t	i, n = 0;
+	int	wsp = 0, empty = 1;
+
+	if (!ds->inbody) {
+		ds->inbody = 1;
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (line[i] == ' ' || line[i] == '\t') {
+			wsp = 1;
+			continue;
+		}
+		if (empty) {
+			/* trailing empty lines are not part of the body */
+			for (; ds->blanks; ds->blanks--)
+				EVP_DigestUpdate(ds->body, "\r\n", 2);
+			empty = 0;
+		}
+		if (n + 2 > sizeof(buf)) {
+			EVP_DigestUpdate(ds->body, buf, n);
+			n = 0;
+		}
+		if (wsp)
+			buf[n++] = ' ';
+		buf[n++] = line[i];
+		wsp = 0;
+	}
+
+	if (empty) {
+		ds->blanks++;
+		return;
+	}
+	EVP_DigestUpdate(ds->body, buf, n);
+	EVP_DigestUpdate(ds->body, "\r\n", 2);
+}
+
+/*
+ * Finish the body hash and compute the hash of the signed headers,
+ * which is what the CA process signs.
+ */
+int
+dkim_sign_digest(struct dkim_sign *ds, unsigned char *md, size_t *mdlen)
+{
+	EVP_MD_CTX		*ctx;
+	struct dkim_field	*f;
+	unsigned char		 bh[EVP_MAX_MD_SIZE];
+	unsigned int		 bhlen, len;
+	char			*hdr;
+	size_t			 i, j, n;
+	int			 ret = 0;
+
+	if (ds->linelen)
+		dkim_header_line(ds, ds->line, ds->linelen);
+	ds->linelen = 0;
+
+	if (!EVP_DigestFinal_ex(ds->body, bh, &bhlen))
+		return 0;
+	if (base64_encode(bh, bhlen, ds->bh, sizeof(ds->bh)) == -1)
+		return 0;
+
+	if ((ctx = EVP_MD_CTX_new()) == NULL)
+		return 0;
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+		goto end;
+
+	/* each name selects the last instance not signed yet */
+	for (i = 0; dkim_headers[i]; i++) {
+		n = strlen(dkim_headers[i]);
+		for (j = ds->nfields; j > 0; j--) {
+			f = &ds->fields[j - 1];
+			if (f->used || strncasecmp(f->data, dkim_headers[i], n) ||
+			    (f->data[n] != ':' && f->data[n] != ' ' &&
+			    f->data[n] != '\t'))
+				continue;
+			f->used = 1;
+			if (!dkim_canon_header(ctx, f->data, f->len, 1))
+				goto end;
+			break;
+		}
+	}
+
+	hdr = dkim_format(ds, ds->bh, "");
+	if (!dkim_canon_header(ctx, hdr, strlen(hdr), 0)) {
+		free(hdr);
+		goto end;
+	}
+	free(hdr);
+
+	if (!EVP_DigestFinal_ex(ctx, md, &len))
+		goto end;
+	*mdlen = len;
+	ret = 1;
+end:
+	EVP_MD_CTX_free(ctx);
+	return ret;
+}
+
+/*
+ * The DKIM-Signature header for the signature returned by the CA, or
+ * NULL if it does not fit in the space reserved for it.
+ */
+char *
+dkim_sign_final(struct dkim_sign *ds, const unsigned char *sig, size_t siglen,
+    size_t *len)
+{
+	char	*b, *hdr;
+	size_t	 blen;
+
+	blen = 4 * ((siglen + 2) / 3) + 1;
+	b = xmalloc(blen);
+	if (base64_encode(sig, siglen, b, blen) == -1) {
+		free(b);
+		return NULL;
+	}
+	hdr = dkim_format(ds, ds->bh, b);
+	free(b);
+
+	*len = strlen(hdr);
+	if (*len != ds->len) {
+		log_warnx("warn: dkim: signature for %s does not fit",
+		    ds->dkim->dkim_domain);
+		free(hdr);
+		return NULL;
+	}
+	return hdr;
+}
+
+static const char *
+dkim_algorithm(const struct dkim *dkim)
+{
+#ifdef EVP_PKEY_ED25519
+	if (dkim->dkim_type == EVP_PKEY_ED25519)
+		return "ed25519-sha256";
+#endif
+	return "rsa-sha256";
+}
+
+static char *
+dkim_format(struct dkim_sign *ds, const char *bh, const char *b)
+{
+	char	 h[256], *hdr, *p;
+	size_t	 i, blen, sz;
+	int	 n;
+
+	h[0] = '\0';
+	for (i = 0; dkim_headers[i]; i++) {
+		if (i)
+			(void)strlcat(h, ":", sizeof(h));
+		(void)strlcat(h, dkim_headers[i], sizeof(h));
+	}
+
+	/* fold the signature so that no line gets too long */
+	blen = strlen(b);
+	sz = 512 + strlen(ds->dkim->dkim_domain) +
+	    strlen(ds->dkim->dkim_selector) + strlen(h) + strlen(bh) +
+	    blen + 3 * (blen / DKIM_FOLD + 1);
+	hdr = xmalloc(sz);
+	n = snprintf(hdr, sz, "DKIM-Signature: v=1; a=%s; c=relaxed/relaxed;"
+	    "\n\td=%s; s=%s; t=%lld;\n\th=%s;\n\tbh=%s;\n\tb=",
+	    dkim_algorithm(ds->dkim), ds->dkim->dkim_domain,
+	    ds->dkim->dkim_selector, (long long)ds->time, h, bh);
+	if (n < 0 || (size_t)n >= sz)
+		fatalx("dkim_format: header too long");
+
+	p = hdr + n;
+	for (i = 0; i < blen; i += DKIM_FOLD) {
+		if (i) {
+			memcpy(p, "\n\t ", 3);
+			p += 3;
+		}
+		n = blen - i < DKIM_FOLD ? blen - i : DKIM_FOLD;
+		memcpy(p, b + i, n);
+		p += n;
+	}
+	*p = '\0';
+
+	return hdr;
+}
+
+/*
+ * Relaxed header canonicalization: lowercase name, unfolded value with
+ * runs of whitespace reduced to a single space and none around the
+ * colon or at the end.
+ */
+static int
+dkim_canon_header(EVP_MD_CTX *ctx, const char *field, size_t len, int crlf)
+{
+	char		*buf;
+	size_t		 i, n = 0;
+	int		 wsp = 0, start = 1, ret;
+	const char	*colon;
+
+	if ((colon = memchr(field, ':', len)) == NULL)
+		return 0;
+
+	buf = xmalloc(len + 3);
+	for (i = 0; field + i < colon; i++) {
+		if (field[i] == ' ' || field[i] == '\t')
+			continue;
+		buf[n++] = tolower((unsigned char)field[i]);
+	}
+	buf[n++] = ':';
+
+	for (i = colon - field + 1; i < len; i++) {
+		if (field[i] == '\r' || field[i] == '\n')
+			continue;
+		if (field[i] == ' ' || field[i] == '\t') {
+			wsp = 1;
+			continue;
+		}
+		if (wsp && !start)
+			buf[n++] = ' ';
+		wsp = start = 0;
+		buf[n++] = field[i];
+	}
+	if (crlf) {
+		buf[n++] = '\r';
+		buf[n++] = '\n';
+	}
+
+	ret = EVP_DigestUpdate(ctx, buf, n);
+	free(buf);
+	return ret;
+}
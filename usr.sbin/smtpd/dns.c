@@ -32,6 +32,7 @@
 #include <netdb.h>
 
 #include <asr.h>
+#include <ctype.h>
 #include <event.h>
 #include <netdb.h>
 #include <resolv.h>
@@ -39,11 +40,48 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "smtpd.h"
 #include "log.h"
 #include "unpack_dns.h"
 
+/*
+ * Complete answers to MX and host requests are cached for the smallest
+ * MX TTL seen, bounded to DNS_CACHE_ADDR_TTL since getaddrinfo does not
+ * report the TTL of the addresses it returns.  Negative answers use the
+ * SOA minimum of the zone, or DNS_CACHE_NEGATIVE_TTL.  Temporary
+ * failures are never cached.  An entry hit DNS_CACHE_PREFETCH_HITS
+ * times is refreshed in the background when it enters the last
+ * 1/DNS_CACHE_PREFETCH_RATIO of its lifetime, so that busy domains do
+ * not stall on expiry.
+ */
+#define	DNS_CACHE_MAX			4096
+#define	DNS_CACHE_TTL_MIN		30
+#define	DNS_CACHE_ADDR_TTL		300
+#define	DNS_CACHE_NEGATIVE_TTL		300
+#define	DNS_CACHE_PREFETCH_HITS		2
+#define	DNS_CACHE_PREFETCH_RATIO	10
+
+struct dns_cache_host {
+	char			*host;
+	struct sockaddr_storage	 ss;
+	int			 preference;
+};
+
+struct dns_cache_entry {
+	TAILQ_ENTRY(dns_cache_entry)	 entry;
+	char				*key;
+	int				 type;
+	time_t				 created;
+	time_t				 expire;
+	size_t				 hits;
+	int				 refreshing;
+	int				 error;
+	struct dns_cache_host		*hosts;
+	size_t				 hostcount;
+};
+
 struct dns_lookup {
 	struct dns_session	*session;
 	char			*host;
@@ -58,12 +96,27 @@ struct dns_session {
 	size_t			 mxfound;
 	int			 error;
 	int			 refcount;
+	uint32_t		 ttl;
+	struct dns_cache_host	*hosts;
+	size_t			 hostcount;
 };
 
+static void dns_query(struct dns_session *);
 static void dns_lookup_host(struct dns_session *, const char *, int);
 static void dns_dispatch_host(struct asr_result *, void *);
 static void dns_dispatch_mx(struct asr_result *, void *);
 static void dns_dispatch_mx_preference(struct asr_result *, void *);
+static void dns_reply_host(struct dns_session *, const char *,
+    const struct sockaddr *, int);
+static void dns_reply_end(struct dns_session *, int);
+static int dns_cache_key(int, const char *, char *, size_t);
+static int dns_cache_reply(struct dns_session *);
+static void dns_cache_set(struct dns_session *, int);
+static void dns_cache_remove(struct dns_cache_entry *);
+
+static struct dict	dns_cache;
+static TAILQ_HEAD(dns_cache_lru, dns_cache_entry) dns_cache_lru;
+static int		dns_cache_inited;
 
 static int
 domainname_is_addr(const char *s, struct sockaddr *sa, socklen_t *sl)
@@ -134,7 +187,10 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 	case IMSG_MTA_DNS_HOST:
 		m_get_string(&m, &host);
 		m_end(&m);
-		dns_lookup_host(s, host, -1);
+		(void)strlcpy(s->name, host, sizeof(s->name));
+		if (dns_cache_reply(s))
+			return;
+		dns_query(s);
 		return;
 
 	case IMSG_MTA_DNS_MX:
@@ -161,18 +217,9 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 		}
 
-		as = res_query_async(s->name, C_IN, T_MX, NULL);
-		if (as == NULL) {
-			log_warn("warn: res_query_async: %s", s->name);
-			m_create(s->p, IMSG_MTA_DNS_HOST_END, 0, 0, -1);
-			m_add_id(s->p, s->reqid);
-			m_add_int(s->p, DNS_EINVAL);
-			m_close(s->p);
-			free(s);
+		if (dns_cache_reply(s))
 			return;
-		}
-
-		event_asr_run(as, dns_dispatch_mx, s);
+		dns_query(s);
 		return;
 
 	case IMSG_MTA_DNS_MX_PREFERENCE:
@@ -200,6 +247,32 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 	}
 }
 
+/*
+ * Start resolving a host or MX session.  The session has no process to
+ * reply to when it only refreshes a cache entry.
+ */
+static void
+dns_query(struct dns_session *s)
+{
+	struct asr_query	*as;
+
+	s->ttl = DNS_CACHE_ADDR_TTL;
+
+	if (s->type == IMSG_MTA_DNS_HOST) {
+		dns_lookup_host(s, s->name, -1);
+		return;
+	}
+
+	as = res_query_async(s->name, C_IN, T_MX, NULL);
+	if (as == NULL) {
+		log_warn("warn: res_query_async: %s", s->name);
+		dns_reply_end(s, DNS_EINVAL);
+		return;
+	}
+
+	event_asr_run(as, dns_dispatch_mx, s);
+}
+
 static void
 dns_dispatch_host(struct asr_result *ar, void *arg)
 {
@@ -211,12 +284,8 @@ dns_dispatch_host(struct asr_result *ar, void *arg)
 
 	for (ai = ar->ar_addrinfo; ai; ai = ai->ai_next) {
 		s->mxfound++;
-		m_create(s->p, IMSG_MTA_DNS_HOST, 0, 0, -1);
-		m_add_id(s->p, s->reqid);
-		m_add_string(s->p, lookup->host);
-		m_add_sockaddr(s->p, ai->ai_addr);
-		m_add_int(s->p, lookup->preference);
-		m_close(s->p);
+		dns_reply_host(s, lookup->host, ai->ai_addr,
+		    lookup->preference);
 	}
 	free(lookup->host);
 	free(lookup);
@@ -229,11 +298,7 @@ dns_dispatch_host(struct asr_result *ar, void *arg)
 	if (--s->refcount)
 		return;
 
-	m_create(s->p, IMSG_MTA_DNS_HOST_END, 0, 0, -1);
-	m_add_id(s->p, s->reqid);
-	m_add_int(s->p, s->mxfound ? DNS_OK : DNS_ENOTFOUND);
-	m_close(s->p);
-	free(s);
+	dns_reply_end(s, s->mxfound ? DNS_OK : DNS_ENOTFOUND);
 }
 
 static void
@@ -250,16 +315,30 @@ dns_dispatch_mx(struct asr_result *ar, void *arg)
 
 	if (ar->ar_h_errno && ar->ar_h_errno != NO_DATA &&
 	    ar->ar_h_errno != NOTIMP) {
-		m_create(s->p,  IMSG_MTA_DNS_HOST_END, 0, 0, -1);
-		m_add_id(s->p, s->reqid);
-		if (ar->ar_rcode == NXDOMAIN)
-			m_add_int(s->p, DNS_ENONAME);
+		if (ar->ar_rcode == NXDOMAIN) {
+			/* negative answers live for the SOA minimum */
+			s->ttl = DNS_CACHE_NEGATIVE_TTL;
+			unpack_init(&pack, ar->ar_data, ar->ar_datalen);
+			if (unpack_header(&pack, &h) != -1 &&
+			    unpack_query(&pack, &q) != -1) {
+				for (; h.ancount; h.ancount--)
+					if (unpack_rr(&pack, &rr) == -1)
+						break;
+				for (; h.nscount; h.nscount--) {
+					if (unpack_rr(&pack, &rr) == -1)
+						break;
+					if (rr.rr_type != T_SOA)
+						continue;
+					s->ttl = rr.rr_ttl < rr.rr.soa.minimum ?
+					    rr.rr_ttl : rr.rr.soa.minimum;
+				}
+			}
+			dns_reply_end(s, DNS_ENONAME);
+		}
 		else if (ar->ar_h_errno == NO_RECOVERY)
-			m_add_int(s->p, DNS_EINVAL);
+			dns_reply_end(s, DNS_EINVAL);
 		else
-			m_add_int(s->p, DNS_RETRY);
-		m_close(s->p);
-		free(s);
+			dns_reply_end(s, DNS_RETRY);
 		free(ar->ar_data);
 		return;
 	}
@@ -274,6 +353,9 @@ dns_dispatch_mx(struct asr_result *ar, void *arg)
 		if (rr.rr_type != T_MX)
 			continue;
 
+		if (rr.rr_ttl < s->ttl)
+			s->ttl = rr.rr_ttl;
+
 		print_dname(rr.rr.mx.exchange, buf, sizeof(buf));
 		buf[strlen(buf) - 1] = '\0';
 
@@ -289,11 +371,7 @@ dns_dispatch_mx(struct asr_result *ar, void *arg)
 	free(ar->ar_data);
 
 	if (nullmx && found == 0) {
-		m_create(s->p, IMSG_MTA_DNS_HOST_END, 0, 0, -1);
-		m_add_id(s->p, s->reqid);
-		m_add_int(s->p, DNS_NULLMX);
-		m_close(s->p);
-		free(s);
+		dns_reply_end(s, DNS_NULLMX);
 		return;
 	}
 
@@ -301,7 +379,6 @@ dns_dispatch_mx(struct asr_result *ar, void *arg)
 	if (found == 0)
 		dns_lookup_host(s, s->name, 0);
 }
-
 static void
 dns_dispatch_mx_preference(struct asr_result *ar, void *arg)
 {
@@ -385,3 +462,199 @@ dns_lookup_host(struct dns_session *s, const char *host, int preference)
 	as = getaddrinfo_async(host, NULL, &hints, NULL);
 	event_asr_run(as, dns_dispatch_host, lookup);
 }
+
+static void
+dns_reply_host(struct dns_session *s, const char *host,
+    const struct sockaddr *sa, int preference)
+{
+	struct dns_cache_host	*h;
+
+	if (s->p) {
+		m_create(s->p, IMSG_MTA_DNS_HOST, 0, 0, -1);
+		m_add_id(s->p, s->reqid);
+		m_add_string(s->p, host);
+		m_add_sockaddr(s->p, sa);
+		m_add_int(s->p, preference);
+		m_close(s->p);
+	}
+
+	if (SA_LEN(sa) > sizeof(h->ss))
+		return;
+	s->hosts = reallocarray(s->hosts, s->hostcount + 1, sizeof(*s->hosts));
+	if (s->hosts == NULL)
+		fatal("reallocarray");
+	h = &s->hosts[s->hostcount++];
+	h->host = xstrdup(host);
+	memset(&h->ss, 0, sizeof(h->ss));
+	memcpy(&h->ss, sa, SA_LEN(sa));
+	h->preference = preference;
+}
+
+static void
+dns_reply_end(struct dns_session *s, int error)
+{
+	struct dns_cache_entry	*e;
+	char			 key[HOST_NAME_MAX+8];
+	size_t			 i;
+
+	if (s->p) {
+		m_create(s->p, IMSG_MTA_DNS_HOST_END, 0, 0, -1);
+		m_add_id(s->p, s->reqid);
+		m_add_int(s->p, error);
+		m_close(s->p);
+	}
+
+	/*
+	 * An answer is only final if no host lookup failed for another
+	 * reason than the name not existing.
+	 */
+	switch (error) {
+	case DNS_OK:
+	case DNS_ENOTFOUND:
+		if (s->error && s->error != EAI_NONAME)
+			break;
+		/* FALLTHROUGH */
+	case DNS_ENONAME:
+	case DNS_NULLMX:
+		dns_cache_set(s, error);
+		break;
+	default:
+		/* let a failed refresh be retried on the next hit */
+		if (s->p == NULL &&
+		    dns_cache_key(s->type, s->name, key, sizeof key) &&
+		    (e = dict_get(&dns_cache, key)) != NULL)
+			e->refreshing = 0;
+		break;
+	}
+
+	for (i = 0; i < s->hostcount; i++)
+		free(s->hosts[i].host);
+	free(s->hosts);
+	free(s);
+}
+
+static int
+dns_cache_key(int type, const char *name, char *buf, size_t len)
+{
+	char	*p;
+
+	if (!bsnprintf(buf, len, "%s:%s",
+	    type == IMSG_MTA_DNS_MX ? "mx" : "host", name))
+		return 0;
+	for (p = buf; *p; p++)
+		*p = tolower((unsigned char)*p);
+	return 1;
+}
+
+/*
+ * Answer the session from the cache if possible, and schedule a refresh
+ * of hot entries about to expire.  Returns 1 if the session was answered
+ * and released.
+ */
+static int
+dns_cache_reply(struct dns_session *s)
+{
+	struct dns_cache_entry	*e;
+	struct dns_session	*r;
+	char			 key[HOST_NAME_MAX+8];
+	time_t			 now;
+	size_t			 i;
+
+	if (!dns_cache_inited) {
+		dict_init(&dns_cache);
+		TAILQ_INIT(&dns_cache_lru);
+		dns_cache_inited = 1;
+	}
+
+	if (!dns_cache_key(s->type, s->name, key, sizeof key))
+		return 0;
+
+	now = time(NULL);
+	if ((e = dict_get(&dns_cache, key)) == NULL || e->expire <= now) {
+		if (e && !e->refreshing)
+			dns_cache_remove(e);
+		stat_increment("resolver.dns.cache.miss", 1);
+		return 0;
+	}
+	stat_increment("resolver.dns.cache.hit", 1);
+
+	TAILQ_REMOVE(&dns_cache_lru, e, entry);
+	TAILQ_INSERT_HEAD(&dns_cache_lru, e, entry);
+
+	for (i = 0; i < e->hostcount; i++) {
+		m_create(s->p, IMSG_MTA_DNS_HOST, 0, 0, -1);
+		m_add_id(s->p, s->reqid);
+		m_add_string(s->p, e->hosts[i].host);
+		m_add_sockaddr(s->p, (struct sockaddr *)&e->hosts[i].ss);
+		m_add_int(s->p, e->hosts[i].preference);
+		m_close(s->p);
+	}
+	m_create(s->p, IMSG_MTA_DNS_HOST_END, 0, 0, -1);
+	m_add_id(s->p, s->reqid);
+	m_add_int(s->p, e->error);
+	m_close(s->p);
+
+	if (++e->hits >= DNS_CACHE_PREFETCH_HITS && !e->refreshing &&
+	    (e->expire - now) * DNS_CACHE_PREFETCH_RATIO <=
+	    e->expire - e->created) {
+		log_debug("debug: dns: prefetching %s", e->key);
+		stat_increment("resolver.dns.cache.prefetch", 1);
+		e->refreshing = 1;
+		r = xcalloc(1, sizeof *r);
+		r->type = s->type;
+		(void)strlcpy(r->name, s->name, sizeof(r->name));
+		dns_query(r);
+	}
+
+	free(s);
+	return 1;
+}
+
+static void
+dns_cache_set(struct dns_session *s, int error)
+{
+	struct dns_cache_entry	*e;
+	char			 key[HOST_NAME_MAX+8];
+	uint32_t		 ttl;
+
+	if (!dns_cache_key(s->type, s->name, key, sizeof key))
+		return;
+
+	if ((e = dict_get(&dns_cache, key)) != NULL)
+		dns_cache_remove(e);
+	if (dict_count(&dns_cache) >= DNS_CACHE_MAX)
+		dns_cache_remove(TAILQ_LAST(&dns_cache_lru, dns_cache_lru));
+
+	ttl = s->ttl;
+	if (error == DNS_ENOTFOUND && ttl > DNS_CACHE_NEGATIVE_TTL)
+		ttl = DNS_CACHE_NEGATIVE_TTL;
+	if (ttl < DNS_CACHE_TTL_MIN)
+		ttl = DNS_CACHE_TTL_MIN;
+
+	e = xcalloc(1, sizeof *e);
+	e->key = xstrdup(key);
+	e->type = s->type;
+	e->created = time(NULL);
+	e->expire = e->created + ttl;
+	e->error = error;
+	e->hosts = s->hosts;
+	e->hostcount = s->hostcount;
+	s->hosts = NULL;
+	s->hostcount = 0;
+	dict_xset(&dns_cache, e->key, e);
+	TAILQ_INSERT_HEAD(&dns_cache_lru, e, entry);
+}
+
+static void
+dns_cache_remove(struct dns_cache_entry *e)
+{
+	size_t	i;
+
+	dict_xpop(&dns_cache, e->key);
+	TAILQ_REMOVE(&dns_cache_lru, e, entry);
+	for (i = 0; i < e->hostcount; i++)
+		free(e->hosts[i].host);
+	free(e->hosts);
+	free(e->key);
+	free(e);
+}
@@ -0,0 +1,294 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#include <asr.h>
+#include <event.h>
+#include <imsg.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "smtpd.h"
+#include "log.h"
+#include "unpack_dns.h"
+
+/*
+ * Answers are cached per reversed address and zone for the TTL of the
+ * record, or of the zone SOA for negative answers, bounded to
+ * DNSBL_TTL_MIN and DNSBL_TTL_MAX.  Failed lookups are not cached and
+ * count as not listed.
+ */
+#define	DNSBL_CACHE_MAX		4096
+#define	DNSBL_TTL_MIN		30
+#define	DNSBL_TTL_MAX		3600
+#define	DNSBL_TTL_NEGATIVE	300
+
+struct dnsbl_entry {
+	TAILQ_ENTRY(dnsbl_entry)	 entry;
+	char				*key;
+	time_t				 expire;
+	int				 listed;
+};
+
+struct dnsbl_query {
+	void		       (*cb)(void *, int);
+	void			*arg;
+	size_t			 pending;
+	int			 listed;
+	int			 done;
+};
+
+struct dnsbl_lookup {
+	struct dnsbl_query	*query;
+	char			*key;
+};
+
+static int	dnsbl_reverse(const struct sockaddr_storage *, char *, size_t);
+static int	dnsbl_cache_get(const char *);
+static void	dnsbl_cache_set(const char *, int, uint32_t);
+static void	dnsbl_cache_remove(struct dnsbl_entry *);
+static void	dnsbl_dispatch(struct asr_result *, void *);
+static void	dnsbl_done(struct dnsbl_query *);
+
+static struct dict	dnsbl_cache;
+static TAILQ_HEAD(dnsbl_lru, dnsbl_entry) dnsbl_lru;
+static int		dnsbl_inited;
+
+/*
+ * Check whether the address is listed in any of the zones.  Returns 0
+ * or 1 when every zone is answered from the cache, otherwise -1 and cb
+ * is called once with the result after querying the missing zones in
+ * parallel.
+ */
+int
+dnsbl_check(struct table *zones, const struct sockaddr_storage *ss,
+    void (*cb)(void *, int), void *arg)
+{
+	struct dnsbl_query	*q;
+	struct dnsbl_lookup	*l;
+	struct asr_query	*as;
+	const char		*zone;
+	char			 rev[128], key[MAXDNAME];
+	void			*iter;
+	int			 listed = 0, ret;
+
+	if (!dnsbl_inited) {
+		dict_init(&dnsbl_cache);
+		TAILQ_INIT(&dnsbl_lru);
+		dnsbl_inited = 1;
+	}
+
+	if (!dnsbl_reverse(ss, rev, sizeof rev))
+		return 0;
+
+	q = xcalloc(1, sizeof *q);
+	q->cb = cb;
+	q->arg = arg;
+
+	/* hold a reference while issuing queries */
+	q->pending = 1;
+
+	iter = NULL;
+	while ((ret = table_static_iter(zones, K_STRING, &iter, &zone)) > 0) {
+		if (!bsnprintf(key, sizeof key, "%s.%s", rev, zone)) {
+			log_warnx("warn: dnsbl: name too long for zone %s",
+			    zone);
+			continue;
+		}
+
+		if ((ret = dnsbl_cache_get(key)) != -1) {
+			stat_increment("lka.dnsbl.cache.hit", 1);
+			listed |= ret;
+			continue;
+		}
+		stat_increment("lka.dnsbl.cache.miss", 1);
+
+		if ((as = res_query_async(key, C_IN, T_A, NULL)) == NULL) {
+			log_warn("warn: dnsbl: res_query_async: %s", key);
+			continue;
+		}
+		l = xcalloc(1, sizeof *l);
+		l->query = q;
+		l->key = xstrdup(key);
+		q->pending++;
+		event_asr_run(as, dnsbl_dispatch, l);
+	}
+	if (ret == -1)
+		log_warnx("warn: dnsbl: zones must be listed in a static table");
+
+	q->listed = listed;
+	if (--q->pending == 0 || listed) {
+		/* nothing in flight, or already known to be listed */
+		q->done = 1;
+		if (q->pending == 0)
+			free(q);
+		return listed;
+	}
+	return -1;
+}
+
+static int
+dnsbl_reverse(const struct sockaddr_storage *ss, char *buf, size_t len)
+{
+	const uint8_t	*p;
+	char		*s = buf;
+	int		 i, n;
+
+	switch (ss->ss_family) {
+	case AF_INET:
+		p = (const uint8_t *)&((const struct sockaddr_in *)ss)->sin_addr;
+		n = snprintf(buf, len, "%u.%u.%u.%u", p[3], p[2], p[1], p[0]);
+		return n > 0 && (size_t)n < len;
+
+	case AF_INET6:
+		p = (const uint8_t *)&((const struct sockaddr_in6 *)ss)->sin6_addr;
+		if (len < 16 * 4)
+			return 0;
+		for (i = 15; i >= 0; i--) {
+			*s++ = "0123456789abcdef"[p[i] & 0xf];
+			*s++ = '.';
+			*s++ = "0123456789abcdef"[p[i] >> 4];
+			*s++ = '.';
+		}
+		s[-1] = '\0';
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+dnsbl_dispatch(struct asr_result *ar, void *arg)
+{
+	struct dnsbl_lookup	*l = arg;
+	struct dnsbl_query	*q = l->query;
+	struct unpack		 pack;
+	struct dns_header	 h;
+	struct dns_query	 dq;
+	struct dns_rr		 rr;
+	uint32_t		 ttl = DNSBL_TTL_NEGATIVE;
+	int			 listed = 0;
+
+	if (ar->ar_h_errno == 0 || ar->ar_rcode == NXDOMAIN ||
+	    ar->ar_h_errno == NO_DATA) {
+		unpack_init(&pack, ar->ar_data, ar->ar_datalen);
+		if (unpack_header(&pack, &h) != -1 &&
+		    unpack_query(&pack, &dq) != -1) {
+			for (; h.ancount; h.ancount--) {
+				if (unpack_rr(&pack, &rr) == -1)
+					break;
+				/* listings are returned as 127.0.0.0/8 */
+				if (rr.rr_type == T_A && (ntohl(rr.rr.in_a.
+				    addr.s_addr) >> 24) == 127) {
+					if (!listed || rr.rr_ttl < ttl)
+						ttl = rr.rr_ttl;
+					listed = 1;
+				}
+			}
+			for (; !listed && h.nscount; h.nscount--) {
+				if (unpack_rr(&pack, &rr) == -1)
+					break;
+				if (rr.rr_type == T_SOA)
+					ttl = rr.rr_ttl < rr.rr.soa.minimum ?
+					    rr.rr_ttl : rr.rr.soa.minimum;
+			}
+		}
+		dnsbl_cache_set(l->key, listed, ttl);
+	}
+	free(ar->ar_data);
+
+	log_debug("debug: dnsbl: %s %s", l->key,
+	    listed ? "listed" : "not listed");
+	if (listed)
+		stat_increment("lka.dnsbl.listed", 1);
+
+	free(l->key);
+	free(l);
+
+	q->listed |= listed;
+	q->pending--;
+	if (!q->done && (q->listed || q->pending == 0))
+		dnsbl_done(q);
+	if (q->pending == 0)
+		free(q);
+}
+
+static void
+dnsbl_done(struct dnsbl_query *q)
+{
+	q->done = 1;
+	q->cb(q->arg, q->listed);
+}
+
+static int
+dnsbl_cache_get(const char *key)
+{
+	struct dnsbl_entry	*e;
+
+	if ((e = dict_get(&dnsbl_cache, key)) == NULL)
+		return -1;
+	if (e->expire <= time(NULL)) {
+		dnsbl_cache_remove(e);
+		return -1;
+	}
+	TAILQ_REMOVE(&dnsbl_lru, e, entry);
+	TAILQ_INSERT_HEAD(&dnsbl_lru, e, entry);
+	return e->listed;
+}
+
+static void
+dnsbl_cache_set(const char *key, int listed, uint32_t ttl)
+{
+	struct dnsbl_entry	*e;
+
+	if ((e = dict_get(&dnsbl_cache, key)) != NULL)
+		dnsbl_cache_remove(e);
+	if (dict_count(&dnsbl_cache) >= DNSBL_CACHE_MAX)
+		dnsbl_cache_remove(TAILQ_LAST(&dnsbl_lru, dnsbl_lru));
+
+	if (ttl < DNSBL_TTL_MIN)
+		ttl = DNSBL_TTL_MIN;
+	if (ttl > DNSBL_TTL_MAX)
+		ttl = DNSBL_TTL_MAX;
+
+	e = xcalloc(1, sizeof *e);
+	e->key = xstrdup(key);
+	e->expire = time(NULL) + ttl;
+	e->listed = listed;
+	dict_xset(&dnsbl_cache, e->key, e);
+	TAILQ_INSERT_HEAD(&dnsbl_lru, e, entry);
+}
+
+static void
+dnsbl_cache_remove(struct dnsbl_entry *e)
+{
+	dict_xpop(&dnsbl_cache, e->key);
+	TAILQ_REMOVE(&dnsbl_lru, e, entry);
+	free(e->key);
+	free(e);
+}
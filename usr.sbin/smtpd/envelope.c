@@ -29,15 +29,66 @@
 #include <arpa/inet.h>
 
 #include <ctype.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "smtpd.h"
 #include "log.h"
 
-static int envelope_ascii_load(struct envelope *, struct dict *);
+static int envelope_ascii_load(struct envelope *, struct hdict *);
 static void envelope_ascii_dump(const struct envelope *, char **, size_t *,
     const char *);
+static int envelope_binary_load(struct envelope *, const unsigned char *,
+    size_t);
+
+/*
+ * Binary envelopes start with a NUL byte, which can never appear in the
+ * ASCII format, followed by a format version.  The rest is a sequence of
+ * (tag, 16-bit length, value) fields with integers in network byte order.
+ * Fields that would not be written by the ASCII dumper are omitted.
+ */
+#define	ENVELOPE_BINARY_MAGIC	"\0ENV"
+#define	ENVELOPE_BINARY_VERSION	1
+#define	ENVELOPE_BINARY_HDRLEN	(sizeof(ENVELOPE_BINARY_MAGIC))
+
+enum envelope_binary_tag {
+	EVB_VERSION		= 1,
+	EVB_DISPATCHER		= 2,
+	EVB_TAG			= 3,
+	EVB_TYPE		= 4,
+	EVB_SMTPNAME		= 5,
+	EVB_HELO		= 6,
+	EVB_HOSTNAME		= 7,
+	EVB_USERNAME		= 8,
+	EVB_ERRORLINE		= 9,
+	EVB_SOCKADDR		= 10,
+	EVB_SENDER		= 11,
+	EVB_RCPT		= 12,
+	EVB_DEST		= 13,
+	EVB_CTIME		= 14,
+	EVB_LASTTRY		= 15,
+	EVB_LASTBOUNCE		= 16,
+	EVB_TTL			= 17,
+	EVB_RETRY		= 18,
+	EVB_FLAGS		= 19,
+	EVB_DSN_NOTIFY		= 20,
+	EVB_DSN_RET		= 21,
+	EVB_DSN_ENVID		= 22,
+	EVB_DSN_ORCPT		= 23,
+	EVB_ESC_CLASS		= 24,
+	EVB_ESC_CODE		= 25,
+	EVB_MDA_EXEC		= 26,
+	EVB_MDA_SUBADDRESS	= 27,
+	EVB_MDA_USER		= 28,
+	EVB_BOUNCE_TTL		= 29,
+	EVB_BOUNCE_DELAY	= 30,
+	EVB_BOUNCE_TYPE		= 31,
+};
+
+#define	EVB_SS_LOCAL		0
+#define	EVB_SS_INET		4
+#define	EVB_SS_INET6		6
 
 void
 envelope_set_errormsg(struct envelope *e, char *fmt, ...)
@@ -71,7 +122,7 @@ envelope_set_esc_code(struct envelope *e, enum enhanced_status_code code)
 }
 
 static int
-envelope_buffer_to_dict(struct dict *d,  const char *ibuf, size_t buflen)
+envelope_buffer_to_dict(struct hdict *d,  const char *ibuf, size_t buflen)
 {
 	static char	 lbuf[sizeof(struct envelope)];
 	size_t		 len;
@@ -106,7 +157,7 @@ envelope_buffer_to_dict(struct dict *d,  const char *ibuf, size_t buflen)
 		/* skip whitespaces after separator */
 		while (*buf && isspace((unsigned char)*buf))
 			*buf++ = 0;
-		dict_set(d, field, buf);
+		hdict_set(d, field, buf);
 		buf = nextline;
 	}
 
@@ -119,18 +170,26 @@ err:
 int
 envelope_load_buffer(struct envelope *ep, const char *ibuf, size_t buflen)
 {
-	struct dict	 d;
+	struct hdict	 d;
 	const char	*val, *errstr;
 	long long	 version;
 	int		 ret = 0;
 
-	dict_init(&d);
+	if (buflen >= ENVELOPE_BINARY_HDRLEN &&
+	    memcmp(ibuf, ENVELOPE_BINARY_MAGIC,
+	    sizeof(ENVELOPE_BINARY_MAGIC) - 1) == 0) {
+		memset(ep, 0, sizeof *ep);
+		return (envelope_binary_load(ep, (const unsigned char *)ibuf,
+		    buflen));
+	}
+
+	hdict_init(&d);
 	if (!envelope_buffer_to_dict(&d, ibuf, buflen)) {
 		log_debug("debug: cannot parse envelope to dict");
 		goto end;
 	}
 
-	val = dict_get(&d, "version");
+	val = hdict_get(&d, "version");
 	if (val == NULL) {
 		log_debug("debug: envelope version not found");
 		goto end;
@@ -151,7 +210,7 @@ envelope_load_buffer(struct envelope *ep, const char *ibuf, size_t buflen)
 	if (ret)
 		ep->version = SMTPD_ENVELOPE_VERSION;
 end:
-	while (dict_poproot(&d, NULL))
+	while (hdict_poproot(&d, NULL))
 		;
 	return (ret);
 }
@@ -476,14 +535,14 @@ ascii_load_field(const char *field, struct envelope *ep, char *buf)
 }
 
 static int
-envelope_ascii_load(struct envelope *ep, struct dict *d)
+envelope_ascii_load(struct envelope *ep, struct hdict *d)
 {
 	const char	       *field;
 	char		       *value;
 	void		       *hdl;
 
 	hdl = NULL;
-	while (dict_iter(d, &hdl, &field, (void **)&value))
+	while (hdict_iter(d, &hdl, &field, (void **)&value))
 		if (!ascii_load_field(field, ep, value))
 			goto err;
 
@@ -765,3 +824,515 @@ envelope_ascii_dump(const struct envelope *ep, char **dest, size_t *len,
 err:
 	*dest = NULL;
 }
+
+static void
+binary_dump(char **dest, size_t *len, enum envelope_binary_tag tag,
+    const void *data, size_t datalen)
+{
+	unsigned char	*p;
+
+	if (*dest == NULL)
+		return;
+
+	if (datalen > UINT16_MAX || *len < 3 + datalen) {
+		*dest = NULL;
+		return;
+	}
+
+	p = (unsigned char *)*dest;
+	p[0] = tag;
+	p[1] = (datalen >> 8) & 0xff;
+	p[2] = datalen & 0xff;
+	memcpy(p + 3, data, datalen);
+	*dest += 3 + datalen;
+	*len -= 3 + datalen;
+}
+
+static void
+binary_dump_uint(char **dest, size_t *len, enum envelope_binary_tag tag,
+    uint64_t value, size_t size)
+{
+	unsigned char	 buf[sizeof(uint64_t)];
+	size_t		 i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = (value >> (8 * (size - i - 1))) & 0xff;
+	binary_dump(dest, len, tag, buf, size);
+}
+
+static void
+binary_dump_string(char **dest, size_t *len, enum envelope_binary_tag tag,
+    const char *s)
+{
+	if (s[0] == '\0')
+		return;
+	binary_dump(dest, len, tag, s, strlen(s));
+}
+
+static void
+binary_dump_mailaddr(char **dest, size_t *len, enum envelope_binary_tag tag,
+    const struct mailaddr *addr)
+{
+	char	buf[sizeof(addr->user) + sizeof(addr->domain)];
+	size_t	ulen, dlen;
+
+	ulen = strnlen(addr->user, sizeof(addr->user) - 1);
+	dlen = strnlen(addr->domain, sizeof(addr->domain) - 1);
+	memcpy(buf, addr->user, ulen);
+	buf[ulen] = '\0';
+	memcpy(buf + ulen + 1, addr->domain, dlen);
+	binary_dump(dest, len, tag, buf, ulen + 1 + dlen);
+}
+
+static void
+binary_dump_sockaddr(char **dest, size_t *len, enum envelope_binary_tag tag,
+    const struct sockaddr_storage *ss)
+{
+	const struct sockaddr_in	*sin;
+	const struct sockaddr_in6	*sin6;
+	unsigned char			 buf[1 + 16 + 4];
+	uint32_t			 scope;
+
+	switch (ss->ss_family) {
+	case AF_LOCAL:
+		buf[0] = EVB_SS_LOCAL;
+		binary_dump(dest, len, tag, buf, 1);
+		break;
+	case AF_INET:
+		sin = (const struct sockaddr_in *)ss;
+		buf[0] = EVB_SS_INET;
+		memcpy(buf + 1, &sin->sin_addr, 4);
+		binary_dump(dest, len, tag, buf, 1 + 4);
+		break;
+	case AF_INET6:
+		sin6 = (const struct sockaddr_in6 *)ss;
+		buf[0] = EVB_SS_INET6;
+		memcpy(buf + 1, &sin6->sin6_addr, 16);
+		scope = htonl(sin6->sin6_scope_id);
+		memcpy(buf + 1 + 16, &scope, 4);
+		binary_dump(dest, len, tag, buf, 1 + 16 + 4);
+		break;
+	}
+}
+
+static void
+binary_dump_fields(const struct envelope *ep, int which, char **dest,
+    size_t *len)
+{
+	/* what smtpctl shows of an envelope, loaded as message fields */
+	if (which & ENVELOPE_FIELDS_SUMMARY) {
+		binary_dump_sockaddr(dest, len, EVB_SOCKADDR, &ep->ss);
+		binary_dump_mailaddr(dest, len, EVB_SENDER, &ep->sender);
+		binary_dump_uint(dest, len, EVB_TYPE, ep->type, 1);
+		binary_dump_string(dest, len, EVB_ERRORLINE, ep->errorline);
+		binary_dump_mailaddr(dest, len, EVB_RCPT, &ep->rcpt);
+		binary_dump_mailaddr(dest, len, EVB_DEST, &ep->dest);
+		binary_dump_uint(dest, len, EVB_CTIME, ep->creation, 8);
+		binary_dump_uint(dest, len, EVB_LASTTRY, ep->lasttry, 8);
+		binary_dump_uint(dest, len, EVB_TTL, ep->ttl, 8);
+		binary_dump_uint(dest, len, EVB_RETRY, ep->retry, 2);
+		binary_dump_uint(dest, len, EVB_FLAGS,
+		    ep->flags & (EF_AUTHENTICATED|EF_BOUNCE|EF_INTERNAL), 4);
+		return;
+	}
+
+	if (which & ENVELOPE_FIELDS_MESSAGE) {
+		binary_dump_string(dest, len, EVB_DISPATCHER, ep->dispatcher);
+		binary_dump_string(dest, len, EVB_TAG, ep->tag);
+		binary_dump_string(dest, len, EVB_SMTPNAME, ep->smtpname);
+		binary_dump_string(dest, len, EVB_HELO, ep->helo);
+		binary_dump_string(dest, len, EVB_HOSTNAME, ep->hostname);
+		binary_dump_sockaddr(dest, len, EVB_SOCKADDR, &ep->ss);
+		binary_dump_mailaddr(dest, len, EVB_SENDER, &ep->sender);
+	}
+
+	if ((which & ENVELOPE_FIELDS_RECIPIENT) == 0)
+		return;
+
+	binary_dump_uint(dest, len, EVB_VERSION, SMTPD_ENVELOPE_VERSION, 4);
+	binary_dump_uint(dest, len, EVB_TYPE, ep->type, 1);
+	binary_dump_string(dest, len, EVB_USERNAME, ep->username);
+	binary_dump_string(dest, len, EVB_ERRORLINE, ep->errorline);
+	binary_dump_mailaddr(dest, len, EVB_RCPT, &ep->rcpt);
+	binary_dump_mailaddr(dest, len, EVB_DEST, &ep->dest);
+	binary_dump_uint(dest, len, EVB_CTIME, ep->creation, 8);
+	binary_dump_uint(dest, len, EVB_LASTTRY, ep->lasttry, 8);
+	binary_dump_uint(dest, len, EVB_LASTBOUNCE, ep->lastbounce, 8);
+	binary_dump_uint(dest, len, EVB_TTL, ep->ttl, 8);
+	binary_dump_uint(dest, len, EVB_RETRY, ep->retry, 2);
+	binary_dump_uint(dest, len, EVB_FLAGS,
+	    ep->flags & (EF_AUTHENTICATED|EF_BOUNCE|EF_INTERNAL), 4);
+	binary_dump_uint(dest, len, EVB_DSN_NOTIFY, ep->dsn_notify, 1);
+	if (ep->dsn_ret == DSN_RETFULL || ep->dsn_ret == DSN_RETHDRS)
+		binary_dump_uint(dest, len, EVB_DSN_RET, ep->dsn_ret, 1);
+	binary_dump_string(dest, len, EVB_DSN_ENVID, ep->dsn_envid);
+	binary_dump_string(dest, len, EVB_DSN_ORCPT, ep->dsn_orcpt);
+	if (ep->esc_class) {
+		binary_dump_uint(dest, len, EVB_ESC_CLASS, ep->esc_class, 1);
+		binary_dump_uint(dest, len, EVB_ESC_CODE, ep->esc_code, 1);
+	}
+
+	switch (ep->type) {
+	case D_MDA:
+		binary_dump_string(dest, len, EVB_MDA_EXEC, ep->mda_exec);
+		binary_dump_string(dest, len, EVB_MDA_SUBADDRESS,
+		    ep->mda_subaddress);
+		binary_dump_string(dest, len, EVB_MDA_USER, ep->mda_user);
+		break;
+	case D_MTA:
+		break;
+	case D_BOUNCE:
+		if (ep->agent.bounce.type == B_DELAYED) {
+			binary_dump_uint(dest, len, EVB_BOUNCE_TTL,
+			    ep->agent.bounce.ttl, 8);
+			binary_dump_uint(dest, len, EVB_BOUNCE_DELAY,
+			    ep->agent.bounce.delay, 8);
+		}
+		binary_dump_uint(dest, len, EVB_BOUNCE_TYPE,
+		    ep->agent.bounce.type, 1);
+		break;
+	default:
+		*dest = NULL;
+	}
+}
+
+int
+envelope_dump_binary(const struct envelope *ep, char *dest, size_t len)
+{
+	char	*p = dest;
+
+	if (len < ENVELOPE_BINARY_HDRLEN)
+		return (0);
+	memcpy(dest, ENVELOPE_BINARY_MAGIC, sizeof(ENVELOPE_BINARY_MAGIC) - 1);
+	dest[ENVELOPE_BINARY_HDRLEN - 1] = ENVELOPE_BINARY_VERSION;
+	dest += ENVELOPE_BINARY_HDRLEN;
+	len -= ENVELOPE_BINARY_HDRLEN;
+
+	binary_dump_fields(ep, ENVELOPE_FIELDS_MESSAGE|ENVELOPE_FIELDS_RECIPIENT,
+	    &dest, &len);
+	if (dest == NULL)
+		return (0);
+
+	return (dest - p);
+}
+
+/*
+ * Dump only the message-level or the recipient-level fields, without the
+ * binary header, so that callers holding many envelopes of a message can
+ * keep the former once.  Both parts are needed to load the envelope back.
+ * The summary fields are a partial envelope of their own, loaded back as
+ * message-level fields alone.
+ */
+int
+envelope_dump_binary_fields(const struct envelope *ep, int which, char *dest,
+    size_t len, size_t *outlen)
+{
+	char	*p = dest;
+
+	binary_dump_fields(ep, which, &dest, &len);
+	if (dest == NULL)
+		return (0);
+
+	*outlen = dest - p;
+	return (1);
+}
+
+static int
+binary_load_uint(uint64_t *dest, const unsigned char *buf, size_t len,
+    size_t size)
+{
+	size_t	i;
+
+	if (len != size)
+		return (0);
+	*dest = 0;
+	for (i = 0; i < size; i++)
+		*dest = (*dest << 8) | buf[i];
+	return (1);
+}
+
+static int
+binary_load_string(char *dest, const unsigned char *buf, size_t len,
+    size_t size)
+{
+	if (len >= size || memchr(buf, '\0', len) != NULL)
+		return (0);
+	memcpy(dest, buf, len);
+	dest[len] = '\0';
+	return (1);
+}
+
+static int
+binary_load_mailaddr(struct mailaddr *dest, const unsigned char *buf,
+    size_t len)
+{
+	const unsigned char	*at;
+	size_t			 ulen;
+
+	if ((at = memchr(buf, '\0', len)) == NULL)
+		return (0);
+	ulen = at - buf;
+	return (binary_load_string(dest->user, buf, ulen, sizeof(dest->user)) &&
+	    binary_load_string(dest->domain, at + 1, len - ulen - 1,
+	    sizeof(dest->domain)));
+}
+
+static int
+binary_load_sockaddr(struct sockaddr_storage *ss, const unsigned char *buf,
+    size_t len)
+{
+	struct sockaddr_in	*sin;
+	struct sockaddr_in6	*sin6;
+	uint32_t		 scope;
+
+	if (len == 0)
+		return (0);
+
+	switch (buf[0]) {
+	case EVB_SS_LOCAL:
+		if (len != 1)
+			return (0);
+		ss->ss_family = AF_LOCAL;
+		break;
+	case EVB_SS_INET:
+		if (len != 1 + 4)
+			return (0);
+		sin = (struct sockaddr_in *)ss;
+		sin->sin_family = AF_INET;
+		memcpy(&sin->sin_addr, buf + 1, 4);
+#ifdef HAVE_STRUCT_SOCKADDR_STORAGE_SS_LEN
+		ss->ss_len = sizeof(struct sockaddr_in);
+#endif
+		break;
+	case EVB_SS_INET6:
+		if (len != 1 + 16 + 4)
+			return (0);
+		sin6 = (struct sockaddr_in6 *)ss;
+		sin6->sin6_family = AF_INET6;
+		memcpy(&sin6->sin6_addr, buf + 1, 16);
+		memcpy(&scope, buf + 1 + 16, 4);
+		sin6->sin6_scope_id = ntohl(scope);
+#ifdef HAVE_STRUCT_SOCKADDR_STORAGE_SS_LEN
+		ss->ss_len = sizeof(struct sockaddr_in6);
+#endif
+		break;
+	default:
+		return (0);
+	}
+	return (1);
+}
+
+static int
+binary_load_field(enum envelope_binary_tag tag, struct envelope *ep,
+    const unsigned char *buf, size_t len)
+{
+	uint64_t	v;
+
+	switch (tag) {
+	case EVB_VERSION:
+		if (!binary_load_uint(&v, buf, len, 4))
+			return (0);
+		ep->version = v;
+		return (1);
+	case EVB_DISPATCHER:
+		return binary_load_string(ep->dispatcher, buf, len,
+		    sizeof ep->dispatcher);
+	case EVB_TAG:
+		return binary_load_string(ep->tag, buf, len, sizeof ep->tag);
+	case EVB_TYPE:
+		if (!binary_load_uint(&v, buf, len, 1))
+			return (0);
+		if (v != D_MDA && v != D_MTA && v != D_BOUNCE)
+			return (0);
+		ep->type = v;
+		return (1);
+	case EVB_SMTPNAME:
+		return binary_load_string(ep->smtpname, buf, len,
+		    sizeof ep->smtpname);
+	case EVB_HELO:
+		return binary_load_string(ep->helo, buf, len, sizeof ep->helo);
+	case EVB_HOSTNAME:
+		return binary_load_string(ep->hostname, buf, len,
+		    sizeof ep->hostname);
+	case EVB_USERNAME:
+		return binary_load_string(ep->username, buf, len,
+		    sizeof ep->username);
+	case EVB_ERRORLINE:
+		return binary_load_string(ep->errorline, buf, len,
+		    sizeof ep->errorline);
+	case EVB_SOCKADDR:
+		return binary_load_sockaddr(&ep->ss, buf, len);
+	case EVB_SENDER:
+		return binary_load_mailaddr(&ep->sender, buf, len);
+	case EVB_RCPT:
+		return binary_load_mailaddr(&ep->rcpt, buf, len);
+	case EVB_DEST:
+		return binary_load_mailaddr(&ep->dest, buf, len);
+	case EVB_CTIME:
+		if (!binary_load_uint(&v, buf, len, 8))
+			return (0);
+		ep->creation = v;
+		return (1);
+	case EVB_LASTTRY:
+		if (!binary_load_uint(&v, buf, len, 8))
+			return (0);
+		ep->lasttry = v;
+		return (1);
+	case EVB_LASTBOUNCE:
+		if (!binary_load_uint(&v, buf, len, 8))
+			return (0);
+		ep->lastbounce = v;
+		return (1);
+	case EVB_TTL:
+		if (!binary_load_uint(&v, buf, len, 8))
+			return (0);
+		ep->ttl = v;
+		return (1);
+	case EVB_RETRY:
+		if (!binary_load_uint(&v, buf, len, 2))
+			return (0);
+		ep->retry = v;
+		return (1);
+	case EVB_FLAGS:
+		if (!binary_load_uint(&v, buf, len, 4))
+			return (0);
+		if (v & ~(EF_AUTHENTICATED|EF_BOUNCE|EF_INTERNAL))
+			return (0);
+		ep->flags = v;
+		return (1);
+	case EVB_DSN_NOTIFY:
+		if (!binary_load_uint(&v, buf, len, 1))
+			return (0);
+		ep->dsn_notify = v;
+		return (1);
+	case EVB_DSN_RET:
+		if (!binary_load_uint(&v, buf, len, 1))
+			return (0);
+		if (v != DSN_RETFULL && v != DSN_RETHDRS)
+			return (0);
+		ep->dsn_ret = v;
+		return (1);
+	case EVB_DSN_ENVID:
+		return binary_load_string(ep->dsn_envid, buf, len,
+		    sizeof ep->dsn_envid);
+	case EVB_DSN_ORCPT:
+		return binary_load_string(ep->dsn_orcpt, buf, len,
+		    sizeof ep->dsn_orcpt);
+	case EVB_ESC_CLASS:
+		if (!binary_load_uint(&v, buf, len, 1))
+			return (0);
+		ep->esc_class = v;
+		return (1);
+	case EVB_ESC_CODE:
+		if (!binary_load_uint(&v, buf, len, 1))
+			return (0);
+		ep->esc_code = v;
+		return (1);
+	case EVB_MDA_EXEC:
+		return binary_load_string(ep->mda_exec, buf, len,
+		    sizeof ep->mda_exec);
+	case EVB_MDA_SUBADDRESS:
+		return binary_load_string(ep->mda_subaddress, buf, len,
+		    sizeof ep->mda_subaddress);
+	case EVB_MDA_USER:
+		return binary_load_string(ep->mda_user, buf, len,
+		    sizeof ep->mda_user);
+	case EVB_BOUNCE_TTL:
+		if (!binary_load_uint(&v, buf, len, 8))
+			return (0);
+		ep->agent.bounce.ttl = v;
+		return (1);
+	case EVB_BOUNCE_DELAY:
+		if (!binary_load_uint(&v, buf, len, 8))
+			return (0);
+		ep->agent.bounce.delay = v;
+		return (1);
+	case EVB_BOUNCE_TYPE:
+		if (!binary_load_uint(&v, buf, len, 1))
+			return (0);
+		if (v != B_FAILED && v != B_DELAYED && v != B_DELIVERED)
+			return (0);
+		ep->agent.bounce.type = v;
+		return (1);
+	}
+
+	return (0);
+}
+
+static int
+binary_load_fields(struct envelope *ep, const unsigned char *buf, size_t len)
+{
+	size_t	flen;
+	int	tag;
+
+	while (len) {
+		if (len < 3)
+			goto err;
+		tag = buf[0];
+		flen = (buf[1] << 8) | buf[2];
+		buf += 3;
+		len -= 3;
+		if (flen > len)
+			goto err;
+		if (!binary_load_field(tag, ep, buf, flen)) {
+			log_warnx("envelope: invalid binary field %d", tag);
+			return (0);
+		}
+		buf += flen;
+		len -= flen;
+	}
+	return (1);
+
+err:
+	log_debug("debug: truncated binary envelope");
+	return (0);
+}
+
+static int
+envelope_binary_load(struct envelope *ep, const unsigned char *buf,
+    size_t len)
+{
+	if (buf[ENVELOPE_BINARY_HDRLEN - 1] != ENVELOPE_BINARY_VERSION) {
+		log_debug("debug: bad binary envelope format %d",
+		    buf[ENVELOPE_BINARY_HDRLEN - 1]);
+		return (0);
+	}
+
+	if (!binary_load_fields(ep, buf + ENVELOPE_BINARY_HDRLEN,
+	    len - ENVELOPE_BINARY_HDRLEN))
+		return (0);
+
+	if (ep->version != SMTPD_ENVELOPE_VERSION) {
+		log_debug("debug: bad envelope version %"PRIu32, ep->version);
+		return (0);
+	}
+	return (1);
+}
+
+/*
+ * With a NULL rcptbuf, only the message-level fields are loaded, and ep
+ * is not a complete envelope.  With a NULL msgbuf, ep must be a copy of
+ * such a partial envelope, to which the recipient-level fields are
+ * added: the message-level fields of many envelopes are parsed once.
+ */
+int
+envelope_load_binary_fields(struct envelope *ep, const char *msgbuf,
+    size_t msglen, const char *rcptbuf, size_t rcptlen)
+{
+	if (msgbuf) {
+		memset(ep, 0, sizeof *ep);
+		if (!binary_load_fields(ep, (const unsigned char *)msgbuf,
+		    msglen))
+			return (0);
+	}
+	if (rcptbuf == NULL)
+		return (1);
+	if (!binary_load_fields(ep, (const unsigned char *)rcptbuf, rcptlen))
+		return (0);
+
+	if (ep->version != SMTPD_ENVELOPE_VERSION) {
+		log_debug("debug: bad envelope version %"PRIu32, ep->version);
+		return (0);
+	}
+	return (1);
+}
@@ -27,6 +27,7 @@
 #include <ctype.h>
 #include <event.h>
 #include <imsg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -40,12 +41,44 @@
 
 #include "smtpd.h"
 
+/*
+ * Nodes are carved from chunks owned by the expansion, and only take the
+ * part of the union their type uses.  Chunks start small since many
+ * expansions are kept in caches, and double up to EXPAND_CHUNK_MAX.
+ */
+#define	EXPAND_CHUNK_MIN	1024
+#define	EXPAND_CHUNK_MAX	(16 * 1024)
+#define	EXPAND_ALIGN(n)		(((n) + 15) & ~(size_t)15)
+#define	EXPAND_MINBUCKETS	16
+
+struct expand_chunk {
+	struct expand_chunk	*next;
+	size_t			 size;
+	size_t			 used;
+};
+
 static const char *expandnode_info(struct expandnode *);
+static size_t expandnode_size(struct expandnode *);
+static uint32_t expandnode_hash(struct expandnode *);
+static int expandnode_match(struct expandnode *, struct expandnode *);
+static void *expand_alloc(struct expand *, size_t);
+static void expand_grow(struct expand *);
 
 struct expandnode *
 expand_lookup(struct expand *expand, struct expandnode *key)
 {
-	return RB_FIND(expandtree, &expand->tree, key);
+	struct expandnode	*xn;
+	uint32_t		 h;
+
+	if (expand->nbuckets == 0)
+		return NULL;
+
+	h = expandnode_hash(key);
+	for (xn = expand->buckets[h & (expand->nbuckets - 1)]; xn;
+	    xn = xn->hnext)
+		if (xn->hash == h && expandnode_match(xn, key))
+			return xn;
+	return NULL;
 }
 
 int
@@ -55,7 +88,7 @@ expand_to_text(struct expand *expand, char *buf, size_t sz)
 
 	buf[0] = '\0';
 
-	RB_FOREACH(xn, expandtree, &expand->tree) {
+	TAILQ_FOREACH(xn, &expand->nodes, entry) {
 		if (buf[0])
 			(void)strlcat(buf, ", ", sz);
 		if (strlcat(buf, expandnode_to_text(xn), sz) >= sz)
@@ -69,6 +102,7 @@ void
 expand_insert(struct expand *expand, struct expandnode *node)
 {
 	struct expandnode *xn;
+	size_t		   len, i;
 
 	node->rule = expand->rule;
 	node->parent = expand->parent;
@@ -90,23 +124,57 @@ expand_insert(struct expand *expand, struct expandnode *node)
 		return;
 	}
 
-	xn = xmemdup(node, sizeof *xn);
+	len = expandnode_size(node);
+	xn = expand_alloc(expand, offsetof(struct expandnode, u) + len);
+	memcpy(xn, node, offsetof(struct expandnode, u) + len);
+	if (node->type != EXPAND_ADDRESS)
+		xn->u.buffer[len - 1] = '\0';
+	xn->subaddress = NULL;
+	xn->hash = expandnode_hash(node);
 	xn->rule = expand->rule;
 	xn->parent = expand->parent;
 	if (xn->parent)
 		xn->depth = xn->parent->depth + 1;
 	else
 		xn->depth = 0;
-	RB_INSERT(expandtree, &expand->tree, xn);
+
+	if (expand->buckets == NULL)
+		TAILQ_INIT(&expand->nodes);
+	if (expand->nb_nodes >= expand->nbuckets)
+		expand_grow(expand);
+	i = xn->hash & (expand->nbuckets - 1);
+	xn->hnext = expand->buckets[i];
+	expand->buckets[i] = xn;
+	TAILQ_INSERT_TAIL(&expand->nodes, xn, entry);
 	if (expand->queue)
 		TAILQ_INSERT_TAIL(expand->queue, xn, tq_entry);
 	expand->nb_nodes++;
 	log_trace(TRACE_EXPAND, "expand: %p: inserted node %p", expand, xn);
 }
 
+/*
+ * Insert the nodes of src in expand, as new nodes of its current
+ * context.
+ */
+void
+expand_merge(struct expand *expand, struct expand *src)
+{
+	struct expandnode	*xn;
+	struct expandnode	 node;
+
+	/* expand_insert() sets per-context fields, work on a copy */
+	TAILQ_FOREACH(xn, &src->nodes, entry) {
+		memset(&node, 0, sizeof(node));
+		node.type = xn->type;
+		memcpy(&node.u, &xn->u, expandnode_size(xn));
+		expand_insert(expand, &node);
+	}
+}
+
 void
 expand_clear(struct expand *expand)
 {
+	struct expand_chunk *c;
 	struct expandnode *xn;
 
 	log_trace(TRACE_EXPAND, "expand: %p: clearing expand tree", expand);
@@ -114,10 +182,15 @@ expand_clear(struct expand *expand)
 		while ((xn = TAILQ_FIRST(expand->queue)))
 			TAILQ_REMOVE(expand->queue, xn, tq_entry);
 
-	while ((xn = RB_ROOT(&expand->tree)) != NULL) {
-		RB_REMOVE(expandtree, &expand->tree, xn);
-		free(xn);
+	while ((c = expand->chunks) != NULL) {
+		expand->chunks = c->next;
+		free(c);
 	}
+	free(expand->buckets);
+	expand->buckets = NULL;
+	expand->nbuckets = 0;
+	expand->nb_nodes = 0;
+	TAILQ_INIT(&expand->nodes);
 }
 
 void
@@ -129,36 +202,119 @@ expand_free(struct expand *expand)
 	free(expand);
 }
 
-int
-expand_cmp(struct expandnode *e1, struct expandnode *e2)
+static void *
+expand_alloc(struct expand *expand, size_t len)
+{
+	struct expand_chunk	*c = expand->chunks;
+	size_t			 hdr = EXPAND_ALIGN(sizeof(*c)), size;
+	void			*p;
+
+	len = EXPAND_ALIGN(len);
+	if (c == NULL || c->size - c->used < len) {
+		size = c ? c->size * 2 : EXPAND_CHUNK_MIN;
+		if (size > EXPAND_CHUNK_MAX)
+			size = EXPAND_CHUNK_MAX;
+		if (size < hdr + len)
+			size = hdr + len;
+		c = xmalloc(size);
+		c->size = size;
+		c->used = hdr;
+		c->next = expand->chunks;
+		expand->chunks = c;
+	}
+
+	p = (char *)c + c->used;
+	c->used += len;
+	return p;
+}
+
+static void
+expand_grow(struct expand *expand)
+{
+	struct expandnode	*xn, **b;
+	size_t			 n, i;
+
+	n = expand->nbuckets ? expand->nbuckets * 2 : EXPAND_MINBUCKETS;
+	b = xcalloc(n, sizeof(*b));
+	free(expand->buckets);
+	expand->buckets = b;
+	expand->nbuckets = n;
+
+	TAILQ_FOREACH(xn, &expand->nodes, entry) {
+		i = xn->hash & (n - 1);
+		xn->hnext = b[i];
+		b[i] = xn;
+	}
+}
+
+/* the part of the union used by the node */
+static size_t
+expandnode_size(struct expandnode *xn)
+{
+	if (xn->type == EXPAND_ADDRESS)
+		return sizeof(xn->u.mailaddr);
+	return strnlen(xn->u.buffer, sizeof(xn->u.buffer) - 1) + 1;
+}
+
+static uint32_t
+fnv1a(uint32_t h, const void *buf, size_t len)
+{
+	const unsigned char	*p = buf;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/* the parent is left out, it is only compared on collisions */
+static uint32_t
+expandnode_hash(struct expandnode *xn)
+{
+	uint32_t	h = 2166136261U;
+
+	h = fnv1a(h, &xn->type, sizeof(xn->type));
+	h = fnv1a(h, &xn->sameuser, sizeof(xn->sameuser));
+	h = fnv1a(h, &xn->realuser, sizeof(xn->realuser));
+	if (xn->type == EXPAND_ADDRESS) {
+		h = fnv1a(h, xn->u.mailaddr.user,
+		    strnlen(xn->u.mailaddr.user, sizeof(xn->u.mailaddr.user)));
+		h = fnv1a(h, "@", 1);
+		h = fnv1a(h, xn->u.mailaddr.domain,
+		    strnlen(xn->u.mailaddr.domain,
+		    sizeof(xn->u.mailaddr.domain)));
+	}
+	else
+		h = fnv1a(h, xn->u.buffer, expandnode_size(xn) - 1);
+	return h;
+}
+
+static int
+expandnode_match(struct expandnode *e1, struct expandnode *e2)
 {
 	struct expandnode *p1, *p2;
-	int		   r;
 
-	if (e1->type < e2->type)
-		return -1;
-	if (e1->type > e2->type)
-		return 1;
-	if (e1->sameuser < e2->sameuser)
-		return -1;
-	if (e1->sameuser > e2->sameuser)
-		return 1;
-	if (e1->realuser < e2->realuser)
-		return -1;
-	if (e1->realuser > e2->realuser)
-		return 1;
+	if (e1->type != e2->type ||
+	    e1->sameuser != e2->sameuser ||
+	    e1->realuser != e2->realuser)
+		return 0;
 
-	r = memcmp(&e1->u, &e2->u, sizeof(e1->u));
-	if (r)
-		return (r);
+	if (e1->type == EXPAND_ADDRESS) {
+		if (strncmp(e1->u.mailaddr.user, e2->u.mailaddr.user,
+		    sizeof(e1->u.mailaddr.user)) ||
+		    strncmp(e1->u.mailaddr.domain, e2->u.mailaddr.domain,
+		    sizeof(e1->u.mailaddr.domain)))
+			return 0;
+	}
+	else if (strncmp(e1->u.buffer, e2->u.buffer, sizeof(e1->u.buffer) - 1))
+		return 0;
 
 	if (e1->parent == e2->parent)
-		return (0);
+		return 1;
 
-	if (e1->parent == NULL)
-		return (-1);
-	if (e2->parent == NULL)
-		return (1);
+	if (e1->parent == NULL || e2->parent == NULL)
+		return 0;
 
 	/*
 	 * The same node can be expanded in for different dest context.
@@ -168,13 +324,11 @@ expand_cmp(struct expandnode *e1, struct expandnode *e2)
 		;
 	for(p2 = e2->parent; p2->type != EXPAND_ADDRESS; p2 = p2->parent)
 		;
-	if (p1 < p2)
-		return (-1);
-	if (p1 > p2)
-		return (1);
+	if (p1 != p2)
+		return 0;
 
 	if (e1->type != EXPAND_FILENAME && e1->type != EXPAND_FILTER)
-		return (0);
+		return 1;
 
 	/*
 	 * For external delivery, we need to distinguish between users.
@@ -184,12 +338,7 @@ expand_cmp(struct expandnode *e1, struct expandnode *e2)
 		;
 	for(p2 = e2->parent; p2 && p2->type != EXPAND_USERNAME; p2 = p2->parent)
 		;
-	if (p1 < p2)
-		return (-1);
-	if (p1 > p2)
-		return (1);
-
-	return (0);
+	return p1 == p2;
 }
 
 static int
@@ -327,5 +476,3 @@ expandnode_info(struct expandnode *e)
 
 	return buffer;
 }
-
-RB_GENERATE(expandtree, expandnode, entry, expand_cmp);
@@ -39,7 +39,6 @@
 #include "log.h"
 
 #define	MAX_FORWARD_SIZE	(4 * 1024)
-#define	MAX_EXPAND_NODES	(100)
 
 int
 forwards_get(int fd, struct expand *expand)
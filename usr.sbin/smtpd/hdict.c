@@ -0,0 +1,273 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hdict.h"
+#include "log.h"
+
+#define	HDICT_MINBUCKETS	16
+
+struct hdictentry {
+	struct hdictentry	*next;
+	TAILQ_ENTRY(hdictentry)	 entry;
+	uint32_t		 hash;
+	const char		*key;
+	void			*data;
+};
+
+/* FNV-1a */
+static uint32_t
+hdict_hash(const char *k)
+{
+	uint32_t	h = 2166136261U;
+
+	for (; *k; k++) {
+		h ^= (unsigned char)*k;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static struct hdictentry **
+hdict_slot(struct hdict *d, const char *k, uint32_t h)
+{
+	struct hdictentry	**ep;
+
+	if (d->nbuckets == 0)
+		return (NULL);
+
+	for (ep = &d->buckets[h & (d->nbuckets - 1)]; *ep; ep = &(*ep)->next)
+		if ((*ep)->hash == h && strcmp((*ep)->key, k) == 0)
+			return (ep);
+	return (NULL);
+}
+
+static void
+hdict_grow(struct hdict *d)
+{
+	struct hdictentry	*e, **b;
+	size_t			 n, i;
+
+	n = d->nbuckets ? d->nbuckets * 2 : HDICT_MINBUCKETS;
+	if ((b = reallocarray(d->buckets, n, sizeof(*b))) == NULL)
+		fatal("hdict_grow: reallocarray");
+	for (i = 0; i < n; i++)
+		b[i] = NULL;
+	d->buckets = b;
+	d->nbuckets = n;
+
+	TAILQ_FOREACH(e, &d->entries, entry) {
+		i = e->hash & (n - 1);
+		e->next = b[i];
+		b[i] = e;
+	}
+}
+
+static void
+hdict_insert(struct hdict *d, const char *k, uint32_t h, void *data)
+{
+	struct hdictentry	*e;
+	size_t			 s = strlen(k) + 1, i;
+	void			*t;
+
+	if ((e = malloc(sizeof(*e) + s)) == NULL)
+		fatal("hdict_insert: malloc");
+	e->hash = h;
+	e->key = t = (char *)(e) + sizeof(*e);
+	e->data = data;
+	memmove(t, k, s);
+
+	if (d->count >= d->nbuckets)
+		hdict_grow(d);
+	i = h & (d->nbuckets - 1);
+	e->next = d->buckets[i];
+	d->buckets[i] = e;
+	TAILQ_INSERT_TAIL(&d->entries, e, entry);
+	d->count += 1;
+}
+
+static void *
+hdict_remove(struct hdict *d, struct hdictentry **ep)
+{
+	struct hdictentry	*e = *ep;
+	void			*data = e->data;
+
+	*ep = e->next;
+	TAILQ_REMOVE(&d->entries, e, entry);
+	free(e);
+	d->count -= 1;
+
+	/* there is no destructor, an emptied dict must not hold memory */
+	if (d->count == 0) {
+		free(d->buckets);
+		d->buckets = NULL;
+		d->nbuckets = 0;
+	}
+
+	return (data);
+}
+
+int
+hdict_check(struct hdict *d, const char *k)
+{
+	return (hdict_slot(d, k, hdict_hash(k)) != NULL);
+}
+
+void *
+hdict_set(struct hdict *d, const char *k, void *data)
+{
+	struct hdictentry	**ep;
+	uint32_t		  h = hdict_hash(k);
+	void			 *old;
+
+	if ((ep = hdict_slot(d, k, h)) == NULL) {
+		hdict_insert(d, k, h, data);
+		return (NULL);
+	}
+
+	old = (*ep)->data;
+	(*ep)->data = data;
+	return (old);
+}
+
+void
+hdict_xset(struct hdict *d, const char *k, void *data)
+{
+	uint32_t	h = hdict_hash(k);
+
+	if (hdict_slot(d, k, h))
+		fatalx("hdict_xset(%p, %s)", d, k);
+	hdict_insert(d, k, h, data);
+}
+
+void *
+hdict_get(struct hdict *d, const char *k)
+{
+	struct hdictentry	**ep;
+
+	if ((ep = hdict_slot(d, k, hdict_hash(k))) == NULL)
+		return (NULL);
+
+	return ((*ep)->data);
+}
+
+void *
+hdict_xget(struct hdict *d, const char *k)
+{
+	struct hdictentry	**ep;
+
+	if ((ep = hdict_slot(d, k, hdict_hash(k))) == NULL)
+		fatalx("hdict_xget(%p, %s)", d, k);
+
+	return ((*ep)->data);
+}
+
+void *
+hdict_pop(struct hdict *d, const char *k)
+{
+	struct hdictentry	**ep;
+
+	if ((ep = hdict_slot(d, k, hdict_hash(k))) == NULL)
+		return (NULL);
+
+	return (hdict_remove(d, ep));
+}
+
+void *
+hdict_xpop(struct hdict *d, const char *k)
+{
+	struct hdictentry	**ep;
+
+	if ((ep = hdict_slot(d, k, hdict_hash(k))) == NULL)
+		fatalx("hdict_xpop(%p, %s)", d, k);
+
+	return (hdict_remove(d, ep));
+}
+
+/* the "root" is the oldest entry */
+int
+hdict_poproot(struct hdict *d, void **data)
+{
+	struct hdictentry	*e, **ep;
+	void			*p;
+
+	if ((e = TAILQ_FIRST(&d->entries)) == NULL)
+		return (0);
+
+	ep = hdict_slot(d, e->key, e->hash);
+	p = hdict_remove(d, ep);
+	if (data)
+		*data = p;
+
+	return (1);
+}
+
+int
+hdict_root(struct hdict *d, const char **k, void **data)
+{
+	struct hdictentry	*e;
+
+	if ((e = TAILQ_FIRST(&d->entries)) == NULL)
+		return (0);
+	if (k)
+		*k = e->key;
+	if (data)
+		*data = e->data;
+	return (1);
+}
+
+int
+hdict_iter(struct hdict *d, void **hdl, const char **k, void **data)
+{
+	struct hdictentry *curr = *hdl;
+
+	if (curr == NULL)
+		curr = TAILQ_FIRST(&d->entries);
+	else
+		curr = TAILQ_NEXT(curr, entry);
+
+	if (curr) {
+		*hdl = curr;
+		if (k)
+			*k = curr->key;
+		if (data)
+			*data = curr->data;
+		return (1);
+	}
+
+	return (0);
+}
+
+void
+hdict_merge(struct hdict *dst, struct hdict *src)
+{
+	struct hdictentry	*e;
+
+	while ((e = TAILQ_FIRST(&src->entries)) != NULL) {
+		if (hdict_slot(dst, e->key, e->hash))
+			fatalx("hdict_merge: duplicate");
+		hdict_insert(dst, e->key, e->hash, e->data);
+		hdict_remove(src, hdict_slot(src, e->key, e->hash));
+	}
+}
@@ -0,0 +1,52 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef	_HDICT_H_
+#define	_HDICT_H_
+
+TAILQ_HEAD(_hdict, hdictentry);
+
+/*
+ * Same interface as a dict, but hashed: lookups do not modify the
+ * structure, and iteration follows the insertion order rather than the
+ * key order.  Use a dict where keys must be walked sorted.
+ */
+struct hdict {
+	struct _hdict		  entries;
+	struct hdictentry	**buckets;
+	size_t			  nbuckets;
+	size_t			  count;
+};
+
+
+/* hdict.c */
+#define hdict_init(d) do { TAILQ_INIT(&((d)->entries)); (d)->buckets = NULL; \
+	(d)->nbuckets = 0; (d)->count = 0; } while(0)
+#define hdict_empty(d) TAILQ_EMPTY(&((d)->entries))
+#define hdict_count(d) ((d)->count)
+int hdict_check(struct hdict *, const char *);
+void *hdict_set(struct hdict *, const char *, void *);
+void hdict_xset(struct hdict *, const char *, void *);
+void *hdict_get(struct hdict *, const char *);
+void *hdict_xget(struct hdict *, const char *);
+void *hdict_pop(struct hdict *, const char *);
+void *hdict_xpop(struct hdict *, const char *);
+int hdict_poproot(struct hdict *, void **);
+int hdict_root(struct hdict *, const char **, void **);
+int hdict_iter(struct hdict *, void **, const char **, void **);
+void hdict_merge(struct hdict *, struct hdict *);
+
+#endif
@@ -0,0 +1,154 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Interned domain names.
+ *
+ * The same domains and MX names come up over and over in a process.
+ * Each distinct name is kept once, case-insensitively and spelled as
+ * first seen, with a reference count and an id that does not change
+ * while it is referenced.  The interned string is what callers keep,
+ * the entry is found back from it, so that structures keyed by domain
+ * compare ids rather than strings once the name has been looked up.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <ctype.h>
+#include <event.h>
+#include <imsg.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+struct intern {
+	uint64_t	 id;
+	size_t		 refs;
+	const char	*key;		/* lowercased, after the name */
+	char		 name[];
+};
+
+static struct intern *intern_find(const char *);
+static struct intern *intern_entry(const char *);
+
+static struct hdict	interns;
+static uint64_t		intern_last;
+static int		intern_inited;
+
+const char *
+intern_domain(const char *name)
+{
+	struct intern	*e;
+	char		*key;
+	size_t		 i, len;
+
+	if ((e = intern_find(name)) == NULL) {
+		len = strlen(name) + 1;
+		e = xcalloc(1, sizeof(*e) + 2 * len);
+		memcpy(e->name, name, len);
+		key = e->name + len;
+		for (i = 0; i < len; i++)
+			key[i] = tolower((unsigned char)name[i]);
+		e->key = key;
+		e->id = ++intern_last;
+		hdict_xset(&interns, e->key, e);
+		stat_increment("intern.domain", 1);
+	}
+	e->refs++;
+
+	return (e->name);
+}
+
+/* the interned spelling of a name, if it is interned at all */
+const char *
+intern_lookup(const char *name)
+{
+	struct intern	*e;
+
+	if ((e = intern_find(name)) == NULL)
+		return (NULL);
+	return (e->name);
+}
+
+/* take another reference on an interned name */
+const char *
+intern_ref(const char *name)
+{
+	intern_entry(name)->refs++;
+	return (name);
+}
+
+void
+intern_release(const char *name)
+{
+	struct intern	*e;
+
+	if (name == NULL)
+		return;
+
+	e = intern_entry(name);
+	if (--e->refs)
+		return;
+
+	hdict_xpop(&interns, e->key);
+	free(e);
+	stat_decrement("intern.domain", 1);
+}
+
+uint64_t
+intern_id(const char *name)
+{
+	return (intern_entry(name)->id);
+}
+
+static struct intern *
+intern_find(const char *name)
+{
+	struct intern	*e;
+	char		 buf[HOST_NAME_MAX + 1], *key;
+	size_t		 i, len;
+
+	if (!intern_inited) {
+		hdict_init(&interns);
+		intern_inited = 1;
+	}
+
+	len = strlen(name) + 1;
+	key = len <= sizeof(buf) ? buf : xmalloc(len);
+	for (i = 0; i < len; i++)
+		key[i] = tolower((unsigned char)name[i]);
+
+	e = hdict_get(&interns, key);
+	if (key != buf)
+		free(key);
+	return (e);
+}
+
+static struct intern *
+intern_entry(const char *name)
+{
+	return ((struct intern *)(name - offsetof(struct intern, name)));
+}
@@ -35,11 +35,35 @@
 #include "iobuf.h"
 
 #define IOBUF_MAX	65536
+#define IOBUF_MIN	4096
 #define IOBUFQ_MIN	4096
+#define IOBUF_POOL_MAX	256
+#define IOBUFQ_CLASSES	5		/* 4KB to 64KB */
+#define IOBUFQ_POOL_MAX	(1024 * 1024)
 
 struct ioqbuf	*ioqbuf_alloc(struct iobuf *, size_t);
+static void	 ioqbuf_free(struct ioqbuf *);
 void		 iobuf_drain(struct iobuf *, size_t);
+static int	 iobuf_prepare(struct iobuf *);
+static void	 iobuf_filled(struct iobuf *, size_t);
 
+/*
+ * Input buffers of IOBUF_MIN bytes released by idle iobufs, shared by
+ * all the iobufs of the process.
+ */
+static char	*iobuf_pool[IOBUF_POOL_MAX];
+static size_t	 iobuf_npool;
+
+/*
+ * Free output chunks, by size class, up to IOBUFQ_POOL_MAX bytes.
+ */
+static struct ioqbuf	*ioqbuf_pool[IOBUFQ_CLASSES];
+static struct iobuf_stats iobuf_stats;
+
+/*
+ * If size is 0, the input buffer is only allocated on the first read,
+ * starting at IOBUF_MIN bytes and growing up to max as reads fill it.
+ */
 int
 iobuf_init(struct iobuf *io, size_t size, size_t max)
 {
@@ -48,17 +72,18 @@ iobuf_init(struct iobuf *io, size_t size, size_t max)
 	if (max == 0)
 		max = IOBUF_MAX;
 
-	if (size == 0)
-		size = max;
-
 	if (size > max)
 		return (-1);
 
+	io->max = max;
+	if (size == 0)
+		return (0);
+
 	if ((io->buf = calloc(size, 1)) == NULL)
 		return (-1);
 
 	io->size = size;
-	io->max = max;
+	iobuf_stats.bytes += size;
 
 	return (0);
 }
@@ -68,11 +93,14 @@ iobuf_clear(struct iobuf *io)
 {
 	struct ioqbuf	*q;
 
+	iobuf_release(io);
+	if (io->buf)
+		iobuf_stats.bytes -= io->size;
 	free(io->buf);
 
 	while ((q = io->outq)) {
 		io->outq = q->next;
-		free(q);
+		ioqbuf_free(q);
 	}
 
 	memset(io, 0, sizeof (*io));
@@ -91,7 +119,7 @@ iobuf_drain(struct iobuf *io, size_t n)
 		} else {
 			left -= q->wpos - q->rpos;
 			io->outq = q->next;
-			free(q);
+			ioqbuf_free(q);
 		}
 	}
 
@@ -117,10 +145,79 @@ iobuf_extend(struct iobuf *io, size_t n)
 
 	io->size += n;
 	io->buf = t;
+	iobuf_stats.bytes += n;
+
+	return (0);
+}
+
+/*
+ * Give the input buffer back to the pool when it holds no data.
+ */
+void
+iobuf_release(struct iobuf *io)
+{
+	if (io->buf == NULL || io->rpos != io->wpos)
+		return;
+
+	if (io->size == IOBUF_MIN && iobuf_npool < IOBUF_POOL_MAX)
+		iobuf_pool[iobuf_npool++] = io->buf;
+	else {
+		iobuf_stats.bytes -= io->size;
+		free(io->buf);
+	}
+
+	io->buf = NULL;
+	io->size = io->rpos = io->wpos = 0;
+}
+
+/*
+ * Make sure there is an input buffer to read into.
+ */
+static int
+iobuf_prepare(struct iobuf *io)
+{
+	size_t	size;
+
+	if (io->buf == NULL) {
+		size = IOBUF_MIN < io->max ? IOBUF_MIN : io->max;
+		if (size == IOBUF_MIN && iobuf_npool)
+			io->buf = iobuf_pool[--iobuf_npool];
+		else {
+			if ((io->buf = malloc(size)) == NULL)
+				return (-1);
+			iobuf_stats.bytes += size;
+		}
+		io->size = size;
+	}
+
+	if (iobuf_left(io) == 0)
+		iobuf_filled(io, 0);
 
 	return (0);
 }
 
+/*
+ * Grow the input buffer after a read that filled it up.
+ */
+static void
+iobuf_filled(struct iobuf *io, size_t n)
+{
+	char	*t;
+	size_t	 size;
+
+	/* only grow if there is no room to reclaim at the front */
+	if (n != iobuf_left(io) || io->rpos || io->size >= io->max)
+		return;
+
+	size = io->size * 2 < io->max ? io->size * 2 : io->max;
+	if ((t = realloc(io->buf, size)) == NULL)
+		return;
+
+	iobuf_stats.bytes += size - io->size;
+	io->buf = t;
+	io->size = size;
+}
+
 size_t
 iobuf_left(struct iobuf *io)
 {
@@ -159,31 +256,37 @@ iobuf_drop(struct iobuf *io, size_t n)
 char *
 iobuf_getline(struct iobuf *iobuf, size_t *rlen)
 {
-	char	*buf;
-	size_t	 len, i;
+	char	*buf, *nl;
+	size_t	 i;
+
+	if (iobuf_len(iobuf) == 0)
+		return (NULL);
 
 	buf = iobuf_data(iobuf);
-	len = iobuf_len(iobuf);
-
-	for (i = 0; i + 1 <= len; i++)
-		if (buf[i] == '\n') {
-			/* Note: the returned address points into the iobuf
-			 * buffer.  We NUL-end it for convenience, and discard
-			 * the data from the iobuf, so that the caller doesn't
-			 * have to do it.  The data remains "valid" as long
-			 * as the iobuf does not overwrite it, that is until
-			 * the next call to iobuf_normalize() or iobuf_extend().
-			 */
-			iobuf_drop(iobuf, i + 1);
-			buf[i] = '\0';
-			if (rlen)
-				*rlen = i;
-			return (buf);
-		}
 
-	return (NULL);
+	if ((nl = memchr(buf, '\n', iobuf_len(iobuf))) == NULL)
+		return (NULL);
+
+	/* Note: the returned address points into the iobuf
+	 * buffer.  We NUL-end it for convenience, and discard
+	 * the data from the iobuf, so that the caller doesn't
+	 * have to do it.  The data remains "valid" as long
+	 * as the iobuf does not overwrite it, that is until
+	 * the next call to iobuf_normalize() or iobuf_extend().
+	 */
+	i = nl - buf;
+	iobuf_drop(iobuf, i + 1);
+	buf[i] = '\0';
+	if (rlen)
+		*rlen = i;
+	return (buf);
 }
 
+/*
+ * Unconsumed data is only moved to the front of the buffer when the
+ * space left after it gets short, so that reads appending a few lines
+ * or a partial DATA chunk do not copy the same bytes over and over.
+ */
 void
 iobuf_normalize(struct iobuf *io)
 {
@@ -195,6 +298,9 @@ iobuf_normalize(struct iobuf *io)
 		return;
 	}
 
+	if (iobuf_left(io) >= io->size / 4)
+		return;
+
 	memmove(io->buf, io->buf + io->rpos, io->wpos - io->rpos);
 	io->wpos -= io->rpos;
 	io->rpos = 0;
@@ -205,6 +311,9 @@ iobuf_read(struct iobuf *io, int fd)
 {
 	ssize_t	n;
 
+	if (iobuf_prepare(io) == -1)
+		return (IOBUF_ERROR);
+
 	n = read(fd, io->buf + io->wpos, iobuf_left(io));
 	if (n == -1) {
 		/* XXX is this really what we want? */
@@ -215,21 +324,71 @@ iobuf_read(struct iobuf *io, int fd)
 	if (n == 0)
 		return (IOBUF_CLOSED);
 
+	iobuf_filled(io, n);
 	io->wpos += n;
 
 	return (n);
 }
 
+void
+iobuf_pool_stats(struct iobuf_stats *stats)
+{
+	*stats = iobuf_stats;
+}
+
+/*
+ * Free the buffers kept in the pools.
+ */
+void
+iobuf_pool_purge(void)
+{
+	struct ioqbuf	*q;
+	size_t		 size;
+	int		 c;
+
+	while (iobuf_npool) {
+		free(iobuf_pool[--iobuf_npool]);
+		iobuf_stats.bytes -= IOBUF_MIN;
+	}
+
+	for (c = 0, size = IOBUFQ_MIN; c < IOBUFQ_CLASSES; c++, size *= 2) {
+		while ((q = ioqbuf_pool[c])) {
+			ioqbuf_pool[c] = q->next;
+			free(q);
+			iobuf_stats.cached -= 1;
+			iobuf_stats.cached_bytes -= size;
+			iobuf_stats.bytes -= size;
+		}
+	}
+}
+
 struct ioqbuf *
 ioqbuf_alloc(struct iobuf *io, size_t len)
 {
-	struct ioqbuf   *q;
+	struct ioqbuf   *q = NULL;
+	size_t		 size;
+	int		 c;
 
-	if (len < IOBUFQ_MIN)
-		len = IOBUFQ_MIN;
+	/* round up to a size class if there is one */
+	for (c = 0, size = IOBUFQ_MIN; c < IOBUFQ_CLASSES; c++, size *= 2)
+		if (len <= size)
+			break;
+	if (c < IOBUFQ_CLASSES) {
+		len = size;
+		if ((q = ioqbuf_pool[c])) {
+			ioqbuf_pool[c] = q->next;
+			iobuf_stats.cached -= 1;
+			iobuf_stats.cached_bytes -= len;
+			iobuf_stats.recycled_bytes += len;
+		}
+	}
 
-	if ((q = malloc(sizeof(*q) + len)) == NULL)
-		return (NULL);
+	if (q == NULL) {
+		if ((q = malloc(sizeof(*q) + len)) == NULL)
+			return (NULL);
+		iobuf_stats.allocated += 1;
+		iobuf_stats.bytes += len;
+	}
 
 	q->rpos = 0;
 	q->wpos = 0;
@@ -246,6 +405,28 @@ ioqbuf_alloc(struct iobuf *io, size_t len)
 	return (q);
 }
 
+static void
+ioqbuf_free(struct ioqbuf *q)
+{
+	size_t	size;
+	int	c;
+
+	for (c = 0, size = IOBUFQ_MIN; c < IOBUFQ_CLASSES; c++, size *= 2)
+		if (q->size == size)
+			break;
+	if (c == IOBUFQ_CLASSES ||
+	    iobuf_stats.cached_bytes + size > IOBUFQ_POOL_MAX) {
+		iobuf_stats.bytes -= q->size;
+		free(q);
+		return;
+	}
+
+	q->next = ioqbuf_pool[c];
+	ioqbuf_pool[c] = q;
+	iobuf_stats.cached += 1;
+	iobuf_stats.cached_bytes += size;
+}
+
 size_t
 iobuf_queued(struct iobuf *io)
 {
@@ -428,6 +609,9 @@ iobuf_read_tls(struct iobuf *io, struct tls *tls)
 {
 	ssize_t	n;
 
+	if (iobuf_prepare(io) == -1)
+		return (IOBUF_ERROR);
+
 	n = tls_read(tls, io->buf + io->wpos, iobuf_left(io));
 	if (n == TLS_WANT_POLLIN)
 		return (IOBUF_WANT_READ);
@@ -438,6 +622,7 @@ iobuf_read_tls(struct iobuf *io, struct tls *tls)
 	else if (n == -1)
 		return (IOBUF_ERROR);
 
+	iobuf_filled(io, n);
 	io->wpos += n;
 
 	return (n);
@@ -35,6 +35,14 @@ struct iobuf {
 	struct ioqbuf	*outqlast;
 };
 
+struct iobuf_stats {
+	size_t		 allocated;	/* output chunks allocated */
+	size_t		 cached;	/* output chunks in the pool */
+	size_t		 cached_bytes;
+	size_t		 recycled_bytes;
+	size_t		 bytes;		/* held by buffers and pools */
+};
+
 struct tls;
 
 #define IOBUF_WANT_READ		-1
@@ -44,6 +52,9 @@ struct tls;
 
 int	iobuf_init(struct iobuf *, size_t, size_t);
 void	iobuf_clear(struct iobuf *);
+void	iobuf_release(struct iobuf *);
+void	iobuf_pool_stats(struct iobuf_stats *);
+void	iobuf_pool_purge(void);
 
 int	iobuf_extend(struct iobuf *, size_t);
 void	iobuf_normalize(struct iobuf *);
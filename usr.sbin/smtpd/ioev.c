@@ -59,12 +59,17 @@ struct io {
 	int		 sock;
 	void		*arg;
 	void		(*cb)(struct io*, int, void *);
+	const char	*name;
 	struct iobuf	 iobuf;
 	size_t		 lowat;
 	int		 timeout;
 	int		 flags;
 	int		 state;
 	struct event	 ev;
+	int		 evsock;	/* registration of ev */
+	short		 evmask;
+	int		 evtimeout;
+	void		(*evcb)(int, short, void *);
 	struct tls	*tls;
 
 	const char	*error; /* only valid immediately on callback */
@@ -82,6 +87,7 @@ void	io_dispatch_connect(int, short, void *);
 size_t	io_pending(struct io *);
 size_t	io_queued(struct io*);
 void	io_reset(struct io *, short, void (*)(int, short, void*));
+void	io_unregister(struct io *);
 void	io_frame_enter(const char *, struct io *, int);
 void	io_frame_leave(struct io *);
 
@@ -97,6 +103,11 @@ void	io_reload_tls(struct io *io);
 static struct io	*current = NULL;
 static uint64_t		 frame = 0;
 static int		_io_debug = 0;
+static int		(*profile_begin_cb)(struct timespec *);
+static void		(*profile_end_cb)(const struct timespec *, const char *,
+			    ...);
+static void		(*clock_enter_cb)(void);
+static void		(*clock_leave_cb)(void);
 
 #define io_debug(args...) do { if (_io_debug) printf(args); } while(0)
 
@@ -227,6 +238,15 @@ io_frame_leave(struct io *io)
 	frame += 1;
 }
 
+/*
+ * Return the io whose event is being dispatched, if any.
+ */
+struct io *
+io_current(void)
+{
+	return (current);
+}
+
 void
 _io_init(void)
 {
@@ -274,8 +294,7 @@ io_free(struct io *io)
 	io->tls = NULL;
 #endif
 
-	if (event_initialized(&io->ev))
-		event_del(&io->ev);
+	io_unregister(io);
 	if (io->sock != -1) {
 		close(io->sock);
 		io->sock = -1;
@@ -311,16 +330,37 @@ io_release(struct io *io)
 void
 io_set_fd(struct io *io, int fd)
 {
+	if (fd != io->sock)
+		io_unregister(io);
 	io->sock = fd;
 	if (fd != -1)
 		io_reload(io);
 }
 
+/* let the program time the callbacks, see profile.c in smtpd */
 void
-io_set_callback(struct io *io, void(*cb)(struct io *, int, void *), void *arg)
+io_set_profiler(int (*begin)(struct timespec *),
+    void (*end)(const struct timespec *, const char *, ...))
+{
+	profile_begin_cb = begin;
+	profile_end_cb = end;
+}
+
+/* let the program cache its clock around the callbacks */
+void
+io_set_clock(void (*enter)(void), void (*leave)(void))
+{
+	clock_enter_cb = enter;
+	clock_leave_cb = leave;
+}
+
+void
+io_set_callback_name(struct io *io, void(*cb)(struct io *, int, void *),
+    void *arg, const char *name)
 {
 	io->cb = cb;
 	io->arg = arg;
+	io->name = name;
 }
 
 void
@@ -529,6 +569,14 @@ io_reload(struct io *io)
 
 	iobuf_normalize(&io->iobuf);
 
+	/*
+	 * Do not keep an empty input buffer while the session is not
+	 * reading, typically waiting for a reply from another process
+	 * or writing a response.
+	 */
+	if (!IO_READING(io) || io->flags & IO_PAUSE_IN)
+		iobuf_release(&io->iobuf);
+
 #ifdef IO_TLS
 	if (io->tls) {
 		io_reload_tls(io);
@@ -562,17 +610,31 @@ io_reset(struct io *io, short events, void (*dispatch)(int, short, void*))
 	 */
 	io->flags |= IO_RESET;
 
-	if (event_initialized(&io->ev))
-		event_del(&io->ev);
-
 	/*
 	 * The io is paused by the user, so we don't want the timeout to be
 	 * effective.
 	 */
-	if (events == 0)
+	if (events == 0) {
+		io_unregister(io);
 		return;
+	}
+
+	/*
+	 * Events are persistent.  As long as the interest does not change,
+	 * keep the registration with the kernel and only re-arm the timeout.
+	 */
+	if (!event_initialized(&io->ev) || io->evsock != io->sock ||
+	    io->evmask != events || io->evcb != dispatch ||
+	    io->evtimeout != io->timeout ||
+	    !event_pending(&io->ev, EV_READ|EV_WRITE, NULL)) {
+		io_unregister(io);
+		event_set(&io->ev, io->sock, events | EV_PERSIST, dispatch, io);
+		io->evsock = io->sock;
+		io->evmask = events;
+		io->evcb = dispatch;
+		io->evtimeout = io->timeout;
+	}
 
-	event_set(&io->ev, io->sock, events, dispatch, io);
 	if (io->timeout >= 0) {
 		tv.tv_sec = io->timeout / 1000;
 		tv.tv_usec = (io->timeout % 1000) * 1000;
@@ -583,6 +645,14 @@ io_reset(struct io *io, short events, void (*dispatch)(int, short, void*))
 	event_add(&io->ev, ptv);
 }
 
+void
+io_unregister(struct io *io)
+{
+	if (event_initialized(&io->ev))
+		event_del(&io->ev);
+	io->evcb = NULL;
+}
+
 size_t
 io_pending(struct io *io)
 {
@@ -733,7 +803,19 @@ leave:
 void
 io_callback(struct io *io, int evt)
 {
-	io->cb(io, evt, io->arg);
+	struct timespec	t0;
+	const char	*name = io->name;
+
+	if (clock_enter_cb)
+		clock_enter_cb();
+	if (profile_begin_cb && profile_begin_cb(&t0)) {
+		/* the io may be gone on return */
+		io->cb(io, evt, io->arg);
+		profile_end_cb(&t0, "io.%s.%s", name, io_strevent(evt));
+	} else
+		io->cb(io, evt, io->arg);
+	if (clock_leave_cb)
+		clock_leave_cb();
 }
 
 int
@@ -779,6 +861,7 @@ io_dispatch_connect(int fd, short ev, void *humppa)
 	io_frame_enter("io_dispatch_connect", io, ev);
 
 	if (ev == EV_TIMEOUT) {
+		io_unregister(io);
 		close(fd);
 		io->sock = -1;
 		io_callback(io, IO_TIMEOUT);
@@ -790,12 +873,14 @@ io_dispatch_connect(int fd, short ev, void *humppa)
 			e = errno;
 		}
 		if (e) {
+			io_unregister(io);
 			close(fd);
 			io->sock = -1;
 			io->error = strerror(e);
 			io_callback(io, e == ETIMEDOUT ? IO_TIMEOUT : IO_ERROR);
 		}
 		else {
+			io_unregister(io);
 			io->state = IO_STATE_UP;
 			io_callback(io, IO_CONNECTED);
 		}
@@ -874,6 +959,9 @@ io_dispatch_handshake_tls(int fd, short event, void *humppa)
 		io_reset(io, EV_READ, io_dispatch_handshake_tls);
 	else if (ret == TLS_WANT_POLLOUT)
 		io_reset(io, EV_WRITE, io_dispatch_handshake_tls);
+	else if (ret == TLS_WANT_ASYNC)
+		/* Suspended until io_wakeup() is called. */
+		io_reset(io, EV_READ, io_dispatch_handshake_tls);
 	else {
 		io->error = tls_error(io->tls);
 		io_callback(io, IO_ERROR);
@@ -916,7 +1004,8 @@ again:
 	default:
 		io_debug("io_dispatch_read_tls(...) -> r=%d\n", n);
 		io_callback(io, IO_DATAIN);
-		if (current == io && IO_READING(io))
+		if (current == io && IO_READING(io) &&
+		    !(io->flags & IO_PAUSE_IN))
 			goto again;
 	}
 
@@ -965,6 +1054,19 @@ io_dispatch_write_tls(int fd, short event, void *humppa)
 	io_frame_leave(io);
 }
 
+/*
+ * Resume a handshake suspended on an asynchronous operation.
+ */
+void
+io_wakeup(struct io *io)
+{
+	if (io->state != IO_STATE_CONNECT_TLS &&
+	    io->state != IO_STATE_ACCEPT_TLS)
+		fatalx("io_wakeup: bad state");
+
+	event_active(&io->ev, EV_READ, 1);
+}
+
 void
 io_reload_tls(struct io *io)
 {
@@ -981,7 +1083,8 @@ io_reload_tls(struct io *io)
 		return;
 	}
 
-	/* paused */
+	/* paused or nothing to write, drop the registration */
+	io_reset(io, 0, NULL);
 }
 
 #endif /* IO_TLS */
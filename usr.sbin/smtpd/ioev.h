@@ -39,7 +39,13 @@ void io_free(struct io *);
 void io_set_read(struct io *);
 void io_set_write(struct io *);
 void io_set_fd(struct io *, int);
-void io_set_callback(struct io *io, void(*)(struct io *, int, void *), void *);
+void io_set_callback_name(struct io *io, void(*)(struct io *, int, void *),
+    void *, const char *);
+#define	io_set_callback(io, cb, arg)	\
+	io_set_callback_name((io), (cb), (arg), #cb)
+void io_set_profiler(int (*)(struct timespec *),
+    void (*)(const struct timespec *, const char *, ...));
+void io_set_clock(void (*)(void), void (*)(void));
 void io_set_timeout(struct io *, int);
 void io_set_lowat(struct io *, size_t);
 void io_pause(struct io *, int);
@@ -54,6 +60,8 @@ const char* io_error(struct io *);
 struct tls* io_tls(struct io *);
 int io_fileno(struct io *);
 int io_paused(struct io *, int);
+struct io *io_current(void);
+void io_wakeup(struct io *);
 
 /* Buffered output functions */
 int io_write(struct io *, const void *, size_t);
@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
+#include <time.h>
 
 #include "smtpd.h"
 
@@ -44,6 +45,9 @@ limit_mta_set_defaults(struct mta_limits *limits)
 	limits->maxconn_per_relay = 100;
 	limits->maxconn_per_domain = 100;
 
+	limits->adaptive_min = 2;
+	limits->adaptive_max = 0;
+
 	limits->conndelay_host = 0;
 	limits->conndelay_route = 5;
 	limits->conndelay_source = 0;
@@ -54,6 +58,7 @@ limit_mta_set_defaults(struct mta_limits *limits)
 	limits->discdelay_route = 3;
 
 	limits->max_mail_per_session = 100;
+	limits->max_rcpt_per_transaction = 100;
 	limits->sessdelay_transaction = 0;
 	limits->sessdelay_keepalive = 10;
 
@@ -82,6 +87,24 @@ limit_mta_set(struct mta_limits *limits, const char *key, int64_t value)
 	else if (!strcmp(key, "max-conn-per-domain"))
 		limits->maxconn_per_domain = value;
 
+	else if (!strcmp(key, "adaptive-conn-min"))
+		limits->adaptive_min = value;
+	else if (!strcmp(key, "adaptive-conn-max"))
+		limits->adaptive_max = value;
+
+	else if (!strcmp(key, "mail-rate-per-domain"))
+		limits->mailrate_domain = value;
+	else if (!strcmp(key, "mail-rate-per-host"))
+		limits->mailrate_host = value;
+	else if (!strcmp(key, "mail-rate-per-source"))
+		limits->mailrate_source = value;
+	else if (!strcmp(key, "rcpt-rate-per-domain"))
+		limits->rcptrate_domain = value;
+	else if (!strcmp(key, "rcpt-rate-per-host"))
+		limits->rcptrate_host = value;
+	else if (!strcmp(key, "rcpt-rate-per-source"))
+		limits->rcptrate_source = value;
+
 	else if (!strcmp(key, "conn-delay-host"))
 		limits->conndelay_host = value;
 	else if (!strcmp(key, "conn-delay-route"))
@@ -100,6 +123,8 @@ limit_mta_set(struct mta_limits *limits, const char *key, int64_t value)
 
 	else if (!strcmp(key, "session-mail-max"))
 		limits->max_mail_per_session = value;
+	else if (!strcmp(key, "transaction-rcpt-max"))
+		limits->max_rcpt_per_transaction = value;
 	else if (!strcmp(key, "session-transaction-delay"))
 		limits->sessdelay_transaction = value;
 	else if (!strcmp(key, "session-keepalive"))
@@ -108,6 +133,12 @@ limit_mta_set(struct mta_limits *limits, const char *key, int64_t value)
 	else if (!strcmp(key, "max-failures-per-session"))
 		limits->max_failures_per_session = value;
 
+	else if (!strcmp(key, "source-policy")) {
+		if (value < 0 || value > 2)
+			return (0);
+		limits->source_policy = value;
+	}
+
 	else if (!strcmp(key, "task-hiwat"))
 		limits->task_hiwat = value;
 	else if (!strcmp(key, "task-lowat"))
@@ -120,3 +151,85 @@ limit_mta_set(struct mta_limits *limits, const char *key, int64_t value)
 
 	return (1);
 }
+
+/*
+ * Rate limits of the filter builtins, as a token bucket per key kept in
+ * the form of its theoretical arrival time (GCRA): a key may be hit
+ * count times in a burst, then once every period / count.  Keys at rest
+ * and the least recently hit keys beyond LIMIT_ENTRIES_MAX are dropped,
+ * which is the same as a full bucket.
+ */
+#define	LIMIT_ENTRIES_MAX	65536
+
+static int64_t
+limit_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+limit_entry_remove(struct limit *l, struct limit_entry *e)
+{
+	hdict_xpop(&l->entries, e->key);
+	TAILQ_REMOVE(&l->lru, e, entry);
+	free(e->key);
+	free(e);
+}
+
+struct limit *
+limit_new(enum limit_key key, int count, int period)
+{
+	struct limit	*l;
+
+	l = xcalloc(1, sizeof(*l));
+	l->key = key;
+	l->interval = (int64_t)period * 1000 / count;
+	if (l->interval == 0)
+		l->interval = 1;
+	l->tolerance = (int64_t)period * 1000 - l->interval;
+	hdict_init(&l->entries);
+	TAILQ_INIT(&l->lru);
+
+	return (l);
+}
+
+/*
+ * Take a token for key, return 1 if the bucket is empty.
+ */
+int
+limit_hit(struct limit *l, const char *key)
+{
+	struct limit_entry	*e;
+	char			 buf[SMTPD_MAXMAILADDRSIZE];
+	int64_t			 now, tat;
+
+	if (!lowercase(buf, key, sizeof(buf)))
+		return (0);
+
+	now = limit_now();
+	if ((e = hdict_get(&l->entries, buf)) != NULL) {
+		tat = e->tat > now ? e->tat : now;
+		if (tat - now > l->tolerance)
+			return (1);
+		TAILQ_REMOVE(&l->lru, e, entry);
+	}
+	else {
+		/* the oldest entry may have refilled already */
+		e = TAILQ_LAST(&l->lru, limit_entry_lru);
+		if (e && (e->tat <= now ||
+		    hdict_count(&l->entries) >= LIMIT_ENTRIES_MAX))
+			limit_entry_remove(l, e);
+
+		e = xcalloc(1, sizeof(*e));
+		e->key = xstrdup(buf);
+		hdict_xset(&l->entries, e->key, e);
+		tat = now;
+	}
+
+	e->tat = tat + l->interval;
+	TAILQ_INSERT_HEAD(&l->lru, e, entry);
+	return (0);
+}
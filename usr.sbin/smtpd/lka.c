@@ -32,10 +32,13 @@
 #include <grp.h> /* needed for setgroups */
 #include <imsg.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
 #include <openssl/ssl.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "smtpd.h"
@@ -44,9 +47,20 @@
 static void lka_imsg(struct mproc *, struct imsg *);
 static void lka_shutdown(void);
 static void lka_sig_handler(int, short, void *);
-static int lka_authenticate(const char *, const char *, const char *);
+static void lka_table_changed(void);
+static void lka_table_updated(struct table *, int);
+static int lka_authenticate(struct mproc *, uint64_t, const char *,
+    const char *, const char *);
+static void lka_auth_init(void);
+static void lka_auth_worker(int);
+static void lka_auth_imsg(struct mproc *, struct imsg *);
+static void lka_auth_digest(const char *, uint8_t *);
+static int lka_auth_cached(const char *, const char *, const uint8_t *);
+static void lka_auth_checkpass(struct mproc *, uint64_t, const char *,
+    const char *, const char *, const uint8_t *);
 static int lka_credentials(const char *, const char *, char *, size_t);
 static int lka_userinfo(const char *, const char *, struct userinfo *);
+static int lka_pkifiles(const char *, const char *, struct pkifiles *);
 static int lka_addrname(const char *, const struct sockaddr *,
     struct addrname *);
 static int lka_mailaddrmap(const char *, const char *, const struct mailaddr *);
@@ -55,6 +69,44 @@ static void proc_timeout(int fd, short event, void *p);
 
 struct event	 ev_proc_ready;
 
+/* control requests waiting for the end of a table update, by peer id */
+static struct tree	 table_updates;
+
+/*
+ * Password hashes are checked by a pool of worker processes, so that an
+ * expensive crypt_checkpass() does not block every other lookup.  Until
+ * the hash or the password changes, a successful check is remembered for
+ * a short while.  Only an HMAC of the password, keyed with a per-process
+ * secret, is kept.
+ */
+#define	LKA_AUTH_WORKERS	4
+#define	LKA_AUTH_CACHE_TTL	30	/* seconds, 0 disables the cache */
+#define	LKA_AUTH_CACHE_MAX	1024
+
+struct lka_auth_worker {
+	struct mproc		 p;
+	size_t			 pending;
+};
+
+struct lka_auth_req {
+	uint64_t		 reqid;
+	struct mproc		*p;
+	char			*key;
+	char			*hash;
+	uint8_t			 digest[EVP_MAX_MD_SIZE];
+};
+
+struct lka_auth_entry {
+	time_t			 expire;
+	char			*hash;
+	uint8_t			 digest[EVP_MAX_MD_SIZE];
+};
+
+static struct lka_auth_worker	 auth_workers[LKA_AUTH_WORKERS];
+static struct tree		 auth_reqs;
+static struct dict		 auth_cache;
+static uint8_t			 auth_secret[32];
+
 static void
 lka_imsg(struct mproc *p, struct imsg *imsg)
 {
@@ -63,12 +115,14 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 	struct sockaddr_storage	 ss;
 	struct userinfo		 userinfo;
 	struct addrname		 addrname;
+	struct pkifiles		 pkifiles;
 	struct envelope		 evp;
 	struct mailaddr		 maddr;
 	struct msg		 m;
 	union lookup		 lk;
 	char			 buf[LINE_MAX];
 	const char		*tablename, *username, *password, *label, *procname;
+	const char		*name;
 	uint64_t		 reqid;
 	int			 v;
 	struct timeval		 tv;
@@ -99,18 +153,6 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 
 	switch (imsg->hdr.type) {
 
-	case IMSG_GETADDRINFO:
-	case IMSG_GETNAMEINFO:
-	case IMSG_RES_QUERY:
-		resolver_dispatch_request(p, imsg);
-		return;
-
-	case IMSG_MTA_DNS_HOST:
-	case IMSG_MTA_DNS_MX:
-	case IMSG_MTA_DNS_MX_PREFERENCE:
-		dns_imsg(p, imsg);
-		return;
-
 	case IMSG_SMTP_CHECK_SENDER:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
@@ -153,6 +195,30 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 		m_close(p);
 		return;
 
+	case IMSG_SMTP_LOOKUP_PKI:
+		m_msg(&m, imsg);
+		m_get_id(&m, &reqid);
+		m_get_string(&m, &tablename);
+		m_get_string(&m, &name);
+		m_end(&m);
+
+		ret = lka_pkifiles(tablename, name, &pkifiles);
+		if (ret != LKA_OK) {
+			m_create(p, IMSG_SMTP_LOOKUP_PKI, 0, 0, -1);
+			m_add_id(p, reqid);
+			m_add_int(p, ret);
+			m_close(p);
+			return;
+		}
+
+		/* only root may read the files */
+		m_create(p_parent, IMSG_LKA_OPEN_PKI, 0, 0, -1);
+		m_add_id(p_parent, reqid);
+		m_add_string(p_parent, pkifiles.cert);
+		m_add_string(p_parent, pkifiles.key);
+		m_close(p_parent);
+		return;
+
 	case IMSG_SMTP_AUTHENTICATE:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
@@ -171,7 +237,10 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 		}
 
-		ret = lka_authenticate(tablename, username, password);
+		ret = lka_authenticate(p, reqid, tablename, username,
+		    password);
+		if (ret == -1)
+			return;
 
 		m_create(p, IMSG_SMTP_AUTHENTICATE, 0, 0, -1);
 		m_add_id(p, reqid);
@@ -323,8 +392,12 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 		return;
 
 	case IMSG_LKA_AUTHENTICATE:
+		/* the reply from the parent starts with the session id */
+		if (imsg->hdr.len - IMSG_HEADER_SIZE < sizeof(reqid))
+			fatalx("lka: bad authentication reply");
+		memcpy(&reqid, imsg->data, sizeof(reqid));
 		imsg->hdr.type = IMSG_SMTP_AUTHENTICATE;
-		m_forward(p_dispatcher, imsg);
+		m_forward(smtp_peer(reqid), imsg);
 		return;
 
 	case IMSG_CTL_VERBOSE:
@@ -341,18 +414,26 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 		profiling = v;
 		return;
 
+	case IMSG_CTL_SHOW_PROFILE:
+		profile_show(p, imsg->hdr.peerid);
+		return;
+
 	case IMSG_CTL_UPDATE_TABLE:
-		ret = 0;
 		table = table_find(env, imsg->data);
 		if (table == NULL) {
 			log_warnx("warn: Lookup table not found: "
 			    "\"%s\"", (char *)imsg->data);
-		} else 
-			ret = table_update(table);
+			m_compose(p_control, IMSG_CTL_FAIL,
+			    imsg->hdr.peerid, 0, -1, NULL, 0);
+			return;
+		}
+		tree_set(&table_updates, imsg->hdr.peerid, table);
+		if ((ret = table_update(table)) != -1)
+			lka_table_updated(table, ret);
+		return;
 
-		m_compose(p_control,
-		    (ret == 1) ? IMSG_CTL_OK : IMSG_CTL_FAIL,
-		    imsg->hdr.peerid, 0, -1, NULL, 0);
+	case IMSG_CTL_SHOW_FILTERS:
+		lka_proc_show(p_control, imsg->hdr.peerid);
 		return;
 
 	case IMSG_LKA_PROCESSOR_FORK:
@@ -654,6 +735,45 @@ lka_sig_handler(int sig, short event, void *p)
 	}
 }
 
+/*
+ * The mta keeps the answers it got for its relays, a table change must
+ * make it ask again.
+ */
+static void
+lka_table_changed(void)
+{
+	int	i;
+
+	for (i = 0; i < mta_peer_count(); i++)
+		m_compose(mta_peer_at(i), IMSG_LKA_TABLE_CHANGED, 0, 0, -1,
+		    NULL, 0);
+}
+
+/*
+ * An update is over, answer every request waiting for the table,
+ * including those of an update that a later one restarted.
+ */
+static void
+lka_table_updated(struct table *t, int ok)
+{
+	struct table	*table;
+	void		*iter;
+	uint64_t	 id;
+
+	for (;;) {
+		iter = NULL;
+		table = NULL;
+		while (tree_iter(&table_updates, &iter, &id, (void **)&table))
+			if (table == t)
+				break;
+		if (table != t)
+			break;
+		tree_xpop(&table_updates, id);
+		m_compose(p_control, ok ? IMSG_CTL_OK : IMSG_CTL_FAIL,
+		    id, 0, -1, NULL, 0);
+	}
+}
+
 void
 lka_shutdown(void)
 {
@@ -666,6 +786,7 @@ lka(void)
 {
 	struct passwd	*pw;
 	struct event	 ev_sigchld;
+	int		 i;
 
 	purge_config(PURGE_LISTENERS);
 
@@ -682,6 +803,8 @@ lka(void)
 	imsg_callback = lka_imsg;
 	event_init();
 
+	lka_auth_init();
+
 	signal_set(&ev_sigchld, SIGCHLD, lka_sig_handler, NULL);
 	signal_add(&ev_sigchld, NULL);
 	signal(SIGINT, SIG_IGN);
@@ -693,12 +816,24 @@ lka(void)
 	config_peer(PROC_QUEUE);
 	config_peer(PROC_CONTROL);
 	config_peer(PROC_DISPATCHER);
+	config_peer(PROC_MTA);
+	config_peer(PROC_SMTP);
+	config_peer(PROC_LOGGER);
+	stat_cpu_start(NULL);
+	memory_start(NULL, NULL);
 
 	/* Ignore them until we get our config */
 	mproc_disable(p_dispatcher);
+	for (i = 0; i < env->sc_mta_workers; i++)
+		mproc_disable(p_mta[i]);
+	for (i = 0; i < env->sc_smtp_workers; i++)
+		mproc_disable(p_smtp[i]);
 
 	lka_report_init();
 	lka_filter_init();
+	table_on_change(lka_table_changed);
+	table_on_update(lka_table_updated);
+	tree_init(&table_updates);
 
 #if HAVE_PLEDGE
 	/* proc & exec will be revoked before serving requests */
@@ -722,7 +857,10 @@ proc_timeout(int fd, short event, void *p)
 		goto reset;
 
 	lka_filter_ready();
+	lka_report_publish();
 	mproc_enable(p_dispatcher);
+	config_peer(PROC_MTA);
+	config_peer(PROC_SMTP);
 	return;
 
 reset:
@@ -732,11 +870,18 @@ reset:
 }
 
 
+/*
+ * Returns -1 when the password check was handed over to a worker, which
+ * replies to the session later.
+ */
 static int
-lka_authenticate(const char *tablename, const char *user, const char *password)
+lka_authenticate(struct mproc *p, uint64_t reqid, const char *tablename,
+    const char *user, const char *password)
 {
 	struct table		*table;
 	char	       		 offloadkey[LINE_MAX];
+	char			 authkey[LINE_MAX];
+	uint8_t			 digest[EVP_MAX_MD_SIZE];
 	union lookup		 lk;
 
 	log_debug("debug: lka: authenticating for %s:%s", tablename, user);
@@ -775,12 +920,227 @@ lka_authenticate(const char *tablename, const char *user, const char *password)
 	case 0:
 		return (LKA_PERMFAIL);
 	default:
-		if (crypt_checkpass(password, lk.creds.password) == 0)
+		(void)snprintf(authkey, sizeof(authkey), "%s:%s", tablename,
+		    user);
+		lka_auth_digest(password, digest);
+		if (lka_auth_cached(authkey, lk.creds.password, digest))
 			return (LKA_OK);
-		return (LKA_PERMFAIL);
+		lka_auth_checkpass(p, reqid, authkey, password,
+		    lk.creds.password, digest);
+		return (-1);
+	}
+}
+
+static void
+lka_auth_init(void)
+{
+	struct lka_auth_worker	*w;
+	int			 i, sp[2];
+
+	tree_init(&auth_reqs);
+	dict_init(&auth_cache);
+	arc4random_buf(auth_secret, sizeof(auth_secret));
+
+	for (i = 0; i < LKA_AUTH_WORKERS; i++) {
+		w = &auth_workers[i];
+		if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) == -1)
+			fatal("lka_auth_init: socketpair");
+
+		if ((w->p.pid = fork()) == -1)
+			fatal("lka_auth_init: fork");
+
+		if (w->p.pid == 0) {
+			close(sp[0]);
+			lka_auth_worker(sp[1]);
+		}
+
+		close(sp[1]);
+		io_set_nonblocking(sp[0]);
+		w->p.proc = PROC_LKA;
+		w->p.name = "auth";
+		w->p.handler = lka_auth_imsg;
+		w->p.data = w;
+		mproc_init(&w->p, sp[0]);
+		mproc_enable(&w->p);
 	}
 }
 
+static void
+lka_auth_worker(int fd)
+{
+	struct mproc	 p;
+	struct imsg	 imsg;
+	struct msg	 m;
+	const char	*password, *hash;
+	uint64_t	 id;
+	ssize_t		 n;
+	int		 ret;
+
+	if (dup2(fd, STDERR_FILENO + 1) == -1)
+		fatal("lka_auth_worker: dup2");
+	closefrom(STDERR_FILENO + 2);
+
+	setproctitle("%s auth", proc_title(PROC_LKA));
+
+#if HAVE_PLEDGE
+	if (pledge("stdio", NULL) == -1)
+		fatal("pledge");
+#endif
+
+	memset(&p, 0, sizeof(p));
+	p.proc = PROC_LKA;
+	p.name = "auth";
+	mproc_init(&p, STDERR_FILENO + 1);
+
+	for (;;) {
+		if ((n = imsg_read(&p.imsgbuf)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fatal("lka_auth_worker: imsg_read");
+		}
+		if (n == 0)
+			_exit(0);
+
+		for (;;) {
+			if ((n = imsg_get(&p.imsgbuf, &imsg)) == -1)
+				fatal("lka_auth_worker: imsg_get");
+			if (n == 0)
+				break;
+
+			m_msg(&m, &imsg);
+			m_get_id(&m, &id);
+			m_get_string(&m, &password);
+			m_get_string(&m, &hash);
+			m_end(&m);
+
+			ret = crypt_checkpass(password, hash) == 0;
+			imsg_free(&imsg);
+
+			m_create(&p, IMSG_LKA_CHECKPASS, 0, 0, -1);
+			m_add_id(&p, id);
+			m_add_int(&p, ret);
+			m_flush(&p);
+		}
+	}
+}
+
+static void
+lka_auth_imsg(struct mproc *p, struct imsg *imsg)
+{
+	struct lka_auth_worker	*w = p->data;
+	struct lka_auth_req	*req;
+	struct lka_auth_entry	*e, *old;
+	struct msg		 m;
+	uint64_t		 id;
+	int			 ret;
+
+	if (imsg == NULL)
+		fatalx("lka: auth worker exited");
+
+	if (imsg->hdr.type != IMSG_LKA_CHECKPASS)
+		fatalx("lka_auth_imsg: unexpected %s imsg",
+		    imsg_to_str(imsg->hdr.type));
+
+	m_msg(&m, imsg);
+	m_get_id(&m, &id);
+	m_get_int(&m, &ret);
+	m_end(&m);
+
+	req = tree_xpop(&auth_reqs, id);
+	w->pending--;
+
+	if (ret && LKA_AUTH_CACHE_TTL) {
+		if (dict_count(&auth_cache) >= LKA_AUTH_CACHE_MAX) {
+			while (dict_poproot(&auth_cache, (void **)&e)) {
+				free(e->hash);
+				free(e);
+			}
+		}
+		e = xcalloc(1, sizeof(*e));
+		e->expire = time(NULL) + LKA_AUTH_CACHE_TTL;
+		e->hash = req->hash;
+		memcpy(e->digest, req->digest, sizeof(e->digest));
+		if ((old = dict_set(&auth_cache, req->key, e))) {
+			free(old->hash);
+			free(old);
+		}
+	}
+	else
+		free(req->hash);
+
+	m_create(req->p, IMSG_SMTP_AUTHENTICATE, 0, 0, -1);
+	m_add_id(req->p, req->reqid);
+	m_add_int(req->p, ret ? LKA_OK : LKA_PERMFAIL);
+	m_close(req->p);
+
+	free(req->key);
+	free(req);
+}
+
+static void
+lka_auth_digest(const char *password, uint8_t *digest)
+{
+	memset(digest, 0, EVP_MAX_MD_SIZE);
+	if (HMAC(EVP_sha256(), auth_secret, sizeof(auth_secret),
+	    (const unsigned char *)password, strlen(password), digest,
+	    NULL) == NULL)
+		fatalx("lka_auth_digest: HMAC failed");
+}
+
+static int
+lka_auth_cached(const char *key, const char *hash, const uint8_t *digest)
+{
+	struct lka_auth_entry	*e;
+
+	if ((e = dict_get(&auth_cache, key)) == NULL)
+		return (0);
+
+	if (e->expire <= time(NULL)) {
+		dict_xpop(&auth_cache, key);
+		free(e->hash);
+		free(e);
+		return (0);
+	}
+
+	if (strcmp(e->hash, hash) != 0 ||
+	    timingsafe_memcmp(e->digest, digest, sizeof(e->digest)) != 0)
+		return (0);
+
+	return (1);
+}
+
+static void
+lka_auth_checkpass(struct mproc *p, uint64_t reqid, const char *key,
+    const char *password, const char *hash, const uint8_t *digest)
+{
+	struct lka_auth_worker	*w;
+	struct lka_auth_req	*req;
+	uint64_t		 id;
+	int			 i;
+
+	w = &auth_workers[0];
+	for (i = 1; i < LKA_AUTH_WORKERS; i++)
+		if (auth_workers[i].pending < w->pending)
+			w = &auth_workers[i];
+
+	req = xcalloc(1, sizeof(*req));
+	req->reqid = reqid;
+	req->p = p;
+	req->key = xstrdup(key);
+	req->hash = xstrdup(hash);
+	memcpy(req->digest, digest, sizeof(req->digest));
+
+	id = generate_uid();
+	tree_xset(&auth_reqs, id, req);
+	w->pending++;
+
+	m_create(&w->p, IMSG_LKA_CHECKPASS, 0, 0, -1);
+	m_add_id(&w->p, id);
+	m_add_string(&w->p, password);
+	m_add_string(&w->p, hash);
+	m_close(&w->p);
+}
+
 static int
 lka_credentials(const char *tablename, const char *label, char *dst, size_t sz)
 {
@@ -851,6 +1211,42 @@ lka_userinfo(const char *tablename, const char *username, struct userinfo *res)
 	}
 }
 
+static int
+lka_pkifiles(const char *tablename, const char *name, struct pkifiles *res)
+{
+	struct table	*table;
+	union lookup	 lk;
+	const char	*domain;
+	char		 wildcard[HOST_NAME_MAX+2];
+	int		 ret;
+
+	log_debug("debug: lka: pki %s:%s", tablename, name);
+	table = table_find(env, tablename);
+	if (table == NULL) {
+		log_warnx("warn: cannot find pki table %s", tablename);
+		return (LKA_TEMPFAIL);
+	}
+
+	ret = table_lookup(table, K_PKI, name, &lk);
+	if (ret == 0 && (domain = strchr(name, '.')) != NULL &&
+	    domain[1] != '\0') {
+		(void)snprintf(wildcard, sizeof wildcard, "*%s", domain);
+		ret = table_lookup(table, K_PKI, wildcard, &lk);
+	}
+
+	switch (ret) {
+	case -1:
+		log_warnx("warn: failure during pki lookup %s:%s",
+		    tablename, name);
+		return (LKA_TEMPFAIL);
+	case 0:
+		return (LKA_PERMFAIL);
+	default:
+		*res = lk.pkifiles;
+		return (LKA_OK);
+	}
+}
+
 static int
 lka_addrname(const char *tablename, const struct sockaddr *sa,
     struct addrname *res)
@@ -29,23 +29,55 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "smtpd.h"
 #include "log.h"
 
 #define	PROTOCOL_VERSION	"0.7"
 
+/*
+ * Processors registering the data-chunk phase receive the message body as
+ * length-prefixed runs of complete lines rather than one request per line,
+ * and answer the same way.  Chunks never carry more than FILTER_CHUNK_MAX
+ * bytes, except for a single line longer than that.
+ */
+#define	FILTER_CHUNK_MAX	32768
+
+/*
+ * The source-dependent conditions of builtin filters only depend on the
+ * address, rdns and fcrdns of the client.  Their result is remembered for
+ * each filter in the session, and across sessions for a short while so
+ * that repeated connections from the same client skip the table and regex
+ * lookups.  Entries are dropped when a table is updated.
+ */
+#define	FILTER_SRC_CACHE_MAX	4096
+#define	FILTER_SRC_CACHE_TTL	60	/* seconds */
+
+struct filter_src_cache_entry {
+	TAILQ_ENTRY(filter_src_cache_entry)	 entry;
+	char					*key;
+	time_t					 expire;
+	int					 ret;
+};
+
 struct filter;
+struct filter_entry;
 struct filter_session;
 static void	filter_protocol_internal(struct filter_session *, uint64_t *, uint64_t, enum filter_phase, const char *);
 static void	filter_protocol(uint64_t, enum filter_phase, const char *);
 static void	filter_protocol_next(uint64_t, uint64_t, enum filter_phase);
 static void	filter_protocol_query(struct filter *, uint64_t, uint64_t, const char *, const char *);
 
-static void	filter_data_internal(struct filter_session *, uint64_t, uint64_t, const char *);
-static void	filter_data(uint64_t, const char *);
-static void	filter_data_next(uint64_t, uint64_t, const char *);
-static void	filter_data_query(struct filter *, uint64_t, uint64_t, const char *);
+static void	filter_protocol_verdict(struct filter_session *, uint64_t, uint64_t, const char *);
+static void	filter_group_query(struct filter_session *, struct filter_entry *, uint64_t, const char *);
+static int	filter_group_response(struct filter_session *, uint64_t, const char *);
+static void	filter_group_free(struct filter_session *);
+
+static void	filter_data_internal(struct filter_session *, uint64_t, uint64_t, const char *, size_t);
+static void	filter_data(uint64_t, const char *, size_t);
+static void	filter_data_next(uint64_t, uint64_t, const char *, size_t);
+static void	filter_data_query(struct filter *, uint64_t, uint64_t, const char *, size_t);
 
 static int	filter_builtins_notimpl(struct filter_session *, struct filter *, uint64_t, const char *);
 static int	filter_builtins_connect(struct filter_session *, struct filter *, uint64_t, const char *);
@@ -55,6 +87,13 @@ static int	filter_builtins_rcpt_to(struct filter_session *, struct filter *, uin
 static int	filter_builtins_data(struct filter_session *, struct filter *, uint64_t, const char *);
 static int	filter_builtins_commit(struct filter_session *, struct filter *, uint64_t, const char *);
 
+static int	filter_dnsbl_query(struct filter_session *, struct filter *, uint64_t, enum filter_phase, const char *);
+static void	filter_dnsbl_done(void *, int);
+static int	filter_spf_query(struct filter_session *, struct filter *, uint64_t, enum filter_phase, const char *);
+static void	filter_spf_done(void *, int);
+
+static void	filter_announce_phases(const char *, uint32_t, int);
+
 static void	filter_result_proceed(uint64_t);
 static void	filter_result_report(uint64_t, const char *);
 static void	filter_result_junk(uint64_t);
@@ -83,6 +122,25 @@ struct filter_session {
 	char *mail_from;
 	
 	enum filter_phase	phase;
+
+	/* source checks of builtin filters, keyed by filter */
+	struct tree		 src_verdicts;
+	struct tree		 dnsbl_verdicts;
+	struct tree		 spf_verdicts;	/* for the current sender */
+
+	/* parallel group waiting for answers, from its first member */
+	struct filter_entry	*group;
+	char		       **group_verdicts;
+	size_t			 group_size;
+	size_t			 group_pending;
+
+	/* when the pending query and the end of message were sent */
+	struct timespec		 query_ts;
+	struct timespec		 data_ts;
+
+	/* reporters receiving this session's events, by reporter index */
+	uint8_t		       *reporters;
+	size_t			 reporters_count;
 };
 
 static struct filter_exec {
@@ -116,12 +174,13 @@ struct filter {
 	size_t 			chain_size;
 	struct filter_config   *config;
 };
-static struct dict filters;
+static struct hdict filters;
 
 struct filter_entry {
 	TAILQ_ENTRY(filter_entry)	entries;
 	uint64_t			id;
 	const char		       *name;
+	uint32_t			group;
 };
 
 struct filter_chain {
@@ -131,47 +190,76 @@ struct filter_chain {
 static struct tree	sessions;
 static int		filters_inited;
 
-static struct dict	filter_chains;
+static struct hdict	filter_chains;
+
+static struct hdict	filter_src_cache;
+static TAILQ_HEAD(filter_src_lru, filter_src_cache_entry) filter_src_lru;
+static unsigned int	filter_src_cache_gen;
 
 struct reporter_proc {
 	TAILQ_ENTRY(reporter_proc)	entries;
 	const char		       *name;
+	size_t				idx;
 };
 TAILQ_HEAD(reporters, reporter_proc);
 
-static struct dict	report_smtp_in;
-static struct dict	report_smtp_out;
+/*
+ * Each distinct reporting processor gets an index at registration, and
+ * every session records at begin which of them are part of its filter
+ * chain, so broadcasting an event doesn't walk the chain per reporter.
+ */
+static char		      **reporter_names;
+static size_t			reporter_count;
+
+static struct hdict	report_smtp_in;
+static struct hdict	report_smtp_out;
 
 static struct smtp_events {
 	const char     *event;
 } smtp_events[] = {
-	{ "link-connect" },
-	{ "link-disconnect" },
-	{ "link-greeting" },
-	{ "link-identify" },
-	{ "link-tls" },
-	{ "link-auth" },
-
-	{ "tx-reset" },
-	{ "tx-begin" },
-	{ "tx-mail" },
-	{ "tx-rcpt" },
-	{ "tx-envelope" },
-	{ "tx-data" },
-	{ "tx-commit" },
-	{ "tx-rollback" },
-
-	{ "protocol-client" },
-	{ "protocol-server" },
-
-	{ "filter-report" },
-	{ "filter-response" },
-
-	{ "timeout" },
+	[REPORT_LINK_CONNECT] = { "link-connect" },
+	[REPORT_LINK_DISCONNECT] = { "link-disconnect" },
+	[REPORT_LINK_GREETING] = { "link-greeting" },
+	[REPORT_LINK_IDENTIFY] = { "link-identify" },
+	[REPORT_LINK_TLS] = { "link-tls" },
+	[REPORT_LINK_AUTH] = { "link-auth" },
+
+	[REPORT_TX_RESET] = { "tx-reset" },
+	[REPORT_TX_BEGIN] = { "tx-begin" },
+	[REPORT_TX_MAIL] = { "tx-mail" },
+	[REPORT_TX_RCPT] = { "tx-rcpt" },
+	[REPORT_TX_ENVELOPE] = { "tx-envelope" },
+	[REPORT_TX_DATA] = { "tx-data" },
+	[REPORT_TX_COMMIT] = { "tx-commit" },
+	[REPORT_TX_ROLLBACK] = { "tx-rollback" },
+
+	[REPORT_PROTOCOL_CLIENT] = { "protocol-client" },
+	[REPORT_PROTOCOL_SERVER] = { "protocol-server" },
+
+	[REPORT_FILTER_REPORT] = { "filter-report" },
+	[REPORT_FILTER_RESPONSE] = { "filter-response" },
+
+	[REPORT_TIMEOUT] = { "timeout" },
 };
 
 static int			processors_inited = 0;
-static struct dict		processors;
+static struct hdict		processors;
+
+/*
+ * Response times of processors are kept per phase, in buckets bounded
+ * by these values in microseconds with a last one for anything slower.
+ * For data, the time is that of the end of message going through.
+ */
+static const uint64_t	filter_latency_bounds[] = {
+	1000, 10000, 100000, 1000000, 10000000
+};
+
+struct filter_latency {
+	size_t		count;
+	uint64_t	total;
+	uint64_t	max;
+	size_t		buckets[nitems(filter_latency_bounds) + 1];
+};
 
 struct processor_instance {
 	char			*name;
@@ -179,9 +267,37 @@ struct processor_instance {
 	struct io		*errfd;
 	int			 ready;
 	uint32_t		 subsystems;
+	int			 data_chunk;
+
+	/* instances of the same processor, sessions are spread by reqid */
+	struct processor_instance	 *pool;
+	struct processor_instance	**instances;
+	size_t				  instances_count;
+
+	struct filter_latency	 latency[FILTER_PHASES_COUNT];
+	size_t			 inflight;
+	size_t			 data_out;
+	size_t			 data_in;
+
+	/* sessions whose data input is paused until the queue drains */
+	struct tree		 paused;
+
+	/* filter-datachunk header waiting for its data */
+	int			 chunk_pending;
+	uint64_t		 chunk_reqid;
+	uint64_t		 chunk_token;
+	size_t			 chunk_len;
 };
 
+static struct processor_instance *processor_get(const char *, uint64_t);
+static void	processor_latency(struct processor_instance *, enum filter_phase,
+    const struct timespec *);
+static int	filter_data_end(const char *, size_t);
 static void	processor_io(struct io *, int, void *);
+static void	processor_hiwat(struct processor_instance *, struct filter_session *);
+static void	processor_resume(struct processor_instance *);
+static void	processor_chunk(struct processor_instance *, const char *);
+static void	processor_chunk_data(struct processor_instance *, const char *);
 static void	processor_errfd(struct io *, int, void *);
 void		lka_filter_process_response(const char *, const char *);
 
@@ -192,7 +308,7 @@ lka_proc_ready(void)
 	struct processor_instance	*pi;
 
 	iter = NULL;
-	while (dict_iter(&processors, &iter, NULL, (void **)&pi))
+	while (hdict_iter(&processors, &iter, NULL, (void **)&pi))
 		if (!pi->ready)
 			return 0;
 	return 1;
@@ -216,10 +332,12 @@ lka_proc_config(struct processor_instance *pi)
 void
 lka_proc_forked(const char *name, uint32_t subsystems, int fd)
 {
-	struct processor_instance	*processor;
+	struct processor_instance	*processor, *pool;
+	char				*pool_name, *p;
+	size_t				 n;
 
 	if (!processors_inited) {
-		dict_init(&processors);
+		hdict_init(&processors);
 		processors_inited = 1;
 	}
 
@@ -232,7 +350,26 @@ lka_proc_forked(const char *name, uint32_t subsystems, int fd)
 
 	io_set_fd(processor->io, fd);
 	io_set_callback(processor->io, processor_io, processor->name);
-	dict_xset(&processors, name, processor);
+	io_set_lowat(processor->io, env->sc_filter_lowat);
+	tree_init(&processor->paused);
+	hdict_xset(&processors, name, processor);
+
+	/* "name#n" is an additional instance of processor "name" */
+	pool = processor;
+	if ((p = strchr(name, '#')) != NULL) {
+		pool_name = xstrdup(name);
+		pool_name[p - name] = '\0';
+		pool = hdict_xget(&processors, pool_name);
+		free(pool_name);
+	}
+	processor->pool = pool;
+
+	n = pool->instances_count + 1;
+	pool->instances = reallocarray(pool->instances, n,
+	    sizeof *pool->instances);
+	if (pool->instances == NULL)
+		fatal("lka_proc_forked: reallocarray");
+	pool->instances[pool->instances_count++] = processor;
 }
 
 void
@@ -240,7 +377,7 @@ lka_proc_errfd(const char *name, int fd)
 {
 	struct processor_instance	*processor;
 
-	processor = dict_xget(&processors, name);
+	processor = hdict_xget(&processors, name);
 
 	io_set_nonblocking(fd);
 
@@ -251,14 +388,90 @@ lka_proc_errfd(const char *name, int fd)
 	lka_proc_config(processor);
 }
 
-struct io *
-lka_proc_get_io(const char *name)
+/*
+ * A session always talks to the same instance of a processor so that
+ * filters keeping per-session state see all of its events.
+ */
+static struct processor_instance *
+processor_get(const char *name, uint64_t reqid)
 {
 	struct processor_instance *processor;
 
-	processor = dict_xget(&processors, name);
+	processor = hdict_xget(&processors, name);
+	if (processor->instances_count > 1)
+		processor = processor->instances[(reqid ^ (reqid >> 32)) %
+		    processor->instances_count];
+
+	return processor;
+}
 
-	return processor->io;
+struct io *
+lka_proc_get_io(const char *name, uint64_t reqid)
+{
+	return processor_get(name, reqid)->io;
+}
+
+static void
+processor_latency(struct processor_instance *processor,
+    enum filter_phase phase, const struct timespec *start)
+{
+	struct filter_latency	*fl = &processor->latency[phase];
+	struct timespec		 now, dt;
+	uint64_t		 us;
+	size_t			 i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, start, &dt);
+	us = (uint64_t)dt.tv_sec * 1000000 + dt.tv_nsec / 1000;
+
+	for (i = 0; i < nitems(filter_latency_bounds); i++)
+		if (us < filter_latency_bounds[i])
+			break;
+	fl->buckets[i]++;
+	fl->count++;
+	fl->total += us;
+	if (us > fl->max)
+		fl->max = us;
+}
+
+void
+lka_proc_show(struct mproc *p, uint32_t peerid)
+{
+	struct processor_instance	*processor;
+	struct filter_latency		*fl;
+	char				 buf[LINE_MAX];
+	void				*iter;
+	size_t				 i;
+
+	iter = NULL;
+	while (processors_inited &&
+	    hdict_iter(&processors, &iter, NULL, (void **)&processor)) {
+		(void)snprintf(buf, sizeof buf,
+		    "%s inflight=%zu queued=%zu data-out=%zu data-in=%zu",
+		    processor->name, processor->inflight,
+		    io_queued(processor->io), processor->data_out,
+		    processor->data_in);
+		m_compose(p, IMSG_CTL_SHOW_FILTERS, peerid, 0, -1,
+		    buf, strlen(buf) + 1);
+
+		for (i = 0; i < nitems(filter_execs); i++) {
+			fl = &processor->latency[filter_execs[i].phase];
+			if (fl->count == 0)
+				continue;
+			(void)snprintf(buf, sizeof buf,
+			    "%s %s count=%zu avg=%lluus max=%lluus "
+			    "hist=%zu/%zu/%zu/%zu/%zu/%zu",
+			    processor->name, filter_execs[i].phase_name,
+			    fl->count,
+			    (unsigned long long)(fl->total / fl->count),
+			    (unsigned long long)fl->max,
+			    fl->buckets[0], fl->buckets[1], fl->buckets[2],
+			    fl->buckets[3], fl->buckets[4], fl->buckets[5]);
+			m_compose(p, IMSG_CTL_SHOW_FILTERS, peerid, 0, -1,
+			    buf, strlen(buf) + 1);
+		}
+	}
+	m_compose(p, IMSG_CTL_SHOW_FILTERS, peerid, 0, -1, NULL, 0);
 }
 
 static void
@@ -266,13 +479,17 @@ processor_register(const char *name, const char *line)
 {
 	struct processor_instance *processor;
 
-	processor = dict_xget(&processors, name);
+	processor = hdict_xget(&processors, name);
 
 	if (strcmp(line, "register|ready") == 0) {
 		processor->ready = 1;
 		return;
 	}
 
+	/* instances run the same command, the first one registers for all */
+	if (processor->pool != processor)
+		return;
+
 	if (strncmp(line, "register|report|", 16) == 0) {
 		lka_report_register_hook(name, line+16);
 		return;
@@ -294,29 +511,129 @@ processor_io(struct io *io, int evt, void *arg)
 	char			*line = NULL;
 	ssize_t			 len;
 
+	processor = hdict_xget(&processors, name);
+
 	switch (evt) {
 	case IO_DATAIN:
-		while ((line = io_getline(io, &len)) != NULL) {
+		for (;;) {
+			if (processor->chunk_pending) {
+				if (io_datalen(io) < processor->chunk_len)
+					return;
+				processor_chunk_data(processor, io_data(io));
+				io_drop(io, processor->chunk_len);
+				processor->chunk_pending = 0;
+			}
+
+			if ((line = io_getline(io, &len)) == NULL)
+				return;
+
 			if (strncmp("register|", line, 9) == 0) {
 				processor_register(name, line);
 				continue;
 			}
 			
-			processor = dict_xget(&processors, name);
 			if (!processor->ready)
 				fatalx("Non-register message before register|"
 				    "ready: %s", line);
 			else if (strncmp(line, "filter-result|", 14) == 0 ||
 			    strncmp(line, "filter-dataline|", 16) == 0)
 				lka_filter_process_response(name, line);
+			else if (strncmp(line, "filter-datachunk|", 17) == 0)
+				processor_chunk(processor, line);
 			else if (strncmp(line, "report|", 7) == 0)
-				lka_report_proc(name, line);
+				lka_report_proc(processor->pool->name, line);
 			else
 				fatalx("Invalid filter message type: %s", line);
 		}
+
+	case IO_LOWAT:
+		processor_resume(processor);
+		break;
 	}
 }
 
+/*
+ * Stop reading data from a session while the processor it is sent to
+ * has more than filter-hiwat bytes queued; the smtp process in turn
+ * stops reading from the client once its own side of the pipe fills.
+ */
+static void
+processor_hiwat(struct processor_instance *processor, struct filter_session *fs)
+{
+	if (io_queued(processor->io) < env->sc_filter_hiwat ||
+	    fs->io == NULL || tree_check(&processor->paused, fs->id))
+		return;
+
+	tree_xset(&processor->paused, fs->id, NULL);
+	io_pause(fs->io, IO_IN);
+	stat_increment("lka.filter.backpressure", 1);
+}
+
+static void
+processor_resume(struct processor_instance *processor)
+{
+	struct filter_session	*fs;
+	uint64_t		 reqid;
+
+	while (tree_poproot(&processor->paused, &reqid, NULL))
+		if ((fs = tree_get(&sessions, reqid)) != NULL && fs->io)
+			io_resume(fs->io, IO_IN);
+}
+
+static void
+processor_chunk(struct processor_instance *processor, const char *line)
+{
+	const char	*p;
+	const char	*errstr;
+	char		*ep;
+
+	p = line + 17;
+	errno = 0;
+	processor->chunk_reqid = strtoull(p, &ep, 16);
+	if (p[0] == '\0' || *ep != '|' || errno == ERANGE)
+		fatalx("Invalid reqid: %s", line);
+
+	p = ep + 1;
+	processor->chunk_token = strtoull(p, &ep, 16);
+	if (p[0] == '\0' || *ep != '|' || errno == ERANGE)
+		fatalx("Invalid token: %s", line);
+
+	p = ep + 1;
+	processor->chunk_len = strtonum(p, 0, FILTER_CHUNK_MAX, &errstr);
+	if (errstr)
+		fatalx("Invalid chunk length: %s", line);
+
+	processor->chunk_pending = 1;
+}
+
+static void
+processor_chunk_data(struct processor_instance *processor, const char *data)
+{
+	struct filter_session	*fs;
+	size_t			 len = processor->chunk_len;
+
+	if (len && data[len - 1] != '\n')
+		fatalx("filter-datachunk does not end with a complete line");
+
+	processor->data_in++;
+
+	/* session can legitimately disappear on a resume */
+	if ((fs = tree_get(&sessions, processor->chunk_reqid)) == NULL)
+		return;
+	if (fs->phase != FILTER_DATA_LINE)
+		fatalx("filter-datachunk out of dataline phase");
+
+	/* the filter suppressed every line of the chunk */
+	if (len == 0)
+		return;
+
+	if (filter_data_end(data, len - 1))
+		processor_latency(processor, FILTER_DATA_LINE, &fs->data_ts);
+
+	filter_data_next(processor->chunk_token, processor->chunk_reqid,
+	    data, len - 1);
+}
+
 static void
 processor_errfd(struct io *io, int evt, void *arg)
 {
@@ -341,8 +658,11 @@ lka_filter_init(void)
 	size_t		i;
 	char		 buffer[LINE_MAX];	/* for traces */
 
-	dict_init(&filters);
-	dict_init(&filter_chains);
+	hdict_init(&filters);
+	hdict_init(&filter_chains);
+	hdict_init(&filter_src_cache);
+	TAILQ_INIT(&filter_src_lru);
+	filter_src_cache_gen = table_generation();
 
 	/* first pass, allocate and init individual filters */
 	iter = NULL;
@@ -353,7 +673,7 @@ lka_filter_init(void)
 			filter->name = name;
 			filter->phases |= (1<<filter_config->phase);
 			filter->config = filter_config;
-			dict_set(&filters, name, filter);
+			hdict_set(&filters, name, filter);
 			log_trace(TRACE_FILTERS, "filters init type=builtin, name=%s, hooks=%08x",
 			    name, filter->phases);
 			break;
@@ -363,7 +683,7 @@ lka_filter_init(void)
 			filter->name = name;
 			filter->proc = filter_config->proc;
 			filter->config = filter_config;
-			dict_set(&filters, name, filter);
+			hdict_set(&filters, name, filter);
 			log_trace(TRACE_FILTERS, "filters init type=proc, name=%s, proc=%s",
 			    name, filter_config->proc);
 			break;
@@ -386,14 +706,14 @@ lka_filter_init(void)
 
 			buffer[0] = '\0';
 			for (i = 0; i < filter->chain_size; ++i) {
-				filter->chain[i] = dict_xget(&filters, filter_config->chain[i]);
+				filter->chain[i] = hdict_xget(&filters, filter_config->chain[i]);
 				if (i)
 					(void)strlcat(buffer, ", ", sizeof buffer);
 				(void)strlcat(buffer, filter->chain[i]->name, sizeof buffer);
 			}
 			log_trace(TRACE_FILTERS, "filters init type=chain, name=%s { %s }", name, buffer);
 
-			dict_set(&filters, name, filter);
+			hdict_set(&filters, name, filter);
 			break;
 
 		case FILTER_TYPE_BUILTIN:
@@ -408,6 +728,7 @@ lka_filter_register_hook(const char *name, const char *hook)
 {
 	struct filter		*filter;
 	const char	*filter_name;
+	struct processor_instance *processor;
 	void		*iter;
 	size_t	i;
 
@@ -417,6 +738,13 @@ lka_filter_register_hook(const char *name, const char *hook)
 	else
 		fatalx("Invalid message direction: %s", hook);
 
+	/* data-chunk is the bulk variant of data-line */
+	if (strcmp(hook, "data-chunk") == 0) {
+		processor = hdict_xget(&processors, name);
+		processor->data_chunk = 1;
+		hook = "data-line";
+	}
+
 	for (i = 0; i < nitems(filter_execs); i++)
 		if (strcmp(hook, filter_execs[i].phase_name) == 0)
 			break;
@@ -424,7 +752,7 @@ lka_filter_register_hook(const char *name, const char *hook)
 		fatalx("Unrecognized report name: %s", hook);
 
 	iter = NULL;
-	while (dict_iter(&filters, &iter, &filter_name, (void **)&filter))
+	while (hdict_iter(&filters, &iter, &filter_name, (void **)&filter))
 		if (filter->proc && strcmp(name, filter->proc) == 0)
 			filter->phases |= (1<<filter_execs[i].phase);
 }
@@ -440,28 +768,38 @@ lka_filter_ready(void)
 	void		*iter;
 	size_t		i;
 	size_t		j;
+	uint32_t	phases;
+	int		builtin;
 
 	/* all filters are ready, actually build the filter chains */
 	iter = NULL;
-	while (dict_iter(&filters, &iter, &filter_name, (void **)&filter)) {
+	while (hdict_iter(&filters, &iter, &filter_name, (void **)&filter)) {
 		filter_chain = xcalloc(1, sizeof *filter_chain);
 		for (i = 0; i < nitems(filter_execs); i++)
 			TAILQ_INIT(&filter_chain->chain[i]);
-		dict_set(&filter_chains, filter_name, filter_chain);
+		hdict_set(&filter_chains, filter_name, filter_chain);
 
 		if (filter->chain) {
+			phases = 0;
+			builtin = 0;
 			for (i = 0; i < filter->chain_size; i++) {
 				subfilter = filter->chain[i];
+				phases |= subfilter->phases;
+				if (subfilter->config->filter_type == FILTER_TYPE_BUILTIN)
+					builtin = 1;
 				for (j = 0; j < nitems(filter_execs); ++j) {
 					if (subfilter->phases & (1<<j)) {
 						filter_entry = xcalloc(1, sizeof *filter_entry);
 						filter_entry->id = generate_uid();
 						filter_entry->name = subfilter->name;
+						filter_entry->group =
+						    filter->config->chain_group[i];
 						TAILQ_INSERT_TAIL(&filter_chain->chain[j],
 						    filter_entry, entries);
 					}
 				}
 			}
+			filter_announce_phases(filter_name, phases, builtin);
 			continue;
 		}
 
@@ -474,7 +812,37 @@ lka_filter_ready(void)
 				    filter_entry, entries);
 			}
 		}
+		filter_announce_phases(filter_name, filter->phases,
+		    filter->config->filter_type == FILTER_TYPE_BUILTIN);
+	}
+}
+
+/*
+ * Tell the smtp process which phases have a filter subscribed for the
+ * listeners using this filter, so that it does not query the others.
+ * Builtin filters match on the helo and sender seen in earlier phases,
+ * which are only recorded when these phases come through.
+ */
+static void
+filter_announce_phases(const char *name, uint32_t phases, int builtin)
+{
+	struct mproc	*p;
+	int		 i;
+
+	if (builtin)
+		phases |= (1<<FILTER_HELO) | (1<<FILTER_EHLO) |
+		    (1<<FILTER_MAIL_FROM);
+
+	for (i = 0; i < smtp_peer_count(); i++) {
+		p = smtp_peer_at(i);
+		m_create(p, IMSG_FILTER_SMTP_PHASES, 0, 0, -1);
+		m_add_string(p, name);
+		m_add_u32(p, phases);
+		m_close(p);
 	}
+
+	log_trace(TRACE_FILTERS, "filters phases name=%s, hooks=%08x",
+	    name, phases);
 }
 
 int
@@ -487,7 +855,7 @@ lka_filter_proc_in_session(uint64_t reqid, const char *proc)
 	if ((fs = tree_get(&sessions, reqid)) == NULL)
 		return 0;
 
-	filter = dict_get(&filters, fs->filter_name);
+	filter = hdict_get(&filters, fs->filter_name);
 	if (filter == NULL || (filter->proc == NULL && filter->chain == NULL))
 		return 0;
 
@@ -506,6 +874,7 @@ void
 lka_filter_begin(uint64_t reqid, const char *filter_name)
 {
 	struct filter_session	*fs;
+	size_t			 i;
 
 	if (!filters_inited) {
 		tree_init(&sessions);
@@ -513,10 +882,22 @@ lka_filter_begin(uint64_t reqid, const char *filter_name)
 	}
 
 	fs = xcalloc(1, sizeof (struct filter_session));
+	memory_alloc(MEMORY_FILTER, sizeof (struct filter_session));
 	fs->id = reqid;
 	fs->filter_name = xstrdup(filter_name);
+	tree_init(&fs->src_verdicts);
+	tree_init(&fs->dnsbl_verdicts);
+	tree_init(&fs->spf_verdicts);
 	tree_xset(&sessions, fs->id, fs);
 
+	if (reporter_count) {
+		fs->reporters = xcalloc(reporter_count, sizeof *fs->reporters);
+		fs->reporters_count = reporter_count;
+		for (i = 0; i < reporter_count; i++)
+			fs->reporters[i] = lka_filter_proc_in_session(reqid,
+			    reporter_names[i]);
+	}
+
 	log_trace(TRACE_FILTERS, "%016"PRIx64" filters session-begin", reqid);
 }
 
@@ -526,13 +907,22 @@ lka_filter_end(uint64_t reqid)
 	struct filter_session	*fs;
 
 	fs = tree_xpop(&sessions, reqid);
+	filter_group_free(fs);
+	while (tree_poproot(&fs->src_verdicts, NULL, NULL))
+		;
+	while (tree_poproot(&fs->dnsbl_verdicts, NULL, NULL))
+		;
+	while (tree_poproot(&fs->spf_verdicts, NULL, NULL))
+		;
 	free(fs->rdns);
 	free(fs->helo);
 	free(fs->mail_from);
 	free(fs->username);
 	free(fs->lastparam);
 	free(fs->filter_name);
+	free(fs->reporters);
 	free(fs);
+	memory_free(MEMORY_FILTER, sizeof (struct filter_session));
 	log_trace(TRACE_FILTERS, "%016"PRIx64" filters session-end", reqid);
 }
 
@@ -540,11 +930,24 @@ void
 lka_filter_data_begin(uint64_t reqid)
 {
 	struct filter_session  *fs;
+	struct filter_chain    *filter_chain;
+	struct mproc	       *p;
 	int	sp[2];
 	int	fd = -1;
+	int	success = 0;
 
 	fs = tree_xget(&sessions, reqid);
 
+	/*
+	 * Without a filter on the data-line phase there is nothing to
+	 * relay, let the smtp process write the message to the queue.
+	 */
+	filter_chain = hdict_get(&filter_chains, fs->filter_name);
+	if (TAILQ_EMPTY(&filter_chain->chain[FILTER_DATA_LINE])) {
+		success = 1;
+		goto end;
+	}
+
 	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) == -1)
 		goto end;
 	io_set_nonblocking(sp[0]);
@@ -553,12 +956,14 @@ lka_filter_data_begin(uint64_t reqid)
 	fs->io = io_new();
 	io_set_fd(fs->io, sp[1]);
 	io_set_callback(fs->io, filter_session_io, fs);
+	success = 1;
 
 end:
-	m_create(p_dispatcher, IMSG_FILTER_SMTP_DATA_BEGIN, 0, 0, fd);
-	m_add_id(p_dispatcher, reqid);
-	m_add_int(p_dispatcher, fd != -1 ? 1 : 0);
-	m_close(p_dispatcher);
+	p = smtp_peer(reqid);
+	m_create(p, IMSG_FILTER_SMTP_DATA_BEGIN, 0, 0, fd);
+	m_add_id(p, reqid);
+	m_add_int(p, success);
+	m_close(p);
 	log_trace(TRACE_FILTERS, "%016"PRIx64" filters data-begin fd=%d", reqid, fd);
 }
 
@@ -579,23 +984,33 @@ static void
 filter_session_io(struct io *io, int evt, void *arg)
 {
 	struct filter_session *fs = arg;
-	char *line = NULL;
-	ssize_t len;
+	const char *data, *nl;
+	size_t len, n;
 
 	log_trace(TRACE_IO, "filter session: %p: %s %s", fs, io_strevent(evt),
 	    io_strio(io));
 
 	switch (evt) {
 	case IO_DATAIN:
-	nextline:
-		line = io_getline(fs->io, &len);
-		/* No complete line received */
-		if (line == NULL)
-			return;
-
-		filter_data(fs->id, line);
-
-		goto nextline;
+		/*
+		 * Hand all complete lines received so far to the chain at
+		 * once, up to FILTER_CHUNK_MAX bytes; line-mode filters
+		 * still get one request per line.
+		 */
+		while ((len = io_datalen(fs->io)) != 0) {
+			data = io_data(fs->io);
+			/* No complete line received */
+			if ((nl = memchr(data, '\n', len)) == NULL)
+				return;
+
+			n = nl - data;
+			while ((nl = memchr(data + n + 1, '\n', len - n - 1)) &&
+			    (size_t)(nl - data) < FILTER_CHUNK_MAX)
+				n = nl - data;
+
+			filter_data(fs->id, data, n);
+			io_drop(fs->io, n + 1);
+		}
 	}
 }
 
@@ -608,8 +1023,8 @@ lka_filter_process_response(const char *name, const char *line)
 	const char *kind = NULL;
 	const char *qid = NULL;
 	const char *response = NULL;
-	const char *parameter = NULL;
 	struct filter_session *fs;
+	struct processor_instance *processor;
 
 	kind = line;
 
@@ -633,6 +1048,12 @@ lka_filter_process_response(const char *name, const char *line)
 
 	response = ep+1;
 
+	processor = hdict_xget(&processors, name);
+	if (strncmp(kind, "filter-dataline|", 16) == 0)
+		processor->data_in++;
+	else if (processor->inflight)
+		processor->inflight--;
+
 	/* session can legitimately disappear on a resume */
 	if ((fs = tree_get(&sessions, reqid)) == NULL)
 		return;
@@ -640,12 +1061,30 @@ lka_filter_process_response(const char *name, const char *line)
 	if (strncmp(kind, "filter-dataline|", 16) == 0) {
 		if (fs->phase != FILTER_DATA_LINE)
 			fatalx("filter-dataline out of dataline phase");
-		filter_data_next(token, reqid, response);
+		if (filter_data_end(response, strlen(response)))
+			processor_latency(processor, FILTER_DATA_LINE,
+			    &fs->data_ts);
+		filter_data_next(token, reqid, response, strlen(response));
 		return;
 	}
 	if (fs->phase == FILTER_DATA_LINE)
 		fatalx("filter-result in dataline phase");
 
+	processor_latency(processor, fs->phase, &fs->query_ts);
+
+	if (fs->group && filter_group_response(fs, token, response))
+		return;
+
+	filter_protocol_verdict(fs, reqid, token, response);
+}
+
+static void
+filter_protocol_verdict(struct filter_session *fs, uint64_t reqid,
+    uint64_t token, const char *response)
+{
+	const char *parameter = NULL;
+	char *ep;
+
 	if ((ep = strchr(response, '|')) != NULL)
 		parameter = ep + 1;
 
@@ -659,7 +1098,7 @@ lka_filter_process_response(const char *name, const char *line)
 		return;
 	} else {
 		if (parameter == NULL)
-			fatalx("Missing parameter: %s", line);
+			fatalx("Missing parameter: %s", response);
 
 		if (strncmp(response, "rewrite|", 8) == 0)
 			filter_result_rewrite(reqid, parameter);
@@ -670,10 +1109,109 @@ lka_filter_process_response(const char *name, const char *line)
 		else if (strncmp(response, "report|", 7) == 0)
 			filter_result_report(reqid, parameter);
 		else
-			fatalx("Invalid directive: %s", line);
+			fatalx("Invalid directive: %s", response);
+	}
+}
+
+/*
+ * Query all members of a parallel group at once.  Their answers are
+ * kept until the last one arrives, then the first disconnect or reject
+ * in chain order wins, else the first other decision, else the chain
+ * proceeds after the group.
+ */
+static void
+filter_group_query(struct filter_session *fs, struct filter_entry *first,
+    uint64_t reqid, const char *param)
+{
+	struct filter_entry	*filter_entry;
+	struct filter		*filter;
+	size_t			 n;
+
+	n = 0;
+	for (filter_entry = first; filter_entry &&
+	    filter_entry->group == first->group;
+	    filter_entry = TAILQ_NEXT(filter_entry, entries))
+		n++;
+
+	fs->group = first;
+	fs->group_verdicts = xcalloc(n, sizeof(*fs->group_verdicts));
+	fs->group_size = n;
+	fs->group_pending = n;
+
+	for (filter_entry = first; n--;
+	    filter_entry = TAILQ_NEXT(filter_entry, entries)) {
+		filter = hdict_get(&filters, filter_entry->name);
+		log_trace(TRACE_FILTERS, "%016"PRIx64" filters protocol phase=%s, "
+		    "action=deferred, filter=%s, group=%u",
+		    fs->id, filter_execs[fs->phase].phase_name,
+		    filter->name, first->group);
+		filter_protocol_query(filter, filter_entry->id, reqid,
+		    filter_execs[fs->phase].phase_name, param);
 	}
 }
 
+static int
+filter_group_response(struct filter_session *fs, uint64_t token,
+    const char *response)
+{
+	struct filter_entry	*filter_entry, *last = NULL;
+	const char		*verdict = NULL;
+	char			*chosen;
+	size_t			 i;
+
+	filter_entry = fs->group;
+	for (i = 0; i < fs->group_size; i++) {
+		if (filter_entry->id == token)
+			break;
+		filter_entry = TAILQ_NEXT(filter_entry, entries);
+	}
+	if (i == fs->group_size || fs->group_verdicts[i])
+		fatalx("misbehaving filter");
+
+	fs->group_verdicts[i] = xstrdup(response);
+	if (--fs->group_pending)
+		return 1;
+
+	for (i = 0; i < fs->group_size; i++) {
+		response = fs->group_verdicts[i];
+		if (strncmp(response, "disconnect|", 11) == 0 ||
+		    strncmp(response, "reject|", 7) == 0) {
+			verdict = response;
+			break;
+		}
+		if (verdict == NULL && strcmp(response, "proceed") != 0)
+			verdict = response;
+	}
+
+	last = fs->group;
+	for (i = 1; i < fs->group_size; i++)
+		last = TAILQ_NEXT(last, entries);
+
+	/* resume the chain from the last member when all proceeded */
+	chosen = xstrdup(verdict ? verdict : "proceed");
+	token = last->id;
+	filter_group_free(fs);
+	filter_protocol_verdict(fs, fs->id, token, chosen);
+	free(chosen);
+	return 1;
+}
+
+static void
+filter_group_free(struct filter_session *fs)
+{
+	size_t	i;
+
+	if (fs->group == NULL)
+		return;
+	for (i = 0; i < fs->group_size; i++)
+		free(fs->group_verdicts[i]);
+	free(fs->group_verdicts);
+	fs->group = NULL;
+	fs->group_verdicts = NULL;
+	fs->group_size = 0;
+	fs->group_pending = 0;
+}
+
 void
 lka_filter_protocol(uint64_t reqid, enum filter_phase phase, const char *param)
 {
@@ -688,6 +1226,7 @@ filter_protocol_internal(struct filter_session *fs, uint64_t *token, uint64_t re
 	struct filter		*filter;
 	struct timeval		 tv;
 	const char		*phase_name = filter_execs[phase].phase_name;
+	uint64_t		 prev_token = *token;
 	int			 resume = 1;
 
 	if (!*token) {
@@ -701,7 +1240,7 @@ filter_protocol_internal(struct filter_session *fs, uint64_t *token, uint64_t re
 		fatalx("misbehaving filter");
 
 	/* based on token, identify the filter_entry we should apply  */
-	filter_chain = dict_get(&filter_chains, fs->filter_name);
+	filter_chain = hdict_get(&filter_chains, fs->filter_name);
 	filter_entry = TAILQ_FIRST(&filter_chain->chain[fs->phase]);
 	if (*token) {
 		TAILQ_FOREACH(filter_entry, &filter_chain->chain[fs->phase], entries)
@@ -723,7 +1262,13 @@ filter_protocol_internal(struct filter_session *fs, uint64_t *token, uint64_t re
 
 	/* process param with current filter_entry */
 	*token = filter_entry->id;
-	filter = dict_get(&filters, filter_entry->name);
+	if (filter_entry->group && fs->phase != FILTER_DATA_LINE &&
+	    TAILQ_NEXT(filter_entry, entries) &&
+	    TAILQ_NEXT(filter_entry, entries)->group == filter_entry->group) {
+		filter_group_query(fs, filter_entry, reqid, param);
+		return;	/* deferred response */
+	}
+	filter = hdict_get(&filters, filter_entry->name);
 	if (filter->proc) {
 		log_trace(TRACE_FILTERS, "%016"PRIx64" filters protocol phase=%s, "
 		    "resume=%s, action=deferred, filter=%s",
@@ -734,6 +1279,26 @@ filter_protocol_internal(struct filter_session *fs, uint64_t *token, uint64_t re
 		return;	/* deferred response */
 	}
 
+	if (filter->config->dnsbl &&
+	    tree_get(&fs->dnsbl_verdicts, (uintptr_t)filter) == NULL &&
+	    filter_dnsbl_query(fs, filter, prev_token, fs->phase, param)) {
+		log_trace(TRACE_FILTERS, "%016"PRIx64" filters protocol phase=%s, "
+		    "resume=%s, action=deferred, filter=%s, dnsbl",
+		    fs->id, phase_name, resume ? "y" : "n",
+		    filter->name);
+		return;	/* deferred response */
+	}
+
+	if (filter->config->spf && fs->mail_from &&
+	    tree_get(&fs->spf_verdicts, (uintptr_t)filter) == NULL &&
+	    filter_spf_query(fs, filter, prev_token, fs->phase, param)) {
+		log_trace(TRACE_FILTERS, "%016"PRIx64" filters protocol phase=%s, "
+		    "resume=%s, action=deferred, filter=%s, spf",
+		    fs->id, phase_name, resume ? "y" : "n",
+		    filter->name);
+		return;	/* deferred response */
+	}
+
 	if (filter_execs[fs->phase].func(fs, filter, reqid, param)) {
 		if (filter->config->rewrite) {
 			log_trace(TRACE_FILTERS, "%016"PRIx64" filters protocol phase=%s, "
@@ -770,7 +1335,7 @@ filter_protocol_internal(struct filter_session *fs, uint64_t *token, uint64_t re
 			    filter->name,
 			    param, filter->config->report);
 
-			gettimeofday(&tv, NULL);
+			clock_cached_tv(&tv);
 			lka_report_filter_report(fs->id, filter->name, 1,
 			    "smtp-in", &tv, filter->config->report);
 		} else if (filter->config->bypass) {
@@ -805,7 +1370,7 @@ filter_protocol_internal(struct filter_session *fs, uint64_t *token, uint64_t re
 }
 
 static void
-filter_data_internal(struct filter_session *fs, uint64_t token, uint64_t reqid, const char *line)
+filter_data_internal(struct filter_session *fs, uint64_t token, uint64_t reqid, const char *data, size_t len)
 {
 	struct filter_chain	*filter_chain;
 	struct filter_entry	*filter_entry;
@@ -817,7 +1382,7 @@ filter_data_internal(struct filter_session *fs, uint64_t token, uint64_t reqid,
 		fatalx("misbehaving filter");
 
 	/* based on token, identify the filter_entry we should apply  */
-	filter_chain = dict_get(&filter_chains, fs->filter_name);
+	filter_chain = hdict_get(&filter_chains, fs->filter_name);
 	filter_entry = TAILQ_FIRST(&filter_chain->chain[fs->phase]);
 	if (token) {
 		TAILQ_FOREACH(filter_entry, &filter_chain->chain[fs->phase], entries)
@@ -830,13 +1395,21 @@ filter_data_internal(struct filter_session *fs, uint64_t token, uint64_t reqid,
 
 	/* no filter_entry, we either had none or reached end of chain */
 	if (filter_entry == NULL) {
-		io_printf(fs->io, "%s\n", line);
+		io_write(fs->io, data, len);
+		io_write(fs->io, "\n", 1);
 		return;
 	}
 
 	/* pass data to the filter */
-	filter = dict_get(&filters, filter_entry->name);
-	filter_data_query(filter, filter_entry->id, reqid, line);
+	filter = hdict_get(&filters, filter_entry->name);
+	filter_data_query(filter, filter_entry->id, reqid, data, len);
+}
+
+/* whether a run of data lines ends with the end of message marker */
+static int
+filter_data_end(const char *data, size_t len)
+{
+	return len && data[len - 1] == '.' && (len == 1 || data[len - 2] == '\n');
 }
 
 static void
@@ -859,6 +1432,8 @@ filter_protocol(uint64_t reqid, enum filter_phase phase, const char *param)
 		fs->mail_from = xstrdup(param + 1);
 		*strchr(fs->mail_from, '>') = '\0';
 		param = fs->mail_from;
+		while (tree_poproot(&fs->spf_verdicts, NULL, NULL))
+			;
 
 		break;
 	case FILTER_RCPT_TO:
@@ -893,18 +1468,22 @@ filter_protocol_next(uint64_t token, uint64_t reqid, enum filter_phase phase)
 	filter_protocol_internal(fs, &token, reqid, phase, fs->lastparam);
 }
 
+/*
+ * Body data travels through the chain as runs of one or more lines
+ * separated by newlines, without the final one.
+ */
 static void
-filter_data(uint64_t reqid, const char *line)
+filter_data(uint64_t reqid, const char *data, size_t len)
 {
 	struct filter_session  *fs;
 
 	fs = tree_xget(&sessions, reqid);
 
-	filter_data_internal(fs, 0, reqid, line);
+	filter_data_internal(fs, 0, reqid, data, len);
 }
 
 static void
-filter_data_next(uint64_t token, uint64_t reqid, const char *line)
+filter_data_next(uint64_t token, uint64_t reqid, const char *data, size_t len)
 {
 	struct filter_session  *fs;
 
@@ -912,7 +1491,7 @@ filter_data_next(uint64_t token, uint64_t reqid, const char *line)
 	if ((fs = tree_get(&sessions, reqid)) == NULL)
 		return;
 
-	filter_data_internal(fs, token, reqid, line);
+	filter_data_internal(fs, token, reqid, data, len);
 }
 
 static void
@@ -920,19 +1499,23 @@ filter_protocol_query(struct filter *filter, uint64_t token, uint64_t reqid, con
 {
 	int	n;
 	struct filter_session	*fs;
+	struct processor_instance *processor;
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	clock_cached_tv(&tv);
 	
 	fs = tree_xget(&sessions, reqid);
+	clock_gettime(CLOCK_MONOTONIC, &fs->query_ts);
+	processor = processor_get(filter->proc, reqid);
+	processor->inflight++;
 	if (strcmp(phase, "connect") == 0)
-		n = io_printf(lka_proc_get_io(filter->proc),
+		n = io_printf(processor->io,
 		    "filter|%s|%lld.%06ld|smtp-in|%s|%016"PRIx64"|%016"PRIx64"|%s|%s\n",
 		    PROTOCOL_VERSION,
 		    (long long)tv.tv_sec, (long)tv.tv_usec,
 		    phase, reqid, token, fs->rdns, param);
 	else
-		n = io_printf(lka_proc_get_io(filter->proc),
+		n = io_printf(processor->io,
 		    "filter|%s|%lld.%06ld|smtp-in|%s|%016"PRIx64"|%016"PRIx64"|%s\n",
 		    PROTOCOL_VERSION,
 		    (long long)tv.tv_sec, (long)tv.tv_usec,
@@ -942,79 +1525,125 @@ filter_protocol_query(struct filter *filter, uint64_t token, uint64_t reqid, con
 }
 
 static void
-filter_data_query(struct filter *filter, uint64_t token, uint64_t reqid, const char *line)
+filter_data_query(struct filter *filter, uint64_t token, uint64_t reqid, const char *data, size_t len)
 {
 	int	n;
 	struct timeval	tv;
+	struct filter_session	*fs;
+	struct processor_instance *processor;
+	struct io	*io;
+	const char	*nl;
 
-	gettimeofday(&tv, NULL);
+	clock_cached_tv(&tv);
 
-	n = io_printf(lka_proc_get_io(filter->proc),
-	    "filter|%s|%lld.%06ld|smtp-in|data-line|"
-	    "%016"PRIx64"|%016"PRIx64"|%s\n",
-	    PROTOCOL_VERSION,
-	    (long long)tv.tv_sec, (long)tv.tv_usec,
-	    reqid, token, line);
-	if (n == -1)
-		fatalx("failed to write to processor");
+	processor = processor_get(filter->proc, reqid);
+	io = processor->io;
+
+	fs = tree_xget(&sessions, reqid);
+	processor->data_out++;
+	if (filter_data_end(data, len))
+		clock_gettime(CLOCK_MONOTONIC, &fs->data_ts);
+
+	if (processor->pool->data_chunk) {
+		n = io_printf(io,
+		    "filter|%s|%lld.%06ld|smtp-in|data-chunk|"
+		    "%016"PRIx64"|%016"PRIx64"|%zu\n",
+		    PROTOCOL_VERSION,
+		    (long long)tv.tv_sec, (long)tv.tv_usec,
+		    reqid, token, len + 1);
+		if (n == -1 || io_write(io, data, len) == -1 ||
+		    io_write(io, "\n", 1) == -1)
+			fatalx("failed to write to processor");
+		processor_hiwat(processor, fs);
+		return;
+	}
+
+	for (;;) {
+		nl = memchr(data, '\n', len);
+		n = io_printf(io,
+		    "filter|%s|%lld.%06ld|smtp-in|data-line|"
+		    "%016"PRIx64"|%016"PRIx64"|%.*s\n",
+		    PROTOCOL_VERSION,
+		    (long long)tv.tv_sec, (long)tv.tv_usec,
+		    reqid, token, (int)(nl ? (size_t)(nl - data) : len), data);
+		if (n == -1)
+			fatalx("failed to write to processor");
+		if (nl == NULL)
+			break;
+		len -= nl - data + 1;
+		data = nl + 1;
+	}
+	processor_hiwat(processor, fs);
 }
 
 static void
 filter_result_proceed(uint64_t reqid)
 {
-	m_create(p_dispatcher, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
-	m_add_id(p_dispatcher, reqid);
-	m_add_int(p_dispatcher, FILTER_PROCEED);
-	m_close(p_dispatcher);
+	struct mproc	*p = smtp_peer(reqid);
+
+	m_create(p, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
+	m_add_id(p, reqid);
+	m_add_int(p, FILTER_PROCEED);
+	m_close(p);
 }
 
 static void
 filter_result_report(uint64_t reqid, const char *param)
 {
-	m_create(p_dispatcher, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
-	m_add_id(p_dispatcher, reqid);
-	m_add_int(p_dispatcher, FILTER_REPORT);
-	m_add_string(p_dispatcher, param);
-	m_close(p_dispatcher);
+	struct mproc	*p = smtp_peer(reqid);
+
+	m_create(p, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
+	m_add_id(p, reqid);
+	m_add_int(p, FILTER_REPORT);
+	m_add_string(p, param);
+	m_close(p);
 }
 
 static void
 filter_result_junk(uint64_t reqid)
 {
-	m_create(p_dispatcher, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
-	m_add_id(p_dispatcher, reqid);
-	m_add_int(p_dispatcher, FILTER_JUNK);
-	m_close(p_dispatcher);
+	struct mproc	*p = smtp_peer(reqid);
+
+	m_create(p, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
+	m_add_id(p, reqid);
+	m_add_int(p, FILTER_JUNK);
+	m_close(p);
 }
 
 static void
 filter_result_rewrite(uint64_t reqid, const char *param)
 {
-	m_create(p_dispatcher, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
-	m_add_id(p_dispatcher, reqid);
-	m_add_int(p_dispatcher, FILTER_REWRITE);
-	m_add_string(p_dispatcher, param);
-	m_close(p_dispatcher);
+	struct mproc	*p = smtp_peer(reqid);
+
+	m_create(p, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
+	m_add_id(p, reqid);
+	m_add_int(p, FILTER_REWRITE);
+	m_add_string(p, param);
+	m_close(p);
 }
 
 static void
 filter_result_reject(uint64_t reqid, const char *message)
 {
-	m_create(p_dispatcher, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
-	m_add_id(p_dispatcher, reqid);
-	m_add_int(p_dispatcher, FILTER_REJECT);
-	m_add_string(p_dispatcher, message);
-	m_close(p_dispatcher);
+	struct mproc	*p = smtp_peer(reqid);
+
+	m_create(p, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
+	m_add_id(p, reqid);
+	m_add_int(p, FILTER_REJECT);
+	m_add_string(p, message);
+	m_close(p);
 }
 
 static void
 filter_result_disconnect(uint64_t reqid, const char *message)
 {
-	m_create(p_dispatcher, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
-	m_add_id(p_dispatcher, reqid);
-	m_add_int(p_dispatcher, FILTER_DISCONNECT);
-	m_add_string(p_dispatcher, message);
-	m_close(p_dispatcher);
+	struct mproc	*p = smtp_peer(reqid);
+
+	m_create(p, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
+	m_add_id(p, reqid);
+	m_add_int(p, FILTER_DISCONNECT);
+	m_add_string(p, message);
+	m_close(p);
 }
 
 
@@ -1225,21 +1854,259 @@ filter_check_rdns(struct filter *filter, const char *hostname)
 	return filter->config->not_rdns < 0 ? !ret : ret;
 }
 
+/*
+ * A filter matching on dnsbl zones waits for the answers before being
+ * evaluated, then the chain is resumed from that filter.
+ */
+struct filter_dnsbl_wait {
+	uint64_t		 reqid;
+	struct filter		*filter;
+	uint64_t		 token;
+	enum filter_phase	 phase;
+	char			*param;
+};
+
+static int
+filter_dnsbl_query(struct filter_session *fs, struct filter *filter,
+    uint64_t token, enum filter_phase phase, const char *param)
+{
+	struct filter_dnsbl_wait	*w;
+	int				 ret;
+
+	w = xcalloc(1, sizeof *w);
+	w->reqid = fs->id;
+	w->filter = filter;
+	w->token = token;
+	w->phase = phase;
+	w->param = xstrdup(param);
+
+	ret = dnsbl_check(filter->config->dnsbl, &fs->ss_src,
+	    filter_dnsbl_done, w);
+	if (ret == -1)
+		return 1;
+
+	tree_xset(&fs->dnsbl_verdicts, (uintptr_t)filter,
+	    (void *)(intptr_t)(ret + 1));
+	free(w->param);
+	free(w);
+	return 0;
+}
+
+static void
+filter_dnsbl_done(void *arg, int listed)
+{
+	struct filter_dnsbl_wait	*w = arg;
+	struct filter_session		*fs;
+	uint64_t			 token;
+
+	/* the session may have ended while waiting */
+	if ((fs = tree_get(&sessions, w->reqid)) != NULL) {
+		tree_xset(&fs->dnsbl_verdicts, (uintptr_t)w->filter,
+		    (void *)(intptr_t)(listed + 1));
+		token = w->token;
+		filter_protocol_internal(fs, &token, w->reqid, w->phase,
+		    w->param);
+	}
+	free(w->param);
+	free(w);
+}
+
 static int
-filter_builtins_notimpl(struct filter_session *fs, struct filter *filter, uint64_t reqid, const char *param)
+filter_check_dnsbl(struct filter_session *fs, struct filter *filter)
 {
+	void	*v;
+	int	 ret = 0;
+
+	if (filter->config->dnsbl == NULL)
+		return 0;
+
+	if ((v = tree_get(&fs->dnsbl_verdicts, (uintptr_t)filter)) != NULL)
+		ret = (intptr_t)v - 1;
+	return filter->config->not_dnsbl < 0 ? !ret : ret;
+}
+
+/*
+ * Likewise, a filter matching on SPF results waits for the evaluation
+ * of the policy of the current sender.
+ */
+static int
+filter_spf_query(struct filter_session *fs, struct filter *filter,
+    uint64_t token, enum filter_phase phase, const char *param)
+{
+	struct filter_dnsbl_wait	*w;
+	int				 ret;
+
+	w = xcalloc(1, sizeof *w);
+	w->reqid = fs->id;
+	w->filter = filter;
+	w->token = token;
+	w->phase = phase;
+	w->param = xstrdup(param);
+
+	ret = spf_check(&fs->ss_src, fs->mail_from, fs->helo,
+	    filter_spf_done, w);
+	if (ret == -1)
+		return 1;
+
+	tree_xset(&fs->spf_verdicts, (uintptr_t)filter,
+	    (void *)(intptr_t)(ret + 1));
+	free(w->param);
+	free(w);
 	return 0;
 }
 
+static void
+filter_spf_done(void *arg, int result)
+{
+	struct filter_dnsbl_wait	*w = arg;
+	struct filter_session		*fs;
+	uint64_t			 token;
+
+	if ((fs = tree_get(&sessions, w->reqid)) != NULL) {
+		tree_xset(&fs->spf_verdicts, (uintptr_t)w->filter,
+		    (void *)(intptr_t)(result + 1));
+		token = w->token;
+		filter_protocol_internal(fs, &token, w->reqid, w->phase,
+		    w->param);
+	}
+	free(w->param);
+	free(w);
+}
+
+static int
+filter_check_spf(struct filter_session *fs, struct filter *filter)
+{
+	void	*v;
+	int	 ret = 0;
+
+	if (filter->config->spf == 0)
+		return 0;
+
+	if ((v = tree_get(&fs->spf_verdicts, (uintptr_t)filter)) != NULL)
+		ret = (filter->config->spf & (1 << ((intptr_t)v - 1))) != 0;
+	else
+		return 0;
+	return filter->config->not_spf < 0 ? !ret : ret;
+}
+
+/*
+ * Rate limits are checked last, so that a filter only takes a token
+ * from the bucket when none of its other conditions matched.
+ */
+static int
+filter_check_limit(struct filter_session *fs, struct filter *filter,
+    const char *param)
+{
+	struct limit	*l = filter->config->limit;
+	const char	*key = NULL;
+	int		 ret;
+
+	if (l == NULL)
+		return 0;
+
+	switch (l->key) {
+	case LIMIT_KEY_SRC:
+		key = ss_to_text(&fs->ss_src);
+		break;
+	case LIMIT_KEY_MAIL_FROM:
+		key = fs->mail_from;
+		break;
+	case LIMIT_KEY_RCPT_TO:
+		key = param;
+		break;
+	}
+	if (key == NULL)
+		return 0;
+
+	ret = limit_hit(l, key);
+	return filter->config->not_limit < 0 ? !ret : ret;
+}
+
 static int
-filter_builtins_global(struct filter_session *fs, struct filter *filter, uint64_t reqid)
+filter_builtins_notimpl(struct filter_session *fs, struct filter *filter, uint64_t reqid, const char *param)
+{
+	return 0;
+}
+
+static void
+filter_src_cache_remove(struct filter_src_cache_entry *e)
 {
-	return filter_check_fcrdns(filter, fs->fcrdns) ||
+	hdict_xpop(&filter_src_cache, e->key);
+	TAILQ_REMOVE(&filter_src_lru, e, entry);
+	free(e->key);
+	free(e);
+}
+
+static int
+filter_builtins_source(struct filter_session *fs, struct filter *filter)
+{
+	struct filter_config		*fc = filter->config;
+	struct filter_src_cache_entry	*e;
+	const char			*src;
+	char				 key[LINE_MAX];
+	void				*v;
+	int				 ret;
+
+	if (!fc->fcrdns && !fc->rdns && fc->rdns_table == NULL &&
+	    fc->rdns_regex == NULL && fc->src_table == NULL &&
+	    fc->src_regex == NULL)
+		return 0;
+
+	if ((v = tree_get(&fs->src_verdicts, (uintptr_t)filter)) != NULL)
+		return (intptr_t)v - 1;
+
+	if (filter_src_cache_gen != table_generation()) {
+		while (!TAILQ_EMPTY(&filter_src_lru))
+			filter_src_cache_remove(TAILQ_FIRST(&filter_src_lru));
+		filter_src_cache_gen = table_generation();
+	}
+
+	src = ss_to_text(&fs->ss_src);
+	if (!bsnprintf(key, sizeof(key), "%s|%s|%d|%s", filter->name, src,
+	    fs->fcrdns, fs->rdns ? fs->rdns : ""))
+		key[0] = '\0';
+
+	if (key[0] && (e = hdict_get(&filter_src_cache, key)) != NULL) {
+		if (e->expire > time(NULL)) {
+			ret = e->ret;
+			TAILQ_REMOVE(&filter_src_lru, e, entry);
+			TAILQ_INSERT_HEAD(&filter_src_lru, e, entry);
+			goto done;
+		}
+		filter_src_cache_remove(e);
+	}
+
+	ret = filter_check_fcrdns(filter, fs->fcrdns) ||
 	    filter_check_rdns(filter, fs->rdns) ||
 	    filter_check_rdns_table(filter, K_DOMAIN, fs->rdns) ||
 	    filter_check_rdns_regex(filter, fs->rdns) ||
-	    filter_check_src_table(filter, K_NETADDR, ss_to_text(&fs->ss_src)) ||
-	    filter_check_src_regex(filter, ss_to_text(&fs->ss_src)) ||
+	    filter_check_src_table(filter, K_NETADDR, src) ||
+	    filter_check_src_regex(filter, src);
+
+	if (key[0]) {
+		if (hdict_count(&filter_src_cache) >= FILTER_SRC_CACHE_MAX)
+			filter_src_cache_remove(TAILQ_LAST(&filter_src_lru,
+			    filter_src_lru));
+		e = xcalloc(1, sizeof(*e));
+		e->key = xstrdup(key);
+		e->expire = time(NULL) + FILTER_SRC_CACHE_TTL;
+		e->ret = ret;
+		hdict_xset(&filter_src_cache, e->key, e);
+		TAILQ_INSERT_HEAD(&filter_src_lru, e, entry);
+	}
+
+done:
+	tree_xset(&fs->src_verdicts, (uintptr_t)filter,
+	    (void *)(intptr_t)(ret + 1));
+	return ret;
+}
+
+static int
+filter_builtins_global(struct filter_session *fs, struct filter *filter, uint64_t reqid,
+    const char *param)
+{
+	return filter_builtins_source(fs, filter) ||
+	    filter_check_dnsbl(fs, filter) ||
 	    filter_check_helo_table(filter, K_DOMAIN, fs->helo) ||
 	    filter_check_helo_regex(filter, fs->helo) ||
 	    filter_check_auth(filter, fs->username) ||
@@ -1247,45 +2114,47 @@ filter_builtins_global(struct filter_session *fs, struct filter *filter, uint64_
 	    filter_check_auth_table(filter, K_CREDENTIALS, fs->username) ||
 	    filter_check_auth_regex(filter, fs->username) ||
 	    filter_check_mail_from_table(filter, K_MAILADDR, fs->mail_from) ||
-	    filter_check_mail_from_regex(filter, fs->mail_from);
+	    filter_check_mail_from_regex(filter, fs->mail_from) ||
+	    filter_check_spf(fs, filter) ||
+	    filter_check_limit(fs, filter, param);
 }
 
 static int
 filter_builtins_connect(struct filter_session *fs, struct filter *filter, uint64_t reqid, const char *param)
 {
-	return filter_builtins_global(fs, filter, reqid);
+	return filter_builtins_global(fs, filter, reqid, param);
 }
 
 static int
 filter_builtins_helo(struct filter_session *fs, struct filter *filter, uint64_t reqid, const char *param)
 {
-	return filter_builtins_global(fs, filter, reqid);
+	return filter_builtins_global(fs, filter, reqid, param);
 }
 
 static int
 filter_builtins_mail_from(struct filter_session *fs, struct filter *filter, uint64_t reqid, const char *param)
 {
-	return filter_builtins_global(fs, filter, reqid);
+	return filter_builtins_global(fs, filter, reqid, param);
 }
 
 static int
 filter_builtins_rcpt_to(struct filter_session *fs, struct filter *filter, uint64_t reqid, const char *param)
 {
-	return filter_builtins_global(fs, filter, reqid) ||
-	    filter_check_rcpt_to_table(filter, K_MAILADDR, param) ||
-	    filter_check_rcpt_to_regex(filter, param);
+	return filter_check_rcpt_to_table(filter, K_MAILADDR, param) ||
+	    filter_check_rcpt_to_regex(filter, param) ||
+	    filter_builtins_global(fs, filter, reqid, param);
 }
 
 static int
 filter_builtins_data(struct filter_session *fs, struct filter *filter, uint64_t reqid, const char *param)
 {
-	return filter_builtins_global(fs, filter, reqid);
+	return filter_builtins_global(fs, filter, reqid, param);
 }
 
 static int
 filter_builtins_commit(struct filter_session *fs, struct filter *filter, uint64_t reqid, const char *param)
 {
-	return filter_builtins_global(fs, filter, reqid);
+	return filter_builtins_global(fs, filter, reqid, param);
 }
 
 static void
@@ -1298,24 +2167,42 @@ lka_report_init(void)
 	struct reporters	*tailq;
 	size_t			 i;
 
-	dict_init(&report_smtp_in);
-	dict_init(&report_smtp_out);
+	hdict_init(&report_smtp_in);
+	hdict_init(&report_smtp_out);
 
 	for (i = 0; i < nitems(smtp_events); ++i) {
 		tailq = xcalloc(1, sizeof (struct reporters));
 		TAILQ_INIT(tailq);
-		dict_xset(&report_smtp_in, smtp_events[i].event, tailq);
+		hdict_xset(&report_smtp_in, smtp_events[i].event, tailq);
 
 		tailq = xcalloc(1, sizeof (struct reporters));
 		TAILQ_INIT(tailq);
-		dict_xset(&report_smtp_out, smtp_events[i].event, tailq);
+		hdict_xset(&report_smtp_out, smtp_events[i].event, tailq);
 	}
 }
 
+static size_t
+report_proc_index(const char *name)
+{
+	char  **tmp;
+	size_t	i;
+
+	for (i = 0; i < reporter_count; i++)
+		if (strcmp(reporter_names[i], name) == 0)
+			return i;
+
+	tmp = reallocarray(reporter_names, reporter_count + 1, sizeof *tmp);
+	if (tmp == NULL)
+		fatal("report_proc_index: reallocarray");
+	reporter_names = tmp;
+	reporter_names[reporter_count] = xstrdup(name);
+	return reporter_count++;
+}
+
 void
 lka_report_register_hook(const char *name, const char *hook)
 {
-	struct dict	*subsystem;
+	struct hdict	*subsystem;
 	struct reporter_proc	*rp;
 	struct reporters	*tailq;
 	void *iter;
@@ -1334,9 +2221,10 @@ lka_report_register_hook(const char *name, const char *hook)
 
 	if (strcmp(hook, "*") == 0) {
 		iter = NULL;
-		while (dict_iter(subsystem, &iter, NULL, (void **)&tailq)) {
+		while (hdict_iter(subsystem, &iter, NULL, (void **)&tailq)) {
 			rp = xcalloc(1, sizeof *rp);
 			rp->name = xstrdup(name);
+			rp->idx = report_proc_index(name);
 			TAILQ_INSERT_TAIL(tailq, rp, entries);
 		}
 		return;
@@ -1348,20 +2236,74 @@ lka_report_register_hook(const char *name, const char *hook)
 	if (i == nitems(smtp_events))
 		fatalx("Unrecognized report name: %s", hook);
 
-	tailq = dict_get(subsystem, hook);
+	tailq = hdict_get(subsystem, hook);
 	rp = xcalloc(1, sizeof *rp);
 	rp->name = xstrdup(name);
+	rp->idx = report_proc_index(name);
 	TAILQ_INSERT_TAIL(tailq, rp, entries);
 }
 
+/*
+ * Tell the dispatcher and the mta workers which events have a reporter
+ * in each direction, so that they don't send lka the ones nobody
+ * subscribed to.
+ */
+void
+lka_report_publish(void)
+{
+	struct reporters	*tailq;
+	struct mproc		*p;
+	uint32_t		 in = 0, out = 0;
+	size_t			 i;
+	int			 w;
+
+	for (i = 0; i < nitems(smtp_events); i++) {
+		tailq = hdict_xget(&report_smtp_in, smtp_events[i].event);
+		if (!TAILQ_EMPTY(tailq))
+			in |= 1U << i;
+		tailq = hdict_xget(&report_smtp_out, smtp_events[i].event);
+		if (!TAILQ_EMPTY(tailq))
+			out |= 1U << i;
+	}
+
+	for (w = 0; w < smtp_peer_count(); w++) {
+		p = smtp_peer_at(w);
+		m_create(p, IMSG_REPORT_SMTP_EVENTS, 0, 0, -1);
+		m_add_u32(p, in);
+		m_add_u32(p, out);
+		m_close(p);
+	}
+
+	for (w = 0; w < env->sc_mta_workers; w++) {
+		m_create(p_mta[w], IMSG_REPORT_SMTP_EVENTS, 0, 0, -1);
+		m_add_u32(p_mta[w], in);
+		m_add_u32(p_mta[w], out);
+		m_close(p_mta[w]);
+	}
+}
+
+static int
+report_session_subscribed(struct filter_session *fs, uint64_t reqid,
+    struct reporter_proc *rp)
+{
+	if (fs == NULL)
+		return 0;
+	if (rp->idx < fs->reporters_count)
+		return fs->reporters[rp->idx];
+	return lka_filter_proc_in_session(reqid, rp->name);
+}
+
 static void
 report_smtp_broadcast(uint64_t reqid, const char *direction, struct timeval *tv, const char *event,
     const char *format, ...)
 {
 	va_list		ap;
-	struct dict	*d;
+	struct hdict	*d;
 	struct reporters	*tailq;
 	struct reporter_proc	*rp;
+	struct filter_session	*fs;
+	char		*line = NULL, *body;
+	int		 len = 0;
 
 	if (strcmp("smtp-in", direction) == 0)
 		d = &report_smtp_in;
@@ -1372,21 +2314,35 @@ report_smtp_broadcast(uint64_t reqid, const char *direction, struct timeval *tv,
 	else
 		fatalx("unexpected direction: %s", direction);
 
-	tailq = dict_xget(d, event);
+	tailq = hdict_xget(d, event);
+	if (TAILQ_EMPTY(tailq))
+		return;
+
+	fs = filters_inited ? tree_get(&sessions, reqid) : NULL;
+
+	/* the line is the same for every subscriber, format it once */
 	TAILQ_FOREACH(rp, tailq, entries) {
-		if (!lka_filter_proc_in_session(reqid, rp->name))
+		if (!report_session_subscribed(fs, reqid, rp))
 			continue;
 
-		va_start(ap, format);
-		if (io_printf(lka_proc_get_io(rp->name),
-		    "report|%s|%lld.%06ld|%s|%s|%016"PRIx64"%s",
-		    PROTOCOL_VERSION, (long long)tv->tv_sec, (long)tv->tv_usec,
-		    direction, event, reqid,
-		    format[0] != '\n' ? "|" : "") == -1 ||
-		    io_vprintf(lka_proc_get_io(rp->name), format, ap) == -1)
+		if (line == NULL) {
+			va_start(ap, format);
+			if (vasprintf(&body, format, ap) == -1)
+				fatal("report_smtp_broadcast: vasprintf");
+			va_end(ap);
+			if ((len = asprintf(&line,
+			    "report|%s|%lld.%06ld|%s|%s|%016"PRIx64"%s%s",
+			    PROTOCOL_VERSION, (long long)tv->tv_sec,
+			    (long)tv->tv_usec, direction, event, reqid,
+			    format[0] != '\n' ? "|" : "", body)) == -1)
+				fatal("report_smtp_broadcast: asprintf");
+			free(body);
+		}
+
+		if (io_write(lka_proc_get_io(rp->name, reqid), line, len) == -1)
 			fatalx("failed to write to processor");
-		va_end(ap);
 	}
+	free(line);
 }
 
 void
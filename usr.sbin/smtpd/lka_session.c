@@ -60,10 +60,33 @@ static void lka_expand(struct lka_session *, struct rule *,
 static void lka_submit(struct lka_session *, struct rule *,
     struct expandnode *);
 static void lka_resume(struct lka_session *);
+static void lka_queue_submit(struct lka_session *);
 
 static int		init;
 static struct tree	sessions;
 
+/*
+ * The nodes read from a .forward file are kept per user and home
+ * directory, with the identity of the file they were read from.  Within
+ * FORWARD_CACHE_TTL seconds they are used as is, then the parent is only
+ * asked whether the file changed, and it is opened and parsed again only
+ * if it did.  Missing files are cached the same way.
+ */
+#define	FORWARD_CACHE_MAX	1024
+#define	FORWARD_CACHE_TTL	60	/* seconds */
+
+struct forward_cache_entry {
+	TAILQ_ENTRY(forward_cache_entry) entry;
+	char			*key;
+	time_t			 expire;
+	int			 exists;
+	struct forward_ident	 ident;
+	struct expand		 expand;
+};
+
+static struct hdict	forward_cache;
+static TAILQ_HEAD(forward_cache_lru, forward_cache_entry) forward_cache_lru;
+
 void
 lka_session(uint64_t id, struct envelope *envelope)
 {
@@ -73,11 +96,12 @@ lka_session(uint64_t id, struct envelope *envelope)
 	if (init == 0) {
 		init = 1;
 		tree_init(&sessions);
+		hdict_init(&forward_cache);
+		TAILQ_INIT(&forward_cache_lru);
 	}
 
 	lks = xcalloc(1, sizeof(*lks));
 	lks->id = id;
-	RB_INIT(&lks->expand.tree);
 	TAILQ_INIT(&lks->deliverylist);
 	tree_xset(&sessions, lks->id, lks);
 
@@ -94,79 +118,206 @@ lka_session(uint64_t id, struct envelope *envelope)
 	lka_resume(lks);
 }
 
-void
-lka_session_forward_reply(struct forward_req *fwreq, int fd)
+static int
+forward_cache_key(struct forward_req *fwreq, char *buf, size_t len)
+{
+	return bsnprintf(buf, len, "%s:%s", fwreq->user, fwreq->directory);
+}
+
+static struct forward_cache_entry *
+forward_cache_get(struct forward_req *fwreq)
+{
+	struct forward_cache_entry	*e;
+	char				 key[LINE_MAX];
+
+	if (!forward_cache_key(fwreq, key, sizeof(key)))
+		return NULL;
+	if ((e = hdict_get(&forward_cache, key)) == NULL)
+		return NULL;
+
+	TAILQ_REMOVE(&forward_cache_lru, e, entry);
+	TAILQ_INSERT_HEAD(&forward_cache_lru, e, entry);
+	return e;
+}
+
+/* also releases the entries that could not be cached */
+static void
+forward_cache_remove(struct forward_cache_entry *e)
+{
+	if (e->key) {
+		hdict_xpop(&forward_cache, e->key);
+		TAILQ_REMOVE(&forward_cache_lru, e, entry);
+	}
+	expand_clear(&e->expand);
+	free(e->key);
+	free(e);
+}
+
+/* return a new empty entry for the lookup the parent just answered */
+static struct forward_cache_entry *
+forward_cache_new(struct forward_req *fwreq, int exists)
+{
+	struct forward_cache_entry	*e, *old;
+	char				 key[LINE_MAX];
+
+	e = xcalloc(1, sizeof(*e));
+	e->exists = exists;
+	e->ident = fwreq->ident;
+	e->expire = time(NULL) + FORWARD_CACHE_TTL;
+	if (!forward_cache_key(fwreq, key, sizeof(key)))
+		return e;
+
+	if ((old = hdict_get(&forward_cache, key)))
+		forward_cache_remove(old);
+	else if (hdict_count(&forward_cache) >= FORWARD_CACHE_MAX)
+		forward_cache_remove(TAILQ_LAST(&forward_cache_lru,
+		    forward_cache_lru));
+
+	e->key = xstrdup(key);
+	hdict_xset(&forward_cache, e->key, e);
+	TAILQ_INSERT_HEAD(&forward_cache_lru, e, entry);
+	return e;
+}
+
+/* expand the pending node of the session with the content of a .forward */
+static void
+lka_forward(struct lka_session *lks, const char *user,
+    struct forward_cache_entry *e)
 {
-	struct lka_session     *lks;
 	struct dispatcher      *dsp;
 	struct rule	       *rule;
 	struct expandnode      *xn;
-	int			ret;
+	size_t			save;
 
-	lks = tree_xget(&sessions, fwreq->id);
 	xn = lks->node;
 	rule = lks->rule;
 
-	lks->flags &= ~F_WAITING;
+	if (!e->exists) {
+		dsp = hdict_get(env->sc_dispatchers, lks->rule->dispatcher);
+		if (dsp->u.local.forward_only) {
+			log_trace(TRACE_EXPAND, "expand: no .forward "
+			    "for user %s on forward-only rule", user);
+			lks->error = LKA_TEMPFAIL;
+		}
+		else if (dsp->u.local.expand_only) {
+			log_trace(TRACE_EXPAND, "expand: no .forward "
+			    "for user %s and no default action on rule", user);
+			lks->error = LKA_PERMFAIL;
+		}
+		else {
+			log_trace(TRACE_EXPAND, "expand: no .forward for "
+			    "user %s, just deliver", user);
+			lka_submit(lks, rule, xn);
+		}
+	}
+	else {
+		dsp = hdict_get(env->sc_dispatchers, rule->dispatcher);
 
-	switch (fwreq->status) {
-	case 0:
-		/* permanent failure while lookup ~/.forward */
-		log_trace(TRACE_EXPAND, "expand: ~/.forward failed for user %s",
-		    fwreq->user);
-		lks->error = LKA_PERMFAIL;
-		break;
-	case 1:
-		if (fd == -1) {
-			dsp = dict_get(env->sc_dispatchers, lks->rule->dispatcher);
+		/* expand for the current user and rule */
+		lks->expand.rule = rule;
+		lks->expand.parent = xn;
+
+		save = lks->expand.nb_nodes;
+		expand_merge(&lks->expand, &e->expand);
+		if (lks->expand.nb_nodes > MAX_EXPAND_NODES) {
+			log_trace(TRACE_EXPAND, "expand: forward file "
+			    "for user %s expanded too many nodes", user);
+			lks->error = LKA_TEMPFAIL;
+		}
+		else if (lks->expand.nb_nodes == save) {
 			if (dsp->u.local.forward_only) {
-				log_trace(TRACE_EXPAND, "expand: no .forward "
-				    "for user %s on forward-only rule", fwreq->user);
+				log_trace(TRACE_EXPAND, "expand: empty .forward "
+				    "for user %s on forward-only rule", user);
 				lks->error = LKA_TEMPFAIL;
 			}
 			else if (dsp->u.local.expand_only) {
-				log_trace(TRACE_EXPAND, "expand: no .forward "
-				    "for user %s and no default action on rule", fwreq->user);
+				log_trace(TRACE_EXPAND, "expand: empty .forward "
+				    "for user %s and no default action on rule", user);
 				lks->error = LKA_PERMFAIL;
 			}
 			else {
-				log_trace(TRACE_EXPAND, "expand: no .forward for "
-				    "user %s, just deliver", fwreq->user);
+				log_trace(TRACE_EXPAND, "expand: empty .forward "
+				    "for user %s, just deliver", user);
 				lka_submit(lks, rule, xn);
 			}
 		}
-		else {
-			dsp = dict_get(env->sc_dispatchers, rule->dispatcher);
+	}
 
-			/* expand for the current user and rule */
-			lks->expand.rule = rule;
-			lks->expand.parent = xn;
+	if (lks->error == LKA_TEMPFAIL && lks->errormsg == NULL)
+		lks->errormsg = "424 4.2.4 Mailing list expansion problem";
+	if (lks->error == LKA_PERMFAIL && lks->errormsg == NULL)
+		lks->errormsg = "524 5.2.4 Mailing list expansion problem";
+}
 
-			/* forwards_get() will close the descriptor no matter what */
-			ret = forwards_get(fd, &lks->expand);
-			if (ret == -1) {
-				log_trace(TRACE_EXPAND, "expand: temporary "
-				    "forward error for user %s", fwreq->user);
-				lks->error = LKA_TEMPFAIL;
-			}
-			else if (ret == 0) {
-				if (dsp->u.local.forward_only) {
-					log_trace(TRACE_EXPAND, "expand: empty .forward "
-					    "for user %s on forward-only rule", fwreq->user);
-					lks->error = LKA_TEMPFAIL;
-				}
-				else if (dsp->u.local.expand_only) {
-					log_trace(TRACE_EXPAND, "expand: empty .forward "
-					    "for user %s and no default action on rule", fwreq->user);
-					lks->error = LKA_PERMFAIL;
-				}
-				else {
-					log_trace(TRACE_EXPAND, "expand: empty .forward "
-					    "for user %s, just deliver", fwreq->user);
-					lka_submit(lks, rule, xn);
-				}
-			}
+/*
+ * Use a fresh cached lookup for the request, or else have the parent
+ * revalidate a stale one.  Returns 1 if the node was expanded.
+ */
+static int
+lka_forward_cached(struct lka_session *lks, struct forward_req *fwreq)
+{
+	struct forward_cache_entry	*e;
+
+	if ((e = forward_cache_get(fwreq)) == NULL)
+		return 0;
+
+	if (e->expire > time(NULL)) {
+		log_trace(TRACE_EXPAND, "expand: .forward cache hit for "
+		    "user %s", fwreq->user);
+		lka_forward(lks, fwreq->user, e);
+		return 1;
+	}
+
+	fwreq->cached = 1;
+	fwreq->ident = e->ident;
+	return 0;
+}
+
+void
+lka_session_forward_reply(struct forward_req *fwreq, int fd)
+{
+	struct forward_cache_entry	*e;
+	struct lka_session		*lks;
+
+	lks = tree_xget(&sessions, fwreq->id);
+
+	lks->flags &= ~F_WAITING;
+
+	switch (fwreq->status) {
+	case 0:
+		/* permanent failure while lookup ~/.forward */
+		log_trace(TRACE_EXPAND, "expand: ~/.forward failed for user %s",
+		    fwreq->user);
+		lks->error = LKA_PERMFAIL;
+		break;
+	case 1:
+		e = forward_cache_new(fwreq, fd != -1);
+
+		/* forwards_get() will close the descriptor no matter what */
+		if (fd != -1 && forwards_get(fd, &e->expand) == -1) {
+			log_trace(TRACE_EXPAND, "expand: temporary "
+			    "forward error for user %s", fwreq->user);
+			lks->error = LKA_TEMPFAIL;
+			forward_cache_remove(e);
+			break;
 		}
+		lka_forward(lks, fwreq->user, e);
+		if (e->key == NULL)
+			forward_cache_remove(e);
+		break;
+	case 2:
+		/* the cached lookup is still valid, unless it was evicted */
+		if ((e = forward_cache_get(fwreq)) == NULL) {
+			fwreq->cached = 0;
+			m_compose(p_parent, IMSG_LKA_OPEN_FORWARD, 0, 0, -1,
+			    fwreq, sizeof(*fwreq));
+			lks->flags |= F_WAITING;
+			return;
+		}
+		log_trace(TRACE_EXPAND, "expand: .forward unchanged for "
+		    "user %s", fwreq->user);
+		e->expire = time(NULL) + FORWARD_CACHE_TTL;
+		lka_forward(lks, fwreq->user, e);
 		break;
 	default:
 		/* temporary failure while looking up ~/.forward */
@@ -186,6 +337,7 @@ lka_resume(struct lka_session *lks)
 {
 	struct envelope		*ep;
 	struct expandnode	*xn;
+	struct mproc		*p;
 
 	if (lks->error)
 		goto error;
@@ -209,20 +361,21 @@ lka_resume(struct lka_session *lks)
 	}
     error:
 	if (lks->error) {
-		m_create(p_dispatcher, IMSG_SMTP_EXPAND_RCPT, 0, 0, -1);
-		m_add_id(p_dispatcher, lks->id);
-		m_add_int(p_dispatcher, lks->error);
+		p = smtp_peer(lks->id);
+		m_create(p, IMSG_SMTP_EXPAND_RCPT, 0, 0, -1);
+		m_add_id(p, lks->id);
+		m_add_int(p, lks->error);
 
 		if (lks->errormsg)
-			m_add_string(p_dispatcher, lks->errormsg);
+			m_add_string(p, lks->errormsg);
 		else {
 			if (lks->error == LKA_PERMFAIL)
-				m_add_string(p_dispatcher, "550 Invalid recipient");
+				m_add_string(p, "550 Invalid recipient");
 			else if (lks->error == LKA_TEMPFAIL)
-				m_add_string(p_dispatcher, "451 Temporary failure");
+				m_add_string(p, "451 Temporary failure");
 		}
 
-		m_close(p_dispatcher);
+		m_close(p);
 		while ((ep = TAILQ_FIRST(&lks->deliverylist)) != NULL) {
 			TAILQ_REMOVE(&lks->deliverylist, ep, entry);
 			free(ep);
@@ -230,14 +383,7 @@ lka_resume(struct lka_session *lks)
 	}
 	else {
 		/* Process the delivery list and submit envelopes to queue */
-		while ((ep = TAILQ_FIRST(&lks->deliverylist)) != NULL) {
-			TAILQ_REMOVE(&lks->deliverylist, ep, entry);
-			m_create(p_queue, IMSG_LKA_ENVELOPE_SUBMIT, 0, 0, -1);
-			m_add_id(p_queue, lks->id);
-			m_add_envelope(p_queue, ep);
-			m_close(p_queue);
-			free(ep);
-		}
+		lka_queue_submit(lks);
 
 		m_create(p_queue, IMSG_LKA_ENVELOPE_COMMIT, 0, 0, -1);
 		m_add_id(p_queue, lks->id);
@@ -249,6 +395,53 @@ lka_resume(struct lka_session *lks)
 	free(lks);
 }
 
+/*
+ * The delivery list goes to the queue in batches: the message-level
+ * fields once, then the id and recipient-level fields of each envelope
+ * sharing them.  An alias expanding to thousands of recipients is then
+ * a few imsgs, each acknowledged by one reply.
+ */
+static void
+lka_queue_submit(struct lka_session *lks)
+{
+	struct envelope	*ep;
+	char		 msgbuf[sizeof(*ep)], rcptbuf[sizeof(*ep)];
+	char		 batchbuf[sizeof(*ep)];
+	size_t		 msglen, rcptlen, batchlen = 0;
+	int		 open = 0;
+
+	while ((ep = TAILQ_FIRST(&lks->deliverylist)) != NULL) {
+		TAILQ_REMOVE(&lks->deliverylist, ep, entry);
+
+		if (!envelope_dump_binary_fields(ep, ENVELOPE_FIELDS_MESSAGE,
+		    msgbuf, sizeof msgbuf, &msglen) ||
+		    !envelope_dump_binary_fields(ep, ENVELOPE_FIELDS_RECIPIENT,
+		    rcptbuf, sizeof rcptbuf, &rcptlen))
+			fatalx("lka: failed to dump envelope");
+
+		if (open && (msglen != batchlen ||
+		    memcmp(msgbuf, batchbuf, msglen) != 0 ||
+		    p_queue->m_pos + IMSG_HEADER_SIZE + sizeof(ep->id) +
+		    sizeof(rcptlen) + rcptlen > MAX_IMSGSIZE)) {
+			m_close(p_queue);
+			open = 0;
+		}
+		if (!open) {
+			m_create(p_queue, IMSG_LKA_ENVELOPE_SUBMIT, 0, 0, -1);
+			m_add_id(p_queue, lks->id);
+			m_add_data(p_queue, msgbuf, msglen);
+			memcpy(batchbuf, msgbuf, msglen);
+			batchlen = msglen;
+			open = 1;
+		}
+		m_add_evpid(p_queue, ep->id);
+		m_add_data(p_queue, rcptbuf, rcptlen);
+		free(ep);
+	}
+	if (open)
+		m_close(p_queue);
+}
+
 static void
 lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 {
@@ -261,7 +454,7 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 	int			r;
 	union lookup		lk;
 	char		       *tag;
-	const char	       *srs_decoded;
+	char			srs_decoded[SMTPD_MAXMAILADDRSIZE];
 
 	if (xn->depth >= EXPAND_DEPTH) {
 		log_trace(TRACE_EXPAND, "expand: lka_expand: node too deep.");
@@ -293,8 +486,8 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 		    ep.sender.user[0] == '\0' &&
 		    (strncasecmp(ep.dest.user, "SRS0=", 5) == 0 ||
 			strncasecmp(ep.dest.user, "SRS1=", 5) == 0)) {
-			srs_decoded = srs_decode(mailaddr_to_text(&ep.dest));
-			if (srs_decoded &&
+			if (srs_decode(mailaddr_to_text(&ep.dest), srs_decoded,
+			    sizeof(srs_decoded)) &&
 			    text_to_mailaddr(&ep.dest, srs_decoded)) {
 				/* flag envelope internal and override dest */
 				ep.flags |= EF_INTERNAL;
@@ -315,7 +508,7 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 			break;
 		}
 
-		dsp = dict_xget(env->sc_dispatchers, rule->dispatcher);
+		dsp = hdict_xget(env->sc_dispatchers, rule->dispatcher);
 		if (dsp->type == DISPATCHER_REMOTE) {
 			lka_submit(lks, rule, xn);
 		}
@@ -365,7 +558,7 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 		    xn->u.user, xn->depth, xn->sameuser);
 
 		/* expand aliases with the given rule */
-		dsp = dict_xget(env->sc_dispatchers, rule->dispatcher);
+		dsp = hdict_xget(env->sc_dispatchers, rule->dispatcher);
 
 		lks->expand.rule = rule;
 		lks->expand.parent = xn;
@@ -390,7 +583,7 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 		/* gilles+hackers@ -> gilles@ */
 		if ((tag = strchr(xn->u.user, *env->sc_subaddressing_delim)) != NULL) {
 			*tag++ = '\0';
-			(void)strlcpy(xn->subaddress, tag, sizeof xn->subaddress);
+			xn->subaddress = tag;
 		}
 
 		userbase = table_find(env, dsp->u.local.table_userbase);
@@ -443,6 +636,9 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 		fwreq.uid = lk.userinfo.uid;
 		fwreq.gid = lk.userinfo.gid;
 
+		if (lka_forward_cached(lks, &fwreq))
+			break;
+
 		m_compose(p_parent, IMSG_LKA_OPEN_FORWARD, 0, 0, -1,
 		    &fwreq, sizeof(fwreq));
 		lks->flags |= F_WAITING;
@@ -455,7 +651,7 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 			break;
 		}
 
-		dsp = dict_xget(env->sc_dispatchers, rule->dispatcher);
+		dsp = hdict_xget(env->sc_dispatchers, rule->dispatcher);
 		if (dsp->u.local.forward_only) {
 			log_trace(TRACE_EXPAND, "expand: filename matched on forward-only rule");
 			lks->error = LKA_TEMPFAIL;
@@ -467,7 +663,7 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 		break;
 
 	case EXPAND_ERROR:
-		dsp = dict_xget(env->sc_dispatchers, rule->dispatcher);
+		dsp = hdict_xget(env->sc_dispatchers, rule->dispatcher);
 		if (dsp->u.local.forward_only) {
 			log_trace(TRACE_EXPAND, "expand: error matched on forward-only rule");
 			lks->error = LKA_TEMPFAIL;
@@ -489,7 +685,7 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 			break;
 		}
 
-		dsp = dict_xget(env->sc_dispatchers, rule->dispatcher);
+		dsp = hdict_xget(env->sc_dispatchers, rule->dispatcher);
 		if (dsp->u.local.forward_only) {
 			log_trace(TRACE_EXPAND, "expand: filter matched on forward-only rule");
 			lks->error = LKA_TEMPFAIL;
@@ -526,7 +722,7 @@ lka_submit(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 	ep = xmemdup(&lks->envelope, sizeof *ep);
 	(void)strlcpy(ep->dispatcher, rule->dispatcher, sizeof ep->dispatcher);
 
-	dsp = dict_xget(env->sc_dispatchers, ep->dispatcher);
+	dsp = hdict_xget(env->sc_dispatchers, ep->dispatcher);
 
 	switch (dsp->type) {
 	case DISPATCHER_REMOTE:
@@ -547,7 +743,9 @@ lka_submit(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 		ep->dest = lka_find_ancestor(xn, EXPAND_ADDRESS)->u.mailaddr;
 		if (xn->type == EXPAND_USERNAME) {
 			(void)strlcpy(ep->mda_user, xn->u.user, sizeof(ep->mda_user));
-			(void)strlcpy(ep->mda_subaddress, xn->subaddress, sizeof(ep->mda_subaddress));
+			(void)strlcpy(ep->mda_subaddress,
+			    xn->subaddress ? xn->subaddress : "",
+			    sizeof(ep->mda_subaddress));
 		}
 		else {
 			user = !xn->parent->realuser ?
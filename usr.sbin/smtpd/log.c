@@ -28,12 +28,14 @@
 
 static int	 debug;
 static int	 verbose;
+static int	(*writer)(int, const char *);
 const char	*log_procname;
 
 void	log_init(int, int);
 void	log_procinit(const char *);
 void	log_setverbose(int);
 int	log_getverbose(void);
+void	log_setwriter(int (*)(int, const char *));
 void	log_warn(const char *, ...)
 	    __attribute__((__format__ (printf, 1, 2)));
 void	log_warnx(const char *, ...)
@@ -85,6 +87,12 @@ log_getverbose(void)
 	return (verbose);
 }
 
+void
+log_setwriter(int (*fn)(int, const char *))
+{
+	writer = fn;
+}
+
 void
 logit(int pri, const char *fmt, ...)
 {
@@ -98,6 +106,7 @@ logit(int pri, const char *fmt, ...)
 void
 vlog(int pri, const char *fmt, va_list ap)
 {
+	char	 line[8192];
 	char	*nfmt;
 	int	 saved_errno = errno;
 
@@ -111,6 +120,11 @@ vlog(int pri, const char *fmt, va_list ap)
 			free(nfmt);
 		}
 		fflush(stderr);
+	} else if (writer != NULL) {
+		/* the writer declines the records it cannot take */
+		(void)vsnprintf(line, sizeof(line), fmt, ap);
+		if (writer(pri, line) == -1)
+			syslog(pri, "%s", line);
 	} else
 		vsyslog(pri, fmt, ap);
 
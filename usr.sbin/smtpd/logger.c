@@ -0,0 +1,578 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <grp.h> /* needed for setgroups */
+#include <imsg.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#ifndef _PATH_LOG
+#define	_PATH_LOG	"/dev/log"
+#endif
+
+/*
+ * With "log async", the other processes never wait on syslog: a record
+ * is a single imsg queued on the pipe to the logger, which writes them
+ * out to a file by batches, or sends them to a syslog socket.  When the
+ * logger falls behind, records are dropped and counted rather than
+ * queued without bound.  Fatal errors, and whatever the forked helpers
+ * log, still go to syslog directly.
+ *
+ * With "log deliveries", the dispatcher also hands over the fields of
+ * every accepted, relayed or delivered envelope, which the logger frames
+ * into a binary delivery log: nothing is formatted as text and parsed
+ * back.  The file is opened by the parent, which renames it and passes
+ * a new one at each rotation.  It starts with a 12 bytes header,
+ * "SMTPDLOG" and a 32 bits version, then holds records in network byte
+ * order:
+ *
+ *	uint32	record length, this field included
+ *	uint8	type: 1 smtp (received), 2 mta (relayed), 3 mda (delivered)
+ *	uint8	result: 1 ok, 2 tempfail, 3 permfail
+ *	uint16	unused, 0
+ *	uint64	time of the event in microseconds
+ *	uint64	envelope id, the message id being its upper 32 bits
+ *	uint64	session id
+ *	uint32	delay since the message was queued, in seconds
+ *	uint32	message size, 0 when it is not known
+ *
+ * followed by eight strings, each a uint16 length and its bytes: sender,
+ * recipient, original recipient, relay, source address, local user, TLS
+ * version:cipher:bits, and status.  An unknown field is empty.
+ */
+
+#define	LOGGER_MAXQUEUED	1024	/* records queued to the logger */
+#define	LOGGER_BUFSIZE		65536	/* file output buffer */
+#define	LOGGER_LINEMAX		8192
+
+#define	DLOG_MAGIC		"SMTPDLOG"
+#define	DLOG_VERSION		1
+#define	DLOG_NSTRINGS		8
+
+struct logger_output {
+	int	 fd;
+	size_t	 len;
+	char	 buf[LOGGER_BUFSIZE];
+};
+
+static void logger_imsg(struct mproc *, struct imsg *);
+static void logger_shutdown(void);
+static void logger_record(int, pid_t, time_t, const char *);
+static void logger_dlog_record(struct msg *);
+static void logger_dlog_reopen(int);
+static void logger_dlog_rotate(int, short, void *);
+static void logger_append(struct logger_output *, const void *, size_t);
+static void logger_output_flush(struct logger_output *);
+static void logger_flush(int, short, void *);
+static int  logger_write(int, const char *);
+static void logger_send(int, const char *);
+
+static int		 logsock;
+static struct sockaddr_un logaddr;
+static char		 loghost[HOST_NAME_MAX+1];
+static struct logger_output textout = { -1 };
+static struct logger_output dlogout = { -1 };
+static size_t		 loglost;
+static struct event	 ev_flush;
+static struct event	 ev_rotate;
+static int		 npeers;
+
+static pid_t		 clientpid;
+static int		 inlog;
+static size_t		 dropped;
+
+static void
+logger_imsg(struct mproc *p, struct imsg *imsg)
+{
+	struct msg	 m;
+	const char	*line;
+	time_t		 t;
+	int		 pri;
+
+	if (imsg == NULL) {
+		/* keep the last records of the processes still exiting */
+		if (--npeers == 0)
+			logger_shutdown();
+		return;
+	}
+
+	switch (imsg->hdr.type) {
+	case IMSG_LOG:
+		m_msg(&m, imsg);
+		m_get_int(&m, &pri);
+		m_get_time(&m, &t);
+		m_get_string(&m, &line);
+		m_end(&m);
+		logger_record(pri, imsg->hdr.pid, t, line);
+		return;
+
+	case IMSG_LOG_DELIVERY:
+		m_msg(&m, imsg);
+		logger_dlog_record(&m);
+		m_end(&m);
+		return;
+
+	case IMSG_LOG_ROTATE:
+		logger_dlog_reopen(imsg_get_fd(imsg));
+		return;
+	}
+
+	fatalx("logger_imsg: unexpected %s imsg", imsg_to_str(imsg->hdr.type));
+}
+
+static void
+logger_shutdown(void)
+{
+	logger_flush(-1, 0, NULL);
+	log_debug("debug: logger exiting");
+	_exit(0);
+}
+
+int
+logger(void)
+{
+	struct passwd	*pw;
+	struct stat	 sb;
+	const char	*path;
+	char		*dot;
+
+	purge_config(PURGE_EVERYTHING);
+
+	if ((pw = getpwnam(SMTPD_USER)) == NULL)
+		fatalx("unknown user " SMTPD_USER);
+
+	if (gethostname(loghost, sizeof(loghost)) == -1)
+		fatal("logger: gethostname");
+	if ((dot = strchr(loghost, '.')) != NULL)
+		*dot = '\0';
+
+	path = env->sc_log_path ? env->sc_log_path : _PATH_LOG;
+	if (!env->sc_log_async || foreground_log)
+		;	/* only there for the delivery log */
+	else if (stat(path, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+		if ((textout.fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1)
+			fatal("logger: socket");
+		memset(&logaddr, 0, sizeof(logaddr));
+		logaddr.sun_family = AF_UNIX;
+		if (strlcpy(logaddr.sun_path, path, sizeof(logaddr.sun_path))
+		    >= sizeof(logaddr.sun_path))
+			fatalx("logger: socket path too long: %s", path);
+		logsock = 1;
+	}
+	else if ((textout.fd = open(path, O_WRONLY|O_APPEND|O_CREAT, 0640))
+	    == -1)
+		fatal("logger: %s", path);
+
+	/*
+	 * The socket is looked up again for every record, so that a
+	 * restarted syslogd is picked up: it must stay reachable.
+	 */
+	if (!logsock) {
+		if (chroot(PATH_CHROOT) == -1)
+			fatal("logger: chroot");
+		if (chdir("/") == -1)
+			fatal("logger: chdir(\"/\")");
+	}
+
+	config_process(PROC_LOGGER);
+
+	if (setgroups(1, &pw->pw_gid) ||
+	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
+	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
+		fatal("logger: cannot drop privileges");
+
+	imsg_callback = logger_imsg;
+	event_init();
+
+	evtimer_set(&ev_flush, logger_flush, NULL);
+
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+
+	config_peer(PROC_PARENT);
+	config_peer(PROC_CA);
+	config_peer(PROC_CONTROL);
+	config_peer(PROC_LKA);
+	config_peer(PROC_RESOLVER);
+	config_peer(PROC_DISPATCHER);
+	config_peer(PROC_QUEUE);
+	config_peer(PROC_SCHEDULER);
+	config_peer(PROC_LAUNCHER);
+	config_peer(PROC_TLS);
+	config_peer(PROC_MTA);
+	config_peer(PROC_SMTP);
+	npeers = 8 + env->sc_scheduler_shards + env->sc_tls_workers +
+	    env->sc_mta_workers + env->sc_smtp_workers;
+
+#if HAVE_PLEDGE
+	if (pledge(logsock ? "stdio unix" : "stdio", NULL) == -1)
+		fatal("pledge");
+#endif
+
+	event_dispatch();
+	fatalx("exited event loop");
+
+	return (0);
+}
+
+static void
+logger_record(int pri, pid_t pid, time_t t, const char *line)
+{
+	extern char	*__progname;
+	char		 buf[LOGGER_LINEMAX], ts[32], lost[64];
+	struct tm	*tm;
+	int		 n;
+
+	if (textout.fd == -1)
+		return;
+
+	if ((tm = localtime(&t)) == NULL ||
+	    strftime(ts, sizeof(ts), "%b %e %H:%M:%S", tm) == 0)
+		(void)strlcpy(ts, "-", sizeof(ts));
+
+	if (logsock) {
+		n = snprintf(buf, sizeof(buf), "<%d>%s %s[%d]: %s",
+		    LOG_MAIL | LOG_PRI(pri), ts, __progname, (int)pid, line);
+		if (n < 0)
+			return;
+		if ((size_t)n >= sizeof(buf))
+			n = sizeof(buf) - 1;
+		if (sendto(textout.fd, buf, n, 0, (struct sockaddr *)&logaddr,
+		    sizeof(logaddr)) == -1) {
+			loglost++;
+			return;
+		}
+		if (loglost) {
+			(void)snprintf(lost, sizeof(lost),
+			    "warn: logger: %zu records lost", loglost);
+			loglost = 0;
+			logger_record(LOG_WARNING, getpid(), t, lost);
+		}
+		return;
+	}
+
+	n = snprintf(buf, sizeof(buf), "%s %s %s[%d]: %s\n",
+	    ts, loghost, __progname, (int)pid, line);
+	if (n < 0)
+		return;
+	if ((size_t)n >= sizeof(buf)) {
+		n = sizeof(buf) - 1;
+		buf[n - 1] = '\n';
+	}
+
+	logger_append(&textout, buf, n);
+}
+
+static void
+logger_dlog_record(struct msg *m)
+{
+	const char	*str[DLOG_NSTRINGS];
+	unsigned char	 rec[LOGGER_LINEMAX * 2], *p;
+	struct timeval	 tv;
+	uint64_t	 evpid, session, u64;
+	uint32_t	 u32;
+	uint16_t	 u16;
+	time_t		 creation;
+	size_t		 size, len, slen[DLOG_NSTRINGS];
+	int		 type, result, i;
+
+	m_get_int(m, &type);
+	m_get_int(m, &result);
+	m_get_evpid(m, &evpid);
+	m_get_id(m, &session);
+	m_get_time(m, &creation);
+	m_get_timeval(m, &tv);
+	m_get_size(m, &size);
+	len = 40;
+	for (i = 0; i < DLOG_NSTRINGS; i++) {
+		m_get_string(m, &str[i]);
+		slen[i] = strlen(str[i]);
+		if (slen[i] > UINT16_MAX)
+			slen[i] = UINT16_MAX;
+		len += 2 + slen[i];
+	}
+
+	if (dlogout.fd == -1)
+		return;
+	if (len > sizeof(rec)) {
+		log_warnx("warn: logger: delivery record too large for "
+		    "evpid %016" PRIx64, evpid);
+		return;
+	}
+
+	p = rec;
+	u32 = htobe32(len);
+	memmove(p, &u32, 4);
+	p[4] = type;
+	p[5] = result;
+	p[6] = p[7] = 0;
+	u64 = htobe64((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+	memmove(p + 8, &u64, 8);
+	u64 = htobe64(evpid);
+	memmove(p + 16, &u64, 8);
+	u64 = htobe64(session);
+	memmove(p + 24, &u64, 8);
+	u32 = htobe32(tv.tv_sec > creation ? tv.tv_sec - creation : 0);
+	memmove(p + 32, &u32, 4);
+	u32 = htobe32(size > UINT32_MAX ? UINT32_MAX : size);
+	memmove(p + 36, &u32, 4);
+	p += 40;
+	for (i = 0; i < DLOG_NSTRINGS; i++) {
+		u16 = htobe16(slen[i]);
+		memmove(p, &u16, 2);
+		memmove(p + 2, str[i], slen[i]);
+		p += 2 + slen[i];
+	}
+
+	logger_append(&dlogout, rec, len);
+}
+
+static void
+logger_dlog_reopen(int fd)
+{
+	struct stat	 sb;
+	uint32_t	 version;
+
+	if (fd == -1)
+		fatalx("logger: no delivery log fd");
+
+	if (dlogout.fd != -1) {
+		logger_output_flush(&dlogout);
+		close(dlogout.fd);
+	}
+	dlogout.fd = fd;
+
+	if (fstat(fd, &sb) == -1)
+		fatal("logger: fstat");
+	if (sb.st_size == 0) {
+		version = htobe32(DLOG_VERSION);
+		logger_append(&dlogout, DLOG_MAGIC, 8);
+		logger_append(&dlogout, &version, sizeof(version));
+	}
+}
+
+static void
+logger_append(struct logger_output *out, const void *data, size_t len)
+{
+	struct timeval	 tv;
+
+	if (out->len + len > sizeof(out->buf))
+		logger_output_flush(out);
+	memmove(out->buf + out->len, data, len);
+	out->len += len;
+
+	/* everything read in this loop iteration goes in a single write */
+	if (!evtimer_pending(&ev_flush, NULL)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_flush, &tv);
+	}
+}
+
+static void
+logger_output_flush(struct logger_output *out)
+{
+	size_t	 off;
+	ssize_t	 n;
+
+	for (off = 0; off < out->len; off += n) {
+		if ((n = write(out->fd, out->buf + off, out->len - off))
+		    == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			log_warn("warn: logger: write");
+			break;
+		}
+	}
+	out->len = 0;
+}
+
+static void
+logger_flush(int fd, short event, void *arg)
+{
+	logger_output_flush(&textout);
+	logger_output_flush(&dlogout);
+}
+
+/*
+ * Runs in the parent, which opens the delivery log for the logger, and
+ * renames it to carry the time of the rotation once the period is over.
+ * Rotations are aligned on multiples of the period.
+ */
+void
+logger_dlog_start(void)
+{
+	evtimer_set(&ev_rotate, logger_dlog_rotate, NULL);
+	logger_dlog_rotate(-1, 0, NULL);
+}
+
+static void
+logger_dlog_rotate(int fd, short event, void *arg)
+{
+	char		 path[PATH_MAX], ts[32];
+	struct timeval	 tv;
+	struct tm	*tm;
+	time_t		 now;
+
+	now = time(NULL);
+
+	/* not on startup, the current file is still in use */
+	if (event == EV_TIMEOUT) {
+		if ((tm = localtime(&now)) == NULL ||
+		    strftime(ts, sizeof(ts), "%Y%m%d%H%M%S", tm) == 0)
+			fatalx("logger_dlog_rotate: bad time");
+		if (!bsnprintf(path, sizeof(path), "%s.%s",
+		    env->sc_dlog_path, ts))
+			fatalx("logger_dlog_rotate: path too long");
+		if (rename(env->sc_dlog_path, path) == -1 && errno != ENOENT)
+			log_warn("warn: delivery log: rename %s",
+			    env->sc_dlog_path);
+	}
+
+	if ((fd = open(env->sc_dlog_path, O_WRONLY|O_APPEND|O_CREAT, 0640))
+	    == -1)
+		log_warn("warn: delivery log: %s", env->sc_dlog_path);
+	else
+		m_compose(p_logger, IMSG_LOG_ROTATE, 0, 0, fd, NULL, 0);
+
+	tv.tv_sec = env->sc_dlog_rotate - now % env->sc_dlog_rotate;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_rotate, &tv);
+}
+
+void
+logger_client(void)
+{
+	clientpid = getpid();
+	log_setwriter(logger_write);
+}
+
+void
+logger_client_done(void)
+{
+	log_setwriter(NULL);
+	(void)imsg_flush(&p_logger->imsgbuf);
+}
+
+static int
+logger_write(int pri, const char *line)
+{
+	char	 buf[64];
+
+	/* forked helpers, fatal errors, and records logged while sending one */
+	if (getpid() != clientpid || inlog || LOG_PRI(pri) <= LOG_CRIT)
+		return (-1);
+
+	if (p_logger->imsgbuf.w.queued >= LOGGER_MAXQUEUED) {
+		dropped++;
+		return (0);
+	}
+
+	inlog = 1;
+	if (dropped) {
+		(void)snprintf(buf, sizeof(buf),
+		    "warn: logger: %zu records dropped", dropped);
+		logger_send(LOG_WARNING, buf);
+		dropped = 0;
+	}
+	logger_send(pri, line);
+	inlog = 0;
+
+	/* a process may _exit() right after a warning: do not leave it queued */
+	if (LOG_PRI(pri) <= LOG_WARNING)
+		(void)imsg_flush(&p_logger->imsgbuf);
+
+	return (0);
+}
+
+void
+logger_delivery(const struct dlog *d)
+{
+	static size_t	 ddropped;
+	struct timeval	 tv;
+	const char	*str[DLOG_NSTRINGS];
+	int		 i;
+
+	if (p_logger == NULL || env->sc_dlog_path == NULL)
+		return;
+
+	if (p_logger->imsgbuf.w.queued >= LOGGER_MAXQUEUED) {
+		ddropped++;
+		return;
+	}
+	if (ddropped) {
+		log_warnx("warn: delivery log: %zu records dropped", ddropped);
+		ddropped = 0;
+	}
+
+	str[0] = d->sender;
+	str[1] = d->rcpt;
+	str[2] = d->orcpt;
+	str[3] = d->relay;
+	str[4] = d->source;
+	str[5] = d->user;
+	str[6] = d->tls;
+	str[7] = d->status;
+
+	gettimeofday(&tv, NULL);
+	m_create(p_logger, IMSG_LOG_DELIVERY, 0, 0, -1);
+	m_add_int(p_logger, d->type);
+	m_add_int(p_logger, d->result);
+	m_add_evpid(p_logger, d->evpid);
+	m_add_id(p_logger, d->session);
+	m_add_time(p_logger, d->creation);
+	m_add_timeval(p_logger, &tv);
+	m_add_size(p_logger, d->size);
+	for (i = 0; i < DLOG_NSTRINGS; i++)
+		m_add_string(p_logger, str[i] ? str[i] : "");
+	m_close(p_logger);
+}
+
+static void
+logger_send(int pri, const char *line)
+{
+	m_create(p_logger, IMSG_LOG, 0, clientpid, -1);
+	m_add_int(p_logger, LOG_PRI(pri));
+	m_add_time(p_logger, time(NULL));
+	m_add_string(p_logger, line);
+	m_close(p_logger);
+}
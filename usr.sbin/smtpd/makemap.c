@@ -56,6 +56,8 @@
 
 static void	 usage(void);
 static int	 parse_map(DB *, int *, char *);
+static int	 parse_compiled(int, int *, char *);
+static FILE	*open_map(char *);
 static int	 add_mapentry(DB *, int *, char *, char *, size_t);
 static int	 add_setentry(DB *, int *, char *, size_t);
 static int	 make_plain(DBT *, char *);
@@ -90,7 +92,7 @@ makemap(int prog_mode, int argc, char *argv[])
 	DB		*db;
 	const char	*opts;
 	char		*conf, *oflag = NULL;
-	int		 ch, dbputs = 0, Uflag = 0;
+	int		 ch, dbputs = 0, Uflag = 0, compiled = 0;
 	DBTYPE		 dbtype = DB_HASH;
 	char		*p;
 	gid_t		 gid;
@@ -125,6 +127,8 @@ makemap(int prog_mode, int argc, char *argv[])
 				dbtype = DB_HASH;
 			else if (strcmp(optarg, "btree") == 0)
 				dbtype = DB_BTREE;
+			else if (strcmp(optarg, "compiled") == 0)
+				compiled = 1;
 			else
 				errx(1, "unsupported DB type '%s'", optarg);
 			break;
@@ -195,8 +199,11 @@ makemap(int prog_mode, int argc, char *argv[])
 		source = argv[0];
 	}
 
-	if (Uflag)
+	if (Uflag) {
+		if (compiled)
+			errx(1, "cannot dump a compiled table");
 		return dump_db(source, dbtype);
+	}
 
 	if (oflag == NULL && asprintf(&oflag, "%s.db", source) == -1)
 		err(1, "asprintf");
@@ -210,6 +217,19 @@ makemap(int prog_mode, int argc, char *argv[])
 	if ((fd = mkstemp(dbname)) == -1)
 		err(1, "mkstemp");
 
+	if (compiled) {
+		if (strcmp(source, "-") != 0)
+			if (fchmod(fd, sb.st_mode) == -1 ||
+			    fchown(fd, sb.st_uid, sb.st_gid) == -1) {
+				warn("couldn't carry ownership and perms to %s",
+				    dbname);
+				goto bad;
+			}
+		if (!parse_compiled(fd, &dbputs, source))
+			goto bad;
+		goto done;
+	}
+
 	db = dbopen(dbname, O_TRUNC|O_RDWR, 0644, dbtype, NULL);
 	if (db == NULL) {
 		warn("dbopen: %s", dbname);
@@ -232,6 +252,7 @@ makemap(int prog_mode, int argc, char *argv[])
 		goto bad;
 	}
 
+done:
 	/* force to disk before renaming over an existing file */
 	if (fsync(fd) == -1) {
 		warn("fsync: %s", dbname);
@@ -262,14 +283,10 @@ bad:
 	return 1;
 }
 
-static int
-parse_map(DB *db, int *dbputs, char *filename)
+static FILE *
+open_map(char *filename)
 {
 	FILE	*fp;
-	char	*key, *val, *line = NULL;
-	size_t	 linesize = 0;
-	size_t	 lineno = 0;
-	int	 malformed, table_type, r;
 
 	if (strcmp(filename, "-") == 0)
 		fp = fdopen(0, "r");
@@ -277,7 +294,7 @@ parse_map(DB *db, int *dbputs, char *filename)
 		fp = fopen(filename, "r");
 	if (fp == NULL) {
 		warn("%s", filename);
-		return 0;
+		return NULL;
 	}
 
 	if (!isatty(fileno(fp)) && flock(fileno(fp), LOCK_SH|LOCK_NB) == -1) {
@@ -286,9 +303,43 @@ parse_map(DB *db, int *dbputs, char *filename)
 		else
 			warn("%s: flock", filename);
 		fclose(fp);
-		return 0;
+		return NULL;
 	}
 
+	return fp;
+}
+
+static int
+parse_compiled(int fd, int *dbputs, char *filename)
+{
+	FILE	*fp;
+	int	 r;
+
+	if ((fp = open_map(filename)) == NULL)
+		return 0;
+
+	r = table_compiled_write(fp, source, fd,
+	    (type == T_SET) ? T_LIST : T_HASH);
+	fclose(fp);
+	if (r == -1)
+		return 0;
+
+	*dbputs = r;
+	return 1;
+}
+
+static int
+parse_map(DB *db, int *dbputs, char *filename)
+{
+	FILE	*fp;
+	char	*key, *val, *line = NULL;
+	size_t	 linesize = 0;
+	size_t	 lineno = 0;
+	int	 malformed, table_type, r;
+
+	if ((fp = open_map(filename)) == NULL)
+		return 0;
+
 	table_type = (type == T_SET) ? T_LIST : T_HASH;
 	while (parse_table_line(fp, &line, &linesize, &table_type,
 	    &key, &val, &malformed) != -1) {
@@ -25,13 +25,18 @@
 #include <sys/queue.h>
 #include <sys/tree.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
+#include <netinet/in.h>
+
+#include <asr.h>
 #include <ctype.h>
 #include <errno.h>
 #include <event.h>
 #include <grp.h> /* needed for setgroups */
 #include <imsg.h>
 #include <inttypes.h>
+#include <netdb.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
@@ -49,6 +54,67 @@
 
 #define MDA_HIWAT		65536
 
+/*
+ * The Delivered-To headers of recently delivered messages, so that the
+ * loop check for each recipient does not read the headers again.
+ */
+#define MDA_LOOP_CACHE_MAX	256
+
+/*
+ * Successful deliveries are reported to the queue once the current
+ * event is processed, in one message for the envelopes of a message.
+ */
+#define MDA_OK_BATCH_MAX	256
+
+struct mda_loopinfo {
+	TAILQ_ENTRY(mda_loopinfo)	 entry;
+	uint32_t			 msgid;
+	struct dict			 rcpts;
+};
+
+/*
+ * Sessions of a user are spread over the destinations it delivers to,
+ * so that one slow mailbox of a virtual user does not hold all of its
+ * sessions: the next envelope is taken for the destination with the
+ * fewest sessions, up to sc_mda_max_dest_session each.
+ */
+struct mda_dest {
+	char			*name;
+	size_t			 running;
+};
+
+/*
+ * Deliveries to an lmtp action are made in-process instead of forking
+ * mail.lmtp for each envelope.  Connections are kept per destination,
+ * up to MDA_LMTP_MAXCONN, and stay open MDA_LMTP_IDLE seconds after
+ * their last transaction.  A transaction carries up to MDA_LMTP_MAXRCPT
+ * recipients of the same message.
+ */
+/*
+ * Envelopes of a message that resolve to the same mbox or maildir
+ * delivery are handed to a single mda process, up to MDA_GROUP_MAX.
+ * With single-instance, envelopes of a message going to different
+ * maildirs of the same user are grouped too, and the recipients that
+ * the mda process needs to know about must fit in the fork request.
+ */
+#define MDA_GROUP_MAX		100
+#define MDA_GROUP_TARGETS	(MAX_IMSGSIZE - IMSG_HEADER_SIZE - \
+				    sizeof(struct deliver) - 64)
+
+/*
+ * Deliveries to the mbox of a user without a wrapper are done by the
+ * mda process itself, which appends other pending messages for the
+ * same mbox in the same run, up to MDA_MBOX_BATCH.  They are opened
+ * before the fork and streamed one after the other.
+ */
+#define MDA_MBOX_BATCH		16
+
+#define MDA_LMTP_MAXCONN	8
+#define MDA_LMTP_MAXRCPT	50
+#define MDA_LMTP_MAXADDR	4
+#define MDA_LMTP_IDLE		30
+#define MDA_LMTP_TIMEOUT	300
+
 struct mda_envelope {
 	TAILQ_ENTRY(mda_envelope)	 entry;
 	uint64_t			 session_id;
@@ -61,6 +127,7 @@ struct mda_envelope {
 	char				*dispatcher;
 	char				*mda_subaddress;
 	char				*mda_exec;
+	char				*lmtp_rcpt;
 };
 
 #define USER_WAITINFO	0x01
@@ -78,19 +145,117 @@ struct mda_user {
 	TAILQ_HEAD(, mda_envelope)	envelopes;
 	int				flags;
 	size_t				running;
+	struct dict			dests;
 	struct userinfo			userinfo;
 };
 
+TAILQ_HEAD(mda_evplist, mda_envelope);
+
+/* another message appended to the mbox by the session */
+struct mda_part {
+	TAILQ_ENTRY(mda_part)	 entry;
+	struct mda_envelope	*evp;
+	struct mda_evplist	 group;
+	size_t			 ngroup;
+	FILE			*datafp;
+	char			*hdr;
+	size_t			 size;
+};
+
 struct mda_session {
 	uint64_t		 id;
 	struct mda_user		*user;
+	struct mda_dest		*dest;
 	struct mda_envelope	*evp;
+	struct mda_evplist	 group;
+	size_t			 ngroup;
+	TAILQ_HEAD(, mda_part)	 parts;
+	struct mda_part		*part;
+	size_t			 size;
 	struct io		*io;
 	FILE			*datafp;
+	struct timespec		 t_start;
+};
+
+enum lmtp_state {
+	LMTP_CONNECT,
+	LMTP_BANNER,
+	LMTP_LHLO,
+	LMTP_READY,
+	LMTP_OPEN,
+	LMTP_MAIL,
+	LMTP_RCPT,
+	LMTP_DATA,
+	LMTP_BODY,
+	LMTP_EOM,
+	LMTP_RSET,
+};
+
+struct mda_lmtp_dest {
+	char				*name;
+	char				*dispatcher;
+	TAILQ_HEAD(, mda_envelope)	 envelopes;
+	TAILQ_HEAD(, mda_lmtp_conn)	 conns;
+	size_t				 nconn;
+	int				 resolving;
+	struct sockaddr_storage		 addr[MDA_LMTP_MAXADDR];
+	size_t				 naddr;
 };
 
+struct mda_lmtp_conn {
+	TAILQ_ENTRY(mda_lmtp_conn)	 entry;
+	uint64_t			 id;
+	struct mda_lmtp_dest		*dest;
+	struct io			*io;
+	enum lmtp_state			 state;
+	size_t				 addr;
+	TAILQ_HEAD(, mda_envelope)	 envelopes;
+	struct mda_envelope		*curr;
+	size_t				 naccepted;
+	FILE				*datafp;
+	int				 databol;
+};
+
+static int mda_lmtp_enqueue(struct mda_user *);
+static struct mda_lmtp_dest *mda_lmtp_dest(struct dispatcher *, const char *);
+static void mda_lmtp_drain(struct mda_lmtp_dest *);
+static void mda_lmtp_connect(struct mda_lmtp_dest *);
+static void mda_lmtp_connect_inet(struct mda_lmtp_conn *);
+static void mda_lmtp_getaddrinfo_cb(void *, int, struct addrinfo *);
+static void mda_lmtp_start(struct mda_lmtp_conn *);
+static void mda_lmtp_on_fd(struct mda_lmtp_conn *, int, const void *, size_t);
+static void mda_lmtp_io(struct io *, int, void *);
+static int mda_lmtp_response(struct mda_lmtp_conn *, const char *);
+static int mda_lmtp_body(struct mda_lmtp_conn *);
+static void mda_lmtp_ready(struct mda_lmtp_conn *);
+static void mda_lmtp_result(struct mda_envelope *, const char *);
+static void mda_lmtp_fail(struct mda_lmtp_conn *, const char *);
+static void mda_lmtp_free(struct mda_lmtp_conn *);
+
+static void mda_deliver_init(struct deliver *, struct mda_user *,
+    struct mda_envelope *);
+static int mda_delivery_key(struct mda_user *, struct mda_envelope *,
+    char *, size_t);
+static void mda_group(struct mda_session *);
+static int mda_is_mbox(struct mda_envelope *);
+static void mda_batch(struct mda_session *);
+static void mda_part_open(struct mda_session *, int, const void *, size_t);
+static void mda_part_free(struct mda_part *);
+static int mda_filter_loops(FILE *, const void *, size_t,
+    struct mda_envelope **, struct mda_evplist *, size_t *);
+static void mda_fork(struct mda_session *);
+static void mda_result(struct mda_session *, enum mda_resp_status,
+    const char *, const char *);
+static void mda_result_envelope(struct mda_envelope *, enum mda_resp_status,
+    const char *, const char *);
+
 static void mda_io(struct io *, int, void *);
-static int mda_check_loop(FILE *, struct mda_envelope *);
+static int mda_check_loop(FILE *, const void *, size_t,
+    struct mda_envelope *);
+static struct mda_loopinfo *mda_loopinfo(FILE *, const void *, size_t,
+    uint32_t);
+static void mda_loopinfo_index(struct mda_loopinfo *, FILE *, const void *,
+    size_t);
 static int mda_getlastline(int, char *, size_t);
 static void mda_done(struct mda_session *);
 static void mda_fail(struct mda_user *, int, const char *,
@@ -98,6 +263,7 @@ static void mda_fail(struct mda_user *, int, const char *,
 static void mda_drain(void);
 static void mda_log(const struct mda_envelope *, const char *, const char *);
 static void mda_queue_ok(uint64_t);
+static void mda_queue_ok_flush(int, short, void *);
 static void mda_queue_tempfail(uint64_t, const char *,
     enum enhanced_status_code);
 static void mda_queue_permfail(uint64_t, const char *, enum enhanced_status_code);
@@ -107,22 +273,33 @@ static void mda_user_free(struct mda_user *);
 static const char *mda_user_to_text(const struct mda_user *);
 static struct mda_envelope *mda_envelope(uint64_t, const struct envelope *);
 static void mda_envelope_free(struct mda_envelope *);
-static struct mda_session * mda_session(struct mda_user *);
+static struct mda_session * mda_session(struct mda_user *,
+    struct mda_envelope *);
+static struct mda_envelope *mda_next_envelope(struct mda_user *);
 static const char *mda_sysexit_to_str(int);
 
 static struct tree	sessions;
 static struct tree	users;
+static struct tree	lmtp_conns;
+static struct dict	lmtp_dests;
 
 static TAILQ_HEAD(, mda_user)	runnable;
+static struct tree		loopinfos;
+static uint64_t			ok_batch[MDA_OK_BATCH_MAX];
+static size_t			ok_nbatch;
+static struct event		ok_ev;
+static TAILQ_HEAD(mda_loopinfo_lru, mda_loopinfo) loopinfo_lru;
 
 void
 mda_imsg(struct mproc *p, struct imsg *imsg)
 {
 	struct mda_session	*s;
+	struct mda_lmtp_conn	*c;
+	struct mda_part		*pt;
 	struct mda_user		*u;
 	struct mda_envelope	*e;
 	struct envelope		 evp;
-	struct deliver		 deliver;
+	struct stat		 sb;
 	struct msg		 m;
 	const void		*data;
 	const char		*error, *parent_error, *syserror;
@@ -207,18 +384,26 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 	case IMSG_MDA_OPEN_MESSAGE:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
+		m_get_data(&m, &data, &sz);
 		m_end(&m);
 
+		if ((c = tree_get(&lmtp_conns, reqid)) != NULL) {
+			mda_lmtp_on_fd(c, imsg_get_fd(imsg), data, sz);
+			return;
+		}
+
 		s = tree_xget(&sessions, reqid);
+		if (s->part) {
+			mda_part_open(s, imsg_get_fd(imsg), data, sz);
+			return;
+		}
 		e = s->evp;
 
 		fd = imsg_get_fd(imsg);
 		if (fd == -1) {
 			log_debug("debug: mda: cannot get message fd");
-			mda_queue_tempfail(e->id,
-			    "Cannot get message fd",
-			    ESC_OTHER_MAIL_SYSTEM_STATUS);
-			mda_log(e, "TempFail", "Cannot get message fd");
+			mda_result(s, MDA_TEMPFAIL, "Cannot get message fd",
+			    "Cannot get message fd");
 			mda_done(s);
 			return;
 		}
@@ -227,24 +412,44 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 		    "for session %016"PRIx64 " evpid %016"PRIx64,
 		    fd, s->id, e->id);
 
+		fadvise_sequential(fd);
 		if ((s->datafp = fdopen(fd, "r")) == NULL) {
 			log_warn("warn: mda: fdopen");
 			close(fd);
-			mda_queue_tempfail(e->id, "fdopen failed",
-			    ESC_OTHER_MAIL_SYSTEM_STATUS);
-			mda_log(e, "TempFail", "fdopen failed");
+			mda_result(s, MDA_TEMPFAIL, "fdopen failed",
+			    "fdopen failed");
 			mda_done(s);
 			return;
 		}
 
 		/* check delivery loop */
-		if (mda_check_loop(s->datafp, e)) {
-			log_debug("debug: mda: loop detected");
-			mda_queue_loop(e->id);
-			mda_log(e, "PermFail", "Loop detected");
-			mda_done(s);
+		if (!mda_filter_loops(s->datafp, data, sz, &s->evp, &s->group,
+		    &s->ngroup)) {
+			if ((pt = TAILQ_FIRST(&s->parts)) == NULL) {
+				mda_done(s);
+				return;
+			}
+			/* start with the next message of the batch instead */
+			TAILQ_REMOVE(&s->parts, pt, entry);
+			fclose(s->datafp);
+			s->datafp = NULL;
+			mda_envelope_free(s->evp);
+			stat_decrement("mda.running", 1);
+			s->evp = pt->evp;
+			while ((e = TAILQ_FIRST(&pt->group))) {
+				TAILQ_REMOVE(&pt->group, e, entry);
+				TAILQ_INSERT_TAIL(&s->group, e, entry);
+			}
+			s->ngroup = pt->ngroup;
+			free(pt);
+
+			m_create(p_queue, IMSG_MDA_OPEN_MESSAGE, 0, 0, -1);
+			m_add_id(p_queue, s->id);
+			m_add_msgid(p_queue, evpid_to_msgid(s->evp->id));
+			m_close(p_queue);
 			return;
 		}
+		e = s->evp;
 
 		/* start queueing delivery headers */
 		if (e->sender[0])
@@ -264,33 +469,31 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 		if (n == -1) {
 			log_warn("warn: mda: "
 			    "fail to write delivery info");
-			mda_queue_tempfail(e->id, "Out of memory",
-			    ESC_OTHER_MAIL_SYSTEM_STATUS);
-			mda_log(e, "TempFail", "Out of memory");
+			mda_result(s, MDA_TEMPFAIL, "Out of memory",
+			    "Out of memory");
 			mda_done(s);
 			return;
 		}
 
-		/* request parent to fork a helper process */
-		memset(&deliver, 0, sizeof deliver);
-		(void)text_to_mailaddr(&deliver.sender, s->evp->sender);
-		(void)text_to_mailaddr(&deliver.rcpt, s->evp->rcpt);
-		(void)text_to_mailaddr(&deliver.dest, s->evp->dest);
-		if (s->evp->mda_exec)
-			(void)strlcpy(deliver.mda_exec, s->evp->mda_exec, sizeof deliver.mda_exec);
-		if (s->evp->mda_subaddress)
-			(void)strlcpy(deliver.mda_subaddress, s->evp->mda_subaddress, sizeof deliver.mda_subaddress);
-		(void)strlcpy(deliver.dispatcher, s->evp->dispatcher, sizeof deliver.dispatcher);
-		deliver.userinfo = s->user->userinfo;
+		if (fstat(fileno(s->datafp), &sb) == -1) {
+			log_warn("warn: mda: fstat");
+			mda_result(s, MDA_TEMPFAIL, "fstat failed",
+			    "fstat failed");
+			mda_done(s);
+			return;
+		}
+		s->size = n + sb.st_size;
 
-		log_debug("debug: mda: querying mda fd "
-		    "for session %016"PRIx64 " evpid %016"PRIx64,
-		    s->id, s->evp->id);
+		/* the other messages of the batch are opened first */
+		if ((s->part = TAILQ_FIRST(&s->parts)) != NULL) {
+			m_create(p_queue, IMSG_MDA_OPEN_MESSAGE, 0, 0, -1);
+			m_add_id(p_queue, s->id);
+			m_add_msgid(p_queue, evpid_to_msgid(s->part->evp->id));
+			m_close(p_queue);
+			return;
+		}
 
-		m_create(p_parent, IMSG_MDA_FORK, 0, 0, -1);
-		m_add_id(p_parent, reqid);
-		m_add_data(p_parent, &deliver, sizeof(deliver));
-		m_close(p_parent);
+		mda_fork(s);
 		return;
 
 	case IMSG_MDA_FORK:
@@ -299,13 +502,11 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 		m_end(&m);
 
 		s = tree_xget(&sessions, reqid);
-		e = s->evp;
 		fd = imsg_get_fd(imsg);
 		if (fd == -1) {
 			log_warn("warn: mda: fail to retrieve mda fd");
-			mda_queue_tempfail(e->id, "Cannot get mda fd",
-			    ESC_OTHER_MAIL_SYSTEM_STATUS);
-			mda_log(e, "TempFail", "Cannot get mda fd");
+			mda_result(s, MDA_TEMPFAIL, "Cannot get mda fd",
+			    "Cannot get mda fd");
 			mda_done(s);
 			return;
 		}
@@ -319,6 +520,25 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 		io_set_write(s->io);
 		return;
 
+	case IMSG_MDA_LMTP_CONNECT:
+		m_msg(&m, imsg);
+		m_get_id(&m, &reqid);
+		m_get_string(&m, &error);
+		m_end(&m);
+
+		c = tree_xget(&lmtp_conns, reqid);
+		fd = imsg_get_fd(imsg);
+		if (fd == -1) {
+			(void)snprintf(buf, sizeof buf, "connect: %s", error);
+			mda_lmtp_fail(c, buf);
+			return;
+		}
+		io_set_nonblocking(fd);
+		io_set_fd(c->io, fd);
+		io_set_read(c->io);
+		c->state = LMTP_BANNER;
+		return;
+
 	case IMSG_MDA_DONE:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
@@ -328,7 +548,8 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 		m_end(&m);
 
 		s = tree_xget(&sessions, reqid);
-		e = s->evp;
+		stat_latency("mda.latency.delivery", &s->t_start);
+
 		/*
 		 * Grab last line of mda stdout/stderr if available.
 		 */
@@ -344,7 +565,8 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 		 */
 		error = NULL;
 		if (mda_status == MDA_OK) {
-			if (s->datafp || (s->io && io_queued(s->io))) {
+			if (s->datafp || s->part ||
+			    (s->io && io_queued(s->io))) {
 				error = "mda exited prematurely";
 				mda_status = MDA_TEMPFAIL;
 			}
@@ -355,33 +577,16 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 		if (mda_sysexit)
 			syserror = mda_sysexit_to_str(mda_sysexit);
 		
-		/* update queue entry */
-		switch (mda_status) {
-		case MDA_TEMPFAIL:
-			mda_queue_tempfail(e->id, error,
-			    ESC_OTHER_MAIL_SYSTEM_STATUS);
-			(void)snprintf(buf, sizeof buf,
-			    "Error (%s%s%s)",
-				       syserror ? syserror : "",
-				       syserror ? ": " : "",
-				       error);
-			mda_log(e, "TempFail", buf);
-			break;
-		case MDA_PERMFAIL:
-			mda_queue_permfail(e->id, error,
-			    ESC_OTHER_MAIL_SYSTEM_STATUS);
+		/* update queue entries */
+		if (mda_status == MDA_OK)
+			(void)strlcpy(buf, "Delivered", sizeof buf);
+		else
 			(void)snprintf(buf, sizeof buf,
 			    "Error (%s%s%s)",
 				       syserror ? syserror : "",
 				       syserror ? ": " : "",
 				       error);
-			mda_log(e, "PermFail", buf);
-			break;
-		case MDA_OK:
-			mda_queue_ok(e->id);
-			mda_log(e, "Ok", "Delivered");
-			break;
-		}
+		mda_result(s, mda_status, error, buf);
 		mda_done(s);
 		return;
 	}
@@ -399,16 +604,21 @@ mda_postprivdrop(void)
 {
 	tree_init(&sessions);
 	tree_init(&users);
+	tree_init(&lmtp_conns);
+	dict_init(&lmtp_dests);
 	TAILQ_INIT(&runnable);
+	tree_init(&loopinfos);
+	TAILQ_INIT(&loopinfo_lru);
+	evtimer_set(&ok_ev, mda_queue_ok_flush, NULL);
 }
 
 static void
 mda_io(struct io *io, int evt, void *arg)
 {
 	struct mda_session	*s = arg;
-	char			*ln = NULL;
-	size_t			 sz = 0;
-	ssize_t			 len;
+	struct mda_part		*pt;
+	char			 buf[MDA_HIWAT];
+	size_t			 len;
 
 	log_trace(TRACE_IO, "mda: %p: %s %s", s, io_strevent(evt),
 	    io_strio(io));
@@ -427,30 +637,29 @@ mda_io(struct io *io, int evt, void *arg)
 			return;
 		}
 
+		/* The content file is passed through as is. */
 		while (io_queued(s->io) < MDA_HIWAT) {
-			if ((len = getline(&ln, &sz, s->datafp)) == -1)
+			if ((len = fread(buf, 1, sizeof(buf),
+			    s->datafp)) == 0)
 				break;
-			if (io_write(s->io, ln, len) == -1) {
-				m_create(p_parent, IMSG_MDA_KILL,
+			if (io_write(s->io, buf, len) == -1) {
+				m_create(p_launcher, IMSG_MDA_KILL,
 				    0, 0, -1);
-				m_add_id(p_parent, s->id);
-				m_add_string(p_parent, "Out of memory");
-				m_close(p_parent);
+				m_add_id(p_launcher, s->id);
+				m_add_string(p_launcher, "Out of memory");
+				m_close(p_launcher);
 				io_pause(io, IO_OUT);
-				free(ln);
 				return;
 			}
 		}
 
-		free(ln);
-		ln = NULL;
 		if (ferror(s->datafp)) {
 			log_debug("debug: mda: ferror on session %016"PRIx64,
 			    s->id);
-			m_create(p_parent, IMSG_MDA_KILL, 0, 0, -1);
-			m_add_id(p_parent, s->id);
-			m_add_string(p_parent, "Error reading body");
-			m_close(p_parent);
+			m_create(p_launcher, IMSG_MDA_KILL, 0, 0, -1);
+			m_add_id(p_launcher, s->id);
+			m_add_string(p_launcher, "Error reading body");
+			m_close(p_launcher);
 			io_pause(io, IO_OUT);
 			return;
 		}
@@ -459,8 +668,28 @@ mda_io(struct io *io, int evt, void *arg)
 			log_debug("debug: mda: end-of-file for session"
 			    " %016"PRIx64 " evpid %016"PRIx64,
 			    s->id, s->evp->id);
+			fadvise_dontneed(fileno(s->datafp));
 			fclose(s->datafp);
 			s->datafp = NULL;
+
+			/* go on with the next message of the batch */
+			if ((pt = s->part) != NULL) {
+				s->part = TAILQ_NEXT(pt, entry);
+				s->datafp = pt->datafp;
+				pt->datafp = NULL;
+				if (io_write(s->io, pt->hdr,
+				    strlen(pt->hdr)) == -1) {
+					m_create(p_launcher, IMSG_MDA_KILL,
+					    0, 0, -1);
+					m_add_id(p_launcher, s->id);
+					m_add_string(p_launcher,
+					    "Out of memory");
+					m_close(p_launcher);
+					io_pause(io, IO_OUT);
+					return;
+				}
+				goto done;
+			}
 			if (io_queued(s->io) == 0)
 				goto done;
 		}
@@ -492,12 +721,98 @@ mda_io(struct io *io, int evt, void *arg)
 }
 
 static int
-mda_check_loop(FILE *fp, struct mda_envelope *e)
+mda_check_loop(FILE *fp, const void *idx, size_t idxlen,
+    struct mda_envelope *e)
+{
+	struct mda_loopinfo	*li;
+	char			 dest[LINE_MAX];
+
+	li = mda_loopinfo(fp, idx, idxlen, evpid_to_msgid(e->id));
+	if (!lowercase(dest, e->dest, sizeof dest))
+		return (0);
+	return (dict_check(&li->rcpts, dest));
+}
+
+/*
+ * Drop the envelopes whose recipient already is in the Delivered-To
+ * headers of the message.  Returns 0 if none is left, the last one
+ * being kept in evp for the caller to release.
+ */
+static int
+mda_filter_loops(FILE *fp, const void *idx, size_t idxlen,
+    struct mda_envelope **evp, struct mda_evplist *group, size_t *ngroup)
 {
-	char		*buf = NULL;
-	size_t		 sz = 0;
-	ssize_t		 len;
-	int		 ret = 0;
+	struct mda_envelope	*e, *enext;
+
+	TAILQ_FOREACH_SAFE(e, group, entry, enext) {
+		if (!mda_check_loop(fp, idx, idxlen, e))
+			continue;
+		log_debug("debug: mda: loop detected");
+		mda_queue_loop(e->id);
+		mda_log(e, "PermFail", "Loop detected");
+		TAILQ_REMOVE(group, e, entry);
+		(*ngroup)--;
+		mda_envelope_free(e);
+		stat_decrement("mda.running", 1);
+	}
+	if (!mda_check_loop(fp, idx, idxlen, *evp))
+		return (1);
+
+	log_debug("debug: mda: loop detected");
+	mda_queue_loop((*evp)->id);
+	mda_log(*evp, "PermFail", "Loop detected");
+	if ((e = TAILQ_FIRST(group)) == NULL)
+		return (0);
+
+	/* deliver for the next recipient instead */
+	TAILQ_REMOVE(group, e, entry);
+	(*ngroup)--;
+	mda_envelope_free(*evp);
+	stat_decrement("mda.running", 1);
+	*evp = e;
+	return (1);
+}
+
+/*
+ * Return the Delivered-To recipients of the message, reading its
+ * headers from fp unless they were seen already.  With a header index,
+ * only the Delivered-To headers are read.
+ */
+static struct mda_loopinfo *
+mda_loopinfo(FILE *fp, const void *idx, size_t idxlen, uint32_t msgid)
+{
+	struct mda_loopinfo	*li;
+	char			*buf = NULL, value[LINE_MAX];
+	size_t			 sz = 0;
+	ssize_t			 len;
+
+	if ((li = tree_get(&loopinfos, msgid)) != NULL) {
+		stat_increment("mda.loop.cache.hit", 1);
+		TAILQ_REMOVE(&loopinfo_lru, li, entry);
+		TAILQ_INSERT_HEAD(&loopinfo_lru, li, entry);
+		return (li);
+	}
+	stat_increment("mda.loop.cache.miss", 1);
+
+	if (tree_count(&loopinfos) >= MDA_LOOP_CACHE_MAX) {
+		li = TAILQ_LAST(&loopinfo_lru, mda_loopinfo_lru);
+		TAILQ_REMOVE(&loopinfo_lru, li, entry);
+		tree_xpop(&loopinfos, li->msgid);
+		while (dict_poproot(&li->rcpts, NULL))
+			;
+		free(li);
+	}
+
+	li = xcalloc(1, sizeof *li);
+	li->msgid = msgid;
+	dict_init(&li->rcpts);
+	tree_xset(&loopinfos, msgid, li);
+	TAILQ_INSERT_HEAD(&loopinfo_lru, li, entry);
+
+	if (idxlen) {
+		mda_loopinfo_index(li, fp, idx, idxlen);
+		return (li);
+	}
 
 	while ((len = getline(&buf, &sz, fp)) != -1) {
 		if (buf[len - 1] == '\n')
@@ -506,17 +821,44 @@ mda_check_loop(FILE *fp, struct mda_envelope *e)
 		if (strchr(buf, ':') == NULL && !isspace((unsigned char)*buf))
 			break;
 
-		if (strncasecmp("Delivered-To: ", buf, 14) == 0) {
-			if (strcasecmp(buf + 14, e->dest) == 0) {
-				ret = 1;
-				break;
-			}
-		}
+		if (strncasecmp("Delivered-To: ", buf, 14) == 0 &&
+		    lowercase(value, buf + 14, sizeof value))
+			dict_set(&li->rcpts, value, NULL);
 	}
 
 	free(buf);
-	fseek(fp, SEEK_SET, 0);
-	return (ret);
+	fseek(fp, 0, SEEK_SET);
+	return (li);
+}
+
+static void
+mda_loopinfo_index(struct mda_loopinfo *li, FILE *fp, const void *idx,
+    size_t idxlen)
+{
+	struct msgindex_hdr	 h;
+	char			 line[LINE_MAX], value[LINE_MAX], *nl;
+	size_t			 pos = 0;
+	ssize_t			 n;
+
+	stat_increment("mda.loop.index", 1);
+	while (msgindex_next(idx, idxlen, &pos, &h)) {
+		if (h.namelen != 12 || strncasecmp(h.name, "Delivered-To", 12))
+			continue;
+
+		n = pread(fileno(fp), line, MIN(h.len, sizeof line - 1),
+		    h.offset);
+		if (n == -1) {
+			log_warn("warn: mda: pread");
+			continue;
+		}
+		line[n] = '\0';
+		if ((nl = strchr(line, '\n')) != NULL)
+			*nl = '\0';
+
+		if (strncasecmp("Delivered-To: ", line, 14) == 0 &&
+		    lowercase(value, line + 14, sizeof value))
+			dict_set(&li->rcpts, value, NULL);
+	}
 }
 
 static int
@@ -582,6 +924,7 @@ static void
 mda_drain(void)
 {
 	struct mda_user		*u;
+	struct mda_envelope	*e;
 
 	while ((u = (TAILQ_FIRST(&runnable)))) {
 
@@ -601,22 +944,33 @@ mda_drain(void)
 			continue;
 		}
 
-		if (u->running >= env->sc_mda_max_user_session) {
-			log_debug("debug: mda: "
-			    "maximum number of session reached for user \"%s\"",
-			    mda_user_to_text(u));
-			u->flags &= ~USER_RUNNABLE;
-			continue;
-		}
+		if (!mda_lmtp_enqueue(u)) {
+			if (u->running >= env->sc_mda_max_user_session) {
+				log_debug("debug: mda: maximum number of "
+				    "session reached for user \"%s\"",
+				    mda_user_to_text(u));
+				u->flags &= ~USER_RUNNABLE;
+				continue;
+			}
 
-		if (tree_count(&sessions) >= env->sc_mda_max_session) {
-			log_debug("debug: mda: "
-			    "maximum number of session reached");
-			TAILQ_INSERT_HEAD(&runnable, u, entry_runnable);
-			return;
-		}
+			if (tree_count(&sessions) >= env->sc_mda_max_session) {
+				log_debug("debug: mda: "
+				    "maximum number of session reached");
+				TAILQ_INSERT_HEAD(&runnable, u, entry_runnable);
+				return;
+			}
+
+			if ((e = mda_next_envelope(u)) == NULL) {
+				log_debug("debug: mda: maximum number of "
+				    "session reached for all destinations of "
+				    "user \"%s\"", mda_user_to_text(u));
+				u->flags &= ~USER_RUNNABLE;
+				stat_increment("mda.dest.throttled", 1);
+				continue;
+			}
 
-		mda_session(u);
+			mda_session(u, e);
+		}
 
 		if (u->evpcount == env->sc_mda_task_lowat) {
 			if (u->flags & USER_ONHOLD) {
@@ -642,13 +996,29 @@ mda_drain(void)
 static void
 mda_done(struct mda_session *s)
 {
+	struct mda_envelope	*e;
+	struct mda_part		*pt;
+
 	log_debug("debug: mda: session %016" PRIx64 " done", s->id);
 
 	tree_xpop(&sessions, s->id);
 
 	mda_envelope_free(s->evp);
+	while ((e = TAILQ_FIRST(&s->group))) {
+		TAILQ_REMOVE(&s->group, e, entry);
+		mda_envelope_free(e);
+	}
+	while ((pt = TAILQ_FIRST(&s->parts))) {
+		TAILQ_REMOVE(&s->parts, pt, entry);
+		mda_part_free(pt);
+	}
 
 	s->user->running--;
+	if (--s->dest->running == 0) {
+		dict_xpop(&s->user->dests, s->dest->name);
+		free(s->dest->name);
+		free(s->dest);
+	}
 	if (!(s->user->flags & USER_RUNNABLE)) {
 		log_debug("debug: mda: user \"%s\" becomes runnable",
 		    s->user->name);
@@ -661,9 +1031,9 @@ mda_done(struct mda_session *s)
 	if (s->io)
 		io_free(s->io);
 
-	free(s);
+	stat_decrement("mda.running", 1 + s->ngroup);
 
-	stat_decrement("mda.running", 1);
+	free(s);
 
 	mda_drain();
 }
@@ -671,6 +1041,7 @@ mda_done(struct mda_session *s)
 static void
 mda_log(const struct mda_envelope *evp, const char *prefix, const char *status)
 {
+	struct dlog d;
 	char rcpt[LINE_MAX];
 
 	rcpt[0] = '\0';
@@ -688,14 +1059,56 @@ mda_log(const struct mda_envelope *evp, const char *prefix, const char *status)
 	    duration_to_text(time(NULL) - evp->creation),
 	    prefix,
 	    status);
+
+	memset(&d, 0, sizeof(d));
+	d.type = DLOG_MDA;
+	if (!strcmp(prefix, "Ok"))
+		d.result = DLOG_OK;
+	else if (!strcmp(prefix, "TempFail"))
+		d.result = DLOG_TEMPFAIL;
+	else
+		d.result = DLOG_PERMFAIL;
+	d.evpid = evp->id;
+	d.session = evp->session_id;
+	d.creation = evp->creation;
+	d.sender = evp->sender;
+	d.rcpt = evp->dest;
+	d.orcpt = evp->rcpt;
+	d.user = evp->user;
+	d.status = status;
+	logger_delivery(&d);
 }
 
 static void
 mda_queue_ok(uint64_t evpid)
 {
+	struct timeval	tv;
+
+	if (ok_nbatch == MDA_OK_BATCH_MAX || (ok_nbatch &&
+	    evpid_to_msgid(ok_batch[0]) != evpid_to_msgid(evpid)))
+		mda_queue_ok_flush(-1, 0, NULL);
+	ok_batch[ok_nbatch++] = evpid;
+
+	if (!evtimer_pending(&ok_ev, NULL)) {
+		timerclear(&tv);
+		evtimer_add(&ok_ev, &tv);
+	}
+}
+
+static void
+mda_queue_ok_flush(int fd, short event, void *arg)
+{
+	size_t	i;
+
+	if (ok_nbatch == 0)
+		return;
+
 	m_create(p_queue, IMSG_MDA_DELIVERY_OK, 0, 0, -1);
-	m_add_evpid(p_queue, evpid);
+	for (i = 0; i < ok_nbatch; i++)
+		m_add_evpid(p_queue, ok_batch[i]);
 	m_close(p_queue);
+	ok_nbatch = 0;
+	stat_increment("mda.delivery.batch", 1);
 }
 
 static void
@@ -736,7 +1149,7 @@ mda_user(const struct envelope *evp)
 	void		*i;
 
 	i = NULL;
-	dsp = dict_xget(env->sc_dispatchers, evp->dispatcher);
+	dsp = hdict_xget(env->sc_dispatchers, evp->dispatcher);
 	while (tree_iter(&users, &i, NULL, (void**)(&u))) {
 		if (!strcmp(evp->mda_user, u->name) &&
 		    !strcmp(dsp->u.local.table_userbase, u->usertable))
@@ -746,6 +1159,7 @@ mda_user(const struct envelope *evp)
 	u = xcalloc(1, sizeof *u);
 	u->id = generate_uid();
 	TAILQ_INIT(&u->envelopes);
+	dict_init(&u->dests);
 	(void)strlcpy(u->name, evp->mda_user, sizeof(u->name));
 	(void)strlcpy(u->usertable, dsp->u.local.table_userbase,
 	    sizeof(u->usertable));
@@ -838,35 +1252,76 @@ mda_envelope_free(struct mda_envelope *e)
 	free(e->rcpt);
 	free(e->user);
 	free(e->mda_exec);
+	free(e->lmtp_rcpt);
 	free(e);
 
 	stat_decrement("mda.envelope", 1);
 }
 
+/*
+ * Pick the first pending envelope for the destination of the user with
+ * the fewest running sessions.  Returns NULL if all of them are at the
+ * limit.
+ */
+static struct mda_envelope *
+mda_next_envelope(struct mda_user *u)
+{
+	struct mda_envelope	*e, *best = NULL;
+	struct mda_dest		*d;
+	size_t			 running, min = SIZE_MAX;
+
+	TAILQ_FOREACH(e, &u->envelopes, entry) {
+		d = dict_get(&u->dests, e->dest);
+		running = d ? d->running : 0;
+		if (running >= env->sc_mda_max_dest_session ||
+		    running >= min)
+			continue;
+		best = e;
+		if ((min = running) == 0)
+			break;
+	}
+	return (best);
+}
+
 static struct mda_session *
-mda_session(struct mda_user * u)
+mda_session(struct mda_user *u, struct mda_envelope *e)
 {
 	struct mda_session *s;
+	struct mda_dest	*d;
 
 	s = xcalloc(1, sizeof *s);
 	s->id = generate_uid();
 	s->user = u;
 	s->io = io_new();
 	io_set_callback(s->io, mda_io, s);
+	clock_gettime(CLOCK_MONOTONIC, &s->t_start);
 
 	tree_xset(&sessions, s->id, s);
 
-	s->evp = TAILQ_FIRST(&u->envelopes);
+	if ((d = dict_get(&u->dests, e->dest)) == NULL) {
+		d = xcalloc(1, sizeof *d);
+		d->name = xstrdup(e->dest);
+		dict_xset(&u->dests, d->name, d);
+	}
+	d->running++;
+	s->dest = d;
+
+	s->evp = e;
 	TAILQ_REMOVE(&u->envelopes, s->evp, entry);
+	TAILQ_INIT(&s->group);
+	TAILQ_INIT(&s->parts);
 	u->evpcount--;
 	u->running++;
 
 	stat_decrement("mda.pending", 1);
 	stat_increment("mda.running", 1);
 
+	mda_group(s);
+	mda_batch(s);
+
 	log_debug("debug: mda: new session %016" PRIx64
-	    " for user \"%s\" evpid %016" PRIx64, s->id,
-	    mda_user_to_text(u), s->evp->id);
+	    " for user \"%s\" evpid %016" PRIx64 " (%zu more)", s->id,
+	    mda_user_to_text(u), s->evp->id, s->ngroup);
 
 	m_create(p_queue, IMSG_MDA_OPEN_MESSAGE, 0, 0, -1);
 	m_add_id(p_queue, s->id);
@@ -876,6 +1331,997 @@ mda_session(struct mda_user * u)
 	return (s);
 }
 
+static void
+mda_deliver_init(struct deliver *deliver, struct mda_user *u,
+    struct mda_envelope *e)
+{
+	memset(deliver, 0, sizeof *deliver);
+	(void)text_to_mailaddr(&deliver->sender, e->sender);
+	(void)text_to_mailaddr(&deliver->rcpt, e->rcpt);
+	(void)text_to_mailaddr(&deliver->dest, e->dest);
+	if (e->mda_exec)
+		(void)strlcpy(deliver->mda_exec, e->mda_exec,
+		    sizeof deliver->mda_exec);
+	if (e->mda_subaddress)
+		(void)strlcpy(deliver->mda_subaddress, e->mda_subaddress,
+		    sizeof deliver->mda_subaddress);
+	(void)strlcpy(deliver->dispatcher, e->dispatcher,
+	    sizeof deliver->dispatcher);
+	deliver->userinfo = u->userinfo;
+}
+
+/*
+ * Describe where the envelope is delivered, for mbox and maildir
+ * actions whose outcome does not depend on the recipient beyond what
+ * is expanded in the command line.  Returns 0 if the delivery cannot
+ * be shared.
+ */
+static int
+mda_delivery_key(struct mda_user *u, struct mda_envelope *e, char *buf,
+    size_t len)
+{
+	struct dispatcher	*dsp;
+	struct deliver		 deliver;
+
+	dsp = hdict_xget(env->sc_dispatchers, e->dispatcher);
+	if (dsp->u.local.mda_wrapper || e->mda_exec)
+		return (0);
+
+	if (dsp->u.local.is_mbox) {
+		(void)strlcpy(buf, "mbox", len);
+		return (1);
+	}
+	if (!dsp->u.local.is_maildir)
+		return (0);
+
+	if (strlcpy(buf, dsp->u.local.command, len) >= len)
+		return (0);
+	mda_deliver_init(&deliver, u, e);
+	if (mda_expand_format(buf, len, &deliver, &u->userinfo, NULL) == -1)
+		return (0);
+	return (1);
+}
+
+/*
+ * Attach to the session the pending envelopes of the same message that
+ * would be delivered the same way.  They share the result of the
+ * delivery.
+ */
+static void
+mda_group(struct mda_session *s)
+{
+	struct mda_user		*u = s->user;
+	struct mda_envelope	*e, *next;
+	struct dispatcher	*dsp;
+	char			 key[EXPAND_BUFFER], ekey[EXPAND_BUFFER];
+	size_t			 left = MDA_GROUP_TARGETS, sz;
+	int			 single;
+
+	if (!mda_delivery_key(u, s->evp, key, sizeof key))
+		return;
+	dsp = hdict_xget(env->sc_dispatchers, s->evp->dispatcher);
+	single = dsp->u.local.single_instance;
+
+	TAILQ_FOREACH_SAFE(e, &u->envelopes, entry, next) {
+		if (s->ngroup >= MDA_GROUP_MAX)
+			break;
+		if (evpid_to_msgid(e->id) != evpid_to_msgid(s->evp->id) ||
+		    strcmp(e->dispatcher, s->evp->dispatcher) ||
+		    strcmp(e->sender, s->evp->sender))
+			continue;
+		if (!mda_delivery_key(u, e, ekey, sizeof ekey))
+			continue;
+		if (single) {
+			sz = strlen(e->dest) + 2;
+			sz += e->rcpt ? strlen(e->rcpt) + 2 : 1;
+			sz += e->mda_subaddress ?
+			    strlen(e->mda_subaddress) + 2 : 1;
+			if (sz > left)
+				break;
+			left -= sz;
+		}
+		else if ((e->mda_subaddress == NULL) !=
+		    (s->evp->mda_subaddress == NULL) ||
+		    (e->mda_subaddress &&
+		    strcmp(e->mda_subaddress, s->evp->mda_subaddress)) ||
+		    strcmp(key, ekey))
+			continue;
+
+		TAILQ_REMOVE(&u->envelopes, e, entry);
+		TAILQ_INSERT_TAIL(&s->group, e, entry);
+		s->ngroup++;
+		u->evpcount--;
+		stat_decrement("mda.pending", 1);
+		stat_increment("mda.running", 1);
+	}
+	if (s->ngroup)
+		stat_increment("mda.grouped", s->ngroup);
+}
+
+static int
+mda_is_mbox(struct mda_envelope *e)
+{
+	struct dispatcher	*dsp;
+
+	dsp = hdict_xget(env->sc_dispatchers, e->dispatcher);
+	return (dsp->type == DISPATCHER_LOCAL && dsp->u.local.is_mbox &&
+	    dsp->u.local.mda_wrapper == NULL && e->mda_exec == NULL);
+}
+
+/*
+ * Attach to a session delivering to the mbox of the user the pending
+ * envelopes of other messages for it, grouped by message.
+ */
+static void
+mda_batch(struct mda_session *s)
+{
+	struct mda_user		*u = s->user;
+	struct mda_envelope	*e, *next, *g, *gnext;
+	struct mda_part		*pt;
+	size_t			 nparts = 0;
+
+	if (!mda_is_mbox(s->evp))
+		return;
+
+	for (e = TAILQ_FIRST(&u->envelopes); e; e = next) {
+		next = TAILQ_NEXT(e, entry);
+		if (nparts + 1 >= MDA_MBOX_BATCH)
+			break;
+		if (strcmp(e->dispatcher, s->evp->dispatcher) ||
+		    !mda_is_mbox(e))
+			continue;
+
+		/* the same message with another sender waits its turn */
+		if (evpid_to_msgid(e->id) == evpid_to_msgid(s->evp->id))
+			continue;
+		TAILQ_FOREACH(pt, &s->parts, entry)
+			if (evpid_to_msgid(e->id) == evpid_to_msgid(pt->evp->id))
+				break;
+		if (pt)
+			continue;
+
+		pt = xcalloc(1, sizeof *pt);
+		pt->evp = e;
+		TAILQ_INIT(&pt->group);
+		TAILQ_REMOVE(&u->envelopes, e, entry);
+		u->evpcount--;
+
+		for (g = next; g; g = gnext) {
+			gnext = TAILQ_NEXT(g, entry);
+			if (pt->ngroup >= MDA_GROUP_MAX)
+				break;
+			if (evpid_to_msgid(g->id) != evpid_to_msgid(e->id) ||
+			    strcmp(g->dispatcher, e->dispatcher) ||
+			    strcmp(g->sender, e->sender) ||
+			    !mda_is_mbox(g))
+				continue;
+			if (g == next)
+				next = gnext;
+			TAILQ_REMOVE(&u->envelopes, g, entry);
+			TAILQ_INSERT_TAIL(&pt->group, g, entry);
+			pt->ngroup++;
+			u->evpcount--;
+		}
+
+		TAILQ_INSERT_TAIL(&s->parts, pt, entry);
+		nparts++;
+		stat_decrement("mda.pending", 1 + pt->ngroup);
+		stat_increment("mda.running", 1 + pt->ngroup);
+	}
+	if (nparts)
+		stat_increment("mda.mbox.batched", nparts);
+}
+
+/*
+ * Take the content of the next message of the batch, unless all of its
+ * recipients looped, then fork the mda once they are all there.
+ */
+static void
+mda_part_open(struct mda_session *s, int fd, const void *idx, size_t idxlen)
+{
+	struct mda_part		*pt = s->part;
+	struct mda_envelope	*e;
+	struct stat		 sb;
+	const char		*error = NULL;
+
+	s->part = TAILQ_NEXT(pt, entry);
+
+	if (fd == -1)
+		error = "Cannot get message fd";
+	else {
+		fadvise_sequential(fd);
+		if ((pt->datafp = fdopen(fd, "r")) == NULL) {
+			log_warn("warn: mda: fdopen");
+			close(fd);
+			error = "fdopen failed";
+		}
+		else if (fstat(fd, &sb) == -1) {
+			log_warn("warn: mda: fstat");
+			error = "fstat failed";
+		}
+	}
+	if (error) {
+		mda_result_envelope(pt->evp, MDA_TEMPFAIL, error, error);
+		TAILQ_FOREACH(e, &pt->group, entry)
+			mda_result_envelope(e, MDA_TEMPFAIL, error, error);
+		TAILQ_REMOVE(&s->parts, pt, entry);
+		mda_part_free(pt);
+	}
+	else if (!mda_filter_loops(pt->datafp, idx, idxlen, &pt->evp,
+	    &pt->group, &pt->ngroup)) {
+		TAILQ_REMOVE(&s->parts, pt, entry);
+		mda_part_free(pt);
+	}
+	else {
+		e = pt->evp;
+		if (e->sender[0])
+			xasprintf(&pt->hdr,
+			    "Return-Path: <%s>\n"
+			    "Delivered-To: %s\n",
+			    e->sender,
+			    e->rcpt ? e->rcpt : e->dest);
+		else
+			xasprintf(&pt->hdr,
+			    "Delivered-To: %s\n",
+			    e->rcpt ? e->rcpt : e->dest);
+		pt->size = strlen(pt->hdr) + sb.st_size;
+	}
+
+	if (s->part) {
+		m_create(p_queue, IMSG_MDA_OPEN_MESSAGE, 0, 0, -1);
+		m_add_id(p_queue, s->id);
+		m_add_msgid(p_queue, evpid_to_msgid(s->part->evp->id));
+		m_close(p_queue);
+		return;
+	}
+
+	mda_fork(s);
+}
+
+static void
+mda_part_free(struct mda_part *pt)
+{
+	struct mda_envelope	*e;
+
+	mda_envelope_free(pt->evp);
+	while ((e = TAILQ_FIRST(&pt->group))) {
+		TAILQ_REMOVE(&pt->group, e, entry);
+		mda_envelope_free(e);
+	}
+	if (pt->datafp)
+		fclose(pt->datafp);
+	stat_decrement("mda.running", 1 + pt->ngroup);
+	free(pt->hdr);
+	free(pt);
+}
+
+/*
+ * Request the parent to fork a helper process for the session.
+ */
+static void
+mda_fork(struct mda_session *s)
+{
+	struct dispatcher	*dsp;
+	struct deliver		 deliver;
+	struct mda_envelope	*e;
+	struct mda_part		*pt;
+	size_t			 nparts = 0;
+
+	mda_deliver_init(&deliver, s->user, s->evp);
+
+	TAILQ_FOREACH(pt, &s->parts, entry)
+		nparts++;
+
+	log_debug("debug: mda: querying mda fd "
+	    "for session %016"PRIx64 " evpid %016"PRIx64
+	    " (%zu more, %zu other messages)", s->id, s->evp->id, s->ngroup,
+	    nparts);
+
+	dsp = hdict_xget(env->sc_dispatchers, s->evp->dispatcher);
+	m_create(p_launcher, IMSG_MDA_FORK, 0, 0, -1);
+	m_add_id(p_launcher, s->id);
+	m_add_data(p_launcher, &deliver, sizeof(deliver));
+	if (dsp->type == DISPATCHER_LOCAL &&
+	    dsp->u.local.single_instance && !mda_is_mbox(s->evp)) {
+		m_add_size(p_launcher, s->ngroup);
+		TAILQ_FOREACH(e, &s->group, entry) {
+			m_add_string(p_launcher, e->dest);
+			m_add_string(p_launcher, e->rcpt);
+			m_add_string(p_launcher, e->mda_subaddress);
+		}
+	}
+	else
+		m_add_size(p_launcher, 0);
+	if (mda_is_mbox(s->evp)) {
+		m_add_size(p_launcher, 1 + nparts);
+		m_add_string(p_launcher, s->evp->sender);
+		m_add_size(p_launcher, s->size);
+		TAILQ_FOREACH(pt, &s->parts, entry) {
+			m_add_string(p_launcher, pt->evp->sender);
+			m_add_size(p_launcher, pt->size);
+		}
+	}
+	else
+		m_add_size(p_launcher, 0);
+	m_close(p_launcher);
+
+	/* the messages are then streamed in order */
+	s->part = TAILQ_FIRST(&s->parts);
+}
+
+/*
+ * Report the outcome of the session for each of its envelopes.
+ */
+static void
+mda_result(struct mda_session *s, enum mda_resp_status status,
+    const char *error, const char *logmsg)
+{
+	struct mda_envelope	*e;
+	struct mda_part		*pt;
+
+	mda_result_envelope(s->evp, status, error, logmsg);
+	TAILQ_FOREACH(e, &s->group, entry)
+		mda_result_envelope(e, status, error, logmsg);
+	TAILQ_FOREACH(pt, &s->parts, entry) {
+		mda_result_envelope(pt->evp, status, error, logmsg);
+		TAILQ_FOREACH(e, &pt->group, entry)
+			mda_result_envelope(e, status, error, logmsg);
+	}
+}
+
+static void
+mda_result_envelope(struct mda_envelope *e, enum mda_resp_status status,
+    const char *error, const char *logmsg)
+{
+	switch (status) {
+	case MDA_TEMPFAIL:
+		mda_queue_tempfail(e->id, error, ESC_OTHER_MAIL_SYSTEM_STATUS);
+		mda_log(e, "TempFail", logmsg);
+		break;
+	case MDA_PERMFAIL:
+		mda_queue_permfail(e->id, error, ESC_OTHER_MAIL_SYSTEM_STATUS);
+		mda_log(e, "PermFail", logmsg);
+		break;
+	case MDA_OK:
+		mda_queue_ok(e->id);
+		mda_log(e, "Ok", logmsg);
+		break;
+	}
+}
+
+/*
+ * Hand the next envelope of the user over to the in-process LMTP client
+ * if its action allows it.  Wrappers, .forward commands and destinations
+ * depending on the user still go through mail.lmtp.
+ */
+static int
+mda_lmtp_enqueue(struct mda_user *u)
+{
+	struct dispatcher	*dsp;
+	struct mda_lmtp_dest	*d;
+	struct mda_envelope	*e;
+	char			 buf[LINE_MAX];
+
+	e = TAILQ_FIRST(&u->envelopes);
+	dsp = hdict_xget(env->sc_dispatchers, e->dispatcher);
+	if (dsp->u.local.lmtp == NULL || dsp->u.local.mda_wrapper ||
+	    e->mda_exec || strchr(dsp->u.local.lmtp, '%'))
+		return (0);
+
+	TAILQ_REMOVE(&u->envelopes, e, entry);
+	u->evpcount--;
+	stat_decrement("mda.pending", 1);
+
+	/* same restriction as for the mda */
+	if (dsp->u.local.user == NULL && u->userinfo.uid == 0) {
+		(void)snprintf(buf, sizeof buf,
+		    "MDA not allowed to deliver to: %s", u->userinfo.username);
+		mda_queue_permfail(e->id, buf, ESC_OTHER_MAIL_SYSTEM_STATUS);
+		mda_log(e, "PermFail", buf);
+		mda_envelope_free(e);
+		return (1);
+	}
+
+	e->lmtp_rcpt = xstrdup(dsp->u.local.lmtp_rcpt_to ? e->dest :
+	    u->userinfo.username);
+
+	d = mda_lmtp_dest(dsp, e->dispatcher);
+	TAILQ_INSERT_TAIL(&d->envelopes, e, entry);
+	stat_increment("mda.lmtp.pending", 1);
+	mda_lmtp_drain(d);
+
+	return (1);
+}
+
+static struct mda_lmtp_dest *
+mda_lmtp_dest(struct dispatcher *dsp, const char *name)
+{
+	struct mda_lmtp_dest	*d;
+
+	if ((d = dict_get(&lmtp_dests, dsp->u.local.lmtp)) != NULL)
+		return (d);
+
+	d = xcalloc(1, sizeof *d);
+	d->name = xstrdup(dsp->u.local.lmtp);
+	d->dispatcher = xstrdup(name);
+	TAILQ_INIT(&d->envelopes);
+	TAILQ_INIT(&d->conns);
+	dict_xset(&lmtp_dests, d->name, d);
+
+	return (d);
+}
+
+static void
+mda_lmtp_drain(struct mda_lmtp_dest *d)
+{
+	struct mda_lmtp_conn	*c;
+	int			 connecting = 0;
+
+	TAILQ_FOREACH(c, &d->conns, entry) {
+		if (TAILQ_EMPTY(&d->envelopes))
+			return;
+		if (c->state == LMTP_READY)
+			mda_lmtp_start(c);
+		else if (c->state < LMTP_READY)
+			connecting = 1;
+	}
+
+	if (!TAILQ_EMPTY(&d->envelopes) && !connecting &&
+	    d->nconn < MDA_LMTP_MAXCONN)
+		mda_lmtp_connect(d);
+}
+
+static void
+mda_lmtp_connect(struct mda_lmtp_dest *d)
+{
+	struct mda_lmtp_conn	*c;
+	struct addrinfo		 hints;
+	char			 buf[HOST_NAME_MAX+1], *host, *port;
+
+	c = xcalloc(1, sizeof *c);
+	c->id = generate_uid();
+	c->dest = d;
+	c->state = LMTP_CONNECT;
+	TAILQ_INIT(&c->envelopes);
+	c->io = io_new();
+	io_set_callback(c->io, mda_lmtp_io, c);
+	io_set_timeout(c->io, MDA_LMTP_TIMEOUT * 1000);
+	tree_xset(&lmtp_conns, c->id, c);
+	TAILQ_INSERT_TAIL(&d->conns, c, entry);
+	d->nconn++;
+	stat_increment("mda.lmtp.conn", 1);
+
+	log_debug("debug: mda: lmtp: connecting to %s", d->name);
+
+	if (d->name[0] == '/') {
+		m_create(p_launcher, IMSG_MDA_LMTP_CONNECT, 0, 0, -1);
+		m_add_id(p_launcher, c->id);
+		m_add_string(p_launcher, d->dispatcher);
+		m_close(p_launcher);
+		return;
+	}
+
+	if (d->naddr) {
+		mda_lmtp_connect_inet(c);
+		return;
+	}
+	if (d->resolving)
+		return;
+
+	/* same syntax as mail.lmtp: host, host:port or [addr]:port */
+	(void)strlcpy(buf, d->name, sizeof buf);
+	host = buf;
+	port = "25";
+	if (*host == '[') {
+		host++;
+		if ((port = strchr(host, ']')) == NULL) {
+			mda_lmtp_fail(c, "invalid address syntax");
+			return;
+		}
+		*port++ = '\0';
+		if (strncasecmp(host, "IPv6:", 5) == 0)
+			host += 5;
+		port = (*port == ':') ? port + 1 : "25";
+	}
+	else if ((port = strchr(host, ':')) != NULL)
+		*port++ = '\0';
+	else
+		port = "25";
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	d->resolving = 1;
+	resolver_getaddrinfo(host, port, &hints, mda_lmtp_getaddrinfo_cb, d);
+}
+
+static void
+mda_lmtp_getaddrinfo_cb(void *arg, int gaierrno, struct addrinfo *ai0)
+{
+	struct mda_lmtp_dest	*d = arg;
+	struct mda_lmtp_conn	*c, *next;
+	struct addrinfo		*ai;
+	char			 buf[256];
+
+	d->resolving = 0;
+	d->naddr = 0;
+	for (ai = ai0; ai && d->naddr < MDA_LMTP_MAXADDR; ai = ai->ai_next)
+		memmove(&d->addr[d->naddr++], ai->ai_addr,
+		    SA_LEN(ai->ai_addr));
+	if (ai0)
+		asr_freeaddrinfo(ai0);
+
+	TAILQ_FOREACH_SAFE(c, &d->conns, entry, next) {
+		if (c->state != LMTP_CONNECT)
+			continue;
+		if (d->naddr)
+			mda_lmtp_connect_inet(c);
+		else {
+			(void)snprintf(buf, sizeof buf, "inet: %s",
+			    gai_strerror(gaierrno));
+			mda_lmtp_fail(c, buf);
+		}
+	}
+}
+
+static void
+mda_lmtp_connect_inet(struct mda_lmtp_conn *c)
+{
+	struct mda_lmtp_dest	*d = c->dest;
+	char			 buf[256];
+
+	for (; c->addr < d->naddr; c->addr++)
+		if (io_connect(c->io,
+		    (struct sockaddr *)&d->addr[c->addr], NULL) != -1)
+			return;
+
+	(void)snprintf(buf, sizeof buf, "connect: %s", io_error(c->io));
+	/* the address may have changed */
+	d->naddr = 0;
+	mda_lmtp_fail(c, buf);
+}
+
+/*
+ * Start a transaction for the first pending envelope and the following
+ * ones for the same message and sender.
+ */
+static void
+mda_lmtp_start(struct mda_lmtp_conn *c)
+{
+	struct mda_lmtp_dest	*d = c->dest;
+	struct mda_envelope	*e, *first, *next;
+	size_t			 n;
+
+	first = TAILQ_FIRST(&d->envelopes);
+	n = 0;
+	for (e = first; e && n < MDA_LMTP_MAXRCPT; e = next) {
+		next = TAILQ_NEXT(e, entry);
+		if (evpid_to_msgid(e->id) != evpid_to_msgid(first->id) ||
+		    strcmp(e->sender, first->sender))
+			continue;
+		TAILQ_REMOVE(&d->envelopes, e, entry);
+		TAILQ_INSERT_TAIL(&c->envelopes, e, entry);
+		n++;
+	}
+	stat_decrement("mda.lmtp.pending", n);
+	stat_increment("mda.running", n);
+
+	log_debug("debug: mda: lmtp: %zu recipient(s) for msg %08"PRIx32
+	    " on %s", n, evpid_to_msgid(first->id), d->name);
+
+	io_set_timeout(c->io, MDA_LMTP_TIMEOUT * 1000);
+	c->state = LMTP_OPEN;
+	m_create(p_queue, IMSG_MDA_OPEN_MESSAGE, 0, 0, -1);
+	m_add_id(p_queue, c->id);
+	m_add_msgid(p_queue, evpid_to_msgid(first->id));
+	m_close(p_queue);
+}
+
+static void
+mda_lmtp_on_fd(struct mda_lmtp_conn *c, int fd, const void *idx,
+    size_t idxlen)
+{
+	struct mda_envelope	*e, *next;
+
+	if (fd != -1)
+		fadvise_sequential(fd);
+	if (fd == -1 || (c->datafp = fdopen(fd, "r")) == NULL) {
+		if (fd != -1)
+			close(fd);
+		while ((e = TAILQ_FIRST(&c->envelopes))) {
+			TAILQ_REMOVE(&c->envelopes, e, entry);
+			mda_lmtp_result(e, "421 Cannot get message fd");
+		}
+		mda_lmtp_ready(c);
+		return;
+	}
+
+	TAILQ_FOREACH_SAFE(e, &c->envelopes, entry, next) {
+		if (mda_check_loop(c->datafp, idx, idxlen, e)) {
+			TAILQ_REMOVE(&c->envelopes, e, entry);
+			mda_queue_loop(e->id);
+			mda_log(e, "PermFail", "Loop detected");
+			mda_envelope_free(e);
+			stat_decrement("mda.running", 1);
+		}
+	}
+	if ((e = TAILQ_FIRST(&c->envelopes)) == NULL) {
+		mda_lmtp_ready(c);
+		return;
+	}
+
+	c->naccepted = 0;
+	c->state = LMTP_MAIL;
+	io_xprintf(c->io, "MAIL FROM:<%s>\r\n", e->sender);
+	io_set_write(c->io);
+}
+
+static void
+mda_lmtp_io(struct io *io, int evt, void *arg)
+{
+	struct mda_lmtp_conn	*c = arg;
+	char			*line, buf[256];
+	size_t			 len;
+
+	log_trace(TRACE_IO, "mda: lmtp %p: %s %s", c, io_strevent(evt),
+	    io_strio(io));
+
+	switch (evt) {
+	case IO_CONNECTED:
+		io_set_read(io);
+		c->state = LMTP_BANNER;
+		break;
+
+	case IO_DATAIN:
+		while ((line = io_getline(io, &len)) != NULL) {
+			if (len > 0 && line[len - 1] == '\r')
+				line[--len] = '\0';
+			log_trace(TRACE_IO, "mda: lmtp %p: <<< %s", c, line);
+			if (len < 4 || !isdigit((unsigned char)line[0]) ||
+			    !isdigit((unsigned char)line[1]) ||
+			    !isdigit((unsigned char)line[2]) ||
+			    (line[3] != ' ' && line[3] != '-')) {
+				mda_lmtp_fail(c, "LMTP server sent an invalid line");
+				return;
+			}
+			if (line[3] == '-')
+				continue;
+			if (mda_lmtp_response(c, line) == -1)
+				return;
+			if (io_queued(io)) {
+				io_set_write(io);
+				return;
+			}
+		}
+		if (io_datalen(io) >= LINE_MAX)
+			mda_lmtp_fail(c, "LMTP server sent a line too long");
+		break;
+
+	case IO_LOWAT:
+		if (c->state == LMTP_BODY && mda_lmtp_body(c) == -1)
+			return;
+		if (io_queued(io) == 0) {
+			io_set_read(io);
+			if (io_datalen(io))
+				mda_lmtp_io(io, IO_DATAIN, c);
+		}
+		break;
+
+	case IO_TIMEOUT:
+		mda_lmtp_fail(c, "connection timeout");
+		break;
+
+	case IO_ERROR:
+		(void)snprintf(buf, sizeof buf, "IO error: %s", io_error(io));
+		if (c->state == LMTP_CONNECT) {
+			c->addr++;
+			if (c->addr < c->dest->naddr) {
+				mda_lmtp_connect_inet(c);
+				break;
+			}
+			c->dest->naddr = 0;
+		}
+		mda_lmtp_fail(c, buf);
+		break;
+
+	case IO_DISCONNECTED:
+		mda_lmtp_fail(c, "connection closed by LMTP server");
+		break;
+
+	default:
+		fatalx("mda_lmtp_io() bad event");
+	}
+}
+
+/*
+ * Handle a reply from the server.  Returns -1 if the connection was
+ * closed.
+ */
+static int
+mda_lmtp_response(struct mda_lmtp_conn *c, const char *line)
+{
+	struct mda_envelope	*e;
+	char			 buf[LINE_MAX];
+	int			 n;
+
+	switch (c->state) {
+	case LMTP_BANNER:
+		if (line[0] != '2') {
+			mda_lmtp_fail(c, line);
+			return (-1);
+		}
+		c->state = LMTP_LHLO;
+		io_xprintf(c->io, "LHLO %s\r\n", env->sc_hostname);
+		break;
+
+	case LMTP_LHLO:
+		if (line[0] != '2') {
+			mda_lmtp_fail(c, line);
+			return (-1);
+		}
+		mda_lmtp_ready(c);
+		break;
+
+	case LMTP_MAIL:
+		if (line[0] != '2') {
+			while ((e = TAILQ_FIRST(&c->envelopes))) {
+				TAILQ_REMOVE(&c->envelopes, e, entry);
+				mda_lmtp_result(e, line);
+			}
+			fclose(c->datafp);
+			c->datafp = NULL;
+			c->state = LMTP_RSET;
+			io_xprintf(c->io, "RSET\r\n");
+			break;
+		}
+		c->curr = TAILQ_FIRST(&c->envelopes);
+		c->state = LMTP_RCPT;
+		io_xprintf(c->io, "RCPT TO:<%s>\r\n", c->curr->lmtp_rcpt);
+		break;
+
+	case LMTP_RCPT:
+		e = c->curr;
+		c->curr = TAILQ_NEXT(e, entry);
+		if (line[0] == '2')
+			c->naccepted++;
+		else {
+			TAILQ_REMOVE(&c->envelopes, e, entry);
+			mda_lmtp_result(e, line);
+		}
+		if (c->curr) {
+			io_xprintf(c->io, "RCPT TO:<%s>\r\n",
+			    c->curr->lmtp_rcpt);
+			break;
+		}
+		if (c->naccepted == 0) {
+			fclose(c->datafp);
+			c->datafp = NULL;
+			c->state = LMTP_RSET;
+			io_xprintf(c->io, "RSET\r\n");
+			break;
+		}
+		c->state = LMTP_DATA;
+		io_xprintf(c->io, "DATA\r\n");
+		break;
+
+	case LMTP_DATA:
+		if (line[0] != '3') {
+			while ((e = TAILQ_FIRST(&c->envelopes))) {
+				TAILQ_REMOVE(&c->envelopes, e, entry);
+				mda_lmtp_result(e, line);
+			}
+			fclose(c->datafp);
+			c->datafp = NULL;
+			c->state = LMTP_RSET;
+			io_xprintf(c->io, "RSET\r\n");
+			break;
+		}
+
+		/* the delivery headers mail.lmtp would have received */
+		e = TAILQ_FIRST(&c->envelopes);
+		n = 0;
+		if (e->sender[0])
+			n = io_printf(c->io, "Return-Path: <%s>\r\n",
+			    e->sender);
+		if (n != -1 && TAILQ_NEXT(e, entry) == NULL)
+			n = io_printf(c->io, "Delivered-To: %s\r\n",
+			    e->rcpt ? e->rcpt : e->dest);
+		if (n == -1) {
+			mda_lmtp_fail(c, "Out of memory");
+			return (-1);
+		}
+		c->state = LMTP_BODY;
+		c->databol = 1;
+		return (mda_lmtp_body(c));
+
+	case LMTP_EOM:
+		/* one reply per accepted recipient */
+		e = TAILQ_FIRST(&c->envelopes);
+		TAILQ_REMOVE(&c->envelopes, e, entry);
+		if (line[0] == '2')
+			(void)snprintf(buf, sizeof buf, "Delivered");
+		else
+			(void)strlcpy(buf, line, sizeof buf);
+		mda_lmtp_result(e, line[0] == '2' ? NULL : buf);
+		if (TAILQ_EMPTY(&c->envelopes))
+			mda_lmtp_ready(c);
+		break;
+
+	case LMTP_RSET:
+		mda_lmtp_ready(c);
+		break;
+
+	default:
+		log_debug("debug: mda: lmtp: unexpected reply in state %d: %s",
+		    c->state, line);
+		mda_lmtp_fail(c, "unexpected reply from LMTP server");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Queue the message, dot-stuffed and with CRLF line endings, until the
+ * output buffer is full.  The content file is read in large blocks and
+ * copied one line span at a time.  Returns -1 if the connection was
+ * closed.
+ */
+static int
+mda_lmtp_body(struct mda_lmtp_conn *c)
+{
+	char	 buf[MDA_HIWAT];
+	char	*p, *nl, *end;
+	size_t	 len;
+
+	while (io_queued(c->io) < MDA_HIWAT) {
+		if ((len = fread(buf, 1, sizeof(buf), c->datafp)) == 0)
+			break;
+		end = buf + len;
+		for (p = buf; p < end; p = nl + 1) {
+			if (c->databol && *p == '.' &&
+			    io_write(c->io, ".", 1) == -1)
+				goto nomem;
+			if ((nl = memchr(p, '\n', end - p)) == NULL) {
+				if (io_write(c->io, p, end - p) == -1)
+					goto nomem;
+				c->databol = 0;
+				break;
+			}
+			if (io_write(c->io, p, nl - p) == -1 ||
+			    io_write(c->io, "\r\n", 2) == -1)
+				goto nomem;
+			c->databol = 1;
+		}
+	}
+
+	if (ferror(c->datafp)) {
+		mda_lmtp_fail(c, "Error reading body");
+		return (-1);
+	}
+	if (feof(c->datafp)) {
+		fadvise_dontneed(fileno(c->datafp));
+		fclose(c->datafp);
+		c->datafp = NULL;
+		c->state = LMTP_EOM;
+		/* terminate an incomplete last line */
+		io_xprintf(c->io, "%s.\r\n", c->databol ? "" : "\r\n");
+	}
+
+	return (0);
+
+    nomem:
+	mda_lmtp_fail(c, "Out of memory");
+	return (-1);
+
+	return (0);
+}
+
+/*
+ * The connection can take a new transaction, or idle until the server
+ * is needed again.
+ */
+static void
+mda_lmtp_ready(struct mda_lmtp_conn *c)
+{
+	if (c->datafp) {
+		fclose(c->datafp);
+		c->datafp = NULL;
+	}
+	c->state = LMTP_READY;
+	if (!TAILQ_EMPTY(&c->dest->envelopes)) {
+		mda_lmtp_start(c);
+		return;
+	}
+	io_set_timeout(c->io, MDA_LMTP_IDLE * 1000);
+	mda_drain();
+}
+
+/*
+ * Report the delivery of the envelope.  A NULL reply means success,
+ * otherwise the reply decides between a temporary and a permanent
+ * failure.
+ */
+static void
+mda_lmtp_result(struct mda_envelope *e, const char *reply)
+{
+	if (reply == NULL) {
+		mda_queue_ok(e->id);
+		mda_log(e, "Ok", "Delivered");
+	}
+	else if (reply[0] == '5') {
+		mda_queue_permfail(e->id, reply, ESC_OTHER_MAIL_SYSTEM_STATUS);
+		mda_log(e, "PermFail", reply);
+	}
+	else {
+		mda_queue_tempfail(e->id, reply, ESC_OTHER_MAIL_SYSTEM_STATUS);
+		mda_log(e, "TempFail", reply);
+	}
+	mda_envelope_free(e);
+	stat_decrement("mda.running", 1);
+}
+
+/*
+ * The connection is unusable.  Envelopes of its transaction are
+ * temporarily failed.  If it never made it to the ready state and no
+ * other connection to the destination did either, the pending ones are
+ * too, rather than retrying in a loop.
+ */
+static void
+mda_lmtp_fail(struct mda_lmtp_conn *c, const char *error)
+{
+	struct mda_lmtp_dest	*d = c->dest;
+	struct mda_lmtp_conn	*o;
+	struct mda_envelope	*e;
+	char			 buf[LINE_MAX];
+	int			 flush;
+
+	if (c->state != LMTP_READY)
+		log_warnx("warn: mda: lmtp: delivery to %s failed: %s",
+		    d->name, error);
+
+	(void)snprintf(buf, sizeof buf, "421 %s", error);
+	while ((e = TAILQ_FIRST(&c->envelopes))) {
+		TAILQ_REMOVE(&c->envelopes, e, entry);
+		mda_lmtp_result(e, buf);
+	}
+
+	flush = c->state < LMTP_READY;
+	TAILQ_FOREACH(o, &d->conns, entry)
+		if (o != c && o->state >= LMTP_READY)
+			flush = 0;
+	if (flush) {
+		while ((e = TAILQ_FIRST(&d->envelopes))) {
+			TAILQ_REMOVE(&d->envelopes, e, entry);
+			stat_decrement("mda.lmtp.pending", 1);
+			stat_increment("mda.running", 1);
+			mda_lmtp_result(e, buf);
+		}
+	}
+
+	mda_lmtp_free(c);
+	mda_lmtp_drain(d);
+	mda_drain();
+}
+
+static void
+mda_lmtp_free(struct mda_lmtp_conn *c)
+{
+	log_debug("debug: mda: lmtp: closing connection to %s",
+	    c->dest->name);
+
+	TAILQ_REMOVE(&c->dest->conns, c, entry);
+	c->dest->nconn--;
+	tree_xpop(&lmtp_conns, c->id);
+	if (c->datafp)
+		fclose(c->datafp);
+	io_free(c->io);
+	c->io = NULL;
+	free(c);
+	stat_decrement("mda.lmtp.conn", 1);
+}
+
 static const char *
 mda_sysexit_to_str(int sysexit)
 {
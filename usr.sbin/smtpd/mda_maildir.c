@@ -0,0 +1,478 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2017 Gilles Chehade <gilles@poolp.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+
+/*
+ * Same delivery as mail.maildir, done in the mda process itself after
+ * privileges are dropped, without an exec.
+ *
+ * The launcher remembers the maildirs it delivered to successfully, up
+ * to MAILDIR_CACHE_MAX, and the mda processes it forks skip creating
+ * the directories of those.  If one disappeared, the delivery creates
+ * it again.
+ *
+ * With single-instance, the message is written once and hard-linked
+ * into the maildirs of the other recipients, or copied when they are
+ * on another filesystem.  It only appears in the new/ directories once
+ * every copy is ready.
+ */
+#define	MAILDIR_CACHE_MAX	4096
+#define	MAILDIR_ESCAPE		"!#$%&'*/?^`{|}~"
+
+struct maildir_dest {
+	char	dir[PATH_MAX];
+	char	junk[PATH_MAX];
+	char	ext[PATH_MAX];
+	char	tmp[PATH_MAX];
+	char	filename[PATH_MAX];
+	int	known;
+};
+
+static void	maildir_prepare(struct maildir_dest *, const char *,
+    const char *, int, const char *);
+static void	maildir_link(struct maildir_dest *, struct maildir_dest *);
+static void	maildir_clone(struct maildir_dest *, struct maildir_dest *);
+static void	maildir_commit(struct maildir_dest *, int);
+static int	maildir_subdir(const char *, char *, size_t);
+static void	maildir_mkdirs(const char *);
+static int	maildir_open(const char *, const char *, int);
+static int	maildir_copy(int, int, int);
+static void	maildir_write(int, const char *, size_t);
+static int	mkdirs_component(const char *, mode_t);
+static int	mkdirs(const char *, mode_t);
+
+static struct dict	maildirs;
+static int		maildirs_inited;
+
+int
+mda_maildir_known(const char *dirname)
+{
+	return (maildirs_inited && dict_check(&maildirs, dirname));
+}
+
+void
+mda_maildir_cache(const char *dirname)
+{
+	if (!maildirs_inited) {
+		dict_init(&maildirs);
+		maildirs_inited = 1;
+	}
+	if (dict_check(&maildirs, dirname))
+		return;
+	if (dict_count(&maildirs) >= MAILDIR_CACHE_MAX)
+		while (dict_poproot(&maildirs, NULL))
+			;
+	dict_set(&maildirs, dirname, NULL);
+}
+
+void
+mda_maildir(struct deliver *deliver, const char *dirname, int junk,
+    struct maildir_target *targets, size_t ntargets)
+{
+	struct maildir_dest	*dests;
+	char			 hostname[HOST_NAME_MAX+1];
+	size_t			 i;
+	int			 fd, is_junk;
+
+	if ((dests = calloc(ntargets + 1, sizeof *dests)) == NULL)
+		err(EX_TEMPFAIL, NULL);
+
+	if (gethostname(hostname, sizeof hostname) != 0)
+		(void)strlcpy(hostname, "localhost", sizeof hostname);
+
+	maildir_prepare(&dests[0], dirname, deliver->mda_subaddress, junk,
+	    hostname);
+	fd = maildir_open(dests[0].dir, dests[0].tmp, dests[0].known);
+
+	is_junk = maildir_copy(STDIN_FILENO, fd, junk);
+
+	if (fsync(fd) == -1 || close(fd) == -1)
+		err(EX_TEMPFAIL, NULL);
+
+	for (i = 0; i < ntargets; i++) {
+		maildir_prepare(&dests[i + 1], targets[i].path,
+		    targets[i].subaddress, junk, hostname);
+		maildir_link(&dests[0], &dests[i + 1]);
+	}
+
+	for (i = 0; i <= ntargets; i++)
+		maildir_commit(&dests[i], is_junk);
+
+	_exit(0);
+}
+
+/*
+ * Create the directories a delivery to the maildir needs, unless the
+ * launcher knows them, and pick the name of the message file.
+ */
+static void
+maildir_prepare(struct maildir_dest *d, const char *dirname,
+    const char *subaddress, int junk, const char *hostname)
+{
+	char		 subdir[PATH_MAX];
+	struct stat	 sb;
+	int		 ret;
+
+	if (strlcpy(d->dir, dirname, sizeof d->dir) >= sizeof d->dir)
+		errc(1, ENAMETOOLONG, "%s", dirname);
+	d->known = mda_maildir_known(dirname);
+	if (!d->known)
+		maildir_mkdirs(d->dir);
+
+	if (junk) {
+		ret = snprintf(d->junk, sizeof d->junk, "%s/.Junk", dirname);
+		if (ret < 0 || (size_t)ret >= sizeof d->junk)
+			errc(1, ENAMETOOLONG, "%s/.Junk", dirname);
+		if (!d->known)
+			maildir_mkdirs(d->junk);
+	}
+
+	if (subaddress && subaddress[0] &&
+	    maildir_subdir(subaddress, subdir, sizeof subdir) &&
+	    subdir[0]) {
+		ret = snprintf(d->ext, sizeof d->ext, "%s/.%s",
+		    dirname, subdir);
+		if (ret < 0 || (size_t)ret >= sizeof d->ext)
+			errc(1, ENAMETOOLONG, "%s/.%s", dirname, subdir);
+		if (stat(d->ext, &sb) != -1) {
+			(void)strlcpy(d->dir, d->ext, sizeof d->dir);
+			d->known = 0;
+			maildir_mkdirs(d->dir);
+		}
+	}
+
+	(void)snprintf(d->filename, sizeof d->filename, "%lld.%08x.%s",
+	    (long long)time(NULL), arc4random(), hostname);
+	ret = snprintf(d->tmp, sizeof d->tmp, "%s/tmp/%s", d->dir,
+	    d->filename);
+	if (ret < 0 || (size_t)ret >= sizeof d->tmp)
+		errc(1, ENAMETOOLONG, "%s/tmp/%s", d->dir, d->filename);
+}
+
+/*
+ * Make the message written for src appear in the tmp/ directory of dst.
+ */
+static void
+maildir_link(struct maildir_dest *src, struct maildir_dest *dst)
+{
+	if (link(src->tmp, dst->tmp) == 0)
+		return;
+	if (errno == ENOENT && dst->known) {
+		/* the cached maildir went away */
+		maildir_mkdirs(dst->dir);
+		if (link(src->tmp, dst->tmp) == 0)
+			return;
+	}
+	/* another filesystem, or one without hard links */
+	if (errno == EXDEV || errno == EMLINK || errno == EPERM ||
+	    errno == EOPNOTSUPP) {
+		maildir_clone(src, dst);
+		return;
+	}
+	err(EX_TEMPFAIL, "link");
+}
+
+static void
+maildir_clone(struct maildir_dest *src, struct maildir_dest *dst)
+{
+	char	 buf[16384];
+	ssize_t	 n;
+	int	 in, out;
+
+	if ((in = open(src->tmp, O_RDONLY)) == -1)
+		err(EX_TEMPFAIL, "open");
+	out = maildir_open(dst->dir, dst->tmp, dst->known);
+
+#ifdef HAVE_COPY_FILE_RANGE
+	/* lets the filesystem share the blocks where it can */
+	for (;;) {
+		n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+		if (n == 0)
+			goto done;
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EXDEV || errno == EINVAL ||
+			    errno == ENOSYS || errno == EOPNOTSUPP)
+				break;
+			err(EX_TEMPFAIL, "copy_file_range");
+		}
+	}
+#endif
+
+	for (;;) {
+		if ((n = read(in, buf, sizeof buf)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_TEMPFAIL, "read");
+		}
+		if (n == 0)
+			break;
+		maildir_write(out, buf, n);
+	}
+
+#ifdef HAVE_COPY_FILE_RANGE
+done:
+#endif
+	if (fsync(out) == -1 || close(out) == -1)
+		err(EX_TEMPFAIL, NULL);
+	close(in);
+}
+
+static void
+maildir_commit(struct maildir_dest *d, int is_junk)
+{
+	const char	*dir = is_junk ? d->junk : d->dir;
+	char		 new[PATH_MAX];
+	int		 ret;
+
+	ret = snprintf(new, sizeof new, "%s/new/%s", dir, d->filename);
+	if (ret < 0 || (size_t)ret >= sizeof new)
+		errc(1, ENAMETOOLONG, "%s/new/%s", dir, d->filename);
+	if (rename(d->tmp, new) == -1) {
+		if (errno != ENOENT || !d->known)
+			err(EX_TEMPFAIL, NULL);
+		maildir_mkdirs(dir);
+		if (rename(d->tmp, new) == -1)
+			err(EX_TEMPFAIL, NULL);
+	}
+}
+
+static int
+maildir_open(const char *dirname, const char *path, int known)
+{
+	int	fd;
+
+	fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0600);
+	if (fd == -1 && errno == ENOENT && known) {
+		/* the cached maildir went away */
+		maildir_mkdirs(dirname);
+		fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0600);
+	}
+	if (fd == -1)
+		err(EX_TEMPFAIL, NULL);
+
+	return (fd);
+}
+
+/*
+ * Copy the message, looking for a spam flag in the headers if needed.
+ * The headers are read, the body is spliced from the pipe to the file
+ * where the system allows it.  Returns 1 if the message is junk.
+ */
+static int
+maildir_copy(int in, int out, int junk)
+{
+	char	 buf[16384], line[LINE_MAX];
+	size_t	 linelen = 0, i;
+	ssize_t	 n;
+	int	 in_hdr = junk, is_junk = 0, overflow = 0;
+
+	while (in_hdr) {
+		if ((n = read(in, buf, sizeof buf)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_TEMPFAIL, "read");
+		}
+		if (n == 0)
+			return (is_junk);
+		for (i = 0; i < (size_t)n && in_hdr; i++) {
+			if (buf[i] != '\n') {
+				if (linelen < sizeof line - 1)
+					line[linelen++] = buf[i];
+				else
+					overflow = 1;
+				continue;
+			}
+			line[linelen] = '\0';
+			if (linelen == 0)
+				in_hdr = 0;
+			else if (!overflow &&
+			    (strcasecmp(line, "x-spam: yes") == 0 ||
+			    strcasecmp(line, "x-spam-flag: yes") == 0))
+				is_junk = 1;
+			linelen = 0;
+			overflow = 0;
+		}
+		maildir_write(out, buf, n);
+	}
+
+#ifdef SPLICE_F_MOVE
+	for (;;) {
+		n = splice(in, NULL, out, NULL, 1 << 20, SPLICE_F_MOVE);
+		if (n == 0)
+			return (is_junk);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			/* not supported for this file, read and write */
+			if (errno == EINVAL || errno == ENOSYS)
+				break;
+			err(EX_TEMPFAIL, "splice");
+		}
+	}
+#endif
+
+	for (;;) {
+		if ((n = read(in, buf, sizeof buf)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_TEMPFAIL, "read");
+		}
+		if (n == 0)
+			return (is_junk);
+		maildir_write(out, buf, n);
+	}
+}
+
+static void
+maildir_write(int fd, const char *buf, size_t len)
+{
+	ssize_t	n;
+
+	while (len) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_TEMPFAIL, "write");
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static int
+maildir_subdir(const char *extension, char *dest, size_t len)
+{
+	char		*sanitized;
+
+	if (strlcpy(dest, extension, len) >= len)
+		return 0;
+
+	for (sanitized = dest; *sanitized; sanitized++)
+		if (strchr(MAILDIR_ESCAPE, *sanitized))
+			*sanitized = ':';
+
+	return 1;
+}
+
+static void
+maildir_mkdirs(const char *dirname)
+{
+	uint	i;
+	int	ret;
+	char	pathname[PATH_MAX];
+	char	*subdirs[] = { "cur", "tmp", "new" };
+
+	if (mkdirs(dirname, 0700) == -1 && errno != EEXIST) {
+		if (errno == EINVAL || errno == ENAMETOOLONG)
+			err(1, NULL);
+		err(EX_TEMPFAIL, NULL);
+	}
+
+	for (i = 0; i < nitems(subdirs); ++i) {
+		ret = snprintf(pathname, sizeof pathname, "%s/%s", dirname,
+		    subdirs[i]);
+		if (ret < 0 || (size_t)ret >= sizeof pathname)
+			errc(1, ENAMETOOLONG, "%s/%s", dirname, subdirs[i]);
+		if (mkdir(pathname, 0700) == -1 && errno != EEXIST)
+			err(EX_TEMPFAIL, NULL);
+	}
+}
+
+static int
+mkdirs_component(const char *path, mode_t mode)
+{
+	struct stat	sb;
+
+	if (stat(path, &sb) == -1) {
+		if (errno != ENOENT)
+			return 0;
+		if (mkdir(path, mode | S_IWUSR | S_IXUSR) == -1)
+			return 0;
+	}
+	else if (!S_ISDIR(sb.st_mode)) {
+		errno = ENOTDIR;
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+mkdirs(const char *path, mode_t mode)
+{
+	char	 buf[PATH_MAX];
+	int	 i = 0;
+	int	 done = 0;
+	const char	*p;
+
+	/* absolute path required */
+	if (*path != '/') {
+		errno = EINVAL;
+		return 0;
+	}
+
+	/* make sure we don't exceed PATH_MAX */
+	if (strlen(path) >= sizeof buf) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+
+	memset(buf, 0, sizeof buf);
+	for (p = path; *p; p++) {
+		if (*p == '/') {
+			if (buf[0] != '\0')
+				if (!mkdirs_component(buf, mode))
+					return 0;
+			while (*p == '/')
+				p++;
+			buf[i++] = '/';
+			buf[i++] = *p;
+			if (*p == '\0' && ++done)
+				break;
+			continue;
+		}
+		buf[i++] = *p;
+	}
+	if (!done)
+		if (!mkdirs_component(buf, mode))
+			return 0;
+
+	if (chmod(path, mode) == -1)
+		return 0;
+
+	return 1;
+}
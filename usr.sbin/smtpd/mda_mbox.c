@@ -19,41 +19,284 @@
 #include "includes.h"
 
 #include <sys/types.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <paths.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "smtpd.h"
 
+/*
+ * Same delivery as mail.local, done in the mda process itself without
+ * an exec.
+ *
+ * The dispatcher hands the messages pending for the mailbox to a single
+ * mda process, one after the other on its standard input, along with
+ * the sender and size of each.  The mailbox is locked once for all of
+ * them and synced once at the end.  If one cannot be written, the
+ * mailbox is truncated back to where the batch started, so that they
+ * all fail together.
+ */
+#define	MBOX_BUFSIZE	65536
+
+static void	mbox_lock(void);
+static void	mbox_unlock(void);
+static int	mbox_open(const char *);
+static void	mbox_append(int, const char *, size_t);
+static void	mbox_write(const char *, size_t);
+static void	mbox_flush(void);
+static void	mbox_output(const char *, size_t);
+static void	mbox_rollback(void);
+static void	mbox_signal(int);
+
+static char		mbox_buf[MBOX_BUFSIZE];
+static size_t		mbox_buflen;
+static int		mbox_fd = -1;
+static volatile off_t	mbox_start = -1;
+static volatile int	mbox_done;
+static int		mbox_lockfd = -1;
+static pid_t		mbox_lockpid = -1;
+
 void
-mda_mbox(struct deliver *deliver)
+mda_mbox(struct deliver *deliver, struct mbox_message *msgs, size_t nmsgs)
+{
+	char	path[PATH_MAX];
+	size_t	i;
+	int	ret;
+
+	if (nmsgs == 0)
+		errx(EX_SOFTWARE, "no message to deliver");
+
+	ret = snprintf(path, sizeof path, "%s/%s",
+	    _PATH_MAILDIR, deliver->userinfo.username);
+	if (ret < 0 || (size_t)ret >= sizeof path)
+		errx(EX_TEMPFAIL, "mailbox pathname too long");
+
+	if (atexit(mbox_rollback) != 0)
+		err(EX_TEMPFAIL, "atexit");
+	if (signal(SIGTERM, mbox_signal) == SIG_ERR ||
+	    signal(SIGALRM, mbox_signal) == SIG_ERR)
+		err(EX_TEMPFAIL, "signal");
+
+	mbox_lock();
+	mbox_fd = mbox_open(path);
+	if ((mbox_start = lseek(mbox_fd, 0, SEEK_END)) == -1)
+		err(EX_TEMPFAIL, "lseek");
+
+	for (i = 0; i < nmsgs; i++)
+		mbox_append(STDIN_FILENO, msgs[i].sender, msgs[i].size);
+	mbox_flush();
+
+	if (fsync(mbox_fd) == -1)
+		err(EX_TEMPFAIL, "fsync");
+	mbox_done = 1;
+	close(mbox_fd);
+	mbox_unlock();
+
+	_exit(0);
+}
+
+/*
+ * Hold the spool lock for the user through lockspool, which keeps it
+ * until its standard input is closed.
+ */
+static void
+mbox_lock(void)
+{
+	int	in[2], out[2];
+	char	c;
+
+	if (pipe(in) == -1 || pipe(out) == -1)
+		err(EX_TEMPFAIL, "pipe");
+
+	switch ((mbox_lockpid = fork())) {
+	case -1:
+		err(EX_TEMPFAIL, "fork");
+	case 0:
+		if (dup2(in[0], STDIN_FILENO) == -1 ||
+		    dup2(out[1], STDOUT_FILENO) == -1)
+			_exit(1);
+		closefrom(STDERR_FILENO + 1);
+		execl(PATH_LOCKSPOOL, "lockspool", (char *)NULL);
+		_exit(1);
+	}
+
+	close(in[0]);
+	close(out[1]);
+	mbox_lockfd = in[1];
+	if (read(out[0], &c, 1) != 1 || c != '1')
+		errx(EX_TEMPFAIL, "lockspool: unable to get lock");
+	close(out[0]);
+}
+
+static void
+mbox_unlock(void)
+{
+	close(mbox_lockfd);
+	mbox_lockfd = -1;
+	(void)waitpid(mbox_lockpid, NULL, 0);
+	mbox_lockpid = -1;
+}
+
+static int
+mbox_open(const char *path)
 {
-	int		ret;
-	char		sender[LINE_MAX];
-	char		*envp[] = {
-		"HOME=/",
-		"PATH=" _PATH_DEFPATH,
-		"LOGNAME=root",
-		"USER=root",
-		NULL,
-	};
-
-	if (deliver->sender.user[0] == '\0' &&
-	    deliver->sender.domain[0] == '\0')
-		ret = snprintf(sender, sizeof sender, "MAILER-DAEMON");
-	else
-		ret = snprintf(sender, sizeof sender, "%s@%s",
-			       deliver->sender.user, deliver->sender.domain);
-	if (ret < 0 || (size_t)ret >= sizeof sender)
+	struct stat	sb, fsb;
+	int		fd;
+
+	if (lstat(path, &sb) == -1)
+		err(EX_TEMPFAIL, "%s", path);
+	if (sb.st_nlink != 1 || !S_ISREG(sb.st_mode))
+		errx(EX_TEMPFAIL, "%s: linked or special file", path);
+	if ((fd = open(path, O_APPEND|O_WRONLY|O_NOFOLLOW)) == -1)
+		err(EX_TEMPFAIL, "%s", path);
+	if (fstat(fd, &fsb) == -1)
+		err(EX_TEMPFAIL, "%s", path);
+	if (sb.st_dev != fsb.st_dev || sb.st_ino != fsb.st_ino)
+		errx(EX_TEMPFAIL, "%s: changed after open", path);
+	if (fsb.st_nlink != 1 || !S_ISREG(fsb.st_mode))
+		errx(EX_TEMPFAIL, "%s: linked or special file", path);
+	if (flock(fd, LOCK_EX) == -1)
+		err(EX_TEMPFAIL, "%s: flock", path);
+
+	return (fd);
+}
+
+/*
+ * Append a message of size bytes read from fd after its From_ line.
+ * As with mail.local, a line starting with "From " at the top of the
+ * message or after an empty line is escaped with a '>'.  The input is
+ * written in runs between those, and the start of a line that could be
+ * one is kept for the next read when it is cut short.
+ */
+static void
+mbox_append(int fd, const char *sender, size_t size)
+{
+	char	 buf[MBOX_BUFSIZE], *p, *run, *end, *nl;
+	size_t	 len = 0;
+	ssize_t	 n;
+	time_t	 now;
+	int	 bol = 1, eline = 1;
+
+	if (sender[0] == '\0')
+		sender = "MAILER-DAEMON";
+	(void)time(&now);
+	n = snprintf(buf, sizeof buf, "From %s %s", sender, ctime(&now));
+	if (n < 0 || (size_t)n >= sizeof buf)
 		errx(EX_TEMPFAIL, "sender address too long");
+	mbox_write(buf, n);
 
-	execle(PATH_MAILLOCAL, PATH_MAILLOCAL, "-f",
-	       sender, deliver->userinfo.username, (char *)NULL, envp);
-	perror("execl");
+	while (size || len) {
+		if (size) {
+			n = read(fd, buf + len, MIN(size, sizeof buf - len));
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				err(EX_TEMPFAIL, "read");
+			}
+			if (n == 0)
+				errx(EX_TEMPFAIL, "message truncated");
+			size -= n;
+			len += n;
+		}
+
+		p = run = buf;
+		end = buf + len;
+		while (p < end) {
+			if (bol) {
+				if (size && end - p < 5 &&
+				    memchr(p, '\n', end - p) == NULL)
+					break;
+				if (*p == '\n') {
+					eline = 1;
+					p++;
+					continue;
+				}
+				if (eline && end - p >= 5 &&
+				    memcmp(p, "From ", 5) == 0) {
+					mbox_write(run, p - run);
+					mbox_write(">", 1);
+					run = p;
+				}
+				bol = eline = 0;
+			}
+			if ((nl = memchr(p, '\n', end - p)) == NULL) {
+				p = end;
+				break;
+			}
+			p = nl + 1;
+			bol = 1;
+		}
+		mbox_write(run, p - run);
+
+		len = end - p;
+		memmove(buf, p, len);
+	}
+
+	/* the message ends with a newline and an empty line */
+	if (!bol)
+		mbox_write("\n", 1);
+	mbox_write("\n", 1);
+}
+
+static void
+mbox_write(const char *data, size_t len)
+{
+	if (mbox_buflen + len > sizeof mbox_buf) {
+		mbox_flush();
+		if (len >= sizeof mbox_buf) {
+			mbox_output(data, len);
+			return;
+		}
+	}
+	memcpy(mbox_buf + mbox_buflen, data, len);
+	mbox_buflen += len;
+}
+
+static void
+mbox_flush(void)
+{
+	mbox_output(mbox_buf, mbox_buflen);
+	mbox_buflen = 0;
+}
+
+static void
+mbox_output(const char *data, size_t len)
+{
+	ssize_t	n;
+
+	while (len) {
+		if ((n = write(mbox_fd, data, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_TEMPFAIL, "write");
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static void
+mbox_rollback(void)
+{
+	if (mbox_start != -1 && !mbox_done)
+		(void)ftruncate(mbox_fd, mbox_start);
+}
+
+static void
+mbox_signal(int sig)
+{
+	mbox_rollback();
 	_exit(EX_TEMPFAIL);
 }
 
@@ -0,0 +1,241 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Memory accounting.
+ *
+ * The major allocators of a process account for what they hold, and
+ * the iobufs keep their own count.  When a "memory limit" is set, the
+ * total gives a pressure level that every process checks against its
+ * own usage: caches are shrunk first, then new transactions are
+ * tempfailed, and last no new connection is accepted.  A level is only
+ * left once the usage is MEMORY_HYSTERESIS percent of the limit below
+ * it, so that the responses do not flap.
+ *
+ * Usage is reported every MEMORY_INTERVAL seconds as the
+ * "memory.<proc>.<type>" stats, which "show memory" displays.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <event.h>
+#include <imsg.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "log.h"
+#include "smtpd.h"
+#include "iobuf.h"
+
+#define	MEMORY_INTERVAL		5	/* seconds */
+#define	MEMORY_HYSTERESIS	5	/* percent */
+
+static void memory_update(void);
+static void memory_report(int, short, void *);
+static void memory_notify(int, short, void *);
+static size_t memory_total(void);
+
+/* percent of the limit at which each level is entered */
+static const size_t memory_threshold[] = {
+	[MEMORY_NORMAL]		= 0,
+	[MEMORY_SHRINK]		= 75,
+	[MEMORY_TEMPFAIL]	= 90,
+	[MEMORY_PAUSE]		= 100,
+};
+
+static const char *memory_level_name[] = {
+	[MEMORY_NORMAL]		= "normal",
+	[MEMORY_SHRINK]		= "shrink",
+	[MEMORY_TEMPFAIL]	= "tempfail",
+	[MEMORY_PAUSE]		= "pause",
+};
+
+static const char *memory_type_name[] = {
+	[MEMORY_IO]		= "io",
+	[MEMORY_SMTP]		= "smtp",
+	[MEMORY_MTA]		= "mta",
+	[MEMORY_FILTER]		= "filter",
+	[MEMORY_EVPCACHE]	= "evpcache",
+};
+
+static size_t		  memory_usage[MEMORY_TYPES];
+static int		  memory_seen[MEMORY_TYPES];
+static enum memory_level  memory_current = MEMORY_NORMAL;
+static void		(*memory_set)(const char *, const struct stat_value *);
+static void		(*memory_cb)(enum memory_level);
+static struct event	  ev_memory;
+static struct event	  ev_memory_notify;
+static int		  memory_started;
+
+void
+memory_start(void (*set)(const char *, const struct stat_value *),
+    void (*cb)(enum memory_level))
+{
+	memory_set = set ? set : stat_set;
+	memory_cb = cb;
+	evtimer_set(&ev_memory, memory_report, NULL);
+	evtimer_set(&ev_memory_notify, memory_notify, NULL);
+	memory_started = 1;
+	memory_report(-1, 0, NULL);
+}
+
+void
+memory_alloc(enum memory_type type, size_t n)
+{
+	memory_usage[type] += n;
+	memory_seen[type] = 1;
+	memory_update();
+}
+
+void
+memory_free(enum memory_type type, size_t n)
+{
+	if (n > memory_usage[type])
+		n = memory_usage[type];
+	memory_usage[type] -= n;
+	memory_update();
+}
+
+enum memory_level
+memory_level(void)
+{
+	return (memory_current);
+}
+
+static size_t
+memory_total(void)
+{
+	struct iobuf_stats	st;
+	size_t			total;
+	int			i;
+
+	iobuf_pool_stats(&st);
+	memory_usage[MEMORY_IO] = st.bytes;
+	if (st.bytes)
+		memory_seen[MEMORY_IO] = 1;
+
+	total = 0;
+	for (i = 0; i < MEMORY_TYPES; i++)
+		total += memory_usage[i];
+	return (total);
+}
+
+static void
+memory_update(void)
+{
+	enum memory_level	level;
+	size_t			limit, total;
+	struct timeval		tv;
+
+	if ((limit = env->sc_memory_limit) == 0)
+		return;
+
+	total = memory_total();
+	level = MEMORY_PAUSE;
+	while (level > MEMORY_NORMAL &&
+	    total < limit / 100 * memory_threshold[level])
+		level--;
+
+	/* stay until well below the threshold of the current level */
+	if (level < memory_current &&
+	    total + limit / 100 * MEMORY_HYSTERESIS >=
+	    limit / 100 * memory_threshold[memory_current])
+		return;
+	if (level == memory_current)
+		return;
+
+	if (level > memory_current)
+		log_warnx("warn: %s: memory usage %zu of %zu bytes, %s",
+		    proc_name(smtpd_process), total, limit,
+		    memory_level_name[level]);
+	else
+		log_info("info: %s: memory usage %zu of %zu bytes, %s",
+		    proc_name(smtpd_process), total, limit,
+		    memory_level_name[level]);
+	memory_current = level;
+
+	/* the allocator that got us here may be in the middle of things */
+	if (memory_started && !evtimer_pending(&ev_memory_notify, NULL)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_memory_notify, &tv);
+	}
+}
+
+static void
+memory_notify(int fd, short event, void *arg)
+{
+	if (memory_current >= MEMORY_SHRINK)
+		iobuf_pool_purge();
+	if (memory_cb)
+		memory_cb(memory_current);
+}
+
+static void
+memory_report(int fd, short event, void *arg)
+{
+	struct timeval	 tv;
+	char		 key[STAT_KEY_SIZE];
+	char		 name[32];
+	size_t		 total;
+	int		 i;
+
+	if (smtpd_process == PROC_SCHEDULER && env->sc_scheduler_shards > 1)
+		(void)snprintf(name, sizeof name, "%s.%d",
+		    proc_name(smtpd_process), env->sc_scheduler_shard);
+	else if (smtpd_process == PROC_TLS)
+		(void)snprintf(name, sizeof name, "%s.%d",
+		    proc_name(smtpd_process), env->sc_tls_worker);
+	else if (smtpd_process == PROC_MTA)
+		(void)snprintf(name, sizeof name, "%s.%d",
+		    proc_name(smtpd_process), env->sc_mta_worker);
+	else if (smtpd_process == PROC_SMTP)
+		(void)snprintf(name, sizeof name, "%s.%d",
+		    proc_name(smtpd_process), env->sc_smtp_worker);
+	else
+		(void)strlcpy(name, proc_name(smtpd_process), sizeof name);
+
+	/* the iobufs are not accounted as they change */
+	memory_update();
+	total = memory_total();
+
+	for (i = 0; i < MEMORY_TYPES; i++) {
+		if (!memory_seen[i])
+			continue;
+		(void)snprintf(key, sizeof key, "memory.%s.%s", name,
+		    memory_type_name[i]);
+		memory_set(key, stat_counter(memory_usage[i]));
+	}
+	(void)snprintf(key, sizeof key, "memory.%s.total", name);
+	memory_set(key, stat_counter(total));
+	if (env->sc_memory_limit) {
+		(void)snprintf(key, sizeof key, "memory.%s.limit", name);
+		memory_set(key, stat_counter(env->sc_memory_limit));
+	}
+	(void)snprintf(key, sizeof key, "memory.%s.level", name);
+	memory_set(key, stat_counter(memory_current));
+
+	tv.tv_sec = MEMORY_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_memory, &tv);
+}
@@ -128,6 +128,13 @@ mproc_event_add(struct mproc *p)
 	if (p->imsgbuf.w.queued)
 		events |= EV_WRITE;
 
+	/*
+	 * This runs for every message composed: do not go through the
+	 * kernel to register the same events again.
+	 */
+	if (p->events == events)
+		return;
+
 	if (p->events)
 		event_del(&p->ev);
 
@@ -144,6 +151,8 @@ mproc_dispatch(int fd, short event, void *arg)
 	struct mproc	*p = arg;
 	struct imsg	 imsg;
 	ssize_t		 n;
+	size_t		 nwrite;
+	uint32_t	 queued;
 
 	p->events = 0;
 
@@ -174,16 +183,40 @@ mproc_dispatch(int fd, short event, void *arg)
 	}
 
 	if (event & EV_WRITE) {
-		n = msgbuf_write(&p->imsgbuf.w);
-		if (n == 0 || (n == -1 && errno != EAGAIN)) {
-			/* this pipe is dead, so remove the event handler */
-			log_debug("debug: %s -> %s: pipe closed",
-			    proc_name(smtpd_process),  p->name);
-			p->handler(p, NULL);
-			return;
+		/*
+		 * Everything composed since the last write goes out here,
+		 * but a message passing a fd ends a sendmsg() call, so keep
+		 * writing until the socket is full rather than waiting for
+		 * another loop iteration each time.
+		 */
+		queued = p->imsgbuf.w.queued;
+		nwrite = 0;
+		while (p->imsgbuf.w.queued) {
+			n = msgbuf_write(&p->imsgbuf.w);
+			if (n == -1 && errno == EAGAIN)
+				break;
+			if (n == 0 || n == -1) {
+				/* this pipe is dead, so remove the event handler */
+				log_debug("debug: %s -> %s: pipe closed",
+				    proc_name(smtpd_process),  p->name);
+				p->handler(p, NULL);
+				return;
+			}
+			nwrite++;
 		}
+
+		/* do not feed the logger with its own profile records */
+		if (profiling & PROFILE_IMSG && p->proc != PROC_LOGGER)
+			log_debug("profile-mproc: %s -> %s: %u imsg in %zu writes, "
+			    "%u queued",
+			    proc_name(smtpd_process),
+			    proc_name(p->proc),
+			    queued - p->imsgbuf.w.queued,
+			    nwrite,
+			    p->imsgbuf.w.queued);
 	}
 
+	clock_cache_enter();
 	for (;;) {
 		if ((n = imsg_get(&p->imsgbuf, &imsg)) == -1) {
 
@@ -192,6 +225,7 @@ mproc_dispatch(int fd, short event, void *arg)
 				log_warnx("warn: client sent invalid imsg "
 				    "over control socket");
 				p->handler(p, NULL);
+				clock_cache_leave();
 				return;
 			}
 			log_warn("fatal: %s: error in imsg_get for %s",
@@ -205,6 +239,7 @@ mproc_dispatch(int fd, short event, void *arg)
 
 		imsg_free(&imsg);
 	}
+	clock_cache_leave();
 
 	mproc_event_add(p);
 }
@@ -337,7 +372,8 @@ m_close(struct mproc *p)
 	    p->m_buf, p->m_pos) == -1)
 		fatal("imsg_compose");
 
-	log_trace(TRACE_MPROC, "mproc: %s -> %s : %zu %s",
+	if (p->m_type != IMSG_LOG)
+		log_trace(TRACE_MPROC, "mproc: %s -> %s : %zu %s",
 		    proc_name(smtpd_process),
 		    proc_name(p->proc),
 		    p->m_pos,
@@ -495,10 +531,25 @@ void
 m_add_envelope(struct mproc *m, const struct envelope *evp)
 {
 	char	buf[sizeof(*evp)];
+	int	len;
 
-	envelope_dump_buffer(evp, buf, sizeof(buf));
 	m_add_evpid(m, evp->id);
-	m_add_string(m, buf);
+
+	/* smtpctl reads envelopes forwarded by control in the ASCII form */
+	if (m->proc == PROC_CONTROL) {
+		envelope_dump_buffer(evp, buf, sizeof(buf));
+		m_add_string(m, buf);
+		return;
+	}
+
+	/*
+	 * All other processes run the same smtpd binary: the binary form
+	 * saves a text rendering and parsing on every hop, and carries its
+	 * format version anyway.
+	 */
+	if ((len = envelope_dump_binary(evp, buf, sizeof(buf))) == 0)
+		fatalx("failed to dump envelope");
+	m_add_data(m, buf, len);
 }
 
 void
@@ -629,14 +680,15 @@ void
 m_get_envelope(struct msg *m, struct envelope *evp)
 {
 	uint64_t	 evpid;
-	const char	*buf;
+	const void	*buf;
+	size_t		 len;
 
 	m_get_evpid(m, &evpid);
-	m_get_string(m, &buf);
+	m_get_data(m, &buf, &len);
 	if (buf == NULL)
 		fatalx("empty envelope buffer");
 
-	if (!envelope_load_buffer(evp, buf, strlen(buf)))
+	if (!envelope_load_buffer(evp, buf, len))
 		fatalx("failed to retrieve envelope");
 	evp->id = evpid;
 }
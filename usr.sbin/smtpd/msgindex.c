@@ -0,0 +1,189 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Message header indexes.
+ *
+ * The index of a message is built by the smtp session as the headers
+ * are written to the spool file, and stored by the queue next to the
+ * message.  It is a struct msgindex followed by one record per header,
+ * in the order of the message:
+ *
+ *	uint32_t	offset of the header line
+ *	uint32_t	length, continuation lines included
+ *	uint8_t		length of the name
+ *	char[]		name, not nul-terminated
+ *
+ * Records are not aligned and are read with memcpy().  The index is
+ * only a hint: a message may have none, and consumers read the message
+ * when it is missing.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smtpd.h"
+
+#define	MSGINDEX_RECORD		(sizeof(uint32_t) * 2 + sizeof(uint8_t))
+
+static int msgindex_grow(struct msgindex_buf *, size_t);
+
+void
+msgindex_add(struct msgindex_buf *mb, const char *name, off_t offset,
+    off_t end)
+{
+	uint32_t	o, l;
+	uint8_t		n;
+	size_t		namelen;
+
+	if (mb->invalid)
+		return;
+
+	namelen = strlen(name);
+	if (namelen > UINT8_MAX || end > UINT32_MAX ||
+	    !msgindex_grow(mb, MSGINDEX_RECORD + namelen)) {
+		mb->invalid = 1;
+		return;
+	}
+
+	o = offset;
+	l = end - offset;
+	n = namelen;
+	memcpy(mb->buf + mb->len, &o, sizeof o);
+	mb->len += sizeof o;
+	memcpy(mb->buf + mb->len, &l, sizeof l);
+	mb->len += sizeof l;
+	memcpy(mb->buf + mb->len, &n, sizeof n);
+	mb->len += sizeof n;
+	memcpy(mb->buf + mb->len, name, namelen);
+	mb->len += namelen;
+	mb->count++;
+}
+
+/*
+ * Complete the index with the end of the headers and the start of the
+ * body.  Return NULL when no index could be built for the message.
+ */
+const void *
+msgindex_end(struct msgindex_buf *mb, off_t hdrend, off_t body, size_t *len)
+{
+	struct msgindex	mi;
+
+	if (mb->invalid || body > UINT32_MAX || !msgindex_grow(mb, 0))
+		return (NULL);
+
+	mi.magic = MSGINDEX_MAGIC;
+	mi.count = mb->count;
+	mi.hdrend = hdrend;
+	mi.body = body;
+	memcpy(mb->buf, &mi, sizeof mi);
+
+	*len = mb->len;
+	return (mb->buf);
+}
+
+void
+msgindex_free(struct msgindex_buf *mb)
+{
+	free(mb->buf);
+	memset(mb, 0, sizeof *mb);
+}
+
+/*
+ * Check that an index is complete, as one stored without a sync may
+ * have been cut short by a crash.
+ */
+int
+msgindex_open(const void *buf, size_t len, struct msgindex *mi)
+{
+	struct msgindex_hdr	h;
+	size_t			pos = 0;
+	uint32_t		n = 0;
+
+	if (len < sizeof *mi)
+		return (0);
+	memcpy(mi, buf, sizeof *mi);
+	if (mi->magic != MSGINDEX_MAGIC)
+		return (0);
+
+	while (msgindex_next(buf, len, &pos, &h))
+		n++;
+	return (n == mi->count && pos == len);
+}
+
+/*
+ * Walk the headers of an index, starting with *pos set to 0.  Return 0
+ * past the last one, or if the index is truncated.
+ */
+int
+msgindex_next(const void *buf, size_t len, size_t *pos,
+    struct msgindex_hdr *h)
+{
+	const char	*p = buf;
+	uint32_t	 o, l;
+	uint8_t		 n;
+
+	if (*pos == 0)
+		*pos = sizeof(struct msgindex);
+	if (len < *pos || len - *pos < MSGINDEX_RECORD)
+		return (0);
+
+	memcpy(&o, p + *pos, sizeof o);
+	memcpy(&l, p + *pos + sizeof o, sizeof l);
+	memcpy(&n, p + *pos + sizeof o + sizeof l, sizeof n);
+	if (len - *pos - MSGINDEX_RECORD < n)
+		return (0);
+
+	h->offset = o;
+	h->len = l;
+	h->name = p + *pos + MSGINDEX_RECORD;
+	h->namelen = n;
+	*pos += MSGINDEX_RECORD + n;
+	return (1);
+}
+
+static int
+msgindex_grow(struct msgindex_buf *mb, size_t len)
+{
+	size_t	 size;
+	char	*buf;
+
+	if (mb->len == 0)
+		mb->len = sizeof(struct msgindex);
+	if (mb->len + len > MSGINDEX_MAX)
+		return (0);
+	if (mb->len + len <= mb->size)
+		return (1);
+
+	size = mb->size ? mb->size * 2 : 512;
+	while (size < mb->len + len)
+		size *= 2;
+	if (size > MSGINDEX_MAX)
+		size = MSGINDEX_MAX;
+	if ((buf = realloc(mb->buf, size)) == NULL)
+		return (0);
+	mb->buf = buf;
+	mb->size = size;
+	return (1);
+}
@@ -53,6 +53,78 @@
 #define DELAY_CHECK_SOURCE_FAST 0
 #define DELAY_CHECK_LIMIT	5
 
+/*
+ * While no connection to a relay is established yet, another route of
+ * the best MX preference level is tried every DELAY_CONNECT_STAGGER
+ * milliseconds, alternating address families, and the first attempt to
+ * connect wins (RFC 8305).
+ */
+#define DELAY_CONNECT_STAGGER	250
+
+/*
+ * With adaptive-conn-max set, the number of connections to a host starts
+ * at adaptive-conn-min and grows by one every time as many messages as
+ * allowed connections were accepted.  It is halved on a 4xx reply, a
+ * failed connection or a connect time AIMD_SPIKE times the average, at
+ * most once every AIMD_HOLDOFF seconds.
+ */
+#define AIMD_HOLDOFF		10
+#define AIMD_SPIKE		4
+#define AIMD_SPIKE_MIN		100	/* ms */
+
+/*
+ * Rate limits are token buckets refilled continuously at the configured
+ * number of messages or recipients per minute, holding at most
+ * RATE_BURST seconds worth of tokens.  A task is only handed out when
+ * every bucket on its way (domain, MX host and source address) can pay
+ * for it; a task larger than a bucket goes through when it is full.
+ */
+#define RATE_BURST		10
+
+/*
+ * Tasks carrying more recipients than the transaction-rcpt-max limit are
+ * split when handed to a session.  The number of tasks a relay keeps in
+ * memory before holding envelopes in the scheduler grows from task-hiwat
+ * up to TASK_WINDOW_SCALE times that to hold TASK_WINDOW seconds worth of
+ * work at the rate sessions take them.  Back at task-lowat, the relay asks
+ * for as many held envelopes as the window has room for, and never fewer
+ * than task-release.
+ *
+ * The holdq is named after the relay text rather than its id, so that the
+ * next generation can pick up what was held when the state is handed over
+ * on reload.  A relay of a new generation assumes it has envelopes held.
+ */
+#define TASK_WINDOW		10
+#define TASK_WINDOW_SCALE	8
+
+/*
+ * Once a relay knows several source addresses, the source-policy limit
+ * selects how the one to connect from is picked among them:
+ *
+ *   0	in the order the source table hands them out
+ *   1	the source with the fewest connections in flight
+ *   2	likewise, with the load weighted by the share of 4xx replies and
+ *	failed connections from that source for the relay domain, up to
+ *	SOURCE_TEMPFAIL_PENALTY times for a source that only got errors.
+ *	The counts are halved every SOURCE_DECAY seconds.
+ */
+#define SOURCE_TEMPFAIL_PENALTY	5
+#define SOURCE_DECAY		300
+
+/*
+ * A route whose replies take SLOW_MIN milliseconds on average, and
+ * SLOW_FACTOR times as long as those of the fastest other route of the
+ * relay, is marked slow for SLOW_TTL seconds.  It only gets a new
+ * connection when the relay has none, and its sessions leave new tasks
+ * to the other ready sessions of the relay.  A session on it waiting
+ * for a reply before the end of data for as long as the slow threshold
+ * hands its task back to the relay.  Once the mark expires, the route
+ * is measured again.
+ */
+#define SLOW_MIN		5000	/* ms */
+#define SLOW_FACTOR		4
+#define SLOW_TTL		300
+
 #define	DELAY_QUADRATIC		1
 #define DELAY_ROUTE_BASE	15
 #define DELAY_ROUTE_MAX		3600
@@ -60,7 +132,40 @@
 #define RELAY_ONHOLD		0x01
 #define RELAY_HOLDQ		0x02
 
+/*
+ * libtls keeps the client session in the file of a tls_config, so the
+ * mta has MTA_TLS_SESSIONS session files, opened before the chroot, and
+ * gives each host of a relay dispatcher a config using one of them.
+ * The least recently used goes to a new host.  The configs are built
+ * from copies of the certificates taken before the pki are purged.
+ */
+#define MTA_TLS_SESSIONS	32
+
+struct mta_tls_cache {
+	struct dict		 hosts;
+	uint8_t			*cert;
+	size_t			 cert_len;
+	uint8_t			*ca;
+	size_t			 ca_len;
+	int			 dhe;
+};
+
+struct mta_tls_slot {
+	TAILQ_ENTRY(mta_tls_slot)	 entry;
+	struct dispatcher_remote	*remote;
+	char				*host;
+	struct tls_config		*config;
+	int				 fd;
+};
+
+static struct mta_tls_slot	tls_slots[MTA_TLS_SESSIONS];
+static TAILQ_HEAD(mta_tls_lru, mta_tls_slot) tls_lru =
+    TAILQ_HEAD_INITIALIZER(tls_lru);
+
 static void mta_setup_dispatcher(struct dispatcher *);
+static void mta_setup_sessions(void);
+static void mta_tls_configure(struct dispatcher_remote *,
+    struct tls_config *);
 static void mta_handle_envelope(struct envelope *, const char *);
 static void mta_query_smarthost(struct envelope *);
 static void mta_on_smarthost(struct envelope *, const char *);
@@ -73,6 +178,22 @@ static void mta_on_secret(struct mta_relay *, const char *);
 static void mta_on_preference(struct mta_relay *, int);
 static void mta_on_source(struct mta_relay *, struct mta_source *);
 static void mta_on_timeout(struct runq *, void *);
+static void mta_on_stagger(int, short, void *);
+static int mta_connect_pooled(struct mta_connector *);
+static size_t mta_host_maxconn(struct mta_host *, struct mta_limits *);
+static int mta_rate_check(struct mta_bucket *, size_t, int64_t, int64_t);
+static void mta_rate_take(struct mta_bucket *, size_t, int64_t);
+static struct mta_task *mta_task_split(struct mta_relay *, struct mta_task *,
+    size_t);
+static size_t mta_relay_hiwat(struct mta_relay *);
+static uint64_t mta_relay_holdq(struct mta_relay *);
+static void mta_source_feedback(struct mta_relay *, struct mta_route *, int);
+static void mta_source_decay(struct mta_connector *, time_t);
+static int64_t mta_source_weight_load(struct mta_connector *);
+static int64_t mta_source_weight_tempfail(struct mta_connector *);
+static struct mta_connector *mta_source_pick(struct mta_relay *,
+    struct mta_connector *);
+static void mta_relay_resize(struct mta_relay *, int64_t);
 static void mta_connect(struct mta_connector *);
 static void mta_route_enable(struct mta_route *);
 static void mta_route_disable(struct mta_route *, int, int);
@@ -100,7 +221,7 @@ static int mta_host_cmp(const struct mta_host *, const struct mta_host *);
 SPLAY_PROTOTYPE(mta_host_tree, mta_host, entry, mta_host_cmp);
 
 SPLAY_HEAD(mta_domain_tree, mta_domain);
-static struct mta_domain *mta_domain(char *, int);
+static struct mta_domain *mta_domain(const char *, int);
 #if 0
 static void mta_domain_ref(struct mta_domain *);
 #endif
@@ -123,6 +244,8 @@ static const char *mta_connector_to_text(struct mta_connector *);
 
 SPLAY_HEAD(mta_route_tree, mta_route);
 static struct mta_route *mta_route(struct mta_source *, struct mta_host *);
+static int mta_route_is_slow(struct mta_route *, time_t);
+static int64_t mta_route_fastest(struct mta_relay *, struct mta_route *);
 static void mta_route_ref(struct mta_route *);
 static void mta_route_unref(struct mta_route *);
 static const char *mta_route_to_text(struct mta_route *);
@@ -132,13 +255,14 @@ SPLAY_PROTOTYPE(mta_route_tree, mta_route, entry, mta_route_cmp);
 struct mta_block {
 	SPLAY_ENTRY(mta_block)	 entry;
 	struct mta_source	*source;
-	char			*domain;
+	const char		*domain;	/* interned */
+	uint64_t		 id;
 };
 
 SPLAY_HEAD(mta_block_tree, mta_block);
 void mta_block(struct mta_source *, char *);
 void mta_unblock(struct mta_source *, char *);
-int mta_is_blocked(struct mta_source *, char *);
+int mta_is_blocked(struct mta_source *, const char *);
 static int mta_block_cmp(const struct mta_block *, const struct mta_block *);
 SPLAY_PROTOTYPE(mta_block_tree, mta_block, entry, mta_block_cmp);
 
@@ -155,6 +279,13 @@ static struct mta_source_tree		sources;
 static struct mta_route_tree		routes;
 static struct mta_block_tree		blocks;
 
+/*
+ * Bumped whenever the state examined by mta_find_route() changes, so
+ * that a connector woken up again before anything changed and before
+ * any delay expired can reuse its last fruitless search.
+ */
+static uint64_t	routes_gen = 1;
+
 static struct tree wait_mx;
 static struct tree wait_preference;
 static struct tree wait_secret;
@@ -166,25 +297,64 @@ static struct event ev_flush_evp;
 static struct runq *runq_relay;
 static struct runq *runq_connector;
 static struct runq *runq_route;
-static struct runq *runq_hoststat;
+
+static int64_t (*mta_source_policies[])(struct mta_connector *) = {
+	NULL,
+	mta_source_weight_load,
+	mta_source_weight_tempfail,
+};
 
 static time_t	max_seen_conndelay_route;
 static time_t	max_seen_discdelay_route;
 
+/*
+ * Entries all live for the same delay after their last update, so the
+ * LRU list is also ordered by expiry: its tail is the next entry to
+ * expire and a single timer is enough.  The table is bounded, the least
+ * recently updated host is evicted to make room.
+ */
 #define	HOSTSTAT_EXPIRE_DELAY	(4 * 3600)
+#define	HOSTSTAT_MAX		16384
 struct hoststat {
+	TAILQ_ENTRY(hoststat)	 entry;
 	char			 name[HOST_NAME_MAX+1];
 	time_t			 tm;
-	char			 error[LINE_MAX];
-	struct tree		 deferred;
+	char			*error;
+	uint64_t		*deferred;
+	size_t			 ndeferred;
+	size_t			 szdeferred;
 };
 static struct dict hoststat;
+static TAILQ_HEAD(hoststat_lru, hoststat) hoststat_lru;
+static struct event ev_hoststat;
+
+/*
+ * The answers of the lka that only depend on the relay, its credentials
+ * and our backup MX preference, and the smarthost of a domain, are kept
+ * for LOOKUP_TTL seconds after the relay that asked for them is gone,
+ * so that a relay created again shortly after starts immediately.
+ * Failures are not kept.  The lka tells when one of its tables changed
+ * and everything is dropped then.
+ */
+#define	LOOKUP_TTL		300
+#define	LOOKUP_MAX		4096
+struct mta_lookup {
+	char			*value;
+	int			 preference;
+	time_t			 expire;
+};
+static struct dict lookups;
+
+static struct mta_lookup *mta_lookup_get(const char *);
+static void mta_lookup_set(const char *, const char *, int);
+static void mta_lookup_flush(void);
 
 void mta_hoststat_update(const char *, const char *);
 void mta_hoststat_cache(const char *, uint64_t);
 void mta_hoststat_uncache(const char *, uint64_t);
 void mta_hoststat_reschedule(const char *);
 static void mta_hoststat_remove_entry(struct hoststat *);
+static void mta_hoststat_expire(int, short, void *);
 
 void
 mta_imsg(struct mproc *p, struct imsg *imsg)
@@ -198,8 +368,10 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 	struct mta_source	*source;
 	struct hoststat		*hs;
 	struct sockaddr_storage	 ss;
-	struct envelope		 evp, *e;
+	struct envelope		 evp, msg, *e;
 	struct msg		 m;
+	const void		*data;
+	size_t			 len;
 	const char		*secret;
 	const char		*hostname;
 	const char		*dom;
@@ -214,9 +386,21 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 	switch (imsg->hdr.type) {
 	case IMSG_QUEUE_TRANSFER:
 		m_msg(&m, imsg);
-		m_get_envelope(&m, &evp);
+		m_get_data(&m, &data, &len);
+		if (data == NULL ||
+		    !envelope_load_binary_fields(&msg, data, len, NULL, 0))
+			fatalx("mta: failed to load message fields");
+		while (!m_is_eom(&m)) {
+			m_get_evpid(&m, &u64);
+			m_get_data(&m, &data, &len);
+			evp = msg;
+			if (data == NULL ||
+			    !envelope_load_binary_fields(&evp, NULL, 0, data, len))
+				fatalx("mta: failed to load envelope");
+			evp.id = u64;
+			mta_handle_envelope(&evp, NULL);
+		}
 		m_end(&m);
-		mta_handle_envelope(&evp, NULL);
 		return;
 
 	case IMSG_MTA_OPEN_MESSAGE:
@@ -229,9 +413,18 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_string(&m, &secret);
 		m_end(&m);
 		relay = tree_xpop(&wait_secret, reqid);
+		if (secret[0]) {
+			(void)snprintf(buf, sizeof buf, "secret:%s:%s",
+			    relay->authtable, relay->authlabel);
+			mta_lookup_set(buf, secret, 0);
+		}
 		mta_on_secret(relay, secret[0] ? secret : NULL);
 		return;
 
+	case IMSG_LKA_TABLE_CHANGED:
+		mta_lookup_flush();
+		return;
+
 	case IMSG_MTA_LOOKUP_SOURCE:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
@@ -271,16 +464,18 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 		m_end(&m);
 		domain = tree_xget(&wait_mx, reqid);
 		mx = xcalloc(1, sizeof *mx);
-		mx->mxname = xstrdup(hostname);
+		mx->mxname = intern_domain(hostname);
 		mx->host = mta_host((struct sockaddr*)&ss);
 		mx->preference = preference;
 		TAILQ_FOREACH(imx, &domain->mxs, entry) {
 			if (imx->preference > mx->preference) {
 				TAILQ_INSERT_BEFORE(imx, mx, entry);
+				routes_gen++;
 				return;
 			}
 		}
 		TAILQ_INSERT_TAIL(&domain->mxs, mx, entry);
+		routes_gen++;
 		return;
 
 	case IMSG_MTA_DNS_HOST_END:
@@ -302,7 +497,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			log_debug("debug: Failed MX query for %s:",
 			    domain->name);
 		}
-		domain->lastmxquery = time(NULL);
+		domain->lastmxquery = clock_cached();
 		waitq_run(&domain->mxs, domain);
 		return;
 
@@ -321,6 +516,11 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			    mta_relay_to_text(relay), dnserror);
 			preference = INT_MAX;
 		}
+		else {
+			(void)snprintf(buf, sizeof buf, "preference:%s:%s",
+			    relay->domain->name, relay->backupname);
+			mta_lookup_set(buf, NULL, preference);
+		}
 		mta_on_preference(relay, preference);
 		return;
 
@@ -346,6 +546,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 				route->flags |= ROUTE_NEW;
 				route->nerror = 0;
 				route->penalty = 0;
+				routes_gen++;
 				mta_route_unref(route); /* from mta_route_disable */
 			}
 
@@ -355,14 +556,15 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 		return;
 
 	case IMSG_CTL_MTA_SHOW_HOSTS:
-		t = time(NULL);
+		t = clock_cached();
 		SPLAY_FOREACH(host, mta_host_tree, &hosts) {
 			(void)snprintf(buf, sizeof(buf),
-			    "%s %s refcount=%d nconn=%zu lastconn=%s",
+			    "%s %s refcount=%d nconn=%zu maxconn=%zu lastconn=%s",
 			    sockaddr_to_text(host->sa),
 			    host->ptrname,
 			    host->refcount,
 			    host->nconn,
+			    host->maxconn,
 			    host->lastconn ? duration_to_text(t - host->lastconn) : "-");
 			m_compose(p, IMSG_CTL_MTA_SHOW_HOSTS,
 			    imsg->hdr.peerid, 0, -1,
@@ -373,7 +575,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 		return;
 
 	case IMSG_CTL_MTA_SHOW_RELAYS:
-		t = time(NULL);
+		t = clock_cached();
 		SPLAY_FOREACH(relay, mta_relay_tree, &relays)
 			mta_relay_show(relay, p, imsg->hdr.peerid, t);
 		m_compose(p, IMSG_CTL_MTA_SHOW_RELAYS, imsg->hdr.peerid,
@@ -384,17 +586,20 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 		SPLAY_FOREACH(route, mta_route_tree, &routes) {
 			v = runq_pending(runq_route, route, &t);
 			(void)snprintf(buf, sizeof(buf),
-			    "%llu. %s %c%c%c%c nconn=%zu nerror=%d penalty=%d timeout=%s",
+			    "%llu. %s %c%c%c%c%c nconn=%zu nerror=%d penalty=%d "
+			    "rtt=%lldms timeout=%s",
 			    (unsigned long long)route->id,
 			    mta_route_to_text(route),
 			    route->flags & ROUTE_NEW ? 'N' : '-',
 			    route->flags & ROUTE_DISABLED ? 'D' : '-',
 			    route->flags & ROUTE_RUNQ ? 'Q' : '-',
 			    route->flags & ROUTE_KEEPALIVE ? 'K' : '-',
+			    route->flags & ROUTE_SLOW ? 'S' : '-',
 			    route->nconn,
 			    route->nerror,
 			    route->penalty,
-			    v ? duration_to_text(t - time(NULL)) : "-");
+			    (long long)route->rtt,
+			    v ? duration_to_text(t - clock_cached()) : "-");
 			m_compose(p, IMSG_CTL_MTA_SHOW_ROUTES,
 			    imsg->hdr.peerid, 0, -1,
 			    buf, strlen(buf) + 1);
@@ -465,6 +670,12 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 		m_compose(p, IMSG_CTL_MTA_SHOW_BLOCK, imsg->hdr.peerid,
 		    0, -1, NULL, 0);
 		return;
+
+	case IMSG_CTL_MTA_SHOW_DESTINATIONS:
+		mta_stat_show(p, imsg->hdr.peerid);
+		m_compose(p, IMSG_CTL_MTA_SHOW_DESTINATIONS, imsg->hdr.peerid,
+		    0, -1, NULL, 0);
+		return;
 	}
 
 	fatalx("mta_imsg: unexpected %s imsg", imsg_to_str(imsg->hdr.type));
@@ -477,8 +688,10 @@ mta_postfork(void)
 	const char *key;
 	void *iter;
 
+	mta_setup_sessions();
+
 	iter = NULL;
-	while (dict_iter(env->sc_dispatchers, &iter, &key, (void **)&dispatcher)) {
+	while (hdict_iter(env->sc_dispatchers, &iter, &key, (void **)&dispatcher)) {
 		log_debug("%s: %s", __func__, key);
 		mta_setup_dispatcher(dispatcher);
 	}
@@ -488,20 +701,75 @@ static void
 mta_setup_dispatcher(struct dispatcher *dispatcher)
 {
 	struct dispatcher_remote *remote;
-	static const char *dheparams[] = { "none", "auto", "legacy" };
+	struct mta_tls_cache *cache;
 	struct tls_config *config;
 	struct pki *pki;
 	struct ca *ca;
-	const char *ciphers;
-	uint32_t protos;
 
 	if (dispatcher->type != DISPATCHER_REMOTE)
 		return;
 
 	remote = &dispatcher->u.remote;
+	cache = xcalloc(1, sizeof(*cache));
+	dict_init(&cache->hosts);
 
+	if (remote->pki) {
+		pki = dict_get(env->sc_pki_dict, remote->pki);
+		if (pki == NULL)
+			fatalx("client pki \"%s\" not found", remote->pki);
+		cache->cert = xmemdup(pki->pki_cert, pki->pki_cert_len);
+		cache->cert_len = pki->pki_cert_len;
+		cache->dhe = pki->pki_dhe;
+	}
+
+	if (remote->ca) {
+		ca = dict_get(env->sc_ca_dict, remote->ca);
+		cache->ca = xmemdup(ca->ca_cert, ca->ca_cert_len);
+		cache->ca_len = ca->ca_cert_len;
+	}
+	else if ((cache->ca = tls_load_file(tls_default_ca_cert_file(),
+	    &cache->ca_len, NULL)) == NULL)
+		fatal("tls_load_file: %s", tls_default_ca_cert_file());
+
+	remote->tls_sessions = cache;
+
+	/* report the errors of the settings now */
 	if ((config = tls_config_new()) == NULL)
 		fatal("smtpd: tls_config_new");
+	mta_tls_configure(remote, config);
+	tls_config_free(config);
+}
+
+/* the session files, owned by the user libtls checks them against */
+static void
+mta_setup_sessions(void)
+{
+	struct passwd *pw;
+	char path[PATH_MAX];
+	size_t i;
+
+	if ((pw = getpwnam(SMTPD_USER)) == NULL)
+		fatalx("unknown user " SMTPD_USER);
+
+	for (i = 0; i < MTA_TLS_SESSIONS; i++) {
+		(void)strlcpy(path, "/tmp/smtpd.session.XXXXXXXXXX",
+		    sizeof(path));
+		if ((tls_slots[i].fd = mkstemp(path)) == -1)
+			fatal("mkstemp");
+		unlink(path);
+		if (fchown(tls_slots[i].fd, pw->pw_uid, pw->pw_gid) == -1)
+			fatal("fchown");
+		TAILQ_INSERT_TAIL(&tls_lru, &tls_slots[i], entry);
+	}
+}
+
+static void
+mta_tls_configure(struct dispatcher_remote *remote, struct tls_config *config)
+{
+	static const char *dheparams[] = { "none", "auto", "legacy" };
+	struct mta_tls_cache *cache = remote->tls_sessions;
+	const char *ciphers;
+	uint32_t protos;
 
 	ciphers = env->sc_tls_ciphers;
 	if (remote->tls_ciphers)
@@ -518,30 +786,17 @@ mta_setup_dispatcher(struct dispatcher *dispatcher)
 			fatalx("%s", tls_config_error(config));
 	}
 
-	if (remote->pki) {
-		pki = dict_get(env->sc_pki_dict, remote->pki);
-		if (pki == NULL)
-			fatalx("client pki \"%s\" not found", remote->pki);
-
-		tls_config_set_dheparams(config, dheparams[pki->pki_dhe]);
+	if (cache->cert) {
+		tls_config_set_dheparams(config, dheparams[cache->dhe]);
 		tls_config_use_fake_private_key(config);
-		if (tls_config_set_keypair_mem(config, pki->pki_cert,
-		    pki->pki_cert_len, NULL, 0) == -1)
+		if (tls_config_set_keypair_mem(config, cache->cert,
+		    cache->cert_len, NULL, 0) == -1)
 			fatalx("tls_config_set_keypair_mem: %s",
 			    tls_config_error(config));
 	}
 
-	if (remote->ca) {
-		ca = dict_get(env->sc_ca_dict, remote->ca);
-		if (tls_config_set_ca_mem(config, ca->ca_cert, ca->ca_cert_len)
-		    == -1)
-			fatalx("tls_config_set_ca_mem: %s",
-			    tls_config_error(config));
-	}
-	else if (tls_config_set_ca_file(config, tls_default_ca_cert_file())
-	    == -1)
-		fatalx("tls_config_set_ca_file: %s",
-		    tls_config_error(config));
+	if (tls_config_set_ca_mem(config, cache->ca, cache->ca_len) == -1)
+		fatalx("tls_config_set_ca_mem: %s", tls_config_error(config));
 
 	if (remote->tls_verify) {
 		tls_config_verify(config);
@@ -550,8 +805,48 @@ mta_setup_dispatcher(struct dispatcher *dispatcher)
 		tls_config_insecure_noverifyname(config);
 		tls_config_insecure_noverifytime(config);
 	}
+}
+
+/* the config holding the client session for a host, or NULL */
+struct tls_config *
+mta_tls_config(struct dispatcher_remote *remote, const char *host)
+{
+	struct mta_tls_cache *cache = remote->tls_sessions;
+	struct mta_tls_slot *slot;
+
+	if ((slot = dict_get(&cache->hosts, host)) == NULL) {
+		slot = TAILQ_LAST(&tls_lru, mta_tls_lru);
+		if (slot->remote) {
+			dict_xpop(&slot->remote->tls_sessions->hosts,
+			    slot->host);
+			free(slot->host);
+			slot->remote = NULL;
+			tls_config_free(slot->config);
+			slot->config = NULL;
+			if (ftruncate(slot->fd, 0) == -1)
+				log_warn("warn: mta: ftruncate");
+		}
+		if ((slot->config = tls_config_new()) == NULL)
+			return (NULL);
+		if (tls_config_set_session_fd(slot->config, slot->fd) == -1) {
+			log_warnx("warn: mta: tls_config_set_session_fd: %s",
+			    tls_config_error(slot->config));
+			tls_config_free(slot->config);
+			slot->config = NULL;
+			return (NULL);
+		}
+		mta_tls_configure(remote, slot->config);
+		slot->remote = remote;
+		slot->host = xstrdup(host);
+		dict_xset(&cache->hosts, slot->host, slot);
+	}
+	TAILQ_REMOVE(&tls_lru, slot, entry);
+	TAILQ_INSERT_HEAD(&tls_lru, slot, entry);
+
+	if (remote->tls_verify)
+		tls_config_verify(slot->config);
 
-	remote->tls_config = config;
+	return (slot->config);
 }
 
 void
@@ -570,14 +865,16 @@ mta_postprivdrop(void)
 	tree_init(&wait_preference);
 	tree_init(&wait_source);
 	tree_init(&flush_evp);
+	dict_init(&lookups);
 	dict_init(&hoststat);
+	TAILQ_INIT(&hoststat_lru);
 
 	evtimer_set(&ev_flush_evp, mta_delivery_flush_event, NULL);
+	evtimer_set(&ev_hoststat, mta_hoststat_expire, NULL);
 
 	runq_init(&runq_relay, mta_on_timeout);
 	runq_init(&runq_connector, mta_on_timeout);
 	runq_init(&runq_route, mta_on_timeout);
-	runq_init(&runq_hoststat, mta_on_timeout);
 }
 
 
@@ -626,6 +923,7 @@ mta_route_ok(struct mta_relay *relay, struct mta_route *route)
 
 	route->nerror = 0;
 	route->flags &= ~ROUTE_NEW;
+	routes_gen++;
 
 	c = mta_connector(relay, route->src);
 	mta_connect(c);
@@ -640,7 +938,293 @@ mta_route_down(struct mta_relay *relay, struct mta_route *route)
 }
 
 void
-mta_route_collect(struct mta_relay *relay, struct mta_route *route)
+mta_route_success(struct mta_relay *relay, struct mta_route *route)
+{
+	struct mta_host		*h = route->dst;
+	struct mta_limits	*l = relay->limits;
+	size_t			 maxconn;
+
+	mta_source_feedback(relay, route, 1);
+
+	if (l->adaptive_max == 0)
+		return;
+
+	maxconn = mta_host_maxconn(h, l);
+	if (++h->nsuccess < maxconn || maxconn >= l->adaptive_max)
+		return;
+
+	h->nsuccess = 0;
+	h->maxconn = maxconn + 1;
+	routes_gen++;
+	log_debug("debug: mta: raising concurrency on %s to %zu",
+	    mta_host_to_text(h), h->maxconn);
+}
+
+void
+mta_route_congested(struct mta_relay *relay, struct mta_route *route,
+    const char *reason)
+{
+	struct mta_host		*h = route->dst;
+	struct mta_limits	*l = relay->limits;
+	size_t			 maxconn;
+	time_t			 now;
+
+	mta_source_feedback(relay, route, 0);
+
+	if (l->adaptive_max == 0)
+		return;
+
+	now = clock_cached();
+	h->nsuccess = 0;
+	if (h->lastcut + AIMD_HOLDOFF > now)
+		return;
+	h->lastcut = now;
+
+	maxconn = mta_host_maxconn(h, l) / 2;
+	if (maxconn < l->adaptive_min)
+		maxconn = l->adaptive_min;
+	if (maxconn < 1)
+		maxconn = 1;
+	if (maxconn == h->maxconn)
+		return;
+
+	h->maxconn = maxconn;
+	routes_gen++;
+	log_info("smtp-out: Reducing concurrency on %s to %zu: %s",
+	    mta_host_to_text(h), h->maxconn, reason);
+	stat_increment("mta.host.congested", 1);
+}
+
+static void
+mta_source_feedback(struct mta_relay *relay, struct mta_route *route, int ok)
+{
+	struct mta_connector	*c;
+
+	c = tree_get(&relay->connectors, (uintptr_t)(route->src));
+	if (c == NULL)
+		return;
+
+	mta_source_decay(c, clock_cached());
+	if (ok)
+		c->nok += 1;
+	else
+		c->ntempfail += 1;
+}
+
+static void
+mta_source_decay(struct mta_connector *c, time_t now)
+{
+	if (c->lastdecay == 0)
+		c->lastdecay = now;
+	while (c->lastdecay + SOURCE_DECAY <= now) {
+		c->nok /= 2;
+		c->ntempfail /= 2;
+		c->lastdecay += SOURCE_DECAY;
+		if (c->nok == 0 && c->ntempfail == 0)
+			c->lastdecay = now;
+	}
+}
+
+static int64_t
+mta_source_weight_load(struct mta_connector *c)
+{
+	return (c->source->nconn);
+}
+
+static int64_t
+mta_source_weight_tempfail(struct mta_connector *c)
+{
+	size_t	total;
+	int64_t	penalty;
+
+	mta_source_decay(c, clock_cached());
+	total = c->nok + c->ntempfail;
+	penalty = 0;
+	if (total)
+		penalty = (SOURCE_TEMPFAIL_PENALTY - 1) * 100 *
+		    c->ntempfail / total;
+
+	return ((c->source->nconn + 1) * (100 + penalty));
+}
+
+/*
+ * Return the usable connector with the lowest weight under the relay
+ * source policy, or c itself if none beats it.
+ */
+static struct mta_connector *
+mta_source_pick(struct mta_relay *relay, struct mta_connector *c)
+{
+	int64_t			(*weight)(struct mta_connector *);
+	struct mta_connector	*o, *best;
+	int64_t			 w, wbest;
+	void			*iter;
+	int			 policy;
+
+	policy = relay->limits->source_policy;
+	if (policy < 0 || (size_t)policy >= nitems(mta_source_policies) ||
+	    (weight = mta_source_policies[policy]) == NULL)
+		return (c);
+
+	best = c;
+	wbest = weight(c);
+	iter = NULL;
+	while (tree_iter(&relay->connectors, &iter, NULL, (void **)&o)) {
+		if (o == c || o->flags & (CONNECTOR_ERROR | CONNECTOR_LIMIT |
+		    CONNECTOR_NEW | CONNECTOR_WAIT | CONNECTOR_STAGGER))
+			continue;
+		if ((w = weight(o)) < wbest) {
+			best = o;
+			wbest = w;
+		}
+	}
+
+	if (best != c)
+		log_debug("debug: mta: source policy prefers %s",
+		    mta_source_to_text(best->source));
+	return (best);
+}
+
+void
+mta_route_latency(struct mta_relay *relay, struct mta_route *route,
+    int64_t ms)
+{
+	struct mta_host	*h = route->dst;
+
+	if (relay->limits->adaptive_max == 0)
+		return;
+
+	if (h->srtt && ms > AIMD_SPIKE_MIN && ms > h->srtt * AIMD_SPIKE)
+		mta_route_congested(relay, route, "connect latency spike");
+
+	h->srtt = h->srtt ? (h->srtt * 7 + ms) / 8 : ms;
+}
+
+void
+mta_route_reply(struct mta_relay *relay, struct mta_route *route, int64_t ms)
+{
+	int64_t	best;
+	int	slow;
+
+	route->rtt = route->rtt ? (route->rtt * 7 + ms) / 8 : ms;
+
+	slow = 0;
+	best = 0;
+	if (route->rtt >= SLOW_MIN) {
+		best = mta_route_fastest(relay, route);
+		slow = best && route->rtt > best * SLOW_FACTOR;
+	}
+
+	if (slow) {
+		route->lastslow = clock_cached();
+		if (route->flags & ROUTE_SLOW)
+			return;
+		route->flags |= ROUTE_SLOW;
+		routes_gen++;
+		log_info("smtp-out: Route %s is slow: replies take %lldms, "
+		    "%lldms on the fastest route", mta_route_to_text(route),
+		    (long long)route->rtt, (long long)best);
+		stat_increment("mta.route.slow", 1);
+	}
+	else if (route->flags & ROUTE_SLOW) {
+		route->flags &= ~ROUTE_SLOW;
+		routes_gen++;
+		log_info("smtp-out: Route %s is no longer slow",
+		    mta_route_to_text(route));
+	}
+}
+
+/*
+ * Whether sessions on the route should leave the tasks of the relay to
+ * its ready sessions on other routes.
+ */
+int
+mta_route_slow(struct mta_relay *relay, struct mta_route *route)
+{
+	if (!mta_route_is_slow(route, clock_cached()))
+		return 0;
+
+	return relay->nconn_ready > route->nconn;
+}
+
+/*
+ * How long a session on the route may wait for a reply before handing
+ * its task back to the relay, or 0 to wait for the usual timeout.
+ */
+int64_t
+mta_route_stall(struct mta_relay *relay, struct mta_route *route)
+{
+	int64_t	ms;
+
+	if (!mta_route_slow(relay, route))
+		return 0;
+
+	ms = mta_route_fastest(relay, route) * SLOW_FACTOR;
+	return ms < SLOW_MIN ? SLOW_MIN : ms;
+}
+
+static int
+mta_route_is_slow(struct mta_route *route, time_t now)
+{
+	if (!(route->flags & ROUTE_SLOW))
+		return 0;
+	if (route->lastslow + SLOW_TTL > now)
+		return 1;
+
+	log_debug("debug: mta: measuring route %s again",
+	    mta_route_to_text(route));
+	route->flags &= ~ROUTE_SLOW;
+	route->rtt = 0;
+	return 0;
+}
+
+/*
+ * The lowest reply time measured on the routes the relay may use, from
+ * its sources to its MXs, other than the given one.
+ */
+static int64_t
+mta_route_fastest(struct mta_relay *relay, struct mta_route *route)
+{
+	struct mta_connector	*c;
+	struct mta_mx		*mx;
+	struct mta_route	 key, *r;
+	int64_t			 best;
+	void			*iter;
+
+	best = 0;
+	iter = NULL;
+	while (tree_iter(&relay->connectors, &iter, NULL, (void **)&c)) {
+		TAILQ_FOREACH(mx, &relay->domain->mxs, entry) {
+			key.src = c->source;
+			key.dst = mx->host;
+			r = SPLAY_FIND(mta_route_tree, &routes, &key);
+			if (r == NULL || r == route || r->rtt == 0)
+				continue;
+			if (best == 0 || r->rtt < best)
+				best = r->rtt;
+		}
+	}
+
+	return best;
+}
+
+static size_t
+mta_host_maxconn(struct mta_host *h, struct mta_limits *l)
+{
+	if (l->adaptive_max == 0)
+		return l->maxconn_per_host;
+
+	if (h->maxconn < l->adaptive_min)
+		h->maxconn = l->adaptive_min;
+	if (h->maxconn > l->adaptive_max)
+		h->maxconn = l->adaptive_max;
+	if (h->maxconn < 1)
+		h->maxconn = 1;
+	return h->maxconn;
+}
+
+void
+mta_route_collect(struct mta_relay *relay, struct mta_route *route,
+    int cancelled)
 {
 	struct mta_connector	*c;
 
@@ -652,10 +1236,11 @@ mta_route_collect(struct mta_relay *relay, struct mta_route *route)
 	route->nconn -= 1;
 	route->src->nconn -= 1;
 	route->dst->nconn -= 1;
-	route->lastdisc = time(NULL);
+	route->lastdisc = clock_cached();
+	routes_gen++;
 
 	/* First connection failed */
-	if (route->flags & ROUTE_NEW)
+	if ((route->flags & ROUTE_NEW) && !cancelled)
 		mta_route_disable(route, 1, ROUTE_DISABLED_NET);
 
 	c = mta_connector(relay, route->src);
@@ -665,33 +1250,111 @@ mta_route_collect(struct mta_relay *relay, struct mta_route *route)
 	mta_relay_unref(relay); /* from mta_connect() */
 }
 
+static int
+mta_rate_check(struct mta_bucket *b, size_t rate, int64_t cost, int64_t now)
+{
+	int64_t	full;
+
+	if (rate == 0)
+		return 1;
+
+	/* tokens are kept in units of 1/60000 so one minute is exact */
+	full = (int64_t)rate * RATE_BURST * 1000;
+	if (b->last == 0)
+		b->level = full;
+	else
+		b->level += (now - b->last) * (int64_t)rate;
+	if (b->level > full)
+		b->level = full;
+	b->last = now;
+
+	return b->level >= cost * 60000 || b->level == full;
+}
+
+static void
+mta_rate_take(struct mta_bucket *b, size_t rate, int64_t cost)
+{
+	if (rate)
+		b->level -= cost * 60000;
+}
+
 struct mta_task *
 mta_route_next_task(struct mta_relay *relay, struct mta_route *route)
 {
-	struct mta_task	*task;
+	struct mta_task		*task;
+	struct mta_envelope	*e;
+	struct mta_limits	*l = relay->limits;
+	struct timespec		 ts;
+	int64_t			 now, nrcpt;
+	size_t			 n;
+
+	if ((task = TAILQ_FIRST(&relay->tasks)) && l->max_rcpt_per_transaction)
+		task = mta_task_split(relay, task, l->max_rcpt_per_transaction);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	if (task &&
+	    (l->mailrate_domain || l->mailrate_host || l->mailrate_source ||
+	    l->rcptrate_domain || l->rcptrate_host || l->rcptrate_source)) {
+		nrcpt = 0;
+		TAILQ_FOREACH(e, &task->envelopes, entry)
+			nrcpt++;
+
+		if (!mta_rate_check(&relay->domain->mailrate,
+		    l->mailrate_domain, 1, now) ||
+		    !mta_rate_check(&relay->domain->rcptrate,
+		    l->rcptrate_domain, nrcpt, now) ||
+		    !mta_rate_check(&route->dst->mailrate,
+		    l->mailrate_host, 1, now) ||
+		    !mta_rate_check(&route->dst->rcptrate,
+		    l->rcptrate_host, nrcpt, now) ||
+		    !mta_rate_check(&route->src->mailrate,
+		    l->mailrate_source, 1, now) ||
+		    !mta_rate_check(&route->src->rcptrate,
+		    l->rcptrate_source, nrcpt, now)) {
+			log_debug("debug: mta: rate limit reached on %s",
+			    mta_route_to_text(route));
+			stat_increment("mta.rate.limited", 1);
+			return (NULL);
+		}
+
+		mta_rate_take(&relay->domain->mailrate, l->mailrate_domain, 1);
+		mta_rate_take(&relay->domain->rcptrate, l->rcptrate_domain,
+		    nrcpt);
+		mta_rate_take(&route->dst->mailrate, l->mailrate_host, 1);
+		mta_rate_take(&route->dst->rcptrate, l->rcptrate_host, nrcpt);
+		mta_rate_take(&route->src->mailrate, l->mailrate_source, 1);
+		mta_rate_take(&route->src->rcptrate, l->rcptrate_source, nrcpt);
+	}
 
-	if ((task = TAILQ_FIRST(&relay->tasks))) {
+	if (task) {
 		TAILQ_REMOVE(&relay->tasks, task, entry);
 		relay->ntask -= 1;
 		task->relay = NULL;
+		relay->taskout += 1;
 
 		/* When the number of tasks is down to lowat, query some evp */
 		if (relay->ntask == (size_t)relay->limits->task_lowat) {
+			mta_relay_resize(relay, now);
 			if (relay->state & RELAY_ONHOLD) {
 				log_info("smtp-out: back to lowat on %s: releasing",
 				    mta_relay_to_text(relay));
 				relay->state &= ~RELAY_ONHOLD;
 			}
 			if (relay->state & RELAY_HOLDQ) {
+				n = mta_relay_hiwat(relay) - relay->ntask;
+				if (n < (size_t)relay->limits->task_release)
+					n = relay->limits->task_release;
 				m_create(p_queue, IMSG_MTA_HOLDQ_RELEASE, 0, 0, -1);
-				m_add_id(p_queue, relay->id);
-				m_add_int(p_queue, relay->limits->task_release);
+				m_add_id(p_queue, relay->holdq);
+				m_add_int(p_queue, (int)n);
 				m_close(p_queue);
 			}
 		}
 		else if (relay->ntask == 0 && relay->state & RELAY_HOLDQ) {
 			m_create(p_queue, IMSG_MTA_HOLDQ_RELEASE, 0, 0, -1);
-			m_add_id(p_queue, relay->id);
+			m_add_id(p_queue, relay->holdq);
 			m_add_int(p_queue, 0);
 			m_close(p_queue);
 		}
@@ -700,6 +1363,110 @@ mta_route_next_task(struct mta_relay *relay, struct mta_route *route)
 	return (task);
 }
 
+/*
+ * Put back a task a session took but gave up on before the end of the
+ * message data, ahead of the others so that it keeps its turn.
+ */
+void
+mta_route_return_task(struct mta_relay *relay, struct mta_task *task)
+{
+	task->relay = relay;
+	TAILQ_INSERT_HEAD(&relay->tasks, task, entry);
+	relay->ntask += 1;
+	if (relay->taskout)
+		relay->taskout -= 1;
+
+	mta_drain(relay);
+}
+
+/*
+ * Move the first max envelopes of the task to a new task queued right
+ * before it, so that it goes out in its own transaction.
+ */
+static struct mta_task *
+mta_task_split(struct mta_relay *relay, struct mta_task *task, size_t max)
+{
+	struct mta_task		*t;
+	struct mta_envelope	*e;
+	size_t			 n;
+
+	n = 0;
+	TAILQ_FOREACH(e, &task->envelopes, entry)
+		if (++n > max)
+			break;
+	if (n <= max)
+		return (task);
+
+	t = xmalloc(sizeof *t);
+	memory_alloc(MEMORY_MTA, sizeof *t);
+	TAILQ_INIT(&t->envelopes);
+	t->relay = relay;
+	t->msgid = task->msgid;
+	t->sender = xstrdup(task->sender);
+	for (n = 0; n < max; n++) {
+		e = TAILQ_FIRST(&task->envelopes);
+		TAILQ_REMOVE(&task->envelopes, e, entry);
+		TAILQ_INSERT_TAIL(&t->envelopes, e, entry);
+		e->task = t;
+	}
+	TAILQ_INSERT_BEFORE(task, t, entry);
+	relay->ntask += 1;
+	stat_increment("mta.task", 1);
+
+	return (t);
+}
+
+/*
+ * Under memory pressure, the window is halved and the envelopes over it
+ * are held in the queue.
+ */
+static size_t
+mta_relay_hiwat(struct mta_relay *relay)
+{
+	size_t	hiwat, min;
+
+	if (relay->taskwin)
+		hiwat = relay->taskwin;
+	else
+		hiwat = relay->limits->task_hiwat;
+
+	if (memory_level() >= MEMORY_SHRINK) {
+		min = relay->limits->task_lowat + 1;
+		hiwat = hiwat / 2 > min ? hiwat / 2 : min;
+	}
+	return (hiwat);
+}
+
+/*
+ * Size the task window from the rate at which sessions took tasks since
+ * the relay was last down to lowat.
+ */
+static void
+mta_relay_resize(struct mta_relay *relay, int64_t now)
+{
+	size_t	want, min, max;
+	int64_t	elapsed;
+
+	min = relay->limits->task_hiwat;
+	max = min * TASK_WINDOW_SCALE;
+	elapsed = now - relay->tasktm;
+
+	if (relay->tasktm && min && elapsed > 0) {
+		want = relay->taskout * TASK_WINDOW * 1000 / elapsed;
+		if (want < min)
+			want = min;
+		if (want > max)
+			want = max;
+		relay->taskwin = ((relay->taskwin ? relay->taskwin : min) +
+		    want) / 2;
+		log_debug("debug: mta: task window %zu on %s",
+		    relay->taskwin, mta_relay_to_text(relay));
+	}
+
+	relay->tasktm = now;
+	relay->taskout = 0;
+}
+
 static void
 mta_handle_envelope(struct envelope *evp, const char *smarthost)
 {
@@ -710,8 +1477,9 @@ mta_handle_envelope(struct envelope *evp, const char *smarthost)
 	struct mailaddr		 maddr;
 	struct relayhost	 relayh;
 	char			 buf[LINE_MAX];
+	char			 srs[SMTPD_MAXMAILADDRSIZE];
 
-	dispatcher = dict_xget(env->sc_dispatchers, evp->dispatcher);
+	dispatcher = hdict_xget(env->sc_dispatchers, evp->dispatcher);
 	if (dispatcher->u.remote.smarthost && smarthost == NULL) {
 		mta_query_smarthost(evp);
 		return;
@@ -760,7 +1528,7 @@ mta_handle_envelope(struct envelope *evp, const char *smarthost)
 	relay = mta_relay(evp, &relayh);
 	/* ignore if we don't know the limits yet */
 	if (relay->limits &&
-	    relay->ntask >= (size_t)relay->limits->task_hiwat) {
+	    relay->ntask >= mta_relay_hiwat(relay)) {
 		if (!(relay->state & RELAY_ONHOLD)) {
 			log_info("smtp-out: hiwat reached on %s: holding envelopes",
 			    mta_relay_to_text(relay));
@@ -776,7 +1544,7 @@ mta_handle_envelope(struct envelope *evp, const char *smarthost)
 		relay->state |= RELAY_HOLDQ;
 		m_create(p_queue, IMSG_MTA_DELIVERY_HOLD, 0, 0, -1);
 		m_add_evpid(p_queue, evp->id);
-		m_add_id(p_queue, relay->id);
+		m_add_id(p_queue, relay->holdq);
 		m_close(p_queue);
 		mta_relay_unref(relay); /* from here */
 		return;
@@ -789,6 +1557,7 @@ mta_handle_envelope(struct envelope *evp, const char *smarthost)
 
 	if (task == NULL) {
 		task = xmalloc(sizeof *task);
+		memory_alloc(MEMORY_MTA, sizeof *task);
 		TAILQ_INIT(&task->envelopes);
 		task->relay = relay;
 		relay->ntask += 1;
@@ -810,14 +1579,27 @@ mta_handle_envelope(struct envelope *evp, const char *smarthost)
 			}
 		}
 
+		/*
+		 * SRS-encode once for the whole message if requested for the
+		 * relay action, AND we're not bouncing, AND the recipient was
+		 * forwarded.  Tasks may be retried on another session, which
+		 * must not encode the sender again.
+		 */
+		if (env->sc_srs_key != NULL && relay->srs &&
+		    evp->sender.user[0] && evp->rcpt.domain[0] &&
+		    (strcmp(evp->rcpt.user, evp->dest.user) ||
+		    strcmp(evp->rcpt.domain, evp->dest.domain)) &&
+		    srs_encode(buf, evp->rcpt.domain, srs, sizeof(srs)))
+			(void)strlcpy(buf, srs, sizeof(buf));
+
 		task->sender = xstrdup(buf);
 		stat_increment("mta.task", 1);
 	}
 
 	e = xcalloc(1, sizeof *e);
+	memory_alloc(MEMORY_MTA, sizeof *e);
 	e->id = evp->id;
 	e->creation = evp->creation;
-	e->smtpname = xstrdup(evp->smtpname);
 	(void)snprintf(buf, sizeof buf, "%s@%s",
 	    evp->dest.user, evp->dest.domain);
 	e->dest = xstrdup(buf);
@@ -883,10 +1665,10 @@ mta_delivery_flush_event(int fd, short event, void *arg)
 
 		log_debug("debug: mta: flush for %016"PRIx64" (-> %s)", e->id, e->dest);
 
-		free(e->smtpname);
 		free(e->dest);
 		free(e->rcpt);
 		free(e->dsn_orcpt);
+		memory_free(MEMORY_MTA, sizeof *e);
 		free(e);
 
 		tv.tv_sec = 0;
@@ -899,20 +1681,48 @@ void
 mta_delivery_log(struct mta_envelope *e, const char *source, const char *relay,
     int delivery, const char *status)
 {
-	if (delivery == IMSG_MTA_DELIVERY_OK)
+	struct dlog	d;
+
+	memset(&d, 0, sizeof(d));
+	if (delivery == IMSG_MTA_DELIVERY_OK) {
 		mta_log(e, "Ok", source, relay, status);
-	else if (delivery == IMSG_MTA_DELIVERY_TEMPFAIL)
+		d.result = DLOG_OK;
+	}
+	else if (delivery == IMSG_MTA_DELIVERY_TEMPFAIL) {
 		mta_log(e, "TempFail", source, relay, status);
-	else if (delivery == IMSG_MTA_DELIVERY_PERMFAIL)
+		d.result = DLOG_TEMPFAIL;
+	}
+	else if (delivery == IMSG_MTA_DELIVERY_PERMFAIL) {
 		mta_log(e, "PermFail", source, relay, status);
-	else if (delivery == IMSG_MTA_DELIVERY_LOOP)
+		d.result = DLOG_PERMFAIL;
+	}
+	else if (delivery == IMSG_MTA_DELIVERY_LOOP) {
 		mta_log(e, "PermFail", source, relay, "Loop detected");
+		d.result = DLOG_PERMFAIL;
+		status = "Loop detected";
+	}
 	else {
 		log_warnx("warn: bad delivery type %d for %016" PRIx64,
 		    delivery, e->id);
 		fatalx("aborting");
 	}
 
+	d.type = DLOG_MTA;
+	d.evpid = e->id;
+	d.session = e->session;
+	d.creation = e->creation;
+	d.size = e->datalen;
+	d.sender = e->task->sender;
+	d.rcpt = e->dest;
+	d.orcpt = e->rcpt;
+	d.relay = relay;
+	d.source = source;
+	d.tls = e->tls;
+	d.status = status;
+	logger_delivery(&d);
+	e->datalen = 0;
+	e->tls = NULL;
+
 	e->delivery = delivery;
 	if (status)
 		(void)strlcpy(e->status, status, sizeof(e->status));
@@ -946,12 +1756,12 @@ mta_query_mx(struct mta_relay *relay)
 		id = generate_uid();
 		tree_xset(&wait_mx, id, relay->domain);
 		if (relay->domain->as_host)
-			m_create(p_lka,  IMSG_MTA_DNS_HOST, 0, 0, -1);
+			m_create(p_resolver,  IMSG_MTA_DNS_HOST, 0, 0, -1);
 		else
-			m_create(p_lka,  IMSG_MTA_DNS_MX, 0, 0, -1);
-		m_add_id(p_lka, id);
-		m_add_string(p_lka, relay->domain->name);
-		m_close(p_lka);
+			m_create(p_resolver,  IMSG_MTA_DNS_MX, 0, 0, -1);
+		m_add_id(p_resolver, id);
+		m_add_string(p_resolver, relay->domain->name);
+		m_close(p_resolver);
 	}
 	relay->status |= RELAY_WAIT_MX;
 	mta_relay_ref(relay);
@@ -976,9 +1786,19 @@ mta_query_limits(struct mta_relay *relay)
 static void
 mta_query_secret(struct mta_relay *relay)
 {
+	struct mta_lookup	*l;
+	char			 key[LINE_MAX];
+
 	if (relay->status & RELAY_WAIT_SECRET)
 		return;
 
+	(void)snprintf(key, sizeof key, "secret:%s:%s",
+	    relay->authtable, relay->authlabel);
+	if ((l = mta_lookup_get(key)) != NULL) {
+		relay->secret = xstrdup(l->value);
+		return;
+	}
+
 	log_debug("debug: mta: querying secret for %s...",
 	    mta_relay_to_text(relay));
 
@@ -999,12 +1819,27 @@ mta_query_smarthost(struct envelope *evp0)
 {
 	struct dispatcher *dispatcher;
 	struct envelope *evp;
+	struct mta_lookup *l;
+	char key[LINE_MAX];
+
+	dispatcher = hdict_xget(env->sc_dispatchers, evp0->dispatcher);
+
+	/*
+	 * Without a domain, the table hands out its smarthosts in turn,
+	 * so the answer is not kept.
+	 */
+	if (dispatcher->u.remote.smarthost_domain) {
+		(void)snprintf(key, sizeof key, "smarthost:%s:%s",
+		    dispatcher->u.remote.smarthost, evp0->dest.domain);
+		if ((l = mta_lookup_get(key)) != NULL) {
+			mta_handle_envelope(evp0, l->value);
+			return;
+		}
+	}
 
 	evp = malloc(sizeof(*evp));
 	memmove(evp, evp0, sizeof(*evp));
 
-	dispatcher = dict_xget(env->sc_dispatchers, evp->dispatcher);
-
 	log_debug("debug: mta: querying smarthost for %s:%s...",
 	    evp->dispatcher, dispatcher->u.remote.smarthost);
 
@@ -1025,20 +1860,31 @@ mta_query_smarthost(struct envelope *evp0)
 static void
 mta_query_preference(struct mta_relay *relay)
 {
+	struct mta_lookup	*l;
+	char			 key[LINE_MAX];
+
 	if (relay->status & RELAY_WAIT_PREFERENCE)
 		return;
 
+	(void)snprintf(key, sizeof key, "preference:%s:%s",
+	    relay->domain->name, relay->backupname);
+	if ((l = mta_lookup_get(key)) != NULL) {
+		relay->backuppref = l->preference;
+		routes_gen++;
+		return;
+	}
+
 	log_debug("debug: mta: querying preference for %s...",
 	    mta_relay_to_text(relay));
 
 	tree_xset(&wait_preference, relay->id, relay);
 	relay->status |= RELAY_WAIT_PREFERENCE;
 
-	m_create(p_lka,  IMSG_MTA_DNS_MX_PREFERENCE, 0, 0, -1);
-	m_add_id(p_lka, relay->id);
-	m_add_string(p_lka, relay->domain->name);
-	m_add_string(p_lka, relay->backupname);
-	m_close(p_lka);
+	m_create(p_resolver,  IMSG_MTA_DNS_MX_PREFERENCE, 0, 0, -1);
+	m_add_id(p_resolver, relay->id);
+	m_add_string(p_resolver, relay->domain->name);
+	m_add_string(p_resolver, relay->backupname);
+	m_close(p_resolver);
 
 	mta_relay_ref(relay);
 }
@@ -1144,6 +1990,9 @@ mta_on_secret(struct mta_relay *relay, const char *secret)
 static void
 mta_on_smarthost(struct envelope *evp, const char *smarthost)
 {
+	struct dispatcher	*dispatcher;
+	char			 key[LINE_MAX];
+
 	if (smarthost == NULL) {
 		log_warnx("warn: Failed to retrieve smarthost "
 			    "for envelope %"PRIx64, evp->id);
@@ -1157,6 +2006,13 @@ mta_on_smarthost(struct envelope *evp, const char *smarthost)
 
 	log_debug("debug: mta: ... got smarthost for %016"PRIx64": %s",
 	    evp->id, smarthost);
+
+	dispatcher = hdict_xget(env->sc_dispatchers, evp->dispatcher);
+	if (dispatcher->u.remote.smarthost_domain) {
+		(void)snprintf(key, sizeof key, "smarthost:%s:%s",
+		    dispatcher->u.remote.smarthost, evp->dest.domain);
+		mta_lookup_set(key, smarthost, 0);
+	}
 	mta_handle_envelope(evp, smarthost);
 	free(evp);
 }
@@ -1168,6 +2024,7 @@ mta_on_preference(struct mta_relay *relay, int preference)
 	    mta_relay_to_text(relay), preference);
 
 	relay->backuppref = preference;
+	routes_gen++;
 
 	relay->status &= ~RELAY_WAIT_PREFERENCE;
 	mta_drain(relay);
@@ -1184,7 +2041,7 @@ mta_on_source(struct mta_relay *relay, struct mta_source *source)
 	log_debug("debug: mta: ... got source for %s: %s",
 	    mta_relay_to_text(relay), source ? mta_source_to_text(source) : "NULL");
 
-	relay->lastsource = time(NULL);
+	relay->lastsource = clock_cached();
 	delay = DELAY_CHECK_SOURCE_SLOW;
 
 	if (source) {
@@ -1193,6 +2050,8 @@ mta_on_source(struct mta_relay *relay, struct mta_source *source)
 			c->flags &= ~CONNECTOR_NEW;
 			delay = DELAY_CHECK_SOURCE;
 		}
+		else
+			c = mta_source_pick(relay, c);
 		mta_connect(c);
 		if ((c->flags & CONNECTOR_ERROR) == 0)
 			relay->sourceloop = 0;
@@ -1244,7 +2103,8 @@ mta_connect(struct mta_connector *c)
 	struct mta_route	*route;
 	struct mta_mx		*mx;
 	struct mta_limits	*l = c->relay->limits;
-	int			 limits;
+	struct timeval		 tv;
+	int			 limits, racing;
 	time_t			 nextconn, now;
 
 	/* toggle the block flag */
@@ -1269,6 +2129,23 @@ mta_connect(struct mta_connector *c)
 		c->flags &= ~CONNECTOR_WAIT;
 	}
 
+	/*
+	 * Racing while every connection to the relay is still connecting.
+	 * The next attempt is then paced by the stagger timer rather than
+	 * by the domain, relay and connector delays.
+	 */
+	racing = c->relay->nconn_pending &&
+	    c->relay->nconn_pending == c->relay->nconn;
+
+	if (c->flags & CONNECTOR_STAGGER) {
+		if (racing) {
+			log_debug("debug: mta: waiting for stagger timer");
+			return;
+		}
+		evtimer_del(&c->ev_stagger);
+		c->flags &= ~CONNECTOR_STAGGER;
+	}
+
 	/* No job. */
 	if (c->relay->ntask == 0) {
 		log_debug("debug: mta: no task for connector");
@@ -1282,10 +2159,15 @@ mta_connect(struct mta_connector *c)
 		return;
 	}
 
+	/* Take over an idle session to one of our MXs if possible. */
+	if (mta_connect_pooled(c))
+		goto again;
+
 	limits = 0;
-	nextconn = now = time(NULL);
+	nextconn = now = clock_cached();
 
-	if (c->relay->domain->lastconn + l->conndelay_domain > nextconn) {
+	if (!racing &&
+	    c->relay->domain->lastconn + l->conndelay_domain > nextconn) {
 		log_debug("debug: mta: cannot use domain %s before %llus",
 		    c->relay->domain->name,
 		    (unsigned long long) c->relay->domain->lastconn + l->conndelay_domain - now);
@@ -1307,7 +2189,7 @@ mta_connect(struct mta_connector *c)
 		limits |= CONNECTOR_LIMIT_SOURCE;
 	}
 
-	if (c->lastconn + l->conndelay_connector > nextconn) {
+	if (!racing && c->lastconn + l->conndelay_connector > nextconn) {
 		log_debug("debug: mta: cannot use %s before %llus",
 		    mta_connector_to_text(c),
 		    (unsigned long long) c->lastconn + l->conndelay_connector - now);
@@ -1318,7 +2200,7 @@ mta_connect(struct mta_connector *c)
 		limits |= CONNECTOR_LIMIT_CONN;
 	}
 
-	if (c->relay->lastconn + l->conndelay_relay > nextconn) {
+	if (!racing && c->relay->lastconn + l->conndelay_relay > nextconn) {
 		log_debug("debug: mta: cannot use %s before %llus",
 		    mta_relay_to_text(c->relay),
 		    (unsigned long long) c->relay->lastconn + l->conndelay_relay - now);
@@ -1355,7 +2237,7 @@ mta_connect(struct mta_connector *c)
 		}
 		log_debug("debug: mta: retrying to connect on %s in %llus...",
 		    mta_connector_to_text(c),
-		    (unsigned long long) nextconn - time(NULL));
+		    (unsigned long long) nextconn - clock_cached());
 		c->flags |= CONNECTOR_WAIT;
 		runq_schedule_at(runq_connector, nextconn, c);
 		return;
@@ -1365,10 +2247,12 @@ mta_connect(struct mta_connector *c)
 		    mta_route_to_text(route));
 
 	c->nconn += 1;
-	c->lastconn = time(NULL);
+	c->lastconn = clock_cached();
 
 	c->relay->nconn += 1;
+	c->relay->nconn_pending += 1;
 	c->relay->lastconn = c->lastconn;
+	c->relay->lastfamily = route->dst->sa->sa_family;
 	c->relay->domain->nconn += 1;
 	c->relay->domain->lastconn = c->lastconn;
 	route->nconn += 1;
@@ -1377,20 +2261,97 @@ mta_connect(struct mta_connector *c)
 	route->src->lastconn = c->lastconn;
 	route->dst->nconn += 1;
 	route->dst->lastconn = c->lastconn;
+	routes_gen++;
 
 	mta_session(c->relay, route, mx->mxname);	/* this never fails synchronously */
 	mta_relay_ref(c->relay);
 
+	if (c->relay->nconn_pending == c->relay->nconn) {
+		log_debug("debug: mta: staggering next attempt on %s",
+		    mta_connector_to_text(c));
+		tv.tv_sec = 0;
+		tv.tv_usec = DELAY_CONNECT_STAGGER * 1000;
+		evtimer_set(&c->ev_stagger, mta_on_stagger, c);
+		evtimer_add(&c->ev_stagger, &tv);
+		c->flags |= CONNECTOR_STAGGER;
+		return;
+	}
+
 	goto again;
 }
 
+static int
+mta_connect_pooled(struct mta_connector *c)
+{
+	struct mta_route	 key, *route;
+	struct mta_relay	*old;
+	struct mta_limits	*l = c->relay->limits;
+	struct mta_mx		*mx;
+	struct mta_connector	*oc;
+	int			 level;
+
+	if (c->relay->nconn >= l->maxconn_per_relay ||
+	    c->relay->domain->nconn >= l->maxconn_per_domain ||
+	    c->nconn >= l->maxconn_per_connector)
+		return 0;
+
+	/* only consider the MXs of the best usable preference level */
+	level = -1;
+	TAILQ_FOREACH(mx, &c->relay->domain->mxs, entry) {
+		if (level != -1 && mx->preference > level)
+			break;
+		if (c->relay->backuppref >= 0 &&
+		    mx->preference >= c->relay->backuppref)
+			break;
+		if (mx->host->flags & HOST_IGNORE)
+			continue;
+		level = mx->preference;
+
+		key.src = c->source;
+		key.dst = mx->host;
+		route = SPLAY_FIND(mta_route_tree, &routes, &key);
+		if (route == NULL || route->flags & ROUTE_DISABLED)
+			continue;
+
+		if ((old = mta_session_reuse(c->relay, route,
+		    mx->mxname)) == NULL)
+			continue;
+
+		log_debug("debug: mta-routing: reusing connection on %s",
+		    mta_route_to_text(route));
+
+		/* the connection now counts for this relay */
+		oc = mta_connector(old, route->src);
+		oc->nconn -= 1;
+		old->nconn -= 1;
+		old->domain->nconn -= 1;
+
+		c->nconn += 1;
+		c->relay->nconn += 1;
+		c->relay->domain->nconn += 1;
+		mta_relay_ref(c->relay);
+		mta_relay_unref(old); /* from mta_connect() */
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+mta_on_stagger(int fd, short ev, void *arg)
+{
+	struct mta_connector	*c = arg;
+
+	c->flags &= ~CONNECTOR_STAGGER;
+	mta_connect(c);
+}
+
 static void
 mta_on_timeout(struct runq *runq, void *arg)
 {
 	struct mta_connector	*connector = arg;
 	struct mta_relay	*relay = arg;
 	struct mta_route	*route = arg;
-	struct hoststat		*hs = arg;
 
 	if (runq == runq_relay) {
 		log_debug("debug: mta: ... timeout for %s",
@@ -1410,12 +2371,6 @@ mta_on_timeout(struct runq *runq, void *arg)
 		mta_route_enable(route);
 		mta_route_unref(route);
 	}
-	else if (runq == runq_hoststat) {
-		log_debug("debug: mta: ... timeout for hoststat %s",
-			hs->name);
-		mta_hoststat_remove_entry(hs);
-		free(hs);
-	}
 }
 
 static void
@@ -1424,7 +2379,7 @@ mta_route_disable(struct mta_route *route, int penalty, int reason)
 	unsigned long long	delay;
 
 	route->penalty += penalty;
-	route->lastpenalty = time(NULL);
+	route->lastpenalty = clock_cached();
 	delay = (unsigned long long)DELAY_ROUTE_BASE * route->penalty * route->penalty;
 	if (delay > DELAY_ROUTE_MAX)
 		delay = DELAY_ROUTE_MAX;
@@ -1442,6 +2397,7 @@ mta_route_disable(struct mta_route *route, int penalty, int reason)
 
 	route->flags |= reason & ROUTE_DISABLED;
 	runq_schedule(runq_route, delay, route);
+	routes_gen++;
 }
 
 static void
@@ -1453,12 +2409,13 @@ mta_route_enable(struct mta_route *route)
 		route->flags &= ~ROUTE_DISABLED;
 		route->flags |= ROUTE_NEW;
 		route->nerror = 0;
+		routes_gen++;
 	}
 
 	if (route->penalty) {
 #if DELAY_QUADRATIC
 		route->penalty -= 1;
-		route->lastpenalty = time(NULL);
+		route->lastpenalty = clock_cached();
 #else
 		route->penalty = 0;
 #endif
@@ -1528,12 +2485,12 @@ mta_drain(struct mta_relay *r)
 	/*
 	 * We have pending task, and it's maybe time too try a new source.
 	 */
-	if (r->nextsource <= time(NULL))
+	if (r->nextsource <= clock_cached())
 		mta_query_source(r);
 	else {
 		log_debug("debug: mta: scheduling relay %s in %llus...",
 		    mta_relay_to_text(r),
-		    (unsigned long long) r->nextsource - time(NULL));
+		    (unsigned long long) r->nextsource - clock_cached());
 		runq_schedule_at(runq_relay, r->nextsource, r);
 		r->status |= RELAY_WAIT_CONNECTOR;
 		mta_relay_ref(r);
@@ -1586,6 +2543,7 @@ mta_flush(struct mta_relay *relay, int fail, const char *error)
 			n++;
 		}
 		free(task->sender);
+		memory_free(MEMORY_MTA, sizeof *task);
 		free(task);
 	}
 
@@ -1596,7 +2554,7 @@ mta_flush(struct mta_relay *relay, int fail, const char *error)
 	/* release all waiting envelopes for the relay */
 	if (relay->state & RELAY_HOLDQ) {
 		m_create(p_queue, IMSG_MTA_HOLDQ_RELEASE, 0, 0, -1);
-		m_add_id(p_queue, relay->id);
+		m_add_id(p_queue, relay->holdq);
 		m_add_int(p_queue, -1);
 		m_close(p_queue);
 	}
@@ -1614,8 +2572,19 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 	struct mta_mx		*mx;
 	int			 level, limit_host, limit_route;
 	int			 family_mismatch, seen, suspended_route;
+	int			 slow, bestslow;
 	time_t			 tm;
 
+	if (c->scangen == routes_gen &&
+	    (c->scanuntil == 0 || now < c->scanuntil)) {
+		log_debug("debug: mta-routing: nothing changed for %s",
+		    mta_connector_to_text(c));
+		*limits |= c->scanlimits;
+		if (c->scantm > *nextconn)
+			*nextconn = c->scantm;
+		return (NULL);
+	}
+
 	log_debug("debug: mta-routing: searching new route for %s...",
 	    mta_connector_to_text(c));
 
@@ -1626,6 +2595,7 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 	family_mismatch = 0;
 	level = -1;
 	best = NULL;
+	bestslow = 0;
 	seen = 0;
 
 	TAILQ_FOREACH(mx, &c->relay->domain->mxs, entry) {
@@ -1678,7 +2648,7 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 			continue;
 		}
 
-		if (mx->host->nconn >= l->maxconn_per_host) {
+		if (mx->host->nconn >= mta_host_maxconn(mx->host, l)) {
 			log_debug("debug: mta-routing: skipping host %s: too many connections",
 			    mta_host_to_text(mx->host));
 			limit_host = 1;
@@ -1740,8 +2710,25 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 			continue;
 		}
 
-		/* Use the route with the lowest number of connections. */
-		if (best && route->nconn >= best->nconn) {
+		slow = mta_route_is_slow(route, now);
+		if (slow && c->relay->nconn) {
+			log_debug("debug: mta-routing: skipping route %s: slow",
+			    mta_route_to_text(route));
+			limit_route = 1;
+			mta_route_unref(route); /* from here */
+			continue;
+		}
+
+		/*
+		 * Use a route that is not slow, then the one with the
+		 * lowest number of connections, and on a tie prefer the
+		 * address family that was not tried last.
+		 */
+		if (best && (slow > bestslow || (slow == bestslow &&
+		    (route->nconn > best->nconn ||
+		    (route->nconn == best->nconn &&
+		    (best->dst->sa->sa_family != c->relay->lastfamily ||
+		    route->dst->sa->sa_family == c->relay->lastfamily)))))) {
 			log_debug("debug: mta-routing: skipping route %s: current one is better",
 			    mta_route_to_text(route));
 			mta_route_unref(route); /* from here */
@@ -1751,6 +2738,7 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 		if (best)
 			mta_route_unref(best); /* from here */
 		best = route;
+		bestslow = slow;
 		*pmx = mx;
 		log_debug("debug: mta-routing: selecting candidate route %s",
 		    mta_route_to_text(route));
@@ -1759,6 +2747,11 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 	if (best)
 		return (best);
 
+	c->scangen = 0;
+	c->scanuntil = tm;
+	c->scantm = 0;
+	c->scanlimits = 0;
+
 	/* Order is important */
 	if (seen == 0) {
 		log_info("smtp-out: No MX found for %s",
@@ -1768,14 +2761,20 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 	else if (limit_route) {
 		log_debug("debug: mta: hit route limit");
 		*limits |= CONNECTOR_LIMIT_ROUTE;
+		c->scanlimits = CONNECTOR_LIMIT_ROUTE;
+		c->scangen = routes_gen;
 	}
 	else if (limit_host) {
 		log_debug("debug: mta: hit host limit");
 		*limits |= CONNECTOR_LIMIT_HOST;
+		c->scanlimits = CONNECTOR_LIMIT_HOST;
+		c->scangen = routes_gen;
 	}
 	else if (tm) {
 		if (tm > *nextconn)
 			*nextconn = tm;
+		c->scantm = tm;
+		c->scangen = routes_gen;
 	}
 	else if (family_mismatch) {
 		log_info("smtp-out: Address family mismatch on %s",
@@ -1808,7 +2807,7 @@ mta_log(const struct mta_envelope *evp, const char *prefix, const char *source,
 	    evp->rcpt ? evp->rcpt : "-",
 	    source ? source : "-",
 	    relay,
-	    duration_to_text(time(NULL) - evp->creation),
+	    duration_to_text(clock_cached() - evp->creation),
 	    prefix,
 	    status);
 }
@@ -1819,7 +2818,7 @@ mta_relay(struct envelope *e, struct relayhost *relayh)
 	struct dispatcher	*dispatcher;
 	struct mta_relay	 key, *r;
 
-	dispatcher = dict_xget(env->sc_dispatchers, e->dispatcher);
+	dispatcher = hdict_xget(env->sc_dispatchers, e->dispatcher);
 
 	memset(&key, 0, sizeof key);
 
@@ -1875,6 +2874,9 @@ mta_relay(struct envelope *e, struct relayhost *relayh)
 		if (key.heloname)
 			r->heloname = xstrdup(key.heloname);
 		r->srs = key.srs;
+		r->holdq = mta_relay_holdq(r);
+		if (env->sc_opts & SMTPD_OPT_TAKEOVER)
+			r->state |= RELAY_HOLDQ;
 		SPLAY_INSERT(mta_relay_tree, &relays, r);
 		stat_increment("mta.relay", 1);
 	} else {
@@ -1885,6 +2887,21 @@ mta_relay(struct envelope *e, struct relayhost *relayh)
 	return (r);
 }
 
+/* FNV-1a of the relay text, which does not change across generations */
+static uint64_t
+mta_relay_holdq(struct mta_relay *relay)
+{
+	const unsigned char	*p;
+	uint64_t		 h;
+
+	h = 14695981039346656037ULL;
+	for (p = (const unsigned char *)mta_relay_to_text(relay); *p; p++) {
+		h ^= *p;
+		h *= 1099511628211ULL;
+	}
+	return (h ? h : 1);
+}
+
 static void
 mta_relay_ref(struct mta_relay *r)
 {
@@ -1902,7 +2919,7 @@ mta_relay_unref(struct mta_relay *relay)
 	/* Make sure they are no envelopes held for this relay */
 	if (relay->state & RELAY_HOLDQ) {
 		m_create(p_queue, IMSG_MTA_HOLDQ_RELEASE, 0, 0, -1);
-		m_add_id(p_queue, relay->id);
+		m_add_id(p_queue, relay->holdq);
 		m_add_int(p_queue, 0);
 		m_close(p_queue);
 	}
@@ -2226,6 +3243,8 @@ mta_host_unref(struct mta_host *h)
 		return;
 
 	SPLAY_REMOVE(mta_host_tree, &hosts, h);
+	if (h->lastconn)
+		routes_gen++;
 	free(h->sa);
 	free(h->ptrname);
 	free(h);
@@ -2259,17 +3278,21 @@ mta_host_cmp(const struct mta_host *a, const struct mta_host *b)
 SPLAY_GENERATE(mta_host_tree, mta_host, entry, mta_host_cmp);
 
 static struct mta_domain *
-mta_domain(char *name, int as_host)
+mta_domain(const char *name, int as_host)
 {
 	struct mta_domain	key, *d;
 
-	key.name = name;
+	key.name = intern_domain(name);
+	key.id = intern_id(key.name);
 	key.as_host = as_host;
 	d = SPLAY_FIND(mta_domain_tree, &domains, &key);
 
-	if (d == NULL) {
+	if (d != NULL)
+		intern_release(key.name);
+	else {
 		d = xcalloc(1, sizeof(*d));
-		d->name = xstrdup(name);
+		d->name = key.name;
+		d->id = key.id;
 		d->as_host = as_host;
 		TAILQ_INIT(&d->mxs);
 		SPLAY_INSERT(mta_domain_tree, &domains, d);
@@ -2299,12 +3322,12 @@ mta_domain_unref(struct mta_domain *d)
 	while ((mx = TAILQ_FIRST(&d->mxs))) {
 		TAILQ_REMOVE(&d->mxs, mx, entry);
 		mta_host_unref(mx->host); /* from IMSG_DNS_HOST */
-		free(mx->mxname);
+		intern_release(mx->mxname);
 		free(mx);
 	}
 
 	SPLAY_REMOVE(mta_domain_tree, &domains, d);
-	free(d->name);
+	intern_release(d->name);
 	free(d);
 	stat_decrement("mta.domain", 1);
 }
@@ -2316,7 +3339,11 @@ mta_domain_cmp(const struct mta_domain *a, const struct mta_domain *b)
 		return (-1);
 	if (a->as_host > b->as_host)
 		return (1);
-	return (strcasecmp(a->name, b->name));
+	if (a->id < b->id)
+		return (-1);
+	if (a->id > b->id)
+		return (1);
+	return (0);
 }
 
 SPLAY_GENERATE(mta_domain_tree, mta_domain, entry, mta_domain_cmp);
@@ -2422,6 +3449,8 @@ mta_connector_free(struct mta_connector *c)
 		    mta_connector_to_text(c));
 		runq_cancel(runq_connector, c);
 	}
+	if (c->flags & CONNECTOR_STAGGER)
+		evtimer_del(&c->ev_stagger);
 	mta_source_unref(c->source); /* from constructor */
 	free(c);
 
@@ -2455,7 +3484,8 @@ mta_route(struct mta_source *src, struct mta_host *dst)
 		r->src = src;
 		r->dst = dst;
 		r->flags |= ROUTE_NEW;
-		r->id = ++rid;
+		/* interleaved, for the ids to be unique over the mta workers */
+		r->id = ++rid * mta_peer_count() + env->sc_mta_worker;
 		SPLAY_INSERT(mta_route_tree, &routes, r);
 		mta_source_ref(src);
 		mta_host_ref(dst);
@@ -2492,7 +3522,7 @@ mta_route_unref(struct mta_route *r)
 	 * Nothing references this route, but we might want to keep it alive
 	 * for a while.
 	 */
-	now = time(NULL);
+	now = clock_cached();
 	sched = 0;
 
 	if (r->penalty) {
@@ -2529,6 +3559,8 @@ mta_route_unref(struct mta_route *r)
 	    mta_route_to_text(r));
 
 	SPLAY_REMOVE(mta_route_tree, &routes, r);
+	if (r->lastconn || r->lastdisc)
+		routes_gen++;
 	mta_source_unref(r->src); /* from constructor */
 	mta_host_unref(r->dst); /* from constructor */
 	free(r);
@@ -2565,21 +3597,28 @@ mta_route_cmp(const struct mta_route *a, const struct mta_route *b)
 
 SPLAY_GENERATE(mta_route_tree, mta_route, entry, mta_route_cmp);
 
+/*
+ * Blocks hold a reference on their domain: a name that is not interned
+ * has no block.
+ */
 void
 mta_block(struct mta_source *src, char *dom)
 {
 	struct mta_block key, *b;
 
 	key.source = src;
-	key.domain = dom;
+	key.domain = dom ? intern_domain(dom) : NULL;
+	key.id = dom ? intern_id(key.domain) : 0;
 
 	b = SPLAY_FIND(mta_block_tree, &blocks, &key);
-	if (b != NULL)
+	if (b != NULL) {
+		intern_release(key.domain);
 		return;
+	}
 
 	b = xcalloc(1, sizeof(*b));
-	if (dom)
-		b->domain = xstrdup(dom);
+	b->domain = key.domain;
+	b->id = key.id;
 	b->source = src;
 	mta_source_ref(src);
 	SPLAY_INSERT(mta_block_tree, &blocks, b);
@@ -2591,7 +3630,13 @@ mta_unblock(struct mta_source *src, char *dom)
 	struct mta_block key, *b;
 
 	key.source = src;
-	key.domain = dom;
+	key.domain = NULL;
+	key.id = 0;
+	if (dom) {
+		if ((key.domain = intern_lookup(dom)) == NULL)
+			return;
+		key.id = intern_id(key.domain);
+	}
 
 	b = SPLAY_FIND(mta_block_tree, &blocks, &key);
 	if (b == NULL)
@@ -2600,17 +3645,23 @@ mta_unblock(struct mta_source *src, char *dom)
 	SPLAY_REMOVE(mta_block_tree, &blocks, b);
 
 	mta_source_unref(b->source);
-	free(b->domain);
+	intern_release(b->domain);
 	free(b);
 }
 
 int
-mta_is_blocked(struct mta_source *src, char *dom)
+mta_is_blocked(struct mta_source *src, const char *dom)
 {
 	struct mta_block key;
 
 	key.source = src;
-	key.domain = dom;
+	key.domain = NULL;
+	key.id = 0;
+	if (dom) {
+		if ((key.domain = intern_lookup(dom)) == NULL)
+			return (0);
+		key.id = intern_id(key.domain);
+	}
 
 	if (SPLAY_FIND(mta_block_tree, &blocks, &key))
 		return (1);
@@ -2626,49 +3677,117 @@ mta_block_cmp(const struct mta_block *a, const struct mta_block *b)
 		return (-1);
 	if (a->source > b->source)
 		return (1);
-	if (!a->domain && b->domain)
+	if (a->id < b->id)
 		return (-1);
-	if (a->domain && !b->domain)
+	if (a->id > b->id)
 		return (1);
-	if (a->domain == b->domain)
-		return (0);
-	return (strcasecmp(a->domain, b->domain));
+	return (0);
 }
 
 SPLAY_GENERATE(mta_block_tree, mta_block, entry, mta_block_cmp);
 
 
 
+static struct mta_lookup *
+mta_lookup_get(const char *key)
+{
+	struct mta_lookup	*l;
+
+	if ((l = dict_get(&lookups, key)) == NULL)
+		return (NULL);
+	if (l->expire > clock_cached())
+		return (l);
+	dict_xpop(&lookups, key);
+	free(l->value);
+	free(l);
+	return (NULL);
+}
+
+static void
+mta_lookup_set(const char *key, const char *value, int preference)
+{
+	struct mta_lookup	*l;
+
+	if ((l = dict_get(&lookups, key)) == NULL) {
+		if (memory_level() >= MEMORY_SHRINK)
+			return;
+		if (dict_count(&lookups) >= LOOKUP_MAX)
+			mta_lookup_flush();
+		l = xcalloc(1, sizeof *l);
+		dict_set(&lookups, key, l);
+	}
+	free(l->value);
+	l->value = value ? xstrdup(value) : NULL;
+	l->preference = preference;
+	l->expire = clock_cached() + LOOKUP_TTL;
+}
+
+void
+mta_memory(enum memory_level level)
+{
+	if (level >= MEMORY_SHRINK)
+		mta_lookup_flush();
+}
+
+static void
+mta_lookup_flush(void)
+{
+	struct mta_lookup	*l;
+
+	while (dict_poproot(&lookups, (void **)&l)) {
+		free(l->value);
+		free(l);
+	}
+}
+
 /* hoststat errors are not critical, we do best effort */
 void
 mta_hoststat_update(const char *host, const char *error)
 {
 	struct hoststat	*hs = NULL;
+	struct timeval	 tv;
 	char		 buf[HOST_NAME_MAX+1];
+	char		*e;
 
 	if (!lowercase(buf, host, sizeof buf))
 		return;
 
+	if ((e = strdup(error)) == NULL)
+		return;
+
 	hs = dict_get(&hoststat, buf);
 	if (hs == NULL) {
-		if ((hs = calloc(1, sizeof *hs)) == NULL)
+		if (dict_count(&hoststat) >= HOSTSTAT_MAX)
+			mta_hoststat_remove_entry(TAILQ_LAST(&hoststat_lru,
+			    hoststat_lru));
+		if ((hs = calloc(1, sizeof *hs)) == NULL) {
+			free(e);
 			return;
-		tree_init(&hs->deferred);
-		runq_schedule(runq_hoststat, HOSTSTAT_EXPIRE_DELAY, hs);
+		}
+		(void)strlcpy(hs->name, buf, sizeof hs->name);
+		dict_set(&hoststat, hs->name, hs);
 	}
-	(void)strlcpy(hs->name, buf, sizeof hs->name);
-	(void)strlcpy(hs->error, error, sizeof hs->error);
-	hs->tm = time(NULL);
-	dict_set(&hoststat, buf, hs);
+	else
+		TAILQ_REMOVE(&hoststat_lru, hs, entry);
+	TAILQ_INSERT_HEAD(&hoststat_lru, hs, entry);
+
+	free(hs->error);
+	hs->error = e;
+	hs->tm = clock_cached();
 
-	runq_cancel(runq_hoststat, hs);
-	runq_schedule(runq_hoststat, HOSTSTAT_EXPIRE_DELAY, hs);
+	if (!evtimer_pending(&ev_hoststat, NULL)) {
+		tv.tv_sec = HOSTSTAT_EXPIRE_DELAY;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_hoststat, &tv);
+	}
 }
 
 void
 mta_hoststat_cache(const char *host, uint64_t evpid)
 {
 	struct hoststat	*hs = NULL;
+	uint64_t	*tab;
+	size_t		 i, sz;
 	char buf[HOST_NAME_MAX+1];
 
 	if (!lowercase(buf, host, sizeof buf))
@@ -2678,16 +3797,31 @@ mta_hoststat_cache(const char *host, uint64_t evpid)
 	if (hs == NULL)
 		return;
 
-	if (tree_count(&hs->deferred) >= env->sc_mta_max_deferred)
+	if (hs->ndeferred >= env->sc_mta_max_deferred)
 		return;
 
-	tree_set(&hs->deferred, evpid, NULL);
+	for (i = 0; i < hs->ndeferred; i++)
+		if (hs->deferred[i] == evpid)
+			return;
+
+	if (hs->ndeferred == hs->szdeferred) {
+		sz = hs->szdeferred ? hs->szdeferred * 2 : 8;
+		if (sz > env->sc_mta_max_deferred)
+			sz = env->sc_mta_max_deferred;
+		tab = reallocarray(hs->deferred, sz, sizeof *tab);
+		if (tab == NULL)
+			return;
+		hs->deferred = tab;
+		hs->szdeferred = sz;
+	}
+	hs->deferred[hs->ndeferred++] = evpid;
 }
 
 void
 mta_hoststat_uncache(const char *host, uint64_t evpid)
 {
 	struct hoststat	*hs = NULL;
+	size_t		 i;
 	char buf[HOST_NAME_MAX+1];
 
 	if (!lowercase(buf, host, sizeof buf))
@@ -2697,15 +3831,24 @@ mta_hoststat_uncache(const char *host, uint64_t evpid)
 	if (hs == NULL)
 		return;
 
-	tree_pop(&hs->deferred, evpid);
+	for (i = 0; i < hs->ndeferred; i++) {
+		if (hs->deferred[i] == evpid) {
+			hs->deferred[i] = hs->deferred[--hs->ndeferred];
+			return;
+		}
+	}
 }
 
+/*
+ * Release the deferred envelopes to the scheduler, packing as many ids
+ * as fit in each message.
+ */
 void
 mta_hoststat_reschedule(const char *host)
 {
 	struct hoststat	*hs = NULL;
 	char		 buf[HOST_NAME_MAX+1];
-	uint64_t	 evpid;
+	size_t		 i, n, max;
 
 	if (!lowercase(buf, host, sizeof buf))
 		return;
@@ -2714,17 +3857,47 @@ mta_hoststat_reschedule(const char *host)
 	if (hs == NULL)
 		return;
 
-	while (tree_poproot(&hs->deferred, &evpid, NULL)) {
+	max = (MAX_IMSGSIZE - IMSG_HEADER_SIZE) / sizeof(uint64_t);
+	for (i = 0; i < hs->ndeferred; i += n) {
+		n = hs->ndeferred - i;
+		if (n > max)
+			n = max;
 		m_compose(p_queue, IMSG_MTA_SCHEDULE, 0, 0, -1,
-		    &evpid, sizeof evpid);
+		    hs->deferred + i, n * sizeof(uint64_t));
 	}
+	free(hs->deferred);
+	hs->deferred = NULL;
+	hs->ndeferred = 0;
+	hs->szdeferred = 0;
 }
 
 static void
 mta_hoststat_remove_entry(struct hoststat *hs)
 {
-	while (tree_poproot(&hs->deferred, NULL, NULL))
-		;
-	dict_pop(&hoststat, hs->name);
-	runq_cancel(runq_hoststat, hs);
+	dict_xpop(&hoststat, hs->name);
+	TAILQ_REMOVE(&hoststat_lru, hs, entry);
+	free(hs->deferred);
+	free(hs->error);
+	free(hs);
+}
+
+static void
+mta_hoststat_expire(int fd, short ev, void *arg)
+{
+	struct hoststat	*hs;
+	struct timeval	 tv;
+	time_t		 now;
+
+	now = clock_cached();
+	while ((hs = TAILQ_LAST(&hoststat_lru, hoststat_lru))) {
+		if (hs->tm + HOSTSTAT_EXPIRE_DELAY > now) {
+			tv.tv_sec = hs->tm + HOSTSTAT_EXPIRE_DELAY - now;
+			tv.tv_usec = 0;
+			evtimer_add(&ev_hoststat, &tv);
+			return;
+		}
+		log_debug("debug: mta: ... timeout for hoststat %s",
+		    hs->name);
+		mta_hoststat_remove_entry(hs);
+	}
 }
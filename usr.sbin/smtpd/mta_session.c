@@ -42,6 +42,8 @@
 #define MAX_TRYBEFOREDISABLE	10
 
 #define MTA_HIWAT		65535
+/* BDAT chunks sent ahead of their replies */
+#define MTA_BDAT_WINDOW		16
 
 enum mta_state {
 	MTA_INIT,
@@ -60,6 +62,7 @@ enum mta_state {
 	MTA_RCPT,
 	MTA_DATA,
 	MTA_BODY,
+	MTA_BDAT,
 	MTA_EOM,
 	MTA_LMTP_EOM,
 	MTA_RSET,
@@ -81,6 +84,51 @@ enum mta_state {
 #define MTA_WAIT		0x1000
 #define MTA_HANGON		0x2000
 #define MTA_RECONN		0x4000
+#define MTA_CONNECTING		0x8000
+#define MTA_CANCELLED		0x10000
+#define MTA_POOLED		0x20000
+#define MTA_STALL		0x40000
+
+/*
+ * Sessions idling after their last task are kept in a pool, from which
+ * another relay routed to the same host with the same TLS, auth and
+ * helo parameters can take them over instead of connecting again.
+ */
+#define MTA_POOL_MAX		128
+
+/*
+ * When a session takes a task, the message fd for the next task of the
+ * relay is requested from the queue ahead of time.  Fds fully sent are
+ * kept too, so that a session delivering the same message to another
+ * relay does not wait for the queue to open it again.  Cached fds are
+ * closed after MTA_FDCACHE_TTL seconds unused.
+ */
+#define MTA_FDCACHE_MAX		64
+#define MTA_FDCACHE_TTL		10
+
+/*
+ * Hosts with which opportunistic TLS failed are remembered by address for
+ * MTA_TLSFAIL_TTL seconds, so that later sessions go straight to plain
+ * SMTP instead of failing the handshake and reconnecting each time.  A
+ * successful handshake forgets the host.
+ */
+#define MTA_TLSFAIL_MAX		4096
+#define MTA_TLSFAIL_TTL		3600
+
+struct mta_tlsfail {
+	TAILQ_ENTRY(mta_tlsfail)	 entry;
+	char				*key;
+	time_t				 expire;
+};
+
+struct mta_fdcache {
+	TAILQ_ENTRY(mta_fdcache)	 entry;
+	uint32_t			 msgid;
+	uint64_t			 reqid;		/* fd still requested */
+	uint64_t			 session;	/* session waiting */
+	int				 fd;
+	time_t				 tm;
+};
 
 #define MTA_EXT_STARTTLS	0x01
 #define MTA_EXT_PIPELINING	0x02
@@ -88,13 +136,14 @@ enum mta_state {
 #define MTA_EXT_AUTH_PLAIN     	0x08
 #define MTA_EXT_AUTH_LOGIN     	0x10
 #define MTA_EXT_SIZE     	0x20
+#define MTA_EXT_CHUNKING	0x40
 
 struct mta_session {
 	uint64_t		 id;
 	struct mta_relay	*relay;
 	struct mta_route	*route;
 	char			*helo;
-	char			*mxname;
+	const char		*mxname;	/* interned */
 
 	char			*username;
 
@@ -122,10 +171,19 @@ struct mta_session {
 	struct mta_envelope	*currevp;
 	FILE			*datafp;
 	size_t			 datalen;
+	int			 databol;
+
+	size_t			 pending;
+	size_t			 discard;
 
 	size_t			 failures;
 
 	char			 replybuf[2048];
+
+	struct timespec		 t_connect;
+	struct timespec		 t_tls;
+	struct timespec		 t_reply;
+	struct timespec		 t_data;
 };
 
 static void mta_session_init(void);
@@ -135,19 +193,34 @@ static void mta_free(struct mta_session *);
 static void mta_getnameinfo_cb(void *, int, const char *, const char *);
 static void mta_on_ptr(void *, void *, void *);
 static void mta_on_timeout(struct runq *, void *);
+static void mta_on_stall(struct runq *, void *);
+static void mta_stall_arm(struct mta_session *);
 static void mta_connect(struct mta_session *);
 static void mta_enter_state(struct mta_session *, int);
 static void mta_flush_task(struct mta_session *, int, const char *, size_t, int);
+static int64_t mta_elapsed(const struct timespec *);
 static void mta_error(struct mta_session *, const char *, ...)
     __attribute__((__format__ (printf, 2, 3)));
+static void mta_send_rcpt(struct mta_session *, struct mta_envelope *);
 static void mta_send(struct mta_session *, char *, ...)
     __attribute__((__format__ (printf, 2, 3)));
 static ssize_t mta_queue_data(struct mta_session *);
+static ssize_t mta_queue_chunk(struct mta_session *);
 static void mta_response(struct mta_session *, char *);
 static const char * mta_strstate(int);
 static void mta_tls_init(struct mta_session *);
 static void mta_tls_started(struct mta_session *);
 static struct mta_session *mta_tree_pop(struct tree *, uint64_t);
+static void mta_on_fd(struct mta_session *, int);
+static void mta_fdcache_prefetch(struct mta_relay *);
+static int mta_fdcache_get(struct mta_session *, uint32_t);
+static void mta_fdcache_put(uint32_t, FILE *);
+static void mta_fdcache_remove(struct mta_fdcache *);
+static void mta_fdcache_arm(void);
+static void mta_fdcache_expire(int, short, void *);
+static int mta_tlsfail_get(struct mta_host *);
+static void mta_tlsfail_set(struct mta_host *, int);
+static void mta_tlsfail_remove(struct mta_tlsfail *);
 static const char * dsn_strret(enum dsn_ret);
 static const char * dsn_strnotify(uint8_t);
 
@@ -160,6 +233,12 @@ void mta_hoststat_uncache(const char *, uint64_t);
 static void mta_filter_begin(struct mta_session *);
 static void mta_filter_end(struct mta_session *);
 static void mta_connected(struct mta_session *);
+static void mta_connect_won(struct mta_session *);
+static int mta_pool_put(struct mta_session *);
+static void mta_pool_remove(struct mta_session *);
+static int mta_pool_strcmp(const char *, const char *);
+static int mta_pool_match(struct mta_session *, struct mta_relay *,
+    const char *);
 static void mta_disconnected(struct mta_session *);
 
 static void mta_report_link_connect(struct mta_session *, const char *, int,
@@ -191,8 +270,16 @@ static struct tree wait_ptr;
 static struct tree wait_fd;
 static struct tree wait_tls_init;
 static struct tree wait_tls_verify;
+static struct tree wait_connect;
+static struct tree pool;
+static TAILQ_HEAD(mta_fdcache_lru, mta_fdcache) fdcache;
+static size_t fdcache_count;
+static struct event ev_fdcache;
+static struct hdict tlsfail;
+static TAILQ_HEAD(mta_tlsfail_lru, mta_tlsfail) tlsfail_lru;
 
 static struct runq *hangon;
+static struct runq *stall;
 
 #define	SESSION_FILTERED(s) \
 	((s)->relay->dispatcher->u.remote.filtername)
@@ -206,9 +293,16 @@ mta_session_init(void)
 		tree_init(&wait_helo);
 		tree_init(&wait_ptr);
 		tree_init(&wait_fd);
+		tree_init(&wait_connect);
+		tree_init(&pool);
+		TAILQ_INIT(&fdcache);
+		evtimer_set(&ev_fdcache, mta_fdcache_expire, NULL);
 		tree_init(&wait_tls_init);
 		tree_init(&wait_tls_verify);
+		hdict_init(&tlsfail);
+		TAILQ_INIT(&tlsfail_lru);
 		runq_init(&hangon, mta_on_timeout);
+		runq_init(&stall, mta_on_stall);
 		init = 1;
 	}
 }
@@ -225,7 +319,11 @@ mta_session(struct mta_relay *relay, struct mta_route *route, const char *mxname
 	s->id = generate_uid();
 	s->relay = relay;
 	s->route = route;
-	s->mxname = xstrdup(mxname);
+	s->mxname = intern_ref(mxname);
+
+	/* counted in relay->nconn_pending until connected */
+	s->flags |= MTA_CONNECTING;
+	tree_xset(&wait_connect, s->id, s);
 
 	mta_filter_begin(s);
 
@@ -274,10 +372,10 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 	struct mta_session	*s;
 	struct msg		 m;
 	uint64_t		 reqid;
+	struct mta_fdcache	*fc;
 	const char		*name;
 	int			 status, fd;
-	struct stat		 sb;
-	
+
 	switch (imsg->hdr.type) {
 
 	case IMSG_MTA_OPEN_MESSAGE:
@@ -286,45 +384,40 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 		m_end(&m);
 
 		fd = imsg_get_fd(imsg);
-		s = mta_tree_pop(&wait_fd, reqid);
-		if (s == NULL) {
-			if (fd != -1)
-				close(fd);
-			return;
-		}
-
-		if (fd == -1) {
-			log_debug("debug: mta: failed to obtain msg fd");
-			mta_flush_task(s, IMSG_MTA_DELIVERY_TEMPFAIL,
-			    "Could not get message fd", 0, 0);
-			mta_enter_state(s, MTA_READY);
-			return;
+		s = NULL;
+		if (tree_check(&wait_fd, reqid)) {
+			if ((s = mta_tree_pop(&wait_fd, reqid)) == NULL) {
+				if (fd != -1)
+					close(fd);
+				return;
+			}
 		}
-
-		if ((s->ext & MTA_EXT_SIZE) && s->ext_size != 0) {
-			if (fstat(fd, &sb) == -1) {
-				log_debug("debug: mta: failed to stat msg fd");
-				mta_flush_task(s, IMSG_MTA_DELIVERY_TEMPFAIL,
-				    "Could not stat message fd", 0, 0);
-				mta_enter_state(s, MTA_READY);
-				close(fd);
+		else {
+			/* a prefetch, maybe with a session waiting for it */
+			TAILQ_FOREACH(fc, &fdcache, entry)
+				if (fc->reqid == reqid)
+					break;
+			if (fc == NULL) {
+				if (fd != -1)
+					close(fd);
 				return;
 			}
-			if (sb.st_size > (off_t)s->ext_size) {
-				log_debug("debug: mta: message too large for peer");
-				mta_flush_task(s, IMSG_MTA_DELIVERY_PERMFAIL,
-				    "message too large for peer", 0, 0);
-				mta_enter_state(s, MTA_READY);
-				close(fd);
+			fc->reqid = 0;
+			fc->tm = time(NULL);
+			if (fc->session)
+				s = mta_tree_pop(&wait_fd, fc->session);
+			fc->session = 0;
+			if (s == NULL && fd != -1) {
+				fc->fd = fd;
+				mta_fdcache_arm();
 				return;
 			}
+			mta_fdcache_remove(fc);
+			if (s == NULL)
+				return;
 		}
-		
-		s->datafp = fdopen(fd, "r");
-		if (s->datafp == NULL)
-			fatal("mta: fdopen");
 
-		mta_enter_state(s, MTA_MAIL);
+		mta_on_fd(s, fd);
 		return;
 
 	case IMSG_MTA_LOOKUP_HELO:
@@ -376,6 +469,7 @@ mta_free(struct mta_session *s)
 {
 	struct mta_relay *relay;
 	struct mta_route *route;
+	int		  cancelled;
 
 	log_debug("debug: mta: %p: session done", s);
 
@@ -384,10 +478,19 @@ mta_free(struct mta_session *s)
 	if (s->ready)
 		s->relay->nconn_ready -= 1;
 
+	if (s->flags & MTA_CONNECTING) {
+		tree_xpop(&wait_connect, s->id);
+		s->relay->nconn_pending -= 1;
+	}
+
+	mta_pool_remove(s);
+
 	if (s->flags & MTA_HANGON) {
 		log_debug("debug: mta: %p: cancelling hangon timer", s);
 		runq_cancel(hangon, s);
 	}
+	if (s->flags & MTA_STALL)
+		runq_cancel(stall, s);
 
 	if (s->io)
 		io_free(s->io);
@@ -402,11 +505,12 @@ mta_free(struct mta_session *s)
 
 	relay = s->relay;
 	route = s->route;
+	cancelled = s->flags & MTA_CANCELLED;
 	free(s->username);
-	free(s->mxname);
+	intern_release(s->mxname);
 	free(s);
 	stat_decrement("mta.session", 1);
-	mta_route_collect(relay, route);
+	mta_route_collect(relay, route, cancelled);
 }
 
 static void
@@ -435,6 +539,293 @@ mta_on_timeout(struct runq *runq, void *arg)
 	mta_enter_state(s, MTA_READY);
 }
 
+/*
+ * On a slow route, a session waiting too long for a reply to the
+ * envelope or the DATA command hands its task back to the relay for
+ * a faster route, and drops the connection.  Nothing of the message
+ * has been accepted yet, so it cannot be delivered twice.
+ */
+static void
+mta_on_stall(struct runq *runq, void *arg)
+{
+	struct mta_session	*s = arg;
+	int64_t			 ms;
+
+	s->flags &= ~MTA_STALL;
+
+	if (s->task == NULL || s->pending == 0 || s->flags & MTA_WAIT ||
+	    (s->state != MTA_MAIL && s->state != MTA_RCPT &&
+	    s->state != MTA_DATA))
+		return;
+
+	ms = mta_elapsed(&s->t_reply);
+	mta_route_reply(s->relay, s->route, ms);
+
+	log_info("%016"PRIx64" mta stalled reason=no reply after %lldms "
+	    "on %s, handing back task", s->id, (long long)ms,
+	    mta_host_to_text(s->route->dst));
+	stat_increment("mta.task.handback", 1);
+
+	if (s->datafp) {
+		mta_fdcache_put(s->task->msgid, s->datafp);
+		s->datafp = NULL;
+	}
+	s->currevp = NULL;
+	mta_route_return_task(s->relay, s->task);
+	s->task = NULL;
+	stat_decrement("mta.task.running", 1);
+
+	mta_free(s);
+}
+
+static void
+mta_stall_arm(struct mta_session *s)
+{
+	int64_t	ms;
+
+	if (s->flags & MTA_STALL) {
+		runq_cancel(stall, s);
+		s->flags &= ~MTA_STALL;
+	}
+
+	if (s->task == NULL || s->pending == 0 ||
+	    (s->state != MTA_MAIL && s->state != MTA_RCPT &&
+	    s->state != MTA_DATA))
+		return;
+
+	if ((ms = mta_route_stall(s->relay, s->route)) == 0)
+		return;
+
+	s->flags |= MTA_STALL;
+	runq_schedule(stall, (ms + 999) / 1000, s);
+}
+
+static void
+mta_on_fd(struct mta_session *s, int fd)
+{
+	struct stat	sb;
+
+	if (fd == -1) {
+		log_debug("debug: mta: failed to obtain msg fd");
+		mta_flush_task(s, IMSG_MTA_DELIVERY_TEMPFAIL,
+		    "Could not get message fd", 0, 0);
+		mta_enter_state(s, MTA_READY);
+		return;
+	}
+
+	if ((s->ext & MTA_EXT_SIZE) && s->ext_size != 0) {
+		if (fstat(fd, &sb) == -1) {
+			log_debug("debug: mta: failed to stat msg fd");
+			mta_flush_task(s, IMSG_MTA_DELIVERY_TEMPFAIL,
+			    "Could not stat message fd", 0, 0);
+			mta_enter_state(s, MTA_READY);
+			close(fd);
+			return;
+		}
+		if (sb.st_size > (off_t)s->ext_size) {
+			log_debug("debug: mta: message too large for peer");
+			mta_flush_task(s, IMSG_MTA_DELIVERY_PERMFAIL,
+			    "message too large for peer", 0, 0);
+			mta_enter_state(s, MTA_READY);
+			close(fd);
+			return;
+		}
+	}
+
+	fadvise_sequential(fd);
+	s->datafp = fdopen(fd, "r");
+	if (s->datafp == NULL)
+		fatal("mta: fdopen");
+
+	mta_enter_state(s, MTA_MAIL);
+}
+
+/*
+ * Request the message fd of the next task of the relay, unless it is
+ * already cached or on its way.
+ */
+static void
+mta_fdcache_prefetch(struct mta_relay *relay)
+{
+	struct mta_task		*task;
+	struct mta_fdcache	*fc;
+
+	if ((task = TAILQ_FIRST(&relay->tasks)) == NULL)
+		return;
+	TAILQ_FOREACH(fc, &fdcache, entry)
+		if (fc->msgid == task->msgid)
+			return;
+	if (fdcache_count >= MTA_FDCACHE_MAX) {
+		/* evict the oldest fd not in flight */
+		TAILQ_FOREACH_REVERSE(fc, &fdcache, mta_fdcache_lru, entry)
+			if (fc->reqid == 0)
+				break;
+		if (fc == NULL)
+			return;
+		mta_fdcache_remove(fc);
+	}
+
+	fc = xcalloc(1, sizeof *fc);
+	fc->msgid = task->msgid;
+	fc->reqid = generate_uid();
+	fc->fd = -1;
+	TAILQ_INSERT_HEAD(&fdcache, fc, entry);
+	fdcache_count++;
+
+	m_create(p_queue, IMSG_MTA_OPEN_MESSAGE, 0, 0, -1);
+	m_add_id(p_queue, fc->reqid);
+	m_add_msgid(p_queue, fc->msgid);
+	m_close(p_queue);
+	stat_increment("mta.fdcache.prefetch", 1);
+}
+
+/*
+ * Hand the cached fd for the message to the session.  Returns 1 if the
+ * session got it or will get it once the pending request completes.
+ */
+static int
+mta_fdcache_get(struct mta_session *s, uint32_t msgid)
+{
+	struct mta_fdcache	*fc;
+	int			 fd;
+
+	TAILQ_FOREACH(fc, &fdcache, entry)
+		if (fc->msgid == msgid && fc->session == 0)
+			break;
+	if (fc == NULL) {
+		stat_increment("mta.fdcache.miss", 1);
+		return (0);
+	}
+	stat_increment("mta.fdcache.hit", 1);
+
+	if (fc->reqid) {
+		fc->session = s->id;
+		tree_xset(&wait_fd, s->id, s);
+		s->flags |= MTA_WAIT;
+		return (1);
+	}
+
+	fd = fc->fd;
+	fc->fd = -1;
+	mta_fdcache_remove(fc);
+	mta_on_fd(s, fd);
+	return (1);
+}
+
+/*
+ * Keep the fd of a message fully sent for another session.
+ */
+static void
+mta_fdcache_put(uint32_t msgid, FILE *fp)
+{
+	struct mta_fdcache	*fc;
+	int			 fd;
+
+	if (fdcache_count >= MTA_FDCACHE_MAX ||
+	    (fd = dup(fileno(fp))) == -1) {
+		fadvise_dontneed(fileno(fp));
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		close(fd);
+		return;
+	}
+
+	fc = xcalloc(1, sizeof *fc);
+	fc->msgid = msgid;
+	fc->fd = fd;
+	fc->tm = time(NULL);
+	TAILQ_INSERT_HEAD(&fdcache, fc, entry);
+	fdcache_count++;
+	mta_fdcache_arm();
+}
+
+static void
+mta_fdcache_arm(void)
+{
+	struct timeval	tv;
+
+	if (evtimer_pending(&ev_fdcache, NULL))
+		return;
+	tv.tv_sec = MTA_FDCACHE_TTL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_fdcache, &tv);
+}
+
+static void
+mta_fdcache_remove(struct mta_fdcache *fc)
+{
+	TAILQ_REMOVE(&fdcache, fc, entry);
+	fdcache_count--;
+	/* no other session took the message in time */
+	if (fc->fd != -1) {
+		fadvise_dontneed(fc->fd);
+		close(fc->fd);
+	}
+	free(fc);
+}
+
+static void
+mta_fdcache_expire(int fd, short ev, void *arg)
+{
+	struct mta_fdcache	*fc, *next;
+	time_t			 now;
+
+	now = time(NULL);
+	TAILQ_FOREACH_SAFE(fc, &fdcache, entry, next)
+		if (fc->reqid == 0 && fc->session == 0 &&
+		    fc->tm + MTA_FDCACHE_TTL <= now)
+			mta_fdcache_remove(fc);
+
+	if (!TAILQ_EMPTY(&fdcache))
+		mta_fdcache_arm();
+}
+
+static int
+mta_tlsfail_get(struct mta_host *h)
+{
+	struct mta_tlsfail	*tf;
+
+	if ((tf = hdict_get(&tlsfail, sa_to_text(h->sa))) == NULL)
+		return 0;
+	if (tf->expire <= time(NULL)) {
+		mta_tlsfail_remove(tf);
+		return 0;
+	}
+	return 1;
+}
+
+static void
+mta_tlsfail_set(struct mta_host *h, int failed)
+{
+	struct mta_tlsfail	*tf;
+	const char		*key = sa_to_text(h->sa);
+
+	if ((tf = hdict_get(&tlsfail, key)))
+		mta_tlsfail_remove(tf);
+	if (!failed)
+		return;
+	if (hdict_count(&tlsfail) >= MTA_TLSFAIL_MAX)
+		mta_tlsfail_remove(TAILQ_LAST(&tlsfail_lru, mta_tlsfail_lru));
+
+	tf = xcalloc(1, sizeof(*tf));
+	tf->key = xstrdup(key);
+	tf->expire = time(NULL) + MTA_TLSFAIL_TTL;
+	hdict_xset(&tlsfail, tf->key, tf);
+	TAILQ_INSERT_HEAD(&tlsfail_lru, tf, entry);
+}
+
+static void
+mta_tlsfail_remove(struct mta_tlsfail *tf)
+{
+	hdict_xpop(&tlsfail, tf->key);
+	TAILQ_REMOVE(&tlsfail_lru, tf, entry);
+	free(tf->key);
+	free(tf);
+}
+
 static void
 mta_on_ptr(void *tag, void *arg, void *data)
 {
@@ -480,6 +871,8 @@ mta_connect(struct mta_session *s)
 		io_free(s->io);
 		s->io = NULL;
 	}
+	s->pending = 0;
+	s->discard = 0;
 
 	s->use_smtps = s->use_starttls = s->use_smtp_tls = 0;
 
@@ -489,8 +882,16 @@ mta_connect(struct mta_session *s)
 			s->use_smtps = 1;	/* smtps */
 		else if (s->flags & (MTA_FORCE_TLS|MTA_FORCE_ANYSSL))
 			s->use_starttls = 1;	/* tls, tls+smtps */
-		else if (!(s->flags & MTA_FORCE_PLAIN))
-			s->use_smtp_tls = 1;
+		else if (!(s->flags & MTA_FORCE_PLAIN)) {
+			if (mta_tlsfail_get(s->route->dst)) {
+				log_debug("debug: mta: %p: TLS recently failed "
+				    "with %s, using plain SMTP", s,
+				    mta_host_to_text(s->route->dst));
+				s->flags |= MTA_DOWNGRADE_PLAIN;
+			}
+			else
+				s->use_smtp_tls = 1;
+		}
 		break;
 	case 1:
 		if (s->flags & MTA_FORCE_ANYSSL) {
@@ -540,6 +941,7 @@ mta_connect(struct mta_session *s)
 	s->io = io_new();
 	io_set_callback(s->io, mta_io, s);
 	io_set_timeout(s->io, 300000);
+	clock_gettime(CLOCK_MONOTONIC, &s->t_connect);
 	if (io_connect(s->io, sa, s->route->src->sa) == -1) {
 		/*
 		 * This error is most likely a "no route",
@@ -564,7 +966,6 @@ mta_enter_state(struct mta_session *s, int newstate)
 	char			 ibuf[LINE_MAX];
 	char			 obuf[LINE_MAX];
 	int			 offset;
-	const char     		*srs_sender;
 
 again:
 	oldstate = s->state;
@@ -606,7 +1007,7 @@ again:
 	case MTA_STARTTLS:
 		if (s->flags & MTA_DOWNGRADE_PLAIN)
 			mta_enter_state(s, MTA_AUTH);
-		if (s->flags & MTA_TLS) /* already started */
+		else if (s->flags & MTA_TLS) /* already started */
 			mta_enter_state(s, MTA_AUTH);
 		else if ((s->ext & MTA_EXT_STARTTLS) == 0) {
 			if (s->flags & MTA_FORCE_TLS || s->flags & MTA_WANT_SECURE) {
@@ -704,6 +1105,7 @@ again:
 
 	case MTA_READY:
 		/* Ready to send a new mail */
+		mta_pool_remove(s);
 		if (s->ready == 0) {
 			s->ready = 1;
 			s->relay->nconn_ready += 1;
@@ -735,19 +1137,31 @@ again:
 		else if (s->task)
 			fatalx("task should be NULL at this point");
 
+		/* leave new tasks to faster routes */
+		if (s->task == NULL && mta_route_slow(s->relay, s->route)) {
+			log_info("%016"PRIx64" mta leaving slow route %s",
+			    s->id, mta_host_to_text(s->route->dst));
+			mta_enter_state(s, MTA_QUIT);
+			break;
+		}
+
 		if (s->task == NULL)
 			s->task = mta_route_next_task(s->relay, s->route);
 		if (s->task == NULL) {
 			log_debug("debug: mta: %p: no task for relay %s",
 			    s, mta_relay_to_text(s->relay));
 
-			if (s->relay->nconn > 1 ||
-			    s->hangon >= s->relay->limits->sessdelay_keepalive) {
+			/* tasks held back by a rate limit, not idle */
+			if (s->relay->ntask)
+				s->hangon = 0;
+
+			if (s->hangon >= s->relay->limits->sessdelay_keepalive ||
+			    (!mta_pool_put(s) && s->relay->nconn > 1)) {
 				mta_enter_state(s, MTA_QUIT);
 				break;
 			}
 
-			log_debug("mta: debug: last connection: hanging on for %llds",
+			log_debug("mta: debug: idle connection: hanging on for %llds",
 			    (long long)(s->relay->limits->sessdelay_keepalive -
 			    s->hangon));
 			s->flags |= MTA_HANGON;
@@ -760,6 +1174,10 @@ again:
 
 		stat_increment("mta.task.running", 1);
 
+		mta_fdcache_prefetch(s->relay);
+		if (mta_fdcache_get(s, s->task->msgid))
+			break;
+
 		m_create(p_queue, IMSG_MTA_OPEN_MESSAGE, 0, 0, -1);
 		m_add_id(p_queue, s->id);
 		m_add_msgid(p_queue, s->task->msgid);
@@ -777,24 +1195,6 @@ again:
 		s->msgtried++;
 		envid_sz = strlen(e->dsn_envid);
 
-		/* SRS-encode if requested for the relay action, AND we're not
-		 * bouncing, AND we have an RCPT which means we are forwarded,
-		 * AND the RCPT has a '@' just for sanity check (will always).
-		 */
-		if (env->sc_srs_key != NULL &&
-		    s->relay->srs &&
-		    strchr(s->task->sender, '@') &&
-		    e->rcpt &&
-		    strchr(e->rcpt, '@')) {
-			/* encode and replace task sender with new SRS-sender */
-			srs_sender = srs_encode(s->task->sender,
-			    strchr(e->rcpt, '@') + 1);
-			if (srs_sender) {
-				free(s->task->sender);
-				s->task->sender = xstrdup(srs_sender);
-			}
-		}
-
 		if (s->ext & MTA_EXT_DSN) {
 			mta_send(s, "MAIL FROM:<%s>%s%s%s%s",
 			    s->task->sender,
@@ -804,6 +1204,19 @@ again:
 			    envid_sz ? e->dsn_envid : "");
 		} else
 			mta_send(s, "MAIL FROM:<%s>", s->task->sender);
+
+		/*
+		 * With PIPELINING, send the whole transaction up to DATA at
+		 * once.  The replies are still processed one at a time, in
+		 * order, as if each command had been sent after the previous
+		 * reply.
+		 */
+		if (s->ext & MTA_EXT_PIPELINING) {
+			TAILQ_FOREACH(e, &s->task->envelopes, entry)
+				mta_send_rcpt(s, e);
+			if (!(s->ext & MTA_EXT_CHUNKING))
+				mta_send(s, "DATA");
+		}
 		break;
 
 	case MTA_RCPT:
@@ -811,15 +1224,8 @@ again:
 			s->currevp = TAILQ_FIRST(&s->task->envelopes);
 
 		e = s->currevp;
-		if (s->ext & MTA_EXT_DSN) {
-			mta_send(s, "RCPT TO:<%s>%s%s%s%s",
-			    e->dest,
-			    e->dsn_notify ? " NOTIFY=" : "",
-			    e->dsn_notify ? dsn_strnotify(e->dsn_notify) : "",
-			    e->dsn_orcpt ? " ORCPT=" : "",
-			    e->dsn_orcpt ? e->dsn_orcpt : "");
-		} else
-			mta_send(s, "RCPT TO:<%s>", e->dest);
+		if (!(s->ext & MTA_EXT_PIPELINING))
+			mta_send_rcpt(s, e);
 
 		mta_report_tx_envelope(s, s->task->msgid, e->id);
 		s->rcptcount++;
@@ -827,7 +1233,15 @@ again:
 
 	case MTA_DATA:
 		fseek(s->datafp, 0, SEEK_SET);
-		mta_send(s, "DATA");
+		s->databol = 1;
+		clock_gettime(CLOCK_MONOTONIC, &s->t_data);
+		if (s->ext & MTA_EXT_CHUNKING) {
+			mta_report_tx_data(s, s->task->msgid, 1);
+			mta_enter_state(s, MTA_BDAT);
+			break;
+		}
+		if (!(s->ext & MTA_EXT_PIPELINING))
+			mta_send(s, "DATA");
 		break;
 
 	case MTA_BODY:
@@ -849,6 +1263,19 @@ again:
 		log_trace(TRACE_MTA, "mta: %p: >>> [...%zd bytes...]", s, q);
 		break;
 
+	case MTA_BDAT:
+		/* chunks do not wait for the reply to the previous one */
+		while (s->datafp && s->pending < MTA_BDAT_WINDOW &&
+		    io_queued(s->io) < MTA_HIWAT) {
+			if ((q = mta_queue_chunk(s)) == -1) {
+				s->flags |= MTA_FREE;
+				break;
+			}
+			log_trace(TRACE_MTA, "mta: %p: >>> [...%zd bytes...]",
+			    s, q);
+		}
+		break;
+
 	case MTA_EOM:
 		mta_send(s, ".");
 		break;
@@ -864,6 +1291,14 @@ again:
 			s->datafp = NULL;
 			s->datalen = 0;
 		}
+		/*
+		 * Replies to pipelined commands of the aborted transaction
+		 * are still on their way, RSET is sent once they are in.
+		 */
+		if (s->pending) {
+			s->discard = s->pending;
+			break;
+		}
 		mta_send(s, "RSET");
 		break;
 
@@ -892,10 +1327,20 @@ mta_response(struct mta_session *s, char *line)
 	char			 buf[LINE_MAX];
 	int			 delivery;
 
+	/* failed transactions for the destination statistics */
+	if ((line[0] == '4' || line[0] == '5') &&
+	    (s->state == MTA_MAIL || s->state == MTA_RCPT ||
+	    s->state == MTA_DATA || s->state == MTA_BDAT ||
+	    s->state == MTA_EOM || s->state == MTA_LMTP_EOM))
+		mta_stat_update(s->relay, s->route, line[0] == '4' ?
+		    MTA_STAT_TEMPFAIL : MTA_STAT_PERMFAIL, 0);
+
 	switch (s->state) {
 
 	case MTA_BANNER:
 		if (line[0] != '2') {
+			if (line[0] == '4')
+				mta_route_congested(s->relay, s->route, line);
 			mta_error(s, "BANNER rejected: %s", line);
 			s->flags |= MTA_FREE;
 			return;
@@ -955,6 +1400,8 @@ mta_response(struct mta_session *s, char *line)
 	case MTA_STARTTLS:
 		if (line[0] != '2') {
 			if (!(s->flags & MTA_WANT_SECURE)) {
+				if (s->use_smtp_tls)
+					mta_tlsfail_set(s->route->dst, 1);
 				mta_enter_state(s, MTA_AUTH);
 				return;
 			}
@@ -1013,8 +1460,10 @@ mta_response(struct mta_session *s, char *line)
 		if (line[0] != '2') {
 			if (line[0] == '5')
 				delivery = IMSG_MTA_DELIVERY_PERMFAIL;
-			else
+			else {
 				delivery = IMSG_MTA_DELIVERY_TEMPFAIL;
+				mta_route_congested(s->relay, s->route, line);
+			}
 
 			mta_flush_task(s, delivery, line, 0, 0);
 			mta_enter_state(s, MTA_RSET);
@@ -1051,6 +1500,8 @@ mta_response(struct mta_session *s, char *line)
 				delivery = IMSG_MTA_DELIVERY_PERMFAIL;
 			else
 				delivery = IMSG_MTA_DELIVERY_TEMPFAIL;
+			if (strncmp(line, "421", 3) == 0)
+				mta_route_congested(s->relay, s->route, line);
 			s->failures++;
 
 			/* remove failed envelope from task list */
@@ -1062,6 +1513,8 @@ mta_response(struct mta_session *s, char *line)
 			    mta_host_to_text(s->route->dst));
 
 			e->session = s->id;
+			if (s->flags & MTA_TLS)
+				e->tls = tls_to_text(io_tls(s->io));
 			/* XXX */
 			/*
 			 * getsockname() can only fail with ENOBUFS here
@@ -1138,17 +1591,46 @@ mta_response(struct mta_session *s, char *line)
 		mta_enter_state(s, MTA_RSET);
 		break;
 
+	case MTA_BDAT:
+		/* the reply to the last chunk ends the transaction */
+		if (s->datafp || s->pending) {
+			if (line[0] == '2') {
+				mta_enter_state(s, MTA_BDAT);
+				break;
+			}
+
+			if (line[0] == '5')
+				delivery = IMSG_MTA_DELIVERY_PERMFAIL;
+			else
+				delivery = IMSG_MTA_DELIVERY_TEMPFAIL;
+			mta_report_tx_rollback(s, s->task->msgid);
+			mta_report_tx_reset(s, s->task->msgid);
+			mta_flush_task(s, delivery, line, 0, 0);
+			mta_enter_state(s, MTA_RSET);
+			break;
+		}
+		/* FALLTHROUGH */
+
 	case MTA_LMTP_EOM:
 	case MTA_EOM:
+		if (s->state != MTA_LMTP_EOM)
+			mta_stat_update(s->relay, s->route, MTA_STAT_DATA,
+			    mta_elapsed(&s->t_data));
 		if (line[0] == '2') {
 			delivery = IMSG_MTA_DELIVERY_OK;
 			s->msgtried = 0;
 			s->msgcount++;
+			mta_route_success(s->relay, s->route);
+			if (s->state != MTA_LMTP_EOM)
+				mta_stat_update(s->relay, s->route,
+				    MTA_STAT_MESSAGE, s->datalen);
 		}
 		else if (line[0] == '5')
 			delivery = IMSG_MTA_DELIVERY_PERMFAIL;
-		else
+		else {
 			delivery = IMSG_MTA_DELIVERY_TEMPFAIL;
+			mta_route_congested(s->relay, s->route, line);
+		}
 		if (delivery != IMSG_MTA_DELIVERY_OK) {
 			mta_report_tx_rollback(s, s->task->msgid);
 			mta_report_tx_reset(s, s->task->msgid);
@@ -1207,6 +1689,7 @@ mta_io(struct io *io, int evt, void *arg)
 	char			*line, *msg, *p;
 	size_t			 len;
 	const char		*error;
+	int64_t			 ms;
 	int			 cont;
 
 	log_trace(TRACE_IO, "mta: %p: %s %s", s, io_strevent(evt),
@@ -1215,6 +1698,12 @@ mta_io(struct io *io, int evt, void *arg)
 	switch (evt) {
 
 	case IO_CONNECTED:
+		stat_latency("mta.latency.connect", &s->t_connect);
+		ms = mta_elapsed(&s->t_connect);
+		mta_route_latency(s->relay, s->route, ms);
+		mta_stat_update(s->relay, s->route, MTA_STAT_CONNECT, ms);
+		if (s->flags & MTA_CONNECTING)
+			mta_connect_won(s);
 		mta_connected(s);
 
 		if (s->use_smtps) {
@@ -1230,9 +1719,13 @@ mta_io(struct io *io, int evt, void *arg)
 		break;
 
 	case IO_TLSREADY:
+		stat_latency("mta.latency.tls", &s->t_tls);
+		mta_stat_update(s->relay, s->route, MTA_STAT_TLS,
+		    mta_elapsed(&s->t_tls));
 		log_info("%016"PRIx64" mta tls ciphers=%s",
 		    s->id, tls_to_text(io_tls(s->io)));
 		s->flags |= MTA_TLS;
+		mta_tlsfail_set(s->route->dst, 0);
 		if (s->relay->dispatcher->u.remote.tls_verify)
 			s->flags |= MTA_TLS_VERIFIED;
 
@@ -1280,6 +1773,8 @@ mta_io(struct io *io, int evt, void *arg)
 			}
 			else if (strcmp(msg, "PIPELINING") == 0)
 				s->ext |= MTA_EXT_PIPELINING;
+			else if (strcmp(msg, "CHUNKING") == 0)
+				s->ext |= MTA_EXT_CHUNKING;
 			else if (strcmp(msg, "DSN") == 0)
 				s->ext |= MTA_EXT_DSN;
 			else if (strncmp(msg, "SIZE ", 5) == 0) {
@@ -1319,6 +1814,18 @@ mta_io(struct io *io, int evt, void *arg)
 				(void)strlcpy(s->replybuf, line, sizeof s->replybuf);
 		}
 
+		/* with pipelining, from the previous reply */
+		if (s->pending) {
+			s->pending--;
+			stat_latency("mta.latency.reply", &s->t_reply);
+			/* the end of data reply waits for the whole body */
+			if (s->state != MTA_BDAT && s->state != MTA_EOM &&
+			    s->state != MTA_LMTP_EOM)
+				mta_route_reply(s->relay, s->route,
+				    mta_elapsed(&s->t_reply));
+			clock_gettime(CLOCK_MONOTONIC, &s->t_reply);
+		}
+
 		if (s->state == MTA_QUIT) {
 			log_info("%016"PRIx64" mta disconnected reason=quit messages=%zu",
 			    s->id, s->msgcount);
@@ -1326,7 +1833,18 @@ mta_io(struct io *io, int evt, void *arg)
 			return;
 		}
 		io_set_write(io);
-		mta_response(s, s->replybuf);
+		if (s->discard) {
+			s->discard--;
+			/* the peer took DATA anyway, end the empty message */
+			if (s->replybuf[0] == '3') {
+				mta_send(s, ".");
+				s->discard++;
+			}
+			else if (s->discard == 0)
+				mta_enter_state(s, MTA_RSET);
+		}
+		else
+			mta_response(s, s->replybuf);
 		if (s->flags & MTA_FREE) {
 			mta_free(s);
 			return;
@@ -1336,8 +1854,15 @@ mta_io(struct io *io, int evt, void *arg)
 			mta_connect(s);
 			return;
 		}
+		mta_stall_arm(s);
 
-		if (io_datalen(s->io)) {
+		/* wait for the next reply to a pipelined command */
+		if (s->pending && io_queued(s->io) == 0) {
+			io_set_read(io);
+			goto nextline;
+		}
+
+		if (io_datalen(s->io) && s->pending == 0) {
 			log_debug("debug: mta: remaining data in input buffer");
 			mta_error(s, "Remote host sent too much data");
 			if (s->flags & MTA_WAIT)
@@ -1348,16 +1873,21 @@ mta_io(struct io *io, int evt, void *arg)
 		break;
 
 	case IO_LOWAT:
-		if (s->state == MTA_BODY) {
-			mta_enter_state(s, MTA_BODY);
+		if (s->state == MTA_BODY ||
+		    (s->state == MTA_BDAT && s->datafp)) {
+			mta_enter_state(s, s->state);
 			if (s->flags & MTA_FREE) {
 				mta_free(s);
 				return;
 			}
 		}
 
-		if (io_queued(s->io) == 0)
+		if (io_queued(s->io) == 0) {
 			io_set_read(io);
+			/* replies to pipelined commands may be buffered */
+			if (io_datalen(io))
+				mta_io(io, IO_DATAIN, s);
+		}
 		break;
 
 	case IO_TIMEOUT:
@@ -1380,6 +1910,7 @@ mta_io(struct io *io, int evt, void *arg)
 			    "downgrading to plain", s->id);
 			s->flags &= ~MTA_TLS;
 			s->flags |= MTA_DOWNGRADE_PLAIN;
+			mta_tlsfail_set(s->route->dst, 1);
 			mta_connect(s);
 			break;
 		}
@@ -1425,31 +1956,66 @@ mta_send(struct mta_session *s, char *fmt, ...)
 		mta_report_protocol_client(s, p);
 
 	io_xprintf(s->io, "%s\r\n", p);
+	if (s->pending++ == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &s->t_reply);
+		mta_stall_arm(s);
+	}
 
 	free(p);
 }
 
+static void
+mta_send_rcpt(struct mta_session *s, struct mta_envelope *e)
+{
+	if (s->ext & MTA_EXT_DSN) {
+		mta_send(s, "RCPT TO:<%s>%s%s%s%s",
+		    e->dest,
+		    e->dsn_notify ? " NOTIFY=" : "",
+		    e->dsn_notify ? dsn_strnotify(e->dsn_notify) : "",
+		    e->dsn_orcpt ? " ORCPT=" : "",
+		    e->dsn_orcpt ? e->dsn_orcpt : "");
+	} else
+		mta_send(s, "RCPT TO:<%s>", e->dest);
+}
+
 /*
  * Queue some data into the input buffer
  */
+/*
+ * Queue the message body for DATA.  The content file is read in large
+ * blocks and copied into the output buffer one line span at a time,
+ * with dot-stuffing and CRLF line endings.
+ */
 static ssize_t
 mta_queue_data(struct mta_session *s)
 {
-	char	*ln = NULL;
-	size_t	 sz = 0, q;
-	ssize_t	 len;
+	char	 buf[MTA_HIWAT];
+	char	*p, *nl, *end;
+	size_t	 len, q;
 
 	q = io_queued(s->io);
 
 	while (io_queued(s->io) < MTA_HIWAT) {
-		if ((len = getline(&ln, &sz, s->datafp)) == -1)
+		if ((len = fread(buf, 1, sizeof(buf), s->datafp)) == 0)
 			break;
-		if (ln[len - 1] == '\n')
-			ln[len - 1] = '\0';
-		s->datalen += io_xprintf(s->io, "%s%s\r\n", *ln == '.' ? "." : "", ln);
+		end = buf + len;
+		for (p = buf; p < end; p = nl + 1) {
+			if (s->databol && *p == '.' &&
+			    io_write(s->io, ".", 1) == -1)
+				fatal("mta: io_write");
+			if ((nl = memchr(p, '\n', end - p)) == NULL) {
+				if (io_write(s->io, p, end - p) == -1)
+					fatal("mta: io_write");
+				s->databol = 0;
+				break;
+			}
+			if (io_write(s->io, p, nl - p) == -1 ||
+			    io_write(s->io, "\r\n", 2) == -1)
+				fatal("mta: io_write");
+			s->databol = 1;
+		}
 	}
 
-	free(ln);
 	if (ferror(s->datafp)) {
 		mta_flush_task(s, IMSG_MTA_DELIVERY_TEMPFAIL,
 		    "Error reading content file", 0, 0);
@@ -1457,13 +2023,70 @@ mta_queue_data(struct mta_session *s)
 	}
 
 	if (feof(s->datafp)) {
-		fclose(s->datafp);
+		/* terminate an incomplete last line */
+		if (!s->databol && io_write(s->io, "\r\n", 2) == -1)
+			fatal("mta: io_write");
+		mta_fdcache_put(s->task->msgid, s->datafp);
 		s->datafp = NULL;
 	}
 
+	s->datalen += io_queued(s->io) - q;
+
 	return (io_queued(s->io) - q);
 }
 
+/*
+ * Queue the next BDAT chunk.  The content file is sent as is, only
+ * line endings need to be turned into CRLF.
+ */
+static ssize_t
+mta_queue_chunk(struct mta_session *s)
+{
+	char	 buf[MTA_HIWAT];
+	char	*p, *nl;
+	size_t	 len, size;
+	int	 last;
+
+	len = fread(buf, 1, sizeof(buf), s->datafp);
+	if (ferror(s->datafp)) {
+		mta_flush_task(s, IMSG_MTA_DELIVERY_TEMPFAIL,
+		    "Error reading content file", 0, 0);
+		return (-1);
+	}
+	last = feof(s->datafp);
+
+	size = len;
+	for (p = buf; (nl = memchr(p, '\n', buf + len - p)); p = nl + 1)
+		size++;
+
+	mta_send(s, "BDAT %zu%s", size, last ? " LAST" : "");
+	for (p = buf; (nl = memchr(p, '\n', buf + len - p)); p = nl + 1)
+		if (io_write(s->io, p, nl - p) == -1 ||
+		    io_write(s->io, "\r\n", 2) == -1)
+			fatal("mta: io_write");
+	if (io_write(s->io, p, buf + len - p) == -1)
+		fatal("mta: io_write");
+	s->datalen += size;
+
+	if (last) {
+		mta_fdcache_put(s->task->msgid, s->datafp);
+		s->datafp = NULL;
+	}
+
+	return (size);
+}
+
+/* milliseconds since the given time */
+static int64_t
+mta_elapsed(const struct timespec *t)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - t->tv_sec) * 1000 +
+	    (now.tv_nsec - t->tv_nsec) / 1000000);
+}
+
 static void
 mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t count,
 	int cache)
@@ -1490,6 +2113,9 @@ mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t co
 		/* we're about to log, associate session to envelope */
 		e->session = s->id;
 		e->ext = s->ext;
+		e->datalen = s->datalen;
+		if (s->flags & MTA_TLS)
+			e->tls = tls_to_text(io_tls(s->io));
 
 		/* XXX */
 		/*
@@ -1518,6 +2144,7 @@ mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t co
 	}
 
 	free(s->task->sender);
+	memory_free(MEMORY_MTA, sizeof *s->task);
 	free(s->task);
 	s->task = NULL;
 
@@ -1551,6 +2178,9 @@ mta_error(struct mta_session *s, const char *fmt, ...)
 		log_info("%016"PRIx64" mta error reason=%s",
 		    s->id, error);
 
+	if (s->state == MTA_INIT && !(s->flags & MTA_CANCELLED))
+		mta_route_congested(s->relay, s->route, error);
+
 	/*
 	 * If not connected yet, and the error is not local, just ignore it
 	 * and try to reconnect.
@@ -1574,6 +2204,7 @@ static void
 mta_tls_init(struct mta_session *s)
 {
 	struct dispatcher_remote *remote;
+	struct tls_config *config;
 	struct tls *tls;
 
 	if ((tls = tls_client()) == NULL) {
@@ -1587,15 +2218,16 @@ mta_tls_init(struct mta_session *s)
 		/* If TLS not explicitly configured, use implicit config. */
 		remote->tls_required = 1;
 		remote->tls_verify = 1;
-		tls_config_verify(remote->tls_config);
 	}
-	if (tls_configure(tls, remote->tls_config) == -1) {
+	config = mta_tls_config(remote, sa_to_text(s->route->dst->sa));
+	if (config == NULL || tls_configure(tls, config) == -1) {
 		log_info("%016"PRIx64" mta closing reason=tls-failure", s->id);
 		tls_free(tls);
 		s->flags |= MTA_FREE;
 		return;
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &s->t_tls);
 	if (io_connect_tls(s->io, tls, s->mxname) == -1) {
 		log_info("%016"PRIx64" mta closing reason=tls-connect-failed", s->id);
 		tls_free(tls);
@@ -1688,6 +2320,7 @@ mta_strstate(int state)
 	CASE(MTA_RCPT);
 	CASE(MTA_DATA);
 	CASE(MTA_BODY);
+	CASE(MTA_BDAT);
 	CASE(MTA_EOM);
 	CASE(MTA_LMTP_EOM);
 	CASE(MTA_RSET);
@@ -1744,6 +2377,143 @@ mta_connected(struct mta_session *s)
 	    &sa_dest);
 }
 
+/*
+ * Take over an idle session established on the given route for another
+ * relay.  Returns the relay it was attached to, or NULL if none could be
+ * reused.
+ */
+struct mta_relay *
+mta_session_reuse(struct mta_relay *relay, struct mta_route *route,
+    const char *mxname)
+{
+	struct mta_session	*s;
+	struct mta_relay	*old;
+	void			*iter;
+
+	mta_session_init();
+
+	iter = NULL;
+	while (tree_iter(&pool, &iter, NULL, (void **)&s)) {
+		if (s->route != route || !mta_pool_match(s, relay, mxname))
+			continue;
+
+		log_debug("debug: mta: %p: reusing idle session for relay %s",
+		    s, mta_relay_to_text(relay));
+		stat_increment("mta.session.reused", 1);
+
+		mta_pool_remove(s);
+		old = s->relay;
+		old->nconn_ready -= 1;
+		relay->nconn_ready += 1;
+		s->relay = relay;
+		intern_release(s->mxname);
+		s->mxname = intern_ref(mxname);
+		s->hangon = 0;
+
+		/* pick the first task asynchronously */
+		runq_cancel(hangon, s);
+		s->flags |= MTA_HANGON;
+		runq_schedule(hangon, 0, s);
+		return old;
+	}
+
+	return NULL;
+}
+
+static int
+mta_pool_put(struct mta_session *s)
+{
+	if (s->flags & MTA_POOLED)
+		return 1;
+	if (tree_count(&pool) >= MTA_POOL_MAX)
+		return 0;
+
+	s->flags |= MTA_POOLED;
+	tree_xset(&pool, s->id, s);
+	return 1;
+}
+
+static void
+mta_pool_remove(struct mta_session *s)
+{
+	if (!(s->flags & MTA_POOLED))
+		return;
+
+	s->flags &= ~MTA_POOLED;
+	tree_xpop(&pool, s->id);
+}
+
+static int
+mta_pool_strcmp(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a != b;
+	return strcmp(a, b);
+}
+
+/*
+ * The session must behave exactly as one the relay would have opened:
+ * same dispatcher (thus TLS and filter settings), transport, port,
+ * credentials and helo.  A verified TLS session is only reused for the
+ * MX name it was verified against.
+ */
+static int
+mta_pool_match(struct mta_session *s, struct mta_relay *relay,
+    const char *mxname)
+{
+	struct mta_relay	*r = s->relay;
+
+	if (r == relay || s->task || s->msgcount >=
+	    relay->limits->max_mail_per_session)
+		return 0;
+	if (r->dispatcher != relay->dispatcher || r->tls != relay->tls ||
+	    r->flags != relay->flags || r->port != relay->port)
+		return 0;
+	if (mta_pool_strcmp(r->authtable, relay->authtable) ||
+	    mta_pool_strcmp(r->authlabel, relay->authlabel) ||
+	    mta_pool_strcmp(r->helotable, relay->helotable) ||
+	    mta_pool_strcmp(r->heloname, relay->heloname))
+		return 0;
+	if ((s->flags & MTA_TLS_VERIFIED) && strcasecmp(s->mxname, mxname))
+		return 0;
+	return 1;
+}
+
+/*
+ * The first connection to a relay is established: abort the attempts
+ * still connecting on other routes.  Their routes are not penalized.
+ */
+static void
+mta_connect_won(struct mta_session *s)
+{
+	struct mta_session	*o;
+	void			*iter;
+	int			 found;
+
+	s->flags &= ~MTA_CONNECTING;
+	tree_xpop(&wait_connect, s->id);
+	s->relay->nconn_pending -= 1;
+
+	do {
+		found = 0;
+		iter = NULL;
+		while (tree_iter(&wait_connect, &iter, NULL, (void **)&o)) {
+			if (o->relay != s->relay || o->io == NULL ||
+			    o->state != MTA_INIT)
+				continue;
+			found = 1;
+			break;
+		}
+		if (found) {
+			log_info("%016"PRIx64" mta closing "
+			    "reason=connection-race-lost", o->id);
+			stat_increment("mta.connect.cancelled", 1);
+			o->flags |= MTA_CANCELLED;
+			mta_free(o);
+		}
+	} while (found);
+}
+
 static void
 mta_disconnected(struct mta_session *s)
 {
@@ -0,0 +1,304 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Per-destination delivery statistics.
+ *
+ * The mta sessions report connections, TLS handshakes, the end of data
+ * replies, delivered messages and failed transactions for the domain,
+ * the MX host and the route they use.  Counters are kept in slots of
+ * MTA_STAT_SLOT seconds over a window of MTA_STAT_SLOTS slots, and
+ * "show destinations" reports rates and average times over it.
+ *
+ * At most MTA_STAT_MAX destinations of each kind are tracked.  When a
+ * new one shows up, the one with the least activity in the window is
+ * folded into an "other" entry, so the busiest destinations stay.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <event.h>
+#include <imsg.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define	MTA_STAT_SLOT	30	/* seconds */
+#define	MTA_STAT_SLOTS	10
+#define	MTA_STAT_MAX	100
+
+enum mta_stat_kind {
+	MTA_STAT_DOMAIN,
+	MTA_STAT_HOST,
+	MTA_STAT_ROUTE,
+	MTA_STAT_KINDS,
+};
+
+struct mta_stat_slot {
+	time_t		epoch;
+	uint64_t	count[MTA_STAT_TYPES];
+	uint64_t	value[MTA_STAT_TYPES];
+};
+
+struct mta_stat {
+	char			*name;
+	time_t			 created;
+	struct mta_stat_slot	 slots[MTA_STAT_SLOTS];
+};
+
+static struct mta_stat *mta_stat_get(enum mta_stat_kind, const char *, time_t);
+static struct mta_stat_slot *mta_stat_slot(struct mta_stat *, time_t);
+static void mta_stat_fold(struct mta_stat *, struct mta_stat *, time_t);
+static uint64_t mta_stat_activity(struct mta_stat *, time_t);
+static void mta_stat_sum(struct mta_stat *, time_t, struct mta_stat_slot *);
+static void mta_stat_line(struct mproc *, uint32_t, enum mta_stat_kind,
+    struct mta_stat *, time_t);
+static const char *mta_stat_ms(const struct mta_stat_slot *,
+    enum mta_stat_type, char *, size_t);
+
+static const char *mta_stat_kind_name[] = {
+	[MTA_STAT_DOMAIN]	= "domain",
+	[MTA_STAT_HOST]		= "host",
+	[MTA_STAT_ROUTE]	= "route",
+};
+
+static struct dict	mta_stats[MTA_STAT_KINDS];
+static struct mta_stat	mta_stat_other[MTA_STAT_KINDS];
+static int		mta_stat_inited;
+
+void
+mta_stat_update(struct mta_relay *relay, struct mta_route *route,
+    enum mta_stat_type type, uint64_t value)
+{
+	struct mta_stat_slot	*slot;
+	char			 buf[LINE_MAX];
+	const char		*names[MTA_STAT_KINDS];
+	time_t			 now;
+	int			 i;
+
+	now = time(NULL);
+	if (!mta_stat_inited) {
+		for (i = 0; i < MTA_STAT_KINDS; i++) {
+			dict_init(&mta_stats[i]);
+			mta_stat_other[i].name = "other";
+			mta_stat_other[i].created = now;
+		}
+		mta_stat_inited = 1;
+	}
+
+	(void)snprintf(buf, sizeof buf, "%s <-> %s",
+	    route->src->sa ? sa_to_text(route->src->sa) : "[]",
+	    sa_to_text(route->dst->sa));
+	names[MTA_STAT_DOMAIN] = relay->domain->name;
+	names[MTA_STAT_HOST] = sa_to_text(route->dst->sa);
+	names[MTA_STAT_ROUTE] = buf;
+
+	for (i = 0; i < MTA_STAT_KINDS; i++) {
+		slot = mta_stat_slot(mta_stat_get(i, names[i], now), now);
+		slot->count[type] += 1;
+		slot->value[type] += value;
+	}
+}
+
+void
+mta_stat_show(struct mproc *p, uint32_t peerid)
+{
+	struct mta_stat	*st;
+	const char	*name;
+	void		*iter;
+	time_t		 now;
+	int		 i;
+
+	if (!mta_stat_inited)
+		return;
+
+	now = time(NULL);
+	for (i = 0; i < MTA_STAT_KINDS; i++) {
+		iter = NULL;
+		while (dict_iter(&mta_stats[i], &iter, &name, (void **)&st))
+			mta_stat_line(p, peerid, i, st, now);
+		if (mta_stat_activity(&mta_stat_other[i], now))
+			mta_stat_line(p, peerid, i, &mta_stat_other[i], now);
+	}
+}
+
+static struct mta_stat *
+mta_stat_get(enum mta_stat_kind kind, const char *name, time_t now)
+{
+	struct mta_stat	*st, *victim = NULL;
+	const char	*key;
+	void		*iter;
+	uint64_t	 n, min = UINT64_MAX;
+
+	if ((st = dict_get(&mta_stats[kind], name)) != NULL)
+		return (st);
+
+	if (dict_count(&mta_stats[kind]) >= MTA_STAT_MAX) {
+		iter = NULL;
+		while (dict_iter(&mta_stats[kind], &iter, &key, (void **)&st))
+			if ((n = mta_stat_activity(st, now)) < min) {
+				min = n;
+				victim = st;
+			}
+		dict_xpop(&mta_stats[kind], victim->name);
+		mta_stat_fold(&mta_stat_other[kind], victim, now);
+		memory_free(MEMORY_MTA, sizeof *victim +
+		    strlen(victim->name) + 1);
+		free(victim->name);
+		free(victim);
+	}
+
+	st = xcalloc(1, sizeof *st);
+	st->name = xstrdup(name);
+	st->created = now;
+	dict_xset(&mta_stats[kind], st->name, st);
+	memory_alloc(MEMORY_MTA, sizeof *st + strlen(st->name) + 1);
+	return (st);
+}
+
+/*
+ * Return the slot for the current time, clearing it if it was last used
+ * for an older period.
+ */
+static struct mta_stat_slot *
+mta_stat_slot(struct mta_stat *st, time_t now)
+{
+	struct mta_stat_slot	*slot;
+	time_t			 epoch = now / MTA_STAT_SLOT;
+
+	slot = &st->slots[epoch % MTA_STAT_SLOTS];
+	if (slot->epoch != epoch) {
+		memset(slot, 0, sizeof *slot);
+		slot->epoch = epoch;
+	}
+	return (slot);
+}
+
+static void
+mta_stat_fold(struct mta_stat *dst, struct mta_stat *src, time_t now)
+{
+	struct mta_stat_slot	*from, *to;
+	time_t			 epoch = now / MTA_STAT_SLOT;
+	int			 i, t;
+
+	for (i = 0; i < MTA_STAT_SLOTS; i++) {
+		from = &src->slots[i];
+		if (from->epoch <= epoch - MTA_STAT_SLOTS)
+			continue;
+		to = &dst->slots[i];
+		if (to->epoch != from->epoch) {
+			memset(to, 0, sizeof *to);
+			to->epoch = from->epoch;
+		}
+		for (t = 0; t < MTA_STAT_TYPES; t++) {
+			to->count[t] += from->count[t];
+			to->value[t] += from->value[t];
+		}
+	}
+}
+
+static uint64_t
+mta_stat_activity(struct mta_stat *st, time_t now)
+{
+	struct mta_stat_slot	sum;
+	uint64_t		n = 0;
+	int			t;
+
+	mta_stat_sum(st, now, &sum);
+	for (t = 0; t < MTA_STAT_TYPES; t++)
+		n += sum.count[t];
+	return (n);
+}
+
+static void
+mta_stat_sum(struct mta_stat *st, time_t now, struct mta_stat_slot *sum)
+{
+	struct mta_stat_slot	*slot;
+	time_t			 epoch = now / MTA_STAT_SLOT;
+	int			 i, t;
+
+	memset(sum, 0, sizeof *sum);
+	for (i = 0; i < MTA_STAT_SLOTS; i++) {
+		slot = &st->slots[i];
+		if (slot->epoch <= epoch - MTA_STAT_SLOTS)
+			continue;
+		for (t = 0; t < MTA_STAT_TYPES; t++) {
+			sum->count[t] += slot->count[t];
+			sum->value[t] += slot->value[t];
+		}
+	}
+}
+
+static void
+mta_stat_line(struct mproc *p, uint32_t peerid, enum mta_stat_kind kind,
+    struct mta_stat *st, time_t now)
+{
+	struct mta_stat_slot	 sum;
+	char			 buf[LINE_MAX];
+	char			 conn[32], tls[32], data[32];
+	uint64_t		 msgs, fails;
+	time_t			 span;
+
+	mta_stat_sum(st, now, &sum);
+
+	/* rates over the part of the window the entry has been there */
+	span = now - st->created;
+	if (span > MTA_STAT_SLOT * MTA_STAT_SLOTS)
+		span = MTA_STAT_SLOT * MTA_STAT_SLOTS;
+	if (span < 1)
+		span = 1;
+
+	msgs = sum.count[MTA_STAT_MESSAGE];
+	fails = sum.count[MTA_STAT_TEMPFAIL] + sum.count[MTA_STAT_PERMFAIL];
+	(void)snprintf(buf, sizeof buf,
+	    "%s %s msgs=%"PRIu64" msg/s=%.2f bytes/s=%.0f"
+	    " connect=%s tls=%s data=%s 4xx=%"PRIu64" 5xx=%"PRIu64
+	    " failed=%.1f%%",
+	    mta_stat_kind_name[kind], st->name,
+	    msgs, (double)msgs / span,
+	    (double)sum.value[MTA_STAT_MESSAGE] / span,
+	    mta_stat_ms(&sum, MTA_STAT_CONNECT, conn, sizeof conn),
+	    mta_stat_ms(&sum, MTA_STAT_TLS, tls, sizeof tls),
+	    mta_stat_ms(&sum, MTA_STAT_DATA, data, sizeof data),
+	    sum.count[MTA_STAT_TEMPFAIL],
+	    sum.count[MTA_STAT_PERMFAIL],
+	    msgs + fails ? 100.0 * fails / (msgs + fails) : 0.0);
+
+	m_compose(p, IMSG_CTL_MTA_SHOW_DESTINATIONS, peerid, 0, -1,
+	    buf, strlen(buf) + 1);
+}
+
+static const char *
+mta_stat_ms(const struct mta_stat_slot *sum, enum mta_stat_type type,
+    char *buf, size_t len)
+{
+	if (sum->count[type] == 0)
+		return ("-");
+	(void)snprintf(buf, len, "%"PRIu64"ms",
+	    sum->value[type] / sum->count[type]);
+	return (buf);
+}
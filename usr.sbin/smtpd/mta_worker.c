@@ -0,0 +1,271 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Outbound delivery workers.
+ *
+ * With "mta workers", the mta does not run in the dispatcher but in a
+ * set of worker processes.  The queue hands each envelope to the worker
+ * owning its relay, picked by hashing the destination domain, or the
+ * action name when the action relays through a smarthost.  A relay,
+ * its domain and its routes are thus always in the same worker and the
+ * limits on them hold as configured.
+ *
+ * Relays of different domains may share MX hosts and sources, so the
+ * per-host, per-route, per-source and per-connector limits are divided
+ * between the workers.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <ctype.h>
+#include <event.h>
+#include <grp.h> /* needed for setgroups */
+#include <imsg.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+static void mta_worker_imsg(struct mproc *, struct imsg *);
+static void mta_worker_limits(void);
+static size_t mta_worker_share(size_t);
+static void mta_worker_shutdown(void);
+
+static void
+mta_worker_imsg(struct mproc *p, struct imsg *imsg)
+{
+	struct msg	m;
+	uint32_t	in, out;
+	int		v;
+
+	if (imsg == NULL)
+		mta_worker_shutdown();
+
+	switch (imsg->hdr.type) {
+	case IMSG_GETADDRINFO:
+	case IMSG_GETADDRINFO_END:
+	case IMSG_GETNAMEINFO:
+	case IMSG_RES_QUERY:
+		resolver_dispatch_result(p, imsg);
+		return;
+
+	case IMSG_CA_RSA_PRIVENC:
+	case IMSG_CA_RSA_PRIVDEC:
+	case IMSG_CA_ECDSA_SIGN:
+		ca_dispatch_result(p, imsg);
+		return;
+
+	case IMSG_CTL_VERBOSE:
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		log_trace_verbose(v);
+		return;
+
+	case IMSG_CTL_PROFILE:
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		profiling = v;
+		return;
+
+	case IMSG_REPORT_SMTP_EVENTS:
+		m_msg(&m, imsg);
+		m_get_u32(&m, &in);
+		m_get_u32(&m, &out);
+		m_end(&m);
+		report_smtp_events(in, out);
+		return;
+
+	case IMSG_QUEUE_TRANSFER:
+	case IMSG_MTA_OPEN_MESSAGE:
+	case IMSG_MTA_LOOKUP_CREDENTIALS:
+	case IMSG_MTA_LOOKUP_SMARTHOST:
+	case IMSG_MTA_LOOKUP_SOURCE:
+	case IMSG_MTA_LOOKUP_HELO:
+	case IMSG_MTA_DNS_HOST:
+	case IMSG_MTA_DNS_HOST_END:
+	case IMSG_MTA_DNS_MX_PREFERENCE:
+	case IMSG_LKA_TABLE_CHANGED:
+	case IMSG_CTL_RESUME_ROUTE:
+	case IMSG_CTL_MTA_SHOW_HOSTS:
+	case IMSG_CTL_MTA_SHOW_RELAYS:
+	case IMSG_CTL_MTA_SHOW_ROUTES:
+	case IMSG_CTL_MTA_SHOW_HOSTSTATS:
+	case IMSG_CTL_MTA_BLOCK:
+	case IMSG_CTL_MTA_UNBLOCK:
+	case IMSG_CTL_MTA_SHOW_BLOCK:
+	case IMSG_CTL_MTA_SHOW_DESTINATIONS:
+		mta_imsg(p, imsg);
+		return;
+	}
+
+	fatalx("mta_worker_imsg: unexpected %s imsg",
+	    imsg_to_str(imsg->hdr.type));
+}
+
+/*
+ * The worker owning the relay of an envelope, the dispatcher when
+ * there are no workers.
+ */
+struct mproc *
+mta_peer(const struct envelope *evp)
+{
+	struct dispatcher	*dispatcher;
+	const char		*key, *s;
+	uint32_t		 h = 2166136261U;
+
+	if (env->sc_mta_workers == 0)
+		return (p_dispatcher);
+
+	key = evp->dest.domain;
+	dispatcher = hdict_get(env->sc_dispatchers, evp->dispatcher);
+	if (dispatcher && dispatcher->type == DISPATCHER_REMOTE &&
+	    dispatcher->u.remote.smarthost)
+		key = evp->dispatcher;
+
+	for (s = key; *s; s++) {
+		h ^= (unsigned char)tolower((unsigned char)*s);
+		h *= 16777619U;
+	}
+
+	return (p_mta[h % env->sc_mta_workers]);
+}
+
+/*
+ * The processes running the mta, for the requests that concern all of
+ * them.
+ */
+int
+mta_peer_count(void)
+{
+	return (env->sc_mta_workers ? env->sc_mta_workers : 1);
+}
+
+struct mproc *
+mta_peer_at(int i)
+{
+	return (env->sc_mta_workers ? p_mta[i] : p_dispatcher);
+}
+
+static void
+mta_worker_limits(void)
+{
+	struct mta_limits	*l;
+	void			*iter;
+
+	iter = NULL;
+	while (dict_iter(env->sc_limits_dict, &iter, NULL, (void **)&l)) {
+		l->maxconn_per_host = mta_worker_share(l->maxconn_per_host);
+		l->maxconn_per_route = mta_worker_share(l->maxconn_per_route);
+		l->maxconn_per_source = mta_worker_share(l->maxconn_per_source);
+		l->maxconn_per_connector =
+		    mta_worker_share(l->maxconn_per_connector);
+		l->adaptive_max = mta_worker_share(l->adaptive_max);
+		if (l->adaptive_min > l->adaptive_max && l->adaptive_max)
+			l->adaptive_min = l->adaptive_max;
+		l->mailrate_host = mta_worker_share(l->mailrate_host);
+		l->mailrate_source = mta_worker_share(l->mailrate_source);
+		l->rcptrate_host = mta_worker_share(l->rcptrate_host);
+		l->rcptrate_source = mta_worker_share(l->rcptrate_source);
+	}
+}
+
+/* this worker's part of a limit, 0 staying for no limit */
+static size_t
+mta_worker_share(size_t limit)
+{
+	size_t	n = env->sc_mta_workers;
+
+	if (limit == 0)
+		return (0);
+	limit = limit / n + (limit % n > (size_t)env->sc_mta_worker);
+	return (limit ? limit : 1);
+}
+
+static void
+mta_worker_shutdown(void)
+{
+	log_debug("debug: mta worker exiting");
+	_exit(0);
+}
+
+int
+mta_worker(void)
+{
+	struct passwd	*pw;
+
+	ca_engine_init();
+
+	mta_postfork();
+	mta_worker_limits();
+
+	purge_config(PURGE_LISTENERS|PURGE_TABLES|PURGE_RULES|PURGE_PKI);
+
+	if ((pw = getpwnam(SMTPD_USER)) == NULL)
+		fatalx("unknown user " SMTPD_USER);
+
+	if (chroot(PATH_CHROOT) == -1)
+		fatal("mta: chroot");
+	if (chdir("/") == -1)
+		fatal("mta: chdir(\"/\")");
+
+	config_process(PROC_MTA);
+
+	if (setgroups(1, &pw->pw_gid) ||
+	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
+	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
+		fatal("mta: cannot drop privileges");
+
+	imsg_callback = mta_worker_imsg;
+	event_init();
+
+	mta_postprivdrop();
+
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+
+	config_peer(PROC_PARENT);
+	config_peer(PROC_QUEUE);
+	config_peer(PROC_LKA);
+	config_peer(PROC_RESOLVER);
+	config_peer(PROC_CONTROL);
+	config_peer(PROC_CA);
+	config_peer(PROC_LOGGER);
+	stat_cpu_start(NULL);
+	memory_start(NULL, mta_memory);
+
+#if HAVE_PLEDGE
+	if (pledge("stdio inet unix recvfd sendfd", NULL) == -1)
+		fatal("pledge");
+#endif
+
+	event_dispatch();
+	fatalx("exited event loop");
+
+	return (0);
+}
@@ -108,6 +108,8 @@ struct rule		*rule;
 struct filter_proc	*processor;
 struct filter_config	*filter_config;
 static uint32_t		 last_dynchain_id = 1;
+static uint32_t		 last_filter_group = 0;
+static uint32_t		 filter_group = 0;
 
 enum listen_options {
 	LO_FAMILY	= 0x000001,
@@ -126,6 +128,8 @@ enum listen_options {
 	LO_MASQUERADE	= 0x002000,
 	LO_CA		= 0x004000,
 	LO_PROXY       	= 0x008000,
+	LO_PREGREET	= 0x010000,
+	LO_DKIM		= 0x020000,
 };
 
 #define PKI_MAX	32
@@ -137,6 +141,7 @@ static struct listen_opts {
 	char	       *filtername;
 	char	       *pki[PKI_MAX];
 	int		pkicount;
+	struct table   *pkitable;
 	char	       *tls_ciphers;
 	char	       *tls_protocols;
 	char	       *ca;
@@ -147,6 +152,7 @@ static struct listen_opts {
 	struct table   *hostnametable;
 	struct table   *sendertable;
 	uint16_t	flags;
+	int		pregreet;
 
 	uint32_t       	options;
 } listen_opts;
@@ -160,9 +166,16 @@ static int	host_dns(struct listen_opts *);
 static int	interface(struct listen_opts *);
 
 int		 delaytonum(char *);
+static int	 filter_limit_set(int, enum limit_key, int64_t, char *);
+static struct pki *pki_alt_get(struct pki *);
+time_t		 tablecachettl(char *);
 int		 is_if_in_group(const char *, const char *);
 
 static int config_lo_mask_source(struct listen_opts *);
+static int processor_name_valid(const char *);
+static void processor_set(const char *, struct filter_proc *);
+static int cpu_proc_valid(const char *);
+static char *numa_node_cpus(int64_t);
 
 typedef struct {
 	union {
@@ -177,34 +190,35 @@ typedef struct {
 
 %}
 
-%token	ACTION ADMD ALIAS ANY ARROW AUTH AUTH_OPTIONAL
-%token	BACKUP BOUNCE BYPASS
-%token	CA CERT CHAIN CHROOT CIPHERS COMMIT COMPRESSION CONNECT
-%token	DATA DATA_LINE DHE DISCONNECT DOMAIN
+%token	ACTION ADMD AFFINITY ALIAS ALTERNATE ANY ARROW ASYNC AUTH AUTH_OPTIONAL
+%token	BACKUP BINARY_ENVELOPE BOUNCE BYPASS
+%token	CA CERT CHAIN CHROOT CIPHERS COALESCE COMMIT COMPRESSION CONNECT CPU
+%token	DATA DATA_LINE DEDUP DELIVERIES DHE DICTIONARY DISCONNECT DKIM DKIM_SIGN DNSBL DOMAIN
 %token	EHLO ENABLE ENCRYPTION ERROR EXPAND_ONLY 
 %token	FCRDNS FILTER FOR FORWARD_ONLY FROM
 %token	GROUP
 %token	HELO HELO_SRC HOST HOSTNAME HOSTNAMES
-%token	INCLUDE INET4 INET6
+%token	INCLUDE INET4 INET6 INSTANCES
 %token	JUNK
 %token	KEY
-%token	LIMIT LISTEN LMTP LOCAL
-%token	MAIL_FROM MAILDIR MASK_SRC MASQUERADE MATCH MAX_MESSAGE_SIZE MAX_DEFERRED MBOX MDA MTA MX
-%token	NO_DSN NO_VERIFY NOOP
+%token	LIMIT LISTEN LMTP LOCAL LOG
+%token	MAIL_FROM MAILDIR MASK_SRC MASQUERADE MATCH MAX_MESSAGE_SIZE MAX_DEFERRED MBOX MDA MEMORY MTA MX
+%token	NEGATIVE_TTL NO_DSN NO_VERIFY NODE NOOP
 %token	ON
-%token	PHASE PKI PORT PROC PROC_EXEC PROTOCOLS PROXY_V2
-%token	QUEUE QUIT
-%token	RCPT_TO RDNS RECIPIENT RECEIVEDAUTH REGEX RELAY REJECT REPORT REWRITE RSET
-%token	SCHEDULER SENDER SENDERS SMTP SMTP_IN SMTP_OUT SMTPS SOCKET SRC SRS SUB_ADDR_DELIM
-%token	TABLE TAG TAGGED TLS TLS_REQUIRE TTL
+%token	PARALLEL PHASE PKI PORT PREGREET PROC PROC_EXEC PROTOCOLS PROXY_V2
+%token	QUEUE QUIT QUORUM
+%token	RCPT_TO RDNS RECIPIENT RECEIVEDAUTH REGEX RELAY REJECT REPLICAS REPORT REWRITE ROTATE RSET
+%token	SCHEDULER SELECTOR SENDER SENDERS SHARD SHARDS SINGLE_INSTANCE SMTP SMTP_IN SMTP_OUT SMTPS SOCKET SPF SRC SRS SUB_ADDR_DELIM
+%token	TABLE TAG TAGGED TLS TLS_REQUIRE TLS_WORKERS TTL
 %token	USER USERBASE
 %token	VERIFY VIRTUAL
-%token	WARN_INTERVAL WRAPPER
+%token	WARN_INTERVAL WORKERS WRAPPER
 
 %token	<v.string>	STRING
 %token  <v.number>	NUMBER
 %type	<v.table>	table
 %type	<v.number>	size negation
+%type	<v.string>	cpu_proc cpu_list
 %type	<v.table>	tables tablenew tableref
 %%
 
@@ -215,7 +229,11 @@ grammar		: /* empty */
 		| grammar bounce '\n'
 		| grammar admd '\n'
 		| grammar ca '\n'
+		| grammar cpu '\n'
+		| grammar dkim '\n'
+		| grammar log '\n'
 		| grammar mda '\n'
+		| grammar memory '\n'
 		| grammar mta '\n'
 		| grammar pki '\n'
 		| grammar proc '\n'
@@ -312,6 +330,43 @@ bounce:
 BOUNCE WARN_INTERVAL {
 	memset(conf->sc_bounce_warn, 0, sizeof conf->sc_bounce_warn);
 } bouncedelays
+| BOUNCE COALESCE STRING STRING {
+	time_t	d;
+	int	type;
+
+	if (!strcmp($3, "failed"))
+		type = B_FAILED;
+	else if (!strcmp($3, "delayed"))
+		type = B_DELAYED;
+	else if (!strcmp($3, "delivered"))
+		type = B_DELIVERED;
+	else {
+		yyerror("invalid bounce type: %s", $3);
+		free($3);
+		free($4);
+		YYERROR;
+	}
+	free($3);
+	if ((d = delaytonum($4)) < 0) {
+		yyerror("invalid coalesce delay: %s", $4);
+		free($4);
+		YYERROR;
+	}
+	free($4);
+	conf->sc_bounce_coalesce[type] = d;
+}
+| BOUNCE LIMIT STRING NUMBER {
+	if (!strcmp($3, "max-session") && $4 > 0)
+		conf->sc_bounce_max_session = $4;
+	else if (!strcmp($3, "max-rate"))
+		conf->sc_bounce_max_rate = $4;
+	else {
+		yyerror("invalid bounce limit keyword: %s", $3);
+		free($3);
+		YYERROR;
+	}
+	free($3);
+}
 ;
 
 
@@ -365,6 +420,117 @@ ca_params_opt
 ;
 
 
+cpu:
+CPU AFFINITY cpu_proc cpu_list {
+	if (dict_check(conf->sc_cpu_affinity, $3)) {
+		yyerror("cpu affinity already set for %s", $3);
+		free($3);
+		free($4);
+		YYERROR;
+	}
+	dict_set(conf->sc_cpu_affinity, $3, $4);
+	free($3);
+}
+;
+
+cpu_proc:
+STRING {
+	if (!cpu_proc_valid($1)) {
+		yyerror("unknown process: %s", $1);
+		free($1);
+		YYERROR;
+	}
+	$$ = $1;
+}
+| CA {
+	$$ = xstrdup("ca");
+}
+| QUEUE {
+	$$ = xstrdup("queue");
+}
+| SCHEDULER {
+	$$ = xstrdup("scheduler");
+}
+| TLS {
+	$$ = xstrdup("tls");
+}
+| MTA {
+	$$ = xstrdup("mta");
+}
+| SMTP {
+	$$ = xstrdup("smtp");
+}
+| SCHEDULER SHARD NUMBER {
+	if ($3 < 0 || $3 >= SCHEDULER_SHARDS_MAX) {
+		yyerror("invalid scheduler shard: %"PRId64, $3);
+		YYERROR;
+	}
+	(void)xasprintf(&$$, "scheduler.%"PRId64, $3);
+}
+;
+
+cpu_list:
+STRING {
+	if (!cpulist_parse($1, NULL, NULL)) {
+		yyerror("invalid cpu list: %s", $1);
+		free($1);
+		YYERROR;
+	}
+	$$ = $1;
+}
+| NUMBER {
+	if ($1 < 0 || $1 > CPULIST_MAX) {
+		yyerror("invalid cpu: %"PRId64, $1);
+		YYERROR;
+	}
+	(void)xasprintf(&$$, "%"PRId64, $1);
+}
+| NODE NUMBER {
+	if (($$ = numa_node_cpus($2)) == NULL) {
+		yyerror("cannot find the cpus of NUMA node %"PRId64, $2);
+		YYERROR;
+	}
+}
+;
+
+
+log:
+LOG ASYNC {
+	conf->sc_log_async = 1;
+}
+| LOG ASYNC STRING {
+	if (*$3 != '/') {
+		yyerror("log path must be absolute: %s", $3);
+		free($3);
+		YYERROR;
+	}
+	conf->sc_log_async = 1;
+	conf->sc_log_path = $3;
+}
+| LOG DELIVERIES STRING {
+	if (*$3 != '/') {
+		yyerror("delivery log path must be absolute: %s", $3);
+		free($3);
+		YYERROR;
+	}
+	conf->sc_dlog_path = $3;
+} dlog_rotate
+;
+
+dlog_rotate:
+/* empty */
+| ROTATE STRING {
+	conf->sc_dlog_rotate = delaytonum($2);
+	if (conf->sc_dlog_rotate <= 0) {
+		yyerror("invalid rotation delay: %s", $2);
+		free($2);
+		YYERROR;
+	}
+	free($2);
+}
+;
+
+
 mda:
 MDA LIMIT limits_mda
 | MDA WRAPPER STRING STRING {
@@ -377,10 +543,28 @@ MDA LIMIT limits_mda
 ;
 
 
+memory:
+MEMORY LIMIT size {
+	if ($3 == 0) {
+		yyerror("invalid memory limit: 0");
+		YYERROR;
+	}
+	conf->sc_memory_limit = $3;
+}
+;
+
 mta:
 MTA MAX_DEFERRED NUMBER  {
 	conf->sc_mta_max_deferred = $3;
 }
+| MTA WORKERS NUMBER {
+	if ($3 < 0 || $3 > MTA_WORKERS_MAX) {
+		yyerror("mta workers must be between 0 and %d",
+		    MTA_WORKERS_MAX);
+		YYERROR;
+	}
+	conf->sc_mta_workers = $3;
+}
 | MTA LIMIT FOR DOMAIN STRING {
 	struct mta_limits	*d;
 
@@ -429,6 +613,12 @@ CERT STRING {
 | KEY STRING {
 	pki->pki_key_file = $2;
 }
+| ALTERNATE CERT STRING {
+	pki_alt_get(pki)->pki_cert_file = $3;
+}
+| ALTERNATE KEY STRING {
+	pki_alt_get(pki)->pki_key_file = $3;
+}
 | DHE STRING {
 	if (strcasecmp($2, "none") == 0)
 		pki->pki_dhe = 0;
@@ -452,6 +642,43 @@ pki_params_opt pki_params
 ;
 
 
+dkim:
+DKIM STRING SELECTOR STRING KEY STRING {
+	struct dkim	*dkim;
+	char		 buf[HOST_NAME_MAX+1];
+
+	if (!res_hnok($2)) {
+		yyerror("not a valid domain name: %s", $2);
+		free($2);
+		free($4);
+		free($6);
+		YYERROR;
+	}
+	if (!res_hnok($4) || strlen($4) >= sizeof(dkim->dkim_selector)) {
+		yyerror("not a valid selector: %s", $4);
+		free($2);
+		free($4);
+		free($6);
+		YYERROR;
+	}
+	xlowercase(buf, $2, sizeof(buf));
+	free($2);
+	if (dict_check(conf->sc_dkim_dict, buf)) {
+		yyerror("dkim key already defined for %s", buf);
+		free($4);
+		free($6);
+		YYERROR;
+	}
+	dkim = xcalloc(1, sizeof *dkim);
+	(void)strlcpy(dkim->dkim_domain, buf, sizeof(dkim->dkim_domain));
+	(void)strlcpy(dkim->dkim_selector, $4, sizeof(dkim->dkim_selector));
+	free($4);
+	dkim->dkim_key_file = $6;
+	dict_set(conf->sc_dkim_dict, dkim->dkim_domain, dkim);
+}
+;
+
+
 proc:
 PROC STRING STRING {
 	if (dict_get(conf->sc_filter_processes_dict, $2)) {
@@ -460,10 +687,15 @@ PROC STRING STRING {
 		free($3);
 		YYERROR;
 	}
+	if (!processor_name_valid($2)) {
+		free($2);
+		free($3);
+		YYERROR;
+	}
 	processor = xcalloc(1, sizeof *processor);
 	processor->command = $3;
 } proc_params {
-	dict_set(conf->sc_filter_processes_dict, $2, processor);
+	processor_set($2, processor);
 	processor = NULL;
 }
 ;
@@ -494,6 +726,17 @@ USER STRING {
 	}
 	processor->chroot = $2;
 }
+| INSTANCES NUMBER {
+	if (processor->instances) {
+		yyerror("instances already specified for this processor");
+		YYERROR;
+	}
+	if ($2 < 1 || $2 > PROCESSOR_INSTANCES_MAX) {
+		yyerror("invalid number of instances: %"PRId64, $2);
+		YYERROR;
+	}
+	processor->instances = $2;
+}
 ;
 
 proc_params:
@@ -503,9 +746,72 @@ proc_params_opt proc_params
 
 
 queue:
-QUEUE COMPRESSION {
+QUEUE BINARY_ENVELOPE {
+	conf->sc_queue_flags |= QUEUE_BINARY_ENVELOPE;
+}
+| QUEUE COMPRESSION {
 	conf->sc_queue_flags |= QUEUE_COMPRESSION;
 }
+| QUEUE COMPRESSION STRING {
+	if (compress_backend_lookup($3) == NULL) {
+		yyerror("unsupported queue compression: %s", $3);
+		free($3);
+		YYERROR;
+	}
+	conf->sc_queue_compress = $3;
+	conf->sc_queue_flags |= QUEUE_COMPRESSION;
+}
+| QUEUE COMPRESSION STRING DICTIONARY STRING {
+	if (compress_backend_lookup($3) == NULL) {
+		yyerror("unsupported queue compression: %s", $3);
+		free($3);
+		free($5);
+		YYERROR;
+	}
+	if (compress_backend_lookup($3)->load_dictionary == NULL) {
+		yyerror("queue compression %s does not use a dictionary", $3);
+		free($3);
+		free($5);
+		YYERROR;
+	}
+	conf->sc_queue_compress = $3;
+	conf->sc_queue_compress_dict = $5;
+	conf->sc_queue_flags |= QUEUE_COMPRESSION;
+}
+| QUEUE DEDUP {
+	conf->sc_queue_flags |= QUEUE_DEDUP;
+}
+| QUEUE LIMIT limits_queue
+| QUEUE SHARDS NUMBER {
+	if ($3 < 1 || $3 > QUEUE_SHARDS_MAX) {
+		yyerror("queue shards must be between 1 and %d",
+		    QUEUE_SHARDS_MAX);
+		YYERROR;
+	}
+	conf->sc_queue_shards = $3;
+}
+| QUEUE REPLICAS NUMBER {
+	if ($3 < 1 || $3 > QUEUE_REPLICAS_MAX) {
+		yyerror("queue replicas must be between 1 and %d",
+		    QUEUE_REPLICAS_MAX);
+		YYERROR;
+	}
+	conf->sc_queue_replicas = $3;
+	conf->sc_queue_quorum = 1;
+}
+| QUEUE REPLICAS NUMBER QUORUM NUMBER {
+	if ($3 < 1 || $3 > QUEUE_REPLICAS_MAX) {
+		yyerror("queue replicas must be between 1 and %d",
+		    QUEUE_REPLICAS_MAX);
+		YYERROR;
+	}
+	if ($5 < 0 || $5 > $3) {
+		yyerror("queue quorum must be between 0 and %d", (int)$3);
+		YYERROR;
+	}
+	conf->sc_queue_replicas = $3;
+	conf->sc_queue_quorum = $5;
+}
 | QUEUE ENCRYPTION {
 	conf->sc_queue_flags |= QUEUE_ENCRYPTION;
 }
@@ -532,6 +838,14 @@ QUEUE COMPRESSION {
 
 scheduler:
 SCHEDULER LIMIT limits_scheduler
+| SCHEDULER SHARDS NUMBER {
+	if ($3 < 1 || $3 > SCHEDULER_SHARDS_MAX) {
+		yyerror("scheduler shards must be between 1 and %d",
+		    SCHEDULER_SHARDS_MAX);
+		YYERROR;
+	}
+	conf->sc_scheduler_shards = $3;
+}
 ;
 
 
@@ -543,6 +857,27 @@ SMTP LIMIT limits_smtp
 | SMTP MAX_MESSAGE_SIZE size {
 	conf->sc_maxsize = $3;
 }
+| SMTP TLS_WORKERS NUMBER {
+	if ($3 < 0 || $3 > TLS_WORKERS_MAX) {
+		yyerror("tls workers must be between 0 and %d",
+		    TLS_WORKERS_MAX);
+		YYERROR;
+	}
+	conf->sc_tls_workers = $3;
+}
+| SMTP WORKERS NUMBER {
+#ifdef SO_REUSEPORT
+	if ($3 < 0 || $3 > SMTP_WORKERS_MAX) {
+		yyerror("smtp workers must be between 0 and %d",
+		    SMTP_WORKERS_MAX);
+		YYERROR;
+	}
+	conf->sc_smtp_workers = $3;
+#else
+	yyerror("smtp workers are not supported on this system");
+	YYERROR;
+#endif
+}
 | SMTP SUB_ADDR_DELIM STRING {
 	if (strlen($3) != 1) {
 		yyerror("subaddressing-delimiter must be one character");
@@ -563,7 +898,17 @@ SRS KEY STRING {
 	conf->sc_srs_key = $3;
 }
 | SRS KEY BACKUP STRING {
-	conf->sc_srs_key_backup = $4;
+	size_t	i;
+
+	for (i = 0; i < SRS_BACKUP_MAX; i++)
+		if (conf->sc_srs_key_backup[i] == NULL)
+			break;
+	if (i == SRS_BACKUP_MAX) {
+		yyerror("too many srs backup keys");
+		free($4);
+		YYERROR;
+	}
+	conf->sc_srs_key_backup[i] = $4;
 }
 | SRS TTL STRING {
 	conf->sc_srs_ttl = delaytonum($3);
@@ -673,6 +1018,13 @@ USER STRING {
 	}
 	dsp->u.local.mda_wrapper = $2;
 }
+| SINGLE_INSTANCE {
+	if (!dsp->u.local.is_maildir) {
+		yyerror("single-instance may only be specified for maildir");
+		YYERROR;
+	}
+	dsp->u.local.single_instance = 1;
+}
 ;
 
 dispatcher_local_options:
@@ -685,12 +1037,17 @@ MBOX {
 	dsp->u.local.is_mbox = 1;
 } dispatcher_local_options
 | MAILDIR {
+	dsp->u.local.is_maildir = 1;
 	asprintf(&dsp->u.local.command, PATH_LIBEXEC"/mail.maildir");
 } dispatcher_local_options
 | MAILDIR JUNK {
+	dsp->u.local.is_maildir = 1;
+	dsp->u.local.maildir_junk = 1;
 	asprintf(&dsp->u.local.command, PATH_LIBEXEC"/mail.maildir -j");
 } dispatcher_local_options
 | MAILDIR STRING {
+	dsp->u.local.is_maildir = 1;
+	dsp->u.local.maildir = xstrdup($2);
 	if (strncmp($2, "~/", 2) == 0)
 		asprintf(&dsp->u.local.command,
 		    PATH_LIBEXEC"/mail.maildir \"%%{user.directory}/%s\"", $2+2);
@@ -699,6 +1056,9 @@ MBOX {
 		    PATH_LIBEXEC"/mail.maildir \"%s\"", $2);
 } dispatcher_local_options
 | MAILDIR STRING JUNK {
+	dsp->u.local.is_maildir = 1;
+	dsp->u.local.maildir = xstrdup($2);
+	dsp->u.local.maildir_junk = 1;
 	if (strncmp($2, "~/", 2) == 0)
 		asprintf(&dsp->u.local.command,
 		    PATH_LIBEXEC"/mail.maildir -j \"%%{user.directory}/%s\"", $2+2);
@@ -709,10 +1069,13 @@ MBOX {
 | LMTP STRING {
 	asprintf(&dsp->u.local.command,
 	    PATH_LIBEXEC"/mail.lmtp -d %s -u", $2);
+	dsp->u.local.lmtp = xstrdup($2);
 } dispatcher_local_options
 | LMTP STRING RCPT_TO {
 	asprintf(&dsp->u.local.command,
 	    PATH_LIBEXEC"/mail.lmtp -d %s -r", $2);
+	dsp->u.local.lmtp = xstrdup($2);
+	dsp->u.local.lmtp_rcpt_to = 1;
 } dispatcher_local_options
 | MDA STRING {
 	asprintf(&dsp->u.local.command,
@@ -1006,7 +1369,7 @@ dispatcher_option dispatcher_options
 
 dispatcher:
 ACTION STRING {
-	if (dict_get(conf->sc_dispatchers, $2)) {
+	if (hdict_get(conf->sc_dispatchers, $2)) {
 		yyerror("dispatcher already declared with that name: %s", $2);
 		YYERROR;
 	}
@@ -1015,7 +1378,7 @@ ACTION STRING {
 	if (dsp->type == DISPATCHER_LOCAL)
 		if (dsp->u.local.table_userbase == NULL)
 			dsp->u.local.table_userbase = "<getpwnam>";
-	dict_set(conf->sc_dispatchers, $2, dsp);
+	hdict_set(conf->sc_dispatchers, $2, dsp);
 	dsp = NULL;
 }
 ;
@@ -1523,7 +1886,7 @@ match_option match_options
 
 match_dispatcher:
 STRING {
-	if (dict_get(conf->sc_dispatchers, $1) == NULL) {
+	if (hdict_get(conf->sc_dispatchers, $1) == NULL) {
 		yyerror("no such dispatcher: %s", $1);
 		YYERROR;
 	}
@@ -1620,6 +1983,13 @@ negation SRC REGEX tables {
 }
 ;
 
+filter_phase_check_dnsbl:
+negation DNSBL tables {
+	filter_config->not_dnsbl = $1 ? -1 : 1;
+	filter_config->dnsbl = $3;
+}
+;
+
 filter_phase_check_helo_table:
 negation HELO tables {
 	filter_config->not_helo_table = $1 ? -1 : 1;
@@ -1665,6 +2035,57 @@ negation MAIL_FROM REGEX tables {
 }
 ;
 
+filter_phase_check_spf:
+negation SPF spf_results {
+	filter_config->not_spf = $1 ? -1 : 1;
+}
+;
+
+spf_results:
+spf_result
+| '{' optnl spf_result_list '}'
+;
+
+spf_result_list:
+spf_result optnl
+| spf_result comma spf_result_list
+;
+
+spf_result:
+STRING {
+	int	result;
+
+	if ((result = text_to_spf_result($1)) == -1) {
+		yyerror("invalid spf result: %s", $1);
+		free($1);
+		YYERROR;
+	}
+	filter_config->spf |= 1 << result;
+	free($1);
+}
+;
+
+filter_phase_check_limit_src:
+negation LIMIT SRC NUMBER '/' STRING {
+	if (filter_limit_set($1, LIMIT_KEY_SRC, $4, $6) == -1)
+		YYERROR;
+}
+;
+
+filter_phase_check_limit_mail_from:
+negation LIMIT MAIL_FROM NUMBER '/' STRING {
+	if (filter_limit_set($1, LIMIT_KEY_MAIL_FROM, $4, $6) == -1)
+		YYERROR;
+}
+;
+
+filter_phase_check_limit_rcpt_to:
+negation LIMIT RCPT_TO NUMBER '/' STRING {
+	if (filter_limit_set($1, LIMIT_KEY_RCPT_TO, $4, $6) == -1)
+		YYERROR;
+}
+;
+
 filter_phase_check_rcpt_to_table:
 negation RCPT_TO tables {
 	filter_config->not_rcpt_to_table = $1 ? -1 : 1;
@@ -1684,7 +2105,9 @@ filter_phase_check_rdns |
 filter_phase_check_rdns_regex |
 filter_phase_check_rdns_table |
 filter_phase_check_src_regex |
-filter_phase_check_src_table;
+filter_phase_check_src_table |
+filter_phase_check_dnsbl |
+filter_phase_check_limit_src;
 
 filter_phase_connect_options:
 filter_phase_global_options;
@@ -1710,6 +2133,8 @@ filter_phase_check_auth_table |
 filter_phase_check_auth_regex |
 filter_phase_check_mail_from_table |
 filter_phase_check_mail_from_regex |
+filter_phase_check_spf |
+filter_phase_check_limit_mail_from |
 filter_phase_global_options;
 
 filter_phase_rcpt_to_options:
@@ -1720,8 +2145,11 @@ filter_phase_check_auth_table |
 filter_phase_check_auth_regex |
 filter_phase_check_mail_from_table |
 filter_phase_check_mail_from_regex |
+filter_phase_check_spf |
+filter_phase_check_limit_mail_from |
 filter_phase_check_rcpt_to_table |
 filter_phase_check_rcpt_to_regex |
+filter_phase_check_limit_rcpt_to |
 filter_phase_global_options;
 
 filter_phase_data_options:
@@ -1732,6 +2160,8 @@ filter_phase_check_auth_table |
 filter_phase_check_auth_regex |
 filter_phase_check_mail_from_table |
 filter_phase_check_mail_from_regex |
+filter_phase_check_spf |
+filter_phase_check_limit_mail_from |
 filter_phase_global_options;
 
 /*
@@ -1759,6 +2189,8 @@ filter_phase_check_auth_table |
 filter_phase_check_auth_regex |
 filter_phase_check_mail_from_table |
 filter_phase_check_mail_from_regex |
+filter_phase_check_spf |
+filter_phase_check_limit_mail_from |
 filter_phase_global_options;
 
 
@@ -1886,6 +2318,11 @@ STRING	{
 		}
 		dict_set(&filter_config->chain_procs, fr->proc, NULL);
 	}
+	else if (filter_group) {
+		yyerror("only proc filters allowed within a parallel group: %s", $1);
+		free($1);
+		YYERROR;
+	}
 
 	fr->filter_subsystem |= filter_config->filter_subsystem;
 	filter_config->chain_size += 1;
@@ -1893,6 +2330,20 @@ STRING	{
 	if (filter_config->chain == NULL)
 		fatal("reallocarray");
 	filter_config->chain[filter_config->chain_size - 1] = $1;
+	filter_config->chain_group = reallocarray(filter_config->chain_group,
+	    filter_config->chain_size, sizeof(uint32_t));
+	if (filter_config->chain_group == NULL)
+		fatal("reallocarray");
+	filter_config->chain_group[filter_config->chain_size - 1] = filter_group;
+}
+| PARALLEL '{' optnl {
+	if (filter_group) {
+		yyerror("no parallel group allowed within a parallel group");
+		YYERROR;
+	}
+	filter_group = ++last_filter_group;
+} filter_list '}' {
+	filter_group = 0;
 }
 ;
 
@@ -1931,6 +2382,11 @@ FILTER STRING PROC_EXEC STRING {
 		free($4);
 		YYERROR;
 	}
+	if (!processor_name_valid($2)) {
+		free($2);
+		free($4);
+		YYERROR;
+	}
 
 	processor = xcalloc(1, sizeof *processor);
 	processor->command = $4;
@@ -1941,7 +2397,7 @@ FILTER STRING PROC_EXEC STRING {
 	filter_config->proc = xstrdup($2);
 	dict_set(conf->sc_filters_dict, $2, filter_config);
 } proc_params {
-	dict_set(conf->sc_filter_processes_dict, filter_config->proc, processor);
+	processor_set(filter_config->proc, processor);
 	processor = NULL;
 	filter_config = NULL;
 }
@@ -2026,6 +2482,9 @@ opt_limit_mda	: STRING NUMBER {
 			else if (!strcmp($1, "max-session-per-user")) {
 				conf->sc_mda_max_user_session = $2;
 			}
+			else if (!strcmp($1, "max-session-per-destination")) {
+				conf->sc_mda_max_dest_session = $2;
+			}
 			else if (!strcmp($1, "task-lowat")) {
 				conf->sc_mda_task_lowat = $2;
 			}
@@ -2055,6 +2514,30 @@ opt_limit_smtp : STRING NUMBER {
 			else if (!strcmp($1, "max-mails")) {
 				conf->sc_session_max_mails = $2;
 			}
+			else if (!strcmp($1, "filter-hiwat")) {
+				conf->sc_filter_hiwat = $2;
+			}
+			else if (!strcmp($1, "filter-lowat")) {
+				conf->sc_filter_lowat = $2;
+			}
+			else if (!strcmp($1, "max-conn-per-src") && $2 >= 0) {
+				conf->sc_conn_max_src = $2;
+			}
+			else if (!strcmp($1, "max-conn-per-net") && $2 >= 0) {
+				conf->sc_conn_max_net = $2;
+			}
+			else if (!strcmp($1, "net4-prefix") &&
+			    $2 > 0 && $2 <= 32) {
+				conf->sc_conn_net4_prefix = $2;
+			}
+			else if (!strcmp($1, "net6-prefix") &&
+			    $2 > 0 && $2 <= 128) {
+				conf->sc_conn_net6_prefix = $2;
+			}
+			else if (!strcmp($1, "conn-rate") &&
+			    $2 >= 0 && $2 <= INT_MAX) {
+				conf->sc_conn_rate = $2;
+			}
 			else {
 				yyerror("invalid session limit keyword: %s", $1);
 				free($1);
@@ -2062,6 +2545,26 @@ opt_limit_smtp : STRING NUMBER {
 			}
 			free($1);
 		}
+		| STRING STRING {
+			if (strcmp($1, "conn-action")) {
+				yyerror("invalid session limit keyword: %s", $1);
+				free($1);
+				free($2);
+				YYERROR;
+			}
+			if (!strcmp($2, "drop"))
+				conf->sc_conn_drop = 1;
+			else if (!strcmp($2, "reject"))
+				conf->sc_conn_drop = 0;
+			else {
+				yyerror("invalid conn-action: %s", $2);
+				free($1);
+				free($2);
+				YYERROR;
+			}
+			free($1);
+			free($2);
+		}
 		;
 
 limits_mda	: opt_limit_mda limits_mda
@@ -2088,6 +2591,47 @@ limits_mta	: opt_limit_mta limits_mta
 		| /* empty */
 		;
 
+opt_limit_queue : STRING NUMBER {
+			if (!strcmp($1, "evpcache-size")) {
+				if ($2 < 0) {
+					yyerror("invalid evpcache-size: %"
+					    PRId64, $2);
+					free($1);
+					YYERROR;
+				}
+				conf->sc_queue_evpcache_size = $2;
+			}
+			else if (!strcmp($1, "ram-size")) {
+				if ($2 < 0) {
+					yyerror("invalid ram-size: %"
+					    PRId64, $2);
+					free($1);
+					YYERROR;
+				}
+				conf->sc_queue_ram_size = $2;
+			}
+			else if (!strcmp($1, "offline-sessions")) {
+				if ($2 <= 0) {
+					yyerror("invalid offline-sessions: %"
+					    PRId64, $2);
+					free($1);
+					YYERROR;
+				}
+				conf->sc_queue_offline_max = $2;
+			}
+			else {
+				yyerror("invalid queue limit keyword: %s", $1);
+				free($1);
+				YYERROR;
+			}
+			free($1);
+		}
+		;
+
+limits_queue	: opt_limit_queue limits_queue
+		| /* empty */
+		;
+
 opt_limit_scheduler : STRING NUMBER {
 			if (!strcmp($1, "max-inflight")) {
 				conf->sc_scheduler_max_inflight = $2;
@@ -2159,6 +2703,14 @@ opt_sock_listen : FILTER STRING {
 				YYERROR;
 			}
 		}
+		| DKIM_SIGN	{
+			if (listen_opts.options & LO_DKIM) {
+				yyerror("dkim-sign already specified");
+				YYERROR;
+			}
+			listen_opts.options |= LO_DKIM;
+			listen_opts.flags |= F_DKIM_SIGN;
+		}
 		| NO_DSN	{
 			if (listen_opts.options & LO_NODSN) {
 				yyerror("no-dsn already specified");
@@ -2361,6 +2913,20 @@ opt_if_listen : INET4 {
 			}
 			listen_opts.pki[listen_opts.pkicount++] = $2;
 		}
+		| PKI tableref			{
+			struct table	*t = $2;
+
+			if (listen_opts.pkitable) {
+				yyerror("pki table already specified");
+				YYERROR;
+			}
+			if (!table_check_use(t, T_DYNAMIC|T_HASH, K_PKI)) {
+				yyerror("invalid use of table \"%s\" as "
+				    "PKI parameter", t->t_name);
+				YYERROR;
+			}
+			listen_opts.pkitable = t;
+		}
 		| CA STRING			{
 			if (listen_opts.options & LO_CA) {
 				yyerror("ca already specified");
@@ -2455,6 +3021,14 @@ opt_if_listen : INET4 {
 			listen_opts.options |= LO_RECEIVEDAUTH;
 			listen_opts.flags |= F_RECEIVEDAUTH;
 		}
+		| DKIM_SIGN	{
+			if (listen_opts.options & LO_DKIM) {
+				yyerror("dkim-sign already specified");
+				YYERROR;
+			}
+			listen_opts.options |= LO_DKIM;
+			listen_opts.flags |= F_DKIM_SIGN;
+		}
 		| NO_DSN	{
 			if (listen_opts.options & LO_NODSN) {
 				yyerror("no-dsn already specified");
@@ -2471,6 +3045,20 @@ opt_if_listen : INET4 {
 			listen_opts.options |= LO_PROXY;
 			listen_opts.flags |= F_PROXY;
 		}
+		| PREGREET STRING	{
+			if (listen_opts.options & LO_PREGREET) {
+				yyerror("pregreet already specified");
+				free($2);
+				YYERROR;
+			}
+			listen_opts.options |= LO_PREGREET;
+			if ((listen_opts.pregreet = delaytonum($2)) <= 0) {
+				yyerror("invalid pregreet delay: %s", $2);
+				free($2);
+				YYERROR;
+			}
+			free($2);
+		}
 		| SENDERS tables	{
 			struct table	*t = $2;
 
@@ -2519,6 +3107,14 @@ socket_listener	: SOCKET sock_listen {
 		;
 
 if_listener	: STRING if_listen {
+			if (listen_opts.pregreet &&
+			    (listen_opts.ssl & F_SMTPS ||
+			    listen_opts.flags & F_PROXY)) {
+				yyerror("pregreet can't be used with smtps "
+				    "or proxy-v2");
+				free($1);
+				YYERROR;
+			}
 			listen_opts.ifx = $1;
 			create_if_listener(&listen_opts);
 		}
@@ -2578,9 +3174,10 @@ table		: TABLE STRING STRING	{
 				free($3);
 				YYERROR;
 			}
-			table = NULL;
 			free($2);
 			free($3);
+		} table_cache {
+			table = NULL;
 		}
 		| TABLE STRING {
 			table = table_create(conf, "static", $2, NULL);
@@ -2590,6 +3187,30 @@ table		: TABLE STRING STRING	{
 		}
 		;
 
+table_cache_option:
+TTL STRING {
+	if ((table->t_cache_ttl = tablecachettl($2)) == -1) {
+		yyerror("ttl delay \"%s\" is invalid", $2);
+		free($2);
+		YYERROR;
+	}
+	free($2);
+}
+| NEGATIVE_TTL STRING {
+	if ((table->t_cache_negttl = tablecachettl($2)) == -1) {
+		yyerror("negative-ttl delay \"%s\" is invalid", $2);
+		free($2);
+		YYERROR;
+	}
+	free($2);
+}
+;
+
+table_cache:
+/* empty */
+| table_cache table_cache_option
+;
+
 tablenew	: STRING			{
 			struct table	*t;
 
@@ -2660,11 +3281,15 @@ lookup(char *s)
 	static const struct keywords keywords[] = {
 		{ "action",		ACTION },
 		{ "admd",		ADMD },
+		{ "affinity",		AFFINITY },
 		{ "alias",		ALIAS },
+		{ "alternate",		ALTERNATE },
 		{ "any",		ANY },
+		{ "async",		ASYNC },
 		{ "auth",		AUTH },
 		{ "auth-optional",     	AUTH_OPTIONAL },
 		{ "backup",		BACKUP },
+		{ "binary-envelope",	BINARY_ENVELOPE },
 		{ "bounce",		BOUNCE },
 		{ "bypass",		BYPASS },
 		{ "ca",			CA },
@@ -2672,13 +3297,21 @@ lookup(char *s)
 		{ "chain",		CHAIN },
 		{ "chroot",		CHROOT },
 		{ "ciphers",		CIPHERS },
+		{ "coalesce",		COALESCE },
 		{ "commit",		COMMIT },
 		{ "compression",	COMPRESSION },
 		{ "connect",		CONNECT },
+		{ "cpu",		CPU },
 		{ "data",		DATA },
 		{ "data-line",		DATA_LINE },
+		{ "dedup",		DEDUP },
+		{ "deliveries",	DELIVERIES },
 		{ "dhe",		DHE },
+		{ "dictionary",		DICTIONARY },
 		{ "disconnect",		DISCONNECT },
+		{ "dkim",		DKIM },
+		{ "dkim-sign",		DKIM_SIGN },
+		{ "dnsbl",		DNSBL },
 		{ "domain",		DOMAIN },
 		{ "ehlo",		EHLO },
 		{ "encryption",		ENCRYPTION },
@@ -2697,12 +3330,14 @@ lookup(char *s)
 		{ "include",		INCLUDE },
 		{ "inet4",		INET4 },
 		{ "inet6",		INET6 },
+		{ "instances",		INSTANCES },
 		{ "junk",		JUNK },
 		{ "key",		KEY },
 		{ "limit",		LIMIT },
 		{ "listen",		LISTEN },
 		{ "lmtp",		LMTP },
 		{ "local",		LOCAL },
+		{ "log",		LOG },
 		{ "mail-from",		MAIL_FROM },
 		{ "maildir",		MAILDIR },
 		{ "mask-src",		MASK_SRC },
@@ -2712,21 +3347,27 @@ lookup(char *s)
 		{ "max-message-size",  	MAX_MESSAGE_SIZE },
 		{ "mbox",		MBOX },
 		{ "mda",		MDA },
+		{ "memory",		MEMORY },
 		{ "mta",		MTA },
 		{ "mx",			MX },
+		{ "negative-ttl",	NEGATIVE_TTL },
 		{ "no-dsn",		NO_DSN },
 		{ "no-verify",		NO_VERIFY },
+		{ "node",		NODE },
 		{ "noop",		NOOP },
 		{ "on",			ON },
+		{ "parallel",		PARALLEL },
 		{ "phase",		PHASE },
 		{ "pki",		PKI },
 		{ "port",		PORT },
+		{ "pregreet",		PREGREET },
 		{ "proc",		PROC },
 		{ "proc-exec",		PROC_EXEC },
 		{ "protocols",		PROTOCOLS },
 		{ "proxy-v2",		PROXY_V2 },
 		{ "queue",		QUEUE },
 		{ "quit",		QUIT },
+		{ "quorum",		QUORUM },
 		{ "rcpt-to",		RCPT_TO },
 		{ "rdns",		RDNS },
 		{ "received-auth",     	RECEIVEDAUTH },
@@ -2734,16 +3375,23 @@ lookup(char *s)
 		{ "regex",		REGEX },
 		{ "reject",		REJECT },
 		{ "relay",		RELAY },
+		{ "replicas",		REPLICAS },
 		{ "report",		REPORT },
 		{ "rewrite",		REWRITE },
+		{ "rotate",		ROTATE },
 		{ "rset",		RSET },
 		{ "scheduler",		SCHEDULER },
+		{ "selector",		SELECTOR },
 		{ "senders",   		SENDERS },
+		{ "shard",		SHARD },
+		{ "shards",		SHARDS },
+		{ "single-instance",	SINGLE_INSTANCE },
 		{ "smtp",		SMTP },
 		{ "smtp-in",		SMTP_IN },
 		{ "smtp-out",		SMTP_OUT },
 		{ "smtps",		SMTPS },
 		{ "socket",		SOCKET },
+		{ "spf",		SPF },
 		{ "src",		SRC },
 		{ "srs",		SRS },
 		{ "sub-addr-delim",	SUB_ADDR_DELIM },
@@ -2752,12 +3400,14 @@ lookup(char *s)
 		{ "tagged",		TAGGED },
 		{ "tls",		TLS },
 		{ "tls-require",       	TLS_REQUIRE },
+		{ "tls-workers",	TLS_WORKERS },
 		{ "ttl",		TTL },
 		{ "user",		USER },
 		{ "userbase",		USERBASE },
 		{ "verify",		VERIFY },
 		{ "virtual",		VIRTUAL },
 		{ "warn-interval",	WARN_INTERVAL },
+		{ "workers",		WORKERS },
 		{ "wrapper",		WRAPPER },
 	};
 	const struct keywords	*p;
@@ -3164,6 +3814,11 @@ parse_config(struct smtpd *x_conf, const char *filename, int opts)
 		errors++;
 	}
 
+	if (conf->sc_filter_lowat >= conf->sc_filter_hiwat) {
+		log_warnx("warn: filter-lowat must be lower than filter-hiwat");
+		errors++;
+	}
+
 	if (errors) {
 		purge_config(PURGE_EVERYTHING);
 		return (-1);
@@ -3272,6 +3927,8 @@ create_if_listener(struct listen_opts *lo)
 		fatalx("invalid listen option: pki requires tls/smtps");
 	if (lo->pkicount == 0 && lo->ssl)
 		fatalx("invalid listen option: pki required for tls/smtps");
+	if (lo->pkitable && !lo->ssl)
+		fatalx("invalid listen option: pki requires tls/smtps");
 
 	flags = lo->flags;
 
@@ -3313,6 +3970,7 @@ config_listener(struct listener *h,  struct listen_opts *lo)
 	h->fd = -1;
 	h->port = lo->port;
 	h->flags = lo->flags;
+	h->pregreet = lo->pregreet;
 
 	if (lo->hostname == NULL)
 		lo->hostname = conf->sc_hostname;
@@ -3340,6 +3998,9 @@ config_listener(struct listener *h,  struct listen_opts *lo)
 			fatalx(NULL);
 		}
 	}
+	if (lo->pkitable != NULL)
+		(void)strlcpy(h->pkitable, lo->pkitable->t_name,
+		    sizeof(h->pkitable));
 
 	if (lo->tls_ciphers != NULL &&
 	    (h->tls_ciphers = strdup(lo->tls_ciphers)) == NULL) {
@@ -3624,6 +4285,50 @@ bad:
 	return (-1);
 }
 
+static int
+filter_limit_set(int negate, enum limit_key key, int64_t count, char *period)
+{
+	int	d;
+
+	d = delaytonum(period);
+	free(period);
+	if (filter_config->limit) {
+		yyerror("limit already specified for this filter");
+		return (-1);
+	}
+	if (count <= 0 || count > INT_MAX) {
+		yyerror("invalid limit count: %"PRId64, count);
+		return (-1);
+	}
+	if (d < 0) {
+		yyerror("invalid limit period");
+		return (-1);
+	}
+
+	filter_config->not_limit = negate ? -1 : 1;
+	filter_config->limit = limit_new(key, count, d);
+	return (0);
+}
+
+static struct pki *
+pki_alt_get(struct pki *p)
+{
+	if (p->pki_alt == NULL) {
+		p->pki_alt = xcalloc(1, sizeof *p->pki_alt);
+		(void)strlcpy(p->pki_alt->pki_name, p->pki_name,
+		    sizeof(p->pki_alt->pki_name));
+	}
+	return (p->pki_alt);
+}
+
+time_t
+tablecachettl(char *str)
+{
+	if (strcmp(str, "0") == 0)
+		return (0);
+	return (delaytonum(str));
+}
+
 int
 is_if_in_group(const char *ifname, const char *groupname)
 {
@@ -3683,3 +4388,80 @@ config_lo_mask_source(struct listen_opts *lo) {
 	return 0;
 }
 
+static int
+cpu_proc_valid(const char *name)
+{
+	static const char *procs[] = {
+		"parent", "lka", "control", "dispatcher", "launcher", "logger"
+	};
+	size_t	i;
+
+	for (i = 0; i < sizeof(procs) / sizeof(procs[0]); i++)
+		if (strcmp(name, procs[i]) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * The cpus of a NUMA node, as listed by the kernel: once a process is
+ * bound to them, its memory is allocated on that node as it touches it.
+ */
+static char *
+numa_node_cpus(int64_t node)
+{
+	char	 path[PATH_MAX];
+	char	*line = NULL;
+	size_t	 sz = 0;
+	ssize_t	 len;
+	FILE	*fp;
+
+	if (node < 0 || node > CPULIST_MAX)
+		return NULL;
+	(void)snprintf(path, sizeof path,
+	    "/sys/devices/system/node/node%"PRId64"/cpulist", node);
+	if ((fp = fopen(path, "r")) == NULL)
+		return NULL;
+	len = getline(&line, &sz, fp);
+	fclose(fp);
+	if (len > 0)
+		line[strcspn(line, "\n")] = '\0';
+	if (len <= 0 || !cpulist_parse(line, NULL, NULL)) {
+		free(line);
+		return NULL;
+	}
+	return line;
+}
+
+static int
+processor_name_valid(const char *name)
+{
+	if (strchr(name, '#') != NULL) {
+		yyerror("invalid processor name, '#' is reserved: %s", name);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * A processor with several instances is forked once per instance; the
+ * first one uses the processor name and the others are registered as
+ * "name#n" pointing back to it, so they are forked and managed like any
+ * other processor.
+ */
+static void
+processor_set(const char *name, struct filter_proc *fp)
+{
+	struct filter_proc	*instance;
+	char			*instance_name;
+	int			 i;
+
+	dict_set(conf->sc_filter_processes_dict, name, fp);
+	for (i = 1; i < fp->instances; i++) {
+		instance = xmemdup(fp, sizeof *fp);
+		instance->pool = name;
+		xasprintf(&instance_name, "%s#%d", name, i);
+		dict_set(conf->sc_filter_processes_dict, instance_name,
+		    instance);
+		free(instance_name);
+	}
+}
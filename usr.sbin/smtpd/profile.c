@@ -0,0 +1,123 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <imsg.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+/*
+ * With "smtpctl profile loop", every imsg handler, io callback and runq
+ * callback run from the event loop of a process is timed, and accounted
+ * under its name.  A single call holding the loop for longer than
+ * PROFILE_STALL_MS is logged as a stall: nothing else is served by the
+ * process meanwhile.
+ */
+#define	PROFILE_STALL_MS	100
+
+static struct dict	profile;
+static int		init;
+
+int
+profile_begin(struct timespec *t0)
+{
+	if ((profiling & PROFILE_LOOP) == 0)
+		return (0);
+
+	clock_gettime(CLOCK_MONOTONIC, t0);
+	return (1);
+}
+
+void
+profile_end(const struct timespec *t0, const char *fmt, ...)
+{
+	struct profile_stat	*ps;
+	struct timespec		 t1, dt;
+	char			 key[STAT_KEY_SIZE];
+	va_list			 ap;
+	int			 r;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	timespecsub(&t1, t0, &dt);
+
+	va_start(ap, fmt);
+	r = vsnprintf(key, sizeof key, fmt, ap);
+	va_end(ap);
+	if (r < 0 || (size_t)r >= sizeof key)
+		return;
+
+	if (!init) {
+		dict_init(&profile);
+		init = 1;
+	}
+	if ((ps = dict_get(&profile, key)) == NULL) {
+		ps = xcalloc(1, sizeof *ps);
+		dict_set(&profile, key, ps);
+	}
+
+	ps->calls++;
+	timespecadd(&ps->total, &dt, &ps->total);
+	if (timespeccmp(&dt, &ps->max, >))
+		ps->max = dt;
+
+	if (dt.tv_sec * 1000 + dt.tv_nsec / 1000000 >= PROFILE_STALL_MS) {
+		ps->stalls++;
+		log_warnx("warn: profile: %s: %s stalled the event loop "
+		    "for %lld.%03lds", proc_name(smtpd_process), key,
+		    (long long)dt.tv_sec, dt.tv_nsec / 1000000);
+	}
+}
+
+/* send all the counters to control, then an empty message */
+void
+profile_show(struct mproc *p, uint32_t peerid)
+{
+	struct profile_stat	*ps;
+	const char		*key;
+	void			*iter;
+	size_t			 len, n;
+
+	n = 0;
+	iter = NULL;
+	while (init && dict_iter(&profile, &iter, &key, (void **)&ps)) {
+		len = IMSG_HEADER_SIZE + strlen(key) + 2 + sizeof(size_t) +
+		    sizeof(*ps);
+		if (n && p->m_pos + len > MAX_IMSGSIZE) {
+			m_close(p);
+			n = 0;
+		}
+		if (n++ == 0)
+			m_create(p, IMSG_CTL_SHOW_PROFILE, peerid, 0, -1);
+		m_add_string(p, key);
+		m_add_data(p, ps, sizeof(*ps));
+	}
+	if (n)
+		m_close(p);
+
+	m_compose(p, IMSG_CTL_SHOW_PROFILE, peerid, 0, -1, NULL, 0);
+}
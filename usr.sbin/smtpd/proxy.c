@@ -21,6 +21,7 @@
 #include <sys/tree.h>
 #include <sys/un.h>
 
+#include <ctype.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,6 +44,23 @@
 #define PROXY_TF_STREAM 0x1
 #define PROXY_TF_DGRAM 0x2
 
+#define PP2_TYPE_ALPN		0x01
+#define PP2_TYPE_AUTHORITY	0x02
+#define PP2_TYPE_CRC32C		0x03
+#define PP2_TYPE_NOOP		0x04
+#define PP2_TYPE_UNIQUE_ID	0x05
+#define PP2_TYPE_SSL		0x20
+#define PP2_SUBTYPE_SSL_VERSION	0x21
+#define PP2_SUBTYPE_SSL_CN	0x22
+#define PP2_SUBTYPE_SSL_CIPHER	0x23
+#define PP2_SUBTYPE_SSL_SIG_ALG	0x24
+#define PP2_SUBTYPE_SSL_KEY_ALG	0x25
+#define PP2_TYPE_NETNS		0x30
+
+#define PP2_CLIENT_SSL		0x01
+#define PP2_CLIENT_CERT_CONN	0x02
+#define PP2_CLIENT_CERT_SESS	0x04
+
 #define PROXY_SESSION_TIMEOUT	300
 
 static const uint8_t pv2_signature[] = {
@@ -89,31 +107,37 @@ struct proxy_session {
 
 	uint64_t	id;
 	int		fd;
-	uint16_t	header_len;
-	uint16_t	header_total;
-	uint16_t	addr_len;
-	uint16_t	addr_total;
 
 	struct sockaddr_storage	ss;
-	struct proxy_hdr_v2	hdr;
-	union proxy_addr	addr;
+	struct proxy_info	info;
 
 	void (*cb_accepted)(struct listener *, int,
-	    const struct sockaddr_storage *, struct io *);
+	    const struct sockaddr_storage *, struct io *,
+	    const struct proxy_info *);
 	void (*cb_dropped)(struct listener *, int,
 	    const struct sockaddr_storage *);
 };
 
 static void proxy_io(struct io *, int, void *);
 static void proxy_error(struct proxy_session *, const char *, const char *);
-static int proxy_header_validate(struct proxy_session *);
-static int proxy_translate_ss(struct proxy_session *);
+static ssize_t proxy_header_validate(struct proxy_session *,
+    const struct proxy_hdr_v2 *, size_t *);
+static int proxy_tlv_next(const uint8_t **, size_t *, uint8_t *,
+    const uint8_t **, size_t *);
+static int proxy_tlv_parse(struct proxy_session *, const uint8_t *, size_t,
+    size_t);
+static int proxy_tlv_ssl(struct proxy_session *, const uint8_t *, size_t);
+static void proxy_tlv_string(char *, size_t, const uint8_t *, size_t);
+static uint32_t proxy_crc32c(const uint8_t *, size_t, size_t);
+static int proxy_translate_ss(struct proxy_session *, uint8_t,
+    const union proxy_addr *);
 
 int
 proxy_session(struct listener *listener, int sock,
     const struct sockaddr_storage *ss,
     void (*accepted)(struct listener *, int,
-	const struct sockaddr_storage *, struct io *),
+	const struct sockaddr_storage *, struct io *,
+	const struct proxy_info *),
     void (*dropped)(struct listener *, int,
 	const struct sockaddr_storage *));
 
@@ -121,7 +145,8 @@ int
 proxy_session(struct listener *listener, int sock,
     const struct sockaddr_storage *ss,
     void (*accepted)(struct listener *, int,
-	const struct sockaddr_storage *, struct io *),
+	const struct sockaddr_storage *, struct io *,
+	const struct proxy_info *),
     void (*dropped)(struct listener *, int,
 	const struct sockaddr_storage *))
 {
@@ -138,8 +163,6 @@ proxy_session(struct listener *listener, int sock,
 	s->id = generate_uid();
 	s->l = listener;
 	s->fd = sock;
-	s->header_len = 0;
-	s->addr_len = 0;
 	s->ss = *ss;
 	s->cb_accepted = accepted;
 	s->cb_dropped = dropped;
@@ -159,68 +182,33 @@ static void
 proxy_io(struct io *io, int evt, void *arg)
 {
 	struct proxy_session	*s = arg;
-	struct proxy_hdr_v2	*h = &s->hdr;
-	uint8_t *buf;
-	size_t len, off;
+	const struct proxy_hdr_v2 *h;
+	const uint8_t		*buf;
+	size_t			 len, addr_len;
+	ssize_t			 total;
 
 	switch (evt) {
 
 	case IO_DATAIN:
+		/*
+		 * The header is parsed in place once it is complete in the
+		 * input buffer, then dropped from it in one go.  Whatever
+		 * follows belongs to the session and is left in the buffer.
+		 */
 		buf = io_data(io);
 		len = io_datalen(io);
+		if (len < sizeof(*h))
+			return;
 
-		if (s->header_len < sizeof(s->hdr)) {
-			/* header is incomplete */
-			off = sizeof(s->hdr) - s->header_len;
-			off = (len < off ? len : off);
-			memcpy((uint8_t *) &s->hdr + s->header_len, buf, off);
-
-			s->header_len += off;
-			buf += off;
-			len -= off;
-			io_drop(s->io, off);
-
-			if (s->header_len < sizeof(s->hdr)) {
-				/* header is still not complete */
-				return;
-			}
-
-			if (proxy_header_validate(s) != 0)
-				return;
-		}
-
-		if (s->addr_len < s->addr_total) {
-			/* address is incomplete */
-			off = s->addr_total - s->addr_len;
-			off = (len < off ? len : off);
-			memcpy((uint8_t *) &s->addr + s->addr_len, buf, off);
-
-			s->header_len += off;
-			s->addr_len += off;
-			buf += off;
-			len -= off;
-			io_drop(s->io, off);
-
-			if (s->addr_len < s->addr_total) {
-				/* address is still not complete */
-				return;
-			}
-		}
-
-		if (s->header_len < s->header_total) {
-			/* additional parameters not complete */
-			/* these are ignored for now, but we still need to drop
-			 * the bytes from the buffer */
-			off = s->header_total - s->header_len;
-			off = (len < off ? len : off);
-
-			s->header_len += off;
-			io_drop(s->io, off);
+		h = (const struct proxy_hdr_v2 *)buf;
+		if ((total = proxy_header_validate(s, h, &addr_len)) == -1)
+			return;
+		if (len < (size_t)total)
+			return;
 
-			if (s->header_len < s->header_total)
-				/* not complete yet */
-				return;
-		}
+		if (proxy_tlv_parse(s, buf, sizeof(*h) + addr_len,
+		    total) == -1)
+			return;
 
 		switch(h->ver_cmd & 0xF) {
 		case PROXY_CLOCAL:
@@ -228,7 +216,8 @@ proxy_io(struct io *io, int evt, void *arg)
 			break;
 
 		case PROXY_CPROXY:
-			if (proxy_translate_ss(s) != 0)
+			if (proxy_translate_ss(s, h->fam,
+			    (const union proxy_addr *)(buf + sizeof(*h))) != 0)
 				return;
 			break;
 
@@ -237,7 +226,17 @@ proxy_io(struct io *io, int evt, void *arg)
 			return;
 		}
 
-		s->cb_accepted(s->l, s->fd, &s->ss, s->io);
+		io_drop(io, total);
+
+		log_info("%016"PRIx64" smtp event=proxied address=%s "
+		    "tls=%s%s%s",
+		    s->id, ss_to_text(&s->ss),
+		    s->info.tls ? (s->info.tls_version[0] ?
+			s->info.tls_version : "yes") : "no",
+		    s->info.unique_id[0] ? " unique-id=" : "",
+		    s->info.unique_id);
+
+		s->cb_accepted(s->l, s->fd, &s->ss, s->io, &s->info);
 		/* we passed off s->io, so it does not need to be freed here */
 		free(s);
 		break;
@@ -275,11 +274,10 @@ proxy_error(struct proxy_session *s, const char *reason, const char *extra)
 	free(s);
 }
 
-static int
-proxy_header_validate(struct proxy_session *s)
+static ssize_t
+proxy_header_validate(struct proxy_session *s, const struct proxy_hdr_v2 *h,
+    size_t *addr_len)
 {
-	struct proxy_hdr_v2 *h = &s->hdr;
-
 	if (memcmp(h->sig, pv2_signature,
 		sizeof(pv2_signature)) != 0) {
 		proxy_error(s, "protocol error", "invalid signature");
@@ -293,19 +291,19 @@ proxy_header_validate(struct proxy_session *s)
 
 	switch (h->fam) {
 	case (PROXY_AF_UNSPEC << 4 | PROXY_TF_UNSPEC):
-		s->addr_total = 0;
+		*addr_len = 0;
 		break;
 
 	case (PROXY_AF_INET << 4 | PROXY_TF_STREAM):
-		s->addr_total = sizeof(s->addr.ipv4);
+		*addr_len = sizeof(struct proxy_addr_ipv4);
 		break;
 
 	case (PROXY_AF_INET6 << 4 | PROXY_TF_STREAM):
-		s->addr_total = sizeof(s->addr.ipv6);
+		*addr_len = sizeof(struct proxy_addr_ipv6);
 		break;
 
 	case (PROXY_AF_UNIX << 4 | PROXY_TF_STREAM):
-		s->addr_total = sizeof(s->addr.un);
+		*addr_len = sizeof(struct proxy_addr_unix);
 		break;
 
 	default:
@@ -313,30 +311,202 @@ proxy_header_validate(struct proxy_session *s)
 		return (-1);
 	}
 
-	s->header_total = ntohs(h->len);
-	if (s->header_total > UINT16_MAX - sizeof(struct proxy_hdr_v2)) {
-		proxy_error(s, "protocol error", "header too long");
+	if (ntohs(h->len) < *addr_len) {
+		proxy_error(s, "protocol error", "address info too short");
 		return (-1);
 	}
-	s->header_total += sizeof(struct proxy_hdr_v2);
 
-	if (s->header_total < sizeof(struct proxy_hdr_v2) + s->addr_total) {
-		proxy_error(s, "protocol error", "address info too short");
+	return sizeof(*h) + ntohs(h->len);
+}
+
+/*
+ * Fetch the next type-length-value from *p, advancing it.  Returns 1 when
+ * a TLV was fetched, 0 at the end of the buffer and -1 if it is truncated.
+ */
+static int
+proxy_tlv_next(const uint8_t **p, size_t *left, uint8_t *type,
+    const uint8_t **v, size_t *vlen)
+{
+	if (*left == 0)
+		return 0;
+	if (*left < 3)
+		return -1;
+
+	*type = (*p)[0];
+	*vlen = (*p)[1] << 8 | (*p)[2];
+	if (*vlen > *left - 3)
+		return -1;
+	*v = *p + 3;
+
+	*p += 3 + *vlen;
+	*left -= 3 + *vlen;
+	return 1;
+}
+
+static int
+proxy_tlv_parse(struct proxy_session *s, const uint8_t *buf, size_t off,
+    size_t total)
+{
+	const uint8_t	*p = buf + off, *v;
+	size_t		 left = total - off, vlen;
+	uint8_t		 type;
+	uint32_t	 crc;
+	int		 r;
+
+	while ((r = proxy_tlv_next(&p, &left, &type, &v, &vlen)) == 1) {
+		switch (type) {
+		case PP2_TYPE_ALPN:
+			proxy_tlv_string(s->info.alpn, sizeof(s->info.alpn),
+			    v, vlen);
+			break;
+
+		case PP2_TYPE_AUTHORITY:
+			proxy_tlv_string(s->info.authority,
+			    sizeof(s->info.authority), v, vlen);
+			break;
+
+		case PP2_TYPE_UNIQUE_ID:
+			proxy_tlv_string(s->info.unique_id,
+			    sizeof(s->info.unique_id), v, vlen);
+			break;
+
+		case PP2_TYPE_CRC32C:
+			if (vlen != sizeof(crc)) {
+				proxy_error(s, "protocol error",
+				    "invalid checksum length");
+				return (-1);
+			}
+			memcpy(&crc, v, sizeof(crc));
+			if (proxy_crc32c(buf, total, v - buf) != ntohl(crc)) {
+				proxy_error(s, "protocol error",
+				    "checksum mismatch");
+				return (-1);
+			}
+			break;
+
+		case PP2_TYPE_SSL:
+			if (proxy_tlv_ssl(s, v, vlen) == -1)
+				return (-1);
+			break;
+
+		default:
+			/* NOOP, NETNS and unknown types are skipped */
+			break;
+		}
+	}
+
+	if (r == -1) {
+		proxy_error(s, "protocol error", "truncated TLV");
+		return (-1);
+	}
+
+	return 0;
+}
+
+static int
+proxy_tlv_ssl(struct proxy_session *s, const uint8_t *buf, size_t len)
+{
+	const uint8_t	*v;
+	size_t		 vlen;
+	uint32_t	 verify;
+	uint8_t		 client, type;
+	int		 r;
+
+	if (len < 1 + sizeof(verify)) {
+		proxy_error(s, "protocol error", "SSL TLV too short");
+		return (-1);
+	}
+	client = buf[0];
+	memcpy(&verify, buf + 1, sizeof(verify));
+	buf += 1 + sizeof(verify);
+	len -= 1 + sizeof(verify);
+
+	while ((r = proxy_tlv_next(&buf, &len, &type, &v, &vlen)) == 1) {
+		switch (type) {
+		case PP2_SUBTYPE_SSL_VERSION:
+			proxy_tlv_string(s->info.tls_version,
+			    sizeof(s->info.tls_version), v, vlen);
+			break;
+
+		case PP2_SUBTYPE_SSL_CN:
+			proxy_tlv_string(s->info.tls_cn,
+			    sizeof(s->info.tls_cn), v, vlen);
+			break;
+
+		case PP2_SUBTYPE_SSL_CIPHER:
+			proxy_tlv_string(s->info.tls_cipher,
+			    sizeof(s->info.tls_cipher), v, vlen);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if (r == -1) {
+		proxy_error(s, "protocol error", "truncated SSL TLV");
 		return (-1);
 	}
 
+	if (client & PP2_CLIENT_SSL) {
+		s->info.tls = 1;
+		/* verify is zero only if a certificate was presented and ok */
+		if (client & (PP2_CLIENT_CERT_CONN | PP2_CLIENT_CERT_SESS) &&
+		    verify == 0)
+			s->info.tls_verified = 1;
+	}
+
 	return 0;
 }
 
+/*
+ * Copy a TLV value as a string, leaving dst empty if it doesn't fit or
+ * isn't printable so that it never ends up in logs or headers garbled.
+ */
+static void
+proxy_tlv_string(char *dst, size_t dstsz, const uint8_t *v, size_t vlen)
+{
+	size_t	i;
+
+	if (vlen >= dstsz)
+		return;
+	for (i = 0; i < vlen; i++)
+		if (!isprint(v[i]))
+			return;
+	memcpy(dst, v, vlen);
+	dst[vlen] = '\0';
+}
+
+/*
+ * CRC32c of the whole header, computed as if the four bytes of the
+ * checksum value at offset skip were zero.
+ */
+static uint32_t
+proxy_crc32c(const uint8_t *buf, size_t len, size_t skip)
+{
+	uint32_t	crc = 0xffffffff;
+	size_t		i;
+	int		k;
+
+	for (i = 0; i < len; i++) {
+		crc ^= (i >= skip && i < skip + 4) ? 0 : buf[i];
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
 static int
-proxy_translate_ss(struct proxy_session *s)
+proxy_translate_ss(struct proxy_session *s, uint8_t fam,
+    const union proxy_addr *addr)
 {
 	struct sockaddr_in *sin = (struct sockaddr_in *) &s->ss;
 	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &s->ss;
 	struct sockaddr_un *sun = (struct sockaddr_un *) &s->ss;
 	size_t sun_len;
 
-	switch (s->hdr.fam) {
+	switch (fam) {
 	case (PROXY_AF_UNSPEC << 4 | PROXY_TF_UNSPEC):
 		/* unspec: only supported for local */
 		proxy_error(s, "address translation", "UNSPEC family not "
@@ -346,29 +516,29 @@ proxy_translate_ss(struct proxy_session *s)
 	case (PROXY_AF_INET << 4 | PROXY_TF_STREAM):
 		memset(&s->ss, 0, sizeof(s->ss));
 		sin->sin_family = AF_INET;
-		sin->sin_port = s->addr.ipv4.src_port;
-		sin->sin_addr.s_addr = s->addr.ipv4.src_addr;
+		sin->sin_port = addr->ipv4.src_port;
+		sin->sin_addr.s_addr = addr->ipv4.src_addr;
 		break;
 
 	case (PROXY_AF_INET6 << 4 | PROXY_TF_STREAM):
 		memset(&s->ss, 0, sizeof(s->ss));
 		sin6->sin6_family = AF_INET6;
-		sin6->sin6_port = s->addr.ipv6.src_port;
-		memcpy(sin6->sin6_addr.s6_addr, s->addr.ipv6.src_addr,
-		    sizeof(s->addr.ipv6.src_addr));
+		sin6->sin6_port = addr->ipv6.src_port;
+		memcpy(sin6->sin6_addr.s6_addr, addr->ipv6.src_addr,
+		    sizeof(addr->ipv6.src_addr));
 		break;
 
 	case (PROXY_AF_UNIX << 4 | PROXY_TF_STREAM):
 		memset(&s->ss, 0, sizeof(s->ss));
-		sun_len = strnlen(s->addr.un.src_addr,
-		    sizeof(s->addr.un.src_addr));
+		sun_len = strnlen(addr->un.src_addr,
+		    sizeof(addr->un.src_addr));
 		if (sun_len > sizeof(sun->sun_path)) {
 			proxy_error(s, "address translation", "Unix socket path"
 			    " longer than supported");
 			return (-1);
 		}
 		sun->sun_family = AF_UNIX;
-		memcpy(sun->sun_path, s->addr.un.src_addr, sun_len);
+		memcpy(sun->sun_path, addr->un.src_addr, sun_len);
 		break;
 
 	default:
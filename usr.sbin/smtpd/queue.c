@@ -26,6 +26,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 
+#include <errno.h>
 #include <event.h>
 #include <fcntl.h>
 #include <grp.h> /* needed for setgroups */
@@ -33,20 +34,124 @@
 #include <inttypes.h>
 #include <pwd.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(HAVE_VIS_H) && !defined(BROKEN_STRNVIS)
+#include <vis.h>
+#else
+#include "bsd-vis.h"
+#endif
 
 #include "smtpd.h"
 #include "log.h"
 
+#define QUEUE_LOAD_BATCH	256
+#define QUEUE_LOAD_MAXQUEUED	4096
+
+/*
+ * Thresholds of the pressure published to the smtp server.  A level is
+ * entered as soon as one signal crosses it, and left on the next tick
+ * once all of them are back below.  The commit latency is smoothed and
+ * decays while nothing is committed.
+ */
+#define QUEUE_PRESSURE_INTERVAL	1		/* seconds */
+#define QUEUE_LATENCY_BUSY	250000		/* usecs */
+#define QUEUE_LATENCY_FULL	1000000
+#define QUEUE_INFLIGHT_BUSY	512		/* messages being received */
+#define QUEUE_INFLIGHT_FULL	2048
+#define QUEUE_BACKLOG_BUSY	(QUEUE_LOAD_MAXQUEUED / 4)	/* imsgs */
+#define QUEUE_BACKLOG_FULL	QUEUE_LOAD_MAXQUEUED
+
+/*
+ * Compressing and encrypting a message is CPU bound and does not touch
+ * the queue state, so when either is enabled the transforms are run by
+ * a pool of workers sharing the spool.  A commit completes when its
+ * worker is done, and the event loop keeps serving the others meantime.
+ */
+#define QUEUE_WORKERS		4
+
+/* scheduler state handed over on reload, or saved for the next start */
+#define QUEUE_STATE_PATH	PATH_SCHEDULER_STATE
+#define QUEUE_STATE_MAGIC	0x53435332	/* "SCS2" */
+
 static void queue_imsg(struct mproc *, struct imsg *);
 static void queue_timeout(int, short, void *);
 static void queue_bounce(struct envelope *, struct delivery_bounce *);
 static void queue_shutdown(void);
+static void queue_memory(enum memory_level);
 static void queue_log(const struct envelope *, const char *, const char *);
 static void queue_msgid_walk(int, short, void *);
+static void queue_submit(uint64_t, struct msg *);
+static void queue_transfer(struct msg *);
+static void queue_schedule(const uint64_t *, size_t);
+static void queue_list(uint32_t, const struct queue_filter *, uint64_t,
+    const void *, size_t);
+static int queue_list_match(const struct queue_filter *,
+    const struct envelope *);
+static void queue_list_line(const struct envelope *, const struct evpstate *,
+    uint32_t, char *, size_t);
+static void queue_state_open(void);
+static void queue_state_write(struct msg *);
+static void queue_state_close(int);
+static void queue_state_load(int, short, void *);
+static void queue_pressure_commit(const struct timespec *);
+static void queue_pressure_update(int);
+static void queue_pressure_timeout(int, short, void *);
+static void queue_commit(struct mproc *, uint64_t, uint32_t,
+    const struct timespec *);
+static void queue_commit_done(struct mproc *, uint64_t, uint32_t, int,
+    const struct timespec *);
+static int queue_commit_sync(struct mproc *, uint64_t, uint32_t,
+    const struct timespec *);
+static void queue_commit_synced(void *, int);
+static void queue_worker_init(void);
+static void queue_worker(int);
+static void queue_worker_imsg(struct mproc *, struct imsg *);
+
+struct queue_worker {
+	struct mproc		 p;
+	size_t			 pending;
+};
+
+struct queue_commit {
+	struct mproc		*p;
+	uint64_t		 reqid;
+	uint32_t		 msgid;
+	struct timespec		 t0;
+	int			 fd;
+};
+
+static struct queue_worker	 workers[QUEUE_WORKERS];
+static struct tree		 commits;
+static int			 nworkers;
+
+static struct event	 ev_qload;
+static int		 qload_discover;
+
+static struct {
+	FILE		*fp;
+	struct event	 ev;
+	int		 pending;	/* shards yet to hand their state */
+	int		 ok;
+	int		 draining;	/* no new message from now on */
+} reload;
+
+static const char *queue_pressure_name[] = {
+	[QUEUE_PRESSURE_NONE]	= "none",
+	[QUEUE_PRESSURE_BUSY]	= "busy",
+	[QUEUE_PRESSURE_FULL]	= "full",
+};
+
+static struct {
+	struct event		 ev;
+	enum queue_pressure	 level;
+	size_t			 inflight;	/* created, not yet committed */
+	int64_t			 latency;	/* usecs */
+	int			 committed;	/* since the last tick */
+} pressure;
 
 
 static void
@@ -56,13 +161,20 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 	struct msg_walkinfo	*wi;
 	struct timeval		 tv;
 	struct bounce_req_msg	*req_bounce;
+	struct timespec		 t0;
 	struct envelope		 evp;
+	struct queue_filter	 filter;
+	struct mproc		*p_sched, *p_session;
 	struct msg		 m;
+	const void		*data;
 	const char		*reason;
+	size_t			 len;
 	uint64_t		 reqid, evpid, holdq;
+	uint64_t		 evpids[MAX_IMSGSIZE / sizeof(uint64_t)];
+	char			 idxbuf[MSGINDEX_MAX];
 	uint32_t		 msgid;
 	time_t			 nexttry;
-	size_t			 n_evp;
+	size_t			 n_evp, i;
 	int			 fd, mta_ext, ret, v, flags, code;
 
 	if (imsg == NULL)
@@ -76,7 +188,11 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_id(&m, &reqid);
 		m_end(&m);
 
-		ret = queue_message_create(&msgid);
+		ret = reload.draining ? 0 : queue_message_create(&msgid);
+		if (ret) {
+			pressure.inflight++;
+			queue_pressure_update(0);
+		}
 
 		m_create(p, IMSG_SMTP_MESSAGE_CREATE, 0, 0, -1);
 		m_add_id(p, reqid);
@@ -95,32 +211,39 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_end(&m);
 
 		queue_message_delete(msgid);
+		if (pressure.inflight)
+			pressure.inflight--;
 
-		m_create(p_scheduler, IMSG_QUEUE_MESSAGE_ROLLBACK,
-		    0, 0, -1);
-		m_add_msgid(p_scheduler, msgid);
-		m_close(p_scheduler);
+		p_sched = scheduler_peer(msgid);
+		m_create(p_sched, IMSG_QUEUE_MESSAGE_ROLLBACK, 0, 0, -1);
+		m_add_msgid(p_sched, msgid);
+		m_close(p_sched);
 		return;
 
 	case IMSG_SMTP_MESSAGE_COMMIT:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
 		m_get_msgid(&m, &msgid);
+		m_get_data(&m, &data, &len);
 		m_end(&m);
 
-		ret = queue_message_commit(msgid);
-
-		m_create(p, IMSG_SMTP_MESSAGE_COMMIT, 0, 0, -1);
-		m_add_id(p, reqid);
-		m_add_int(p, (ret == 0) ? 0 : 1);
-		m_close(p);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (reload.draining) {
+			queue_commit_done(p, reqid, msgid, 0, &t0);
+			return;
+		}
+		if (len && !queue_message_index(msgid, data, len))
+			log_warnx("warn: queue: could not store the header "
+			    "index of message %08"PRIx32, msgid);
 
-		if (ret) {
-			m_create(p_scheduler, IMSG_QUEUE_MESSAGE_COMMIT,
-			    0, 0, -1);
-			m_add_msgid(p_scheduler, msgid);
-			m_close(p_scheduler);
+		if (nworkers) {
+			queue_commit(p, reqid, msgid, &t0);
+			return;
 		}
+		if (queue_commit_sync(p, reqid, msgid, &t0))
+			return;
+		ret = queue_message_commit(msgid);
+		queue_commit_done(p, reqid, msgid, ret, &t0);
 		return;
 
 	case IMSG_SMTP_MESSAGE_OPEN:
@@ -144,79 +267,75 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 	case IMSG_LKA_ENVELOPE_SUBMIT:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
-		m_get_envelope(&m, &evp);
+		queue_submit(reqid, &m);
 		m_end(&m);
-
-		if (evp.id == 0)
-			log_warnx("warn: imsg_queue_submit_envelope: evpid=0");
-		if (evpid_to_msgid(evp.id) == 0)
-			log_warnx("warn: imsg_queue_submit_envelope: msgid=0, "
-			    "evpid=%016"PRIx64, evp.id);
-		ret = queue_envelope_create(&evp);
-		m_create(p_dispatcher, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
-		m_add_id(p_dispatcher, reqid);
-		if (ret == 0)
-			m_add_int(p_dispatcher, 0);
-		else {
-			m_add_int(p_dispatcher, 1);
-			m_add_evpid(p_dispatcher, evp.id);
-		}
-		m_close(p_dispatcher);
-		if (ret) {
-			m_create(p_scheduler,
-			    IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
-			m_add_envelope(p_scheduler, &evp);
-			m_close(p_scheduler);
-		}
 		return;
 
 	case IMSG_LKA_ENVELOPE_COMMIT:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
 		m_end(&m);
-		m_create(p_dispatcher, IMSG_QUEUE_ENVELOPE_COMMIT, 0, 0, -1);
-		m_add_id(p_dispatcher, reqid);
-		m_add_int(p_dispatcher, 1);
-		m_close(p_dispatcher);
+		p_session = smtp_peer(reqid);
+		m_create(p_session, IMSG_QUEUE_ENVELOPE_COMMIT, 0, 0, -1);
+		m_add_id(p_session, reqid);
+		m_add_int(p_session, 1);
+		m_close(p_session);
 		return;
 
 	case IMSG_SCHED_ENVELOPE_REMOVE:
+		/*
+		 * The envelopes of a removed message come in a row: delete
+		 * them in one backend call, which lets it drop the whole
+		 * message at once, and acknowledge the lot in one imsg.
+		 */
 		m_msg(&m, imsg);
-		m_get_evpid(&m, &evpid);
+		m_create(p, IMSG_QUEUE_ENVELOPE_ACK, 0, 0, -1);
+		n_evp = 0;
+		while (!m_is_eom(&m)) {
+			m_get_evpid(&m, &evpid);
+			m_add_evpid(p, evpid);
+
+			/* already removed by scheduler */
+			if (queue_envelope_load(evpid, &evp) == 0)
+				continue;
+
+			queue_log(&evp, "Remove", "Removed by administrator");
+			if (n_evp && evpid_to_msgid(evpid) !=
+			    evpid_to_msgid(evpids[0])) {
+				queue_envelope_delete_batch(evpids, n_evp);
+				n_evp = 0;
+			}
+			evpids[n_evp++] = evpid;
+		}
 		m_end(&m);
-
-		m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_ACK, 0, 0, -1);
-		m_add_evpid(p_scheduler, evpid);
-		m_close(p_scheduler);
-
-		/* already removed by scheduler */
-		if (queue_envelope_load(evpid, &evp) == 0)
-			return;
-
-		queue_log(&evp, "Remove", "Removed by administrator");
-		queue_envelope_delete(evpid);
+		if (n_evp)
+			queue_envelope_delete_batch(evpids, n_evp);
+		m_close(p);
 		return;
 
 	case IMSG_SCHED_ENVELOPE_EXPIRE:
 		m_msg(&m, imsg);
-		m_get_evpid(&m, &evpid);
+		while (!m_is_eom(&m)) {
+			m_get_evpid(&m, &evpid);
+
+			m_create(p, IMSG_QUEUE_ENVELOPE_ACK, 0, 0, -1);
+			m_add_evpid(p, evpid);
+			m_close(p);
+
+			/* already removed by scheduler*/
+			if (queue_envelope_load(evpid, &evp) == 0)
+				continue;
+
+			memset(&bounce, 0, sizeof(struct delivery_bounce));
+			bounce.type = B_FAILED;
+			envelope_set_errormsg(&evp, "Envelope expired");
+			envelope_set_esc_class(&evp, ESC_STATUS_PERMFAIL);
+			envelope_set_esc_code(&evp, ESC_DELIVERY_TIME_EXPIRED);
+			queue_bounce(&evp, &bounce);
+			queue_log(&evp, "Expire", "Envelope expired");
+			queue_envelope_delete(evpid);
+		}
 		m_end(&m);
-
-		m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_ACK, 0, 0, -1);
-		m_add_evpid(p_scheduler, evpid);
-		m_close(p_scheduler);
-
-		/* already removed by scheduler*/
-		if (queue_envelope_load(evpid, &evp) == 0)
-			return;
-
-		bounce.type = B_FAILED;
-		envelope_set_errormsg(&evp, "Envelope expired");
-		envelope_set_esc_class(&evp, ESC_STATUS_PERMFAIL);
-		envelope_set_esc_code(&evp, ESC_DELIVERY_TIME_EXPIRED);
-		queue_bounce(&evp, &bounce);
-		queue_log(&evp, "Expire", "Envelope expired");
-		queue_envelope_delete(evpid);
 		return;
 
 	case IMSG_SCHED_ENVELOPE_BOUNCE:
@@ -226,59 +345,52 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 
 		if (queue_envelope_load(evpid, &evp) == 0) {
 			log_warnx("queue: bounce: failed to load envelope");
-			m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
-			m_add_evpid(p_scheduler, evpid);
-			m_add_u32(p_scheduler, 0); /* not in-flight */
-			m_close(p_scheduler);
+			m_create(p, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
+			m_add_evpid(p, evpid);
+			m_add_u32(p, 0); /* not in-flight */
+			m_close(p);
 			return;
 		}
 		queue_bounce(&evp, &req_bounce->bounce);
 		evp.lastbounce = req_bounce->timestamp;
-		if (!queue_envelope_update(&evp))
+		if (!queue_envelope_retry(&evp))
 			log_warnx("warn: could not update envelope %016"PRIx64, evpid);
 		return;
 
 	case IMSG_SCHED_ENVELOPE_DELIVER:
 		m_msg(&m, imsg);
-		m_get_evpid(&m, &evpid);
-		m_end(&m);
-		if (queue_envelope_load(evpid, &evp) == 0) {
-			log_warnx("queue: deliver: failed to load envelope");
-			m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
-			m_add_evpid(p_scheduler, evpid);
-			m_add_u32(p_scheduler, 1); /* in-flight */
-			m_close(p_scheduler);
-			return;
+		while (!m_is_eom(&m)) {
+			m_get_evpid(&m, &evpid);
+			if (queue_envelope_load(evpid, &evp) == 0) {
+				log_warnx("queue: deliver: failed to load "
+				    "envelope");
+				m_create(p, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
+				m_add_evpid(p, evpid);
+				m_add_u32(p, 1); /* in-flight */
+				m_close(p);
+				continue;
+			}
+			evp.lasttry = time(NULL);
+			m_create(p_dispatcher, IMSG_QUEUE_DELIVER, 0, 0, -1);
+			m_add_envelope(p_dispatcher, &evp);
+			m_close(p_dispatcher);
 		}
-		evp.lasttry = time(NULL);
-		m_create(p_dispatcher, IMSG_QUEUE_DELIVER, 0, 0, -1);
-		m_add_envelope(p_dispatcher, &evp);
-		m_close(p_dispatcher);
+		m_end(&m);
 		return;
 
 	case IMSG_SCHED_ENVELOPE_INJECT:
 		m_msg(&m, imsg);
-		m_get_evpid(&m, &evpid);
+		n_evp = 0;
+		while (!m_is_eom(&m))
+			m_get_evpid(&m, &evpids[n_evp++]);
 		m_end(&m);
-		bounce_add(evpid);
+		bounce_add(evpids, n_evp);
 		return;
 
 	case IMSG_SCHED_ENVELOPE_TRANSFER:
 		m_msg(&m, imsg);
-		m_get_evpid(&m, &evpid);
+		queue_transfer(&m);
 		m_end(&m);
-		if (queue_envelope_load(evpid, &evp) == 0) {
-			log_warnx("queue: failed to load envelope");
-			m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
-			m_add_evpid(p_scheduler, evpid);
-			m_add_u32(p_scheduler, 1); /* in-flight */
-			m_close(p_scheduler);
-			return;
-		}
-		evp.lasttry = time(NULL);
-		m_create(p_dispatcher, IMSG_QUEUE_TRANSFER, 0, 0, -1);
-		m_add_envelope(p_dispatcher, &evp);
-		m_close(p_dispatcher);
 		return;
 
 	case IMSG_CTL_LIST_ENVELOPES:
@@ -318,6 +430,39 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_close(p_control);
 		return;
 
+	case IMSG_CTL_LIST_QUEUE:
+		m_msg(&m, imsg);
+		m_get_data(&m, &data, &len);
+		if (len != sizeof filter)
+			fatalx("queue: bad filter size");
+		memcpy(&filter, data, sizeof filter);
+		m_get_evpid(&m, &evpid);
+		m_get_data(&m, &data, &len);
+		m_end(&m);
+		queue_list(imsg->hdr.peerid, &filter, evpid, data,
+		    len / sizeof(struct evpstate));
+		return;
+
+	case IMSG_QUEUE_BULK_MATCH:
+		/* the scheduler selected these, check what it cannot */
+		m_msg(&m, imsg);
+		m_get_data(&m, &data, &len);
+		if (len != sizeof filter)
+			fatalx("queue: bad filter size");
+		memcpy(&filter, data, sizeof filter);
+		m_get_data(&m, &data, &len);
+		m_end(&m);
+		for (i = 0, n_evp = 0; i < len / sizeof(evpid); i++) {
+			memmove(&evpid, (const char *)data + i * sizeof(evpid),
+			    sizeof(evpid));
+			if (queue_envelope_load(evpid, &evp) &&
+			    queue_list_match(&filter, &evp))
+				evpids[n_evp++] = evpid;
+		}
+		m_compose(p, IMSG_QUEUE_BULK_MATCH, imsg->hdr.peerid, 0, -1,
+		    evpids, n_evp * sizeof(evpid));
+		return;
+
 	case IMSG_MDA_OPEN_MESSAGE:
 	case IMSG_MTA_OPEN_MESSAGE:
 		m_msg(&m, imsg);
@@ -327,36 +472,69 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		fd = queue_message_fd_r(msgid);
 		m_create(p, imsg->hdr.type, 0, 0, fd);
 		m_add_id(p, reqid);
+		if (imsg->hdr.type == IMSG_MDA_OPEN_MESSAGE) {
+			/* the header index spares the loop check a parse */
+			v = (fd == -1) ? 0 : queue_message_index_load(msgid,
+			    idxbuf, sizeof idxbuf);
+			m_add_data(p, idxbuf, v);
+		}
 		m_close(p);
 		return;
 
 	case IMSG_MDA_DELIVERY_OK:
+		/* the envelopes delivered for a message, in one batch */
+		m_msg(&m, imsg);
+		n_evp = 0;
+		while (!m_is_eom(&m)) {
+			m_get_evpid(&m, &evpid);
+			if (n_evp && evpid_to_msgid(evpid) !=
+			    evpid_to_msgid(evpids[0]))
+				fatalx("queue: delivery batch spans messages");
+			if (queue_envelope_load(evpid, &evp) == 0) {
+				log_warn("queue: dsn: failed to load envelope");
+				continue;
+			}
+			if (evp.dsn_notify & DSN_SUCCESS) {
+				bounce.type = B_DELIVERED;
+				bounce.dsn_ret = evp.dsn_ret;
+				envelope_set_esc_class(&evp, ESC_STATUS_OK);
+				queue_bounce(&evp, &bounce);
+			}
+			evpids[n_evp++] = evpid;
+		}
+		m_end(&m);
+		if (n_evp == 0)
+			return;
+		queue_envelope_delete_batch(evpids, n_evp);
+		p_sched = scheduler_peer(evpid_to_msgid(evpids[0]));
+		m_create(p_sched, IMSG_QUEUE_DELIVERY_OK, 0, 0, -1);
+		for (i = 0; i < n_evp; i++)
+			m_add_evpid(p_sched, evpids[i]);
+		m_close(p_sched);
+		return;
+
 	case IMSG_MTA_DELIVERY_OK:
 		m_msg(&m, imsg);
 		m_get_evpid(&m, &evpid);
-		if (imsg->hdr.type == IMSG_MTA_DELIVERY_OK)
-			m_get_int(&m, &mta_ext);
+		m_get_int(&m, &mta_ext);
 		m_end(&m);
+		p_sched = scheduler_peer(evpid_to_msgid(evpid));
 		if (queue_envelope_load(evpid, &evp) == 0) {
 			log_warn("queue: dsn: failed to load envelope");
 			return;
 		}
-		if (evp.dsn_notify & DSN_SUCCESS) {
+		if (evp.dsn_notify & DSN_SUCCESS &&
+		    (mta_ext & MTA_EXT_DSN) == 0) {
 			bounce.type = B_DELIVERED;
 			bounce.dsn_ret = evp.dsn_ret;
 			envelope_set_esc_class(&evp, ESC_STATUS_OK);
-			if (imsg->hdr.type == IMSG_MDA_DELIVERY_OK)
-				queue_bounce(&evp, &bounce);
-			else if (imsg->hdr.type == IMSG_MTA_DELIVERY_OK &&
-			    (mta_ext & MTA_EXT_DSN) == 0) {
-				bounce.mta_without_dsn = 1;
-				queue_bounce(&evp, &bounce);
-			}
+			bounce.mta_without_dsn = 1;
+			queue_bounce(&evp, &bounce);
 		}
 		queue_envelope_delete(evpid);
-		m_create(p_scheduler, IMSG_QUEUE_DELIVERY_OK, 0, 0, -1);
-		m_add_evpid(p_scheduler, evpid);
-		m_close(p_scheduler);
+		m_create(p_sched, IMSG_QUEUE_DELIVERY_OK, 0, 0, -1);
+		m_add_evpid(p_sched, evpid);
+		m_close(p_sched);
 		return;
 
 	case IMSG_MDA_DELIVERY_TEMPFAIL:
@@ -366,23 +544,24 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_string(&m, &reason);
 		m_get_int(&m, &code);
 		m_end(&m);
+		p_sched = scheduler_peer(evpid_to_msgid(evpid));
 		if (queue_envelope_load(evpid, &evp) == 0) {
 			log_warnx("queue: tempfail: failed to load envelope");
-			m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
-			m_add_evpid(p_scheduler, evpid);
-			m_add_u32(p_scheduler, 1); /* in-flight */
-			m_close(p_scheduler);
+			m_create(p_sched, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
+			m_add_evpid(p_sched, evpid);
+			m_add_u32(p_sched, 1); /* in-flight */
+			m_close(p_sched);
 			return;
 		}
 		envelope_set_errormsg(&evp, "%s", reason);
 		envelope_set_esc_class(&evp, ESC_STATUS_TEMPFAIL);
 		envelope_set_esc_code(&evp, code);
 		evp.retry++;
-		if (!queue_envelope_update(&evp))
+		if (!queue_envelope_retry(&evp))
 			log_warnx("warn: could not update envelope %016"PRIx64, evpid);
-		m_create(p_scheduler, IMSG_QUEUE_DELIVERY_TEMPFAIL, 0, 0, -1);
-		m_add_envelope(p_scheduler, &evp);
-		m_close(p_scheduler);
+		m_create(p_sched, IMSG_QUEUE_DELIVERY_TEMPFAIL, 0, 0, -1);
+		m_add_envelope(p_sched, &evp);
+		m_close(p_sched);
 		return;
 
 	case IMSG_MDA_DELIVERY_PERMFAIL:
@@ -392,12 +571,13 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_string(&m, &reason);
 		m_get_int(&m, &code);
 		m_end(&m);
+		p_sched = scheduler_peer(evpid_to_msgid(evpid));
 		if (queue_envelope_load(evpid, &evp) == 0) {
 			log_warnx("queue: permfail: failed to load envelope");
-			m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
-			m_add_evpid(p_scheduler, evpid);
-			m_add_u32(p_scheduler, 1); /* in-flight */
-			m_close(p_scheduler);
+			m_create(p_sched, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
+			m_add_evpid(p_sched, evpid);
+			m_add_u32(p_sched, 1); /* in-flight */
+			m_close(p_sched);
 			return;
 		}
 		bounce.type = B_FAILED;
@@ -406,9 +586,9 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		envelope_set_esc_code(&evp, code);
 		queue_bounce(&evp, &bounce);
 		queue_envelope_delete(evpid);
-		m_create(p_scheduler, IMSG_QUEUE_DELIVERY_PERMFAIL, 0, 0, -1);
-		m_add_evpid(p_scheduler, evpid);
-		m_close(p_scheduler);
+		m_create(p_sched, IMSG_QUEUE_DELIVERY_PERMFAIL, 0, 0, -1);
+		m_add_evpid(p_sched, evpid);
+		m_close(p_sched);
 		return;
 
 	case IMSG_MDA_DELIVERY_LOOP:
@@ -416,12 +596,13 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_msg(&m, imsg);
 		m_get_evpid(&m, &evpid);
 		m_end(&m);
+		p_sched = scheduler_peer(evpid_to_msgid(evpid));
 		if (queue_envelope_load(evpid, &evp) == 0) {
 			log_warnx("queue: loop: failed to load envelope");
-			m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
-			m_add_evpid(p_scheduler, evpid);
-			m_add_u32(p_scheduler, 1); /* in-flight */
-			m_close(p_scheduler);
+			m_create(p_sched, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
+			m_add_evpid(p_sched, evpid);
+			m_add_u32(p_sched, 1); /* in-flight */
+			m_close(p_sched);
 			return;
 		}
 		envelope_set_errormsg(&evp, "%s", "Loop detected");
@@ -430,20 +611,21 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		bounce.type = B_FAILED;
 		queue_bounce(&evp, &bounce);
 		queue_envelope_delete(evp.id);
-		m_create(p_scheduler, IMSG_QUEUE_DELIVERY_LOOP, 0, 0, -1);
-		m_add_evpid(p_scheduler, evp.id);
-		m_close(p_scheduler);
+		m_create(p_sched, IMSG_QUEUE_DELIVERY_LOOP, 0, 0, -1);
+		m_add_evpid(p_sched, evp.id);
+		m_close(p_sched);
 		return;
 
 	case IMSG_MTA_DELIVERY_HOLD:
 	case IMSG_MDA_DELIVERY_HOLD:
+		m_msg(&m, imsg);
+		m_get_evpid(&m, &evpid);
 		imsg->hdr.type = IMSG_QUEUE_HOLDQ_HOLD;
-		m_forward(p_scheduler, imsg);
+		m_forward(scheduler_peer(evpid_to_msgid(evpid)), imsg);
 		return;
 
 	case IMSG_MTA_SCHEDULE:
-		imsg->hdr.type = IMSG_QUEUE_ENVELOPE_SCHEDULE;
-		m_forward(p_scheduler, imsg);
+		queue_schedule(imsg->data, imsg->hdr.len - IMSG_HEADER_SIZE);
 		return;
 
 	case IMSG_MTA_HOLDQ_RELEASE:
@@ -452,21 +634,63 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_id(&m, &holdq);
 		m_get_int(&m, &v);
 		m_end(&m);
-		m_create(p_scheduler, IMSG_QUEUE_HOLDQ_RELEASE, 0, 0, -1);
-		if (imsg->hdr.type == IMSG_MTA_HOLDQ_RELEASE)
-			m_add_int(p_scheduler, D_MTA);
-		else
-			m_add_int(p_scheduler, D_MDA);
-		m_add_id(p_scheduler, holdq);
-		m_add_int(p_scheduler, v);
-		m_close(p_scheduler);
+		/*
+		 * Each shard holds its own part of the holdq and releases
+		 * up to the count: a shard left with too few held envelopes
+		 * would otherwise stall them.
+		 */
+		for (i = 0; i < (size_t)env->sc_scheduler_shards; i++) {
+			p_sched = p_schedulers[i];
+			m_create(p_sched, IMSG_QUEUE_HOLDQ_RELEASE, 0, 0, -1);
+			if (imsg->hdr.type == IMSG_MTA_HOLDQ_RELEASE)
+				m_add_int(p_sched, D_MTA);
+			else
+				m_add_int(p_sched, D_MDA);
+			m_add_id(p_sched, holdq);
+			m_add_int(p_sched, v);
+			m_close(p_sched);
+		}
 		return;
 
 	case IMSG_CTL_PAUSE_MDA:
 	case IMSG_CTL_PAUSE_MTA:
 	case IMSG_CTL_RESUME_MDA:
 	case IMSG_CTL_RESUME_MTA:
-		m_forward(p_scheduler, imsg);
+		for (i = 0; i < (size_t)env->sc_scheduler_shards; i++)
+			m_forward(p_schedulers[i], imsg);
+		return;
+
+	case IMSG_RELOAD_DRAIN:
+		/* whether the deliveries in progress are waited for */
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		queue_state_open();
+		for (i = 0; i < (size_t)env->sc_scheduler_shards; i++) {
+			m_create(p_schedulers[i], IMSG_RELOAD_DRAIN, 0, 0, -1);
+			m_add_int(p_schedulers[i], v);
+			m_close(p_schedulers[i]);
+		}
+		return;
+
+	case IMSG_RELOAD_STATE:
+		m_msg(&m, imsg);
+		queue_state_write(&m);
+		m_end(&m);
+		return;
+
+	case IMSG_RELOAD_DONE:
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		queue_state_close(v);
+		return;
+
+	case IMSG_RELOAD_TAKEOVER:
+		/* the previous generation is gone, pick up its state */
+		m_msg(&m, imsg);
+		m_end(&m);
+		queue_state_load(-1, 0, NULL);
 		return;
 
 	case IMSG_CTL_VERBOSE:
@@ -483,6 +707,10 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		profiling = v;
 		return;
 
+	case IMSG_CTL_SHOW_PROFILE:
+		profile_show(p, imsg->hdr.peerid);
+		return;
+
 	case IMSG_CTL_DISCOVER_EVPID:
 		m_msg(&m, imsg);
 		m_get_evpid(&m, &evpid);
@@ -497,20 +725,25 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 		}
 
-		m_create(p_scheduler, IMSG_QUEUE_DISCOVER_EVPID,
-		    0, 0, -1);
-		m_add_envelope(p_scheduler, &evp);
-		m_close(p_scheduler);
+		p_sched = scheduler_peer(evpid_to_msgid(evpid));
+		m_create(p_sched, IMSG_QUEUE_DISCOVER_EVPID, 0, 0, -1);
+		m_add_envelope(p_sched, &evp);
+		m_close(p_sched);
 
-		m_create(p_scheduler, IMSG_QUEUE_DISCOVER_MSGID,
-		    0, 0, -1);
-		m_add_msgid(p_scheduler, evpid_to_msgid(evpid));
-		m_close(p_scheduler);
+		m_create(p_sched, IMSG_QUEUE_DISCOVER_MSGID, 0, 0, -1);
+		m_add_msgid(p_sched, evpid_to_msgid(evpid));
+		m_close(p_sched);
 		n_evp = 1;
 		m_compose(p_control, imsg->hdr.type, imsg->hdr.peerid,
 		    0, -1, &n_evp, sizeof n_evp);
 		return;
 
+	case IMSG_CTL_QUEUE_EXPORT:
+	case IMSG_CTL_QUEUE_IMPORT:
+		queue_archive(imsg->hdr.type, imsg->hdr.peerid, imsg->data,
+		    imsg->hdr.len - sizeof(imsg->hdr));
+		return;
+
 	case IMSG_CTL_DISCOVER_MSGID:
 		m_msg(&m, imsg);
 		m_get_msgid(&m, &msgid);
@@ -529,21 +762,157 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 	fatalx("queue_imsg: unexpected %s imsg", imsg_to_str(imsg->hdr.type));
 }
 
+/*
+ * A batch of expanded envelopes from the lka, in the layout of
+ * queue_transfer().  The smtp session gets the ids of the batch in one
+ * reply, zero for an envelope that could not be created.
+ */
+static void
+queue_submit(uint64_t reqid, struct msg *m)
+{
+	struct envelope	 msg, evp;
+	struct mproc	*p_sched, *p_session;
+	const void	*data;
+	size_t		 len;
+	uint64_t	 evpid;
+
+	m_get_data(m, &data, &len);
+	if (data == NULL ||
+	    !envelope_load_binary_fields(&msg, data, len, NULL, 0))
+		fatalx("queue: failed to load message fields");
+
+	p_session = smtp_peer(reqid);
+	m_create(p_session, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
+	m_add_id(p_session, reqid);
+	while (!m_is_eom(m)) {
+		m_get_evpid(m, &evpid);
+		m_get_data(m, &data, &len);
+		evp = msg;
+		if (data == NULL ||
+		    !envelope_load_binary_fields(&evp, NULL, 0, data, len))
+			fatalx("queue: failed to load envelope");
+		evp.id = evpid;
+
+		if (evpid_to_msgid(evp.id) == 0)
+			log_warnx("warn: imsg_queue_submit_envelope: msgid=0, "
+			    "evpid=%016"PRIx64, evp.id);
+		if (!queue_envelope_create(&evp)) {
+			m_add_evpid(p_session, 0);
+			continue;
+		}
+		m_add_evpid(p_session, evp.id);
+
+		p_sched = scheduler_peer(evpid_to_msgid(evp.id));
+		m_create(p_sched, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
+		m_add_envelope(p_sched, &evp);
+		m_close(p_sched);
+	}
+	m_close(p_session);
+}
+
+/*
+ * The envelopes of a message are sent to the mta together: the
+ * message-level fields once, then the recipient-level fields and id of
+ * each envelope.  The scheduler batches envelopes by message, so this
+ * is one imsg per message in most cases, or one per mta worker when
+ * the recipients are on relays owned by different workers.
+ */
+static void
+queue_transfer(struct msg *m)
+{
+	struct envelope	 evp;
+	struct mproc	*p_sched, *p_out = NULL, *p;
+	char		 msgbuf[sizeof(evp)], rcptbuf[sizeof(evp)];
+	size_t		 msglen, rcptlen;
+	uint64_t	 evpid;
+	uint32_t	 msgid = 0;
+
+	while (!m_is_eom(m)) {
+		m_get_evpid(m, &evpid);
+		if (queue_envelope_load(evpid, &evp) == 0) {
+			log_warnx("queue: failed to load envelope");
+			p_sched = scheduler_peer(evpid_to_msgid(evpid));
+			m_create(p_sched, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
+			m_add_evpid(p_sched, evpid);
+			m_add_u32(p_sched, 1); /* in-flight */
+			m_close(p_sched);
+			continue;
+		}
+		evp.lasttry = time(NULL);
+
+		if (!envelope_dump_binary_fields(&evp,
+		    ENVELOPE_FIELDS_RECIPIENT, rcptbuf, sizeof rcptbuf,
+		    &rcptlen))
+			fatalx("queue: failed to dump envelope");
+
+		p = mta_peer(&evp);
+		if (p_out && (evpid_to_msgid(evpid) != msgid || p != p_out ||
+		    p_out->m_pos + sizeof(evpid) + sizeof(rcptlen) +
+		    rcptlen > MAX_IMSGSIZE)) {
+			m_close(p_out);
+			p_out = NULL;
+		}
+		if (p_out == NULL) {
+			if (!envelope_dump_binary_fields(&evp,
+			    ENVELOPE_FIELDS_MESSAGE, msgbuf, sizeof msgbuf,
+			    &msglen))
+				fatalx("queue: failed to dump envelope");
+			p_out = p;
+			m_create(p_out, IMSG_QUEUE_TRANSFER, 0, 0, -1);
+			m_add_data(p_out, msgbuf, msglen);
+			msgid = evpid_to_msgid(evpid);
+		}
+		m_add_evpid(p_out, evpid);
+		m_add_data(p_out, rcptbuf, rcptlen);
+	}
+	if (p_out)
+		m_close(p_out);
+}
+
+/*
+ * The mta batches the envelope ids to schedule again, whatever their
+ * message: hand each shard its own.
+ */
+static void
+queue_schedule(const uint64_t *ids, size_t len)
+{
+	uint64_t	 evpids[MAX_IMSGSIZE / sizeof(uint64_t)];
+	size_t		 i, n, nids;
+	int		 shard;
+
+	if (len % sizeof(*ids))
+		fatalx("queue: bad schedule message size");
+	nids = len / sizeof(*ids);
+
+	for (shard = 0; shard < env->sc_scheduler_shards; shard++) {
+		for (i = 0, n = 0; i < nids; i++) {
+			if (scheduler_peer(evpid_to_msgid(ids[i])) ==
+			    p_schedulers[shard])
+				evpids[n++] = ids[i];
+		}
+		if (n)
+			m_compose(p_schedulers[shard],
+			    IMSG_QUEUE_ENVELOPE_SCHEDULE, 0, 0, -1,
+			    evpids, n * sizeof(*evpids));
+	}
+}
+
 static void
 queue_msgid_walk(int fd, short event, void *arg)
 {
 	struct envelope		 evp;
 	struct timeval		 tv;
 	struct msg_walkinfo	*wi = arg;
+	struct mproc		*p_sched;
 	int			 r;
 
+	p_sched = scheduler_peer(wi->msgid);
 	r = queue_message_walk(&evp, wi->msgid, &wi->done, &wi->data);
 	if (r == -1) {
 		if (wi->n_evp) {
-			m_create(p_scheduler, IMSG_QUEUE_DISCOVER_MSGID,
-			    0, 0, -1);
-			m_add_msgid(p_scheduler, wi->msgid);
-			m_close(p_scheduler);
+			m_create(p_sched, IMSG_QUEUE_DISCOVER_MSGID, 0, 0, -1);
+			m_add_msgid(p_sched, wi->msgid);
+			m_close(p_sched);
 		}
 
 		m_compose(p_control, IMSG_CTL_DISCOVER_MSGID, wi->peerid, 0, -1,
@@ -554,9 +923,9 @@ queue_msgid_walk(int fd, short event, void *arg)
 	}
 
 	if (r) {
-		m_create(p_scheduler, IMSG_QUEUE_DISCOVER_EVPID, 0, 0, -1);
-		m_add_envelope(p_scheduler, &evp);
-		m_close(p_scheduler);
+		m_create(p_sched, IMSG_QUEUE_DISCOVER_EVPID, 0, 0, -1);
+		m_add_envelope(p_sched, &evp);
+		m_close(p_sched);
 		wi->n_evp += 1;
 	}
 
@@ -569,7 +938,8 @@ queue_msgid_walk(int fd, short event, void *arg)
 static void
 queue_bounce(struct envelope *e, struct delivery_bounce *d)
 {
-	struct envelope	b;
+	struct envelope	 b;
+	struct mproc	*p_sched;
 
 	b = *e;
 	b.type = D_BOUNCE;
@@ -597,18 +967,345 @@ queue_bounce(struct envelope *e, struct delivery_bounce *d)
 		log_debug("debug: queue: bouncing evp:%016" PRIx64
 		    " as evp:%016" PRIx64, e->id, b.id);
 
-		m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
-		m_add_envelope(p_scheduler, &b);
-		m_close(p_scheduler);
+		p_sched = scheduler_peer(evpid_to_msgid(b.id));
+		m_create(p_sched, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
+		m_add_envelope(p_sched, &b);
+		m_close(p_sched);
 
-		m_create(p_scheduler, IMSG_QUEUE_MESSAGE_COMMIT, 0, 0, -1);
-		m_add_msgid(p_scheduler, evpid_to_msgid(b.id));
-		m_close(p_scheduler);
+		m_create(p_sched, IMSG_QUEUE_MESSAGE_COMMIT, 0, 0, -1);
+		m_add_msgid(p_sched, evpid_to_msgid(b.id));
+		m_close(p_sched);
 
 		stat_increment("queue.bounce", 1);
 	}
 }
 
+static void
+queue_memory(enum memory_level level)
+{
+	if (level >= MEMORY_SHRINK)
+		queue_envelope_cache_shrink();
+}
+
+static void
+queue_pressure_commit(const struct timespec *t0)
+{
+	struct timespec	 t1, dt;
+	int64_t		 usecs;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	timespecsub(&t1, t0, &dt);
+	usecs = (int64_t)dt.tv_sec * 1000000 + dt.tv_nsec / 1000;
+
+	pressure.latency += (usecs - pressure.latency) / 8;
+	pressure.committed++;
+	if (pressure.inflight)
+		pressure.inflight--;
+	queue_pressure_update(0);
+}
+
+/*
+ * Going up is immediate, going down waits for the tick so that a single
+ * fast commit does not reopen the gates.
+ */
+static void
+queue_pressure_update(int tick)
+{
+	enum queue_pressure	 level;
+	enum queue_space	 space;
+	struct mproc		*p;
+	size_t			 backlog;
+	int			 i;
+
+	backlog = 0;
+	for (i = 0; i < env->sc_scheduler_shards; i++)
+		backlog += p_schedulers[i]->imsgbuf.w.queued;
+	space = queue_space();
+
+	if (space == QUEUE_SPACE_FULL ||
+	    pressure.latency >= QUEUE_LATENCY_FULL ||
+	    pressure.inflight >= QUEUE_INFLIGHT_FULL ||
+	    backlog >= QUEUE_BACKLOG_FULL)
+		level = QUEUE_PRESSURE_FULL;
+	else if (space == QUEUE_SPACE_LOW ||
+	    pressure.latency >= QUEUE_LATENCY_BUSY ||
+	    pressure.inflight >= QUEUE_INFLIGHT_BUSY ||
+	    backlog >= QUEUE_BACKLOG_BUSY)
+		level = QUEUE_PRESSURE_BUSY;
+	else
+		level = QUEUE_PRESSURE_NONE;
+
+	if (level == pressure.level || (level < pressure.level && !tick))
+		return;
+
+	if (level > pressure.level)
+		log_warnx("warn: queue: pressure %s: latency=%lldms "
+		    "inflight=%zu backlog=%zu space=%s",
+		    queue_pressure_name[level],
+		    (long long)pressure.latency / 1000, pressure.inflight,
+		    backlog, space == QUEUE_SPACE_OK ? "ok" :
+		    space == QUEUE_SPACE_LOW ? "low" : "full");
+	else
+		log_info("info: queue: pressure %s",
+		    queue_pressure_name[level]);
+	pressure.level = level;
+
+	for (i = 0; i < smtp_peer_count(); i++) {
+		p = smtp_peer_at(i);
+		m_create(p, IMSG_QUEUE_PRESSURE, 0, 0, -1);
+		m_add_int(p, level);
+		m_close(p);
+	}
+}
+
+static void
+queue_pressure_timeout(int fd, short event, void *p)
+{
+	struct timeval	 tv;
+
+	if (pressure.committed == 0)
+		pressure.latency /= 2;
+	pressure.committed = 0;
+	queue_pressure_update(1);
+
+	stat_set("queue.pressure.level", stat_counter(pressure.level));
+	stat_set("queue.pressure.latency",
+	    stat_counter(pressure.latency / 1000));
+	stat_set("queue.pressure.inflight", stat_counter(pressure.inflight));
+
+	tv.tv_sec = QUEUE_PRESSURE_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&pressure.ev, &tv);
+}
+
+static void
+queue_commit(struct mproc *p, uint64_t reqid, uint32_t msgid,
+    const struct timespec *t0)
+{
+	struct queue_worker	*w;
+	struct queue_commit	*c;
+	uint64_t		 id;
+	int			 i;
+
+	w = &workers[0];
+	for (i = 1; i < nworkers; i++)
+		if (workers[i].pending < w->pending)
+			w = &workers[i];
+
+	c = xcalloc(1, sizeof(*c));
+	c->p = p;
+	c->reqid = reqid;
+	c->msgid = msgid;
+	c->t0 = *t0;
+
+	id = generate_uid();
+	tree_xset(&commits, id, c);
+	w->pending++;
+
+	m_create(&w->p, IMSG_QUEUE_MESSAGE_TRANSFORM, 0, 0, -1);
+	m_add_id(&w->p, id);
+	m_add_msgid(&w->p, msgid);
+	m_close(&w->p);
+}
+
+static void
+queue_commit_done(struct mproc *p, uint64_t reqid, uint32_t msgid, int ret,
+    const struct timespec *t0)
+{
+	struct mproc	*p_sched;
+
+	queue_pressure_commit(t0);
+
+	m_create(p, IMSG_SMTP_MESSAGE_COMMIT, 0, 0, -1);
+	m_add_id(p, reqid);
+	m_add_int(p, (ret == 0) ? 0 : 1);
+	m_close(p);
+
+	if (ret) {
+		p_sched = scheduler_peer(msgid);
+		m_create(p_sched, IMSG_QUEUE_MESSAGE_COMMIT, 0, 0, -1);
+		m_add_msgid(p_sched, msgid);
+		m_close(p_sched);
+	}
+}
+
+/*
+ * With io_uring, the message content is flushed to disk before the
+ * commit, without holding the queue while the disk works.
+ */
+static int
+queue_commit_sync(struct mproc *p, uint64_t reqid, uint32_t msgid,
+    const struct timespec *t0)
+{
+	struct queue_commit	*c;
+	int			 fd;
+
+	if (!uring_enabled())
+		return (0);
+
+	if ((fd = queue_message_fd_sync(msgid)) == -1)
+		return (0);
+
+	c = xcalloc(1, sizeof(*c));
+	c->p = p;
+	c->reqid = reqid;
+	c->msgid = msgid;
+	c->t0 = *t0;
+	c->fd = fd;
+
+	if (!uring_fsync(fd, queue_commit_synced, c)) {
+		close(fd);
+		free(c);
+		return (0);
+	}
+	return (1);
+}
+
+static void
+queue_commit_synced(void *arg, int res)
+{
+	struct queue_commit	*c = arg;
+	int			 ret = 0;
+
+	close(c->fd);
+	if (res < 0) {
+		errno = -res;
+		log_warn("warn: queue: fsync");
+	} else
+		ret = queue_message_commit_transformed(c->msgid);
+
+	queue_commit_done(c->p, c->reqid, c->msgid, ret, &c->t0);
+	free(c);
+}
+
+static void
+queue_worker_init(void)
+{
+	struct queue_worker	*w;
+	int			 i, sp[2];
+
+	if ((env->sc_queue_flags & (QUEUE_COMPRESSION|QUEUE_ENCRYPTION)) == 0)
+		return;
+
+	tree_init(&commits);
+
+	for (i = 0; i < QUEUE_WORKERS; i++) {
+		w = &workers[i];
+		if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) == -1)
+			fatal("queue_worker_init: socketpair");
+
+		if ((w->p.pid = fork()) == -1)
+			fatal("queue_worker_init: fork");
+
+		if (w->p.pid == 0) {
+			close(sp[0]);
+			queue_worker(sp[1]);
+		}
+
+		close(sp[1]);
+		io_set_nonblocking(sp[0]);
+		w->p.proc = PROC_QUEUE;
+		w->p.name = "worker";
+		w->p.handler = queue_worker_imsg;
+		w->p.data = w;
+		mproc_init(&w->p, sp[0]);
+		mproc_enable(&w->p);
+	}
+	nworkers = QUEUE_WORKERS;
+}
+
+static void
+queue_worker(int fd)
+{
+	struct mproc	 p;
+	struct imsg	 imsg;
+	struct msg	 m;
+	uint64_t	 id;
+	uint32_t	 msgid;
+	ssize_t		 n;
+	int		 ret;
+
+	if (dup2(fd, STDERR_FILENO + 1) == -1)
+		fatal("queue_worker: dup2");
+	closefrom(STDERR_FILENO + 2);
+
+	setproctitle("%s worker", proc_title(PROC_QUEUE));
+
+#if HAVE_PLEDGE
+	if (pledge("stdio rpath wpath cpath", NULL) == -1)
+		fatal("pledge");
+#endif
+
+	memset(&p, 0, sizeof(p));
+	p.proc = PROC_QUEUE;
+	p.name = "worker";
+	mproc_init(&p, STDERR_FILENO + 1);
+
+	for (;;) {
+		if ((n = imsg_read(&p.imsgbuf)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fatal("queue_worker: imsg_read");
+		}
+		if (n == 0)
+			_exit(0);
+
+		for (;;) {
+			if ((n = imsg_get(&p.imsgbuf, &imsg)) == -1)
+				fatal("queue_worker: imsg_get");
+			if (n == 0)
+				break;
+
+			m_msg(&m, &imsg);
+			m_get_id(&m, &id);
+			m_get_msgid(&m, &msgid);
+			m_end(&m);
+			imsg_free(&imsg);
+
+			ret = queue_message_transform(msgid);
+
+			m_create(&p, IMSG_QUEUE_MESSAGE_TRANSFORM, 0, 0, -1);
+			m_add_id(&p, id);
+			m_add_int(&p, ret);
+			m_flush(&p);
+		}
+	}
+}
+
+static void
+queue_worker_imsg(struct mproc *p, struct imsg *imsg)
+{
+	struct queue_worker	*w = p->data;
+	struct queue_commit	*c;
+	struct msg		 m;
+	uint64_t		 id;
+	int			 ret;
+
+	if (imsg == NULL)
+		fatalx("queue: worker exited");
+
+	if (imsg->hdr.type != IMSG_QUEUE_MESSAGE_TRANSFORM)
+		fatalx("queue_worker_imsg: unexpected %s imsg",
+		    imsg_to_str(imsg->hdr.type));
+
+	m_msg(&m, imsg);
+	m_get_id(&m, &id);
+	m_get_int(&m, &ret);
+	m_end(&m);
+
+	c = tree_xpop(&commits, id);
+	w->pending--;
+
+	if (ret && queue_commit_sync(c->p, c->reqid, c->msgid, &c->t0)) {
+		free(c);
+		return;
+	}
+	if (ret)
+		ret = queue_message_commit_transformed(c->msgid);
+	queue_commit_done(c->p, c->reqid, c->msgid, ret, &c->t0);
+	free(c);
+}
+
 static void
 queue_shutdown(void)
 {
@@ -622,7 +1319,6 @@ queue(void)
 {
 	struct passwd	*pw;
 	struct timeval	 tv;
-	struct event	 ev_qload;
 
 	purge_config(PURGE_EVERYTHING & ~PURGE_DISPATCHERS);
 
@@ -630,8 +1326,8 @@ queue(void)
 		if ((pw = getpwnam(SMTPD_USER)) == NULL)
 			fatalx("unknown user " SMTPD_USER);
 
-	env->sc_queue_flags |= QUEUE_EVPCACHE;
-	env->sc_queue_evpcache_size = 1024;
+	if (env->sc_queue_evpcache_size)
+		env->sc_queue_flags |= QUEUE_EVPCACHE;
 
 	if (chroot(PATH_SPOOL) == -1)
 		fatal("queue: chroot");
@@ -667,12 +1363,28 @@ queue(void)
 	config_peer(PROC_LKA);
 	config_peer(PROC_SCHEDULER);
 	config_peer(PROC_DISPATCHER);
-
-	/* setup queue loading task */
+	config_peer(PROC_MTA);
+	config_peer(PROC_SMTP);
+	config_peer(PROC_LOGGER);
+	stat_cpu_start(NULL);
+	memory_start(NULL, queue_memory);
+	queue_worker_init();
+	uring_init();
+
+	evtimer_set(&pressure.ev, queue_pressure_timeout, NULL);
+	queue_pressure_timeout(-1, 0, NULL);
+
+	/*
+	 * Setup queue loading task.  On a reload the schedulers get the
+	 * state of the previous generation once it has drained instead,
+	 * and on a start the state saved at the last stop if any.
+	 */
 	evtimer_set(&ev_qload, queue_timeout, &ev_qload);
+	evtimer_set(&reload.ev, queue_state_load, NULL);
 	tv.tv_sec = 0;
 	tv.tv_usec = 10;
-	evtimer_add(&ev_qload, &tv);
+	if (!(env->sc_opts & SMTPD_OPT_TAKEOVER))
+		evtimer_add(&reload.ev, &tv);
 
 #if HAVE_PLEDGE
 	if (pledge("stdio rpath wpath cpath flock recvfd sendfd", NULL) == -1)
@@ -692,36 +1404,269 @@ queue_timeout(int fd, short event, void *p)
 	struct envelope	 evp;
 	struct event	*ev = p;
 	struct timeval	 tv;
-	int		 r;
+	struct mproc	*p_sched;
+	int		 i, n, r;
+
+	/*
+	 * Load the envelopes by batches, but let the schedulers catch up
+	 * when too many submissions are still waiting to be written.
+	 */
+	for (n = 0; n < QUEUE_LOAD_BATCH; n++) {
+		for (i = 0; i < env->sc_scheduler_shards; i++)
+			if (p_schedulers[i]->imsgbuf.w.queued >=
+			    QUEUE_LOAD_MAXQUEUED)
+				break;
+		if (i < env->sc_scheduler_shards)
+			break;
+
+		r = queue_envelope_walk(&evp);
+		if (r == -1) {
+			if (msgid) {
+				p_sched = scheduler_peer(msgid);
+				m_create(p_sched, qload_discover ?
+				    IMSG_QUEUE_DISCOVER_MSGID :
+				    IMSG_QUEUE_MESSAGE_COMMIT, 0, 0, -1);
+				m_add_msgid(p_sched, msgid);
+				m_close(p_sched);
+			}
+			log_debug("debug: queue: done loading queue into "
+			    "scheduler");
+			return;
+		}
 
-	r = queue_envelope_walk(&evp);
-	if (r == -1) {
-		if (msgid) {
-			m_create(p_scheduler, IMSG_QUEUE_MESSAGE_COMMIT,
-			    0, 0, -1);
-			m_add_msgid(p_scheduler, msgid);
-			m_close(p_scheduler);
+		if (r) {
+			if (msgid && evpid_to_msgid(evp.id) != msgid) {
+				p_sched = scheduler_peer(msgid);
+				m_create(p_sched, qload_discover ?
+				    IMSG_QUEUE_DISCOVER_MSGID :
+				    IMSG_QUEUE_MESSAGE_COMMIT, 0, 0, -1);
+				m_add_msgid(p_sched, msgid);
+				m_close(p_sched);
+			}
+			msgid = evpid_to_msgid(evp.id);
+			p_sched = scheduler_peer(msgid);
+			m_create(p_sched, qload_discover ?
+			    IMSG_QUEUE_DISCOVER_EVPID :
+			    IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
+			m_add_envelope(p_sched, &evp);
+			m_close(p_sched);
 		}
-		log_debug("debug: queue: done loading queue into scheduler");
+	}
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 10;
+	evtimer_add(ev, &tv);
+}
+
+/*
+ * On reload, the schedulers of the old generation write their pending
+ * envelopes to a state file in the spool, which the new generation
+ * reads back once the old one has exited.  A stop writes it too, for
+ * the next start.  Each record is the raw scheduler info followed by
+ * the length and name of the domain, then the holdq the envelope was
+ * held on, or 0.
+ *
+ * No message is accepted once the state is being written.  A shard
+ * that commits one after its dump reports the state incomplete, even
+ * late, and the file is dropped: envelopes that vanish later are only
+ * found missing when scheduled, but a missing one would never be.
+ */
+static void
+queue_state_open(void)
+{
+	uint32_t	hdr[2];
+
+	reload.pending = env->sc_scheduler_shards;
+	reload.ok = 1;
+	reload.draining = 1;
+	reload.fp = fopen(QUEUE_STATE_PATH ".tmp", "w");
+	if (reload.fp == NULL) {
+		log_warn("warn: queue: %s", QUEUE_STATE_PATH ".tmp");
+		reload.ok = 0;
 		return;
 	}
+	hdr[0] = QUEUE_STATE_MAGIC;
+	hdr[1] = sizeof(struct scheduler_info);
+	if (fwrite(hdr, sizeof hdr, 1, reload.fp) != 1)
+		reload.ok = 0;
+}
 
-	if (r) {
-		if (msgid && evpid_to_msgid(evp.id) != msgid) {
-			m_create(p_scheduler, IMSG_QUEUE_MESSAGE_COMMIT,
-			    0, 0, -1);
-			m_add_msgid(p_scheduler, msgid);
-			m_close(p_scheduler);
-		}
-		msgid = evpid_to_msgid(evp.id);
-		m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
-		m_add_envelope(p_scheduler, &evp);
-		m_close(p_scheduler);
+static void
+queue_state_write(struct msg *m)
+{
+	const void	*data;
+	const char	*domain;
+	uint64_t	 holdq;
+	size_t		 sz;
+	uint16_t	 len;
+
+	while (!m_is_eom(m)) {
+		m_get_data(m, &data, &sz);
+		m_get_string(m, &domain);
+		m_get_id(m, &holdq);
+		if (reload.fp == NULL || !reload.ok)
+			continue;
+		len = strlen(domain);
+		if (fwrite(data, sz, 1, reload.fp) != 1 ||
+		    fwrite(&len, sizeof len, 1, reload.fp) != 1 ||
+		    fwrite(domain, len, 1, reload.fp) != 1 ||
+		    fwrite(&holdq, sizeof holdq, 1, reload.fp) != 1)
+			reload.ok = 0;
+	}
+}
+
+static void
+queue_state_close(int ok)
+{
+	if (reload.pending == 0) {
+		if (!ok && reload.ok) {
+			log_warnx("warn: queue: scheduler state outdated, "
+			    "the queue will be rescanned");
+			unlink(QUEUE_STATE_PATH);
+			reload.ok = 0;
+		}
+		return;
+	}
+
+	if (!ok)
+		reload.ok = 0;
+	if (--reload.pending)
+		return;
+
+	if (reload.fp) {
+		if (fclose(reload.fp) != 0)
+			reload.ok = 0;
+		reload.fp = NULL;
+		if (reload.ok &&
+		    rename(QUEUE_STATE_PATH ".tmp", QUEUE_STATE_PATH) == -1) {
+			log_warn("warn: queue: rename: %s", QUEUE_STATE_PATH);
+			reload.ok = 0;
+		}
+		if (!reload.ok)
+			unlink(QUEUE_STATE_PATH ".tmp");
+	}
+	if (!reload.ok)
+		log_warnx("warn: queue: scheduler state not saved, "
+		    "the queue will be rescanned");
+
+	m_compose(p_parent, IMSG_RELOAD_DONE, 0, 0, -1, NULL, 0);
+}
+
+static void
+queue_state_load(int fd, short event, void *p)
+{
+	static size_t		 total;
+	struct scheduler_info	 si;
+	struct timeval		 tv;
+	struct mproc		*p_sched;
+	uint32_t		 hdr[2], msgid;
+	uint64_t		 holdq;
+	uint16_t		 len;
+	char			 domain[SMTPD_MAXDOMAINPARTSIZE];
+	int			 i, n, inmsg[SCHEDULER_SHARDS_MAX];
+
+	if (reload.fp == NULL) {
+		reload.fp = fopen(QUEUE_STATE_PATH, "r");
+		if (reload.fp == NULL &&
+		    !(env->sc_opts & SMTPD_OPT_TAKEOVER)) {
+			log_debug("debug: queue: no scheduler state saved, "
+			    "loading the queue");
+			tv.tv_sec = 0;
+			tv.tv_usec = 10;
+			evtimer_add(&ev_qload, &tv);
+			return;
+		}
+		/* never read twice, what follows would be missing */
+		unlink(QUEUE_STATE_PATH);
+		if (reload.fp == NULL ||
+		    fread(hdr, sizeof hdr, 1, reload.fp) != 1 ||
+		    hdr[0] != QUEUE_STATE_MAGIC ||
+		    hdr[1] != sizeof(struct scheduler_info)) {
+			log_warnx("warn: queue: no usable scheduler state, "
+			    "rescanning the queue");
+			goto rescan;
+		}
+	}
+
+	memset(inmsg, 0, sizeof inmsg);
+	for (n = 0; n < QUEUE_LOAD_BATCH; n++) {
+		for (i = 0; i < env->sc_scheduler_shards; i++)
+			if (p_schedulers[i]->imsgbuf.w.queued >=
+			    QUEUE_LOAD_MAXQUEUED)
+				break;
+		if (i < env->sc_scheduler_shards)
+			break;
+
+		if (fread(&si, sizeof si, 1, reload.fp) != 1) {
+			if (!feof(reload.fp))
+				goto bad;
+			for (i = 0; i < env->sc_scheduler_shards; i++) {
+				if (inmsg[i])
+					m_close(p_schedulers[i]);
+				m_compose(p_schedulers[i], IMSG_RELOAD_DONE,
+				    0, 0, -1, NULL, 0);
+			}
+			fclose(reload.fp);
+			reload.fp = NULL;
+			log_info("info: queue: %zu envelopes taken over from "
+			    "the %s", total, env->sc_opts & SMTPD_OPT_TAKEOVER ?
+			    "previous generation" : "saved scheduler state");
+			return;
+		}
+		if (fread(&len, sizeof len, 1, reload.fp) != 1 ||
+		    len >= sizeof domain ||
+		    fread(domain, len, 1, reload.fp) != 1 ||
+		    fread(&holdq, sizeof holdq, 1, reload.fp) != 1)
+			goto bad;
+		domain[len] = '\0';
+
+		msgid = evpid_to_msgid(si.evpid);
+		i = msgid % env->sc_scheduler_shards;
+		p_sched = p_schedulers[i];
+		if (inmsg[i] && p_sched->m_pos + IMSG_HEADER_SIZE +
+		    sizeof(size_t) + sizeof si + len + 2 + sizeof holdq >
+		    MAX_IMSGSIZE) {
+			m_close(p_sched);
+			inmsg[i] = 0;
+		}
+		if (!inmsg[i]) {
+			m_create(p_sched, IMSG_RELOAD_STATE, 0, 0, -1);
+			inmsg[i] = 1;
+		}
+		m_add_data(p_sched, &si, sizeof si);
+		m_add_string(p_sched, domain);
+		m_add_id(p_sched, holdq);
+		total++;
 	}
 
+	for (i = 0; i < env->sc_scheduler_shards; i++)
+		if (inmsg[i])
+			m_close(p_schedulers[i]);
+
 	tv.tv_sec = 0;
 	tv.tv_usec = 10;
-	evtimer_add(ev, &tv);
+	evtimer_add(&reload.ev, &tv);
+	return;
+
+bad:
+	log_warnx("warn: queue: corrupted scheduler state, "
+	    "rescanning the queue");
+	for (i = 0; i < env->sc_scheduler_shards; i++) {
+		if (inmsg[i])
+			m_close(p_schedulers[i]);
+		m_compose(p_schedulers[i], IMSG_RELOAD_DONE, 0, 0, -1,
+		    NULL, 0);
+	}
+
+rescan:
+	if (reload.fp) {
+		fclose(reload.fp);
+		reload.fp = NULL;
+	}
+	qload_discover = 1;
+	tv.tv_sec = 0;
+	tv.tv_usec = 10;
+	evtimer_add(&ev_qload, &tv);
 }
 
 static void
@@ -745,3 +1690,186 @@ queue_log(const struct envelope *e, const char *prefix, const char *status)
 	    duration_to_text(time(NULL) - e->creation),
 	    status);
 }
+
+/*
+ * Check the envelopes the scheduler selected for a listing page and
+ * send back those matching, up to the filter limit.  The reply ends
+ * with the cursor for the next page.
+ */
+static void
+queue_list(uint32_t peerid, const struct queue_filter *f, uint64_t next,
+    const void *data, size_t n)
+{
+	struct evpstate		 state;
+	struct envelope		 evp;
+	struct dict		 counts;
+	struct queue_count	*c;
+	const char		*domain;
+	char			 line[LINE_MAX];
+	void			*iter;
+	size_t			 i, found = 0;
+
+	dict_init(&counts);
+
+	for (i = 0; i < n; i++) {
+		memcpy(&state, (const char *)data + i * sizeof state,
+		    sizeof state);
+
+		/* resume right here on the next page */
+		if (f->limit && found == f->limit) {
+			next = state.evpid;
+			break;
+		}
+
+		if (queue_envelope_load(state.evpid, &evp) == 0)
+			continue;
+		if (!queue_list_match(f, &evp))
+			continue;
+		found++;
+
+		if (f->summary) {
+			if ((c = dict_get(&counts, evp.dest.domain)) == NULL) {
+				c = xcalloc(1, sizeof *c);
+				dict_set(&counts, evp.dest.domain, c);
+			}
+			c->total++;
+			if (state.flags & EF_SUSPEND)
+				c->suspended++;
+			if (state.flags & EF_INFLIGHT)
+				c->inflight++;
+			else if (state.flags & EF_HOLD)
+				c->held++;
+			else if (state.flags & EF_PENDING)
+				c->pending++;
+			continue;
+		}
+
+		if (f->fields) {
+			queue_list_line(&evp, &state, f->fields, line,
+			    sizeof line);
+			m_create(p_control, IMSG_CTL_LIST_QUEUE, peerid, 0, -1);
+			m_add_int(p_control, QUEUE_LIST_LINE);
+			m_add_string(p_control, line);
+			m_close(p_control);
+			continue;
+		}
+
+		/* see IMSG_CTL_LIST_ENVELOPES */
+		if (state.flags & EF_INFLIGHT)
+			evp.lasttry = state.time;
+		m_create(p_control, IMSG_CTL_LIST_QUEUE, peerid, 0, -1);
+		m_add_int(p_control, QUEUE_LIST_ENVELOPE);
+		m_add_int(p_control, state.flags);
+		m_add_time(p_control, state.time);
+		m_add_envelope(p_control, &evp);
+		m_close(p_control);
+	}
+
+	iter = NULL;
+	while (dict_iter(&counts, &iter, &domain, (void **)&c)) {
+		m_create(p_control, IMSG_CTL_LIST_QUEUE, peerid, 0, -1);
+		m_add_int(p_control, QUEUE_LIST_COUNT);
+		m_add_string(p_control, domain);
+		m_add_data(p_control, c, sizeof *c);
+		m_close(p_control);
+	}
+	while (dict_poproot(&counts, (void **)&c))
+		free(c);
+
+	m_create(p_control, IMSG_CTL_LIST_QUEUE, peerid, 0, -1);
+	m_add_int(p_control, QUEUE_LIST_END);
+	m_add_evpid(p_control, next);
+	m_add_size(p_control, found);
+	m_close(p_control);
+}
+
+static int
+queue_list_match(const struct queue_filter *f, const struct envelope *evp)
+{
+	const char	*at;
+	size_t		 len;
+
+	if (f->type != -1 && (int)evp->type != f->type)
+		return (0);
+	if (f->age && time(NULL) - evp->creation < f->age)
+		return (0);
+	if (f->domain[0] && strcasecmp(f->domain, evp->rcpt.domain) &&
+	    strcasecmp(f->domain, evp->dest.domain))
+		return (0);
+	if (f->sender[0]) {
+		if ((at = strrchr(f->sender, '@')) == NULL) {
+			if (strcasecmp(f->sender, evp->sender.domain))
+				return (0);
+		} else {
+			/* compare the parts, the address may not fit a buffer */
+			len = at - f->sender;
+			if (strlen(evp->sender.user) != len ||
+			    strncasecmp(f->sender, evp->sender.user, len) ||
+			    strcasecmp(at + 1, evp->sender.domain))
+				return (0);
+		}
+	}
+	if (f->tag[0] && strcmp(f->tag, evp->tag))
+		return (0);
+	if (f->error[0] && strstr(evp->errorline, f->error) == NULL)
+		return (0);
+
+	return (1);
+}
+
+/* the projection of an envelope on the requested fields, "|" separated */
+static void
+queue_list_line(const struct envelope *evp, const struct evpstate *state,
+    uint32_t fields, char *buf, size_t len)
+{
+	const char	*type = "?", *runstate;
+	char		 tmp[LINE_MAX];
+
+	buf[0] = '\0';
+
+	if (evp->type == D_MDA)
+		type = "mda";
+	else if (evp->type == D_MTA)
+		type = "mta";
+	else if (evp->type == D_BOUNCE)
+		type = "bounce";
+
+	if (state->flags & EF_INFLIGHT)
+		runstate = "inflight";
+	else if (state->flags & EF_SUSPEND)
+		runstate = "suspended";
+	else if (state->flags & EF_HOLD)
+		runstate = "held";
+	else
+		runstate = "pending";
+
+#define	FIELD(f, ...) do {						\
+	if (fields & (f)) {						\
+		(void)snprintf(tmp, sizeof tmp, __VA_ARGS__);		\
+		if (buf[0])						\
+			(void)strlcat(buf, "|", len);			\
+		(void)strlcat(buf, tmp, len);				\
+	}								\
+} while (0)
+
+	FIELD(QUEUE_FIELD_ID, "%016"PRIx64, evp->id);
+	FIELD(QUEUE_FIELD_TYPE, "%s", type);
+	FIELD(QUEUE_FIELD_SENDER, "%s@%s", evp->sender.user,
+	    evp->sender.domain);
+	FIELD(QUEUE_FIELD_RCPT, "%s@%s", evp->rcpt.user, evp->rcpt.domain);
+	FIELD(QUEUE_FIELD_DEST, "%s@%s", evp->dest.user, evp->dest.domain);
+	FIELD(QUEUE_FIELD_CTIME, "%lld", (long long)evp->creation);
+	FIELD(QUEUE_FIELD_EXPIRE, "%lld",
+	    (long long)(evp->creation + evp->ttl));
+	FIELD(QUEUE_FIELD_LASTTRY, "%lld", (long long)evp->lasttry);
+	FIELD(QUEUE_FIELD_RETRY, "%d", (int)evp->retry);
+	FIELD(QUEUE_FIELD_STATE, "%s", runstate);
+#undef FIELD
+
+	if (fields & QUEUE_FIELD_ERROR) {
+		strnvis(tmp, evp->errorline, sizeof tmp, 0);
+		if (buf[0])
+			(void)strlcat(buf, "|", len);
+		(void)strlcat(buf, tmp, len);
+	}
+}
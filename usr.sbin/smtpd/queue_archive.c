@@ -0,0 +1,595 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Queue archives, to move a queue to another host or another backend.
+ *
+ * An archive is a header line, then for each message the records of
+ * its envelopes followed by the message itself, and an end line:
+ *
+ *	OpenSMTPD queue archive 1
+ *	envelope <len>		the envelope in text form
+ *	...
+ *	message <len>		the decoded message
+ *	...
+ *	end
+ *
+ * The queue process writes or reads it on a pipe handed over to smtpctl,
+ * which does the optional compression.  Messages go through the queue
+ * backend API, so that the archive does not depend on the backend, the
+ * compression or the encryption of either queue.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define ARCHIVE_MAGIC		"OpenSMTPD queue archive 1"
+#define ARCHIVE_HIWAT		65536
+#define ARCHIVE_MAXQUEUED	4096	/* imsg not read by a scheduler */
+
+enum archive_state {
+	ARCHIVE_HEADER,
+	ARCHIVE_RECORD,
+	ARCHIVE_ENVELOPE,
+	ARCHIVE_MESSAGE,
+	ARCHIVE_END,
+};
+
+struct archive {
+	int			 type;
+	uint32_t		 peerid;
+	struct io		*io;
+	struct event		 ev;
+	enum archive_state	 state;
+
+	/* export: the messages to write, as smtpctl lists them */
+	uint32_t		*msgids;
+	size_t			 nmsgids;
+	size_t			 msgidsz;
+	size_t			 next;
+
+	/* the message being copied */
+	uint32_t		 msgid;
+	int			 fd;
+	size_t			 left;
+	struct envelope		*evps;
+	size_t			 nevps;
+	size_t			 evpsz;
+
+	size_t			 messages;
+	size_t			 envelopes;
+	size_t			 failed;
+};
+
+static void archive_io(struct io *, int, void *);
+static void archive_export(struct archive *);
+static int archive_export_message(struct archive *, uint32_t);
+static void archive_import(struct archive *);
+static int archive_import_record(struct archive *, const char *);
+static void archive_import_commit(struct archive *);
+static int archive_throttle(struct archive *);
+static void archive_resume(int, short, void *);
+static void archive_done(struct archive *, const char *);
+
+static struct archive	*archive;
+
+/*
+ * An export first lists the messages to write and an empty list starts
+ * it, an import starts right away.  The queue then hands one end of a
+ * pipe back to smtpctl, as control does not take descriptors from its
+ * clients.
+ */
+void
+queue_archive(int type, uint32_t peerid, const void *data, size_t len)
+{
+	struct archive	*a;
+	size_t		 n;
+	void		*tmp;
+	int		 fds[2], fd;
+
+	if ((a = archive) != NULL &&
+	    (a->peerid != peerid || a->type != type || a->io)) {
+		/* only answer the request that would have started it */
+		if (len)
+			return;
+		m_create(p_control, type, peerid, 0, -1);
+		m_add_int(p_control, 0);
+		m_add_size(p_control, 0);
+		m_add_size(p_control, 0);
+		m_add_size(p_control, 0);
+		m_add_string(p_control, "an archive is in progress");
+		m_close(p_control);
+		return;
+	}
+
+	if (a == NULL) {
+		a = xcalloc(1, sizeof(*a));
+		a->type = type;
+		a->peerid = peerid;
+		a->fd = -1;
+		evtimer_set(&a->ev, archive_resume, a);
+		archive = a;
+	}
+
+	if (type == IMSG_CTL_QUEUE_EXPORT && len) {
+		n = len / sizeof(uint32_t);
+		if (a->nmsgids + n > a->msgidsz) {
+			tmp = recallocarray(a->msgids, a->msgidsz,
+			    a->nmsgids + n, sizeof(uint32_t));
+			if (tmp == NULL) {
+				archive_done(a, "out of memory");
+				return;
+			}
+			a->msgids = tmp;
+			a->msgidsz = a->nmsgids + n;
+		}
+		memmove(a->msgids + a->nmsgids, data, n * sizeof(uint32_t));
+		a->nmsgids += n;
+		return;
+	}
+
+	if (pipe(fds) == -1) {
+		archive_done(a, "cannot create pipe");
+		return;
+	}
+	a->io = io_new();
+	if (a->io == NULL)
+		fatal("queue: io_new");
+	io_set_callback(a->io, archive_io, a);
+
+	if (type == IMSG_CTL_QUEUE_EXPORT) {
+		fd = fds[0];
+		io_set_nonblocking(fds[1]);
+		io_set_fd(a->io, fds[1]);
+	}
+	else {
+		fd = fds[1];
+		io_set_nonblocking(fds[0]);
+		io_set_fd(a->io, fds[0]);
+	}
+	m_compose(p_control, type, peerid, 0, fd, NULL, 0);
+
+	log_info("info: queue: %s started",
+	    type == IMSG_CTL_QUEUE_EXPORT ? "export" : "import");
+
+	if (type == IMSG_CTL_QUEUE_EXPORT) {
+		io_xprintf(a->io, "%s\n", ARCHIVE_MAGIC);
+		a->state = ARCHIVE_RECORD;
+		io_set_lowat(a->io, ARCHIVE_HIWAT / 2);
+		io_set_write(a->io);
+		archive_export(a);
+	}
+	else {
+		a->state = ARCHIVE_HEADER;
+		io_set_read(a->io);
+	}
+}
+
+static void
+archive_io(struct io *io, int evt, void *arg)
+{
+	struct archive	*a = arg;
+
+	switch (evt) {
+	case IO_DATAIN:
+		archive_import(a);
+		break;
+
+	case IO_LOWAT:
+		if (a->state == ARCHIVE_END && io_queued(io) == 0)
+			archive_done(a, NULL);
+		else
+			archive_export(a);
+		break;
+
+	case IO_DISCONNECTED:
+		if (a->type == IMSG_CTL_QUEUE_IMPORT &&
+		    a->state == ARCHIVE_END)
+			archive_done(a, NULL);
+		else
+			archive_done(a, "archive truncated");
+		break;
+
+	default:
+		archive_done(a, io_error(io));
+		break;
+	}
+}
+
+/*
+ * Fill the output up to the high watermark, one message at a time.
+ */
+static void
+archive_export(struct archive *a)
+{
+	char	buf[ARCHIVE_HIWAT];
+	ssize_t	n;
+
+	while (io_queued(a->io) < ARCHIVE_HIWAT) {
+		if (a->fd != -1) {
+			n = read(a->fd, buf, MIN(sizeof(buf), a->left));
+			if (n <= 0) {
+				archive_done(a, "cannot read message");
+				return;
+			}
+			io_write(a->io, buf, n);
+			a->left -= n;
+			if (a->left == 0) {
+				close(a->fd);
+				a->fd = -1;
+				a->messages++;
+			}
+			continue;
+		}
+
+		if (a->state == ARCHIVE_END)
+			break;
+
+		if (a->next == a->nmsgids) {
+			/* be told when the last of the archive is out */
+			io_set_lowat(a->io, 0);
+			io_xprintf(a->io, "end\n");
+			a->state = ARCHIVE_END;
+			break;
+		}
+
+		if (!archive_export_message(a, a->msgids[a->next++]))
+			a->failed++;
+	}
+}
+
+/*
+ * Queue the envelopes of a message and open it for copy.  A message
+ * delivered since it was listed is skipped.
+ */
+static int
+archive_export_message(struct archive *a, uint32_t msgid)
+{
+	struct envelope	 evp;
+	struct stat	 sb;
+	char		 buf[sizeof(struct envelope)];
+	void		*data = NULL;
+	size_t		 n = 0;
+	int		 fd, done = 0, r, len;
+
+	if ((fd = queue_message_fd_r(msgid)) == -1)
+		return (1);
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return (0);
+	}
+
+	while ((r = queue_message_walk(&evp, msgid, &done, &data)) != -1) {
+		if (r == 0)
+			continue;
+		if ((len = envelope_dump_buffer(&evp, buf, sizeof(buf))) == 0) {
+			a->failed++;
+			continue;
+		}
+		io_xprintf(a->io, "envelope %d\n", len);
+		io_write(a->io, buf, len);
+		n++;
+	}
+
+	if (n == 0) {
+		close(fd);
+		return (1);
+	}
+
+	io_xprintf(a->io, "message %lld\n", (long long)sb.st_size);
+	a->envelopes += n;
+	if (sb.st_size == 0) {
+		close(fd);
+		a->messages++;
+		return (1);
+	}
+	a->fd = fd;
+	a->left = sb.st_size;
+	return (1);
+}
+
+static void
+archive_import(struct archive *a)
+{
+	char		*line;
+	size_t		 len, n;
+	ssize_t		 w;
+	char		 buf[sizeof(struct envelope) + 1];
+	struct envelope	*tmp;
+
+	for (;;) {
+		/* let the schedulers catch up with the submissions */
+		if (archive_throttle(a)) {
+			io_pause(a->io, IO_IN);
+			return;
+		}
+
+		switch (a->state) {
+		case ARCHIVE_HEADER:
+		case ARCHIVE_RECORD:
+		case ARCHIVE_END:
+			if ((line = io_getline(a->io, &len)) == NULL) {
+				if (io_datalen(a->io) >= LINE_MAX) {
+					archive_done(a, "line too long");
+					return;
+				}
+				return;
+			}
+			if (!archive_import_record(a, line))
+				return;
+			break;
+
+		case ARCHIVE_ENVELOPE:
+			if (io_datalen(a->io) < a->left)
+				return;
+			memcpy(buf, io_data(a->io), a->left);
+			buf[a->left] = '\0';
+			io_drop(a->io, a->left);
+			a->state = ARCHIVE_RECORD;
+			if (a->nevps == a->evpsz) {
+				n = a->evpsz ? a->evpsz * 2 : 16;
+				tmp = reallocarray(a->evps, n,
+				    sizeof(*a->evps));
+				if (tmp == NULL)
+					fatal("queue_archive: reallocarray");
+				a->evps = tmp;
+				a->evpsz = n;
+			}
+			if (!envelope_load_buffer(&a->evps[a->nevps], buf,
+			    a->left)) {
+				a->failed++;
+				break;
+			}
+			a->nevps++;
+			break;
+
+		case ARCHIVE_MESSAGE:
+			if ((len = io_datalen(a->io)) == 0)
+				return;
+			len = MIN(len, a->left);
+			if ((w = write(a->fd, io_data(a->io), len)) == -1) {
+				log_warn("warn: queue: import");
+				archive_done(a, "cannot write message");
+				return;
+			}
+			io_drop(a->io, w);
+			a->left -= w;
+			if (a->left == 0)
+				archive_import_commit(a);
+			break;
+		}
+	}
+}
+
+static int
+archive_import_record(struct archive *a, const char *line)
+{
+	const char	*errstr;
+	const char	*p;
+
+	if (a->state == ARCHIVE_HEADER) {
+		if (strcmp(line, ARCHIVE_MAGIC)) {
+			archive_done(a, "not a queue archive");
+			return (0);
+		}
+		a->state = ARCHIVE_RECORD;
+		return (1);
+	}
+
+	if (a->state == ARCHIVE_END) {
+		archive_done(a, "data after the end of the archive");
+		return (0);
+	}
+
+	if (strncmp(line, "envelope ", 9) == 0) {
+		a->left = strtonum(line + 9, 1, sizeof(struct envelope),
+		    &errstr);
+		if (errstr) {
+			archive_done(a, "invalid envelope record");
+			return (0);
+		}
+		a->state = ARCHIVE_ENVELOPE;
+		return (1);
+	}
+
+	if (strncmp(line, "message ", 8) == 0) {
+		p = line + 8;
+		a->left = strtonum(p, 0, LLONG_MAX, &errstr);
+		if (errstr) {
+			archive_done(a, "invalid message record");
+			return (0);
+		}
+		if (!queue_message_create(&a->msgid)) {
+			archive_done(a, "cannot create message");
+			return (0);
+		}
+		if ((a->fd = queue_message_fd_rw(a->msgid)) == -1) {
+			queue_message_delete(a->msgid);
+			a->msgid = 0;
+			archive_done(a, "cannot open message");
+			return (0);
+		}
+		a->state = ARCHIVE_MESSAGE;
+		if (a->left == 0)
+			archive_import_commit(a);
+		return (1);
+	}
+
+	if (strcmp(line, "end") == 0) {
+		if (a->nevps) {
+			archive_done(a, "envelopes without a message");
+			return (0);
+		}
+		a->state = ARCHIVE_END;
+		return (1);
+	}
+
+	archive_done(a, "invalid record");
+	return (0);
+}
+
+/*
+ * The message is written, create its envelopes and hand them to the
+ * scheduler.  The original creation time is kept, so that the envelopes
+ * expire as they would have on the previous host.
+ */
+static void
+archive_import_commit(struct archive *a)
+{
+	struct envelope	*evp;
+	struct mproc	*p_sched;
+	time_t		 creation;
+	size_t		 i, n;
+
+	close(a->fd);
+	a->fd = -1;
+	a->state = ARCHIVE_RECORD;
+
+	for (i = 0, n = 0; i < a->nevps; i++) {
+		evp = &a->evps[i];
+		if (hdict_get(env->sc_dispatchers, evp->dispatcher) == NULL) {
+			log_warnx("warn: queue: import: unknown dispatcher "
+			    "\"%s\"", evp->dispatcher);
+			a->failed++;
+			continue;
+		}
+		creation = evp->creation;
+		evp->id = msgid_to_evpid(a->msgid);
+		if (!queue_envelope_create(evp)) {
+			a->failed++;
+			continue;
+		}
+		if (creation)
+			evp->creation = creation;
+		/* the scheduler gets the created envelopes in order */
+		if (n != i)
+			a->evps[n] = *evp;
+		n++;
+	}
+
+	if (n == 0 || !queue_message_commit(a->msgid)) {
+		queue_message_delete(a->msgid);
+		a->failed += n;
+		a->msgid = 0;
+		a->nevps = 0;
+		return;
+	}
+
+	/* backends only update committed envelopes, creation is reset */
+	for (i = 0; i < n; i++)
+		if (!queue_envelope_update(&a->evps[i]))
+			log_warnx("warn: queue: import: could not keep "
+			    "creation time of %016"PRIx64, a->evps[i].id);
+
+	p_sched = scheduler_peer(a->msgid);
+	for (i = 0; i < n; i++) {
+		m_create(p_sched, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
+		m_add_envelope(p_sched, &a->evps[i]);
+		m_close(p_sched);
+	}
+	m_create(p_sched, IMSG_QUEUE_MESSAGE_COMMIT, 0, 0, -1);
+	m_add_msgid(p_sched, a->msgid);
+	m_close(p_sched);
+
+	a->messages++;
+	a->envelopes += n;
+	a->msgid = 0;
+	a->nevps = 0;
+}
+
+/*
+ * Tell if too many submissions wait to be read by a scheduler, and
+ * check again a bit later if so.
+ */
+static int
+archive_throttle(struct archive *a)
+{
+	struct timeval	tv;
+	int		i;
+
+	for (i = 0; i < env->sc_scheduler_shards; i++)
+		if (p_schedulers[i]->imsgbuf.w.queued >= ARCHIVE_MAXQUEUED)
+			break;
+	if (i == env->sc_scheduler_shards)
+		return (0);
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 10000;
+	evtimer_add(&a->ev, &tv);
+	return (1);
+}
+
+static void
+archive_resume(int fd, short event, void *arg)
+{
+	struct archive	*a = arg;
+
+	if (archive_throttle(a))
+		return;
+
+	io_resume(a->io, IO_IN);
+	archive_import(a);
+}
+
+static void
+archive_done(struct archive *a, const char *error)
+{
+	if (a->msgid) {
+		queue_message_delete(a->msgid);
+		a->msgid = 0;
+	}
+	if (a->fd != -1)
+		close(a->fd);
+
+	if (error)
+		log_warnx("warn: queue: %s failed: %s",
+		    a->type == IMSG_CTL_QUEUE_EXPORT ? "export" : "import",
+		    error);
+	log_info("info: queue: %s: %zu messages, %zu envelopes, %zu failed",
+	    a->type == IMSG_CTL_QUEUE_EXPORT ? "export" : "import",
+	    a->messages, a->envelopes, a->failed);
+
+	m_create(p_control, a->type, a->peerid, 0, -1);
+	m_add_int(p_control, error == NULL);
+	m_add_size(p_control, a->messages);
+	m_add_size(p_control, a->envelopes);
+	m_add_size(p_control, a->failed);
+	m_add_string(p_control, error ? error : "");
+	m_close(p_control);
+
+	evtimer_del(&a->ev);
+	if (a->io)
+		io_free(a->io);
+	free(a->msgids);
+	free(a->evps);
+	free(a);
+	archive = NULL;
+}
@@ -23,6 +23,9 @@
 #include <sys/tree.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
 
 #include <ctype.h>
 #include <errno.h>
@@ -38,9 +41,19 @@
 #include "smtpd.h"
 #include "log.h"
 
+/* largest decoded message kept in anonymous memory for delivery */
+#define	QUEUE_MEMFD_MAXSIZE	(1024 * 1024)
+
+/* how long new messages keep going to the same queue bucket */
+#define	MSGID_BUCKET_PERIOD	60		/* seconds */
+
 static const char* envelope_validate(struct envelope *);
 
+#ifdef HAVE_DB_API
+extern struct queue_backend	queue_backend_db;
+#endif
 extern struct queue_backend	queue_backend_fs;
+extern struct queue_backend	queue_backend_log;
 extern struct queue_backend	queue_backend_null;
 extern struct queue_backend	queue_backend_proc;
 extern struct queue_backend	queue_backend_ram;
@@ -48,10 +61,36 @@ extern struct queue_backend	queue_backend_ram;
 static void queue_envelope_cache_add(struct envelope *);
 static void queue_envelope_cache_update(struct envelope *);
 static void queue_envelope_cache_del(uint64_t evpid);
+static struct evpcache_msg *queue_envelope_cache_msg(struct envelope *);
+static void queue_envelope_cache_msg_release(struct evpcache_msg *);
+static void queue_envelope_summary(struct envelope *);
 
-TAILQ_HEAD(evplst, envelope);
+/*
+ * Cached envelopes are kept in their compact binary encoding, which is a
+ * fraction of the size of a struct envelope and cheap to decode.  The
+ * fields shared by all recipients of a message (sender, helo, ...) are
+ * stored once per message and referenced by its envelopes; an envelope
+ * whose message-level fields differ from the shared copy is cached whole.
+ */
+struct evpcache_msg {
+	uint32_t			 msgid;
+	size_t				 refs;
+	size_t				 len;
+	char				 buf[];
+};
+
+struct evpcache_entry {
+	TAILQ_ENTRY(evpcache_entry)	 entry;
+	uint64_t			 id;
+	struct evpcache_msg		*msg;
+	size_t				 len;
+	char				 buf[];
+};
+
+TAILQ_HEAD(evplst, evpcache_entry);
 
 static struct tree		evpcache_tree;
+static struct tree		evpcache_msgs;
 static struct evplst		evpcache_list;
 static struct queue_backend	*backend;
 
@@ -60,13 +99,31 @@ static int (*handler_message_create)(uint32_t *);
 static int (*handler_message_commit)(uint32_t, const char*);
 static int (*handler_message_delete)(uint32_t);
 static int (*handler_message_fd_r)(uint32_t);
+static int (*handler_message_index)(uint32_t, const char *, size_t);
+static int (*handler_message_index_load)(uint32_t, char *, size_t);
 static int (*handler_envelope_create)(uint32_t, const char *, size_t, uint64_t *);
 static int (*handler_envelope_delete)(uint64_t);
+static int (*handler_envelope_delete_batch)(const uint64_t *, size_t);
 static int (*handler_envelope_update)(uint64_t, const char *, size_t);
+static int (*handler_envelope_retry)(uint64_t, const char *, size_t);
 static int (*handler_envelope_load)(uint64_t, char *, size_t);
 static int (*handler_envelope_walk)(uint64_t *, char *, size_t);
 static int (*handler_message_walk)(uint64_t *, char *, size_t,
     uint32_t, int *, void **);
+static int (*handler_envelope_summary)(uint64_t, const char *, size_t);
+static int (*handler_summary_open)(void);
+static int (*handler_summary_walk)(uint64_t *, char *, size_t);
+
+/*
+ * Messages are spread over the queue shards by msgid.  Shard 0 is the
+ * spool itself, shard n lives under /shard.n which is expected to be a
+ * mount point of its own.  Only the fs backend uses more than one.
+ */
+static char	shard_roots[QUEUE_SHARDS_MAX][sizeof("/shard.-2147483648")];
+static int	nshards = 1;
+
+/* as last reported by the backend, for the pressure sent to smtp */
+static enum queue_space	shard_space[QUEUE_SHARDS_MAX];
 
 #ifdef QUEUE_PROFILING
 
@@ -104,15 +161,63 @@ static inline void profile_leave(void)
 static int
 queue_message_path(uint32_t msgid, char *buf, size_t len)
 {
-	return bsnprintf(buf, len, "%s/%08"PRIx32, PATH_TEMPORARY, msgid);
+	/* on the same filesystem as the shard the message goes to */
+	return bsnprintf(buf, len, "%s%s/%08"PRIx32,
+	    shard_roots[queue_shard(msgid)], PATH_TEMPORARY, msgid);
+}
+
+int
+queue_shards(void)
+{
+	return (nshards);
+}
+
+int
+queue_shard(uint32_t msgid)
+{
+	return (msgid % nshards);
+}
+
+const char *
+queue_shard_root(int shard)
+{
+	return (shard_roots[shard]);
+}
+
+void
+queue_space_update(int shard, enum queue_space space)
+{
+	shard_space[shard] = space;
+}
+
+/*
+ * A full shard leaves new messages to the others, so the queue is only
+ * full once no shard has room, and getting there as soon as one has.
+ */
+enum queue_space
+queue_space(void)
+{
+	enum queue_space	space;
+	int			i, full;
+
+	space = QUEUE_SPACE_OK;
+	full = 0;
+	for (i = 0; i < nshards; i++) {
+		if (shard_space[i] != QUEUE_SPACE_OK)
+			space = QUEUE_SPACE_LOW;
+		if (shard_space[i] == QUEUE_SPACE_FULL)
+			full++;
+	}
+	return (full == nshards ? QUEUE_SPACE_FULL : space);
 }
 
 int
 queue_init(const char *name, int server)
 {
+	char		 path[PATH_MAX];
 	struct passwd	*pwq;
 	struct group	*gr;
-	int		 r;
+	int		 i, r;
 
 	pwq = getpwnam(SMTPD_QUEUE_USER);
 	if (pwq == NULL)
@@ -123,10 +228,17 @@ queue_init(const char *name, int server)
 		fatalx("unknown group %s", SMTPD_QUEUE_GROUP);
 
 	tree_init(&evpcache_tree);
+	tree_init(&evpcache_msgs);
 	TAILQ_INIT(&evpcache_list);
 
 	if (!strcmp(name, "fs"))
 		backend = &queue_backend_fs;
+#ifdef HAVE_DB_API
+	else if (!strcmp(name, "db"))
+		backend = &queue_backend_db;
+#endif
+	else if (!strcmp(name, "log"))
+		backend = &queue_backend_log;
 	else if (!strcmp(name, "null"))
 		backend = &queue_backend_null;
 	else if (!strcmp(name, "ram"))
@@ -134,6 +246,22 @@ queue_init(const char *name, int server)
 	else
 		backend = &queue_backend_proc;
 
+	if (backend == &queue_backend_fs && env != NULL)
+		nshards = env->sc_queue_shards;
+	else if (backend == &queue_backend_fs) {
+		/* without a configuration, go by the spool layout */
+		for (nshards = 1; nshards < QUEUE_SHARDS_MAX; nshards++) {
+			(void)snprintf(path, sizeof(path), "%s/shard.%d",
+			    PATH_SPOOL, nshards);
+			if (access(path, F_OK) == -1)
+				break;
+		}
+	}
+	for (i = 1; i < nshards; i++)
+		if (!bsnprintf(shard_roots[i], sizeof(shard_roots[i]),
+		    "/shard.%d", i))
+			fatalx("queue_init: shard root too long");
+
 	if (server) {
 		if (ckdir(PATH_SPOOL, 0711, 0, 0, 1) == 0)
 			fatalx("error in spool directory setup");
@@ -142,10 +270,34 @@ queue_init(const char *name, int server)
 		if (ckdir(PATH_SPOOL PATH_PURGE, 0700, pwq->pw_uid, 0, 1) == 0)
 			fatalx("error in purge directory setup");
 
-		mvpurge(PATH_SPOOL PATH_TEMPORARY, PATH_SPOOL PATH_PURGE);
+		/*
+		 * A reloading generation still writes there, and the
+		 * scheduler state saved at the last stop is kept.
+		 */
+		if (!(env->sc_opts & SMTPD_OPT_TAKEOVER)) {
+			(void)rename(PATH_SPOOL PATH_SCHEDULER_STATE,
+			    PATH_SPOOL "/scheduler.state");
+			mvpurge(PATH_SPOOL PATH_TEMPORARY, PATH_SPOOL PATH_PURGE);
+		}
 
 		if (ckdir(PATH_SPOOL PATH_TEMPORARY, 0700, pwq->pw_uid, 0, 1) == 0)
 			fatalx("error in purge directory setup");
+		if (!(env->sc_opts & SMTPD_OPT_TAKEOVER))
+			(void)rename(PATH_SPOOL "/scheduler.state",
+			    PATH_SPOOL PATH_SCHEDULER_STATE);
+
+		for (i = 1; i < nshards; i++) {
+			(void)snprintf(path, sizeof(path), "%s%s",
+			    PATH_SPOOL, shard_roots[i]);
+			if (ckdir(path, 0711, 0, 0, 1) == 0)
+				fatalx("error in queue shard setup");
+			(void)strlcat(path, PATH_TEMPORARY, sizeof(path));
+			if (ckdir(path, 0700, pwq->pw_uid, 0, 1) == 0)
+				fatalx("error in queue shard setup");
+			if (!(env->sc_opts & SMTPD_OPT_TAKEOVER) &&
+			    rmtree(path, 1) == -1)
+				fatalx("error in queue shard setup");
+		}
 	}
 
 	r = backend->init(pwq, server, name);
@@ -213,63 +365,92 @@ queue_message_delete(uint32_t msgid)
 	return (r);
 }
 
+static int
+queue_message_encode(FILE *ifp, FILE *ofp)
+{
+	void		*hdl;
+	int		 r;
+
+	if ((hdl = crypto_encrypt_stream_begin(ofp)) == NULL)
+		return (0);
+	r = compress_file_cb(ifp, crypto_encrypt_stream_write, hdl);
+	if (!crypto_encrypt_stream_end(hdl))
+		r = 0;
+
+	return (r);
+}
+
+/*
+ * Compress and/or encrypt the incoming message file in place.  This is
+ * the costly part of a commit, which the queue hands to its workers.
+ */
 int
-queue_message_commit(uint32_t msgid)
+queue_message_transform(uint32_t msgid)
 {
-	int	r;
 	char	msgpath[PATH_MAX];
 	char	tmppath[PATH_MAX];
 	FILE	*ifp = NULL;
 	FILE	*ofp = NULL;
+	int	 r = 0;
 
-	profile_enter("queue_message_commit");
+	if ((env->sc_queue_flags & (QUEUE_COMPRESSION|QUEUE_ENCRYPTION)) == 0)
+		return (1);
 
 	queue_message_path(msgid, msgpath, sizeof(msgpath));
+	if (!bsnprintf(tmppath, sizeof tmppath, "%s.%s", msgpath,
+	    (env->sc_queue_flags & QUEUE_ENCRYPTION) ? "enc" : "comp"))
+		return (0);
 
-	if (env->sc_queue_flags & QUEUE_COMPRESSION) {
-		bsnprintf(tmppath, sizeof tmppath, "%s.comp", msgpath);
-		ifp = fopen(msgpath, "r");
-		ofp = fopen(tmppath, "w+");
-		if (ifp == NULL || ofp == NULL)
-			goto err;
-		if (!compress_file(ifp, ofp))
-			goto err;
-		fclose(ifp);
-		fclose(ofp);
-		ifp = NULL;
-		ofp = NULL;
+	if ((ifp = fopen(msgpath, "r")) == NULL)
+		goto end;
+	if ((ofp = fopen(tmppath, "w+")) == NULL)
+		goto end;
+
+	/*
+	 * when both are enabled, compress and encrypt in a single pass
+	 * rather than going through an intermediate compressed copy.
+	 */
+	if ((env->sc_queue_flags & QUEUE_COMPRESSION) &&
+	    (env->sc_queue_flags & QUEUE_ENCRYPTION))
+		r = queue_message_encode(ifp, ofp);
+	else if (env->sc_queue_flags & QUEUE_COMPRESSION)
+		r = compress_file(ifp, ofp);
+	else
+		r = crypto_encrypt_file(ifp, ofp);
+	if (fclose(ofp) != 0)
+		r = 0;
+	ofp = NULL;
 
-		if (rename(tmppath, msgpath) == -1) {
-			if (errno == ENOSPC)
-				return (0);
-			unlink(tmppath);
+	if (r && rename(tmppath, msgpath) == -1) {
+		if (errno != ENOSPC)
 			log_warn("rename");
-			return (0);
-		}
+		r = 0;
 	}
+	if (!r)
+		unlink(tmppath);
 
-	if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
-		bsnprintf(tmppath, sizeof tmppath, "%s.enc", msgpath);
-		ifp = fopen(msgpath, "r");
-		ofp = fopen(tmppath, "w+");
-		if (ifp == NULL || ofp == NULL)
-			goto err;
-		if (!crypto_encrypt_file(ifp, ofp))
-			goto err;
+end:
+	if (ifp)
 		fclose(ifp);
+	if (ofp) {
 		fclose(ofp);
-		ifp = NULL;
-		ofp = NULL;
-
-		if (rename(tmppath, msgpath) == -1) {
-			if (errno == ENOSPC)
-				return (0);
-			unlink(tmppath);
-			log_warn("rename");
-			return (0);
-		}
+		unlink(tmppath);
 	}
+	return (r);
+}
 
+/*
+ * Hand a transformed message over to the backend.
+ */
+int
+queue_message_commit_transformed(uint32_t msgid)
+{
+	int	r;
+	char	msgpath[PATH_MAX];
+
+	profile_enter("queue_message_commit");
+
+	queue_message_path(msgid, msgpath, sizeof(msgpath));
 	r = handler_message_commit(msgid, msgpath);
 	profile_leave();
 
@@ -281,21 +462,111 @@ queue_message_commit(uint32_t msgid)
 	    msgid, r);
 
 	return (r);
+}
+
+int
+queue_message_commit(uint32_t msgid)
+{
+	if (!queue_message_transform(msgid))
+		return (0);
+	return (queue_message_commit_transformed(msgid));
+}
+
+/*
+ * Where the decoded copy of a compressed or encrypted message handed to
+ * the mta/mda goes.  When the system allows it, it is kept in anonymous
+ * memory rather than written back to the spool disk.  The memory file
+ * cannot grow past QUEUE_MEMFD_MAXSIZE, as the decoded size is only
+ * known once the message is decoded.
+ */
+static int
+queue_message_memfd(void)
+{
+#if defined(HAVE_MEMFD_CREATE) && defined(F_SEAL_GROW)
+	int	fd;
+
+	if ((fd = memfd_create("smtpd", MFD_ALLOW_SEALING)) == -1)
+		return (-1);
+	if (ftruncate(fd, QUEUE_MEMFD_MAXSIZE) == -1 ||
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_GROW) == -1) {
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+#else
+	return (-1);
+#endif
+}
+
+/* Decode the message on fdin to fdout, and rewind fdout. */
+static int
+queue_message_decode(int fdin, int fdout)
+{
+	FILE	*ifp = NULL;
+	FILE	*ofp = NULL;
+	void	*hdl;
+	off_t	 len;
+	int	 fd, r;
+
+	if ((fd = dup(fdin)) == -1)
+		goto err;
+	if ((ifp = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		goto err;
+	}
+	if ((fd = dup(fdout)) == -1)
+		goto err;
+	if ((ofp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		goto err;
+	}
+
+	/*
+	 * when both are enabled, decrypt straight into the decompressor
+	 * so that the message is decoded in a single pass.
+	 */
+	if ((env->sc_queue_flags & QUEUE_ENCRYPTION) &&
+	    (env->sc_queue_flags & QUEUE_COMPRESSION)) {
+		if ((hdl = uncompress_stream_begin(ofp)) == NULL)
+			goto err;
+		r = crypto_decrypt_file_cb(ifp, uncompress_stream_write, hdl);
+		if (!uncompress_stream_end(hdl))
+			r = 0;
+	} else if (env->sc_queue_flags & QUEUE_ENCRYPTION)
+		r = crypto_decrypt_file(ifp, ofp);
+	else
+		r = uncompress_file(ifp, ofp);
+	if (!r || fflush(ofp) != 0 || (len = ftello(ofp)) == -1)
+		goto err;
+
+	fclose(ifp);
+	ifp = NULL;
+	if (!safe_fclose(ofp)) {
+		ofp = NULL;
+		goto err;
+	}
+	ofp = NULL;
+
+	/* a memory file was sized to its cap beforehand */
+	if (ftruncate(fdout, len) == -1)
+		goto err;
+	if (lseek(fdout, 0, SEEK_SET) == -1)
+		goto err;
+
+	return (1);
 
 err:
 	if (ifp)
 		fclose(ifp);
 	if (ofp)
 		fclose(ofp);
-	return 0;
+	return (0);
 }
 
 int
 queue_message_fd_r(uint32_t msgid)
 {
-	int	fdin = -1, fdout = -1, fd = -1;
-	FILE	*ifp = NULL;
-	FILE	*ofp = NULL;
+	int	fdin = -1, fdout = -1;
 
 	profile_enter("queue_message_fd_r");
 	fdin = handler_message_fd_r(msgid);
@@ -307,63 +578,32 @@ queue_message_fd_r(uint32_t msgid)
 	if (fdin == -1)
 		return (-1);
 
-	if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
-		if ((fdout = mktmpfile()) == -1)
-			goto err;
-		if ((fd = dup(fdout)) == -1)
-			goto err;
-		if ((ifp = fdopen(fdin, "r")) == NULL)
-			goto err;
-		fdin = fd;
-		fd = -1;
-		if ((ofp = fdopen(fdout, "w+")) == NULL)
-			goto err;
+	if ((env->sc_queue_flags & (QUEUE_COMPRESSION|QUEUE_ENCRYPTION)) == 0)
+		return (fdin);
 
-		if (!crypto_decrypt_file(ifp, ofp))
+	/* a message too large for memory is decoded again to the disk */
+	if ((fdout = queue_message_memfd()) != -1 &&
+	    !queue_message_decode(fdin, fdout)) {
+		close(fdout);
+		fdout = -1;
+		if (lseek(fdin, 0, SEEK_SET) == -1)
 			goto err;
-
-		fclose(ifp);
-		ifp = NULL;
-		fclose(ofp);
-		ofp = NULL;
-		lseek(fdin, SEEK_SET, 0);
 	}
-
-	if (env->sc_queue_flags & QUEUE_COMPRESSION) {
+	if (fdout == -1) {
 		if ((fdout = mktmpfile()) == -1)
 			goto err;
-		if ((fd = dup(fdout)) == -1)
-			goto err;
-		if ((ifp = fdopen(fdin, "r")) == NULL)
-			goto err;
-		fdin = fd;
-		fd = -1;
-		if ((ofp = fdopen(fdout, "w+")) == NULL)
-			goto err;
-
-		if (!uncompress_file(ifp, ofp))
+		if (!queue_message_decode(fdin, fdout))
 			goto err;
-
-		fclose(ifp);
-		ifp = NULL;
-		fclose(ofp);
-		ofp = NULL;
-		lseek(fdin, SEEK_SET, 0);
 	}
+	close(fdin);
 
-	return (fdin);
+	return (fdout);
 
 err:
-	if (fd != -1)
-		close(fd);
 	if (fdin != -1)
 		close(fdin);
 	if (fdout != -1)
 		close(fdout);
-	if (ifp)
-		fclose(ifp);
-	if (ofp)
-		fclose(ofp);
 	return -1;
 }
 
@@ -377,6 +617,71 @@ queue_message_fd_rw(uint32_t msgid)
 	return open(buf, O_RDWR | O_CREAT | O_EXCL, 0600);
 }
 
+/* the content of a message not committed yet, to be synced */
+int
+queue_message_fd_sync(uint32_t msgid)
+{
+	char buf[PATH_MAX];
+
+	queue_message_path(msgid, buf, sizeof(buf));
+
+	return open(buf, O_RDONLY);
+}
+
+/*
+ * Store the header index of an incoming message, before it is
+ * committed.  The index is a hint for consumers, so a backend is free
+ * not to keep it.  It would give away the layout of the headers of an
+ * encrypted queue, so none is stored then.
+ */
+int
+queue_message_index(uint32_t msgid, const void *buf, size_t len)
+{
+	int	r;
+
+	if (handler_message_index == NULL ||
+	    env->sc_queue_flags & QUEUE_ENCRYPTION)
+		return (1);
+
+	profile_enter("queue_message_index");
+	r = handler_message_index(msgid, buf, len);
+	profile_leave();
+
+	log_trace(TRACE_QUEUE,
+	    "queue-backend: queue_message_index(%08"PRIx32", %zu) -> %d",
+	    msgid, len, r);
+
+	return (r);
+}
+
+/* Return the length of the header index of a message, or 0 if none. */
+int
+queue_message_index_load(uint32_t msgid, void *buf, size_t len)
+{
+	struct msgindex	mi;
+	int		r;
+
+	if (handler_message_index_load == NULL ||
+	    env->sc_queue_flags & QUEUE_ENCRYPTION)
+		return (0);
+
+	profile_enter("queue_message_index_load");
+	r = handler_message_index_load(msgid, buf, len);
+	profile_leave();
+
+	if (r > 0 && !msgindex_open(buf, r, &mi)) {
+		log_warnx("warn: queue-backend: bad index for message %08"PRIx32,
+		    msgid);
+		r = 0;
+	}
+
+	log_trace(TRACE_QUEUE,
+	    "queue-backend: queue_message_index_load(%08"PRIx32") -> %d",
+	    msgid, r);
+
+	return (r > 0 ? r : 0);
+}
+
 static int
 queue_envelope_dump_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 {
@@ -388,7 +693,10 @@ queue_envelope_dump_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 	char	encbuf[sizeof(struct envelope)];
 
 	evp = evpbuf;
-	evplen = envelope_dump_buffer(ep, evpbuf, evpbufsize);
+	if (env->sc_queue_flags & QUEUE_BINARY_ENVELOPE)
+		evplen = envelope_dump_binary(ep, evpbuf, evpbufsize);
+	else
+		evplen = envelope_dump_buffer(ep, evpbuf, evpbufsize);
 	if (evplen == 0)
 		return (0);
 
@@ -445,33 +753,97 @@ queue_envelope_load_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 	return (envelope_load_buffer(ep, evp, evplen));
 }
 
+static struct evpcache_msg *
+queue_envelope_cache_msg(struct envelope *e)
+{
+	struct evpcache_msg	*msg;
+	char			 buf[sizeof(struct envelope)];
+	size_t			 len;
+	uint32_t		 msgid;
+
+	if (!envelope_dump_binary_fields(e, ENVELOPE_FIELDS_MESSAGE, buf,
+	    sizeof buf, &len))
+		return (NULL);
+
+	msgid = evpid_to_msgid(e->id);
+	if ((msg = tree_get(&evpcache_msgs, msgid)) != NULL) {
+		if (msg->len != len || memcmp(msg->buf, buf, len))
+			return (NULL);
+		msg->refs++;
+		return (msg);
+	}
+
+	msg = xmalloc(sizeof *msg + len);
+	memory_alloc(MEMORY_EVPCACHE, sizeof *msg + len);
+	msg->msgid = msgid;
+	msg->refs = 1;
+	msg->len = len;
+	memcpy(msg->buf, buf, len);
+	tree_xset(&evpcache_msgs, msgid, msg);
+	stat_increment("queue.evpcache.messages", 1);
+	stat_increment("queue.evpcache.bytes", len);
+	return (msg);
+}
+
 static void
 queue_envelope_cache_add(struct envelope *e)
 {
-	struct envelope *cached;
+	struct evpcache_entry	*cached;
+	struct evpcache_msg	*msg;
+	char			 evpbuf[sizeof(struct envelope)];
+	size_t			 evplen;
+
+	/* nothing new is cached under memory pressure */
+	if (memory_level() >= MEMORY_SHRINK)
+		return;
+
+	if ((msg = queue_envelope_cache_msg(e)) != NULL) {
+		if (!envelope_dump_binary_fields(e, ENVELOPE_FIELDS_RECIPIENT,
+		    evpbuf, sizeof evpbuf, &evplen)) {
+			queue_envelope_cache_msg_release(msg);
+			return;
+		}
+	}
+	else if ((evplen = envelope_dump_binary(e, evpbuf, sizeof evpbuf)) == 0)
+		return;
 
 	while (tree_count(&evpcache_tree) >= env->sc_queue_evpcache_size)
 		queue_envelope_cache_del(TAILQ_LAST(&evpcache_list, evplst)->id);
 
-	cached = xcalloc(1, sizeof *cached);
-	*cached = *e;
+	cached = xmalloc(sizeof *cached + evplen);
+	memory_alloc(MEMORY_EVPCACHE, sizeof *cached + evplen);
+	cached->id = e->id;
+	cached->msg = msg;
+	cached->len = evplen;
+	memcpy(cached->buf, evpbuf, evplen);
 	TAILQ_INSERT_HEAD(&evpcache_list, cached, entry);
 	tree_xset(&evpcache_tree, e->id, cached);
 	stat_increment("queue.evpcache.size", 1);
+	stat_increment("queue.evpcache.bytes", evplen);
 }
 
 static void
-queue_envelope_cache_update(struct envelope *e)
+queue_envelope_cache_msg_release(struct evpcache_msg *msg)
 {
-	struct envelope *cached;
+	if (--msg->refs)
+		return;
+
+	tree_xpop(&evpcache_msgs, msg->msgid);
+	stat_decrement("queue.evpcache.messages", 1);
+	stat_decrement("queue.evpcache.bytes", msg->len);
+	memory_free(MEMORY_EVPCACHE, sizeof *msg + msg->len);
+	free(msg);
+}
 
-	if ((cached = tree_get(&evpcache_tree, e->id)) == NULL) {
+static void
+queue_envelope_cache_update(struct envelope *e)
+{
+	if (tree_get(&evpcache_tree, e->id) == NULL) {
 		queue_envelope_cache_add(e);
 		stat_increment("queue.evpcache.update.missed", 1);
 	} else {
-		TAILQ_REMOVE(&evpcache_list, cached, entry);
-		*cached = *e;
-		TAILQ_INSERT_HEAD(&evpcache_list, cached, entry);
+		queue_envelope_cache_del(e->id);
+		queue_envelope_cache_add(e);
 		stat_increment("queue.evpcache.update.hit", 1);
 	}
 }
@@ -479,14 +851,31 @@ queue_envelope_cache_update(struct envelope *e)
 static void
 queue_envelope_cache_del(uint64_t evpid)
 {
-	struct envelope *cached;
+	struct evpcache_entry	*cached;
 
 	if ((cached = tree_pop(&evpcache_tree, evpid)) == NULL)
 		return;
 
 	TAILQ_REMOVE(&evpcache_list, cached, entry);
-	free(cached);
+	if (cached->msg)
+		queue_envelope_cache_msg_release(cached->msg);
 	stat_decrement("queue.evpcache.size", 1);
+	stat_decrement("queue.evpcache.bytes", cached->len);
+	memory_free(MEMORY_EVPCACHE, sizeof *cached + cached->len);
+	free(cached);
+}
+
+/*
+ * Drop the least recently used half of the cache.
+ */
+void
+queue_envelope_cache_shrink(void)
+{
+	size_t	n;
+
+	n = tree_count(&evpcache_tree) / 2;
+	while (n--)
+		queue_envelope_cache_del(TAILQ_LAST(&evpcache_list, evplst)->id);
 }
 
 int
@@ -521,6 +910,8 @@ queue_envelope_create(struct envelope *ep)
 
 	if (r && env->sc_queue_flags & QUEUE_EVPCACHE)
 		queue_envelope_cache_add(ep);
+	if (r)
+		queue_envelope_summary(ep);
 
 	return (r);
 }
@@ -544,17 +935,55 @@ queue_envelope_delete(uint64_t evpid)
 	return (r);
 }
 
+/*
+ * Delete envelopes, which must all belong to the same message.  The
+ * backend may do it in one operation when they are the last ones.
+ */
+int
+queue_envelope_delete_batch(const uint64_t *evpids, size_t n)
+{
+	size_t	i;
+	int	r;
+
+	if (handler_envelope_delete_batch == NULL) {
+		for (i = 0; i < n; i++)
+			if (!queue_envelope_delete(evpids[i]))
+				return (0);
+		return (1);
+	}
+
+	if (env->sc_queue_flags & QUEUE_EVPCACHE)
+		for (i = 0; i < n; i++)
+			queue_envelope_cache_del(evpids[i]);
+
+	profile_enter("queue_envelope_delete_batch");
+	r = handler_envelope_delete_batch(evpids, n);
+	profile_leave();
+
+	log_trace(TRACE_QUEUE,
+	    "queue-backend: queue_envelope_delete_batch(%08"PRIx32", %zu) -> %d",
+	    evpid_to_msgid(evpids[0]), n, r);
+
+	return (r);
+}
+
 int
 queue_envelope_load(uint64_t evpid, struct envelope *ep)
 {
 	const char	*e;
 	char		 evpbuf[sizeof(struct envelope)];
 	size_t		 evplen;
-	struct envelope	*cached;
+	struct evpcache_entry	*cached;
 
 	if ((env->sc_queue_flags & QUEUE_EVPCACHE) &&
-	    (cached = tree_get(&evpcache_tree, evpid))) {
-		*ep = *cached;
+	    (cached = tree_get(&evpcache_tree, evpid)) &&
+	    (cached->msg ?
+	    envelope_load_binary_fields(ep, cached->msg->buf, cached->msg->len,
+	    cached->buf, cached->len) :
+	    envelope_load_buffer(ep, cached->buf, cached->len))) {
+		ep->id = evpid;
+		TAILQ_REMOVE(&evpcache_list, cached, entry);
+		TAILQ_INSERT_HEAD(&evpcache_list, cached, entry);
 		stat_increment("queue.evpcache.load.hit", 1);
 		return (1);
 	}
@@ -603,6 +1032,8 @@ queue_envelope_update(struct envelope *ep)
 
 	if (r && env->sc_queue_flags & QUEUE_EVPCACHE)
 		queue_envelope_cache_update(ep);
+	if (r)
+		queue_envelope_summary(ep);
 
 	log_trace(TRACE_QUEUE,
 	    "queue-backend: queue_envelope_update(%016"PRIx64") -> %d",
@@ -611,6 +1042,41 @@ queue_envelope_update(struct envelope *ep)
 	return (r);
 }
 
+/*
+ * Same as queue_envelope_update() for the bookkeeping of a temporary
+ * failure, which the backend may store more cheaply at the expense of
+ * losing the last updates on a crash.
+ */
+int
+queue_envelope_retry(struct envelope *ep)
+{
+	char	evpbuf[sizeof(struct envelope)];
+	size_t	evplen;
+	int	r;
+
+	if (handler_envelope_retry == NULL)
+		return (queue_envelope_update(ep));
+
+	evplen = queue_envelope_dump_buffer(ep, evpbuf, sizeof evpbuf);
+	if (evplen == 0)
+		return (0);
+
+	profile_enter("queue_envelope_retry");
+	r = handler_envelope_retry(ep->id, evpbuf, evplen);
+	profile_leave();
+
+	if (r && env->sc_queue_flags & QUEUE_EVPCACHE)
+		queue_envelope_cache_update(ep);
+	if (r)
+		queue_envelope_summary(ep);
+
+	log_trace(TRACE_QUEUE,
+	    "queue-backend: queue_envelope_retry(%016"PRIx64") -> %d",
+	    ep->id, r);
+
+	return (r);
+}
+
 int
 queue_message_walk(struct envelope *ep, uint32_t msgid, int *done, void **data)
 {
@@ -641,6 +1107,7 @@ queue_message_walk(struct envelope *ep, uint32_t msgid, int *done, void **data)
 			 * strict checks in caching. Envelopes could anyway
 			 * be loaded from backend if it isn't cached.
 			 */
+			queue_envelope_summary(ep);
 			return (1);
 		}
 		log_warnx("warn: invalid envelope %016" PRIx64 ": %s",
@@ -673,6 +1140,7 @@ queue_envelope_walk(struct envelope *ep)
 			ep->id = evpid;
 			if (env->sc_queue_flags & QUEUE_EVPCACHE)
 				queue_envelope_cache_add(ep);
+			queue_envelope_summary(ep);
 			return (1);
 		}
 		log_warnx("warn: invalid envelope %016" PRIx64 ": %s",
@@ -681,13 +1149,89 @@ queue_envelope_walk(struct envelope *ep)
 	return (0);
 }
 
+/*
+ * The backend may keep a summary of the queued envelopes, for smtpctl
+ * to list the queue while smtpd is not running.  It is stored in clear,
+ * so an encrypted queue has none.
+ */
+static void
+queue_envelope_summary(struct envelope *ep)
+{
+	char	buf[sizeof(struct envelope)];
+	size_t	len;
+
+	if (handler_envelope_summary == NULL ||
+	    env->sc_queue_flags & QUEUE_ENCRYPTION)
+		return;
+
+	if (!envelope_dump_binary_fields(ep, ENVELOPE_FIELDS_SUMMARY, buf,
+	    sizeof buf, &len))
+		return;
+
+	profile_enter("queue_envelope_summary");
+	handler_envelope_summary(ep->id, buf, len);
+	profile_leave();
+}
+
+/*
+ * Only the fields shown by smtpctl are loaded.  Without a usable summary,
+ * the caller walks the envelopes instead.
+ */
+int
+queue_summary_open(void)
+{
+	int	r;
+
+	if (handler_summary_open == NULL)
+		return (0);
+
+	r = handler_summary_open();
+
+	log_trace(TRACE_QUEUE, "queue-backend: queue_summary_open() -> %d", r);
+
+	return (r);
+}
+
+int
+queue_summary_walk(struct envelope *ep)
+{
+	char		 buf[sizeof(struct envelope)];
+	uint64_t	 evpid;
+	int		 r;
+
+	r = handler_summary_walk(&evpid, buf, sizeof buf);
+	if (r == -1)
+		return (r);
+
+	if (r && envelope_load_binary_fields(ep, buf, r, NULL, 0)) {
+		ep->id = evpid;
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Ids are handed out in sequence from a random starting point, so that
+ * a running queue never hands out the same one twice.  The top byte of
+ * a msgid, which picks the queue bucket, follows the clock instead:
+ * messages queued around the same time end up in the same directory.
+ */
 uint32_t
 queue_generate_msgid(void)
 {
-	uint32_t msgid;
+	static uint32_t	seq;
+	static int	init;
+	uint32_t	msgid;
+
+	if (!init) {
+		seq = arc4random();
+		init = 1;
+	}
 
-	while ((msgid = arc4random()) == 0)
-		;
+	do {
+		msgid = (time(NULL) / MSGID_BUCKET_PERIOD & 0xff) << 24;
+		msgid |= seq++ & 0x00ffffff;
+	} while (msgid == 0);
 
 	return msgid;
 }
@@ -695,15 +1239,21 @@ queue_generate_msgid(void)
 uint64_t
 queue_generate_evpid(uint32_t msgid)
 {
-	uint32_t rnd;
-	uint64_t evpid;
+	static uint32_t	seq;
+	static int	init;
+	uint64_t	evpid;
+
+	if (!init) {
+		seq = arc4random();
+		init = 1;
+	}
 
-	while ((rnd = arc4random()) == 0)
-		;
+	if (seq == 0)
+		seq++;
 
 	evpid = msgid;
 	evpid <<= 32;
-	evpid |= rnd;
+	evpid |= seq++;
 
 	return evpid;
 }
@@ -727,7 +1277,7 @@ envelope_validate(struct envelope *ep)
 	if (memchr(ep->errorline, '\0', sizeof(ep->errorline)) == NULL)
 		return "invalid error line";
 
-	if (dict_get(env->sc_dispatchers, ep->dispatcher) == NULL)
+	if (hdict_get(env->sc_dispatchers, ep->dispatcher) == NULL)
 		return "unknown dispatcher";
 
 	return NULL;
@@ -763,6 +1313,18 @@ queue_api_on_message_fd_r(int(*cb)(uint32_t))
 	handler_message_fd_r = cb;
 }
 
+void
+queue_api_on_message_index(int(*cb)(uint32_t, const char *, size_t))
+{
+	handler_message_index = cb;
+}
+
+void
+queue_api_on_message_index_load(int(*cb)(uint32_t, char *, size_t))
+{
+	handler_message_index_load = cb;
+}
+
 void
 queue_api_on_envelope_create(int(*cb)(uint32_t, const char *, size_t, uint64_t *))
 {
@@ -775,12 +1337,24 @@ queue_api_on_envelope_delete(int(*cb)(uint64_t))
 	handler_envelope_delete = cb;
 }
 
+void
+queue_api_on_envelope_delete_batch(int(*cb)(const uint64_t *, size_t))
+{
+	handler_envelope_delete_batch = cb;
+}
+
 void
 queue_api_on_envelope_update(int(*cb)(uint64_t, const char *, size_t))
 {
 	handler_envelope_update = cb;
 }
 
+void
+queue_api_on_envelope_retry(int(*cb)(uint64_t, const char *, size_t))
+{
+	handler_envelope_retry = cb;
+}
+
 void
 queue_api_on_envelope_load(int(*cb)(uint64_t, char *, size_t))
 {
@@ -799,3 +1373,21 @@ queue_api_on_message_walk(int(*cb)(uint64_t *, char *, size_t,
 {
 	handler_message_walk = cb;
 }
+
+void
+queue_api_on_envelope_summary(int(*cb)(uint64_t, const char *, size_t))
+{
+	handler_envelope_summary = cb;
+}
+
+void
+queue_api_on_summary_open(int(*cb)(void))
+{
+	handler_summary_open = cb;
+}
+
+void
+queue_api_on_summary_walk(int(*cb)(uint64_t *, char *, size_t))
+{
+	handler_summary_walk = cb;
+}
@@ -0,0 +1,988 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_DB_H
+#include <db.h>
+#elif defined(HAVE_DB1_DB_H)
+#include <db1/db.h>
+#elif defined(HAVE_DB_185_H)
+#include <db_185.h>
+#endif
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+/*
+ * Envelopes are kept in a single db(3) btree keyed by evpid, stored
+ * big-endian so that keys sort by msgid first: walking the queue is a
+ * cursor scan, and walking a message is a range scan from msgid << 32.
+ * Message bodies are plain files in hashed buckets.
+ *
+ * db(3) has no transactions and writes pages in place whenever its
+ * cache is full, so a tree caught in a crash can be torn.  The tree
+ * the queue works on is a scratch copy, rebuilt at startup from the
+ * last checkpoint, a snapshot of the tree which is never modified,
+ * and the journal.  The changes of an operation, e.g. all the envelopes
+ * of a committed message, are appended to the journal as a single
+ * record and synced before the operation returns, hence before it is
+ * acknowledged, then applied to the scratch tree.  Once the journal
+ * outgrows the snapshot, a new one is written aside and renamed over
+ * it, after which the journal is emptied.  Replaying the journal goes
+ * in order and the last change to an envelope wins, so it is harmless
+ * over a snapshot which already has its changes, and a torn record is
+ * dropped as a whole.
+ *
+ * The envelopes of an incoming message are kept in memory until the
+ * message is committed.
+ */
+#define	PATH_DB			"/db"
+#define	PATH_DB_ENVELOPES	PATH_DB "/envelopes.db"
+#define	PATH_DB_TREE		PATH_DB "/tree"
+#define	PATH_DB_TREE_DB		PATH_DB_TREE "/envelopes.db"
+#define	PATH_DB_CHECKPOINT	PATH_DB "/checkpoint"
+#define	PATH_DB_CHECKPOINT_DB	PATH_DB_CHECKPOINT "/envelopes.db"
+#define	PATH_DB_JOURNAL		PATH_DB "/journal"
+
+#define	QDB_MAGIC		0x4c424451	/* "QDBL" */
+#define	QDB_JOURNAL_MIN		(4 * 1024 * 1024)
+
+enum {
+	QDB_PUT = 1,
+	QDB_DEL,
+};
+
+/* a record: header, changes, then a checksum of the changes */
+struct qdb_header {
+	uint32_t	magic;
+	uint32_t	count;
+	uint64_t	len;
+};
+
+struct qdb_change {
+	uint32_t	type;
+	uint32_t	len;
+	uint64_t	evpid;
+};
+
+struct qdb_envelope {
+	char		*buf;
+	size_t		 len;
+};
+
+struct qdb_incoming {
+	struct tree	 envelopes;
+};
+
+static int	qdb_setup(void);
+static DB	*qdb_create(char *, const char *);
+static int	qdb_load(void);
+static void	qdb_replay(void);
+static void	qdb_key(DBT *, uint8_t *, uint64_t);
+static uint64_t	qdb_evpid(const DBT *);
+static int	qdb_put(uint64_t, const char *, size_t);
+static int	qdb_del(uint64_t);
+static void	qdb_log(uint32_t, uint64_t, const char *, size_t);
+static int	qdb_commit(void);
+static void	qdb_abort(void);
+static void	qdb_apply(const char *, size_t);
+static uint32_t	qdb_sum(const void *, size_t);
+static int	qdb_checkpoint(void);
+static void	qdb_checkpoint_cb(int, short, void *);
+static int	qdb_seek(uint64_t, uint64_t *, char *, size_t);
+static void	qdb_message_path(uint32_t, char *, size_t);
+static void	qdb_message_gc(uint32_t);
+static void	qdb_envelope_set(struct qdb_incoming *, uint64_t,
+    const char *, size_t);
+static void	qdb_incoming_free(struct qdb_incoming *);
+
+static DB		*db;
+static int		 jfd = -1;
+static off_t		 jsize;
+static off_t		 snapsize;
+static struct tree	 incoming;
+static struct event	 ev_checkpoint;
+
+/* the changes of the operation in progress */
+static char		*changes;
+static size_t		 changes_len;
+static size_t		 changes_size;
+static uint32_t		 changes_count;
+
+static uint32_t
+qdb_sum(const void *buf, size_t len)
+{
+	const uint8_t	*p = buf;
+	uint32_t	 sum = 2166136261U;
+
+	/* FNV-1a */
+	while (len--) {
+		sum ^= *p++;
+		sum *= 16777619;
+	}
+	return (sum);
+}
+
+static int
+qdb_setup(void)
+{
+	if (db)
+		return (1);
+
+	/* opened lazily, once the queue process is in its chroot */
+	if ((db = qdb_create(PATH_DB_TREE, PATH_DB_TREE_DB)) == NULL)
+		return (0);
+	if (!qdb_load()) {
+		db->close(db);
+		db = NULL;
+		return (0);
+	}
+	jfd = open(PATH_DB_JOURNAL, O_CREAT|O_RDWR|O_APPEND, 0600);
+	if (jfd == -1) {
+		log_warn("warn: queue-db: open: %s", PATH_DB_JOURNAL);
+		db->close(db);
+		db = NULL;
+		return (0);
+	}
+	evtimer_set(&ev_checkpoint, qdb_checkpoint_cb, NULL);
+
+	qdb_replay();
+
+	return (1);
+}
+
+/*
+ * Create a tree in a directory of its own, emptied first: db(3) may
+ * leave files of its own behind when interrupted, and wait for them.
+ */
+static DB *
+qdb_create(char *dir, const char *path)
+{
+	BTREEINFO	 info;
+	DB		*t;
+
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		log_warn("warn: queue-db: mkdir: %s", dir);
+		return (NULL);
+	}
+	if (rmtree(dir, 1) == -1)
+		return (NULL);
+
+	memset(&info, 0, sizeof(info));
+	t = dbopen(path, O_CREAT|O_EXCL|O_RDWR, 0600, DB_BTREE, &info);
+	if (t == NULL)
+		log_warn("warn: queue-db: dbopen: %s", path);
+	return (t);
+}
+
+/* copy the last checkpoint into the scratch tree */
+static int
+qdb_load(void)
+{
+	DB		*snap;
+	DBT		 key, val;
+	struct stat	 sb;
+	int		 r;
+
+	snap = dbopen(PATH_DB_ENVELOPES, O_RDONLY, 0600, DB_BTREE, NULL);
+	if (snap == NULL) {
+		if (errno == ENOENT)
+			return (1);
+		log_warn("warn: queue-db: dbopen: %s", PATH_DB_ENVELOPES);
+		return (0);
+	}
+	for (r = snap->seq(snap, &key, &val, R_FIRST); r == 0;
+	    r = snap->seq(snap, &key, &val, R_NEXT))
+		if (db->put(db, &key, &val, 0) == -1)
+			break;
+	snap->close(snap);
+	if (r != 1) {
+		log_warn("warn: queue-db: %s", PATH_DB_ENVELOPES);
+		return (0);
+	}
+	if (stat(PATH_DB_ENVELOPES, &sb) == 0)
+		snapsize = sb.st_size;
+	return (1);
+}
+
+/* apply the complete records of the journal, drop the rest */
+static void
+qdb_replay(void)
+{
+	struct qdb_header	 h;
+	struct stat		 sb;
+	char			*buf;
+	uint32_t		 sum;
+	off_t			 off;
+	size_t			 n;
+
+	if (fstat(jfd, &sb) == -1)
+		fatal("queue-db: fstat");
+
+	for (off = 0; off < sb.st_size; off += n) {
+		if ((uint64_t)(sb.st_size - off) < sizeof(h) + sizeof(sum) ||
+		    pread(jfd, &h, sizeof(h), off) != sizeof(h) ||
+		    h.magic != QDB_MAGIC ||
+		    h.len > (uint64_t)(sb.st_size - off) - sizeof(h) -
+		    sizeof(sum))
+			break;
+		n = sizeof(h) + h.len + sizeof(sum);
+		buf = xmalloc(h.len + sizeof(sum));
+		if (pread(jfd, buf, h.len + sizeof(sum), off + sizeof(h)) !=
+		    (ssize_t)(h.len + sizeof(sum))) {
+			free(buf);
+			break;
+		}
+		memcpy(&sum, buf + h.len, sizeof(sum));
+		if (sum != qdb_sum(buf, h.len)) {
+			free(buf);
+			break;
+		}
+		qdb_apply(buf, h.len);
+		free(buf);
+	}
+	if (off < sb.st_size)
+		log_warnx("warn: queue-db: dropping the journal from %lld",
+		    (long long)off);
+
+	/* start afresh, there is no appending after a torn record */
+	jsize = sb.st_size;
+	if (jsize && !qdb_checkpoint())
+		fatalx("queue-db: could not replay the journal");
+}
+
+static void
+qdb_key(DBT *key, uint8_t *buf, uint64_t evpid)
+{
+	int	i;
+
+	for (i = 7; i >= 0; i--) {
+		buf[i] = evpid & 0xff;
+		evpid >>= 8;
+	}
+	key->data = buf;
+	key->size = sizeof(uint64_t);
+}
+
+static uint64_t
+qdb_evpid(const DBT *key)
+{
+	const uint8_t	*buf = key->data;
+	uint64_t	 evpid;
+	size_t		 i;
+
+	evpid = 0;
+	for (i = 0; i < key->size && i < sizeof(uint64_t); i++)
+		evpid = (evpid << 8) | buf[i];
+	return (evpid);
+}
+
+static int
+qdb_put(uint64_t evpid, const char *buf, size_t len)
+{
+	DBT	key, val;
+	uint8_t	kbuf[sizeof(uint64_t)];
+
+	qdb_key(&key, kbuf, evpid);
+	val.data = (void *)buf;
+	val.size = len;
+	if (db->put(db, &key, &val, 0) == -1) {
+		log_warn("warn: queue-db: put");
+		return (0);
+	}
+	return (1);
+}
+
+static int
+qdb_del(uint64_t evpid)
+{
+	DBT	key;
+	uint8_t	kbuf[sizeof(uint64_t)];
+
+	qdb_key(&key, kbuf, evpid);
+	if (db->del(db, &key, 0) == -1) {
+		log_warn("warn: queue-db: del");
+		return (0);
+	}
+	return (1);
+}
+
+static void
+qdb_log(uint32_t type, uint64_t evpid, const char *buf, size_t len)
+{
+	struct qdb_change	 c;
+	char			*p;
+	size_t			 need;
+
+	need = changes_len + sizeof(c) + len;
+	if (need > changes_size) {
+		if ((p = realloc(changes, need * 2)) == NULL)
+			fatal("qdb_log: realloc");
+		changes = p;
+		changes_size = need * 2;
+	}
+
+	memset(&c, 0, sizeof(c));
+	c.type = type;
+	c.len = len;
+	c.evpid = evpid;
+	memcpy(changes + changes_len, &c, sizeof(c));
+	if (len)
+		memcpy(changes + changes_len + sizeof(c), buf, len);
+	changes_len = need;
+	changes_count++;
+}
+
+/*
+ * Write the changes logged so far as one record and sync it, then
+ * apply them to the tree.  Once this returns, the operation survives
+ * a crash.
+ */
+static int
+qdb_commit(void)
+{
+	struct qdb_header	 h;
+	struct iovec		 iov[3];
+	struct timeval		 tv;
+	uint32_t		 sum;
+	ssize_t			 n;
+
+	if (changes_count == 0)
+		return (1);
+
+	memset(&h, 0, sizeof(h));
+	h.magic = QDB_MAGIC;
+	h.count = changes_count;
+	h.len = changes_len;
+	sum = qdb_sum(changes, changes_len);
+
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = changes;
+	iov[1].iov_len = changes_len;
+	iov[2].iov_base = &sum;
+	iov[2].iov_len = sizeof(sum);
+
+	do {
+		n = writev(jfd, iov, 3);
+	} while (n == -1 && errno == EINTR);
+	if (n != (ssize_t)(sizeof(h) + changes_len + sizeof(sum))) {
+		if (n == -1)
+			log_warn("warn: queue-db: writev");
+		else
+			log_warnx("warn: queue-db: short write");
+		goto fail;
+	}
+	if (fsync(jfd) == -1) {
+		log_warn("warn: queue-db: fsync");
+		goto fail;
+	}
+	jsize += n;
+
+	qdb_apply(changes, changes_len);
+	qdb_abort();
+
+	/* run once the pending imsgs have been processed */
+	if (jsize > snapsize && jsize > QDB_JOURNAL_MIN &&
+	    !evtimer_pending(&ev_checkpoint, NULL)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_checkpoint, &tv);
+	}
+	return (1);
+
+fail:
+	if (ftruncate(jfd, jsize) == -1)
+		fatal("queue-db: ftruncate");
+	qdb_abort();
+	return (0);
+}
+
+static void
+qdb_abort(void)
+{
+	changes_len = 0;
+	changes_count = 0;
+}
+
+static void
+qdb_apply(const char *buf, size_t len)
+{
+	struct qdb_change	c;
+	size_t			off;
+	int			r;
+
+	for (off = 0; off + sizeof(c) <= len; off += sizeof(c) + c.len) {
+		memcpy(&c, buf + off, sizeof(c));
+		if (c.len > len - off - sizeof(c))
+			fatalx("queue-db: bad journal record");
+		if (c.type == QDB_PUT)
+			r = qdb_put(c.evpid, buf + off + sizeof(c), c.len);
+		else
+			r = qdb_del(c.evpid);
+		/* the tree is behind the journal, which cannot be undone */
+		if (!r)
+			fatalx("queue-db: could not apply the journal");
+	}
+}
+
+/*
+ * Write the scratch tree aside and rename it over the snapshot, which
+ * makes the journal useless.
+ */
+static int
+qdb_checkpoint(void)
+{
+	DB		*snap;
+	DBT		 key, val;
+	struct stat	 sb;
+	int		 fd, r;
+
+	if ((snap = qdb_create(PATH_DB_CHECKPOINT, PATH_DB_CHECKPOINT_DB)) == NULL)
+		return (0);
+	for (r = db->seq(db, &key, &val, R_FIRST); r == 0;
+	    r = db->seq(db, &key, &val, R_NEXT))
+		if (snap->put(snap, &key, &val, 0) == -1)
+			break;
+	if (r != 1) {
+		log_warn("warn: queue-db: checkpoint");
+		snap->close(snap);
+		goto fail;
+	}
+	if (snap->close(snap) == -1) {
+		log_warn("warn: queue-db: close");
+		goto fail;
+	}
+
+	if ((fd = open(PATH_DB_CHECKPOINT_DB, O_RDONLY)) == -1 ||
+	    fsync(fd) == -1 || fstat(fd, &sb) == -1) {
+		log_warn("warn: queue-db: %s", PATH_DB_CHECKPOINT_DB);
+		if (fd != -1)
+			close(fd);
+		goto fail;
+	}
+	close(fd);
+	if (rename(PATH_DB_CHECKPOINT_DB, PATH_DB_ENVELOPES) == -1) {
+		log_warn("warn: queue-db: rename");
+		goto fail;
+	}
+	if ((fd = open(PATH_DB, O_RDONLY)) == -1 || fsync(fd) == -1) {
+		log_warn("warn: queue-db: %s", PATH_DB);
+		if (fd != -1)
+			close(fd);
+		return (0);
+	}
+	close(fd);
+	snapsize = sb.st_size;
+
+	if (ftruncate(jfd, 0) == -1 || fsync(jfd) == -1) {
+		log_warn("warn: queue-db: journal");
+		return (0);
+	}
+	jsize = 0;
+	if (evtimer_pending(&ev_checkpoint, NULL))
+		evtimer_del(&ev_checkpoint);
+	return (1);
+
+fail:
+	(void)rmtree(PATH_DB_CHECKPOINT, 1);
+	return (0);
+}
+
+static void
+qdb_checkpoint_cb(int fd, short event, void *p)
+{
+	(void)qdb_checkpoint();
+}
+
+/* first envelope at or after evpid */
+static int
+qdb_seek(uint64_t evpid, uint64_t *found, char *buf, size_t len)
+{
+	DBT	key, val;
+	uint8_t	kbuf[sizeof(uint64_t)];
+	int	r;
+
+	qdb_key(&key, kbuf, evpid);
+	if ((r = db->seq(db, &key, &val, R_CURSOR)) == -1) {
+		log_warn("warn: queue-db: seq");
+		return (-1);
+	}
+	if (r == 1)
+		return (0);
+
+	*found = qdb_evpid(&key);
+	if (val.size > len) {
+		log_warnx("warn: queue-db: envelope %016"PRIx64" too large",
+		    *found);
+		return (-1);
+	}
+	memcpy(buf, val.data, val.size);
+	return (val.size);
+}
+
+static void
+qdb_message_path(uint32_t msgid, char *buf, size_t len)
+{
+	if (!bsnprintf(buf, len, "%s/%02x/%08x", PATH_DB,
+	    (msgid & 0xff000000) >> 24, msgid))
+		fatalx("qdb_message_path: path does not fit buffer");
+}
+
+/* remove the message once its last envelope is gone */
+static void
+qdb_message_gc(uint32_t msgid)
+{
+	DBT	key, val;
+	uint8_t	kbuf[sizeof(uint64_t)];
+	char	path[PATH_MAX];
+	int	r;
+
+	qdb_key(&key, kbuf, (uint64_t)msgid << 32);
+	if ((r = db->seq(db, &key, &val, R_CURSOR)) == -1) {
+		log_warn("warn: queue-db: seq");
+		return;
+	}
+	if (r == 0 && evpid_to_msgid(qdb_evpid(&key)) == msgid)
+		return;
+
+	qdb_message_path(msgid, path, sizeof(path));
+	if (unlink(path) == -1 && errno != ENOENT)
+		log_warn("warn: queue-db: unlink: %s", path);
+}
+
+static void
+qdb_envelope_set(struct qdb_incoming *in, uint64_t evpid, const char *buf,
+    size_t len)
+{
+	struct qdb_envelope	*e;
+
+	if ((e = tree_get(&in->envelopes, evpid)) == NULL) {
+		e = xcalloc(1, sizeof(*e));
+		tree_xset(&in->envelopes, evpid, e);
+	}
+	free(e->buf);
+	e->buf = xmemdup(buf, len);
+	e->len = len;
+}
+
+static void
+qdb_incoming_free(struct qdb_incoming *in)
+{
+	struct qdb_envelope	*e;
+
+	while (tree_poproot(&in->envelopes, NULL, (void **)&e)) {
+		free(e->buf);
+		free(e);
+	}
+	free(in);
+}
+
+static int
+queue_db_message_create(uint32_t *msgid)
+{
+	struct qdb_incoming	*in;
+	char			 path[PATH_MAX];
+	struct stat		 sb;
+
+	if (!qdb_setup())
+		return (0);
+
+	for (;;) {
+		*msgid = queue_generate_msgid();
+		if (tree_check(&incoming, *msgid))
+			continue;
+		qdb_message_path(*msgid, path, sizeof(path));
+		if (stat(path, &sb) == 0)
+			continue;
+		if (errno != ENOENT) {
+			log_warn("warn: queue-db: stat");
+			*msgid = 0;
+			return (0);
+		}
+		break;
+	}
+
+	in = xcalloc(1, sizeof(*in));
+	tree_init(&in->envelopes);
+	tree_xset(&incoming, *msgid, in);
+
+	return (1);
+}
+
+static int
+queue_db_message_commit(uint32_t msgid, const char *path)
+{
+	struct qdb_incoming	*in;
+	struct qdb_envelope	*e;
+	char			 msgpath[PATH_MAX];
+	char			*p;
+	uint64_t		 evpid;
+	void			*iter;
+
+	if (!qdb_setup())
+		return (0);
+
+	if ((in = tree_get(&incoming, msgid)) == NULL) {
+		log_warnx("warn: queue-db: msgid not found");
+		return (0);
+	}
+
+	qdb_message_path(msgid, msgpath, sizeof(msgpath));
+	if (rename(path, msgpath) == -1) {
+		if (errno != ENOENT) {
+			log_warn("warn: queue-db: rename");
+			return (0);
+		}
+		/* create the bucket */
+		p = strrchr(msgpath, '/');
+		*p = '\0';
+		if (mkdir(msgpath, 0700) == -1 && errno != EEXIST) {
+			log_warn("warn: queue-db: mkdir");
+			return (0);
+		}
+		*p = '/';
+		if (rename(path, msgpath) == -1) {
+			log_warn("warn: queue-db: rename");
+			return (0);
+		}
+	}
+
+	/*
+	 * The envelopes are only visible once journaled: a crash before
+	 * that leaves an orphan message file, never an envelope without
+	 * its message.
+	 */
+	iter = NULL;
+	while (tree_iter(&in->envelopes, &iter, &evpid, (void **)&e))
+		qdb_log(QDB_PUT, evpid, e->buf, e->len);
+	if (!qdb_commit())
+		goto fail;
+
+	tree_xpop(&incoming, msgid);
+	qdb_incoming_free(in);
+
+	return (1);
+
+fail:
+	if (rename(msgpath, path) == -1)
+		log_warn("warn: queue-db: rename");
+	return (0);
+}
+
+static int
+queue_db_message_delete(uint32_t msgid)
+{
+	struct qdb_incoming	*in;
+	DBT			 key, val;
+	uint8_t			 kbuf[sizeof(uint64_t)];
+	char			 path[PATH_MAX];
+	int			 r;
+
+	if (!qdb_setup())
+		return (0);
+
+	if ((in = tree_pop(&incoming, msgid)) != NULL) {
+		qdb_incoming_free(in);
+		return (1);
+	}
+
+	/* a range scan over the envelopes of the message */
+	qdb_key(&key, kbuf, (uint64_t)msgid << 32);
+	r = db->seq(db, &key, &val, R_CURSOR);
+	while (r == 0 && evpid_to_msgid(qdb_evpid(&key)) == msgid) {
+		qdb_log(QDB_DEL, qdb_evpid(&key), NULL, 0);
+		r = db->seq(db, &key, &val, R_NEXT);
+	}
+	if (r == -1) {
+		log_warn("warn: queue-db: seq");
+		qdb_abort();
+		return (0);
+	}
+	if (!qdb_commit())
+		return (0);
+
+	qdb_message_path(msgid, path, sizeof(path));
+	if (unlink(path) == -1 && errno != ENOENT)
+		log_warn("warn: queue-db: unlink: %s", path);
+
+	return (1);
+}
+
+static int
+queue_db_message_fd_r(uint32_t msgid)
+{
+	char	path[PATH_MAX];
+	int	fd;
+
+	qdb_message_path(msgid, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("warn: queue-db: open");
+		return (-1);
+	}
+
+	return (fd);
+}
+
+static int
+queue_db_envelope_create(uint32_t msgid, const char *buf, size_t len,
+    uint64_t *evpid)
+{
+	struct qdb_incoming	*in;
+	DBT			 key, val;
+	uint8_t			 kbuf[sizeof(uint64_t)];
+	int			 r;
+
+	if (!qdb_setup())
+		return (0);
+
+	in = tree_get(&incoming, msgid);
+	for (;;) {
+		*evpid = queue_generate_evpid(msgid);
+		if (in) {
+			if (tree_check(&in->envelopes, *evpid))
+				continue;
+			break;
+		}
+		qdb_key(&key, kbuf, *evpid);
+		if ((r = db->get(db, &key, &val, 0)) == -1) {
+			log_warn("warn: queue-db: get");
+			return (0);
+		}
+		if (r == 1)
+			break;
+	}
+
+	if (in) {
+		/* stored along with the message at commit time */
+		qdb_envelope_set(in, *evpid, buf, len);
+		return (1);
+	}
+
+	/* an envelope added to a committed message, e.g. a bounce */
+	qdb_log(QDB_PUT, *evpid, buf, len);
+	return (qdb_commit());
+}
+
+static int
+queue_db_envelope_delete(uint64_t evpid)
+{
+	struct qdb_incoming	*in;
+	struct qdb_envelope	*e;
+
+	if (!qdb_setup())
+		return (0);
+
+	if ((in = tree_get(&incoming, evpid_to_msgid(evpid))) != NULL) {
+		if ((e = tree_pop(&in->envelopes, evpid)) != NULL) {
+			free(e->buf);
+			free(e);
+		}
+		return (1);
+	}
+
+	qdb_log(QDB_DEL, evpid, NULL, 0);
+	if (!qdb_commit())
+		return (0);
+	qdb_message_gc(evpid_to_msgid(evpid));
+
+	return (1);
+}
+
+static int
+queue_db_envelope_delete_batch(const uint64_t *evpids, size_t n)
+{
+	size_t	i;
+
+	if (!qdb_setup())
+		return (0);
+
+	if (tree_check(&incoming, evpid_to_msgid(evpids[0]))) {
+		for (i = 0; i < n; i++)
+			if (!queue_db_envelope_delete(evpids[i]))
+				return (0);
+		return (1);
+	}
+
+	for (i = 0; i < n; i++)
+		qdb_log(QDB_DEL, evpids[i], NULL, 0);
+	if (!qdb_commit())
+		return (0);
+	qdb_message_gc(evpid_to_msgid(evpids[0]));
+
+	return (1);
+}
+
+static int
+queue_db_envelope_update(uint64_t evpid, const char *buf, size_t len)
+{
+	struct qdb_incoming	*in;
+
+	if (!qdb_setup())
+		return (0);
+
+	if ((in = tree_get(&incoming, evpid_to_msgid(evpid))) != NULL) {
+		if (!tree_check(&in->envelopes, evpid))
+			return (0);
+		qdb_envelope_set(in, evpid, buf, len);
+		return (1);
+	}
+
+	qdb_log(QDB_PUT, evpid, buf, len);
+	return (qdb_commit());
+}
+
+static int
+queue_db_envelope_load(uint64_t evpid, char *buf, size_t len)
+{
+	struct qdb_incoming	*in;
+	struct qdb_envelope	*e;
+	DBT			 key, val;
+	uint8_t			 kbuf[sizeof(uint64_t)];
+	int			 r;
+
+	if (!qdb_setup())
+		return (0);
+
+	if ((in = tree_get(&incoming, evpid_to_msgid(evpid))) != NULL) {
+		if ((e = tree_get(&in->envelopes, evpid)) == NULL ||
+		    e->len > len)
+			return (0);
+		memcpy(buf, e->buf, e->len);
+		return (e->len);
+	}
+
+	qdb_key(&key, kbuf, evpid);
+	if ((r = db->get(db, &key, &val, 0)) == -1) {
+		log_warn("warn: queue-db: get");
+		return (0);
+	}
+	if (r == 1 || val.size > len)
+		return (0);
+	memcpy(buf, val.data, val.size);
+
+	return (val.size);
+}
+
+static int
+queue_db_envelope_walk(uint64_t *evpid, char *buf, size_t len)
+{
+	static uint64_t	 next;
+	static int	 done;
+	int		 r;
+
+	if (done)
+		return (-1);
+
+	if (!qdb_setup())
+		return (-1);
+
+	/* resume from the key, entries may have gone in the meantime */
+	if ((r = qdb_seek(next, evpid, buf, len)) > 0) {
+		next = *evpid + 1;
+		return (r);
+	}
+
+	done = 1;
+	return (-1);
+}
+
+static int
+queue_db_message_walk(uint64_t *evpid, char *buf, size_t len,
+    uint32_t msgid, int *done, void **data)
+{
+	uint64_t	*next = *data;
+	int		 r;
+
+	if (*done)
+		return (-1);
+
+	if (!qdb_setup())
+		return (-1);
+
+	if (next == NULL) {
+		next = xcalloc(1, sizeof(*next));
+		*next = (uint64_t)msgid << 32;
+		*data = next;
+	}
+
+	if ((r = qdb_seek(*next, evpid, buf, len)) > 0 &&
+	    evpid_to_msgid(*evpid) == msgid) {
+		*next = *evpid + 1;
+		return (r);
+	}
+
+	free(next);
+	*data = NULL;
+	*done = 1;
+	return (-1);
+}
+
+static int
+queue_db_close(void)
+{
+	if (db == NULL)
+		return (1);
+	if (jsize)
+		(void)qdb_checkpoint();
+	return (1);
+}
+
+static int
+queue_db_init(struct passwd *pw, int server, const char *conf)
+{
+	tree_init(&incoming);
+
+	if (ckdir(PATH_SPOOL PATH_DB, 0700, pw->pw_uid, 0, server) == 0)
+		return (0);
+
+	queue_api_on_close(queue_db_close);
+	queue_api_on_message_create(queue_db_message_create);
+	queue_api_on_message_commit(queue_db_message_commit);
+	queue_api_on_message_delete(queue_db_message_delete);
+	queue_api_on_message_fd_r(queue_db_message_fd_r);
+	queue_api_on_envelope_create(queue_db_envelope_create);
+	queue_api_on_envelope_delete(queue_db_envelope_delete);
+	queue_api_on_envelope_delete_batch(queue_db_envelope_delete_batch);
+	queue_api_on_envelope_update(queue_db_envelope_update);
+	queue_api_on_envelope_load(queue_db_envelope_load);
+	queue_api_on_envelope_walk(queue_db_envelope_walk);
+	queue_api_on_message_walk(queue_db_message_walk);
+
+	return (1);
+}
+
+struct queue_backend	queue_backend_db = {
+	queue_db_init,
+};
@@ -19,28 +19,31 @@
 #include "includes.h"
 
 #include <sys/types.h>
-#if HAVE_SYS_MOUNT_H
-#include <sys/mount.h>
-#endif
 #include <sys/queue.h>
 #include <sys/tree.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#ifdef HAVE_SYS_STATFS_H
-#include <sys/statfs.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_STATVFS_H
+#include <sys/statvfs.h>
 #endif
 
 #include <dirent.h>
 #include <errno.h>
+#include <event.h>
 #include <fcntl.h>
 #include <fts.h>
 #include <inttypes.h>
 #include <pwd.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <openssl/evp.h>
+
 #include "smtpd.h"
 #include "log.h"
 
@@ -48,29 +51,159 @@
 #define PATH_INCOMING		"/incoming"
 #define PATH_EVPTMP		PATH_INCOMING "/envelope.tmp"
 #define PATH_MESSAGE		"/message"
+#define PATH_REPLICA		"/replica.%d"
+#define PATH_BODIES		"/bodies"
+#define PATH_BODY		"/body"
+#define PATH_INDEX		"/index"
+#define RETRY_SUFFIX		".retry"
+#define PATH_SUMMARY		PATH_QUEUE "/summary"
+#define PATH_SUMMARYTMP		PATH_QUEUE "/summary.tmp"
 
 /* percentage of remaining space / inodes required to accept new messages */
 #define	MINSPACE		5
 #define	MININODES		5
 
+/*
+ * Space is checked every SPACE_CHECK_MESSAGES messages or when the last
+ * check is older than SPACE_CHECK_INTERVAL, and on every message once
+ * less than twice the minimum is left.  A timer refreshes the stats.
+ */
+#define	SPACE_CHECK_MESSAGES	128
+#define	SPACE_CHECK_INTERVAL	1		/* seconds */
+#define	SPACE_STAT_INTERVAL	10		/* seconds */
+
+#define	REPLICA_FLUSH_INTERVAL	1		/* seconds */
+
+#define	BODY_GC_INTERVAL	60		/* seconds */
+#define	BODY_MINSIZE		4096		/* not worth sharing below */
+
 struct qwalk {
 	FTS	*fts;
 	int	 depth;
 };
 
-static int	fsqueue_check_space(void);
+/* the header of a retry record, followed by the envelope */
+struct fsqueue_retry {
+	uint32_t	magic;
+	uint32_t	len;
+	uint32_t	sum;
+};
+#define	RETRY_MAGIC		0x52545259
+
+/*
+ * The envelope summary is a log of records, each a header followed by
+ * the summary fields of an envelope.  The last record of an envelope
+ * wins, a deleted one has no fields.  The log starts over with each
+ * queue walk, after which a marker says it covers the whole queue.
+ */
+struct fsqueue_summary {
+	uint64_t	evpid;
+	uint32_t	magic;
+	uint32_t	kind;
+	uint32_t	len;
+	uint32_t	sum;
+};
+#define	SUMMARY_MAGIC		0x534d5259
+
+enum fsqueue_summary_kind {
+	SUMMARY_ENVELOPE,
+	SUMMARY_DELETE,
+	SUMMARY_MESSAGE_DELETE,
+	SUMMARY_WALKED,
+};
+
+/* records of an incoming message, written when it is committed */
+struct fsqueue_summary_buf {
+	char	*buf;
+	size_t	 len;
+	size_t	 size;
+	size_t	 count;
+};
+
+#define	SUMMARY_COMPACT_MIN	65536		/* records */
+
+static int	fsqueue_check_space(int);
+static int	fsqueue_statvfs(int);
+static void	fsqueue_space_timeout(int, short, void *);
 static void	fsqueue_envelope_path(uint64_t, char *, size_t);
 static void	fsqueue_envelope_incoming_path(uint64_t, char *, size_t);
-static int	fsqueue_envelope_dump(char *, const char *, size_t, int, int);
+static void	fsqueue_envelope_retry_path(uint64_t, char *, size_t);
+static int	fsqueue_retry_load(uint64_t, char *, size_t);
+static uint32_t	fsqueue_retry_sum(const char *, size_t);
+static int	fsqueue_envelope_dump(const char *, char *, const char *,
+    size_t, int, int);
 static void	fsqueue_message_path(uint32_t, char *, size_t);
 static void	fsqueue_message_incoming_path(uint32_t, char *, size_t);
+static int     *fsqueue_evpcount(uint32_t);
 static void    *fsqueue_qwalk_new(void);
 static int	fsqueue_qwalk(void *, uint64_t *);
 static void	fsqueue_qwalk_close(void *);
+static int	fsqueue_body_split(uint32_t, const char *, const char *);
+static int	fsqueue_body_hash(uint32_t, int, off_t *, char *, size_t);
+static int	fsqueue_copy_range(int, off_t, off_t, const char *);
+static int	fsqueue_cat(int, int);
+static void	fsqueue_body_gc(const char *);
+static void	fsqueue_body_timeout(int, short, void *);
+static int	fsqueue_replicate(uint32_t);
+static int	fsqueue_replica_copy(const char *, const char *);
+static int	fsqueue_replica_commit(int, uint32_t, const char *);
+static void	fsqueue_replica_envelope(uint64_t, const char *, size_t);
+static void	fsqueue_replica_message(uint32_t);
+static void	fsqueue_replica_flush(int, short, void *);
+static void	fsqueue_replica_path(int, uint32_t, char *, size_t);
+static void	fsqueue_summary_open(void);
+static void	fsqueue_summary_header(struct fsqueue_summary *, uint64_t,
+    int, const char *, size_t);
+static void	fsqueue_summary_add(uint64_t, int, const char *, size_t);
+static void	fsqueue_summary_append(const struct iovec *, int, size_t);
+static void	fsqueue_summary_commit(uint32_t);
+static void	fsqueue_summary_drop(uint32_t);
+static int	fsqueue_summary_scan(FILE *, struct tree *);
+static int	fsqueue_summary_read(FILE *, off_t, struct fsqueue_summary *,
+    char *, size_t);
+static void	fsqueue_summary_compact(void);
 
 struct tree evpcount;
+static struct tree incoming;
+static int walked;
 static struct timespec startup;
 
+struct space {
+	time_t		checked;
+	unsigned int	count;
+	int		ok;
+	int		low;
+};
+
+static struct event	ev_space;
+static struct space	space[QUEUE_SHARDS_MAX];
+
+/* changes to committed messages, mirrored to the replicas in batches */
+struct replica_op {
+	char	*buf;		/* NULL once the envelope is deleted */
+	size_t	 len;
+};
+
+static int		dedup;
+static struct event	ev_body;
+static int		ev_body_set;
+
+static int		replicas;
+static int		quorum;
+static struct tree	replica_envelopes;	/* evpid -> replica_op */
+static struct tree	replica_messages;	/* msgid -> REF */
+static struct event	ev_replica;
+static int		ev_replica_set;
+
+static int		summary;
+static int		summary_fd = -1;
+static size_t		summary_records;	/* in the log */
+static size_t		summary_compacted;	/* left by the last compaction */
+static struct tree	summary_incoming;	/* msgid -> fsqueue_summary_buf */
+static FILE	       *summary_fp;		/* smtpctl */
+static struct tree	summary_offsets;	/* evpid -> offset + 1 */
+static void	       *summary_iter;
+
 #define REF	(int*)0xf00
 
 static int
@@ -78,24 +211,39 @@ queue_fs_message_create(uint32_t *msgid)
 {
 	char		rootdir[PATH_MAX];
 	struct stat	sb;
-
-	if (!fsqueue_check_space())
-		return 0;
+	int		tries = 0;
 
 again:
 	*msgid = queue_generate_msgid();
 
-	/* prevent possible collision later when moving to Q_QUEUE */
-	fsqueue_message_path(*msgid, rootdir, sizeof(rootdir));
-	if (stat(rootdir, &sb) != -1)
-		goto again;
-
-	/* we hit an unexpected error, temporarily fail */
-	if (errno != ENOENT) {
+	/* a full shard leaves the message to the others */
+	if (!fsqueue_check_space(queue_shard(*msgid))) {
+		if (++tries < 2 * queue_shards())
+			goto again;
 		*msgid = 0;
 		return 0;
 	}
 
+	/*
+	 * prevent possible collision later when moving to Q_QUEUE: ids
+	 * do not repeat within a run, only messages left by a previous
+	 * one may be in the way, and they are all known once walked.
+	 */
+	if (walked) {
+		if (tree_check(&evpcount, *msgid))
+			goto again;
+	} else {
+		fsqueue_message_path(*msgid, rootdir, sizeof(rootdir));
+		if (stat(rootdir, &sb) != -1)
+			goto again;
+
+		/* we hit an unexpected error, temporarily fail */
+		if (errno != ENOENT) {
+			*msgid = 0;
+			return 0;
+		}
+	}
+
 	fsqueue_message_incoming_path(*msgid, rootdir, sizeof(rootdir));
 	if (mkdir(rootdir, 0700) == -1) {
 		if (errno == EEXIST)
@@ -111,6 +259,9 @@ again:
 		return 0;
 	}
 
+	/* remember the message is incoming, saves a stat() per envelope */
+	tree_xset(&incoming, *msgid, REF);
+
 	return (1);
 }
 
@@ -127,9 +278,18 @@ queue_fs_message_commit(uint32_t msgid, const char *path)
 	if (strlcat(msgpath, PATH_MESSAGE, sizeof(msgpath))
 	    >= sizeof(msgpath))
 		return (0);
-	if (rename(path, msgpath) == -1)
+	if (dedup) {
+		if (!fsqueue_body_split(msgid, path, msgpath))
+			return (0);
+	} else if (rename(path, msgpath) == -1)
 		return (0);
 
+	/* the message is only accepted once enough replicas have it */
+	if (replicas && !fsqueue_replicate(msgid))
+		return (0);
+
+	tree_pop(&incoming, msgid);
+
 	fsqueue_message_incoming_path(msgid, incomingdir, sizeof(incomingdir));
 	fsqueue_message_path(msgid, msgdir, sizeof(msgdir));
 	if (strlcpy(queuedir, msgdir, sizeof(queuedir))
@@ -137,8 +297,10 @@ queue_fs_message_commit(uint32_t msgid, const char *path)
 		return (0);
 
 	/* first attempt to rename */
-	if (rename(incomingdir, msgdir) == 0)
+	if (rename(incomingdir, msgdir) == 0) {
+		fsqueue_summary_commit(msgid);
 		return 1;
+	}
 	if (errno == ENOSPC)
 		return 0;
 	if (errno != ENOENT) {
@@ -165,16 +327,20 @@ queue_fs_message_commit(uint32_t msgid, const char *path)
 		return 0;
 	}
 
+	fsqueue_summary_commit(msgid);
 	return 1;
 }
 
 static int
 queue_fs_message_fd_r(uint32_t msgid)
 {
-	int fd;
+	int fd, bfd, out = -1;
 	char path[PATH_MAX];
+	char body[PATH_MAX];
 
 	fsqueue_message_path(msgid, path, sizeof(path));
+	if (!bsnprintf(body, sizeof(body), "%s%s", path, PATH_BODY))
+		return -1;
 	if (strlcat(path, PATH_MESSAGE, sizeof(path))
 	    >= sizeof(path))
 		return -1;
@@ -184,7 +350,87 @@ queue_fs_message_fd_r(uint32_t msgid)
 		return -1;
 	}
 
-	return fd;
+	/* a deduplicated message is put back together */
+	if ((bfd = open(body, O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			return fd;
+		log_warn("warn: queue-fs: open");
+		close(fd);
+		return -1;
+	}
+#ifdef HAVE_MEMFD_CREATE
+	out = memfd_create("smtpd", 0);
+#endif
+	if (out == -1)
+		out = mktmpfile();
+
+	if (!fsqueue_cat(out, fd) || !fsqueue_cat(out, bfd)) {
+		log_warn("warn: queue-fs: message %08"PRIx32, msgid);
+		close(out);
+		out = -1;
+	} else
+		lseek(out, 0, SEEK_SET);
+	close(fd);
+	close(bfd);
+	return out;
+}
+
+/*
+ * The header index goes in the incoming directory of the message, and
+ * moves to the queue on commit.  It is not synced: a torn index fails
+ * msgindex_open() and the message is parsed instead.
+ */
+static int
+queue_fs_message_index(uint32_t msgid, const char *buf, size_t len)
+{
+	char	path[PATH_MAX];
+	int	fd;
+
+	fsqueue_message_incoming_path(msgid, path, sizeof(path));
+	if (strlcat(path, PATH_INDEX, sizeof(path)) >= sizeof(path))
+		return (0);
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		log_warn("warn: queue-fs: open");
+		return (0);
+	}
+	if (write(fd, buf, len) != (ssize_t)len) {
+		log_warn("warn: queue-fs: write");
+		close(fd);
+		if (unlink(path) == -1)
+			log_warn("warn: queue-fs: unlink");
+		return (0);
+	}
+	if (close(fd) == -1) {
+		log_warn("warn: queue-fs: close");
+		return (0);
+	}
+	return (1);
+}
+
+static int
+queue_fs_message_index_load(uint32_t msgid, char *buf, size_t len)
+{
+	char	path[PATH_MAX];
+	ssize_t	n;
+	int	fd;
+
+	fsqueue_message_path(msgid, path, sizeof(path));
+	if (strlcat(path, PATH_INDEX, sizeof(path)) >= sizeof(path))
+		return (0);
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			log_warn("warn: queue-fs: open");
+		return (0);
+	}
+	if ((n = read(fd, buf, len)) == -1) {
+		log_warn("warn: queue-fs: read");
+		n = 0;
+	}
+	close(fd);
+
+	return (n);
 }
 
 static int
@@ -200,6 +446,12 @@ queue_fs_message_delete(uint32_t msgid)
 	if (rmtree(path, 0) == -1)
 		log_warn("warn: queue-fs: rmtree");
 
+	if (tree_pop(&incoming, msgid) == NULL) {
+		fsqueue_replica_message(msgid);
+		fsqueue_summary_add(msgid_to_evpid(msgid),
+		    SUMMARY_MESSAGE_DELETE, NULL, 0);
+	}
+	fsqueue_summary_drop(msgid);
 	tree_pop(&evpcount, msgid);
 
 	return 1;
@@ -210,17 +462,16 @@ queue_fs_envelope_create(uint32_t msgid, const char *buf, size_t len,
     uint64_t *evpid)
 {
 	char		path[PATH_MAX];
-	int		queued = 0, i, r = 0, *n;
-	struct stat	sb;
+	int		queued, i, r = 0, *n;
 
 	if (msgid == 0) {
 		log_warnx("warn: queue-fs: msgid=0, evpid=%016"PRIx64, *evpid);
 		goto done;
 	}
 
-	fsqueue_message_incoming_path(msgid, path, sizeof(path));
-	if (stat(path, &sb) == -1)
-		queued = 1;
+	queued = tree_get(&incoming, msgid) == NULL;
+	if (queued)
+		fsqueue_evpcount(msgid);
 
 	for (i = 0; i < 20; i ++) {
 		*evpid = queue_generate_evpid(msgid);
@@ -230,7 +481,8 @@ queue_fs_envelope_create(uint32_t msgid, const char *buf, size_t len,
 			fsqueue_envelope_incoming_path(*evpid, path,
 			    sizeof(path));
 
-		if ((r = fsqueue_envelope_dump(path, buf, len, 0, 0)) != 0)
+		if ((r = fsqueue_envelope_dump(queue_shard_root(
+		    queue_shard(msgid)), path, buf, len, 0, 0)) != 0)
 			goto done;
 	}
 	r = 0;
@@ -238,6 +490,9 @@ queue_fs_envelope_create(uint32_t msgid, const char *buf, size_t len,
 
 done:
 	if (r) {
+		/* envelopes of incoming messages go with the commit */
+		if (queued)
+			fsqueue_replica_envelope(*evpid, buf, len);
 		n = tree_pop(&evpcount, msgid);
 		if (n == NULL)
 			n = REF;
@@ -251,19 +506,34 @@ static int
 queue_fs_envelope_load(uint64_t evpid, char *buf, size_t len)
 {
 	char	 pathname[PATH_MAX];
-	FILE	*fp;
-	size_t	 r;
+	ssize_t	 n;
+	size_t	 r = 0;
+	int	 fd;
+
+	if ((r = fsqueue_retry_load(evpid, buf, len)) != 0)
+		return (r);
 
 	fsqueue_envelope_path(evpid, pathname, sizeof(pathname));
 
-	fp = fopen(pathname, "r");
-	if (fp == NULL) {
+	/* Envelopes are small, read them without going through stdio. */
+	if ((fd = open(pathname, O_RDONLY)) == -1) {
 		if (errno != ENOENT && errno != ENFILE)
-			log_warn("warn: queue-fs: fopen");
+			log_warn("warn: queue-fs: open");
 		return 0;
 	}
 
-	r = fread(buf, 1, len, fp);
+	while (r < len) {
+		if ((n = read(fd, buf + r, len - r)) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_warn("warn: queue-fs: read");
+			r = 0;
+			break;
+		}
+		if (n == 0)
+			break;
+		r += n;
+	}
 	if (r) {
 		if (r == len) {
 			log_warn("warn: queue-fs: too large");
@@ -272,7 +542,7 @@ queue_fs_envelope_load(uint64_t evpid, char *buf, size_t len)
 		else
 			buf[r] = '\0';
 	}
-	fclose(fp);
+	close(fd);
 
 	return (r);
 }
@@ -282,9 +552,63 @@ queue_fs_envelope_update(uint64_t evpid, const char *buf, size_t len)
 {
 	char dest[PATH_MAX];
 
+	/* a retry record would hide what is written now */
+	fsqueue_envelope_retry_path(evpid, dest, sizeof(dest));
+	if (unlink(dest) == -1 && errno != ENOENT)
+		log_warn("warn: queue-fs: unlink");
+
 	fsqueue_envelope_path(evpid, dest, sizeof(dest));
 
-	return (fsqueue_envelope_dump(dest, buf, len, 1, 1));
+	if (!fsqueue_envelope_dump(queue_shard_root(queue_shard(
+	    evpid_to_msgid(evpid))), dest, buf, len, 1, 1))
+		return (0);
+
+	fsqueue_replica_envelope(evpid, buf, len);
+	return (1);
+}
+
+/*
+ * The bookkeeping of a temporary failure goes to a record next to the
+ * envelope, rewritten in place without a sync or a rename.  A record
+ * torn by a crash fails its checksum and the envelope file, which only
+ * misses the last retries, is loaded instead.  A full update of the
+ * envelope folds the record back into the file.
+ */
+static int
+queue_fs_envelope_retry(uint64_t evpid, const char *buf, size_t len)
+{
+	struct fsqueue_retry	hdr;
+	struct iovec		iov[2];
+	char			path[PATH_MAX];
+	int			fd;
+
+	fsqueue_envelope_retry_path(evpid, path, sizeof(path));
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		log_warn("warn: queue-fs: open");
+		return (0);
+	}
+
+	hdr.magic = RETRY_MAGIC;
+	hdr.len = len;
+	hdr.sum = fsqueue_retry_sum(buf, len);
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	if (writev(fd, iov, 2) != (ssize_t)(sizeof(hdr) + len)) {
+		log_warn("warn: queue-fs: write");
+		close(fd);
+		if (unlink(path) == -1)
+			log_warn("warn: queue-fs: unlink");
+		return (0);
+	}
+	if (close(fd) == -1) {
+		log_warn("warn: queue-fs: close");
+		return (0);
+	}
+
+	fsqueue_replica_envelope(evpid, buf, len);
+	return (1);
 }
 
 static int
@@ -294,13 +618,23 @@ queue_fs_envelope_delete(uint64_t evpid)
 	uint32_t	msgid;
 	int		*n;
 
+	/* counted before the envelope goes if the message was not walked */
+	msgid = evpid_to_msgid(evpid);
+	fsqueue_evpcount(msgid);
+
 	fsqueue_envelope_path(evpid, pathname, sizeof(pathname));
 	if (unlink(pathname) == -1)
 		if (errno != ENOENT)
 			return 0;
+	fsqueue_envelope_retry_path(evpid, pathname, sizeof(pathname));
+	if (unlink(pathname) == -1 && errno != ENOENT)
+		log_warn("warn: queue-fs: unlink");
 
-	msgid = evpid_to_msgid(evpid);
-	n = tree_pop(&evpcount, msgid);
+	fsqueue_replica_envelope(evpid, NULL, 0);
+	fsqueue_summary_add(evpid, SUMMARY_DELETE, NULL, 0);
+
+	if ((n = tree_pop(&evpcount, msgid)) == NULL)
+		return (1);
 	n -= 1;
 
 	if (n - REF == 0)
@@ -311,6 +645,44 @@ queue_fs_envelope_delete(uint64_t evpid)
 	return (1);
 }
 
+/*
+ * When the envelopes are all that is left of the message, move the
+ * whole message to the purge directory instead of unlinking each file.
+ */
+static int
+queue_fs_envelope_delete_batch(const uint64_t *evpids, size_t n)
+{
+	char		path[PATH_MAX];
+	uint32_t	msgid;
+	int		*count, r;
+	size_t		i;
+
+	msgid = evpid_to_msgid(evpids[0]);
+	count = fsqueue_evpcount(msgid);
+	if (count && (size_t)(count - REF) == n &&
+	    tree_get(&incoming, msgid) == NULL) {
+		fsqueue_message_path(msgid, path, sizeof(path));
+		/* the purge directory is not on the other shards' disks */
+		if (queue_shard(msgid) == 0)
+			r = mvpurge(path, PATH_PURGE);
+		else
+			r = rmtree(path, 0);
+		if (r == 0) {
+			tree_pop(&evpcount, msgid);
+			fsqueue_replica_message(msgid);
+			fsqueue_summary_add(msgid_to_evpid(msgid),
+			    SUMMARY_MESSAGE_DELETE, NULL, 0);
+			return 1;
+		}
+		log_warn("warn: queue-fs: could not remove %s", path);
+	}
+
+	for (i = 0; i < n; i++)
+		if (!queue_fs_envelope_delete(evpids[i]))
+			return 0;
+	return 1;
+}
+
 static int
 queue_fs_message_walk(uint64_t *evpid, char *buf, size_t len,
     uint32_t msgid, int *done, void **data)
@@ -325,9 +697,7 @@ queue_fs_message_walk(uint64_t *evpid, char *buf, size_t len,
 	if (*done)
 		return (-1);
 
-	if (!bsnprintf(path, sizeof path, "%s/%02x/%08x",
-	    PATH_QUEUE, (msgid  & 0xff000000) >> 24, msgid))
-		fatalx("queue_fs_message_walk: path does not fit buffer");
+	fsqueue_message_path(msgid, path, sizeof(path));
 
 	if (dir == NULL) {
 		if ((dir = opendir(path)) == NULL) {
@@ -358,7 +728,6 @@ queue_fs_message_walk(uint64_t *evpid, char *buf, size_t len,
 			continue;
 		}
 
-		memset(buf, 0, len);
 		r = queue_fs_envelope_load(*evpid, buf, len);
 		if (r) {
 			n = tree_pop(&evpcount, msgid);
@@ -388,11 +757,15 @@ queue_fs_envelope_walk(uint64_t *evpid, char *buf, size_t len)
 	if (done)
 		return (-1);
 
-	if (hdl == NULL)
+	if (hdl == NULL) {
+		/* the walk runs once the queue event loop is set up */
+		evtimer_set(&ev_space, fsqueue_space_timeout, NULL);
+		fsqueue_space_timeout(-1, 0, NULL);
+		fsqueue_summary_open();
 		hdl = fsqueue_qwalk_new();
+	}
 
 	if (fsqueue_qwalk(hdl, evpid)) {
-		memset(buf, 0, len);
 		r = queue_fs_envelope_load(*evpid, buf, len);
 		if (r) {
 			msgid = evpid_to_msgid(*evpid);
@@ -407,19 +780,99 @@ queue_fs_envelope_walk(uint64_t *evpid, char *buf, size_t len)
 
 	fsqueue_qwalk_close(hdl);
 	done = 1;
+	walked = 1;
+	summary_compacted = summary_records;
+	fsqueue_summary_add(0, SUMMARY_WALKED, NULL, 0);
 	return (-1);
 }
 
 static int
-fsqueue_check_space(void)
+queue_fs_envelope_summary(uint64_t evpid, const char *buf, size_t len)
+{
+	fsqueue_summary_add(evpid, SUMMARY_ENVELOPE, buf, len);
+	return (1);
+}
+
+/*
+ * The summary is only used if it was started by a queue walk that went
+ * through.  Records past a torn one, left by a crash, are ignored.
+ */
+static int
+queue_fs_summary_open(void)
+{
+	if ((summary_fp = fopen(PATH_SUMMARY, "r")) == NULL)
+		return (0);
+
+	tree_init(&summary_offsets);
+	summary_iter = NULL;
+	if (fsqueue_summary_scan(summary_fp, &summary_offsets) == 1)
+		return (1);
+
+	while (tree_poproot(&summary_offsets, NULL, NULL))
+		;
+	fclose(summary_fp);
+	summary_fp = NULL;
+	return (0);
+}
+
+static int
+queue_fs_summary_walk(uint64_t *evpid, char *buf, size_t len)
 {
-#ifdef __OpenBSD__
-	struct statfs	buf;
+	struct fsqueue_summary	 hdr;
+	void			*off;
+
+	if (summary_fp == NULL)
+		return (-1);
+
+	if (!tree_iter(&summary_offsets, &summary_iter, evpid, &off)) {
+		while (tree_poproot(&summary_offsets, NULL, NULL))
+			;
+		fclose(summary_fp);
+		summary_fp = NULL;
+		return (-1);
+	}
+
+	if (!fsqueue_summary_read(summary_fp, (uintptr_t)off - 1, &hdr, buf,
+	    len))
+		return (0);
+	return (hdr.len);
+}
+
+static int
+fsqueue_check_space(int shard)
+{
+	struct space	*sp = &space[shard];
+
+	if (sp->ok && !sp->low &&
+	    ++sp->count < SPACE_CHECK_MESSAGES &&
+	    time(NULL) - sp->checked < SPACE_CHECK_INTERVAL)
+		return (sp->ok);
+
+	return (fsqueue_statvfs(shard));
+}
+
+static int
+fsqueue_statvfs(int shard)
+{
+	struct space	*sp = &space[shard];
+#ifdef HAVE_SYS_STATVFS_H
+	struct statvfs	buf;
+	char		path[PATH_MAX];
+	char		key[64];
 	uint64_t	used;
 	uint64_t	total;
-
-	if (statfs(PATH_QUEUE, &buf) == -1) {
-		log_warn("warn: queue-fs: statfs");
+	uint64_t	bfree, ffree;
+	int		ok;
+
+	sp->checked = time(NULL);
+	sp->count = 0;
+
+	(void)snprintf(path, sizeof(path), "%s%s",
+	    queue_shard_root(shard), PATH_QUEUE);
+	if (statvfs(path, &buf) == -1) {
+		log_warn("warn: queue-fs: statvfs: %s", path);
+		sp->ok = 0;
+		queue_space_update(shard, QUEUE_SPACE_FULL);
 		return 0;
 	}
 
@@ -429,8 +882,12 @@ fsqueue_check_space(void)
 	 * Some systems will set them to 0, others will set them to -1.
 	 */
 	if (buf.f_bfree == 0 || buf.f_ffree == 0 ||
-	    (int64_t)buf.f_bfree == -1 || (int64_t)buf.f_ffree == -1)
+	    (int64_t)buf.f_bfree == -1 || (int64_t)buf.f_ffree == -1) {
+		sp->ok = 1;
+		sp->low = 0;
+		queue_space_update(shard, QUEUE_SPACE_OK);
 		return 1;
+	}
 
 	used = buf.f_blocks - buf.f_bfree;
 	total = buf.f_bavail + used;
@@ -438,12 +895,7 @@ fsqueue_check_space(void)
 		used = (float)used / (float)total * 100;
 	else
 		used = 100;
-	if (100 - used < MINSPACE) {
-		log_warnx("warn: not enough disk space: %llu%% left",
-		    (unsigned long long) 100 - used);
-		log_warnx("warn: temporarily rejecting messages");
-		return 0;
-	}
+	bfree = 100 - used;
 
 	used = buf.f_files - buf.f_ffree;
 	total = buf.f_favail + used;
@@ -451,21 +903,69 @@ fsqueue_check_space(void)
 		used = (float)used / (float)total * 100;
 	else
 		used = 100;
-	if (100 - used < MININODES) {
-		log_warnx("warn: not enough inodes: %llu%% left",
-		    (unsigned long long) 100 - used);
-		log_warnx("warn: temporarily rejecting messages");
-		return 0;
+	ffree = 100 - used;
+
+	if (queue_shards() == 1) {
+		stat_set("queue.fs.space", stat_counter(bfree));
+		stat_set("queue.fs.inodes", stat_counter(ffree));
+	} else {
+		(void)snprintf(key, sizeof(key), "queue.fs.shard.%d.space",
+		    shard);
+		stat_set(key, stat_counter(bfree));
+		(void)snprintf(key, sizeof(key), "queue.fs.shard.%d.inodes",
+		    shard);
+		stat_set(key, stat_counter(ffree));
+	}
+
+	ok = 1;
+	if (bfree < MINSPACE) {
+		if (sp->ok)
+			log_warnx("warn: not enough disk space on %s: "
+			    "%llu%% left", path, (unsigned long long)bfree);
+		ok = 0;
+	}
+	if (ffree < MININODES) {
+		if (sp->ok)
+			log_warnx("warn: not enough inodes on %s: "
+			    "%llu%% left", path, (unsigned long long)ffree);
+		ok = 0;
 	}
+	if (sp->ok && !ok)
+		log_warnx("warn: temporarily rejecting messages on %s", path);
+	else if (!sp->ok && ok)
+		log_info("info: queue-fs: accepting messages on %s again",
+		    path);
+
+	sp->ok = ok;
+	sp->low = bfree < 2 * MINSPACE || ffree < 2 * MININODES;
+	queue_space_update(shard, !sp->ok ? QUEUE_SPACE_FULL :
+	    sp->low ? QUEUE_SPACE_LOW : QUEUE_SPACE_OK);
+#else
+	sp->ok = 1;
 #endif
 
-	return 1;
+	return sp->ok;
+}
+
+static void
+fsqueue_space_timeout(int fd, short event, void *p)
+{
+	struct timeval	tv;
+	int		i;
+
+	for (i = 0; i < queue_shards(); i++)
+		(void)fsqueue_statvfs(i);
+
+	tv.tv_sec = SPACE_STAT_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_space, &tv);
 }
 
 static void
 fsqueue_envelope_path(uint64_t evpid, char *buf, size_t len)
 {
-	if (!bsnprintf(buf, len, "%s/%02x/%08x/%016" PRIx64,
+	if (!bsnprintf(buf, len, "%s%s/%02x/%08x/%016" PRIx64,
+		queue_shard_root(queue_shard(evpid_to_msgid(evpid))),
 		PATH_QUEUE,
 		(evpid_to_msgid(evpid) & 0xff000000) >> 24,
 		evpid_to_msgid(evpid),
@@ -476,51 +976,108 @@ fsqueue_envelope_path(uint64_t evpid, char *buf, size_t len)
 static void
 fsqueue_envelope_incoming_path(uint64_t evpid, char *buf, size_t len)
 {
-	if (!bsnprintf(buf, len, "%s/%08x/%016" PRIx64,
+	if (!bsnprintf(buf, len, "%s%s/%08x/%016" PRIx64,
+		queue_shard_root(queue_shard(evpid_to_msgid(evpid))),
 		PATH_INCOMING,
 		evpid_to_msgid(evpid),
 		evpid))
 		fatalx("fsqueue_envelope_incoming_path: path does not fit buffer");
 }
 
+static void
+fsqueue_envelope_retry_path(uint64_t evpid, char *buf, size_t len)
+{
+	fsqueue_envelope_path(evpid, buf, len);
+	if (strlcat(buf, RETRY_SUFFIX, len) >= len)
+		fatalx("fsqueue_envelope_retry_path: path does not fit buffer");
+}
+
 static int
-fsqueue_envelope_dump(char *dest, const char *evpbuf, size_t evplen,
-    int do_atomic, int do_sync)
+fsqueue_retry_load(uint64_t evpid, char *buf, size_t len)
 {
-	const char     *path = do_atomic ? PATH_EVPTMP : dest;
-	FILE	       *fp = NULL;
-	int		fd;
-	size_t		w;
+	struct fsqueue_retry	hdr;
+	char			path[PATH_MAX];
+	int			fd, r = 0;
 
-	if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1) {
-		log_warn("warn: queue-fs: open");
-		goto tempfail;
+	fsqueue_envelope_retry_path(evpid, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno != ENOENT && errno != ENFILE)
+			log_warn("warn: queue-fs: open");
+		return (0);
 	}
 
-	if ((fp = fdopen(fd, "w")) == NULL) {
-		log_warn("warn: queue-fs: fdopen");
-		goto tempfail;
+	if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+	    hdr.magic == RETRY_MAGIC && hdr.len && hdr.len < len &&
+	    read(fd, buf, hdr.len) == (ssize_t)hdr.len &&
+	    fsqueue_retry_sum(buf, hdr.len) == hdr.sum) {
+		buf[hdr.len] = '\0';
+		r = hdr.len;
 	}
+	else
+		log_warnx("warn: queue-fs: ignoring torn retry record of "
+		    "%016"PRIx64, evpid);
+	close(fd);
 
-	w = fwrite(evpbuf, 1, evplen, fp);
-	if (w < evplen) {
-		log_warn("warn: queue-fs: short write");
-		goto tempfail;
+	return (r);
+}
+
+/* FNV-1a, enough to tell a torn record */
+static uint32_t
+fsqueue_retry_sum(const char *buf, size_t len)
+{
+	uint32_t	h = 2166136261U;
+
+	while (len--) {
+		h ^= (unsigned char)*buf++;
+		h *= 16777619;
+	}
+	return (h);
+}
+
+static int
+fsqueue_envelope_dump(const char *root, char *dest, const char *evpbuf,
+    size_t evplen, int do_atomic, int do_sync)
+{
+	char		tmp[PATH_MAX];
+	const char     *path = dest;
+	int		fd;
+	ssize_t		w;
+
+	/* the temporary file must be on the same filesystem as dest */
+	if (do_atomic) {
+		if (!bsnprintf(tmp, sizeof(tmp), "%s%s", root, PATH_EVPTMP))
+			return (0);
+		path = tmp;
 	}
-	if (fflush(fp)) {
-		log_warn("warn: queue-fs: fflush");
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1) {
+		log_warn("warn: queue-fs: open");
 		goto tempfail;
 	}
-	if (do_sync && fsync(fileno(fp))) {
+
+	/*
+	 * envelopes are small and written in one go, there is no point
+	 * in going through stdio buffering for each of them.
+	 */
+	while (evplen) {
+		if ((w = write(fd, evpbuf, evplen)) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_warn("warn: queue-fs: write");
+			goto tempfail;
+		}
+		evpbuf += w;
+		evplen -= w;
+	}
+	if (do_sync && fsync(fd)) {
 		log_warn("warn: queue-fs: fsync");
 		goto tempfail;
 	}
-	if (fclose(fp) != 0) {
-		log_warn("warn: queue-fs: fclose");
-		fp = NULL;
+	if (close(fd) == -1) {
+		log_warn("warn: queue-fs: close");
+		fd = -1;
 		goto tempfail;
 	}
-	fp = NULL;
 	fd = -1;
 
 	if (do_atomic && rename(path, dest) == -1) {
@@ -530,9 +1087,7 @@ fsqueue_envelope_dump(char *dest, const char *evpbuf, size_t evplen,
 	return (1);
 
 tempfail:
-	if (fp)
-		fclose(fp);
-	else if (fd != -1)
+	if (fd != -1)
 		close(fd);
 	if (unlink(path) == -1)
 		log_warn("warn: queue-fs: unlink");
@@ -542,17 +1097,60 @@ tempfail:
 static void
 fsqueue_message_path(uint32_t msgid, char *buf, size_t len)
 {
-	if (!bsnprintf(buf, len, "%s/%02x/%08x",
+	if (!bsnprintf(buf, len, "%s%s/%02x/%08x",
+		queue_shard_root(queue_shard(msgid)),
 		PATH_QUEUE,
 		(msgid & 0xff000000) >> 24,
 		msgid))
 		fatalx("fsqueue_message_path: path does not fit buffer");
 }
 
+/*
+ * The envelope count of a message, as an offset from REF.  Messages
+ * the queue did not walk, such as those taken over from the previous
+ * generation on a reload, are counted from their directory the first
+ * time.
+ */
+static int *
+fsqueue_evpcount(uint32_t msgid)
+{
+	struct dirent	*dp;
+	DIR		*dir;
+	char		 path[PATH_MAX];
+	char		 msgid_str[9];
+	int		*n;
+
+	if ((n = tree_get(&evpcount, msgid)) != NULL)
+		return (n);
+	if (tree_get(&incoming, msgid))
+		return (NULL);
+
+	fsqueue_message_path(msgid, path, sizeof(path));
+	if ((dir = opendir(path)) == NULL) {
+		if (errno != ENOENT)
+			log_warn("warn: queue-fs: opendir: %s", path);
+		return (NULL);
+	}
+
+	n = REF;
+	(void)snprintf(msgid_str, sizeof msgid_str, "%08" PRIx32, msgid);
+	while ((dp = readdir(dir)) != NULL)
+		if (strlen(dp->d_name) == 16 &&
+		    strncmp(dp->d_name, msgid_str, 8) == 0)
+			n += 1;
+	(void)closedir(dir);
+
+	if (n == REF)
+		return (NULL);
+	tree_xset(&evpcount, msgid, n);
+	return (n);
+}
+
 static void
 fsqueue_message_incoming_path(uint32_t msgid, char *buf, size_t len)
 {
-	if (!bsnprintf(buf, len, "%s/%08x",
+	if (!bsnprintf(buf, len, "%s%s/%08x",
+		queue_shard_root(queue_shard(msgid)),
 		PATH_INCOMING,
 		msgid))
 		fatalx("fsqueue_message_incoming_path: path does not fit buffer");
@@ -561,17 +1159,25 @@ fsqueue_message_incoming_path(uint32_t msgid, char *buf, size_t len)
 static void *
 fsqueue_qwalk_new(void)
 {
-	char		 path[PATH_MAX];
-	char * const	 path_argv[] = { path, NULL };
+	char		 paths[QUEUE_SHARDS_MAX][PATH_MAX];
+	char		*path_argv[QUEUE_SHARDS_MAX + 1];
 	struct qwalk	*q;
+	int		 i;
+
+	/* all shards are walked in one go */
+	for (i = 0; i < queue_shards(); i++) {
+		(void)snprintf(paths[i], sizeof(paths[i]), "%s%s",
+		    queue_shard_root(i), PATH_QUEUE);
+		path_argv[i] = paths[i];
+	}
+	path_argv[i] = NULL;
 
 	q = xcalloc(1, sizeof(*q));
-	(void)strlcpy(path, PATH_QUEUE, sizeof(path));
 	q->fts = fts_open(path_argv,
 	    FTS_PHYSICAL | FTS_NOCHDIR, NULL);
 
 	if (q->fts == NULL)
-		fatal("fsqueue_qwalk_new: fts_open: %s", path);
+		fatal("fsqueue_qwalk_new: fts_open");
 
 	return (q);
 }
@@ -644,44 +1250,897 @@ fsqueue_qwalk(void *hdl, uint64_t *evpid)
 	return (0);
 }
 
+/*
+ * With dedup, the headers stay in the message file while the rest,
+ * which is what identical submissions share, is moved to a single copy
+ * under the bodies directory of the shard, named after its hash, and
+ * hard linked from the message directory as its body file.  The link
+ * count is the reference count: a body only linked from the bodies
+ * directory is unused and removed by a periodic sweep.
+ */
+static int
+fsqueue_body_split(uint32_t msgid, const char *path, const char *msgpath)
+{
+	char		body[PATH_MAX];
+	char		link_path[PATH_MAX];
+	char		tmp[PATH_MAX];
+	char		bucket[PATH_MAX];
+	struct stat	sb;
+	struct timeval	tv;
+	off_t		off;
+	int		fd;
+
+	if (!ev_body_set) {
+		evtimer_set(&ev_body, fsqueue_body_timeout, NULL);
+		tv.tv_sec = BODY_GC_INTERVAL;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_body, &tv);
+		ev_body_set = 1;
+	}
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (0);
+	if (fstat(fd, &sb) == -1 || sb.st_size < BODY_MINSIZE ||
+	    !fsqueue_body_hash(msgid, fd, &off, body, sizeof(body)) ||
+	    sb.st_size - off < BODY_MINSIZE)
+		goto plain;
+
+	fsqueue_message_incoming_path(msgid, link_path, sizeof(link_path));
+	if (strlcat(link_path, PATH_BODY, sizeof(link_path))
+	    >= sizeof(link_path))
+		goto plain;
+
+	if (link(body, link_path) == 0)
+		stat_increment("queue.fs.dedup", 1);
+	else if (errno != ENOENT) {
+		/* EMLINK included, the message keeps its whole content */
+		if (errno != EMLINK)
+			log_warn("warn: queue-fs: link: %s", body);
+		goto plain;
+	} else {
+		(void)strlcpy(bucket, body, sizeof(bucket));
+		*strrchr(bucket, '/') = '\0';
+		if (mkdir(bucket, 0700) == -1 && errno != EEXIST) {
+			log_warn("warn: queue-fs: mkdir: %s", bucket);
+			goto plain;
+		}
+		if (!bsnprintf(tmp, sizeof(tmp), "%s.tmp", body) ||
+		    !fsqueue_copy_range(fd, off, sb.st_size - off, tmp))
+			goto plain;
+		if (rename(tmp, body) == -1 || link(body, link_path) == -1) {
+			log_warn("warn: queue-fs: %s", body);
+			unlink(tmp);
+			goto plain;
+		}
+	}
+
+	if (!fsqueue_copy_range(fd, 0, off, msgpath)) {
+		unlink(link_path);
+		goto plain;
+	}
+	close(fd);
+	unlink(path);
+	return (1);
+
+plain:
+	close(fd);
+	return (rename(path, msgpath) == 0);
+}
+
+/*
+ * Find where the headers end and hash what follows.  Messages are
+ * stored with bare newlines, the headers end at the first empty line.
+ */
+static int
+fsqueue_body_hash(uint32_t msgid, int fd, off_t *off, char *buf,
+    size_t len)
+{
+	unsigned char	 md[EVP_MAX_MD_SIZE];
+	char		 hex[EVP_MAX_MD_SIZE * 2 + 1];
+	char		 rbuf[BUFSIZ];
+	EVP_MD_CTX	*ctx;
+	unsigned int	 mdlen, i;
+	ssize_t		 n, j;
+	off_t		 pos = 0;
+	int		 nl = 0, r = 0;
+
+	*off = -1;
+	if ((ctx = EVP_MD_CTX_new()) == NULL)
+		return (0);
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+		goto end;
+	while ((n = read(fd, rbuf, sizeof(rbuf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			log_warn("warn: queue-fs: read");
+			goto end;
+		}
+		j = 0;
+		if (*off == -1) {
+			for (; j < n && *off == -1; j++) {
+				if (rbuf[j] != '\n')
+					nl = 0;
+				else if (++nl == 2)
+					*off = pos + j + 1;
+			}
+		}
+		if (*off != -1 && !EVP_DigestUpdate(ctx, rbuf + j, n - j))
+			goto end;
+		pos += n;
+	}
+	if (*off == -1 || !EVP_DigestFinal_ex(ctx, md, &mdlen))
+		goto end;
+
+	for (i = 0; i < mdlen; i++)
+		(void)snprintf(hex + i * 2, 3, "%02x", md[i]);
+	r = bsnprintf(buf, len, "%s%s/%.2s/%s",
+	    queue_shard_root(queue_shard(msgid)), PATH_BODIES, hex, hex);
+
+end:
+	EVP_MD_CTX_free(ctx);
+	return (r);
+}
+
+static int
+fsqueue_copy_range(int fd, off_t off, off_t len, const char *dst)
+{
+	char	buf[BUFSIZ];
+	ssize_t	n, w, o;
+	int	ofd;
+
+	if ((ofd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		log_warn("warn: queue-fs: open: %s", dst);
+		return (0);
+	}
+	while (len) {
+		n = pread(fd, buf, MIN((off_t)sizeof(buf), len), off);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			goto fail;
+		for (o = 0; o < n; o += w)
+			if ((w = write(ofd, buf + o, n - o)) == -1) {
+				if (errno != EINTR)
+					goto fail;
+				w = 0;
+			}
+		off += n;
+		len -= n;
+	}
+	if (close(ofd) == -1) {
+		ofd = -1;
+		goto fail;
+	}
+	return (1);
+
+fail:
+	log_warn("warn: queue-fs: %s", dst);
+	if (ofd != -1)
+		close(ofd);
+	unlink(dst);
+	return (0);
+}
+
+static int
+fsqueue_cat(int out, int in)
+{
+	char	buf[BUFSIZ];
+	ssize_t	n, w, off;
+
+	while ((n = read(in, buf, sizeof(buf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (0);
+		}
+		for (off = 0; off < n; off += w)
+			if ((w = write(out, buf + off, n - off)) == -1) {
+				if (errno != EINTR)
+					return (0);
+				w = 0;
+			}
+	}
+	return (1);
+}
+
+static void
+fsqueue_body_gc(const char *prefix)
+{
+	char		 paths[QUEUE_SHARDS_MAX][PATH_MAX];
+	char		*path_argv[QUEUE_SHARDS_MAX + 1];
+	FTS		*fts;
+	FTSENT		*e;
+	int		 i, n;
+
+	for (i = n = 0; i < queue_shards(); i++)
+		if (bsnprintf(paths[i], sizeof(paths[i]), "%s%s%s", prefix,
+		    queue_shard_root(i), PATH_BODIES))
+			path_argv[n++] = paths[i];
+	path_argv[n] = NULL;
+
+	if ((fts = fts_open(path_argv, FTS_PHYSICAL | FTS_NOCHDIR,
+	    NULL)) == NULL) {
+		log_warn("warn: queue-fs: fts_open");
+		return;
+	}
+	while ((e = fts_read(fts)) != NULL)
+		if (e->fts_info == FTS_F && e->fts_statp->st_nlink == 1 &&
+		    unlink(e->fts_accpath) == -1)
+			log_warn("warn: queue-fs: unlink: %s", e->fts_path);
+	fts_close(fts);
+}
+
+static void
+fsqueue_body_timeout(int fd, short event, void *p)
+{
+	struct timeval	tv;
+
+	fsqueue_body_gc("");
+
+	tv.tv_sec = BODY_GC_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_body, &tv);
+}
+
+static void
+fsqueue_replica_path(int replica, uint32_t msgid, char *buf, size_t len)
+{
+	if (!bsnprintf(buf, len, PATH_REPLICA "%s/%02x/%08x",
+		replica,
+		PATH_QUEUE,
+		(msgid & 0xff000000) >> 24,
+		msgid))
+		fatalx("fsqueue_replica_path: path does not fit buffer");
+}
+
+/*
+ * Copy the incoming message, body and envelopes, to every replica and
+ * tell whether enough of them have it for the commit to be acknowledged.
+ * When they do not, the copies that were made are removed again.
+ */
+static int
+fsqueue_replicate(uint32_t msgid)
+{
+	char		 src[PATH_MAX];
+	char		 srcpath[PATH_MAX];
+	char		 dir[PATH_MAX];
+	char		 dstpath[PATH_MAX];
+	int		 done[QUEUE_REPLICAS_MAX];
+	struct dirent	*dp;
+	DIR		*d;
+	int		 i, n, failed;
+
+	fsqueue_message_incoming_path(msgid, src, sizeof(src));
+
+	n = 0;
+	for (i = 1; i <= replicas; i++) {
+		if (!bsnprintf(dir, sizeof(dir), PATH_REPLICA "%s/%08x",
+		    i, PATH_INCOMING, msgid))
+			continue;
+		if (mkdir(dir, 0700) == -1) {
+			log_warn("warn: queue-fs: replica %d: mkdir", i);
+			continue;
+		}
+
+		failed = 0;
+		if ((d = opendir(src)) == NULL) {
+			log_warn("warn: queue-fs: opendir");
+			failed = 1;
+		}
+		while (!failed && (dp = readdir(d)) != NULL) {
+			if (dp->d_name[0] == '.')
+				continue;
+			if (!bsnprintf(srcpath, sizeof(srcpath), "%s/%s",
+			    src, dp->d_name) ||
+			    !bsnprintf(dstpath, sizeof(dstpath), "%s/%s",
+			    dir, dp->d_name) ||
+			    !fsqueue_replica_copy(srcpath, dstpath)) {
+				log_warnx("warn: queue-fs: replica %d: "
+				    "could not copy %s", i, srcpath);
+				failed = 1;
+			}
+		}
+		if (d)
+			closedir(d);
+
+		if (failed || !fsqueue_replica_commit(i, msgid, dir)) {
+			(void)rmtree(dir, 0);
+			continue;
+		}
+		done[n++] = i;
+	}
+
+	if (n >= quorum)
+		return (1);
+
+	log_warnx("warn: queue-fs: msg=%08"PRIx32" only on %d replicas, "
+	    "%d needed", msgid, n, quorum);
+	while (n--) {
+		fsqueue_replica_path(done[n], msgid, dir, sizeof(dir));
+		(void)rmtree(dir, 0);
+	}
+	return (0);
+}
+
+static int
+fsqueue_replica_copy(const char *src, const char *dst)
+{
+	char	 buf[BUFSIZ];
+	ssize_t	 r, w;
+	size_t	 off;
+	int	 ifd, ofd = -1;
+
+	if ((ifd = open(src, O_RDONLY)) == -1)
+		return (0);
+	if ((ofd = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1)
+		goto fail;
+
+	while ((r = read(ifd, buf, sizeof(buf))) != 0) {
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			goto fail;
+		}
+		for (off = 0; off < (size_t)r; off += w)
+			if ((w = write(ofd, buf + off, r - off)) == -1) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				goto fail;
+			}
+	}
+	if (fsync(ofd) == -1)
+		goto fail;
+	if (close(ofd) == -1) {
+		ofd = -1;
+		goto fail;
+	}
+	close(ifd);
+	return (1);
+
+fail:
+	log_warn("warn: queue-fs: %s", dst);
+	close(ifd);
+	if (ofd != -1) {
+		close(ofd);
+		unlink(dst);
+	}
+	return (0);
+}
+
+static int
+fsqueue_replica_commit(int replica, uint32_t msgid, const char *dir)
+{
+	char	msgdir[PATH_MAX];
+	char	bucket[PATH_MAX];
+
+	fsqueue_replica_path(replica, msgid, msgdir, sizeof(msgdir));
+	if (rename(dir, msgdir) == 0)
+		return (1);
+	if (errno != ENOENT) {
+		log_warn("warn: queue-fs: replica %d: rename", replica);
+		return (0);
+	}
+
+	(void)strlcpy(bucket, msgdir, sizeof(bucket));
+	*strrchr(bucket, '/') = '\0';
+	if (mkdir(bucket, 0700) == -1 && errno != EEXIST) {
+		log_warn("warn: queue-fs: replica %d: mkdir", replica);
+		return (0);
+	}
+	if (rename(dir, msgdir) == -1) {
+		log_warn("warn: queue-fs: replica %d: rename", replica);
+		return (0);
+	}
+	return (1);
+}
+
+/*
+ * Later changes to committed messages do not wait for the replicas:
+ * they are recorded here, successive updates of an envelope collapse
+ * into the last one, and the lot is written out shortly after.
+ */
+static void
+fsqueue_replica_envelope(uint64_t evpid, const char *buf, size_t len)
+{
+	struct replica_op	*op;
+
+	if (replicas == 0)
+		return;
+
+	if ((op = tree_get(&replica_envelopes, evpid)) == NULL) {
+		op = xcalloc(1, sizeof(*op));
+		tree_xset(&replica_envelopes, evpid, op);
+	}
+	free(op->buf);
+	op->buf = buf ? xmemdup(buf, len) : NULL;
+	op->len = len;
+
+	fsqueue_replica_message(0);
+}
+
+static void
+fsqueue_replica_message(uint32_t msgid)
+{
+	struct timeval	tv;
+
+	if (replicas == 0)
+		return;
+
+	if (msgid)
+		tree_set(&replica_messages, msgid, REF);
+
+	if (!ev_replica_set) {
+		evtimer_set(&ev_replica, fsqueue_replica_flush, NULL);
+		ev_replica_set = 1;
+	}
+	if (!evtimer_pending(&ev_replica, NULL)) {
+		tv.tv_sec = REPLICA_FLUSH_INTERVAL;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_replica, &tv);
+	}
+}
+
+static void
+fsqueue_replica_flush(int fd, short event, void *p)
+{
+	struct replica_op	*op;
+	char			 root[PATH_MAX];
+	char			 path[PATH_MAX];
+	uint64_t		 id;
+	void			*iter;
+	int			 i;
+
+	for (i = 1; i <= replicas; i++) {
+		(void)snprintf(root, sizeof(root), PATH_REPLICA, i);
+
+		iter = NULL;
+		while (tree_iter(&replica_envelopes, &iter, &id,
+		    (void **)&op)) {
+			/* the whole message goes away anyway */
+			if (tree_get(&replica_messages, evpid_to_msgid(id)))
+				continue;
+			fsqueue_replica_path(i, evpid_to_msgid(id), path,
+			    sizeof(path));
+			if (!bsnprintf(path + strlen(path),
+			    sizeof(path) - strlen(path), "/%016"PRIx64, id))
+				continue;
+			if (op->buf == NULL) {
+				if (unlink(path) == -1 && errno != ENOENT)
+					log_warn("warn: queue-fs: replica %d: "
+					    "unlink", i);
+			} else
+				(void)fsqueue_envelope_dump(root, path,
+				    op->buf, op->len, 1, 1);
+		}
+
+		iter = NULL;
+		while (tree_iter(&replica_messages, &iter, &id, NULL)) {
+			fsqueue_replica_path(i, id, path, sizeof(path));
+			if (rmtree(path, 0) == -1)
+				log_warnx("warn: queue-fs: replica %d: "
+				    "could not remove %s", i, path);
+		}
+	}
+
+	while (tree_poproot(&replica_envelopes, NULL, (void **)&op)) {
+		free(op->buf);
+		free(op);
+	}
+	while (tree_poproot(&replica_messages, NULL, NULL))
+		;
+}
+
+static void
+fsqueue_summary_open(void)
+{
+	if (!summary || summary_fd != -1)
+		return;
+
+	summary_fd = open(PATH_SUMMARY, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+	    0600);
+	if (summary_fd == -1) {
+		log_warn("warn: queue-fs: open: %s", PATH_SUMMARY);
+		summary = 0;
+	}
+	summary_records = 0;
+}
+
+static void
+fsqueue_summary_header(struct fsqueue_summary *hdr, uint64_t evpid, int kind,
+    const char *buf, size_t len)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->evpid = evpid;
+	hdr->magic = SUMMARY_MAGIC;
+	hdr->kind = kind;
+	hdr->len = len;
+	hdr->sum = fsqueue_retry_sum(buf, len);
+}
+
+/*
+ * Records of an incoming message are held until it is committed, which
+ * appends them in one write.  Those of a queued message are appended
+ * right away.
+ */
+static void
+fsqueue_summary_add(uint64_t evpid, int kind, const char *buf, size_t len)
+{
+	struct fsqueue_summary_buf	*sb;
+	struct fsqueue_summary		 hdr;
+	struct iovec			 iov[2];
+	uint32_t			 msgid;
+	size_t				 size;
+	char				*p;
+
+	if (!summary)
+		return;
+
+	fsqueue_summary_header(&hdr, evpid, kind, buf, len);
+
+	msgid = evpid_to_msgid(evpid);
+	if (tree_get(&incoming, msgid) == NULL) {
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = (void *)buf;
+		iov[1].iov_len = len;
+		fsqueue_summary_append(iov, 2, 1);
+		return;
+	}
+
+	if ((sb = tree_get(&summary_incoming, msgid)) == NULL) {
+		sb = xcalloc(1, sizeof(*sb));
+		tree_xset(&summary_incoming, msgid, sb);
+	}
+	if (sb->len + sizeof(hdr) + len > sb->size) {
+		size = (sb->len + sizeof(hdr) + len) * 2;
+		if ((p = realloc(sb->buf, size)) == NULL)
+			fatal("fsqueue_summary_add: realloc");
+		sb->buf = p;
+		sb->size = size;
+	}
+	memcpy(sb->buf + sb->len, &hdr, sizeof(hdr));
+	sb->len += sizeof(hdr);
+	if (len)
+		memcpy(sb->buf + sb->len, buf, len);
+	sb->len += len;
+	sb->count++;
+}
+
+static void
+fsqueue_summary_append(const struct iovec *iov, int iovcnt, size_t records)
+{
+	ssize_t	len;
+	int	i;
+
+	fsqueue_summary_open();
+	if (!summary)
+		return;
+
+	for (len = 0, i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (writev(summary_fd, iov, iovcnt) != len) {
+		/* a summary missing records must not be used */
+		log_warn("warn: queue-fs: write: %s", PATH_SUMMARY);
+		if (unlink(PATH_SUMMARY) == -1)
+			log_warn("warn: queue-fs: unlink: %s", PATH_SUMMARY);
+		close(summary_fd);
+		summary_fd = -1;
+		summary = 0;
+		return;
+	}
+	summary_records += records;
+
+	if (walked &&
+	    summary_records > 2 * summary_compacted + SUMMARY_COMPACT_MIN)
+		fsqueue_summary_compact();
+}
+
+static void
+fsqueue_summary_commit(uint32_t msgid)
+{
+	struct fsqueue_summary_buf	*sb;
+	struct iovec			 iov;
+
+	if ((sb = tree_pop(&summary_incoming, msgid)) == NULL)
+		return;
+
+	iov.iov_base = sb->buf;
+	iov.iov_len = sb->len;
+	fsqueue_summary_append(&iov, 1, sb->count);
+	free(sb->buf);
+	free(sb);
+}
+
+static void
+fsqueue_summary_drop(uint32_t msgid)
+{
+	struct fsqueue_summary_buf	*sb;
+
+	if ((sb = tree_pop(&summary_incoming, msgid)) == NULL)
+		return;
+
+	free(sb->buf);
+	free(sb);
+}
+
+/*
+ * Replay the log into the offset of the last record of each envelope
+ * left.  Returns whether a queue walk went through, or -1 on error.
+ */
+static int
+fsqueue_summary_scan(FILE *fp, struct tree *offsets)
+{
+	struct fsqueue_summary	 hdr;
+	char			 buf[sizeof(struct envelope)];
+	uint64_t		 evpid;
+	off_t			 off;
+	void			*iter;
+	int			 complete = 0;
+
+	for (off = 0; fread(&hdr, sizeof(hdr), 1, fp) == 1;
+	    off += sizeof(hdr) + hdr.len) {
+		if (hdr.magic != SUMMARY_MAGIC || hdr.len >= sizeof(buf) ||
+		    fread(buf, 1, hdr.len, fp) != hdr.len ||
+		    fsqueue_retry_sum(buf, hdr.len) != hdr.sum) {
+			log_warnx("warn: queue-fs: ignoring torn summary "
+			    "record at %lld", (long long)off);
+			break;
+		}
+
+		switch (hdr.kind) {
+		case SUMMARY_ENVELOPE:
+			tree_set(offsets, hdr.evpid,
+			    (void *)(uintptr_t)(off + 1));
+			break;
+		case SUMMARY_DELETE:
+			tree_pop(offsets, hdr.evpid);
+			break;
+		case SUMMARY_MESSAGE_DELETE:
+			for (;;) {
+				iter = NULL;
+				if (!tree_iterfrom(offsets, &iter, hdr.evpid,
+				    &evpid, NULL))
+					break;
+				if (evpid_to_msgid(evpid) !=
+				    evpid_to_msgid(hdr.evpid))
+					break;
+				tree_pop(offsets, evpid);
+			}
+			break;
+		case SUMMARY_WALKED:
+			complete = 1;
+			break;
+		}
+	}
+	if (ferror(fp)) {
+		log_warn("warn: queue-fs: read: %s", PATH_SUMMARY);
+		return (-1);
+	}
+
+	return (complete);
+}
+
+static int
+fsqueue_summary_read(FILE *fp, off_t off, struct fsqueue_summary *hdr,
+    char *buf, size_t len)
+{
+	int	fd = fileno(fp);
+
+	if (pread(fd, hdr, sizeof(*hdr), off) != sizeof(*hdr) ||
+	    hdr->len >= len ||
+	    pread(fd, buf, hdr->len, off + sizeof(*hdr)) != (ssize_t)hdr->len) {
+		log_warnx("warn: queue-fs: bad summary record at %lld",
+		    (long long)off);
+		return (0);
+	}
+	buf[hdr->len] = '\0';
+
+	return (1);
+}
+
+/*
+ * Rewrite the log with the last record of each envelope left.  It is
+ * done once the log has grown past twice what was left the previous
+ * time, so that the cost of reading it back is spread over the records
+ * appended since.
+ */
+static void
+fsqueue_summary_compact(void)
+{
+	struct fsqueue_summary	 hdr;
+	struct tree		 offsets;
+	char			 buf[sizeof(struct envelope)];
+	FILE			*fp, *ofp = NULL;
+	uint64_t		 evpid;
+	void			*iter, *off;
+	size_t			 n = 0;
+	int			 fd;
+
+	/* whatever happens, not again before the log has grown as much */
+	summary_compacted = summary_records;
+
+	tree_init(&offsets);
+	if ((fp = fopen(PATH_SUMMARY, "r")) == NULL) {
+		log_warn("warn: queue-fs: fopen: %s", PATH_SUMMARY);
+		return;
+	}
+	if (fsqueue_summary_scan(fp, &offsets) != 1)
+		goto end;
+
+	if ((fd = open(PATH_SUMMARYTMP, O_WRONLY | O_CREAT | O_TRUNC,
+	    0600)) == -1)
+		goto fail;
+	if ((ofp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		goto fail;
+	}
+
+	iter = NULL;
+	while (tree_iter(&offsets, &iter, &evpid, &off)) {
+		if (!fsqueue_summary_read(fp, (uintptr_t)off - 1, &hdr, buf,
+		    sizeof buf))
+			goto fail;
+		fwrite(&hdr, sizeof(hdr), 1, ofp);
+		fwrite(buf, 1, hdr.len, ofp);
+		n++;
+	}
+	fsqueue_summary_header(&hdr, 0, SUMMARY_WALKED, NULL, 0);
+	fwrite(&hdr, sizeof(hdr), 1, ofp);
+
+	if (fflush(ofp) == EOF || ferror(ofp))
+		goto fail;
+	if (fclose(ofp) == EOF) {
+		ofp = NULL;
+		goto fail;
+	}
+	ofp = NULL;
+	if (rename(PATH_SUMMARYTMP, PATH_SUMMARY) == -1)
+		goto fail;
+
+	close(summary_fd);
+	if ((summary_fd = open(PATH_SUMMARY, O_WRONLY | O_APPEND)) == -1) {
+		log_warn("warn: queue-fs: open: %s", PATH_SUMMARY);
+		if (unlink(PATH_SUMMARY) == -1)
+			log_warn("warn: queue-fs: unlink: %s", PATH_SUMMARY);
+		summary = 0;
+		goto end;
+	}
+	summary_records = summary_compacted = n + 1;
+	log_debug("debug: queue-fs: summary compacted to %zu envelopes", n);
+	goto end;
+
+fail:
+	log_warn("warn: queue-fs: %s", PATH_SUMMARYTMP);
+	if (ofp)
+		fclose(ofp);
+	if (unlink(PATH_SUMMARYTMP) == -1 && errno != ENOENT)
+		log_warn("warn: queue-fs: unlink: %s", PATH_SUMMARYTMP);
+end:
+	fclose(fp);
+	while (tree_poproot(&offsets, NULL, NULL))
+		;
+}
+
+static int
+queue_fs_close(void)
+{
+	if (ev_replica_set && evtimer_pending(&ev_replica, NULL)) {
+		evtimer_del(&ev_replica);
+		fsqueue_replica_flush(-1, 0, NULL);
+	}
+	return (1);
+}
+
 static int
 queue_fs_init(struct passwd *pw, int server, const char *conf)
 {
 	unsigned int	 n;
 	char		*paths[] = { PATH_QUEUE, PATH_INCOMING };
 	char		 path[PATH_MAX];
-	int		 ret;
+	int		 i, ret, purge;
 
-	/* remove incoming/ if it exists */
-	if (server)
+	/*
+	 * Remove incoming/ if it exists, unless the previous generation
+	 * is still receiving messages there.
+	 */
+	purge = server && !(env->sc_opts & SMTPD_OPT_TAKEOVER);
+	if (purge)
 		mvpurge(PATH_SPOOL PATH_INCOMING, PATH_SPOOL PATH_PURGE);
 
-	fsqueue_envelope_path(0, path, sizeof(path));
-
 	ret = 1;
-	for (n = 0; n < nitems(paths); n++) {
-		(void)strlcpy(path, PATH_SPOOL, sizeof(path));
-		if (strlcat(path, paths[n], sizeof(path)) >= sizeof(path))
-			fatalx("path too long %s%s", PATH_SPOOL, paths[n]);
-		if (ckdir(path, 0700, pw->pw_uid, 0, server) == 0)
+	for (i = 0; i < queue_shards(); i++) {
+		/* the purge directory is on another filesystem */
+		if (purge && i > 0) {
+			(void)snprintf(path, sizeof(path), "%s%s%s",
+			    PATH_SPOOL, queue_shard_root(i), PATH_INCOMING);
+			if (access(path, F_OK) == 0)
+				(void)rmtree(path, 0);
+		}
+		for (n = 0; n < nitems(paths); n++) {
+			if (!bsnprintf(path, sizeof(path), "%s%s%s",
+			    PATH_SPOOL, queue_shard_root(i), paths[n]))
+				fatalx("path too long %s%s%s", PATH_SPOOL,
+				    queue_shard_root(i), paths[n]);
+			if (ckdir(path, 0700, pw->pw_uid, 0, server) == 0)
+				ret = 0;
+		}
+	}
+
+	if (server && env->sc_queue_flags & QUEUE_DEDUP) {
+		dedup = 1;
+		for (i = 0; i < queue_shards(); i++) {
+			(void)snprintf(path, sizeof(path), "%s%s%s",
+			    PATH_SPOOL, queue_shard_root(i), PATH_BODIES);
+			if (ckdir(path, 0700, pw->pw_uid, 0, 1) == 0)
+				ret = 0;
+		}
+		if (purge)
+			fsqueue_body_gc(PATH_SPOOL);
+	}
+
+	/* replicas are only written to by the server */
+	if (server && env->sc_queue_replicas) {
+		replicas = env->sc_queue_replicas;
+		quorum = env->sc_queue_quorum;
+	}
+	for (i = 1; i <= replicas; i++) {
+		(void)snprintf(path, sizeof(path), "%s" PATH_REPLICA,
+		    PATH_SPOOL, i);
+		if (ckdir(path, 0711, 0, 0, server) == 0)
 			ret = 0;
+		/* leftovers of interrupted commits */
+		(void)snprintf(path, sizeof(path), "%s" PATH_REPLICA "%s",
+		    PATH_SPOOL, i, PATH_INCOMING);
+		if (purge && access(path, F_OK) == 0)
+			(void)rmtree(path, 1);
+		for (n = 0; n < nitems(paths); n++) {
+			if (!bsnprintf(path, sizeof(path),
+			    "%s" PATH_REPLICA "%s", PATH_SPOOL, i, paths[n]))
+				fatalx("replica path too long");
+			if (ckdir(path, 0700, pw->pw_uid, 0, server) == 0)
+				ret = 0;
+		}
+	}
+
+	/* the summary is in clear, an encrypted queue keeps none */
+	if (server) {
+		summary = !(env->sc_queue_flags & QUEUE_ENCRYPTION);
+		if (!summary && unlink(PATH_SPOOL PATH_SUMMARY) == -1 &&
+		    errno != ENOENT)
+			log_warn("warn: queue-fs: unlink: %s",
+			    PATH_SPOOL PATH_SUMMARY);
 	}
 
 	if (clock_gettime(CLOCK_REALTIME, &startup))
 		fatal("clock_gettime");
 
 	tree_init(&evpcount);
+	tree_init(&incoming);
+	tree_init(&replica_envelopes);
+	tree_init(&replica_messages);
+	tree_init(&summary_incoming);
 
+	queue_api_on_close(queue_fs_close);
 	queue_api_on_message_create(queue_fs_message_create);
 	queue_api_on_message_commit(queue_fs_message_commit);
 	queue_api_on_message_delete(queue_fs_message_delete);
 	queue_api_on_message_fd_r(queue_fs_message_fd_r);
+	queue_api_on_message_index(queue_fs_message_index);
+	queue_api_on_message_index_load(queue_fs_message_index_load);
 	queue_api_on_envelope_create(queue_fs_envelope_create);
 	queue_api_on_envelope_delete(queue_fs_envelope_delete);
+	queue_api_on_envelope_delete_batch(queue_fs_envelope_delete_batch);
 	queue_api_on_envelope_update(queue_fs_envelope_update);
+	queue_api_on_envelope_retry(queue_fs_envelope_retry);
 	queue_api_on_envelope_load(queue_fs_envelope_load);
 	queue_api_on_envelope_walk(queue_fs_envelope_walk);
 	queue_api_on_message_walk(queue_fs_message_walk);
+	queue_api_on_envelope_summary(queue_fs_envelope_summary);
+	queue_api_on_summary_open(queue_fs_summary_open);
+	queue_api_on_summary_walk(queue_fs_summary_walk);
 
 	return (ret);
 }
@@ -0,0 +1,1241 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+/*
+ * Messages and envelopes are appended as records to segment files, and
+ * deletions as tombstones.  The location of every live record is kept
+ * in memory, rebuilt at startup by replaying the segments in order: the
+ * last record for an id wins.
+ *
+ * Messages larger than QL_INLINE_MAX are moved to a file of their own in
+ * PATH_LOG_MSG instead, and only recorded in the segment: they are handed
+ * out as is to the mta and mda, and the compaction does not copy them.
+ *
+ * The envelopes of an incoming message are kept in memory and written
+ * along with the message when it is committed.  Segments are rotated
+ * once they reach QL_SEGMENT_SIZE.  Once less than half of the oldest
+ * one is live, its live records are copied to the active segment a
+ * chunk at a time, then it is removed.  Only the oldest segment is
+ * compacted: a tombstone can only refer to an older record, so its
+ * tombstones can be dropped along with it.
+ */
+#define PATH_LOG		"/log"
+#define PATH_LOG_MSG		PATH_LOG "/msg"
+
+#define	QL_MAGIC		0x474f4c51	/* "QLOG" */
+#define	QL_SEGMENT_SIZE		(16 * 1024 * 1024)
+#define	QL_COMPACT_INTERVAL	10		/* seconds */
+#define	QL_COMPACT_CHUNK	(1024 * 1024)
+#define	QL_COPY_SIZE		(64 * 1024)
+#define	QL_INLINE_MAX		(64 * 1024)
+
+enum {
+	QL_MESSAGE = 1,
+	QL_ENVELOPE,
+	QL_MESSAGE_DELETE,
+	QL_ENVELOPE_DELETE,
+	QL_MESSAGE_FILE,		/* no payload, in PATH_LOG_MSG */
+};
+
+struct ql_header {
+	uint32_t	magic;
+	uint32_t	type;
+	uint64_t	id;
+	uint64_t	len;
+};
+
+/* header, payload, then a checksum of the payload */
+#define	QL_RECSIZE(len)	(sizeof(struct ql_header) + (len) + sizeof(uint32_t))
+
+struct ql_segment {
+	TAILQ_ENTRY(ql_segment)	 entry;
+	uint32_t		 id;
+	int			 fd;
+	off_t			 size;
+	off_t			 live;
+};
+
+struct ql_loc {
+	struct ql_segment	*seg;
+	off_t			 off;
+	size_t			 len;		/* of the payload */
+};
+
+struct ql_envelope {
+	struct ql_loc		 loc;
+	char			*buf;		/* until the message is committed */
+	size_t			 len;
+};
+
+struct ql_message {
+	struct ql_loc		 loc;
+	int			 committed;
+	int			 external;
+	struct tree		 envelopes;
+};
+
+static void	ql_setup(void);
+static void	ql_replay(struct ql_segment *, int);
+static void	ql_apply(struct ql_segment *, off_t, const struct ql_header *);
+static struct ql_segment *ql_segment_open(uint32_t, int);
+static void	ql_segment_remove(struct ql_segment *);
+static int	ql_rotate(void);
+static int	ql_write(const void *, size_t);
+static int	ql_append(uint32_t, uint64_t, const void *, size_t,
+    struct ql_loc *);
+static int	ql_append_file(uint32_t, const char *, struct ql_loc *);
+static int	ql_move_file(uint32_t, const char *, struct ql_loc *);
+static void	ql_msgpath(uint32_t, char *, size_t);
+static int	ql_sync(void);
+static void	ql_truncate(off_t);
+static int	ql_copy(int, off_t, int, size_t);
+static void	ql_use(struct ql_loc *);
+static void	ql_release(struct ql_loc *);
+static struct ql_message *ql_message(uint32_t, int);
+static void	ql_message_free(uint32_t);
+static struct ql_envelope *ql_envelope(uint64_t);
+static int	ql_envelope_read(struct ql_envelope *, char *, size_t);
+static void	ql_compact(int, short, void *);
+static void	ql_compact_schedule(int);
+static void	ql_stat(void);
+static uint32_t	ql_sum(uint32_t, const void *, size_t);
+
+static TAILQ_HEAD(ql_segment_list, ql_segment) segments;
+static struct ql_segment       *active;
+static struct tree		messages;
+static struct event		ev_compact;
+static off_t			compact_off;
+static int			ready;
+static int			msgdir = -1;
+static dev_t			msgdev;
+
+static uint32_t
+ql_sum(uint32_t sum, const void *buf, size_t len)
+{
+	const uint8_t	*p = buf;
+
+	/* FNV-1a */
+	while (len--) {
+		sum ^= *p++;
+		sum *= 16777619;
+	}
+	return (sum);
+}
+
+#define	QL_SUM_INIT	2166136261U
+
+static int
+ql_idcmp(const void *a, const void *b)
+{
+	uint32_t	x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Segments are read once the queue process is chrooted, on first use.
+ */
+static void
+ql_setup(void)
+{
+	struct dirent		*dp;
+	struct ql_message	*m;
+	struct ql_segment	*seg;
+	struct stat		 sb;
+	DIR			*dir;
+	uint32_t		*ids = NULL, id;
+	uint64_t		 next;
+	size_t			 n = 0, i;
+	void			*iter;
+	char			*end;
+
+	if (ready)
+		return;
+	ready = 1;
+
+	if ((dir = opendir(PATH_LOG)) == NULL)
+		fatal("queue-log: opendir: %s", PATH_LOG);
+	while ((dp = readdir(dir)) != NULL) {
+		if (strlen(dp->d_name) != 8)
+			continue;
+		id = strtoul(dp->d_name, &end, 16);
+		if (*end != '\0' || id == 0)
+			continue;
+		if ((ids = reallocarray(ids, n + 1, sizeof(*ids))) == NULL)
+			fatal("queue-log: reallocarray");
+		ids[n++] = id;
+	}
+	closedir(dir);
+	qsort(ids, n, sizeof(*ids), ql_idcmp);
+
+	for (i = 0; i < n; i++) {
+		if ((seg = ql_segment_open(ids[i], 0)) == NULL)
+			fatalx("queue-log: cannot open segment %08"PRIx32, ids[i]);
+		ql_replay(seg, i == n - 1);
+	}
+	free(ids);
+
+	/* drop what was not committed, and messages without envelopes */
+	next = 0;
+	for (;;) {
+		iter = NULL;
+		if (!tree_iterfrom(&messages, &iter, next, &next, (void **)&m))
+			break;
+		if (!m->committed || tree_count(&m->envelopes) == 0)
+			ql_message_free(next);
+		next++;
+	}
+
+	/* a message file is only kept if its record made it to the log */
+	if ((msgdir = open(PATH_LOG_MSG, O_RDONLY | O_DIRECTORY)) == -1)
+		fatal("queue-log: open: %s", PATH_LOG_MSG);
+	if (fstat(msgdir, &sb) == -1)
+		fatal("queue-log: fstat: %s", PATH_LOG_MSG);
+	msgdev = sb.st_dev;
+	if ((dir = fdopendir(dup(msgdir))) == NULL)
+		fatal("queue-log: opendir: %s", PATH_LOG_MSG);
+	while ((dp = readdir(dir)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		id = strtoul(dp->d_name, &end, 16);
+		if (*end == '\0' && (m = tree_get(&messages, id)) != NULL &&
+		    m->external)
+			continue;
+		log_debug("debug: queue-log: removing stale message file %s",
+		    dp->d_name);
+		if (unlinkat(msgdir, dp->d_name, 0) == -1)
+			log_warn("warn: queue-log: unlink: %s", dp->d_name);
+	}
+	closedir(dir);
+
+	active = TAILQ_LAST(&segments, ql_segment_list);
+	if (!ql_rotate())
+		fatalx("queue-log: cannot create segment");
+
+	evtimer_set(&ev_compact, ql_compact, NULL);
+	ql_compact_schedule(0);
+	ql_stat();
+}
+
+static struct ql_segment *
+ql_segment_open(uint32_t id, int create)
+{
+	struct ql_segment	*seg;
+	struct stat		 sb;
+	char			 path[PATH_MAX];
+	int			 fd;
+
+	if (!bsnprintf(path, sizeof(path), "%s/%08"PRIx32, PATH_LOG, id))
+		fatalx("queue-log: path does not fit buffer");
+
+	fd = open(path, O_RDWR | O_APPEND | (create ? O_CREAT | O_EXCL : 0),
+	    0600);
+	if (fd == -1) {
+		log_warn("warn: queue-log: open: %s", path);
+		return (NULL);
+	}
+	if (fstat(fd, &sb) == -1) {
+		log_warn("warn: queue-log: fstat: %s", path);
+		close(fd);
+		return (NULL);
+	}
+
+	seg = xcalloc(1, sizeof(*seg));
+	seg->id = id;
+	seg->fd = fd;
+	seg->size = sb.st_size;
+	TAILQ_INSERT_TAIL(&segments, seg, entry);
+
+	return (seg);
+}
+
+static void
+ql_segment_remove(struct ql_segment *seg)
+{
+	char	path[PATH_MAX];
+
+	if (!bsnprintf(path, sizeof(path), "%s/%08"PRIx32, PATH_LOG, seg->id))
+		fatalx("queue-log: path does not fit buffer");
+	if (unlink(path) == -1)
+		log_warn("warn: queue-log: unlink: %s", path);
+
+	TAILQ_REMOVE(&segments, seg, entry);
+	close(seg->fd);
+	free(seg);
+}
+
+/*
+ * A torn record at the end of the last segment is what a crash leaves
+ * behind, it is cut.  Anywhere else, the rest of the segment is ignored.
+ */
+static void
+ql_replay(struct ql_segment *seg, int last)
+{
+	struct ql_header	 h;
+	char			 buf[QL_COPY_SIZE];
+	uint32_t		 sum, trailer;
+	off_t			 off, pos, end;
+	size_t			 n;
+
+	for (off = 0; off < seg->size; off += QL_RECSIZE(h.len)) {
+		if (pread(seg->fd, &h, sizeof(h), off) != sizeof(h))
+			goto bad;
+		if (h.magic != QL_MAGIC ||
+		    (uint64_t)(seg->size - off) < QL_RECSIZE(0) ||
+		    h.len > (uint64_t)(seg->size - off) - QL_RECSIZE(0))
+			goto bad;
+
+		/* message contents are only checked where a write can be torn */
+		pos = off + sizeof(h);
+		end = pos + h.len;
+		if (h.type != QL_MESSAGE || last) {
+			sum = QL_SUM_INIT;
+			for (; pos < end; pos += n) {
+				n = MIN(sizeof(buf), (size_t)(end - pos));
+				if (pread(seg->fd, buf, n, pos) != (ssize_t)n)
+					goto bad;
+				sum = ql_sum(sum, buf, n);
+			}
+			if (pread(seg->fd, &trailer, sizeof(trailer), end) !=
+			    sizeof(trailer) || trailer != sum)
+				goto bad;
+		}
+
+		ql_apply(seg, off, &h);
+	}
+	return;
+
+bad:
+	if (last) {
+		log_warnx("warn: queue-log: truncating segment %08"PRIx32
+		    " at %lld", seg->id, (long long)off);
+		if (ftruncate(seg->fd, off) == -1)
+			fatal("queue-log: ftruncate");
+		seg->size = off;
+	}
+	else
+		log_warnx("warn: queue-log: bad record in segment %08"PRIx32
+		    " at %lld, ignoring the rest", seg->id, (long long)off);
+}
+
+static void
+ql_apply(struct ql_segment *seg, off_t off, const struct ql_header *h)
+{
+	struct ql_message	*m;
+	struct ql_envelope	*e;
+	struct ql_loc		 loc;
+
+	loc.seg = seg;
+	loc.off = off;
+	loc.len = h->len;
+
+	switch (h->type) {
+	case QL_MESSAGE:
+	case QL_MESSAGE_FILE:
+		m = ql_message(h->id, 1);
+		ql_release(&m->loc);
+		m->loc = loc;
+		m->committed = 1;
+		m->external = h->type == QL_MESSAGE_FILE;
+		ql_use(&m->loc);
+		break;
+
+	case QL_ENVELOPE:
+		m = ql_message(evpid_to_msgid(h->id), 1);
+		if ((e = tree_get(&m->envelopes, h->id)) == NULL) {
+			e = xcalloc(1, sizeof(*e));
+			tree_xset(&m->envelopes, h->id, e);
+		}
+		ql_release(&e->loc);
+		e->loc = loc;
+		ql_use(&e->loc);
+		break;
+
+	case QL_MESSAGE_DELETE:
+		if (tree_get(&messages, h->id))
+			ql_message_free(h->id);
+		break;
+
+	case QL_ENVELOPE_DELETE:
+		if ((m = tree_get(&messages, evpid_to_msgid(h->id))) == NULL)
+			break;
+		if ((e = tree_pop(&m->envelopes, h->id)) == NULL)
+			break;
+		ql_release(&e->loc);
+		free(e);
+		break;
+
+	default:
+		log_warnx("warn: queue-log: unknown record type %"PRIu32
+		    " in segment %08"PRIx32, h->type, seg->id);
+		break;
+	}
+}
+
+static int
+ql_rotate(void)
+{
+	struct ql_segment	*seg;
+
+	if (active && active->size < QL_SEGMENT_SIZE)
+		return (1);
+
+	if (active && fsync(active->fd) == -1)
+		log_warn("warn: queue-log: fsync");
+	if ((seg = ql_segment_open(active ? active->id + 1 : 1, 1)) == NULL)
+		return (0);
+	active = seg;
+	ql_stat();
+
+	return (1);
+}
+
+static int
+ql_write(const void *buf, size_t len)
+{
+	const char	*p = buf;
+	ssize_t		 n;
+
+	while (len) {
+		if ((n = write(active->fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_warn("warn: queue-log: write");
+			return (0);
+		}
+		p += n;
+		len -= n;
+		active->size += n;
+	}
+	return (1);
+}
+
+static int
+ql_append(uint32_t type, uint64_t id, const void *buf, size_t len,
+    struct ql_loc *loc)
+{
+	struct ql_header	 h;
+	struct iovec		 iov[3];
+	uint32_t		 sum;
+	ssize_t			 n;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = QL_MAGIC;
+	h.type = type;
+	h.id = id;
+	h.len = len;
+	sum = ql_sum(QL_SUM_INIT, buf, len);
+
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	iov[2].iov_base = &sum;
+	iov[2].iov_len = sizeof(sum);
+
+	do {
+		n = writev(active->fd, iov, 3);
+	} while (n == -1 && errno == EINTR);
+	if (n != (ssize_t)QL_RECSIZE(len)) {
+		if (n == -1)
+			log_warn("warn: queue-log: writev");
+		else
+			log_warnx("warn: queue-log: short write");
+		ql_truncate(active->size);
+		return (0);
+	}
+
+	loc->seg = active;
+	loc->off = active->size;
+	loc->len = len;
+	active->size += n;
+
+	return (1);
+}
+
+static int
+ql_append_file(uint32_t msgid, const char *path, struct ql_loc *loc)
+{
+	struct ql_header	 h;
+	struct stat		 sb;
+	char			 buf[QL_COPY_SIZE];
+	uint32_t		 sum = QL_SUM_INIT;
+	off_t			 start = active->size;
+	size_t			 left;
+	ssize_t			 n;
+	int			 fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("warn: queue-log: open: %s", path);
+		return (0);
+	}
+	if (fstat(fd, &sb) == -1) {
+		log_warn("warn: queue-log: fstat: %s", path);
+		close(fd);
+		return (0);
+	}
+
+	memset(&h, 0, sizeof(h));
+	h.magic = QL_MAGIC;
+	h.type = QL_MESSAGE;
+	h.id = msgid;
+	h.len = sb.st_size;
+	if (!ql_write(&h, sizeof(h)))
+		goto fail;
+
+	for (left = sb.st_size; left; left -= n) {
+		if ((n = read(fd, buf, MIN(sizeof(buf), left))) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			log_warn("warn: queue-log: read: %s", path);
+			goto fail;
+		}
+		if (n == 0) {
+			log_warnx("warn: queue-log: %s: short read", path);
+			goto fail;
+		}
+		sum = ql_sum(sum, buf, n);
+		if (!ql_write(buf, n))
+			goto fail;
+	}
+	if (!ql_write(&sum, sizeof(sum)))
+		goto fail;
+	close(fd);
+
+	loc->seg = active;
+	loc->off = start;
+	loc->len = sb.st_size;
+	return (1);
+
+fail:
+	close(fd);
+	ql_truncate(start);
+	return (0);
+}
+
+/*
+ * Move a large message to its own file.  The file and its name are on
+ * disk before the record that refers to it is written.
+ */
+static int
+ql_move_file(uint32_t msgid, const char *path, struct ql_loc *loc)
+{
+	char	dest[PATH_MAX];
+	int	fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("warn: queue-log: open: %s", path);
+		return (0);
+	}
+	if (fsync(fd) == -1) {
+		log_warn("warn: queue-log: fsync: %s", path);
+		close(fd);
+		return (0);
+	}
+	close(fd);
+
+	ql_msgpath(msgid, dest, sizeof(dest));
+	if (rename(path, dest) == -1) {
+		log_warn("warn: queue-log: rename: %s", path);
+		return (0);
+	}
+	if (fsync(msgdir) == -1) {
+		log_warn("warn: queue-log: fsync: %s", PATH_LOG_MSG);
+		goto fail;
+	}
+	if (!ql_append(QL_MESSAGE_FILE, msgid, NULL, 0, loc))
+		goto fail;
+	return (1);
+
+fail:
+	if (rename(dest, path) == -1)
+		log_warn("warn: queue-log: rename: %s", dest);
+	return (0);
+}
+
+static void
+ql_msgpath(uint32_t msgid, char *buf, size_t len)
+{
+	if (!bsnprintf(buf, len, "%s/%08"PRIx32, PATH_LOG_MSG, msgid))
+		fatalx("queue-log: path does not fit buffer");
+}
+
+static int
+ql_sync(void)
+{
+	if (fsync(active->fd) == -1) {
+		log_warn("warn: queue-log: fsync");
+		return (0);
+	}
+	return (1);
+}
+
+/* undo a partial append */
+static void
+ql_truncate(off_t size)
+{
+	if (ftruncate(active->fd, size) == -1)
+		fatal("queue-log: ftruncate");
+	active->size = size;
+}
+
+static int
+ql_copy(int from, off_t off, int to, size_t len)
+{
+	char	buf[QL_COPY_SIZE];
+	ssize_t	n, w;
+	size_t	i;
+
+	while (len) {
+		n = pread(from, buf, MIN(sizeof(buf), len), off);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			log_warn("warn: queue-log: pread");
+			return (0);
+		}
+		for (i = 0; i < (size_t)n; i += w) {
+			if ((w = write(to, buf + i, n - i)) == -1) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				log_warn("warn: queue-log: write");
+				return (0);
+			}
+		}
+		off += n;
+		len -= n;
+	}
+	return (1);
+}
+
+static void
+ql_use(struct ql_loc *loc)
+{
+	loc->seg->live += QL_RECSIZE(loc->len);
+}
+
+static void
+ql_release(struct ql_loc *loc)
+{
+	if (loc->seg == NULL)
+		return;
+	loc->seg->live -= QL_RECSIZE(loc->len);
+	loc->seg = NULL;
+}
+
+static struct ql_message *
+ql_message(uint32_t msgid, int create)
+{
+	struct ql_message	*m;
+
+	if ((m = tree_get(&messages, msgid)) == NULL && create) {
+		m = xcalloc(1, sizeof(*m));
+		tree_init(&m->envelopes);
+		tree_xset(&messages, msgid, m);
+	}
+	return (m);
+}
+
+static void
+ql_message_free(uint32_t msgid)
+{
+	struct ql_message	*m;
+	struct ql_envelope	*e;
+	char			 path[PATH_MAX];
+
+	m = tree_xpop(&messages, msgid);
+	while (tree_poproot(&m->envelopes, NULL, (void **)&e)) {
+		ql_release(&e->loc);
+		free(e->buf);
+		free(e);
+	}
+	ql_release(&m->loc);
+	if (m->external) {
+		ql_msgpath(msgid, path, sizeof(path));
+		if (unlink(path) == -1 && errno != ENOENT)
+			log_warn("warn: queue-log: unlink: %s", path);
+	}
+	free(m);
+}
+
+static struct ql_envelope *
+ql_envelope(uint64_t evpid)
+{
+	struct ql_message	*m;
+
+	if ((m = tree_get(&messages, evpid_to_msgid(evpid))) == NULL)
+		return (NULL);
+	return (tree_get(&m->envelopes, evpid));
+}
+
+static int
+ql_envelope_read(struct ql_envelope *e, char *buf, size_t len)
+{
+	ssize_t	n;
+
+	if (e->buf) {
+		if (e->len >= len) {
+			log_warnx("warn: queue-log: too large");
+			return (0);
+		}
+		memcpy(buf, e->buf, e->len);
+		buf[e->len] = '\0';
+		return (e->len);
+	}
+
+	if (e->loc.len >= len) {
+		log_warnx("warn: queue-log: too large");
+		return (0);
+	}
+	n = pread(e->loc.seg->fd, buf, e->loc.len,
+	    e->loc.off + sizeof(struct ql_header));
+	if (n != (ssize_t)e->loc.len) {
+		log_warn("warn: queue-log: pread");
+		return (0);
+	}
+	buf[n] = '\0';
+	return (n);
+}
+
+static void
+ql_compact_schedule(int now)
+{
+	struct timeval	tv;
+
+	tv.tv_sec = now ? 0 : QL_COMPACT_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_compact, &tv);
+}
+
+/*
+ * Copy up to QL_COMPACT_CHUNK of the live records of the oldest segment
+ * to the active one, and remove it when done.
+ */
+static void
+ql_compact(int fd, short event, void *p)
+{
+	struct ql_segment	*seg;
+	struct ql_message	*m;
+	struct ql_envelope	*e;
+	struct ql_header	 h;
+	struct ql_loc		*loc, nloc;
+	size_t			 copied = 0;
+
+	ql_stat();
+
+	seg = TAILQ_FIRST(&segments);
+	if (seg == active ||
+	    (compact_off == 0 && seg->live > seg->size / 2)) {
+		ql_compact_schedule(0);
+		return;
+	}
+
+	while (compact_off < seg->size && copied < QL_COMPACT_CHUNK) {
+		if (pread(seg->fd, &h, sizeof(h), compact_off) != sizeof(h) ||
+		    h.magic != QL_MAGIC)
+			break;
+
+		loc = NULL;
+		if ((h.type == QL_MESSAGE || h.type == QL_MESSAGE_FILE) &&
+		    (m = tree_get(&messages, h.id)) != NULL)
+			loc = &m->loc;
+		else if (h.type == QL_ENVELOPE &&
+		    (e = ql_envelope(h.id)) != NULL)
+			loc = &e->loc;
+
+		/* tombstones and replaced records are dropped */
+		if (loc && loc->seg == seg && loc->off == compact_off) {
+			if (!ql_rotate())
+				goto retry;
+			nloc.seg = active;
+			nloc.off = active->size;
+			nloc.len = loc->len;
+			if (!ql_copy(seg->fd, compact_off, active->fd,
+			    QL_RECSIZE(loc->len))) {
+				ql_truncate(nloc.off);
+				goto retry;
+			}
+			active->size += QL_RECSIZE(loc->len);
+			ql_release(loc);
+			*loc = nloc;
+			ql_use(loc);
+			copied += QL_RECSIZE(h.len);
+		}
+		compact_off += QL_RECSIZE(h.len);
+	}
+
+	if (compact_off < seg->size && copied >= QL_COMPACT_CHUNK) {
+		ql_compact_schedule(1);
+		return;
+	}
+
+	/* what was copied must be on disk before the segment goes away */
+	if (!ql_sync())
+		goto retry;
+	stat_increment("queue.log.compaction", 1);
+	ql_segment_remove(seg);
+	compact_off = 0;
+	ql_stat();
+	ql_compact_schedule(1);
+	return;
+
+retry:
+	ql_compact_schedule(0);
+}
+
+static void
+ql_stat(void)
+{
+	struct ql_segment	*seg;
+	size_t			 count = 0, size = 0, live = 0;
+
+	TAILQ_FOREACH(seg, &segments, entry) {
+		count++;
+		size += seg->size;
+		live += seg->live;
+	}
+	stat_set("queue.log.segments", stat_counter(count));
+	stat_set("queue.log.size", stat_counter(size));
+	stat_set("queue.log.live", stat_counter(live));
+}
+
+static int
+queue_log_message_create(uint32_t *msgid)
+{
+	ql_setup();
+
+	do {
+		*msgid = queue_generate_msgid();
+	} while (tree_check(&messages, *msgid));
+
+	(void)ql_message(*msgid, 1);
+	return (1);
+}
+
+static int
+queue_log_message_commit(uint32_t msgid, const char *path)
+{
+	struct ql_message	*m;
+	struct ql_envelope	*e;
+	struct stat		 sb;
+	char			 dest[PATH_MAX];
+	off_t			 start;
+	uint64_t		 evpid;
+	void			*iter;
+	int			 external;
+
+	ql_setup();
+
+	if ((m = tree_get(&messages, msgid)) == NULL || m->committed) {
+		log_warnx("warn: queue-log: msgid not found");
+		return (0);
+	}
+
+	/* the message and its envelopes go to the same segment */
+	if (!ql_rotate())
+		return (0);
+	start = active->size;
+
+	if (stat(path, &sb) == -1) {
+		log_warn("warn: queue-log: stat: %s", path);
+		return (0);
+	}
+	/* the temporary directory of a shard may be on another device */
+	external = sb.st_size > QL_INLINE_MAX && sb.st_dev == msgdev;
+	if (external) {
+		if (!ql_move_file(msgid, path, &m->loc))
+			return (0);
+	}
+	else if (!ql_append_file(msgid, path, &m->loc))
+		return (0);
+	iter = NULL;
+	while (tree_iter(&m->envelopes, &iter, &evpid, (void **)&e))
+		if (!ql_append(QL_ENVELOPE, evpid, e->buf, e->len, &e->loc))
+			goto fail;
+	if (!ql_sync())
+		goto fail;
+
+	m->committed = 1;
+	m->external = external;
+	ql_use(&m->loc);
+	iter = NULL;
+	while (tree_iter(&m->envelopes, &iter, NULL, (void **)&e)) {
+		ql_use(&e->loc);
+		free(e->buf);
+		e->buf = NULL;
+	}
+	if (!external && unlink(path) == -1)
+		log_warn("warn: queue-log: unlink: %s", path);
+
+	return (1);
+
+fail:
+	ql_truncate(start);
+	if (external) {
+		ql_msgpath(msgid, dest, sizeof(dest));
+		if (rename(dest, path) == -1)
+			log_warn("warn: queue-log: rename: %s", dest);
+	}
+	m->loc.seg = NULL;
+	iter = NULL;
+	while (tree_iter(&m->envelopes, &iter, NULL, (void **)&e))
+		e->loc.seg = NULL;
+	return (0);
+}
+
+static int
+queue_log_message_delete(uint32_t msgid)
+{
+	struct ql_message	*m;
+	struct ql_loc		 loc;
+
+	ql_setup();
+
+	if ((m = tree_get(&messages, msgid)) == NULL)
+		return (1);
+
+	/* the message is kept until its tombstone is on disk */
+	if (m->committed) {
+		if (!ql_rotate() ||
+		    !ql_append(QL_MESSAGE_DELETE, msgid, NULL, 0, &loc)) {
+			log_warnx("warn: queue-log: could not record deletion "
+			    "of message %08"PRIx32, msgid);
+			return (0);
+		}
+		if (!ql_sync()) {
+			ql_truncate(loc.off);
+			return (0);
+		}
+	}
+	ql_message_free(msgid);
+
+	return (1);
+}
+
+static int
+queue_log_message_fd_r(uint32_t msgid)
+{
+	struct ql_message	*m;
+	char			 path[PATH_MAX];
+	int			 fd;
+
+	ql_setup();
+
+	if ((m = tree_get(&messages, msgid)) == NULL || !m->committed) {
+		log_warnx("warn: queue-log: not found");
+		return (-1);
+	}
+
+	if (m->external) {
+		ql_msgpath(msgid, path, sizeof(path));
+		if ((fd = open(path, O_RDONLY)) == -1)
+			log_warn("warn: queue-log: open: %s", path);
+		return (fd);
+	}
+
+	/* small enough not to go through the disk */
+	fd = -1;
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("smtpd", 0);
+#endif
+	if (fd == -1)
+		fd = mktmpfile();
+	if (fd == -1) {
+		log_warn("warn: queue-log: cannot create a message file");
+		return (-1);
+	}
+	if (!ql_copy(m->loc.seg->fd, m->loc.off + sizeof(struct ql_header),
+	    fd, m->loc.len) || lseek(fd, 0, SEEK_SET) == -1) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+static int
+queue_log_envelope_create(uint32_t msgid, const char *buf, size_t len,
+    uint64_t *evpid)
+{
+	struct ql_message	*m;
+	struct ql_envelope	*e;
+
+	ql_setup();
+
+	if ((m = tree_get(&messages, msgid)) == NULL) {
+		log_warnx("warn: queue-log: msgid not found");
+		return (0);
+	}
+
+	do {
+		*evpid = queue_generate_evpid(msgid);
+	} while (tree_check(&m->envelopes, *evpid));
+
+	e = xcalloc(1, sizeof(*e));
+	if (!m->committed) {
+		e->buf = xmemdup(buf, len);
+		e->len = len;
+	}
+	else if (!ql_rotate() ||
+	    !ql_append(QL_ENVELOPE, *evpid, buf, len, &e->loc) ||
+	    !ql_sync()) {
+		if (e->loc.seg)
+			ql_truncate(e->loc.off);
+		free(e);
+		return (0);
+	}
+	else
+		ql_use(&e->loc);
+	tree_xset(&m->envelopes, *evpid, e);
+
+	return (1);
+}
+
+static int
+queue_log_envelope_delete(uint64_t evpid)
+{
+	struct ql_message	*m;
+	struct ql_envelope	*e;
+	struct ql_loc		 loc;
+	uint32_t		 msgid = evpid_to_msgid(evpid);
+
+	ql_setup();
+
+	if ((m = tree_get(&messages, msgid)) == NULL ||
+	    (e = tree_get(&m->envelopes, evpid)) == NULL)
+		return (1);
+
+	/* the last envelope goes with the message */
+	if (tree_count(&m->envelopes) == 1)
+		return (queue_log_message_delete(msgid));
+
+	if (m->committed) {
+		if (!ql_rotate() ||
+		    !ql_append(QL_ENVELOPE_DELETE, evpid, NULL, 0, &loc))
+			return (0);
+		if (!ql_sync()) {
+			ql_truncate(loc.off);
+			return (0);
+		}
+	}
+	tree_xpop(&m->envelopes, evpid);
+	ql_release(&e->loc);
+	free(e->buf);
+	free(e);
+
+	return (1);
+}
+
+static int
+queue_log_envelope_delete_batch(const uint64_t *evpids, size_t n)
+{
+	struct ql_message	*m;
+	uint32_t		 msgid = evpid_to_msgid(evpids[0]);
+	size_t			 i;
+
+	ql_setup();
+
+	/* a single tombstone when the batch is all that is left */
+	if ((m = tree_get(&messages, msgid)) != NULL &&
+	    tree_count(&m->envelopes) == n)
+		return (queue_log_message_delete(msgid));
+
+	for (i = 0; i < n; i++)
+		if (!queue_log_envelope_delete(evpids[i]))
+			return (0);
+	return (1);
+}
+
+static int
+queue_log_envelope_update(uint64_t evpid, const char *buf, size_t len)
+{
+	struct ql_envelope	*e;
+	struct ql_loc		 loc;
+
+	ql_setup();
+
+	if ((e = ql_envelope(evpid)) == NULL) {
+		log_warnx("warn: queue-log: not found");
+		return (0);
+	}
+
+	if (e->buf) {
+		free(e->buf);
+		e->buf = xmemdup(buf, len);
+		e->len = len;
+		return (1);
+	}
+
+	if (!ql_rotate() ||
+	    !ql_append(QL_ENVELOPE, evpid, buf, len, &loc))
+		return (0);
+	if (!ql_sync()) {
+		ql_truncate(loc.off);
+		return (0);
+	}
+	ql_release(&e->loc);
+	e->loc = loc;
+	ql_use(&e->loc);
+
+	return (1);
+}
+
+static int
+queue_log_envelope_load(uint64_t evpid, char *buf, size_t len)
+{
+	struct ql_envelope	*e;
+
+	ql_setup();
+
+	if ((e = ql_envelope(evpid)) == NULL)
+		return (0);
+	return (ql_envelope_read(e, buf, len));
+}
+
+static int
+queue_log_envelope_walk(uint64_t *evpid, char *buf, size_t len)
+{
+	static uint64_t		 next;
+	static int		 done;
+	struct ql_message	*m;
+	struct ql_envelope	*e;
+	uint64_t		 msgid;
+	void			*iter, *iter2;
+
+	if (done)
+		return (-1);
+
+	ql_setup();
+
+	/* resume from the key, entries may have gone in the meantime */
+	iter = NULL;
+	while (tree_iterfrom(&messages, &iter, evpid_to_msgid(next), &msgid,
+	    (void **)&m)) {
+		if (!m->committed)
+			continue;
+		iter2 = NULL;
+		if (!tree_iterfrom(&m->envelopes, &iter2,
+		    msgid == evpid_to_msgid(next) ? next : 0, evpid,
+		    (void **)&e))
+			continue;
+		next = *evpid + 1;
+		return (ql_envelope_read(e, buf, len));
+	}
+
+	done = 1;
+	return (-1);
+}
+
+static int
+queue_log_message_walk(uint64_t *evpid, char *buf, size_t len,
+    uint32_t msgid, int *done, void **data)
+{
+	struct ql_message	*m;
+	struct ql_envelope	*e;
+	uint64_t		*next = *data;
+	void			*iter;
+
+	if (*done)
+		return (-1);
+
+	ql_setup();
+
+	if (next == NULL) {
+		next = xcalloc(1, sizeof(*next));
+		*next = (uint64_t)msgid << 32;
+		*data = next;
+	}
+
+	iter = NULL;
+	if ((m = tree_get(&messages, msgid)) != NULL && m->committed &&
+	    tree_iterfrom(&m->envelopes, &iter, *next, evpid, (void **)&e)) {
+		*next = *evpid + 1;
+		return (ql_envelope_read(e, buf, len));
+	}
+
+	free(next);
+	*data = NULL;
+	*done = 1;
+	return (-1);
+}
+
+static int
+queue_log_close(void)
+{
+	if (active && fsync(active->fd) == -1)
+		log_warn("warn: queue-log: fsync");
+	return (1);
+}
+
+static int
+queue_log_init(struct passwd *pw, int server, const char *conf)
+{
+	TAILQ_INIT(&segments);
+	tree_init(&messages);
+
+	if (ckdir(PATH_SPOOL PATH_LOG, 0700, pw->pw_uid, 0, server) == 0)
+		return (0);
+	if (ckdir(PATH_SPOOL PATH_LOG_MSG, 0700, pw->pw_uid, 0, server) == 0)
+		return (0);
+
+	queue_api_on_close(queue_log_close);
+	queue_api_on_message_create(queue_log_message_create);
+	queue_api_on_message_commit(queue_log_message_commit);
+	queue_api_on_message_delete(queue_log_message_delete);
+	queue_api_on_message_fd_r(queue_log_message_fd_r);
+	queue_api_on_envelope_create(queue_log_envelope_create);
+	queue_api_on_envelope_delete(queue_log_envelope_delete);
+	queue_api_on_envelope_delete_batch(queue_log_envelope_delete_batch);
+	queue_api_on_envelope_update(queue_log_envelope_update);
+	queue_api_on_envelope_load(queue_log_envelope_load);
+	queue_api_on_envelope_walk(queue_log_envelope_walk);
+	queue_api_on_message_walk(queue_log_message_walk);
+
+	return (1);
+}
+
+struct queue_backend	queue_backend_log = {
+	queue_log_init,
+};
@@ -26,27 +26,56 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <event.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <string.h>
 
 #include "smtpd.h"
 #include "log.h"
 
+/* requests sent without waiting for the reply, when pipelining */
+#define	QUEUE_PROC_MAXINFLIGHT	1024
+
+/* evpids per PROC_QUEUE_ENVELOPE_DELETE_BATCH request */
+#define	QUEUE_PROC_BATCH	((MAX_IMSGSIZE - IMSG_HEADER_SIZE) / sizeof(uint64_t))
+
+static void	queue_proc_read(void *, size_t);
+static void	queue_proc_end(void);
+static void	queue_proc_next(void);
+static void	queue_proc_wait(uint32_t);
+static void	queue_proc_drain(size_t);
+static void	queue_proc_done(void);
+static void	queue_proc_dispatch(int, short, void *);
+static int	queue_proc_async(void);
+
 static struct imsgbuf	 ibuf;
 static struct imsg	 imsg;
 static size_t		 rlen;
 static char		*rdata;
 
+static uint32_t		 caps;
+static uint32_t		 reqid;
+static size_t		 inflight;
+static struct event	 ev_reply;
+static int		 ev_set;
+
 static void
 queue_proc_call(void)
 {
-	ssize_t	n;
-
 	if (imsg_flush(&ibuf) == -1) {
 		log_warn("warn: queue-proc: imsg_flush");
 		fatalx("queue-proc: exiting");
 	}
 
+	queue_proc_wait(reqid);
+}
+
+static void
+queue_proc_next(void)
+{
+	ssize_t	n;
+
 	while (1) {
 		if ((n = imsg_get(&ibuf, &imsg)) == -1) {
 			log_warn("warn: queue-proc: imsg_get");
@@ -77,6 +106,119 @@ queue_proc_call(void)
 	fatalx("queue-proc: exiting");
 }
 
+/* replies to pipelined requests found on the way are consumed */
+static void
+queue_proc_wait(uint32_t id)
+{
+	while (1) {
+		queue_proc_next();
+		if (!(caps & PROC_QUEUE_CAP_PIPELINE) ||
+		    imsg.hdr.peerid == id)
+			return;
+		queue_proc_done();
+	}
+}
+
+static void
+queue_proc_drain(size_t n)
+{
+	while (inflight > n) {
+		queue_proc_next();
+		queue_proc_done();
+	}
+}
+
+/* the reply to a pipelined request, nobody waits for its result */
+static void
+queue_proc_done(void)
+{
+	int	r;
+
+	if (inflight == 0) {
+		log_warnx("warn: queue-proc: unexpected reply");
+		fatalx("queue-proc: exiting");
+	}
+	inflight--;
+
+	queue_proc_read(&r, sizeof(r));
+	queue_proc_end();
+	if (r != 1)
+		log_warnx("warn: queue-proc: request %"PRIu32" failed",
+		    imsg.hdr.peerid);
+}
+
+static void
+queue_proc_dispatch(int fd, short event, void *p)
+{
+	ssize_t	n;
+
+	/* a synchronous call may have consumed the replies already */
+	if (inflight == 0)
+		return;
+
+	if ((n = imsg_read(&ibuf)) == -1 && errno != EAGAIN) {
+		log_warn("warn: queue-proc: imsg_read");
+		fatalx("queue-proc: exiting");
+	}
+	if (n == 0) {
+		log_warnx("warn: queue-proc: pipe closed");
+		fatalx("queue-proc: exiting");
+	}
+
+	while (inflight) {
+		if ((n = imsg_get(&ibuf, &imsg)) == -1) {
+			log_warn("warn: queue-proc: imsg_get");
+			fatalx("queue-proc: exiting");
+		}
+		if (n == 0)
+			break;
+		rlen = imsg.hdr.len - IMSG_HEADER_SIZE;
+		rdata = imsg.data;
+		if (imsg.hdr.type != PROC_QUEUE_OK) {
+			log_warnx("warn: queue-proc: bad response");
+			fatalx("queue-proc: exiting");
+		}
+		queue_proc_done();
+	}
+}
+
+/*
+ * Send a request whose result is only logged.  When the backend
+ * pipelines, its reply is picked up later from the event loop.
+ */
+static int
+queue_proc_async(void)
+{
+	int	r;
+
+	if (!(caps & PROC_QUEUE_CAP_PIPELINE)) {
+		queue_proc_call();
+		queue_proc_read(&r, sizeof(r));
+		queue_proc_end();
+		return (r);
+	}
+
+	if (imsg_flush(&ibuf) == -1) {
+		log_warn("warn: queue-proc: imsg_flush");
+		fatalx("queue-proc: exiting");
+	}
+	inflight++;
+
+	/* only reached from the queue event loop */
+	if (!ev_set) {
+		event_set(&ev_reply, ibuf.fd, EV_READ|EV_PERSIST,
+		    queue_proc_dispatch, NULL);
+		event_add(&ev_reply, NULL);
+		ev_set = 1;
+	}
+
+	/* do not let the backend get too far behind */
+	if (inflight >= QUEUE_PROC_MAXINFLIGHT)
+		queue_proc_drain(QUEUE_PROC_MAXINFLIGHT / 2);
+
+	return (1);
+}
+
 static void
 queue_proc_read(void *dst, size_t len)
 {
@@ -109,7 +251,7 @@ queue_proc_close(void)
 {
 	int	r;
 
-	imsg_compose(&ibuf, PROC_QUEUE_CLOSE, 0, 0, -1, NULL, 0);
+	imsg_compose(&ibuf, PROC_QUEUE_CLOSE, ++reqid, 0, -1, NULL, 0);
 
 	queue_proc_call();
 	queue_proc_read(&r, sizeof(r));
@@ -123,7 +265,7 @@ queue_proc_message_create(uint32_t *msgid)
 {
 	int	r;
 
-	imsg_compose(&ibuf, PROC_QUEUE_MESSAGE_CREATE, 0, 0, -1, NULL, 0);
+	imsg_compose(&ibuf, PROC_QUEUE_MESSAGE_CREATE, ++reqid, 0, -1, NULL, 0);
 
 	queue_proc_call();
 	queue_proc_read(&r, sizeof(r));
@@ -145,7 +287,7 @@ queue_proc_message_commit(uint32_t msgid, const char *path)
 		return (0);
 	}
 
-	imsg_compose(&ibuf, PROC_QUEUE_MESSAGE_COMMIT, 0, 0, fd, &msgid,
+	imsg_compose(&ibuf, PROC_QUEUE_MESSAGE_COMMIT, ++reqid, 0, fd, &msgid,
 	    sizeof(msgid));
 
 	queue_proc_call();
@@ -158,22 +300,16 @@ queue_proc_message_commit(uint32_t msgid, const char *path)
 static int
 queue_proc_message_delete(uint32_t msgid)
 {
-	int	r;
-
-	imsg_compose(&ibuf, PROC_QUEUE_MESSAGE_DELETE, 0, 0, -1, &msgid,
+	imsg_compose(&ibuf, PROC_QUEUE_MESSAGE_DELETE, ++reqid, 0, -1, &msgid,
 	    sizeof(msgid));
 
-	queue_proc_call();
-	queue_proc_read(&r, sizeof(r));
-	queue_proc_end();
-
-	return (r);
+	return (queue_proc_async());
 }
 
 static int
 queue_proc_message_fd_r(uint32_t msgid)
 {
-	imsg_compose(&ibuf, PROC_QUEUE_MESSAGE_FD_R, 0, 0, -1, &msgid,
+	imsg_compose(&ibuf, PROC_QUEUE_MESSAGE_FD_R, ++reqid, 0, -1, &msgid,
 	    sizeof(msgid));
 
 	queue_proc_call();
@@ -190,7 +326,7 @@ queue_proc_envelope_create(uint32_t msgid, const char *buf, size_t len,
 	int		 r;
 
 	msgid = evpid_to_msgid(*evpid);
-	b = imsg_create(&ibuf, PROC_QUEUE_ENVELOPE_CREATE, 0, 0,
+	b = imsg_create(&ibuf, PROC_QUEUE_ENVELOPE_CREATE, ++reqid, 0,
 	    sizeof(msgid) + len);
 	if (imsg_add(b, &msgid, sizeof(msgid)) == -1 ||
 	    imsg_add(b, buf, len) == -1)
@@ -209,16 +345,28 @@ queue_proc_envelope_create(uint32_t msgid, const char *buf, size_t len,
 static int
 queue_proc_envelope_delete(uint64_t evpid)
 {
-	int	r;
-
-	imsg_compose(&ibuf, PROC_QUEUE_ENVELOPE_DELETE, 0, 0, -1, &evpid,
+	imsg_compose(&ibuf, PROC_QUEUE_ENVELOPE_DELETE, ++reqid, 0, -1, &evpid,
 	    sizeof(evpid));
 
-	queue_proc_call();
-	queue_proc_read(&r, sizeof(r));
-	queue_proc_end();
+	return (queue_proc_async());
+}
 
-	return (r);
+static int
+queue_proc_envelope_delete_batch(const uint64_t *evpids, size_t n)
+{
+	size_t	count;
+
+	while (n) {
+		count = MIN(n, QUEUE_PROC_BATCH);
+		imsg_compose(&ibuf, PROC_QUEUE_ENVELOPE_DELETE_BATCH, ++reqid,
+		    0, -1, evpids, count * sizeof(*evpids));
+		if (!queue_proc_async())
+			return (0);
+		evpids += count;
+		n -= count;
+	}
+
+	return (1);
 }
 
 static int
@@ -227,7 +375,7 @@ queue_proc_envelope_update(uint64_t evpid, const char *buf, size_t len)
 	struct ibuf	*b;
 	int		 r;
 
-	b = imsg_create(&ibuf, PROC_QUEUE_ENVELOPE_UPDATE, 0, 0,
+	b = imsg_create(&ibuf, PROC_QUEUE_ENVELOPE_UPDATE, ++reqid, 0,
 	    len + sizeof(evpid));
 	if (imsg_add(b, &evpid, sizeof(evpid)) == -1 ||
 	    imsg_add(b, buf, len) == -1)
@@ -246,7 +394,7 @@ queue_proc_envelope_load(uint64_t evpid, char *buf, size_t len)
 {
 	int	r;
 
-	imsg_compose(&ibuf, PROC_QUEUE_ENVELOPE_LOAD, 0, 0, -1, &evpid,
+	imsg_compose(&ibuf, PROC_QUEUE_ENVELOPE_LOAD, ++reqid, 0, -1, &evpid,
 	    sizeof(evpid));
 
 	queue_proc_call();
@@ -268,7 +416,7 @@ queue_proc_envelope_walk(uint64_t *evpid, char *buf, size_t len)
 {
 	int	r;
 
-	imsg_compose(&ibuf, PROC_QUEUE_ENVELOPE_WALK, 0, 0, -1, NULL, 0);
+	imsg_compose(&ibuf, PROC_QUEUE_ENVELOPE_WALK, ++reqid, 0, -1, NULL, 0);
 
 	queue_proc_call();
 	queue_proc_read(&r, sizeof(r));
@@ -293,7 +441,7 @@ queue_proc_envelope_walk(uint64_t *evpid, char *buf, size_t len)
 static int
 queue_proc_init(struct passwd *pw, int server, const char *conf)
 {
-	uint32_t	version;
+	uint32_t	version, offer;
 	int		fd;
 
 	fd = fork_proc_backend("queue", conf, "queue-proc", 0);
@@ -303,7 +451,7 @@ queue_proc_init(struct passwd *pw, int server, const char *conf)
 	imsg_init(&ibuf, fd);
 
 	version = PROC_QUEUE_API_VERSION;
-	imsg_compose(&ibuf, PROC_QUEUE_INIT, 0, 0, -1,
+	imsg_compose(&ibuf, PROC_QUEUE_INIT, ++reqid, 0, -1,
 	    &version, sizeof(version));
 
 	queue_api_on_close(queue_proc_close);
@@ -318,8 +466,24 @@ queue_proc_init(struct passwd *pw, int server, const char *conf)
 	queue_api_on_envelope_walk(queue_proc_envelope_walk);
 
 	queue_proc_call();
+	offer = 0;
+	if (rlen >= sizeof(offer))
+		queue_proc_read(&offer, sizeof(offer));
 	queue_proc_end();
 
+	/* older backends do not offer anything */
+	offer &= PROC_QUEUE_CAP_PIPELINE | PROC_QUEUE_CAP_DELETE_BATCH;
+	if (offer) {
+		imsg_compose(&ibuf, PROC_QUEUE_CAPABILITIES, ++reqid, 0, -1,
+		    &offer, sizeof(offer));
+		queue_proc_call();
+		queue_proc_end();
+		caps = offer;
+	}
+	if (caps & PROC_QUEUE_CAP_DELETE_BATCH)
+		queue_api_on_envelope_delete_batch(
+		    queue_proc_envelope_delete_batch);
+
 	return (1);
 }
 
@@ -23,7 +23,13 @@
 #include <sys/tree.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -31,18 +37,42 @@
 #include "smtpd.h"
 #include "log.h"
 
+/*
+ * Past the configured memory budget, the oldest committed messages are
+ * spilled to the spool, body and envelopes, and served from there until
+ * they are removed.  Their entries are kept with a NULL buffer.
+ */
+#define PATH_RAM		"/ram"
+
+#define	QR_INCOMING		0
+#define	QR_MEMORY		1
+#define	QR_SPILLED		2
+
 struct qr_envelope {
 	char		*buf;
 	size_t		 len;
 };
 
 struct qr_message {
-	char		*buf;
-	size_t		 len;
-	struct tree	 envelopes;
+	uint32_t		 msgid;
+	int			 state;
+	char			*buf;
+	size_t			 len;
+	struct tree		 envelopes;
+	TAILQ_ENTRY(qr_message)	 entry;
 };
 
+static void qr_path(uint32_t, uint64_t, char *, size_t);
+static int qr_write(uint32_t, uint64_t, const char *, size_t);
+static size_t qr_read(uint32_t, uint64_t, char *, size_t);
+static int qr_spill(struct qr_message *);
+static void qr_budget(void);
+static void qr_free(struct qr_message *);
+
 static struct tree messages;
+static TAILQ_HEAD(, qr_message) hot;
+static size_t	budget;
+static size_t	used;
 
 static struct qr_message *
 get_message(uint32_t msgid)
@@ -72,6 +102,8 @@ queue_ram_message_create(uint32_t *msgid)
 		*msgid = queue_generate_msgid();
 	} while (tree_check(&messages, *msgid));
 
+	msg->msgid = *msgid;
+	msg->state = QR_INCOMING;
 	tree_xset(&messages, *msgid, msg);
 
 	return (1);
@@ -119,9 +151,15 @@ queue_ram_message_commit(uint32_t msgid, const char *path)
 	else {
 		ret = 1;
 		stat_increment("queue.ram.message.size", msg->len);
+		used += msg->len;
+		msg->state = QR_MEMORY;
+		TAILQ_INSERT_TAIL(&hot, msg, entry);
 	}
 	fclose(f);
 
+	if (ret)
+		qr_budget();
+
 	return (ret);
 }
 
@@ -129,64 +167,58 @@ static int
 queue_ram_message_delete(uint32_t msgid)
 {
 	struct qr_message	*msg;
-	struct qr_envelope	*evp;
-	uint64_t		 evpid;
 
 	if ((msg = tree_pop(&messages, msgid)) == NULL) {
 		log_warnx("warn: queue-ram: not found");
 		return (0);
 	}
-	while (tree_poproot(&messages, &evpid, (void**)&evp)) {
-		stat_decrement("queue.ram.envelope.size", evp->len);
-		free(evp->buf);
-		free(evp);
-	}
-	stat_decrement("queue.ram.message.size", msg->len);
-	free(msg->buf);
-	free(msg);
-	return (0);
+	qr_free(msg);
+	return (1);
 }
 
 static int
 queue_ram_message_fd_r(uint32_t msgid)
 {
 	struct qr_message	*msg;
-	size_t			 n;
-	FILE			*f;
-	int			 fd, fd2;
+	char			 path[PATH_MAX];
+	ssize_t			 n;
+	size_t			 off;
+	int			 fd = -1;
 
 	if ((msg = tree_get(&messages, msgid)) == NULL) {
 		log_warnx("warn: queue-ram: not found");
 		return (-1);
 	}
 
-	fd = mktmpfile();
-	if (fd == -1) {
-		log_warn("warn: queue-ram: mktmpfile");
-		return (-1);
+	if (msg->state == QR_SPILLED) {
+		qr_path(msgid, 0, path, sizeof(path));
+		if ((fd = open(path, O_RDONLY)) == -1)
+			log_warn("warn: queue-ram: open: %s", path);
+		return (fd);
 	}
 
-	fd2 = dup(fd);
-	if (fd2 == -1) {
-		log_warn("warn: queue-ram: dup");
-		close(fd);
-		return (-1);
-	}
-	f = fdopen(fd2, "w");
-	if (f == NULL) {
-		log_warn("warn: queue-ram: fdopen");
-		close(fd);
-		close(fd2);
+	/* do not go through the disk for a message that is in memory */
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("smtpd", 0);
+#endif
+	if (fd == -1)
+		fd = mktmpfile();
+	if (fd == -1) {
+		log_warn("warn: queue-ram: cannot create a message file");
 		return (-1);
 	}
-	n = fwrite(msg->buf, 1, msg->len, f);
-	if (n != msg->len) {
-		log_warn("warn: queue-ram: write");
-		close(fd);
-		fclose(f);
-		return (-1);
+
+	for (off = 0; off < msg->len; off += n) {
+		if ((n = write(fd, msg->buf + off, msg->len - off)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			log_warn("warn: queue-ram: write");
+			close(fd);
+			return (-1);
+		}
 	}
-	fclose(f);
 	lseek(fd, 0, SEEK_SET);
 	return (fd);
 }
@@ -209,6 +241,14 @@ queue_ram_envelope_create(uint32_t msgid, const char *buf, size_t len,
 		log_warn("warn: queue-ram: calloc");
 		return (0);
 	}
+	if (msg->state == QR_SPILLED) {
+		if (!qr_write(msgid, *evpid, buf, len)) {
+			free(evp);
+			return (0);
+		}
+		tree_xset(&msg->envelopes, *evpid, evp);
+		return (1);
+	}
 	evp->len = len;
 	evp->buf = malloc(len);
 	if (evp->buf == NULL) {
@@ -219,6 +259,8 @@ queue_ram_envelope_create(uint32_t msgid, const char *buf, size_t len,
 	memmove(evp->buf, buf, len);
 	tree_xset(&msg->envelopes, *evpid, evp);
 	stat_increment("queue.ram.envelope.size", len);
+	used += len;
+	qr_budget();
 	return (1);
 }
 
@@ -227,6 +269,7 @@ queue_ram_envelope_delete(uint64_t evpid)
 {
 	struct qr_envelope	*evp;
 	struct qr_message	*msg;
+	char			 path[PATH_MAX];
 
 	if ((msg = get_message(evpid_to_msgid(evpid))) == NULL)
 		return (0);
@@ -235,14 +278,19 @@ queue_ram_envelope_delete(uint64_t evpid)
 		log_warnx("warn: queue-ram: not found");
 		return (0);
 	}
-	stat_decrement("queue.ram.envelope.size", evp->len);
+	if (evp->buf) {
+		stat_decrement("queue.ram.envelope.size", evp->len);
+		used -= evp->len;
+	} else {
+		qr_path(msg->msgid, evpid, path, sizeof(path));
+		if (unlink(path) == -1 && errno != ENOENT)
+			log_warn("warn: queue-ram: unlink: %s", path);
+	}
 	free(evp->buf);
 	free(evp);
 	if (tree_empty(&msg->envelopes)) {
 		tree_xpop(&messages, evpid_to_msgid(evpid));
-		stat_decrement("queue.ram.message.size", msg->len);
-		free(msg->buf);
-		free(msg);
+		qr_free(msg);
 	}
 	return (1);
 }
@@ -261,17 +309,21 @@ queue_ram_envelope_update(uint64_t evpid, const char *buf, size_t len)
 		log_warn("warn: queue-ram: not found");
 		return (0);
 	}
+	if (msg->state == QR_SPILLED)
+		return (qr_write(msg->msgid, evpid, buf, len));
 	tmp = malloc(len);
 	if (tmp == NULL) {
 		log_warn("warn: queue-ram: malloc");
 		return (0);
 	}
 	memmove(tmp, buf, len);
+	stat_decrement("queue.ram.envelope.size", evp->len);
+	stat_increment("queue.ram.envelope.size", len);
+	used = used - evp->len + len;
 	free(evp->buf);
 	evp->len = len;
 	evp->buf = tmp;
-	stat_decrement("queue.ram.envelope.size", evp->len);
-	stat_increment("queue.ram.envelope.size", len);
+	qr_budget();
 	return (1);
 }
 
@@ -288,6 +340,8 @@ queue_ram_envelope_load(uint64_t evpid, char *buf, size_t len)
 		log_warn("warn: queue-ram: not found");
 		return (0);
 	}
+	if (msg->state == QR_SPILLED)
+		return (qr_read(msg->msgid, evpid, buf, len));
 	if (len < evp->len) {
 		log_warnx("warn: queue-ram: buffer too small");
 		return (0);
@@ -302,10 +356,204 @@ queue_ram_envelope_walk(uint64_t *evpid, char *buf, size_t len)
 	return (-1);
 }
 
+static void
+qr_path(uint32_t msgid, uint64_t evpid, char *buf, size_t len)
+{
+	int	r;
+
+	if (evpid)
+		r = bsnprintf(buf, len, "%s/%08x/%016"PRIx64, PATH_RAM,
+		    msgid, evpid);
+	else
+		r = bsnprintf(buf, len, "%s/%08x/message", PATH_RAM, msgid);
+	if (!r)
+		fatalx("qr_path: path does not fit buffer");
+}
+
+static int
+qr_write(uint32_t msgid, uint64_t evpid, const char *buf, size_t len)
+{
+	char	path[PATH_MAX];
+	char	tmp[PATH_MAX];
+	ssize_t	n;
+	int	fd;
+
+	qr_path(msgid, evpid, path, sizeof(path));
+	if (!bsnprintf(tmp, sizeof(tmp), "%s.tmp", path))
+		return (0);
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		log_warn("warn: queue-ram: open: %s", tmp);
+		return (0);
+	}
+	while (len) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_warn("warn: queue-ram: write");
+			goto fail;
+		}
+		buf += n;
+		len -= n;
+	}
+	if (close(fd) == -1) {
+		fd = -1;
+		log_warn("warn: queue-ram: close");
+		goto fail;
+	}
+	if (rename(tmp, path) == -1) {
+		fd = -1;
+		log_warn("warn: queue-ram: rename");
+		goto fail;
+	}
+	return (1);
+
+fail:
+	if (fd != -1)
+		close(fd);
+	unlink(tmp);
+	return (0);
+}
+
+static size_t
+qr_read(uint32_t msgid, uint64_t evpid, char *buf, size_t len)
+{
+	char	path[PATH_MAX];
+	ssize_t	n;
+	size_t	r = 0;
+	int	fd;
+
+	qr_path(msgid, evpid, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("warn: queue-ram: open: %s", path);
+		return (0);
+	}
+	while (r < len) {
+		if ((n = read(fd, buf + r, len - r)) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_warn("warn: queue-ram: read");
+			r = 0;
+			break;
+		}
+		if (n == 0)
+			break;
+		r += n;
+	}
+	close(fd);
+
+	if (r == len) {
+		log_warnx("warn: queue-ram: buffer too small");
+		return (0);
+	}
+	return (r);
+}
+
+static int
+qr_spill(struct qr_message *msg)
+{
+	struct qr_envelope	*evp;
+	char			 path[PATH_MAX];
+	uint64_t		 evpid;
+	void			*iter;
+
+	if (!bsnprintf(path, sizeof(path), "%s/%08x", PATH_RAM, msg->msgid))
+		return (0);
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+		log_warn("warn: queue-ram: mkdir: %s", path);
+		return (0);
+	}
+
+	if (!qr_write(msg->msgid, 0, msg->buf, msg->len))
+		goto fail;
+	iter = NULL;
+	while (tree_iter(&msg->envelopes, &iter, &evpid, (void **)&evp))
+		if (!qr_write(msg->msgid, evpid, evp->buf, evp->len))
+			goto fail;
+
+	iter = NULL;
+	while (tree_iter(&msg->envelopes, &iter, &evpid, (void **)&evp)) {
+		stat_decrement("queue.ram.envelope.size", evp->len);
+		used -= evp->len;
+		free(evp->buf);
+		evp->buf = NULL;
+		evp->len = 0;
+	}
+	stat_decrement("queue.ram.message.size", msg->len);
+	used -= msg->len;
+	free(msg->buf);
+	msg->buf = NULL;
+	msg->len = 0;
+
+	TAILQ_REMOVE(&hot, msg, entry);
+	msg->state = QR_SPILLED;
+	stat_increment("queue.ram.message.spilled", 1);
+	return (1);
+
+fail:
+	if (rmtree(path, 0) == -1)
+		log_warnx("warn: queue-ram: could not remove %s", path);
+	return (0);
+}
+
+/* spill the oldest messages until memory is back under the budget */
+static void
+qr_budget(void)
+{
+	struct qr_message	*msg;
+
+	while (budget && used > budget && (msg = TAILQ_FIRST(&hot)))
+		if (!qr_spill(msg))
+			break;
+}
+
+static void
+qr_free(struct qr_message *msg)
+{
+	struct qr_envelope	*evp;
+	char			 path[PATH_MAX];
+	uint64_t		 evpid;
+
+	while (tree_poproot(&msg->envelopes, &evpid, (void**)&evp)) {
+		if (evp->buf) {
+			stat_decrement("queue.ram.envelope.size", evp->len);
+			used -= evp->len;
+		}
+		free(evp->buf);
+		free(evp);
+	}
+
+	if (msg->state == QR_MEMORY)
+		TAILQ_REMOVE(&hot, msg, entry);
+	if (msg->state == QR_SPILLED) {
+		if (bsnprintf(path, sizeof(path), "%s/%08x", PATH_RAM,
+		    msg->msgid) && rmtree(path, 0) == -1)
+			log_warnx("warn: queue-ram: could not remove %s", path);
+		stat_decrement("queue.ram.message.spilled", 1);
+	}
+	if (msg->buf) {
+		stat_decrement("queue.ram.message.size", msg->len);
+		used -= msg->len;
+	}
+	free(msg->buf);
+	free(msg);
+}
+
 static int
 queue_ram_init(struct passwd *pw, int server, const char * conf)
 {
 	tree_init(&messages);
+	TAILQ_INIT(&hot);
+
+	if (env != NULL)
+		budget = env->sc_queue_ram_size;
+
+	/* whatever was spilled did not survive the previous run */
+	if (server && budget) {
+		if (ckdir(PATH_SPOOL PATH_RAM, 0700, pw->pw_uid, 0, 1) == 0 ||
+		    rmtree(PATH_SPOOL PATH_RAM, 1) == -1)
+			return (0);
+	}
 
 	queue_api_on_message_create(queue_ram_message_create);
 	queue_api_on_message_commit(queue_ram_message_commit);
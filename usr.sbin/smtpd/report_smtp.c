@@ -46,6 +46,32 @@
 
 #include "smtpd.h"
 
+/*
+ * Events with a reporter subscribed, per direction, as published by lka
+ * once every processor registered.  Until then, everything is sent.
+ */
+static uint32_t	report_events_in = ~0U;
+static uint32_t	report_events_out = ~0U;
+
+void
+report_smtp_events(uint32_t in, uint32_t out)
+{
+	report_events_in = in;
+	report_events_out = out;
+}
+
+int
+report_smtp_wanted(const char *direction, enum report_event event)
+{
+	uint32_t	events;
+
+	if (strcmp(direction, "smtp-in") == 0)
+		events = report_events_in;
+	else
+		events = report_events_out;
+	return (events & (1U << event)) != 0;
+}
+
 void
 report_smtp_link_connect(const char *direction, uint64_t qid, const char *rdns, int fcrdns,
     const struct sockaddr_storage *ss_src,
@@ -53,7 +79,7 @@ report_smtp_link_connect(const char *direction, uint64_t qid, const char *rdns,
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_LINK_CONNECT, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -72,7 +98,10 @@ report_smtp_link_greeting(const char *direction, uint64_t qid,
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_LINK_GREETING))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_LINK_GREETING, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -87,7 +116,10 @@ report_smtp_link_identify(const char *direction, uint64_t qid, const char *metho
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_LINK_IDENTIFY))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_LINK_IDENTIFY, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -103,7 +135,10 @@ report_smtp_link_tls(const char *direction, uint64_t qid, const char *ssl)
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_LINK_TLS))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_LINK_TLS, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -118,7 +153,10 @@ report_smtp_link_disconnect(const char *direction, uint64_t qid)
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_LINK_DISCONNECT))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_LINK_DISCONNECT, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -132,7 +170,7 @@ report_smtp_link_auth(const char *direction, uint64_t qid, const char *user, con
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_LINK_AUTH, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -148,7 +186,10 @@ report_smtp_tx_reset(const char *direction, uint64_t qid, uint32_t msgid)
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_TX_RESET))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_TX_RESET, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -163,7 +204,10 @@ report_smtp_tx_begin(const char *direction, uint64_t qid, uint32_t msgid)
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_TX_BEGIN))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_TX_BEGIN, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -178,7 +222,10 @@ report_smtp_tx_mail(const char *direction, uint64_t qid, uint32_t msgid, const c
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_TX_MAIL))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_TX_MAIL, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -195,7 +242,10 @@ report_smtp_tx_rcpt(const char *direction, uint64_t qid, uint32_t msgid, const c
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_TX_RCPT))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_TX_RCPT, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -212,7 +262,10 @@ report_smtp_tx_envelope(const char *direction, uint64_t qid, uint32_t msgid, uin
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_TX_ENVELOPE))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_TX_ENVELOPE, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -228,7 +281,10 @@ report_smtp_tx_data(const char *direction, uint64_t qid, uint32_t msgid, int ok)
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_TX_DATA))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_TX_DATA, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -244,7 +300,10 @@ report_smtp_tx_commit(const char *direction, uint64_t qid, uint32_t msgid, size_
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_TX_COMMIT))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_TX_COMMIT, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -260,7 +319,10 @@ report_smtp_tx_rollback(const char *direction, uint64_t qid, uint32_t msgid)
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_TX_ROLLBACK))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_TX_ROLLBACK, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -275,7 +337,10 @@ report_smtp_protocol_client(const char *direction, uint64_t qid, const char *com
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_PROTOCOL_CLIENT))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_PROTOCOL_CLIENT, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -290,7 +355,10 @@ report_smtp_protocol_server(const char *direction, uint64_t qid, const char *res
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_PROTOCOL_SERVER))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_PROTOCOL_SERVER, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -305,7 +373,10 @@ report_smtp_filter_response(const char *direction, uint64_t qid, int phase, int
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_FILTER_RESPONSE))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_FILTER_RESPONSE, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -322,7 +393,10 @@ report_smtp_timeout(const char *direction, uint64_t qid)
 {
 	struct timeval	tv;
 
-	gettimeofday(&tv, NULL);
+	if (!report_smtp_wanted(direction, REPORT_TIMEOUT))
+		return;
+
+	clock_cached_tv(&tv);
 
 	m_create(p_lka, IMSG_REPORT_SMTP_TIMEOUT, 0, 0, -1);
 	m_add_string(p_lka, direction);
@@ -25,14 +25,19 @@
 
 #include <asr.h>
 #include <errno.h>
+#include <event.h>
+#include <grp.h> /* needed for setgroups */
+#include <imsg.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "smtpd.h"
 #include "log.h"
 
-#define p_resolver p_lka
-
 struct request {
 	SPLAY_ENTRY(request)	 entry;
 	uint32_t		 id;
@@ -43,24 +48,43 @@ struct request {
 	struct addrinfo		*ai;
 };
 
+/*
+ * A query identical to one still in flight is not sent again: the
+ * requester is added to the waiters of the running query, and all of
+ * them get the result.
+ */
+struct waiter {
+	TAILQ_ENTRY(waiter)	 entry;
+	uint32_t		 reqid;
+	struct mproc		*proc;
+};
+
 struct session {
-	uint32_t	 reqid;
-	struct mproc	*proc;
-	char		*host;
-	char		*serv;
+	TAILQ_HEAD(, waiter)	 waiters;
+	char			*key;
+	char			*host;
+	char			*serv;
 };
 
 SPLAY_HEAD(reqtree, request);
 
+static void resolver_imsg(struct mproc *, struct imsg *);
+static void resolver_shutdown(void);
 static void resolver_init(void);
 static void resolver_getaddrinfo_cb(struct asr_result *, void *);
 static void resolver_getnameinfo_cb(struct asr_result *, void *);
 static void resolver_res_query_cb(struct asr_result *, void *);
+static int resolver_session_join(const char *, struct mproc *, uint32_t);
+static struct session *resolver_session_new(const char *, struct mproc *,
+    uint32_t);
+static void resolver_session_start(struct session *);
+static void resolver_session_free(struct session *);
 
 static int request_cmp(struct request *, struct request *);
 SPLAY_PROTOTYPE(reqtree, request, entry, request_cmp);
 
 static struct reqtree reqs;
+static struct hdict sessions;
 
 void
 resolver_getaddrinfo(const char *hostname, const char *servname,
@@ -159,8 +183,11 @@ resolver_dispatch_request(struct mproc *proc, struct imsg *imsg)
 	struct sockaddr_storage ss;
 	struct sockaddr *sa;
 	struct msg m;
+	char key[LINE_MAX];
 	uint32_t reqid;
-	int class, type, flags, save_errno;
+	int class, type, flags, port, save_errno;
+
+	resolver_init();
 
 	reqid = imsg->hdr.peerid;
 	m_msg(&m, imsg);
@@ -178,13 +205,19 @@ resolver_dispatch_request(struct mproc *proc, struct imsg *imsg)
 		m_get_string(&m, &servname);
 		m_end(&m);
 
+		(void)snprintf(key, sizeof(key), "ai/%d/%d/%d/%d/%s/%s",
+		    hints.ai_flags, hints.ai_family, hints.ai_socktype,
+		    hints.ai_protocol, hostname ? hostname : "",
+		    servname ? servname : "");
+		if (resolver_session_join(key, proc, reqid))
+			break;
+
 		s = NULL;
 		q = NULL;
-		if ((s = calloc(1, sizeof(*s))) &&
+		if ((s = resolver_session_new(key, proc, reqid)) &&
 		    (q = getaddrinfo_async(hostname, servname, &hints, NULL)) &&
 		    (event_asr_run(q, resolver_getaddrinfo_cb, s))) {
-			s->reqid = reqid;
-			s->proc = proc;
+			resolver_session_start(s);
 			break;
 		}
 		save_errno = errno;
@@ -192,7 +225,7 @@ resolver_dispatch_request(struct mproc *proc, struct imsg *imsg)
 		if (q)
 			asr_abort(q);
 		if (s)
-			free(s);
+			resolver_session_free(s);
 
 		m_create(proc, IMSG_GETADDRINFO_END, reqid, 0, -1);
 		m_add_int(proc, EAI_SYSTEM);
@@ -206,27 +239,34 @@ resolver_dispatch_request(struct mproc *proc, struct imsg *imsg)
 		m_get_int(&m, &flags);
 		m_end(&m);
 
+		if (sa->sa_family == AF_INET)
+			port = ntohs(((struct sockaddr_in *)sa)->sin_port);
+		else if (sa->sa_family == AF_INET6)
+			port = ntohs(((struct sockaddr_in6 *)sa)->sin6_port);
+		else
+			port = 0;
+		(void)snprintf(key, sizeof(key), "ni/%d/%s/%d", flags,
+		    sa_to_text(sa), port);
+		if (resolver_session_join(key, proc, reqid))
+			break;
+
 		s = NULL;
 		q = NULL;
-		if ((s = calloc(1, sizeof(*s))) &&
+		if ((s = resolver_session_new(key, proc, reqid)) &&
 		    (s->host = malloc(NI_MAXHOST)) &&
 		    (s->serv = malloc(NI_MAXSERV)) &&
 		    (q = getnameinfo_async(sa, SA_LEN(sa), s->host, NI_MAXHOST,
 			s->serv, NI_MAXSERV, flags, NULL)) &&
 		    (event_asr_run(q, resolver_getnameinfo_cb, s))) {
-			s->reqid = reqid;
-			s->proc = proc;
+			resolver_session_start(s);
 			break;
 		}
 		save_errno = errno;
 
 		if (q)
 			asr_abort(q);
-		if (s) {
-			free(s->host);
-			free(s->serv);
-			free(s);
-		}
+		if (s)
+			resolver_session_free(s);
 
 		m_create(proc, IMSG_GETNAMEINFO, reqid, 0, -1);
 		m_add_int(proc, EAI_SYSTEM);
@@ -242,13 +282,17 @@ resolver_dispatch_request(struct mproc *proc, struct imsg *imsg)
 		m_get_int(&m, &type);
 		m_end(&m);
 
+		(void)snprintf(key, sizeof(key), "res/%d/%d/%s", class, type,
+		    dname);
+		if (resolver_session_join(key, proc, reqid))
+			break;
+
 		s = NULL;
 		q = NULL;
-		if ((s = calloc(1, sizeof(*s))) &&
+		if ((s = resolver_session_new(key, proc, reqid)) &&
 		    (q = res_query_async(dname, class, type, NULL)) &&
 		    (event_asr_run(q, resolver_res_query_cb, s))) {
-			s->reqid = reqid;
-			s->proc = proc;
+			resolver_session_start(s);
 			break;
 		}
 		save_errno = errno;
@@ -256,7 +300,7 @@ resolver_dispatch_request(struct mproc *proc, struct imsg *imsg)
 		if (q)
 			asr_abort(q);
 		if (s)
-			free(s);
+			resolver_session_free(s);
 
 		m_create(proc, IMSG_RES_QUERY, reqid, 0, -1);
 		m_add_int(proc, NETDB_INTERNAL);
@@ -381,69 +425,245 @@ resolver_init(void)
 
 	if (init == 0) {
 		SPLAY_INIT(&reqs);
+		hdict_init(&sessions);
 		init = 1;
 	}
 }
 
+static int
+resolver_session_join(const char *key, struct mproc *proc, uint32_t reqid)
+{
+	struct session *s;
+	struct waiter *w;
+
+	if ((s = hdict_get(&sessions, key)) == NULL)
+		return 0;
+	if ((w = calloc(1, sizeof(*w))) == NULL)
+		return 0;
+
+	w->reqid = reqid;
+	w->proc = proc;
+	TAILQ_INSERT_TAIL(&s->waiters, w, entry);
+	stat_increment("resolver.query.coalesced", 1);
+	return 1;
+}
+
+static struct session *
+resolver_session_new(const char *key, struct mproc *proc, uint32_t reqid)
+{
+	struct session *s;
+	struct waiter *w;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return NULL;
+	TAILQ_INIT(&s->waiters);
+
+	if ((s->key = strdup(key)) == NULL ||
+	    (w = calloc(1, sizeof(*w))) == NULL) {
+		resolver_session_free(s);
+		return NULL;
+	}
+	w->reqid = reqid;
+	w->proc = proc;
+	TAILQ_INSERT_TAIL(&s->waiters, w, entry);
+
+	return s;
+}
+
+/* the query is running, let identical ones wait for it */
+static void
+resolver_session_start(struct session *s)
+{
+	hdict_xset(&sessions, s->key, s);
+	stat_increment("resolver.query", 1);
+}
+
+static void
+resolver_session_free(struct session *s)
+{
+	struct waiter *w;
+
+	if (s->key && hdict_get(&sessions, s->key) == s)
+		hdict_xpop(&sessions, s->key);
+	while ((w = TAILQ_FIRST(&s->waiters))) {
+		TAILQ_REMOVE(&s->waiters, w, entry);
+		free(w);
+	}
+	free(s->key);
+	free(s->host);
+	free(s->serv);
+	free(s);
+}
+
 static void
 resolver_getaddrinfo_cb(struct asr_result *ar, void *arg)
 {
 	struct session *s = arg;
+	struct waiter *w;
 	struct addrinfo *ai;
 
-	for (ai = ar->ar_addrinfo; ai; ai = ai->ai_next) {
-		m_create(s->proc, IMSG_GETADDRINFO, s->reqid, 0, -1);
-		m_add_int(s->proc, ai->ai_flags);
-		m_add_int(s->proc, ai->ai_family);
-		m_add_int(s->proc, ai->ai_socktype);
-		m_add_int(s->proc, ai->ai_protocol);
-		m_add_sockaddr(s->proc, ai->ai_addr);
-		m_add_string(s->proc, ai->ai_canonname);
-		m_close(s->proc);
-	}
+	TAILQ_FOREACH(w, &s->waiters, entry) {
+		for (ai = ar->ar_addrinfo; ai; ai = ai->ai_next) {
+			m_create(w->proc, IMSG_GETADDRINFO, w->reqid, 0, -1);
+			m_add_int(w->proc, ai->ai_flags);
+			m_add_int(w->proc, ai->ai_family);
+			m_add_int(w->proc, ai->ai_socktype);
+			m_add_int(w->proc, ai->ai_protocol);
+			m_add_sockaddr(w->proc, ai->ai_addr);
+			m_add_string(w->proc, ai->ai_canonname);
+			m_close(w->proc);
+		}
 
-	m_create(s->proc, IMSG_GETADDRINFO_END, s->reqid, 0, -1);
-	m_add_int(s->proc, ar->ar_gai_errno);
-	m_add_int(s->proc, ar->ar_errno);
-	m_close(s->proc);
+		m_create(w->proc, IMSG_GETADDRINFO_END, w->reqid, 0, -1);
+		m_add_int(w->proc, ar->ar_gai_errno);
+		m_add_int(w->proc, ar->ar_errno);
+		m_close(w->proc);
+	}
 
 	if (ar->ar_addrinfo)
 		asr_freeaddrinfo(ar->ar_addrinfo);
-	free(s);
+	resolver_session_free(s);
 }
 
 static void
 resolver_getnameinfo_cb(struct asr_result *ar, void *arg)
 {
 	struct session *s = arg;
+	struct waiter *w;
+
+	TAILQ_FOREACH(w, &s->waiters, entry) {
+		m_create(w->proc, IMSG_GETNAMEINFO, w->reqid, 0, -1);
+		m_add_int(w->proc, ar->ar_gai_errno);
+		m_add_int(w->proc, ar->ar_errno);
+		m_add_string(w->proc, ar->ar_gai_errno ? NULL : s->host);
+		m_add_string(w->proc, ar->ar_gai_errno ? NULL : s->serv);
+		m_close(w->proc);
+	}
 
-	m_create(s->proc, IMSG_GETNAMEINFO, s->reqid, 0, -1);
-	m_add_int(s->proc, ar->ar_gai_errno);
-	m_add_int(s->proc, ar->ar_errno);
-	m_add_string(s->proc, ar->ar_gai_errno ? NULL : s->host);
-	m_add_string(s->proc, ar->ar_gai_errno ? NULL : s->serv);
-	m_close(s->proc);
-
-	free(s->host);
-	free(s->serv);
-	free(s);
+	resolver_session_free(s);
 }
 
 static void
 resolver_res_query_cb(struct asr_result *ar, void *arg)
 {
 	struct session *s = arg;
-
-	m_create(s->proc, IMSG_RES_QUERY, s->reqid, 0, -1);
-	m_add_int(s->proc, ar->ar_h_errno);
-	m_add_int(s->proc, ar->ar_errno);
-	m_add_int(s->proc, ar->ar_rcode);
-	m_add_int(s->proc, ar->ar_count);
-	m_add_data(s->proc, ar->ar_data, ar->ar_datalen);
-	m_close(s->proc);
+	struct waiter *w;
+
+	TAILQ_FOREACH(w, &s->waiters, entry) {
+		m_create(w->proc, IMSG_RES_QUERY, w->reqid, 0, -1);
+		m_add_int(w->proc, ar->ar_h_errno);
+		m_add_int(w->proc, ar->ar_errno);
+		m_add_int(w->proc, ar->ar_rcode);
+		m_add_int(w->proc, ar->ar_count);
+		m_add_data(w->proc, ar->ar_data, ar->ar_datalen);
+		m_close(w->proc);
+	}
 
 	free(ar->ar_data);
-	free(s);
+	resolver_session_free(s);
+}
+
+/*
+ * The resolver process answers the DNS requests of the dispatcher: the
+ * lookups proxied above, and the MX and host lookups of the mta with
+ * their cache in dns.c.  Running apart from the lka, a burst of queries
+ * does not delay the table lookups and filters of the smtp sessions.
+ */
+static void
+resolver_imsg(struct mproc *p, struct imsg *imsg)
+{
+	struct msg	m;
+	int		v;
+
+	if (imsg == NULL)
+		resolver_shutdown();
+
+	switch (imsg->hdr.type) {
+	case IMSG_GETADDRINFO:
+	case IMSG_GETNAMEINFO:
+	case IMSG_RES_QUERY:
+		resolver_dispatch_request(p, imsg);
+		return;
+
+	case IMSG_MTA_DNS_HOST:
+	case IMSG_MTA_DNS_MX:
+	case IMSG_MTA_DNS_MX_PREFERENCE:
+		dns_imsg(p, imsg);
+		return;
+
+	case IMSG_CTL_VERBOSE:
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		log_trace_verbose(v);
+		return;
+
+	case IMSG_CTL_PROFILE:
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		profiling = v;
+		return;
+
+	case IMSG_CTL_SHOW_PROFILE:
+		profile_show(p, imsg->hdr.peerid);
+		return;
+	}
+
+	fatalx("resolver_imsg: unexpected %s imsg",
+	    imsg_to_str(imsg->hdr.type));
+}
+
+static void
+resolver_shutdown(void)
+{
+	log_debug("debug: resolver agent exiting");
+	_exit(0);
+}
+
+int
+resolver(void)
+{
+	struct passwd	*pw;
+
+	purge_config(PURGE_EVERYTHING);
+
+	if ((pw = getpwnam(SMTPD_USER)) == NULL)
+		fatalx("unknown user " SMTPD_USER);
+
+	config_process(PROC_RESOLVER);
+
+	if (setgroups(1, &pw->pw_gid) ||
+	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
+	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
+		fatal("resolver: cannot drop privileges");
+
+	imsg_callback = resolver_imsg;
+	event_init();
+
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+
+	config_peer(PROC_PARENT);
+	config_peer(PROC_CONTROL);
+	config_peer(PROC_DISPATCHER);
+	config_peer(PROC_MTA);
+	config_peer(PROC_SMTP);
+	config_peer(PROC_LOGGER);
+	stat_cpu_start(NULL);
+	memory_start(NULL, NULL);
+
+#if HAVE_PLEDGE
+	if (pledge("stdio dns", NULL) == -1)
+		fatal("pledge");
+#endif
+
+	event_dispatch();
+	fatalx("exited event loop");
+
+	return (0);
 }
 
 static int
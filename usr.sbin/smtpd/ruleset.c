@@ -26,12 +26,69 @@
 #include <netinet/in.h>
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "smtpd.h"
+#include "log.h"
 
 #define MATCH_RESULT(r, neg) ((r) == -1 ? -1 : ((neg) < 0 ? !(r) : (r)))
 
+/*
+ * Rules requiring a destination domain or a tag that is listed in a
+ * static table without patterns can only match envelopes with one of
+ * these keys.  Such rules are indexed by key, so that ruleset_match() only
+ * evaluates the rules indexed under the envelope's domain and tag along
+ * with the rules that could not be indexed, still in configuration order.
+ */
+struct ruleset_bucket {
+	size_t		 count;
+	size_t		*rules;
+};
+
+struct ruleset_index {
+	int			 built;
+	unsigned int		 generation;
+	size_t			 count;
+	struct rule		**rules;
+	struct ruleset_bucket	 generic;
+	struct dict		 domains;
+	struct dict		 tags;
+};
+
+static struct ruleset_index	ruleset;
+
+/*
+ * Predicates on the session and the sender have the same result for all
+ * recipients of a message, so their results are remembered per message
+ * and rule.  The sender fields are kept to check that the message is
+ * still the same one; results are only valid until tables are updated.
+ */
+#define	RULESET_MEMO_MAX	256
+
+enum ruleset_predicate {
+	P_TAG,
+	P_FROM,
+	P_SMTP_HELO,
+	P_SMTP_AUTH,
+	P_SMTP_STARTTLS,
+	P_SMTP_MAIL_FROM,
+};
+
+struct ruleset_memo {
+	enum envelope_flags	 flags;
+	char			 tag[SMTPD_TAG_SIZE];
+	char			 helo[HOST_NAME_MAX+1];
+	char			 hostname[HOST_NAME_MAX+1];
+	char			 username[SMTPD_MAXMAILADDRSIZE];
+	struct sockaddr_storage	 ss;
+	struct mailaddr		 sender;
+	uint16_t		*results;
+};
+
+static struct tree	ruleset_memos;
+static int		ruleset_memos_init;
+
 static int
 ruleset_match_tag(struct rule *r, const struct envelope *evp)
 {
@@ -219,11 +276,238 @@ ruleset_match_smtp_rcpt_to(struct rule *r, const struct envelope *evp)
 	return MATCH_RESULT(ret, r->flag_smtp_rcpt_to);
 }
 
+static void
+ruleset_bucket_add(struct ruleset_bucket *b, size_t n)
+{
+	size_t	*tmp;
+
+	tmp = reallocarray(b->rules, b->count + 1, sizeof(*b->rules));
+	if (tmp == NULL)
+		fatal("ruleset_bucket_add: reallocarray");
+	b->rules = tmp;
+	b->rules[b->count++] = n;
+}
+
+static int
+ruleset_index_rule(struct dict *d, const char *name, enum table_service service,
+    size_t n)
+{
+	struct ruleset_bucket	*b;
+	struct table		*table;
+	const char		*key;
+	void			*iter;
+	int			 r;
+
+	if ((table = table_find(env, name)) == NULL)
+		return (0);
+
+	iter = NULL;
+	if ((r = table_static_iter(table, service, &iter, &key)) == -1)
+		return (0);
+
+	for (; r == 1; r = table_static_iter(table, service, &iter, &key)) {
+		if ((b = dict_get(d, key)) == NULL) {
+			b = xcalloc(1, sizeof(*b));
+			dict_xset(d, key, b);
+		}
+		ruleset_bucket_add(b, n);
+	}
+	return (1);
+}
+
+static void
+ruleset_index_build(void)
+{
+	struct rule	*r, **tmp;
+	size_t		 n;
+
+	dict_init(&ruleset.domains);
+	dict_init(&ruleset.tags);
+
+	TAILQ_FOREACH(r, env->sc_rules, r_entry) {
+		n = ruleset.count;
+		tmp = reallocarray(ruleset.rules, n + 1, sizeof(*tmp));
+		if (tmp == NULL)
+			fatal("ruleset_index_build: reallocarray");
+		ruleset.rules = tmp;
+		ruleset.rules[ruleset.count++] = r;
+
+		if (r->flag_for == 1 && !r->flag_for_regex &&
+		    ruleset_index_rule(&ruleset.domains, r->table_for,
+		    K_DOMAIN, n))
+			continue;
+		if (r->flag_tag == 1 && !r->flag_tag_regex &&
+		    ruleset_index_rule(&ruleset.tags, r->table_tag,
+		    K_STRING, n))
+			continue;
+		ruleset_bucket_add(&ruleset.generic, n);
+	}
+	ruleset.built = 1;
+	ruleset.generation = table_generation();
+
+	log_debug("debug: ruleset: %zu rules, %zu not indexed, "
+	    "%zu domains, %zu tags", ruleset.count, ruleset.generic.count,
+	    dict_count(&ruleset.domains), dict_count(&ruleset.tags));
+}
+
+static void
+ruleset_memo_clear(void)
+{
+	struct ruleset_memo	*memo;
+
+	if (!ruleset_memos_init)
+		return;
+
+	while (tree_poproot(&ruleset_memos, NULL, (void **)&memo)) {
+		free(memo->results);
+		free(memo);
+	}
+}
+
+static int
+ruleset_memo_same(struct ruleset_memo *memo, const struct envelope *evp)
+{
+	return (memo->flags == (evp->flags & (EF_INTERNAL|EF_AUTHENTICATED)) &&
+	    strcmp(memo->tag, evp->tag) == 0 &&
+	    strcmp(memo->helo, evp->helo) == 0 &&
+	    strcmp(memo->hostname, evp->hostname) == 0 &&
+	    strcmp(memo->username, evp->username) == 0 &&
+	    memo->ss.ss_family == evp->ss.ss_family &&
+	    memcmp(&memo->ss, &evp->ss, SS_LEN(&evp->ss)) == 0 &&
+	    strcmp(memo->sender.user, evp->sender.user) == 0 &&
+	    strcmp(memo->sender.domain, evp->sender.domain) == 0);
+}
+
+static uint16_t *
+ruleset_memo_get(const struct envelope *evp)
+{
+	struct ruleset_memo	*memo;
+	uint64_t		 id;
+
+	if (evpid_to_msgid(evp->id) == 0)
+		return (NULL);
+
+	if (!ruleset_memos_init) {
+		tree_init(&ruleset_memos);
+		ruleset_memos_init = 1;
+	}
+
+	id = (uint64_t)evpid_to_msgid(evp->id) << 1;
+	if (evp->flags & EF_INTERNAL)
+		id |= 1;
+
+	if ((memo = tree_get(&ruleset_memos, id)) == NULL) {
+		if (tree_count(&ruleset_memos) >= RULESET_MEMO_MAX)
+			ruleset_memo_clear();
+		memo = xcalloc(1, sizeof(*memo));
+		memo->results = xcalloc(ruleset.count ? ruleset.count : 1,
+		    sizeof(*memo->results));
+		tree_xset(&ruleset_memos, id, memo);
+	}
+	else if (ruleset_memo_same(memo, evp))
+		return (memo->results);
+
+	memo->flags = evp->flags & (EF_INTERNAL|EF_AUTHENTICATED);
+	(void)strlcpy(memo->tag, evp->tag, sizeof(memo->tag));
+	(void)strlcpy(memo->helo, evp->helo, sizeof(memo->helo));
+	(void)strlcpy(memo->hostname, evp->hostname, sizeof(memo->hostname));
+	(void)strlcpy(memo->username, evp->username, sizeof(memo->username));
+	memo->ss = evp->ss;
+	memo->sender = evp->sender;
+	memset(memo->results, 0, ruleset.count * sizeof(*memo->results));
+
+	return (memo->results);
+}
+
+static int
+ruleset_memo_eval(uint16_t *memo, enum ruleset_predicate p,
+    int (*match)(struct rule *, const struct envelope *), struct rule *r,
+    const struct envelope *evp)
+{
+	int	ret;
+
+	if (memo && (*memo & (1 << p)))
+		return ((*memo >> (p + 8)) & 1);
+
+	ret = match(r, evp);
+	if (memo && ret != -1)
+		*memo |= (1 << p) | ((ret ? 1 : 0) << (p + 8));
+
+	return (ret);
+}
+
+static void
+ruleset_index_clear(void)
+{
+	struct ruleset_bucket	*b;
+
+	ruleset_memo_clear();
+	if (!ruleset.built)
+		return;
+
+	while (dict_poproot(&ruleset.domains, (void **)&b)) {
+		free(b->rules);
+		free(b);
+	}
+	while (dict_poproot(&ruleset.tags, (void **)&b)) {
+		free(b->rules);
+		free(b);
+	}
+	free(ruleset.generic.rules);
+	free(ruleset.rules);
+	memset(&ruleset, 0, sizeof(ruleset));
+}
+
+static struct ruleset_bucket *
+ruleset_index_get(struct dict *d, const char *key)
+{
+	char	lkey[1024];
+
+	if (!lowercase(lkey, key, sizeof lkey))
+		return (NULL);
+	return (dict_get(d, lkey));
+}
+
+/*
+ * Return the index of the next candidate rule after n, in configuration
+ * order, or ruleset.count when none is left.
+ */
+static size_t
+ruleset_next(struct ruleset_bucket **b, size_t *pos, size_t nb, size_t n)
+{
+	size_t	i, next = ruleset.count;
+
+	for (i = 0; i < nb; i++) {
+		if (b[i] == NULL)
+			continue;
+		while (pos[i] < b[i]->count && b[i]->rules[pos[i]] < n)
+			pos[i]++;
+		if (pos[i] < b[i]->count && b[i]->rules[pos[i]] < next)
+			next = b[i]->rules[pos[i]];
+	}
+	return (next);
+}
+
 struct rule *
 ruleset_match(const struct envelope *evp)
 {
-	struct rule	*r;
-	int		i = 0;
+	struct ruleset_bucket	*b[3];
+	struct rule		*r;
+	uint16_t		*memo, *m;
+	size_t			 pos[3], n;
+	int			 i = 0;
+
+	/* tables changed, keys and predicate results may be stale */
+	if (ruleset.built && ruleset.generation != table_generation())
+		ruleset_index_clear();
+	if (!ruleset.built)
+		ruleset_index_build();
+	memo = ruleset_memo_get(evp);
+
+	b[0] = &ruleset.generic;
+	b[1] = ruleset_index_get(&ruleset.domains, evp->dest.domain);
+	b[2] = ruleset_index_get(&ruleset.tags, evp->tag);
+	memset(pos, 0, sizeof(pos));
 
 #define	MATCH_EVAL(x)				\
 	switch ((x)) {				\
@@ -231,15 +515,24 @@ ruleset_match(const struct envelope *evp)
 	case 0:		continue;		\
 	default:	break;			\
 	}
-	TAILQ_FOREACH(r, env->sc_rules, r_entry) {
-		++i;
-		MATCH_EVAL(ruleset_match_tag(r, evp));
-		MATCH_EVAL(ruleset_match_from(r, evp));
+	for (n = ruleset_next(b, pos, nitems(b), 0); n < ruleset.count;
+	    n = ruleset_next(b, pos, nitems(b), n + 1)) {
+		r = ruleset.rules[n];
+		m = memo ? &memo[n] : NULL;
+		i = n + 1;
+		MATCH_EVAL(ruleset_memo_eval(m, P_TAG,
+		    ruleset_match_tag, r, evp));
+		MATCH_EVAL(ruleset_memo_eval(m, P_FROM,
+		    ruleset_match_from, r, evp));
 		MATCH_EVAL(ruleset_match_to(r, evp));
-		MATCH_EVAL(ruleset_match_smtp_helo(r, evp));
-		MATCH_EVAL(ruleset_match_smtp_auth(r, evp));
-		MATCH_EVAL(ruleset_match_smtp_starttls(r, evp));
-		MATCH_EVAL(ruleset_match_smtp_mail_from(r, evp));
+		MATCH_EVAL(ruleset_memo_eval(m, P_SMTP_HELO,
+		    ruleset_match_smtp_helo, r, evp));
+		MATCH_EVAL(ruleset_memo_eval(m, P_SMTP_AUTH,
+		    ruleset_match_smtp_auth, r, evp));
+		MATCH_EVAL(ruleset_memo_eval(m, P_SMTP_STARTTLS,
+		    ruleset_match_smtp_starttls, r, evp));
+		MATCH_EVAL(ruleset_memo_eval(m, P_SMTP_MAIL_FROM,
+		    ruleset_match_smtp_mail_from, r, evp));
 		MATCH_EVAL(ruleset_match_smtp_rcpt_to(r, evp));
 		goto matched;
 	}
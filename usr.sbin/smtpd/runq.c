@@ -25,25 +25,46 @@
 #include <sys/uio.h>
 
 #include <imsg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
 #include "smtpd.h"
 
+/*
+ * Pending jobs are indexed twice: by (when, seq) to find the next job to
+ * run, and by (arg, seq) so that runq_cancel() and runq_pending() do not
+ * have to scan the whole queue.  The sequence number keeps jobs scheduled
+ * for the same time in insertion order.
+ */
 struct job {
-	TAILQ_ENTRY(job)	 entry;
+	RB_ENTRY(job)		 entry;
+	RB_ENTRY(job)		 arg_entry;
 	time_t			 when;
+	uint64_t		 seq;
 	void			*arg;
 };
 
+RB_HEAD(jobtree, job);
+RB_HEAD(jobargtree, job);
+
 struct runq {
-	TAILQ_HEAD(, job)	 jobs;
+	struct jobtree		 jobs;
+	struct jobargtree	 args;
+	uint64_t		 seq;
 	void			(*cb)(struct runq *, void *);
+	const char		*name;
 	struct event		 ev;
 };
 
 static void runq_timeout(int, short, void *);
+static int job_cmp(struct job *, struct job *);
+static int job_arg_cmp(struct job *, struct job *);
+static struct job *runq_find(struct runq *, void *);
+
+RB_PROTOTYPE_STATIC(jobtree, job, entry, job_cmp);
+RB_PROTOTYPE_STATIC(jobargtree, job, arg_entry, job_arg_cmp);
 
 static struct runq *active;
 
@@ -54,11 +75,11 @@ runq_reset(struct runq *runq)
 	struct job	*job;
 	time_t		 now;
 
-	job = TAILQ_FIRST(&runq->jobs);
+	job = RB_MIN(jobtree, &runq->jobs);
 	if (job == NULL)
 		return;
 
-	now = time(NULL);
+	now = clock_cached();
 	if (job->when <= now)
 		tv.tv_sec = 0;
 	else
@@ -72,25 +93,34 @@ runq_timeout(int fd, short ev, void *arg)
 {
 	struct runq	*runq = arg;
 	struct job	*job;
+	struct timespec	 t0;
 	time_t		 now;
+	int		 prof;
 
+	clock_cache_enter();
 	active = runq;
-	now = time(NULL);
+	now = clock_cached();
 
-	while((job = TAILQ_FIRST(&runq->jobs))) {
+	while((job = RB_MIN(jobtree, &runq->jobs))) {
 		if (job->when > now)
 			break;
-		TAILQ_REMOVE(&runq->jobs, job, entry);
+		RB_REMOVE(jobtree, &runq->jobs, job);
+		RB_REMOVE(jobargtree, &runq->args, job);
+		prof = profile_begin(&t0);
 		runq->cb(runq, job->arg);
+		if (prof)
+			profile_end(&t0, "runq.%s", runq->name);
 		free(job);
 	}
 
 	active = NULL;
 	runq_reset(runq);
+	clock_cache_leave();
 }
 
 int
-runq_init(struct runq **runqp, void (*cb)(struct runq *, void *))
+runq_init_name(struct runq **runqp, void (*cb)(struct runq *, void *),
+    const char *name)
 {
 	struct runq	*runq;
 
@@ -99,7 +129,10 @@ runq_init(struct runq **runqp, void (*cb)(struct runq *, void *))
 		return (0);
 
 	runq->cb = cb;
-	TAILQ_INIT(&runq->jobs);
+	runq->name = name;
+	runq->seq = 0;
+	RB_INIT(&runq->jobs);
+	RB_INIT(&runq->args);
 	evtimer_set(&runq->ev, runq_timeout, runq);
 
 	*runqp = runq;
@@ -110,16 +143,13 @@ runq_init(struct runq **runqp, void (*cb)(struct runq *, void *))
 int
 runq_schedule(struct runq *runq, time_t delay, void *arg)
 {
-	time_t t;
-
-	time(&t);
-	return runq_schedule_at(runq, t + delay, arg);
+	return runq_schedule_at(runq, clock_cached() + delay, arg);
 }
 
 int
 runq_schedule_at(struct runq *runq, time_t when, void *arg)
 {
-	struct job	*job, *tmpjob;
+	struct job	*job;
 
 	job = malloc(sizeof(*job));
 	if (job == NULL)
@@ -127,17 +157,12 @@ runq_schedule_at(struct runq *runq, time_t when, void *arg)
 
 	job->arg = arg;
 	job->when = when;
+	job->seq = runq->seq++;
 
-	TAILQ_FOREACH(tmpjob, &runq->jobs, entry) {
-		if (tmpjob->when > job->when) {
-			TAILQ_INSERT_BEFORE(tmpjob, job, entry);
-			goto done;
-		}
-	}
-	TAILQ_INSERT_TAIL(&runq->jobs, job, entry);
+	RB_INSERT(jobtree, &runq->jobs, job);
+	RB_INSERT(jobargtree, &runq->args, job);
 
-    done:
-	if (runq != active && job == TAILQ_FIRST(&runq->jobs)) {
+	if (runq != active && job == RB_MIN(jobtree, &runq->jobs)) {
 		evtimer_del(&runq->ev);
 		runq_reset(runq);
 	}
@@ -147,22 +172,21 @@ runq_schedule_at(struct runq *runq, time_t when, void *arg)
 int
 runq_cancel(struct runq *runq, void *arg)
 {
-	struct job	*job, *first;
-
-	first = TAILQ_FIRST(&runq->jobs);
-	TAILQ_FOREACH(job, &runq->jobs, entry) {
-		if (job->arg == arg) {
-			TAILQ_REMOVE(&runq->jobs, job, entry);
-			free(job);
-			if (runq != active && job == first) {
-				evtimer_del(&runq->ev);
-				runq_reset(runq);
-			}
-			return (1);
-		}
-	}
+	struct job	*job;
+	int		 first;
 
-	return (0);
+	if ((job = runq_find(runq, arg)) == NULL)
+		return (0);
+
+	first = (job == RB_MIN(jobtree, &runq->jobs));
+	RB_REMOVE(jobtree, &runq->jobs, job);
+	RB_REMOVE(jobargtree, &runq->args, job);
+	free(job);
+	if (runq != active && first) {
+		evtimer_del(&runq->ev);
+		runq_reset(runq);
+	}
+	return (1);
 }
 
 int
@@ -170,13 +194,61 @@ runq_pending(struct runq *runq, void *arg, time_t *when)
 {
 	struct job	*job;
 
-	TAILQ_FOREACH(job, &runq->jobs, entry) {
-		if (job->arg == arg) {
-			if (when)
-				*when = job->when;
-			return (1);
-		}
-	}
+	if ((job = runq_find(runq, arg)) == NULL)
+		return (0);
+
+	if (when)
+		*when = job->when;
+	return (1);
+}
+
+/*
+ * Return the job for this arg that runs first, if any.  An arg is seldom
+ * scheduled more than once, so the walk is usually a single step.
+ */
+static struct job *
+runq_find(struct runq *runq, void *arg)
+{
+	struct job	 key, *job, *first = NULL;
+
+	key.arg = arg;
+	key.seq = 0;
+	for (job = RB_NFIND(jobargtree, &runq->args, &key);
+	    job && job->arg == arg;
+	    job = RB_NEXT(jobargtree, &runq->args, job))
+		if (first == NULL || job_cmp(job, first) < 0)
+			first = job;
 
+	return (first);
+}
+
+static int
+job_cmp(struct job *a, struct job *b)
+{
+	if (a->when < b->when)
+		return (-1);
+	if (a->when > b->when)
+		return (1);
+	if (a->seq < b->seq)
+		return (-1);
+	if (a->seq > b->seq)
+		return (1);
+	return (0);
+}
+
+static int
+job_arg_cmp(struct job *a, struct job *b)
+{
+	if ((uintptr_t)a->arg < (uintptr_t)b->arg)
+		return (-1);
+	if ((uintptr_t)a->arg > (uintptr_t)b->arg)
+		return (1);
+	if (a->seq < b->seq)
+		return (-1);
+	if (a->seq > b->seq)
+		return (1);
 	return (0);
 }
+
+RB_GENERATE_STATIC(jobtree, job, entry, job_cmp);
+RB_GENERATE_STATIC(jobargtree, job, arg_entry, job_arg_cmp);
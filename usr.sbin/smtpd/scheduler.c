@@ -36,39 +36,108 @@
 #include <inttypes.h>
 #include <pwd.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "smtpd.h"
 #include "log.h"
 
+#define	SCHEDULER_BATCH_MAX	1024	/* evpids per imsg to the queue */
+#define	SCHEDULER_LIST_MAX	512	/* candidates per queue listing page */
+#define	SCHEDULER_LIST_SCAN	8192	/* envelopes looked at per page */
+#define	SCHEDULER_DUMP_MAX	1024	/* envelopes handed over per round */
+
+/*
+ * Envelopes held for a relay when the previous generation handed them
+ * over are put back on their holdq, for the relay to release as its
+ * task window allows.  The mta of this generation may never see that
+ * relay, so whatever is still held after SCHEDULER_RESTORE_HOLD seconds
+ * is released.  Only mta holdqs are named after their relay; the mda
+ * ones do not outlive the process and their envelopes go back pending.
+ */
+#define	SCHEDULER_RESTORE_HOLD	60	/* seconds */
+
+struct restore_hold {
+	uint64_t	evpid;
+	uint64_t	holdq;
+};
+
+/*
+ * A bulk operation selects the envelopes in the backend and applies the
+ * action to them in one pass, rather than smtpctl sending an imsg per
+ * envelope.  The sender, tag and error are not known to the scheduler:
+ * when the filter has any, the selected envelopes go to the queue which
+ * sends back those matching, SCHEDULER_BATCH_MAX at a time.
+ */
+struct scheduler_bulk {
+	struct mproc	*p;
+	int		 action;
+	size_t		 pending;	/* batches at the queue */
+	size_t		 count;
+};
+
 static void scheduler_imsg(struct mproc *, struct imsg *);
 static void scheduler_shutdown(void);
 static void scheduler_reset_events(void);
 static void scheduler_timeout(int, short, void *);
+static void scheduler_schedule(void);
+static void scheduler_send_batch(int, uint32_t, size_t);
+static size_t scheduler_list(const struct queue_filter *, struct evpstate *,
+    size_t, uint64_t *);
+static void scheduler_summary(struct queue_count *, size_t *);
+static size_t scheduler_bulk_select(const struct queue_filter *);
+static size_t scheduler_bulk_apply(int, const void *, size_t);
+static void scheduler_bulk_done(struct mproc *, uint32_t, int, size_t);
+static void scheduler_dump(int, short, void *);
+static void scheduler_restore_commit(void);
+static void scheduler_restore_release(int, short, void *);
 
 static struct scheduler_backend *backend = NULL;
 static struct event		 ev;
 static size_t			 ninflight = 0;
+static size_t			 maxinflight;
 static int			*types;
 static uint64_t			*evpids;
 static uint32_t			*msgids;
 static struct evpstate		*state;
+static int			 draining;
+static struct event		 ev_dump;
+static uint64_t			 dump_from;
+static int			 dump_lost;
+static uint32_t			 restore_msgid;
+static struct restore_hold	*restore_held;
+static size_t			 restore_nheld;
+static size_t			 restore_maxheld;
+static struct tree		 restored_holdqs;
+static struct event		 ev_restore;
+static struct tree		 bulks;
+static uint64_t			*bulk_ids;
+static size_t			 bulk_max;
 
 extern const char *backend_scheduler;
 
 void
 scheduler_imsg(struct mproc *p, struct imsg *imsg)
 {
+	static struct evpstate	 list[SCHEDULER_LIST_MAX];
+	static struct queue_domain domains[QUEUE_DOMAIN_MAX];
+	struct queue_filter	 filter;
+	struct queue_count	 count;
+	struct scheduler_bulk	*bulk;
 	struct bounce_req_msg	 req;
 	struct envelope		 evp;
 	struct scheduler_info	 si;
 	struct msg		 m;
+	const void		*data;
+	const char		*name;
 	uint64_t		 evpid, id, holdq;
 	uint32_t		 msgid;
 	uint32_t       		 inflight;
-	size_t			 n, i;
+	char			*domain;
+	size_t			 n, i, sz;
 	time_t			 timestamp;
 	int			 v, r, type;
+	struct timeval		 tv;
 
 	if (imsg == NULL)
 		scheduler_shutdown();
@@ -83,7 +152,7 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		    "scheduler: inserting evp:%016" PRIx64, evp.id);
 		scheduler_info(&si, &evp);
 		stat_increment("scheduler.envelope.incoming", 1);
-		backend->insert(&si);
+		backend->insert(&si, evp.dest.domain);
 		return;
 
 	case IMSG_QUEUE_MESSAGE_COMMIT:
@@ -96,6 +165,14 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		stat_decrement("scheduler.envelope.incoming", n);
 		stat_increment("scheduler.envelope", n);
 		scheduler_reset_events();
+		/* committed behind the dump, the state misses it */
+		if (draining == 2)
+			dump_lost = 1;
+		else if (draining == 3) {
+			m_create(p_queue, IMSG_RELOAD_DONE, 0, 0, -1);
+			m_add_int(p_queue, 0);
+			m_close(p_queue);
+		}
 		return;
 
 	case IMSG_QUEUE_DISCOVER_EVPID:
@@ -112,7 +189,7 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		    "scheduler: discovering evp:%016" PRIx64, evp.id);
 		scheduler_info(&si, &evp);
 		stat_increment("scheduler.envelope.incoming", 1);
-		backend->insert(&si);
+		backend->insert(&si, evp.dest.domain);
 		return;
 
 	case IMSG_QUEUE_DISCOVER_MSGID:
@@ -165,28 +242,35 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		return;
 
 	case IMSG_QUEUE_ENVELOPE_ACK:
+		/* one or more envelopes */
 		m_msg(&m, imsg);
-		m_get_evpid(&m, &evpid);
+		while (!m_is_eom(&m)) {
+			m_get_evpid(&m, &evpid);
+			log_trace(TRACE_SCHEDULER,
+			    "scheduler: queue ack removal of evp:%016" PRIx64,
+			    evpid);
+			ninflight -= 1;
+			stat_decrement("scheduler.envelope.inflight", 1);
+		}
 		m_end(&m);
-		log_trace(TRACE_SCHEDULER,
-		    "scheduler: queue ack removal of evp:%016" PRIx64,
-		    evpid);
-		ninflight -= 1;
-		stat_decrement("scheduler.envelope.inflight", 1);
 		scheduler_reset_events();
 		return;
 
 	case IMSG_QUEUE_DELIVERY_OK:
+		/* one or more envelopes */
 		m_msg(&m, imsg);
-		m_get_evpid(&m, &evpid);
+		while (!m_is_eom(&m)) {
+			m_get_evpid(&m, &evpid);
+			log_trace(TRACE_SCHEDULER,
+			    "scheduler: deleting evp:%016" PRIx64 " (ok)",
+			    evpid);
+			backend->delete(evpid);
+			ninflight -= 1;
+			stat_increment("scheduler.delivery.ok", 1);
+			stat_decrement("scheduler.envelope.inflight", 1);
+			stat_decrement("scheduler.envelope", 1);
+		}
 		m_end(&m);
-		log_trace(TRACE_SCHEDULER,
-		    "scheduler: deleting evp:%016" PRIx64 " (ok)", evpid);
-		backend->delete(evpid);
-		ninflight -= 1;
-		stat_increment("scheduler.delivery.ok", 1);
-		stat_decrement("scheduler.envelope.inflight", 1);
-		stat_decrement("scheduler.envelope", 1);
 		scheduler_reset_events();
 		return;
 
@@ -276,6 +360,81 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		scheduler_reset_events();
 		return;
 
+	case IMSG_RELOAD_DRAIN:
+		/*
+		 * A new generation takes over: stop starting deliveries,
+		 * wait for the inflight ones and then hand the pending
+		 * envelopes over to the queue.  On a stop, the inflight
+		 * ones are handed over as pending without waiting.
+		 */
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		log_debug("debug: scheduler: draining, %zu inflight",
+		    ninflight);
+		draining = 1;
+		evtimer_set(&ev_dump, scheduler_dump, NULL);
+		if (!v) {
+			draining = 2;
+			scheduler_dump(-1, 0, NULL);
+		}
+		scheduler_reset_events();
+		return;
+
+	case IMSG_RELOAD_STATE:
+		/* envelopes handed over by the previous generation */
+		m_msg(&m, imsg);
+		while (!m_is_eom(&m)) {
+			m_get_data(&m, &data, &sz);
+			m_get_string(&m, &name);
+			m_get_id(&m, &holdq);
+			if (sz != sizeof si)
+				fatalx("scheduler: bad reload state record");
+			memmove(&si, data, sizeof si);
+			msgid = evpid_to_msgid(si.evpid);
+			if (restore_msgid && restore_msgid != msgid)
+				scheduler_restore_commit();
+			log_trace(TRACE_SCHEDULER,
+			    "scheduler: restoring evp:%016" PRIx64, si.evpid);
+			restore_msgid = msgid;
+			stat_increment("scheduler.envelope.incoming", 1);
+			backend->insert(&si, name);
+			if (holdq == 0 || si.type != D_MTA ||
+			    backend->restore_hold == NULL)
+				continue;
+			if (restore_nheld == restore_maxheld) {
+				restore_maxheld = restore_maxheld ?
+				    restore_maxheld * 2 : 64;
+				restore_held = reallocarray(restore_held,
+				    restore_maxheld, sizeof *restore_held);
+				if (restore_held == NULL)
+					fatal("scheduler: reallocarray");
+			}
+			restore_held[restore_nheld].evpid = si.evpid;
+			restore_held[restore_nheld].holdq = holdq;
+			restore_nheld++;
+		}
+		m_end(&m);
+		return;
+
+	case IMSG_RELOAD_DONE:
+		m_msg(&m, imsg);
+		m_end(&m);
+		scheduler_restore_commit();
+		free(restore_held);
+		restore_held = NULL;
+		restore_maxheld = 0;
+		log_debug("debug: scheduler: reload state restored, "
+		    "%zu holdqs", tree_count(&restored_holdqs));
+		if (!tree_empty(&restored_holdqs)) {
+			tv.tv_sec = SCHEDULER_RESTORE_HOLD;
+			tv.tv_usec = 0;
+			evtimer_set(&ev_restore, scheduler_restore_release,
+			    NULL);
+			evtimer_add(&ev_restore, &tv);
+		}
+		return;
+
 	case IMSG_CTL_PAUSE_MDA:
 		log_trace(TRACE_SCHEDULER, "scheduler: pausing mda");
 		env->sc_flags |= SMTPD_MDA_PAUSED;
@@ -312,6 +471,10 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		profiling = v;
 		return;
 
+	case IMSG_CTL_SHOW_PROFILE:
+		profile_show(p, imsg->hdr.peerid);
+		return;
+
 	case IMSG_CTL_LIST_MESSAGES:
 		msgid = *(uint32_t *)(imsg->data);
 		n = backend->messages(msgid, msgids, env->sc_scheduler_max_msg_batch_size);
@@ -334,6 +497,82 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		    imsg->hdr.peerid, 0, -1, NULL, 0);
 		return;
 
+	case IMSG_CTL_LIST_QUEUE:
+		memcpy(&filter, imsg->data, sizeof filter);
+		n = scheduler_list(&filter, list, SCHEDULER_LIST_MAX, &id);
+		/* the listing goes on with the first message of the next shard */
+		if (id == 0 &&
+		    env->sc_scheduler_shard + 1 < env->sc_scheduler_shards)
+			id = msgid_to_evpid(env->sc_scheduler_shard + 1);
+		m_create(p_queue, IMSG_CTL_LIST_QUEUE, imsg->hdr.peerid, 0, -1);
+		m_add_data(p_queue, &filter, sizeof filter);
+		m_add_evpid(p_queue, id);
+		m_add_data(p_queue, list, n * sizeof *list);
+		m_close(p_queue);
+		return;
+
+	case IMSG_CTL_QUEUE_SUMMARY:
+		/* domains are listed after the one in the request */
+		domain = imsg->data;
+		domain[SMTPD_MAXDOMAINPARTSIZE - 1] = '\0';
+		n = i = 0;
+		if (backend->summary == NULL || !backend->summary(&count, &n))
+			scheduler_summary(&count, &n);
+		else if (backend->domains)
+			i = backend->domains(domain[0] ? domain : NULL,
+			    domains, nitems(domains));
+		m_create(p, IMSG_CTL_QUEUE_SUMMARY, imsg->hdr.peerid, 0, -1);
+		m_add_size(p, n);
+		m_add_data(p, &count, sizeof count);
+		m_add_data(p, domains, i * sizeof *domains);
+		m_close(p);
+		return;
+
+	case IMSG_CTL_QUEUE_BULK:
+		if (imsg->hdr.len - IMSG_HEADER_SIZE != sizeof filter)
+			fatalx("scheduler: bad bulk filter size");
+		memcpy(&filter, imsg->data, sizeof filter);
+		n = scheduler_bulk_select(&filter);
+		if (!filter.sender[0] && !filter.tag[0] && !filter.error[0] &&
+		    backend->select) {
+			scheduler_bulk_done(p, imsg->hdr.peerid, filter.bulk,
+			    scheduler_bulk_apply(filter.bulk, bulk_ids, n));
+			return;
+		}
+		bulk = xcalloc(1, sizeof *bulk);
+		bulk->p = p;
+		bulk->action = filter.bulk;
+		tree_xset(&bulks, imsg->hdr.peerid, bulk);
+		i = 0;
+		do {
+			sz = n - i;
+			if (sz > SCHEDULER_BATCH_MAX)
+				sz = SCHEDULER_BATCH_MAX;
+			m_create(p_queue, IMSG_QUEUE_BULK_MATCH,
+			    imsg->hdr.peerid, 0, -1);
+			m_add_data(p_queue, &filter, sizeof filter);
+			m_add_data(p_queue, bulk_ids + i, sz * sizeof *bulk_ids);
+			m_close(p_queue);
+			bulk->pending++;
+			i += sz;
+		} while (i < n);
+		return;
+
+	case IMSG_QUEUE_BULK_MATCH:
+		bulk = tree_xget(&bulks, imsg->hdr.peerid);
+		sz = imsg->hdr.len - IMSG_HEADER_SIZE;
+		if (sz % sizeof(id))
+			fatalx("scheduler: bad bulk match size");
+		bulk->count += scheduler_bulk_apply(bulk->action, imsg->data,
+		    sz / sizeof(id));
+		if (--bulk->pending)
+			return;
+		tree_xpop(&bulks, imsg->hdr.peerid);
+		scheduler_bulk_done(bulk->p, imsg->hdr.peerid, bulk->action,
+		    bulk->count);
+		free(bulk);
+		return;
+
 	case IMSG_CTL_SCHEDULE:
 		id = *(uint64_t *)(imsg->data);
 		if (id <= 0xffffffffL)
@@ -349,8 +588,15 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		return;
 
 	case IMSG_QUEUE_ENVELOPE_SCHEDULE:
-		id = *(uint64_t *)(imsg->data);
-		backend->schedule(id);
+		/* the mta batches envelope ids */
+		if ((imsg->hdr.len - IMSG_HEADER_SIZE) % sizeof(id))
+			fatalx("scheduler: bad schedule message size");
+		for (i = 0; i < (imsg->hdr.len - IMSG_HEADER_SIZE) / sizeof(id);
+		    i++) {
+			memmove(&id, (char *)imsg->data + i * sizeof(id),
+			    sizeof(id));
+			backend->schedule(id);
+		}
 		scheduler_reset_events();
 		return;
 
@@ -408,6 +654,105 @@ scheduler_shutdown(void)
 	_exit(0);
 }
 
+static void
+scheduler_restore_commit(void)
+{
+	size_t	i, n;
+
+	if (restore_msgid == 0)
+		return;
+	n = backend->commit(restore_msgid);
+	stat_decrement("scheduler.envelope.incoming", n);
+	stat_increment("scheduler.envelope", n);
+	restore_msgid = 0;
+
+	for (i = 0; i < restore_nheld; i++)
+		if (backend->restore_hold(restore_held[i].evpid,
+		    restore_held[i].holdq))
+			tree_set(&restored_holdqs, restore_held[i].holdq, NULL);
+	restore_nheld = 0;
+
+	scheduler_reset_events();
+}
+
+static void
+scheduler_restore_release(int fd, short event, void *p)
+{
+	uint64_t	holdq;
+	int		n;
+
+	n = 0;
+	while (tree_poproot(&restored_holdqs, &holdq, NULL))
+		n += backend->release(D_MTA, holdq, 0);
+	if (n)
+		log_info("info: scheduler: released %d envelopes held by "
+		    "the previous generation", n);
+	scheduler_reset_events();
+}
+
+/*
+ * Send the pending envelopes to the queue in rounds, paced on the
+ * queue channel, then tell it whether the state is complete.  The
+ * backends without a dump operation leave the new generation to
+ * rescan the queue.
+ */
+static void
+scheduler_dump(int fd, short event, void *p)
+{
+	static struct scheduler_info	 si[SCHEDULER_DUMP_MAX];
+	static const char		*domains[SCHEDULER_DUMP_MAX];
+	static uint64_t			 held[SCHEDULER_DUMP_MAX];
+	static size_t			 total;
+	struct timeval			 tv;
+	size_t				 i, n, len;
+	int				 inmsg;
+
+	if (backend->dump == NULL) {
+		draining = 3;
+		m_create(p_queue, IMSG_RELOAD_DONE, 0, 0, -1);
+		m_add_int(p_queue, 0);
+		m_close(p_queue);
+		return;
+	}
+
+	if (p_queue->imsgbuf.w.queued < SCHEDULER_DUMP_MAX) {
+		n = backend->dump(&dump_from, si, domains, held,
+		    SCHEDULER_DUMP_MAX);
+		for (i = 0, inmsg = 0; i < n; i++) {
+			len = IMSG_HEADER_SIZE + sizeof(size_t) + sizeof si[i] +
+			    strlen(domains[i]) + 2 + sizeof held[i];
+			if (inmsg && p_queue->m_pos + len > MAX_IMSGSIZE) {
+				m_close(p_queue);
+				inmsg = 0;
+			}
+			if (!inmsg) {
+				m_create(p_queue, IMSG_RELOAD_STATE, 0, 0, -1);
+				inmsg = 1;
+			}
+			m_add_data(p_queue, &si[i], sizeof si[i]);
+			m_add_string(p_queue, domains[i]);
+			m_add_id(p_queue, held[i]);
+		}
+		if (inmsg)
+			m_close(p_queue);
+		total += n;
+
+		if (n < SCHEDULER_DUMP_MAX) {
+			log_debug("debug: scheduler: handed over %zu envelopes",
+			    total);
+			draining = 3;
+			m_create(p_queue, IMSG_RELOAD_DONE, 0, 0, -1);
+			m_add_int(p_queue, !dump_lost);
+			m_close(p_queue);
+			return;
+		}
+	}
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 10000;
+	evtimer_add(&ev_dump, &tv);
+}
+
 static void
 scheduler_reset_events(void)
 {
@@ -419,6 +764,16 @@ scheduler_reset_events(void)
 	evtimer_add(&ev, &tv);
 }
 
+/*
+ * Messages are spread over the scheduler shards by msgid, everything
+ * about a message goes to the shard owning it.
+ */
+struct mproc *
+scheduler_peer(uint32_t msgid)
+{
+	return (p_schedulers[msgid % env->sc_scheduler_shards]);
+}
+
 int
 scheduler(void)
 {
@@ -452,6 +807,18 @@ scheduler(void)
 	types = xcalloc(env->sc_scheduler_max_schedule, sizeof *types);
 	msgids = xcalloc(env->sc_scheduler_max_msg_batch_size, sizeof *msgids);
 	state = xcalloc(env->sc_scheduler_max_evp_batch_size, sizeof *state);
+	tree_init(&restored_holdqs);
+	tree_init(&bulks);
+
+	/* the shards share the inflight limit */
+	maxinflight = env->sc_scheduler_max_inflight /
+	    env->sc_scheduler_shards;
+	if (maxinflight == 0)
+		maxinflight = 1;
+	if (env->sc_scheduler_shards > 1)
+		log_debug("debug: scheduler: shard %d of %d, max inflight %zu",
+		    env->sc_scheduler_shard, env->sc_scheduler_shards,
+		    maxinflight);
 
 	imsg_callback = scheduler_imsg;
 	event_init();
@@ -463,6 +830,9 @@ scheduler(void)
 
 	config_peer(PROC_CONTROL);
 	config_peer(PROC_QUEUE);
+	config_peer(PROC_LOGGER);
+	stat_cpu_start(NULL);
+	memory_start(NULL, NULL);
 
 	evtimer_set(&ev, scheduler_timeout, NULL);
 	scheduler_reset_events();
@@ -478,8 +848,40 @@ scheduler(void)
 	return (0);
 }
 
+/*
+ * Send the evpids of the given type in the current batch to the queue,
+ * packed into as few imsgs as possible.
+ */
+static void
+scheduler_send_batch(int type, uint32_t imsgtype, size_t count)
+{
+	size_t	i, n;
+
+	for (i = 0, n = 0; i < count; i++) {
+		if (types[i] != type)
+			continue;
+		if (n == 0)
+			m_create(p_queue, imsgtype, 0, 0, -1);
+		m_add_evpid(p_queue, evpids[i]);
+		if (++n == SCHEDULER_BATCH_MAX) {
+			m_close(p_queue);
+			n = 0;
+		}
+	}
+	if (n)
+		m_close(p_queue);
+}
+
 static void
 scheduler_timeout(int fd, short event, void *p)
+{
+	clock_cache_enter();
+	scheduler_schedule();
+	clock_cache_leave();
+}
+
+static void
+scheduler_schedule(void)
 {
 	struct timeval		tv;
 	size_t			i;
@@ -496,7 +898,9 @@ scheduler_timeout(int fd, short event, void *p)
 
 	mask = SCHED_UPDATE;
 
-	if (ninflight <  env->sc_scheduler_max_inflight) {
+	if (draining)
+		mask |= SCHED_EXPIRE | SCHED_REMOVE;
+	else if (ninflight < maxinflight) {
 		mask |= SCHED_EXPIRE | SCHED_REMOVE | SCHED_BOUNCE;
 		if (!(env->sc_flags & SMTPD_MDA_PAUSED))
 			mask |= SCHED_MDA;
@@ -517,6 +921,14 @@ scheduler_timeout(int fd, short event, void *p)
 
 	if (r == 0) {
 
+		if (draining) {
+			if (ninflight == 0 && draining == 1) {
+				draining = 2;
+				scheduler_dump(-1, 0, NULL);
+			}
+			return;
+		}
+
 		if (delay < -1)
 			fatalx("scheduler: invalid delay %d", delay);
 
@@ -544,9 +956,6 @@ scheduler_timeout(int fd, short event, void *p)
 		case SCHED_REMOVE:
 			log_debug("debug: scheduler: evp:%016" PRIx64
 			    " removed", evpids[i]);
-			m_create(p_queue, IMSG_SCHED_ENVELOPE_REMOVE, 0, 0, -1);
-			m_add_evpid(p_queue, evpids[i]);
-			m_close(p_queue);
 			d_envelope += 1;
 			d_removed += 1;
 			d_inflight += 1;
@@ -555,9 +964,6 @@ scheduler_timeout(int fd, short event, void *p)
 		case SCHED_EXPIRE:
 			log_debug("debug: scheduler: evp:%016" PRIx64
 			    " expired", evpids[i]);
-			m_create(p_queue, IMSG_SCHED_ENVELOPE_EXPIRE, 0, 0, -1);
-			m_add_evpid(p_queue, evpids[i]);
-			m_close(p_queue);
 			d_envelope += 1;
 			d_expired += 1;
 			d_inflight += 1;
@@ -572,32 +978,29 @@ scheduler_timeout(int fd, short event, void *p)
 		case SCHED_BOUNCE:
 			log_debug("debug: scheduler: evp:%016" PRIx64
 			    " scheduled (bounce)", evpids[i]);
-			m_create(p_queue, IMSG_SCHED_ENVELOPE_INJECT, 0, 0, -1);
-			m_add_evpid(p_queue, evpids[i]);
-			m_close(p_queue);
 			d_inflight += 1;
 			break;
 
 		case SCHED_MDA:
 			log_debug("debug: scheduler: evp:%016" PRIx64
 			    " scheduled (mda)", evpids[i]);
-			m_create(p_queue, IMSG_SCHED_ENVELOPE_DELIVER, 0, 0, -1);
-			m_add_evpid(p_queue, evpids[i]);
-			m_close(p_queue);
 			d_inflight += 1;
 			break;
 
 		case SCHED_MTA:
 			log_debug("debug: scheduler: evp:%016" PRIx64
 			    " scheduled (mta)", evpids[i]);
-			m_create(p_queue, IMSG_SCHED_ENVELOPE_TRANSFER, 0, 0, -1);
-			m_add_evpid(p_queue, evpids[i]);
-			m_close(p_queue);
 			d_inflight += 1;
 			break;
 		}
 	}
 
+	scheduler_send_batch(SCHED_REMOVE, IMSG_SCHED_ENVELOPE_REMOVE, count);
+	scheduler_send_batch(SCHED_EXPIRE, IMSG_SCHED_ENVELOPE_EXPIRE, count);
+	scheduler_send_batch(SCHED_BOUNCE, IMSG_SCHED_ENVELOPE_INJECT, count);
+	scheduler_send_batch(SCHED_MDA, IMSG_SCHED_ENVELOPE_DELIVER, count);
+	scheduler_send_batch(SCHED_MTA, IMSG_SCHED_ENVELOPE_TRANSFER, count);
+
 	stat_decrement("scheduler.envelope", d_envelope);
 	stat_increment("scheduler.envelope.inflight", d_inflight);
 	stat_increment("scheduler.envelope.expired", d_expired);
@@ -610,3 +1013,172 @@ scheduler_timeout(int fd, short event, void *p)
 	tv.tv_usec = 0;
 	evtimer_add(&ev, &tv);
 }
+
+/*
+ * Collect from the filter cursor the envelopes in the requested state.
+ * The scan is bounded so that a sparse filter over a large queue does
+ * not stall the scheduler: *next is where the following page starts,
+ * or 0 once the whole queue was seen.
+ */
+static size_t
+scheduler_list(const struct queue_filter *f, struct evpstate *dst,
+    size_t size, uint64_t *next)
+{
+	uint64_t	from = f->from;
+	uint32_t	msgid;
+	size_t		n = 0, scanned = 0, r, want, i, k;
+
+	while (n < size && scanned < SCHEDULER_LIST_SCAN) {
+		want = size - n;
+		r = backend->envelopes(from, dst + n, want);
+		for (i = 0, k = n; i < r; i++) {
+			from = dst[n + i].evpid + 1;
+			if ((dst[n + i].flags & f->flags) == f->flags)
+				dst[k++] = dst[n + i];
+		}
+		n = k;
+		scanned += r;
+		if (r == want)
+			continue;
+
+		/* done with this message, move to the next one */
+		msgid = evpid_to_msgid(from);
+		if (r)
+			msgid = evpid_to_msgid(from - 1);
+		if (msgid == 0xffffffff ||
+		    backend->messages(msgid + 1, &msgid, 1) == 0) {
+			*next = 0;
+			return (n);
+		}
+		from = msgid_to_evpid(msgid);
+	}
+
+	*next = from;
+	return (n);
+}
+
+/*
+ * Collect in bulk_ids the envelopes of the filter known to the scheduler.
+ * Backends without a selection only tell the state, the queue checks the
+ * rest.
+ */
+static size_t
+scheduler_bulk_select(const struct queue_filter *f)
+{
+	struct queue_filter	 page;
+	uint64_t		 from = 0;
+	size_t			 n = 0, r, i, size;
+
+	size = backend->select ? SCHEDULER_LIST_MAX :
+	    env->sc_scheduler_max_evp_batch_size;
+	page = *f;
+	page.from = 0;
+
+	for (;;) {
+		if (bulk_max - n < size) {
+			bulk_max = bulk_max ? bulk_max * 2 : SCHEDULER_BATCH_MAX;
+			bulk_ids = reallocarray(bulk_ids, bulk_max,
+			    sizeof *bulk_ids);
+			if (bulk_ids == NULL)
+				fatal("scheduler: reallocarray");
+			continue;
+		}
+		if (backend->select) {
+			r = backend->select(f, &from, bulk_ids + n, size);
+			n += r;
+			if (r < size)
+				break;
+			continue;
+		}
+		r = scheduler_list(&page, state, size, &page.from);
+		for (i = 0; i < r; i++)
+			bulk_ids[n++] = state[i].evpid;
+		if (page.from == 0)
+			break;
+	}
+
+	return (n);
+}
+
+static size_t
+scheduler_bulk_apply(int action, const void *data, size_t n)
+{
+	uint64_t	id;
+	size_t		i, r = 0;
+
+	for (i = 0; i < n; i++) {
+		memmove(&id, (const char *)data + i * sizeof(id), sizeof(id));
+		switch (action) {
+		case QUEUE_BULK_SCHEDULE:
+			r += backend->schedule(id);
+			break;
+		case QUEUE_BULK_SUSPEND:
+			r += backend->suspend(id);
+			break;
+		case QUEUE_BULK_RESUME:
+			r += backend->resume(id);
+			break;
+		case QUEUE_BULK_REMOVE:
+			r += backend->remove(id);
+			break;
+		}
+	}
+	scheduler_reset_events();
+
+	return (r);
+}
+
+static void
+scheduler_bulk_done(struct mproc *p, uint32_t peerid, int action, size_t n)
+{
+	static const char	*name[] = {
+		[QUEUE_BULK_SCHEDULE]	= "scheduled",
+		[QUEUE_BULK_SUSPEND]	= "suspended",
+		[QUEUE_BULK_RESUME]	= "resumed",
+		[QUEUE_BULK_REMOVE]	= "removed",
+	};
+
+	if (action >= QUEUE_BULK_SCHEDULE && action <= QUEUE_BULK_REMOVE)
+		log_info("info: scheduler: %zu envelopes %s by filter", n,
+		    name[action]);
+
+	m_create(p, IMSG_CTL_QUEUE_BULK, peerid, 0, -1);
+	m_add_size(p, n);
+	m_close(p);
+}
+
+/* count envelopes by state for backends that do not keep a summary */
+static void
+scheduler_summary(struct queue_count *c, size_t *nmsg)
+{
+	uint32_t	msgid = 0;
+	uint64_t	from;
+	size_t		n, i;
+
+	memset(c, 0, sizeof *c);
+	*nmsg = 0;
+
+	while (backend->messages(msgid, &msgid, 1)) {
+		*nmsg += 1;
+		from = msgid_to_evpid(msgid);
+		do {
+			n = backend->envelopes(from, state,
+			    env->sc_scheduler_max_evp_batch_size);
+			for (i = 0; i < n; i++) {
+				c->total++;
+				if (state[i].flags & EF_SUSPEND)
+					c->suspended++;
+				if (state[i].flags & EF_INFLIGHT)
+					c->inflight++;
+				else if (state[i].flags & EF_HOLD)
+					c->held++;
+				else if (state[i].flags & EF_PENDING)
+					c->pending++;
+			}
+			if (n)
+				from = state[n - 1].evpid + 1;
+		} while (n == env->sc_scheduler_max_evp_batch_size);
+		if (msgid++ == 0xffffffff)
+			break;
+	}
+}
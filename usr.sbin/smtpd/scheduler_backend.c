@@ -55,7 +55,7 @@ scheduler_info(struct scheduler_info *sched, struct envelope *evp)
 
 	disp = evp->type == D_BOUNCE ?
 	    env->sc_dispatcher_bounce :
-	    dict_xget(env->sc_dispatchers, evp->dispatcher);
+	    hdict_xget(env->sc_dispatchers, evp->dispatcher);
 
 	switch (disp->type) {
 	case DISPATCHER_LOCAL:
@@ -33,7 +33,7 @@
 #include "smtpd.h"
 
 static int scheduler_null_init(const char *);
-static int scheduler_null_insert(struct scheduler_info *);
+static int scheduler_null_insert(struct scheduler_info *, const char *);
 static size_t scheduler_null_commit(uint32_t);
 static size_t scheduler_null_rollback(uint32_t);
 static int scheduler_null_update(struct scheduler_info *);
@@ -77,7 +77,7 @@ scheduler_null_init(const char *arg)
 }
 
 static int
-scheduler_null_insert(struct scheduler_info *si)
+scheduler_null_insert(struct scheduler_info *si, const char *domain)
 {
 	return (0);
 }
@@ -25,26 +25,64 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <event.h>
+#include <inttypes.h>
 #include <string.h>
 
 #include "smtpd.h"
 #include "log.h"
 
+/* requests sent without waiting for the reply, when pipelining */
+#define	SCHEDULER_PROC_MAXINFLIGHT	1024
+
+static void	scheduler_proc_read(void *, size_t);
+static void	scheduler_proc_end(void);
+static void	scheduler_proc_next(void);
+static void	scheduler_proc_wait(uint32_t);
+static void	scheduler_proc_drain(size_t);
+static void	scheduler_proc_done(void);
+static void	scheduler_proc_dispatch(int, short, void *);
+static int	scheduler_proc_async(void);
+static void	scheduler_proc_bulk(int, const void *, size_t);
+static void	scheduler_proc_flush(void);
+
 static struct imsgbuf	 ibuf;
 static struct imsg	 imsg;
 static size_t		 rlen;
 static char		*rdata;
 
+static uint32_t		 caps;
+static uint32_t		 reqid;
+static size_t		 inflight;
+static struct event	 ev_reply;
+static int		 ev_set;
+
+/*
+ * Inserts and deletes waiting to go out as a single batch request.
+ * They are flushed before any other request is composed, so that the
+ * backend sees operations in order.  Every event handled by the
+ * scheduler ends with a batch call, so none of them lingers.
+ */
+static int		 bulk_type;
+static size_t		 bulk_len;
+static char		 bulk[MAX_IMSGSIZE - IMSG_HEADER_SIZE];
+
 static void
 scheduler_proc_call(void)
 {
-	ssize_t	n;
-
 	if (imsg_flush(&ibuf) == -1) {
 		log_warn("warn: scheduler-proc: imsg_flush");
 		fatalx("scheduler-proc: exiting");
 	}
 
+	scheduler_proc_wait(reqid);
+}
+
+static void
+scheduler_proc_next(void)
+{
+	ssize_t	n;
+
 	while (1) {
 		if ((n = imsg_get(&ibuf, &imsg)) == -1) {
 			log_warn("warn: scheduler-proc: imsg_get");
@@ -75,6 +113,142 @@ scheduler_proc_call(void)
 	fatalx("scheduler-proc: exiting");
 }
 
+/* replies to pipelined requests found on the way are consumed */
+static void
+scheduler_proc_wait(uint32_t id)
+{
+	while (1) {
+		scheduler_proc_next();
+		if (!(caps & PROC_SCHEDULER_CAP_PIPELINE) ||
+		    imsg.hdr.peerid == id)
+			return;
+		scheduler_proc_done();
+	}
+}
+
+static void
+scheduler_proc_drain(size_t n)
+{
+	while (inflight > n) {
+		scheduler_proc_next();
+		scheduler_proc_done();
+	}
+}
+
+/* the reply to a pipelined request, nobody waits for its result */
+static void
+scheduler_proc_done(void)
+{
+	int	r;
+
+	if (inflight == 0) {
+		log_warnx("warn: scheduler-proc: unexpected reply");
+		fatalx("scheduler-proc: exiting");
+	}
+	inflight--;
+
+	scheduler_proc_read(&r, sizeof(r));
+	scheduler_proc_end();
+	if (r != 1)
+		log_warnx("warn: scheduler-proc: request %"PRIu32" failed",
+		    imsg.hdr.peerid);
+}
+
+static void
+scheduler_proc_dispatch(int fd, short event, void *p)
+{
+	ssize_t	n;
+
+	/* a synchronous call may have consumed the replies already */
+	if (inflight == 0)
+		return;
+
+	if ((n = imsg_read(&ibuf)) == -1 && errno != EAGAIN) {
+		log_warn("warn: scheduler-proc: imsg_read");
+		fatalx("scheduler-proc: exiting");
+	}
+	if (n == 0) {
+		log_warnx("warn: scheduler-proc: pipe closed");
+		fatalx("scheduler-proc: exiting");
+	}
+
+	while (inflight) {
+		if ((n = imsg_get(&ibuf, &imsg)) == -1) {
+			log_warn("warn: scheduler-proc: imsg_get");
+			fatalx("scheduler-proc: exiting");
+		}
+		if (n == 0)
+			break;
+		rlen = imsg.hdr.len - IMSG_HEADER_SIZE;
+		rdata = imsg.data;
+		if (imsg.hdr.type != PROC_SCHEDULER_OK) {
+			log_warnx("warn: scheduler-proc: bad response");
+			fatalx("scheduler-proc: exiting");
+		}
+		scheduler_proc_done();
+	}
+}
+
+/*
+ * Send a request whose result the scheduler does not act on.  When the
+ * backend pipelines, its reply is picked up later from the event loop.
+ */
+static int
+scheduler_proc_async(void)
+{
+	int	r;
+
+	if (!(caps & PROC_SCHEDULER_CAP_PIPELINE)) {
+		scheduler_proc_call();
+		scheduler_proc_read(&r, sizeof(r));
+		scheduler_proc_end();
+		return (r);
+	}
+
+	if (imsg_flush(&ibuf) == -1) {
+		log_warn("warn: scheduler-proc: imsg_flush");
+		fatalx("scheduler-proc: exiting");
+	}
+	inflight++;
+
+	/* only reached from the scheduler event loop */
+	if (!ev_set) {
+		event_set(&ev_reply, ibuf.fd, EV_READ|EV_PERSIST,
+		    scheduler_proc_dispatch, NULL);
+		event_add(&ev_reply, NULL);
+		ev_set = 1;
+	}
+
+	/* do not let the backend get too far behind */
+	if (inflight >= SCHEDULER_PROC_MAXINFLIGHT)
+		scheduler_proc_drain(SCHEDULER_PROC_MAXINFLIGHT / 2);
+
+	return (1);
+}
+
+static void
+scheduler_proc_bulk(int type, const void *data, size_t len)
+{
+	if (bulk_len &&
+	    (bulk_type != type || bulk_len + len > sizeof(bulk)))
+		scheduler_proc_flush();
+
+	bulk_type = type;
+	memcpy(bulk + bulk_len, data, len);
+	bulk_len += len;
+}
+
+static void
+scheduler_proc_flush(void)
+{
+	if (bulk_len == 0)
+		return;
+
+	imsg_compose(&ibuf, bulk_type, ++reqid, 0, -1, bulk, bulk_len);
+	bulk_len = 0;
+	(void)scheduler_proc_async();
+}
+
 static void
 scheduler_proc_read(void *dst, size_t len)
 {
@@ -106,7 +280,7 @@ static int
 scheduler_proc_init(const char *conf)
 {
 	int		fd, r;
-	uint32_t	version;
+	uint32_t	version, offer;
 
 	fd = fork_proc_backend("scheduler", conf, "scheduler-proc", 0);
 	if (fd == -1)
@@ -115,23 +289,46 @@ scheduler_proc_init(const char *conf)
 	imsg_init(&ibuf, fd);
 
 	version = PROC_SCHEDULER_API_VERSION;
-	imsg_compose(&ibuf, PROC_SCHEDULER_INIT, 0, 0, -1,
+	imsg_compose(&ibuf, PROC_SCHEDULER_INIT, ++reqid, 0, -1,
 	    &version, sizeof(version));
 	scheduler_proc_call();
 	scheduler_proc_read(&r, sizeof(r));
+	offer = 0;
+	if (rlen >= sizeof(offer))
+		scheduler_proc_read(&offer, sizeof(offer));
 	scheduler_proc_end();
 
+	/* older backends do not offer anything */
+	offer &= PROC_SCHEDULER_CAP_PIPELINE | PROC_SCHEDULER_CAP_BATCH;
+	if (offer) {
+		imsg_compose(&ibuf, PROC_SCHEDULER_CAPABILITIES, ++reqid, 0,
+		    -1, &offer, sizeof(offer));
+		scheduler_proc_call();
+		scheduler_proc_end();
+		caps = offer;
+	}
+
 	return (1);
 }
 
 static int
-scheduler_proc_insert(struct scheduler_info *si)
+scheduler_proc_insert(struct scheduler_info *si, const char *domain)
 {
 	int	r;
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_INSERT");
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_INSERT, 0, 0, -1, si, sizeof(*si));
+	if (caps & PROC_SCHEDULER_CAP_BATCH) {
+		scheduler_proc_bulk(PROC_SCHEDULER_INSERT_BATCH, si,
+		    sizeof(*si));
+		return (1);
+	}
+
+	imsg_compose(&ibuf, PROC_SCHEDULER_INSERT, ++reqid, 0, -1,
+	    si, sizeof(*si));
+
+	if (caps & PROC_SCHEDULER_CAP_PIPELINE)
+		return (scheduler_proc_async());
 
 	scheduler_proc_call();
 	scheduler_proc_read(&r, sizeof(r));
@@ -147,7 +344,9 @@ scheduler_proc_commit(uint32_t msgid)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_COMMIT");
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_COMMIT, 0, 0, -1,
+	scheduler_proc_flush();
+
+	imsg_compose(&ibuf, PROC_SCHEDULER_COMMIT, ++reqid, 0, -1,
 	    &msgid, sizeof(msgid));
 
 	scheduler_proc_call();
@@ -164,7 +363,9 @@ scheduler_proc_rollback(uint32_t msgid)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_ROLLBACK");
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_ROLLBACK, 0, 0, -1,
+	scheduler_proc_flush();
+
+	imsg_compose(&ibuf, PROC_SCHEDULER_ROLLBACK, ++reqid, 0, -1,
 	    &msgid, sizeof(msgid));
 
 	scheduler_proc_call();
@@ -181,7 +382,9 @@ scheduler_proc_update(struct scheduler_info *si)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_UPDATE");
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_UPDATE, 0, 0, -1, si, sizeof(*si));
+	scheduler_proc_flush();
+
+	imsg_compose(&ibuf, PROC_SCHEDULER_UPDATE, ++reqid, 0, -1, si, sizeof(*si));
 
 	scheduler_proc_call();
 	scheduler_proc_read(&r, sizeof(r));
@@ -199,9 +402,18 @@ scheduler_proc_delete(uint64_t evpid)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_DELETE");
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_DELETE, 0, 0, -1,
+	if (caps & PROC_SCHEDULER_CAP_BATCH) {
+		scheduler_proc_bulk(PROC_SCHEDULER_DELETE_BATCH, &evpid,
+		    sizeof(evpid));
+		return (1);
+	}
+
+	imsg_compose(&ibuf, PROC_SCHEDULER_DELETE, ++reqid, 0, -1,
 	    &evpid, sizeof(evpid));
 
+	if (caps & PROC_SCHEDULER_CAP_PIPELINE)
+		return (scheduler_proc_async());
+
 	scheduler_proc_call();
 	scheduler_proc_read(&r, sizeof(r));
 	scheduler_proc_end();
@@ -217,7 +429,9 @@ scheduler_proc_hold(uint64_t evpid, uint64_t holdq)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_HOLD");
 
-	buf = imsg_create(&ibuf, PROC_SCHEDULER_HOLD, 0, 0,
+	scheduler_proc_flush();
+
+	buf = imsg_create(&ibuf, PROC_SCHEDULER_HOLD, ++reqid, 0,
 	    sizeof(evpid) + sizeof(holdq));
 	if (buf == NULL)
 		return (-1);
@@ -227,6 +441,9 @@ scheduler_proc_hold(uint64_t evpid, uint64_t holdq)
 		return (-1);
 	imsg_close(&ibuf, buf);
 
+	if (caps & PROC_SCHEDULER_CAP_PIPELINE)
+		return (scheduler_proc_async());
+
 	scheduler_proc_call();
 
 	scheduler_proc_read(&r, sizeof(r));
@@ -243,7 +460,9 @@ scheduler_proc_release(int type, uint64_t holdq, int n)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_RELEASE");
 
-	buf = imsg_create(&ibuf, PROC_SCHEDULER_RELEASE, 0, 0,
+	scheduler_proc_flush();
+
+	buf = imsg_create(&ibuf, PROC_SCHEDULER_RELEASE, ++reqid, 0,
 	    sizeof(holdq) + sizeof(n));
 	if (buf == NULL)
 		return (-1);
@@ -255,6 +474,9 @@ scheduler_proc_release(int type, uint64_t holdq, int n)
 		return (-1);
 	imsg_close(&ibuf, buf);
 
+	if (caps & PROC_SCHEDULER_CAP_PIPELINE)
+		return (scheduler_proc_async());
+
 	scheduler_proc_call();
 
 	scheduler_proc_read(&r, sizeof(r));
@@ -271,7 +493,9 @@ scheduler_proc_batch(int typemask, int *delay, size_t *count, uint64_t *evpids,
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_BATCH");
 
-	buf = imsg_create(&ibuf, PROC_SCHEDULER_BATCH, 0, 0,
+	scheduler_proc_flush();
+
+	buf = imsg_create(&ibuf, PROC_SCHEDULER_BATCH, ++reqid, 0,
 	    sizeof(typemask) + sizeof(*count));
 	if (buf == NULL)
 		return (-1);
@@ -302,7 +526,9 @@ scheduler_proc_messages(uint32_t from, uint32_t *dst, size_t size)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_MESSAGES");
 
-	buf = imsg_create(&ibuf, PROC_SCHEDULER_MESSAGES, 0, 0,
+	scheduler_proc_flush();
+
+	buf = imsg_create(&ibuf, PROC_SCHEDULER_MESSAGES, ++reqid, 0,
 	    sizeof(from) + sizeof(size));
 	if (buf == NULL)
 		return (-1);
@@ -329,7 +555,9 @@ scheduler_proc_envelopes(uint64_t from, struct evpstate *dst, size_t size)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_ENVELOPES");
 
-	buf = imsg_create(&ibuf, PROC_SCHEDULER_ENVELOPES, 0, 0,
+	scheduler_proc_flush();
+
+	buf = imsg_create(&ibuf, PROC_SCHEDULER_ENVELOPES, ++reqid, 0,
 	    sizeof(from) + sizeof(size));
 	if (buf == NULL)
 		return (-1);
@@ -355,7 +583,9 @@ scheduler_proc_schedule(uint64_t evpid)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_SCHEDULE");
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_SCHEDULE, 0, 0, -1,
+	scheduler_proc_flush();
+
+	imsg_compose(&ibuf, PROC_SCHEDULER_SCHEDULE, ++reqid, 0, -1,
 	    &evpid, sizeof(evpid));
 
 	scheduler_proc_call();
@@ -373,7 +603,9 @@ scheduler_proc_remove(uint64_t evpid)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_REMOVE");
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_REMOVE, 0, 0, -1,
+	scheduler_proc_flush();
+
+	imsg_compose(&ibuf, PROC_SCHEDULER_REMOVE, ++reqid, 0, -1,
 	    &evpid, sizeof(evpid));
 
 	scheduler_proc_call();
@@ -391,7 +623,9 @@ scheduler_proc_suspend(uint64_t evpid)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_SUSPEND");
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_SUSPEND, 0, 0, -1,
+	scheduler_proc_flush();
+
+	imsg_compose(&ibuf, PROC_SCHEDULER_SUSPEND, ++reqid, 0, -1,
 	    &evpid, sizeof(evpid));
 
 	scheduler_proc_call();
@@ -409,7 +643,9 @@ scheduler_proc_resume(uint64_t evpid)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_RESUME");
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_RESUME, 0, 0, -1,
+	scheduler_proc_flush();
+
+	imsg_compose(&ibuf, PROC_SCHEDULER_RESUME, ++reqid, 0, -1,
 	    &evpid, sizeof(evpid));
 
 	scheduler_proc_call();
@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <imsg.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -37,10 +38,24 @@
 #include "log.h"
 
 TAILQ_HEAD(evplist, rq_envelope);
+TAILQ_HEAD(msglist, rq_message);
+
+/*
+ * Scheduled envelopes waiting to be handed to mta, mda or bounce are
+ * queued on their message, and messages with such envelopes are served
+ * round-robin, so that a message with a large number of recipients
+ * does not hold back the others.  Each turn hands out up to a quantum
+ * of envelopes of the same message: they are sent to the mta together
+ * and recipients sharing a relay end up in the same transaction.
+ */
+#define	RQ_READY_QUANTUM	 32
 
 struct rq_message {
 	uint32_t		 msgid;
 	struct tree		 envelopes;
+
+	struct evplist		 q_ready[3]; /* delivery type */
+	TAILQ_ENTRY(rq_message)	 r_entry[3];
 };
 
 struct rq_envelope {
@@ -72,6 +87,27 @@ struct rq_envelope {
 
 	time_t			 t_inflight;
 	time_t			 t_scheduled;
+
+	struct rq_domain	*domain;
+	SPLAY_ENTRY(rq_envelope) d_entry;
+	SPLAY_ENTRY(rq_envelope) a_entry;
+};
+
+/*
+ * What "smtpctl show queue summary" reports per destination domain is
+ * maintained as envelopes change state, so that it is available without
+ * walking a queue of millions.  The envelopes of a domain waiting for
+ * their next try, and all of them by age, are kept in trees of their own
+ * for the next retry and the oldest envelope to be tracked as well.
+ */
+struct rq_domain {
+	char			 name[SMTPD_MAXDOMAINPARTSIZE];
+	size_t			 refs;
+	struct queue_count	 count;
+	SPLAY_HEAD(domaintree, rq_envelope)	q_pending;
+	SPLAY_HEAD(agetree, rq_envelope)	q_age;
+	struct rq_envelope	*next;
+	struct rq_envelope	*oldest;
 };
 
 struct rq_holdq {
@@ -79,27 +115,89 @@ struct rq_holdq {
 	size_t			 count;
 };
 
+/*
+ * Held envelopes are only looked at again when their holdq is released,
+ * which may be long after they expired.  They are also indexed by
+ * expiry, through the tree entry they do not otherwise use while held,
+ * so that they can be expired on time.
+ */
+SPLAY_HEAD(expiretree, rq_envelope);
+
+/*
+ * Envelopes and messages are carved out of fixed-size slabs rather than
+ * malloc'd one at a time: a large queue holds millions of them and the
+ * per-allocation overhead and fragmentation dominate otherwise. Each
+ * item is prefixed with a pointer to its slab so that a slab can be given
+ * back once all of its items are freed.
+ */
+#define	RQ_SLAB_SIZE		 (64 * 1024)
+
+struct rq_item {
+	struct rq_slab		*slab;
+	struct rq_item		*next;	/* start of the object when in use */
+};
+
+struct rq_slab {
+	TAILQ_ENTRY(rq_slab)	 entry;
+	struct rq_item		*free;
+	size_t			 used;
+};
+
+struct rq_pool {
+	const char		*stat;
+	size_t			 objsize;
+	size_t			 itemsize;
+	size_t			 nitems;
+	TAILQ_HEAD(, rq_slab)	 partial;
+};
+
+/*
+ * Pending envelopes of the ramqueue wait in a calendar of one-second
+ * buckets covering the next RQ_CALENDAR_SIZE seconds from base, which
+ * makes queueing and dequeueing them constant time regardless of the
+ * size of the queue.  Those due later are kept sorted in an overflow
+ * tree and moved to their bucket as the calendar reaches them.
+ *
+ * An envelope is due at the earliest of its next try and its expiry,
+ * and sits in the bucket of that second, or in the current one if it
+ * is already due.  Since base never moves past a bucket that is not
+ * empty, where an envelope is can be told from its due time alone.
+ */
+#define	RQ_CALENDAR_SIZE	 4096
+
+struct rq_calendar {
+	time_t			 base;
+	size_t			 count;
+	struct evplist		 buckets[RQ_CALENDAR_SIZE];
+	SPLAY_HEAD(prioqtree, rq_envelope)	overflow;
+};
+
 struct rq_queue {
 	size_t			 evpcount;
 	struct tree		 messages;
-	SPLAY_HEAD(prioqtree, rq_envelope)	q_priotree;
+	struct rq_calendar	*q_calendar;
 
+	/* envelopes of an update, sorted in the calendar on commit */
 	struct evplist		 q_pending;
 	struct evplist		 q_inflight;
 
-	struct evplist		 q_mta;
-	struct evplist		 q_mda;
-	struct evplist		 q_bounce;
+	struct msglist		 q_ready[3]; /* delivery type */
+	size_t			 r_served[3]; /* from head message */
 	struct evplist		 q_update;
 	struct evplist		 q_expired;
 	struct evplist		 q_removed;
 };
 
 static int rq_envelope_cmp(struct rq_envelope *, struct rq_envelope *);
+static int rq_envelope_age_cmp(struct rq_envelope *, struct rq_envelope *);
+static int rq_envelope_expire_cmp(struct rq_envelope *, struct rq_envelope *);
 
 SPLAY_PROTOTYPE(prioqtree, rq_envelope, t_entry, rq_envelope_cmp);
+SPLAY_PROTOTYPE(domaintree, rq_envelope, d_entry, rq_envelope_cmp);
+SPLAY_PROTOTYPE(agetree, rq_envelope, a_entry, rq_envelope_age_cmp);
+SPLAY_PROTOTYPE(expiretree, rq_envelope, t_entry, rq_envelope_expire_cmp);
 static int scheduler_ram_init(const char *);
-static int scheduler_ram_insert(struct scheduler_info *);
+static int scheduler_ram_insert(struct scheduler_info *, const char *);
 static size_t scheduler_ram_commit(uint32_t);
 static size_t scheduler_ram_rollback(uint32_t);
 static int scheduler_ram_update(struct scheduler_info *);
@@ -114,8 +212,37 @@ static int scheduler_ram_remove(uint64_t);
 static int scheduler_ram_suspend(uint64_t);
 static int scheduler_ram_resume(uint64_t);
 static int scheduler_ram_query(uint64_t);
+static int scheduler_ram_summary(struct queue_count *, size_t *);
+static size_t scheduler_ram_domains(const char *, struct queue_domain *, size_t);
+static size_t scheduler_ram_dump(uint64_t *, struct scheduler_info *,
+    const char **, uint64_t *, size_t);
+static int scheduler_ram_restore_hold(uint64_t, uint64_t);
+static size_t scheduler_ram_select(const struct queue_filter *, uint64_t *,
+    uint64_t *, size_t);
 
 static void sorted_insert(struct rq_queue *, struct rq_envelope *);
+static void sorted_remove(struct rq_queue *, struct rq_envelope *);
+
+static time_t rq_envelope_due(struct rq_envelope *);
+static struct evplist *rq_calendar_bucket(struct rq_calendar *,
+    struct rq_envelope *);
+static void rq_calendar_advance(struct rq_calendar *);
+static time_t rq_calendar_next(struct rq_calendar *);
+
+static int rq_envelope_match(const struct queue_filter *,
+    struct rq_envelope *);
+static int rq_holdq_insert(struct rq_envelope *, uint64_t);
+static void rq_holdq_remove(struct rq_envelope *);
+
+static struct rq_domain *rq_domain_get(const char *);
+static void rq_domain_put(struct rq_domain *);
+static void rq_domain_link(struct rq_envelope *);
+static void rq_domain_unlink(struct rq_envelope *);
+static void rq_domain_count(struct rq_envelope *, int);
+
+static void rq_pool_init(struct rq_pool *, const char *, size_t);
+static void *rq_pool_get(struct rq_pool *);
+static void rq_pool_put(struct rq_pool *, void *);
 
 static void rq_queue_init(struct rq_queue *);
 static void rq_queue_merge(struct rq_queue *, struct rq_queue *);
@@ -123,10 +250,15 @@ static void rq_queue_dump(struct rq_queue *, const char *);
 static void rq_queue_schedule(struct rq_queue *rq);
 static struct evplist *rq_envelope_list(struct rq_queue *, struct rq_envelope *);
 static void rq_envelope_schedule(struct rq_queue *, struct rq_envelope *);
+static void rq_envelope_unlink(struct rq_queue *, struct rq_envelope *);
+static void rq_ready_insert(struct rq_queue *, struct rq_envelope *);
+static void rq_ready_remove(struct rq_queue *, struct rq_envelope *);
+static struct rq_envelope *rq_ready_next(struct rq_queue *, enum delivery_type);
 static int rq_envelope_remove(struct rq_queue *, struct rq_envelope *);
 static int rq_envelope_suspend(struct rq_queue *, struct rq_envelope *);
 static int rq_envelope_resume(struct rq_queue *, struct rq_envelope *);
 static void rq_envelope_delete(struct rq_queue *, struct rq_envelope *);
+static void rq_envelope_state(struct rq_envelope *, uint8_t);
 static const char *rq_envelope_to_text(struct rq_envelope *);
 
 struct scheduler_backend scheduler_backend_ramqueue = {
@@ -150,17 +282,29 @@ struct scheduler_backend scheduler_backend_ramqueue = {
 	scheduler_ram_suspend,
 	scheduler_ram_resume,
 	scheduler_ram_query,
+
+	scheduler_ram_summary,
+	scheduler_ram_domains,
+	scheduler_ram_dump,
+	scheduler_ram_restore_hold,
+	scheduler_ram_select,
 };
 
 static struct rq_queue	ramqueue;
 static struct tree	updates;
 static struct tree	holdqs[3]; /* delivery type */
+static struct expiretree holdexpire;
+static struct rq_pool	envelope_pool;
+static struct rq_pool	message_pool;
+static struct dict	domains;
+static struct queue_count totals;
 
 static time_t		currtime;
 
 #define BACKOFF_TRANSFER	400
 #define BACKOFF_DELIVERY	10
 #define BACKOFF_OVERFLOW	3
+#define BACKOFF_JITTER		4
 
 static time_t
 scheduler_backoff(time_t t0, time_t base, uint32_t step)
@@ -180,27 +324,61 @@ scheduler_next(time_t t0, time_t base, uint32_t step)
 	return (t);
 }
 
+/*
+ * Envelopes that failed together, typically because their destination
+ * was down, would otherwise all be retried on the same second and hit
+ * it again at once when it comes back.  Delay each retry by a random
+ * fraction of the time left until it, so that they trickle in.
+ */
+static time_t
+scheduler_jitter(time_t t)
+{
+	time_t	delay;
+
+	if ((delay = (t - currtime) / BACKOFF_JITTER) <= 0)
+		return (t);
+	if (delay > UINT32_MAX)
+		delay = UINT32_MAX;
+
+	return (t + arc4random_uniform(delay));
+}
+
 static int
 scheduler_ram_init(const char *arg)
 {
+	struct rq_calendar	*c;
+	size_t			 i;
+
 	rq_queue_init(&ramqueue);
+	c = xcalloc(1, sizeof *c);
+	c->base = clock_cached();
+	for (i = 0; i < RQ_CALENDAR_SIZE; i++)
+		TAILQ_INIT(&c->buckets[i]);
+	SPLAY_INIT(&c->overflow);
+	ramqueue.q_calendar = c;
 	tree_init(&updates);
 	tree_init(&holdqs[D_MDA]);
 	tree_init(&holdqs[D_MTA]);
 	tree_init(&holdqs[D_BOUNCE]);
+	SPLAY_INIT(&holdexpire);
+	dict_init(&domains);
+	rq_pool_init(&envelope_pool, "scheduler.ramqueue.pool.envelope",
+	    sizeof(struct rq_envelope));
+	rq_pool_init(&message_pool, "scheduler.ramqueue.pool.message",
+	    sizeof(struct rq_message));
 
 	return (1);
 }
 
 static int
-scheduler_ram_insert(struct scheduler_info *si)
+scheduler_ram_insert(struct scheduler_info *si, const char *domain)
 {
 	struct rq_queue		*update;
 	struct rq_message	*message;
 	struct rq_envelope	*envelope;
 	uint32_t		 msgid;
 
-	currtime = time(NULL);
+	currtime = clock_cached();
 
 	msgid = evpid_to_msgid(si->evpid);
 
@@ -214,22 +392,31 @@ scheduler_ram_insert(struct scheduler_info *si)
 
 	/* find/prepare the msgtree message in ramqueue update */
 	if ((message = tree_get(&update->messages, msgid)) == NULL) {
-		message = xcalloc(1, sizeof *message);
+		message = rq_pool_get(&message_pool);
 		message->msgid = msgid;
 		tree_init(&message->envelopes);
+		TAILQ_INIT(&message->q_ready[D_MDA]);
+		TAILQ_INIT(&message->q_ready[D_MTA]);
+		TAILQ_INIT(&message->q_ready[D_BOUNCE]);
 		tree_xset(&update->messages, msgid, message);
 		stat_increment("scheduler.ramqueue.message", 1);
 	}
 
 	/* create envelope in ramqueue message */
-	envelope = xcalloc(1, sizeof *envelope);
+	envelope = rq_pool_get(&envelope_pool);
 	envelope->evpid = si->evpid;
 	envelope->type = si->type;
 	envelope->message = message;
+	envelope->domain = rq_domain_get(domain);
 	envelope->ctime = si->creation;
 	envelope->expire = si->creation + si->ttl;
-	envelope->sched = scheduler_backoff(si->creation,
-	    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY, si->retry);
+	/* envelopes handed over on reload keep their next try */
+	if (si->nexttry)
+		envelope->sched = si->nexttry;
+	else
+		envelope->sched = scheduler_backoff(si->creation,
+		    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY,
+		    si->retry);
 	tree_xset(&message->envelopes, envelope->evpid, envelope);
 
 	update->evpcount++;
@@ -249,7 +436,7 @@ scheduler_ram_commit(uint32_t msgid)
 	struct rq_queue	*update;
 	size_t		 r;
 
-	currtime = time(NULL);
+	currtime = clock_cached();
 
 	update = tree_xpop(&updates, msgid);
 	r = update->evpcount;
@@ -277,7 +464,7 @@ scheduler_ram_rollback(uint32_t msgid)
 	struct rq_envelope	*evp;
 	size_t			 r;
 
-	currtime = time(NULL);
+	currtime = clock_cached();
 
 	if ((update = tree_pop(&updates, msgid)) == NULL)
 		return (0);
@@ -301,7 +488,7 @@ scheduler_ram_update(struct scheduler_info *si)
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
 
-	currtime = time(NULL);
+	currtime = clock_cached();
 
 	msgid = evpid_to_msgid(si->evpid);
 	msg = tree_xget(&ramqueue.messages, msgid);
@@ -319,15 +506,15 @@ scheduler_ram_update(struct scheduler_info *si)
 	 */
 	if (evp->flags & RQ_ENVELOPE_REMOVED) {
 		TAILQ_INSERT_TAIL(&ramqueue.q_removed, evp, entry);
-		evp->state = RQ_EVPSTATE_SCHEDULED;
+		rq_envelope_state(evp, RQ_EVPSTATE_SCHEDULED);
 		evp->t_scheduled = currtime;
 		return (1);
 	}
 
-	evp->sched = scheduler_next(evp->ctime,
-	    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY, si->retry);
+	evp->sched = scheduler_jitter(scheduler_next(evp->ctime,
+	    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY, si->retry));
 
-	evp->state = RQ_EVPSTATE_PENDING;
+	rq_envelope_state(evp, RQ_EVPSTATE_PENDING);
 	if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
 		sorted_insert(&ramqueue, evp);
 
@@ -343,7 +530,7 @@ scheduler_ram_delete(uint64_t evpid)
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
 
-	currtime = time(NULL);
+	currtime = clock_cached();
 
 	msgid = evpid_to_msgid(evpid);
 	msg = tree_xget(&ramqueue.messages, msgid);
@@ -365,12 +552,11 @@ scheduler_ram_delete(uint64_t evpid)
 static int
 scheduler_ram_hold(uint64_t evpid, uint64_t holdq)
 {
-	struct rq_holdq		*hq;
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
 
-	currtime = time(NULL);
+	currtime = clock_cached();
 
 	msgid = evpid_to_msgid(evpid);
 	msg = tree_xget(&ramqueue.messages, msgid);
@@ -384,21 +570,13 @@ scheduler_ram_hold(uint64_t evpid, uint64_t holdq)
 
 	/* If the envelope is suspended, just mark it as pending */
 	if (evp->flags & RQ_ENVELOPE_SUSPEND) {
-		evp->state = RQ_EVPSTATE_PENDING;
+		rq_envelope_state(evp, RQ_EVPSTATE_PENDING);
 		return (0);
 	}
 
-	hq = tree_get(&holdqs[evp->type], holdq);
-	if (hq == NULL) {
-		hq = xcalloc(1, sizeof(*hq));
-		TAILQ_INIT(&hq->q);
-		tree_xset(&holdqs[evp->type], holdq, hq);
-		stat_increment("scheduler.ramqueue.holdq", 1);
-	}
-
 	/* If the holdq is full, just "tempfail" the envelope */
-	if (hq->count >= HOLDQ_MAXSIZE) {
-		evp->state = RQ_EVPSTATE_PENDING;
+	if (!rq_holdq_insert(evp, holdq)) {
+		rq_envelope_state(evp, RQ_EVPSTATE_PENDING);
 		evp->flags |= RQ_ENVELOPE_UPDATE;
 		evp->flags |= RQ_ENVELOPE_OVERFLOW;
 		sorted_insert(&ramqueue, evp);
@@ -406,21 +584,44 @@ scheduler_ram_hold(uint64_t evpid, uint64_t holdq)
 		return (0);
 	}
 
-	evp->state = RQ_EVPSTATE_HELD;
-	evp->holdq = holdq;
-	/* This is an optimization: upon release, the envelopes will be
-	 * inserted in the pending queue from the first element to the last.
-	 * Since elements already in the queue were received first, they
-	 * were scheduled first, so they will be reinserted before the
-	 * current element.
-	 */
-	TAILQ_INSERT_HEAD(&hq->q, evp, entry);
-	hq->count += 1;
-	stat_increment("scheduler.ramqueue.hold", 1);
+	return (1);
+}
+
+/*
+ * Put back on its holdq an envelope which was held when handed over by
+ * the previous generation, so that the relay it waits for releases it
+ * at the pace of its task window rather than all at once.
+ */
+static int
+scheduler_ram_restore_hold(uint64_t evpid, uint64_t holdq)
+{
+	struct rq_message	*msg;
+	struct rq_envelope	*evp;
+
+	currtime = clock_cached();
+
+	if ((msg = tree_get(&ramqueue.messages, evpid_to_msgid(evpid))) == NULL)
+		return (0);
+	if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		return (0);
+	if (evp->state != RQ_EVPSTATE_PENDING ||
+	    evp->flags & (RQ_ENVELOPE_SUSPEND | RQ_ENVELOPE_REMOVED |
+	    RQ_ENVELOPE_EXPIRED))
+		return (0);
 
+	sorted_remove(&ramqueue, evp);
+	if (!rq_holdq_insert(evp, holdq)) {
+		sorted_insert(&ramqueue, evp);
+		return (0);
+	}
 	return (1);
 }
 
+/*
+ * Release n envelopes, as many as the task window the mta advertised,
+ * or all of them for n == 0 and n == -1.  They are scheduled directly,
+ * so that the next batch hands them all over at once.
+ */
 static int
 scheduler_ram_release(int type, uint64_t holdq, int n)
 {
@@ -428,11 +629,7 @@ scheduler_ram_release(int type, uint64_t holdq, int n)
 	struct rq_envelope	*evp;
 	int			 i, update;
 
-	currtime = time(NULL);
-
-	hq = tree_get(&holdqs[type], holdq);
-	if (hq == NULL)
-		return (0);
+	currtime = clock_cached();
 
 	if (n == -1) {
 		n = 0;
@@ -442,30 +639,14 @@ scheduler_ram_release(int type, uint64_t holdq, int n)
 		update = 0;
 
 	for (i = 0; n == 0 || i < n; i++) {
-		evp = TAILQ_FIRST(&hq->q);
-		if (evp == NULL)
+		/* the holdq goes away with its last envelope */
+		if ((hq = tree_get(&holdqs[type], holdq)) == NULL)
 			break;
-
-		TAILQ_REMOVE(&hq->q, evp, entry);
-		hq->count -= 1;
-		evp->holdq = 0;
-
-		/* When released, all envelopes are put in the pending queue
-		 * and will be rescheduled immediately.  As an optimization,
-		 * we could just schedule them directly.
-		 */
-		evp->state = RQ_EVPSTATE_PENDING;
+		evp = TAILQ_FIRST(&hq->q);
 		if (update)
 			evp->flags |= RQ_ENVELOPE_UPDATE;
-		sorted_insert(&ramqueue, evp);
-	}
-
-	if (TAILQ_EMPTY(&hq->q)) {
-		tree_xpop(&holdqs[type], holdq);
-		free(hq);
-		stat_decrement("scheduler.ramqueue.holdq", 1);
+		rq_envelope_schedule(&ramqueue, evp);
 	}
-	stat_decrement("scheduler.ramqueue.hold", i);
 
 	return (i);
 }
@@ -477,7 +658,7 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 	size_t			 i, n;
 	time_t			 t;
 
-	currtime = time(NULL);
+	currtime = clock_cached();
 
 	rq_queue_schedule(&ramqueue);
 	if (tracing & TRACE_SCHEDULER)
@@ -522,7 +703,7 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 
 			evp->sched = scheduler_next(evp->ctime, t, 0);
 			evp->flags &= ~(RQ_ENVELOPE_UPDATE|RQ_ENVELOPE_OVERFLOW);
-			evp->state = RQ_EVPSTATE_PENDING;
+			rq_envelope_state(evp, RQ_EVPSTATE_PENDING);
 			if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
 				sorted_insert(&ramqueue, evp);
 
@@ -530,39 +711,39 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 				break;
 		}
 
-		if (mask & SCHED_BOUNCE && (evp = TAILQ_FIRST(&ramqueue.q_bounce))) {
-			TAILQ_REMOVE(&ramqueue.q_bounce, evp, entry);
+		if (mask & SCHED_BOUNCE &&
+		    (evp = rq_ready_next(&ramqueue, D_BOUNCE))) {
 			types[i] = SCHED_BOUNCE;
 			evpids[i] = evp->evpid;
 
 			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
-			evp->state = RQ_EVPSTATE_INFLIGHT;
+			rq_envelope_state(evp, RQ_EVPSTATE_INFLIGHT);
 			evp->t_inflight = currtime;
 
 			if (++i == *count)
 				break;
 		}
 
-		if (mask & SCHED_MDA && (evp = TAILQ_FIRST(&ramqueue.q_mda))) {
-			TAILQ_REMOVE(&ramqueue.q_mda, evp, entry);
+		if (mask & SCHED_MDA &&
+		    (evp = rq_ready_next(&ramqueue, D_MDA))) {
 			types[i] = SCHED_MDA;
 			evpids[i] = evp->evpid;
 
 			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
-			evp->state = RQ_EVPSTATE_INFLIGHT;
+			rq_envelope_state(evp, RQ_EVPSTATE_INFLIGHT);
 			evp->t_inflight = currtime;
 
 			if (++i == *count)
 				break;
 		}
 
-		if (mask & SCHED_MTA && (evp = TAILQ_FIRST(&ramqueue.q_mta))) {
-			TAILQ_REMOVE(&ramqueue.q_mta, evp, entry);
+		if (mask & SCHED_MTA &&
+		    (evp = rq_ready_next(&ramqueue, D_MTA))) {
 			types[i] = SCHED_MTA;
 			evpids[i] = evp->evpid;
 
 			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
-			evp->state = RQ_EVPSTATE_INFLIGHT;
+			rq_envelope_state(evp, RQ_EVPSTATE_INFLIGHT);
 			evp->t_inflight = currtime;
 
 			if (++i == *count)
@@ -581,13 +762,12 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 		return (1);
 	}
 
-	if ((evp = TAILQ_FIRST(&ramqueue.q_pending))) {
-		if (evp->sched < evp->expire)
-			t = evp->sched;
-		else
-			t = evp->expire;
+	t = rq_calendar_next(ramqueue.q_calendar);
+	if ((evp = SPLAY_MIN(expiretree, &holdexpire)) &&
+	    (t == -1 || evp->expire < t))
+		t = evp->expire;
+	if (t != -1)
 		*delay = (t < currtime) ? 0 : (t - currtime);
-	}
 	else
 		*delay = -1;
 
@@ -671,7 +851,7 @@ scheduler_ram_schedule(uint64_t evpid)
 	void			*i;
 	int			 r;
 
-	currtime = time(NULL);
+	currtime = clock_cached();
 
 	if (evpid > 0xffffffff) {
 		msgid = evpid_to_msgid(evpid);
@@ -709,7 +889,7 @@ scheduler_ram_remove(uint64_t evpid)
 	void			*i;
 	int			 r;
 
-	currtime = time(NULL);
+	currtime = clock_cached();
 
 	if (evpid > 0xffffffff) {
 		msgid = evpid_to_msgid(evpid);
@@ -743,7 +923,7 @@ scheduler_ram_suspend(uint64_t evpid)
 	void			*i;
 	int			 r;
 
-	currtime = time(NULL);
+	currtime = clock_cached();
 
 	if (evpid > 0xffffffff) {
 		msgid = evpid_to_msgid(evpid);
@@ -777,7 +957,7 @@ scheduler_ram_resume(uint64_t evpid)
 	void			*i;
 	int			 r;
 
-	currtime = time(NULL);
+	currtime = clock_cached();
 
 	if (evpid > 0xffffffff) {
 		msgid = evpid_to_msgid(evpid);
@@ -818,17 +998,264 @@ scheduler_ram_query(uint64_t evpid)
 	return (1);
 }
 
+/*
+ * Select for a bulk operation the envelopes after *from that match the
+ * type, state and age of the filter.  With a domain, only the envelopes
+ * of that destination domain are walked, oldest first, so that an age
+ * ends the walk as well; otherwise the whole queue is, in evpid order.
+ * Fewer than size envelopes are returned once the walk is over.
+ */
+static size_t
+scheduler_ram_select(const struct queue_filter *f, uint64_t *from,
+    uint64_t *dst, size_t size)
+{
+	struct rq_domain	*d;
+	struct rq_message	*msg;
+	struct rq_envelope	*evp;
+	char			 buf[SMTPD_MAXDOMAINPARTSIZE];
+	void			*i, *j;
+	uint64_t		 id;
+	size_t			 n, k;
+
+	currtime = clock_cached();
+	n = 0;
+
+	if (f->domain[0]) {
+		for (k = 0; f->domain[k] && k < sizeof(buf) - 1; k++)
+			buf[k] = tolower((unsigned char)f->domain[k]);
+		buf[k] = '\0';
+		if ((d = dict_get(&domains, buf)) == NULL)
+			return (0);
+
+		evp = NULL;
+		if (*from &&
+		    (msg = tree_get(&ramqueue.messages, evpid_to_msgid(*from))) &&
+		    (evp = tree_get(&msg->envelopes, *from)))
+			evp = SPLAY_NEXT(agetree, &d->q_age, evp);
+		else if (*from == 0)
+			evp = SPLAY_MIN(agetree, &d->q_age);
+
+		for (; evp && n < size;
+		    evp = SPLAY_NEXT(agetree, &d->q_age, evp)) {
+			if (f->age && currtime - evp->ctime < f->age)
+				break;
+			if (rq_envelope_match(f, evp))
+				dst[n++] = evp->evpid;
+			*from = evp->evpid;
+		}
+		return (n);
+	}
+
+	id = *from ? *from + 1 : 0;
+	i = NULL;
+	while (n < size && tree_iterfrom(&ramqueue.messages, &i,
+	    evpid_to_msgid(id), NULL, (void **)&msg)) {
+		j = NULL;
+		while (n < size && tree_iterfrom(&msg->envelopes, &j, id,
+		    NULL, (void **)&evp)) {
+			if (rq_envelope_match(f, evp))
+				dst[n++] = evp->evpid;
+			*from = evp->evpid;
+		}
+	}
+
+	return (n);
+}
+
+/*
+ * Export the envelopes from *from on, in evpid order, for the schedulers
+ * of a reloaded smtpd to pick up without reading the queue again.  The
+ * domains point into the ramqueue and are valid until it next changes.
+ * Held envelopes come with their holdq, others with 0.
+ */
+static size_t
+scheduler_ram_dump(uint64_t *from, struct scheduler_info *dst,
+    const char **domains, uint64_t *held, size_t size)
+{
+	struct rq_message	*msg;
+	struct rq_envelope	*evp;
+	void			*i, *j;
+	size_t			 n = 0;
+
+	i = NULL;
+	while (n < size && tree_iterfrom(&ramqueue.messages, &i,
+	    evpid_to_msgid(*from), NULL, (void **)&msg)) {
+		j = NULL;
+		while (n < size && tree_iterfrom(&msg->envelopes, &j, *from,
+		    NULL, (void **)&evp)) {
+			*from = evp->evpid + 1;
+			if (evp->flags & (RQ_ENVELOPE_REMOVED | RQ_ENVELOPE_EXPIRED))
+				continue;
+
+			memset(&dst[n], 0, sizeof dst[n]);
+			dst[n].evpid = evp->evpid;
+			dst[n].type = evp->type;
+			dst[n].creation = evp->ctime;
+			dst[n].ttl = evp->expire - evp->ctime;
+			dst[n].nexttry = evp->sched;
+			domains[n] = evp->domain->name;
+			held[n] = evp->state == RQ_EVPSTATE_HELD ?
+			    evp->holdq : 0;
+			n++;
+		}
+	}
+
+	return (n);
+}
+
+static int
+scheduler_ram_summary(struct queue_count *c, size_t *nmsg)
+{
+	*c = totals;
+	*nmsg = tree_count(&ramqueue.messages);
+
+	return (1);
+}
+
+/* domains sorting after "from", or all of them */
+static size_t
+scheduler_ram_domains(const char *from, struct queue_domain *dst, size_t size)
+{
+	struct rq_domain	*d;
+	const char		*key;
+	void			*iter;
+	size_t			 n;
+
+	iter = NULL;
+	for (n = 0; n < size; ) {
+		if (dict_iterfrom(&domains, &iter, from, &key,
+		    (void **)&d) == 0)
+			break;
+		if (from && strcmp(key, from) == 0)
+			continue;
+		/* only envelopes being removed, or not committed yet */
+		if (d->count.total == 0)
+			continue;
+
+		(void)strlcpy(dst[n].name, d->name, sizeof dst[n].name);
+		dst[n].count = d->count;
+		dst[n].oldest = d->oldest ? d->oldest->ctime : 0;
+		dst[n].next = 0;
+		if (d->next)
+			dst[n].next = MIN(d->next->sched, d->next->expire);
+		n++;
+	}
+
+	return (n);
+}
+
 static void
 sorted_insert(struct rq_queue *rq, struct rq_envelope *evp)
 {
-	struct rq_envelope	*evp2;
+	struct rq_calendar	*c = rq->q_calendar;
+	struct evplist		*b;
+
+	if ((b = rq_calendar_bucket(c, evp)) != NULL) {
+		TAILQ_INSERT_TAIL(b, evp, entry);
+		c->count++;
+	}
+	else
+		SPLAY_INSERT(prioqtree, &c->overflow, evp);
+
+	SPLAY_INSERT(domaintree, &evp->domain->q_pending, evp);
+	if (evp->domain->next == NULL ||
+	    rq_envelope_cmp(evp, evp->domain->next) < 0)
+		evp->domain->next = evp;
+}
+
+static void
+sorted_remove(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_calendar	*c = rq->q_calendar;
+	struct rq_domain	*d = evp->domain;
+	struct evplist		*b;
 
-	SPLAY_INSERT(prioqtree, &rq->q_priotree, evp);
-	evp2 = SPLAY_NEXT(prioqtree, &rq->q_priotree, evp);
-	if (evp2)
-		TAILQ_INSERT_BEFORE(evp2, evp, entry);
+	if ((b = rq_calendar_bucket(c, evp)) != NULL) {
+		TAILQ_REMOVE(b, evp, entry);
+		c->count--;
+	}
 	else
-		TAILQ_INSERT_TAIL(&rq->q_pending, evp, entry);
+		SPLAY_REMOVE(prioqtree, &c->overflow, evp);
+
+	SPLAY_REMOVE(domaintree, &d->q_pending, evp);
+	if (d->next == evp)
+		d->next = SPLAY_MIN(domaintree, &d->q_pending);
+}
+
+static time_t
+rq_envelope_due(struct rq_envelope *evp)
+{
+	return (evp->sched < evp->expire) ? evp->sched : evp->expire;
+}
+
+/*
+ * Return the bucket of a pending envelope, or NULL if it is due past
+ * the end of the calendar.
+ */
+static struct evplist *
+rq_calendar_bucket(struct rq_calendar *c, struct rq_envelope *evp)
+{
+	time_t	t;
+
+	if ((t = rq_envelope_due(evp)) < c->base)
+		t = c->base;
+	if (t - c->base >= RQ_CALENDAR_SIZE)
+		return (NULL);
+
+	return (&c->buckets[t % RQ_CALENDAR_SIZE]);
+}
+
+/*
+ * Move the calendar up to the current time, stopping at the first
+ * bucket with due envelopes, and bring in those from the overflow
+ * tree that now fall within it.
+ */
+static void
+rq_calendar_advance(struct rq_calendar *c)
+{
+	struct rq_envelope	*evp;
+	time_t			 base = c->base;
+
+	if (c->count == 0) {
+		if (c->base < currtime)
+			c->base = currtime;
+	}
+	else {
+		while (c->base < currtime &&
+		    TAILQ_EMPTY(&c->buckets[c->base % RQ_CALENDAR_SIZE]))
+			c->base++;
+	}
+	if (c->base == base)
+		return;
+
+	while ((evp = SPLAY_MIN(prioqtree, &c->overflow)) != NULL) {
+		if (rq_envelope_due(evp) - c->base >= RQ_CALENDAR_SIZE)
+			break;
+		SPLAY_REMOVE(prioqtree, &c->overflow, evp);
+		TAILQ_INSERT_TAIL(rq_calendar_bucket(c, evp), evp, entry);
+		c->count++;
+	}
+}
+
+/*
+ * Return the time at which the next pending envelope is due, or -1 if
+ * there is none.
+ */
+static time_t
+rq_calendar_next(struct rq_calendar *c)
+{
+	struct rq_envelope	*evp;
+	time_t			 t;
+
+	if (c->count) {
+		for (t = c->base; ; t++)
+			if (!TAILQ_EMPTY(&c->buckets[t % RQ_CALENDAR_SIZE]))
+				return (t);
+	}
+	if ((evp = SPLAY_MIN(prioqtree, &c->overflow)) != NULL)
+		return (rq_envelope_due(evp));
+
+	return (-1);
 }
 
 static void
@@ -838,13 +1265,12 @@ rq_queue_init(struct rq_queue *rq)
 	tree_init(&rq->messages);
 	TAILQ_INIT(&rq->q_pending);
 	TAILQ_INIT(&rq->q_inflight);
-	TAILQ_INIT(&rq->q_mta);
-	TAILQ_INIT(&rq->q_mda);
-	TAILQ_INIT(&rq->q_bounce);
+	TAILQ_INIT(&rq->q_ready[D_MDA]);
+	TAILQ_INIT(&rq->q_ready[D_MTA]);
+	TAILQ_INIT(&rq->q_ready[D_BOUNCE]);
 	TAILQ_INIT(&rq->q_update);
 	TAILQ_INIT(&rq->q_expired);
 	TAILQ_INIT(&rq->q_removed);
-	SPLAY_INIT(&rq->q_priotree);
 }
 
 static void
@@ -867,7 +1293,7 @@ rq_queue_merge(struct rq_queue *rq, struct rq_queue *update)
 		    (void*)&envelope)))
 			envelope->message = tomessage;
 		tree_merge(&tomessage->envelopes, &message->envelopes);
-		free(message);
+		rq_pool_put(&message_pool, message);
 		stat_decrement("scheduler.ramqueue.message", 1);
 	}
 
@@ -875,6 +1301,7 @@ rq_queue_merge(struct rq_queue *rq, struct rq_queue *update)
 	while ((envelope = TAILQ_FIRST(&update->q_pending))) {
 		TAILQ_REMOVE(&update->q_pending, envelope, entry);
 		sorted_insert(rq, envelope);
+		rq_domain_link(envelope);
 	}
 
 	rq->evpcount += update->evpcount;
@@ -885,12 +1312,30 @@ rq_queue_merge(struct rq_queue *rq, struct rq_queue *update)
 static void
 rq_queue_schedule(struct rq_queue *rq)
 {
+	struct rq_calendar	*c = rq->q_calendar;
 	struct rq_envelope	*evp;
 	size_t			 n;
 
 	n = 0;
-	while ((evp = TAILQ_FIRST(&rq->q_pending))) {
-		if (evp->sched > currtime && evp->expire > currtime)
+	while ((evp = SPLAY_MIN(expiretree, &holdexpire))) {
+		if (evp->expire > currtime || n == SCHEDULEMAX)
+			break;
+		rq_holdq_remove(evp);
+		TAILQ_INSERT_TAIL(&rq->q_expired, evp, entry);
+		rq_domain_count(evp, -1);
+		evp->state = RQ_EVPSTATE_SCHEDULED;
+		evp->flags |= RQ_ENVELOPE_EXPIRED;
+		evp->t_scheduled = currtime;
+		n += 1;
+	}
+
+	n = 0;
+	for (;;) {
+		rq_calendar_advance(c);
+		if (c->base > currtime)
+			break;
+		evp = TAILQ_FIRST(&c->buckets[c->base % RQ_CALENDAR_SIZE]);
+		if (evp == NULL)
 			break;
 
 		if (n == SCHEDULEMAX)
@@ -901,9 +1346,9 @@ rq_queue_schedule(struct rq_queue *rq)
 			    evp->flags);
 
 		if (evp->expire <= currtime) {
-			TAILQ_REMOVE(&rq->q_pending, evp, entry);
-			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+			sorted_remove(rq, evp);
 			TAILQ_INSERT_TAIL(&rq->q_expired, evp, entry);
+			rq_domain_count(evp, -1);
 			evp->state = RQ_EVPSTATE_SCHEDULED;
 			evp->flags |= RQ_ENVELOPE_EXPIRED;
 			evp->t_scheduled = currtime;
@@ -928,12 +1373,9 @@ rq_envelope_list(struct rq_queue *rq, struct rq_envelope *evp)
 			return &rq->q_removed;
 		if (evp->flags & RQ_ENVELOPE_UPDATE)
 			return &rq->q_update;
-		if (evp->type == D_MTA)
-			return &rq->q_mta;
-		if (evp->type == D_MDA)
-			return &rq->q_mda;
-		if (evp->type == D_BOUNCE)
-			return &rq->q_bounce;
+		if (evp->type == D_MTA || evp->type == D_MDA ||
+		    evp->type == D_BOUNCE)
+			return &evp->message->q_ready[evp->type];
 		fatalx("%016" PRIx64 " bad evp type %d", evp->evpid, evp->type);
 
 	case RQ_EVPSTATE_INFLIGHT:
@@ -949,81 +1391,183 @@ rq_envelope_list(struct rq_queue *rq, struct rq_envelope *evp)
 
 static void
 rq_envelope_schedule(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	if (evp->state == RQ_EVPSTATE_HELD) {
+		rq_holdq_remove(evp);
+	}
+	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
+		sorted_remove(rq, evp);
+
+	if (evp->flags & RQ_ENVELOPE_UPDATE)
+		TAILQ_INSERT_TAIL(&rq->q_update, evp, entry);
+	else
+		rq_ready_insert(rq, evp);
+	rq_envelope_state(evp, RQ_EVPSTATE_SCHEDULED);
+	evp->t_scheduled = currtime;
+}
+
+/*
+ * Remove an envelope from the list it is currently on.
+ */
+static void
+rq_envelope_unlink(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct evplist	*evl;
+
+	evl = rq_envelope_list(rq, evp);
+	if (evl == &rq->q_pending)
+		sorted_remove(rq, evp);
+	else if (evl == &evp->message->q_ready[evp->type])
+		rq_ready_remove(rq, evp);
+	else
+		TAILQ_REMOVE(evl, evp, entry);
+}
+
+static int
+rq_envelope_match(const struct queue_filter *f, struct rq_envelope *evp)
+{
+	uint16_t	flags;
+
+	if (evp->flags & (RQ_ENVELOPE_REMOVED | RQ_ENVELOPE_EXPIRED))
+		return (0);
+	if (f->type != -1 && (int)evp->type != f->type)
+		return (0);
+	if (f->age && currtime - evp->ctime < f->age)
+		return (0);
+
+	/* as reported by scheduler_ram_envelopes() */
+	flags = evp->state == RQ_EVPSTATE_INFLIGHT ? EF_INFLIGHT : EF_PENDING;
+	if (evp->state == RQ_EVPSTATE_HELD)
+		flags |= EF_HOLD;
+	if (evp->flags & RQ_ENVELOPE_SUSPEND)
+		flags |= EF_SUSPEND;
+
+	return ((flags & f->flags) == f->flags);
+}
+
+/*
+ * Return 0 if the holdq is full.  Otherwise the envelope goes to the
+ * head: upon release, the envelopes are scheduled from the first to the
+ * last, and those already on the holdq were received, and scheduled,
+ * before this one.
+ */
+static int
+rq_holdq_insert(struct rq_envelope *evp, uint64_t holdq)
 {
 	struct rq_holdq	*hq;
-	struct evplist	*q = NULL;
 
-	switch (evp->type) {
-	case D_MTA:
-		q = &rq->q_mta;
-		break;
-	case D_MDA:
-		q = &rq->q_mda;
-		break;
-	case D_BOUNCE:
-		q = &rq->q_bounce;
-		break;
+	hq = tree_get(&holdqs[evp->type], holdq);
+	if (hq == NULL) {
+		hq = xcalloc(1, sizeof(*hq));
+		TAILQ_INIT(&hq->q);
+		tree_xset(&holdqs[evp->type], holdq, hq);
+		stat_increment("scheduler.ramqueue.holdq", 1);
 	}
+	if (hq->count >= HOLDQ_MAXSIZE)
+		return (0);
 
-	if (evp->flags & RQ_ENVELOPE_UPDATE)
-		q = &rq->q_update;
+	rq_envelope_state(evp, RQ_EVPSTATE_HELD);
+	evp->holdq = holdq;
+	TAILQ_INSERT_HEAD(&hq->q, evp, entry);
+	SPLAY_INSERT(expiretree, &holdexpire, evp);
+	hq->count += 1;
+	stat_increment("scheduler.ramqueue.hold", 1);
 
-	if (evp->state == RQ_EVPSTATE_HELD) {
-		hq = tree_xget(&holdqs[evp->type], evp->holdq);
-		TAILQ_REMOVE(&hq->q, evp, entry);
-		hq->count -= 1;
-		if (TAILQ_EMPTY(&hq->q)) {
-			tree_xpop(&holdqs[evp->type], evp->holdq);
-			free(hq);
-		}
-		evp->holdq = 0;
-		stat_decrement("scheduler.ramqueue.hold", 1);
+	return (1);
+}
+
+static void
+rq_holdq_remove(struct rq_envelope *evp)
+{
+	struct rq_holdq	*hq;
+
+	hq = tree_xget(&holdqs[evp->type], evp->holdq);
+	TAILQ_REMOVE(&hq->q, evp, entry);
+	SPLAY_REMOVE(expiretree, &holdexpire, evp);
+	hq->count -= 1;
+	if (TAILQ_EMPTY(&hq->q)) {
+		tree_xpop(&holdqs[evp->type], evp->holdq);
+		free(hq);
+		stat_decrement("scheduler.ramqueue.holdq", 1);
 	}
-	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND)) {
-		TAILQ_REMOVE(&rq->q_pending, evp, entry);
-		SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+	evp->holdq = 0;
+	stat_decrement("scheduler.ramqueue.hold", 1);
+}
+
+static void
+rq_ready_insert(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_message	*msg = evp->message;
+
+	if (TAILQ_EMPTY(&msg->q_ready[evp->type]))
+		TAILQ_INSERT_TAIL(&rq->q_ready[evp->type], msg,
+		    r_entry[evp->type]);
+	TAILQ_INSERT_TAIL(&msg->q_ready[evp->type], evp, entry);
+}
+
+static void
+rq_ready_remove(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_message	*msg = evp->message;
+
+	TAILQ_REMOVE(&msg->q_ready[evp->type], evp, entry);
+	if (TAILQ_EMPTY(&msg->q_ready[evp->type])) {
+		if (TAILQ_FIRST(&rq->q_ready[evp->type]) == msg)
+			rq->r_served[evp->type] = 0;
+		TAILQ_REMOVE(&rq->q_ready[evp->type], msg,
+		    r_entry[evp->type]);
 	}
+}
 
-	TAILQ_INSERT_TAIL(q, evp, entry);
-	evp->state = RQ_EVPSTATE_SCHEDULED;
-	evp->t_scheduled = currtime;
+/*
+ * Take the next envelope of the given type, from the message at the head
+ * of the round-robin, which goes to the back once it has been served its
+ * quantum and still has more.
+ */
+static struct rq_envelope *
+rq_ready_next(struct rq_queue *rq, enum delivery_type type)
+{
+	struct rq_message	*msg;
+	struct rq_envelope	*evp;
+
+	if ((msg = TAILQ_FIRST(&rq->q_ready[type])) == NULL)
+		return (NULL);
+
+	evp = TAILQ_FIRST(&msg->q_ready[type]);
+	rq_ready_remove(rq, evp);
+	if (!TAILQ_EMPTY(&msg->q_ready[type]) &&
+	    ++rq->r_served[type] == RQ_READY_QUANTUM) {
+		rq->r_served[type] = 0;
+		TAILQ_REMOVE(&rq->q_ready[type], msg, r_entry[type]);
+		TAILQ_INSERT_TAIL(&rq->q_ready[type], msg, r_entry[type]);
+	}
+
+	return (evp);
 }
 
 static int
 rq_envelope_remove(struct rq_queue *rq, struct rq_envelope *evp)
 {
-	struct rq_holdq	*hq;
-	struct evplist	*evl;
-
 	if (evp->flags & (RQ_ENVELOPE_REMOVED | RQ_ENVELOPE_EXPIRED))
 		return (0);
 	/*
 	 * If envelope is inflight, mark it envelope for removal.
 	 */
 	if (evp->state == RQ_EVPSTATE_INFLIGHT) {
+		rq_domain_count(evp, -1);
 		evp->flags |= RQ_ENVELOPE_REMOVED;
 		return (1);
 	}
 
 	if (evp->state == RQ_EVPSTATE_HELD) {
-		hq = tree_xget(&holdqs[evp->type], evp->holdq);
-		TAILQ_REMOVE(&hq->q, evp, entry);
-		hq->count -= 1;
-		if (TAILQ_EMPTY(&hq->q)) {
-			tree_xpop(&holdqs[evp->type], evp->holdq);
-			free(hq);
-		}
-		evp->holdq = 0;
-		stat_decrement("scheduler.ramqueue.hold", 1);
+		rq_holdq_remove(evp);
 	}
 	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND)) {
-		evl = rq_envelope_list(rq, evp);
-		TAILQ_REMOVE(evl, evp, entry);
-		if (evl == &rq->q_pending)
-			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+		rq_envelope_unlink(rq, evp);
 	}
 
 	TAILQ_INSERT_TAIL(&rq->q_removed, evp, entry);
+	rq_domain_count(evp, -1);
 	evp->state = RQ_EVPSTATE_SCHEDULED;
 	evp->flags |= RQ_ENVELOPE_REMOVED;
 	evp->t_scheduled = currtime;
@@ -1034,32 +1578,20 @@ rq_envelope_remove(struct rq_queue *rq, struct rq_envelope *evp)
 static int
 rq_envelope_suspend(struct rq_queue *rq, struct rq_envelope *evp)
 {
-	struct rq_holdq	*hq;
-	struct evplist	*evl;
-
 	if (evp->flags & RQ_ENVELOPE_SUSPEND)
 		return (0);
 
+	rq_domain_count(evp, -1);
 	if (evp->state == RQ_EVPSTATE_HELD) {
-		hq = tree_xget(&holdqs[evp->type], evp->holdq);
-		TAILQ_REMOVE(&hq->q, evp, entry);
-		hq->count -= 1;
-		if (TAILQ_EMPTY(&hq->q)) {
-			tree_xpop(&holdqs[evp->type], evp->holdq);
-			free(hq);
-		}
-		evp->holdq = 0;
+		rq_holdq_remove(evp);
 		evp->state = RQ_EVPSTATE_PENDING;
-		stat_decrement("scheduler.ramqueue.hold", 1);
 	}
 	else if (evp->state != RQ_EVPSTATE_INFLIGHT) {
-		evl = rq_envelope_list(rq, evp);
-		TAILQ_REMOVE(evl, evp, entry);
-		if (evl == &rq->q_pending)
-			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+		rq_envelope_unlink(rq, evp);
 	}
 
 	evp->flags |= RQ_ENVELOPE_SUSPEND;
+	rq_domain_count(evp, 1);
 
 	return (1);
 }
@@ -1072,15 +1604,19 @@ rq_envelope_resume(struct rq_queue *rq, struct rq_envelope *evp)
 	if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
 		return (0);
 
+	rq_domain_count(evp, -1);
 	if (evp->state != RQ_EVPSTATE_INFLIGHT) {
 		evl = rq_envelope_list(rq, evp);
 		if (evl == &rq->q_pending)
 			sorted_insert(rq, evp);
+		else if (evl == &evp->message->q_ready[evp->type])
+			rq_ready_insert(rq, evp);
 		else
 			TAILQ_INSERT_TAIL(evl, evp, entry);
 	}
 
 	evp->flags &= ~RQ_ENVELOPE_SUSPEND;
+	rq_domain_count(evp, 1);
 
 	return (1);
 }
@@ -1091,15 +1627,184 @@ rq_envelope_delete(struct rq_queue *rq, struct rq_envelope *evp)
 	tree_xpop(&evp->message->envelopes, evp->evpid);
 	if (tree_empty(&evp->message->envelopes)) {
 		tree_xpop(&rq->messages, evp->message->msgid);
-		free(evp->message);
+		rq_pool_put(&message_pool, evp->message);
 		stat_decrement("scheduler.ramqueue.message", 1);
 	}
 
-	free(evp);
+	/* envelopes of an update were never linked */
+	if (rq == &ramqueue)
+		rq_domain_unlink(evp);
+	rq_domain_put(evp->domain);
+
+	rq_pool_put(&envelope_pool, evp);
 	rq->evpcount--;
 	stat_decrement("scheduler.ramqueue.envelope", 1);
 }
 
+static void
+rq_envelope_state(struct rq_envelope *evp, uint8_t state)
+{
+	rq_domain_count(evp, -1);
+	evp->state = state;
+	rq_domain_count(evp, 1);
+}
+
+static struct rq_domain *
+rq_domain_get(const char *name)
+{
+	struct rq_domain	*d;
+	char			 buf[SMTPD_MAXDOMAINPARTSIZE];
+	size_t			 i;
+
+	for (i = 0; name[i] && i < sizeof(buf) - 1; i++)
+		buf[i] = tolower((unsigned char)name[i]);
+	buf[i] = '\0';
+
+	if ((d = dict_get(&domains, buf)) == NULL) {
+		d = xcalloc(1, sizeof *d);
+		(void)strlcpy(d->name, buf, sizeof d->name);
+		SPLAY_INIT(&d->q_pending);
+		SPLAY_INIT(&d->q_age);
+		dict_xset(&domains, d->name, d);
+		stat_increment("scheduler.ramqueue.domain", 1);
+	}
+	d->refs++;
+
+	return (d);
+}
+
+static void
+rq_domain_put(struct rq_domain *d)
+{
+	if (--d->refs)
+		return;
+
+	dict_xpop(&domains, d->name);
+	free(d);
+	stat_decrement("scheduler.ramqueue.domain", 1);
+}
+
+/* the envelope is now part of the queue */
+static void
+rq_domain_link(struct rq_envelope *evp)
+{
+	struct rq_domain	*d = evp->domain;
+
+	SPLAY_INSERT(agetree, &d->q_age, evp);
+	if (d->oldest == NULL || rq_envelope_age_cmp(evp, d->oldest) < 0)
+		d->oldest = evp;
+	rq_domain_count(evp, 1);
+}
+
+static void
+rq_domain_unlink(struct rq_envelope *evp)
+{
+	struct rq_domain	*d = evp->domain;
+
+	rq_domain_count(evp, -1);
+	SPLAY_REMOVE(agetree, &d->q_age, evp);
+	if (d->oldest == evp)
+		d->oldest = SPLAY_MIN(agetree, &d->q_age);
+}
+
+/*
+ * Add or take back the envelope from the counters of its domain and
+ * of the queue, according to its current state.  Envelopes about to be
+ * removed or expired are not counted, as in "smtpctl show queue".
+ */
+static void
+rq_domain_count(struct rq_envelope *evp, int n)
+{
+	struct queue_count	*c[2];
+	size_t			 i;
+
+	if (evp->flags & (RQ_ENVELOPE_REMOVED | RQ_ENVELOPE_EXPIRED))
+		return;
+
+	c[0] = &evp->domain->count;
+	c[1] = &totals;
+	for (i = 0; i < nitems(c); i++) {
+		c[i]->total += n;
+		if (evp->flags & RQ_ENVELOPE_SUSPEND)
+			c[i]->suspended += n;
+		if (evp->state == RQ_EVPSTATE_INFLIGHT)
+			c[i]->inflight += n;
+		else if (evp->state == RQ_EVPSTATE_HELD)
+			c[i]->held += n;
+		else
+			c[i]->pending += n;
+	}
+}
+
+static void
+rq_pool_init(struct rq_pool *pool, const char *stat, size_t size)
+{
+	pool->stat = stat;
+	pool->objsize = size;
+	pool->itemsize = offsetof(struct rq_item, next) + size;
+	pool->itemsize = (pool->itemsize + sizeof(void *) - 1) &
+	    ~(sizeof(void *) - 1);
+	pool->nitems = (RQ_SLAB_SIZE - sizeof(struct rq_slab)) / pool->itemsize;
+	TAILQ_INIT(&pool->partial);
+}
+
+static void *
+rq_pool_get(struct rq_pool *pool)
+{
+	struct rq_slab	*slab;
+	struct rq_item	*item;
+	char		*p;
+	size_t		 i;
+
+	if ((slab = TAILQ_FIRST(&pool->partial)) == NULL) {
+		slab = xmalloc(RQ_SLAB_SIZE);
+		slab->free = NULL;
+		slab->used = 0;
+		p = (char *)(slab + 1);
+		for (i = 0; i < pool->nitems; i++) {
+			item = (struct rq_item *)(p + i * pool->itemsize);
+			item->slab = slab;
+			item->next = slab->free;
+			slab->free = item;
+		}
+		TAILQ_INSERT_HEAD(&pool->partial, slab, entry);
+		stat_increment(pool->stat, RQ_SLAB_SIZE);
+	}
+
+	item = slab->free;
+	slab->free = item->next;
+	if (slab->free == NULL)
+		TAILQ_REMOVE(&pool->partial, slab, entry);
+	slab->used++;
+
+	memset(&item->next, 0, pool->objsize);
+	return (&item->next);
+}
+
+static void
+rq_pool_put(struct rq_pool *pool, void *obj)
+{
+	struct rq_slab	*slab;
+	struct rq_item	*item;
+
+	item = (struct rq_item *)((char *)obj - offsetof(struct rq_item, next));
+	slab = item->slab;
+
+	if (slab->free == NULL)
+		TAILQ_INSERT_TAIL(&pool->partial, slab, entry);
+	item->next = slab->free;
+	slab->free = item;
+	slab->used--;
+
+	/* release empty slabs, but keep one around to avoid thrashing */
+	if (slab->used == 0 && (TAILQ_FIRST(&pool->partial) != slab ||
+	    TAILQ_NEXT(slab, entry) != NULL)) {
+		TAILQ_REMOVE(&pool->partial, slab, entry);
+		free(slab);
+		stat_decrement(pool->stat, RQ_SLAB_SIZE);
+	}
+}
+
 static const char *
 rq_envelope_to_text(struct rq_envelope *e)
 {
@@ -1198,4 +1903,31 @@ rq_envelope_cmp(struct rq_envelope *e1, struct rq_envelope *e2)
 	return 0;
 }
 
+static int
+rq_envelope_age_cmp(struct rq_envelope *e1, struct rq_envelope *e2)
+{
+	if (e1->ctime != e2->ctime)
+		return (e1->ctime < e2->ctime) ? -1 : 1;
+
+	if (e1->evpid != e2->evpid)
+		return (e1->evpid < e2->evpid) ? -1 : 1;
+
+	return 0;
+}
+
+static int
+rq_envelope_expire_cmp(struct rq_envelope *e1, struct rq_envelope *e2)
+{
+	if (e1->expire != e2->expire)
+		return (e1->expire < e2->expire) ? -1 : 1;
+
+	if (e1->evpid != e2->evpid)
+		return (e1->evpid < e2->evpid) ? -1 : 1;
+
+	return 0;
+}
+
 SPLAY_GENERATE(prioqtree, rq_envelope, t_entry, rq_envelope_cmp);
+SPLAY_GENERATE(domaintree, rq_envelope, d_entry, rq_envelope_cmp);
+SPLAY_GENERATE(agetree, rq_envelope, a_entry, rq_envelope_age_cmp);
+SPLAY_GENERATE(expiretree, rq_envelope, t_entry, rq_envelope_expire_cmp);
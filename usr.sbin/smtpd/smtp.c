@@ -25,6 +25,9 @@
 #include <sys/tree.h>
 #include <sys/socket.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #include <errno.h>
 #include <event.h>
 #include <grp.h> /* needed for setgroups */
@@ -35,9 +38,13 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <tls.h>
 #include <unistd.h>
 
+#include <openssl/sha.h>
+
 #include "smtpd.h"
 #include "log.h"
 #include "ssl.h"
@@ -49,18 +56,29 @@ static void smtp_accept(int, short, void *);
 static void smtp_dropped(struct listener *, int, const struct sockaddr_storage *);
 static int smtp_enqueue(void);
 static int smtp_can_accept(void);
+static int smtp_reap(void);
+static void smtp_reap_timeout(int, short, void *);
+static void smtp_occupancy_stat(void);
+static void smtp_accept_resume(void);
+static void smtp_pregreet(struct listener *, int, const struct sockaddr_storage *);
+static void smtp_pregreet_cb(int, short, void *);
+static void smtp_pregreet_reject(struct listener *, int);
+static int smtp_verdict_get(const struct sockaddr_storage *);
+static void smtp_verdict_set(const struct sockaddr_storage *, int);
 static void smtp_setup_listeners(void);
-static void smtp_setup_listener_tls(struct listener *);
 
 int
 proxy_session(struct listener *listener, int sock,
     const struct sockaddr_storage *ss,
     void (*accepted)(struct listener *, int,
-	const struct sockaddr_storage *, struct io *),
+	const struct sockaddr_storage *, struct io *,
+	const struct proxy_info *),
     void (*dropped)(struct listener *, int,
 	const struct sockaddr_storage *));
 
-static void smtp_accepted(struct listener *, int, const struct sockaddr_storage *, struct io *);
+static void smtp_accepted(struct listener *, int, const struct sockaddr_storage *, struct io *,
+    const struct proxy_info *);
+static void smtp_defer_accept(struct listener *);
 
 /*
  * This function are not publicy exported because it is a hack until libtls
@@ -69,13 +87,103 @@ static void smtp_accepted(struct listener *, int, const struct sockaddr_storage
 void tls_config_use_fake_private_key(struct tls_config *config);
 
 #define	SMTP_FD_RESERVE	5
+#define	SMTP_ACCEPT_MAX	64
+#define	SMTP_DEFER_ACCEPT	30	/* seconds */
+#define	SMTP_DRAIN_CHECK	1	/* seconds */
+
+/*
+ * On listeners with a pregreet delay, clients must wait that long for
+ * the greeting before a session is set up.  Those talking first are
+ * disconnected, and both outcomes are remembered per source address:
+ * clients that passed go straight to a session, those that failed are
+ * turned away at once until the verdict expires.
+ */
+#define	SMTP_VERDICT_MAX	4096
+#define	SMTP_VERDICT_PASS_TTL	3600
+#define	SMTP_VERDICT_FAIL_TTL	300
+
+/*
+ * With connection limits configured, sessions are counted per source
+ * address and per network, and connections beyond the maxima or above
+ * the connection rate of their source are turned away as they are
+ * accepted, before any session, pregreet or DNS work.  Only sources
+ * with sessions open have a counter.
+ */
+#define	SMTP_CONN_LIMITED() \
+	(env->sc_conn_max_src || env->sc_conn_max_net || env->sc_conn_rate)
+
+struct smtp_conncount {
+	char				*key;
+	size_t				 count;
+};
+
+struct smtp_pregreet {
+	struct listener		*listener;
+	struct sockaddr_storage	 ss;
+	struct event		 ev;
+};
+
+struct smtp_verdict {
+	TAILQ_ENTRY(smtp_verdict)	 entry;
+	char				*key;
+	time_t				 expire;
+	int				 pass;
+};
+
+/*
+ * On reload, the listening sockets are passed from one generation to
+ * the next, so that connections wait in the backlog instead of being
+ * refused.  The new dispatcher gets them at setup and binds only the
+ * listeners not found among them.
+ */
+struct smtp_inherited {
+	TAILQ_ENTRY(smtp_inherited)	 entry;
+	struct sockaddr_storage		 ss;
+	int				 fd;
+};
 
 static size_t	sessions;
 static size_t	maxsessions;
+static size_t	pregreets;
+
+static struct dict	smtp_verdicts;
+static TAILQ_HEAD(smtp_verdict_lru, smtp_verdict) smtp_verdict_lru;
+
+static struct hdict	smtp_conncounts;
+static struct limit    *smtp_connrate;
+
+static TAILQ_HEAD(, smtp_inherited) smtp_inherited =
+    TAILQ_HEAD_INITIALIZER(smtp_inherited);
+static int		smtp_reload_paused;
+static int		smtp_draining;
+static struct event	smtp_drain_ev;
+static struct event	smtp_reap_ev;
+
+static uint8_t		*smtp_default_ca;
+static size_t		 smtp_default_ca_len;
+
+static void smtp_verdict_remove(struct smtp_verdict *);
+static const char *smtp_conn_netkey(const struct sockaddr_storage *);
+static int smtp_conn_admit(const struct sockaddr_storage *);
+static void smtp_conn_release(const struct sockaddr_storage *);
+static void smtp_conn_count(const char *, int);
+static void smtp_proxied(struct listener *, int, const struct sockaddr_storage *,
+    struct io *, const struct proxy_info *);
+static void smtp_send_unavailable(struct listener *, int);
+static int smtp_listener_adopt(struct listener *);
+static int smtp_ss_match(const struct sockaddr_storage *,
+    const struct sockaddr_storage *);
+static void smtp_reload_export(struct mproc *);
+static void smtp_drain(int, short, void *);
 
 void
 smtp_imsg(struct mproc *p, struct imsg *imsg)
 {
+	struct listener	*l;
+	struct msg	 m;
+	const char	*name;
+	uint32_t	 phases;
+
 	switch (imsg->hdr.type) {
 	case IMSG_SMTP_CHECK_SENDER:
 	case IMSG_SMTP_EXPAND_RCPT:
@@ -89,8 +197,12 @@ smtp_imsg(struct mproc *p, struct imsg *imsg)
 	case IMSG_SMTP_MESSAGE_COMMIT:
 	case IMSG_SMTP_MESSAGE_CREATE:
 	case IMSG_SMTP_MESSAGE_OPEN:
+	case IMSG_CA_DKIM_SIGN:
 	case IMSG_QUEUE_ENVELOPE_SUBMIT:
 	case IMSG_QUEUE_ENVELOPE_COMMIT:
+	case IMSG_QUEUE_PRESSURE:
+	case IMSG_TLS_READY:
+	case IMSG_TLS_FAIL:
 		smtp_session_imsg(p, imsg);
 		return;
 
@@ -104,6 +216,22 @@ smtp_imsg(struct mproc *p, struct imsg *imsg)
 		    smtp_enqueue(), NULL, 0);
 		return;
 
+	case IMSG_SMTP_LOOKUP_PKI:
+	case IMSG_CA_LOAD_PKI:
+		smtp_sni_imsg(p, imsg);
+		return;
+
+	case IMSG_FILTER_SMTP_PHASES:
+		m_msg(&m, imsg);
+		m_get_string(&m, &name);
+		m_get_u32(&m, &phases);
+		m_end(&m);
+
+		TAILQ_FOREACH(l, env->sc_listeners, entry)
+			if (strcmp(l->filter_name, name) == 0)
+				l->filter_skip = ~phases;
+		return;
+
 	case IMSG_CTL_PAUSE_SMTP:
 		log_debug("debug: smtp: pausing listening sockets");
 		smtp_pause();
@@ -115,6 +243,35 @@ smtp_imsg(struct mproc *p, struct imsg *imsg)
 		env->sc_flags &= ~SMTPD_SMTP_PAUSED;
 		smtp_resume();
 		return;
+
+	case IMSG_RELOAD_LISTENER:
+		smtp_reload_export(p);
+		return;
+
+	case IMSG_RELOAD_ABORT:
+		log_debug("debug: smtp: reload aborted");
+		if (smtp_reload_paused) {
+			smtp_reload_paused = 0;
+			env->sc_flags &= ~SMTPD_SMTP_PAUSED;
+			smtp_resume();
+		}
+		return;
+
+	case IMSG_RELOAD_DRAIN:
+		/* the new generation accepts, finish the sessions */
+		log_info("info: smtp: handed listeners over, draining "
+		    "%zu sessions", sessions + pregreets);
+		smtp_draining = 1;
+		TAILQ_FOREACH(l, env->sc_listeners, entry) {
+			if (l->fd == -1)
+				continue;
+			event_del(&l->ev);
+			close(l->fd);
+			l->fd = -1;
+		}
+		evtimer_set(&smtp_drain_ev, smtp_drain, NULL);
+		smtp_drain(-1, 0, NULL);
+		return;
 	}
 
 	fatalx("smtp_imsg: unexpected %s imsg", imsg_to_str(imsg->hdr.type));
@@ -141,9 +298,20 @@ static void
 smtp_setup_listeners(void)
 {
 	struct listener	       *l;
+	struct smtp_inherited  *i;
 	int			opt;
 
+	/* the smtp workers listen, the dispatcher only has local sessions */
+	if (smtpd_process == PROC_DISPATCHER && env->sc_smtp_workers)
+		return;
+
 	TAILQ_FOREACH(l, env->sc_listeners, entry) {
+		if (smtp_listener_adopt(l)) {
+			if (l->flags & F_SSL)
+				smtp_setup_listener_tls(l);
+			continue;
+		}
+
 		if ((l->fd = socket(l->ss.ss_family, SOCK_STREAM, 0)) == -1) {
 			if (errno == EAFNOSUPPORT) {
 				log_warn("smtpd: socket");
@@ -165,6 +333,13 @@ smtp_setup_listeners(void)
 			sizeof(opt)) < 0)
 			fatal("smtpd: setsockopt");
 #endif
+#ifdef SO_REUSEPORT
+		/* each smtp worker binds its own socket to the address */
+		if (env->sc_smtp_workers &&
+		    setsockopt(l->fd, SOL_SOCKET, SO_REUSEPORT, &opt,
+		    sizeof(opt)) == -1)
+			fatal("smtpd: setsockopt");
+#endif
 #ifdef IPV6_V6ONLY
 		/*
 		 * If using IPv6, bind only to IPv6 if possible.
@@ -178,18 +353,147 @@ smtp_setup_listeners(void)
 		if (bind(l->fd, (struct sockaddr *)&l->ss, SS_LEN(&l->ss)) == -1)
 			fatal("smtpd: bind");
 	}
+
+	/* the listeners dropped from the configuration */
+	while ((i = TAILQ_FIRST(&smtp_inherited))) {
+		TAILQ_REMOVE(&smtp_inherited, i, entry);
+		log_info("info: smtp: closing listener on %s",
+		    ss_to_text(&i->ss));
+		close(i->fd);
+		free(i);
+	}
 }
 
+void
+smtp_takeover_listener(int fd, const struct sockaddr_storage *ss)
+{
+	struct smtp_inherited	*i;
+
+	i = xcalloc(1, sizeof(*i));
+	i->ss = *ss;
+	i->fd = fd;
+	TAILQ_INSERT_TAIL(&smtp_inherited, i, entry);
+}
+
+static int
+smtp_listener_adopt(struct listener *l)
+{
+	struct smtp_inherited	*i;
+	int			 opt;
+
+	TAILQ_FOREACH(i, &smtp_inherited, entry)
+		if (smtp_ss_match(&i->ss, &l->ss))
+			break;
+	if (i == NULL)
+		return 0;
+
+	TAILQ_REMOVE(&smtp_inherited, i, entry);
+	l->fd = i->fd;
+	free(i);
+
+	log_debug("debug: smtp: took over listener on %s port %d",
+	    ss_to_text(&l->ss), ntohs(l->port));
+
+#if defined(TCP_DEFER_ACCEPT)
+	/* set again in smtp_setup_events() if this listener wants it */
+	opt = 0;
+	if (l->ss.ss_family != AF_LOCAL)
+		(void)setsockopt(l->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt,
+		    sizeof(opt));
+#else
+	(void)opt;
+#endif
+	return 1;
+}
+
+static int
+smtp_ss_match(const struct sockaddr_storage *a,
+    const struct sockaddr_storage *b)
+{
+	const struct sockaddr_in	*a4, *b4;
+	const struct sockaddr_in6	*a6, *b6;
+
+	if (a->ss_family != b->ss_family)
+		return 0;
+
+	switch (a->ss_family) {
+	case AF_INET:
+		a4 = (const struct sockaddr_in *)a;
+		b4 = (const struct sockaddr_in *)b;
+		return (a4->sin_port == b4->sin_port &&
+		    a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+	case AF_INET6:
+		a6 = (const struct sockaddr_in6 *)a;
+		b6 = (const struct sockaddr_in6 *)b;
+		return (a6->sin6_port == b6->sin6_port &&
+		    a6->sin6_scope_id == b6->sin6_scope_id &&
+		    memcmp(&a6->sin6_addr, &b6->sin6_addr,
+		    sizeof(a6->sin6_addr)) == 0);
+	default:
+		return (SS_LEN(a) == SS_LEN(b) &&
+		    memcmp(a, b, SS_LEN(a)) == 0);
+	}
+}
+
+/*
+ * Stop accepting and pass the listening sockets to the parent for the
+ * next generation, the connections wait in the backlog meanwhile.
+ */
 static void
-smtp_setup_listener_tls(struct listener *l)
+smtp_reload_export(struct mproc *p)
+{
+	struct listener	*l;
+	int		 fd;
+
+	if (!(env->sc_flags & SMTPD_SMTP_PAUSED)) {
+		smtp_pause();
+		env->sc_flags |= SMTPD_SMTP_PAUSED;
+		smtp_reload_paused = 1;
+	}
+
+	TAILQ_FOREACH(l, env->sc_listeners, entry) {
+		if (l->fd == -1)
+			continue;
+		if ((fd = dup(l->fd)) == -1) {
+			log_warn("warn: smtp: dup");
+			continue;
+		}
+		m_compose(p, IMSG_RELOAD_LISTENER, 0, 0, fd,
+		    &l->ss, sizeof(l->ss));
+	}
+	m_compose(p, IMSG_RELOAD_LISTENER, 0, 0, -1, NULL, 0);
+}
+
+static void
+smtp_drain(int fd, short event, void *p)
+{
+	struct timeval	tv;
+
+	if (sessions + pregreets == 0) {
+		log_info("info: smtp: sessions drained");
+		m_compose(p_parent, IMSG_RELOAD_DRAIN, 0, 0, -1, NULL, 0);
+		return;
+	}
+
+	tv.tv_sec = SMTP_DRAIN_CHECK;
+	tv.tv_usec = 0;
+	evtimer_add(&smtp_drain_ev, &tv);
+}
+
+/*
+ * The settings of the server contexts of a listener, without the
+ * keypairs.
+ */
+struct tls_config *
+smtp_tls_config(struct listener *l)
 {
 	static const char *dheparams[] = { "none", "auto", "legacy" };
 	struct tls_config *config;
 	const char *ciphers;
 	uint32_t protos;
-	struct pki *pki;
 	struct ca *ca;
-	int i;
+	char buf[PATH_MAX * 2 + 64];
+	unsigned char sid[SHA256_DIGEST_LENGTH];
 
 	if ((config = tls_config_new()) == NULL)
 		fatal("smtpd: tls_config_new");
@@ -208,15 +512,81 @@ smtp_setup_listener_tls(struct listener *l)
 			fatalx("%s", tls_config_error(config));
 	}
 
+	if (tls_config_set_dheparams(config, dheparams[l->pki_dhe]) == -1)
+		fatalx("tls_config_set_dheparams: %s",
+		    tls_config_error(config));
+
+	tls_config_use_fake_private_key(config);
+
+	if (l->ca_name[0]) {
+		ca = dict_get(env->sc_ca_dict, l->ca_name);
+		if (tls_config_set_ca_mem(config, ca->ca_cert, ca->ca_cert_len)
+		    == -1)
+			fatalx("tls_config_set_ca_mem: %s",
+			    tls_config_error(config));
+	}
+	else if (smtp_default_ca) {
+		if (tls_config_set_ca_mem(config, smtp_default_ca,
+		    smtp_default_ca_len) == -1)
+			fatalx("tls_config_set_ca_mem: %s",
+			    tls_config_error(config));
+	}
+	else if (tls_config_set_ca_file(config, tls_default_ca_cert_file())
+	    == -1)
+		fatal("tls_config_set_ca_file");
+
+	if (l->flags & F_TLS_VERIFY)
+		tls_config_verify_client(config);
+
+	/*
+	 * Hand out session tickets so that returning clients resume
+	 * their session instead of going through a full handshake,
+	 * and the private key operation in the ca process it implies.
+	 */
+	if (tls_config_set_session_lifetime(config,
+	    SMTPD_TLS_SESSION_LIFETIME) == -1)
+		fatalx("tls_config_set_session_lifetime: %s",
+		    tls_config_error(config));
+
+	/*
+	 * A session only resumes in the same session id context, which
+	 * libtls makes up for each config.  Derive it from the listener
+	 * instead, so that it is the same in all the tls workers.
+	 */
+	(void)snprintf(buf, sizeof(buf), "%s:%d:%s:%s:%x",
+	    ss_to_text(&l->ss), ntohs(l->port), l->pki_name, l->ca_name,
+	    l->flags);
+	SHA256((unsigned char *)buf, strlen(buf), sid);
+	if (tls_config_set_session_id(config, sid, sizeof(sid)) == -1)
+		fatalx("tls_config_set_session_id: %s",
+		    tls_config_error(config));
+
+	return (config);
+}
+
+void
+smtp_setup_listener_tls(struct listener *l)
+{
+	struct tls_config *config;
+	struct pki *pki;
+	int i;
+
 	pki = l->pki[0];
 	if (pki == NULL)
 		fatal("no pki defined");
+	l->pki_dhe = pki->pki_dhe;
 
-	if (tls_config_set_dheparams(config, dheparams[pki->pki_dhe]) == -1)
-		fatalx("tls_config_set_dheparams: %s",
-		    tls_config_error(config));
+	/*
+	 * Certificates of the pki table are set up after the chroot,
+	 * keep the default CA around for them.
+	 */
+	if (l->pkitable[0] && l->ca_name[0] == '\0' &&
+	    smtp_default_ca == NULL &&
+	    (smtp_default_ca = tls_load_file(tls_default_ca_cert_file(),
+	    &smtp_default_ca_len, NULL)) == NULL)
+		fatal("tls_load_file");
 
-	tls_config_use_fake_private_key(config);
+	config = smtp_tls_config(l);
 	for (i = 0; i < l->pkicount; i++) {
 		pki = l->pki[i];
 		if (i == 0) {
@@ -230,23 +600,17 @@ smtp_setup_listener_tls(struct listener *l)
 				fatalx("tls_config_add_keypair_mem: %s",
 				    tls_config_error(config));
 		}
+		if (pki->pki_alt && tls_config_add_keypair_alt_mem(config,
+		    pki->pki_alt->pki_cert, pki->pki_alt->pki_cert_len,
+		    NULL, 0) == -1)
+			fatalx("tls_config_add_keypair_alt_mem: %s",
+			    tls_config_error(config));
 	}
 	free(l->pki);
 	l->pkicount = 0;
 
-	if (l->ca_name[0]) {
-		ca = dict_get(env->sc_ca_dict, l->ca_name);
-		if (tls_config_set_ca_mem(config, ca->ca_cert, ca->ca_cert_len)
-		    == -1)
-			fatalx("tls_config_set_ca_mem: %s",
-			    tls_config_error(config));
-	}
-	else if (tls_config_set_ca_file(config, tls_default_ca_cert_file())
-	    == -1)
-		fatal("tls_config_set_ca_file");
-
-	if (l->flags & F_TLS_VERIFY)
-		tls_config_verify_client(config);
+	if (l->pkitable[0])
+		smtp_sni_setup(l, config);
 
 	l->tls = tls_server();
 	if (l->tls == NULL)
@@ -254,7 +618,7 @@ smtp_setup_listener_tls(struct listener *l)
 	if (tls_configure(l->tls, config) == -1) {
 		fatalx("tls_configure: %s", tls_error(l->tls));
 	}
-	tls_config_free(config);
+	l->tls_config = config;
 }
 
 
@@ -263,13 +627,26 @@ smtp_setup_events(void)
 {
 	struct listener *l;
 
+	dict_init(&smtp_verdicts);
+	TAILQ_INIT(&smtp_verdict_lru);
+	smtp_sni_init();
+	hdict_init(&smtp_conncounts);
+	evtimer_set(&smtp_reap_ev, smtp_reap_timeout, NULL);
+	if (env->sc_conn_rate)
+		smtp_connrate = limit_new(LIMIT_KEY_SRC, env->sc_conn_rate, 60);
+
 	TAILQ_FOREACH(l, env->sc_listeners, entry) {
+		if (l->fd == -1)
+			continue;
 		log_debug("debug: smtp: listen on %s port %d flags 0x%01x",
 		    ss_to_text(&l->ss), ntohs(l->port), l->flags);
 
 		io_set_nonblocking(l->fd);
 		if (listen(l->fd, SMTPD_BACKLOG) == -1)
 			fatal("listen");
+		if (l->flags & (F_SMTPS|F_PROXY) &&
+		    l->ss.ss_family != AF_LOCAL)
+			smtp_defer_accept(l);
 		event_set(&l->ev, l->fd, EV_READ|EV_PERSIST, smtp_accept, l);
 
 		if (!(env->sc_flags & SMTPD_SMTP_PAUSED))
@@ -291,7 +668,8 @@ smtp_pause(void)
 		return;
 
 	TAILQ_FOREACH(l, env->sc_listeners, entry)
-		event_del(&l->ev);
+		if (l->fd != -1)
+			event_del(&l->ev);
 }
 
 static void
@@ -301,9 +679,12 @@ smtp_resume(void)
 
 	if (env->sc_flags & (SMTPD_SMTP_DISABLED|SMTPD_SMTP_PAUSED))
 		return;
+	if (smtp_draining)
+		return;
 
 	TAILQ_FOREACH(l, env->sc_listeners, entry)
-		event_add(&l->ev, NULL);
+		if (l->fd != -1)
+			event_add(&l->ev, NULL);
 }
 
 static int
@@ -323,7 +704,7 @@ smtp_enqueue(void)
 	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, fd))
 		return (-1);
 
-	if ((smtp_session(listener, fd[0], &listener->ss, env->sc_hostname, NULL)) == -1) {
+	if ((smtp_session(listener, fd[0], &listener->ss, env->sc_hostname, NULL, NULL)) == -1) {
 		close(fd[0]);
 		close(fd[1]);
 		return (-1);
@@ -341,89 +722,249 @@ smtp_accept(int fd, short event, void *p)
 {
 	struct listener		*listener = p;
 	struct sockaddr_storage	 ss;
+	struct timeval		 tv;
 	socklen_t		 len;
-	int			 sock;
+	int			 sock, n;
 
 	if (env->sc_flags & SMTPD_SMTP_PAUSED)
 		fatalx("smtp_session: unexpected client");
 
-	if (!smtp_can_accept()) {
-		log_warnx("warn: Disabling incoming SMTP connections: "
-		    "Client limit reached");
-		goto pause;
-	}
-
-	len = sizeof(ss);
-	if ((sock = accept(fd, (struct sockaddr *)&ss, &len)) == -1) {
-		if (errno == ENFILE || errno == EMFILE) {
-			log_warn("warn: Disabling incoming SMTP connections");
+	/*
+	 * Drain pending connections, up to a limit so that a connection
+	 * storm on one listener does not starve the existing sessions.
+	 */
+	for (n = 0; n < SMTP_ACCEPT_MAX; n++) {
+		if (!smtp_can_accept() && !smtp_reap()) {
+			log_warnx("warn: Disabling incoming SMTP connections: "
+			    "%s limit reached", memory_level() >= MEMORY_PAUSE ?
+			    "Memory" : "Client");
 			goto pause;
 		}
-		if (errno == EINTR || errno == EWOULDBLOCK ||
-		    errno == ECONNABORTED)
-			return;
-		fatal("smtp_accept");
-	}
 
-	if (listener->flags & F_PROXY) {
-		io_set_nonblocking(sock);
-		if (proxy_session(listener, sock, &ss,
-			smtp_accepted, smtp_dropped) == -1) {
+		len = sizeof(ss);
+#ifdef HAVE_ACCEPT4
+		sock = accept4(fd, (struct sockaddr *)&ss, &len, SOCK_NONBLOCK);
+#else
+		sock = accept(fd, (struct sockaddr *)&ss, &len);
+#endif
+		if (sock == -1) {
+			if (errno == ENFILE || errno == EMFILE) {
+				log_warn("warn: Disabling incoming SMTP "
+				    "connections");
+				goto pause;
+			}
+			if (errno == EINTR || errno == EWOULDBLOCK ||
+			    errno == ECONNABORTED)
+				return;
+			fatal("smtp_accept");
+		}
+
+		if (listener->flags & F_PROXY) {
+#ifndef HAVE_ACCEPT4
+			io_set_nonblocking(sock);
+#endif
+			if (proxy_session(listener, sock, &ss,
+				smtp_proxied, smtp_dropped) == -1)
+				close(sock);
+			continue;
+		}
+
+		if (!smtp_conn_admit(&ss)) {
+			if (!env->sc_conn_drop)
+				smtp_send_unavailable(listener, sock);
 			close(sock);
-			return;
+			continue;
 		}
-		return;
-	}
 
-	smtp_accepted(listener, sock, &ss, NULL);
+		if (listener->pregreet) {
+			smtp_pregreet(listener, sock, &ss);
+			continue;
+		}
+
+		smtp_accepted(listener, sock, &ss, NULL, NULL);
+	}
 	return;
 
 pause:
 	smtp_pause();
 	env->sc_flags |= SMTPD_SMTP_DISABLED;
+	if (!evtimer_pending(&smtp_reap_ev, NULL)) {
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		evtimer_add(&smtp_reap_ev, &tv);
+	}
 	return;
 }
 
+/*
+ * On listeners where the client speaks first, with a TLS handshake or
+ * a proxy header, have the kernel hold new connections until there is
+ * something to read, so that clients opening connections and sending
+ * nothing never wake us up.  This can't be done for plain SMTP, where
+ * the client waits for the greeting.
+ */
+static void
+smtp_defer_accept(struct listener *l)
+{
+#if defined(TCP_DEFER_ACCEPT)
+	int	timeout = SMTP_DEFER_ACCEPT;
+
+	if (setsockopt(l->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout,
+	    sizeof(timeout)) == -1)
+		log_warn("warn: smtp: setsockopt TCP_DEFER_ACCEPT");
+#elif defined(SO_ACCEPTFILTER)
+	struct accept_filter_arg	afa;
+
+	/* fails when the accf_data module isn't loaded */
+	memset(&afa, 0, sizeof(afa));
+	(void)strlcpy(afa.af_name, "dataready", sizeof(afa.af_name));
+	if (setsockopt(l->fd, SOL_SOCKET, SO_ACCEPTFILTER, &afa,
+	    sizeof(afa)) == -1)
+		log_debug("debug: smtp: no dataready accept filter: %s",
+		    strerror(errno));
+#endif
+}
+
 static int
 smtp_can_accept(void)
 {
-	if (sessions + 1 == maxsessions)
+	if (memory_level() >= MEMORY_PAUSE)
+		return 0;
+	if (sessions + pregreets + 1 >= maxsessions)
 		return 0;
 	return (getdtablesize() - getdtablecount() - SMTP_FD_RESERVE >= 2);
 }
 
+/*
+ * At the cap, give the slot of the session idle the longest to the new
+ * connection rather than turning everyone away.  Freeing more sessions
+ * does not help under memory pressure.
+ */
+static int
+smtp_reap(void)
+{
+	if (memory_level() >= MEMORY_PAUSE)
+		return 0;
+	while (!smtp_can_accept())
+		if (!smtp_session_reap())
+			return 0;
+	return 1;
+}
+
+/*
+ * While disabled at the cap, the waiting connections are only seen
+ * again once a session goes away.  Check every second whether one can
+ * be reaped for them instead.
+ */
+static void
+smtp_reap_timeout(int fd, short event, void *p)
+{
+	struct timeval	tv;
+
+	if (!(env->sc_flags & SMTPD_SMTP_DISABLED))
+		return;
+
+	if (memory_level() < MEMORY_PAUSE && smtp_session_reapable()) {
+		log_debug("debug: smtp: idle sessions to reap, "
+		    "re-enabling incoming connections");
+		env->sc_flags &= ~SMTPD_SMTP_DISABLED;
+		smtp_resume();
+		return;
+	}
+
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	evtimer_add(&smtp_reap_ev, &tv);
+}
+
+/*
+ * Percentage of the session slots in use, which the session timeouts
+ * shrink with.
+ */
+int
+smtp_occupancy(void)
+{
+	size_t	n;
+
+	if (maxsessions == 0)
+		return 100;
+	n = (sessions + pregreets) * 100 / maxsessions;
+	return (n > 100 ? 100 : n);
+}
+
+static void
+smtp_occupancy_stat(void)
+{
+	static int	last = -1;
+	int		n;
+
+	if ((n = smtp_occupancy()) == last)
+		return;
+	stat_set("smtp.session.occupancy", stat_counter(n));
+	last = n;
+}
+
 void
-smtp_collect(void)
+smtp_collect(const struct sockaddr_storage *ss)
 {
+	smtp_conn_release(ss);
 	sessions--;
 	stat_decrement("smtp.session", 1);
+	smtp_occupancy_stat();
 
+	smtp_accept_resume();
+}
+
+static void
+smtp_accept_resume(void)
+{
 	if (!smtp_can_accept())
 		return;
 
 	if (env->sc_flags & SMTPD_SMTP_DISABLED) {
 		log_warnx("warn: smtp: "
-		    "fd exhaustion over, re-enabling incoming connections");
+		    "limit cleared, re-enabling incoming connections");
 		env->sc_flags &= ~SMTPD_SMTP_DISABLED;
 		smtp_resume();
 	}
 }
 
+void
+smtp_memory(enum memory_level level)
+{
+	if (level < MEMORY_PAUSE) {
+		smtp_accept_resume();
+		return;
+	}
+
+	if (!(env->sc_flags & SMTPD_SMTP_DISABLED)) {
+		log_warnx("warn: Disabling incoming SMTP connections: "
+		    "Memory limit reached");
+		smtp_pause();
+		env->sc_flags |= SMTPD_SMTP_DISABLED;
+	}
+}
+
 static void
-smtp_accepted(struct listener *listener, int sock, const struct sockaddr_storage *ss, struct io *io)
+smtp_accepted(struct listener *listener, int sock, const struct sockaddr_storage *ss, struct io *io,
+    const struct proxy_info *proxy)
 {
 	int     ret;
 
-	ret = smtp_session(listener, sock, ss, NULL, io);
+	ret = smtp_session(listener, sock, ss, NULL, io, proxy);
 	if (ret == -1) {
 		log_warn("warn: Failed to create SMTP session");
+		smtp_conn_release(ss);
 		close(sock);
 		return;
 	}
+#ifndef HAVE_ACCEPT4
 	io_set_nonblocking(sock);
+#endif
 
 	sessions++;
 	stat_increment("smtp.session", 1);
+	smtp_occupancy_stat();
 	if (listener->ss.ss_family == AF_LOCAL)
 		stat_increment("smtp.session.local", 1);
 	if (listener->ss.ss_family == AF_INET)
@@ -432,6 +973,252 @@ smtp_accepted(struct listener *listener, int sock, const struct sockaddr_storage
 		stat_increment("smtp.session.inet6", 1);
 }
 
+static void
+smtp_pregreet(struct listener *listener, int sock,
+    const struct sockaddr_storage *ss)
+{
+	struct smtp_pregreet	*pg;
+	struct timeval		 tv;
+
+	switch (smtp_verdict_get(ss)) {
+	case 1:
+		smtp_accepted(listener, sock, ss, NULL, NULL);
+		return;
+	case 0:
+		stat_increment("smtp.pregreet.rejected", 1);
+		smtp_conn_release(ss);
+		smtp_pregreet_reject(listener, sock);
+		return;
+	}
+
+	pg = xcalloc(1, sizeof(*pg));
+	pg->listener = listener;
+	pg->ss = *ss;
+	event_set(&pg->ev, sock, EV_READ, smtp_pregreet_cb, pg);
+	tv.tv_sec = listener->pregreet;
+	tv.tv_usec = 0;
+	event_add(&pg->ev, &tv);
+	pregreets++;
+}
+
+static void
+smtp_pregreet_cb(int fd, short event, void *p)
+{
+	struct smtp_pregreet	*pg = p;
+	char			 c;
+
+	pregreets--;
+
+	if (event & EV_TIMEOUT) {
+		stat_increment("smtp.pregreet.passed", 1);
+		smtp_verdict_set(&pg->ss, 1);
+		smtp_accepted(pg->listener, fd, &pg->ss, NULL, NULL);
+	}
+	else if (recv(fd, &c, 1, MSG_PEEK) > 0) {
+		log_info("info: smtp: %s talked before the greeting, "
+		    "disconnecting", ss_to_text(&pg->ss));
+		stat_increment("smtp.pregreet.rejected", 1);
+		smtp_verdict_set(&pg->ss, 0);
+		smtp_conn_release(&pg->ss);
+		smtp_pregreet_reject(pg->listener, fd);
+	}
+	else {
+		smtp_conn_release(&pg->ss);
+		close(fd);
+	}
+
+	free(pg);
+	smtp_accept_resume();
+}
+
+static void
+smtp_pregreet_reject(struct listener *listener, int sock)
+{
+	smtp_send_unavailable(listener, sock);
+	close(sock);
+}
+
+static void
+smtp_send_unavailable(struct listener *listener, int sock)
+{
+	char	buf[HOST_NAME_MAX + 64];
+	int	n;
+
+	n = snprintf(buf, sizeof(buf), "421 %s Service not available, "
+	    "closing transmission channel\r\n", listener->hostname);
+	if (n > 0 && (size_t)n < sizeof(buf))
+		(void)send(sock, buf, n, 0);
+}
+
+/*
+ * Proxied clients are only known once the proxy header is read, so
+ * their limits are checked then.
+ */
+static void
+smtp_proxied(struct listener *listener, int sock,
+    const struct sockaddr_storage *ss, struct io *io,
+    const struct proxy_info *proxy)
+{
+	if (!smtp_conn_admit(ss)) {
+		if (!env->sc_conn_drop)
+			smtp_send_unavailable(listener, sock);
+		io_free(io);
+		return;
+	}
+
+	smtp_accepted(listener, sock, ss, io, proxy);
+}
+
+static const char *
+smtp_conn_netkey(const struct sockaddr_storage *ss)
+{
+	static char		 buf[64];
+	struct sockaddr_storage	 net;
+	struct sockaddr_in	*sin = (struct sockaddr_in *)&net;
+	struct sockaddr_in6	*sin6 = (struct sockaddr_in6 *)&net;
+	int			 i, bits;
+
+	net = *ss;
+	if (net.ss_family == AF_INET) {
+		bits = env->sc_conn_net4_prefix;
+		if (bits < 32)
+			sin->sin_addr.s_addr &=
+			    htonl(0xffffffffU << (32 - bits));
+	}
+	else {
+		bits = env->sc_conn_net6_prefix;
+		for (i = 0; i < 16; i++, bits -= 8) {
+			if (bits >= 8)
+				continue;
+			sin6->sin6_addr.s6_addr[i] &=
+			    bits > 0 ? 0xff << (8 - bits) : 0;
+		}
+	}
+
+	(void)snprintf(buf, sizeof(buf), "net:%s", ss_to_text(&net));
+	return (buf);
+}
+
+static int
+smtp_conn_admit(const struct sockaddr_storage *ss)
+{
+	struct smtp_conncount	*c;
+	const char		*reason = NULL;
+	char			 src[64];
+
+	if (!SMTP_CONN_LIMITED())
+		return 1;
+	if (ss->ss_family != AF_INET && ss->ss_family != AF_INET6)
+		return 1;
+
+	(void)strlcpy(src, ss_to_text(ss), sizeof(src));
+	if (env->sc_conn_max_src &&
+	    (c = hdict_get(&smtp_conncounts, src)) &&
+	    c->count >= env->sc_conn_max_src)
+		reason = "too many connections";
+	else if (env->sc_conn_max_net &&
+	    (c = hdict_get(&smtp_conncounts, smtp_conn_netkey(ss))) &&
+	    c->count >= env->sc_conn_max_net)
+		reason = "too many connections from network";
+	else if (smtp_connrate && limit_hit(smtp_connrate, src))
+		reason = "connection rate exceeded";
+
+	if (reason) {
+		log_debug("debug: smtp: %s: %s, %s", src, reason,
+		    env->sc_conn_drop ? "dropping" : "rejecting");
+		stat_increment("smtp.conn.limited", 1);
+		return 0;
+	}
+
+	if (env->sc_conn_max_src)
+		smtp_conn_count(src, 1);
+	if (env->sc_conn_max_net)
+		smtp_conn_count(smtp_conn_netkey(ss), 1);
+	return 1;
+}
+
+static void
+smtp_conn_release(const struct sockaddr_storage *ss)
+{
+	if (!SMTP_CONN_LIMITED())
+		return;
+	if (ss->ss_family != AF_INET && ss->ss_family != AF_INET6)
+		return;
+
+	if (env->sc_conn_max_src)
+		smtp_conn_count(ss_to_text(ss), -1);
+	if (env->sc_conn_max_net)
+		smtp_conn_count(smtp_conn_netkey(ss), -1);
+}
+
+static void
+smtp_conn_count(const char *key, int n)
+{
+	struct smtp_conncount	*c;
+
+	if ((c = hdict_get(&smtp_conncounts, key)) == NULL) {
+		if (n < 0)
+			return;
+		c = xcalloc(1, sizeof(*c));
+		c->key = xstrdup(key);
+		hdict_xset(&smtp_conncounts, c->key, c);
+	}
+
+	if (n > 0)
+		c->count++;
+	else if (--c->count == 0) {
+		hdict_xpop(&smtp_conncounts, c->key);
+		free(c->key);
+		free(c);
+	}
+}
+
+static int
+smtp_verdict_get(const struct sockaddr_storage *ss)
+{
+	struct smtp_verdict	*v;
+
+	if ((v = dict_get(&smtp_verdicts, ss_to_text(ss))) == NULL)
+		return -1;
+	if (v->expire <= time(NULL)) {
+		smtp_verdict_remove(v);
+		return -1;
+	}
+	TAILQ_REMOVE(&smtp_verdict_lru, v, entry);
+	TAILQ_INSERT_HEAD(&smtp_verdict_lru, v, entry);
+	return v->pass;
+}
+
+static void
+smtp_verdict_set(const struct sockaddr_storage *ss, int pass)
+{
+	struct smtp_verdict	*v;
+	const char		*key = ss_to_text(ss);
+
+	if ((v = dict_get(&smtp_verdicts, key)) != NULL)
+		smtp_verdict_remove(v);
+	if (dict_count(&smtp_verdicts) >= SMTP_VERDICT_MAX)
+		smtp_verdict_remove(TAILQ_LAST(&smtp_verdict_lru,
+		    smtp_verdict_lru));
+
+	v = xcalloc(1, sizeof(*v));
+	v->key = xstrdup(key);
+	v->expire = time(NULL) +
+	    (pass ? SMTP_VERDICT_PASS_TTL : SMTP_VERDICT_FAIL_TTL);
+	v->pass = pass;
+	dict_xset(&smtp_verdicts, v->key, v);
+	TAILQ_INSERT_HEAD(&smtp_verdict_lru, v, entry);
+}
+
+static void
+smtp_verdict_remove(struct smtp_verdict *v)
+{
+	dict_xpop(&smtp_verdicts, v->key);
+	TAILQ_REMOVE(&smtp_verdict_lru, v, entry);
+	free(v->key);
+	free(v);
+}
+
 static void
 smtp_dropped(struct listener *listener, int sock, const struct sockaddr_storage *ss)
 {
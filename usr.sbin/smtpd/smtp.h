@@ -53,6 +53,7 @@ struct smtp_params {
 	const char		*helo;		/* string to use with HELO */
 	const char		*auth_user;	/* for AUTH */
 	const char		*auth_pass;	/* for AUTH */
+	int			 pipelining;	/* pipeline the envelope */
 };
 
 struct smtp_rcpt {
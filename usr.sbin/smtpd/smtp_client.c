@@ -67,6 +67,7 @@ enum {
 
 #define FLAG_TLS		0x01
 #define FLAG_TLS_VERIFIED	0x02
+#define FLAG_PIPELINED		0x04
 
 #define SMTP_EXT_STARTTLS	0x01
 #define SMTP_EXT_PIPELINING	0x02
@@ -92,6 +93,7 @@ struct smtp_client {
 	struct smtp_mail	*mail;
 	int			 rcptidx;
 	int			 rcptok;
+	int			 skip;
 };
 
 void log_trace_verbose(int);
@@ -104,10 +106,12 @@ static void smtp_client_state(struct smtp_client *, int);
 static void smtp_client_abort(struct smtp_client *, int, const char *);
 static void smtp_client_cancel(struct smtp_client *, int, const char *);
 static void smtp_client_sendcmd(struct smtp_client *, char *, ...);
+static void smtp_client_sendrcpt(struct smtp_client *, struct smtp_rcpt *);
 static void smtp_client_sendbody(struct smtp_client *);
 static int smtp_client_readline(struct smtp_client *);
 static int smtp_client_replycat(struct smtp_client *, const char *);
 static void smtp_client_response(struct smtp_client *, const char *);
+static int smtp_client_pipelined(struct smtp_client *);
 static void smtp_client_mail_abort(struct smtp_client *);
 static void smtp_client_mail_status(struct smtp_client *, const char *);
 static void smtp_client_rcpt_status(struct smtp_client *, struct smtp_rcpt *, const char *);
@@ -207,6 +211,9 @@ smtp_sendmail(struct smtp_client *proto, struct smtp_mail *mail)
 		fatalx("connection is not ready");
 
 	proto->mail = mail;
+	proto->rcptidx = 0;
+	proto->rcptok = 0;
+	proto->skip = 0;
 	smtp_client_state(proto, STATE_MAIL);
 }
 
@@ -256,10 +263,9 @@ smtp_client_cancel(struct smtp_client *proto, int err, const char *reason)
 static void
 smtp_client_state(struct smtp_client *proto, int newstate)
 {
-	struct smtp_rcpt *rcpt;
 	char ibuf[LINE_MAX], obuf[LINE_MAX];
 	size_t n;
-	int oldstate;
+	int i, oldstate;
 
 	if (proto->reply)
 		proto->reply[0] = '\0';
@@ -386,6 +392,15 @@ smtp_client_state(struct smtp_client *proto, int newstate)
 		break;
 
 	case STATE_MAIL:
+		/*
+		 * When pipelining (RFC 2920), the whole envelope and the
+		 * DATA command are sent at once, and the responses are
+		 * then processed in order.
+		 */
+		if (proto->params.pipelining &&
+		    proto->ext & SMTP_EXT_PIPELINING &&
+		    proto->mail->rcptcount)
+			proto->flags |= FLAG_PIPELINED;
 		if (proto->ext & SMTP_EXT_DSN)
 			smtp_client_sendcmd(proto, "MAIL FROM:<%s>%s%s%s%s",
 			    proto->mail->from,
@@ -396,6 +411,12 @@ smtp_client_state(struct smtp_client *proto, int newstate)
 		else
 			smtp_client_sendcmd(proto, "MAIL FROM:<%s>",
 			    proto->mail->from);
+		if (proto->flags & FLAG_PIPELINED) {
+			for (i = 0; i < proto->mail->rcptcount; i++)
+				smtp_client_sendrcpt(proto,
+				    &proto->mail->rcpt[i]);
+			smtp_client_sendcmd(proto, "DATA");
+		}
 		break;
 
 	case STATE_RCPT:
@@ -403,19 +424,14 @@ smtp_client_state(struct smtp_client *proto, int newstate)
 			smtp_client_state(proto, STATE_DATA);
 			break;
 		}
-		rcpt = &proto->mail->rcpt[proto->rcptidx];
-		if (proto->ext & SMTP_EXT_DSN)
-			smtp_client_sendcmd(proto, "RCPT TO:<%s>%s%s%s%s",
-			    rcpt->to,
-			    rcpt->dsn_notify ? " NOTIFY=" : "",
-			    rcpt->dsn_notify ? rcpt->dsn_notify : "",
-			    rcpt->dsn_orcpt ? " ORCPT=" : "",
-			    rcpt->dsn_orcpt ? rcpt->dsn_orcpt : "");
-		else
-			smtp_client_sendcmd(proto, "RCPT TO:<%s>", rcpt->to);
+		if ((proto->flags & FLAG_PIPELINED) == 0)
+			smtp_client_sendrcpt(proto,
+			    &proto->mail->rcpt[proto->rcptidx]);
 		break;
 
 	case STATE_DATA:
+		if (proto->flags & FLAG_PIPELINED)
+			break;
 		if (proto->rcptok == 0) {
 			smtp_client_mail_abort(proto);
 			smtp_client_state(proto, STATE_RSET);
@@ -456,6 +472,23 @@ smtp_client_response(struct smtp_client *proto, const char *line)
 	struct smtp_rcpt *rcpt;
 	int i, seen;
 
+	/*
+	 * After a pipelined MAIL FROM failed, drop the responses to the
+	 * RCPT and DATA commands that were sent along.
+	 */
+	if (proto->skip) {
+		if (line[0] == '3') {
+			smtp_client_abort(proto, FAIL_PROTO,
+			    "DATA accepted after MAIL failed");
+			return;
+		}
+		if (--proto->skip == 0) {
+			proto->flags &= ~FLAG_PIPELINED;
+			smtp_client_state(proto, STATE_RSET);
+		}
+		return;
+	}
+
 	switch (proto->state) {
 	case STATE_BANNER:
 		if (line[0] != '2')
@@ -540,8 +573,11 @@ smtp_client_response(struct smtp_client *proto, const char *line)
 
 	case STATE_MAIL:
 		if (line[0] != '2') {
+			if (proto->flags & FLAG_PIPELINED)
+				proto->skip = proto->mail->rcptcount + 1;
 			smtp_client_mail_status(proto, line);
-			smtp_client_state(proto, STATE_RSET);
+			if (proto->skip == 0)
+				smtp_client_state(proto, STATE_RSET);
 		}
 		else
 			smtp_client_state(proto, STATE_RCPT);
@@ -551,17 +587,20 @@ smtp_client_response(struct smtp_client *proto, const char *line)
 		rcpt = &proto->mail->rcpt[proto->rcptidx++];
 		if (line[0] != '2')
 			smtp_client_rcpt_status(proto, rcpt, line);
-		else {
+		else
 			proto->rcptok++;
-			smtp_client_state(proto, STATE_RCPT);
-		}
+		smtp_client_state(proto, STATE_RCPT);
 		break;
 
 	case STATE_DATA:
+		proto->flags &= ~FLAG_PIPELINED;
 		if (line[0] != '2' && line[0] != '3') {
 			smtp_client_mail_status(proto, line);
 			smtp_client_state(proto, STATE_RSET);
 		}
+		else if (proto->rcptok == 0)
+			smtp_client_abort(proto, FAIL_PROTO,
+			    "DATA accepted without recipients");
 		else
 			smtp_client_state(proto, STATE_BODY);
 		break;
@@ -750,21 +789,43 @@ smtp_client_readline(struct smtp_client *proto)
 	if (io_datalen(proto->io)) {
 		/*
 		 * There should be no pending data after a response is read,
-		 * except for the multiple status lines after a LMTP message.
-		 * It can also happen with pipelineing, but we don't do that
-		 * for now.
+		 * except for the multiple status lines after a LMTP message,
+		 * or the responses to the rest of a pipelined envelope.
 		 */
-		if (!(proto->params.lmtp && proto->state == STATE_EOM)) {
+		if (!(proto->params.lmtp && proto->state == STATE_EOM) &&
+		    (proto->flags & FLAG_PIPELINED) == 0) {
 			smtp_client_abort(proto, FAIL_PROTO, "Trailing data");
 			return 0;
 		}
 	}
 
+	if (smtp_client_pipelined(proto)) {
+		/* More responses are due and nothing is to be sent. */
+		smtp_client_response(proto, proto->reply);
+		proto->reply[0] = '\0';
+		return 1;
+	}
+
 	io_set_write(proto->io);
 	smtp_client_response(proto, proto->reply);
 	return 0;
 }
 
+/*
+ * Tell if the response being handled is followed by another pipelined
+ * response rather than by a new command.
+ */
+static int
+smtp_client_pipelined(struct smtp_client *proto)
+{
+	if ((proto->flags & FLAG_PIPELINED) == 0)
+		return 0;
+	/* A DATA accepted while skipping aborts the session. */
+	if (proto->skip)
+		return proto->skip > 1 && proto->reply[0] != '3';
+	return proto->state == STATE_MAIL || proto->state == STATE_RCPT;
+}
+
 /*
  * Concatenate the given response line.
  */
@@ -890,6 +951,20 @@ smtp_client_sendcmd(struct smtp_client *proto, char *fmt, ...)
 		smtp_client_abort(proto, FAIL_INTERNAL, NULL);
 }
 
+static void
+smtp_client_sendrcpt(struct smtp_client *proto, struct smtp_rcpt *rcpt)
+{
+	if (proto->ext & SMTP_EXT_DSN)
+		smtp_client_sendcmd(proto, "RCPT TO:<%s>%s%s%s%s",
+		    rcpt->to,
+		    rcpt->dsn_notify ? " NOTIFY=" : "",
+		    rcpt->dsn_notify ? rcpt->dsn_notify : "",
+		    rcpt->dsn_orcpt ? " ORCPT=" : "",
+		    rcpt->dsn_orcpt ? rcpt->dsn_orcpt : "");
+	else
+		smtp_client_sendcmd(proto, "RCPT TO:<%s>", rcpt->to);
+}
+
 static void
 smtp_client_mail_status(struct smtp_client *proto, const char *status)
 {
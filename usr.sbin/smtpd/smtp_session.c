@@ -32,6 +32,7 @@
 #include <asr.h>		/* for asr_freeaddrinfo() */
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,12 +45,16 @@
 #include "bsd-vis.h"
 #endif
 
+#include <openssl/evp.h>
+
 #include "smtpd.h"
 #include "log.h"
 #include "rfc5322.h"
 
 #define	SMTP_LINE_MAX			65535
 #define	DATA_HIWAT			65535
+#define	SPOOL_BUFSIZE			(128 * 1024)
+#define	SPOOL_SYNC_INTERVAL		(4 * 1024 * 1024)
 #define	APPEND_DOMAIN_BUFFER_SIZE	SMTP_LINE_MAX
 
 enum smtp_state {
@@ -62,6 +67,7 @@ enum smtp_state {
 	STATE_AUTH_PASSWORD,
 	STATE_AUTH_FINALIZE,
 	STATE_BODY,
+	STATE_BDAT,
 	STATE_QUIT,
 };
 
@@ -72,7 +78,9 @@ enum session_flags {
 	SF_AUTHENTICATED	= 0x0008,
 	SF_BOUNCE		= 0x0010,
 	SF_VERIFIED		= 0x0020,
+	SF_PIPELINED		= 0x0040,
 	SF_BADINPUT		= 0x0080,
+	SF_TLSWAIT		= 0x0100,	/* handshake in a tls worker */
 };
 
 enum {
@@ -94,6 +102,7 @@ enum smtp_command {
 	CMD_MAIL_FROM,
 	CMD_RCPT_TO,
 	CMD_DATA,
+	CMD_BDAT,
 	CMD_RSET,
 	CMD_QUIT,
 	CMD_HELP,
@@ -122,12 +131,25 @@ struct smtp_tx {
 	int			 error;
 	size_t			 datain;
 	size_t			 odatalen;
+	size_t			 msgsize;
 	FILE			*ofile;
+	char			*obuf;
+	off_t			 owritten;
+	off_t			 osynced;
 	struct io		*filter;
+	int			 filter_paused;
 	struct rfc5322_parser	*parser;
 	int			 rcvcount;
 	int			 has_date;
 	int			 has_message_id;
+	int			 inbody;
+	char			*chunkbuf;
+	size_t			 chunklen;
+	struct dkim_sign	*dkim;
+	struct msgindex_buf	 index;
+	off_t			 hdroff;	/* header being parsed */
+	off_t			 hdrend;
+	off_t			 body;
 
 	uint8_t			 junk;
 };
@@ -138,20 +160,28 @@ struct smtp_session {
 	struct listener		*listener;
 	void			*ssl_ctx;
 	struct sockaddr_storage	 ss;
-	char			 rdns[HOST_NAME_MAX+1];
-	char			 smtpname[HOST_NAME_MAX+1];
+	char			*rdns;
+	const char		*smtpname;	/* listener's, or servername */
+	char			*servername;
 	int			 fcrdns;
+	struct proxy_info	*proxy;		/* TLS terminated by a proxy */
+	struct tls_info		*tls;
 
 	int			 flags;
 	enum smtp_state		 state;
 
 	uint8_t			 banner_sent;
-	char			 helo[LINE_MAX];
-	char			 cmd[LINE_MAX];
-	char			 username[SMTPD_MAXMAILADDRSIZE];
+	char			*helo;
+	char			*cmd;
+	char			*cmdbuf;	/* split by smtp_command() */
+	size_t			 cmdsize;
+	char			*username;
 
 	size_t			 mailcount;
 	struct event		 pause;
+	struct event		 pipeline;
+	size_t			 bdat_size;
+	int			 bdat_last;
 
 	struct smtp_tx		*tx;
 
@@ -160,6 +190,12 @@ struct smtp_session {
 	const char		*filter_param;
 
 	uint8_t			 junk;
+
+	struct timespec		 t_wait;	/* for latency stats */
+
+	TAILQ_ENTRY(smtp_session) idle_entry;
+	time_t			 active;	/* last reply or data received */
+	uint8_t			 idle;		/* waiting for the client */
 };
 
 #define ADVERTISE_TLS(s) \
@@ -175,32 +211,56 @@ struct smtp_session {
 #define	SESSION_FILTERED(s) \
 	((s)->listener->flags & F_FILTERED)
 
+#define	SESSION_FILTERED_PHASE(s, phase) \
+	(SESSION_FILTERED(s) && \
+	    !((s)->listener->filter_skip & (1 << (phase))))
+
 #define	SESSION_DATA_FILTERED(s) \
-	((s)->listener->flags & F_FILTERED)
+	SESSION_FILTERED_PHASE(s, FILTER_DATA_LINE)
 
 
 static int smtp_mailaddr(struct mailaddr *, char *, int, char **, const char *);
 static void smtp_session_init(void);
 static void smtp_lookup_servername(struct smtp_session *);
+static const char *smtp_proxy_tls_text(const struct proxy_info *);
+static const char *smtp_tls_text(struct smtp_session *);
 static void smtp_getnameinfo_cb(void *, int, const char *, const char *);
 static void smtp_getaddrinfo_cb(void *, int, struct addrinfo *);
 static void smtp_connected(struct smtp_session *);
 static void smtp_send_banner(struct smtp_session *);
 static void smtp_tls_init(struct smtp_session *);
+static void smtp_tls_offload(struct smtp_session *);
+static void smtp_tls_ready(struct smtp_session *);
 static void smtp_tls_started(struct smtp_session *);
 static void smtp_io(struct io *, int, void *);
+static int smtp_pipelining_allowed(struct smtp_session *, const char *);
+static void smtp_pipeline_hold(struct smtp_session *);
+static void smtp_pipeline_next(int, short, void *);
+static void smtp_bdat_read(struct smtp_session *);
+static void smtp_bdat_data(struct smtp_session *);
+static void smtp_data_body(struct smtp_session *);
 static void smtp_enter_state(struct smtp_session *, int);
 static void smtp_reply(struct smtp_session *, char *, ...);
 static void smtp_command(struct smtp_session *, char *);
 static void smtp_rfc4954_auth_plain(struct smtp_session *, char *);
 static void smtp_rfc4954_auth_login(struct smtp_session *, char *);
 static void smtp_free(struct smtp_session *, const char *);
+static void smtp_set_cmd(struct smtp_session *, const char *, size_t);
+static void smtp_reply_lines(struct smtp_session *, const char *);
+static const char *smtp_ehlo_caps(struct smtp_session *);
 static const char *smtp_strstate(int);
 static void smtp_auth_failure_pause(struct smtp_session *);
 static void smtp_auth_failure_resume(int, short, void *);
+static int smtp_pressure_exempt(struct smtp_session *);
+static void smtp_session_idle(struct smtp_session *);
+static void smtp_session_busy(struct smtp_session *);
+static void smtp_session_touch(struct smtp_session *);
+static int smtp_session_timeout(struct smtp_session *);
+static void smtp_pressure_resume(int, short, void *);
 
 static int  smtp_tx(struct smtp_session *);
 static void smtp_tx_free(struct smtp_tx *);
+static void smtp_tx_dlog(struct smtp_tx *, struct smtp_rcpt *);
 static void smtp_tx_create_message(struct smtp_tx *);
 static void smtp_tx_mail_from(struct smtp_tx *, const char *);
 static void smtp_tx_rcpt_to(struct smtp_tx *, const char *);
@@ -208,9 +268,16 @@ static void smtp_tx_open_message(struct smtp_tx *);
 static void smtp_tx_commit(struct smtp_tx *);
 static void smtp_tx_rollback(struct smtp_tx *);
 static int  smtp_tx_dataline(struct smtp_tx *, const char *);
+static int  smtp_tx_parse(struct smtp_tx *, const char *);
+static void smtp_tx_chunk(struct smtp_tx *, const char *, size_t);
+static void smtp_tx_chunkline(struct smtp_tx *);
 static int  smtp_tx_filtered_dataline(struct smtp_tx *, const char *);
 static void smtp_tx_eom(struct smtp_tx *);
+static void smtp_tx_dkim_begin(struct smtp_tx *);
+static void smtp_tx_dkim_sign(struct smtp_tx *);
+static void smtp_tx_dkim_signed(struct smtp_tx *, const void *, size_t);
 static void smtp_filter_fd(struct smtp_tx *, int);
+static void smtp_filter_hiwat(struct smtp_tx *);
 static int  smtp_message_fd(struct smtp_tx *, int);
 static void smtp_message_begin(struct smtp_tx *);
 static void smtp_message_end(struct smtp_tx *);
@@ -218,6 +285,11 @@ static int  smtp_filter_printf(struct smtp_tx *, const char *, ...)
     __attribute__((__format__ (printf, 2, 3)));
 static int  smtp_message_printf(struct smtp_tx *, const char *, ...)
     __attribute__((__format__ (printf, 2, 3)));
+static int  smtp_message_vdkim(struct smtp_tx *, const char *, va_list);
+static int  smtp_message_putline(struct smtp_tx *, const char *);
+static int  smtp_message_write(struct smtp_tx *, const char *, size_t);
+static void smtp_message_writeback(struct smtp_tx *, size_t);
+static void smtp_message_close(struct smtp_tx *);
 
 static int  smtp_check_rset(struct smtp_session *, const char *);
 static int  smtp_check_helo(struct smtp_session *, const char *);
@@ -227,6 +299,7 @@ static int  smtp_check_starttls(struct smtp_session *, const char *);
 static int  smtp_check_mail_from(struct smtp_session *, const char *);
 static int  smtp_check_rcpt_to(struct smtp_session *, const char *);
 static int  smtp_check_data(struct smtp_session *, const char *);
+static int  smtp_check_bdat(struct smtp_session *, const char *);
 static int  smtp_check_noop(struct smtp_session *, const char *);
 static int  smtp_check_noparam(struct smtp_session *, const char *);
 
@@ -290,6 +363,7 @@ static struct {
 	{ CMD_MAIL_FROM,        FILTER_MAIL_FROM,       "MAIL FROM",    smtp_check_mail_from,   smtp_proceed_mail_from },
 	{ CMD_RCPT_TO,          FILTER_RCPT_TO,         "RCPT TO",      smtp_check_rcpt_to,     smtp_proceed_rcpt_to },
 	{ CMD_DATA,             FILTER_DATA,            "DATA",         smtp_check_data,        smtp_proceed_data },
+	{ CMD_BDAT,             FILTER_DATA,            "BDAT",         smtp_check_bdat,        smtp_proceed_data },
 	{ CMD_RSET,             FILTER_RSET,            "RSET",         smtp_check_rset,        smtp_proceed_rset },
 	{ CMD_QUIT,             FILTER_QUIT,            "QUIT",         smtp_check_noparam,     smtp_proceed_quit },
 	{ CMD_NOOP,             FILTER_NOOP,            "NOOP",         smtp_check_noop,        smtp_proceed_noop },
@@ -310,20 +384,77 @@ static struct tree wait_ssl_init;
 static struct tree wait_ssl_verify;
 static struct tree wait_filters;
 static struct tree wait_filter_fd;
+static struct tree wait_ca_dkim;
+static struct tree wait_tls;
 
-static void
-header_append_domain_buffer(char *buffer, char *domain, size_t len)
+/*
+ * Pressure published by the queue.  While it is busy the banner is
+ * delayed by SMTP_PRESSURE_DELAY seconds, and while it is full new
+ * transactions are tempfailed before any data is sent.  Authenticated
+ * sessions, submission listeners and local enqueueing are exempt.
+ */
+#define	SMTP_PRESSURE_DELAY	2	/* seconds */
+
+static enum queue_pressure	queue_pressure;
+
+/*
+ * Timeouts shrink as the sessions fill the available slots, from the
+ * full SMTPD_SESSION_TIMEOUT up to SMTP_TIMEOUT_OCCUPANCY percent down
+ * to SMTP_TIMEOUT_MIN seconds at the cap, twice that while receiving
+ * data.  At the cap, a new connection reaps the session that has waited
+ * the longest for its client, if that is at least SMTP_REAP_IDLE
+ * seconds.  Only a complete command or message data counts, so that
+ * slow-drip clients are not saved by trickling bytes in.  Sessions
+ * waiting for us are never reaped, nor is local enqueueing.
+ */
+#define	SMTP_TIMEOUT_OCCUPANCY	50	/* percent */
+#define	SMTP_TIMEOUT_MIN	30	/* seconds */
+#define	SMTP_REAP_IDLE		5	/* seconds */
+
+static TAILQ_HEAD(, smtp_session)	idle_sessions;
+
+/*
+ * The rdns and fcrdns results are kept per client address, so that
+ * clients reconnecting within RDNS_CACHE_TTL seconds, or within
+ * RDNS_CACHE_NEGTTL seconds for a missing or mismatching name, get the
+ * banner without any DNS query.  Temporary failures are not cached.
+ */
+#define	RDNS_CACHE_MAX		4096
+#define	RDNS_CACHE_TTL		300	/* seconds */
+#define	RDNS_CACHE_NEGTTL	60	/* seconds */
+
+struct rdns_cache_entry {
+	TAILQ_ENTRY(rdns_cache_entry)	 entry;
+	char				*key;
+	time_t				 expire;
+	char				*rdns;
+	int				 fcrdns;
+};
+
+static struct hdict	rdns_cache;
+static TAILQ_HEAD(rdns_cache_lru, rdns_cache_entry) rdns_cache_lru;
+
+static void smtp_rdns_cache_remove(struct rdns_cache_entry *);
+static int smtp_rdns_cache_get(struct smtp_session *);
+static void smtp_rdns_cache_set(struct smtp_session *);
+
+/*
+ * Return where the domain goes in an address that has none, or -1 if
+ * the address is to be left as it is.  The last address of a header is
+ * followed by the newline, which ends an escape.
+ */
+static int
+header_append_domain_offset(const char *buffer, size_t len, int eol)
 {
 	size_t	i;
 	int	escape, quote, comment, bracket;
 	int	has_domain, has_bracket, has_group;
-	int	pos_bracket, pos_component, pos_insert;
-	char	copy[APPEND_DOMAIN_BUFFER_SIZE];
+	int	pos_bracket, pos_component;
 
 	escape = quote = comment = bracket = 0;
 	has_domain = has_bracket = has_group = 0;
-	pos_bracket = pos_insert = pos_component = 0;
-	for (i = 0; buffer[i]; ++i) {
+	pos_bracket = pos_component = 0;
+	for (i = 0; i < len; ++i) {
 		if (buffer[i] == '(' && !escape && !quote)
 			comment++;
 		if (buffer[i] == '"' && !escape && !comment)
@@ -351,18 +482,20 @@ header_append_domain_buffer(char *buffer, char *domain, size_t len)
 		if (!comment && buffer[i] != ')' && !isspace((unsigned char)buffer[i]))
 			pos_component = i;
 	}
+	if (eol)
+		escape = 0;
 
 	/* parse error, do not attempt to modify */
 	if (escape || quote || comment || bracket)
-		return;
+		return -1;
 
 	/* domain already present, no need to modify */
 	if (has_domain)
-		return;
+		return -1;
 
 	/* address is group, skip */
 	if (has_group)
-		return;
+		return -1;
 
 	/* there's an address between brackets, just append domain */
 	if (has_bracket) {
@@ -370,18 +503,27 @@ header_append_domain_buffer(char *buffer, char *domain, size_t len)
 		while (isspace((unsigned char)buffer[pos_bracket]))
 			pos_bracket--;
 		if (buffer[pos_bracket] == '<')
-			return;
-		pos_insert = pos_bracket + 1;
+			return -1;
+		return pos_bracket + 1;
 	}
-	else {
-		/* otherwise append address to last component */
-		pos_insert = pos_component + 1;
 
-		/* empty address */
-                if (buffer[pos_component] == '\0' ||
-		    isspace((unsigned char)buffer[pos_component]))
-                        return;
-	}
+	/* empty address */
+	if (len == 0 || isspace((unsigned char)buffer[pos_component]))
+		return -1;
+
+	/* otherwise append address to last component */
+	return pos_component + 1;
+}
+
+static void
+header_append_domain_buffer(char *buffer, char *domain, size_t len)
+{
+	int	pos_insert;
+	char	copy[APPEND_DOMAIN_BUFFER_SIZE];
+
+	pos_insert = header_append_domain_offset(buffer, strlen(buffer), 0);
+	if (pos_insert == -1)
+		return;
 
 	if (snprintf(copy, sizeof copy, "%.*s@%s%s",
 		(int)pos_insert, buffer,
@@ -389,7 +531,7 @@ header_append_domain_buffer(char *buffer, char *domain, size_t len)
 		buffer+pos_insert) >= (int)sizeof copy)
 		return;
 
-	memcpy(buffer, copy, len);
+	(void)strlcpy(buffer, copy, len);
 }
 
 static void
@@ -472,106 +614,97 @@ header_address_rewrite_buffer(char *buffer, const char *address, size_t len)
 	memcpy(buffer, copy, len);
 }
 
+/*
+ * Masquerading rewrites the whole address, so it is done on a copy.
+ */
+static void
+header_address_masquerade(struct smtp_tx *tx, const char *addr, size_t len,
+    int eol)
+{
+	char	buffer[APPEND_DOMAIN_BUFFER_SIZE];
+
+	(void)memcpy(buffer, addr, len);
+	if (eol)
+		buffer[len++] = '\n';
+	buffer[len] = '\0';
+	header_append_domain_buffer(buffer, tx->session->listener->hostname,
+	    sizeof buffer);
+	header_address_rewrite_buffer(buffer, mailaddr_to_text(&tx->evp.sender),
+	    sizeof buffer);
+	smtp_message_printf(tx, "%s", buffer);
+}
+
+/*
+ * Write a To, Cc or From header with the local domain appended to the
+ * addresses that have none.  The addresses are found in place in the
+ * unfolded value, and what is between the changes is written as is,
+ * so a header that needs no change is written in one piece.
+ */
 static void
 header_domain_append_callback(struct smtp_tx *tx, const char *hdr,
     const char *val)
 {
-	size_t			i, j, linelen;
-	int			escape, quote, comment, skip;
-	char			buffer[APPEND_DOMAIN_BUFFER_SIZE];
-	const char *line, *end;
+	const char	*domain = tx->session->listener->hostname;
+	size_t		 i, len, start, done, alen;
+	int		 escape, quote, comment, masquerade, pos, eol = 0;
+
+	masquerade = tx->session->flags & SF_AUTHENTICATED &&
+	    tx->session->listener->sendertable[0] &&
+	    tx->session->listener->flags & F_MASQUERADE &&
+	    !strcasecmp(hdr, "From");
 
 	if (smtp_message_printf(tx, "%s:", hdr) == -1)
 		return;
 
-	j = 0;
-	escape = quote = comment = skip = 0;
-	memset(buffer, 0, sizeof buffer);
-
-	for (line = val; line; line = end) {
-		end = strchr(line, '\n');
-		if (end) {
-			linelen = end - line;
-			end++;
-		}
-		else
-			linelen = strlen(line);
-
-		for (i = 0; i < linelen; ++i) {
-			if (line[i] == '(' && !escape && !quote)
+	len = strlen(val);
+	escape = quote = comment = 0;
+	start = done = 0;
+	for (i = 0; i <= len; ++i) {
+		if (i < len) {
+			/* folding is not part of the address syntax */
+			if (val[i] == '\n')
+				continue;
+			if (val[i] == '(' && !escape && !quote)
 				comment++;
-			if (line[i] == '"' && !escape && !comment)
+			if (val[i] == '"' && !escape && !comment)
 				quote = !quote;
-			if (line[i] == ')' && !escape && !quote && comment)
+			if (val[i] == ')' && !escape && !quote && comment)
 				comment--;
-			if (line[i] == '\\' && !escape && !comment)
+			if (val[i] == '\\' && !escape && !comment)
 				escape = 1;
 			else
 				escape = 0;
 
-			/* found a separator, buffer contains a full address */
-			if (line[i] == ',' && !escape && !quote && !comment) {
-				if (!skip && j + strlen(tx->session->listener->hostname) + 1 < sizeof buffer) {
-					header_append_domain_buffer(buffer, tx->session->listener->hostname, sizeof buffer);
-					if (tx->session->flags & SF_AUTHENTICATED &&
-					    tx->session->listener->sendertable[0] &&
-					    tx->session->listener->flags & F_MASQUERADE &&
-					    !(strcasecmp(hdr, "From")))
-						header_address_rewrite_buffer(buffer, mailaddr_to_text(&tx->evp.sender),
-						    sizeof buffer);
-				}
-				if (smtp_message_printf(tx, "%s,", buffer) == -1)
+			/* not a separator, the address goes on */
+			if (val[i] != ',' || escape || quote || comment)
+				continue;
+		}
+
+		/* val[start..i) is a full address */
+		alen = i - start;
+		if (alen + strlen(domain) + 2 < APPEND_DOMAIN_BUFFER_SIZE) {
+			if (masquerade) {
+				if (smtp_message_printf(tx, "%.*s",
+				    (int)(start - done), val + done) == -1)
 					return;
-				j = 0;
-				skip = 0;
-				memset(buffer, 0, sizeof buffer);
+				eol = (i == len);
+				header_address_masquerade(tx, val + start, alen,
+				    eol);
+				done = i;
 			}
-			else {
-				if (skip) {
-					if (smtp_message_printf(tx, "%c", line[i]) == -1)
-						return;
-				}
-				else {
-					buffer[j++] = line[i];
-					if (j == sizeof (buffer) - 1) {
-						if (smtp_message_printf(tx, "%s", buffer) == -1)
-							return;
-						skip = 1;
-						j = 0;
-						memset(buffer, 0, sizeof buffer);
-					}
-				}
-			}
-		}
-		if (skip) {
-			if (smtp_message_printf(tx, "\n") == -1)
-				return;
-		}
-		else {
-			buffer[j++] = '\n';
-			if (j == sizeof (buffer) - 1) {
-				if (smtp_message_printf(tx, "%s", buffer) == -1)
+			else if ((pos = header_append_domain_offset(val + start,
+			    alen, i == len)) != -1) {
+				if (smtp_message_printf(tx, "%.*s@%s",
+				    (int)(start + pos - done), val + done,
+				    domain) == -1)
 					return;
-				skip = 1;
-				j = 0;
-				memset(buffer, 0, sizeof buffer);
+				done = start + pos;
 			}
 		}
+		start = i + 1;
 	}
 
-	/* end of header, if buffer is not empty we'll process it */
-	if (buffer[0]) {
-		if (j + strlen(tx->session->listener->hostname) + 1 < sizeof buffer) {
-			header_append_domain_buffer(buffer, tx->session->listener->hostname, sizeof buffer);
-			if (tx->session->flags & SF_AUTHENTICATED &&
-			    tx->session->listener->sendertable[0] &&
-			    tx->session->listener->flags & F_MASQUERADE &&
-			    !(strcasecmp(hdr, "From")))
-				header_address_rewrite_buffer(buffer, mailaddr_to_text(&tx->evp.sender),
-				    sizeof buffer);
-		}
-		smtp_message_printf(tx, "%s", buffer);
-	}
+	smtp_message_printf(tx, "%s%s", val + done, eol ? "" : "\n");
 }
 
 static void
@@ -591,13 +724,19 @@ smtp_session_init(void)
 		tree_init(&wait_ssl_verify);
 		tree_init(&wait_filters);
 		tree_init(&wait_filter_fd);
+		tree_init(&wait_ca_dkim);
+		tree_init(&wait_tls);
+		hdict_init(&rdns_cache);
+		TAILQ_INIT(&rdns_cache_lru);
+		TAILQ_INIT(&idle_sessions);
 		init = 1;
 	}
 }
 
 int
 smtp_session(struct listener *listener, int sock,
-    const struct sockaddr_storage *ss, const char *hostname, struct io *io)
+    const struct sockaddr_storage *ss, const char *hostname, struct io *io,
+    const struct proxy_info *proxy)
 {
 	struct smtp_session	*s;
 
@@ -605,8 +744,9 @@ smtp_session(struct listener *listener, int sock,
 
 	if ((s = calloc(1, sizeof(*s))) == NULL)
 		return (-1);
+	memory_alloc(MEMORY_SMTP, sizeof(*s));
 
-	s->id = generate_uid();
+	s->id = smtp_peer_id();
 	s->listener = listener;
 	memmove(&s->ss, ss, sizeof(*ss));
 
@@ -617,11 +757,24 @@ smtp_session(struct listener *listener, int sock,
 
 	io_set_callback(s->io, smtp_io, s);
 	io_set_fd(s->io, sock);
-	io_set_timeout(s->io, SMTPD_SESSION_TIMEOUT * 1000);
 	io_set_write(s->io);
+	evtimer_set(&s->pipeline, smtp_pipeline_next, s);
 	s->state = STATE_NEW;
+	io_set_timeout(s->io, smtp_session_timeout(s));
+
+	s->smtpname = listener->hostname;
 
-	(void)strlcpy(s->smtpname, listener->hostname, sizeof(s->smtpname));
+	/*
+	 * The proxy already terminated TLS with the client, trust what it
+	 * says about it unless we are about to do the handshake ourselves.
+	 */
+	if (proxy && proxy->tls && !(listener->flags & F_SMTPS)) {
+		s->proxy = xmemdup(proxy, sizeof(*proxy));
+		s->flags |= SF_SECURE;
+		if (proxy->tls_verified)
+			s->flags |= SF_VERIFIED;
+		stat_increment("smtp.proxy.tls", 1);
+	}
 
 	log_trace(TRACE_SMTP, "smtp: %p: connected to listener %p "
 	    "[hostname=%s, port=%d, tag=%s]", s, listener,
@@ -633,9 +786,11 @@ smtp_session(struct listener *listener, int sock,
 		/* A bit of a hack */
 		if (!strcmp(hostname, "localhost"))
 			s->flags |= SF_BOUNCE;
-		(void)strlcpy(s->rdns, hostname, sizeof(s->rdns));
+		s->rdns = xstrdup(hostname);
 		s->fcrdns = 1;
 		smtp_lookup_servername(s);
+	} else if (smtp_rdns_cache_get(s)) {
+		smtp_lookup_servername(s);
 	} else {
 		resolver_getnameinfo((struct sockaddr *)&s->ss,
 		    NI_NAMEREQD | NI_NUMERICSERV, smtp_getnameinfo_cb, s);
@@ -653,7 +808,7 @@ smtp_getnameinfo_cb(void *arg, int gaierrno, const char *host, const char *serv)
 	struct addrinfo hints;
 
 	if (gaierrno) {
-		(void)strlcpy(s->rdns, "<unknown>", sizeof(s->rdns));
+		s->rdns = xstrdup("<unknown>");
 
 		if (gaierrno == EAI_NODATA || gaierrno == EAI_NONAME)
 			s->fcrdns = 0;
@@ -663,11 +818,12 @@ smtp_getnameinfo_cb(void *arg, int gaierrno, const char *host, const char *serv)
 			s->fcrdns = -1;
 		}
 
+		smtp_rdns_cache_set(s);
 		smtp_lookup_servername(s);
 		return;
 	}
 
-	(void)strlcpy(s->rdns, host, sizeof(s->rdns));
+	s->rdns = xstrdup(host);
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = s->ss.ss_family;
@@ -703,9 +859,68 @@ smtp_getaddrinfo_cb(void *arg, int gaierrno, struct addrinfo *ai0)
 		asr_freeaddrinfo(ai0);
 	}
 
+	smtp_rdns_cache_set(s);
 	smtp_lookup_servername(s);
 }
 
+static void
+smtp_rdns_cache_remove(struct rdns_cache_entry *e)
+{
+	hdict_xpop(&rdns_cache, e->key);
+	TAILQ_REMOVE(&rdns_cache_lru, e, entry);
+	free(e->key);
+	free(e->rdns);
+	free(e);
+}
+
+static int
+smtp_rdns_cache_get(struct smtp_session *s)
+{
+	struct rdns_cache_entry	*e;
+
+	if ((e = hdict_get(&rdns_cache, ss_to_text(&s->ss))) == NULL)
+		return 0;
+	if (e->expire <= clock_cached()) {
+		smtp_rdns_cache_remove(e);
+		return 0;
+	}
+
+	TAILQ_REMOVE(&rdns_cache_lru, e, entry);
+	TAILQ_INSERT_HEAD(&rdns_cache_lru, e, entry);
+
+	log_trace(TRACE_SMTP, "smtp: %p: cached rdns %s (fcrdns=%d) for %s",
+	    s, e->rdns, e->fcrdns, e->key);
+	s->rdns = xstrdup(e->rdns);
+	s->fcrdns = e->fcrdns;
+	return 1;
+}
+
+static void
+smtp_rdns_cache_set(struct smtp_session *s)
+{
+	struct rdns_cache_entry	*e;
+	const char		*key;
+
+	if (s->fcrdns == -1)
+		return;
+
+	key = ss_to_text(&s->ss);
+	if ((e = hdict_get(&rdns_cache, key)))
+		smtp_rdns_cache_remove(e);
+	else if (hdict_count(&rdns_cache) >= RDNS_CACHE_MAX)
+		smtp_rdns_cache_remove(TAILQ_LAST(&rdns_cache_lru,
+		    rdns_cache_lru));
+
+	e = xcalloc(1, sizeof(*e));
+	e->key = xstrdup(key);
+	e->rdns = xstrdup(s->rdns);
+	e->fcrdns = s->fcrdns;
+	e->expire = clock_cached() +
+	    (s->fcrdns == 1 ? RDNS_CACHE_TTL : RDNS_CACHE_NEGTTL);
+	hdict_xset(&rdns_cache, e->key, e);
+	TAILQ_INSERT_HEAD(&rdns_cache_lru, e, entry);
+}
+
 void
 smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 {
@@ -720,10 +935,19 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 	int				 status, success, fd;
 	int                              filter_response;
 	const char                      *filter_param;
+	const void			*data;
+	size_t				 datalen;
 	uint8_t                          i;
 
 	switch (imsg->hdr.type) {
 
+	case IMSG_QUEUE_PRESSURE:
+		m_msg(&m, imsg);
+		m_get_int(&m, &status);
+		m_end(&m);
+		queue_pressure = status;
+		return;
+
 	case IMSG_SMTP_CHECK_SENDER:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
@@ -754,6 +978,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_string(&m, &line);
 		m_end(&m);
 		s = tree_xpop(&wait_lka_rcpt, reqid);
+		stat_latency("smtp.latency.rcpt", &s->t_wait);
 
 		tmp[0] = '\0';
 		if (s->tx->evp.rcpt.user[0]) {
@@ -784,7 +1009,8 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_int(&m, &status);
 		if (status == LKA_OK) {
 			m_get_string(&m, &helo);
-			(void)strlcpy(s->smtpname, helo, sizeof(s->smtpname));
+			s->servername = xstrdup(helo);
+			s->smtpname = s->servername;
 		}
 		m_end(&m);
 		smtp_connected(s);
@@ -838,6 +1064,80 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		}
 		return;
 
+	case IMSG_CA_DKIM_SIGN:
+		m_msg(&m, imsg);
+		m_get_id(&m, &reqid);
+		m_get_int(&m, &success);
+		data = NULL;
+		datalen = 0;
+		if (success)
+			m_get_data(&m, &data, &datalen);
+		m_end(&m);
+
+		s = tree_xpop(&wait_ca_dkim, reqid);
+		smtp_tx_dkim_signed(s->tx, data, datalen);
+		return;
+
+	case IMSG_TLS_READY:
+		m_msg(&m, imsg);
+		m_get_id(&m, &reqid);
+		m_get_data(&m, &data, &datalen);
+		m_end(&m);
+		if (datalen != sizeof(struct tls_info))
+			fatalx("smtp: bad tls info");
+
+		fd = imsg_get_fd(imsg);
+		if (fd == -1)
+			fatalx("smtp: no socket from tls worker");
+		/* the session went away meanwhile */
+		if ((s = tree_pop(&wait_tls, reqid)) == NULL) {
+			close(fd);
+			return;
+		}
+		s->flags &= ~SF_TLSWAIT;
+
+		/* from now on, the session talks plaintext to the worker */
+		close(io_fileno(s->io));
+		io_set_fd(s->io, fd);
+		io_resume(s->io, IO_IN);
+
+		s->tls = xmemdup(data, sizeof(struct tls_info));
+		smtp_tls_ready(s);
+		return;
+
+	case IMSG_TLS_FAIL:
+		m_msg(&m, imsg);
+		m_get_id(&m, &reqid);
+		m_get_int(&m, &status);
+		m_get_string(&m, &line);
+		m_end(&m);
+
+		if ((s = tree_pop(&wait_tls, reqid)) == NULL)
+			return;
+		s->flags &= ~SF_TLSWAIT;
+
+		if (status == IO_TIMEOUT) {
+			log_info("%016"PRIx64" smtp disconnected "
+			    "reason=timeout",
+			    s->id);
+			stat_increment("smtp.session.timeout", 1);
+			smtp_report_timeout(s);
+			smtp_free(s, "timeout");
+		}
+		else if (status == IO_DISCONNECTED) {
+			log_info("%016"PRIx64" smtp disconnected "
+			    "reason=disconnect",
+			    s->id);
+			smtp_free(s, "disconnected");
+		}
+		else {
+			log_info("%016"PRIx64" smtp disconnected "
+			    "reason=\"io-error: %s\"",
+			    s->id, line);
+			smtp_free(s, "IO error");
+		}
+		return;
+
 	case IMSG_FILTER_SMTP_DATA_BEGIN:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
@@ -846,7 +1146,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 
 		fd = imsg_get_fd(imsg);
 		s = tree_xpop(&wait_filter_fd, reqid);
-		if (!success || fd == -1) {
+		if (!success) {
 			if (fd != -1)
 				close(fd);
 			smtp_reply(s, "421 %s Temporary Error",
@@ -855,25 +1155,29 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 		}
 
+		/* no fd means no data filter, the body goes straight to queue */
 		log_debug("smtp: %p: fd %d from lka", s, fd);
 
-		smtp_filter_fd(s->tx, fd);
+		if (fd != -1)
+			smtp_filter_fd(s->tx, fd);
 		smtp_message_begin(s->tx);
 		return;
 
 	case IMSG_QUEUE_ENVELOPE_SUBMIT:
+		/* a batch of the expansion, zero for a failed envelope */
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
-		m_get_int(&m, &success);
 		s = tree_xget(&wait_lka_rcpt, reqid);
-		if (success) {
+		while (!m_is_eom(&m)) {
 			m_get_evpid(&m, &evpid);
+			if (evpid == 0) {
+				s->tx->error = TX_ERROR_ENVELOPE;
+				continue;
+			}
 			s->tx->evp.id = evpid;
 			s->tx->destcount++;
 			smtp_report_tx_envelope(s, s->tx->msgid, evpid);
 		}
-		else
-			s->tx->error = TX_ERROR_ENVELOPE;
 		m_end(&m);
 		return;
 
@@ -885,6 +1189,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		if (!success)
 			fatalx("commit evp failed: not supposed to happen");
 		s = tree_xpop(&wait_lka_rcpt, reqid);
+		stat_latency("smtp.latency.rcpt", &s->t_wait);
 		if (s->tx->error) {
 			/*
 			 * If an envelope failed, we can't cancel the last
@@ -897,6 +1202,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		}
 		else {
 			rcpt = xcalloc(1, sizeof(*rcpt));
+			memory_alloc(MEMORY_SMTP, sizeof(*rcpt));
 			rcpt->evpid = s->tx->evp.id;
 			rcpt->destcount = s->tx->destcount;
 			rcpt->maddr = s->tx->evp.rcpt;
@@ -916,6 +1222,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_int(&m, &success);
 		m_end(&m);
 		s = tree_xpop(&wait_queue_commit, reqid);
+		stat_latency("smtp.latency.commit", &s->t_wait);
 		if (!success) {
 			smtp_reply(s, "421 %s Temporary failure",
 			    esc_code(ESC_STATUS_TEMPFAIL, ESC_OTHER_MAIL_SYSTEM_STATUS));
@@ -948,6 +1255,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 			    rcpt->maddr.user,
 			    rcpt->maddr.user[0] == '\0' ? "" : "@",
 			    rcpt->maddr.domain);
+			smtp_tx_dlog(s->tx, rcpt);
 		}
 		smtp_tx_free(s->tx);
 		s->mailcount++;
@@ -1008,6 +1316,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		m_end(&m);
 
 		s = tree_xpop(&wait_filters, reqid);
+		stat_latency("smtp.latency.filter", &s->t_wait);
 
 		switch (filter_response) {
 		case FILTER_REJECT:
@@ -1027,6 +1336,9 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 				smtp_enter_state(s, STATE_QUIT);
 			else if (s->filter_phase == FILTER_COMMIT)
 				smtp_proceed_rollback(s, NULL);
+			else if (s->filter_phase == FILTER_DATA &&
+			    s->last_cmd == CMD_BDAT)
+				smtp_bdat_read(s);
 			break;
 
 
@@ -1072,6 +1384,11 @@ static void
 smtp_tls_init(struct smtp_session *s)
 {
 	io_set_read(s->io);
+	clock_gettime(CLOCK_MONOTONIC, &s->t_wait);
+	if (env->sc_tls_workers && s->listener->pkitable[0] == '\0') {
+		smtp_tls_offload(s);
+		return;
+	}
 	if (io_accept_tls(s->io, s->listener->tls) == -1) {
 		log_info("%016"PRIx64" smtp disconnected "
 		    "reason=tls-accept-failed",
@@ -1080,15 +1397,82 @@ smtp_tls_init(struct smtp_session *s)
 	}
 }
 
+/*
+ * Hand the handshake and the record layer over to a tls worker.  The
+ * session sleeps until the worker gives back a socketpair to talk
+ * plaintext on, or tells the handshake failed.
+ */
+static void
+smtp_tls_offload(struct smtp_session *s)
+{
+	int	fd;
+
+	/* nothing may come before the handshake, see smtp_io() */
+	if (io_datalen(s->io)) {
+		log_info("%016"PRIx64" smtp disconnected "
+		    "reason=tls-accept-failed",
+		    s->id);
+		smtp_free(s, "accept failed");
+		return;
+	}
+
+	if ((fd = dup(io_fileno(s->io))) == -1 ||
+	    tls_worker_accept(s->listener, fd, s->id) == -1) {
+		if (fd == -1)
+			log_warn("warn: smtp: dup");
+		log_info("%016"PRIx64" smtp disconnected "
+		    "reason=tls-accept-failed",
+		    s->id);
+		smtp_free(s, "accept failed");
+		return;
+	}
+
+	io_pause(s->io, IO_IN);
+	s->flags |= SF_TLSWAIT;
+	tree_xset(&wait_tls, s->id, s);
+}
+
+static void
+smtp_tls_ready(struct smtp_session *s)
+{
+	stat_latency("smtp.latency.tls", &s->t_wait);
+	log_info("%016"PRIx64" smtp tls ciphers=%s",
+	    s->id, smtp_tls_text(s));
+
+	smtp_report_link_tls(s, smtp_tls_text(s));
+
+	s->flags |= SF_SECURE;
+	if (s->listener->flags & F_TLS_VERIFY)
+		s->flags |= SF_VERIFIED;
+	free(s->helo);
+	s->helo = NULL;
+
+	smtp_tls_started(s);
+}
+
 static void
 smtp_tls_started(struct smtp_session *s)
 {
-	if (tls_peer_cert_provided(io_tls(s->io))) {
+	char		 key[64];
+
+	/*
+	 * Only full handshakes cost a private key operation; count them
+	 * per certificate type to see how many clients get ECDSA.
+	 */
+	if (s->tls->resumed)
+		stat_increment("smtp.tls.resumed", 1);
+	else if (s->tls->cert_type[0]) {
+		(void)snprintf(key, sizeof key, "smtp.tls.handshake.%s",
+		    s->tls->cert_type);
+		stat_increment(key, 1);
+	}
+
+	if (s->tls->peer_hash[0]) {
 		log_info("%016"PRIx64" smtp "
 		    "cert-check result=\"%s\" fingerprint=\"%s\"",
 		    s->id,
 		    (s->flags & SF_VERIFIED) ? "verified" : "unchecked",
-		    tls_peer_cert_hash(io_tls(s->io)));
+		    s->tls->peer_hash);
 	}
 
 	if (s->listener->flags & F_SMTPS) {
@@ -1102,6 +1486,29 @@ smtp_tls_started(struct smtp_session *s)
 	}
 }
 
+static const char *
+smtp_tls_text(struct smtp_session *s)
+{
+	static char	buf[256];
+
+	(void)snprintf(buf, sizeof buf, "%s:%s:%d",
+	    s->tls->version, s->tls->cipher, s->tls->strength);
+
+	return (buf);
+}
+
+static const char *
+smtp_proxy_tls_text(const struct proxy_info *proxy)
+{
+	static char	buf[256];
+
+	(void)snprintf(buf, sizeof buf, "%s:%s",
+	    proxy->tls_version[0] ? proxy->tls_version : "unknown",
+	    proxy->tls_cipher[0] ? proxy->tls_cipher : "unknown");
+
+	return (buf);
+}
+
 static void
 smtp_io(struct io *io, int evt, void *arg)
 {
@@ -1116,20 +1523,24 @@ smtp_io(struct io *io, int evt, void *arg)
 	switch (evt) {
 
 	case IO_TLSREADY:
-		log_info("%016"PRIx64" smtp tls ciphers=%s",
-		    s->id, tls_to_text(io_tls(s->io)));
-
-		smtp_report_link_tls(s, tls_to_text(io_tls(s->io)));
-
-		s->flags |= SF_SECURE;
-		if (s->listener->flags & F_TLS_VERIFY)
-			s->flags |= SF_VERIFIED;
-		s->helo[0] = '\0';
-
-		smtp_tls_started(s);
+		if (s->listener->pkitable[0])
+			smtp_sni_release(io_tls(s->io));
+		s->tls = xcalloc(1, sizeof(*s->tls));
+		tls_session_info(io_tls(s->io), s->tls);
+		smtp_tls_ready(s);
 		break;
 
 	case IO_DATAIN:
+		if (s->state == STATE_BODY || s->state == STATE_BDAT)
+			smtp_session_touch(s);
+		if (s->state == STATE_BDAT) {
+			smtp_bdat_data(s);
+			break;
+		}
+		if (s->state == STATE_BODY && s->tx->inbody &&
+		    s->tx->filter == NULL && !(tracing & TRACE_SMTP))
+			smtp_data_body(s);
+
 	    nextline:
 		line = io_getline(s->io, &len);
 		if ((line == NULL && io_datalen(s->io) >= SMTP_LINE_MAX) ||
@@ -1138,6 +1549,7 @@ smtp_io(struct io *io, int evt, void *arg)
 			smtp_reply(s, "500 %s Line too long",
 			    esc_code(ESC_STATUS_PERMFAIL, ESC_OTHER_STATUS));
 			smtp_enter_state(s, STATE_QUIT);
+			io_resume(io, IO_OUT);
 			io_set_write(io);
 			return;
 		}
@@ -1165,35 +1577,47 @@ smtp_io(struct io *io, int evt, void *arg)
 				goto nextline;
 		}
 
-		/* Pipelining not supported */
-		if (io_datalen(s->io)) {
+		/* Only pipeline what RFC 2920 allows, and only after EHLO */
+		if (io_datalen(s->io) && !smtp_pipelining_allowed(s, line)) {
 			s->flags |= SF_BADINPUT;
 			smtp_reply(s, "500 %s %s: Pipelining not supported",
 			    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
 			    esc_description(ESC_INVALID_COMMAND));
 			smtp_enter_state(s, STATE_QUIT);
+			io_resume(io, IO_OUT);
 			io_set_write(io);
 			return;
 		}
 
 		if (eom) {
 			io_set_write(io);
+			smtp_pipeline_hold(s);
 			if (s->tx->filter == NULL)
 				smtp_tx_eom(s->tx);
 			return;
 		}
 
 		/* Must be a command */
-		if (strlcpy(s->cmd, line, sizeof(s->cmd)) >= sizeof(s->cmd)) {
+		if (len >= LINE_MAX) {
 			s->flags |= SF_BADINPUT;
 			smtp_reply(s, "500 %s Command line too long",
 			    esc_code(ESC_STATUS_PERMFAIL, ESC_OTHER_STATUS));
 			smtp_enter_state(s, STATE_QUIT);
+			io_resume(io, IO_OUT);
 			io_set_write(io);
 			return;
 		}
+		/*
+		 * The line points into the input buffer, which moves when
+		 * the io is reloaded with pipelined input still pending.
+		 * The copy must outlive this call, as filters keep a
+		 * pointer to the arguments until they answer.
+		 */
+		smtp_set_cmd(s, line, len);
 		io_set_write(io);
-		smtp_command(s, line);
+		smtp_pipeline_hold(s);
+		smtp_session_busy(s);
+		smtp_command(s, s->cmdbuf);
 		break;
 
 	case IO_LOWAT:
@@ -1218,6 +1642,7 @@ smtp_io(struct io *io, int evt, void *arg)
 		log_info("%016"PRIx64" smtp disconnected "
 		    "reason=timeout",
 		    s->id);
+		stat_increment("smtp.session.timeout", 1);
 		smtp_report_timeout(s);
 		smtp_free(s, "timeout");
 		break;
@@ -1241,36 +1666,214 @@ smtp_io(struct io *io, int evt, void *arg)
 	}
 }
 
-static void
-smtp_command(struct smtp_session *s, char *line)
+/*
+ * RFC 2920 lets the client send RSET, MAIL and RCPT without waiting for
+ * the previous reply, as well as the next command after the final dot.
+ * RFC 3030 adds BDAT, whose chunk follows the command line right away.
+ * Anything else must be the last command of a group: a client that keeps
+ * talking after STARTTLS, AUTH or DATA is still rejected.
+ */
+static int
+smtp_pipelining_allowed(struct smtp_session *s, const char *line)
 {
-	char			       *args;
-	int				cmd, i;
+	if (!(s->flags & SF_EHLO))
+		return (0);
 
-	log_trace(TRACE_SMTP, "smtp: %p: <<< %s", s, line);
+	if (s->state == STATE_BODY)
+		return (1);
 
-	/*
-	 * These states are special.
-	 */
-	if (s->state == STATE_AUTH_INIT) {
-		smtp_report_protocol_client(s, "********");
-		smtp_rfc4954_auth_plain(s, line);
-		return;
+	if (s->state != STATE_HELO)
+		return (0);
+
+	return (strncasecmp(line, "MAIL FROM:", 10) == 0 ||
+	    strncasecmp(line, "RCPT TO:", 8) == 0 ||
+	    strncasecmp(line, "BDAT ", 5) == 0 ||
+	    strcasecmp(line, "RSET") == 0);
+}
+
+/*
+ * While more pipelined input is buffered, hold the replies back so that
+ * they all go out in a single write once the last command of the group
+ * has been answered.
+ */
+static void
+smtp_pipeline_hold(struct smtp_session *s)
+{
+	if (io_datalen(s->io) || io_paused(s->io, IO_OUT)) {
+		s->flags |= SF_PIPELINED;
+		io_pause(s->io, IO_OUT);
 	}
-	if (s->state == STATE_AUTH_USERNAME || s->state == STATE_AUTH_PASSWORD) {
-		smtp_report_protocol_client(s, "********");
-		smtp_rfc4954_auth_login(s, line);
+}
+
+/*
+ * The reply to a pipelined command has been queued: process the next
+ * buffered command, or flush the replies if there is none.
+ */
+static void
+smtp_pipeline_next(int fd, short event, void *p)
+{
+	struct smtp_session	*s = p;
+
+	s->flags &= ~SF_PIPELINED;
+
+	if (s->state != STATE_HELO ||
+	    (memchr(io_data(s->io), '\n', io_datalen(s->io)) == NULL &&
+	    io_datalen(s->io) < SMTP_LINE_MAX)) {
+		io_resume(s->io, IO_OUT);
 		return;
 	}
 
-	if (s->state == STATE_HELO && strncasecmp(line, "AUTH PLAIN ", 11) == 0)
-		smtp_report_protocol_client(s, "AUTH PLAIN ********");
-	else
-		smtp_report_protocol_client(s, line);
+	io_set_read(s->io);
+	smtp_io(s->io, IO_DATAIN, s);
+	if (s->state == STATE_QUIT)
+		io_resume(s->io, IO_OUT);
+}
 
+/*
+ * Start reading the chunk announced by a BDAT command.  Some or all of
+ * it may already be sitting in the input buffer.
+ */
+static void
+smtp_bdat_read(struct smtp_session *s)
+{
+	smtp_enter_state(s, STATE_BDAT);
+	io_set_read(s->io);
+	smtp_io(s->io, IO_DATAIN, s);
+}
 
-	/*
-	 * Unlike other commands, "mail from" and "rcpt to" contain a
+/*
+ * Past the headers, body lines only need to be unstuffed and spooled:
+ * take them straight from the input buffer, and leave the end of
+ * message, or a line too long, to the line-based path.
+ */
+static void
+smtp_data_body(struct smtp_session *s)
+{
+	struct smtp_tx	*tx = s->tx;
+	char		*data, *line, *nl;
+	size_t		 datalen, len, n;
+
+	data = io_data(s->io);
+	datalen = io_datalen(s->io);
+
+	for (n = 0; (nl = memchr(data + n, '\n', datalen - n)); n = nl - data + 1) {
+		line = data + n;
+		len = nl - line;
+		if (len >= SMTP_LINE_MAX)
+			break;
+
+		/* Strip trailing '\r' */
+		if (len && line[len - 1] == '\r')
+			len--;
+		if (len == 1 && line[0] == '.')
+			break;
+
+		tx->datain += len + 1;
+		if (tx->datain > env->sc_maxsize)
+			tx->error = TX_ERROR_SIZE;
+
+		/* escape lines starting with a '.' */
+		if (len && line[0] == '.') {
+			line++;
+			len--;
+		}
+		(void)smtp_message_write(tx, line, len);
+	}
+	io_drop(s->io, n);
+}
+
+static void
+smtp_bdat_data(struct smtp_session *s)
+{
+	struct timeval	 tv;
+	size_t		 len;
+	int		 discard;
+
+	/*
+	 * A chunk for a rejected BDAT command must still be read off the
+	 * wire, since neither the message nor the transaction exist.
+	 */
+	discard = (s->tx == NULL || s->tx->ofile == NULL);
+
+	len = io_datalen(s->io);
+	if (len > s->bdat_size)
+		len = s->bdat_size;
+	if (!discard)
+		smtp_tx_chunk(s->tx, io_data(s->io), len);
+	io_drop(s->io, len);
+	s->bdat_size -= len;
+
+	/* Wait for the rest of the chunk */
+	if (s->bdat_size)
+		return;
+
+	io_set_write(s->io);
+	smtp_pipeline_hold(s);
+
+	if (discard) {
+		smtp_enter_state(s, s->helo ? STATE_HELO : STATE_CONNECTED);
+		/* the error reply was queued before the chunk was read */
+		if (s->flags & SF_PIPELINED) {
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+			evtimer_add(&s->pipeline, &tv);
+		}
+		return;
+	}
+
+	if (!s->bdat_last) {
+		smtp_enter_state(s, STATE_HELO);
+		smtp_reply(s, "250 %s %zu octets received",
+		    esc_code(ESC_STATUS_OK, ESC_OTHER_STATUS), s->tx->datain);
+		return;
+	}
+
+	/* An unterminated last line still belongs to the message */
+	if (s->tx->chunklen && !s->tx->error)
+		smtp_tx_chunkline(s->tx);
+
+	log_trace(TRACE_SMTP, "<<< [EOM]");
+
+	if (s->tx->filter) {
+		io_printf(s->tx->filter, ".\n");
+		return;
+	}
+
+	if (!s->tx->error)
+		(void)smtp_tx_parse(s->tx, NULL);
+	smtp_tx_eom(s->tx);
+}
+
+static void
+smtp_command(struct smtp_session *s, char *line)
+{
+	char			       *args;
+	int				cmd, i;
+
+	log_trace(TRACE_SMTP, "smtp: %p: <<< %s", s, line);
+
+	/*
+	 * These states are special.
+	 */
+	if (s->state == STATE_AUTH_INIT) {
+		smtp_report_protocol_client(s, "********");
+		smtp_rfc4954_auth_plain(s, line);
+		return;
+	}
+	if (s->state == STATE_AUTH_USERNAME || s->state == STATE_AUTH_PASSWORD) {
+		smtp_report_protocol_client(s, "********");
+		smtp_rfc4954_auth_login(s, line);
+		return;
+	}
+
+	if (s->state == STATE_HELO && strncasecmp(line, "AUTH PLAIN ", 11) == 0)
+		smtp_report_protocol_client(s, "AUTH PLAIN ********");
+	else
+		smtp_report_protocol_client(s, line);
+
+
+	/*
+	 * Unlike other commands, "mail from" and "rcpt to" contain a
 	 * space in the command name.
 	 */
 	if (strncasecmp("mail from:", line, 10) == 0 ||
@@ -1352,6 +1955,20 @@ smtp_command(struct smtp_session *s, char *line)
 		smtp_filter_phase(FILTER_DATA, s, NULL);
 		break;
 
+	case CMD_BDAT:
+		s->bdat_size = 0;
+		if (!smtp_check_bdat(s, args)) {
+			if (s->bdat_size)
+				smtp_bdat_read(s);
+			break;
+		}
+		/* The first chunk opens the message like DATA does */
+		if (s->tx->ofile == NULL)
+			smtp_filter_phase(FILTER_DATA, s, NULL);
+		else
+			smtp_bdat_read(s);
+		break;
+
 	/*
 	 * ANY
 	 */
@@ -1393,7 +2010,7 @@ smtp_check_rset(struct smtp_session *s, const char *args)
 	if (!smtp_check_noparam(s, args))
 		return 0;
 
-	if (s->helo[0] == '\0') {
+	if (s->helo == NULL) {
 		smtp_reply(s, "503 %s %s: Command not allowed at this point.",
 		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
 		    esc_description(ESC_INVALID_COMMAND));
@@ -1412,7 +2029,7 @@ smtp_check_helo(struct smtp_session *s, const char *args)
 		return 0;
 	}
 
-	if (s->helo[0]) {
+	if (s->helo) {
 		smtp_reply(s, "503 %s %s: Already identified",
 		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
 		    esc_description(ESC_INVALID_COMMAND));
@@ -1446,7 +2063,7 @@ smtp_check_ehlo(struct smtp_session *s, const char *args)
 		return 0;
 	}
 
-	if (s->helo[0]) {
+	if (s->helo) {
 		smtp_reply(s, "503 %s %s: Already identified",
 		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
 		    esc_description(ESC_INVALID_COMMAND));
@@ -1473,7 +2090,7 @@ smtp_check_ehlo(struct smtp_session *s, const char *args)
 static int
 smtp_check_auth(struct smtp_session *s, const char *args)
 {
-	if (s->helo[0] == '\0' || s->tx) {
+	if (s->helo == NULL || s->tx) {
 		smtp_reply(s, "503 %s %s: Command not allowed at this point.",
 		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
 		    esc_description(ESC_INVALID_COMMAND));
@@ -1507,7 +2124,7 @@ smtp_check_auth(struct smtp_session *s, const char *args)
 static int
 smtp_check_starttls(struct smtp_session *s, const char *args)
 {
-	if (s->helo[0] == '\0' || s->tx) {
+	if (s->helo == NULL || s->tx) {
 		smtp_reply(s, "503 %s %s: Command not allowed at this point.",
 		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
 		    esc_description(ESC_INVALID_COMMAND));
@@ -1548,7 +2165,7 @@ smtp_check_mail_from(struct smtp_session *s, const char *args)
 	(void)strlcpy(tmp, args, sizeof tmp);
 	copy = tmp;
 
-	if (s->helo[0] == '\0' || s->tx) {
+	if (s->helo == NULL || s->tx) {
 		smtp_reply(s, "503 %s %s: Command not allowed at this point.",
 		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
 		    esc_description(ESC_INVALID_COMMAND));
@@ -1573,6 +2190,23 @@ smtp_check_mail_from(struct smtp_session *s, const char *args)
 		return 0;
 	}
 
+	if (memory_level() >= MEMORY_TEMPFAIL) {
+		stat_increment("smtp.memory.tempfail", 1);
+		smtp_reply(s, "452 %s %s: Insufficient system resources",
+		    esc_code(ESC_STATUS_TEMPFAIL, ESC_MAIL_SYSTEM_FULL),
+		    esc_description(ESC_MAIL_SYSTEM_FULL));
+		return 0;
+	}
+
+	if (queue_pressure >= QUEUE_PRESSURE_FULL &&
+	    !smtp_pressure_exempt(s)) {
+		stat_increment("smtp.pressure.tempfail", 1);
+		smtp_reply(s, "451 %s %s: Queue busy, try again later",
+		    esc_code(ESC_STATUS_TEMPFAIL, ESC_MAIL_SYSTEM_CONGESTION),
+		    esc_description(ESC_MAIL_SYSTEM_CONGESTION));
+		return 0;
+	}
+
 	if (s->mailcount >= env->sc_session_max_mails) {
 		/* we can pretend we had too many recipients */
 		smtp_reply(s, "452 %s %s: Too many messages sent",
@@ -1607,6 +2241,13 @@ smtp_check_rcpt_to(struct smtp_session *s, const char *args)
 		return 0;
 	}
 
+	if (s->tx->ofile) {
+		smtp_reply(s, "503 %s %s: Command not allowed at this point.",
+		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
+		    esc_description(ESC_INVALID_COMMAND));
+		return 0;
+	}
+
 	if (s->tx->rcptcount >= env->sc_session_max_rcpt) {
 		smtp_reply(s->tx->session, "451 %s %s: Too many recipients",
 		    esc_code(ESC_STATUS_TEMPFAIL, ESC_TOO_MANY_RECIPIENTS),
@@ -1646,6 +2287,76 @@ smtp_check_data(struct smtp_session *s, const char *args)
 		return 0;
 	}
 
+	/* The message was already started with BDAT */
+	if (s->tx->ofile) {
+		smtp_reply(s, "503 %s %s: Command not allowed at this point.",
+		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
+		    esc_description(ESC_INVALID_COMMAND));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+smtp_check_bdat(struct smtp_session *s, const char *args)
+{
+	char		 tmp[SMTP_LINE_MAX];
+	char		*size, *last;
+	const char	*errstr;
+
+	/*
+	 * Without a valid size, there is no telling where the chunk
+	 * ends and the next command starts.
+	 */
+	if (args == NULL) {
+		s->flags |= SF_BADINPUT;
+		smtp_reply(s, "501 %s %s: BDAT requires a chunk size",
+		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND_ARGUMENTS),
+		    esc_description(ESC_INVALID_COMMAND_ARGUMENTS));
+		smtp_enter_state(s, STATE_QUIT);
+		return 0;
+	}
+
+	(void)strlcpy(tmp, args, sizeof tmp);
+	last = tmp;
+	size = strsep(&last, " ");
+	s->bdat_size = strtonum(size, 0, SSIZE_MAX, &errstr);
+	if (errstr) {
+		s->flags |= SF_BADINPUT;
+		smtp_reply(s, "501 %s %s: Chunk size is %s",
+		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND_ARGUMENTS),
+		    esc_description(ESC_INVALID_COMMAND_ARGUMENTS), errstr);
+		smtp_enter_state(s, STATE_QUIT);
+		return 0;
+	}
+
+	s->bdat_last = 0;
+	if (last) {
+		if (strcasecmp(last, "LAST")) {
+			smtp_reply(s, "501 %s %s: Invalid BDAT parameter",
+			    esc_code(ESC_STATUS_PERMFAIL,
+				ESC_INVALID_COMMAND_ARGUMENTS),
+			    esc_description(ESC_INVALID_COMMAND_ARGUMENTS));
+			return 0;
+		}
+		s->bdat_last = 1;
+	}
+
+	if (s->tx == NULL) {
+		smtp_reply(s, "503 %s %s: Command not allowed at this point.",
+		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
+		    esc_description(ESC_INVALID_COMMAND));
+		return 0;
+	}
+
+	if (s->tx->rcptcount == 0) {
+		smtp_reply(s, "503 %s %s: No recipient specified",
+		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND_ARGUMENTS),
+		    esc_description(ESC_INVALID_COMMAND_ARGUMENTS));
+		return 0;
+	}
+
 	return 1;
 }
 
@@ -1676,6 +2387,7 @@ smtp_query_filters(enum filter_phase phase, struct smtp_session *s, const char *
 	m_add_string(p_lka, args);
 	m_close(p_lka);
 	tree_xset(&wait_filters, s->id, s);
+	clock_gettime(CLOCK_MONOTONIC, &s->t_wait);
 }
 
 static void
@@ -1724,6 +2436,10 @@ smtp_filter_data_end(struct smtp_session *s)
 
 	io_free(s->tx->filter);
 	s->tx->filter = NULL;
+	if (s->tx->filter_paused) {
+		s->tx->filter_paused = 0;
+		io_resume(s->io, IO_IN);
+	}
 
 	m_create(p_lka, IMSG_FILTER_SMTP_DATA_END, 0, 0, -1);
 	m_add_id(p_lka, s->id);
@@ -1738,7 +2454,7 @@ smtp_filter_phase(enum filter_phase phase, struct smtp_session *s, const char *p
 	s->filter_phase = phase;
 	s->filter_param = param;
 
-	if (SESSION_FILTERED(s)) {
+	if (SESSION_FILTERED_PHASE(s, phase)) {
 		smtp_query_filters(phase, s, param ? param : "");
 		return;
 	}
@@ -1771,7 +2487,8 @@ smtp_proceed_rset(struct smtp_session *s, const char *args)
 static void
 smtp_proceed_helo(struct smtp_session *s, const char *args)
 {
-	(void)strlcpy(s->helo, args, sizeof(s->helo));
+	free(s->helo);
+	s->helo = xstrdup(args);
 	s->flags &= SF_SECURE | SF_AUTHENTICATED | SF_VERIFIED;
 
 	smtp_report_link_identify(s, "HELO", s->helo);
@@ -1789,7 +2506,8 @@ smtp_proceed_helo(struct smtp_session *s, const char *args)
 static void
 smtp_proceed_ehlo(struct smtp_session *s, const char *args)
 {
-	(void)strlcpy(s->helo, args, sizeof(s->helo));
+	free(s->helo);
+	s->helo = xstrdup(args);
 	s->flags &= SF_SECURE | SF_AUTHENTICATED | SF_VERIFIED;
 	s->flags |= SF_EHLO;
 	s->flags |= SF_8BITMIME;
@@ -1804,16 +2522,40 @@ smtp_proceed_ehlo(struct smtp_session *s, const char *args)
 	    ss_to_text(&s->ss),
 	    s->ss.ss_family == AF_INET6 ? "" : "]");
 
-	smtp_reply(s, "250-8BITMIME");
-	smtp_reply(s, "250-ENHANCEDSTATUSCODES");
-	smtp_reply(s, "250-SIZE %zu", env->sc_maxsize);
-	if (ADVERTISE_EXT_DSN(s))
-		smtp_reply(s, "250-DSN");
-	if (ADVERTISE_TLS(s))
-		smtp_reply(s, "250-STARTTLS");
-	if (ADVERTISE_AUTH(s))
-		smtp_reply(s, "250-AUTH PLAIN LOGIN");
-	smtp_reply(s, "250 HELP");
+	smtp_reply_lines(s, smtp_ehlo_caps(s));
+}
+
+/*
+ * The capabilities only depend on the listener and on whether STARTTLS
+ * and AUTH are advertised, so build each variant once per listener.
+ */
+static const char *
+smtp_ehlo_caps(struct smtp_session *s)
+{
+	char	**caps;
+	int	  r;
+
+	caps = &s->listener->ehlo[(ADVERTISE_TLS(s) ? 1 : 0) |
+	    (ADVERTISE_AUTH(s) ? 2 : 0)];
+	if (*caps)
+		return (*caps);
+
+	r = asprintf(caps,
+	    "250-8BITMIME\r\n"
+	    "250-ENHANCEDSTATUSCODES\r\n"
+	    "250-PIPELINING\r\n"
+	    "250-CHUNKING\r\n"
+	    "250-SIZE %zu\r\n"
+	    "%s%s%s"
+	    "250 HELP\r\n",
+	    env->sc_maxsize,
+	    ADVERTISE_EXT_DSN(s) ? "250-DSN\r\n" : "",
+	    ADVERTISE_TLS(s) ? "250-STARTTLS\r\n" : "",
+	    ADVERTISE_AUTH(s) ? "250-AUTH PLAIN LOGIN\r\n" : "");
+	if (r == -1)
+		fatal("smtp_ehlo_caps: asprintf");
+
+	return (*caps);
 }
 
 static void
@@ -1936,8 +2678,7 @@ smtp_proceed_rollback(struct smtp_session *s, const char *args)
 
 	tx = s->tx;
 
-	fclose(tx->ofile);
-	tx->ofile = NULL;
+	smtp_message_close(tx);
 
 	smtp_tx_rollback(tx);
 	smtp_tx_free(tx);
@@ -1975,9 +2716,10 @@ smtp_rfc4954_auth_plain(struct smtp_session *s, char *arg)
 		if (user == NULL || user >= buf + len - 2)
 			goto abort;
 		user++; /* skip NUL */
-		if (strlcpy(s->username, user, sizeof(s->username))
-		    >= sizeof(s->username))
+		if (strlen(user) >= SMTPD_MAXMAILADDRSIZE)
 			goto abort;
+		free(s->username);
+		s->username = xstrdup(user);
 
 		pass = memchr(user, '\0', len - (user - buf));
 		if (pass == NULL || pass >= buf + len - 2)
@@ -2020,10 +2762,12 @@ smtp_rfc4954_auth_login(struct smtp_session *s, char *arg)
 		return;
 
 	case STATE_AUTH_USERNAME:
-		memset(s->username, 0, sizeof(s->username));
-		if (base64_decode(arg, (unsigned char *)s->username,
-				  sizeof(s->username) - 1) == -1)
+		memset(buf, 0, sizeof(buf));
+		if (base64_decode(arg, (unsigned char *)buf,
+				  SMTPD_MAXMAILADDRSIZE - 1) == -1)
 			goto abort;
+		free(s->username);
+		s->username = xstrdup(buf);
 
 		smtp_enter_state(s, STATE_AUTH_PASSWORD);
 		smtp_reply(s, "334 UGFzc3dvcmQ6");
@@ -2084,12 +2828,31 @@ smtp_connected(struct smtp_session *s)
 	smtp_report_link_connect(s, s->rdns, s->fcrdns, &s->ss,
 	    &s->listener->ss);
 
+	if (s->proxy) {
+		log_info("%016"PRIx64" smtp tls ciphers=%s proxied=yes",
+		    s->id, smtp_proxy_tls_text(s->proxy));
+		smtp_report_link_tls(s, smtp_proxy_tls_text(s->proxy));
+	}
+
 	smtp_filter_phase(FILTER_CONNECT, s, ss_to_text(&s->ss));
 }
 
 static void
 smtp_proceed_connected(struct smtp_session *s)
 {
+	struct timeval	tv;
+
+	if (queue_pressure >= QUEUE_PRESSURE_BUSY &&
+	    !smtp_pressure_exempt(s) && !evtimer_initialized(&s->pause)) {
+		log_debug("debug: smtp: %p: queue busy, delaying banner", s);
+		stat_increment("smtp.pressure.delayed", 1);
+		tv.tv_sec = SMTP_PRESSURE_DELAY;
+		tv.tv_usec = 0;
+		evtimer_set(&s->pause, smtp_pressure_resume, s);
+		evtimer_add(&s->pause, &tv);
+		return;
+	}
+
 	if (s->listener->flags & F_SMTPS)
 		smtp_tls_init(s);
 	else
@@ -2112,14 +2875,103 @@ smtp_enter_state(struct smtp_session *s, int newstate)
 	    smtp_strstate(newstate));
 
 	s->state = newstate;
+	io_set_timeout(s->io, smtp_session_timeout(s));
+}
+
+static void
+smtp_session_idle(struct smtp_session *s)
+{
+	if (s->listener == env->sc_sock_listener)
+		return;
+	if (s->idle)
+		TAILQ_REMOVE(&idle_sessions, s, idle_entry);
+	TAILQ_INSERT_TAIL(&idle_sessions, s, idle_entry);
+	s->idle = 1;
+	s->active = time(NULL);
+}
+
+static void
+smtp_session_busy(struct smtp_session *s)
+{
+	if (!s->idle)
+		return;
+	TAILQ_REMOVE(&idle_sessions, s, idle_entry);
+	s->idle = 0;
+}
+
+static void
+smtp_session_touch(struct smtp_session *s)
+{
+	if (s->idle)
+		smtp_session_idle(s);
+}
+
+static int
+smtp_session_timeout(struct smtp_session *s)
+{
+	int	occupancy, timeout, min;
+
+	timeout = SMTPD_SESSION_TIMEOUT;
+	if (s->listener == env->sc_sock_listener)
+		return (timeout * 1000);
+
+	min = SMTP_TIMEOUT_MIN;
+	if (s->state == STATE_BODY || s->state == STATE_BDAT)
+		min *= 2;
+
+	occupancy = smtp_occupancy();
+	if (occupancy > SMTP_TIMEOUT_OCCUPANCY)
+		timeout -= (timeout - min) *
+		    (occupancy - SMTP_TIMEOUT_OCCUPANCY) /
+		    (100 - SMTP_TIMEOUT_OCCUPANCY);
+	if (timeout < min)
+		timeout = min;
+
+	return (timeout * 1000);
+}
+
+int
+smtp_session_reapable(void)
+{
+	struct smtp_session	*s;
+
+	smtp_session_init();
+
+	s = TAILQ_FIRST(&idle_sessions);
+	return (s && time(NULL) - s->active >= SMTP_REAP_IDLE);
+}
+
+/*
+ * Make room for a new connection at the cap.  Return 1 if a session
+ * was freed.
+ */
+int
+smtp_session_reap(void)
+{
+	struct smtp_session	*s;
+	time_t			 idle;
+
+	if (!smtp_session_reapable())
+		return (0);
+	s = TAILQ_FIRST(&idle_sessions);
+	idle = time(NULL) - s->active;
+
+	log_info("%016"PRIx64" smtp disconnected "
+	    "reason=reaped idle=%lld",
+	    s->id, (long long)idle);
+	stat_increment("smtp.session.reaped", 1);
+	smtp_report_timeout(s);
+	smtp_free(s, "reaped");
+	return (1);
 }
 
 static void
 smtp_reply(struct smtp_session *s, char *fmt, ...)
 {
-	va_list	 ap;
-	int	 n;
-	char	 buf[LINE_MAX*2], tmp[LINE_MAX*2];
+	struct timeval	 tv;
+	va_list		 ap;
+	int		 n;
+	char		 buf[LINE_MAX*2], tmp[LINE_MAX*2];
 
 	va_start(ap, fmt);
 	n = vsnprintf(buf, sizeof buf, fmt, ap);
@@ -2137,6 +2989,7 @@ smtp_reply(struct smtp_session *s, char *fmt, ...)
 
 	log_trace(TRACE_SMTP, "smtp: %p: >>> %s", s, buf);
 	smtp_report_protocol_server(s, buf);
+	smtp_session_idle(s);
 
 	switch (buf[0]) {
 	case '2':
@@ -2196,7 +3049,8 @@ smtp_reply(struct smtp_session *s, char *fmt, ...)
 			    s->id, n, buf);
 		}
 		else {
-			strnvis(tmp, s->cmd, sizeof tmp, VIS_SAFE | VIS_CSTYLE);
+			strnvis(tmp, s->cmd ? s->cmd : "", sizeof tmp,
+			    VIS_SAFE | VIS_CSTYLE);
 			log_info("%016"PRIx64" smtp "
 			    "failed-command command=\"%s\" "
 			    "result=\"%.*s\"",
@@ -2205,7 +3059,75 @@ smtp_reply(struct smtp_session *s, char *fmt, ...)
 		break;
 	}
 
-	io_xprintf(s->io, "%s\r\n", buf);
+	if (n > (int)sizeof buf - 3)
+		n = sizeof buf - 3;
+	buf[n++] = '\r';
+	buf[n++] = '\n';
+	if (io_write(s->io, buf, n) == -1)
+		fatal("smtp_reply: io_write");
+
+	/* last line of the reply to a pipelined command */
+	if (s->flags & SF_PIPELINED && buf[3] != '-') {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add(&s->pipeline, &tv);
+	}
+}
+
+/*
+ * Queue a block of complete CRLF-terminated reply lines.  Sessions
+ * reporting protocol-server events go through smtp_reply() for each
+ * line so that every line is reported, others get the block queued in
+ * one go.
+ */
+static void
+smtp_reply_lines(struct smtp_session *s, const char *lines)
+{
+	struct timeval	 tv;
+	const char	*p, *last = lines;
+	size_t		 len;
+
+	if (SESSION_FILTERED(s) &&
+	    report_smtp_wanted("smtp-in", REPORT_PROTOCOL_SERVER)) {
+		for (p = lines; *p; p += len + 2) {
+			len = strcspn(p, "\r");
+			smtp_reply(s, "%.*s", (int)len, p);
+		}
+		return;
+	}
+
+	for (p = lines; *p; p += len + 2) {
+		len = strcspn(p, "\r");
+		log_trace(TRACE_SMTP, "smtp: %p: >>> %.*s", s, (int)len, p);
+		last = p;
+	}
+	io_xprint(s->io, lines);
+
+	if (s->flags & SF_PIPELINED && last[3] != '-') {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add(&s->pipeline, &tv);
+	}
+}
+
+/*
+ * Keep the command line, and a second copy for smtp_command() to split,
+ * in a buffer that only grows to fit the longest command seen.
+ */
+static void
+smtp_set_cmd(struct smtp_session *s, const char *line, size_t len)
+{
+	char	*p;
+
+	if (2 * (len + 1) > s->cmdsize) {
+		if ((p = realloc(s->cmd, 2 * (len + 1))) == NULL)
+			fatal("smtp_set_cmd: realloc");
+		s->cmd = p;
+		s->cmdsize = 2 * (len + 1);
+	}
+	memcpy(s->cmd, line, len + 1);
+	s->cmdbuf = s->cmd + len + 1;
+	memcpy(s->cmdbuf, line, len + 1);
 }
 
 static void
@@ -2217,18 +3139,37 @@ smtp_free(struct smtp_session *s, const char * reason)
 		smtp_tx_free(s->tx);
 	}
 
+	evtimer_del(&s->pipeline);
+	if (evtimer_initialized(&s->pause))
+		evtimer_del(&s->pause);
+	smtp_session_busy(s);
+
 	smtp_report_link_disconnect(s);
 	smtp_filter_end(s);
 
-	if (s->flags & SF_SECURE && s->listener->flags & F_SMTPS)
+	if (s->proxy)
+		stat_decrement("smtp.proxy.tls", 1);
+	else if (s->flags & SF_SECURE && s->listener->flags & F_SMTPS)
 		stat_decrement("smtp.smtps", 1);
-	if (s->flags & SF_SECURE && s->listener->flags & F_STARTTLS)
+	else if (s->flags & SF_SECURE && s->listener->flags & F_STARTTLS)
 		stat_decrement("smtp.tls", 1);
 
+	if (s->listener->pkitable[0] && io_tls(s->io))
+		smtp_sni_release(io_tls(s->io));
+	if (s->flags & SF_TLSWAIT)
+		tree_xpop(&wait_tls, s->id);
 	io_free(s->io);
+	free(s->rdns);
+	free(s->proxy);
+	free(s->tls);
+	free(s->servername);
+	free(s->helo);
+	free(s->cmd);
+	free(s->username);
+
+	smtp_collect(&s->ss);
+	memory_free(MEMORY_SMTP, sizeof(*s));
 	free(s);
-
-	smtp_collect();
 }
 
 static int
@@ -2302,6 +3243,20 @@ smtp_auth_failure_pause(struct smtp_session *s)
 	evtimer_add(&s->pause, &tv);
 }
 
+static int
+smtp_pressure_exempt(struct smtp_session *s)
+{
+	return (s->flags & SF_AUTHENTICATED ||
+	    s->listener->flags & F_AUTH_REQUIRE ||
+	    s->listener == env->sc_sock_listener);
+}
+
+static void
+smtp_pressure_resume(int fd, short event, void *p)
+{
+	smtp_proceed_connected(p);
+}
+
 static int
 smtp_tx(struct smtp_session *s)
 {
@@ -2310,6 +3265,7 @@ smtp_tx(struct smtp_session *s)
 	tx = calloc(1, sizeof(*tx));
 	if (tx == NULL)
 		return 0;
+	memory_alloc(MEMORY_SMTP, sizeof(*tx));
 
 	TAILQ_INIT(&tx->rcpts);
 
@@ -2322,7 +3278,9 @@ smtp_tx(struct smtp_session *s)
 	(void)strlcpy(tx->evp.smtpname, s->smtpname, sizeof(tx->evp.smtpname));
 	(void)strlcpy(tx->evp.hostname, s->rdns, sizeof tx->evp.hostname);
 	(void)strlcpy(tx->evp.helo, s->helo, sizeof(tx->evp.helo));
-	(void)strlcpy(tx->evp.username, s->username, sizeof(tx->evp.username));
+	if (s->username)
+		(void)strlcpy(tx->evp.username, s->username,
+		    sizeof(tx->evp.username));
 
 	if (s->flags & SF_BOUNCE)
 		tx->evp.flags |= EF_BOUNCE;
@@ -2330,6 +3288,7 @@ smtp_tx(struct smtp_session *s)
 		tx->evp.flags |= EF_AUTHENTICATED;
 
 	if ((tx->parser = rfc5322_parser_new()) == NULL) {
+		memory_free(MEMORY_SMTP, sizeof(*tx));
 		free(tx);
 		return 0;
 	}
@@ -2343,20 +3302,63 @@ smtp_tx_free(struct smtp_tx *tx)
 	struct smtp_rcpt *rcpt;
 
 	rfc5322_free(tx->parser);
+	msgindex_free(&tx->index);
 
 	while ((rcpt = TAILQ_FIRST(&tx->rcpts))) {
 		TAILQ_REMOVE(&tx->rcpts, rcpt, entry);
+		memory_free(MEMORY_SMTP, sizeof(*rcpt));
 		free(rcpt);
 	}
 
 	if (tx->ofile)
-		fclose(tx->ofile);
+		smtp_message_close(tx);
+
+	if (tx->chunkbuf)
+		memory_free(MEMORY_SMTP, SMTP_LINE_MAX);
+	free(tx->chunkbuf);
+	dkim_sign_free(tx->dkim);
 
 	tx->session->tx = NULL;
 
+	memory_free(MEMORY_SMTP, sizeof(*tx));
 	free(tx);
 }
 
+static void
+smtp_tx_dlog(struct smtp_tx *tx, struct smtp_rcpt *rcpt)
+{
+	struct smtp_session	*s = tx->session;
+	struct dlog		 d;
+	char			 sender[LINE_MAX], dest[LINE_MAX];
+
+	(void)snprintf(sender, sizeof(sender), "%s%s%s",
+	    tx->evp.sender.user,
+	    tx->evp.sender.user[0] == '\0' ? "" : "@",
+	    tx->evp.sender.domain);
+	(void)snprintf(dest, sizeof(dest), "%s%s%s",
+	    rcpt->maddr.user,
+	    rcpt->maddr.user[0] == '\0' ? "" : "@",
+	    rcpt->maddr.domain);
+
+	memset(&d, 0, sizeof(d));
+	d.type = DLOG_SMTP;
+	d.result = DLOG_OK;
+	d.evpid = rcpt->evpid;
+	d.session = s->id;
+	d.creation = time(NULL);
+	d.size = tx->odatalen;
+	d.sender = sender;
+	d.rcpt = dest;
+	d.relay = s->rdns;
+	d.source = ss_to_text(&s->ss);
+	if (s->tls)
+		d.tls = smtp_tls_text(s);
+	else if (s->proxy)
+		d.tls = smtp_proxy_tls_text(s->proxy);
+	d.status = "Accepted";
+	logger_delivery(&d);
+}
+
 static void
 smtp_tx_mail_from(struct smtp_tx *tx, const char *line)
 {
@@ -2381,8 +3383,12 @@ smtp_tx_mail_from(struct smtp_tx *tx, const char *line)
 
 		if (strncasecmp(opt, "AUTH=", 5) == 0)
 			log_debug("debug: smtp: AUTH in MAIL FROM command");
-		else if (strncasecmp(opt, "SIZE=", 5) == 0)
+		else if (strncasecmp(opt, "SIZE=", 5) == 0) {
 			log_debug("debug: smtp: SIZE in MAIL FROM command");
+			/* only a hint for the spool preallocation */
+			tx->msgsize = strtonum(opt + 5, 0, env->sc_maxsize,
+			    NULL);
+		}
 		else if (strcasecmp(opt, "BODY=7BIT") == 0)
 			/* XXX only for this transaction */
 			tx->session->flags &= ~SF_8BITMIME;
@@ -2513,6 +3519,7 @@ smtp_tx_rcpt_to(struct smtp_tx *tx, const char *line)
 	m_add_envelope(p_lka, &tx->evp);
 	m_close(p_lka);
 	tree_xset(&wait_lka_rcpt, tx->session->id, tx->session);
+	clock_gettime(CLOCK_MONOTONIC, &tx->session->t_wait);
 }
 
 static void
@@ -2525,14 +3532,27 @@ smtp_tx_open_message(struct smtp_tx *tx)
 	tree_xset(&wait_queue_fd, tx->session->id, tx->session);
 }
 
+/*
+ * The header index built while parsing goes along with the commit, for
+ * the queue to store next to the message.
+ */
 static void
 smtp_tx_commit(struct smtp_tx *tx)
 {
+	const void	*idx;
+	size_t		 idxlen = 0;
+
+	if ((idx = msgindex_end(&tx->index, tx->hdrend, tx->body,
+	    &idxlen)) == NULL)
+		idx = "";
+
 	m_create(p_queue, IMSG_SMTP_MESSAGE_COMMIT, 0, 0, -1);
 	m_add_id(p_queue, tx->session->id);
 	m_add_msgid(p_queue, tx->msgid);
+	m_add_data(p_queue, idx, idxlen);
 	m_close(p_queue);
 	tree_xset(&wait_queue_commit, tx->session->id, tx->session);
+	clock_gettime(CLOCK_MONOTONIC, &tx->session->t_wait);
 	smtp_filter_data_end(tx->session);
 }
 
@@ -2550,9 +3570,6 @@ smtp_tx_rollback(struct smtp_tx *tx)
 static int
 smtp_tx_dataline(struct smtp_tx *tx, const char *line)
 {
-	struct rfc5322_result res;
-	int r;
-
 	log_trace(TRACE_SMTP, "<<< [MSG] %s", line);
 
 	if (!strcmp(line, ".")) {
@@ -2572,6 +3589,20 @@ smtp_tx_dataline(struct smtp_tx *tx, const char *line)
 			line += 1;
 	}
 
+	return smtp_tx_parse(tx, line);
+}
+
+static int
+smtp_tx_parse(struct smtp_tx *tx, const char *line)
+{
+	struct rfc5322_result res;
+	int r;
+
+	if (tx->inbody && line) {
+		smtp_message_putline(tx, line);
+		return 0;
+	}
+
 	if (rfc5322_push(tx->parser, line) == -1) {
 		log_warnx("failed to push dataline");
 		tx->error = TX_ERROR_INTERNAL;
@@ -2597,6 +3628,8 @@ smtp_tx_dataline(struct smtp_tx *tx, const char *line)
 			if (!strcasecmp("Bcc", res.hdr))
 				continue;
 
+			tx->hdroff = tx->owritten;
+
 			if (!strcasecmp("To", res.hdr) ||
 			    !strcasecmp("Cc", res.hdr) ||
 			    !strcasecmp("From", res.hdr)) {
@@ -2632,11 +3665,15 @@ smtp_tx_dataline(struct smtp_tx *tx, const char *line)
 			break;
 
 		case RFC5322_HEADER_END:
+			if (!strcasecmp("Bcc", res.hdr))
+				break;
 			if (!strcasecmp("To", res.hdr) ||
 			    !strcasecmp("Cc", res.hdr) ||
 			    !strcasecmp("From", res.hdr))
 				header_domain_append_callback(tx, res.hdr,
 				    res.value);
+			msgindex_add(&tx->index, res.hdr, tx->hdroff,
+			    tx->owritten);
 			break;
 
 		case RFC5322_END_OF_HEADERS:
@@ -2645,23 +3682,36 @@ smtp_tx_dataline(struct smtp_tx *tx, const char *line)
 
 				if (!tx->has_date) {
 					log_debug("debug: %p: adding Date", tx);
+					tx->hdroff = tx->owritten;
 					smtp_message_printf(tx, "Date: %s\n",
 					    time_to_text(tx->time));
+					msgindex_add(&tx->index, "Date",
+					    tx->hdroff, tx->owritten);
 				}
 
 				if (!tx->has_message_id) {
 					log_debug("debug: %p: adding Message-ID", tx);
+					tx->hdroff = tx->owritten;
 					smtp_message_printf(tx,
 					    "Message-ID: <%016"PRIx64"@%s>\n",
 					    generate_uid(),
 					    tx->session->listener->hostname);
+					msgindex_add(&tx->index, "Message-ID",
+					    tx->hdroff, tx->owritten);
 				}
 			}
+			tx->hdrend = tx->body = tx->owritten;
 			break;
 
 		case RFC5322_BODY_START:
+			/* the parser has nothing more to do with the body */
+			tx->inbody = 1;
+			smtp_message_putline(tx, res.value);
+			tx->body = tx->owritten;
+			break;
+
 		case RFC5322_BODY:
-			smtp_message_printf(tx, "%s\n", res.value);
+			smtp_message_putline(tx, res.value);
 			break;
 
 		case RFC5322_END_OF_MESSAGE:
@@ -2684,15 +3734,161 @@ smtp_tx_filtered_dataline(struct smtp_tx *tx, const char *line)
 			return 0;
 	}
 	io_printf(tx->filter, "%s\n", line ? line : ".");
+	smtp_filter_hiwat(tx);
 	return line ? 0 : 1;
 }
 
+/*
+ * BDAT chunks carry the message verbatim, with no dot-stuffing and with
+ * no regard for line boundaries.  Reassemble them into lines for the
+ * header processing done on DATA.
+ */
+static void
+smtp_tx_chunk(struct smtp_tx *tx, const char *data, size_t len)
+{
+	const char	*nl;
+	size_t		 n;
+
+	tx->datain += len;
+	if (tx->datain > env->sc_maxsize)
+		tx->error = TX_ERROR_SIZE;
+
+	if (tx->chunkbuf == NULL) {
+		tx->chunkbuf = xmalloc(SMTP_LINE_MAX);
+		memory_alloc(MEMORY_SMTP, SMTP_LINE_MAX);
+	}
+
+	while (len && !tx->error) {
+		nl = memchr(data, '\n', len);
+		n = nl ? (size_t)(nl - data) : len;
+		if (tx->chunklen + n >= SMTP_LINE_MAX) {
+			tx->error = TX_ERROR_MALFORMED;
+			return;
+		}
+		memcpy(tx->chunkbuf + tx->chunklen, data, n);
+		tx->chunklen += n;
+		if (nl == NULL)
+			return;
+		data += n + 1;
+		len -= n + 1;
+		smtp_tx_chunkline(tx);
+	}
+}
+
+static void
+smtp_tx_chunkline(struct smtp_tx *tx)
+{
+	char	*line = tx->chunkbuf;
+	size_t	 len = tx->chunklen;
+
+	tx->chunklen = 0;
+
+	/* Strip trailing '\r' */
+	if (len && line[len - 1] == '\r')
+		len--;
+	line[len] = '\0';
+
+	log_trace(TRACE_SMTP, "<<< [MSG] %s", line);
+
+	/* filters speak the DATA protocol, so stuff the dots back in */
+	if (tx->filter) {
+		io_printf(tx->filter, "%s%s\n", line[0] == '.' ? "." : "",
+		    line);
+		smtp_filter_hiwat(tx);
+	} else
+		(void)smtp_tx_parse(tx, line);
+}
+
 static void
 smtp_tx_eom(struct smtp_tx *tx)
 {
+	smtp_session_busy(tx->session);
 	smtp_filter_phase(FILTER_COMMIT, tx->session, NULL);
 }
 
+/*
+ * Sign messages from senders in a domain with a DKIM key.  A header of
+ * the size of the signature is reserved at the top of the spool file
+ * and overwritten once the message is complete.
+ */
+static void
+smtp_tx_dkim_begin(struct smtp_tx *tx)
+{
+	struct dkim_sign	*ds;
+	struct dkim		*dkim;
+	const char		*hdr;
+	char			 domain[HOST_NAME_MAX+1];
+	size_t			 len;
+
+	if (tx->evp.sender.domain[0] == '\0' || tx->odatalen != 0)
+		return;
+
+	xlowercase(domain, tx->evp.sender.domain, sizeof(domain));
+	if ((dkim = dict_get(env->sc_dkim_dict, domain)) == NULL)
+		return;
+
+	if ((ds = dkim_sign_new(dkim, time(NULL))) == NULL) {
+		tx->error = TX_ERROR_RESOURCES;
+		return;
+	}
+	hdr = dkim_sign_placeholder(ds, &len);
+	smtp_message_write(tx, hdr, len);
+	msgindex_add(&tx->index, "DKIM-Signature", 0, tx->owritten);
+	tx->dkim = ds;
+}
+
+static void
+smtp_tx_dkim_sign(struct smtp_tx *tx)
+{
+	struct smtp_session	*s = tx->session;
+	unsigned char		 md[EVP_MAX_MD_SIZE];
+	char			 domain[HOST_NAME_MAX+1];
+	size_t			 mdlen;
+
+	if (!dkim_sign_digest(tx->dkim, md, &mdlen)) {
+		log_warnx("warn: smtp-in: session %016"PRIx64": dkim digest",
+		    s->id);
+		dkim_sign_free(tx->dkim);
+		tx->dkim = NULL;
+		tx->error = TX_ERROR_INTERNAL;
+		smtp_message_end(tx);
+		return;
+	}
+
+	xlowercase(domain, tx->evp.sender.domain, sizeof(domain));
+	m_create(p_ca, IMSG_CA_DKIM_SIGN, 0, 0, -1);
+	m_add_id(p_ca, s->id);
+	m_add_string(p_ca, domain);
+	m_add_data(p_ca, md, mdlen);
+	m_close(p_ca);
+	tree_xset(&wait_ca_dkim, s->id, s);
+}
+
+static void
+smtp_tx_dkim_signed(struct smtp_tx *tx, const void *sig, size_t siglen)
+{
+	char	*hdr = NULL;
+	size_t	 len;
+
+	if (sig)
+		hdr = dkim_sign_final(tx->dkim, sig, siglen, &len);
+	dkim_sign_free(tx->dkim);
+	tx->dkim = NULL;
+
+	if (hdr == NULL)
+		tx->error = TX_ERROR_INTERNAL;
+	else if (fflush(tx->ofile) == EOF ||
+	    pwrite(fileno(tx->ofile), hdr, len, 0) != (ssize_t)len) {
+		log_warn("smtp-in: session %016"PRIx64": dkim pwrite",
+		    tx->session->id);
+		tx->error = TX_ERROR_IO;
+	} else
+		stat_increment("smtp.dkim.signed", 1);
+	free(hdr);
+
+	smtp_message_end(tx);
+}
+
 static int
 smtp_message_fd(struct smtp_tx *tx, int fd)
 {
@@ -2709,9 +3905,69 @@ smtp_message_fd(struct smtp_tx *tx, int fd)
 		smtp_enter_state(s, STATE_QUIT);
 		return 0;
 	}
+
+	/* the spool file is written in large blocks, not per line */
+	tx->obuf = xmalloc(SPOOL_BUFSIZE);
+	if (setvbuf(tx->ofile, tx->obuf, _IOFBF, SPOOL_BUFSIZE) != 0) {
+		free(tx->obuf);
+		tx->obuf = NULL;
+	}
+	else
+		memory_alloc(MEMORY_SMTP, SPOOL_BUFSIZE);
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+	/*
+	 * Reserve the announced size at once.  Unlike posix_fallocate(),
+	 * this neither changes the file size nor falls back to writing
+	 * zeroes where the filesystem cannot do it.
+	 */
+	if (tx->msgsize >= SPOOL_BUFSIZE &&
+	    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, tx->msgsize) == -1 &&
+	    errno != EOPNOTSUPP && errno != ENOSYS)
+		log_debug("debug: smtp: %p: fallocate: %s", s, strerror(errno));
+#endif
 	return 1;
 }
 
+/*
+ * Start the writeback of large messages as they come, so that most of
+ * the data is on disk by the time the queue syncs the file at commit.
+ */
+static void
+smtp_message_writeback(struct smtp_tx *tx, size_t len)
+{
+	tx->owritten += len;
+
+#ifdef HAVE_SYNC_FILE_RANGE
+	if (tx->owritten - tx->osynced < SPOOL_SYNC_INTERVAL)
+		return;
+
+	if (fflush(tx->ofile) == EOF) {
+		log_warn("smtp-in: session %016"PRIx64": fflush", tx->session->id);
+		tx->error = TX_ERROR_IO;
+		return;
+	}
+	(void)sync_file_range(fileno(tx->ofile), tx->osynced,
+	    tx->owritten - tx->osynced, SYNC_FILE_RANGE_WRITE);
+	tx->osynced = tx->owritten;
+#endif
+}
+
+/* flushing the buffer can fail too, which fails the transaction */
+static void
+smtp_message_close(struct smtp_tx *tx)
+{
+	if (fclose(tx->ofile) == EOF && tx->error == TX_OK) {
+		log_warn("smtp-in: session %016"PRIx64": fclose", tx->session->id);
+		tx->error = TX_ERROR_IO;
+	}
+	tx->ofile = NULL;
+	if (tx->obuf)
+		memory_free(MEMORY_SMTP, SPOOL_BUFSIZE);
+	free(tx->obuf);
+	tx->obuf = NULL;
+}
+
 static void
 filter_session_io(struct io *io, int evt, void *arg)
 {
@@ -2736,9 +3992,31 @@ filter_session_io(struct io *io, int evt, void *arg)
 		}
 
 		goto nextline;
+
+	case IO_LOWAT:
+		if (tx->filter_paused) {
+			tx->filter_paused = 0;
+			io_resume(tx->session->io, IO_IN);
+		}
+		break;
 	}
 }
 
+/*
+ * Stop reading the message from the client while the filters have too
+ * much of it queued, until the queue is back down to filter-lowat.
+ */
+static void
+smtp_filter_hiwat(struct smtp_tx *tx)
+{
+	if (tx->filter_paused || io_queued(tx->filter) < env->sc_filter_hiwat)
+		return;
+
+	tx->filter_paused = 1;
+	io_pause(tx->session->io, IO_IN);
+	stat_increment("smtp.filter.backpressure", 1);
+}
+
 static void
 smtp_filter_fd(struct smtp_tx *tx, int fd)
 {
@@ -2751,6 +4029,7 @@ smtp_filter_fd(struct smtp_tx *tx, int fd)
 	tx->filter = io_new();
 	io_set_fd(tx->filter, fd);
 	io_set_callback(tx->filter, filter_session_io, tx);
+	io_set_lowat(tx->filter, env->sc_filter_lowat);
 }
 
 static void
@@ -2768,12 +4047,19 @@ smtp_message_begin(struct smtp_tx *tx)
 
 	log_debug("smtp: %p: message begin", s);
 
-	smtp_reply(s, "354 Enter mail, end with \".\""
-	    " on a line by itself");
+	if (s->listener->flags & F_DKIM_SIGN)
+		smtp_tx_dkim_begin(tx);
 
-	if (s->junk || (s->tx && s->tx->junk))
+	/* headers sent to the filters are indexed as they come back */
+	if (s->junk || (s->tx && s->tx->junk)) {
+		tx->hdroff = tx->owritten;
 		m_printf(tx, "X-Spam: Yes\n");
+		if (tx->filter == NULL)
+			msgindex_add(&tx->index, "X-Spam", tx->hdroff,
+			    tx->owritten);
+	}
 
+	tx->hdroff = tx->owritten;
 	m_printf(tx, "Received: ");
 	if (!(s->listener->flags & F_MASK_SOURCE)) {
 		m_printf(tx, "from %s (%s %s%s%s)",
@@ -2792,16 +4078,21 @@ smtp_message_begin(struct smtp_tx *tx)
 	    tx->msgid);
 
 	if (s->flags & SF_SECURE) {
-		m_printf(tx, " (%s:%s:%d:%s)",
-		    tls_conn_version(io_tls(s->io)),
-		    tls_conn_cipher(io_tls(s->io)),
-		    tls_conn_cipher_strength(io_tls(s->io)),
-		    (s->flags & SF_VERIFIED) ? "YES" : "NO");
+		if (s->proxy)
+			m_printf(tx, " (%s:%s)",
+			    smtp_proxy_tls_text(s->proxy),
+			    (s->flags & SF_VERIFIED) ? "YES" : "NO");
+		else
+			m_printf(tx, " (%s:%s:%d:%s)",
+			    s->tls->version,
+			    s->tls->cipher,
+			    s->tls->strength,
+			    (s->flags & SF_VERIFIED) ? "YES" : "NO");
 
 		if (s->listener->flags & F_RECEIVEDAUTH) {
 			m_printf(tx, " auth=%s",
-			    s->username[0] ? "yes" : "no");
-			if (s->username[0])
+			    s->username ? "yes" : "no");
+			if (s->username)
 				m_printf(tx, " user=%s", s->username);
 		}
 	}
@@ -2814,7 +4105,16 @@ smtp_message_begin(struct smtp_tx *tx)
 	}
 
 	m_printf(tx, ";\n\t%s\n", time_to_text(time(&tx->time)));
+	if (tx->filter == NULL)
+		msgindex_add(&tx->index, "Received", tx->hdroff, tx->owritten);
 
+	if (s->last_cmd == CMD_BDAT) {
+		smtp_bdat_read(s);
+		return;
+	}
+
+	smtp_reply(s, "354 Enter mail, end with \".\""
+	    " on a line by itself");
 	smtp_enter_state(s, STATE_BODY);
 }
 
@@ -2825,10 +4125,14 @@ smtp_message_end(struct smtp_tx *tx)
 
 	s = tx->session;
 
-	log_debug("debug: %p: end of message, error=%d", s, tx->error);
+	if (tx->dkim && tx->error == TX_OK) {
+		smtp_tx_dkim_sign(tx);
+		return;
+	}
 
-	fclose(tx->ofile);
-	tx->ofile = NULL;
+	smtp_message_close(tx);
+
+	log_debug("debug: %p: end of message, error=%d", s, tx->error);
 
 	switch(tx->error) {
 	case TX_OK:
@@ -2902,19 +4206,76 @@ smtp_message_printf(struct smtp_tx *tx, const char *fmt, ...)
 		return -1;
 
 	va_start(ap, fmt);
-	len = vfprintf(tx->ofile, fmt, ap);
+	if (tx->dkim == NULL)
+		len = vfprintf(tx->ofile, fmt, ap);
+	else
+		len = smtp_message_vdkim(tx, fmt, ap);
 	va_end(ap);
 
 	if (len == -1) {
 		log_warn("smtp-in: session %016"PRIx64": vfprintf", tx->session->id);
 		tx->error = TX_ERROR_IO;
 	}
-	else
+	else {
 		tx->odatalen += len;
+		smtp_message_writeback(tx, len);
+	}
 
 	return len;
 }
 
+/*
+ * Headers of a message being signed are also given to the signer, as
+ * they are written.
+ */
+static int
+smtp_message_vdkim(struct smtp_tx *tx, const char *fmt, va_list ap)
+{
+	char	*buf;
+	int	 len;
+
+	if ((len = vasprintf(&buf, fmt, ap)) == -1)
+		return -1;
+
+	dkim_sign_header(tx->dkim, buf, len);
+	if (fwrite(buf, 1, len, tx->ofile) != (size_t)len)
+		len = -1;
+	free(buf);
+
+	return len;
+}
+
+/*
+ * Same as smtp_message_printf(tx, "%s\n", line), without the format
+ * processing, for body lines.
+ */
+static int
+smtp_message_putline(struct smtp_tx *tx, const char *line)
+{
+	return smtp_message_write(tx, line, strlen(line));
+}
+
+static int
+smtp_message_write(struct smtp_tx *tx, const char *line, size_t len)
+{
+	if (tx->error)
+		return -1;
+
+	if (fwrite(line, 1, len, tx->ofile) != len ||
+	    putc('\n', tx->ofile) == EOF) {
+		log_warn("smtp-in: session %016"PRIx64": fwrite", tx->session->id);
+		tx->error = TX_ERROR_IO;
+		return -1;
+	}
+	tx->odatalen += len + 1;
+	smtp_message_writeback(tx, len + 1);
+
+	if (tx->dkim)
+		dkim_sign_body(tx->dkim, line, len);
+
+	return len + 1;
+}
+
 #define CASE(x) case x : return #x
 
 const char *
@@ -2932,6 +4293,7 @@ smtp_strstate(int state)
 	CASE(STATE_AUTH_PASSWORD);
 	CASE(STATE_AUTH_FINALIZE);
 	CASE(STATE_BODY);
+	CASE(STATE_BDAT);
 	CASE(STATE_QUIT);
 	default:
 		(void)snprintf(buf, sizeof(buf), "STATE_??? (%d)", state);
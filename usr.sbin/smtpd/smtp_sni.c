@@ -0,0 +1,381 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Certificates looked up by TLS server name.
+ *
+ * A listener with a pki table only has its pki certificates configured
+ * at startup.  When a client asks for a server name none of them match,
+ * the handshake is suspended and the name is looked up in the table by
+ * the lka.  The parent reads the certificate and key files it found,
+ * the ca keeps the key and passes the certificate on to us, and the
+ * handshake resumes with a server context built for it.
+ *
+ * These contexts are kept in an LRU for SNI_TTL seconds, and the names
+ * that are not in the table for SNI_NEGATIVE_TTL seconds.  A context
+ * dropped from the LRU is only freed once the handshakes using it are
+ * over, as they still refer to its keypair.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <event.h>
+#include <imsg.h>
+#include <limits.h>
+#include <openssl/async.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define	SNI_CACHE_MAX		1024
+#define	SNI_TTL			3600
+#define	SNI_NEGATIVE_TTL	300
+
+struct sni_cert {
+	TAILQ_ENTRY(sni_cert)	 entry;
+	char			*key;
+	struct tls		*tls;		/* NULL if not in the table */
+	time_t			 expire;
+	int			 refs;		/* handshakes using it */
+	int			 cached;	/* in the LRU */
+};
+
+struct sni_req {
+	uint64_t		 id;
+	struct listener		*listener;
+	char			*key;
+	struct io		*io;		/* the suspended handshake */
+	struct sni_cert		*cert;
+	int			 done;
+	int			 orphan;
+};
+
+static struct tls *smtp_sni_lookup(void *, struct tls *, const char *);
+static struct sni_cert *smtp_sni_get(const char *);
+static struct sni_cert *smtp_sni_add(const char *, struct tls *, time_t);
+static void smtp_sni_uncache(struct sni_cert *);
+static void smtp_sni_unref(struct sni_cert *);
+static struct tls *smtp_sni_use(struct sni_cert *, struct tls *);
+static struct tls *smtp_sni_configure(struct listener *, const void *, size_t);
+static void smtp_sni_done(struct sni_req *, struct sni_cert *);
+static void smtp_sni_cleanup(ASYNC_WAIT_CTX *, const void *, OSSL_ASYNC_FD,
+    void *);
+
+/*
+ * This function is not publicly exported because it is a hack until
+ * libtls has a proper way to load certificates on demand.
+ */
+typedef struct tls *(*tls_sni_cb)(void *, struct tls *, const char *);
+int tls_config_set_sni_cb(struct tls_config *, tls_sni_cb, void *);
+
+static struct dict			 sni_certs;
+static TAILQ_HEAD(sni_lru, sni_cert)	 sni_lru;
+static struct tree			 sni_reqs;
+static struct tree			 sni_conns;
+
+void
+smtp_sni_init(void)
+{
+	dict_init(&sni_certs);
+	TAILQ_INIT(&sni_lru);
+	tree_init(&sni_reqs);
+	tree_init(&sni_conns);
+}
+
+void
+smtp_sni_setup(struct listener *l, struct tls_config *config)
+{
+	if (tls_config_set_sni_cb(config, smtp_sni_lookup, l) == -1)
+		fatalx("tls_config_set_sni_cb: %s", tls_config_error(config));
+}
+
+/*
+ * Called by libtls from the handshake of a listener, for a name that
+ * none of its pki match.
+ */
+static struct tls *
+smtp_sni_lookup(void *arg, struct tls *conn, const char *name)
+{
+	struct listener	*l = arg;
+	struct sni_cert	*c;
+	struct sni_req	*req;
+	ASYNC_JOB	*job;
+	ASYNC_WAIT_CTX	*waitctx;
+	char		 lname[HOST_NAME_MAX+1];
+	char		 key[PATH_MAX + HOST_NAME_MAX + 2];
+
+	if (!lowercase(lname, name, sizeof lname))
+		return (NULL);
+	(void)snprintf(key, sizeof key, "%s:%s", l->pkitable, lname);
+
+	if ((c = smtp_sni_get(key)) != NULL) {
+		stat_increment("smtp.sni.hit", 1);
+		return (smtp_sni_use(c, conn));
+	}
+	stat_increment("smtp.sni.miss", 1);
+
+	req = xcalloc(1, sizeof(*req));
+	req->id = smtp_peer_id();
+	req->listener = l;
+	req->key = xstrdup(key);
+	tree_xset(&sni_reqs, req->id, req);
+
+	m_create(p_lka, IMSG_SMTP_LOOKUP_PKI, 0, 0, -1);
+	m_add_id(p_lka, req->id);
+	m_add_string(p_lka, l->pkitable);
+	m_add_string(p_lka, lname);
+	m_close(p_lka);
+
+	/*
+	 * Without a handshake to suspend, the default certificate is
+	 * presented this time and the one looked up kept for the next.
+	 */
+	if ((job = ASYNC_get_current_job()) == NULL ||
+	    (req->io = io_current()) == NULL) {
+		req->orphan = 1;
+		return (NULL);
+	}
+
+	waitctx = ASYNC_get_wait_ctx(job);
+	if (!ASYNC_WAIT_CTX_set_wait_fd(waitctx, req, -1, req,
+	    smtp_sni_cleanup))
+		fatalx("smtp_sni_lookup: ASYNC_WAIT_CTX_set_wait_fd");
+	while (!req->done)
+		if (!ASYNC_pause_job())
+			fatalx("smtp_sni_lookup: ASYNC_pause_job");
+	ASYNC_WAIT_CTX_clear_fd(waitctx, req);
+
+	c = req->cert;
+	free(req->key);
+	free(req);
+	if (c == NULL)
+		return (NULL);
+
+	conn = smtp_sni_use(c, conn);
+	smtp_sni_unref(c);
+	return (conn);
+}
+
+/*
+ * The handshake of a connection is over, or the connection is gone.
+ */
+void
+smtp_sni_release(struct tls *conn)
+{
+	struct sni_cert	*c;
+
+	if ((c = tree_pop(&sni_conns, (uintptr_t)conn)) != NULL)
+		smtp_sni_unref(c);
+}
+
+void
+smtp_sni_imsg(struct mproc *p, struct imsg *imsg)
+{
+	struct sni_req	*req;
+	struct sni_cert	*c = NULL;
+	struct tls	*tls;
+	struct msg	 m;
+	const void	*cert;
+	size_t		 certlen;
+	uint64_t	 id;
+	int		 ret;
+
+	switch (imsg->hdr.type) {
+	case IMSG_SMTP_LOOKUP_PKI:
+		m_msg(&m, imsg);
+		m_get_id(&m, &id);
+		m_get_int(&m, &ret);
+		m_end(&m);
+
+		req = tree_xpop(&sni_reqs, id);
+		if (ret == LKA_PERMFAIL)
+			c = smtp_sni_add(req->key, NULL, SNI_NEGATIVE_TTL);
+		smtp_sni_done(req, c);
+		return;
+
+	case IMSG_CA_LOAD_PKI:
+		m_msg(&m, imsg);
+		m_get_id(&m, &id);
+		m_get_int(&m, &ret);
+		if (ret)
+			m_get_data(&m, &cert, &certlen);
+		m_end(&m);
+
+		req = tree_xpop(&sni_reqs, id);
+		tls = NULL;
+		if (ret)
+			tls = smtp_sni_configure(req->listener, cert, certlen);
+		if (tls)
+			log_debug("debug: smtp: loaded certificate for %s",
+			    req->key);
+		c = smtp_sni_add(req->key, tls,
+		    tls ? SNI_TTL : SNI_NEGATIVE_TTL);
+		smtp_sni_done(req, c);
+		return;
+	}
+
+	fatalx("smtp_sni_imsg: unexpected %s imsg",
+	    imsg_to_str(imsg->hdr.type));
+}
+
+static void
+smtp_sni_done(struct sni_req *req, struct sni_cert *c)
+{
+	/* nobody is waiting for this one anymore */
+	if (req->orphan) {
+		free(req->key);
+		free(req);
+		return;
+	}
+
+	/* held until the handshake resumes */
+	if (c)
+		c->refs++;
+	req->done = 1;
+	req->cert = c;
+	io_wakeup(req->io);
+}
+
+/*
+ * Called by OpenSSL when the connection of a suspended handshake is
+ * freed before it could be resumed.
+ */
+static void
+smtp_sni_cleanup(ASYNC_WAIT_CTX *ctx, const void *key, OSSL_ASYNC_FD fd,
+    void *arg)
+{
+	struct sni_req	*req = arg;
+
+	if (req->done) {
+		if (req->cert)
+			smtp_sni_unref(req->cert);
+		free(req->key);
+		free(req);
+	}
+	else {
+		req->io = NULL;
+		req->orphan = 1;
+	}
+}
+
+static struct sni_cert *
+smtp_sni_get(const char *key)
+{
+	struct sni_cert	*c;
+
+	if ((c = dict_get(&sni_certs, key)) == NULL)
+		return (NULL);
+	if (c->expire <= time(NULL)) {
+		smtp_sni_uncache(c);
+		return (NULL);
+	}
+	TAILQ_REMOVE(&sni_lru, c, entry);
+	TAILQ_INSERT_HEAD(&sni_lru, c, entry);
+	return (c);
+}
+
+static struct sni_cert *
+smtp_sni_add(const char *key, struct tls *tls, time_t ttl)
+{
+	struct sni_cert	*c;
+
+	/* another handshake may have looked it up in the meantime */
+	if ((c = dict_get(&sni_certs, key)) != NULL)
+		smtp_sni_uncache(c);
+
+	c = xcalloc(1, sizeof(*c));
+	c->key = xstrdup(key);
+	c->tls = tls;
+	c->expire = time(NULL) + ttl;
+	c->cached = 1;
+	dict_xset(&sni_certs, c->key, c);
+	TAILQ_INSERT_HEAD(&sni_lru, c, entry);
+
+	while (dict_count(&sni_certs) > SNI_CACHE_MAX)
+		smtp_sni_uncache(TAILQ_LAST(&sni_lru, sni_lru));
+
+	return (c);
+}
+
+static void
+smtp_sni_uncache(struct sni_cert *c)
+{
+	dict_xpop(&sni_certs, c->key);
+	TAILQ_REMOVE(&sni_lru, c, entry);
+	c->cached = 0;
+	if (c->refs == 0)
+		smtp_sni_unref(c);
+}
+
+static void
+smtp_sni_unref(struct sni_cert *c)
+{
+	if (c->refs && --c->refs)
+		return;
+	if (c->cached)
+		return;
+	tls_free(c->tls);
+	free(c->key);
+	free(c);
+}
+
+static struct tls *
+smtp_sni_use(struct sni_cert *c, struct tls *conn)
+{
+	if (c->tls == NULL)
+		return (NULL);
+
+	smtp_sni_release(conn);
+	c->refs++;
+	tree_xset(&sni_conns, (uintptr_t)conn, c);
+	return (c->tls);
+}
+
+static struct tls *
+smtp_sni_configure(struct listener *l, const void *cert, size_t certlen)
+{
+	struct tls_config	*config;
+	struct tls		*tls = NULL;
+
+	config = smtp_tls_config(l);
+	if (tls_config_set_keypair_mem(config, cert, certlen, NULL, 0) == -1) {
+		log_warnx("warn: smtp: pki table %s: %s", l->pkitable,
+		    tls_config_error(config));
+		goto end;
+	}
+	if ((tls = tls_server()) == NULL)
+		fatal("tls_server");
+	if (tls_configure(tls, config) == -1) {
+		log_warnx("warn: smtp: pki table %s: %s", l->pkitable,
+		    tls_error(tls));
+		tls_free(tls);
+		tls = NULL;
+	}
+
+    end:
+	tls_config_free(config);
+	return (tls);
+}
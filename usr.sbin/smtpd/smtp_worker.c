@@ -0,0 +1,274 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Inbound session workers.
+ *
+ * With "smtp workers", the sessions of the listeners do not run in the
+ * dispatcher but in a set of worker processes.  Each worker binds its
+ * own socket on every listener with SO_REUSEPORT, so that the kernel
+ * spreads the connections between them, and talks to the lka, the
+ * queue and the ca over its own channels.  The dispatcher keeps the
+ * local sessions, for the enqueuer and the bounces.
+ *
+ * Replies to a session are routed by its id, which tells the process
+ * it was made in.  A source spreads over the workers as it connects,
+ * so the per-source and per-network limits are divided between them.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <event.h>
+#include <grp.h> /* needed for setgroups */
+#include <imsg.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+static void smtp_worker_imsg(struct mproc *, struct imsg *);
+static void smtp_worker_limits(void);
+static size_t smtp_worker_share(size_t);
+static void smtp_worker_shutdown(void);
+
+static void
+smtp_worker_imsg(struct mproc *p, struct imsg *imsg)
+{
+	struct msg	m;
+	uint32_t	in, out;
+	int		v;
+
+	if (imsg == NULL)
+		smtp_worker_shutdown();
+
+	switch (imsg->hdr.type) {
+	case IMSG_GETADDRINFO:
+	case IMSG_GETADDRINFO_END:
+	case IMSG_GETNAMEINFO:
+	case IMSG_RES_QUERY:
+		resolver_dispatch_result(p, imsg);
+		return;
+
+	case IMSG_CA_RSA_PRIVENC:
+	case IMSG_CA_RSA_PRIVDEC:
+	case IMSG_CA_ECDSA_SIGN:
+		ca_dispatch_result(p, imsg);
+		return;
+
+	case IMSG_CONF_START:
+		return;
+	case IMSG_CONF_END:
+		smtp_configure();
+		return;
+
+	case IMSG_CTL_VERBOSE:
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		log_trace_verbose(v);
+		return;
+
+	case IMSG_CTL_PROFILE:
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		profiling = v;
+		return;
+
+	case IMSG_REPORT_SMTP_EVENTS:
+		m_msg(&m, imsg);
+		m_get_u32(&m, &in);
+		m_get_u32(&m, &out);
+		m_end(&m);
+		report_smtp_events(in, out);
+		return;
+
+	case IMSG_SMTP_CHECK_SENDER:
+	case IMSG_SMTP_EXPAND_RCPT:
+	case IMSG_SMTP_LOOKUP_HELO:
+	case IMSG_SMTP_LOOKUP_PKI:
+	case IMSG_CA_LOAD_PKI:
+	case IMSG_SMTP_AUTHENTICATE:
+	case IMSG_SMTP_MESSAGE_COMMIT:
+	case IMSG_SMTP_MESSAGE_CREATE:
+	case IMSG_SMTP_MESSAGE_OPEN:
+	case IMSG_CA_DKIM_SIGN:
+	case IMSG_FILTER_SMTP_PROTOCOL:
+	case IMSG_FILTER_SMTP_DATA_BEGIN:
+	case IMSG_FILTER_SMTP_PHASES:
+	case IMSG_QUEUE_ENVELOPE_SUBMIT:
+	case IMSG_QUEUE_ENVELOPE_COMMIT:
+	case IMSG_QUEUE_PRESSURE:
+	case IMSG_TLS_READY:
+	case IMSG_TLS_FAIL:
+	case IMSG_CTL_PAUSE_SMTP:
+	case IMSG_CTL_RESUME_SMTP:
+	case IMSG_RELOAD_LISTENER:
+	case IMSG_RELOAD_ABORT:
+	case IMSG_RELOAD_DRAIN:
+		smtp_imsg(p, imsg);
+		return;
+	}
+
+	fatalx("smtp_worker_imsg: unexpected %s imsg",
+	    imsg_to_str(imsg->hdr.type));
+}
+
+/*
+ * An id for a request of this process, which smtp_peer() maps back to
+ * it: the remainder by the number of smtp processes is the index of
+ * the process, the dispatcher first.
+ */
+uint64_t
+smtp_peer_id(void)
+{
+	uint64_t	id, n, i;
+
+	n = env->sc_smtp_workers + 1;
+	i = smtpd_process == PROC_SMTP ? env->sc_smtp_worker + 1 : 0;
+	do {
+		id = generate_uid();
+		id = id - id % n + i;
+	} while (id == 0);
+
+	return (id);
+}
+
+/* the process a reply to a session goes to */
+struct mproc *
+smtp_peer(uint64_t id)
+{
+	uint64_t	i;
+
+	if (env->sc_smtp_workers == 0)
+		return (p_dispatcher);
+
+	i = id % (env->sc_smtp_workers + 1);
+	return (i ? p_smtp[i - 1] : p_dispatcher);
+}
+
+/*
+ * The processes running smtp sessions, for the requests that concern
+ * all of them.
+ */
+int
+smtp_peer_count(void)
+{
+	return (env->sc_smtp_workers + 1);
+}
+
+struct mproc *
+smtp_peer_at(int i)
+{
+	return (i ? p_smtp[i - 1] : p_dispatcher);
+}
+
+static void
+smtp_worker_limits(void)
+{
+	env->sc_conn_max_src = smtp_worker_share(env->sc_conn_max_src);
+	env->sc_conn_max_net = smtp_worker_share(env->sc_conn_max_net);
+	env->sc_conn_rate = smtp_worker_share(env->sc_conn_rate);
+}
+
+/* this worker's part of a limit, 0 staying for no limit */
+static size_t
+smtp_worker_share(size_t limit)
+{
+	size_t	n = env->sc_smtp_workers;
+
+	if (limit == 0)
+		return (0);
+	limit = limit / n + (limit % n > (size_t)env->sc_smtp_worker);
+	return (limit ? limit : 1);
+}
+
+static void
+smtp_worker_shutdown(void)
+{
+	log_debug("debug: smtp worker exiting");
+	_exit(0);
+}
+
+int
+smtp_worker(void)
+{
+	struct passwd	*pw;
+
+	ca_engine_init();
+
+	smtp_postfork();
+	smtp_worker_limits();
+
+	/* do not purge listeners and pki, they are purged
+	 * in smtp_configure()
+	 */
+	purge_config(PURGE_TABLES|PURGE_RULES);
+
+	if ((pw = getpwnam(SMTPD_USER)) == NULL)
+		fatalx("unknown user " SMTPD_USER);
+
+	if (chroot(PATH_CHROOT) == -1)
+		fatal("smtp: chroot");
+	if (chdir("/") == -1)
+		fatal("smtp: chdir(\"/\")");
+
+	config_process(PROC_SMTP);
+
+	if (setgroups(1, &pw->pw_gid) ||
+	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
+	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
+		fatal("smtp: cannot drop privileges");
+
+	imsg_callback = smtp_worker_imsg;
+	event_init();
+
+	smtp_postprivdrop();
+
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+
+	config_peer(PROC_PARENT);
+	config_peer(PROC_QUEUE);
+	config_peer(PROC_LKA);
+	config_peer(PROC_RESOLVER);
+	config_peer(PROC_CONTROL);
+	config_peer(PROC_CA);
+	config_peer(PROC_LOGGER);
+	config_peer(PROC_TLS);
+	stat_cpu_start(NULL);
+	memory_start(NULL, smtp_memory);
+
+#if HAVE_PLEDGE
+	if (pledge("stdio inet unix recvfd sendfd", NULL) == -1)
+		fatal("pledge");
+#endif
+
+	event_dispatch();
+	fatalx("exited event loop");
+
+	return (0);
+}
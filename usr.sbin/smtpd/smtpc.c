@@ -21,22 +21,40 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <event.h>
+#include <limits.h>
 #include <netdb.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <tls.h>
 #include <unistd.h>
 
 #include "smtp.h"
 #include "log.h"
 
+#define BULK_REPORT_INTERVAL	10	/* seconds */
+
+struct bulk_conn {
+	struct addrinfo	*ai;
+	int		 ready;
+};
+
 static void parse_server(char *);
 static void parse_message(FILE *);
 static void resume(void);
+static void bulk_open(const char *);
+static struct smtp_mail *bulk_next(void);
+static void bulk_free(struct smtp_mail *);
+static void bulk_connect(void);
+static void bulk_stats(const char *);
+static void bulk_report(int, short, void *);
 
 static int verbose = 1;
 static int done = 0;
@@ -52,13 +70,37 @@ static const char *cafile = NULL;
 static const char *protocols = NULL;
 static const char *ciphers = NULL;
 
+/*
+ * Bulk injection: a stream of batch SMTP transactions is sent over
+ * several persistent, pipelined sessions.
+ */
+static struct {
+	const char	*source;
+	DIR		*dir;
+	FILE		*fp;
+	char		 path[PATH_MAX];
+	size_t		 lineno;
+	int		 eof;
+	int		 conns;
+	int		 active;
+	struct timespec	 start;
+	struct event	 ev;
+	size_t		 mails;
+	size_t		 ok;
+	size_t		 failed;
+	size_t		 bytes;
+} bulk;
+
 static void
 usage(void)
 {
 	extern char *__progname;
 
 	fprintf(stderr, "usage: %s [-Chnv] [-a authfile] [-F from] [-H helo] "
-	    "[-s server] [-T params] [recipient ...]\n", __progname);
+	    "[-s server] [-T params] [recipient ...]\n"
+	    "       %s -B source [-Cv] [-a authfile] [-c connections] "
+	    "[-H helo] [-s server]\n"
+	    "            [-T params]\n", __progname, __progname);
 	exit(1);
 }
 
@@ -130,6 +172,7 @@ main(int argc, char **argv)
 	uint32_t protos;
 	char *server = "localhost";
 	char *authstr = NULL;
+	const char *errstr;
 	size_t alloc = 0;
 	ssize_t len;
 	struct passwd *pw;
@@ -155,8 +198,13 @@ main(int argc, char **argv)
 	memset(&mail, 0, sizeof(mail));
 	mail.from = pw->pw_name;
 
-	while ((ch = getopt(argc, argv, "CF:H:S:T:a:hns:v")) != -1) {
+	bulk.conns = 1;
+
+	while ((ch = getopt(argc, argv, "B:CF:H:S:T:a:c:hns:v")) != -1) {
 		switch (ch) {
+		case 'B':
+			bulk.source = optarg;
+			break;
 		case 'C':
 			params.tls_verify = 0;
 			break;
@@ -189,6 +237,11 @@ main(int argc, char **argv)
 			params.auth_pass = authstr;
 			fclose(authfile);
 			break;
+		case 'c':
+			bulk.conns = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr)
+				fatalx("connections is %s: %s", errstr, optarg);
+			break;
 		case 'h':
 			usage();
 			break;
@@ -211,6 +264,9 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (bulk.source && (argc || noaction))
+		usage();
+
 	if (argc) {
 		mail.rcpt = calloc(argc, sizeof(*mail.rcpt));
 		if (mail.rcpt == NULL)
@@ -248,6 +304,26 @@ main(int argc, char **argv)
 	} else
 		tls_config_verify(tls_config);
 
+	if (bulk.source) {
+		bulk_open(bulk.source);
+		parse_server(server);
+#if HAVE_PLEDGE
+		if (pledge("stdio rpath inet tmppath", NULL) == -1)
+			fatal("pledge");
+#endif
+		params.pipelining = 1;
+		clock_gettime(CLOCK_MONOTONIC, &bulk.start);
+		if (verbose > 1) {
+			evtimer_set(&bulk.ev, bulk_report, NULL);
+			bulk_report(-1, 0, &bulk);
+		}
+		for (i = 0; i < bulk.conns; i++)
+			bulk_connect();
+		event_dispatch();
+		bulk_stats("done");
+		return (bulk.failed ? 1 : 0);
+	}
+
 #if HAVE_PLEDGE
 	if (pledge("stdio inet dns tmppath", NULL) == -1)
 		fatal("pledge");
@@ -443,6 +519,226 @@ resume(void)
 	}
 }
 
+/*
+ * Open the bulk source: a file of batch SMTP transactions, or a directory
+ * holding such files.
+ */
+static void
+bulk_open(const char *source)
+{
+	if (strcmp(source, "-") == 0) {
+		bulk.fp = stdin;
+		(void)strlcpy(bulk.path, "<stdin>", sizeof(bulk.path));
+		return;
+	}
+
+	if ((bulk.dir = opendir(source)) != NULL)
+		return;
+	if (errno != ENOTDIR)
+		fatal("%s", source);
+
+	if ((bulk.fp = fopen(source, "r")) == NULL)
+		fatal("%s", source);
+	(void)strlcpy(bulk.path, source, sizeof(bulk.path));
+}
+
+/*
+ * Read the next line from the bulk source, without the line ending.
+ * Move to the next file of the directory when needed.
+ */
+static char *
+bulk_getline(char **line, size_t *linesz)
+{
+	struct dirent *dp;
+	ssize_t len;
+
+	for (;;) {
+		if (bulk.fp == NULL) {
+			if (bulk.dir == NULL)
+				return NULL;
+			if ((dp = readdir(bulk.dir)) == NULL) {
+				closedir(bulk.dir);
+				bulk.dir = NULL;
+				return NULL;
+			}
+			if (dp->d_name[0] == '.')
+				continue;
+			(void)snprintf(bulk.path, sizeof(bulk.path), "%s/%s",
+			    bulk.source, dp->d_name);
+			if ((bulk.fp = fopen(bulk.path, "r")) == NULL) {
+				log_warn("%s", bulk.path);
+				continue;
+			}
+			bulk.lineno = 0;
+		}
+
+		if ((len = getline(line, linesz, bulk.fp)) != -1) {
+			bulk.lineno++;
+			if (len && (*line)[len - 1] == '\n')
+				(*line)[--len] = '\0';
+			if (len && (*line)[len - 1] == '\r')
+				(*line)[--len] = '\0';
+			return *line;
+		}
+		if (ferror(bulk.fp))
+			fatal("%s", bulk.path);
+		if (bulk.fp != stdin)
+			fclose(bulk.fp);
+		bulk.fp = NULL;
+	}
+}
+
+/*
+ * Extract the address of a "MAIL FROM:" or "RCPT TO:" command.
+ */
+static char *
+bulk_addr(char *line, const char *cmd)
+{
+	char *p, *e;
+
+	p = line + strlen(cmd);
+	while (*p == ' ')
+		p++;
+	if (*p != '<' || (e = strchr(p, '>')) == NULL)
+		fatalx("%s:%zu: invalid address", bulk.path, bulk.lineno);
+	*e = '\0';
+	if ((p = strdup(p + 1)) == NULL)
+		fatal("strdup");
+	return p;
+}
+
+/*
+ * Parse the next batch SMTP transaction: a MAIL FROM, one or more RCPT TO,
+ * then DATA followed by the dot-stuffed message ending with a single dot.
+ * Other commands are ignored.
+ */
+static struct smtp_mail *
+bulk_next(void)
+{
+	struct smtp_mail *m;
+	struct smtp_rcpt *r;
+	char *line = NULL;
+	size_t linesz = 0;
+	int indata = 0;
+
+	if (bulk.eof)
+		return NULL;
+
+	if ((m = calloc(1, sizeof(*m))) == NULL)
+		fatal("calloc");
+
+	while (bulk_getline(&line, &linesz)) {
+		if (indata) {
+			if (strcmp(line, ".") == 0) {
+				free(line);
+				rewind(m->fp);
+				return m;
+			}
+			if (fprintf(m->fp, "%s\n",
+			    line[0] == '.' ? line + 1 : line) < 0)
+				fatal("fprintf");
+			bulk.bytes += strlen(line) + 2;
+		}
+		else if (strncasecmp(line, "MAIL FROM:", 10) == 0) {
+			if (m->from)
+				fatalx("%s:%zu: nested MAIL FROM", bulk.path,
+				    bulk.lineno);
+			m->from = bulk_addr(line, "MAIL FROM:");
+		}
+		else if (strncasecmp(line, "RCPT TO:", 8) == 0) {
+			if (m->from == NULL)
+				fatalx("%s:%zu: RCPT TO without MAIL FROM",
+				    bulk.path, bulk.lineno);
+			r = reallocarray(m->rcpt, m->rcptcount + 1,
+			    sizeof(*m->rcpt));
+			if (r == NULL)
+				fatal("reallocarray");
+			m->rcpt = r;
+			r = &m->rcpt[m->rcptcount++];
+			memset(r, 0, sizeof(*r));
+			r->to = bulk_addr(line, "RCPT TO:");
+		}
+		else if (strcasecmp(line, "DATA") == 0) {
+			if (m->rcptcount == 0)
+				fatalx("%s:%zu: DATA without RCPT TO",
+				    bulk.path, bulk.lineno);
+			if ((m->fp = tmpfile()) == NULL)
+				fatal("tmpfile");
+			indata = 1;
+		}
+		else if (m->from)
+			fatalx("%s:%zu: unexpected command", bulk.path,
+			    bulk.lineno);
+	}
+
+	free(line);
+	if (m->from)
+		fatalx("%s: unterminated transaction", bulk.path);
+	free(m);
+	bulk.eof = 1;
+	return NULL;
+}
+
+static void
+bulk_free(struct smtp_mail *m)
+{
+	int i;
+
+	for (i = 0; i < m->rcptcount; i++)
+		free((char *)m->rcpt[i].to);
+	free(m->rcpt);
+	free((char *)m->from);
+	if (m->fp)
+		fclose(m->fp);
+	free(m);
+}
+
+static void
+bulk_connect(void)
+{
+	struct bulk_conn *c;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		fatal("calloc");
+
+	bulk.active++;
+	c->ai = ai;
+	params.dst = ai->ai_addr;
+	if (smtp_connect(&params, c) == NULL)
+		fatal("smtp_connect");
+}
+
+static void
+bulk_stats(const char *label)
+{
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - bulk.start.tv_sec) +
+	    (now.tv_nsec - bulk.start.tv_nsec) / 1e9;
+	if (secs <= 0)
+		secs = 1e-9;
+
+	log_info("%s: %zu messages, %zu recipients ok, %zu failed, "
+	    "%zu bytes in %.1fs: %.1f msg/s, %.1f KB/s", label,
+	    bulk.mails, bulk.ok, bulk.failed, bulk.bytes, secs,
+	    bulk.mails / secs, bulk.bytes / secs / 1024);
+}
+
+static void
+bulk_report(int fd, short event, void *arg)
+{
+	struct timeval tv;
+
+	if (arg == NULL)
+		bulk_stats("progress");
+
+	tv.tv_sec = BULK_REPORT_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&bulk.ev, &tv);
+}
+
 void
 log_trace(int lvl, const char *emsg, ...)
 {
@@ -473,8 +769,20 @@ smtp_require_tls(void *tag, struct smtp_client *proto)
 void
 smtp_ready(void *tag, struct smtp_client *proto)
 {
+	struct bulk_conn *c = tag;
+	struct smtp_mail *m;
+
 	log_debug("connection ready...");
 
+	if (bulk.source) {
+		c->ready = 1;
+		if ((m = bulk_next()) == NULL)
+			smtp_quit(proto);
+		else
+			smtp_sendmail(proto, m);
+		return;
+	}
+
 	if (done || noaction)
 		smtp_quit(proto);
 	else
@@ -508,6 +816,15 @@ smtp_failed(void *tag, struct smtp_client *proto, int failure, const char *detai
 void
 smtp_status(void *tag, struct smtp_client *proto, struct smtp_status *status)
 {
+	if (bulk.source) {
+		if (status->status[0] == '2')
+			bulk.ok++;
+		else
+			bulk.failed++;
+		if (verbose < 2 && status->status[0] == '2')
+			return;
+	}
+
 	log_info("%s: %s: %s", status->rcpt->to, status->cmd, status->status);
 }
 
@@ -518,6 +835,18 @@ smtp_done(void *tag, struct smtp_client *proto, struct smtp_mail *mail)
 
 	log_debug("mail done...");
 
+	if (bulk.source) {
+		/* recipients left without a status were aborted */
+		for (i = 0; i < mail->rcptcount; i++)
+			if (!mail->rcpt[i].done) {
+				log_warnx("%s: aborted", mail->rcpt[i].to);
+				bulk.failed++;
+			}
+		bulk.mails++;
+		bulk_free(mail);
+		return;
+	}
+
 	if (noaction)
 		return;
 
@@ -531,8 +860,31 @@ smtp_done(void *tag, struct smtp_client *proto, struct smtp_mail *mail)
 void
 smtp_closed(void *tag, struct smtp_client *proto)
 {
+	struct bulk_conn *c = tag;
+
 	log_debug("connection closed...");
 
+	if (bulk.source) {
+		bulk.active--;
+		/*
+		 * Reconnect while there are messages left, unless the
+		 * session never got ready: try the next address then.
+		 */
+		if (!c->ready && c->ai == ai)
+			ai = ai->ai_next;
+		free(c);
+		if (!bulk.eof && ai)
+			bulk_connect();
+		else if (bulk.active == 0) {
+			if (!bulk.eof) {
+				log_warnx("no more host");
+				bulk.failed++;
+			}
+			event_loopexit(NULL);
+		}
+		return;
+	}
+
 	ai = ai->ai_next;
 	if (noaction && ai == NULL)
 		done = 1;
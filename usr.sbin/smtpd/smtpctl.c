@@ -29,15 +29,22 @@
 #include <sys/tree.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <net/if.h>
 /* #include <net/if_media.h> */
 /* #include <net/if_types.h> */
 #include <netinet/in.h>
+#ifdef HAVE_ARPA_NAMESER_COMPAT_H
+#include <arpa/nameser_compat.h>
+#endif
 #include <arpa/inet.h>
+#include <arpa/nameser.h>
 
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <event.h>
 #include <fts.h>
 #include <grp.h>
 #include <inttypes.h>
@@ -47,6 +54,9 @@
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef HAVE_UTIL_H
+#include <util.h>
+#endif
 #if defined(HAVE_VIS_H) && !defined(BROKEN_STRNVIS)
 #include <vis.h>
 #else
@@ -57,6 +67,7 @@
 #include "smtpd.h"
 #include "parser.h"
 #include "log.h"
+#include "spfwalk.h"
 
 #ifndef PATH_GZCAT
 #define PATH_GZCAT	"/usr/bin/gzcat"
@@ -82,14 +93,21 @@ static void display(const char *);
 static int str_to_trace(const char *);
 static int str_to_profile(const char *);
 static void show_offline_envelope(uint64_t);
+static void str_to_queue_filter(char *, struct queue_filter *);
 static int is_gzip_fp(FILE *);
 static int is_encrypted_fp(FILE *);
 static int is_encrypted_buffer(const char *);
 static int is_gzip_buffer(const char *);
+static void queue_dir(uint32_t, char *, size_t);
 static FILE *offline_file(void);
 static void sendmail_compat(int, char **);
-
-extern int	spfwalk(int, struct parameter *);
+static int spfwalk_term(struct spf_walk *, struct spf_frame *,
+    struct spf_term *);
+static int spfwalk_addrs(struct spf_walk *, struct spf_term *, const char *);
+static int spfwalk_expand(struct spf_walk *, struct spf_frame *,
+    const char *, char *, size_t);
+static void spfwalk_print(const struct sockaddr_storage *, int);
+static void spfwalk_done(struct spf_walk *, int);
 
 extern char	*__progname;
 int		 sendmail;
@@ -100,6 +118,10 @@ char		*rdata;
 size_t		 rlen;
 time_t		 now;
 
+#ifdef HAVE_DB_API
+struct queue_backend queue_backend_db;
+#endif
+struct queue_backend queue_backend_log;
 struct queue_backend queue_backend_null;
 struct queue_backend queue_backend_proc;
 struct queue_backend queue_backend_ram;
@@ -124,6 +146,28 @@ void stat_decrement(const char *k, size_t v)
 {
 }
 
+void stat_set(const char *k, const struct stat_value *v)
+{
+}
+
+struct stat_value *stat_counter(size_t v)
+{
+	return NULL;
+}
+
+void memory_alloc(enum memory_type t, size_t n)
+{
+}
+
+void memory_free(enum memory_type t, size_t n)
+{
+}
+
+enum memory_level memory_level(void)
+{
+	return MEMORY_NORMAL;
+}
+
 int
 srv_connect(void)
 {
@@ -488,6 +532,34 @@ srv_foreach_envelope(struct parameter *argv, int ctl, size_t *total, size_t *ok)
 	}
 }
 
+/*
+ * Have smtpd apply the action to the envelopes matching a filter itself,
+ * instead of one request per envelope.
+ */
+static int
+srv_queue_bulk(const char *str, int action, const char *done)
+{
+	struct queue_filter	 f;
+	char			*spec;
+	size_t			 n;
+
+	if ((spec = strdup(str)) == NULL)
+		err(1, "strdup");
+	str_to_queue_filter(spec, &f);
+	free(spec);
+	if (f.from || f.limit || f.fields || f.summary)
+		errx(1, "filter: only selectors apply to %s envelopes", done);
+	f.bulk = action;
+
+	srv_send(IMSG_CTL_QUEUE_BULK, &f, sizeof(f));
+	srv_recv(IMSG_CTL_QUEUE_BULK);
+	srv_read(&n, sizeof(n));
+	srv_end();
+	printf("%zu envelope%s %s\n", n, (n > 1) ? "s" : "", done);
+
+	return (0);
+}
+
 static void
 srv_show_cmd(int cmd, const void *data, size_t len)
 {
@@ -548,58 +620,255 @@ do_log_verbose(int argc, struct parameter *argv)
 	return srv_check_result(1);
 }
 
-static int
-do_monitor(int argc, struct parameter *argv)
+/*
+ * Monitoring subscribes to the stats pushed by smtpd at each interval:
+ * the ones that changed since the previous update, then the digest.
+ */
+enum monitor_format {
+	MONITOR_TABLE,
+	MONITOR_JSON,
+	MONITOR_OPENMETRICS,
+};
+
+static void
+monitor_table(struct stat_digest *digest, struct stat_digest *last,
+    size_t count)
+{
+	if (count % 25 == 0) {
+		if (count != 0)
+			printf("\n");
+		printf("--- client ---  "
+		    "-- envelope --   "
+		    "---- relay/delivery --- "
+		    "------- misc -------\n"
+		    "curr conn disc  "
+		    "curr  enq  deq   "
+		    "ok tmpfail prmfail loop "
+		    "expire remove bounce\n");
+	}
+	printf("%4zu %4zu %4zu  "
+	    "%4zu %4zu %4zu "
+	    "%4zu    %4zu    %4zu %4zu   "
+	    "%4zu   %4zu   %4zu\n",
+	    digest->clt_connect - digest->clt_disconnect,
+	    digest->clt_connect - last->clt_connect,
+	    digest->clt_disconnect - last->clt_disconnect,
+
+	    digest->evp_enqueued - digest->evp_dequeued,
+	    digest->evp_enqueued - last->evp_enqueued,
+	    digest->evp_dequeued - last->evp_dequeued,
+
+	    digest->dlv_ok - last->dlv_ok,
+	    digest->dlv_tempfail - last->dlv_tempfail,
+	    digest->dlv_permfail - last->dlv_permfail,
+	    digest->dlv_loop - last->dlv_loop,
+
+	    digest->evp_expired - last->evp_expired,
+	    digest->evp_removed - last->evp_removed,
+	    digest->evp_bounce - last->evp_bounce);
+}
+
+static void
+monitor_value(const struct stat_value *val)
+{
+	switch (val->type) {
+	case STAT_COUNTER:
+		printf("%zd", val->u.counter);
+		break;
+	case STAT_TIMESTAMP:
+		printf("%" PRId64, (int64_t)val->u.timestamp);
+		break;
+	case STAT_TIMEVAL:
+		printf("%lld.%06ld", (long long)val->u.tv.tv_sec,
+		    (long)val->u.tv.tv_usec);
+		break;
+	case STAT_TIMESPEC:
+		printf("%lld.%09ld", (long long)val->u.ts.tv_sec,
+		    val->u.ts.tv_nsec);
+		break;
+	}
+}
+
+static void
+monitor_json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", (unsigned char)*s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+/* "smtpd_" and the key with anything but letters and digits as '_' */
+static void
+monitor_openmetrics_name(const char *key, size_t len, const char *suffix)
+{
+	size_t	i;
+
+	printf("smtpd_");
+	for (i = 0; i < len; i++)
+		putchar(isalnum((unsigned char)key[i]) ? key[i] : '_');
+	printf("%s", suffix);
+}
+
+/*
+ * The latency histograms are made of one counter per bucket, named
+ * "<key>.le.<bound>ms" or "<key>.le.inf", which sort in order: they come
+ * out with cumulative buckets and a count.
+ */
+static void
+monitor_openmetrics(struct dict *stats)
+{
+	struct stat_value	*val;
+	const char		*key, *le, *base = NULL;
+	void			*iter;
+	size_t			 baselen = 0, total = 0, len;
+	long long		 bound;
+
+	iter = NULL;
+	while (dict_iter(stats, &iter, &key, (void **)&val)) {
+		le = strstr(key, ".le.");
+		len = le ? (size_t)(le - key) : 0;
+		if (base && (le == NULL || len != baselen ||
+		    strncmp(key, base, len))) {
+			monitor_openmetrics_name(base, baselen, "_bucket");
+			printf("{le=\"+Inf\"} %zu\n", total);
+			monitor_openmetrics_name(base, baselen, "_count");
+			printf(" %zu\n", total);
+			base = NULL;
+		}
+
+		if (le && val->type == STAT_COUNTER) {
+			if (base == NULL) {
+				base = key;
+				baselen = len;
+				total = 0;
+				printf("# TYPE ");
+				monitor_openmetrics_name(base, baselen, "");
+				printf(" histogram\n");
+			}
+			total += val->u.counter;
+			if (strcmp(le + 4, "inf") == 0)
+				continue;
+			bound = strtoll(le + 4, NULL, 10);
+			monitor_openmetrics_name(base, baselen, "_bucket");
+			printf("{le=\"%lld.%03lld\"} %zu\n", bound / 1000,
+			    bound % 1000, total);
+			continue;
+		}
+
+		printf("# TYPE ");
+		monitor_openmetrics_name(key, strlen(key), "");
+		printf(" gauge\n");
+		monitor_openmetrics_name(key, strlen(key), " ");
+		monitor_value(val);
+		printf("\n");
+	}
+	if (base) {
+		monitor_openmetrics_name(base, baselen, "_bucket");
+		printf("{le=\"+Inf\"} %zu\n", total);
+		monitor_openmetrics_name(base, baselen, "_count");
+		printf(" %zu\n", total);
+	}
+	printf("# EOF\n");
+}
+
+static void
+monitor(enum monitor_format format, int interval)
 {
-	struct stat_digest	last, digest;
-	size_t			count;
+	struct stat_digest	 last, digest;
+	struct stat_value	 val, *v;
+	struct dict		 stats;
+	const char		*key;
+	size_t			 count, len, n;
 
 	memset(&last, 0, sizeof(last));
+	dict_init(&stats);
 	count = 0;
+	n = 0;
 
+	srv_send(IMSG_CTL_MONITOR, &interval, sizeof(interval));
 	while (1) {
-		srv_send(IMSG_CTL_GET_DIGEST, NULL, 0);
-		srv_recv(IMSG_CTL_GET_DIGEST);
+		srv_recv(-1);
+		if (imsg.hdr.type == IMSG_CTL_FAIL)
+			errx(1, "invalid interval: %d", interval);
+
+		if (imsg.hdr.type == IMSG_CTL_MONITOR) {
+			while (rlen) {
+				srv_get_string(&key);
+				srv_read(&len, sizeof(len));
+				if (len != sizeof(val) || key == NULL)
+					errx(1, "bad stat in response");
+				srv_read(&val, sizeof(val));
+
+				if (format == MONITOR_JSON) {
+					printf(n++ ? "," : "{\"stats\":{");
+					monitor_json_string(key);
+					printf(":");
+					monitor_value(&val);
+				}
+				else if (format == MONITOR_OPENMETRICS) {
+					if ((v = dict_get(&stats, key)) == NULL) {
+						v = xmalloc(sizeof(*v));
+						dict_set(&stats, key, v);
+					}
+					*v = val;
+				}
+			}
+			srv_end();
+			continue;
+		}
+
+		if (imsg.hdr.type != IMSG_CTL_GET_DIGEST)
+			errx(1, "bad message type");
 		srv_read(&digest, sizeof(digest));
 		srv_end();
 
-		if (count % 25 == 0) {
-			if (count != 0)
-				printf("\n");
-			printf("--- client ---  "
-			    "-- envelope --   "
-			    "---- relay/delivery --- "
-			    "------- misc -------\n"
-			    "curr conn disc  "
-			    "curr  enq  deq   "
-			    "ok tmpfail prmfail loop "
-			    "expire remove bounce\n");
+		switch (format) {
+		case MONITOR_TABLE:
+			monitor_table(&digest, &last, count);
+			break;
+		case MONITOR_JSON:
+			printf("%s},\"timestamp\":%lld}\n", n ? "" : "{\"stats\":{",
+			    (long long)digest.timestamp);
+			n = 0;
+			break;
+		case MONITOR_OPENMETRICS:
+			monitor_openmetrics(&stats);
+			break;
 		}
-		printf("%4zu %4zu %4zu  "
-		    "%4zu %4zu %4zu "
-		    "%4zu    %4zu    %4zu %4zu   "
-		    "%4zu   %4zu   %4zu\n",
-		    digest.clt_connect - digest.clt_disconnect,
-		    digest.clt_connect - last.clt_connect,
-		    digest.clt_disconnect - last.clt_disconnect,
-
-		    digest.evp_enqueued - digest.evp_dequeued,
-		    digest.evp_enqueued - last.evp_enqueued,
-		    digest.evp_dequeued - last.evp_dequeued,
-
-		    digest.dlv_ok - last.dlv_ok,
-		    digest.dlv_tempfail - last.dlv_tempfail,
-		    digest.dlv_permfail - last.dlv_permfail,
-		    digest.dlv_loop - last.dlv_loop,
-
-		    digest.evp_expired - last.evp_expired,
-		    digest.evp_removed - last.evp_removed,
-		    digest.evp_bounce - last.evp_bounce);
+		fflush(stdout);
 
 		last = digest;
 		count++;
-		sleep(1);
 	}
+}
+
+static int
+do_monitor(int argc, struct parameter *argv)
+{
+	monitor(MONITOR_TABLE, argc ? argv[0].u.u_int : 1);
+
+	return (0);
+}
+
+static int
+do_monitor_json(int argc, struct parameter *argv)
+{
+	monitor(MONITOR_JSON, argc ? argv[0].u.u_int : 1);
+
+	return (0);
+}
+
+static int
+do_monitor_openmetrics(int argc, struct parameter *argv)
+{
+	monitor(MONITOR_OPENMETRICS, argc ? argv[0].u.u_int : 1);
 
 	return (0);
 }
@@ -615,6 +884,13 @@ do_pause_envelope(int argc, struct parameter *argv)
 	return (0);
 }
 
+static int
+do_pause_envelope_filter(int argc, struct parameter *argv)
+{
+	return (srv_queue_bulk(argv[0].u.u_str, QUEUE_BULK_SUSPEND,
+	    "paused"));
+}
+
 static int
 do_pause_mda(int argc, struct parameter *argv)
 {
@@ -647,6 +923,165 @@ do_profile(int argc, struct parameter *argv)
 	return srv_check_result(1);
 }
 
+/*
+ * The queue answers with its end of the archive pipe, or with the result
+ * when it could not start.  The result follows the transfer otherwise.
+ */
+static int
+srv_queue_archive(int type)
+{
+	int	fd;
+
+	srv_recv(type);
+	if ((fd = imsg_get_fd(&imsg)) != -1)
+		srv_end();
+	return (fd);
+}
+
+static int
+srv_queue_archive_result(const char *verb)
+{
+	const char	*error;
+	size_t		 messages, envelopes, failed;
+	int		 ok;
+
+	srv_get_int(&ok);
+	srv_read(&messages, sizeof(messages));
+	srv_read(&envelopes, sizeof(envelopes));
+	srv_read(&failed, sizeof(failed));
+	srv_get_string(&error);
+	if (!ok)
+		warnx("%s", (error && *error) ? error : "archive failed");
+	srv_end();
+
+	if (ok) {
+		fprintf(stderr, "%zu message%s, %zu envelope%s %s",
+		    messages, (messages != 1) ? "s" : "",
+		    envelopes, (envelopes != 1) ? "s" : "", verb);
+		if (failed)
+			fprintf(stderr, ", %zu failed", failed);
+		fprintf(stderr, "\n");
+		return (failed ? 1 : 0);
+	}
+	return (1);
+}
+
+static int
+do_queue_export(int argc, struct parameter *argv)
+{
+	struct compress_backend	*backend = NULL;
+	uint32_t		 msgid, *msgids = NULL, *tmp;
+	size_t			 n = 0, sz = 0, i, chunk;
+	ssize_t			 r;
+	char			 buf[BUFSIZ];
+	FILE			*fp;
+	int			 fd;
+
+	if (argc) {
+		backend = compress_backend_lookup(argv[0].u.u_str);
+		if (backend == NULL)
+			errx(1, "unknown compression: %s", argv[0].u.u_str);
+	}
+	if (isatty(STDOUT_FILENO))
+		errx(1, "refusing to write an archive to a terminal");
+
+	msgid = 0;
+	while (srv_iter_messages(&msgid)) {
+		if (n == sz) {
+			sz = sz ? sz * 2 : 1024;
+			if ((tmp = reallocarray(msgids, sz,
+			    sizeof(*msgids))) == NULL)
+				err(1, "reallocarray");
+			msgids = tmp;
+		}
+		msgids[n++] = msgid;
+	}
+
+	for (i = 0; i < n; i += chunk) {
+		chunk = MIN(n - i, 1024);
+		srv_send(IMSG_CTL_QUEUE_EXPORT, msgids + i,
+		    chunk * sizeof(*msgids));
+	}
+	srv_send(IMSG_CTL_QUEUE_EXPORT, NULL, 0);
+	free(msgids);
+
+	if ((fd = srv_queue_archive(IMSG_CTL_QUEUE_EXPORT)) == -1)
+		return srv_queue_archive_result("exported");
+
+	if (backend) {
+		if ((fp = fdopen(fd, "r")) == NULL)
+			err(1, "fdopen");
+		if (!backend->compress_file(fp, stdout))
+			errx(1, "could not compress archive");
+		fclose(fp);
+	}
+	else {
+		while ((r = read(fd, buf, sizeof(buf))) != 0) {
+			if (r == -1) {
+				if (errno == EINTR)
+					continue;
+				err(1, "read");
+			}
+			if (fwrite(buf, 1, r, stdout) != (size_t)r)
+				err(1, "write");
+		}
+		close(fd);
+		if (fflush(stdout) != 0)
+			err(1, "write");
+	}
+
+	srv_recv(IMSG_CTL_QUEUE_EXPORT);
+	return srv_queue_archive_result("exported");
+}
+
+static int
+do_queue_import(int argc, struct parameter *argv)
+{
+	struct compress_backend	*backend;
+	unsigned char		 buf[BUFSIZ];
+	size_t			 n;
+	void			*hdl = NULL;
+	FILE			*fp;
+	int			 fd, error = 0;
+
+	srv_send(IMSG_CTL_QUEUE_IMPORT, NULL, 0);
+	if ((fd = srv_queue_archive(IMSG_CTL_QUEUE_IMPORT)) == -1)
+		return srv_queue_archive_result("imported");
+
+	/* the queue may give up early, its result tells why */
+	signal(SIGPIPE, SIG_IGN);
+	if ((fp = fdopen(fd, "w")) == NULL)
+		err(1, "fdopen");
+
+	n = fread(buf, 1, 4, stdin);
+	if ((backend = compress_backend_detect(buf, n)) != NULL) {
+		if ((hdl = backend->uncompress_stream_begin(fp)) == NULL)
+			errx(1, "could not uncompress archive");
+	}
+
+	while (n) {
+		if (hdl) {
+			if (!backend->uncompress_stream_write(hdl, buf, n)) {
+				error = 1;
+				break;
+			}
+		}
+		else if (fwrite(buf, 1, n, fp) != n)
+			break;
+		n = fread(buf, 1, sizeof(buf), stdin);
+	}
+	if (ferror(stdin))
+		err(1, "read");
+	if (hdl && !backend->uncompress_stream_end(hdl))
+		error = 1;
+	fclose(fp);
+	if (error)
+		warnx("could not uncompress archive");
+
+	srv_recv(IMSG_CTL_QUEUE_IMPORT);
+	return (srv_queue_archive_result("imported") || error);
+}
+
 static int
 do_remove(int argc, struct parameter *argv)
 {
@@ -658,6 +1093,13 @@ do_remove(int argc, struct parameter *argv)
 	return (0);
 }
 
+static int
+do_remove_filter(int argc, struct parameter *argv)
+{
+	return (srv_queue_bulk(argv[0].u.u_str, QUEUE_BULK_REMOVE,
+	    "removed"));
+}
+
 static int
 do_resume_envelope(int argc, struct parameter *argv)
 {
@@ -669,6 +1111,13 @@ do_resume_envelope(int argc, struct parameter *argv)
 	return (0);
 }
 
+static int
+do_resume_envelope_filter(int argc, struct parameter *argv)
+{
+	return (srv_queue_bulk(argv[0].u.u_str, QUEUE_BULK_RESUME,
+	    "resumed"));
+}
+
 static int
 do_resume_mda(int argc, struct parameter *argv)
 {
@@ -715,17 +1164,21 @@ do_schedule(int argc, struct parameter *argv)
 	return (0);
 }
 
+static int
+do_schedule_filter(int argc, struct parameter *argv)
+{
+	return (srv_queue_bulk(argv[0].u.u_str, QUEUE_BULK_SCHEDULE,
+	    "scheduled"));
+}
+
 static int
 do_show_envelope(int argc, struct parameter *argv)
 {
 	char	 buf[PATH_MAX];
 
-	if (!bsnprintf(buf, sizeof(buf), "%s%s/%02x/%08x/%016" PRIx64,
-	    PATH_SPOOL,
-	    PATH_QUEUE,
-	    (evpid_to_msgid(argv[0].u.u_evpid) & 0xff000000) >> 24,
-	    evpid_to_msgid(argv[0].u.u_evpid),
-	    argv[0].u.u_evpid))
+	queue_dir(evpid_to_msgid(argv[0].u.u_evpid), buf, sizeof(buf));
+	if (!bsnprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
+	    "/%016" PRIx64, argv[0].u.u_evpid))
 		errx(1, "unable to retrieve envelope");
 
 	display(buf);
@@ -733,6 +1186,28 @@ do_show_envelope(int argc, struct parameter *argv)
 	return (0);
 }
 
+/* the directory of a message, in whichever queue shard holds it */
+static void
+queue_dir(uint32_t msgid, char *buf, size_t len)
+{
+	struct stat	sb;
+	int		i;
+
+	for (i = 0; i < QUEUE_SHARDS_MAX; i++) {
+		if (i == 0)
+			(void)snprintf(buf, len, "%s%s/%02x/%08x", PATH_SPOOL,
+			    PATH_QUEUE, (msgid & 0xff000000) >> 24, msgid);
+		else
+			(void)snprintf(buf, len, "%s/shard.%d%s/%02x/%08x",
+			    PATH_SPOOL, i, PATH_QUEUE,
+			    (msgid & 0xff000000) >> 24, msgid);
+		if (stat(buf, &sb) == 0)
+			return;
+	}
+	(void)snprintf(buf, len, "%s%s/%02x/%08x", PATH_SPOOL, PATH_QUEUE,
+	    (msgid & 0xff000000) >> 24, msgid);
+}
+
 static int
 do_show_hoststats(int argc, struct parameter *argv)
 {
@@ -745,6 +1220,9 @@ static int
 do_show_message(int argc, struct parameter *argv)
 {
 	char	 buf[PATH_MAX];
+	char	 body[PATH_MAX];
+	pid_t	 pid;
+	int	 status;
 	uint32_t msgid;
 
 	if (argv[0].type == P_EVPID)
@@ -752,13 +1230,27 @@ do_show_message(int argc, struct parameter *argv)
 	else
 		msgid = argv[0].u.u_msgid;
 
-	if (!bsnprintf(buf, sizeof(buf), "%s%s/%02x/%08x/message",
-	    PATH_SPOOL,
-	    PATH_QUEUE,
-	    (msgid & 0xff000000) >> 24,
-	    msgid))
+	queue_dir(msgid, buf, sizeof(buf));
+	if (strlcpy(body, buf, sizeof(body)) >= sizeof(body) ||
+	    strlcat(body, "/body", sizeof(body)) >= sizeof(body) ||
+	    strlcat(buf, "/message", sizeof(buf)) >= sizeof(buf))
 		errx(1, "unable to retrieve message");
 
+	/* with queue dedup, the part past the headers may be shared */
+	if (access(body, F_OK) == 0) {
+		fflush(stdout);
+		switch (pid = fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			display(buf);
+		}
+		if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0)
+			errx(1, "unable to retrieve message");
+		display(body);
+	}
+
 	display(buf);
 
 	return (0);
@@ -771,9 +1263,11 @@ do_show_queue(int argc, struct parameter *argv)
 	uint32_t	 msgid;
 	FTS		*fts;
 	FTSENT		*ftse;
-	char		*qpath[] = {"/queue", NULL};
+	char		 paths[QUEUE_SHARDS_MAX][PATH_MAX];
+	char		*qpath[QUEUE_SHARDS_MAX + 1];
 	char		*tmp;
 	uint64_t	 evpid;
+	int		 i, r;
 
 	now = time(NULL);
 
@@ -781,6 +1275,21 @@ do_show_queue(int argc, struct parameter *argv)
 		queue_init("fs", 0);
 		if (chroot(PATH_SPOOL) == -1 || chdir("/") == -1)
 			err(1, "%s", PATH_SPOOL);
+
+		/* the summary kept by the queue saves parsing each envelope */
+		if (queue_summary_open()) {
+			while ((r = queue_summary_walk(&evp)) != -1)
+				if (r)
+					show_queue_envelope(&evp, 0);
+			return (0);
+		}
+
+		for (i = 0; i < queue_shards(); i++) {
+			(void)snprintf(paths[i], sizeof(paths[i]), "%s%s",
+			    queue_shard_root(i), PATH_QUEUE);
+			qpath[i] = paths[i];
+		}
+		qpath[i] = NULL;
 		fts = fts_open(qpath, FTS_PHYSICAL|FTS_NOCHDIR, NULL);
 		if (fts == NULL)
 			err(1, "%s/queue", PATH_SPOOL);
@@ -816,6 +1325,199 @@ do_show_queue(int argc, struct parameter *argv)
 	return (0);
 }
 
+static int
+do_show_queue_filter(int argc, struct parameter *argv)
+{
+	struct queue_filter	 f;
+	struct queue_count	 count, *c;
+	struct envelope		 evp;
+	struct dict		 counts;
+	const char		*s;
+	char			*spec;
+	void			*iter;
+	uint64_t		 next;
+	size_t			 found, len;
+	time_t			 nexttry;
+	int			 type, flags;
+
+	now = time(NULL);
+
+	if ((spec = strdup(argv[0].u.u_str)) == NULL)
+		err(1, "strdup");
+	str_to_queue_filter(spec, &f);
+	free(spec);
+
+	dict_init(&counts);
+
+	/* one page per round trip, until the cursor wraps or the limit */
+	do {
+		srv_send(IMSG_CTL_LIST_QUEUE, &f, sizeof(f));
+		for (;;) {
+			srv_recv(IMSG_CTL_LIST_QUEUE);
+			srv_get_int(&type);
+			if (type == QUEUE_LIST_END)
+				break;
+			switch (type) {
+			case QUEUE_LIST_ENVELOPE:
+				srv_get_int(&flags);
+				srv_get_time(&nexttry);
+				srv_get_envelope(&evp);
+				evp.flags |= flags;
+				evp.nexttry = nexttry;
+				show_queue_envelope(&evp, 1);
+				break;
+			case QUEUE_LIST_LINE:
+				srv_get_string(&s);
+				printf("%s\n", s);
+				break;
+			case QUEUE_LIST_COUNT:
+				srv_get_string(&s);
+				srv_read(&len, sizeof(len));
+				if (len != sizeof(count))
+					errx(1, "bad count in response");
+				srv_read(&count, sizeof(count));
+				if ((c = dict_get(&counts, s)) == NULL) {
+					if ((c = calloc(1, sizeof(*c))) == NULL)
+						err(1, "calloc");
+					dict_set(&counts, s, c);
+				}
+				c->total += count.total;
+				c->pending += count.pending;
+				c->inflight += count.inflight;
+				c->held += count.held;
+				c->suspended += count.suspended;
+				break;
+			default:
+				errx(1, "wrong record in response: %d", type);
+			}
+			srv_end();
+		}
+		srv_get_evpid(&next);
+		srv_read(&found, sizeof(found));
+		srv_end();
+
+		if (f.limit) {
+			f.limit -= found;
+			if (f.limit == 0)
+				break;
+		}
+		f.from = next;
+	} while (next);
+
+	iter = NULL;
+	while (dict_iter(&counts, &iter, &s, (void **)&c))
+		printf("%s|%zu|%zu|%zu|%zu|%zu\n", s, c->total, c->pending,
+		    c->inflight, c->held, c->suspended);
+
+	return (0);
+}
+
+static int
+do_show_queue_summary(int argc, struct parameter *argv)
+{
+	struct queue_count	 c;
+	struct queue_domain	 d;
+	char			 from[SMTPD_MAXDOMAINPARTSIZE];
+	size_t			 nmsg, len, n;
+	time_t			 now;
+
+	memset(from, 0, sizeof from);
+	now = time(NULL);
+	do {
+		srv_send(IMSG_CTL_QUEUE_SUMMARY, from, sizeof from);
+		srv_recv(IMSG_CTL_QUEUE_SUMMARY);
+		srv_read(&nmsg, sizeof(nmsg));
+		srv_read(&len, sizeof(len));
+		if (len != sizeof(c))
+			errx(1, "bad summary in response");
+		srv_read(&c, sizeof(c));
+		srv_read(&len, sizeof(len));
+		if (len % sizeof(d))
+			errx(1, "bad summary in response");
+
+		if (from[0] == '\0') {
+			printf("messages=%zu\n", nmsg);
+			printf("envelopes=%zu\n", c.total);
+			printf("pending=%zu\n", c.pending);
+			printf("inflight=%zu\n", c.inflight);
+			printf("held=%zu\n", c.held);
+			printf("suspended=%zu\n", c.suspended);
+		}
+
+		for (n = 0; n < len / sizeof(d); n++) {
+			srv_read(&d, sizeof(d));
+			printf("%s|%zu|%zu|%zu|%zu|%zu|%s", d.name,
+			    d.count.total, d.count.pending, d.count.inflight,
+			    d.count.held, d.count.suspended,
+			    duration_to_text(now - d.oldest));
+			if (d.next)
+				printf("|%s\n", duration_to_text(
+				    d.next > now ? d.next - now : 0));
+			else
+				printf("|-\n");
+			(void)strlcpy(from, d.name, sizeof from);
+		}
+		srv_end();
+	} while (n == QUEUE_DOMAIN_MAX);
+
+	return (0);
+}
+
+static int
+do_show_profile(int argc, struct parameter *argv)
+{
+	static const struct {
+		int		 proc;
+		const char	*name;
+	} procs[] = {
+		{ PROC_PARENT,		"parent" },
+		{ PROC_LKA,		"lka" },
+		{ PROC_RESOLVER,	"resolver" },
+		{ PROC_QUEUE,		"queue" },
+		{ PROC_CONTROL,		"control" },
+		{ PROC_SCHEDULER,	"scheduler" },
+		{ PROC_DISPATCHER,	"dispatcher" },
+		{ PROC_CA,		"ca" },
+	};
+	struct profile_stat	 ps;
+	const char		*key;
+	size_t			 i, len;
+	int			 v;
+
+	for (i = 0; i < nitems(procs); i++) {
+		v = procs[i].proc;
+		srv_send(IMSG_CTL_SHOW_PROFILE, &v, sizeof(v));
+		do {
+			srv_recv(IMSG_CTL_SHOW_PROFILE);
+			len = rlen;
+			while (rlen) {
+				srv_get_string(&key);
+				srv_read(&len, sizeof(len));
+				if (len != sizeof(ps) || key == NULL)
+					errx(1, "bad profile in response");
+				srv_read(&ps, sizeof(ps));
+				printf("%s|%s|%zu|%lld.%06ld|%lld.%06ld|%zu\n",
+				    procs[i].name, key, ps.calls,
+				    (long long)ps.total.tv_sec,
+				    ps.total.tv_nsec / 1000,
+				    (long long)ps.max.tv_sec,
+				    ps.max.tv_nsec / 1000, ps.stalls);
+			}
+			srv_end();
+		} while (len);
+	}
+
+	return (0);
+}
+
+static int
+do_show_filters(int argc, struct parameter *argv)
+{
+	srv_show_cmd(IMSG_CTL_SHOW_FILTERS, NULL, 0);
+
+	return (0);
+}
+
 static int
 do_show_hosts(int argc, struct parameter *argv)
 {
@@ -832,6 +1534,14 @@ do_show_relays(int argc, struct parameter *argv)
 	return (0);
 }
 
+static int
+do_show_destinations(int argc, struct parameter *argv)
+{
+	srv_show_cmd(IMSG_CTL_MTA_SHOW_DESTINATIONS, NULL, 0);
+
+	return (0);
+}
+
 static int
 do_show_routes(int argc, struct parameter *argv)
 {
@@ -840,6 +1550,64 @@ do_show_routes(int argc, struct parameter *argv)
 	return (0);
 }
 
+/*
+ * One line per process from the "memory.<proc>.<type>" stats, which
+ * come sorted by key.
+ */
+static int
+do_show_memory(int argc, struct parameter *argv)
+{
+	static const char *levels[] = {
+		"normal", "shrink", "tempfail", "pause"
+	};
+	struct stat_kv	 kv;
+	char		 name[STAT_KEY_SIZE];
+	char		 buf[FMT_SCALED_STRSIZE];
+	const char	*proc, *type;
+	size_t		 len;
+
+	memset(&kv, 0, sizeof kv);
+	name[0] = '\0';
+
+	while (1) {
+		srv_send(IMSG_CTL_GET_STATS, &kv, sizeof kv);
+		srv_recv(IMSG_CTL_GET_STATS);
+		srv_read(&kv, sizeof(kv));
+		srv_end();
+
+		if (kv.iter == NULL)
+			break;
+
+		if (strncmp(kv.key, "memory.", 7) != 0 ||
+		    kv.val.type != STAT_COUNTER)
+			continue;
+		proc = kv.key + 7;
+		if ((type = strrchr(proc, '.')) == NULL)
+			continue;
+		len = type++ - proc;
+
+		if (strlen(name) != len || strncmp(name, proc, len) != 0) {
+			if (name[0] != '\0')
+				printf("\n");
+			(void)snprintf(name, sizeof name, "%.*s", (int)len, proc);
+			printf("%-12s", name);
+		}
+
+		if (strcmp(type, "level") == 0) {
+			printf(" level=%s", kv.val.u.counter < nitems(levels) ?
+			    levels[kv.val.u.counter] : "?");
+			continue;
+		}
+		if (fmt_scaled(kv.val.u.counter, buf) == -1)
+			(void)snprintf(buf, sizeof buf, "%zu", kv.val.u.counter);
+		printf(" %s=%s", type, buf);
+	}
+	if (name[0] != '\0')
+		printf("\n");
+
+	return (0);
+}
+
 static int
 do_show_stats(int argc, struct parameter *argv)
 {
@@ -874,9 +1642,9 @@ do_show_stats(int argc, struct parameter *argv)
 				    kv.key, (int64_t)kv.val.u.timestamp);
 				break;
 			case STAT_TIMEVAL:
-				printf("%s=%lld.%lld\n",
+				printf("%s=%lld.%06ld\n",
 				    kv.key, (long long)kv.val.u.tv.tv_sec,
-				    (long long)kv.val.u.tv.tv_usec);
+				    (long)kv.val.u.tv.tv_usec);
 				break;
 			case STAT_TIMESPEC:
 				printf("%s=%lld.%06ld\n",
@@ -895,18 +1663,28 @@ do_show_stats(int argc, struct parameter *argv)
 static int
 do_show_status(int argc, struct parameter *argv)
 {
-	uint32_t	sc_flags;
+	struct timeval	 tv;
+	const char	*name;
+	uint32_t	 sc_flags;
+	size_t		 usage;
 
 	srv_send(IMSG_CTL_SHOW_STATUS, NULL, 0);
 	srv_recv(IMSG_CTL_SHOW_STATUS);
 	srv_read(&sc_flags, sizeof(sc_flags));
-	srv_end();
 	printf("MDA %s\n",
 	    (sc_flags & SMTPD_MDA_PAUSED) ? "paused" : "running");
 	printf("MTA %s\n",
 	    (sc_flags & SMTPD_MTA_PAUSED) ? "paused" : "running");
 	printf("SMTP %s\n",
 	    (sc_flags & SMTPD_SMTP_PAUSED) ? "paused" : "running");
+	while (rlen) {
+		srv_get_string(&name);
+		srv_read(&tv, sizeof(tv));
+		srv_read(&usage, sizeof(usage));
+		printf("cpu %-14s %lld.%03lds %3zu%%\n", name,
+		    (long long)tv.tv_sec, (long)tv.tv_usec / 1000, usage);
+	}
+	srv_end();
 	return (0);
 }
 
@@ -1042,12 +1820,179 @@ do_discover(int argc, struct parameter *argv)
 	return (0);
 }
 
+/*
+ * Print the networks that the SPF policies of the domains read on the
+ * standard input allow, for use in whitelists.  The policies are walked
+ * as the builtin evaluation would, with every term taken as not matching
+ * so that all the allowed networks are listed.
+ */
+#define	SPFWALK_MAX_LOOKUPS	100
+
+static int	spfwalk_family = AF_UNSPEC;
+static struct dict spfwalk_seen;
+
 static int
 do_spf_walk(int argc, struct parameter *argv)
 {
+	struct spf_walk	*w;
+	const char	*ip_family = NULL;
+	char		*line = NULL;
+	size_t		 linesize = 0;
+	ssize_t		 linelen;
+
 	droppriv();
 
-	return spfwalk(argc, argv);
+	if (argv)
+		ip_family = argv[0].u.u_str;
+	if (ip_family) {
+		if (strcmp(ip_family, "-4") == 0)
+			spfwalk_family = AF_INET;
+		else if (strcmp(ip_family, "-6") == 0)
+			spfwalk_family = AF_INET6;
+		else
+			errx(1, "invalid ip_family");
+	}
+
+	dict_init(&spfwalk_seen);
+	event_init();
+
+	while ((linelen = getline(&line, &linesize, stdin)) != -1) {
+		while (linelen-- > 0 && isspace((unsigned char)line[linelen]))
+			line[linelen] = '\0';
+		if (linelen <= 0)
+			continue;
+
+		w = xcalloc(1, sizeof *w);
+		w->term = spfwalk_term;
+		w->expand = spfwalk_expand;
+		w->done = spfwalk_done;
+		w->family = spfwalk_family;
+		w->max_lookups = SPFWALK_MAX_LOOKUPS;
+		w->max_voids = SPFWALK_MAX_LOOKUPS;
+		spf_walk_start(w, line);
+	}
+	free(line);
+
+#if HAVE_PLEDGE
+	if (pledge("dns stdio", NULL) == -1)
+		err(1, "pledge");
+#endif
+
+	event_dispatch();
+
+	return (0);
+}
+
+static int
+spfwalk_term(struct spf_walk *w, struct spf_frame *f, struct spf_term *t)
+{
+	struct spf_dns	*d;
+	char		 name[MAXDNAME];
+	size_t		 i;
+	int		 waiting = 0;
+
+	/* only the networks that an including chain of "+" lets pass */
+	if (t->result != SPF_PASS)
+		return (0);
+	for (i = 0; i + 1 < w->depth; i++)
+		if (w->frames[i].txt->record->terms[w->frames[i].idx].result !=
+		    SPF_PASS)
+			return (0);
+
+	switch (t->mech) {
+	case SPF_IP4:
+		if (spfwalk_family != AF_INET6)
+			spfwalk_print(&t->net, t->cidr4);
+		return (0);
+	case SPF_IP6:
+		if (spfwalk_family != AF_INET)
+			spfwalk_print(&t->net, t->cidr6);
+		return (0);
+	case SPF_A:
+		if (spf_walk_target(w, f, t->spec, name, sizeof name) != 0)
+			return (0);
+		return (spfwalk_addrs(w, t, name));
+	case SPF_MX:
+		if (spf_walk_target(w, f, t->spec, name, sizeof name) != 0)
+			return (0);
+		if ((d = spf_dns_get(w, T_MX, name)) == NULL)
+			return (-1);
+		if (d->status != SPF_DNS_OK)
+			return (0);
+		d->refs++;
+		for (i = 0; i < d->count; i++)
+			if (spfwalk_addrs(w, t, d->names[i]) == -1)
+				waiting = 1;
+		spf_dns_unref(d);
+		return (waiting ? -1 : 0);
+	default:
+		/* ptr and exists depend on the client */
+		return (0);
+	}
+}
+
+static int
+spfwalk_addrs(struct spf_walk *w, struct spf_term *t, const char *name)
+{
+	struct spf_dns	*d;
+	size_t		 i;
+	int		 waiting = 0;
+
+	if (spfwalk_family != AF_INET6) {
+		if ((d = spf_dns_get(w, T_A, name)) == NULL)
+			waiting = 1;
+		else
+			for (i = 0; i < d->count; i++)
+				spfwalk_print(&d->addrs[i], t->cidr4);
+	}
+	if (spfwalk_family != AF_INET) {
+		if ((d = spf_dns_get(w, T_AAAA, name)) == NULL)
+			waiting = 1;
+		else
+			for (i = 0; i < d->count; i++)
+				spfwalk_print(&d->addrs[i], t->cidr6);
+	}
+	return (waiting ? -1 : 0);
+}
+
+static int
+spfwalk_expand(struct spf_walk *w, struct spf_frame *f, const char *spec,
+    char *buf, size_t len)
+{
+	warnx("%s: %s contains macros and can't be resolved", f->domain, spec);
+	return (1);
+}
+
+/* print each network once, terms may be evaluated again after a wait */
+static void
+spfwalk_print(const struct sockaddr_storage *ss, int cidr)
+{
+	char	buf[INET6_ADDRSTRLEN + 5];
+	int	max;
+
+	max = ss->ss_family == AF_INET ? 32 : 128;
+	if (inet_ntop(ss->ss_family, ss->ss_family == AF_INET ?
+	    (const void *)&((const struct sockaddr_in *)ss)->sin_addr :
+	    (const void *)&((const struct sockaddr_in6 *)ss)->sin6_addr,
+	    buf, INET6_ADDRSTRLEN) == NULL)
+		return;
+	if (cidr < max)
+		(void)snprintf(buf + strlen(buf), sizeof buf - strlen(buf),
+		    "/%d", cidr);
+	if (dict_check(&spfwalk_seen, buf))
+		return;
+	dict_set(&spfwalk_seen, buf, NULL);
+	printf("%s\n", buf);
+}
+
+static void
+spfwalk_done(struct spf_walk *w, int result)
+{
+	if (result == SPF_TEMPERROR)
+		warnx("%s: lookup failed", w->domain);
+	else if (result == SPF_PERMERROR)
+		warnx("%s: invalid SPF policy", w->domain);
+	free(w);
 }
 
 #define cmd_install_priv(s, f) \
@@ -1089,19 +2034,32 @@ main(int argc, char **argv)
 	cmd_install_priv("log brief",		do_log_brief);
 	cmd_install_priv("log verbose",		do_log_verbose);
 	cmd_install_priv("monitor",		do_monitor);
+	cmd_install_priv("monitor <int>",	do_monitor);
+	cmd_install_priv("monitor json",	do_monitor_json);
+	cmd_install_priv("monitor json <int>",	do_monitor_json);
+	cmd_install_priv("monitor openmetrics",	do_monitor_openmetrics);
+	cmd_install_priv("monitor openmetrics <int>", do_monitor_openmetrics);
 	cmd_install_priv("pause envelope <evpid>", do_pause_envelope);
 	cmd_install_priv("pause envelope <msgid>", do_pause_envelope);
 	cmd_install_priv("pause envelope all",	do_pause_envelope);
+	cmd_install_priv("pause envelope filter <str>",
+	    do_pause_envelope_filter);
 	cmd_install_priv("pause mda",		do_pause_mda);
 	cmd_install_priv("pause mta",		do_pause_mta);
 	cmd_install_priv("pause smtp",		do_pause_smtp);
 	cmd_install_priv("profile <str>",	do_profile);
+	cmd_install_priv("queue export",	do_queue_export);
+	cmd_install_priv("queue export <str>", do_queue_export);
+	cmd_install_priv("queue import",	do_queue_import);
 	cmd_install_priv("remove <evpid>",	do_remove);
 	cmd_install_priv("remove <msgid>",	do_remove);
 	cmd_install_priv("remove all",		do_remove);
+	cmd_install_priv("remove filter <str>",	do_remove_filter);
 	cmd_install_priv("resume envelope <evpid>", do_resume_envelope);
 	cmd_install_priv("resume envelope <msgid>", do_resume_envelope);
 	cmd_install_priv("resume envelope all",	do_resume_envelope);
+	cmd_install_priv("resume envelope filter <str>",
+	    do_resume_envelope_filter);
 	cmd_install_priv("resume mda",		do_resume_mda);
 	cmd_install_priv("resume mta",		do_resume_mta);
 	cmd_install_priv("resume route <routeid>", do_resume_route);
@@ -1109,13 +2067,20 @@ main(int argc, char **argv)
 	cmd_install_priv("schedule <msgid>",	do_schedule);
 	cmd_install_priv("schedule <evpid>",	do_schedule);
 	cmd_install_priv("schedule all",	do_schedule);
+	cmd_install_priv("schedule filter <str>", do_schedule_filter);
+	cmd_install_priv("show destinations",	do_show_destinations);
 	cmd_install_priv("show envelope <evpid>", do_show_envelope);
+	cmd_install_priv("show filters",	do_show_filters);
+	cmd_install_priv("show profile",	do_show_profile);
 	cmd_install_priv("show hoststats",	do_show_hoststats);
 	cmd_install_priv("show message <msgid>", do_show_message);
 	cmd_install_priv("show message <evpid>", do_show_message);
 	cmd_install_priv("show queue",		do_show_queue);
 	cmd_install_priv("show queue <msgid>",	do_show_queue);
+	cmd_install_priv("show queue filter <str>", do_show_queue_filter);
+	cmd_install_priv("show queue summary",	do_show_queue_summary);
 	cmd_install_priv("show hosts",		do_show_hosts);
+	cmd_install_priv("show memory",		do_show_memory);
 	cmd_install_priv("show relays",		do_show_relays);
 	cmd_install_priv("show routes",		do_show_routes);
 	cmd_install_priv("show stats",		do_show_stats);
@@ -1283,7 +2248,8 @@ show_offline_envelope(uint64_t evpid)
 	struct envelope	evp;
 
 	if (!bsnprintf(pathname, sizeof pathname,
-		"/queue/%02x/%08x/%016"PRIx64,
+		"%s/queue/%02x/%08x/%016"PRIx64,
+		queue_shard_root(queue_shard(evpid_to_msgid(evpid))),
 		(evpid_to_msgid(evpid) & 0xff000000) >> 24,
 		evpid_to_msgid(evpid), evpid))
 		goto end;
@@ -1301,7 +2267,7 @@ show_offline_envelope(uint64_t evpid)
 		goto end;
 	}
 
-	if (is_gzip_buffer(p)) {
+	if (is_gzip_buffer(p) || compress_backend_detect(p, plen)) {
 		warnx("offline compressed queue is not supported yet");
 		goto end;
 	}
@@ -1323,6 +2289,7 @@ display(const char *s)
 	char   *key;
 	int	gzipped;
 	char   *gzcat_argv0 = strrchr(PATH_GZCAT, '/') + 1;
+	uint8_t	magic[4];
 
 	if ((fp = fopen(s, "r")) == NULL)
 		err(1, "fopen");
@@ -1353,6 +2320,21 @@ display(const char *s)
 	}
 	gzipped = is_gzip_fp(fp);
 
+	/* the framed formats have no external tool to rely on */
+	if (!gzipped && fread(magic, 1, sizeof magic, fp) == sizeof magic &&
+	    compress_backend_detect(magic, sizeof magic)) {
+		FILE   *ofp = NULL;
+
+		if ((ofp = tmpfile()) == NULL)
+			err(1, "tmpfile");
+		fseek(fp, 0, SEEK_SET);
+		if (!uncompress_file(fp, ofp))
+			errx(1, "could not uncompress object");
+		fclose(fp);
+		fp = ofp;
+	}
+	fseek(fp, 0, SEEK_SET);
+
 	lseek(fileno(fp), 0, SEEK_SET);
 	(void)dup2(fileno(fp), STDIN_FILENO);
 	if (gzipped)
@@ -1395,6 +2377,136 @@ str_to_trace(const char *str)
 	return (0);
 }
 
+/*
+ * Parse a comma separated list of key=value filters such as
+ * "domain=example.org,state=pending,age=1h,fields=id+rcpt+error".
+ */
+static void
+str_to_queue_filter(char *spec, struct queue_filter *f)
+{
+	static const struct {
+		const char	*name;
+		uint32_t	 field;
+	} fields[] = {
+		{ "id",		QUEUE_FIELD_ID },
+		{ "type",	QUEUE_FIELD_TYPE },
+		{ "sender",	QUEUE_FIELD_SENDER },
+		{ "rcpt",	QUEUE_FIELD_RCPT },
+		{ "dest",	QUEUE_FIELD_DEST },
+		{ "ctime",	QUEUE_FIELD_CTIME },
+		{ "expire",	QUEUE_FIELD_EXPIRE },
+		{ "lasttry",	QUEUE_FIELD_LASTTRY },
+		{ "retry",	QUEUE_FIELD_RETRY },
+		{ "state",	QUEUE_FIELD_STATE },
+		{ "error",	QUEUE_FIELD_ERROR },
+	};
+	const char	*errstr;
+	char		*key, *val, *name, *ep;
+	long long	 age;
+	size_t		 i;
+
+	memset(f, 0, sizeof(*f));
+	f->type = -1;
+
+	while ((key = strsep(&spec, ",")) != NULL) {
+		if (*key == '\0')
+			continue;
+		if ((val = strchr(key, '=')) != NULL)
+			*val++ = '\0';
+
+		if (!strcmp(key, "summary") && val == NULL) {
+			f->summary = 1;
+			continue;
+		}
+		if (val == NULL || *val == '\0')
+			errx(1, "filter %s: missing value", key);
+
+		if (!strcmp(key, "domain")) {
+			if (strlcpy(f->domain, val, sizeof(f->domain)) >=
+			    sizeof(f->domain))
+				errx(1, "filter domain: too long");
+		} else if (!strcmp(key, "sender")) {
+			if (strlcpy(f->sender, val, sizeof(f->sender)) >=
+			    sizeof(f->sender))
+				errx(1, "filter sender: too long");
+		} else if (!strcmp(key, "tag")) {
+			if (strlcpy(f->tag, val, sizeof(f->tag)) >=
+			    sizeof(f->tag))
+				errx(1, "filter tag: too long");
+		} else if (!strcmp(key, "error")) {
+			if (strlcpy(f->error, val, sizeof(f->error)) >=
+			    sizeof(f->error))
+				errx(1, "filter error: too long");
+		} else if (!strcmp(key, "state")) {
+			if (!strcmp(val, "pending"))
+				f->flags = EF_PENDING;
+			else if (!strcmp(val, "inflight"))
+				f->flags = EF_INFLIGHT;
+			else if (!strcmp(val, "held"))
+				f->flags = EF_HOLD;
+			else if (!strcmp(val, "suspended"))
+				f->flags = EF_SUSPEND;
+			else
+				errx(1, "filter state: invalid: %s", val);
+		} else if (!strcmp(key, "type")) {
+			if (!strcmp(val, "mda"))
+				f->type = D_MDA;
+			else if (!strcmp(val, "mta"))
+				f->type = D_MTA;
+			else if (!strcmp(val, "bounce"))
+				f->type = D_BOUNCE;
+			else
+				errx(1, "filter type: invalid: %s", val);
+		} else if (!strcmp(key, "age")) {
+			age = strtoll(val, &ep, 10);
+			if (ep == val || age < 0)
+				errx(1, "filter age: invalid: %s", val);
+			switch (*ep) {
+			case 'd':
+				age *= 24;
+				/* FALLTHROUGH */
+			case 'h':
+				age *= 60;
+				/* FALLTHROUGH */
+			case 'm':
+				age *= 60;
+				/* FALLTHROUGH */
+			case 's':
+				ep++;
+				/* FALLTHROUGH */
+			case '\0':
+				break;
+			}
+			if (*ep != '\0')
+				errx(1, "filter age: invalid: %s", val);
+			f->age = age;
+		} else if (!strcmp(key, "limit")) {
+			f->limit = strtonum(val, 1, LLONG_MAX, &errstr);
+			if (errstr)
+				errx(1, "filter limit: %s: %s", errstr, val);
+		} else if (!strcmp(key, "after")) {
+			f->from = strtoull(val, &ep, 16);
+			if (ep == val || *ep != '\0')
+				errx(1, "filter after: invalid: %s", val);
+			f->from++;
+		} else if (!strcmp(key, "fields")) {
+			while ((name = strsep(&val, "+")) != NULL) {
+				for (i = 0; i < nitems(fields); i++)
+					if (!strcmp(fields[i].name, name))
+						break;
+				if (i == nitems(fields))
+					errx(1, "filter fields: invalid: %s",
+					    name);
+				f->fields |= fields[i].field;
+			}
+		} else
+			errx(1, "invalid filter: %s", key);
+	}
+
+	if (f->summary && f->fields)
+		errx(1, "summary cannot be combined with fields");
+}
+
 static int
 str_to_profile(const char *str)
 {
@@ -1402,6 +2514,8 @@ str_to_profile(const char *str)
 		return PROFILE_IMSG;
 	if (!strcmp(str, "queue"))
 		return PROFILE_QUEUE;
+	if (!strcmp(str, "loop"))
+		return PROFILE_LOOP;
 	errx(1, "invalid profile keyword: %s", str);
 	return (0);
 }
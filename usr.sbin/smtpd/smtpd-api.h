@@ -21,6 +21,7 @@
 #define	_SMTPD_API_H_
 
 #include "dict.h"
+#include "hdict.h"
 #include "tree.h"
 
 struct mailaddr {
@@ -44,8 +45,19 @@ enum {
 	PROC_QUEUE_ENVELOPE_LOAD,
 	PROC_QUEUE_ENVELOPE_UPDATE,
 	PROC_QUEUE_ENVELOPE_WALK,
+	PROC_QUEUE_CAPABILITIES,
+	PROC_QUEUE_ENVELOPE_DELETE_BATCH,
 };
 
+/*
+ * A backend may append these flags to its PROC_QUEUE_INIT reply.  The
+ * ones smtpd will use are then confirmed by PROC_QUEUE_CAPABILITIES.
+ * With PIPELINE, requests may be sent before earlier ones are answered
+ * and every reply carries the peerid of its request.
+ */
+#define	PROC_QUEUE_CAP_PIPELINE		0x01
+#define	PROC_QUEUE_CAP_DELETE_BATCH	0x02
+
 #define PROC_SCHEDULER_API_VERSION	2
 
 struct scheduler_info;
@@ -68,8 +80,24 @@ enum {
 	PROC_SCHEDULER_REMOVE,
 	PROC_SCHEDULER_SUSPEND,
 	PROC_SCHEDULER_RESUME,
+	PROC_SCHEDULER_CAPABILITIES,
+	PROC_SCHEDULER_INSERT_BATCH,
+	PROC_SCHEDULER_DELETE_BATCH,
 };
 
+/*
+ * As for queue backends, a scheduler backend may append these flags to
+ * its PROC_SCHEDULER_INIT reply, and those smtpd will use are confirmed
+ * by PROC_SCHEDULER_CAPABILITIES.  With PIPELINE, inserts, deletes,
+ * holds and releases are sent without waiting for their reply, and
+ * every reply carries the peerid of its request.  With BATCH, inserts
+ * and deletes are coalesced into INSERT_BATCH requests carrying an
+ * array of struct scheduler_info and DELETE_BATCH requests carrying an
+ * array of evpids, each answered by a single int.
+ */
+#define	PROC_SCHEDULER_CAP_PIPELINE	0x01
+#define	PROC_SCHEDULER_CAP_BATCH	0x02
+
 enum envelope_flags {
 	EF_AUTHENTICATED	= 0x01,
 	EF_BOUNCE		= 0x02,
@@ -136,6 +164,7 @@ enum table_service {
 	K_STRING	= 0x400,
 	K_REGEX		= 0x800,
 	K_AUTH		= 0x1000,
+	K_PKI		= 0x2000,	/* returns struct pkifiles	*/
 };
 #define K_ANY		  0xffff
 
@@ -247,11 +276,18 @@ void queue_api_on_message_create(int(*)(uint32_t *));
 void queue_api_on_message_commit(int(*)(uint32_t, const char*));
 void queue_api_on_message_delete(int(*)(uint32_t));
 void queue_api_on_message_fd_r(int(*)(uint32_t));
+void queue_api_on_message_index(int(*)(uint32_t, const char *, size_t));
+void queue_api_on_message_index_load(int(*)(uint32_t, char *, size_t));
 void queue_api_on_envelope_create(int(*)(uint32_t, const char *, size_t, uint64_t *));
 void queue_api_on_envelope_delete(int(*)(uint64_t));
+void queue_api_on_envelope_delete_batch(int(*)(const uint64_t *, size_t));
 void queue_api_on_envelope_update(int(*)(uint64_t, const char *, size_t));
+void queue_api_on_envelope_retry(int(*)(uint64_t, const char *, size_t));
 void queue_api_on_envelope_load(int(*)(uint64_t, char *, size_t));
 void queue_api_on_envelope_walk(int(*)(uint64_t *, char *, size_t));
+void queue_api_on_envelope_summary(int(*)(uint64_t, const char *, size_t));
+void queue_api_on_summary_open(int(*)(void));
+void queue_api_on_summary_walk(int(*)(uint64_t *, char *, size_t));
 void queue_api_on_message_walk(int(*)(uint64_t *, char *, size_t,
     uint32_t, int *, void **));
 void queue_api_no_chroot(void);
@@ -52,6 +52,10 @@
 #define	PATH_MAILLOCAL		PATH_LIBEXEC "/mail.local"
 #endif
 
+#ifndef	PATH_LOCKSPOOL
+#define	PATH_LOCKSPOOL		PATH_LIBEXEC "/lockspool"
+#endif
+
 #ifndef PATH_MAKEMAP
 #define	PATH_MAKEMAP		"/usr/sbin/makemap"
 #endif
@@ -27,6 +27,12 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#if defined(HAVE_SYS_INOTIFY_H)
+#include <sys/inotify.h>
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/event.h>
+#endif
 
 #ifdef BSD_AUTH
 #include <bsd_auth.h>
@@ -95,23 +101,47 @@ static void parent_send_config_lka(void);
 static void parent_send_config_dispatcher(void);
 static void parent_send_config_ca(void);
 static void parent_sig_handler(int, short, void *);
-static void forkmda(struct mproc *, uint64_t, struct deliver *);
-static int parent_forward_open(char *, char *, uid_t, gid_t);
+static int launcher(void);
+static void launcher_imsg(struct mproc *, struct imsg *);
+static void forkmda(struct mproc *, uint64_t, struct deliver *,
+    struct maildir_target *, size_t, struct mbox_message *, size_t);
+static int maildir_path(struct dispatcher *, struct deliver *, const char *,
+    char *, size_t);
+static int delivery_user(const char *, struct userinfo *);
+static void lmtp_connect(struct mproc *, uint64_t, const char *);
+static int parent_forward_open(char *, char *, uid_t, gid_t,
+    struct forward_ident *);
+static int parent_forward_unchanged(struct forward_req *);
+static void parent_open_pki(uint64_t, const char *, const char *);
 static struct child *child_add(pid_t, int, const char *);
 static struct mproc *start_child(int, char **, char *);
-static struct mproc *setup_peer(enum smtp_proc_type, pid_t, int);
+static struct mproc *setup_peer(enum smtp_proc_type, pid_t, int, int);
 static void setup_peers(struct mproc *, struct mproc *);
 static void setup_done(struct mproc *);
 static void setup_proc(void);
-static struct mproc *setup_peer(enum smtp_proc_type, pid_t, int);
+static struct mproc *setup_peer(enum smtp_proc_type, pid_t, int, int);
 static int imsg_wait(struct imsgbuf *, struct imsg *, int);
+static void parent_reload(void);
+static void parent_reload_spawn(void);
+static void parent_reload_imsg(struct mproc *, struct imsg *);
+static void parent_reload_broadcast(int);
+static void parent_stop(void);
+static void parent_stop_timeout(int, short, void *);
+static void parent_takeover_setup(void);
+static void parent_takeover_listeners(void);
+static void parent_takeover_imsg(struct mproc *, struct imsg *);
 
 static void	offline_scan(int, short, void *);
+static void	offline_schedule(time_t);
+static void	offline_watch(void);
+static void	offline_notify(int, short, void *);
 static int	offline_add(char *, uid_t, gid_t);
 static void	offline_done(void);
 static int	offline_enqueue(char *, uid_t, gid_t);
 
 static void	purge_task(void);
+static void	purge_timeout(int, short, void *);
+static void	ticket_timeout(int, short, void *);
 static int	parent_auth_user(const char *, const char *);
 static void	load_pki_tree(void);
 static void	load_pki_keys(void);
@@ -119,6 +149,19 @@ static void	load_pki_keys(void);
 static void	fork_filter_processes(void);
 static void	fork_filter_process(const char *, const char *, const char *, const char *, const char *, uint32_t);
 
+/*
+ * The delivery users of the dispatchers, as last returned by getpwnam(),
+ * kept USERINFO_CACHE_TTL seconds.  There are only as many as the
+ * dispatchers with a user option.
+ */
+struct delivery_user {
+	struct userinfo		 userinfo;
+	time_t			 expire;
+	int			 found;
+};
+
+static struct dict	delivery_users;
+
 enum child_type {
 	CHILD_DAEMON,
 	CHILD_MDA,
@@ -133,6 +176,8 @@ struct child {
 	int			 mda_out;
 	uint64_t		 mda_id;
 	char			*path;
+	char			**paths;
+	size_t			 npaths;
 	char			*cause;
 };
 
@@ -143,16 +188,78 @@ struct offline {
 	char			*path;
 };
 
-#define OFFLINE_READMAX		20
-#define OFFLINE_QUEUEMAX	5
+/*
+ * The offline directory is scanned at startup, and again whenever a file
+ * is written to it if the system can tell.  A scan pass reads up to
+ * OFFLINE_READMAX files, and the scan pauses while OFFLINE_BACKLOG files
+ * wait for one of the env->sc_queue_offline_max enqueue sessions.  Files
+ * younger than OFFLINE_SETTLE seconds may still be written to, they are
+ * left for a later scan.
+ */
+#define OFFLINE_READMAX		256
+#define OFFLINE_BACKLOG		1024
+#define OFFLINE_SETTLE		2
 static size_t			offline_running = 0;
+static size_t			offline_queued = 0;
 TAILQ_HEAD(, offline)		offline_q;
+static struct hdict		offline_files;	/* queued, running or failed */
+static FTS		       *offline_fts;
+static int			offline_rescan;
+static int			offline_young;
+static int			offline_watch_fd = -1;
+static struct event		offline_watch_ev;
 
 static struct event		config_ev;
 static struct event		offline_ev;
-static struct timeval		offline_timeout;
+
+/* the queue moves delivered messages to purge/ at runtime */
+#define PURGE_INTERVAL		60
 
 static pid_t			purge_pid = -1;
+static struct event		purge_ev;
+
+/*
+ * The session ticket keys of the tls workers are made here and shared,
+ * so that a client resumes its session on whichever worker it lands.
+ * They are renewed as libtls would, after 3/4 of the session lifetime,
+ * and the workers keep the previous ones for the rest of it.
+ */
+static struct event		ticket_ev;
+static uint32_t			ticket_keyrev;
+
+/*
+ * On SIGHUP, a new generation of smtpd is started and given the
+ * listening sockets over a channel, which stays open until this
+ * generation has drained its sessions and handed over the scheduler
+ * state.  The new generation sees the end of the channel as the time
+ * to take over.
+ */
+enum reload_state {
+	RELOAD_NONE,
+	RELOAD_LISTENERS,	/* collecting the listening sockets */
+	RELOAD_STARTING,	/* waiting for the new generation */
+	RELOAD_DRAINING,	/* the new generation accepts */
+};
+
+struct reload_listener {
+	TAILQ_ENTRY(reload_listener)	 entry;
+	struct sockaddr_storage		 ss;
+	int				 fd;
+};
+
+static enum reload_state	reload_state = RELOAD_NONE;
+static int			reload_pending;	/* smtp processes to hear from */
+static struct mproc	       *p_reload = NULL;
+static char		       *reload_key = NULL;
+static TAILQ_HEAD(, reload_listener) reload_listeners =
+    TAILQ_HEAD_INITIALIZER(reload_listeners);
+
+/*
+ * On SIGTERM, the scheduler state is saved the same way before exiting,
+ * for the next start to pick up instead of reading the whole queue.
+ */
+static int			stopping;
+static struct event		stop_ev;
 
 extern char	**environ;
 void		(*imsg_callback)(struct mproc *, struct imsg *);
@@ -165,9 +272,15 @@ struct mproc	*p_control = NULL;
 struct mproc	*p_lka = NULL;
 struct mproc	*p_parent = NULL;
 struct mproc	*p_queue = NULL;
-struct mproc	*p_scheduler = NULL;
+struct mproc	*p_schedulers[SCHEDULER_SHARDS_MAX];
 struct mproc	*p_dispatcher = NULL;
 struct mproc	*p_ca = NULL;
+struct mproc	*p_launcher = NULL;
+struct mproc	*p_logger = NULL;
+struct mproc	*p_resolver = NULL;
+struct mproc	*p_tls[TLS_WORKERS_MAX];
+struct mproc	*p_mta[MTA_WORKERS_MAX];
+struct mproc	*p_smtp[SMTP_WORKERS_MAX];
 
 const char	*backend_queue = "fs";
 const char	*backend_scheduler = "ramqueue";
@@ -189,15 +302,12 @@ parent_imsg(struct mproc *p, struct imsg *imsg)
 {
 	struct forward_req	*fwreq;
 	struct filter_proc	*processor;
-	struct deliver		 deliver;
-	struct child		*c;
+	struct reload_listener	*rl;
 	struct msg		 m;
-	const void		*data;
-	const char		*username, *password, *cause, *procname;
+	const char		*username, *password, *procname;
+	const char		*certfile, *keyfile;
 	uint64_t		 reqid;
-	size_t			 sz;
-	void			*i;
-	int			 fd, n, v, ret;
+	int			 fd, v, ret;
 
 	if (imsg == NULL)
 		fatalx("process %s socket closed", p->name);
@@ -206,8 +316,14 @@ parent_imsg(struct mproc *p, struct imsg *imsg)
 	case IMSG_LKA_OPEN_FORWARD:
 		CHECK_IMSG_DATA_SIZE(imsg, sizeof *fwreq);
 		fwreq = imsg->data;
+		if (fwreq->cached && parent_forward_unchanged(fwreq)) {
+			fwreq->status = 2;
+			m_compose(p, IMSG_LKA_OPEN_FORWARD, 0, 0, -1,
+			    fwreq, sizeof *fwreq);
+			return;
+		}
 		fd = parent_forward_open(fwreq->user, fwreq->directory,
-		    fwreq->uid, fwreq->gid);
+		    fwreq->uid, fwreq->gid, &fwreq->ident);
 		fwreq->status = 0;
 		if (fd == -1 && errno != ENOENT) {
 			if (errno == EAGAIN)
@@ -219,6 +335,15 @@ parent_imsg(struct mproc *p, struct imsg *imsg)
 		    fwreq, sizeof *fwreq);
 		return;
 
+	case IMSG_LKA_OPEN_PKI:
+		m_msg(&m, imsg);
+		m_get_id(&m, &reqid);
+		m_get_string(&m, &certfile);
+		m_get_string(&m, &keyfile);
+		m_end(&m);
+		parent_open_pki(reqid, certfile, keyfile);
+		return;
+
 	case IMSG_LKA_AUTHENTICATE:
 		/*
 		 * If we reached here, it means we want root to lookup
@@ -238,46 +363,12 @@ parent_imsg(struct mproc *p, struct imsg *imsg)
 		m_close(p);
 		return;
 
-	case IMSG_MDA_FORK:
-		m_msg(&m, imsg);
-		m_get_id(&m, &reqid);
-		m_get_data(&m, &data, &sz);
-		m_end(&m);
-		if (sz != sizeof(deliver))
-			fatalx("expected deliver");
-		memmove(&deliver, data, sz);
-		forkmda(p, reqid, &deliver);
-		return;
-
-	case IMSG_MDA_KILL:
-		m_msg(&m, imsg);
-		m_get_id(&m, &reqid);
-		m_get_string(&m, &cause);
-		m_end(&m);
-
-		i = NULL;
-		while ((n = tree_iter(&children, &i, NULL, (void**)&c)))
-			if (c->type == CHILD_MDA &&
-			    c->mda_id == reqid &&
-			    c->cause == NULL)
-				break;
-		if (!n) {
-			log_debug("debug: smtpd: "
-			    "kill request: proc not found");
-			return;
-		}
-
-		c->cause = xstrdup(cause);
-		log_debug("debug: smtpd: kill requested for %u: %s",
-		    c->pid, c->cause);
-		kill(c->pid, SIGTERM);
-		return;
-
 	case IMSG_CTL_VERBOSE:
 		m_msg(&m, imsg);
 		m_get_int(&m, &v);
 		m_end(&m);
 		log_trace_verbose(v);
+		m_forward(p_launcher, imsg);
 		return;
 
 	case IMSG_CTL_PROFILE:
@@ -285,6 +376,11 @@ parent_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_int(&m, &v);
 		m_end(&m);
 		profiling = v;
+		m_forward(p_launcher, imsg);
+		return;
+
+	case IMSG_CTL_SHOW_PROFILE:
+		profile_show(p, imsg->hdr.peerid);
 		return;
 
 	case IMSG_LKA_PROCESSOR_ERRFD:
@@ -297,6 +393,38 @@ parent_imsg(struct mproc *p, struct imsg *imsg)
 		m_add_string(p_lka, procname);
 		m_close(p_lka);
 		return;
+
+	case IMSG_RELOAD_LISTENER:
+		/* the listening sockets, up to one without a fd per process */
+		if ((fd = imsg_get_fd(imsg)) == -1) {
+			if (--reload_pending == 0)
+				parent_reload_spawn();
+			return;
+		}
+		CHECK_IMSG_DATA_SIZE(imsg, sizeof(rl->ss));
+		rl = xcalloc(1, sizeof(*rl));
+		memcpy(&rl->ss, imsg->data, sizeof(rl->ss));
+		rl->fd = fd;
+		TAILQ_INSERT_TAIL(&reload_listeners, rl, entry);
+		return;
+
+	case IMSG_RELOAD_DRAIN:
+		/* no session left, the schedulers can hand over */
+		if (--reload_pending == 0) {
+			m_create(p_queue, IMSG_RELOAD_DRAIN, 0, 0, -1);
+			m_add_int(p_queue, 1);
+			m_close(p_queue);
+		}
+		return;
+
+	case IMSG_RELOAD_DONE:
+		if (stopping)
+			log_debug("debug: smtpd: scheduler state saved");
+		else
+			log_info("info: reload: handed over to the new "
+			    "generation");
+		parent_shutdown();
+		/* NOTREACHED */
 	}
 
 	fatalx("parent_imsg: unexpected %s imsg from %s",
@@ -317,19 +445,35 @@ static void
 parent_shutdown(void)
 {
 	pid_t pid;
+	int i;
 
 	mproc_clear(p_ca);
+	mproc_clear(p_launcher);
 	mproc_clear(p_dispatcher);
 	mproc_clear(p_control);
 	mproc_clear(p_lka);
-	mproc_clear(p_scheduler);
+	mproc_clear(p_resolver);
+	for (i = 0; i < env->sc_scheduler_shards; i++)
+		mproc_clear(p_schedulers[i]);
 	mproc_clear(p_queue);
+	for (i = 0; i < env->sc_tls_workers; i++)
+		mproc_clear(p_tls[i]);
+	for (i = 0; i < env->sc_mta_workers; i++)
+		mproc_clear(p_mta[i]);
+	for (i = 0; i < env->sc_smtp_workers; i++)
+		mproc_clear(p_smtp[i]);
+	if (p_logger) {
+		logger_client_done();
+		mproc_clear(p_logger);
+	}
 
 	do {
 		pid = waitpid(WAIT_MYPGRP, NULL, 0);
 	} while (pid != -1 || (pid == -1 && errno == EINTR));
 
-	unlink(SMTPD_SOCKET);
+	/* the socket belongs to the new generation */
+	if (reload_state != RELOAD_DRAINING)
+		unlink(SMTPD_SOCKET);
 
 	log_info("Exiting");
 	exit(0);
@@ -347,9 +491,16 @@ parent_send_config(int fd, short event, void *p)
 static void
 parent_send_config_dispatcher(void)
 {
+	int	i;
+
 	log_debug("debug: parent_send_config: configuring dispatcher process");
 	m_compose(p_dispatcher, IMSG_CONF_START, 0, 0, -1, NULL, 0);
 	m_compose(p_dispatcher, IMSG_CONF_END, 0, 0, -1, NULL, 0);
+
+	for (i = 0; i < env->sc_smtp_workers; i++) {
+		m_compose(p_smtp[i], IMSG_CONF_START, 0, 0, -1, NULL, 0);
+		m_compose(p_smtp[i], IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	}
 }
 
 void
@@ -375,13 +526,14 @@ parent_sig_handler(int sig, short event, void *p)
 	int		 status, fail;
 	pid_t		 pid;
 	char		*cause;
+	size_t		 j;
 
 	switch (sig) {
 	case SIGTERM:
 	case SIGINT:
 		log_debug("debug: got signal %d", sig);
-		parent_shutdown();
-		/* NOT REACHED */
+		parent_stop();
+		return;
 
 	case SIGCHLD:
 		do {
@@ -463,6 +615,16 @@ parent_sig_handler(int sig, short event, void *p)
 					child->cause = NULL;
 				}
 				free(child->cause);
+				if (child->path && mda_status == MDA_OK)
+					mda_maildir_cache(child->path);
+				free(child->path);
+				for (j = 0; j < child->npaths; j++) {
+					if (mda_status == MDA_OK)
+						mda_maildir_cache(
+						    child->paths[j]);
+					free(child->paths[j]);
+				}
+				free(child->paths);
 				log_debug("debug: smtpd: mda process done "
 				    "for session %016"PRIx64 ": %s",
 				    child->mda_id, cause);
@@ -478,13 +640,16 @@ parent_sig_handler(int sig, short event, void *p)
 				break;
 
 			case CHILD_ENQUEUE_OFFLINE:
+				/* failed files are not retried until restart */
 				if (fail)
 					log_warnx("warn: smtpd: "
 					    "couldn't enqueue offline "
 					    "message %s; smtpctl %s",
 					    child->path, cause);
-				else
+				else {
 					unlink(child->path);
+					hdict_pop(&offline_files, child->path);
+				}
 				free(child->path);
 				offline_done();
 				break;
@@ -497,6 +662,9 @@ parent_sig_handler(int sig, short event, void *p)
 			free(cause);
 		} while (pid > 0 || (pid == -1 && errno == EINTR));
 
+		break;
+	case SIGHUP:
+		parent_reload();
 		break;
 	default:
 		fatalx("smtpd: unexpected signal");
@@ -506,7 +674,7 @@ parent_sig_handler(int sig, short event, void *p)
 int
 main(int argc, char *argv[])
 {
-	int		 c, i;
+	int		 c, i, j;
 	int		 opts, flags;
 	const char	*conffile = CONF_FILE;
 	int		 save_argc = argc;
@@ -553,13 +721,20 @@ main(int argc, char *argv[])
 	env = conf;
 
 	TAILQ_INIT(&offline_q);
+	hdict_init(&offline_files);
 
-	while ((c = getopt(argc, argv, "B:dD:hnP:f:FT:vx:")) != -1) {
+	while ((c = getopt(argc, argv, "B:dD:hHnP:f:FT:vx:")) != -1) {
 		switch (c) {
 		case 'B':
-			if (strstr(optarg, "queue=") == optarg)
+			if (strstr(optarg, "queue=") == optarg) {
 				backend_queue = strchr(optarg, '=') + 1;
-			else if (strstr(optarg, "scheduler=") == optarg)
+#ifndef HAVE_DB_API
+				/* or it would be taken for a proc backend */
+				if (!strcmp(backend_queue, "db"))
+					fatalx("queue backend \"db\" not "
+					    "available: built without db(3)");
+#endif
+			} else if (strstr(optarg, "scheduler=") == optarg)
 				backend_scheduler = strchr(optarg, '=') + 1;
 			else if (strstr(optarg, "stat=") == optarg)
 				backend_stat = strchr(optarg, '=') + 1;
@@ -582,6 +757,10 @@ main(int argc, char *argv[])
 			log_info("version: " SMTPD_NAME " " SMTPD_VERSION);
 			usage();
 			break;
+		case 'H':
+			/* internal, the new generation on reload */
+			opts |= SMTPD_OPT_TAKEOVER;
+			break;
 		case 'n':
 			debug = 2;
 			opts |= SMTPD_OPT_NOACTION;
@@ -634,6 +813,8 @@ main(int argc, char *argv[])
 				profiling |= PROFILE_IMSG;
 			else if (!strcmp(optarg, "profile-queue"))
 				profiling |= PROFILE_QUEUE;
+			else if (!strcmp(optarg, "profile-loop"))
+				profiling |= PROFILE_LOOP;
 			else
 				log_warnx("warn: unknown trace flag \"%s\"",
 				    optarg);
@@ -665,6 +846,18 @@ main(int argc, char *argv[])
 
 	env->sc_opts |= opts;
 
+	/*
+	 * Only the lka looks up tables: the other children parse the
+	 * configuration without loading the contents of static tables,
+	 * so that large ones are neither read nor held by every process.
+	 */
+	if (rexec != NULL && strcmp(rexec, "lka") != 0)
+		env->sc_opts |= SMTPD_OPT_NOTABLES;
+
+	/* read the channel first, it then closes cleanly if we fail */
+	if (rexec == NULL && env->sc_opts & SMTPD_OPT_TAKEOVER)
+		parent_takeover_setup();
+
 	if (parse_config(conf, conffile, opts))
 		exit(1);
 
@@ -696,6 +889,8 @@ main(int argc, char *argv[])
 
 	log_init(foreground_log, LOG_MAIL);
 	log_trace_verbose(tracing);
+	io_set_profiler(profile_begin, profile_end);
+	io_set_clock(clock_cache_enter, clock_cache_leave);
 	load_pki_tree();
 	load_pki_keys();
 
@@ -710,6 +905,9 @@ main(int argc, char *argv[])
 	if (rexec == NULL) {
 		smtpd_process = PROC_PARENT;
 
+		if (reload_key)
+			env->sc_queue_key = reload_key;
+
 		if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
 			if (env->sc_queue_key == NULL) {
 				char	*password;
@@ -755,25 +953,102 @@ main(int argc, char *argv[])
 		p_lka = start_child(save_argc, save_argv, "lka");
 		p_lka->proc = PROC_LKA;
 
+		p_resolver = start_child(save_argc, save_argv, "resolver");
+		p_resolver->proc = PROC_RESOLVER;
+
 		p_dispatcher = start_child(save_argc, save_argv, "dispatcher");
 		p_dispatcher->proc = PROC_DISPATCHER;
 
 		p_queue = start_child(save_argc, save_argv, "queue");
 		p_queue->proc = PROC_QUEUE;
 
-		p_scheduler = start_child(save_argc, save_argv, "scheduler");
-		p_scheduler->proc = PROC_SCHEDULER;
+		for (i = 0; i < env->sc_scheduler_shards; i++) {
+			p_schedulers[i] = start_child(save_argc, save_argv,
+			    "scheduler");
+			p_schedulers[i]->proc = PROC_SCHEDULER;
+			p_schedulers[i]->shard = i;
+		}
+
+		p_launcher = start_child(save_argc, save_argv, "launcher");
+		p_launcher->proc = PROC_LAUNCHER;
+
+		for (i = 0; i < env->sc_tls_workers; i++) {
+			p_tls[i] = start_child(save_argc, save_argv, "tls");
+			p_tls[i]->proc = PROC_TLS;
+			p_tls[i]->shard = i;
+		}
+
+		for (i = 0; i < env->sc_mta_workers; i++) {
+			p_mta[i] = start_child(save_argc, save_argv, "mta");
+			p_mta[i]->proc = PROC_MTA;
+			p_mta[i]->shard = i;
+		}
+
+		for (i = 0; i < env->sc_smtp_workers; i++) {
+			p_smtp[i] = start_child(save_argc, save_argv, "smtp");
+			p_smtp[i]->proc = PROC_SMTP;
+			p_smtp[i]->shard = i;
+		}
+
+		if ((env->sc_log_async && !foreground_log) ||
+		    env->sc_dlog_path) {
+			p_logger = start_child(save_argc, save_argv, "logger");
+			p_logger->proc = PROC_LOGGER;
+		}
 
 		setup_peers(p_control, p_ca);
 		setup_peers(p_control, p_lka);
 		setup_peers(p_control, p_dispatcher);
 		setup_peers(p_control, p_queue);
-		setup_peers(p_control, p_scheduler);
+		setup_peers(p_control, p_resolver);
+		for (i = 0; i < env->sc_scheduler_shards; i++)
+			setup_peers(p_control, p_schedulers[i]);
 		setup_peers(p_dispatcher, p_ca);
 		setup_peers(p_dispatcher, p_lka);
+		setup_peers(p_dispatcher, p_launcher);
 		setup_peers(p_dispatcher, p_queue);
+		setup_peers(p_dispatcher, p_resolver);
 		setup_peers(p_queue, p_lka);
-		setup_peers(p_queue, p_scheduler);
+		for (i = 0; i < env->sc_scheduler_shards; i++)
+			setup_peers(p_queue, p_schedulers[i]);
+		for (i = 0; i < env->sc_tls_workers; i++) {
+			setup_peers(p_control, p_tls[i]);
+			setup_peers(p_dispatcher, p_tls[i]);
+			setup_peers(p_ca, p_tls[i]);
+		}
+		for (i = 0; i < env->sc_mta_workers; i++) {
+			setup_peers(p_control, p_mta[i]);
+			setup_peers(p_queue, p_mta[i]);
+			setup_peers(p_lka, p_mta[i]);
+			setup_peers(p_resolver, p_mta[i]);
+			setup_peers(p_ca, p_mta[i]);
+		}
+		for (i = 0; i < env->sc_smtp_workers; i++) {
+			setup_peers(p_control, p_smtp[i]);
+			setup_peers(p_queue, p_smtp[i]);
+			setup_peers(p_lka, p_smtp[i]);
+			setup_peers(p_resolver, p_smtp[i]);
+			setup_peers(p_ca, p_smtp[i]);
+			for (j = 0; j < env->sc_tls_workers; j++)
+				setup_peers(p_tls[j], p_smtp[i]);
+		}
+		if (p_logger) {
+			setup_peers(p_logger, p_ca);
+			setup_peers(p_logger, p_control);
+			setup_peers(p_logger, p_lka);
+			setup_peers(p_logger, p_resolver);
+			setup_peers(p_logger, p_dispatcher);
+			setup_peers(p_logger, p_queue);
+			for (i = 0; i < env->sc_scheduler_shards; i++)
+				setup_peers(p_logger, p_schedulers[i]);
+			setup_peers(p_logger, p_launcher);
+			for (i = 0; i < env->sc_tls_workers; i++)
+				setup_peers(p_logger, p_tls[i]);
+			for (i = 0; i < env->sc_mta_workers; i++)
+				setup_peers(p_logger, p_mta[i]);
+			for (i = 0; i < env->sc_smtp_workers; i++)
+				setup_peers(p_logger, p_smtp[i]);
+		}
 
 		if (env->sc_queue_key) {
 			if (imsg_compose(&p_queue->imsgbuf, IMSG_SETUP_KEY, 0,
@@ -784,12 +1059,55 @@ main(int argc, char *argv[])
 				fatal("imsg_flush");
 		}
 
+		for (i = 0; i < env->sc_scheduler_shards; i++) {
+			if (imsg_compose(&p_schedulers[i]->imsgbuf,
+			    IMSG_SETUP_SHARD, 0, 0, -1, &i, sizeof(i)) == -1)
+				fatal("imsg_compose");
+			if (imsg_flush(&p_schedulers[i]->imsgbuf) == -1)
+				fatal("imsg_flush");
+		}
+		for (i = 0; i < env->sc_tls_workers; i++) {
+			if (imsg_compose(&p_tls[i]->imsgbuf,
+			    IMSG_SETUP_SHARD, 0, 0, -1, &i, sizeof(i)) == -1)
+				fatal("imsg_compose");
+			if (imsg_flush(&p_tls[i]->imsgbuf) == -1)
+				fatal("imsg_flush");
+		}
+		for (i = 0; i < env->sc_mta_workers; i++) {
+			if (imsg_compose(&p_mta[i]->imsgbuf,
+			    IMSG_SETUP_SHARD, 0, 0, -1, &i, sizeof(i)) == -1)
+				fatal("imsg_compose");
+			if (imsg_flush(&p_mta[i]->imsgbuf) == -1)
+				fatal("imsg_flush");
+		}
+		for (i = 0; i < env->sc_smtp_workers; i++) {
+			if (imsg_compose(&p_smtp[i]->imsgbuf,
+			    IMSG_SETUP_SHARD, 0, 0, -1, &i, sizeof(i)) == -1)
+				fatal("imsg_compose");
+			if (imsg_flush(&p_smtp[i]->imsgbuf) == -1)
+				fatal("imsg_flush");
+		}
+
+		/* the listening sockets of the previous generation */
+		parent_takeover_listeners();
+
 		setup_done(p_ca);
 		setup_done(p_control);
 		setup_done(p_lka);
+		setup_done(p_resolver);
 		setup_done(p_dispatcher);
 		setup_done(p_queue);
-		setup_done(p_scheduler);
+		for (i = 0; i < env->sc_scheduler_shards; i++)
+			setup_done(p_schedulers[i]);
+		setup_done(p_launcher);
+		for (i = 0; i < env->sc_tls_workers; i++)
+			setup_done(p_tls[i]);
+		for (i = 0; i < env->sc_mta_workers; i++)
+			setup_done(p_mta[i]);
+		for (i = 0; i < env->sc_smtp_workers; i++)
+			setup_done(p_smtp[i]);
+		if (p_logger)
+			setup_done(p_logger);
 
 		log_debug("smtpd: setup done");
 
@@ -824,6 +1142,13 @@ main(int argc, char *argv[])
 		return lka();
 	}
 
+	else if (!strcmp(rexec, "resolver")) {
+		smtpd_process = PROC_RESOLVER;
+		setup_proc();
+
+		return resolver();
+	}
+
 	else if (!strcmp(rexec, "dispatcher")) {
 		smtpd_process = PROC_DISPATCHER;
 		setup_proc();
@@ -835,8 +1160,14 @@ main(int argc, char *argv[])
 		smtpd_process = PROC_QUEUE;
 		setup_proc();
 
-		if (env->sc_queue_flags & QUEUE_COMPRESSION)
-			env->sc_comp = compress_backend_lookup("gzip");
+		if (env->sc_queue_flags & QUEUE_COMPRESSION) {
+			env->sc_comp = compress_backend_lookup(
+			    env->sc_queue_compress ?
+			    env->sc_queue_compress : "gzip");
+			if (env->sc_queue_compress_dict &&
+			    !compress_dictionary(env->sc_queue_compress_dict))
+				fatalx("could not load compression dictionary");
+		}
 
 		if (!queue_init(backend_queue, 1))
 			fatalx("could not initialize queue backend");
@@ -858,6 +1189,41 @@ main(int argc, char *argv[])
 		return scheduler();
 	}
 
+	else if (!strcmp(rexec, "launcher")) {
+		smtpd_process = PROC_LAUNCHER;
+		setup_proc();
+
+		return launcher();
+	}
+
+	else if (!strcmp(rexec, "logger")) {
+		smtpd_process = PROC_LOGGER;
+		setup_proc();
+
+		return logger();
+	}
+
+	else if (!strcmp(rexec, "tls")) {
+		smtpd_process = PROC_TLS;
+		setup_proc();
+
+		return tls_worker();
+	}
+
+	else if (!strcmp(rexec, "mta")) {
+		smtpd_process = PROC_MTA;
+		setup_proc();
+
+		return mta_worker();
+	}
+
+	else if (!strcmp(rexec, "smtp")) {
+		smtpd_process = PROC_SMTP;
+		setup_proc();
+
+		return smtp_worker();
+	}
+
 	fatalx("bad rexec: %s", rexec);
 
 	return (1);
@@ -928,13 +1294,13 @@ setup_peers(struct mproc *a, struct mproc *b)
 	io_set_nonblocking(sp[1]);
 
 	if (imsg_compose(&a->imsgbuf, IMSG_SETUP_PEER, b->proc, b->pid, sp[0],
-	    NULL, 0) == -1)
+	    &b->shard, sizeof(b->shard)) == -1)
 		fatal("imsg_compose");
 	if (imsg_flush(&a->imsgbuf) == -1)
 		fatal("imsg_flush");
 
 	if (imsg_compose(&b->imsgbuf, IMSG_SETUP_PEER, a->proc, a->pid, sp[1],
-	    NULL, 0) == -1)
+	    &a->shard, sizeof(a->shard)) == -1)
 		fatal("imsg_compose");
 	if (imsg_flush(&b->imsgbuf) == -1)
 		fatal("imsg_flush");
@@ -966,7 +1332,9 @@ setup_proc(void)
 {
 	struct imsgbuf *ibuf;
 	struct imsg imsg;
+	struct sockaddr_storage ss;
         int setup = 1;
+	int shard;
 
 	log_procinit(proc_title(smtpd_process));
 
@@ -989,9 +1357,31 @@ setup_proc(void)
 		case IMSG_SETUP_KEY:
 			env->sc_queue_key = strdup(imsg.data);
 			break;
+		case IMSG_SETUP_SHARD:
+			if (imsg.hdr.len - IMSG_HEADER_SIZE != sizeof(shard))
+				fatalx("bad shard setup");
+			memcpy(&shard, imsg.data, sizeof(shard));
+			if (smtpd_process == PROC_TLS)
+				env->sc_tls_worker = shard;
+			else if (smtpd_process == PROC_MTA)
+				env->sc_mta_worker = shard;
+			else if (smtpd_process == PROC_SMTP)
+				env->sc_smtp_worker = shard;
+			else
+				env->sc_scheduler_shard = shard;
+			break;
 		case IMSG_SETUP_PEER:
+			if (imsg.hdr.len - IMSG_HEADER_SIZE != sizeof(shard))
+				fatalx("bad peer setup");
+			memcpy(&shard, imsg.data, sizeof(shard));
 			setup_peer(imsg.hdr.peerid, imsg.hdr.pid,
-			    imsg_get_fd(&imsg));
+			    imsg_get_fd(&imsg), shard);
+			break;
+		case IMSG_RELOAD_LISTENER:
+			if (imsg.hdr.len - IMSG_HEADER_SIZE != sizeof(ss))
+				fatalx("bad listener setup");
+			memcpy(&ss, imsg.data, sizeof(ss));
+			smtp_takeover_listener(imsg_get_fd(&imsg), &ss);
 			break;
 		case IMSG_SETUP_DONE:
 			setup = 0;
@@ -1012,7 +1402,7 @@ setup_proc(void)
 }
 
 static struct mproc *
-setup_peer(enum smtp_proc_type proc, pid_t pid, int sock)
+setup_peer(enum smtp_proc_type proc, pid_t pid, int sock, int shard)
 {
 	struct mproc *p, **pp;
 
@@ -1033,7 +1423,9 @@ setup_peer(enum smtp_proc_type proc, pid_t pid, int sock)
 		pp = &p_control;
 		break;
 	case PROC_SCHEDULER:
-		pp = &p_scheduler;
+		if (shard < 0 || shard >= env->sc_scheduler_shards)
+			fatalx("bad scheduler shard");
+		pp = &p_schedulers[shard];
 		break;
 	case PROC_DISPATCHER:
 		pp = &p_dispatcher;
@@ -1041,6 +1433,30 @@ setup_peer(enum smtp_proc_type proc, pid_t pid, int sock)
 	case PROC_CA:
 		pp = &p_ca;
 		break;
+	case PROC_LAUNCHER:
+		pp = &p_launcher;
+		break;
+	case PROC_LOGGER:
+		pp = &p_logger;
+		break;
+	case PROC_RESOLVER:
+		pp = &p_resolver;
+		break;
+	case PROC_TLS:
+		if (shard < 0 || shard >= env->sc_tls_workers)
+			fatalx("bad tls worker");
+		pp = &p_tls[shard];
+		break;
+	case PROC_MTA:
+		if (shard < 0 || shard >= env->sc_mta_workers)
+			fatalx("bad mta worker");
+		pp = &p_mta[shard];
+		break;
+	case PROC_SMTP:
+		if (shard < 0 || shard >= env->sc_smtp_workers)
+			fatalx("bad smtp worker");
+		pp = &p_smtp[shard];
+		break;
 	default:
 		fatalx("unknown peer");
 	}
@@ -1056,11 +1472,316 @@ setup_peer(enum smtp_proc_type proc, pid_t pid, int sock)
 	mproc_init(p, sock);
 	p->pid = pid;
 	p->proc = proc;
+	p->shard = shard;
 	p->handler = imsg_dispatch;
 
-	*pp = p;
+	*pp = p;
+
+	return p;
+}
+
+/*
+ * Reload: collect the listening sockets from the smtp processes, which
+ * stop accepting meanwhile, and start a new generation with them.
+ */
+static void
+parent_reload(void)
+{
+	int	i;
+
+	if (stopping)
+		return;
+	if (reload_state != RELOAD_NONE || p_reload) {
+		log_warnx("warn: reload already in progress");
+		return;
+	}
+
+	log_info("info: reloading %s", env->sc_conffile);
+	reload_state = RELOAD_LISTENERS;
+	reload_pending = smtp_peer_count();
+	for (i = 0; i < smtp_peer_count(); i++)
+		m_compose(smtp_peer_at(i), IMSG_RELOAD_LISTENER, 0, 0, -1,
+		    NULL, 0);
+}
+
+static void
+parent_reload_broadcast(int type)
+{
+	int	i;
+
+	reload_pending = smtp_peer_count();
+	for (i = 0; i < smtp_peer_count(); i++)
+		m_compose(smtp_peer_at(i), type, 0, 0, -1, NULL, 0);
+}
+
+/*
+ * Stop accepting and let the schedulers write their state right away,
+ * the deliveries in progress with it: those done meanwhile are found
+ * gone from the queue when scheduled again.  A second signal, or a
+ * reload under way, exits at once and the next start reads the queue.
+ */
+static void
+parent_stop(void)
+{
+	struct timeval	tv;
+	int		i;
+
+	if (stopping || reload_state != RELOAD_NONE)
+		parent_shutdown();
+
+	log_info("info: saving the scheduler state before exiting");
+	stopping = 1;
+	for (i = 0; i < smtp_peer_count(); i++)
+		m_compose(smtp_peer_at(i), IMSG_CTL_PAUSE_SMTP, 0, 0, -1,
+		    NULL, 0);
+	m_create(p_queue, IMSG_RELOAD_DRAIN, 0, 0, -1);
+	m_add_int(p_queue, 0);
+	m_close(p_queue);
+
+	evtimer_set(&stop_ev, parent_stop_timeout, NULL);
+	tv.tv_sec = SMTPD_SHUTDOWN_TIMEOUT;
+	tv.tv_usec = 0;
+	evtimer_add(&stop_ev, &tv);
+}
+
+static void
+parent_stop_timeout(int fd, short event, void *p)
+{
+	log_warnx("warn: scheduler state not saved in time, exiting");
+	parent_shutdown();
+}
+
+static void
+parent_reload_spawn(void)
+{
+	struct reload_listener	*rl;
+	char			*argv[SMTPD_MAXARG];
+	int			 sp[2], argc, i;
+	pid_t			 pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) == -1) {
+		log_warn("warn: reload: socketpair");
+		goto fail;
+	}
+
+	switch (pid = fork()) {
+	case -1:
+		log_warn("warn: reload: fork");
+		close(sp[0]);
+		close(sp[1]);
+		goto fail;
+	case 0:
+		break;
+	default:
+		close(sp[1]);
+		if (fcntl(sp[0], F_SETFD, FD_CLOEXEC) == -1)
+			fatal("reload: fcntl");
+		io_set_nonblocking(sp[0]);
+
+		p_reload = xcalloc(1, sizeof(*p_reload));
+		p_reload->name = xstrdup("reload");
+		p_reload->proc = PROC_PARENT;
+		p_reload->pid = pid;
+		p_reload->handler = parent_reload_imsg;
+		mproc_init(p_reload, sp[0]);
+		mproc_enable(p_reload);
+
+		if (env->sc_queue_key)
+			m_compose(p_reload, IMSG_SETUP_KEY, 0, 0, -1,
+			    env->sc_queue_key, strlen(env->sc_queue_key) + 1);
+		while ((rl = TAILQ_FIRST(&reload_listeners))) {
+			TAILQ_REMOVE(&reload_listeners, rl, entry);
+			m_compose(p_reload, IMSG_RELOAD_LISTENER, 0, 0, rl->fd,
+			    &rl->ss, sizeof(rl->ss));
+			free(rl);
+		}
+		m_compose(p_reload, IMSG_SETUP_DONE, 0, 0, -1, NULL, 0);
+
+		log_debug("debug: reload: new generation is pid %d", pid);
+		reload_state = RELOAD_STARTING;
+		return;
+	}
+
+	/* out of our process group, we wait for it when shutting down */
+	if (setsid() == -1)
+		fatal("reload: setsid");
+	if (sp[1] != 3) {
+		if (dup2(sp[1], 3) == -1)
+			fatal("reload: dup2");
+	} else if (fcntl(sp[1], F_SETFD, 0) == -1)
+		fatal("reload: fcntl");
+
+	xclosefrom(4);
+
+	for (argc = 0, i = 0; i < saved_argc && argc < SMTPD_MAXARG - 2; i++)
+		if (strcmp(saved_argv[i], "-H") != 0)
+			argv[argc++] = saved_argv[i];
+	argv[argc++] = "-H";
+	argv[argc] = NULL;
+
+	execvp(argv[0], argv);
+	fatal("reload: execvp");
+
+fail:
+	while ((rl = TAILQ_FIRST(&reload_listeners))) {
+		TAILQ_REMOVE(&reload_listeners, rl, entry);
+		close(rl->fd);
+		free(rl);
+	}
+	reload_state = RELOAD_NONE;
+	parent_reload_broadcast(IMSG_RELOAD_ABORT);
+}
+
+/* the channel to the new generation */
+static void
+parent_reload_imsg(struct mproc *p, struct imsg *imsg)
+{
+	if (imsg == NULL) {
+		mproc_clear(p_reload);
+		free(p_reload->name);
+		free(p_reload);
+		p_reload = NULL;
+
+		if (reload_state == RELOAD_STARTING) {
+			log_warnx("warn: reload: new generation failed, "
+			    "resuming");
+			reload_state = RELOAD_NONE;
+			parent_reload_broadcast(IMSG_RELOAD_ABORT);
+		}
+		else
+			log_warnx("warn: reload: new generation exited");
+		return;
+	}
+
+	switch (imsg->hdr.type) {
+	case IMSG_RELOAD_TAKEOVER:
+		log_info("info: reload: new generation running, "
+		    "draining sessions");
+		reload_state = RELOAD_DRAINING;
+		parent_reload_broadcast(IMSG_RELOAD_DRAIN);
+		return;
+	}
+
+	fatalx("parent_reload_imsg: unexpected %s imsg",
+	    imsg_to_str(imsg->hdr.type));
+}
+
+/*
+ * The new generation gets the queue key and the listening sockets
+ * before starting its processes.
+ */
+static void
+parent_takeover_setup(void)
+{
+	struct reload_listener	*rl;
+	struct imsg		 imsg;
+	int			 setup = 1;
+
+	p_reload = xcalloc(1, sizeof(*p_reload));
+	p_reload->name = xstrdup("reload");
+	p_reload->proc = PROC_PARENT;
+	p_reload->handler = parent_takeover_imsg;
+	mproc_init(p_reload, 3);
+	if (fcntl(3, F_SETFD, FD_CLOEXEC) == -1)
+		fatal("takeover: fcntl");
+
+	while (setup) {
+		if (imsg_wait(&p_reload->imsgbuf, &imsg, 10000) == -1)
+			fatal("takeover: imsg_wait");
+
+		switch (imsg.hdr.type) {
+		case IMSG_SETUP_KEY:
+			reload_key = xstrdup(imsg.data);
+			break;
+		case IMSG_RELOAD_LISTENER:
+			if (imsg.hdr.len - IMSG_HEADER_SIZE != sizeof(rl->ss))
+				fatalx("takeover: bad listener");
+			rl = xcalloc(1, sizeof(*rl));
+			memcpy(&rl->ss, imsg.data, sizeof(rl->ss));
+			if ((rl->fd = imsg_get_fd(&imsg)) == -1)
+				fatalx("takeover: listener socket not received");
+			TAILQ_INSERT_TAIL(&reload_listeners, rl, entry);
+			break;
+		case IMSG_SETUP_DONE:
+			setup = 0;
+			break;
+		default:
+			fatalx("takeover: unexpected %s imsg",
+			    imsg_to_str(imsg.hdr.type));
+		}
+		imsg_free(&imsg);
+	}
+
+	io_set_nonblocking(3);
+}
+
+/*
+ * Hand the listening sockets of the previous generation to the smtp
+ * processes, one socket of each address to each: the k-th socket goes
+ * to the k-th worker.  When the previous generation had fewer workers,
+ * the others share a socket rather than failing to bind next to one
+ * without SO_REUSEPORT; with fewer now, the extra sockets are closed.
+ */
+static void
+parent_takeover_listeners(void)
+{
+	struct reload_listener	*rl, *next;
+	struct sockaddr_storage	 ss;
+	struct mproc		*p;
+	int			 k, n, w, nproc, fd;
+
+	nproc = env->sc_smtp_workers ? env->sc_smtp_workers : 1;
+
+	while ((rl = TAILQ_FIRST(&reload_listeners))) {
+		ss = rl->ss;
+		n = 0;
+		TAILQ_FOREACH(rl, &reload_listeners, entry)
+			if (memcmp(&rl->ss, &ss, sizeof(ss)) == 0)
+				n++;
+
+		k = 0;
+		TAILQ_FOREACH_SAFE(rl, &reload_listeners, entry, next) {
+			if (memcmp(&rl->ss, &ss, sizeof(ss)) != 0)
+				continue;
+			for (w = k; w < nproc; w += n) {
+				p = env->sc_smtp_workers ? p_smtp[w] :
+				    p_dispatcher;
+				if ((fd = dup(rl->fd)) == -1)
+					fatal("takeover: dup");
+				if (imsg_compose(&p->imsgbuf,
+				    IMSG_RELOAD_LISTENER, 0, 0, fd, &rl->ss,
+				    sizeof(rl->ss)) == -1)
+					fatal("imsg_compose");
+				if (imsg_flush(&p->imsgbuf) == -1)
+					fatal("imsg_flush");
+			}
+			TAILQ_REMOVE(&reload_listeners, rl, entry);
+			close(rl->fd);
+			free(rl);
+			k++;
+		}
+	}
+}
+
+/* the channel to the previous generation, closed as it exits */
+static void
+parent_takeover_imsg(struct mproc *p, struct imsg *imsg)
+{
+	if (imsg == NULL) {
+		log_info("info: previous generation exited, taking over");
+		mproc_clear(p_reload);
+		free(p_reload->name);
+		free(p_reload);
+		p_reload = NULL;
+
+		if (pidfile(NULL) < 0)
+			log_warn("warn: pidfile");
+		m_compose(p_queue, IMSG_RELOAD_TAKEOVER, 0, 0, -1, NULL, 0);
+		return;
+	}
 
-	return p;
+	fatalx("parent_takeover_imsg: unexpected %s imsg",
+	    imsg_to_str(imsg->hdr.type));
 }
 
 static int
@@ -1098,6 +1819,7 @@ smtpd(void) {
 	struct event	 ev_sigchld;
 	struct event	 ev_sighup;
 	struct timeval	 tv;
+	int		 i;
 
 	imsg_callback = parent_imsg;
 
@@ -1106,9 +1828,23 @@ smtpd(void) {
 	child_add(p_queue->pid, CHILD_DAEMON, proc_title(PROC_QUEUE));
 	child_add(p_control->pid, CHILD_DAEMON, proc_title(PROC_CONTROL));
 	child_add(p_lka->pid, CHILD_DAEMON, proc_title(PROC_LKA));
-	child_add(p_scheduler->pid, CHILD_DAEMON, proc_title(PROC_SCHEDULER));
+	child_add(p_resolver->pid, CHILD_DAEMON, proc_title(PROC_RESOLVER));
+	for (i = 0; i < env->sc_scheduler_shards; i++)
+		child_add(p_schedulers[i]->pid, CHILD_DAEMON,
+		    proc_title(PROC_SCHEDULER));
 	child_add(p_dispatcher->pid, CHILD_DAEMON, proc_title(PROC_DISPATCHER));
 	child_add(p_ca->pid, CHILD_DAEMON, proc_title(PROC_CA));
+	child_add(p_launcher->pid, CHILD_DAEMON, proc_title(PROC_LAUNCHER));
+	if (p_logger)
+		child_add(p_logger->pid, CHILD_DAEMON, proc_title(PROC_LOGGER));
+	for (i = 0; i < env->sc_tls_workers; i++)
+		child_add(p_tls[i]->pid, CHILD_DAEMON, proc_title(PROC_TLS));
+	for (i = 0; i < env->sc_mta_workers; i++)
+		child_add(p_mta[i]->pid, CHILD_DAEMON, proc_title(PROC_MTA));
+	for (i = 0; i < env->sc_smtp_workers; i++)
+		child_add(p_smtp[i]->pid, CHILD_DAEMON, proc_title(PROC_SMTP));
+
+	config_affinity();
 
 	event_init();
 
@@ -1127,6 +1863,15 @@ smtpd(void) {
 	config_peer(PROC_QUEUE);
 	config_peer(PROC_CA);
 	config_peer(PROC_DISPATCHER);
+	config_peer(PROC_LAUNCHER);
+	config_peer(PROC_LOGGER);
+	config_peer(PROC_TLS);
+	config_peer(PROC_MTA);
+	config_peer(PROC_SMTP);
+	stat_cpu_start(NULL);
+	memory_start(NULL, NULL);
+	if (env->sc_dlog_path)
+		logger_dlog_start();
 
 	evtimer_set(&config_ev, parent_send_config, NULL);
 	memset(&tv, 0, sizeof(tv));
@@ -1134,20 +1879,77 @@ smtpd(void) {
 
 	/* defer offline scanning for a second */
 	evtimer_set(&offline_ev, offline_scan, NULL);
-	offline_timeout.tv_sec = 1;
-	offline_timeout.tv_usec = 0;
-	evtimer_add(&offline_ev, &offline_timeout);
+	offline_schedule(1);
+	offline_watch();
 
-	if (pidfile(NULL) < 0)
+	/*
+	 * On reload, ask the previous generation to hand over.  Its
+	 * pidfile is removed as it exits, ours is written after that.
+	 */
+	if (p_reload) {
+		mproc_enable(p_reload);
+		m_compose(p_reload, IMSG_RELOAD_TAKEOVER, 0, 0, -1, NULL, 0);
+	} else if (pidfile(NULL) < 0)
 		err(1, "pidfile");
 
 	fork_filter_processes();
 
-	purge_task();
+	evtimer_set(&purge_ev, purge_timeout, NULL);
+	purge_timeout(-1, 0, NULL);
+
+	if (env->sc_tls_workers) {
+		ticket_keyrev = arc4random();
+		evtimer_set(&ticket_ev, ticket_timeout, NULL);
+		ticket_timeout(-1, 0, NULL);
+	}
 
 #if HAVE_PLEDGE
 	if (pledge("stdio rpath wpath cpath fattr tmppath "
-	    "getpw sendfd proc exec id inet chown unix", NULL) == -1)
+	    "getpw sendfd recvfd proc exec id inet chown unix", NULL) == -1)
+		fatal("pledge");
+#endif
+
+	event_dispatch();
+	fatalx("exited event loop");
+
+	return (0);
+}
+
+/*
+ * The launcher creates the mda processes on behalf of the dispatcher,
+ * so that the parent event loop does not depend on the delivery rate.
+ * It is a fresh process with only the dispatchers left in its
+ * configuration, which keeps fork() cheap.
+ */
+static int
+launcher(void)
+{
+	struct event	 ev_sigchld;
+
+	purge_config(PURGE_LISTENERS|PURGE_TABLES|PURGE_RULES|PURGE_PKI);
+
+	config_process(PROC_LAUNCHER);
+
+	imsg_callback = launcher_imsg;
+	event_init();
+
+	tree_init(&children);
+	dict_init(&delivery_users);
+
+	signal_set(&ev_sigchld, SIGCHLD, parent_sig_handler, NULL);
+	signal_add(&ev_sigchld, NULL);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+
+	config_peer(PROC_PARENT);
+	config_peer(PROC_DISPATCHER);
+	config_peer(PROC_LOGGER);
+
+#if HAVE_PLEDGE
+	if (pledge("stdio rpath wpath cpath fattr flock tmppath "
+	    "getpw sendfd proc exec id chown unix", NULL) == -1)
 		fatal("pledge");
 #endif
 
@@ -1157,6 +1959,110 @@ smtpd(void) {
 	return (0);
 }
 
+static void
+launcher_imsg(struct mproc *p, struct imsg *imsg)
+{
+	struct deliver		 deliver;
+	struct maildir_target	*targets;
+	struct mbox_message	*msgs;
+	struct child		*c;
+	struct msg		 m;
+	const void		*data;
+	const char		*cause, *dsp_name;
+	uint64_t		 reqid;
+	size_t			 sz, ntargets, nmsgs, j;
+	void			*i;
+	int			 n, v;
+
+	if (imsg == NULL) {
+		log_debug("debug: launcher exiting");
+		_exit(0);
+	}
+
+	switch (imsg->hdr.type) {
+	case IMSG_MDA_FORK:
+		m_msg(&m, imsg);
+		m_get_id(&m, &reqid);
+		m_get_data(&m, &data, &sz);
+		if (sz != sizeof(deliver))
+			fatalx("expected deliver");
+		memmove(&deliver, data, sz);
+		m_get_size(&m, &ntargets);
+		if (ntargets > SIZE_MAX / sizeof(*targets))
+			fatalx("too many maildir targets");
+		targets = ntargets ? xcalloc(ntargets, sizeof(*targets)) : NULL;
+		for (j = 0; j < ntargets; j++) {
+			m_get_string(&m, &targets[j].dest);
+			m_get_string(&m, &targets[j].rcpt);
+			m_get_string(&m, &targets[j].subaddress);
+		}
+		m_get_size(&m, &nmsgs);
+		if (nmsgs > SIZE_MAX / sizeof(*msgs))
+			fatalx("too many mbox messages");
+		msgs = nmsgs ? xcalloc(nmsgs, sizeof(*msgs)) : NULL;
+		for (j = 0; j < nmsgs; j++) {
+			m_get_string(&m, &msgs[j].sender);
+			m_get_size(&m, &msgs[j].size);
+		}
+		m_end(&m);
+		forkmda(p, reqid, &deliver, targets, ntargets, msgs, nmsgs);
+		for (j = 0; j < ntargets; j++)
+			free(targets[j].path);
+		free(targets);
+		free(msgs);
+		return;
+
+	case IMSG_MDA_LMTP_CONNECT:
+		m_msg(&m, imsg);
+		m_get_id(&m, &reqid);
+		m_get_string(&m, &dsp_name);
+		m_end(&m);
+		lmtp_connect(p, reqid, dsp_name);
+		return;
+
+	case IMSG_MDA_KILL:
+		m_msg(&m, imsg);
+		m_get_id(&m, &reqid);
+		m_get_string(&m, &cause);
+		m_end(&m);
+
+		i = NULL;
+		while ((n = tree_iter(&children, &i, NULL, (void**)&c)))
+			if (c->type == CHILD_MDA &&
+			    c->mda_id == reqid &&
+			    c->cause == NULL)
+				break;
+		if (!n) {
+			log_debug("debug: smtpd: "
+			    "kill request: proc not found");
+			return;
+		}
+
+		c->cause = xstrdup(cause);
+		log_debug("debug: smtpd: kill requested for %u: %s",
+		    c->pid, c->cause);
+		kill(c->pid, SIGTERM);
+		return;
+
+	case IMSG_CTL_VERBOSE:
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		log_trace_verbose(v);
+		return;
+
+	case IMSG_CTL_PROFILE:
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		profiling = v;
+		return;
+	}
+
+	fatalx("launcher_imsg: unexpected %s imsg",
+	    imsg_to_str(imsg->hdr.type));
+}
+
 static void
 load_pki_tree(void)
 {
@@ -1176,6 +2082,17 @@ load_pki_tree(void)
 
 		if (!ssl_load_certificate(pki, pki->pki_cert_file))
 			fatalx("load_pki_tree: failed to load certificate file");
+
+		if (pki->pki_alt == NULL)
+			continue;
+		if (pki->pki_alt->pki_cert_file == NULL)
+			fatalx("load_pki_tree: missing alternate certificate file");
+		if (pki->pki_alt->pki_key_file == NULL)
+			fatalx("load_pki_tree: missing alternate key file");
+		if (!ssl_load_certificate(pki->pki_alt,
+		    pki->pki_alt->pki_cert_file))
+			fatalx("load_pki_tree: failed to load alternate "
+			    "certificate file");
 	}
 
 	log_debug("debug: init ca-tree");
@@ -1191,6 +2108,7 @@ void
 load_pki_keys(void)
 {
 	struct pki	*pki;
+	struct dkim	*dkim;
 	const char	*k;
 	void		*iter_dict;
 
@@ -1201,6 +2119,17 @@ load_pki_keys(void)
 
 		if (!ssl_load_keyfile(pki, pki->pki_key_file, k))
 			fatalx("load_pki_keys: failed to load key file");
+		if (pki->pki_alt && !ssl_load_keyfile(pki->pki_alt,
+		    pki->pki_alt->pki_key_file, k))
+			fatalx("load_pki_keys: failed to load alternate key file");
+	}
+
+	iter_dict = NULL;
+	while (dict_iter(env->sc_dkim_dict, &iter_dict, &k, (void **)&dkim)) {
+		log_debug("info: loading dkim key for %s", k);
+
+		if (!ssl_load_dkimkey(dkim, dkim->dkim_key_file))
+			fatalx("load_pki_keys: failed to load dkim key file");
 	}
 }
 
@@ -1322,6 +2251,41 @@ purge_task(void)
 	}
 }
 
+static void
+purge_timeout(int fd, short event, void *arg)
+{
+	struct timeval	tv;
+
+	if (purge_pid == -1)
+		purge_task();
+
+	tv.tv_sec = PURGE_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&purge_ev, &tv);
+}
+
+static void
+ticket_timeout(int fd, short event, void *arg)
+{
+	struct timeval	tv;
+	unsigned char	key[TLS_TICKET_KEY_SIZE];
+	int		i;
+
+	arc4random_buf(key, sizeof(key));
+	for (i = 0; i < env->sc_tls_workers; i++) {
+		m_create(p_tls[i], IMSG_TLS_TICKET_KEY, 0, 0, -1);
+		m_add_u32(p_tls[i], ticket_keyrev);
+		m_add_data(p_tls[i], key, sizeof(key));
+		m_close(p_tls[i]);
+	}
+	explicit_bzero(key, sizeof(key));
+	ticket_keyrev++;
+
+	tv.tv_sec = 3 * (SMTPD_TLS_SESSION_LIFETIME / 4);
+	tv.tv_usec = 0;
+	evtimer_add(&ticket_ev, &tv);
+}
+
 static void
 fork_filter_processes(void)
 {
@@ -1331,6 +2295,7 @@ fork_filter_processes(void)
 	struct filter_config *fc;
 	struct filter_config *fcs;
 	struct filter_proc *fp;
+	struct filter_proc *pool;
 	size_t		 i;
 
 	/* For each filter chain, assign the registered subsystem to subfilters */
@@ -1353,6 +2318,14 @@ fork_filter_processes(void)
 		}
 	}
 
+	/* instances of a processor serve the filters of the first one */
+	iter = NULL;
+	while (dict_iter(env->sc_filter_processes_dict, &iter, &name, (void **)&fp))
+		if (fp->pool) {
+			pool = dict_xget(env->sc_filter_processes_dict, fp->pool);
+			fp->filter_subsystem = pool->filter_subsystem;
+		}
+
 	iter = NULL;
 	while (dict_iter(env->sc_filter_processes_dict, &iter, &name, (void **)&fp))
 		fork_filter_process(name, fp->command, fp->user, fp->group, fp->chroot, fp->filter_subsystem);
@@ -1457,21 +2430,125 @@ fork_filter_process(const char *name, const char *command, const char *user, con
 	_exit(1);
 }
 
+/*
+ * The dispatcher runs chrooted, the launcher connects to the unix socket
+ * of an LMTP destination on its behalf.
+ */
+static void
+lmtp_connect(struct mproc *p, uint64_t id, const char *name)
+{
+	struct dispatcher	*dsp;
+	struct sockaddr_un	 sun;
+	const char		*error = NULL;
+	int			 fd = -1;
+
+	dsp = hdict_xget(env->sc_dispatchers, name);
+	if (dsp->type != DISPATCHER_LOCAL || dsp->u.local.lmtp == NULL ||
+	    dsp->u.local.lmtp[0] != '/')
+		fatalx("lmtp_connect: bad dispatcher %s", name);
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, dsp->u.local.lmtp, sizeof sun.sun_path)
+	    >= sizeof sun.sun_path)
+		error = "socket path is too long";
+	else if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		error = strerror(errno);
+	else {
+		/* do not block if the server backlog is full */
+		io_set_nonblocking(fd);
+		if (connect(fd, (struct sockaddr *)&sun, sizeof sun) == -1) {
+			error = strerror(errno);
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	m_create(p, IMSG_MDA_LMTP_CONNECT, 0, 0, fd);
+	m_add_id(p, id);
+	m_add_string(p, error ? error : "");
+	m_close(p);
+}
+
+static int
+delivery_user(const char *name, struct userinfo *res)
+{
+	struct delivery_user	*u;
+	struct passwd		*pw;
+	time_t			 now;
+
+	now = time(NULL);
+	if ((u = dict_get(&delivery_users, name)) == NULL) {
+		u = xcalloc(1, sizeof *u);
+		dict_xset(&delivery_users, name, u);
+	}
+	else if (u->expire > now) {
+		if (u->found)
+			*res = u->userinfo;
+		return (u->found);
+	}
+
+	memset(&u->userinfo, 0, sizeof u->userinfo);
+	if ((pw = getpwnam(name)) != NULL &&
+	    strlcpy(u->userinfo.username, pw->pw_name,
+	    sizeof u->userinfo.username) < sizeof u->userinfo.username &&
+	    strlcpy(u->userinfo.directory, pw->pw_dir,
+	    sizeof u->userinfo.directory) < sizeof u->userinfo.directory) {
+		u->userinfo.uid = pw->pw_uid;
+		u->userinfo.gid = pw->pw_gid;
+		u->found = 1;
+		u->expire = now + USERINFO_CACHE_TTL;
+		*res = u->userinfo;
+	}
+	else {
+		u->found = 0;
+		u->expire = now + USERINFO_CACHE_NEGTTL;
+	}
+	return (u->found);
+}
+
+/*
+ * Expand the maildir the deliver goes to.  Returns 0 if the path could
+ * not be expanded.
+ */
+static int
+maildir_path(struct dispatcher *dsp, struct deliver *deliver,
+    const char *pw_dir, char *buf, size_t len)
+{
+	int	n;
+
+	if (dsp->u.local.maildir == NULL)
+		n = snprintf(buf, len, "%s/Maildir", pw_dir);
+	else
+		n = strlcpy(buf, dsp->u.local.maildir, len);
+	if (n < 0 || (size_t)n >= len)
+		return 0;
+	if (dsp->u.local.maildir &&
+	    mda_expand_format(buf, len, deliver, &deliver->userinfo, NULL) == -1)
+		return 0;
+	return 1;
+}
+
 static void
-forkmda(struct mproc *p, uint64_t id, struct deliver *deliver)
+forkmda(struct mproc *p, uint64_t id, struct deliver *deliver,
+    struct maildir_target *targets, size_t ntargets,
+    struct mbox_message *msgs, size_t nmsgs)
 {
-	char		 ebuf[128], sfn[32];
+	char		 ebuf[128], sfn[32], maildir[PATH_MAX];
+	char		 path[PATH_MAX];
+	struct deliver	 tdeliver;
 	struct dispatcher	*dsp;
 	struct child	*child;
 	pid_t		 pid;
 	int		 allout, pipefd[2];
-	struct passwd	*pw;
+	size_t		 i, j, npaths;
+	struct userinfo	 ui;
 	const char	*pw_name;
 	uid_t	pw_uid;
 	gid_t	pw_gid;
 	const char	*pw_dir;
 
-	dsp = dict_xget(env->sc_dispatchers, deliver->dispatcher);
+	dsp = hdict_xget(env->sc_dispatchers, deliver->dispatcher);
 	if (dsp->type != DISPATCHER_LOCAL)
 		fatalx("non-local dispatcher called from forkmda()");
 
@@ -1480,7 +2557,7 @@ forkmda(struct mproc *p, uint64_t id, struct deliver *deliver)
 	    dsp->u.local.user ? dsp->u.local.user : deliver->userinfo.username);
 
 	if (dsp->u.local.user) {
-		if ((pw = getpwnam(dsp->u.local.user)) == NULL) {
+		if (!delivery_user(dsp->u.local.user, &ui)) {
 			(void)snprintf(ebuf, sizeof ebuf,
 			    "delivery user '%s' does not exist",
 			    dsp->u.local.user);
@@ -1492,10 +2569,10 @@ forkmda(struct mproc *p, uint64_t id, struct deliver *deliver)
 			m_close(p_dispatcher);
 			return;
 		}
-		pw_name = pw->pw_name;
-		pw_uid = pw->pw_uid;
-		pw_gid = pw->pw_gid;
-		pw_dir = pw->pw_dir;
+		pw_name = ui.username;
+		pw_uid = ui.uid;
+		pw_gid = ui.gid;
+		pw_dir = ui.directory;
 	}
 	else {
 		pw_name = deliver->userinfo.username;
@@ -1518,7 +2595,58 @@ forkmda(struct mproc *p, uint64_t id, struct deliver *deliver)
 
 	if (dsp->u.local.is_mbox && dsp->u.local.command != NULL)
 		fatalx("serious memory corruption in privileged process");
-	
+
+	/* maildir deliveries without a wrapper are done without exec */
+	maildir[0] = '\0';
+	if (dsp->u.local.is_maildir && dsp->u.local.mda_wrapper == NULL &&
+	    deliver->mda_exec[0] == '\0') {
+		if (!maildir_path(dsp, deliver, pw_dir, maildir,
+		    sizeof maildir))
+			goto badpath;
+
+		/* other maildirs the message is linked into */
+		npaths = 0;
+		for (i = 0; i < ntargets; i++) {
+			tdeliver = *deliver;
+			if (!text_to_mailaddr(&tdeliver.dest, targets[i].dest) ||
+			    !text_to_mailaddr(&tdeliver.rcpt, targets[i].rcpt ?
+			    targets[i].rcpt : targets[i].dest))
+				goto badpath;
+			tdeliver.mda_subaddress[0] = '\0';
+			if (targets[i].subaddress &&
+			    strlcpy(tdeliver.mda_subaddress,
+			    targets[i].subaddress,
+			    sizeof tdeliver.mda_subaddress) >=
+			    sizeof tdeliver.mda_subaddress)
+				goto badpath;
+			if (!maildir_path(dsp, &tdeliver, pw_dir, path,
+			    sizeof path))
+				goto badpath;
+
+			/* the same mailbox gets a single copy */
+			if (strcmp(path, maildir) == 0 &&
+			    strcmp(tdeliver.mda_subaddress,
+			    deliver->mda_subaddress) == 0)
+				continue;
+			for (j = 0; j < npaths; j++)
+				if (strcmp(path, targets[j].path) == 0 &&
+				    strcmp(targets[j].subaddress ?
+				    targets[j].subaddress : "",
+				    tdeliver.mda_subaddress) == 0)
+					break;
+			if (j < npaths)
+				continue;
+			targets[npaths].dest = targets[i].dest;
+			targets[npaths].rcpt = targets[i].rcpt;
+			targets[npaths].subaddress = targets[i].subaddress;
+			targets[npaths].path = xstrdup(path);
+			npaths++;
+		}
+		ntargets = npaths;
+	}
+	else
+		ntargets = 0;
+
 	if (pipe(pipefd) == -1) {
 		(void)snprintf(ebuf, sizeof ebuf, "pipe: %s", strerror(errno));
 		m_create(p_dispatcher, IMSG_MDA_DONE, 0, 0, -1);
@@ -1567,6 +2695,14 @@ forkmda(struct mproc *p, uint64_t id, struct deliver *deliver)
 		child = child_add(pid, CHILD_MDA, NULL);
 		child->mda_out = allout;
 		child->mda_id = id;
+		if (maildir[0])
+			child->path = xstrdup(maildir);
+		if (ntargets) {
+			child->paths = xcalloc(ntargets, sizeof(char *));
+			for (i = 0; i < ntargets; i++)
+				child->paths[i] = xstrdup(targets[i].path);
+			child->npaths = ntargets;
+		}
 		close(pipefd[0]);
 		m_create(p, IMSG_MDA_FORK, 0, 0, pipefd[1]);
 		m_add_id(p, id);
@@ -1604,32 +2740,58 @@ forkmda(struct mproc *p, uint64_t id, struct deliver *deliver)
 	if (dsp->u.local.is_mbox &&
 	    dsp->u.local.mda_wrapper == NULL &&
 	    deliver->mda_exec[0] == '\0')
-		mda_mbox(deliver);
+		mda_mbox(deliver, msgs, nmsgs);
+	else if (maildir[0])
+		mda_maildir(deliver, maildir, dsp->u.local.maildir_junk,
+		    targets, ntargets);
 	else
 		mda_unpriv(dsp, deliver, pw_name, pw_dir);
+	return;
+
+badpath:
+	m_create(p_dispatcher, IMSG_MDA_DONE, 0, 0, -1);
+	m_add_id(p_dispatcher, id);
+	m_add_int(p_dispatcher, MDA_PERMFAIL);
+	m_add_int(p_dispatcher, EX_DATAERR);
+	m_add_string(p_dispatcher, "maildir path could not be expanded");
+	m_close(p_dispatcher);
 }
 
 static void
 offline_scan(int fd, short ev, void *arg)
 {
 	char		*path_argv[2];
-	FTS		*fts = arg;
 	FTSENT		*e;
+	time_t		 settled;
 	int		 n = 0;
 
 	path_argv[0] = PATH_SPOOL PATH_OFFLINE;
 	path_argv[1] = NULL;
 
-	if (fts == NULL) {
+	if (offline_fts == NULL) {
 		log_debug("debug: smtpd: scanning offline queue...");
-		fts = fts_open(path_argv, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
-		if (fts == NULL) {
+		offline_fts = fts_open(path_argv, FTS_PHYSICAL | FTS_NOCHDIR,
+		    NULL);
+		if (offline_fts == NULL) {
 			log_warn("fts_open: %s", path_argv[0]);
 			return;
 		}
+		offline_rescan = 0;
+		offline_young = 0;
 	}
 
-	while ((e = fts_read(fts)) != NULL) {
+	settled = time(NULL) - OFFLINE_SETTLE;
+	for (;;) {
+		if (n == OFFLINE_READMAX) {
+			offline_schedule(0);
+			return;
+		}
+		/* offline_done() resumes the scan */
+		if (offline_queued >= OFFLINE_BACKLOG)
+			return;
+		if ((e = fts_read(offline_fts)) == NULL)
+			break;
+
 		if (e->fts_info != FTS_F)
 			continue;
 
@@ -1641,6 +2803,14 @@ offline_scan(int fd, short ev, void *arg)
 		if (e->fts_statp->st_gid != e->fts_parent->fts_statp->st_gid)
 			continue;
 
+		if (hdict_check(&offline_files, e->fts_path))
+			continue;
+
+		if (e->fts_statp->st_mtime > settled) {
+			offline_young = 1;
+			continue;
+		}
+
 		if (e->fts_statp->st_size == 0) {
 			if (unlink(e->fts_accpath) == -1)
 				log_warnx("warn: smtpd: could not unlink %s", e->fts_accpath);
@@ -1653,18 +2823,109 @@ offline_scan(int fd, short ev, void *arg)
 			    "could not add offline message %s", e->fts_name);
 			continue;
 		}
-
-		if ((n++) == OFFLINE_READMAX) {
-			evtimer_set(&offline_ev, offline_scan, fts);
-			offline_timeout.tv_sec = 0;
-			offline_timeout.tv_usec = 100000;
-			evtimer_add(&offline_ev, &offline_timeout);
-			return;
-		}
+		n++;
 	}
 
 	log_debug("debug: smtpd: offline scanning done");
-	fts_close(fts);
+	fts_close(offline_fts);
+	offline_fts = NULL;
+
+	if (offline_rescan)
+		offline_schedule(0);
+	else if (offline_young)
+		offline_schedule(OFFLINE_SETTLE);
+}
+
+static void
+offline_schedule(time_t sec)
+{
+	struct timeval	tv;
+
+	tv.tv_sec = sec;
+	tv.tv_usec = 0;
+	evtimer_add(&offline_ev, &tv);
+}
+
+/*
+ * Have the kernel tell when files are written to the offline directory,
+ * with inotify or kqueue.  Elsewhere, files enqueued offline while the
+ * daemon runs are only seen at the next start.
+ */
+static void
+offline_watch(void)
+{
+#if defined(HAVE_SYS_INOTIFY_H)
+	int		fd;
+
+	if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		log_warn("warn: smtpd: inotify_init1");
+		return;
+	}
+	if (inotify_add_watch(fd, PATH_SPOOL PATH_OFFLINE,
+	    IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		log_warn("warn: smtpd: inotify_add_watch: %s",
+		    PATH_SPOOL PATH_OFFLINE);
+		close(fd);
+		return;
+	}
+#elif defined(HAVE_SYS_EVENT_H)
+	struct kevent	kev;
+	int		fd, dfd;
+
+	if ((dfd = open(PATH_SPOOL PATH_OFFLINE, O_RDONLY | O_DIRECTORY)) ==
+	    -1) {
+		log_warn("warn: smtpd: open: %s", PATH_SPOOL PATH_OFFLINE);
+		return;
+	}
+	if ((fd = kqueue()) == -1) {
+		log_warn("warn: smtpd: kqueue");
+		close(dfd);
+		return;
+	}
+	EV_SET(&kev, dfd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0,
+	    NULL);
+	if (kevent(fd, &kev, 1, NULL, 0, NULL) == -1) {
+		log_warn("warn: smtpd: kevent: %s", PATH_SPOOL PATH_OFFLINE);
+		close(fd);
+		close(dfd);
+		return;
+	}
+	io_set_nonblocking(fd);
+#else
+	int		fd = -1;
+
+	return;
+#endif
+
+	offline_watch_fd = fd;
+	event_set(&offline_watch_ev, offline_watch_fd, EV_READ | EV_PERSIST,
+	    offline_notify, NULL);
+	event_add(&offline_watch_ev, NULL);
+}
+
+static void
+offline_notify(int fd, short ev, void *arg)
+{
+#if defined(HAVE_SYS_INOTIFY_H)
+	char		buf[4096];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+#elif defined(HAVE_SYS_EVENT_H)
+	struct kevent	kev;
+	struct timespec	ts;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 0;
+	while (kevent(fd, NULL, 0, &kev, 1, &ts) > 0)
+		;
+#endif
+
+	/* a scan in progress may already have passed the new file */
+	if (offline_fts)
+		offline_rescan = 1;
+	else
+		offline_schedule(0);
 }
 
 static int
@@ -1798,22 +3059,33 @@ offline_enqueue(char *name, uid_t uid, gid_t gid)
 }
 
 static int
-offline_add(char *path, uid_t uid, gid_t gid)
+offline_add(char *name, uid_t uid, gid_t gid)
 {
 	struct offline	*q;
+	char		 path[PATH_MAX];
 
-	if (offline_running < OFFLINE_QUEUEMAX)
+	if (!bsnprintf(path, sizeof(path), "%s/%s", PATH_SPOOL PATH_OFFLINE,
+	    name))
+		return (-1);
+
+	if (offline_running < env->sc_queue_offline_max) {
 		/* skip queue */
-		return offline_enqueue(path, uid, gid);
+		if (offline_enqueue(name, uid, gid) == -1)
+			return (-1);
+		hdict_set(&offline_files, path, NULL);
+		return (0);
+	}
 
-	q = malloc(sizeof(*q) + strlen(path) + 1);
+	q = malloc(sizeof(*q) + strlen(name) + 1);
 	if (q == NULL)
 		return (-1);
 	q->uid = uid;
 	q->gid = gid;
 	q->path = (char *)q + sizeof(*q);
-	memmove(q->path, path, strlen(path) + 1);
+	memmove(q->path, name, strlen(name) + 1);
 	TAILQ_INSERT_TAIL(&offline_q, q, entry);
+	offline_queued++;
+	hdict_set(&offline_files, path, NULL);
 
 	return (0);
 }
@@ -1822,24 +3094,102 @@ static void
 offline_done(void)
 {
 	struct offline	*q;
+	char		 path[PATH_MAX];
 
 	offline_running--;
 
-	while (offline_running < OFFLINE_QUEUEMAX) {
+	while (offline_running < env->sc_queue_offline_max) {
 		if ((q = TAILQ_FIRST(&offline_q)) == NULL)
 			break; /* all done */
 		TAILQ_REMOVE(&offline_q, q, entry);
-		offline_enqueue(q->path, q->uid, q->gid);
+		offline_queued--;
+		if (offline_enqueue(q->path, q->uid, q->gid) == -1 &&
+		    bsnprintf(path, sizeof(path), "%s/%s",
+		    PATH_SPOOL PATH_OFFLINE, q->path))
+			hdict_pop(&offline_files, path);
 		free(q);
 	}
+
+	if (offline_fts && offline_queued < OFFLINE_BACKLOG / 2 &&
+	    !evtimer_pending(&offline_ev, NULL))
+		offline_schedule(0);
+}
+
+/*
+ * Tell whether the .forward file lka holds a lookup of is still the same,
+ * without opening it.  Anything unusual is left to parent_forward_open().
+ */
+static int
+parent_forward_unchanged(struct forward_req *fwreq)
+{
+	struct forward_ident	*id = &fwreq->ident;
+	char			 pathname[PATH_MAX];
+	struct stat		 sb;
+
+	if (!bsnprintf(pathname, sizeof (pathname), "%s/.forward",
+		fwreq->directory))
+		return 0;
+
+	if (stat(fwreq->directory, &sb) == -1 || sb.st_mode & S_ISVTX)
+		return 0;
+	if (id->found && sb.st_ctime != id->dir_ctime)
+		return 0;
+
+	if (lstat(pathname, &sb) == -1)
+		return (errno == ENOENT && !id->found);
+
+	return (id->found &&
+	    S_ISREG(sb.st_mode) &&
+	    sb.st_dev == id->dev &&
+	    sb.st_ino == id->ino &&
+	    sb.st_size == id->size &&
+	    sb.st_mtime == id->mtime &&
+	    sb.st_ctime == id->ctime);
+}
+
+/*
+ * Read the files of a certificate found in a pki table for the ca, which
+ * keeps the key and passes the certificate on to the dispatcher.
+ */
+static void
+parent_open_pki(uint64_t reqid, const char *certfile, const char *keyfile)
+{
+	char	*cert = NULL, *key = NULL;
+	off_t	 certlen = 0, keylen = 0;
+	int	 ret = 0;
+
+	if ((cert = ssl_load_file(certfile, &certlen, 0755)) == NULL)
+		log_warn("warn: pki table: %s", certfile);
+	else if ((key = ssl_load_file(keyfile, &keylen, 0700)) == NULL)
+		log_warn("warn: pki table: %s", keyfile);
+	else if ((size_t)(certlen + keylen) >
+	    MAX_IMSGSIZE - IMSG_HEADER_SIZE - 64)
+		log_warnx("warn: pki table: %s: certificate and key too large",
+		    certfile);
+	else
+		ret = 1;
+
+	m_create(p_ca, IMSG_CA_LOAD_PKI, 0, 0, -1);
+	m_add_id(p_ca, reqid);
+	m_add_int(p_ca, ret);
+	if (ret) {
+		m_add_data(p_ca, cert, certlen);
+		m_add_data(p_ca, key, keylen);
+	}
+	m_close(p_ca);
+
+	free(cert);
+	freezero(key, keylen);
 }
 
 static int
-parent_forward_open(char *username, char *directory, uid_t uid, gid_t gid)
+parent_forward_open(char *username, char *directory, uid_t uid, gid_t gid,
+    struct forward_ident *id)
 {
 	char		pathname[PATH_MAX];
 	int		fd;
 	struct stat	sb;
+	time_t		dir_ctime;
 
 	if (!bsnprintf(pathname, sizeof (pathname), "%s/.forward",
 		directory)) {
@@ -1857,6 +3207,9 @@ parent_forward_open(char *username, char *directory, uid_t uid, gid_t gid)
 		errno = EAGAIN;
 		return -1;
 	}
+	dir_ctime = sb.st_ctime;
+
+	memset(id, 0, sizeof(*id));
 
 	do {
 		fd = open(pathname, O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
@@ -1882,14 +3235,24 @@ parent_forward_open(char *username, char *directory, uid_t uid, gid_t gid)
 		return -1;
 	}
 
+	if (fstat(fd, &sb) == 0) {
+		id->found = 1;
+		id->dev = sb.st_dev;
+		id->ino = sb.st_ino;
+		id->size = sb.st_size;
+		id->mtime = sb.st_mtime;
+		id->ctime = sb.st_ctime;
+		id->dir_ctime = dir_ctime;
+	}
+
 	return fd;
 }
 
 void
 imsg_dispatch(struct mproc *p, struct imsg *imsg)
 {
-	struct timespec	t0, t1, dt;
-	int		msg;
+	struct timespec	t0, t1, dt, tp;
+	int		msg, prof;
 
 	if (imsg == NULL) {
 		imsg_callback(p, imsg);
@@ -1900,10 +3263,15 @@ imsg_dispatch(struct mproc *p, struct imsg *imsg)
 
 	if (profiling & PROFILE_IMSG)
 		clock_gettime(CLOCK_MONOTONIC, &t0);
+	prof = profile_begin(&tp);
 
 	msg = imsg->hdr.type;
 	imsg_callback(p, imsg);
 
+	if (prof)
+		profile_end(&tp, "imsg.%s.%s", proc_name(p->proc),
+		    imsg_to_str(msg));
+
 	if (profiling & PROFILE_IMSG) {
 		clock_gettime(CLOCK_MONOTONIC, &t1);
 		timespecsub(&t1, &t0, &dt);
@@ -1965,6 +3333,18 @@ proc_title(enum smtp_proc_type proc)
 		return "dispatcher";
 	case PROC_CA:
 		return "crypto";
+	case PROC_LAUNCHER:
+		return "launcher";
+	case PROC_LOGGER:
+		return "logger";
+	case PROC_TLS:
+		return "tls";
+	case PROC_MTA:
+		return "mta";
+	case PROC_SMTP:
+		return "smtp";
+	case PROC_RESOLVER:
+		return "resolver";
 	case PROC_CLIENT:
 		return "client";
 	case PROC_PROCESSOR:
@@ -1991,6 +3371,18 @@ proc_name(enum smtp_proc_type proc)
 		return "dispatcher";
 	case PROC_CA:
 		return "ca";
+	case PROC_LAUNCHER:
+		return "launcher";
+	case PROC_LOGGER:
+		return "logger";
+	case PROC_TLS:
+		return "tls";
+	case PROC_MTA:
+		return "mta";
+	case PROC_SMTP:
+		return "smtp";
+	case PROC_RESOLVER:
+		return "resolver";
 	case PROC_CLIENT:
 		return "client-proc";
 	default:
@@ -2013,8 +3405,12 @@ imsg_to_str(int type)
 
 	CASE(IMSG_CTL_GET_DIGEST);
 	CASE(IMSG_CTL_GET_STATS);
+	CASE(IMSG_CTL_MONITOR);
 	CASE(IMSG_CTL_LIST_MESSAGES);
 	CASE(IMSG_CTL_LIST_ENVELOPES);
+	CASE(IMSG_CTL_LIST_QUEUE);
+	CASE(IMSG_CTL_QUEUE_SUMMARY);
+	CASE(IMSG_CTL_QUEUE_BULK);
 	CASE(IMSG_CTL_MTA_SHOW_HOSTS);
 	CASE(IMSG_CTL_MTA_SHOW_RELAYS);
 	CASE(IMSG_CTL_MTA_SHOW_ROUTES);
@@ -2022,6 +3418,7 @@ imsg_to_str(int type)
 	CASE(IMSG_CTL_MTA_BLOCK);
 	CASE(IMSG_CTL_MTA_UNBLOCK);
 	CASE(IMSG_CTL_MTA_SHOW_BLOCK);
+	CASE(IMSG_CTL_MTA_SHOW_DESTINATIONS);
 	CASE(IMSG_CTL_PAUSE_EVP);
 	CASE(IMSG_CTL_PAUSE_MDA);
 	CASE(IMSG_CTL_PAUSE_MTA);
@@ -2029,6 +3426,7 @@ imsg_to_str(int type)
 	CASE(IMSG_CTL_PROFILE);
 	CASE(IMSG_CTL_PROFILE_DISABLE);
 	CASE(IMSG_CTL_PROFILE_ENABLE);
+	CASE(IMSG_CTL_SHOW_PROFILE);
 	CASE(IMSG_CTL_RESUME_EVP);
 	CASE(IMSG_CTL_RESUME_MDA);
 	CASE(IMSG_CTL_RESUME_MTA);
@@ -2037,12 +3435,15 @@ imsg_to_str(int type)
 	CASE(IMSG_CTL_REMOVE);
 	CASE(IMSG_CTL_SCHEDULE);
 	CASE(IMSG_CTL_SHOW_STATUS);
+	CASE(IMSG_CTL_SHOW_FILTERS);
 	CASE(IMSG_CTL_TRACE_DISABLE);
 	CASE(IMSG_CTL_TRACE_ENABLE);
 	CASE(IMSG_CTL_UPDATE_TABLE);
 	CASE(IMSG_CTL_VERBOSE);
 	CASE(IMSG_CTL_DISCOVER_EVPID);
 	CASE(IMSG_CTL_DISCOVER_MSGID);
+	CASE(IMSG_CTL_QUEUE_EXPORT);
+	CASE(IMSG_CTL_QUEUE_IMPORT);
 
 	CASE(IMSG_CTL_SMTP_SESSION);
 
@@ -2052,6 +3453,7 @@ imsg_to_str(int type)
 	CASE(IMSG_RES_QUERY);
 
 	CASE(IMSG_SETUP_KEY);
+	CASE(IMSG_SETUP_SHARD);
 	CASE(IMSG_SETUP_PEER);
 	CASE(IMSG_SETUP_DONE);
 
@@ -2062,10 +3464,24 @@ imsg_to_str(int type)
 	CASE(IMSG_STAT_DECREMENT);
 	CASE(IMSG_STAT_SET);
 
+	CASE(IMSG_LOG);
+	CASE(IMSG_LOG_DELIVERY);
+	CASE(IMSG_LOG_ROTATE);
+
+	CASE(IMSG_RELOAD_LISTENER);
+	CASE(IMSG_RELOAD_ABORT);
+	CASE(IMSG_RELOAD_TAKEOVER);
+	CASE(IMSG_RELOAD_DRAIN);
+	CASE(IMSG_RELOAD_STATE);
+	CASE(IMSG_RELOAD_DONE);
+
 	CASE(IMSG_LKA_AUTHENTICATE);
+	CASE(IMSG_LKA_CHECKPASS);
 	CASE(IMSG_LKA_OPEN_FORWARD);
+	CASE(IMSG_LKA_OPEN_PKI);
 	CASE(IMSG_LKA_ENVELOPE_SUBMIT);
 	CASE(IMSG_LKA_ENVELOPE_COMMIT);
+	CASE(IMSG_LKA_TABLE_CHANGED);
 
 	CASE(IMSG_QUEUE_DELIVER);
 	CASE(IMSG_QUEUE_DELIVERY_OK);
@@ -2076,6 +3492,7 @@ imsg_to_str(int type)
 	CASE(IMSG_QUEUE_DISCOVER_MSGID);
 	CASE(IMSG_QUEUE_ENVELOPE_ACK);
 	CASE(IMSG_QUEUE_ENVELOPE_COMMIT);
+	CASE(IMSG_QUEUE_BULK_MATCH);
 	CASE(IMSG_QUEUE_ENVELOPE_REMOVE);
 	CASE(IMSG_QUEUE_ENVELOPE_SCHEDULE);
 	CASE(IMSG_QUEUE_ENVELOPE_SUBMIT);
@@ -2083,6 +3500,8 @@ imsg_to_str(int type)
 	CASE(IMSG_QUEUE_HOLDQ_RELEASE);
 	CASE(IMSG_QUEUE_MESSAGE_COMMIT);
 	CASE(IMSG_QUEUE_MESSAGE_ROLLBACK);
+	CASE(IMSG_QUEUE_MESSAGE_TRANSFORM);
+	CASE(IMSG_QUEUE_PRESSURE);
 	CASE(IMSG_QUEUE_SMTP_SESSION);
 	CASE(IMSG_QUEUE_TRANSFER);
 
@@ -2097,6 +3516,7 @@ imsg_to_str(int type)
 	CASE(IMSG_MDA_LOOKUP_USERINFO);
 	CASE(IMSG_MDA_KILL);
 	CASE(IMSG_MDA_OPEN_MESSAGE);
+	CASE(IMSG_MDA_LMTP_CONNECT);
 
 	CASE(IMSG_MTA_DELIVERY_OK);
 	CASE(IMSG_MTA_DELIVERY_TEMPFAIL);
@@ -2130,6 +3550,7 @@ imsg_to_str(int type)
 	CASE(IMSG_SMTP_CHECK_SENDER);
 	CASE(IMSG_SMTP_EXPAND_RCPT);
 	CASE(IMSG_SMTP_LOOKUP_HELO);
+	CASE(IMSG_SMTP_LOOKUP_PKI);
 
 	CASE(IMSG_SMTP_REQ_CONNECT);
 	CASE(IMSG_SMTP_REQ_HELO);
@@ -2142,6 +3563,11 @@ imsg_to_str(int type)
 	CASE(IMSG_SMTP_EVENT_ROLLBACK);
 	CASE(IMSG_SMTP_EVENT_DISCONNECT);
 
+	CASE(IMSG_TLS_ACCEPT);
+	CASE(IMSG_TLS_READY);
+	CASE(IMSG_TLS_FAIL);
+	CASE(IMSG_TLS_TICKET_KEY);
+
 	CASE(IMSG_LKA_PROCESSOR_FORK);
 	CASE(IMSG_LKA_PROCESSOR_ERRFD);
 
@@ -2163,16 +3589,20 @@ imsg_to_str(int type)
 	CASE(IMSG_REPORT_SMTP_PROTOCOL_SERVER);
 	CASE(IMSG_REPORT_SMTP_FILTER_RESPONSE);
 	CASE(IMSG_REPORT_SMTP_TIMEOUT);
+	CASE(IMSG_REPORT_SMTP_EVENTS);
 
 	CASE(IMSG_FILTER_SMTP_BEGIN);
 	CASE(IMSG_FILTER_SMTP_END);
 	CASE(IMSG_FILTER_SMTP_PROTOCOL);
 	CASE(IMSG_FILTER_SMTP_DATA_BEGIN);
 	CASE(IMSG_FILTER_SMTP_DATA_END);
+	CASE(IMSG_FILTER_SMTP_PHASES);
 
 	CASE(IMSG_CA_RSA_PRIVENC);
 	CASE(IMSG_CA_RSA_PRIVDEC);
 	CASE(IMSG_CA_ECDSA_SIGN);
+	CASE(IMSG_CA_DKIM_SIGN);
+	CASE(IMSG_CA_LOAD_PKI);
 
 	default:
 		(void)snprintf(buf, sizeof(buf), "IMSG_??? (%d)", type);
@@ -58,8 +58,16 @@
 #define	DEFAULT_MAX_BODY_SIZE	(35*1024*1024)
 
 #define	EXPAND_BUFFER		 1024
+#define	MAX_EXPAND_NODES	 100
 
 #define SMTPD_QUEUE_EXPIRY	 (4 * 24 * 60 * 60)
+
+/* secrets still accepted when decoding SRS addresses */
+#define SRS_BACKUP_MAX		 4
+
+/* how long system user lookups are trusted for local delivery */
+#define USERINFO_CACHE_TTL	 60
+#define USERINFO_CACHE_NEGTTL	 10
 #ifndef SMTPD_USER
 #define SMTPD_USER		 "_smtpd"
 #endif
@@ -75,7 +83,9 @@
 #endif
 #define	SMTPD_VERSION		 "7.6.0-portable"
 #define SMTPD_SESSION_TIMEOUT	 300
-#define SMTPD_BACKLOG		 5
+#define SMTPD_SHUTDOWN_TIMEOUT	 30
+#define SMTPD_TLS_SESSION_LIFETIME (60 * 60)
+#define SMTPD_BACKLOG		 128
 
 #ifndef PATH_SMTPCTL
 #define	PATH_SMTPCTL		"/usr/sbin/smtpctl"
@@ -84,6 +94,7 @@
 #define PATH_OFFLINE		"/offline"
 #define PATH_PURGE		"/purge"
 #define PATH_TEMPORARY		"/temporary"
+#define PATH_SCHEDULER_STATE	PATH_TEMPORARY "/scheduler.state"
 
 #ifndef	PATH_LIBEXEC
 #define	PATH_LIBEXEC		"/usr/local/libexec/smtpd"
@@ -111,6 +122,7 @@
 #define	F_MASQUERADE		0x1000
 #define	F_FILTERED		0x2000
 #define	F_PROXY			0x4000
+#define	F_DKIM_SIGN		0x8000
 
 #define RELAY_TLS_OPPORTUNISTIC	0
 #define RELAY_TLS_STARTTLS	1
@@ -165,6 +177,11 @@ struct addrname {
 	char			name[HOST_NAME_MAX+1];
 };
 
+struct pkifiles {
+	char	cert[PATH_MAX];
+	char	key[PATH_MAX];
+};
+
 union lookup {
 	struct expand		*expand;
 	struct credentials	 creds;
@@ -176,13 +193,14 @@ union lookup {
 	struct addrname		 addrname;
 	struct maddrmap		*maddrmap;
 	char			 relayhost[LINE_MAX];
+	struct pkifiles		 pkifiles;
 };
 
 /*
  * Bump IMSG_VERSION whenever a change is made to enum imsg_type.
  * This will ensure that we can never use a wrong version of smtpctl with smtpd.
  */
-#define	IMSG_VERSION		16
+#define	IMSG_VERSION		18
 
 enum imsg_type {
 	IMSG_NONE,
@@ -192,8 +210,12 @@ enum imsg_type {
 
 	IMSG_CTL_GET_DIGEST,
 	IMSG_CTL_GET_STATS,
+	IMSG_CTL_MONITOR,
 	IMSG_CTL_LIST_MESSAGES,
 	IMSG_CTL_LIST_ENVELOPES,
+	IMSG_CTL_LIST_QUEUE,
+	IMSG_CTL_QUEUE_SUMMARY,
+	IMSG_CTL_QUEUE_BULK,
 	IMSG_CTL_MTA_SHOW_HOSTS,
 	IMSG_CTL_MTA_SHOW_RELAYS,
 	IMSG_CTL_MTA_SHOW_ROUTES,
@@ -201,6 +223,7 @@ enum imsg_type {
 	IMSG_CTL_MTA_BLOCK,
 	IMSG_CTL_MTA_UNBLOCK,
 	IMSG_CTL_MTA_SHOW_BLOCK,
+	IMSG_CTL_MTA_SHOW_DESTINATIONS,
 	IMSG_CTL_PAUSE_EVP,
 	IMSG_CTL_PAUSE_MDA,
 	IMSG_CTL_PAUSE_MTA,
@@ -208,6 +231,7 @@ enum imsg_type {
 	IMSG_CTL_PROFILE,
 	IMSG_CTL_PROFILE_DISABLE,
 	IMSG_CTL_PROFILE_ENABLE,
+	IMSG_CTL_SHOW_PROFILE,
 	IMSG_CTL_RESUME_EVP,
 	IMSG_CTL_RESUME_MDA,
 	IMSG_CTL_RESUME_MTA,
@@ -216,12 +240,15 @@ enum imsg_type {
 	IMSG_CTL_REMOVE,
 	IMSG_CTL_SCHEDULE,
 	IMSG_CTL_SHOW_STATUS,
+	IMSG_CTL_SHOW_FILTERS,
 	IMSG_CTL_TRACE_DISABLE,
 	IMSG_CTL_TRACE_ENABLE,
 	IMSG_CTL_UPDATE_TABLE,
 	IMSG_CTL_VERBOSE,
 	IMSG_CTL_DISCOVER_EVPID,
 	IMSG_CTL_DISCOVER_MSGID,
+	IMSG_CTL_QUEUE_EXPORT,
+	IMSG_CTL_QUEUE_IMPORT,
 
 	IMSG_CTL_SMTP_SESSION,
 
@@ -231,6 +258,7 @@ enum imsg_type {
 	IMSG_RES_QUERY,
 
 	IMSG_SETUP_KEY,
+	IMSG_SETUP_SHARD,
 	IMSG_SETUP_PEER,
 	IMSG_SETUP_DONE,
 
@@ -241,10 +269,24 @@ enum imsg_type {
 	IMSG_STAT_DECREMENT,
 	IMSG_STAT_SET,
 
+	IMSG_LOG,
+	IMSG_LOG_DELIVERY,
+	IMSG_LOG_ROTATE,
+
+	IMSG_RELOAD_LISTENER,
+	IMSG_RELOAD_ABORT,
+	IMSG_RELOAD_TAKEOVER,
+	IMSG_RELOAD_DRAIN,
+	IMSG_RELOAD_STATE,
+	IMSG_RELOAD_DONE,
+
 	IMSG_LKA_AUTHENTICATE,
+	IMSG_LKA_CHECKPASS,
 	IMSG_LKA_OPEN_FORWARD,
+	IMSG_LKA_OPEN_PKI,
 	IMSG_LKA_ENVELOPE_SUBMIT,
 	IMSG_LKA_ENVELOPE_COMMIT,
+	IMSG_LKA_TABLE_CHANGED,
 
 	IMSG_QUEUE_DELIVER,
 	IMSG_QUEUE_DELIVERY_OK,
@@ -255,6 +297,7 @@ enum imsg_type {
 	IMSG_QUEUE_DISCOVER_MSGID,
 	IMSG_QUEUE_ENVELOPE_ACK,
 	IMSG_QUEUE_ENVELOPE_COMMIT,
+	IMSG_QUEUE_BULK_MATCH,
 	IMSG_QUEUE_ENVELOPE_REMOVE,
 	IMSG_QUEUE_ENVELOPE_SCHEDULE,
 	IMSG_QUEUE_ENVELOPE_SUBMIT,
@@ -262,6 +305,8 @@ enum imsg_type {
 	IMSG_QUEUE_HOLDQ_RELEASE,
 	IMSG_QUEUE_MESSAGE_COMMIT,
 	IMSG_QUEUE_MESSAGE_ROLLBACK,
+	IMSG_QUEUE_MESSAGE_TRANSFORM,
+	IMSG_QUEUE_PRESSURE,
 	IMSG_QUEUE_SMTP_SESSION,
 	IMSG_QUEUE_TRANSFER,
 
@@ -276,6 +321,7 @@ enum imsg_type {
 	IMSG_MDA_LOOKUP_USERINFO,
 	IMSG_MDA_KILL,
 	IMSG_MDA_OPEN_MESSAGE,
+	IMSG_MDA_LMTP_CONNECT,
 
 	IMSG_MTA_DELIVERY_OK,
 	IMSG_MTA_DELIVERY_TEMPFAIL,
@@ -309,6 +355,7 @@ enum imsg_type {
 	IMSG_SMTP_CHECK_SENDER,
 	IMSG_SMTP_EXPAND_RCPT,
 	IMSG_SMTP_LOOKUP_HELO,
+	IMSG_SMTP_LOOKUP_PKI,
 
 	IMSG_SMTP_REQ_CONNECT,
 	IMSG_SMTP_REQ_HELO,
@@ -321,6 +368,11 @@ enum imsg_type {
 	IMSG_SMTP_EVENT_ROLLBACK,
 	IMSG_SMTP_EVENT_DISCONNECT,
 
+	IMSG_TLS_ACCEPT,
+	IMSG_TLS_READY,
+	IMSG_TLS_FAIL,
+	IMSG_TLS_TICKET_KEY,
+
 	IMSG_LKA_PROCESSOR_FORK,
 	IMSG_LKA_PROCESSOR_ERRFD,
 
@@ -342,16 +394,20 @@ enum imsg_type {
 	IMSG_REPORT_SMTP_PROTOCOL_SERVER,
 	IMSG_REPORT_SMTP_FILTER_RESPONSE,
 	IMSG_REPORT_SMTP_TIMEOUT,
+	IMSG_REPORT_SMTP_EVENTS,
 
 	IMSG_FILTER_SMTP_BEGIN,
 	IMSG_FILTER_SMTP_END,
 	IMSG_FILTER_SMTP_PROTOCOL,
 	IMSG_FILTER_SMTP_DATA_BEGIN,
 	IMSG_FILTER_SMTP_DATA_END,
+	IMSG_FILTER_SMTP_PHASES,
 
 	IMSG_CA_RSA_PRIVENC,
 	IMSG_CA_RSA_PRIVDEC,
 	IMSG_CA_ECDSA_SIGN,
+	IMSG_CA_DKIM_SIGN,
+	IMSG_CA_LOAD_PKI,
 };
 
 enum smtp_proc_type {
@@ -362,6 +418,12 @@ enum smtp_proc_type {
 	PROC_SCHEDULER,
 	PROC_DISPATCHER,
 	PROC_CA,
+	PROC_LAUNCHER,
+	PROC_LOGGER,
+	PROC_TLS,
+	PROC_MTA,
+	PROC_SMTP,
+	PROC_RESOLVER,
 	PROC_PROCESSOR,
 	PROC_CLIENT,
 };
@@ -381,6 +443,10 @@ struct table {
 	unsigned int			 t_services;
 	void				*t_handle;
 	struct table_backend		*t_backend;
+
+	time_t				 t_cache_ttl;
+	time_t				 t_cache_negttl;
+	void				*t_cache;
 };
 
 struct table_backend {
@@ -446,8 +512,10 @@ enum filter_phase {
 };
 
 struct expandnode {
-	RB_ENTRY(expandnode)	entry;
+	TAILQ_ENTRY(expandnode)	entry;
 	TAILQ_ENTRY(expandnode)	tq_entry;
+	struct expandnode      *hnext;
+	uint32_t		hash;
 	enum expand_type	type;
 	int			sameuser;
 	int			realuser;
@@ -456,6 +524,11 @@ struct expandnode {
 	struct rule	       *rule;
 	struct expandnode      *parent;
 	unsigned int		depth;
+	const char	       *subaddress;
+	/*
+	 * must be last: the nodes of an expansion are only allocated up to
+	 * the part of the union their type uses.
+	 */
 	union {
 		/*
 		 * user field handles both expansion user and system user
@@ -465,15 +538,21 @@ struct expandnode {
 		char		buffer[EXPAND_BUFFER];
 		struct mailaddr	mailaddr;
 	}			u;
-	char		subaddress[SMTPD_SUBADDRESS_SIZE];
 };
 
+/*
+ * A zeroed expand is empty.  Its nodes are hashed, and carved from chunks
+ * that are all released by expand_clear().
+ */
 struct expand {
-	RB_HEAD(expandtree, expandnode)	 tree;
-	TAILQ_HEAD(xnodes, expandnode)	*queue;
-	size_t				 nb_nodes;
-	struct rule			*rule;
-	struct expandnode		*parent;
+	TAILQ_HEAD(expandnodes, expandnode)	 nodes;
+	struct expandnode		**buckets;
+	size_t				  nbuckets;
+	struct expand_chunk		 *chunks;
+	TAILQ_HEAD(xnodes, expandnode)	 *queue;
+	size_t				  nb_nodes;
+	struct rule			 *rule;
+	struct expandnode		 *parent;
 };
 
 struct maddrnode {
@@ -485,6 +564,35 @@ struct maddrmap {
 	TAILQ_HEAD(xmaddr, maddrnode)	queue;
 };
 
+/*
+ * Index of the headers of a message, see msgindex.c.  Offsets are those
+ * of the message as read from queue_message_fd_r().
+ */
+#define	MSGINDEX_MAGIC		0x48445258
+#define	MSGINDEX_MAX		8192	/* bytes, beyond which none is kept */
+
+struct msgindex {
+	uint32_t		magic;
+	uint32_t		count;		/* headers */
+	uint32_t		hdrend;		/* past the last header */
+	uint32_t		body;		/* past the separator line */
+};
+
+struct msgindex_hdr {
+	off_t			offset;
+	size_t			len;
+	const char	       *name;
+	size_t			namelen;
+};
+
+struct msgindex_buf {
+	char		       *buf;
+	size_t			len;
+	size_t			size;
+	uint32_t		count;
+	int			invalid;
+};
+
 #define DSN_SUCCESS 0x01
 #define DSN_FAILURE 0x02
 #define DSN_DELAY   0x04
@@ -494,6 +602,12 @@ struct maddrmap {
 #define	DSN_ORCPT_LEN	500
 
 #define	SMTPD_ENVELOPE_VERSION		3
+
+/* envelope_dump_binary_fields() */
+#define	ENVELOPE_FIELDS_MESSAGE		0x01
+#define	ENVELOPE_FIELDS_RECIPIENT	0x02
+#define	ENVELOPE_FIELDS_SUMMARY		0x04
+
 struct envelope {
 	TAILQ_ENTRY(envelope)		entry;
 
@@ -541,6 +655,29 @@ struct envelope {
 	uint8_t				esc_code;
 };
 
+/* connection details received from a PROXY protocol v2 header */
+struct proxy_info {
+	char			 unique_id[129];
+	char			 alpn[64];
+	char			 authority[HOST_NAME_MAX+1];
+
+	int			 tls;		/* client used TLS to the proxy */
+	int			 tls_verified;	/* and a verified certificate */
+	char			 tls_version[32];
+	char			 tls_cipher[128];
+	char			 tls_cn[128];
+};
+
+/* what is logged and reported about the TLS session of a client */
+struct tls_info {
+	char			 version[32];
+	char			 cipher[128];
+	int			 strength;
+	int			 resumed;
+	char			 cert_type[16];	/* of the server certificate */
+	char			 peer_hash[128]; /* empty without client cert */
+};
+
 struct listener {
 	uint16_t       		 flags;
 	int			 fd;
@@ -556,6 +693,10 @@ struct listener {
 	char			 hostname[HOST_NAME_MAX+1];
 	char			 hostnametable[PATH_MAX];
 	char			 sendertable[PATH_MAX];
+	char			 pkitable[PATH_MAX];
+	uint32_t		 filter_skip;	/* phases without filters */
+	int			 pregreet;	/* seconds before greeting */
+	char			*ehlo[4];	/* capabilities, by session */
 
 	TAILQ_ENTRY(listener)	 entry;
 
@@ -564,8 +705,10 @@ struct listener {
 	char			*tls_protocols;
 	char			*tls_ciphers;
 	struct tls		*tls;
+	struct tls_config	*tls_config;	/* for the ticket keys */
 	struct pki		**pki;
 	int			 pkicount;
+	int			 pki_dhe;
 };
 
 struct smtpd {
@@ -574,6 +717,8 @@ struct smtpd {
 
 #define SMTPD_OPT_VERBOSE		0x00000001
 #define SMTPD_OPT_NOACTION		0x00000002
+#define SMTPD_OPT_TAKEOVER		0x00000004 /* started by a reload */
+#define SMTPD_OPT_NOTABLES		0x00000008 /* no table lookups here */
 	uint32_t			sc_opts;
 
 #define SMTPD_EXITING			0x00000001 /* unused */
@@ -589,16 +734,36 @@ struct smtpd {
 #define QUEUE_COMPRESSION      		0x00000001
 #define QUEUE_ENCRYPTION      		0x00000002
 #define QUEUE_EVPCACHE			0x00000004
+#define QUEUE_BINARY_ENVELOPE		0x00000008
+#define QUEUE_DEDUP			0x00000010
 	uint32_t			sc_queue_flags;
 	char			       *sc_queue_key;
+	char			       *sc_queue_compress;
+	char			       *sc_queue_compress_dict;
 	size_t				sc_queue_evpcache_size;
+	size_t				sc_queue_ram_size;
+	size_t				sc_queue_offline_max;
+#define	QUEUE_SHARDS_MAX		16
+	int				sc_queue_shards;
+#define	QUEUE_REPLICAS_MAX		8
+	int				sc_queue_replicas;
+	int				sc_queue_quorum;
 
 	size_t				sc_session_max_rcpt;
 	size_t				sc_session_max_mails;
+	size_t				sc_filter_hiwat;
+	size_t				sc_filter_lowat;
+	size_t				sc_conn_max_src;
+	size_t				sc_conn_max_net;
+	int				sc_conn_net4_prefix;
+	int				sc_conn_net6_prefix;
+	size_t				sc_conn_rate;	/* per minute */
+	int				sc_conn_drop;
 
 	struct dict		       *sc_mda_wrappers;
 	size_t				sc_mda_max_session;
 	size_t				sc_mda_max_user_session;
+	size_t				sc_mda_max_dest_session;
 	size_t				sc_mda_task_hiwat;
 	size_t				sc_mda_task_lowat;
 	size_t				sc_mda_task_release;
@@ -609,12 +774,35 @@ struct smtpd {
 	size_t				sc_scheduler_max_evp_batch_size;
 	size_t				sc_scheduler_max_msg_batch_size;
 	size_t				sc_scheduler_max_schedule;
+#define	SCHEDULER_SHARDS_MAX		16
+	int				sc_scheduler_shards;
+	int				sc_scheduler_shard; /* scheduler only */
+#define	TLS_WORKERS_MAX			16
+	int				sc_tls_workers;
+	int				sc_tls_worker;	/* tls worker only */
+#define	MTA_WORKERS_MAX			16
+	int				sc_mta_workers;
+	int				sc_mta_worker;	/* mta worker only */
+#define	SMTP_WORKERS_MAX		16
+	int				sc_smtp_workers;
+	int				sc_smtp_worker;	/* smtp worker only */
 
 	struct dict		       *sc_filter_processes_dict;
 
+	int				sc_log_async;
+	char			       *sc_log_path;
+	char			       *sc_dlog_path;
+	time_t				sc_dlog_rotate;
+
+	struct dict		       *sc_cpu_affinity;
+	size_t				sc_memory_limit;
+
 	int				sc_ttl;
 #define MAX_BOUNCE_WARN			4
 	time_t				sc_bounce_warn[MAX_BOUNCE_WARN];
+	time_t				sc_bounce_coalesce[B_DELIVERED + 1];
+	size_t				sc_bounce_max_session;
+	size_t				sc_bounce_max_rate;
 	char				sc_hostname[HOST_NAME_MAX+1];
 	struct stat_backend	       *sc_stat;
 	struct compress_backend	       *sc_comp;
@@ -630,12 +818,13 @@ struct smtpd {
 
 
 	struct dict				*sc_filters_dict;
-	struct dict				*sc_dispatchers;
+	struct hdict				*sc_dispatchers;
 	struct dispatcher			*sc_dispatcher_bounce;
 
 	struct dict			       *sc_ca_dict;
 	struct dict			       *sc_pki_dict;
 	struct dict			       *sc_ssl_dict;
+	struct dict			       *sc_dkim_dict;
 
 	struct dict			       *sc_tables_dict;		/* keyed lookup	*/
 
@@ -646,7 +835,7 @@ struct smtpd {
 	char				       *sc_subaddressing_delim;
 
 	char				       *sc_srs_key;
-	char				       *sc_srs_key_backup;
+	char				       *sc_srs_key_backup[SRS_BACKUP_MAX];
 	int				        sc_srs_ttl;
 
 	char				       *sc_admd;
@@ -671,6 +860,18 @@ struct smtpd {
 #define PROFILE_TOSTAT	0x0001
 #define PROFILE_IMSG	0x0002
 #define PROFILE_QUEUE	0x0004
+#define PROFILE_LOOP	0x0008
+
+/* what a cached .forward lookup was made from */
+struct forward_ident {
+	int				found;
+	dev_t				dev;
+	ino_t				ino;
+	off_t				size;
+	time_t				mtime;
+	time_t				ctime;
+	time_t				dir_ctime;
+};
 
 struct forward_req {
 	uint64_t			id;
@@ -680,6 +881,10 @@ struct forward_req {
 	uid_t				uid;
 	gid_t				gid;
 	char				directory[PATH_MAX];
+
+	/* set by lka to revalidate a cached lookup, returned by the parent */
+	int				cached;
+	struct forward_ident		ident;
 };
 
 struct deliver {
@@ -695,6 +900,11 @@ struct deliver {
 	struct userinfo		userinfo;
 };
 
+struct mta_bucket {
+	int64_t			 level;
+	int64_t			 last;
+};
+
 struct mta_host {
 	SPLAY_ENTRY(mta_host)	 entry;
 	struct sockaddr		*sa;
@@ -704,6 +914,15 @@ struct mta_host {
 	time_t			 lastconn;
 	time_t			 lastptrquery;
 
+	/* adaptive concurrency */
+	size_t			 maxconn;
+	size_t			 nsuccess;
+	time_t			 lastcut;
+	int64_t			 srtt;
+
+	struct mta_bucket	 mailrate;
+	struct mta_bucket	 rcptrate;
+
 #define HOST_IGNORE	0x01
 	int			 flags;
 };
@@ -711,13 +930,14 @@ struct mta_host {
 struct mta_mx {
 	TAILQ_ENTRY(mta_mx)	 entry;
 	struct mta_host		*host;
-	char			*mxname;
+	const char		*mxname;	/* interned */
 	int			 preference;
 };
 
 struct mta_domain {
 	SPLAY_ENTRY(mta_domain)	 entry;
-	char			*name;
+	const char		*name;		/* interned */
+	uint64_t		 id;
 	int			 as_host;
 	TAILQ_HEAD(, mta_mx)	 mxs;
 	int			 mxstatus;
@@ -725,6 +945,8 @@ struct mta_domain {
 	size_t			 nconn;
 	time_t			 lastconn;
 	time_t			 lastmxquery;
+	struct mta_bucket	 mailrate;
+	struct mta_bucket	 rcptrate;
 };
 
 struct mta_source {
@@ -733,6 +955,8 @@ struct mta_source {
 	int			 refcount;
 	size_t			 nconn;
 	time_t			 lastconn;
+	struct mta_bucket	 mailrate;
+	struct mta_bucket	 rcptrate;
 };
 
 struct mta_connector {
@@ -758,11 +982,24 @@ struct mta_connector {
 
 #define CONNECTOR_NEW			0x10000
 #define CONNECTOR_WAIT			0x20000
+#define CONNECTOR_STAGGER		0x40000
 	int				 flags;
 
 	int				 refcount;
 	size_t				 nconn;
 	time_t				 lastconn;
+	struct event			 ev_stagger;
+
+	/* outcome of the last fruitless route search */
+	uint64_t			 scangen;
+	time_t				 scanuntil;
+	time_t				 scantm;
+	int				 scanlimits;
+
+	/* recent outcomes, for the source policy */
+	size_t				 nok;
+	size_t				 ntempfail;
+	time_t				 lastdecay;
 };
 
 struct mta_route {
@@ -773,6 +1010,7 @@ struct mta_route {
 #define ROUTE_NEW		0x01
 #define ROUTE_RUNQ		0x02
 #define ROUTE_KEEPALIVE		0x04
+#define ROUTE_SLOW		0x08
 #define ROUTE_DISABLED		0xf0
 #define ROUTE_DISABLED_NET	0x10
 #define ROUTE_DISABLED_SMTP	0x20
@@ -784,6 +1022,10 @@ struct mta_route {
 	time_t			 lastconn;
 	time_t			 lastdisc;
 	time_t			 lastpenalty;
+
+	/* smoothed time to a reply, in ms */
+	int64_t			 rtt;
+	time_t			 lastslow;
 };
 
 struct mta_limits {
@@ -794,6 +1036,17 @@ struct mta_limits {
 	size_t	maxconn_per_relay;
 	size_t	maxconn_per_domain;
 
+	size_t	adaptive_min;
+	size_t	adaptive_max;
+
+	/* messages and recipients per minute, 0 for no limit */
+	size_t	mailrate_domain;
+	size_t	mailrate_host;
+	size_t	mailrate_source;
+	size_t	rcptrate_domain;
+	size_t	rcptrate_host;
+	size_t	rcptrate_source;
+
 	time_t	conndelay_host;
 	time_t	conndelay_route;
 	time_t	conndelay_source;
@@ -804,12 +1057,14 @@ struct mta_limits {
 	time_t	discdelay_route;
 
 	size_t	max_mail_per_session;
+	size_t	max_rcpt_per_transaction;
 	time_t	sessdelay_transaction;
 	time_t	sessdelay_keepalive;
 
 	size_t	max_failures_per_session;
 
 	int	family;
+	int	source_policy;
 
 	int	task_hiwat;
 	int	task_lowat;
@@ -819,6 +1074,7 @@ struct mta_limits {
 struct mta_relay {
 	SPLAY_ENTRY(mta_relay)	 entry;
 	uint64_t		 id;
+	uint64_t		 holdq;
 
 	struct dispatcher	*dispatcher;
 	struct mta_domain	*domain;
@@ -841,6 +1097,9 @@ struct mta_relay {
 	int			 state;
 	size_t			 ntask;
 	TAILQ_HEAD(, mta_task)	 tasks;
+	size_t			 taskwin;
+	size_t			 taskout;
+	int64_t			 tasktm;
 
 	struct tree		 connectors;
 	size_t			 sourceloop;
@@ -863,6 +1122,8 @@ struct mta_relay {
 	int			 refcount;
 	size_t			 nconn;
 	size_t			 nconn_ready;
+	size_t			 nconn_pending;
+	int			 lastfamily;
 	time_t			 lastconn;
 };
 
@@ -871,7 +1132,6 @@ struct mta_envelope {
 	uint64_t			 id;
 	uint64_t			 session;
 	time_t				 creation;
-	char				*smtpname;
 	char				*dest;
 	char				*rcpt;
 	struct mta_task			*task;
@@ -884,6 +1144,10 @@ struct mta_envelope {
 	enum dsn_ret			dsn_ret;
 
 	char				 status[LINE_MAX];
+
+	/* set by the session for the delivery log */
+	size_t				 datalen;
+	const char			*tls;
 };
 
 struct mta_task {
@@ -894,6 +1158,35 @@ struct mta_task {
 	char				*sender;
 };
 
+enum dlog_type {
+	DLOG_SMTP = 1,
+	DLOG_MTA,
+	DLOG_MDA,
+};
+
+enum dlog_result {
+	DLOG_OK = 1,
+	DLOG_TEMPFAIL,
+	DLOG_PERMFAIL,
+};
+
+struct dlog {
+	enum dlog_type		 type;
+	enum dlog_result	 result;
+	uint64_t		 evpid;
+	uint64_t		 session;
+	time_t			 creation;
+	size_t			 size;
+	const char		*sender;
+	const char		*rcpt;
+	const char		*orcpt;
+	const char		*relay;
+	const char		*source;
+	const char		*user;
+	const char		*tls;
+	const char		*status;
+};
+
 struct passwd;
 
 struct queue_backend {
@@ -905,6 +1198,12 @@ struct compress_backend {
 	size_t	(*uncompress_chunk)(void *, size_t, void *, size_t);
 	int	(*compress_file)(FILE *, FILE *);
 	int	(*uncompress_file)(FILE *, FILE *);
+	int	(*compress_file_cb)(FILE *,
+		    int (*)(void *, const void *, size_t), void *);
+	void   *(*uncompress_stream_begin)(FILE *);
+	int	(*uncompress_stream_write)(void *, const void *, size_t);
+	int	(*uncompress_stream_end)(void *);
+	int	(*load_dictionary)(const char *);
 };
 
 /* auth structures */
@@ -917,10 +1216,14 @@ struct auth_backend {
 	int	(*authenticate)(char *, char *);
 };
 
+struct queue_count;
+struct queue_domain;
+struct queue_filter;
+
 struct scheduler_backend {
 	int	(*init)(const char *);
 
-	int	(*insert)(struct scheduler_info *);
+	int	(*insert)(struct scheduler_info *, const char *);
 	size_t	(*commit)(uint32_t);
 	size_t	(*rollback)(uint32_t);
 
@@ -938,6 +1241,15 @@ struct scheduler_backend {
 	int	(*suspend)(uint64_t);
 	int	(*resume)(uint64_t);
 	int	(*query)(uint64_t);
+
+	/* optional */
+	int	(*summary)(struct queue_count *, size_t *);
+	size_t	(*domains)(const char *, struct queue_domain *, size_t);
+	size_t	(*dump)(uint64_t *, struct scheduler_info *, const char **,
+	    uint64_t *, size_t);
+	int	(*restore_hold)(uint64_t, uint64_t);
+	size_t	(*select)(const struct queue_filter *, uint64_t *, uint64_t *,
+	    size_t);
 };
 
 enum stat_type {
@@ -964,6 +1276,46 @@ struct stat_kv {
 	struct stat_value	val;
 };
 
+/* what the memory held by a process is accounted to */
+enum memory_type {
+	MEMORY_IO,		/* iobufs, from their own stats */
+	MEMORY_SMTP,		/* smtp sessions and transactions */
+	MEMORY_MTA,		/* mta tasks and envelopes */
+	MEMORY_FILTER,		/* filter sessions */
+	MEMORY_EVPCACHE,	/* queue envelope cache */
+	MEMORY_TYPES
+};
+
+/* responses to memory pressure, each level implies the previous ones */
+enum memory_level {
+	MEMORY_NORMAL,
+	MEMORY_SHRINK,		/* shrink caches and mta task windows */
+	MEMORY_TEMPFAIL,	/* tempfail new transactions */
+	MEMORY_PAUSE,		/* stop accepting connections */
+};
+
+/* pressure on the queue as seen by the smtp server */
+enum queue_pressure {
+	QUEUE_PRESSURE_NONE,
+	QUEUE_PRESSURE_BUSY,	/* delay the banner */
+	QUEUE_PRESSURE_FULL,	/* tempfail new transactions */
+};
+
+/* free space reported by a queue backend, per shard */
+enum queue_space {
+	QUEUE_SPACE_OK,
+	QUEUE_SPACE_LOW,
+	QUEUE_SPACE_FULL,
+};
+
+/* one handler as seen by the event loop profiler */
+struct profile_stat {
+	size_t			calls;
+	size_t			stalls;
+	struct timespec		total;
+	struct timespec		max;
+};
+
 struct stat_backend {
 	void	(*init)(void);
 	void	(*close)(void);
@@ -973,6 +1325,70 @@ struct stat_backend {
 	int	(*iter)(void **, char **, struct stat_value *);
 };
 
+/*
+ * A page of "smtpctl show queue filter": the scheduler selects the
+ * envelopes by state from its cursor, the queue checks the rest.
+ * For a bulk operation, the whole queue is selected at once and the
+ * action applied to the matching envelopes.
+ */
+struct queue_filter {
+	uint64_t		 from;
+	size_t			 limit;
+	uint16_t		 flags;
+	int			 type;
+	time_t			 age;
+	int			 summary;
+#define	QUEUE_BULK_SCHEDULE	1
+#define	QUEUE_BULK_SUSPEND	2
+#define	QUEUE_BULK_RESUME	3
+#define	QUEUE_BULK_REMOVE	4
+	int			 bulk;
+#define	QUEUE_FIELD_ID		0x0001
+#define	QUEUE_FIELD_TYPE	0x0002
+#define	QUEUE_FIELD_SENDER	0x0004
+#define	QUEUE_FIELD_RCPT	0x0008
+#define	QUEUE_FIELD_DEST	0x0010
+#define	QUEUE_FIELD_CTIME	0x0020
+#define	QUEUE_FIELD_EXPIRE	0x0040
+#define	QUEUE_FIELD_LASTTRY	0x0080
+#define	QUEUE_FIELD_RETRY	0x0100
+#define	QUEUE_FIELD_STATE	0x0200
+#define	QUEUE_FIELD_ERROR	0x0400
+	uint32_t		 fields;
+	char			 domain[SMTPD_MAXDOMAINPARTSIZE];
+	char			 sender[SMTPD_MAXMAILADDRSIZE];
+	char			 tag[SMTPD_TAG_SIZE];
+	char			 error[128];
+};
+
+/* records of an IMSG_CTL_LIST_QUEUE reply */
+enum queue_list_type {
+	QUEUE_LIST_ENVELOPE,
+	QUEUE_LIST_LINE,
+	QUEUE_LIST_COUNT,
+	QUEUE_LIST_END,
+};
+
+struct queue_count {
+	size_t			 total;
+	size_t			 pending;
+	size_t			 inflight;
+	size_t			 held;
+	size_t			 suspended;
+};
+
+/*
+ * Per destination domain, kept up to date by the scheduler; a summary
+ * reply holds up to QUEUE_DOMAIN_MAX of them after the totals.
+ */
+#define	QUEUE_DOMAIN_MAX	32
+struct queue_domain {
+	char			 name[SMTPD_MAXDOMAINPARTSIZE];
+	struct queue_count	 count;
+	time_t			 oldest;
+	time_t			 next;
+};
+
 struct stat_digest {
 	time_t			 startup;
 	time_t			 timestamp;
@@ -998,6 +1414,7 @@ struct mproc {
 	pid_t		 pid;
 	char		*name;
 	int		 proc;
+	int		 shard;
 	void		(*handler)(struct mproc *, struct imsg *);
 	struct imsgbuf	 imsgbuf;
 
@@ -1030,9 +1447,15 @@ extern struct mproc *p_control;
 extern struct mproc *p_parent;
 extern struct mproc *p_lka;
 extern struct mproc *p_queue;
-extern struct mproc *p_scheduler;
+extern struct mproc *p_schedulers[SCHEDULER_SHARDS_MAX];
 extern struct mproc *p_dispatcher;
 extern struct mproc *p_ca;
+extern struct mproc *p_launcher;
+extern struct mproc *p_logger;
+extern struct mproc *p_resolver;
+extern struct mproc *p_tls[TLS_WORKERS_MAX];
+extern struct mproc *p_mta[MTA_WORKERS_MAX];
+extern struct mproc *p_smtp[SMTP_WORKERS_MAX];
 
 extern struct smtpd	*env;
 extern void (*imsg_callback)(struct mproc *, struct imsg *);
@@ -1072,6 +1495,31 @@ enum filter_subsystem {
 	FILTER_SUBSYSTEM_SMTP_OUT	= 1<<1,
 };
 
+enum report_event {
+	REPORT_LINK_CONNECT,
+	REPORT_LINK_DISCONNECT,
+	REPORT_LINK_GREETING,
+	REPORT_LINK_IDENTIFY,
+	REPORT_LINK_TLS,
+	REPORT_LINK_AUTH,
+	REPORT_TX_RESET,
+	REPORT_TX_BEGIN,
+	REPORT_TX_MAIL,
+	REPORT_TX_RCPT,
+	REPORT_TX_ENVELOPE,
+	REPORT_TX_DATA,
+	REPORT_TX_COMMIT,
+	REPORT_TX_ROLLBACK,
+	REPORT_PROTOCOL_CLIENT,
+	REPORT_PROTOCOL_SERVER,
+	REPORT_FILTER_REPORT,
+	REPORT_FILTER_RESPONSE,
+	REPORT_TIMEOUT,
+	REPORT_EVENTS_COUNT,
+};
+
+#define	PROCESSOR_INSTANCES_MAX		64
+
 struct filter_proc {
 	const char		       *command;
 	const char		       *user;
@@ -1079,6 +1527,39 @@ struct filter_proc {
 	const char		       *chroot;
 	int				errfd;
 	enum filter_subsystem		filter_subsystem;
+	int				instances;
+	const char		       *pool;	/* first instance, if not us */
+};
+
+enum spf_result {
+	SPF_NONE,
+	SPF_NEUTRAL,
+	SPF_PASS,
+	SPF_FAIL,
+	SPF_SOFTFAIL,
+	SPF_TEMPERROR,
+	SPF_PERMERROR,
+};
+
+enum limit_key {
+	LIMIT_KEY_SRC,
+	LIMIT_KEY_MAIL_FROM,
+	LIMIT_KEY_RCPT_TO,
+};
+
+struct limit_entry {
+	TAILQ_ENTRY(limit_entry)	 entry;
+	char				*key;
+	int64_t				 tat;	/* ms, monotonic */
+};
+
+/* rate of hits allowed per key, as a token bucket */
+struct limit {
+	enum limit_key			 key;
+	int64_t				 interval;	/* ms per token */
+	int64_t				 tolerance;	/* ms of burst */
+	struct hdict			 entries;
+	TAILQ_HEAD(limit_entry_lru, limit_entry) lru;
 };
 
 struct filter_config {
@@ -1095,6 +1576,7 @@ struct filter_config {
 	char                           *proc;
 
 	const char		      **chain;
+	uint32_t		       *chain_group;	/* parallel group, or 0 */
 	size_t				chain_size;
 	struct dict			chain_procs;
 
@@ -1113,6 +1595,15 @@ struct filter_config {
 	int8_t                          not_src_table;
 	struct table                   *src_table;
 
+	int8_t				not_dnsbl;
+	struct table		       *dnsbl;
+
+	int8_t				not_spf;
+	uint8_t				spf;	/* mask of SPF results */
+
+	int8_t				not_limit;
+	struct limit		       *limit;
+
 	int8_t                          not_src_regex;
 	struct table                   *src_regex;
 
@@ -1183,6 +1674,10 @@ enum dispatcher_type {
 
 struct dispatcher_local {
 	uint8_t is_mbox;	/* only for MBOX */
+	uint8_t is_maildir;	/* only for MAILDIR */
+	uint8_t maildir_junk;	/* only for MAILDIR */
+	char	*maildir;	/* only for MAILDIR, NULL for ~/Maildir */
+	uint8_t	 single_instance;	/* only for MAILDIR */
 
 	uint8_t	expand_only;
 	uint8_t	forward_only;
@@ -1190,6 +1685,9 @@ struct dispatcher_local {
 	char	*mda_wrapper;
 	char	*command;
 
+	char	*lmtp;		/* destination, for in-process delivery */
+	uint8_t	 lmtp_rcpt_to;
+
 	char	*table_alias;
 	char	*table_virtual;
 	char	*table_userbase;
@@ -1203,7 +1701,7 @@ struct dispatcher_remote {
 
 	char	*source;
 
-	struct tls_config *tls_config;
+	struct mta_tls_cache *tls_sessions;
 	char	*ca;
 	char	*pki;
 
@@ -1287,7 +1785,7 @@ int aliases_virtual_get(struct expand *, const struct mailaddr *);
 
 
 /* bounce.c */
-void bounce_add(uint64_t);
+void bounce_add(const uint64_t *, size_t);
 void bounce_fd(int);
 
 
@@ -1297,14 +1795,22 @@ int	 ca_X509_verify(void *, void *, const char *, const char *, const char **);
 void	 ca_imsg(struct mproc *, struct imsg *);
 void	 ca_init(void);
 void	 ca_engine_init(void);
+void	 ca_dispatch_result(struct mproc *, struct imsg *);
 
 
 /* compress_backend.c */
 struct compress_backend *compress_backend_lookup(const char *);
+struct compress_backend *compress_backend_detect(const void *, size_t);
+int	compress_dictionary(const char *);
+size_t	compress_read_chunk(FILE *, char *, size_t, int);
 size_t	compress_chunk(void *, size_t, void *, size_t);
 size_t	uncompress_chunk(void *, size_t, void *, size_t);
 int	compress_file(FILE *, FILE *);
 int	uncompress_file(FILE *, FILE *);
+int	compress_file_cb(FILE *, int (*)(void *, const void *, size_t), void *);
+void   *uncompress_stream_begin(FILE *);
+int	uncompress_stream_write(void *, const void *, size_t);
+int	uncompress_stream_end(void *);
 
 /* config.c */
 #define PURGE_LISTENERS		0x01
@@ -1318,6 +1824,7 @@ struct smtpd *config_default(void);
 void purge_config(uint8_t);
 void config_process(enum smtp_proc_type);
 void config_peer(enum smtp_proc_type);
+void config_affinity(void);
 
 
 /* control.c */
@@ -1329,14 +1836,36 @@ int control_create_socket(void);
 int	crypto_setup(const char *, size_t);
 int	crypto_encrypt_file(FILE *, FILE *);
 int	crypto_decrypt_file(FILE *, FILE *);
+int	crypto_decrypt_file_cb(FILE *, int (*)(void *, const void *, size_t),
+	    void *);
 size_t	crypto_encrypt_buffer(const char *, size_t, char *, size_t);
 size_t	crypto_decrypt_buffer(const char *, size_t, char *, size_t);
+void   *crypto_encrypt_stream_begin(FILE *);
+int	crypto_encrypt_stream_write(void *, const void *, size_t);
+int	crypto_encrypt_stream_end(void *);
+
+
+/* dkim.c */
+struct dkim;
+struct dkim_sign *dkim_sign_new(const struct dkim *, time_t);
+void dkim_sign_free(struct dkim_sign *);
+const char *dkim_sign_placeholder(struct dkim_sign *, size_t *);
+void dkim_sign_header(struct dkim_sign *, const char *, size_t);
+void dkim_sign_body(struct dkim_sign *, const char *, size_t);
+int dkim_sign_digest(struct dkim_sign *, unsigned char *, size_t *);
+char *dkim_sign_final(struct dkim_sign *, const unsigned char *, size_t,
+    size_t *);
 
 
 /* dns.c */
 void dns_imsg(struct mproc *, struct imsg *);
 
 
+/* dnsbl.c */
+int dnsbl_check(struct table *, const struct sockaddr_storage *,
+    void (*)(void *, int), void *);
+
+
 /* enqueue.c */
 int		 enqueue(int, char **, FILE *);
 
@@ -1348,42 +1877,66 @@ void envelope_set_esc_class(struct envelope *, enum enhanced_status_class);
 void envelope_set_esc_code(struct envelope *, enum enhanced_status_code);
 int envelope_load_buffer(struct envelope *, const char *, size_t);
 int envelope_dump_buffer(const struct envelope *, char *, size_t);
+int envelope_dump_binary(const struct envelope *, char *, size_t);
+int envelope_dump_binary_fields(const struct envelope *, int, char *, size_t,
+    size_t *);
+int envelope_load_binary_fields(struct envelope *, const char *, size_t,
+    const char *, size_t);
 
 
 /* expand.c */
-int expand_cmp(struct expandnode *, struct expandnode *);
 void expand_insert(struct expand *, struct expandnode *);
+void expand_merge(struct expand *, struct expand *);
 struct expandnode *expand_lookup(struct expand *, struct expandnode *);
 void expand_clear(struct expand *);
 void expand_free(struct expand *);
 int expand_line(struct expand *, const char *, int);
 int expand_to_text(struct expand *, char *, size_t);
-RB_PROTOTYPE(expandtree, expandnode, nodes, expand_cmp);
 
 
 /* forward.c */
 int forwards_get(int, struct expand *);
 
 
+/* intern.c */
+const char *intern_domain(const char *);
+const char *intern_lookup(const char *);
+const char *intern_ref(const char *);
+void intern_release(const char *);
+uint64_t intern_id(const char *);
+
+
 /* limit.c */
 void limit_mta_set_defaults(struct mta_limits *);
 int limit_mta_set(struct mta_limits *, const char*, int64_t);
+struct limit *limit_new(enum limit_key, int, int);
+int limit_hit(struct limit *, const char *);
 
 
 /* lka.c */
 int lka(void);
 
 
+/* logger.c */
+int logger(void);
+void logger_client(void);
+void logger_client_done(void);
+void logger_delivery(const struct dlog *);
+void logger_dlog_start(void);
+
+
 /* lka_proc.c */
 int lka_proc_ready(void);
 void lka_proc_forked(const char *, uint32_t, int);
 void lka_proc_errfd(const char *, int);
-struct io *lka_proc_get_io(const char *);
+struct io *lka_proc_get_io(const char *, uint64_t);
+void lka_proc_show(struct mproc *, uint32_t);
 
 
 /* lka_report.c */
 void lka_report_init(void);
 void lka_report_register_hook(const char *, const char *);
+void lka_report_publish(void);
 void lka_report_smtp_link_connect(const char *, struct timeval *, uint64_t, const char *, int,
     const struct sockaddr_storage *, const struct sockaddr_storage *);
 void lka_report_smtp_link_disconnect(const char *, struct timeval *, uint64_t);
@@ -1438,9 +1991,26 @@ void mda_postprivdrop(void);
 void mda_imsg(struct mproc *, struct imsg *);
 
 
+/* mda_maildir.c */
+struct maildir_target {
+	const char	*dest;
+	const char	*rcpt;
+	const char	*subaddress;
+	char		*path;
+};
+int mda_maildir_known(const char *);
+void mda_maildir_cache(const char *);
+void mda_maildir(struct deliver *, const char *, int,
+    struct maildir_target *, size_t);
+
+
 /* mda_mbox.c */
+struct mbox_message {
+	const char	*sender;
+	size_t		 size;
+};
 void mda_mbox_init(struct deliver *);
-void mda_mbox(struct deliver *);
+void mda_mbox(struct deliver *, struct mbox_message *, size_t);
 
 
 /* mda_unpriv.c */
@@ -1463,6 +2033,14 @@ void maddrmap_insert(struct maddrmap *, struct maddrnode *);
 void maddrmap_free(struct maddrmap *);
 
 
+/* memory.c */
+void memory_start(void (*)(const char *, const struct stat_value *),
+    void (*)(enum memory_level));
+void memory_alloc(enum memory_type, size_t);
+void memory_free(enum memory_type, size_t);
+enum memory_level memory_level(void);
+
+
 /* mproc.c */
 int mproc_fork(struct mproc *, const char*, char **);
 void mproc_init(struct mproc *, int);
@@ -1513,27 +2091,68 @@ void m_get_params(struct msg *, struct dict *);
 void m_clear_params(struct dict *);
 
 
+/* msgindex.c */
+void msgindex_add(struct msgindex_buf *, const char *, off_t, off_t);
+const void *msgindex_end(struct msgindex_buf *, off_t, off_t, size_t *);
+void msgindex_free(struct msgindex_buf *);
+int msgindex_open(const void *, size_t, struct msgindex *);
+int msgindex_next(const void *, size_t, size_t *, struct msgindex_hdr *);
+
+
 /* mta.c */
 void mta_postfork(void);
 void mta_postprivdrop(void);
+struct tls_config *mta_tls_config(struct dispatcher_remote *, const char *);
 void mta_imsg(struct mproc *, struct imsg *);
 void mta_route_ok(struct mta_relay *, struct mta_route *);
 void mta_route_error(struct mta_relay *, struct mta_route *);
 void mta_route_down(struct mta_relay *, struct mta_route *);
-void mta_route_collect(struct mta_relay *, struct mta_route *);
+void mta_route_collect(struct mta_relay *, struct mta_route *, int);
+void mta_route_success(struct mta_relay *, struct mta_route *);
+void mta_route_congested(struct mta_relay *, struct mta_route *,
+    const char *);
+void mta_route_latency(struct mta_relay *, struct mta_route *, int64_t);
+void mta_route_reply(struct mta_relay *, struct mta_route *, int64_t);
+int mta_route_slow(struct mta_relay *, struct mta_route *);
+int64_t mta_route_stall(struct mta_relay *, struct mta_route *);
 void mta_source_error(struct mta_relay *, struct mta_route *, const char *);
 void mta_delivery_log(struct mta_envelope *, const char *, const char *, int, const char *);
 void mta_delivery_notify(struct mta_envelope *);
 struct mta_task *mta_route_next_task(struct mta_relay *, struct mta_route *);
+void mta_route_return_task(struct mta_relay *, struct mta_task *);
 const char *mta_host_to_text(struct mta_host *);
 const char *mta_relay_to_text(struct mta_relay *);
+void mta_memory(enum memory_level);
+
+
+/* mta_stat.c */
+enum mta_stat_type {
+	MTA_STAT_CONNECT,
+	MTA_STAT_TLS,
+	MTA_STAT_DATA,
+	MTA_STAT_MESSAGE,
+	MTA_STAT_TEMPFAIL,
+	MTA_STAT_PERMFAIL,
+	MTA_STAT_TYPES,
+};
+void mta_stat_update(struct mta_relay *, struct mta_route *,
+    enum mta_stat_type, uint64_t);
+void mta_stat_show(struct mproc *, uint32_t);
 
 
 /* mta_session.c */
 void mta_session(struct mta_relay *, struct mta_route *, const char *);
+struct mta_relay *mta_session_reuse(struct mta_relay *, struct mta_route *,
+    const char *);
 void mta_session_imsg(struct mproc *, struct imsg *);
 
 
+/* mta_worker.c */
+int mta_worker(void);
+struct mproc *mta_peer(const struct envelope *);
+int mta_peer_count(void);
+struct mproc *mta_peer_at(int);
+
 /* parse.y */
 int parse_config(struct smtpd *, const char *, int);
 int cmdline_symset(char *);
@@ -1543,25 +2162,53 @@ int cmdline_symset(char *);
 int queue(void);
 
 
+/* queue_archive.c */
+void queue_archive(int, uint32_t, const void *, size_t);
+
+
 /* queue_backend.c */
 uint32_t queue_generate_msgid(void);
 uint64_t queue_generate_evpid(uint32_t);
 int queue_init(const char *, int);
+int queue_shards(void);
+int queue_shard(uint32_t);
+const char *queue_shard_root(int);
 int queue_close(void);
 int queue_message_create(uint32_t *);
 int queue_message_delete(uint32_t);
 int queue_message_commit(uint32_t);
+int queue_message_transform(uint32_t);
+int queue_message_commit_transformed(uint32_t);
 int queue_message_fd_r(uint32_t);
 int queue_message_fd_rw(uint32_t);
+int queue_message_fd_sync(uint32_t);
+int queue_message_index(uint32_t, const void *, size_t);
+int queue_message_index_load(uint32_t, void *, size_t);
 int queue_envelope_create(struct envelope *);
 int queue_envelope_delete(uint64_t);
+int queue_envelope_delete_batch(const uint64_t *, size_t);
 int queue_envelope_load(uint64_t, struct envelope *);
 int queue_envelope_update(struct envelope *);
+int queue_envelope_retry(struct envelope *);
 int queue_envelope_walk(struct envelope *);
 int queue_message_walk(struct envelope *, uint32_t, int *, void **);
+int queue_summary_open(void);
+int queue_summary_walk(struct envelope *);
+void queue_envelope_cache_shrink(void);
+void queue_space_update(int, enum queue_space);
+enum queue_space queue_space(void);
+
+
+/* profile.c */
+int profile_begin(struct timespec *);
+void profile_end(const struct timespec *, const char *, ...)
+    __attribute__((__format__ (printf, 2, 3)));
+void profile_show(struct mproc *, uint32_t);
 
 
 /* report_smtp.c */
+void report_smtp_events(uint32_t, uint32_t);
+int report_smtp_wanted(const char *, enum report_event);
 void report_smtp_link_connect(const char *, uint64_t, const char *, int,
     const struct sockaddr_storage *, const struct sockaddr_storage *);
 void report_smtp_link_disconnect(const char *, uint64_t);
@@ -1589,6 +2236,7 @@ struct rule *ruleset_match(const struct envelope *);
 
 /* scheduler.c */
 int scheduler(void);
+struct mproc *scheduler_peer(uint32_t);
 
 
 /* scheduler_bakend.c */
@@ -1610,6 +2258,7 @@ void resolver_res_query(const char *, int, int,
     void (*cb)(void *, int, int, int, const void *, int), void *);
 void resolver_dispatch_request(struct mproc *, struct imsg *);
 void resolver_dispatch_result(struct mproc *, struct imsg *);
+int resolver(void);
 
 
 /* smtp.c */
@@ -1617,12 +2266,34 @@ void smtp_postfork(void);
 void smtp_postprivdrop(void);
 void smtp_imsg(struct mproc *, struct imsg *);
 void smtp_configure(void);
-void smtp_collect(void);
+void smtp_collect(const struct sockaddr_storage *);
+void smtp_takeover_listener(int, const struct sockaddr_storage *);
+struct tls_config *smtp_tls_config(struct listener *);
+void smtp_setup_listener_tls(struct listener *);
+void smtp_memory(enum memory_level);
+int smtp_occupancy(void);
+
+
+/* smtp_sni.c */
+void smtp_sni_init(void);
+void smtp_sni_setup(struct listener *, struct tls_config *);
+void smtp_sni_release(struct tls *);
+void smtp_sni_imsg(struct mproc *, struct imsg *);
+
+
+/* smtp_worker.c */
+int smtp_worker(void);
+uint64_t smtp_peer_id(void);
+struct mproc *smtp_peer(uint64_t);
+int smtp_peer_count(void);
+struct mproc *smtp_peer_at(int);
 
 
 /* smtp_session.c */
 int smtp_session(struct listener *, int, const struct sockaddr_storage *,
-    const char *, struct io *);
+    const char *, struct io *, const struct proxy_info *);
+int smtp_session_reapable(void);
+int smtp_session_reap(void);
 void smtp_session_imsg(struct mproc *, struct imsg *);
 
 
@@ -1635,9 +2306,14 @@ void log_imsg(int, int, struct imsg *);
 int fork_proc_backend(const char *, const char *, const char *, int);
 
 
+/* spf.c */
+int spf_check(const struct sockaddr_storage *, const char *, const char *,
+    void (*)(void *, int), void *);
+
+
 /* srs.c */
-const char *srs_encode(const char *, const char *);
-const char *srs_decode(const char *);
+int srs_encode(const char *, const char *, char *, size_t);
+int srs_decode(const char *, char *, size_t);
 
 
 /* stat_backend.c */
@@ -1645,6 +2321,8 @@ struct stat_backend	*stat_backend_lookup(const char *);
 void	stat_increment(const char *, size_t);
 void	stat_decrement(const char *, size_t);
 void	stat_set(const char *, const struct stat_value *);
+void	stat_latency(const char *, const struct timespec *);
+void	stat_cpu_start(void (*)(const char *, const struct stat_value *));
 struct stat_value *stat_counter(size_t);
 struct stat_value *stat_timestamp(time_t);
 struct stat_value *stat_timeval(struct timeval *);
@@ -1660,6 +2338,11 @@ struct table *table_create(struct smtpd *, const char *, const char *,
 int	table_config(struct table *);
 int	table_open(struct table *);
 int	table_update(struct table *);
+void	table_updated(struct table *, int);
+void	table_changed(struct table *);
+unsigned int table_generation(void);
+void	table_on_change(void (*)(void));
+void	table_on_update(void (*)(struct table *, int));
 void	table_close(struct table *);
 void	table_dump(struct table *);
 int	table_check_use(struct table *, uint32_t, uint32_t);
@@ -1673,6 +2356,7 @@ void table_destroy(struct smtpd *, struct table *);
 void table_add(struct table *, const char *, const char *);
 int table_domain_match(const char *, const char *);
 int table_netaddr_match(const char *, const char *);
+int table_netaddr_match_parsed(struct netaddr *, struct netaddr *);
 int table_mailaddr_match(const char *, const char *);
 int table_regex_match(const char *, const char *);
 void	table_open_all(struct smtpd *);
@@ -1680,6 +2364,15 @@ void	table_dump_all(struct smtpd *);
 void	table_close_all(struct smtpd *);
 
 
+/* table_compiled.c */
+int table_compiled_write(FILE *, const char *, int, int);
+
+
+/* table_static.c */
+int table_static_iter(struct table *, enum table_service, void **,
+    const char **);
+
+
 /* to.c */
 int text_to_netaddr(struct netaddr *, const char *);
 int text_to_mailaddr(struct mailaddr *, const char *);
@@ -1689,6 +2382,7 @@ int text_to_credentials(struct credentials *, const char *);
 int text_to_expandnode(struct expandnode *, const char *);
 uint64_t text_to_evpid(const char *);
 uint32_t text_to_msgid(const char *);
+int text_to_spf_result(const char *);
 const char *sa_to_text(const struct sockaddr *);
 const char *ss_to_text(const struct sockaddr_storage *);
 const char *time_to_text(time_t);
@@ -1698,6 +2392,19 @@ const char *sockaddr_to_text(const struct sockaddr *);
 const char *mailaddr_to_text(const struct mailaddr *);
 const char *expandnode_to_text(struct expandnode *);
 const char *tls_to_text(struct tls *);
+const char *spf_result_to_text(int);
+
+
+/* tls_worker.c */
+int tls_worker(void);
+int tls_worker_accept(struct listener *, int, uint64_t);
+void tls_session_info(struct tls *, struct tls_info *);
+
+
+/* uring.c */
+int uring_init(void);
+int uring_enabled(void);
+int uring_fsync(int, void (*)(void *, int), void *);
 
 
 /* util.c */
@@ -1746,6 +2453,14 @@ int base64_decode(char const *, unsigned char *, size_t);
 int base64_encode_rfc3548(unsigned char const *, size_t,
 		      char *, size_t);
 void xclosefrom(int);
+void fadvise_sequential(int);
+void fadvise_dontneed(int);
+void clock_cache_enter(void);
+void clock_cache_leave(void);
+time_t clock_cached(void);
+void clock_cached_tv(struct timeval *);
+#define	CPULIST_MAX	1023
+int cpulist_parse(const char *, void (*)(int, void *), void *);
 
 void log_trace_verbose(int);
 void log_trace0(const char *, ...)
@@ -1763,7 +2478,9 @@ void waitq_run(void *, void *);
 /* runq.c */
 struct runq;
 
-int runq_init(struct runq **, void (*)(struct runq *, void *));
+int runq_init_name(struct runq **, void (*)(struct runq *, void *),
+    const char *);
+#define	runq_init(q, cb)	runq_init_name((q), (cb), #cb)
 int runq_schedule(struct runq *, time_t, void *);
 int runq_schedule_at(struct runq *, time_t, void *);
 int runq_cancel(struct runq *, void *);
@@ -0,0 +1,406 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * An SMTP server accepting and discarding all mail as fast as it can,
+ * to benchmark the outbound path of smtpd in the lab:
+ *
+ *	$ smtpsink -p 2526 -i 1
+ *
+ * with, in smtpd.conf:
+ *
+ *	action "sink" relay host smtp://127.0.0.1:2526
+ *
+ * Given a certificate and a key, STARTTLS is offered too.  Counters are
+ * printed every -i seconds and on exit.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "ioev.h"
+#include "log.h"
+
+#define	SINK_LINE_MAX	16384
+#define	SINK_TIMEOUT	300000
+#define	SINK_MAXLISTEN	16
+
+enum sink_state {
+	SINK_COMMAND,
+	SINK_DATA,
+	SINK_TLS,
+	SINK_QUIT,
+};
+
+struct sink {
+	struct io	*io;
+	enum sink_state	 state;
+};
+
+struct sink_stats {
+	size_t		 sessions;
+	size_t		 active;
+	size_t		 messages;
+	size_t		 rcpts;
+	size_t		 bytes;
+	size_t		 errors;
+};
+
+static void	sink_accept(int, short, void *);
+static void	sink_io(struct io *, int, void *);
+static void	sink_line(struct sink *, char *, size_t);
+static void	sink_command(struct sink *, char *);
+static void	sink_free(struct sink *);
+static void	sink_stats(int, short, void *);
+static void	sink_exit(int, short, void *);
+static void	usage(void);
+
+static char		 hostname[HOST_NAME_MAX+1];
+static struct tls	*tls;
+static struct sink_stats stats, last;
+static struct timespec	 tlast;
+static struct event	 ev_listen[SINK_MAXLISTEN];
+static struct event	 ev_stats;
+static struct timeval	 tv_stats;
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-v] [-C cert -K key] [-i interval] "
+	    "[-l address] [-p port]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct addrinfo		 hints, *res, *ai;
+	struct tls_config	*config;
+	struct event		 ev_sigint, ev_sigterm;
+	const char		*address = "127.0.0.1", *port = "25";
+	const char		*cert = NULL, *key = NULL, *errstr;
+	int			 ch, fd, on = 1, n = 0, verbose = 0, error;
+
+	while ((ch = getopt(argc, argv, "C:K:i:l:p:v")) != -1) {
+		switch (ch) {
+		case 'C':
+			cert = optarg;
+			break;
+		case 'K':
+			key = optarg;
+			break;
+		case 'i':
+			tv_stats.tv_sec = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr)
+				errx(1, "interval is %s: %s", errstr, optarg);
+			break;
+		case 'l':
+			address = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	if (argc || (cert == NULL) != (key == NULL))
+		usage();
+
+	log_init(1, LOG_MAIL);
+	log_setverbose(verbose);
+
+	if (gethostname(hostname, sizeof(hostname)) == -1)
+		fatal("gethostname");
+
+	if (cert) {
+		if ((config = tls_config_new()) == NULL)
+			fatal("tls_config_new");
+		if (tls_config_set_keypair_file(config, cert, key) == -1)
+			fatalx("tls_config_set_keypair_file: %s",
+			    tls_config_error(config));
+		if ((tls = tls_server()) == NULL)
+			fatal("tls_server");
+		if (tls_configure(tls, config) == -1)
+			fatalx("tls_configure: %s", tls_error(tls));
+		tls_config_free(config);
+	}
+
+	event_init();
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((error = getaddrinfo(address, port, &hints, &res)))
+		fatalx("%s: %s", address, gai_strerror(error));
+	for (ai = res; ai && n < SINK_MAXLISTEN; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol)) == -1)
+			fatal("socket");
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on,
+		    sizeof(on)) == -1)
+			fatal("setsockopt");
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1)
+			fatal("bind");
+		if (listen(fd, SOMAXCONN) == -1)
+			fatal("listen");
+		io_set_nonblocking(fd);
+		event_set(&ev_listen[n], fd, EV_READ|EV_PERSIST, sink_accept,
+		    NULL);
+		event_add(&ev_listen[n++], NULL);
+	}
+	freeaddrinfo(res);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal_set(&ev_sigint, SIGINT, sink_exit, NULL);
+	signal_set(&ev_sigterm, SIGTERM, sink_exit, NULL);
+	signal_add(&ev_sigint, NULL);
+	signal_add(&ev_sigterm, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &tlast);
+	if (tv_stats.tv_sec) {
+		evtimer_set(&ev_stats, sink_stats, NULL);
+		evtimer_add(&ev_stats, &tv_stats);
+	}
+
+	log_info("smtpsink: listening on %s port %s%s", address, port,
+	    tls ? ", with STARTTLS" : "");
+
+	event_dispatch();
+
+	return (0);
+}
+
+static void
+sink_accept(int fd, short event, void *arg)
+{
+	struct sink	*s;
+	int		 sock;
+
+	if ((sock = accept(fd, NULL, NULL)) == -1) {
+		if (errno != EAGAIN && errno != EINTR &&
+		    errno != ECONNABORTED)
+			log_warn("warn: smtpsink: accept");
+		return;
+	}
+	io_set_nonblocking(sock);
+
+	if ((s = calloc(1, sizeof(*s))) == NULL ||
+	    (s->io = io_new()) == NULL) {
+		log_warn("warn: smtpsink: calloc");
+		free(s);
+		close(sock);
+		return;
+	}
+
+	stats.sessions++;
+	stats.active++;
+
+	io_set_callback(s->io, sink_io, s);
+	io_set_fd(s->io, sock);
+	io_set_timeout(s->io, SINK_TIMEOUT);
+	io_set_write(s->io);
+	io_printf(s->io, "220 %s ESMTP smtpsink\r\n", hostname);
+}
+
+static void
+sink_io(struct io *io, int evt, void *arg)
+{
+	struct sink	*s = arg;
+	char		*line;
+	size_t		 len;
+
+	switch (evt) {
+	case IO_TLSREADY:
+		s->state = SINK_COMMAND;
+		break;
+
+	case IO_DATAIN:
+		/* all the pipelined commands are answered at once */
+		while ((line = io_getline(io, &len))) {
+			if (len && line[len - 1] == '\r')
+				line[--len] = '\0';
+			sink_line(s, line, len);
+			if (s->state == SINK_QUIT || s->state == SINK_TLS)
+				break;
+		}
+		if (line == NULL && io_datalen(io) >= SINK_LINE_MAX) {
+			io_print(io, "500 5.5.2 Line too long\r\n");
+			s->state = SINK_QUIT;
+		}
+		if (io_queued(io))
+			io_set_write(io);
+		break;
+
+	case IO_LOWAT:
+		if (s->state == SINK_QUIT) {
+			sink_free(s);
+			break;
+		}
+		io_set_read(io);
+		if (s->state == SINK_TLS && io_accept_tls(io, tls) == -1) {
+			log_warnx("warn: smtpsink: tls: %s", io_error(io));
+			stats.errors++;
+			sink_free(s);
+		}
+		break;
+
+	case IO_DISCONNECTED:
+		sink_free(s);
+		break;
+
+	case IO_TIMEOUT:
+	case IO_ERROR:
+		log_debug("debug: smtpsink: %s: %s", io_strevent(evt),
+		    io_error(io) ? io_error(io) : "");
+		stats.errors++;
+		sink_free(s);
+		break;
+
+	default:
+		fatalx("sink_io: unexpected event %d", evt);
+	}
+}
+
+static void
+sink_line(struct sink *s, char *line, size_t len)
+{
+	if (s->state != SINK_DATA) {
+		sink_command(s, line);
+		return;
+	}
+
+	if (strcmp(line, ".") == 0) {
+		stats.messages++;
+		s->state = SINK_COMMAND;
+		io_print(s->io, "250 2.0.0 Message accepted for delivery\r\n");
+		return;
+	}
+	stats.bytes += len + 2;
+}
+
+static void
+sink_command(struct sink *s, char *line)
+{
+	char	*verb = line;
+	size_t	 n;
+
+	n = strcspn(line, " ");
+	if (line[n])
+		line[n] = '\0';
+
+	if (!strcasecmp(verb, "EHLO"))
+		io_printf(s->io, "250-%s Hello\r\n"
+		    "250-8BITMIME\r\n"
+		    "250-ENHANCEDSTATUSCODES\r\n"
+		    "%s"
+		    "250 PIPELINING\r\n", hostname,
+		    (tls && io_tls(s->io) == NULL) ? "250-STARTTLS\r\n" : "");
+	else if (!strcasecmp(verb, "HELO"))
+		io_printf(s->io, "250 %s Hello\r\n", hostname);
+	else if (!strcasecmp(verb, "MAIL") || !strcasecmp(verb, "RSET") ||
+	    !strcasecmp(verb, "NOOP"))
+		io_print(s->io, "250 2.0.0 Ok\r\n");
+	else if (!strcasecmp(verb, "RCPT")) {
+		stats.rcpts++;
+		io_print(s->io, "250 2.1.5 Ok\r\n");
+	}
+	else if (!strcasecmp(verb, "DATA")) {
+		s->state = SINK_DATA;
+		io_print(s->io, "354 Enter mail, end with \".\" on a line "
+		    "by itself\r\n");
+	}
+	else if (!strcasecmp(verb, "STARTTLS")) {
+		if (tls == NULL || io_tls(s->io))
+			io_print(s->io, "502 5.5.1 Command not implemented\r\n");
+		else {
+			s->state = SINK_TLS;
+			io_print(s->io, "220 2.0.0 Ready to start TLS\r\n");
+		}
+	}
+	else if (!strcasecmp(verb, "QUIT")) {
+		s->state = SINK_QUIT;
+		io_print(s->io, "221 2.0.0 Bye\r\n");
+	}
+	else
+		io_print(s->io, "500 5.5.1 Invalid command\r\n");
+}
+
+static void
+sink_free(struct sink *s)
+{
+	stats.active--;
+	io_free(s->io);
+	free(s);
+}
+
+static void
+sink_stats(int fd, short event, void *arg)
+{
+	struct timespec	now;
+	double		secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - tlast.tv_sec) +
+	    (now.tv_nsec - tlast.tv_nsec) / 1e9;
+	if (secs <= 0)
+		secs = 1;
+
+	printf("sessions=%zu active=%zu messages=%zu rcpts=%zu bytes=%zu "
+	    "errors=%zu sessions/s=%.1f messages/s=%.1f MB/s=%.2f\n",
+	    stats.sessions, stats.active, stats.messages, stats.rcpts,
+	    stats.bytes, stats.errors,
+	    (stats.sessions - last.sessions) / secs,
+	    (stats.messages - last.messages) / secs,
+	    (stats.bytes - last.bytes) / secs / (1024 * 1024));
+	fflush(stdout);
+
+	last = stats;
+	tlast = now;
+	if (event == EV_TIMEOUT)
+		evtimer_add(&ev_stats, &tv_stats);
+}
+
+static void
+sink_exit(int sig, short event, void *arg)
+{
+	sink_stats(-1, 0, NULL);
+	exit(0);
+}
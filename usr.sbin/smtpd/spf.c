@@ -0,0 +1,587 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#include <ctype.h>
+#include <event.h>
+#include <imsg.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "smtpd.h"
+#include "log.h"
+#include "spfwalk.h"
+
+/*
+ * Builtin SPF (RFC 7208) evaluation for the filters, on top of the
+ * walker shared with "smtpctl spf walk".
+ *
+ * Results are cached by address and domain for the shortest TTL they
+ * depend on, unless the evaluation expanded macros that are not part
+ * of that key.
+ */
+#define	SPF_CACHE_MAX		4096
+#define	SPF_TTL_MIN		30
+
+struct spf_cached {
+	TAILQ_ENTRY(spf_cached)	 entry;
+	char			*key;
+	time_t			 expire;
+	int			 result;
+};
+
+struct spf_eval {
+	struct spf_walk		 w;
+	void		       (*cb)(void *, int);
+	void			*arg;
+	struct sockaddr_storage	 ss;
+	char			 local[SMTPD_MAXLOCALPARTSIZE];
+	char			 domain[MAXDNAME];
+	char			 helo[MAXDNAME];
+	char			 key[MAXDNAME + 64];
+	int			 nocache;
+	int			 sync;
+	int			 result;
+};
+
+static int	spf_term(struct spf_walk *, struct spf_frame *,
+    struct spf_term *);
+static int	spf_names(struct spf_eval *, struct spf_dns *, const char *,
+    struct spf_term *);
+static void	spf_done(struct spf_walk *, int);
+static int	spf_expand(struct spf_walk *, struct spf_frame *,
+    const char *, char *, size_t);
+static int	spf_macro(struct spf_eval *, struct spf_frame *, int,
+    char *, size_t);
+static int	spf_addr_match(const struct sockaddr_storage *,
+    const struct sockaddr_storage *, int);
+static int	spf_reverse(const struct sockaddr_storage *, char *, size_t);
+
+static int	spf_cached_get(const char *);
+static void	spf_cached_set(const char *, int, time_t);
+static void	spf_cached_remove(struct spf_cached *);
+
+static struct hdict	spf_cache;
+static TAILQ_HEAD(spf_cached_lru, spf_cached) spf_cached_lru;
+static int		spf_inited;
+
+/*
+ * Evaluate the SPF policy of the sender domain, or of the helo name for
+ * the null sender, for the address.  Returns the result when it is known
+ * without waiting, otherwise -1 and cb is called once with the result.
+ */
+int
+spf_check(const struct sockaddr_storage *ss, const char *sender,
+    const char *helo, void (*cb)(void *, int), void *arg)
+{
+	struct spf_eval	*ev;
+	const char	*at;
+	char		*p;
+	int		 ret;
+
+	if (!spf_inited) {
+		hdict_init(&spf_cache);
+		TAILQ_INIT(&spf_cached_lru);
+		spf_inited = 1;
+	}
+
+	if (ss->ss_family != AF_INET && ss->ss_family != AF_INET6)
+		return SPF_NONE;
+
+	ev = xcalloc(1, sizeof *ev);
+	ev->cb = cb;
+	ev->arg = arg;
+	ev->ss = *ss;
+	ev->result = -1;
+	if (helo)
+		(void)strlcpy(ev->helo, helo, sizeof ev->helo);
+
+	if (sender && (at = strrchr(sender, '@')) != NULL && at[1]) {
+		if ((size_t)(at - sender) >= sizeof ev->local ||
+		    strlcpy(ev->domain, at + 1, sizeof ev->domain) >=
+		    sizeof ev->domain) {
+			free(ev);
+			return SPF_NONE;
+		}
+		memcpy(ev->local, sender, at - sender);
+	} else {
+		(void)strlcpy(ev->local, "postmaster", sizeof ev->local);
+		(void)strlcpy(ev->domain, ev->helo, sizeof ev->domain);
+	}
+	for (p = ev->domain; *p; p++)
+		*p = tolower((unsigned char)*p);
+
+	/* an address literal or a single label has no policy */
+	if (strchr(ev->domain, '.') == NULL || ev->domain[0] == '[') {
+		free(ev);
+		return SPF_NONE;
+	}
+
+	(void)snprintf(ev->key, sizeof ev->key, "%s|%s", ss_to_text(ss),
+	    ev->domain);
+	if ((ret = spf_cached_get(ev->key)) != -1) {
+		stat_increment("lka.spf.cache.hit", 1);
+		free(ev);
+		return ret;
+	}
+	stat_increment("lka.spf.cache.miss", 1);
+
+	ev->w.term = spf_term;
+	ev->w.expand = spf_expand;
+	ev->w.done = spf_done;
+	ev->w.arg = ev;
+	ev->w.family = ss->ss_family;
+	ev->w.max_lookups = SPF_MAX_LOOKUPS;
+	ev->w.max_voids = SPF_MAX_VOID;
+
+	ev->sync = 1;
+	spf_walk_start(&ev->w, ev->domain);
+	ev->sync = 0;
+	if ((ret = ev->result) != -1)
+		free(ev);
+	return ret;
+}
+
+/*
+ * Evaluate a term that the walker does not handle itself.  Returns 0 if
+ * it does not match, the result plus one if it matched or failed the
+ * evaluation and -1 if waiting for an answer.
+ */
+static int
+spf_term(struct spf_walk *w, struct spf_frame *f, struct spf_term *t)
+{
+	struct spf_eval	*ev = w->arg;
+	struct spf_dns	*d;
+	char		 target[MAXDNAME], name[MAXDNAME];
+	int		 type, ret;
+
+	switch (t->mech) {
+	case SPF_ALL:
+		return t->result + 1;
+	case SPF_IP4:
+	case SPF_IP6:
+		if (spf_addr_match(&ev->ss, &t->net,
+		    t->mech == SPF_IP4 ? t->cidr4 : t->cidr6) == 1)
+			return t->result + 1;
+		return 0;
+	default:
+		break;
+	}
+
+	if (spf_walk_target(w, f, t->spec, target, sizeof target) != 0)
+		return SPF_PERMERROR + 1;
+	(void)strlcpy(name, target, sizeof name);
+
+	type = ev->ss.ss_family == AF_INET ? T_A : T_AAAA;
+	switch (t->mech) {
+	case SPF_MX:
+		type = T_MX;
+		break;
+	case SPF_PTR:
+		type = T_PTR;
+		if (!spf_reverse(&ev->ss, name, sizeof name))
+			return 0;
+		break;
+	case SPF_EXISTS:
+		type = T_A;
+		break;
+	default:
+		break;
+	}
+
+	if ((d = spf_dns_get(w, type, name)) == NULL)
+		return -1;
+	if (d->status == SPF_DNS_ERROR)
+		return SPF_TEMPERROR + 1;
+	if (d->status == SPF_DNS_VOID) {
+		if (spf_walk_void(w) == -1)
+			return SPF_PERMERROR + 1;
+		return 0;
+	}
+
+	switch (t->mech) {
+	case SPF_EXISTS:
+		return d->count ? t->result + 1 : 0;
+
+	case SPF_A:
+		for (ret = 0; ret < (int)d->count; ret++)
+			if (spf_addr_match(&ev->ss, &d->addrs[ret],
+			    ev->ss.ss_family == AF_INET ? t->cidr4 :
+			    t->cidr6) == 1)
+				return t->result + 1;
+		return 0;
+
+	case SPF_MX:
+		if (d->count > SPF_MAX_NAMES)
+			return SPF_PERMERROR + 1;
+		/* FALLTHROUGH */
+	case SPF_PTR:
+		ret = spf_names(ev, d, target, t);
+		if (ret == 1)
+			return t->result + 1;
+		return ret;
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Match the address against the addresses of the MX or PTR names.  They
+ * are all looked up at once, and the term matches as soon as one of
+ * them holds the address.  PTR names must also be within the domain.
+ */
+static int
+spf_names(struct spf_eval *ev, struct spf_dns *names, const char *domain,
+    struct spf_term *t)
+{
+	struct spf_dns	*d;
+	const char	*name;
+	size_t		 i, j, n, dlen, len;
+	int		 type, cidr, waiting = 0;
+
+	type = ev->ss.ss_family == AF_INET ? T_A : T_AAAA;
+	cidr = ev->ss.ss_family == AF_INET ? t->cidr4 : t->cidr6;
+	dlen = strlen(domain);
+
+	/* the names answer is held while fetching */
+	names->refs++;
+	for (i = 0, n = 0; i < names->count && n < SPF_MAX_NAMES; i++) {
+		name = names->names[i];
+		if (t->mech == SPF_PTR) {
+			len = strlen(name);
+			if (len < dlen || strcasecmp(name + len - dlen,
+			    domain) || (len > dlen && name[len - dlen - 1] !=
+			    '.'))
+				continue;
+		}
+		n++;
+		if ((d = spf_dns_get(&ev->w, type, name)) == NULL) {
+			waiting = 1;
+			continue;
+		}
+		for (j = 0; j < d->count; j++)
+			if (spf_addr_match(&ev->ss, &d->addrs[j], cidr) == 1) {
+				spf_dns_unref(names);
+				return 1;
+			}
+	}
+	spf_dns_unref(names);
+
+	return waiting ? -1 : 0;
+}
+
+static void
+spf_done(struct spf_walk *w, int result)
+{
+	struct spf_eval	*ev = w->arg;
+	time_t		 now = clock_cached();
+
+	log_debug("debug: spf: %s for %s from %s", spf_result_to_text(result),
+	    ev->domain, ss_to_text(&ev->ss));
+	stat_increment("lka.spf.evaluated", 1);
+	stat_increment("lka.spf.dns.hit", w->hits);
+	stat_increment("lka.spf.dns.query", w->queries);
+
+	if (!ev->nocache && result != SPF_TEMPERROR) {
+		if (w->expire < now + SPF_TTL_MIN)
+			w->expire = now + SPF_TTL_MIN;
+		spf_cached_set(ev->key, result, w->expire);
+	}
+
+	if (ev->sync) {
+		ev->result = result;
+		return;
+	}
+	ev->cb(ev->arg, result);
+	free(ev);
+}
+
+/*
+ * Expand the macros of a domain-spec (RFC 7208 section 7), and keep the
+ * rightmost labels of names that are too long.
+ */
+static int
+spf_expand(struct spf_walk *w, struct spf_frame *f, const char *spec,
+    char *buf, size_t len)
+{
+	struct spf_eval	*ev = w->arg;
+	char		 value[MAXDNAME * 2], *parts[128], *s;
+	const char	*p, *delims;
+	size_t		 o = 0, n, i, keep, dlen;
+	int		 letter, reverse;
+
+	for (p = spec; *p; p++) {
+		if (*p != '%') {
+			if (o + 1 >= len)
+				return -1;
+			buf[o++] = *p;
+			continue;
+		}
+
+		switch (*++p) {
+		case '%':
+			s = "%";
+			break;
+		case '_':
+			s = " ";
+			break;
+		case '-':
+			s = "%20";
+			break;
+		case '{':
+			break;
+		default:
+			return -1;
+		}
+		if (*p != '{') {
+			if ((o += strlcpy(buf + o, s, len - o)) >= len)
+				return -1;
+			continue;
+		}
+
+		letter = tolower((unsigned char)*++p);
+		if (spf_macro(ev, f, letter, value, sizeof value) == -1)
+			return -1;
+		p++;
+
+		keep = 0;
+		while (isdigit((unsigned char)*p))
+			keep = keep * 10 + (*p++ - '0');
+		if (keep > nitems(parts))
+			keep = nitems(parts);
+		reverse = 0;
+		if (*p == 'r' || *p == 'R') {
+			reverse = 1;
+			p++;
+		}
+		delims = p;
+		while (*p && strchr(".-+,/_=", *p))
+			p++;
+		if (*p != '}')
+			return -1;
+		dlen = p - delims;
+
+		/* split on the delimiters, and join back with dots */
+		n = 0;
+		s = value;
+		while (n < nitems(parts)) {
+			parts[n++] = s;
+			while (*s && (dlen ? memchr(delims, *s, dlen) == NULL :
+			    *s != '.'))
+				s++;
+			if (*s == '\0')
+				break;
+			*s++ = '\0';
+		}
+		for (i = 0; reverse && i < n / 2; i++) {
+			s = parts[i];
+			parts[i] = parts[n - 1 - i];
+			parts[n - 1 - i] = s;
+		}
+		for (i = keep && keep < n ? n - keep : 0; i < n; i++) {
+			if ((o += strlcpy(buf + o, parts[i], len - o)) >= len)
+				return -1;
+			if (i + 1 < n) {
+				if (o + 1 >= len)
+					return -1;
+				buf[o++] = '.';
+			}
+		}
+	}
+	buf[o] = '\0';
+
+	while (o > 253 && (s = strchr(buf, '.')) != NULL) {
+		memmove(buf, s + 1, strlen(s + 1) + 1);
+		o = strlen(buf);
+	}
+	if (o == 0 || o > 253)
+		return -1;
+	for (s = buf; *s; s++)
+		*s = tolower((unsigned char)*s);
+	return 0;
+}
+
+static int
+spf_macro(struct spf_eval *ev, struct spf_frame *f, int letter, char *buf,
+    size_t len)
+{
+	const uint8_t	*p;
+	char		*s;
+	int		 i;
+
+	switch (letter) {
+	case 's':
+		ev->nocache = 1;
+		if ((size_t)snprintf(buf, len, "%s@%s", ev->local, ev->domain)
+		    >= len)
+			return -1;
+		return 0;
+	case 'l':
+		ev->nocache = 1;
+		return strlcpy(buf, ev->local, len) < len ? 0 : -1;
+	case 'o':
+		return strlcpy(buf, ev->domain, len) < len ? 0 : -1;
+	case 'd':
+		return strlcpy(buf, f->domain, len) < len ? 0 : -1;
+	case 'h':
+		ev->nocache = 1;
+		return strlcpy(buf, ev->helo, len) < len ? 0 : -1;
+	case 'p':
+		return strlcpy(buf, "unknown", len) < len ? 0 : -1;
+	case 'v':
+		return strlcpy(buf, ev->ss.ss_family == AF_INET ? "in-addr" :
+		    "ip6", len) < len ? 0 : -1;
+	case 'i':
+		if (ev->ss.ss_family == AF_INET) {
+			p = (const uint8_t *)&((struct sockaddr_in *)
+			    &ev->ss)->sin_addr;
+			(void)snprintf(buf, len, "%u.%u.%u.%u", p[0], p[1],
+			    p[2], p[3]);
+			return 0;
+		}
+		if (len < 16 * 4)
+			return -1;
+		p = (const uint8_t *)&((struct sockaddr_in6 *)
+		    &ev->ss)->sin6_addr;
+		for (s = buf, i = 0; i < 16; i++) {
+			*s++ = "0123456789abcdef"[p[i] >> 4];
+			*s++ = '.';
+			*s++ = "0123456789abcdef"[p[i] & 0xf];
+			*s++ = '.';
+		}
+		s[-1] = '\0';
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static int
+spf_addr_match(const struct sockaddr_storage *ss,
+    const struct sockaddr_storage *net, int bits)
+{
+	const uint8_t	*a, *b;
+	int		 max;
+
+	if (ss->ss_family != net->ss_family)
+		return 0;
+
+	if (ss->ss_family == AF_INET) {
+		a = (const uint8_t *)&((const struct sockaddr_in *)ss)->sin_addr;
+		b = (const uint8_t *)&((const struct sockaddr_in *)net)->sin_addr;
+		max = 32;
+	} else {
+		a = (const uint8_t *)&((const struct sockaddr_in6 *)ss)->sin6_addr;
+		b = (const uint8_t *)&((const struct sockaddr_in6 *)net)->sin6_addr;
+		max = 128;
+	}
+	if (bits < 0 || bits > max)
+		bits = max;
+
+	for (; bits >= 8; bits -= 8)
+		if (*a++ != *b++)
+			return 0;
+	if (bits && ((*a ^ *b) & (0xff << (8 - bits))))
+		return 0;
+	return 1;
+}
+
+static int
+spf_reverse(const struct sockaddr_storage *ss, char *buf, size_t len)
+{
+	const uint8_t	*p;
+	char		*s = buf;
+	int		 i, n;
+
+	switch (ss->ss_family) {
+	case AF_INET:
+		p = (const uint8_t *)&((const struct sockaddr_in *)ss)->sin_addr;
+		n = snprintf(buf, len, "%u.%u.%u.%u.in-addr.arpa",
+		    p[3], p[2], p[1], p[0]);
+		return n > 0 && (size_t)n < len;
+
+	case AF_INET6:
+		p = (const uint8_t *)&((const struct sockaddr_in6 *)ss)->sin6_addr;
+		if (len < 16 * 4 + sizeof "ip6.arpa")
+			return 0;
+		for (i = 15; i >= 0; i--) {
+			*s++ = "0123456789abcdef"[p[i] & 0xf];
+			*s++ = '.';
+			*s++ = "0123456789abcdef"[p[i] >> 4];
+			*s++ = '.';
+		}
+		(void)strlcpy(s, "ip6.arpa", len - (s - buf));
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+spf_cached_get(const char *key)
+{
+	struct spf_cached	*r;
+
+	if ((r = hdict_get(&spf_cache, key)) == NULL)
+		return -1;
+	if (r->expire <= clock_cached()) {
+		spf_cached_remove(r);
+		return -1;
+	}
+	TAILQ_REMOVE(&spf_cached_lru, r, entry);
+	TAILQ_INSERT_HEAD(&spf_cached_lru, r, entry);
+	return r->result;
+}
+
+static void
+spf_cached_set(const char *key, int result, time_t expire)
+{
+	struct spf_cached	*r;
+
+	if ((r = hdict_get(&spf_cache, key)) != NULL)
+		spf_cached_remove(r);
+	else if (hdict_count(&spf_cache) >= SPF_CACHE_MAX)
+		spf_cached_remove(TAILQ_LAST(&spf_cached_lru, spf_cached_lru));
+
+	r = xcalloc(1, sizeof *r);
+	r->key = xstrdup(key);
+	r->expire = expire;
+	r->result = result;
+	hdict_xset(&spf_cache, r->key, r);
+	TAILQ_INSERT_HEAD(&spf_cached_lru, r, entry);
+}
+
+static void
+spf_cached_remove(struct spf_cached *r)
+{
+	hdict_xpop(&spf_cache, r->key);
+	TAILQ_REMOVE(&spf_cached_lru, r, entry);
+	free(r->key);
+	free(r);
+}
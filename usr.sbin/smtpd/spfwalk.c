@@ -17,384 +17,811 @@
 #include "includes.h"
 
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/tree.h>
 
 #ifdef HAVE_ARPA_NAMESER_COMPAT_H
 #include <arpa/nameser_compat.h>
 #endif
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
-#include <netinet/in.h>
 
-#include <arpa/inet.h>
 #include <asr.h>
 #include <ctype.h>
-#include <err.h>
-#include <errno.h>
 #include <event.h>
+#include <imsg.h>
 #include <limits.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <time.h>
 
-#include "smtpd-defines.h"
-#include "smtpd-api.h"
+#include "smtpd.h"
+#include "log.h"
 #include "unpack_dns.h"
-#include "parser.h"
-
-struct target {
-	void	(*dispatch)(struct dns_rr *, struct target *);
-	int	  cidr4;
-	int	  cidr6;
-};
-
-int spfwalk(int, struct parameter *);
+#include "spfwalk.h"
 
-static void	dispatch_txt(struct dns_rr *, struct target *);
-static void	dispatch_mx(struct dns_rr *, struct target *);
-static void	dispatch_a(struct dns_rr *, struct target *);
-static void	dispatch_aaaa(struct dns_rr *, struct target *);
-static void	lookup_record(int, char *, struct target *);
-static void	dispatch_record(struct asr_result *, void *);
-static ssize_t	parse_txt(const char *, size_t, char *, size_t);
-static int	parse_target(char *, struct target *);
-void *xmalloc(size_t size);
+/*
+ * Walker of SPF (RFC 7208) policies, for the builtin evaluation and for
+ * "smtpctl spf walk".
+ *
+ * DNS answers are cached by type and name for the TTL of their records,
+ * bounded to SPF_TTL_MIN and SPF_TTL_MAX, and TXT answers are kept as
+ * parsed records, so that the include and redirect trees of popular
+ * domains are walked again without any query.  Failed lookups are kept
+ * for SPF_TTL_ERROR only.  When a record is entered, the names of its
+ * terms are all queried at once, within the lookup limit, and the terms
+ * are then walked in order as the answers come in.
+ */
+#define	SPF_DNS_CACHE_MAX	4096
+#define	SPF_TTL_MIN		30
+#define	SPF_TTL_MAX		3600
+#define	SPF_TTL_NEGATIVE	300
+#define	SPF_TTL_ERROR		10
+#define	SPF_RECORD_MAX		4096
+
+static void	spf_walk_step(struct spf_walk *);
+static void	spf_walk_finish(struct spf_walk *, int);
+static int	spf_walk_term(struct spf_walk *, struct spf_frame *,
+    struct spf_term *);
+static int	spf_walk_push(struct spf_walk *, struct spf_dns *,
+    const char *);
+static int	spf_walk_pop(struct spf_walk *, int);
+static void	spf_walk_prefetch(struct spf_walk *, struct spf_frame *);
+
+static struct spf_record *spf_record_parse(const char *);
+static void	spf_record_free(struct spf_record *);
+
+static struct spf_dns *spf_dns_lookup(struct spf_walk *, int, const char *);
+static void	spf_dns_dispatch(struct asr_result *, void *);
+static void	spf_dns_answer(struct spf_dns *, struct asr_result *);
+static void	spf_dns_uncache(struct spf_dns *);
+static void	spf_dns_free(struct spf_dns *);
+
+static struct hdict	spf_dns_cache;
+static TAILQ_HEAD(spf_dns_lru, spf_dns) spf_dns_lru;
+static int		spf_dns_inited;
 
-int     ip_v4 = 0;
-int     ip_v6 = 0;
-int     ip_both = 1;
+/*
+ * Walk the policy of the domain.  done() is called once with the result,
+ * possibly before returning.
+ */
+void
+spf_walk_start(struct spf_walk *w, const char *domain)
+{
+	if (!spf_dns_inited) {
+		hdict_init(&spf_dns_cache);
+		TAILQ_INIT(&spf_dns_lru);
+		spf_dns_inited = 1;
+	}
 
-struct dict seen;
+	(void)strlcpy(w->domain, domain, sizeof w->domain);
+	w->lookups = 0;
+	w->voids = 0;
+	w->waiting = 0;
+	w->queries = 0;
+	w->hits = 0;
+	w->expire = clock_cached() + SPF_TTL_MAX;
+	w->depth = 0;
+	spf_walk_step(w);
+}
 
+/*
+ * The name a term applies to: its domain-spec, or the domain of the
+ * record.  Returns 1 if the term must be skipped.
+ */
 int
-spfwalk(int argc, struct parameter *argv)
+spf_walk_target(struct spf_walk *w, struct spf_frame *f, const char *spec,
+    char *buf, size_t len)
 {
-	struct target	 tgt;
-	const char	*ip_family = NULL;
-	char		*line = NULL;
-	size_t		 linesize = 0;
-	ssize_t		 linelen;
-
-	if (argv)
-		ip_family = argv[0].u.u_str;
-
-	if (ip_family) {
-		if (strcmp(ip_family, "-4") == 0) {
-			ip_both = 0;
-			ip_v4 = 1;
-		} else if (strcmp(ip_family, "-6") == 0) {
-			ip_both = 0;
-			ip_v6 = 1;
-		} else
-			errx(1, "invalid ip_family");
+	if (spec == NULL)
+		spec = f->domain;
+	else if (strchr(spec, '%')) {
+		if (w->expand == NULL)
+			return 1;
+		return w->expand(w, f, spec, buf, len);
 	}
+	if (!lowercase(buf, spec, len) || *buf == '\0' || strlen(buf) > 253)
+		return -1;
+	return 0;
+}
 
-	dict_init(&seen);
-  	event_init();
-
-	tgt.cidr4 = tgt.cidr6 = -1;
-	tgt.dispatch = dispatch_txt;
-
-	while ((linelen = getline(&line, &linesize, stdin)) != -1) {
-		while (linelen-- > 0 && isspace((unsigned char)line[linelen]))
-			line[linelen] = '\0';
+/* count a lookup that had no answer, -1 past the limit */
+int
+spf_walk_void(struct spf_walk *w)
+{
+	if (++w->voids > w->max_voids)
+		return -1;
+	return 0;
+}
 
-		if (linelen > 0)
-			lookup_record(T_TXT, line, &tgt);
+static void
+spf_walk_step(struct spf_walk *w)
+{
+	struct spf_frame	*f;
+	struct spf_record	*rec;
+	struct spf_dns		*d;
+	char			 name[MAXDNAME];
+	int			 ret;
+
+	if (w->depth == 0) {
+		if ((d = spf_dns_get(w, T_TXT, w->domain)) == NULL)
+			return;
+		if (d->status == SPF_DNS_ERROR)
+			spf_walk_finish(w, SPF_TEMPERROR);
+		else if (d->status == SPF_DNS_INVALID)
+			spf_walk_finish(w, SPF_PERMERROR);
+		else if (d->record == NULL)
+			spf_walk_finish(w, SPF_NONE);
+		else if (spf_walk_push(w, d, w->domain) == -1)
+			spf_walk_finish(w, SPF_PERMERROR);
+		else
+			goto loop;
+		return;
 	}
 
-	free(line);
+loop:
+	for (;;) {
+		f = &w->frames[w->depth - 1];
+		rec = f->txt->record;
+
+		if (f->idx < rec->nterms) {
+			ret = spf_walk_term(w, f, &rec->terms[f->idx]);
+			if (ret == -1)
+				return;	/* waiting for answers */
+			if (ret == -2)
+				continue; /* entered an include */
+			if (ret == 0) {
+				f->idx++;
+				f->counted = 0;
+				continue;
+			}
+			if (spf_walk_pop(w, ret - 1) == -1)
+				return;
+			continue;
+		}
 
-#if HAVE_PLEDGE
-	if (pledge("dns stdio", NULL) == -1)
-		err(1, "pledge");
-#endif
+		if (rec->redirect == NULL) {
+			if (spf_walk_pop(w, SPF_NEUTRAL) == -1)
+				return;
+			continue;
+		}
 
-  	event_dispatch();
+		if (!f->counted) {
+			f->counted = 1;
+			if (++w->lookups > w->max_lookups) {
+				spf_walk_finish(w, SPF_PERMERROR);
+				return;
+			}
+		}
+		ret = spf_walk_target(w, f, rec->redirect, name, sizeof name);
+		if (ret == 1) {
+			if (spf_walk_pop(w, SPF_NEUTRAL) == -1)
+				return;
+			continue;
+		}
+		if (ret == -1) {
+			spf_walk_finish(w, SPF_PERMERROR);
+			return;
+		}
+		if ((d = spf_dns_get(w, T_TXT, name)) == NULL)
+			return;
+		if (d->status == SPF_DNS_ERROR) {
+			spf_walk_finish(w, SPF_TEMPERROR);
+			return;
+		}
+		if (d->status != SPF_DNS_OK || d->record == NULL) {
+			spf_walk_finish(w, SPF_PERMERROR);
+			return;
+		}
 
-	return 0;
+		/* the target record replaces the current one */
+		d->refs++;
+		spf_dns_unref(f->txt);
+		f->txt = d;
+		(void)strlcpy(f->domain, name, sizeof f->domain);
+		f->idx = 0;
+		f->counted = 0;
+		spf_walk_prefetch(w, f);
+	}
 }
 
-void
-lookup_record(int type, char *record, struct target *tgt)
+static void
+spf_walk_finish(struct spf_walk *w, int result)
 {
-	struct asr_query *as;
-	struct target *ntgt;
-	size_t i;
-
-	if (strchr(record, '%') != NULL) {
-		for (i = 0; record[i] != '\0'; i++) {
-			if (!isprint(record[i]))
-				record[i] = '?';
-		}
-		warnx("%s: %s contains macros and can't be resolved", __func__,
-		    record);
-		return;
-	}
-	as = res_query_async(record, C_IN, type, NULL);
-	if (as == NULL)
-		err(1, "res_query_async");
-	ntgt = xmalloc(sizeof(*ntgt));
-	*ntgt = *tgt;
-	event_asr_run(as, dispatch_record, (void *)ntgt);
+	while (w->depth)
+		spf_dns_unref(w->frames[--w->depth].txt);
+	w->done(w, result);
 }
 
-void
-dispatch_record(struct asr_result *ar, void *arg)
+/*
+ * Count the lookup of a term and enter includes, the other terms are
+ * left to the user of the walk.  Returns 0 if the term does not match,
+ * the result plus one if it matched or failed the walk, -1 if waiting
+ * for an answer and -2 if an included record was entered.
+ */
+static int
+spf_walk_term(struct spf_walk *w, struct spf_frame *f, struct spf_term *t)
 {
-	struct target *tgt = arg;
-	struct unpack pack;
-	struct dns_header h;
-	struct dns_query q;
-	struct dns_rr rr;
+	struct spf_dns	*d;
+	char		 name[MAXDNAME];
+	int		 ret;
+
+	switch (t->mech) {
+	case SPF_ALL:
+	case SPF_IP4:
+	case SPF_IP6:
+		return w->term(w, f, t);
+	default:
+		break;
+	}
 
-	/* best effort */
-	if (ar->ar_h_errno && ar->ar_h_errno != NO_DATA)
-		goto end;
+	if (!f->counted) {
+		f->counted = 1;
+		if (++w->lookups > w->max_lookups)
+			return SPF_PERMERROR + 1;
+	}
 
-	unpack_init(&pack, ar->ar_data, ar->ar_datalen);
-	unpack_header(&pack, &h);
-	unpack_query(&pack, &q);
+	if (t->mech != SPF_INCLUDE)
+		return w->term(w, f, t);
 
-	for (; h.ancount; h.ancount--) {
-		unpack_rr(&pack, &rr);
-		/**/
-		tgt->dispatch(&rr, tgt);
+	if ((ret = spf_walk_target(w, f, t->spec, name, sizeof name)) == 1)
+		return 0;
+	if (ret == -1)
+		return SPF_PERMERROR + 1;
+	if ((d = spf_dns_get(w, T_TXT, name)) == NULL)
+		return -1;
+	if (d->status == SPF_DNS_ERROR)
+		return SPF_TEMPERROR + 1;
+	if (d->status == SPF_DNS_VOID) {
+		(void)spf_walk_void(w);
+		return SPF_PERMERROR + 1;
 	}
-end:
-	free(tgt);
+	if (d->status == SPF_DNS_INVALID || d->record == NULL)
+		return SPF_PERMERROR + 1;
+	if (spf_walk_push(w, d, name) == -1)
+		return SPF_PERMERROR + 1;
+	return -2;
 }
 
-void
-dispatch_txt(struct dns_rr *rr, struct target *tgt)
+static int
+spf_walk_push(struct spf_walk *w, struct spf_dns *d, const char *domain)
 {
-	char buf[4096];
-	char *argv[512];
-	char buf2[512];
-	struct target ltgt;
-	struct in6_addr ina;
-	char **ap = argv;
-	char *in = buf;
-	char *record, *end;
-	ssize_t n;
-
-	if (rr->rr_type != T_TXT)
-		return;
-	n = parse_txt(rr->rr.other.rdata, rr->rr.other.rdlen, buf, sizeof(buf));
-	if (n == -1 || n == sizeof(buf))
-		return;
-	buf[n] = '\0';
-
-	if (strncasecmp("v=spf1 ", buf, 7))
-		return;
-
-	while ((*ap = strsep(&in, " ")) != NULL) {
-		if (strcasecmp(*ap, "v=spf1") == 0)
-			continue;
-
-		end = *ap + strlen(*ap)-1;
-		if (*end == '.')
-			*end = '\0';
+	struct spf_frame	*f;
+
+	if (w->depth == nitems(w->frames))
+		return -1;
+
+	f = &w->frames[w->depth++];
+	f->txt = d;
+	d->refs++;
+	(void)strlcpy(f->domain, domain, sizeof f->domain);
+	f->idx = 0;
+	f->counted = 0;
+	spf_walk_prefetch(w, f);
+	return 0;
+}
 
-		if (dict_set(&seen, *ap, &seen))
-			continue;
+/*
+ * Leave the current record with its result.  Returns -1 when the walk
+ * is over, otherwise the including term is resolved and the parent
+ * record is resumed.
+ */
+static int
+spf_walk_pop(struct spf_walk *w, int result)
+{
+	struct spf_frame	*f;
+	struct spf_term		*t;
 
-		if (**ap == '-' || **ap == '~')
-			continue;
+	f = &w->frames[--w->depth];
+	spf_dns_unref(f->txt);
+	f->txt = NULL;
 
-		if (**ap == '+' || **ap == '?')
-			(*ap)++;
+	if (w->depth == 0) {
+		spf_walk_finish(w, result);
+		return -1;
+	}
 
-		ltgt.cidr4 = ltgt.cidr6 = -1;
+	f = &w->frames[w->depth - 1];
+	t = &f->txt->record->terms[f->idx];
+	switch (result) {
+	case SPF_PASS:
+		return spf_walk_pop(w, t->result);
+	case SPF_FAIL:
+	case SPF_SOFTFAIL:
+	case SPF_NEUTRAL:
+		f->idx++;
+		f->counted = 0;
+		return 0;
+	case SPF_TEMPERROR:
+		spf_walk_finish(w, SPF_TEMPERROR);
+		return -1;
+	default:
+		spf_walk_finish(w, SPF_PERMERROR);
+		return -1;
+	}
+}
 
-		if (strncasecmp("ip4:", *ap, 4) == 0) {
-			if ((ip_v4 == 1 || ip_both == 1) &&
-			    inet_net_pton(AF_INET, *(ap) + 4,
-			    &ina, sizeof(ina)) != -1)
-				printf("%s\n", *(ap) + 4);
+/* query the names of the terms of a record that was just entered */
+static void
+spf_walk_prefetch(struct spf_walk *w, struct spf_frame *f)
+{
+	struct spf_record	*rec = f->txt->record;
+	struct spf_term		*t;
+	char			 name[MAXDNAME];
+	size_t			 i;
+	int			 left;
+
+	left = w->max_lookups - w->lookups;
+	for (i = 0; i < rec->nterms && left > 0; i++) {
+		t = &rec->terms[i];
+		switch (t->mech) {
+		case SPF_INCLUDE:
+		case SPF_A:
+		case SPF_MX:
+		case SPF_EXISTS:
+			break;
+		default:
 			continue;
 		}
-		if (strncasecmp("ip6:", *ap, 4) == 0) {
-			if ((ip_v6 == 1 || ip_both == 1) &&
-			    inet_net_pton(AF_INET6, *(ap) + 4,
-			    &ina, sizeof(ina)) != -1)
-				printf("%s\n", *(ap) + 4);
+		left--;
+		if (t->spec && strchr(t->spec, '%'))
 			continue;
-		}
-		if (strcasecmp("a", *ap) == 0) {
-			print_dname(rr->rr_dname, buf2, sizeof(buf2));
-			buf2[strlen(buf2) - 1] = '\0';
-			ltgt.dispatch = dispatch_a;
-			lookup_record(T_A, buf2, &ltgt);
-			ltgt.dispatch = dispatch_aaaa;
-			lookup_record(T_AAAA, buf2, &ltgt);
+		if (spf_walk_target(w, f, t->spec, name, sizeof name) != 0)
 			continue;
+
+		switch (t->mech) {
+		case SPF_INCLUDE:
+			(void)spf_dns_lookup(w, T_TXT, name);
+			break;
+		case SPF_A:
+			if (w->family != AF_INET6)
+				(void)spf_dns_lookup(w, T_A, name);
+			if (w->family != AF_INET)
+				(void)spf_dns_lookup(w, T_AAAA, name);
+			break;
+		case SPF_MX:
+			(void)spf_dns_lookup(w, T_MX, name);
+			break;
+		default:
+			(void)spf_dns_lookup(w, T_A, name);
+			break;
 		}
-		if (strncasecmp("a:", *ap, 2) == 0) {
-			record = *(ap) + 2;
-			if (parse_target(record, &ltgt) < 0)
-				continue;
-			ltgt.dispatch = dispatch_a;
-			lookup_record(T_A, record, &ltgt);
-			ltgt.dispatch = dispatch_aaaa;
-			lookup_record(T_AAAA, record, &ltgt);
+	}
+	if (left > 0 && rec->redirect && strchr(rec->redirect, '%') == NULL &&
+	    spf_walk_target(w, f, rec->redirect, name, sizeof name) == 0)
+		(void)spf_dns_lookup(w, T_TXT, name);
+}
+
+/* parse the terms of a "v=spf1" record, NULL if it is not valid */
+static struct spf_record *
+spf_record_parse(const char *txt)
+{
+	struct spf_record	*rec;
+	struct spf_term		*t;
+	struct sockaddr_in	*sin;
+	struct sockaddr_in6	*sin6;
+	char			*buf, *p, *tok, *arg, *cidr, *cidr6, *end;
+	const char		*errstr;
+	size_t			 n;
+
+	rec = xcalloc(1, sizeof *rec);
+	buf = xstrdup(txt + 6);
+
+	/* enough terms for any record that fits */
+	for (n = 1, p = buf; *p; p++)
+		if (*p == ' ')
+			n++;
+	rec->terms = xcalloc(n, sizeof *rec->terms);
+
+	p = buf;
+	while ((tok = strsep(&p, " ")) != NULL) {
+		if (*tok == '\0')
 			continue;
-		}
-		if (strncasecmp("exists:", *ap, 7) == 0) {
-			ltgt.dispatch = dispatch_a;
-			lookup_record(T_A, *(ap) + 7, &ltgt);
+
+		/* modifiers */
+		arg = tok + strcspn(tok, ":/=");
+		if (*arg == '=') {
+			*arg++ = '\0';
+			if (strcasecmp(tok, "redirect") == 0) {
+				if (rec->redirect || *arg == '\0')
+					goto bad;
+				rec->redirect = xstrdup(arg);
+			}
+			/* exp and unknown modifiers are ignored */
 			continue;
 		}
-		if (strncasecmp("include:", *ap, 8) == 0) {
-			ltgt.dispatch = dispatch_txt;
-			lookup_record(T_TXT, *(ap) + 8, &ltgt);
-			continue;
+
+		t = &rec->terms[rec->nterms];
+		t->result = SPF_PASS;
+		t->cidr4 = 32;
+		t->cidr6 = 128;
+		switch (*tok) {
+		case '+':
+			tok++;
+			break;
+		case '-':
+			t->result = SPF_FAIL;
+			tok++;
+			break;
+		case '~':
+			t->result = SPF_SOFTFAIL;
+			tok++;
+			break;
+		case '?':
+			t->result = SPF_NEUTRAL;
+			tok++;
+			break;
 		}
-		if (strncasecmp("redirect=", *ap, 9) == 0) {
-			ltgt.dispatch = dispatch_txt;
-			lookup_record(T_TXT, *(ap) + 9, &ltgt);
-			continue;
+
+		/* name[:domain-spec or address][/cidr] */
+		arg = tok + strcspn(tok, ":/");
+		cidr = cidr6 = NULL;
+		if (*arg == '/')
+			cidr = arg;
+		if (*arg == ':') {
+			*arg++ = '\0';
+			/* a domain-spec may hold '/' in macro delimiters */
+			for (end = arg; *end && *end != '/'; end++)
+				if (end[0] == '%' && end[1] == '{')
+					end += strcspn(end, "}") - 1;
+			if (*end == '/')
+				cidr = end;
+		} else
+			arg = NULL;
+		if (cidr) {
+			cidr6 = strstr(cidr, "//");
+			if (cidr6) {
+				cidr6[0] = cidr6[1] = '\0';
+				cidr6 += 2;
+			}
+			*cidr++ = '\0';
+			if (*cidr == '\0')
+				cidr = NULL;
 		}
-		if (strcasecmp("mx", *ap) == 0) {
-			print_dname(rr->rr_dname, buf2, sizeof(buf2));
-			buf2[strlen(buf2) - 1] = '\0';
-			ltgt.dispatch = dispatch_mx;
-			lookup_record(T_MX, buf2, &ltgt);
-			continue;
+		if (arg && *arg == '\0')
+			goto bad;
+
+		if (strcasecmp(tok, "all") == 0 && !arg)
+			t->mech = SPF_ALL;
+		else if (strcasecmp(tok, "include") == 0 && arg)
+			t->mech = SPF_INCLUDE;
+		else if (strcasecmp(tok, "a") == 0)
+			t->mech = SPF_A;
+		else if (strcasecmp(tok, "mx") == 0)
+			t->mech = SPF_MX;
+		else if (strcasecmp(tok, "ptr") == 0)
+			t->mech = SPF_PTR;
+		else if (strcasecmp(tok, "exists") == 0 && arg)
+			t->mech = SPF_EXISTS;
+		else if (strcasecmp(tok, "ip4") == 0 && arg) {
+			t->mech = SPF_IP4;
+			sin = (struct sockaddr_in *)&t->net;
+			sin->sin_family = AF_INET;
+			if (inet_pton(AF_INET, arg, &sin->sin_addr) != 1)
+				goto bad;
+			arg = NULL;
 		}
-		if (strncasecmp("mx:", *ap, 3) == 0) {
-			record = *(ap) + 3;
-			if (parse_target(record, &ltgt) < 0)
-				continue;
-			ltgt.dispatch = dispatch_mx;
-			lookup_record(T_MX, record, &ltgt);
-			continue;
+		else if (strcasecmp(tok, "ip6") == 0 && arg) {
+			t->mech = SPF_IP6;
+			sin6 = (struct sockaddr_in6 *)&t->net;
+			sin6->sin6_family = AF_INET6;
+			if (inet_pton(AF_INET6, arg, &sin6->sin6_addr) != 1)
+				goto bad;
+			arg = NULL;
+		}
+		else
+			goto bad;
+
+		/* ip6 takes a single prefix, a and mx a dual one */
+		if (t->mech == SPF_IP6) {
+			if (cidr6)
+				goto bad;
+			cidr6 = cidr;
+			cidr = NULL;
+		} else if (t->mech != SPF_IP4 && t->mech != SPF_A &&
+		    t->mech != SPF_MX && (cidr || cidr6))
+			goto bad;
+		if (t->mech == SPF_IP4 && cidr6)
+			goto bad;
+		if (cidr) {
+			t->cidr4 = strtonum(cidr, 0, 32, &errstr);
+			if (errstr)
+				goto bad;
 		}
+		if (cidr6) {
+			t->cidr6 = strtonum(cidr6, 0, 128, &errstr);
+			if (errstr)
+				goto bad;
+		}
+
+		if (arg)
+			t->spec = xstrdup(arg);
+		rec->nterms++;
 	}
-	*ap = NULL;
+
+	free(buf);
+	return rec;
+
+bad:
+	free(buf);
+	spf_record_free(rec);
+	return NULL;
 }
 
-void
-dispatch_mx(struct dns_rr *rr, struct target *tgt)
+static void
+spf_record_free(struct spf_record *rec)
 {
-	char buf[512];
-	struct target ltgt;
+	size_t	i;
 
-	if (rr->rr_type != T_MX)
-		return;
+	for (i = 0; i < rec->nterms; i++)
+		free(rec->terms[i].spec);
+	free(rec->terms);
+	free(rec->redirect);
+	free(rec);
+}
 
-	print_dname(rr->rr.mx.exchange, buf, sizeof(buf));
-	buf[strlen(buf) - 1] = '\0';
-	if (buf[strlen(buf) - 1] == '.')
-		buf[strlen(buf) - 1] = '\0';
+/*
+ * Return the answer to the query, or NULL if it is in flight, in which
+ * case the walk is resumed once all its pending answers came in.
+ */
+struct spf_dns *
+spf_dns_get(struct spf_walk *w, int type, const char *name)
+{
+	struct spf_dns	*d;
+	struct spf_wait	*wait;
+
+	d = spf_dns_lookup(w, type, name);
+	if (d->pending) {
+		wait = xcalloc(1, sizeof *wait);
+		wait->w = w;
+		TAILQ_INSERT_TAIL(&d->waiters, wait, entry);
+		w->waiting++;
+		return NULL;
+	}
 
-	ltgt = *tgt;
-	ltgt.dispatch = dispatch_a;
-	lookup_record(T_A, buf, &ltgt);
-	ltgt.dispatch = dispatch_aaaa;
-	lookup_record(T_AAAA, buf, &ltgt);
+	if (d->cached) {
+		TAILQ_REMOVE(&spf_dns_lru, d, entry);
+		TAILQ_INSERT_HEAD(&spf_dns_lru, d, entry);
+	}
+	if (d->expire < w->expire)
+		w->expire = d->expire;
+	return d;
 }
 
-void
-dispatch_a(struct dns_rr *rr, struct target *tgt)
+/* find the cached answer, or start the query */
+static struct spf_dns *
+spf_dns_lookup(struct spf_walk *w, int type, const char *name)
 {
-	char buffer[512];
-	const char *ptr;
+	struct spf_dns		*d;
+	struct asr_query	*as;
+	char			 key[MAXDNAME + 16];
 
-	if (rr->rr_type != T_A)
-		return;
+	(void)snprintf(key, sizeof key, "%d/", type);
+	(void)lowercase(key + strlen(key), name, sizeof key - strlen(key));
 
-	if ((ptr = inet_ntop(AF_INET, &rr->rr.in_a.addr,
-	    buffer, sizeof buffer))) {
-		if (tgt->cidr4 >= 0)
-			printf("%s/%d\n", ptr, tgt->cidr4);
-		else
-			printf("%s\n", ptr);
+	if ((d = hdict_get(&spf_dns_cache, key)) != NULL) {
+		if (d->pending || d->expire > clock_cached()) {
+			w->hits++;
+			return d;
+		}
+		spf_dns_uncache(d);
+	}
+	w->queries++;
+
+	d = xcalloc(1, sizeof *d);
+	TAILQ_INIT(&d->waiters);
+	d->key = xstrdup(key);
+	d->type = type;
+	d->cached = 1;
+	hdict_xset(&spf_dns_cache, d->key, d);
+
+	if ((as = res_query_async(name, C_IN, type, NULL)) == NULL) {
+		log_warn("warn: spf: res_query_async: %s", name);
+		d->status = SPF_DNS_ERROR;
+		d->expire = clock_cached() + SPF_TTL_ERROR;
+		TAILQ_INSERT_HEAD(&spf_dns_lru, d, entry);
+		return d;
 	}
+	d->pending = 1;
+	event_asr_run(as, spf_dns_dispatch, d);
+	return d;
 }
 
-void
-dispatch_aaaa(struct dns_rr *rr, struct target *tgt)
+static void
+spf_dns_dispatch(struct asr_result *ar, void *arg)
 {
-	char buffer[512];
-	const char *ptr;
-
-	if (rr->rr_type != T_AAAA)
-		return;
-
-	if ((ptr = inet_ntop(AF_INET6, &rr->rr.in_aaaa.addr6,
-	    buffer, sizeof buffer))) {
-		if (tgt->cidr6 >= 0)
-			printf("%s/%d\n", ptr, tgt->cidr6);
-		else
-			printf("%s\n", ptr);
+	struct spf_dns	*d = arg;
+	struct spf_dns	*old, *prev;
+	struct spf_wait	*wait;
+	struct spf_walk	*w;
+
+	spf_dns_answer(d, ar);
+	free(ar->ar_data);
+	d->pending = 0;
+
+	/* make room, sparing the answers in use */
+	old = TAILQ_LAST(&spf_dns_lru, spf_dns_lru);
+	while (old && hdict_count(&spf_dns_cache) > SPF_DNS_CACHE_MAX) {
+		prev = TAILQ_PREV(old, spf_dns_lru, entry);
+		if (old->refs == 0)
+			spf_dns_uncache(old);
+		old = prev;
+	}
+	if (d->cached)
+		TAILQ_INSERT_HEAD(&spf_dns_lru, d, entry);
+
+	d->refs++;
+	while ((wait = TAILQ_FIRST(&d->waiters)) != NULL) {
+		TAILQ_REMOVE(&d->waiters, wait, entry);
+		w = wait->w;
+		free(wait);
+		if (--w->waiting == 0)
+			spf_walk_step(w);
 	}
+	spf_dns_unref(d);
 }
 
-ssize_t
-parse_txt(const char *rdata, size_t rdatalen, char *dst, size_t dstsz)
+static void
+spf_dns_answer(struct spf_dns *d, struct asr_result *ar)
 {
-	size_t len;
-	ssize_t r = 0;
-
-	while (rdatalen) {
-		len = *(const unsigned char *)rdata;
-		if (len >= rdatalen) {
-			errno = EINVAL;
-			return -1;
-		}
+	struct unpack		 pack;
+	struct dns_header	 h;
+	struct dns_query	 dq;
+	struct dns_rr		 rr;
+	struct sockaddr_in	*sin;
+	struct sockaddr_in6	*sin6;
+	const uint8_t		*p;
+	char			 txt[SPF_RECORD_MAX], name[MAXDNAME];
+	size_t			 len, n, records = 0;
+	uint32_t		 ttl = SPF_TTL_NEGATIVE;
+	int			 found = 0;
+
+	d->status = SPF_DNS_ERROR;
+	d->expire = clock_cached() + SPF_TTL_ERROR;
+	if (ar->ar_h_errno && ar->ar_rcode != NXDOMAIN &&
+	    ar->ar_h_errno != NO_DATA)
+		return;
 
-		rdata++;
-		rdatalen--;
+	unpack_init(&pack, ar->ar_data, ar->ar_datalen);
+	if (unpack_header(&pack, &h) == -1 || unpack_query(&pack, &dq) == -1)
+		return;
 
-		if (len == 0)
+	d->status = SPF_DNS_VOID;
+	for (; h.ancount; h.ancount--) {
+		if (unpack_rr(&pack, &rr) == -1)
+			break;
+		if (rr.rr_type != d->type)
 			continue;
-
-		if (len >= dstsz) {
-			errno = EOVERFLOW;
-			return -1;
+		if (!found || rr.rr_ttl < ttl)
+			ttl = rr.rr_ttl;
+		found = 1;
+
+		switch (rr.rr_type) {
+		case T_A:
+		case T_AAAA:
+			d->addrs = reallocarray(d->addrs, d->count + 1,
+			    sizeof *d->addrs);
+			if (d->addrs == NULL)
+				fatal("reallocarray");
+			memset(&d->addrs[d->count], 0, sizeof *d->addrs);
+			if (rr.rr_type == T_A) {
+				sin = (struct sockaddr_in *)&d->addrs[d->count];
+				sin->sin_family = AF_INET;
+				sin->sin_addr = rr.rr.in_a.addr;
+			} else {
+				sin6 = (struct sockaddr_in6 *)
+				    &d->addrs[d->count];
+				sin6->sin6_family = AF_INET6;
+				sin6->sin6_addr = rr.rr.in_aaaa.addr6;
+			}
+			d->count++;
+			break;
+
+		case T_MX:
+		case T_PTR:
+			print_dname(rr.rr_type == T_MX ? rr.rr.mx.exchange :
+			    rr.rr.ptr.ptrname, name, sizeof name);
+			len = strlen(name);
+			if (len && name[len - 1] == '.')
+				name[--len] = '\0';
+			if (len == 0)
+				break;
+			d->names = reallocarray(d->names, d->count + 1,
+			    sizeof *d->names);
+			if (d->names == NULL)
+				fatal("reallocarray");
+			d->names[d->count++] = xstrdup(name);
+			break;
+
+		case T_TXT:
+			/* concatenate the character-strings */
+			p = (const uint8_t *)rr.rr.other.rdata;
+			n = rr.rr.other.rdlen;
+			len = 0;
+			while (n) {
+				if (*p >= n || len + *p >= sizeof txt) {
+					len = sizeof txt;
+					break;
+				}
+				memcpy(txt + len, p + 1, *p);
+				len += *p;
+				n -= *p + 1;
+				p += *p + 1;
+			}
+			if (len == sizeof txt)
+				break;
+			txt[len] = '\0';
+			if (strncasecmp(txt, "v=spf1", 6) ||
+			    (txt[6] != '\0' && txt[6] != ' '))
+				break;
+			if (records++) {
+				d->status = SPF_DNS_INVALID;
+				break;
+			}
+			if ((d->record = spf_record_parse(txt)) == NULL)
+				d->status = SPF_DNS_INVALID;
+			break;
 		}
-		memmove(dst, rdata, len);
-		dst += len;
-		dstsz -= len;
+	}
 
-		rdata += len;
-		rdatalen -= len;
-		r += len;
+	if (found && d->status == SPF_DNS_VOID)
+		d->status = SPF_DNS_OK;
+	if (d->status == SPF_DNS_INVALID && d->record) {
+		spf_record_free(d->record);
+		d->record = NULL;
 	}
 
-	return r;
+	for (; !found && h.nscount; h.nscount--) {
+		if (unpack_rr(&pack, &rr) == -1)
+			break;
+		if (rr.rr_type == T_SOA)
+			ttl = rr.rr_ttl < rr.rr.soa.minimum ?
+			    rr.rr_ttl : rr.rr.soa.minimum;
+	}
+
+	if (ttl < SPF_TTL_MIN)
+		ttl = SPF_TTL_MIN;
+	if (ttl > SPF_TTL_MAX)
+		ttl = SPF_TTL_MAX;
+	d->expire = clock_cached() + ttl;
 }
 
-int
-parse_target(char *record, struct target *tgt)
+static void
+spf_dns_uncache(struct spf_dns *d)
 {
-	const char *err;
-	char *m4, *m6;
-
-	m4 = record;
-	strsep(&m4, "/");
-	if (m4 == NULL)
-		return 0;
-
-	m6 = m4;
-	strsep(&m6, "/");
-
-	if (*m4) {
-		tgt->cidr4 = strtonum(m4, 0, 32, &err);
-		if (err)
-			return tgt->cidr4 = -1;
-	}
-
-	if (m6 == NULL)
-		return 0;
+	if (!d->cached)
+		return;
+	hdict_xpop(&spf_dns_cache, d->key);
+	if (!d->pending)
+		TAILQ_REMOVE(&spf_dns_lru, d, entry);
+	d->cached = 0;
+	if (d->refs == 0 && !d->pending)
+		spf_dns_free(d);
+}
 
-	tgt->cidr6 = strtonum(m6, 0, 128, &err);
-	if (err)
-		return tgt->cidr6 = -1;
+void
+spf_dns_unref(struct spf_dns *d)
+{
+	if (--d->refs == 0 && !d->cached)
+		spf_dns_free(d);
+}
 
-	return 0;
+static void
+spf_dns_free(struct spf_dns *d)
+{
+	size_t	i;
+
+	if (d->names)
+		for (i = 0; i < d->count; i++)
+			free(d->names[i]);
+	free(d->names);
+	free(d->addrs);
+	if (d->record)
+		spf_record_free(d->record);
+	free(d->key);
+	free(d);
 }
@@ -0,0 +1,130 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SPFWALK_H
+#define SPFWALK_H
+
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <arpa/nameser.h>
+
+#define	SPF_MAX_LOOKUPS		10
+#define	SPF_MAX_VOID		2
+#define	SPF_MAX_NAMES		10
+#define	SPF_MAX_DEPTH		(SPF_MAX_LOOKUPS + 1)
+
+enum spf_mech {
+	SPF_ALL,
+	SPF_INCLUDE,
+	SPF_A,
+	SPF_MX,
+	SPF_PTR,
+	SPF_IP4,
+	SPF_IP6,
+	SPF_EXISTS,
+};
+
+struct spf_term {
+	enum spf_mech		 mech;
+	int			 result;
+	char			*spec;
+	int			 cidr4;
+	int			 cidr6;
+	struct sockaddr_storage	 net;
+};
+
+struct spf_record {
+	size_t			 nterms;
+	struct spf_term		*terms;
+	char			*redirect;
+};
+
+enum spf_dns_status {
+	SPF_DNS_OK,
+	SPF_DNS_VOID,
+	SPF_DNS_ERROR,
+	SPF_DNS_INVALID,
+};
+
+struct spf_walk;
+
+struct spf_wait {
+	TAILQ_ENTRY(spf_wait)	 entry;
+	struct spf_walk		*w;
+};
+
+/* a cached answer, shared by the walks that need it */
+struct spf_dns {
+	TAILQ_ENTRY(spf_dns)	 entry;
+	TAILQ_HEAD(, spf_wait)	 waiters;
+	char			*key;
+	int			 type;
+	int			 pending;
+	int			 cached;
+	int			 refs;
+	time_t			 expire;
+	enum spf_dns_status	 status;
+	size_t			 count;
+	struct sockaddr_storage	*addrs;
+	char			**names;
+	struct spf_record	*record;
+};
+
+struct spf_frame {
+	struct spf_dns		*txt;
+	char			 domain[MAXDNAME];
+	size_t			 idx;
+	int			 counted;
+};
+
+/*
+ * A walk of the policy of a domain.  The walker enters the include and
+ * redirect records, and hands every other term to term(), which returns
+ * 0 to go on, the result plus one to end the record, or -1 if it waits
+ * for answers.  Domain-specs with macros are expanded by expand(), or
+ * the terms holding them are skipped if there is none.
+ */
+struct spf_walk {
+	int		       (*term)(struct spf_walk *, struct spf_frame *,
+			    struct spf_term *);
+	int		       (*expand)(struct spf_walk *, struct spf_frame *,
+			    const char *, char *, size_t);
+	void		       (*done)(struct spf_walk *, int);
+	void			*arg;
+	int			 family;	/* AF_UNSPEC for both */
+	int			 max_lookups;
+	int			 max_voids;
+
+	char			 domain[MAXDNAME];
+	int			 lookups;
+	int			 voids;
+	int			 waiting;
+	size_t			 queries;
+	size_t			 hits;
+	time_t			 expire;
+	size_t			 depth;
+	struct spf_frame	 frames[SPF_MAX_DEPTH];
+};
+
+void	spf_walk_start(struct spf_walk *, const char *);
+int	spf_walk_target(struct spf_walk *, struct spf_frame *, const char *,
+    char *, size_t);
+int	spf_walk_void(struct spf_walk *);
+struct spf_dns *spf_dns_get(struct spf_walk *, int, const char *);
+void	spf_dns_unref(struct spf_dns *);
+
+#endif
@@ -38,13 +38,42 @@
 #include <time.h>
 #include <unistd.h>
 
-#include <openssl/sha.h>
-#include <string.h>
+#ifdef HAVE_EVP_MAC_FETCH
+#include <openssl/core_names.h>
+#endif
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 #include "smtpd.h"
+#include "log.h"
 
 static uint8_t	base32[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
 
+/*
+ * The key schedule of every secret is computed once.  Addresses are
+ * signed with an HMAC of the primary secret; the plain SHA1 of the
+ * secret and the value, used by older versions, is still accepted.
+ *
+ * With EVP_MAC, initializing a context again without a key starts
+ * over from its key schedule.  HMAC_CTX, deprecated there, is only
+ * used where EVP_MAC is missing.
+ */
+struct srs_key {
+#ifdef HAVE_EVP_MAC_FETCH
+	EVP_MAC_CTX	*hmac;
+#else
+	HMAC_CTX	*hmac;
+#endif
+	EVP_MD_CTX	*sha;
+};
+
+static struct srs_key	 srs_keys[1 + SRS_BACKUP_MAX];
+static size_t		 srs_nkeys;
+static EVP_MD_CTX	*srs_md;
+#ifndef HAVE_EVP_MAC_FETCH
+static HMAC_CTX		*srs_hmac;
+#endif
+
 static int
 minrange(uint16_t tref, uint16_t t2, int drift, int mod)
 {
@@ -87,292 +116,370 @@ timestamp_check_range(uint16_t tref, uint16_t t2)
 	return 1;
 }
 
-static const unsigned char *
-srs_hash(const char *key, const char *value)
+static void
+srs_init(void)
+{
+#ifdef HAVE_EVP_MAC_FETCH
+	OSSL_PARAM	 params[2];
+	EVP_MAC		*mac;
+#endif
+	const char	*secret;
+	size_t		 i;
+
+	if (srs_nkeys)
+		return;
+
+	if ((srs_md = EVP_MD_CTX_new()) == NULL)
+		fatal("srs_init: EVP_MD_CTX_new");
+#ifdef HAVE_EVP_MAC_FETCH
+	if ((mac = EVP_MAC_fetch(NULL, "HMAC", NULL)) == NULL)
+		fatalx("srs_init: EVP_MAC_fetch");
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+	    "SHA1", 0);
+	params[1] = OSSL_PARAM_construct_end();
+#else
+	if ((srs_hmac = HMAC_CTX_new()) == NULL)
+		fatal("srs_init: HMAC_CTX_new");
+#endif
+
+	for (i = 0; i < 1 + SRS_BACKUP_MAX; i++) {
+		secret = i ? env->sc_srs_key_backup[i - 1] : env->sc_srs_key;
+		if (secret == NULL)
+			break;
+#ifdef HAVE_EVP_MAC_FETCH
+		if ((srs_keys[i].hmac = EVP_MAC_CTX_new(mac)) == NULL ||
+		    !EVP_MAC_init(srs_keys[i].hmac,
+		    (const unsigned char *)secret, strlen(secret), params))
+			fatalx("srs_init: EVP_MAC_init");
+#else
+		if ((srs_keys[i].hmac = HMAC_CTX_new()) == NULL ||
+		    !HMAC_Init_ex(srs_keys[i].hmac, secret, strlen(secret),
+		    EVP_sha1(), NULL))
+			fatalx("srs_init: HMAC_Init_ex");
+#endif
+		if ((srs_keys[i].sha = EVP_MD_CTX_new()) == NULL ||
+		    !EVP_DigestInit_ex(srs_keys[i].sha, EVP_sha1(), NULL) ||
+		    !EVP_DigestUpdate(srs_keys[i].sha, secret, strlen(secret)))
+			fatalx("srs_init: EVP_DigestInit_ex");
+	}
+	srs_nkeys = i;
+#ifdef HAVE_EVP_MAC_FETCH
+	EVP_MAC_free(mac);
+#endif
+}
+
+/* compute the HHHH checksum of value into hash */
+static int
+srs_hash(const struct srs_key *key, int legacy, const char *value, char *hash)
+{
+	unsigned char	 md[EVP_MAX_MD_SIZE];
+	char		 b64[EVP_MAX_MD_SIZE * 2];
+	unsigned int	 mdlen;
+#ifdef HAVE_EVP_MAC_FETCH
+	size_t		 maclen;
+#endif
+
+	if (legacy) {
+		if (!EVP_MD_CTX_copy_ex(srs_md, key->sha) ||
+		    !EVP_DigestUpdate(srs_md, value, strlen(value)) ||
+		    !EVP_DigestFinal_ex(srs_md, md, &mdlen))
+			return 0;
+	}
+#ifdef HAVE_EVP_MAC_FETCH
+	else {
+		if (!EVP_MAC_init(key->hmac, NULL, 0, NULL) ||
+		    !EVP_MAC_update(key->hmac, (const unsigned char *)value,
+		    strlen(value)) ||
+		    !EVP_MAC_final(key->hmac, md, &maclen, sizeof md))
+			return 0;
+		mdlen = maclen;
+	}
+#else
+	else if (!HMAC_CTX_copy(srs_hmac, key->hmac) ||
+	    !HMAC_Update(srs_hmac, (const unsigned char *)value,
+	    strlen(value)) ||
+	    !HMAC_Final(srs_hmac, md, &mdlen))
+		return 0;
+#endif
+
+	if (base64_encode_rfc3548(md, mdlen, b64, sizeof b64) == -1)
+		return 0;
+	memcpy(hash, b64, 4);
+	hash[4] = '\0';
+	return 1;
+}
+
+/* check the HHHH checksum against all the secrets */
+static int
+srs_check(const char *hash, const char *value)
+{
+	char	md[5];
+	size_t	i;
+	int	legacy;
+
+	for (i = 0; i < srs_nkeys; i++)
+		for (legacy = 0; legacy <= 1; legacy++)
+			if (srs_hash(&srs_keys[i], legacy, value, md) &&
+			    strncmp(md, hash, 4) == 0)
+				return 1;
+	return 0;
+}
+
+static int
+srs_timestamp_decode(const char *p, uint16_t *ts)
+{
+	uint8_t	*idx;
+
+	if ((idx = strchr(base32, p[0])) == NULL)
+		return 0;
+	*ts = ((idx - base32) << 5);
+
+	if ((idx = strchr(base32, p[1])) == NULL)
+		return 0;
+	*ts |= (idx - base32);
+	return 1;
+}
+
+static int
+srs_timestamp_valid(uint16_t srs_timestamp)
 {
-	SHA_CTX	c;
-	static unsigned char md[SHA_DIGEST_LENGTH];
-
-	SHA1_Init(&c);
-	SHA1_Update(&c, key, strlen(key));
-	SHA1_Update(&c, value, strlen(value));
-	SHA1_Final(md, &c);
-	return md;
+	uint16_t timestamp;
+
+	/* compute current 10 bits timestamp */
+	timestamp = (time(NULL) / (60 * 60 * 24)) % 1024;
+
+	/* check that SRS timestamp isn't too far from current */
+	if (timestamp != srs_timestamp)
+		if (! timestamp_check_range(timestamp, srs_timestamp))
+			return 0;
+	return 1;
 }
 
-static const char *
-srs0_encode(const char *sender, const char *rcpt_domain)
+static int
+srs0_encode(const char *sender, const char *rcpt_domain, char *dest,
+    size_t destsz)
 {
-	static char dest[SMTPD_MAXMAILADDRSIZE];
 	char tmp[SMTPD_MAXMAILADDRSIZE];
-	char md[SHA_DIGEST_LENGTH*4+1];
-	struct mailaddr maddr;
+	char md[5];
+	const char *at;
 	uint16_t timestamp;
 	int ret;
 
 	/* compute 10 bits timestamp according to spec */
 	timestamp = (time(NULL) / (60 * 60 * 24)) % 1024;
 
-	/* parse sender into user and domain */
-	if (! text_to_mailaddr(&maddr, sender))
-		return sender;
+	if ((at = strrchr(sender, '@')) == NULL)
+		return 0;
 
 	/* TT=<orig_domainpart>=<orig_userpart>@<new_domainpart> */
-	ret = snprintf(tmp, sizeof tmp, "%c%c=%s=%s@%s",
+	ret = snprintf(tmp, sizeof tmp, "%c%c=%s=%.*s@%s",
 	    base32[(timestamp>>5) & 0x1F],
 	    base32[timestamp & 0x1F],
-	    maddr.domain, maddr.user, rcpt_domain);
+	    at + 1, (int)(at - sender), sender, rcpt_domain);
 	if (ret == -1 || ret >= (int)sizeof tmp)
-		return sender;
+		return 0;
 
 	/* compute HHHH */
-	base64_encode_rfc3548(srs_hash(env->sc_srs_key, tmp), SHA_DIGEST_LENGTH,
-	    md, sizeof md);
+	if (!srs_hash(&srs_keys[0], 0, tmp, md))
+		return 0;
 
 	/* prepend SRS0=HHHH= prefix */
-	ret = snprintf(dest, sizeof dest, "SRS0=%c%c%c%c=%s",
-	    md[0], md[1], md[2], md[3], tmp);
-	if (ret == -1 || ret >= (int)sizeof dest)
-		return sender;
+	ret = snprintf(dest, destsz, "SRS0=%s=%s", md, tmp);
+	if (ret == -1 || ret >= (int)destsz)
+		return 0;
 
-	return dest;
+	return 1;
 }
 
-static const char *
-srs1_encode_srs0(const char *sender, const char *rcpt_domain)
+static int
+srs1_encode_srs0(const char *sender, const char *rcpt_domain, char *dest,
+    size_t destsz)
 {
-	static char dest[SMTPD_MAXMAILADDRSIZE];
 	char tmp[SMTPD_MAXMAILADDRSIZE];
-	char md[SHA_DIGEST_LENGTH*4+1];
-	struct mailaddr maddr;
+	char md[5];
+	const char *at;
 	int ret;
 
-	/* parse sender into user and domain */
-	if (! text_to_mailaddr(&maddr, sender))
-		return sender;
+	if ((at = strrchr(sender, '@')) == NULL)
+		return 0;
 
 	/* <last_domainpart>==<SRS0_userpart>@<new_domainpart> */
-	ret = snprintf(tmp, sizeof tmp, "%s==%s@%s",
-	    maddr.domain, maddr.user, rcpt_domain);
+	ret = snprintf(tmp, sizeof tmp, "%s==%.*s@%s",
+	    at + 1, (int)(at - sender), sender, rcpt_domain);
 	if (ret == -1 || ret >= (int)sizeof tmp)
-		return sender;
+		return 0;
 
 	/* compute HHHH */
-	base64_encode_rfc3548(srs_hash(env->sc_srs_key, tmp), SHA_DIGEST_LENGTH,
-		md, sizeof md);
+	if (!srs_hash(&srs_keys[0], 0, tmp, md))
+		return 0;
 
 	/* prepend SRS1=HHHH= prefix */
-	ret = snprintf(dest, sizeof dest, "SRS1=%c%c%c%c=%s",
-	    md[0], md[1], md[2], md[3], tmp);
-	if (ret == -1 || ret >= (int)sizeof dest)
-		return sender;
+	ret = snprintf(dest, destsz, "SRS1=%s=%s", md, tmp);
+	if (ret == -1 || ret >= (int)destsz)
+		return 0;
 
-	return dest;
+	return 1;
 }
 
-static const char *
-srs1_encode_srs1(const char *sender, const char *rcpt_domain)
+static int
+srs1_encode_srs1(const char *sender, const char *rcpt_domain, char *dest,
+    size_t destsz)
 {
-	static char dest[SMTPD_MAXMAILADDRSIZE];
 	char tmp[SMTPD_MAXMAILADDRSIZE];
-	char md[SHA_DIGEST_LENGTH*4+1];
-	struct mailaddr maddr;
+	char md[5];
+	const char *at;
 	int ret;
 
-	/* parse sender into user and domain */
-	if (! text_to_mailaddr(&maddr, sender))
-		return sender;
+	if ((at = strrchr(sender, '@')) == NULL)
+		return 0;
 
 	/* <SRS1_userpart>@<new_domainpart> */
-	ret = snprintf(tmp, sizeof tmp, "%s@%s", maddr.user, rcpt_domain);
+	ret = snprintf(tmp, sizeof tmp, "%.*s@%s",
+	    (int)(at - sender), sender, rcpt_domain);
 	if (ret == -1 || ret >= (int)sizeof tmp)
-		return sender;
+		return 0;
 
 	/* sanity check: there's at least room for a checksum
 	 * with allowed delimiter =, + or -
 	 */
 	if (strlen(tmp) < 5)
-		return sender;
+		return 0;
 	if (tmp[4] != '=' && tmp[4] != '+' && tmp[4] != '-')
-		return sender;
+		return 0;
 
 	/* compute HHHH */
-	base64_encode_rfc3548(srs_hash(env->sc_srs_key, tmp + 5), SHA_DIGEST_LENGTH,
-		md, sizeof md);
+	if (!srs_hash(&srs_keys[0], 0, tmp + 5, md))
+		return 0;
 
 	/* prepend SRS1=HHHH= prefix skipping previous hops' HHHH */
-	ret = snprintf(dest, sizeof dest, "SRS1=%c%c%c%c=%s",
-	    md[0], md[1], md[2], md[3], tmp + 5);
-	if (ret == -1 || ret >= (int)sizeof dest)
-		return sender;
+	ret = snprintf(dest, destsz, "SRS1=%s=%s", md, tmp + 5);
+	if (ret == -1 || ret >= (int)destsz)
+		return 0;
 
-	return dest;
+	return 1;
 }
 
-const char *
-srs_encode(const char *sender, const char *rcpt_domain)
+/*
+ * Rewrite sender for a message forwarded from rcpt_domain into dest.
+ * Returns 0 if the sender is to be left as is.
+ */
+int
+srs_encode(const char *sender, const char *rcpt_domain, char *dest,
+    size_t destsz)
 {
+	srs_init();
+
 	if (strncasecmp(sender, "SRS0=", 5) == 0)
-		return srs1_encode_srs0(sender+5, rcpt_domain);
+		return srs1_encode_srs0(sender+5, rcpt_domain, dest, destsz);
 	if (strncasecmp(sender, "SRS1=", 5) == 0)
-		return srs1_encode_srs1(sender+5, rcpt_domain);
-	return srs0_encode(sender, rcpt_domain);
+		return srs1_encode_srs1(sender+5, rcpt_domain, dest, destsz);
+	return srs0_encode(sender, rcpt_domain, dest, destsz);
 }
 
-static const char *
-srs0_decode(const char *rcpt)
+static int
+srs0_decode(const char *rcpt, char *dest, size_t destsz)
 {
-	static char dest[SMTPD_MAXMAILADDRSIZE];
-	char md[SHA_DIGEST_LENGTH*4+1];
-	struct mailaddr maddr;
-	char *p;
-	uint8_t *idx;
+	const char *at, *p;
+	uint16_t srs_timestamp;
 	int ret;
-	uint16_t timestamp, srs_timestamp;
 
 	/* sanity check: we have room for a checksum and delimiter */
 	if (strlen(rcpt) < 5)
-		return NULL;
-
-	/* compute checksum */
-	base64_encode_rfc3548(srs_hash(env->sc_srs_key, rcpt+5), SHA_DIGEST_LENGTH,
-	    md, sizeof md);
+		return 0;
 
 	/* compare prefix checksum with computed checksum */
-	if (strncmp(md, rcpt, 4) != 0) {
-		if (env->sc_srs_key_backup == NULL)
-			return NULL;
-		base64_encode_rfc3548(srs_hash(env->sc_srs_key_backup, rcpt+5),
-		    SHA_DIGEST_LENGTH, md, sizeof md);
-		if (strncmp(md, rcpt, 4) != 0)
-			return NULL;
-	}
+	if (!srs_check(rcpt, rcpt + 5))
+		return 0;
 	rcpt += 5;
 
 	/* sanity check: we have room for a timestamp and delimiter */
 	if (strlen(rcpt) < 3)
-		return NULL;
+		return 0;
 
 	/* decode timestamp */
-	if ((idx = strchr(base32, rcpt[0])) == NULL)
-		return NULL;
-	srs_timestamp = ((idx - base32) << 5);
-
-	if ((idx = strchr(base32, rcpt[1])) == NULL)
-		return NULL;
-	srs_timestamp |= (idx - base32);
+	if (!srs_timestamp_decode(rcpt, &srs_timestamp))
+		return 0;
 	rcpt += 3;
 
-	/* compute current 10 bits timestamp */
-	timestamp = (time(NULL) / (60 * 60 * 24)) % 1024;
-
-	/* check that SRS timestamp isn't too far from current */
-	if (timestamp != srs_timestamp)
-		if (! timestamp_check_range(timestamp, srs_timestamp))
-			return NULL;
-
-	if (! text_to_mailaddr(&maddr, rcpt))
-		return NULL;
+	if (!srs_timestamp_valid(srs_timestamp))
+		return 0;
 
 	/* sanity check: we have at least one SRS separator */
-	if ((p = strchr(maddr.user, '=')) == NULL)
-		return NULL;
-	*p++ = '\0';
+	if ((at = strrchr(rcpt, '@')) == NULL ||
+	    (p = memchr(rcpt, '=', at - rcpt)) == NULL)
+		return 0;
 
-	/* maddr.user holds "domain\0user", with p pointing at user */
-	ret = snprintf(dest, sizeof dest, "%s@%s", p, maddr.user);
-	if (ret == -1 || ret >= (int)sizeof dest)
-		return NULL;
+	/* rcpt holds "domain=user@...", with p pointing at the separator */
+	ret = snprintf(dest, destsz, "%.*s@%.*s", (int)(at - p - 1), p + 1,
+	    (int)(p - rcpt), rcpt);
+	if (ret == -1 || ret >= (int)destsz)
+		return 0;
 
-	return dest;
+	return 1;
 }
 
-static const char *
-srs1_decode(const char *rcpt)
+static int
+srs1_decode(const char *rcpt, char *dest, size_t destsz)
 {
-	static char dest[SMTPD_MAXMAILADDRSIZE];
-	char md[SHA_DIGEST_LENGTH*4+1];
-	struct mailaddr maddr;
-	char *p;
-	uint8_t *idx;
+	const char *at, *p;
+	uint16_t srs_timestamp;
 	int ret;
-	uint16_t timestamp, srs_timestamp;
 
 	/* sanity check: we have room for a checksum and delimiter */
 	if (strlen(rcpt) < 5)
-		return NULL;
-
-	/* compute checksum */
-	base64_encode_rfc3548(srs_hash(env->sc_srs_key, rcpt+5), SHA_DIGEST_LENGTH,
-	    md, sizeof md);
+		return 0;
 
 	/* compare prefix checksum with computed checksum */
-	if (strncmp(md, rcpt, 4) != 0) {
-		if (env->sc_srs_key_backup == NULL)
-			return NULL;
-		base64_encode_rfc3548(srs_hash(env->sc_srs_key_backup, rcpt+5),
-		    SHA_DIGEST_LENGTH, md, sizeof md);
-		if (strncmp(md, rcpt, 4) != 0)
-			return NULL;
-	}
+	if (!srs_check(rcpt, rcpt + 5))
+		return 0;
 	rcpt += 5;
 
-	if (! text_to_mailaddr(&maddr, rcpt))
-		return NULL;
-
 	/* sanity check: we have at least one SRS separator */
-	if ((p = strchr(maddr.user, '=')) == NULL)
-		return NULL;
-	*p++ = '\0';
-
-	/* maddr.user holds "domain\0user", with p pointing at user */
-	ret = snprintf(dest, sizeof dest, "SRS0%s@%s", p, maddr.user);
-	if (ret == -1 || ret >= (int)sizeof dest)
-		return NULL;
+	if ((at = strrchr(rcpt, '@')) == NULL ||
+	    (p = memchr(rcpt, '=', at - rcpt)) == NULL)
+		return 0;
 
+	/* rcpt holds "domain==user@...", with p pointing at the separator */
+	ret = snprintf(dest, destsz, "SRS0%.*s@%.*s", (int)(at - p - 1), p + 1,
+	    (int)(p - rcpt), rcpt);
+	if (ret == -1 || ret >= (int)destsz)
+		return 0;
 
 	/* we're ready to return decoded address, but let's check if
 	 * SRS0 timestamp is valid.
 	 */
 
 	/* first, get rid of SRS0 checksum (=HHHH=), we can't check it */
-	if (strlen(p) < 6)
-		return NULL;
+	p += 1;
+	if (at - p < 6)
+		return 0;
 	p += 6;
 
 	/* we should be pointing to a timestamp, check that we're indeed */
-	if (strlen(p) < 3)
-		return NULL;
+	if (at - p < 3)
+		return 0;
 	if (p[2] != '=' && p[2] != '+' && p[2] != '-')
-		return NULL;
-	p[2] = '\0';
-
-	if ((idx = strchr(base32, p[0])) == NULL)
-		return NULL;
-	srs_timestamp = ((idx - base32) << 5);
-
-	if ((idx = strchr(base32, p[1])) == NULL)
-		return NULL;
-	srs_timestamp |= (idx - base32);
-
-	/* compute current 10 bits timestamp */
-	timestamp = (time(NULL) / (60 * 60 * 24)) % 1024;
+		return 0;
 
-	/* check that SRS timestamp isn't too far from current */
-	if (timestamp != srs_timestamp)
-		if (! timestamp_check_range(timestamp, srs_timestamp))
-			return NULL;
+	if (!srs_timestamp_decode(p, &srs_timestamp))
+		return 0;
 
-	return dest;
+	return srs_timestamp_valid(srs_timestamp);
 }
 
-const char *
-srs_decode(const char *rcpt)
+/*
+ * Decode an SRS address into dest.  Returns 0 if it is not a valid SRS
+ * address for one of the secrets.
+ */
+int
+srs_decode(const char *rcpt, char *dest, size_t destsz)
 {
+	srs_init();
+
 	if (strncasecmp(rcpt, "SRS0=", 5) == 0)
-		return srs0_decode(rcpt + 5);
+		return srs0_decode(rcpt + 5, dest, destsz);
 	if (strncasecmp(rcpt, "SRS1=", 5) == 0)
-		return srs1_decode(rcpt + 5);
+		return srs1_decode(rcpt + 5, dest, destsz);
 
-	return NULL;
+	return 0;
 }
@@ -36,7 +36,7 @@
 #include "log.h"
 #include "ssl.h"
 
-static char *
+char *
 ssl_load_file(const char *name, off_t *len, mode_t perm)
 {
 	struct stat	 st;
@@ -207,6 +207,44 @@ ssl_load_keyfile(struct pki *p, const char *pathname, const char *pkiname)
 	return 1;
 }
 
+/*
+ * DKIM keys are only ever used by the CA process, but the others need
+ * to know the type and size of the signatures.
+ */
+int
+ssl_load_dkimkey(struct dkim *d, const char *pathname)
+{
+	EVP_PKEY	*pkey;
+	BIO		*bio;
+	char		 pass[1024];
+
+	d->dkim_key = ssl_load_key(pathname, &d->dkim_key_len, pass, 0740,
+	    d->dkim_domain);
+	if (d->dkim_key == NULL)
+		return 0;
+
+	if ((bio = BIO_new_mem_buf(d->dkim_key, d->dkim_key_len)) == NULL)
+		return 0;
+	pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (pkey == NULL)
+		return 0;
+
+	d->dkim_type = EVP_PKEY_id(pkey);
+	d->dkim_siglen = EVP_PKEY_size(pkey);
+	EVP_PKEY_free(pkey);
+
+	switch (d->dkim_type) {
+	case EVP_PKEY_RSA:
+#ifdef EVP_PKEY_ED25519
+	case EVP_PKEY_ED25519:
+#endif
+		return 1;
+	}
+	log_warnx("warn: %s: unsupported DKIM key type", pathname);
+	return 0;
+}
+
 int
 ssl_load_cafile(struct ca *c, const char *pathname)
 {
@@ -27,6 +27,9 @@ struct pki {
 	off_t			 pki_key_len;
 
 	int			 pki_dhe;
+
+	/* certificate of another key type, picked per handshake */
+	struct pki		*pki_alt;
 };
 
 struct ca {
@@ -37,10 +40,24 @@ struct ca {
 	off_t			 ca_cert_len;
 };
 
+struct dkim {
+	char			 dkim_domain[HOST_NAME_MAX+1];
+	char			 dkim_selector[HOST_NAME_MAX+1];
+
+	char			*dkim_key_file;
+	char			*dkim_key;
+	off_t			 dkim_key_len;
+
+	int			 dkim_type;	/* EVP_PKEY_RSA, ... */
+	size_t			 dkim_siglen;
+};
+
 
 /* ssl.c */
 void ssl_error(const char *);
+char *ssl_load_file(const char *, off_t *, mode_t);
 int ssl_load_certificate(struct pki *, const char *);
 int ssl_load_keyfile(struct pki *, const char *, const char *);
 int ssl_load_cafile(struct ca *, const char *);
+int ssl_load_dkimkey(struct dkim *, const char *);
 char *ssl_pubkey_hash(const char *, off_t);
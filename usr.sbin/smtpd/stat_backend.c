@@ -19,6 +19,7 @@
 #include "includes.h"
 
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/queue.h>
 #include <sys/tree.h>
@@ -28,12 +29,34 @@
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 
 #include "log.h"
 #include "smtpd.h"
 
 extern struct stat_backend	stat_backend_ramstat;
 
+/*
+ * Counters are updated for every event on hot paths: rather than sending
+ * an imsg to control for each update, they are summed up locally and the
+ * pending updates are sent once a second, packed in as few imsg as
+ * possible.
+ */
+#define	STAT_FLUSH_INTERVAL	1	/* seconds */
+
+struct stat_pending {
+	size_t	increment;
+	size_t	decrement;
+};
+
+static void stat_update(const char *, size_t, int);
+static void stat_flush(int, short, void *);
+static void stat_flush_type(uint32_t);
+
+static struct dict	pending;
+static struct event	ev_flush;
+static int		init;
+
 struct stat_backend *
 stat_backend_lookup(const char *name)
 {
@@ -43,33 +66,19 @@ stat_backend_lookup(const char *name)
 void
 stat_increment(const char *key, size_t count)
 {
-	struct stat_value	*value;
-
 	if (count == 0)
 		return;
 
-	value = stat_counter(count);
-
-	m_create(p_control, IMSG_STAT_INCREMENT, 0, 0, -1);
-	m_add_string(p_control, key);
-	m_add_data(p_control, value, sizeof(*value));
-	m_close(p_control);
+	stat_update(key, count, 1);
 }
 
 void
 stat_decrement(const char *key, size_t count)
 {
-	struct stat_value	*value;
-
 	if (count == 0)
 		return;
 
-	value = stat_counter(count);
-
-	m_create(p_control, IMSG_STAT_DECREMENT, 0, 0, -1);
-	m_add_string(p_control, key);
-	m_add_data(p_control, value, sizeof(*value));
-	m_close(p_control);
+	stat_update(key, count, 0);
 }
 
 void
@@ -81,6 +90,185 @@ stat_set(const char *key, const struct stat_value *value)
 	m_close(p_control);
 }
 
+static void
+stat_update(const char *key, size_t count, int increment)
+{
+	struct stat_pending	*sp;
+	struct timeval		 tv;
+
+	if (!init) {
+		dict_init(&pending);
+		evtimer_set(&ev_flush, stat_flush, NULL);
+		init = 1;
+	}
+
+	if ((sp = dict_get(&pending, key)) == NULL) {
+		sp = xcalloc(1, sizeof *sp);
+		dict_set(&pending, key, sp);
+	}
+	if (increment)
+		sp->increment += count;
+	else
+		sp->decrement += count;
+
+	if (!evtimer_pending(&ev_flush, NULL)) {
+		tv.tv_sec = STAT_FLUSH_INTERVAL;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_flush, &tv);
+	}
+}
+
+static void
+stat_flush(int fd, short event, void *arg)
+{
+	stat_flush_type(IMSG_STAT_INCREMENT);
+	stat_flush_type(IMSG_STAT_DECREMENT);
+}
+
+static void
+stat_flush_type(uint32_t type)
+{
+	struct stat_pending	*sp;
+	struct stat_value	*value;
+	const char		*key;
+	void			*iter;
+	size_t			*count, len, n;
+
+	n = 0;
+	iter = NULL;
+	while (dict_iter(&pending, &iter, &key, (void **)&sp)) {
+		if (type == IMSG_STAT_INCREMENT)
+			count = &sp->increment;
+		else
+			count = &sp->decrement;
+		if (*count == 0)
+			continue;
+
+		len = IMSG_HEADER_SIZE + strlen(key) + 2 + sizeof(size_t) +
+		    sizeof(*value);
+		if (n && p_control->m_pos + len > MAX_IMSGSIZE) {
+			m_close(p_control);
+			n = 0;
+		}
+		if (n++ == 0)
+			m_create(p_control, type, 0, 0, -1);
+
+		value = stat_counter(*count);
+		m_add_string(p_control, key);
+		m_add_data(p_control, value, sizeof(*value));
+		*count = 0;
+	}
+	if (n)
+		m_close(p_control);
+}
+
+/*
+ * Account for the time elapsed since t0 in a latency histogram: one
+ * counter per power of two milliseconds, named after the upper bound
+ * of the bucket so that they sort in order in "show stats".
+ */
+#define	STAT_LATENCY_MAX	65536	/* ms */
+
+void
+stat_latency(const char *key, const struct timespec *t0)
+{
+	struct timespec	t1, dt;
+	char		buf[STAT_KEY_SIZE];
+	long long	ms, bound;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	timespecsub(&t1, t0, &dt);
+	ms = dt.tv_sec * 1000LL + (dt.tv_nsec + 999999) / 1000000;
+
+	for (bound = 1; bound < ms && bound <= STAT_LATENCY_MAX; bound *= 2)
+		;
+	if (bound > STAT_LATENCY_MAX)
+		(void)snprintf(buf, sizeof buf, "%s.le.inf", key);
+	else
+		(void)snprintf(buf, sizeof buf, "%s.le.%05lldms", key, bound);
+
+	stat_increment(buf, 1);
+}
+
+/*
+ * Sample the cpu time used by this process and report it along with the
+ * share of one cpu it used over the last interval, as "cpu.<proc>.time"
+ * and "cpu.<proc>.usage".  Control keeps them for "show status".
+ */
+#define	STAT_CPU_INTERVAL	5	/* seconds */
+
+static void stat_cpu(int, short, void *);
+
+static void		(*cpu_set)(const char *, const struct stat_value *);
+static struct event	  ev_cpu;
+static struct timeval	  cpu_last;
+static struct timespec	  cpu_when;
+static int		  cpu_sampled;
+
+void
+stat_cpu_start(void (*set)(const char *, const struct stat_value *))
+{
+	cpu_set = set ? set : stat_set;
+	evtimer_set(&ev_cpu, stat_cpu, NULL);
+	stat_cpu(-1, 0, NULL);
+}
+
+static void
+stat_cpu(int fd, short event, void *arg)
+{
+	struct rusage	 ru;
+	struct timeval	 cpu, dcpu, tv;
+	struct timespec	 now, dt;
+	char		 key[STAT_KEY_SIZE];
+	const char	*name;
+	long long	 used, elapsed;
+	size_t		 usage = 0;
+	int		 shard = -1;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		fatal("stat_cpu: getrusage");
+	timeradd(&ru.ru_utime, &ru.ru_stime, &cpu);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (cpu_sampled) {
+		timersub(&cpu, &cpu_last, &dcpu);
+		timespecsub(&now, &cpu_when, &dt);
+		used = dcpu.tv_sec * 1000000LL + dcpu.tv_usec;
+		elapsed = dt.tv_sec * 1000000LL + dt.tv_nsec / 1000;
+		if (elapsed > 0)
+			usage = (used * 100 + elapsed / 2) / elapsed;
+	}
+	cpu_last = cpu;
+	cpu_when = now;
+	cpu_sampled = 1;
+
+	name = proc_name(smtpd_process);
+	if (smtpd_process == PROC_SCHEDULER && env->sc_scheduler_shards > 1)
+		shard = env->sc_scheduler_shard;
+	else if (smtpd_process == PROC_TLS)
+		shard = env->sc_tls_worker;
+	else if (smtpd_process == PROC_MTA)
+		shard = env->sc_mta_worker;
+	else if (smtpd_process == PROC_SMTP)
+		shard = env->sc_smtp_worker;
+
+	if (shard == -1)
+		(void)snprintf(key, sizeof key, "cpu.%s.time", name);
+	else
+		(void)snprintf(key, sizeof key, "cpu.%s.%d.time", name, shard);
+	cpu_set(key, stat_timeval(&cpu));
+
+	if (shard == -1)
+		(void)snprintf(key, sizeof key, "cpu.%s.usage", name);
+	else
+		(void)snprintf(key, sizeof key, "cpu.%s.%d.usage", name, shard);
+	cpu_set(key, stat_counter(usage));
+
+	tv.tv_sec = STAT_CPU_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_cpu, &tv);
+}
+
 /* helpers */
 
 struct stat_value *
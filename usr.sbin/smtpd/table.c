@@ -32,6 +32,7 @@
 #include <regex.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "smtpd.h"
 #include "log.h"
@@ -39,6 +40,7 @@
 struct table_backend *table_backend_lookup(const char *);
 
 extern struct table_backend table_backend_static;
+extern struct table_backend table_backend_compiled;
 #ifdef HAVE_DB_API
 extern struct table_backend table_backend_db;
 #endif
@@ -48,11 +50,41 @@ extern struct table_backend table_backend_proc;
 static int table_parse_lookup(enum table_service, const char *, const char *,
     union lookup *);
 static int parse_sockaddr(struct sockaddr *, int, const char *);
+static int table_cache_get(struct table *, const char *, int *, char **);
+static void table_cache_set(struct table *, const char *, int, const char *);
+static void table_cache_clear(struct table *);
 
 static unsigned int last_table_id = 0;
+static unsigned int table_gen = 0;
+static void (*table_notify)(void);
+static void (*table_update_notify)(struct table *, int);
+
+/*
+ * Lookup results are cached per table, in front of the backend, for the
+ * time configured with the ttl and negative-ttl table options.  Entries
+ * are evicted in LRU order when the cache is full, and the whole cache
+ * is dropped when the table is updated.  Proc tables are a blocking round
+ * trip to the backend, so they cache results for a second by default.
+ */
+#define	TABLE_CACHE_MAX		4096
+#define	TABLE_CACHE_PROC_TTL	1	/* seconds */
+
+struct table_cache_entry {
+	TAILQ_ENTRY(table_cache_entry)	 entry;
+	char				*key;
+	time_t				 expire;
+	int				 ret;
+	char				*value;
+};
+
+struct table_cache {
+	struct dict			 dict;
+	TAILQ_HEAD(table_cache_lru, table_cache_entry) lru;
+};
 
 static struct table_backend *backends[] = {
 	&table_backend_static,
+	&table_backend_compiled,
 #ifdef HAVE_DB_API
 	&table_backend_db,
 #endif
@@ -94,6 +126,7 @@ table_service_name(enum table_service s)
 	case K_STRING:		return "string";
 	case K_REGEX:		return "regex";
 	case K_AUTH:		return "auth";
+	case K_PKI:		return "pki";
 	}
 	return "???";
 }
@@ -129,6 +162,8 @@ table_service_from_name(const char *service)
 		return K_REGEX;
 	if (!strcmp(service, "auth"))
 		return K_AUTH;
+	if (!strcmp(service, "pki"))
+		return K_PKI;
 	return (-1);
 }
 
@@ -148,8 +183,8 @@ int
 table_lookup(struct table *table, enum table_service kind, const char *key,
     union lookup *lk)
 {
-	char lkey[1024], *buf = NULL;
-	int r;
+	char lkey[1024], ckey[LINE_MAX], *buf = NULL;
+	int r, cache = 0;
 
 	r = -1;
 	if (table->t_backend->lookup == NULL)
@@ -158,8 +193,23 @@ table_lookup(struct table *table, enum table_service kind, const char *key,
 		log_warnx("warn: lookup key too long: %s", key);
 		errno = EINVAL;
 	}
-	else
-		r = table->t_backend->lookup(table, kind, lkey, lk ? &buf : NULL);
+	else {
+		if (table->t_cache_ttl || table->t_cache_negttl)
+			cache = bsnprintf(ckey, sizeof ckey, "%s|%s|%s",
+			    lk ? "lookup" : "match", table_service_name(kind),
+			    lkey);
+		if (cache && table_cache_get(table, ckey, &r, lk ? &buf : NULL))
+			stat_increment("table.cache.hit", 1);
+		else {
+			r = table->t_backend->lookup(table, kind, lkey,
+			    lk ? &buf : NULL);
+			if (cache) {
+				stat_increment("table.cache.miss", 1);
+				if (r != -1)
+					table_cache_set(table, ckey, r, buf);
+			}
+		}
+	}
 
 	if (r == 1) {
 		log_trace(TRACE_LOOKUP, "lookup: %s \"%s\" as %s in table %s:%s -> %s%s%s",
@@ -260,6 +310,14 @@ table_create(struct smtpd *conf, const char *backend, const char *name,
 	t = xcalloc(1, sizeof(*t));
 	t->t_services = tb->services;
 	t->t_backend = tb;
+	if (tb == &table_backend_proc) {
+		t->t_cache_ttl = TABLE_CACHE_PROC_TTL;
+		t->t_cache_negttl = TABLE_CACHE_PROC_TTL;
+	}
+	else if (tb == &table_backend_getpwnam) {
+		t->t_cache_ttl = USERINFO_CACHE_TTL;
+		t->t_cache_negttl = USERINFO_CACHE_NEGTTL;
+	}
 
 	if (config) {
 		if (strlcpy(t->t_config, config, sizeof t->t_config)
@@ -289,6 +347,8 @@ void
 table_destroy(struct smtpd *conf, struct table *t)
 {
 	dict_xpop(conf->sc_tables_dict, t->t_name);
+	table_cache_clear(t);
+	free(t->t_cache);
 	free(t);
 }
 
@@ -375,6 +435,7 @@ table_open(struct table *t)
 void
 table_close(struct table *t)
 {
+	table_cache_clear(t);
 	if (t->t_backend->close)
 		t->t_backend->close(t);
 }
@@ -382,9 +443,70 @@ table_close(struct table *t)
 int
 table_update(struct table *t)
 {
-	if (t->t_backend->update == NULL)
+	int	r;
+
+	if (t->t_backend->update == NULL) {
+		/* nothing to reload, but forget what was cached */
+		table_changed(t);
 		return (1);
-	return (t->t_backend->update(t));
+	}
+	r = t->t_backend->update(t);
+	if (r == -1)
+		/* in progress, table_updated() tells the result */
+		return (-1);
+	table_changed(t);
+	return (r);
+}
+
+/*
+ * Called by the backends that load the new content in the background,
+ * once the update started by table_update() is over.
+ */
+void
+table_updated(struct table *t, int ok)
+{
+	if (ok)
+		table_changed(t);
+	if (table_update_notify)
+		table_update_notify(t, ok);
+}
+
+/*
+ * Called when the content of a table may have changed.
+ */
+void
+table_changed(struct table *t)
+{
+	table_cache_clear(t);
+	table_gen++;
+	if (table_notify)
+		table_notify();
+}
+
+/*
+ * Register a function to call whenever a table changed, for processes
+ * that must tell others to forget what they learnt from the tables.
+ */
+void
+table_on_change(void (*cb)(void))
+{
+	table_notify = cb;
+}
+
+/*
+ * Register a function to call when an update that table_update() left
+ * in progress is over, with its result.
+ */
+void
+table_on_update(void (*cb)(struct table *, int))
+{
+	table_update_notify = cb;
+}
+
+unsigned int
+table_generation(void)
+{
+	return (table_gen);
 }
 
 
@@ -428,11 +550,17 @@ table_netaddr_match(const char *s1, const char *s2)
 		return 0;
 	if (!text_to_netaddr(&n2, s2))
 		return 0;
-	if (n1.ss.ss_family != n2.ss.ss_family)
+	return table_netaddr_match_parsed(&n1, &n2);
+}
+
+int
+table_netaddr_match_parsed(struct netaddr *n1, struct netaddr *n2)
+{
+	if (n1->ss.ss_family != n2->ss.ss_family)
 		return 0;
-	if (SS_LEN(&n1.ss) != SS_LEN(&n2.ss))
+	if (SS_LEN(&n1->ss) != SS_LEN(&n2->ss))
 		return 0;
-	return table_match_mask(&n1.ss, &n2);
+	return table_match_mask(&n1->ss, n2);
 }
 
 static int
@@ -494,31 +622,146 @@ table_inet6_match(struct sockaddr_in6 *ss, struct netaddr *ssmask)
 	return (1);
 }
 
+/*
+ * Compiled patterns are cached by their source text, so that each lookup
+ * against a regex table or filter does not recompile them.  Patterns that
+ * fail to compile are cached too.  The cache is flushed when it grows too
+ * large, which only happens with large or frequently updated db tables.
+ */
+#define	REGEX_CACHE_MAX		4096
+
+struct regex_entry {
+	regex_t		preg;
+	int		valid;
+};
+
+static struct dict	regex_cache;
+static int		regex_cache_init;
+
+static void
+table_regex_flush(void)
+{
+	struct regex_entry	*re;
+
+	while (dict_poproot(&regex_cache, (void **)&re)) {
+		if (re->valid)
+			regfree(&re->preg);
+		free(re);
+	}
+}
+
 int
 table_regex_match(const char *string, const char *pattern)
 {
-	regex_t preg;
-	int	cflags = REG_EXTENDED|REG_NOSUB;
-	int ret;
+	struct regex_entry	*re;
+	const char		*p = pattern;
+	int			 cflags = REG_EXTENDED|REG_NOSUB;
 
-	if (strncmp(pattern, "(?i)", 4) == 0) {
-		cflags |= REG_ICASE;
-		pattern += 4;
+	if (!regex_cache_init) {
+		dict_init(&regex_cache);
+		regex_cache_init = 1;
 	}
 
-	if (regcomp(&preg, pattern, cflags) != 0)
+	if ((re = dict_get(&regex_cache, pattern)) == NULL) {
+		if (dict_count(&regex_cache) >= REGEX_CACHE_MAX)
+			table_regex_flush();
+
+		if (strncmp(p, "(?i)", 4) == 0) {
+			cflags |= REG_ICASE;
+			p += 4;
+		}
+
+		re = xcalloc(1, sizeof *re);
+		re->valid = regcomp(&re->preg, p, cflags) == 0;
+		dict_xset(&regex_cache, pattern, re);
+	}
+
+	if (!re->valid)
+		return (0);
+
+	if (regexec(&re->preg, string, 0, NULL, 0) != 0)
 		return (0);
 
-	ret = regexec(&preg, string, 0, NULL, 0);
+	return (1);
+}
+
+static void
+table_cache_remove(struct table_cache *tc, struct table_cache_entry *e)
+{
+	dict_xpop(&tc->dict, e->key);
+	TAILQ_REMOVE(&tc->lru, e, entry);
+	free(e->key);
+	free(e->value);
+	free(e);
+}
+
+static int
+table_cache_get(struct table *t, const char *key, int *ret, char **dst)
+{
+	struct table_cache		*tc = t->t_cache;
+	struct table_cache_entry	*e;
 
-	regfree(&preg);
+	if (tc == NULL || (e = dict_get(&tc->dict, key)) == NULL)
+		return (0);
 
-	if (ret != 0)
+	if (e->expire <= time(NULL)) {
+		table_cache_remove(tc, e);
 		return (0);
+	}
+
+	if (e->ret == 1 && dst && e->value)
+		*dst = xstrdup(e->value);
+	*ret = e->ret;
 
+	TAILQ_REMOVE(&tc->lru, e, entry);
+	TAILQ_INSERT_HEAD(&tc->lru, e, entry);
 	return (1);
 }
 
+static void
+table_cache_set(struct table *t, const char *key, int ret, const char *value)
+{
+	struct table_cache		*tc = t->t_cache;
+	struct table_cache_entry	*e;
+	time_t				 ttl;
+
+	ttl = (ret == 1) ? t->t_cache_ttl : t->t_cache_negttl;
+	if (ttl == 0)
+		return;
+
+	if (tc == NULL) {
+		tc = xcalloc(1, sizeof(*tc));
+		dict_init(&tc->dict);
+		TAILQ_INIT(&tc->lru);
+		t->t_cache = tc;
+	}
+
+	if ((e = dict_get(&tc->dict, key)))
+		table_cache_remove(tc, e);
+	else if (dict_count(&tc->dict) >= TABLE_CACHE_MAX)
+		table_cache_remove(tc, TAILQ_LAST(&tc->lru, table_cache_lru));
+
+	e = xcalloc(1, sizeof(*e));
+	e->key = xstrdup(key);
+	e->expire = time(NULL) + ttl;
+	e->ret = ret;
+	if (value)
+		e->value = xstrdup(value);
+	dict_xset(&tc->dict, e->key, e);
+	TAILQ_INSERT_HEAD(&tc->lru, e, entry);
+}
+
+static void
+table_cache_clear(struct table *t)
+{
+	struct table_cache		*tc = t->t_cache;
+
+	if (tc == NULL)
+		return;
+	while (!TAILQ_EMPTY(&tc->lru))
+		table_cache_remove(tc, TAILQ_FIRST(&tc->lru));
+}
+
 void
 table_dump_all(struct smtpd *conf)
 {
@@ -661,6 +904,21 @@ table_parse_lookup(enum table_service service, const char *key,
 			return (-1);
 		return (1);
 
+	case K_PKI:
+		/* the certificate file, then the key file */
+		if ((p = strpbrk(line, " \t")) == NULL || p == line ||
+		    (size_t)(p - line) >= sizeof(lk->pkifiles.cert))
+			return (-1);
+		memmove(lk->pkifiles.cert, line, p - line);
+		lk->pkifiles.cert[p - line] = '\0';
+		p += strspn(p, " \t");
+		if (*p == '\0' || strpbrk(p, " \t") != NULL)
+			return (-1);
+		if (strlcpy(lk->pkifiles.key, p, sizeof(lk->pkifiles.key))
+		    >= sizeof(lk->pkifiles.key))
+			return (-1);
+		return (1);
+
 	default:
 		return (-1);
 	}
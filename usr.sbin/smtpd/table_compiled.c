@@ -0,0 +1,557 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+/*
+ * A compiled table is a read-only file produced by makemap -d compiled,
+ * which is mapped in memory as is.  It holds the entries sorted by key
+ * for binary search, followed by the indexes of domain patterns and of
+ * keys parsed as network addresses, and by the NUL-terminated strings.
+ * Offsets are relative to the start of the file, in host byte order.
+ */
+#define	TABLE_COMPILED_MAGIC	"SMTPDTC1"
+
+struct table_compiled_header {
+	char		magic[8];
+	uint32_t	type;
+	uint32_t	nkeys;
+	uint32_t	npatterns;
+	uint32_t	nnetaddrs;
+	uint32_t	keys;
+	uint32_t	patterns;
+	uint32_t	netaddrs;
+	uint32_t	size;
+};
+
+struct table_compiled_entry {
+	uint32_t	key;
+	uint32_t	value;		/* 0 for list entries */
+};
+
+struct table_compiled_netaddr {
+	uint32_t	entry;
+	uint8_t		family;
+	uint8_t		bits;
+	uint8_t		pad[2];
+	uint8_t		addr[16];
+};
+
+struct table_compiled_handle {
+	const uint8_t				*map;
+	size_t					 size;
+	const struct table_compiled_header	*hdr;
+	const struct table_compiled_entry	*keys;
+	const uint32_t				*patterns;
+	const struct table_compiled_netaddr	*netaddrs;
+	uint32_t				 iter;
+};
+
+static int table_compiled_config(struct table *);
+static int table_compiled_update(struct table *);
+static int table_compiled_open(struct table *);
+static void *table_compiled_open2(struct table *);
+static int table_compiled_lookup(struct table *, enum table_service,
+    const char *, char **);
+static int table_compiled_fetch(struct table *, enum table_service, char **);
+static void table_compiled_close(struct table *);
+static void table_compiled_close2(void *);
+
+struct table_backend table_backend_compiled = {
+	.name = "compiled",
+	.services = K_ALIAS|K_CREDENTIALS|K_DOMAIN|K_NETADDR|K_USERINFO|
+	K_SOURCE|K_MAILADDR|K_ADDRNAME|K_MAILADDRMAP|K_RELAYHOST|
+	K_STRING|K_REGEX|K_PKI,
+	.config = table_compiled_config,
+	.add = NULL,
+	.dump = NULL,
+	.open = table_compiled_open,
+	.update = table_compiled_update,
+	.close = table_compiled_close,
+	.lookup = table_compiled_lookup,
+	.fetch = table_compiled_fetch,
+};
+
+static struct keycmp {
+	enum table_service	service;
+	int		       (*func)(const char *, const char *);
+} keycmp[] = {
+	{ K_MAILADDR, table_mailaddr_match },
+	{ K_REGEX, table_regex_match },
+};
+
+static int
+table_compiled_config(struct table *table)
+{
+	void	*handle;
+
+	if ((handle = table_compiled_open2(table)) == NULL)
+		return 0;
+
+	table_compiled_close2(handle);
+	return 1;
+}
+
+static int
+table_compiled_update(struct table *table)
+{
+	void	*handle;
+
+	if ((handle = table_compiled_open2(table)) == NULL) {
+		log_info("info: Failed to update table \"%s\"", table->t_name);
+		return 0;
+	}
+
+	table_compiled_close2(table->t_handle);
+	table->t_handle = handle;
+	log_info("info: Table \"%s\" successfully updated", table->t_name);
+	return 1;
+}
+
+static int
+table_compiled_open(struct table *table)
+{
+	if ((table->t_handle = table_compiled_open2(table)) == NULL)
+		return 0;
+	return 1;
+}
+
+static void
+table_compiled_close(struct table *table)
+{
+	table_compiled_close2(table->t_handle);
+	table->t_handle = NULL;
+}
+
+static int
+table_compiled_check(size_t size, uint32_t off, uint32_t count, size_t len)
+{
+	if (off > size || off % sizeof(uint32_t))
+		return 0;
+	if (count && (size - off) / count < len)
+		return 0;
+	return 1;
+}
+
+static void *
+table_compiled_open2(struct table *table)
+{
+	struct table_compiled_handle		*h;
+	const struct table_compiled_header	*hdr;
+	struct stat				 sb;
+	void					*map;
+	int					 fd;
+
+	if ((fd = open(table->t_config, O_RDONLY)) == -1) {
+		log_warn("warn: %s", table->t_config);
+		return NULL;
+	}
+	if (fstat(fd, &sb) == -1) {
+		log_warn("warn: fstat: %s", table->t_config);
+		close(fd);
+		return NULL;
+	}
+	if (sb.st_size < (off_t)sizeof(*hdr) || sb.st_size > UINT32_MAX) {
+		log_warnx("warn: %s: invalid compiled table", table->t_config);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_warn("warn: mmap: %s", table->t_config);
+		return NULL;
+	}
+
+	hdr = map;
+	if (memcmp(hdr->magic, TABLE_COMPILED_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->size != (size_t)sb.st_size ||
+	    (hdr->type != T_LIST && hdr->type != T_HASH) ||
+	    !table_compiled_check(sb.st_size, hdr->keys, hdr->nkeys,
+	    sizeof(struct table_compiled_entry)) ||
+	    !table_compiled_check(sb.st_size, hdr->patterns, hdr->npatterns,
+	    sizeof(uint32_t)) ||
+	    !table_compiled_check(sb.st_size, hdr->netaddrs, hdr->nnetaddrs,
+	    sizeof(struct table_compiled_netaddr)) ||
+	    ((const uint8_t *)map)[sb.st_size - 1] != '\0') {
+		log_warnx("warn: %s: invalid compiled table", table->t_config);
+		munmap(map, sb.st_size);
+		return NULL;
+	}
+
+	h = xcalloc(1, sizeof(*h));
+	h->map = map;
+	h->size = sb.st_size;
+	h->hdr = hdr;
+	h->keys = (const void *)(h->map + hdr->keys);
+	h->patterns = (const void *)(h->map + hdr->patterns);
+	h->netaddrs = (const void *)(h->map + hdr->netaddrs);
+	table->t_type = hdr->type;
+
+	return h;
+}
+
+static void
+table_compiled_close2(void *hdl)
+{
+	struct table_compiled_handle	*h = hdl;
+
+	if (h == NULL)
+		return;
+	munmap((void *)h->map, h->size);
+	free(h);
+}
+
+/*
+ * Strings are checked when used rather than when the table is opened, so
+ * that opening does not need to go over the whole file.  The file ends
+ * with a NUL, so any offset in range points to a terminated string.
+ */
+static const char *
+table_compiled_string(struct table_compiled_handle *h, uint32_t off)
+{
+	if (off >= h->size)
+		return NULL;
+	return (const char *)h->map + off;
+}
+
+static const struct table_compiled_entry *
+table_compiled_find(struct table_compiled_handle *h, const char *key)
+{
+	const struct table_compiled_entry	*e;
+	const char				*k;
+	uint32_t				 lo, hi, mid;
+	int					 r;
+
+	lo = 0;
+	hi = h->hdr->nkeys;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = &h->keys[mid];
+		if ((k = table_compiled_string(h, e->key)) == NULL)
+			return NULL;
+		if ((r = strcmp(key, k)) == 0)
+			return e;
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+static const struct table_compiled_entry *
+table_compiled_entry(struct table_compiled_handle *h, uint32_t i)
+{
+	if (i >= h->hdr->nkeys)
+		return NULL;
+	return &h->keys[i];
+}
+
+static int
+table_compiled_lookup(struct table *table, enum table_service service,
+    const char *key, char **dst)
+{
+	struct table_compiled_handle		*h = table->t_handle;
+	const struct table_compiled_entry	*e = NULL;
+	const struct table_compiled_netaddr	*na;
+	struct netaddr				 n1, n2;
+	struct sockaddr_in			*sin;
+	struct sockaddr_in6			*sin6;
+	const char				*k, *v;
+	int					(*match)(const char *, const char *) = NULL;
+	size_t					 i;
+
+	for (i = 0; i < nitems(keycmp); ++i)
+		if (keycmp[i].service == service)
+			match = keycmp[i].func;
+
+	/* keys match themselves for all services but regex */
+	if (service != K_REGEX)
+		e = table_compiled_find(h, key);
+
+	if (e == NULL && service == K_DOMAIN) {
+		for (i = 0; i < h->hdr->npatterns; i++) {
+			if ((e = table_compiled_entry(h, h->patterns[i])) &&
+			    (k = table_compiled_string(h, e->key)) &&
+			    table_domain_match(key, k))
+				break;
+			e = NULL;
+		}
+	}
+	else if (e == NULL && service == K_NETADDR &&
+	    text_to_netaddr(&n1, key)) {
+		for (i = 0; i < h->hdr->nnetaddrs; i++) {
+			na = &h->netaddrs[i];
+			memset(&n2, 0, sizeof(n2));
+			n2.bits = na->bits;
+			if (na->family == AF_INET) {
+				sin = (struct sockaddr_in *)&n2.ss;
+				sin->sin_family = AF_INET;
+				memcpy(&sin->sin_addr, na->addr,
+				    sizeof(sin->sin_addr));
+#ifdef HAVE_STRUCT_SOCKADDR_IN_SIN_LEN
+				sin->sin_len = sizeof(*sin);
+#endif
+			}
+			else {
+				sin6 = (struct sockaddr_in6 *)&n2.ss;
+				sin6->sin6_family = AF_INET6;
+				memcpy(&sin6->sin6_addr, na->addr,
+				    sizeof(sin6->sin6_addr));
+#ifdef HAVE_STRUCT_SOCKADDR_IN6_SIN6_LEN
+				sin6->sin6_len = sizeof(*sin6);
+#endif
+			}
+			if (table_netaddr_match_parsed(&n1, &n2) &&
+			    (e = table_compiled_entry(h, na->entry)))
+				break;
+		}
+	}
+	else if (e == NULL && match) {
+		for (i = 0; i < h->hdr->nkeys; i++) {
+			if ((k = table_compiled_string(h, h->keys[i].key)) &&
+			    match(key, k)) {
+				e = &h->keys[i];
+				break;
+			}
+		}
+	}
+
+	if (e == NULL)
+		return 0;
+	if (dst == NULL)
+		return 1;
+
+	if (e->value)
+		v = table_compiled_string(h, e->value);
+	else
+		v = table_compiled_string(h, e->key);
+	if (v == NULL)
+		return 0;
+
+	if ((*dst = strdup(v)) == NULL)
+		return -1;
+	return 1;
+}
+
+static int
+table_compiled_fetch(struct table *table, enum table_service service,
+    char **dst)
+{
+	struct table_compiled_handle	*h = table->t_handle;
+	const char			*k;
+
+	if (h->hdr->nkeys == 0)
+		return 0;
+	if (h->iter >= h->hdr->nkeys)
+		h->iter = 0;
+
+	if ((k = table_compiled_string(h, h->keys[h->iter++].key)) == NULL)
+		return 0;
+	if ((*dst = strdup(k)) == NULL)
+		return -1;
+	return 1;
+}
+
+/*
+ * Writer side, used by makemap.  The source is parsed the same way as for
+ * static tables, and the whole table is laid out in memory before being
+ * written to fd.  Returns the number of entries, or -1.
+ */
+struct table_compiled_source {
+	char		*value;
+	int		 isnetaddr;
+	struct netaddr	 netaddr;
+};
+
+static void
+table_compiled_source_free(struct dict *d)
+{
+	struct table_compiled_source	*s;
+
+	while (dict_poproot(d, (void **)&s)) {
+		free(s->value);
+		free(s);
+	}
+}
+
+int
+table_compiled_write(FILE *fp, const char *source, int fd, int type)
+{
+	struct table_compiled_header	*hdr;
+	struct table_compiled_entry	*e;
+	struct table_compiled_netaddr	*na;
+	struct table_compiled_source	*s;
+	struct sockaddr_in		*sin;
+	struct sockaddr_in6		*sin6;
+	struct dict			 entries;
+	const char			*k;
+	char				*line = NULL, *keyp, *valp;
+	char				 lkey[1024];
+	size_t				 linesize = 0, lineno = 0, size, off;
+	size_t				 nkeys, npatterns, nnetaddrs, len;
+	size_t				 i, ip, in;
+	uint8_t				*buf;
+	void				*iter;
+	ssize_t				 n;
+	int				 malformed, ret = -1;
+
+	dict_init(&entries);
+	nkeys = npatterns = nnetaddrs = 0;
+	size = 0;
+
+	while (parse_table_line(fp, &line, &linesize, &type,
+	    &keyp, &valp, &malformed) != -1) {
+		lineno++;
+		if (malformed) {
+			log_warnx("%s:%zu: invalid entry", source, lineno);
+			goto end;
+		}
+		if (keyp == NULL)
+			continue;
+		if (!lowercase(lkey, keyp, sizeof(lkey))) {
+			log_warnx("%s:%zu: key too long", source, lineno);
+			goto end;
+		}
+		if (dict_check(&entries, lkey)) {
+			log_warnx("%s:%zu: duplicate entry for %s", source,
+			    lineno, keyp);
+			goto end;
+		}
+
+		s = xcalloc(1, sizeof(*s));
+		if (valp)
+			s->value = xstrdup(valp);
+		s->isnetaddr = text_to_netaddr(&s->netaddr, lkey);
+		dict_xset(&entries, lkey, s);
+
+		nkeys++;
+		if (strchr(lkey, '*'))
+			npatterns++;
+		if (s->isnetaddr)
+			nnetaddrs++;
+		size += strlen(lkey) + 1;
+		if (valp)
+			size += strlen(valp) + 1;
+	}
+	if (ferror(fp)) {
+		log_warn("%s: getline", source);
+		goto end;
+	}
+	if (type == T_NONE)
+		type = T_HASH;
+
+	off = sizeof(*hdr);
+	size += off + nkeys * sizeof(*e) + npatterns * sizeof(uint32_t) +
+	    nnetaddrs * sizeof(*na) + 1;
+	size = (size + 3) & ~(size_t)3;
+	if (size > UINT32_MAX) {
+		log_warnx("%s: table too large", source);
+		goto end;
+	}
+
+	buf = xcalloc(1, size);
+	hdr = (struct table_compiled_header *)buf;
+	memcpy(hdr->magic, TABLE_COMPILED_MAGIC, sizeof(hdr->magic));
+	hdr->type = type;
+	hdr->nkeys = nkeys;
+	hdr->npatterns = npatterns;
+	hdr->nnetaddrs = nnetaddrs;
+	hdr->keys = off;
+	hdr->patterns = hdr->keys + nkeys * sizeof(*e);
+	hdr->netaddrs = hdr->patterns + npatterns * sizeof(uint32_t);
+	hdr->size = size;
+	off = hdr->netaddrs + nnetaddrs * sizeof(*na);
+
+	/* dict iteration is in key order, as table_compiled_find() expects */
+	i = ip = in = 0;
+	iter = NULL;
+	while (dict_iter(&entries, &iter, &k, (void **)&s)) {
+		e = (struct table_compiled_entry *)(buf + hdr->keys) + i;
+		len = strlen(k) + 1;
+		memcpy(buf + off, k, len);
+		e->key = off;
+		off += len;
+		if (s->value) {
+			len = strlen(s->value) + 1;
+			memcpy(buf + off, s->value, len);
+			e->value = off;
+			off += len;
+		}
+
+		if (strchr(k, '*'))
+			((uint32_t *)(buf + hdr->patterns))[ip++] = i;
+		if (s->isnetaddr) {
+			na = (struct table_compiled_netaddr *)
+			    (buf + hdr->netaddrs) + in++;
+			na->entry = i;
+			na->bits = s->netaddr.bits;
+			na->family = s->netaddr.ss.ss_family;
+			if (na->family == AF_INET) {
+				sin = (struct sockaddr_in *)&s->netaddr.ss;
+				memcpy(na->addr, &sin->sin_addr,
+				    sizeof(sin->sin_addr));
+			}
+			else {
+				sin6 = (struct sockaddr_in6 *)&s->netaddr.ss;
+				memcpy(na->addr, &sin6->sin6_addr,
+				    sizeof(sin6->sin6_addr));
+			}
+		}
+		i++;
+	}
+
+	for (off = 0; off < size; off += n) {
+		if ((n = write(fd, buf + off, size - off)) == -1) {
+			if (errno == EINTR)
+				n = 0;
+			else {
+				log_warn("write");
+				free(buf);
+				goto end;
+			}
+		}
+	}
+	free(buf);
+	ret = nkeys;
+
+end:
+	free(line);
+	table_compiled_source_free(&entries);
+	return ret;
+}
@@ -38,6 +38,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "smtpd.h"
 #include "log.h"
@@ -53,14 +54,15 @@ static void table_db_close(struct table *);
 static void table_db_close2(void *);
 
 static char *table_db_get_entry(void *, const char *, size_t *);
-static char *table_db_get_entry_match(void *, const char *, size_t *,
-    int(*)(const char *, const char *));
+static char *table_db_get_entry_match(void *, enum table_service,
+    const char *, size_t *, int(*)(const char *, const char *));
+static void table_db_index(void *);
 
 struct table_backend table_backend_db = {
 	.name = "db",
 	.services = K_ALIAS|K_CREDENTIALS|K_DOMAIN|K_NETADDR|K_USERINFO|
 	K_SOURCE|K_MAILADDR|K_ADDRNAME|K_MAILADDRMAP|K_RELAYHOST|
-	K_STRING|K_REGEX,
+	K_STRING|K_REGEX|K_PKI,
 	.config = table_db_config,
 	.add = NULL,
 	.dump = NULL,
@@ -81,11 +83,25 @@ static struct keycmp {
 	{ K_REGEX, table_regex_match },
 };
 
+/*
+ * The db file is checked for changes at most once per second rather
+ * than on every lookup.
+ *
+ * Keys that can match something else than themselves, domain patterns
+ * and network addresses, are collected on the first domain or netaddr
+ * lookup so that these do not need to go over the whole database.
+ */
+#define	TABLE_DB_CHECK_INTERVAL	1
+
 struct dbhandle {
 	DB		*db;
 	char		 pathname[PATH_MAX];
 	time_t		 mtime;
+	time_t		 checked;
 	int		 iter;
+	int		 indexed;
+	struct dict	 patterns;
+	struct dict	 netaddrs;
 };
 
 static int
@@ -146,6 +162,9 @@ table_db_open2(struct table *table)
 		goto error;
 
 	handle->mtime = sb.st_mtime;
+	handle->checked = time(NULL);
+	dict_init(&handle->patterns);
+	dict_init(&handle->netaddrs);
 	handle->db = dbopen(table->t_config, O_RDONLY, 0600, DB_HASH, NULL);
 	if (handle->db == NULL)
 		goto error;
@@ -163,6 +182,12 @@ static void
 table_db_close2(void *hdl)
 {
 	struct dbhandle	*handle = hdl;
+	void		*p;
+
+	while (dict_poproot(&handle->patterns, NULL))
+		;
+	while (dict_poproot(&handle->netaddrs, &p))
+		free(p);
 	handle->db->close(handle->db);
 	free(handle);
 }
@@ -178,14 +203,19 @@ table_db_lookup(struct table *table, enum table_service service, const char *key
 	int	       (*match)(const char *, const char *) = NULL;
 	size_t		i;
 	struct stat	sb;
-
-	if (stat(handle->pathname, &sb) == -1)
-		return -1;
-
-	/* DB has changed, close and reopen */
-	if (sb.st_mtime != handle->mtime) {
-		table_db_update(table);
-		handle = table->t_handle;
+	time_t		now;
+
+	now = time(NULL);
+	if (now - handle->checked >= TABLE_DB_CHECK_INTERVAL) {
+		if (stat(handle->pathname, &sb) == -1)
+			return -1;
+		handle->checked = now;
+
+		/* DB has changed, close and reopen */
+		if (sb.st_mtime != handle->mtime) {
+			table_db_update(table);
+			handle = table->t_handle;
+		}
 	}
 
 	for (i = 0; i < nitems(keycmp); ++i)
@@ -195,7 +225,8 @@ table_db_lookup(struct table *table, enum table_service service, const char *key
 	if (match == NULL)
 		line = table_db_get_entry(handle, key, &len);
 	else
-		line = table_db_get_entry_match(handle, key, &len, match);
+		line = table_db_get_entry_match(handle, service, key, &len,
+		    match);
 	if (line == NULL)
 		return 0;
 
@@ -236,14 +267,49 @@ table_db_fetch(struct table *table, enum table_service service, char **dst)
 
 
 static char *
-table_db_get_entry_match(void *hdl, const char *key, size_t *len,
-    int(*func)(const char *, const char *))
+table_db_get_entry_match(void *hdl, enum table_service service,
+    const char *key, size_t *len, int(*func)(const char *, const char *))
 {
 	struct dbhandle	*handle = hdl;
+	struct netaddr	 netaddr;
 	DBT dbk;
 	DBT dbd;
 	int r;
 	char *buf = NULL;
+	const char *k;
+	void *iter;
+	struct netaddr *na;
+
+	/* keys match themselves for all services but regex */
+	if (service != K_REGEX &&
+	    (buf = table_db_get_entry(handle, key, len)) != NULL) {
+		free(buf);
+		*len = strlen(key) + 1;
+		return xstrdup(key);
+	}
+
+	if (service == K_DOMAIN || service == K_NETADDR) {
+		if (!handle->indexed)
+			table_db_index(handle);
+
+		iter = NULL;
+		if (service == K_DOMAIN) {
+			while (dict_iter(&handle->patterns, &iter, &k, NULL))
+				if (func(key, k))
+					goto found;
+		}
+		else if (text_to_netaddr(&netaddr, key)) {
+			while (dict_iter(&handle->netaddrs, &iter, &k,
+			    (void **)&na))
+				if (table_netaddr_match_parsed(&netaddr, na))
+					goto found;
+		}
+		return NULL;
+
+	found:
+		*len = strlen(k) + 1;
+		return xstrdup(k);
+	}
 
 	for (r = handle->db->seq(handle->db, &dbk, &dbd, R_FIRST); !r;
 	     r = handle->db->seq(handle->db, &dbk, &dbd, R_NEXT)) {
@@ -257,6 +323,35 @@ table_db_get_entry_match(void *hdl, const char *key, size_t *len,
 	return NULL;
 }
 
+static void
+table_db_index(void *hdl)
+{
+	struct dbhandle	*handle = hdl;
+	struct netaddr	 netaddr;
+	DBT dbk;
+	DBT dbd;
+	int r;
+	char key[LINE_MAX];
+
+	for (r = handle->db->seq(handle->db, &dbk, &dbd, R_FIRST); !r;
+	     r = handle->db->seq(handle->db, &dbk, &dbd, R_NEXT)) {
+		if (dbk.size == 0 || dbk.size >= sizeof key)
+			continue;
+		memcpy(key, dbk.data, dbk.size);
+		key[dbk.size] = '\0';
+
+		if (strchr(key, '*'))
+			dict_set(&handle->patterns, key, NULL);
+		if (text_to_netaddr(&netaddr, key))
+			dict_set(&handle->netaddrs, key,
+			    xmemdup(&netaddr, sizeof netaddr));
+	}
+
+	/* the sequential scan moved the cursor used by fetch */
+	handle->iter = 0;
+	handle->indexed = 1;
+}
+
 static char *
 table_db_get_entry(void *hdl, const char *key, size_t *len)
 {
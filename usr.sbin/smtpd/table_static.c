@@ -29,16 +29,50 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <event.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "smtpd.h"
 #include "log.h"
 
+/*
+ * Besides the entries, keep the keys that can match something else than
+ * themselves: domain patterns, and keys parsed as network addresses, so
+ * that domain and netaddr lookups do not need to go over the whole table.
+ */
 struct table_static_priv {
 	int		 type;
 	struct dict	 dict;
+	struct dict	 patterns;
+	struct dict	 netaddrs;
 	void		*iter;
+
+	struct table_static_load *load;
+};
+
+/*
+ * On update, the new table is loaded a chunk of lines at a time from the
+ * event loop, while lookups are still served from the current one, and
+ * swapped in once the whole file is read.
+ */
+#define	TABLE_STATIC_LOAD_CHUNK	10000
+
+struct table_static_load {
+	struct table		 *table;
+	struct table_static_priv *priv;
+	const char		 *path;
+	FILE			 *fp;
+	char			 *line;
+	size_t			  linesize;
+	int			  lineno;
+	int			  typeonly;
+	struct event		  ev;
+};
+
+struct table_static_netaddr {
+	struct netaddr	 netaddr;
+	void		*value;
 };
 
 /* static backend */
@@ -51,12 +85,13 @@ static int table_static_lookup(struct table *, enum table_service, const char *,
     char **);
 static int table_static_fetch(struct table *, enum table_service, char **);
 static void table_static_close(struct table *);
+static void table_static_load_free(struct table_static_load *);
 
 struct table_backend table_backend_static = {
 	.name = "static",
 	.services = K_ALIAS|K_CREDENTIALS|K_DOMAIN|K_NETADDR|K_USERINFO|
 	K_SOURCE|K_MAILADDR|K_ADDRNAME|K_MAILADDRMAP|K_RELAYHOST|
-	K_STRING|K_REGEX,
+	K_STRING|K_REGEX|K_PKI,
 	.config = table_static_config,
 	.add = table_static_add,
 	.dump = table_static_dump,
@@ -71,8 +106,6 @@ static struct keycmp {
 	enum table_service	service;
 	int		       (*func)(const char *, const char *);
 } keycmp[] = {
-	{ K_DOMAIN, table_domain_match },
-	{ K_NETADDR, table_netaddr_match },
 	{ K_MAILADDR, table_mailaddr_match },
 	{ K_REGEX, table_regex_match },
 };
@@ -83,15 +116,24 @@ table_static_priv_free(struct table_static_priv *priv)
 {
 	void *p;
 
+	if (priv->load)
+		table_static_load_free(priv->load);
+
 	while (dict_poproot(&priv->dict, (void **)&p))
 		if (p != priv)
 			free(p);
+	while (dict_poproot(&priv->patterns, NULL))
+		;
+	while (dict_poproot(&priv->netaddrs, &p))
+		free(p);
 	free(priv);
 }
 
 static int
 table_static_priv_add(struct table_static_priv *priv, const char *key, const char *val)
 {
+	struct table_static_netaddr *na;
+	struct netaddr netaddr;
 	char lkey[1024];
 	void *old, *new = NULL;
 
@@ -108,6 +150,19 @@ table_static_priv_add(struct table_static_priv *priv, const char *key, const cha
 
 	/* use priv if value is null, so we can detect duplicate entries */
 	old = dict_set(&priv->dict, lkey, new ? new : priv);
+
+	if (strchr(lkey, '*'))
+		dict_set(&priv->patterns, lkey, new ? new : priv);
+	if (text_to_netaddr(&netaddr, lkey)) {
+		if ((na = dict_get(&priv->netaddrs, lkey)) == NULL) {
+			if ((na = malloc(sizeof(*na))) == NULL)
+				return (-1);
+			dict_set(&priv->netaddrs, lkey, na);
+		}
+		na->netaddr = netaddr;
+		na->value = new ? new : priv;
+	}
+
 	if (old) {
 		if (old != priv)
 			free(old);
@@ -118,50 +173,145 @@ table_static_priv_add(struct table_static_priv *priv, const char *key, const cha
 }
 
 static int
-table_static_priv_load(struct table_static_priv *priv, const char *path)
+table_static_load_read(struct table_static_load *load, size_t max)
 {
-	FILE	*fp;
-	char	*line = NULL;
-	int	 lineno = 0;
-	size_t	 linesize = 0;
+	struct table_static_priv *priv = load->priv;
 	char	*keyp;
 	char	*valp;
-	int	 malformed, ret = 0;
-
-	if ((fp = fopen(path, "r")) == NULL) {
-		log_warn("%s: fopen", path);
-		return 0;
-	}
+	int	 malformed;
+	size_t	 n;
 
-	while (parse_table_line(fp, &line, &linesize, &priv->type,
-	    &keyp, &valp, &malformed) != -1) {
-		lineno++;
+	for (n = 0; max == 0 || n < max; n++) {
+		if (parse_table_line(load->fp, &load->line, &load->linesize,
+		    &priv->type, &keyp, &valp, &malformed) == -1)
+			break;
+		load->lineno++;
 		if (malformed) {
 			log_warnx("%s:%d invalid map entry",
-			    path, lineno);
-			goto end;
+			    load->path, load->lineno);
+			return 0;
 		}
 		if (keyp == NULL)
 			continue;
+		if (load->typeonly)
+			break;
 		table_static_priv_add(priv, keyp, valp);
 	}
 
-	if (ferror(fp)) {
-		log_warn("%s: getline", path);
-		goto end;
+	if (max && n == max)
+		return -1;
+
+	if (ferror(load->fp)) {
+		log_warn("%s: getline", load->path);
+		return 0;
 	}
 
 	/* Accept empty alias files; treat them as hashes */
 	if (priv->type == T_NONE)
 		priv->type = T_HASH;
 
-	ret = 1;
-end:
-	free(line);
-	fclose(fp);
+	return 1;
+}
+
+static int
+table_static_priv_load(struct table_static_priv *priv, const char *path)
+{
+	struct table_static_load load;
+	int	 ret;
+
+	memset(&load, 0, sizeof(load));
+	load.priv = priv;
+	load.path = path;
+	/* only the lka looks entries up, the others just need the type */
+	load.typeonly = env->sc_opts & SMTPD_OPT_NOTABLES ? 1 : 0;
+	if ((load.fp = fopen(path, "r")) == NULL) {
+		log_warn("%s: fopen", path);
+		return 0;
+	}
+
+	ret = table_static_load_read(&load, 0);
+
+	free(load.line);
+	fclose(load.fp);
 	return ret;
 }
 
+static struct table_static_priv *
+table_static_priv_new(int type)
+{
+	struct table_static_priv *priv;
+
+	priv = calloc(1, sizeof(*priv));
+	if (priv == NULL)
+		return NULL;
+	priv->type = type;
+	dict_init(&priv->dict);
+	dict_init(&priv->patterns);
+	dict_init(&priv->netaddrs);
+	return priv;
+}
+
+static void
+table_static_load_free(struct table_static_load *load)
+{
+	struct table_static_priv *cur = load->table->t_handle;
+
+	if (cur && cur->load == load)
+		cur->load = NULL;
+	if (evtimer_pending(&load->ev, NULL))
+		evtimer_del(&load->ev);
+	if (load->priv)
+		table_static_priv_free(load->priv);
+	free(load->line);
+	fclose(load->fp);
+	free(load);
+}
+
+/*
+ * Read the next chunk, 1 once the new content replaced the old one, 0
+ * when the update failed, -1 while there is more to read.
+ */
+static int
+table_static_load_run(struct table_static_load *load)
+{
+	struct table		 *t = load->table;
+	struct table_static_priv *old = t->t_handle;
+	struct timeval		  tv;
+
+	switch (table_static_load_read(load, TABLE_STATIC_LOAD_CHUNK)) {
+	case -1:
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add(&load->ev, &tv);
+		return -1;
+	case 0:
+		log_info("info: Failed to update table \"%s\"", t->t_name);
+		table_static_load_free(load);
+		return 0;
+	}
+
+	t->t_handle = load->priv;
+	t->t_type = load->priv->type;
+	load->priv = NULL;
+	old->load = NULL;
+	table_static_priv_free(old);
+	table_static_load_free(load);
+
+	log_info("info: Table \"%s\" successfully updated", t->t_name);
+	return 1;
+}
+
+static void
+table_static_load_step(int fd, short event, void *arg)
+{
+	struct table_static_load	*load = arg;
+	struct table			*t = load->table;
+	int				 r;
+
+	if ((r = table_static_load_run(load)) != -1)
+		table_updated(t, r);
+}
+
 static int
 table_static_config(struct table *t)
 {
@@ -172,12 +322,9 @@ table_static_config(struct table *t)
 		return 1;
 
 	/* new config */
-	priv = calloc(1, sizeof(*priv));
-	if (priv == NULL)
+	if ((priv = table_static_priv_new(t->t_type)) == NULL)
 		return 0;
-	priv->type = t->t_type;
-	dict_init(&priv->dict);
-	
+
 	if (*t->t_config) {
 		/* load the config file */
 		if (table_static_priv_load(priv, t->t_config) == 0) {
@@ -243,13 +390,42 @@ table_static_dump(struct table *table)
 static int
 table_static_update(struct table *table)
 {
-	if (table_static_config(table) == 1) {
-		log_info("info: Table \"%s\" successfully updated", table->t_name);
-		return 1;
+	struct table_static_priv *priv = table->t_handle;
+	struct table_static_load *load;
+
+	if (priv == NULL || *table->t_config == '\0') {
+		if (table_static_config(table) == 1) {
+			log_info("info: Table \"%s\" successfully updated",
+			    table->t_name);
+			return 1;
+		}
+		log_info("info: Failed to update table \"%s\"", table->t_name);
+		return 0;
 	}
 
-	log_info("info: Failed to update table \"%s\"", table->t_name);
-	return 0;
+	/* restart an update already in progress */
+	if (priv->load)
+		table_static_load_free(priv->load);
+
+	if ((load = calloc(1, sizeof(*load))) == NULL ||
+	    (load->priv = table_static_priv_new(table->t_type)) == NULL) {
+		free(load);
+		log_warn("warn: table_static_update");
+		return 0;
+	}
+	load->table = table;
+	load->path = table->t_config;
+	if ((load->fp = fopen(load->path, "r")) == NULL) {
+		log_warn("%s: fopen", load->path);
+		log_info("info: Failed to update table \"%s\"", table->t_name);
+		table_static_priv_free(load->priv);
+		free(load);
+		return 0;
+	}
+	evtimer_set(&load->ev, table_static_load_step, load);
+	priv->load = load;
+
+	return table_static_load_run(load);
 }
 
 static int
@@ -275,6 +451,8 @@ table_static_lookup(struct table *table, enum table_service service, const char
     char **dst)
 {
 	struct table_static_priv *priv = table->t_handle;
+	struct table_static_netaddr *na;
+	struct netaddr	netaddr;
 	char	       *line;
 	int		ret;
 	int	       (*match)(const char *, const char *) = NULL;
@@ -287,24 +465,39 @@ table_static_lookup(struct table *table, enum table_service service, const char
 		if (keycmp[i].service == service)
 			match = keycmp[i].func;
 
+	/* keys match themselves for all services but regex */
 	line = NULL;
+	if (service != K_REGEX)
+		line = dict_get(&priv->dict, key);
+	ret = line != NULL;
+
 	iter = NULL;
-	ret = 0;
-	while (dict_iter(&priv->dict, &iter, &k, (void **)&v)) {
-		if (match) {
-			if (match(key, k)) {
+	if (ret == 0 && service == K_DOMAIN) {
+		while (dict_iter(&priv->patterns, &iter, &k, (void **)&v))
+			if (table_domain_match(key, k)) {
 				line = v;
 				ret = 1;
+				break;
 			}
-		}
-		else {
-			if (strcmp(key, k) == 0) {
+	}
+	else if (ret == 0 && service == K_NETADDR) {
+		if (text_to_netaddr(&netaddr, key))
+			while (dict_iter(&priv->netaddrs, &iter, &k,
+			    (void **)&na))
+				if (table_netaddr_match_parsed(&netaddr,
+				    &na->netaddr)) {
+					line = na->value;
+					ret = 1;
+					break;
+				}
+	}
+	else if (ret == 0 && match) {
+		while (dict_iter(&priv->dict, &iter, &k, (void **)&v))
+			if (match(key, k)) {
 				line = v;
 				ret = 1;
+				break;
 			}
-		}
-		if (ret)
-			break;
 	}
 
 	if (dst == NULL)
@@ -320,6 +513,27 @@ table_static_lookup(struct table *table, enum table_service service, const char
 	return 1;
 }
 
+/*
+ * Iterate over the keys of a static table, for callers that want to index
+ * them.  Returns -1 if the table cannot be matched by exact key for this
+ * service, 0 at the end of the table.
+ */
+int
+table_static_iter(struct table *t, enum table_service service, void **iter,
+    const char **key)
+{
+	struct table_static_priv *priv = t->t_handle;
+
+	if (t->t_backend != &table_backend_static || priv == NULL)
+		return (-1);
+	if (service == K_DOMAIN && dict_count(&priv->patterns))
+		return (-1);
+	if (service != K_DOMAIN && service != K_STRING)
+		return (-1);
+
+	return (dict_iter(&priv->dict, iter, key, NULL));
+}
+
 static int
 table_static_fetch(struct table *t, enum table_service service, char **dst)
 {
@@ -0,0 +1,470 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * TLS termination workers.
+ *
+ * With "smtp tls-workers", the dispatcher does not run the handshakes
+ * and the record layer of the smtps and STARTTLS sessions itself.  When
+ * a session is about to start TLS, the client socket is passed to one
+ * of the workers, round-robin, and the session waits.  The worker does
+ * the handshake, with the private key operations in the ca process as
+ * usual, then hands a socketpair back to the dispatcher along with what
+ * the session logs and reports about the TLS connection.  From there,
+ * the worker only moves data between the client and the socketpair,
+ * and the session reads and writes plaintext.
+ *
+ * Listeners with a pki table keep TLS in the dispatcher, as the
+ * certificates are looked up for each server name there.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <event.h>
+#include <grp.h> /* needed for setgroups */
+#include <imsg.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+/* stop reading from one side while this much is queued to the other */
+#define	TLS_WORKER_HIWAT	(64 * 1024)
+
+struct tls_conn {
+	uint64_t		 id;		/* of the smtp session */
+	struct listener		*listener;
+	struct io		*tls;		/* to the client */
+	struct io		*plain;		/* to the dispatcher */
+	int			 writing;	/* tls io in write mode */
+	int			 closing;	/* flushing, the other side is gone */
+};
+
+static void tls_worker_imsg(struct mproc *, struct imsg *);
+static void tls_worker_ticket_key(uint32_t, const void *, size_t);
+static void tls_worker_shutdown(void);
+static void tls_conn_accept(int, uint64_t, int);
+static void tls_conn_ready(struct tls_conn *);
+static void tls_conn_fail(struct tls_conn *, int, const char *);
+static void tls_conn_flush(struct tls_conn *);
+static void tls_conn_close(struct tls_conn *, struct io *);
+static void tls_conn_free(struct tls_conn *);
+static void tls_conn_io(struct io *, int, void *);
+static void tls_conn_plain_io(struct io *, int, void *);
+
+static int	tls_worker_next;
+
+/*
+ * Dispatcher side: pass the client socket of session id to a worker.
+ * The socket is closed once sent.
+ */
+int
+tls_worker_accept(struct listener *listener, int fd, uint64_t id)
+{
+	struct listener	*l;
+	struct mproc	*p;
+	int		 idx;
+
+	idx = 0;
+	TAILQ_FOREACH(l, env->sc_listeners, entry) {
+		if (l == listener)
+			break;
+		idx++;
+	}
+	if (l == NULL) {
+		close(fd);
+		return (-1);
+	}
+
+	p = p_tls[tls_worker_next];
+	tls_worker_next = (tls_worker_next + 1) % env->sc_tls_workers;
+
+	m_create(p, IMSG_TLS_ACCEPT, 0, 0, fd);
+	m_add_id(p, id);
+	m_add_int(p, idx);
+	m_close(p);
+
+	return (0);
+}
+
+void
+tls_session_info(struct tls *tls, struct tls_info *info)
+{
+	const char	*s;
+
+	memset(info, 0, sizeof(*info));
+	if ((s = tls_conn_version(tls)) != NULL)
+		(void)strlcpy(info->version, s, sizeof(info->version));
+	if ((s = tls_conn_cipher(tls)) != NULL)
+		(void)strlcpy(info->cipher, s, sizeof(info->cipher));
+	info->strength = tls_conn_cipher_strength(tls);
+	info->resumed = tls_conn_session_resumed(tls);
+	if ((s = tls_conn_cert_type(tls)) != NULL)
+		(void)strlcpy(info->cert_type, s, sizeof(info->cert_type));
+	if (tls_peer_cert_provided(tls) &&
+	    (s = tls_peer_cert_hash(tls)) != NULL)
+		(void)strlcpy(info->peer_hash, s, sizeof(info->peer_hash));
+}
+
+static void
+tls_worker_imsg(struct mproc *p, struct imsg *imsg)
+{
+	struct msg	 m;
+	const void	*data;
+	size_t		 sz;
+	uint64_t	 id;
+	uint32_t	 keyrev;
+	int		 idx, v;
+
+	if (imsg == NULL)
+		tls_worker_shutdown();
+
+	switch (imsg->hdr.type) {
+	case IMSG_TLS_ACCEPT:
+		m_msg(&m, imsg);
+		m_get_id(&m, &id);
+		m_get_int(&m, &idx);
+		m_end(&m);
+		tls_conn_accept(imsg_get_fd(imsg), id, idx);
+		return;
+
+	case IMSG_TLS_TICKET_KEY:
+		m_msg(&m, imsg);
+		m_get_u32(&m, &keyrev);
+		m_get_data(&m, &data, &sz);
+		m_end(&m);
+		tls_worker_ticket_key(keyrev, data, sz);
+		explicit_bzero(imsg->data, imsg->hdr.len - IMSG_HEADER_SIZE);
+		return;
+
+	case IMSG_CA_RSA_PRIVENC:
+	case IMSG_CA_RSA_PRIVDEC:
+	case IMSG_CA_ECDSA_SIGN:
+		ca_dispatch_result(p, imsg);
+		return;
+
+	case IMSG_CTL_VERBOSE:
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		log_trace_verbose(v);
+		return;
+
+	case IMSG_CTL_PROFILE:
+		m_msg(&m, imsg);
+		m_get_int(&m, &v);
+		m_end(&m);
+		profiling = v;
+		return;
+	}
+
+	fatalx("tls_worker_imsg: unexpected %s imsg",
+	    imsg_to_str(imsg->hdr.type));
+}
+
+/*
+ * The ticket keys come from the parent, the same for all workers, so
+ * that a ticket issued by one of them is accepted by the others.
+ */
+static void
+tls_worker_ticket_key(uint32_t keyrev, const void *key, size_t len)
+{
+	struct listener	*l;
+
+	TAILQ_FOREACH(l, env->sc_listeners, entry) {
+		if (l->tls_config == NULL)
+			continue;
+		if (tls_config_add_ticket_key(l->tls_config, keyrev,
+		    (unsigned char *)key, len) == -1)
+			fatalx("tls_config_add_ticket_key: %s",
+			    tls_config_error(l->tls_config));
+	}
+}
+
+static void
+tls_worker_shutdown(void)
+{
+	log_debug("debug: tls worker exiting");
+	_exit(0);
+}
+
+int
+tls_worker(void)
+{
+	struct passwd	*pw;
+	struct listener	*l;
+
+	ca_engine_init();
+
+	TAILQ_FOREACH(l, env->sc_listeners, entry)
+		if (l->flags & F_SSL && l->pkitable[0] == '\0')
+			smtp_setup_listener_tls(l);
+
+	purge_config(PURGE_TABLES|PURGE_RULES|PURGE_DISPATCHERS|PURGE_PKI);
+
+	if ((pw = getpwnam(SMTPD_USER)) == NULL)
+		fatalx("unknown user " SMTPD_USER);
+
+	if (chroot(PATH_CHROOT) == -1)
+		fatal("tls: chroot");
+	if (chdir("/") == -1)
+		fatal("tls: chdir(\"/\")");
+
+	config_process(PROC_TLS);
+
+	if (setgroups(1, &pw->pw_gid) ||
+	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
+	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
+		fatal("tls: cannot drop privileges");
+
+	imsg_callback = tls_worker_imsg;
+	event_init();
+
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+
+	config_peer(PROC_PARENT);
+	config_peer(PROC_CONTROL);
+	config_peer(PROC_DISPATCHER);
+	config_peer(PROC_SMTP);
+	config_peer(PROC_CA);
+	config_peer(PROC_LOGGER);
+	stat_cpu_start(NULL);
+	memory_start(NULL, NULL);
+
+#if HAVE_PLEDGE
+	if (pledge("stdio unix recvfd sendfd", NULL) == -1)
+		fatal("pledge");
+#endif
+
+	event_dispatch();
+	fatalx("exited event loop");
+
+	return (0);
+}
+
+static void
+tls_conn_accept(int fd, uint64_t id, int idx)
+{
+	struct tls_conn	*c;
+	struct listener	*l;
+
+	if (fd == -1)
+		fatalx("tls_conn_accept: no socket");
+
+	TAILQ_FOREACH(l, env->sc_listeners, entry)
+		if (idx-- == 0)
+			break;
+	if (l == NULL || l->tls == NULL)
+		fatalx("tls_conn_accept: bad listener");
+
+	c = xcalloc(1, sizeof(*c));
+	c->id = id;
+	c->listener = l;
+	if ((c->tls = io_new()) == NULL)
+		fatal("tls_conn_accept: io_new");
+	io_set_callback(c->tls, tls_conn_io, c);
+	io_set_timeout(c->tls, SMTPD_SESSION_TIMEOUT * 1000);
+	io_set_fd(c->tls, fd);
+	io_set_read(c->tls);
+	stat_increment("tls.worker.session", 1);
+
+	if (io_accept_tls(c->tls, l->tls) == -1)
+		tls_conn_fail(c, IO_ERROR, io_error(c->tls));
+}
+
+static void
+tls_conn_ready(struct tls_conn *c)
+{
+	struct tls_info	info;
+	struct mproc	*p;
+	int		sp[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) == -1) {
+		log_warn("warn: tls: socketpair");
+		tls_conn_fail(c, IO_ERROR, "socketpair failed");
+		return;
+	}
+	io_set_nonblocking(sp[0]);
+	io_set_nonblocking(sp[1]);
+
+	tls_session_info(io_tls(c->tls), &info);
+	p = smtp_peer(c->id);
+	m_create(p, IMSG_TLS_READY, 0, 0, sp[1]);
+	m_add_id(p, c->id);
+	m_add_data(p, &info, sizeof(info));
+	m_close(p);
+
+	/* the session enforces its own timeouts from now on */
+	io_set_timeout(c->tls, -1);
+
+	if ((c->plain = io_new()) == NULL)
+		fatal("tls_conn_ready: io_new");
+	io_set_callback(c->plain, tls_conn_plain_io, c);
+	io_set_fd(c->plain, sp[0]);
+}
+
+static void
+tls_conn_fail(struct tls_conn *c, int evt, const char *error)
+{
+	struct mproc	*p = smtp_peer(c->id);
+
+	m_create(p, IMSG_TLS_FAIL, 0, 0, -1);
+	m_add_id(p, c->id);
+	m_add_int(p, evt);
+	m_add_string(p, error ? error : "");
+	m_close(p);
+
+	tls_conn_free(c);
+}
+
+/*
+ * The tls io is half-duplex: it only writes to the client in write
+ * mode, and goes back to reading once its output is flushed.
+ */
+static void
+tls_conn_flush(struct tls_conn *c)
+{
+	if (c->writing || io_queued(c->tls) == 0)
+		return;
+	c->writing = 1;
+	io_set_write(c->tls);
+}
+
+/*
+ * One side is gone: let the other flush what is queued for it before
+ * closing both.
+ */
+static void
+tls_conn_close(struct tls_conn *c, struct io *io)
+{
+	struct io	*other;
+
+	other = (io == c->tls) ? c->plain : c->tls;
+	if (c->closing || io_queued(other) == 0) {
+		tls_conn_free(c);
+		return;
+	}
+
+	c->closing = 1;
+	io_pause(io, IO_IN | IO_OUT);
+	io_pause(other, IO_IN);
+}
+
+static void
+tls_conn_free(struct tls_conn *c)
+{
+	io_free(c->tls);
+	if (c->plain)
+		io_free(c->plain);
+	stat_decrement("tls.worker.session", 1);
+	free(c);
+}
+
+static void
+tls_conn_io(struct io *io, int evt, void *arg)
+{
+	struct tls_conn	*c = arg;
+
+	log_trace(TRACE_IO, "tls: %p: %s %s", c, io_strevent(evt),
+	    io_strio(io));
+
+	switch (evt) {
+	case IO_TLSREADY:
+		tls_conn_ready(c);
+		break;
+
+	case IO_DATAIN:
+		io_write(c->plain, io_data(io), io_datalen(io));
+		io_drop(io, io_datalen(io));
+		if (io_queued(c->plain) > TLS_WORKER_HIWAT)
+			io_pause(io, IO_IN);
+		break;
+
+	case IO_LOWAT:
+		if (c->closing) {
+			tls_conn_free(c);
+			break;
+		}
+		c->writing = 0;
+		io_set_read(io);
+		if (io_paused(c->plain, IO_IN))
+			io_resume(c->plain, IO_IN);
+		break;
+
+	case IO_TIMEOUT:
+	case IO_DISCONNECTED:
+	case IO_ERROR:
+		if (c->plain == NULL) {
+			tls_conn_fail(c, evt, io_error(io));
+			break;
+		}
+		tls_conn_close(c, io);
+		break;
+
+	default:
+		fatalx("tls_conn_io()");
+	}
+}
+
+static void
+tls_conn_plain_io(struct io *io, int evt, void *arg)
+{
+	struct tls_conn	*c = arg;
+
+	log_trace(TRACE_IO, "tls: %p: %s %s", c, io_strevent(evt),
+	    io_strio(io));
+
+	switch (evt) {
+	case IO_DATAIN:
+		io_write(c->tls, io_data(io), io_datalen(io));
+		io_drop(io, io_datalen(io));
+		tls_conn_flush(c);
+		if (io_queued(c->tls) > TLS_WORKER_HIWAT)
+			io_pause(io, IO_IN);
+		break;
+
+	case IO_LOWAT:
+		if (c->closing) {
+			tls_conn_free(c);
+			break;
+		}
+		if (io_paused(c->tls, IO_IN))
+			io_resume(c->tls, IO_IN);
+		break;
+
+	case IO_DISCONNECTED:
+	case IO_ERROR:
+		tls_conn_close(c, io);
+		break;
+
+	default:
+		fatalx("tls_conn_plain_io()");
+	}
+}
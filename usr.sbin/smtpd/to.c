@@ -821,6 +821,35 @@ tls_to_text(struct tls *tls)
 }
 #endif
 
+static const char *spf_results[] = {
+	"none",
+	"neutral",
+	"pass",
+	"fail",
+	"softfail",
+	"temperror",
+	"permerror",
+};
+
+const char *
+spf_result_to_text(int result)
+{
+	if (result < 0 || result > SPF_PERMERROR)
+		return "unknown";
+	return spf_results[result];
+}
+
+int
+text_to_spf_result(const char *s)
+{
+	int	i;
+
+	for (i = 0; i <= SPF_PERMERROR; i++)
+		if (strcasecmp(s, spf_results[i]) == 0)
+			return i;
+	return -1;
+}
+
 static int
 broken_inet_net_pton_ipv6(const char *src, void *dst, size_t size)
 {
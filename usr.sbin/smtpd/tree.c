@@ -28,14 +28,14 @@
 #include "log.h"
 
 struct treeentry {
-	SPLAY_ENTRY(treeentry)	 entry;
+	RB_ENTRY(treeentry)	 entry;
 	uint64_t		 id;
 	void			*data;
 };
 
 static int treeentry_cmp(struct treeentry *, struct treeentry *);
 
-SPLAY_PROTOTYPE(_tree, treeentry, entry, treeentry_cmp);
+RB_PROTOTYPE_STATIC(_tree, treeentry, entry, treeentry_cmp);
 
 int
 tree_check(struct tree *t, uint64_t id)
@@ -43,7 +43,7 @@ tree_check(struct tree *t, uint64_t id)
 	struct treeentry	key;
 
 	key.id = id;
-	return (SPLAY_FIND(_tree, &t->tree, &key) != NULL);
+	return (RB_FIND(_tree, &t->tree, &key) != NULL);
 }
 
 void *
@@ -53,11 +53,11 @@ tree_set(struct tree *t, uint64_t id, void *data)
 	char			*old;
 
 	key.id = id;
-	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL) {
+	if ((entry = RB_FIND(_tree, &t->tree, &key)) == NULL) {
 		if ((entry = malloc(sizeof *entry)) == NULL)
 			fatal("tree_set: malloc");
 		entry->id = id;
-		SPLAY_INSERT(_tree, &t->tree, entry);
+		RB_INSERT(_tree, &t->tree, entry);
 		old = NULL;
 		t->count += 1;
 	} else
@@ -77,7 +77,7 @@ tree_xset(struct tree *t, uint64_t id, void *data)
 		fatal("tree_xset: malloc");
 	entry->id = id;
 	entry->data = data;
-	if (SPLAY_INSERT(_tree, &t->tree, entry))
+	if (RB_INSERT(_tree, &t->tree, entry))
 		fatalx("tree_xset(%p, 0x%016"PRIx64 ")", t, id);
 	t->count += 1;
 }
@@ -88,7 +88,7 @@ tree_get(struct tree *t, uint64_t id)
 	struct treeentry	key, *entry;
 
 	key.id = id;
-	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL)
+	if ((entry = RB_FIND(_tree, &t->tree, &key)) == NULL)
 		return (NULL);
 
 	return (entry->data);
@@ -100,7 +100,7 @@ tree_xget(struct tree *t, uint64_t id)
 	struct treeentry	key, *entry;
 
 	key.id = id;
-	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL)
+	if ((entry = RB_FIND(_tree, &t->tree, &key)) == NULL)
 		fatalx("tree_get(%p, 0x%016"PRIx64 ")", t, id);
 
 	return (entry->data);
@@ -113,11 +113,11 @@ tree_pop(struct tree *t, uint64_t id)
 	void			*data;
 
 	key.id = id;
-	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL)
+	if ((entry = RB_FIND(_tree, &t->tree, &key)) == NULL)
 		return (NULL);
 
 	data = entry->data;
-	SPLAY_REMOVE(_tree, &t->tree, entry);
+	RB_REMOVE(_tree, &t->tree, entry);
 	free(entry);
 	t->count -= 1;
 
@@ -131,11 +131,11 @@ tree_xpop(struct tree *t, uint64_t id)
 	void			*data;
 
 	key.id = id;
-	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL)
+	if ((entry = RB_FIND(_tree, &t->tree, &key)) == NULL)
 		fatalx("tree_xpop(%p, 0x%016" PRIx64 ")", t, id);
 
 	data = entry->data;
-	SPLAY_REMOVE(_tree, &t->tree, entry);
+	RB_REMOVE(_tree, &t->tree, entry);
 	free(entry);
 	t->count -= 1;
 
@@ -147,14 +147,14 @@ tree_poproot(struct tree *t, uint64_t *id, void **data)
 {
 	struct treeentry	*entry;
 
-	entry = SPLAY_ROOT(&t->tree);
+	entry = RB_ROOT(&t->tree);
 	if (entry == NULL)
 		return (0);
 	if (id)
 		*id = entry->id;
 	if (data)
 		*data = entry->data;
-	SPLAY_REMOVE(_tree, &t->tree, entry);
+	RB_REMOVE(_tree, &t->tree, entry);
 	free(entry);
 	t->count -= 1;
 
@@ -166,7 +166,7 @@ tree_root(struct tree *t, uint64_t *id, void **data)
 {
 	struct treeentry	*entry;
 
-	entry = SPLAY_ROOT(&t->tree);
+	entry = RB_ROOT(&t->tree);
 	if (entry == NULL)
 		return (0);
 	if (id)
@@ -182,9 +182,9 @@ tree_iter(struct tree *t, void **hdl, uint64_t *id, void **data)
 	struct treeentry *curr = *hdl;
 
 	if (curr == NULL)
-		curr = SPLAY_MIN(_tree, &t->tree);
+		curr = RB_MIN(_tree, &t->tree);
 	else
-		curr = SPLAY_NEXT(_tree, &t->tree, curr);
+		curr = RB_NEXT(_tree, &t->tree, curr);
 
 	if (curr) {
 		*hdl = curr;
@@ -205,18 +205,13 @@ tree_iterfrom(struct tree *t, void **hdl, uint64_t k, uint64_t *id, void **data)
 
 	if (curr == NULL) {
 		if (k == 0)
-			curr = SPLAY_MIN(_tree, &t->tree);
+			curr = RB_MIN(_tree, &t->tree);
 		else {
 			key.id = k;
-			curr = SPLAY_FIND(_tree, &t->tree, &key);
-			if (curr == NULL) {
-				SPLAY_INSERT(_tree, &t->tree, &key);
-				curr = SPLAY_NEXT(_tree, &t->tree, &key);
-				SPLAY_REMOVE(_tree, &t->tree, &key);
-			}
+			curr = RB_NFIND(_tree, &t->tree, &key);
 		}
 	} else
-		curr = SPLAY_NEXT(_tree, &t->tree, curr);
+		curr = RB_NEXT(_tree, &t->tree, curr);
 
 	if (curr) {
 		*hdl = curr;
@@ -235,10 +230,10 @@ tree_merge(struct tree *dst, struct tree *src)
 {
 	struct treeentry	*entry;
 
-	while (!SPLAY_EMPTY(&src->tree)) {
-		entry = SPLAY_ROOT(&src->tree);
-		SPLAY_REMOVE(_tree, &src->tree, entry);
-		if (SPLAY_INSERT(_tree, &dst->tree, entry))
+	while (!RB_EMPTY(&src->tree)) {
+		entry = RB_ROOT(&src->tree);
+		RB_REMOVE(_tree, &src->tree, entry);
+		if (RB_INSERT(_tree, &dst->tree, entry))
 			fatalx("tree_merge: duplicate");
 	}
 	dst->count += src->count;
@@ -255,4 +250,4 @@ treeentry_cmp(struct treeentry *a, struct treeentry *b)
 	return (0);
 }
 
-SPLAY_GENERATE(_tree, treeentry, entry, treeentry_cmp);
+RB_GENERATE_STATIC(_tree, treeentry, entry, treeentry_cmp);
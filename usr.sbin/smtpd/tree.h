@@ -20,7 +20,7 @@
 #ifndef	_TREE_H_
 #define	_TREE_H_
 
-SPLAY_HEAD(_tree, treeentry);
+RB_HEAD(_tree, treeentry);
 
 struct tree {
 	struct _tree	tree;
@@ -29,8 +29,8 @@ struct tree {
 
 
 /* tree.c */
-#define tree_init(t) do { SPLAY_INIT(&((t)->tree)); (t)->count = 0; } while(0)
-#define tree_empty(t) SPLAY_EMPTY(&((t)->tree))
+#define tree_init(t) do { RB_INIT(&((t)->tree)); (t)->count = 0; } while(0)
+#define tree_empty(t) RB_EMPTY(&((t)->tree))
 #define tree_count(t) ((t)->count)
 int tree_check(struct tree *, uint64_t);
 void *tree_set(struct tree *, uint64_t, void *);
@@ -0,0 +1,290 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Asynchronous disk operations over io_uring.
+ *
+ * Operations are queued as they come and submitted together once the
+ * event loop gets back from the current callbacks.  The ring signals
+ * completions on an eventfd watched by libevent, and the callback of
+ * each operation gets the result of its syscall, or -errno.
+ *
+ * Without io_uring, or when the kernel refuses to set up a ring, the
+ * engine is off and the callers go through their synchronous path.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#ifdef HAVE_IO_URING
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+#endif
+
+#include <errno.h>
+#include <event.h>
+#include <imsg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES	64
+
+struct uring_op {
+	TAILQ_ENTRY(uring_op)	 entry;
+	int			 fd;
+	void			(*cb)(void *, int);
+	void			*arg;
+};
+
+static void uring_queue(void);
+static void uring_submit(int, short, void *);
+static void uring_dispatch(int, short, void *);
+
+static TAILQ_HEAD(, uring_op)	waiting = TAILQ_HEAD_INITIALIZER(waiting);
+
+static struct {
+	int			 fd;
+	int			 efd;
+	struct event		 ev;
+	struct event		 ev_submit;
+
+	void			*sq;
+	size_t			 sqlen;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	struct io_uring_sqe	*sqes;
+	size_t			 sqeslen;
+
+	void			*cq;
+	size_t			 cqlen;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	unsigned		 queued;	/* in the ring, not submitted */
+	unsigned		 inflight;	/* in the ring */
+} ring = { .fd = -1 };
+
+int
+uring_init(void)
+{
+	struct io_uring_params	p;
+
+	memset(&p, 0, sizeof(p));
+	if ((ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) == -1) {
+		log_debug("debug: uring: io_uring_setup: %s", strerror(errno));
+		return (0);
+	}
+
+	ring.sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cqlen > ring.sqlen)
+			ring.sqlen = ring.cqlen;
+		ring.cqlen = 0;
+	}
+
+	ring.sq = mmap(NULL, ring.sqlen, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq == MAP_FAILED)
+		fatal("uring_init: mmap");
+	ring.cq = ring.sq;
+	if (ring.cqlen) {
+		ring.cq = mmap(NULL, ring.cqlen, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cq == MAP_FAILED)
+			fatal("uring_init: mmap");
+	}
+	ring.sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqeslen, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		fatal("uring_init: mmap");
+
+	ring.sq_tail = (unsigned *)((char *)ring.sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)((char *)ring.sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)((char *)ring.sq + p.sq_off.array);
+	ring.cq_head = (unsigned *)((char *)ring.cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)((char *)ring.cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)((char *)ring.cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((char *)ring.cq + p.cq_off.cqes);
+
+	if ((ring.efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1)
+		fatal("uring_init: eventfd");
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_EVENTFD,
+	    &ring.efd, 1) == -1) {
+		log_debug("debug: uring: io_uring_register: %s",
+		    strerror(errno));
+		close(ring.efd);
+		munmap(ring.sqes, ring.sqeslen);
+		if (ring.cqlen)
+			munmap(ring.cq, ring.cqlen);
+		munmap(ring.sq, ring.sqlen);
+		close(ring.fd);
+		ring.fd = -1;
+		return (0);
+	}
+
+	event_set(&ring.ev, ring.efd, EV_READ|EV_PERSIST, uring_dispatch, NULL);
+	event_add(&ring.ev, NULL);
+	evtimer_set(&ring.ev_submit, uring_submit, NULL);
+
+	log_debug("debug: uring: io_uring enabled");
+	return (1);
+}
+
+int
+uring_enabled(void)
+{
+	return (ring.fd != -1);
+}
+
+int
+uring_fsync(int fd, void (*cb)(void *, int), void *arg)
+{
+	struct uring_op	*op;
+
+	if (ring.fd == -1)
+		return (0);
+
+	op = xcalloc(1, sizeof(*op));
+	op->fd = fd;
+	op->cb = cb;
+	op->arg = arg;
+	TAILQ_INSERT_TAIL(&waiting, op, entry);
+	uring_queue();
+	return (1);
+}
+
+/* move the waiting operations to the ring while it has room */
+static void
+uring_queue(void)
+{
+	struct io_uring_sqe	*sqe;
+	struct uring_op		*op;
+	struct timeval		 tv;
+	unsigned		 tail, i;
+
+	tail = *ring.sq_tail;
+	while ((op = TAILQ_FIRST(&waiting)) && ring.inflight < URING_ENTRIES) {
+		TAILQ_REMOVE(&waiting, op, entry);
+
+		i = tail & *ring.sq_mask;
+		sqe = &ring.sqes[i];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = op->fd;
+		sqe->user_data = (uint64_t)(uintptr_t)op;
+		ring.sq_array[i] = i;
+
+		tail++;
+		ring.queued++;
+		ring.inflight++;
+	}
+	__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+	if (ring.queued && !evtimer_pending(&ring.ev_submit, NULL)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add(&ring.ev_submit, &tv);
+	}
+}
+
+static void
+uring_submit(int fd, short event, void *arg)
+{
+	struct timeval	tv;
+	int		n;
+
+	n = syscall(__NR_io_uring_enter, ring.fd, ring.queued, 0, 0, NULL, 0);
+	if (n == -1) {
+		if (errno != EAGAIN && errno != EBUSY && errno != EINTR)
+			fatal("uring_submit: io_uring_enter");
+		n = 0;
+	}
+	ring.queued -= n;
+
+	/* the kernel is short of resources, retry a bit later */
+	if (ring.queued) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 1000;
+		evtimer_add(&ring.ev_submit, &tv);
+	}
+}
+
+static void
+uring_dispatch(int fd, short event, void *arg)
+{
+	struct io_uring_cqe	*cqe;
+	struct uring_op		*op;
+	uint64_t		 n;
+	unsigned		 head;
+	int			 res;
+
+	if (read(ring.efd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+		fatal("uring_dispatch: read");
+
+	head = *ring.cq_head;
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		op = (struct uring_op *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		head++;
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		ring.inflight--;
+
+		op->cb(op->arg, res);
+		free(op);
+	}
+
+	uring_queue();
+}
+
+#else
+
+int
+uring_init(void)
+{
+	return (0);
+}
+
+int
+uring_enabled(void)
+{
+	return (0);
+}
+
+int
+uring_fsync(int fd, void (*cb)(void *, int), void *arg)
+{
+	return (0);
+}
+
+#endif
@@ -32,6 +32,7 @@
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fts.h>
 #include <libgen.h>
 #include <resolv.h>
@@ -921,6 +922,72 @@ parse_table_line(FILE *fp, char **line, size_t *linesize,
 	return (0);
 }
 
+/*
+ * Message files are read sequentially, and once by a given process:
+ * ask for an early readahead on open, and drop their pages from the
+ * cache once fully read, so that spool data does not evict the more
+ * useful tables and envelopes.
+ */
+#define	FADVISE_READAHEAD	(1024 * 1024)
+
+void
+fadvise_sequential(int fd)
+{
+#ifdef HAVE_POSIX_FADVISE
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	(void)posix_fadvise(fd, 0, FADVISE_READAHEAD, POSIX_FADV_WILLNEED);
+#endif
+}
+
+void
+fadvise_dontneed(int fd)
+{
+#ifdef HAVE_POSIX_FADVISE
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/*
+ * A clock for the hot paths, read once per event loop wakeup rather
+ * than once per operation.  The imsg, io and runq callbacks run between
+ * clock_cache_enter() and clock_cache_leave(), and see the time of
+ * their wakeup.  Outside of them, the clock is read on each call.
+ */
+static int		clock_depth;
+static struct timeval	clock_tv;
+
+void
+clock_cache_enter(void)
+{
+	if (clock_depth++ == 0)
+		gettimeofday(&clock_tv, NULL);
+}
+
+void
+clock_cache_leave(void)
+{
+	if (clock_depth == 0)
+		fatalx("clock_cache_leave: not entered");
+	clock_depth--;
+}
+
+time_t
+clock_cached(void)
+{
+	if (clock_depth == 0)
+		return (time(NULL));
+	return (clock_tv.tv_sec);
+}
+
+void
+clock_cached_tv(struct timeval *tv)
+{
+	if (clock_depth == 0)
+		gettimeofday(tv, NULL);
+	else
+		*tv = clock_tv;
+}
+
 void
 xclosefrom(int lowfd)
 {
@@ -931,3 +998,44 @@ xclosefrom(int lowfd)
     closefrom(lowfd);
 #endif
 }
+
+/*
+ * Walk a cpu list such as "0-3,8,10-11" and call cb for every cpu in it.
+ * Returns 0 if the list is malformed or names a cpu above CPULIST_MAX.
+ */
+int
+cpulist_parse(const char *list, void (*cb)(int, void *), void *arg)
+{
+	const char	*p = list;
+	char		*ep;
+	long		 lo, hi;
+
+	if (*p == '\0')
+		return 0;
+
+	for (;;) {
+		if (!isdigit((unsigned char)*p))
+			return 0;
+		errno = 0;
+		lo = hi = strtol(p, &ep, 10);
+		if (errno || lo > CPULIST_MAX)
+			return 0;
+		p = ep;
+		if (*p == '-') {
+			p++;
+			if (!isdigit((unsigned char)*p))
+				return 0;
+			hi = strtol(p, &ep, 10);
+			if (errno || hi > CPULIST_MAX || hi < lo)
+				return 0;
+			p = ep;
+		}
+		if (cb)
+			for (; lo <= hi; lo++)
+				cb(lo, arg);
+		if (*p == '\0')
+			return 1;
+		if (*p++ != ',')
+			return 0;
+	}
+}